@@ -0,0 +1,106 @@
+#include "AlignedBuffer.h"
+#include <new>
+#include <utility>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+#endif
+
+namespace CLAMP {
+    /// Constructor: no buffer allocated
+    AlignedBuffer::AlignedBuffer() :
+        data(nullptr),
+        allocated(0)
+    {
+    }
+
+    /** \brief Constructor
+     *
+     *  \param[in] size_       Size, in bytes
+     *  \param[in] hugePages_  Ask for the buffer to be backed by huge pages, where supported.  See reserve().
+     */
+    AlignedBuffer::AlignedBuffer(std::size_t size_, bool hugePages_) :
+        data(nullptr),
+        allocated(0)
+    {
+        reserve(size_, hugePages_);
+    }
+
+    AlignedBuffer::AlignedBuffer(AlignedBuffer&& other) :
+        data(other.data),
+        allocated(other.allocated)
+    {
+        other.data = nullptr;
+        other.allocated = 0;
+    }
+
+    AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& other) {
+        if (this != &other) {
+            release();
+            std::swap(data, other.data);
+            std::swap(allocated, other.allocated);
+        }
+        return *this;
+    }
+
+    AlignedBuffer::~AlignedBuffer() {
+        release();
+    }
+
+    /** \brief Makes sure the buffer holds at least size_ bytes.
+     *
+     *  Only reallocates if the buffer is smaller than that, in which case the old contents are lost.  Throws
+     *  std::bad_alloc if the memory isn't available.
+     *
+     *  \param[in] size_       Minimum size, in bytes
+     *  \param[in] hugePages_  Ask for transparent huge pages (Linux only; elsewhere, and if the kernel declines, this
+     *                         is silently ignored)
+     */
+    void AlignedBuffer::reserve(std::size_t size_, bool hugePages_) {
+        if (size_ <= allocated) {
+            return;
+        }
+        release();
+
+#if defined(_WIN32)
+        (void)hugePages_; // Large pages on Windows need a user privilege we can't count on
+        void* p = VirtualAlloc(nullptr, size_, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+#else
+        void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+#if defined(MADV_HUGEPAGE)
+        if (hugePages_) {
+            madvise(p, size_, MADV_HUGEPAGE);
+        }
+#else
+        (void)hugePages_;
+#endif
+#endif
+        data = static_cast<unsigned char*>(p);
+        allocated = size_;
+    }
+
+    /// Frees the buffer.
+    void AlignedBuffer::release() {
+        if (data == nullptr) {
+            return;
+        }
+#if defined(_WIN32)
+        VirtualFree(data, 0, MEM_RELEASE);
+#else
+        munmap(data, allocated);
+#endif
+        data = nullptr;
+        allocated = 0;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+namespace CLAMP {
+    /** \brief A page-aligned byte buffer, for USB transfers.
+     *
+     *  The buffer is allocated directly from the operating system (VirtualAlloc or mmap), so it starts on a page boundary,
+     *  which lets the USB driver transfer straight into it.  On Linux, it can optionally be backed by transparent huge
+     *  pages, which helps for buffers of several megabytes.
+     *
+     *  Like std::unique_ptr, it can be moved but not copied.  Reallocating (reserve() with a larger size) discards the
+     *  contents.
+     */
+    class AlignedBuffer {
+    public:
+        AlignedBuffer();
+        explicit AlignedBuffer(std::size_t size_, bool hugePages_ = false);
+        AlignedBuffer(AlignedBuffer&& other);
+        AlignedBuffer& operator=(AlignedBuffer&& other);
+        ~AlignedBuffer();
+
+        void reserve(std::size_t size_, bool hugePages_ = false);
+        void release();
+
+        /// Start of the buffer (nullptr if nothing is allocated)
+        unsigned char* get() const { return data; }
+        /// Size of the buffer, in bytes
+        std::size_t size() const { return allocated; }
+
+    private:
+        AlignedBuffer(const AlignedBuffer&) = delete;
+        AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+        unsigned char* data;
+        std::size_t allocated;
+    };
+}
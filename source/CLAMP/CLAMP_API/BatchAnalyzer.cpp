@@ -0,0 +1,410 @@
+#include "BatchAnalyzer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+
+using std::vector;
+using std::string;
+using std::function;
+using CLAMP::SignalProcessing::SweepAnalysis;
+using CLAMP::SignalProcessing::SweepAnalysisResult;
+using CLAMP::SignalProcessing::SegmentAnalysis;
+using CLAMP::SignalProcessing::BatchExponentialFit;
+
+namespace CLAMP {
+    namespace IO {
+        /// \cond private
+        // Records read at a time when looking for sweeps in a file without a sweep index
+        static const std::size_t SCAN_BLOCK_RECORDS = 64 * 1024;
+
+        // Tasks per worker thread for a file's sweeps: enough to even out sweeps of different lengths
+        static const std::size_t TASKS_PER_THREAD = 4;
+
+        struct BatchAnalyzer::SweepRange {
+            uint64_t sweep;
+            std::size_t first;
+            std::size_t count;
+            uint32_t firstTimestamp;
+        };
+
+        template <typename T>
+        static void appendColumn(vector<T>& to, const vector<T>& from) {
+            to.insert(to.end(), from.begin(), from.end());
+        }
+
+        // A CSV field: empty for NaN, so spreadsheets and pandas read it as missing
+        static void writeValue(std::ostream& out, double value) {
+            out << ',';
+            if (!std::isnan(value)) {
+                char buffer[32];
+                std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+                out << buffer;
+            }
+        }
+
+        // The file's name as a CSV field, quoted if it needs to be
+        static void writeFileName(std::ostream& out, const string& name) {
+            if (name.find_first_of(",\"\r\n") == string::npos) {
+                out << name;
+                return;
+            }
+            out << '"';
+            for (char c : name) {
+                if (c == '"') {
+                    out << '"';
+                }
+                out << c;
+            }
+            out << '"';
+        }
+
+        static const string& fileName(const vector<string>& fileNames, uint32_t index) {
+            static const string unknown;
+            return (index < fileNames.size()) ? fileNames[index] : unknown;
+        }
+
+        // Timestamps and measured values of records [first, first + n) of a channel, from whichever record format the file has
+        static void readRecords(const SaveFileReader& reader, std::size_t channel, std::size_t first, std::size_t n, vector<uint32_t>& timestamps, vector<double>& measured) {
+            timestamps.clear();
+            measured.clear();
+            if (reader.isChunked) {
+                // The last chunk starting at or before first, and on from there
+                std::size_t lo = 0, hi = reader.numChunks();
+                while (hi - lo > 1) {
+                    std::size_t mid = (lo + hi) / 2;
+                    if (reader.chunkFirstRecordIndex(mid) <= first) {
+                        lo = mid;
+                    }
+                    else {
+                        hi = mid;
+                    }
+                }
+                Chunk chunk;
+                for (std::size_t c = lo; c < reader.numChunks() && timestamps.size() < n; c++) {
+                    reader.readChunk(c, chunk);
+                    std::size_t base = reader.chunkFirstRecordIndex(c);
+                    for (std::size_t i = std::max(first, base) - base; i < chunk.size() && timestamps.size() < n; i++) {
+                        timestamps.push_back(chunk.timestamps[i]);
+                        measured.push_back(reader.toMeasured(chunk.measuredCodes[i]));
+                    }
+                }
+                return;
+            }
+
+            timestamps.resize(n);
+            reader.timestamps().copyTo(timestamps.data(), first, n);
+            measured.reserve(n);
+            if (reader.isCompact) {
+                RecordView<int32_t> codes = reader.measuredCodes();
+                for (std::size_t i = 0; i < n; i++) {
+                    measured.push_back(reader.toMeasured(codes[first + i]));
+                }
+            }
+            else {
+                RecordView<float> values = reader.isMultiplexed ? reader.measured(channel) : reader.measured();
+                for (std::size_t i = 0; i < n; i++) {
+                    measured.push_back(values[first + i]);
+                }
+            }
+        }
+        /// \endcond
+
+        //--------------------------------------------------------------------------
+        /// Empties the table
+        void SegmentTable::clear() {
+            *this = SegmentTable();
+        }
+
+        /// Adds another table's rows after this one's
+        void SegmentTable::append(const SegmentTable& other) {
+            appendColumn(file, other.file);
+            appendColumn(channel, other.channel);
+            appendColumn(sweep, other.sweep);
+            appendColumn(segment, other.segment);
+            appendColumn(applied, other.applied);
+            appendColumn(steadyState, other.steadyState);
+            appendColumn(peak, other.peak);
+            appendColumn(A, other.A);
+            appendColumn(tau, other.tau);
+            appendColumn(C, other.C);
+            appendColumn(chi2, other.chi2);
+            appendColumn(iterations, other.iterations);
+        }
+
+        /** \brief Writes the table as CSV, with a header row.
+         *
+         *  \param[in] out        Where to write it
+         *  \param[in] fileNames  Name to write for each file index
+         */
+        void SegmentTable::writeCSV(std::ostream& out, const vector<string>& fileNames) const {
+            out << "file,channel,sweep,segment,applied,steady_state,peak,A,tau,C,chi2,iterations\n";
+            for (std::size_t i = 0; i < size(); i++) {
+                writeFileName(out, fileName(fileNames, file[i]));
+                out << ',' << channel[i] << ',' << sweep[i] << ',' << segment[i];
+                writeValue(out, applied[i]);
+                writeValue(out, steadyState[i]);
+                writeValue(out, peak[i]);
+                writeValue(out, A[i]);
+                writeValue(out, tau[i]);
+                writeValue(out, C[i]);
+                writeValue(out, chi2[i]);
+                out << ',' << iterations[i] << '\n';
+            }
+        }
+
+        //--------------------------------------------------------------------------
+        /// Empties the table
+        void SweepTable::clear() {
+            *this = SweepTable();
+        }
+
+        /// Adds another table's rows after this one's
+        void SweepTable::append(const SweepTable& other) {
+            appendColumn(file, other.file);
+            appendColumn(channel, other.channel);
+            appendColumn(sweep, other.sweep);
+            appendColumn(start, other.start);
+            appendColumn(records, other.records);
+            appendColumn(resistance, other.resistance);
+            appendColumn(Ra, other.Ra);
+            appendColumn(Rm, other.Rm);
+            appendColumn(Cm, other.Cm);
+        }
+
+        /** \brief Writes the table as CSV, with a header row.
+         *
+         *  \param[in] out        Where to write it
+         *  \param[in] fileNames  Name to write for each file index
+         */
+        void SweepTable::writeCSV(std::ostream& out, const vector<string>& fileNames) const {
+            out << "file,channel,sweep,start,records,resistance,Ra,Rm,Cm\n";
+            for (std::size_t i = 0; i < size(); i++) {
+                writeFileName(out, fileName(fileNames, file[i]));
+                out << ',' << channel[i] << ',' << sweep[i];
+                writeValue(out, start[i]);
+                out << ',' << records[i];
+                writeValue(out, resistance[i]);
+                writeValue(out, Ra[i]);
+                writeValue(out, Rm[i]);
+                writeValue(out, Cm[i]);
+                out << '\n';
+            }
+        }
+
+        //--------------------------------------------------------------------------
+        /** \brief Constructor
+         *
+         *  \param[in] pool_  Where to run the analysis; must outlive this object
+         */
+        const std::size_t BatchAnalyzer::SWEEPS_PER_BATCH;
+
+        BatchAnalyzer::BatchAnalyzer(ThreadPool& pool_) :
+            pool(pool_),
+            fitMode(BatchExponentialFit::LOCKSTEP)
+        {
+        }
+
+        /** \brief Analyzes one file, in parallel across its sweeps.
+         *
+         *  \param[in] source      File to analyze
+         *  \param[in] fileIndex   Written to the tables' file column
+         *  \param[out] segments   The file's per-segment results are appended here
+         *  \param[out] sweeps     The file's per-sweep results are appended here
+         *  \return What was analyzed.  Failures throw, rather than setting AnalysisResult::error.
+         */
+        AnalysisResult BatchAnalyzer::analyzeFile(const FILENAME& source, uint32_t fileIndex, SegmentTable& segments, SweepTable& sweeps) const {
+            auto start = std::chrono::steady_clock::now();
+            AnalysisResult result;
+            result.source = source;
+
+            SaveFileReader reader;
+            reader.open(source);
+            if (reader.isAux) {
+                result.skipped = true;
+                return result;
+            }
+
+            std::size_t numChannels = reader.isMultiplexed ? reader.channelSettings.size() : 1;
+            for (std::size_t channel = 0; channel < numChannels; channel++) {
+                const SavedSettings& settings = reader.isMultiplexed ? reader.channelSettings[channel] : reader.settings;
+                const SimplifiedWaveform& waveform = settings.waveform;
+                if (waveform.waveform.empty()) {
+                    continue;
+                }
+                uint64_t period = static_cast<uint64_t>(waveform.waveform.back().endIndex) + 1;
+                vector<SweepRange> ranges = findSweeps(reader, period);
+
+                // Contiguous runs of sweeps per task, each task with its own buffers
+                SweepAnalysis analysis(waveform, settings.isVoltageClamp, reader.samplingRate);
+                vector<SweepAnalysisResult> analyzed(ranges.size());
+                std::size_t numTasks = std::min<std::size_t>(ranges.size(), (pool.numThreads() + 1) * TASKS_PER_THREAD);
+                vector<function<void()>> tasks;
+                for (std::size_t t = 0; t < numTasks; t++) {
+                    std::size_t first = ranges.size() * t / numTasks;
+                    std::size_t end = ranges.size() * (t + 1) / numTasks;
+                    BatchExponentialFit::Mode mode = fitMode;
+                    tasks.push_back([&reader, &ranges, &analysis, &analyzed, channel, period, first, end, mode]() {
+                        vector<double> values;
+                        SweepAnalysis::Scratch scratch;
+                        BatchExponentialFit fits;
+                        vector<SegmentAnalysis*> pending;
+                        vector<BatchExponentialFit::Result> fitted;
+                        for (std::size_t batchStart = first; batchStart < end; batchStart += SWEEPS_PER_BATCH) {
+                            std::size_t batchEnd = std::min(end, batchStart + SWEEPS_PER_BATCH);
+                            fits.clear();
+                            pending.clear();
+                            for (std::size_t s = batchStart; s < batchEnd; s++) {
+                                readSweep(reader, channel, ranges[s], period, values);
+                                analysis.analyzeDeferred(values, analyzed[s], scratch, fits, pending);
+                            }
+                            fits.fit(fitted, mode);
+                            for (std::size_t i = 0; i < pending.size(); i++) {
+                                SegmentAnalysis& segment = *pending[i];
+                                std::copy(fitted[i].beta, fitted[i].beta + 3, segment.beta);
+                                segment.chi2 = fitted[i].chi2;
+                                segment.iterations = fitted[i].iterations;
+                                segment.fitValid = true;
+                            }
+                            for (std::size_t s = batchStart; s < batchEnd; s++) {
+                                analysis.finish(analyzed[s]);
+                            }
+                        }
+                    });
+                }
+                pool.run(tasks);
+
+                for (std::size_t s = 0; s < ranges.size(); s++) {
+                    const SweepRange& range = ranges[s];
+                    const SweepAnalysisResult& sweepResult = analyzed[s];
+                    sweeps.file.push_back(fileIndex);
+                    sweeps.channel.push_back(static_cast<uint32_t>(channel));
+                    sweeps.sweep.push_back(range.sweep);
+                    sweeps.start.push_back(range.firstTimestamp / reader.samplingRate);
+                    sweeps.records.push_back(range.count);
+                    sweeps.resistance.push_back(sweepResult.resistance);
+                    sweeps.Ra.push_back(sweepResult.Ra);
+                    sweeps.Rm.push_back(sweepResult.Rm);
+                    sweeps.Cm.push_back(sweepResult.Cm);
+
+                    for (unsigned int i = 0; i < waveform.size(); i++) {
+                        const SegmentAnalysis& segment = sweepResult.segments[i];
+                        if (!segment.dcValid && !segment.fitValid) {
+                            continue; // Not in this sweep, or only one timestep long
+                        }
+                        segments.file.push_back(fileIndex);
+                        segments.channel.push_back(static_cast<uint32_t>(channel));
+                        segments.sweep.push_back(range.sweep);
+                        segments.segment.push_back(i);
+                        segments.applied.push_back(waveform.waveform[i].appliedValue);
+                        segments.steadyState.push_back(segment.steadyState);
+                        segments.peak.push_back(segment.peak);
+                        segments.A.push_back(segment.beta[0]);
+                        segments.tau.push_back(-1.0 / segment.beta[1]);
+                        segments.C.push_back(segment.beta[2]);
+                        segments.chi2.push_back(segment.chi2);
+                        segments.iterations.push_back(segment.iterations);
+                    }
+                    result.records += range.count;
+                }
+                result.sweeps += ranges.size();
+            }
+
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        /** \brief Analyzes several files, in parallel.
+         *
+         *  \param[in] sources    Files to analyze; their indices are the tables' file column
+         *  \param[out] segments  Cleared, then filled with every file's per-segment results, in file order
+         *  \param[out] sweeps    Cleared, then filled with every file's per-sweep results, in file order
+         *  \param[in] finished   If set, called as each file finishes
+         *  \return One result per file, in the same order as sources.  A file that fails doesn't stop the others; its
+         *          error is set, and it has no rows in the tables.
+         */
+        vector<AnalysisResult> BatchAnalyzer::analyzeFiles(const vector<FILENAME>& sources, SegmentTable& segments, SweepTable& sweeps, const FinishedCallback& finished) const {
+            vector<AnalysisResult> results(sources.size());
+            vector<SegmentTable> fileSegments(sources.size());
+            vector<SweepTable> fileSweeps(sources.size());
+            std::mutex callbackMutex;
+            vector<function<void()>> tasks;
+            tasks.reserve(sources.size());
+            for (std::size_t i = 0; i < sources.size(); i++) {
+                tasks.push_back([this, &sources, &results, &fileSegments, &fileSweeps, &finished, &callbackMutex, i]() {
+                    AnalysisResult& result = results[i];
+                    try {
+                        result = analyzeFile(sources[i], static_cast<uint32_t>(i), fileSegments[i], fileSweeps[i]);
+                    }
+                    catch (const std::exception& e) {
+                        result = AnalysisResult();
+                        result.source = sources[i];
+                        result.error = e.what();
+                        fileSegments[i].clear();
+                        fileSweeps[i].clear();
+                    }
+                    if (finished) {
+                        std::lock_guard<std::mutex> lock(callbackMutex);
+                        finished(result);
+                    }
+                });
+            }
+            pool.run(tasks);
+
+            segments.clear();
+            sweeps.clear();
+            for (std::size_t i = 0; i < sources.size(); i++) {
+                segments.append(fileSegments[i]);
+                sweeps.append(fileSweeps[i]);
+            }
+            return results;
+        }
+
+        // Each sweep from the sweep index, or else each run of records within one period of the waveform
+        vector<BatchAnalyzer::SweepRange> BatchAnalyzer::findSweeps(const SaveFileReader& reader, uint64_t period) {
+            vector<SweepRange> ranges;
+            if (!reader.sweeps.empty()) {
+                for (const SweepIndexEntry& entry : reader.sweeps) {
+                    SweepRange range = { entry.sweep, static_cast<std::size_t>(entry.firstRecord), static_cast<std::size_t>(entry.records), entry.firstTimestamp };
+                    ranges.push_back(range);
+                }
+                return ranges;
+            }
+
+            vector<uint32_t> timestamps;
+            vector<double> measured;
+            uint32_t previous = 0;
+            std::size_t n = reader.numRecords();
+            for (std::size_t first = 0; first < n; first += SCAN_BLOCK_RECORDS) {
+                readRecords(reader, 0, first, std::min(SCAN_BLOCK_RECORDS, n - first), timestamps, measured);
+                for (std::size_t i = 0; i < timestamps.size(); i++) {
+                    uint32_t t = timestamps[i];
+                    bool startsSweep = ranges.empty() || t < previous || t - previous >= period || t % period <= previous % period;
+                    if (startsSweep) {
+                        SweepRange range = { static_cast<uint64_t>(ranges.size()), first + i, 0, t };
+                        ranges.push_back(range);
+                    }
+                    ranges.back().count++;
+                    previous = t;
+                }
+            }
+            return ranges;
+        }
+
+        // The sweep's measured values, indexed by timestep within the waveform, with NaN for the timesteps it doesn't have
+        void BatchAnalyzer::readSweep(const SaveFileReader& reader, std::size_t channel, const SweepRange& range, uint64_t period, vector<double>& values) {
+            vector<uint32_t> timestamps;
+            vector<double> measured;
+            readRecords(reader, channel, range.first, range.count, timestamps, measured);
+            values.assign(static_cast<std::size_t>(period), std::numeric_limits<double>::quiet_NaN());
+            for (std::size_t i = 0; i < timestamps.size(); i++) {
+                if (timestamps[i] - range.firstTimestamp >= period) {
+                    break; // Only one period of it fits; a sweep index entry shouldn't be longer than that anyway
+                }
+                values[static_cast<std::size_t>(timestamps[i] % period)] = measured[i];
+            }
+        }
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "SaveFileReader.h"
+#include "SweepAnalysis.h"
+#include "ThreadPool.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /** \brief Per-segment results of BatchAnalyzer, column by column.
+         *
+         *  One row per segment analyzed (one that lasts more than one timestep, and has data in the sweep), for every
+         *  sweep of every channel of every file, in that order.  Values that weren't calculated (e.g., the fit of a
+         *  segment without a step) are NaN.
+         */
+        struct SegmentTable {
+            std::vector<uint32_t> file;      ///< Index of the file in the list given to BatchAnalyzer::analyzeFiles()
+            std::vector<uint32_t> channel;   ///< Channel, for multiplexed files; 0 otherwise
+            std::vector<uint64_t> sweep;     ///< Number of the sweep in the recording
+            std::vector<uint32_t> segment;   ///< Index of the segment in the waveform
+            std::vector<double> applied;     ///< The segment's applied voltage or current
+            std::vector<double> steadyState; ///< See SignalProcessing::SegmentAnalysis
+            std::vector<double> peak;
+            std::vector<double> A;           ///< Fitted asymptote (ExponentialFit beta[0])
+            std::vector<double> tau;         ///< Fitted time constant, -1 / beta[1], in seconds
+            std::vector<double> C;           ///< Fitted amplitude (beta[2])
+            std::vector<double> chi2;
+            std::vector<uint32_t> iterations;
+
+            std::size_t size() const { return file.size(); }
+            void clear();
+            void append(const SegmentTable& other);
+            void writeCSV(std::ostream& out, const std::vector<std::string>& fileNames) const;
+        };
+
+        /// Per-sweep results of BatchAnalyzer, column by column: one row per sweep of every channel of every file
+        struct SweepTable {
+            std::vector<uint32_t> file;      ///< Index of the file in the list given to BatchAnalyzer::analyzeFiles()
+            std::vector<uint32_t> channel;   ///< Channel, for multiplexed files; 0 otherwise
+            std::vector<uint64_t> sweep;     ///< Number of the sweep in the recording
+            std::vector<double> start;       ///< Time of its first record, in seconds
+            std::vector<uint64_t> records;   ///< Number of records
+            std::vector<double> resistance;  ///< See SignalProcessing::SweepAnalysisResult; NaN where not calculated
+            std::vector<double> Ra;
+            std::vector<double> Rm;
+            std::vector<double> Cm;
+
+            std::size_t size() const { return file.size(); }
+            void clear();
+            void append(const SweepTable& other);
+            void writeCSV(std::ostream& out, const std::vector<std::string>& fileNames) const;
+        };
+
+        /// Outcome of analyzing one file with BatchAnalyzer
+        struct AnalysisResult {
+            FILENAME source;
+            bool skipped;           ///< An aux file, which has nothing to analyze
+            std::string error;      ///< Why the analysis failed; empty if it succeeded
+            uint64_t sweeps;        ///< Sweeps analyzed, over all channels
+            uint64_t records;       ///< Records read
+            double seconds;         ///< Wall-clock time taken
+
+            AnalysisResult() : skipped(false), sweeps(0), records(0), seconds(0) {}
+        };
+
+        /** \brief Runs the data display's analysis (see SignalProcessing::SweepAnalysis) over save files, in parallel.
+         *
+         *  Files are read with SaveFileReader, so they're memory-mapped rather than read into memory, in any of the
+         *  headstage record formats.  Sweeps come from the file's sweep index if it has one (see
+         *  SaveFile::setSweepIndex()); otherwise a sweep ends wherever the waveform starts over or the timestamps skip
+         *  a whole period.  Each channel of a multiplexed file is analyzed with its own settings.
+         *
+         *  analyzeFiles() runs one pool task per file, and each file runs one task per sweep, so a directory of small
+         *  files and a single long recording both keep every core busy.  The results are gathered in file order,
+         *  whatever order the tasks finish in, so the tables are the same from run to run.
+         *
+         *  Within a task, the transients of SWEEPS_PER_BATCH sweeps at a time are fitted together with
+         *  SignalProcessing::BatchExponentialFit, in the mode set by setFitMode().
+         *
+         *  The values analyzed are the ones in the file, without the display's low-pass filter, so they can differ
+         *  slightly from what the display showed when a filter was on.
+         */
+        class BatchAnalyzer {
+        public:
+            /// Called as each file of analyzeFiles() finishes, on whichever thread analyzed it, one call at a time
+            typedef std::function<void(const AnalysisResult&)> FinishedCallback;
+
+            explicit BatchAnalyzer(ThreadPool& pool_ = ThreadPool::instance());
+
+            /// Sweeps whose fits are batched together, per task
+            static const std::size_t SWEEPS_PER_BATCH = 256;
+
+            /// How the exponential fits are done: LOCKSTEP (the default), or SERIAL as the reference
+            void setFitMode(SignalProcessing::BatchExponentialFit::Mode mode) { fitMode = mode; }
+            /// See setFitMode()
+            SignalProcessing::BatchExponentialFit::Mode getFitMode() const { return fitMode; }
+
+            AnalysisResult analyzeFile(const FILENAME& source, uint32_t fileIndex, SegmentTable& segments, SweepTable& sweeps) const;
+            std::vector<AnalysisResult> analyzeFiles(const std::vector<FILENAME>& sources, SegmentTable& segments, SweepTable& sweeps, const FinishedCallback& finished = FinishedCallback()) const;
+
+        private:
+            /// \cond private
+            struct SweepRange;
+            /// \endcond
+
+            ThreadPool& pool;
+            SignalProcessing::BatchExponentialFit::Mode fitMode;
+
+            static std::vector<SweepRange> findSweeps(const SaveFileReader& reader, uint64_t period);
+            static void readSweep(const SaveFileReader& reader, std::size_t channel, const SweepRange& range, uint64_t period, std::vector<double>& values);
+        };
+    }
+}
@@ -0,0 +1,391 @@
+#include "BatchExponentialFit.h"
+#include "DataAnalysis.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using std::invalid_argument;
+using std::vector;
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /// \cond private
+        // The lanes' interleaved samples and state
+        struct BatchExponentialFit::Lanes {
+            vector<double> x;    // Sample k of lane l at k * LANES + l
+            vector<double> y;
+            vector<double> w;    // 1 within the lane's segment, 0 past its end
+            vector<double> e;    // exp(B * x) at each lane's current beta
+            vector<double> eNew; // exp(B * x) at each lane's trial beta
+            vector<double> laneXs; // One lane's samples, for ExponentialFit::initialGuess
+            vector<double> laneYs;
+
+            std::size_t segment[LANES]; // Being fitted in each lane
+            std::size_t length[LANES];  // Its number of samples; 0 for an idle lane
+            std::size_t filled[LANES];  // Samples of the lane that may be nonzero
+            bool active[LANES];
+            double on[LANES];           // active, as 1 or 0
+            double A[LANES], B[LANES], C[LANES];
+            double lambda[LANES], chi2[LANES];
+            unsigned int iterations[LANES], numSteps[LANES], consecutiveNonSteps[LANES];
+            bool first[LANES];
+        };
+
+        // exp(v) without branches or calls, so a loop of them vectorizes: v = n ln 2 + r with |r| <= ln 2 / 2, e^r by
+        // its Taylor series to r^12 (relative error under 2e-16), times 2^n built in the exponent bits.  Within an ulp
+        // or two of std::exp.  v is clamped to where 2^n is a normal double, with (z + |z|) / 2 = max(z, 0) rather than
+        // comparisons, which keep the loop from vectorizing; it leaves v exact within the range.
+        static inline double fastExp(double v) {
+            const double LOG2E = 1.4426950408889634;
+            const double LN2_HI = 6.93147180369123816490e-01; // ln 2, in two parts, so n * LN2_HI is exact
+            const double LN2_LO = 1.90821492927058770002e-10;
+            const double ROUND = 6755399441055744.0;          // 1.5 * 2^52: adding it rounds to an integer, in the low bits
+            double below = -708.0 - v;
+            v += (below + std::abs(below)) * 0.5;
+            double above = v - 709.0;
+            v -= (above + std::abs(above)) * 0.5;
+            double t = v * LOG2E + ROUND;
+            double n = t - ROUND;
+            double r = (v - n * LN2_HI) - n * LN2_LO;
+            double r2 = r * r; // Estrin's scheme, for a shorter dependency chain than Horner's
+            double r4 = r2 * r2;
+            double r8 = r4 * r4;
+            double q0 = 1.0 + r;
+            double q1 = 1.0 / 2 + r * (1.0 / 6);
+            double q2 = 1.0 / 24 + r * (1.0 / 120);
+            double q3 = 1.0 / 720 + r * (1.0 / 5040);
+            double q4 = 1.0 / 40320 + r * (1.0 / 362880);
+            double q5 = 1.0 / 3628800 + r * (1.0 / 39916800);
+            double q6 = 1.0 / 479001600;
+            double p = (q0 + q1 * r2) + (q2 + q3 * r2) * r4 + ((q4 + q5 * r2) + q6 * r4) * r8;
+            uint64_t bits;
+            std::memcpy(&bits, &t, sizeof(bits));
+            bits = (bits + 1023) << 52; // n's low bits are t's, so this is 2^n
+            double scale;
+            std::memcpy(&scale, &bits, sizeof(scale));
+            return p * scale;
+        }
+
+        // The loops below run across lanes, and mask with multiplications rather than branches so they vectorize: w is 1
+        // within each lane's segment and 0 past its end, and on is 1 for the active lanes.
+
+        // exp(B * x) for the active lanes' samples, 0 elsewhere
+        static void expLanes(const double* x, const double* w, std::size_t maxLength, const double* on, const double* B, double* e) {
+            const std::size_t LANES = BatchExponentialFit::LANES;
+            for (std::size_t k = 0; k < maxLength * LANES; k += LANES) {
+                double row[LANES]; // Written here first, as e might alias x or w as far as the compiler knows
+                for (std::size_t l = 0; l < LANES; l++) {
+                    row[l] = (w[k + l] * on[l]) * fastExp(B[l] * x[k + l]);
+                }
+                std::copy(row, row + LANES, e + k);
+            }
+        }
+
+        // Sums over the lanes' samples, per lane: J'*J (without the constant [0][0]), J'*r and r'*r, as in
+        // ExponentialFit::accumulateNormalEquations, for beta = { A, B, C } and e = exp(B * x).  The sums are kept in
+        // locals so the compiler can hold them in registers.
+        static void accumulateLanes(const double* x, const double* y, const double* w, const double* e, std::size_t maxLength,
+                                    const double* A, const double* C, double sums[9][BatchExponentialFit::LANES]) {
+            const std::size_t LANES = BatchExponentialFit::LANES;
+            double s01[LANES] = {}, s02[LANES] = {}, s11[LANES] = {}, s12[LANES] = {}, s22[LANES] = {};
+            double b0[LANES] = {}, b1[LANES] = {}, b2[LANES] = {}, c[LANES] = {};
+            for (std::size_t k = 0; k < maxLength * LANES; k += LANES) {
+                for (std::size_t l = 0; l < LANES; l++) {
+                    double r = (y[k + l] - (C[l] * e[k + l] + A[l])) * w[k + l];
+                    double g1 = C[l] * x[k + l] * e[k + l];
+                    double g2 = e[k + l];
+                    s01[l] += g1;
+                    s02[l] += g2;
+                    s11[l] += g1 * g1;
+                    s12[l] += g1 * g2;
+                    s22[l] += g2 * g2;
+                    b0[l] += r;
+                    b1[l] += g1 * r;
+                    b2[l] += g2 * r;
+                    c[l] += r * r;
+                }
+            }
+            for (std::size_t l = 0; l < LANES; l++) {
+                sums[0][l] = s01[l];
+                sums[1][l] = s02[l];
+                sums[2][l] = s11[l];
+                sums[3][l] = s12[l];
+                sums[4][l] = s22[l];
+                sums[5][l] = b0[l];
+                sums[6][l] = b1[l];
+                sums[7][l] = b2[l];
+                sums[8][l] = c[l];
+            }
+        }
+
+        // Just r'*r, per lane, as in ExponentialFit::sumOfSquares
+        static void sumOfSquaresLanes(const double* y, const double* w, const double* e, std::size_t maxLength,
+                                      const double* A, const double* C, double* sums) {
+            const std::size_t LANES = BatchExponentialFit::LANES;
+            double c[LANES] = {};
+            for (std::size_t k = 0; k < maxLength * LANES; k += LANES) {
+                for (std::size_t l = 0; l < LANES; l++) {
+                    double r = (y[k + l] - (C[l] * e[k + l] + A[l])) * w[k + l];
+                    c[l] += r * r;
+                }
+            }
+            for (std::size_t l = 0; l < LANES; l++) {
+                sums[l] = c[l];
+            }
+        }
+        /// \endcond
+
+        const std::size_t BatchExponentialFit::LANES;
+
+        BatchExponentialFit::BatchExponentialFit() :
+            starts(1, 0)
+        {
+        }
+
+        /** \brief Adds a segment to fit.
+         *
+         *  \param[in] xs  Times, as for ExponentialFit::lm()
+         *  \param[in] ys  Values; the same length as xs, and at least 3 of them
+         *  \returns The segment's index in the results of fit()
+         */
+        std::size_t BatchExponentialFit::add(const vector<double>& xs_, const vector<double>& ys_) {
+            if (xs_.size() != ys_.size() || xs_.size() < 3) {
+                throw invalid_argument("A segment to fit needs matching xs and ys, at least 3 of them.");
+            }
+            xs.insert(xs.end(), xs_.begin(), xs_.end());
+            ys.insert(ys.end(), ys_.begin(), ys_.end());
+            starts.push_back(xs.size());
+            return size() - 1;
+        }
+
+        /// Forgets the segments added, keeping the memory for the next batch
+        void BatchExponentialFit::clear() {
+            xs.clear();
+            ys.clear();
+            starts.resize(1);
+        }
+
+        /** \brief Fits every segment added.
+         *
+         *  \param[out] results  One per segment, in the order they were added
+         *  \param[in] mode      LOCKSTEP, or SERIAL for ExponentialFit::lm() itself
+         */
+        void BatchExponentialFit::fit(vector<Result>& results, Mode mode) const {
+            results.resize(size());
+            if (mode == SERIAL) {
+                vector<double> segmentXs, segmentYs;
+                for (std::size_t i = 0; i < size(); i++) {
+                    segmentXs.assign(xs.begin() + starts[i], xs.begin() + starts[i + 1]);
+                    segmentYs.assign(ys.begin() + starts[i], ys.begin() + starts[i + 1]);
+                    results[i].iterations = ExponentialFit::lm(segmentXs, segmentYs, results[i].beta, results[i].chi2);
+                }
+                return;
+            }
+
+            // Longest last, so a lane refilled with the next segment makes the others pad as little as possible
+            vector<std::size_t> order(size());
+            std::iota(order.begin(), order.end(), std::size_t(0));
+            std::stable_sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) { return length(a) < length(b); });
+
+            Lanes lanes;
+            std::size_t capacity = order.empty() ? 0 : length(order.back());
+            lanes.x.assign(capacity * LANES, 0.0);
+            lanes.y.assign(capacity * LANES, 0.0);
+            lanes.w.assign(capacity * LANES, 0.0);
+            lanes.e.assign(capacity * LANES, 0.0);
+            lanes.eNew.assign(capacity * LANES, 0.0);
+            std::size_t next = 0;
+            for (std::size_t l = 0; l < LANES; l++) {
+                lanes.length[l] = 0;
+                lanes.filled[l] = 0;
+                lanes.active[l] = false;
+                lanes.on[l] = 0;
+                if (next < order.size()) {
+                    load(lanes, l, order[next++]);
+                }
+            }
+
+            // Levenberg-Marquardt iterations on every active lane at once, following ExponentialFit::lm() and
+            // lmOneStep() lane by lane.  The exponentials at each lane's current beta are kept from one iteration to the
+            // next: a rejected step leaves beta as it was, and an accepted one moves it to where the trial exponentials
+            // were computed, so each iteration takes one exp() per sample where lm() takes two.
+            double sums[9][LANES];
+            double newA[LANES], newB[LANES], newC[LANES], newSums[LANES];
+            bool accepted[LANES];
+            while (std::any_of(lanes.active, lanes.active + LANES, [](bool a) { return a; })) {
+                std::size_t maxLength = *std::max_element(lanes.length, lanes.length + LANES);
+                accumulateLanes(lanes.x.data(), lanes.y.data(), lanes.w.data(), lanes.e.data(), maxLength, lanes.A, lanes.C, sums);
+
+                double oldChi2[LANES];
+                for (std::size_t l = 0; l < LANES; l++) {
+                    newA[l] = lanes.A[l];
+                    newB[l] = lanes.B[l];
+                    newC[l] = lanes.C[l];
+                    if (!lanes.active[l]) {
+                        continue;
+                    }
+                    oldChi2[l] = lanes.chi2[l];
+                    lanes.chi2[l] = sums[8][l] / lanes.length[l];
+
+                    // A * delta = J'*r, with A = J'*J + lambda * diag(J'*J)
+                    double JtJ[3][3] = {
+                        { static_cast<double>(lanes.length[l]), sums[0][l], sums[1][l] },
+                        { sums[0][l], sums[2][l], sums[3][l] },
+                        { sums[1][l], sums[3][l], sums[4][l] }
+                    };
+                    double b[3] = { sums[5][l], sums[6][l], sums[7][l] };
+                    for (unsigned int i = 0; i < 3; i++) {
+                        JtJ[i][i] += lanes.lambda[l] * JtJ[i][i];
+                    }
+                    double Ainv[3][3];
+                    ExponentialFit::inverse(JtJ, Ainv);
+                    double delta[3] = { 0, 0, 0 };
+                    for (unsigned int i = 0; i < 3; i++) {
+                        for (unsigned int j = 0; j < 3; j++) {
+                            delta[i] += Ainv[i][j] * b[j];
+                        }
+                    }
+                    newA[l] = lanes.A[l] + delta[0];
+                    newB[l] = lanes.B[l] + delta[1];
+                    newC[l] = lanes.C[l] + delta[2];
+                }
+
+                expLanes(lanes.x.data(), lanes.w.data(), maxLength, lanes.on, newB, lanes.eNew.data());
+                sumOfSquaresLanes(lanes.y.data(), lanes.w.data(), lanes.eNew.data(), maxLength, newA, newC, newSums);
+
+                bool done[LANES];
+                for (std::size_t l = 0; l < LANES; l++) {
+                    accepted[l] = false;
+                    done[l] = false;
+                    if (lanes.active[l]) {
+                        double newBeta[3] = { newA[l], newB[l], newC[l] };
+                        done[l] = step(lanes, l, newBeta, newSums[l], oldChi2[l], accepted[l]);
+                    }
+                }
+
+                for (std::size_t k = 0; k < maxLength * LANES; k += LANES) {
+                    for (std::size_t l = 0; l < LANES; l++) {
+                        if (accepted[l]) {
+                            lanes.e[k + l] = lanes.eNew[k + l];
+                        }
+                    }
+                }
+
+                for (std::size_t l = 0; l < LANES; l++) {
+                    if (!done[l]) {
+                        continue;
+                    }
+                    Result& result = results[lanes.segment[l]];
+                    result.beta[0] = lanes.A[l];
+                    result.beta[1] = lanes.B[l];
+                    result.beta[2] = lanes.C[l];
+                    result.chi2 = lanes.chi2[l];
+                    result.iterations = lanes.iterations[l];
+                    lanes.active[l] = false;
+                    lanes.on[l] = 0;
+                    lanes.length[l] = 0;
+                    if (next < order.size()) {
+                        load(lanes, l, order[next++]);
+                    }
+                }
+            }
+        }
+
+        // Starts fitting a segment in lane l: its samples, lm()'s initial guess, and the exponentials there
+        void BatchExponentialFit::load(Lanes& lanes, std::size_t l, std::size_t segment) const {
+            std::size_t n = length(segment);
+            std::size_t start = starts[segment];
+            for (std::size_t k = 0; k < n; k++) {
+                lanes.x[k * LANES + l] = xs[start + k];
+                lanes.y[k * LANES + l] = ys[start + k];
+                lanes.w[k * LANES + l] = 1;
+            }
+            // Past the segment's end, samples the masks leave out of every sum (as far as the lane's last segment went)
+            for (std::size_t k = n; k < lanes.filled[l]; k++) {
+                lanes.x[k * LANES + l] = 0;
+                lanes.y[k * LANES + l] = 0;
+                lanes.w[k * LANES + l] = 0;
+                lanes.e[k * LANES + l] = 0;
+                lanes.eNew[k * LANES + l] = 0;
+            }
+
+            lanes.laneXs.assign(xs.begin() + start, xs.begin() + start + n);
+            lanes.laneYs.assign(ys.begin() + start, ys.begin() + start + n);
+            double beta[3];
+            if (!ExponentialFit::initialGuess(lanes.laneXs, lanes.laneYs, beta)) {
+                beta[0] = lanes.laneYs.back();
+                beta[1] = -3000; // As lm()
+                beta[2] = lanes.laneYs.front() - lanes.laneYs.back();
+            }
+            for (std::size_t k = 0; k < n; k++) {
+                lanes.e[k * LANES + l] = fastExp(beta[1] * lanes.x[k * LANES + l]);
+            }
+            lanes.filled[l] = n;
+
+            lanes.segment[l] = segment;
+            lanes.length[l] = n;
+            lanes.active[l] = true;
+            lanes.on[l] = 1;
+            lanes.A[l] = beta[0];
+            lanes.B[l] = beta[1];
+            lanes.C[l] = beta[2];
+            lanes.lambda[l] = 0.001;
+            lanes.chi2[l] = 0;
+            lanes.iterations[l] = lanes.numSteps[l] = lanes.consecutiveNonSteps[l] = 0;
+            lanes.first[l] = true;
+        }
+
+        // The end of one iteration of lm() for lane l, given the trial beta and its sum of squares: accepts or rejects
+        // the step and adjusts lambda as lmOneStep() does, then applies lm()'s stopping rules.  Returns true if the fit
+        // is over.
+        bool BatchExponentialFit::step(Lanes& lanes, std::size_t l, const double newBeta[3], double newSum, double oldChi2, bool& accepted) {
+            double oldBeta[3] = { lanes.A[l], lanes.B[l], lanes.C[l] };
+            double& lambda = lanes.lambda[l];
+            if (newSum / lanes.length[l] >= lanes.chi2[l]) {
+                if (lambda < 10) {
+                    lambda = 10 * lambda;
+                }
+                accepted = false;
+            }
+            else {
+                if (lambda / 10 > 1e-10) {
+                    lambda = lambda / 10;
+                }
+                lanes.A[l] = newBeta[0];
+                lanes.B[l] = newBeta[1];
+                lanes.C[l] = newBeta[2];
+                accepted = true;
+            }
+            lanes.iterations[l]++;
+
+            if (lambda < 1e-9) {
+                return true;
+            }
+            if (accepted) {
+                lanes.consecutiveNonSteps[l] = 0;
+                if (!lanes.first[l]) {
+                    double fracChangeChi2 = std::abs((lanes.chi2[l] - oldChi2) / oldChi2);
+                    double fracChangeBeta = std::abs((lanes.A[l] - oldBeta[0]) / oldBeta[0]) + std::abs((lanes.B[l] - oldBeta[1]) / oldBeta[1]) + std::abs((lanes.C[l] - oldBeta[2]) / oldBeta[2]);
+                    if (fracChangeChi2 < 1e-6 && fracChangeBeta < 1e-6) {
+                        return true;
+                    }
+                }
+            }
+            else {
+                lanes.consecutiveNonSteps[l]++;
+                if (lanes.consecutiveNonSteps[l] > 10) {
+                    return true;
+                }
+            }
+            lanes.numSteps[l]++;
+            if (lanes.numSteps[l] > 200) {
+                return true;
+            }
+            lanes.first[l] = false;
+            return false;
+        }
+    }
+}
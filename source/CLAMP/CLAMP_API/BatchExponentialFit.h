@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Fits ExponentialFit's model to many segments at once.
+         *
+         *  Offline analysis fits hundreds of thousands of transients, each a few hundred samples long, one after another
+         *  with ExponentialFit::lm().  Here LANES segments are fitted at once, in lockstep: their samples are interleaved,
+         *  so each pass over them is a loop across independent segments, which compilers vectorize without changing any
+         *  one segment's arithmetic.  Each lane runs exactly lm()'s Levenberg-Marquardt iteration, from the same initial
+         *  guess, with the same stopping rules, and takes the next segment as soon as its fit is over.  Segments are taken
+         *  shortest first, so lanes fitting segments of different lengths pad little.  Each lane keeps the exponentials
+         *  at its current parameters between iterations, so it evaluates exp() half as often as lm(), and exp() itself
+         *  is a polynomial the compiler vectorizes along with the rest (within two ulps of std::exp).  The gain grows with
+         *  the vector width the build targets: modest with plain SSE2, about twice lm()'s speed with AVX.
+         *
+         *  LOCKSTEP and SERIAL (lm() on each segment in turn, the reference) differ only in rounding: the order each
+         *  segment's sums are added up, and exp().  So their parameters agree to well within lm()'s convergence
+         *  tolerance of 1e-6, although a fit can stop an iteration sooner or later.
+         \code
+            BatchExponentialFit batch;
+            for (...) {
+                batch.add(xs, ys);
+            }
+            std::vector<BatchExponentialFit::Result> results;
+            batch.fit(results);
+         \endcode
+         */
+        class BatchExponentialFit {
+        public:
+            /// How fit() fits the segments
+            enum Mode {
+                LOCKSTEP, ///< LANES segments at a time, vectorized across segments
+                SERIAL    ///< ExponentialFit::lm() on each segment in turn
+            };
+
+            /// Segments fitted together in LOCKSTEP mode
+            static const std::size_t LANES = 8;
+
+            /// Fit of one segment, as ExponentialFit::lm() returns it
+            struct Result {
+                double beta[3];          ///< See ExponentialFit::f()
+                double chi2;             ///< Mean squared residual
+                unsigned int iterations; ///< Levenberg-Marquardt iterations
+            };
+
+            BatchExponentialFit();
+
+            std::size_t add(const std::vector<double>& xs, const std::vector<double>& ys);
+            void clear();
+            /// Number of segments added
+            std::size_t size() const { return starts.size() - 1; }
+
+            void fit(std::vector<Result>& results, Mode mode = LOCKSTEP) const;
+
+        private:
+            /// \cond private
+            struct Lanes;
+            /// \endcond
+
+            // The segments' samples, one after another; segment i is [starts[i], starts[i + 1])
+            std::vector<double> xs;
+            std::vector<double> ys;
+            std::vector<std::size_t> starts;
+
+            std::size_t length(std::size_t segment) const { return starts[segment + 1] - starts[segment]; }
+            void load(Lanes& lanes, std::size_t l, std::size_t segment) const;
+            static bool step(Lanes& lanes, std::size_t l, const double newBeta[3], double newSum, double oldChi2, bool& accepted);
+        };
+    }
+}
@@ -3,6 +3,8 @@
 #include "Constants.h"
 #include "common.h"
 #include <cmath>
+#include <algorithm>
+#include <limits>
 
 using std::invalid_argument;
 using std::vector;
@@ -12,11 +14,30 @@ namespace CLAMP {
     namespace SignalProcessing {
         void Filter::filter(const vector<double>& in, vector<double>& out) {
             out.resize(in.size());
-            for (unsigned int i = 0; i < in.size(); ++i) {
+            if (!in.empty()) {
+                process(in.data(), out.data(), in.size());
+            }
+        }
+
+        void Filter::process(const double* in, double* out, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i) {
                 out[i] = filterOne(in[i]);
             }
         }
 
+        void Filter::process(const float* in, float* out, std::size_t n) {
+            const std::size_t BLOCK = 256;
+            double buffer[BLOCK];
+            for (std::size_t first = 0; first < n; first += BLOCK) {
+                std::size_t count = std::min(BLOCK, n - first);
+                std::copy(in + first, in + first + count, buffer);
+                process(buffer, buffer, count);
+                for (std::size_t i = 0; i < count; ++i) {
+                    out[first + i] = static_cast<float>(buffer[i]);
+                }
+            }
+        }
+
         //----------------------------------------------------------------------------------------------------------------------------
 
         BiquadFilter::BiquadFilter() {
@@ -30,12 +51,13 @@ namespace CLAMP {
                 index++;  // We'll be a little blase' about index - we only care if it's 0, 1, or > 1.  So we only increment here, and don't worry about overflowing it
             }
             else {
+                // prevOut[0] is subtracted last, so each output only has to wait one multiply and one subtract for the previous one
                 out = a[0] * in + a[1] * prevIn[0] + a[2] * prevIn[1]
-                    - b[1] * prevOut[0] - b[2] * prevOut[1];
+                    - b[2] * prevOut[1] - b[1] * prevOut[0];
             }
 
             // If we get NaNs, don't pollute the filter
-            if (!isnan(in) && !isnan(out)) {
+            if (!std::isnan(in) && !std::isnan(out)) {
                 prevIn[1] = prevIn[0];
                 prevIn[0] = in;
                 prevOut[1] = prevOut[0];
@@ -45,6 +67,52 @@ namespace CLAMP {
             return out;
         }
 
+        void BiquadFilter::process(const double* in, double* out, std::size_t n) {
+            std::size_t i = 0;
+
+            // The first two points pass straight through
+            for (; i < n && index < 2; ++i) {
+                out[i] = BiquadFilter::filterOne(in[i]);
+            }
+            if (i == n) {
+                return;
+            }
+
+            // Keep the coefficients and state in locals for the rest of the block
+            const double a0 = a[0], a1 = a[1], a2 = a[2], b1 = b[1], b2 = b[2];
+            double in1 = prevIn[0], in2 = prevIn[1];
+            double out1 = prevOut[0], out2 = prevOut[1];
+
+            while (i < n) {
+                // Find the next run of valid (non-NaN) points.  Once the state is valid, the output can only be NaN if the
+                // input is, so that's the only check we need.
+                std::size_t end = i;
+                while (end < n && !std::isnan(in[end])) {
+                    ++end;
+                }
+
+                for (; i < end; ++i) {
+                    double x = in[i];
+                    double y = a0 * x + a1 * in1 + a2 * in2 - b2 * out2 - b1 * out1;
+                    in2 = in1;
+                    in1 = x;
+                    out2 = out1;
+                    out1 = y;
+                    out[i] = y;
+                }
+
+                // NaNs pass through to the output without touching the state
+                for (; i < n && std::isnan(in[i]); ++i) {
+                    out[i] = in[i];
+                }
+            }
+
+            prevIn[0] = in1;
+            prevIn[1] = in2;
+            prevOut[0] = out1;
+            prevOut[1] = out2;
+        }
+
         void BiquadFilter::reset() {
             index = 0;
         }
@@ -140,15 +208,160 @@ namespace CLAMP {
         double NthOrderBesselLowPassFilter::filterOne(double in) {
             double out = in;
             for (SecondOrderBesselLowPassFilter& f : filters) {
-                out = f.filterOne(out);
+                out = f.BiquadFilter::filterOne(out);
             }
             return out;
         }
 
+        /* Runs N biquad stages in series over a block of data.  N is a compile-time constant so that the loop over stages
+         * is unrolled and all the coefficients and state stay in registers.  Each point goes through all the stages before
+         * the next point starts, which lets the CPU overlap the (otherwise serial) recurrences of the different stages.
+         */
+        template <std::size_t N>
+        void processCascade(BiquadFilter* stages, const double* in, double* out, std::size_t n) {
+            std::size_t i = 0;
+
+            // The first two points pass straight through every stage
+            for (; i < n && stages[0].index < 2; ++i) {
+                double y = in[i];
+                for (std::size_t s = 0; s < N; s++) {
+                    y = stages[s].BiquadFilter::filterOne(y);
+                }
+                out[i] = y;
+            }
+            if (i == n) {
+                return;
+            }
+
+            double a0[N], a1[N], a2[N], b1[N], b2[N];
+            double in1[N], in2[N], out1[N], out2[N];
+            for (std::size_t s = 0; s < N; s++) {
+                a0[s] = stages[s].a[0]; a1[s] = stages[s].a[1]; a2[s] = stages[s].a[2];
+                b1[s] = stages[s].b[1]; b2[s] = stages[s].b[2];
+                in1[s] = stages[s].prevIn[0]; in2[s] = stages[s].prevIn[1];
+                out1[s] = stages[s].prevOut[0]; out2[s] = stages[s].prevOut[1];
+            }
+
+            for (; i < n; ++i) {
+                double x = in[i];
+                // A NaN input gives a NaN output and leaves the state alone, in every stage
+                if (std::isnan(x)) {
+                    out[i] = x;
+                    continue;
+                }
+                for (std::size_t s = 0; s < N; s++) {
+                    double y = a0[s] * x + a1[s] * in1[s] + a2[s] * in2[s] - b2[s] * out2[s] - b1[s] * out1[s];
+                    in2[s] = in1[s];
+                    in1[s] = x;
+                    out2[s] = out1[s];
+                    out1[s] = y;
+                    x = y;
+                }
+                out[i] = x;
+            }
+
+            for (std::size_t s = 0; s < N; s++) {
+                stages[s].prevIn[0] = in1[s]; stages[s].prevIn[1] = in2[s];
+                stages[s].prevOut[0] = out1[s]; stages[s].prevOut[1] = out2[s];
+            }
+        }
+
+        void NthOrderBesselLowPassFilter::process(const double* in, double* out, std::size_t n) {
+            switch (filters.size()) {
+            case 2:
+                processCascade<2>(filters.data(), in, out, n);
+                break;
+            case 3:
+                processCascade<3>(filters.data(), in, out, n);
+                break;
+            case 4:
+                processCascade<4>(filters.data(), in, out, n);
+                break;
+            default:
+                Filter::process(in, out, n);
+                break;
+            }
+        }
+
         void NthOrderBesselLowPassFilter::reset() {
             for (SecondOrderBesselLowPassFilter& f : filters) {
                 f.reset();
             }
         }
+
+        //----------------------------------------------------------------------------------------------------------------------------
+        /** \brief Constructor
+         *
+         * \param[in] factor_ Decimation factor (e.g., 4 to keep every 4th sample).
+         * \param[in] fc      Cutoff (-6 dB) frequency, in Hz.  Typically half the output sampling rate.
+         * \param[in] ts      Sampling time/period of the input.
+         * \param[in] delay   Delay of the filter, in output samples.  Larger values give a sharper cutoff.
+         */
+        DecimatingLowPassFilter::DecimatingLowPassFilter(unsigned int factor_, double fc, double ts, unsigned int delay) :
+            factor(factor_)
+        {
+            if (factor == 0 || delay == 0) {
+                throw invalid_argument("Decimation factor and delay must be positive");
+            }
+            if (fc <= 0 || fc * ts >= 0.5) {
+                throw invalid_argument("Cutoff frequency must be between 0 and the Nyquist frequency");
+            }
+
+            std::size_t numTaps = 2 * delay * factor + 1;
+            double center = (numTaps - 1) / 2.0;
+            double wc = 2.0 * fc * ts; // Cutoff, as a fraction of the Nyquist frequency
+            taps.resize(numTaps);
+            double sum = 0;
+            for (std::size_t i = 0; i < numTaps; i++) {
+                double n = i - center;
+                double sinc = (n == 0) ? 1.0 : sin(PI * wc * n) / (PI * wc * n);
+                double window = 0.42 - 0.5 * cos(2 * PI * i / (numTaps - 1)) + 0.08 * cos(4 * PI * i / (numTaps - 1));
+                taps[numTaps - 1 - i] = sinc * window;
+                sum += sinc * window;
+            }
+            // Unity gain at DC
+            for (double& t : taps) {
+                t /= sum;
+            }
+
+            history.resize(2 * numTaps);
+            reset();
+        }
+
+        void DecimatingLowPassFilter::push(double in) {
+            lastWasNaN = std::isnan(in);
+            if (lastWasNaN) {
+                return;
+            }
+
+            std::size_t numTaps = taps.size();
+            if (!primed) {
+                std::fill(history.begin(), history.end(), in);
+                primed = true;
+            }
+            pos = (pos + 1) % numTaps;
+            history[pos] = in;
+            history[pos + numTaps] = in;
+        }
+
+        double DecimatingLowPassFilter::output() const {
+            if (lastWasNaN || !primed) {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+
+            // history[pos + 1 .. pos + numTaps] are the inputs, oldest first
+            const double* x = &history[pos + 1];
+            double out = 0;
+            for (std::size_t i = 0; i < taps.size(); i++) {
+                out += taps[i] * x[i];
+            }
+            return out;
+        }
+
+        void DecimatingLowPassFilter::reset() {
+            pos = 0;
+            primed = false;
+            lastWasNaN = false;
+        }
     }
 }
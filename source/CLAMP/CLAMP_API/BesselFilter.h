@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
 
 namespace CLAMP {
     /** \brief Signal processing functionality (filtering, data analysis algorithms, etc.)
@@ -27,6 +28,25 @@ namespace CLAMP {
              */
             void filter(const std::vector<double>& in, std::vector<double>& out);
 
+            /** \brief Filter a block of data
+             *
+             *  The default implementation calls filterOne() for each point; subclasses override it with faster block versions.
+             *  Equivalent to calling filterOne() for each point in turn, so blocks can be any size and calls can be mixed with
+             *  filterOne().  \a in and \a out may be the same array.
+             *
+             *  \param[in] in    The input data (\a n points).
+             *  \param[out] out  The filtered data (\a n points).
+             *  \param[in] n     Number of points.
+             */
+            virtual void process(const double* in, double* out, std::size_t n);
+
+            /** \brief Filter a block of single precision data
+             *
+             *  The data is converted to double precision in small blocks and filtered with process(const double*, double*, std::size_t),
+             *  so subclasses don't need to implement this separately.
+             */
+            void process(const float* in, float* out, std::size_t n);
+
             /** \brief Filter one data point.
              *
              *  One key functionality is a pointwise filter (i.e., data comes in time step by time step and is filtered
@@ -74,6 +94,10 @@ namespace CLAMP {
             /// \copydoc Filter::filterOne
             double filterOne(double in) override;
 
+            /// \copydoc Filter::process
+            void process(const double* in, double* out, std::size_t n) override;
+            using Filter::process;
+
             /// \copydoc Filter::reset
             void reset() override;
 
@@ -89,6 +113,9 @@ namespace CLAMP {
             double prevOut[2];
             // Index lets us know if we're at time 0 or 1 (before prevIn and prevOut are valid)
             unsigned int index;
+
+            template <std::size_t N>
+            friend void processCascade(BiquadFilter* stages, const double* in, double* out, std::size_t n);
         };
 
         /// Second order Bessel Low Pass Filter
@@ -116,11 +143,52 @@ namespace CLAMP {
             /// \copydoc Filter::filterOne
             double filterOne(double in) override;
 
+            /// \copydoc Filter::process
+            void process(const double* in, double* out, std::size_t n) override;
+            using Filter::process;
+
             /// \copydoc Filter::reset
             void reset() override;
 
         private:
             std::vector<SecondOrderBesselLowPassFilter> filters;
         };
+
+        /** \brief Low pass FIR filter for decimation (i.e., downsampling by an integer factor).
+         *
+         *  Every input sample is pushed with push(), which only stores it; the filter sum is evaluated by output(), which the
+         *  caller only needs to call for the samples it keeps.  So when downsampling by a factor M, the cost is one filter
+         *  evaluation per retained sample, rather than one per input sample (this is equivalent to a polyphase decimator).
+         *
+         *  The filter is a linear phase, Blackman-windowed sinc with 2 * delay * M + 1 taps, so it delays the signal by
+         *  exactly \a delay output samples.
+         *
+         *  Like BiquadFilter, NaN inputs don't pollute the filter: they're skipped, and the output is NaN until the next
+         *  valid input.  The filter is primed with the first valid input, so there's no startup transient.
+         */
+        class DecimatingLowPassFilter {
+        public:
+            DecimatingLowPassFilter(unsigned int factor_, double fc, double ts, unsigned int delay = 2);
+
+            /// Store the next input sample
+            void push(double in);
+            /// Filtered value at the most recently pushed sample
+            double output() const;
+
+            /// \copydoc Filter::reset
+            void reset();
+
+            /// Decimation factor this filter was designed for
+            unsigned int getFactor() const { return factor; }
+
+        private:
+            unsigned int factor;
+            std::vector<double> taps; // Stored in reverse order, to match the history order
+            // Circular buffer of previous inputs, stored twice so that the last taps.size() inputs are always contiguous
+            std::vector<double> history;
+            unsigned int pos;
+            bool primed;
+            bool lastWasNaN;
+        };
     }
 }
@@ -9,8 +9,13 @@
 #include "DataAnalysis.h"
 #include <algorithm>
 #include <ctime>
+#include <chrono>
+#include <thread>
 #include "RAM.h"
+#include "USBReaderThread.h"
+#include "USBCapture.h"
 #include "Constants.h"
+#include "Trace.h"
 
 
 using std::string;
@@ -33,19 +38,65 @@ namespace CLAMP {
 
     const unsigned int INIT_USB_BUFFER_SIZE = 2 * MEGA;
 
+    PacketSpan::PacketSpan() :
+        timestamps(nullptr),
+        digIns(nullptr),
+        digOuts(nullptr),
+        length(0)
+    {
+        for (unsigned int adc = 0; adc < 8; adc++) {
+            adcs[adc] = nullptr;
+        }
+    }
+
     //----------------------------------------------------------------------------------------
     /** \brief Constructor
      *
      *  \param[in] is18bit  True if 18-bit ADCs are used; false for 16-bit ADCs.
      */
-    Board::Board(bool is18bit) : 
+    Board::Board(bool is18bit) :
+        Board(unique_ptr<OpalKellyBoard>(new OpalKellyBoard()), is18bit)
+    {
+    }
+
+    /** \brief Constructor, for a board other than a plain OpalKellyBoard (e.g., a SimulatedBoard)
+     *
+     *  \param[in] backend  Interface to the evaluation board.  The Board takes ownership.
+     *  \param[in] is18bit  True if 18-bit ADCs are used; false for 16-bit ADCs.
+     */
+    Board::Board(unique_ptr<OpalKellyBoard> backend, bool is18bit) :
+        cableDelaysConfirmed(false),
         controller(*this),
         readQueue(channels, controller), 
         fifoPercentageFull(0), 
         latency(0),
+        transferPolicy(getSamplingRateHz()),
+        okbOwner(std::move(backend)),
+        okb(*okbOwner),
+        commandMutex("Board::commandMutex"),
         is18bitADC(is18bit), 
-        usbBuffer(nullptr), 
-        usbBufferSize(0), 
+        usbBuffer(), 
+        hugePageBuffers(false), 
+        bytesReadTotal(0),
+        packetsReadTotal(0),
+        decodeNanoseconds(0),
+        transfersTotal(0),
+        transferBytesTotal(0),
+        minTransferBytes(0),
+        transferNanoseconds(0),
+        readQueueBytes(0),
+        readQueueAllocations(0),
+        usbBufferBytes(0),
+        packetLayoutDirty(true),
+        fifoWaitStrategy(SLEEP_BACKOFF),
+        readerPriority(Thread::NORMAL_PRIORITY),
+        readerCpu(-1),
+        channelLoopWritten(false),
+        samplingRateWritten(false),
+        dataTransferWritten(false),
+        nextDataConsumerId(0),
+        firstNewPacket(0),
+        nextSampleCallbackId(0),
         waveformRAM(*this)
     {
         for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
@@ -57,6 +108,10 @@ namespace CLAMP {
             chip[chipIndex]->chipRegisters.r3.value.is18bitADC = is18bit;
         }
         channelRepetition = 1;
+        std::fill(outputDecimation, outputDecimation + MAX_NUM_CHIPS, 1u);
+        std::fill(baseDataTransfer.adcs, baseDataTransfer.adcs + 8, false);
+        baseDataTransfer.digin = false;
+        baseDataTransfer.digout = false;
 		
 		usingDac.resize(8);
 		for (int i = 0; i < 8; i++) {
@@ -70,6 +125,7 @@ namespace CLAMP {
     }
 
     Board::~Board() {
+        stopReaderThread();
         stop();
         flush();
 		setStatusLeds(false, 0);
@@ -77,8 +133,8 @@ namespace CLAMP {
         for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
             delete chip[i];
         }
-        delete[]usbBuffer;
         digitalOutputExtent.reset();
+        controller.clearWaveformCache(); // Its runs belong to waveformRAM, which is destroyed first
     }
 
     /** \brief Open this board's connection to the FPGA
@@ -87,9 +143,10 @@ namespace CLAMP {
      *
      *  \param[in] dllPath      Path of the Opal Kelly dll.  "" to use default path.
      *  \param[in] bitfilePath  Path of the bit file to upload.  "" to use default path, "main.bit".
+     *  \param[in] serialNumber Serial number of the Opal Kelly board to open.  "" to use the first one found.
      */
-    bool Board::open(const string& dllPath, const string& bitfilePath) {
-		if (!okb.open(dllPath, bitfilePath)) {
+    bool Board::open(const string& dllPath, const string& bitfilePath, const string& serialNumber) {
+		if (!okb.open(dllPath, bitfilePath, serialNumber)) {
 			return false;
 		}
 
@@ -97,8 +154,9 @@ namespace CLAMP {
 
         enableChannels(getAllChannels());
         setSamplingRate();
-        bool adcs[8] = { true, true, true, true, true, true, true, true }; // TODO - delete
-        setDataTransfer(adcs, true, true); // TODO - get rid of this function
+        // ADCs and digital I/O are only transferred if something asks for them; see addDataConsumer()
+        bool adcs[8] = { false, false, false, false, false, false, false, false };
+        setDataTransfer(adcs, false, false);
 		for (int i = 0; i < MAX_NUM_CHIPS; i++) {
 			enableDigitalMarker(i, false);
 			setDigitalMarkerDestination(i, 0);
@@ -216,7 +274,7 @@ namespace CLAMP {
 	}
 
     void Board::setClockFreq_internal(uint8_t M, uint8_t D) {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         // Wait for DcmProgDone = 1 before reprogramming clock synthesizer
         for (;;) {
             okb.updateWiresOut();
@@ -237,72 +295,425 @@ namespace CLAMP {
         }
     }
 
+    // Grows the USB buffer to at least size bytes (never shrinks it)
     void Board::setUSBBufferSize(unsigned int size) {
-        if (size > usbBufferSize) {
-            if (usbBuffer != nullptr) {
-                delete[]usbBuffer;
-                usbBuffer = nullptr;
-            }
-            usbBuffer = new unsigned char[size];
-            usbBufferSize = size;
+        usbBuffer.reserve(size, hugePageBuffers);
+        usbBufferBytes = usbBuffer.size();
+    }
+
+    // Sizes the USB buffer once, before a run, for the largest read the run can do, so read() never reallocates mid-run
+    void Board::sizeUSBBufferForRun(unsigned int numTimesteps) {
+        unsigned int packets = std::min(numTimesteps, transferPolicy.getMaxPackets());
+        setUSBBufferSize(packets * getPacketLayout().packetSize);
+    }
+
+    /** \brief Whether USB buffers should be backed by huge pages.
+     *
+     *  Only has an effect on Linux (with transparent huge pages enabled), for buffers allocated after the call; i.e.,
+     *  the read buffer, if it has to grow, and the reader thread's buffers, the next time it's started.
+     *
+     *  \param[in] value  True to ask for huge pages.
+     */
+    void Board::setHugePageBuffers(bool value) {
+        hugePageBuffers = value;
+    }
+
+    /** \brief Number of USB control transfers made to the board so far.
+     *
+     *  Counts wire updates, triggers and pipe-in writes (i.e., configuration and commands), but not data reads.
+     *  Compare the values before and after a sweep to see how much configuration traffic it caused.
+     *
+     *  \returns The count, since the board was created.
+     */
+    uint64_t Board::getNumControlTransactions() const {
+        return okb.getNumControlTransactions();
+    }
+
+    /** \brief Starts copying the raw USB data returned by read() to a file.
+     *
+     *  Each read is written as it came from the board, along with the configuration it decodes with (the channel loop,
+     *  the enabled channels, and their conversion settings; see CaptureConfiguration), whenever that changes.  The file
+     *  can be played back without hardware, with a SimulatedBoard and a ReplaySource, or decoded read by read with
+     *  USBCapture, for benchmarking and debugging the processing of the data, and for checking that changes to it don't
+     *  change its results (ClampBenchmarks --replay).
+     *
+     *  \param[in] filename  File to write; it is overwritten.
+     */
+    void Board::startUSBCapture(const FILENAME& filename) {
+        usbCapture.reset(new USBCaptureWriter(filename));
+    }
+
+    /// Stops the capture started by startUSBCapture(), and closes the file.
+    void Board::stopUSBCapture() {
+        usbCapture.reset();
+    }
+
+    /** \brief Gaps in the timestamps of the data read so far, i.e., samples lost between the board and the computer.
+     *
+     *  Like \ref fifoPercentageFull and \ref latency, this is only updated whenever data is read.  A FIFO that fills
+     *  up is the usual cause.
+     *
+     *  \returns The counts, since the board was created or resetTimestampGaps() was last called.  Safe to call from any
+     *           thread.
+     */
+    TimestampGaps Board::getTimestampGaps() const {
+        return readQueue.getTimestampGaps();
+    }
+
+    /** \brief Totals of the data read so far, for measuring throughput.
+     *
+     *  Safe to call from any thread, including while another thread is reading.
+     *
+     *  \returns Bytes and packets read, and time spent decoding them, since the board was created.
+     */
+    ReadStatistics Board::getReadStatistics() const {
+        ReadStatistics result;
+        result.bytesRead = bytesReadTotal.load();
+        result.packetsRead = packetsReadTotal.load();
+        result.decodeSeconds = decodeNanoseconds.load() * 1e-9;
+        result.transfers = transfersTotal.load();
+        result.transferBytes = transferBytesTotal.load();
+        result.minTransferBytes = minTransferBytes.load();
+        result.transferSeconds = transferNanoseconds.load() * 1e-9;
+        return result;
+    }
+
+    /// Starts over the smallest transfer reported by getReadStatistics().
+    void Board::resetTransferMinimum() {
+        minTransferBytes = 0;
+    }
+
+    const double Board::MAX_USB_BYTES_PER_SECOND = 480e6 / 8;
+
+    // Reads from the data pipe, adding to the transfer totals returned by getReadStatistics()
+    long Board::readDataPipe(long length, unsigned char* data) {
+        using std::chrono::steady_clock;
+
+        steady_clock::time_point begin = steady_clock::now();
+        long bytes = okb.readFromPipeOut(PipeOut::Data, length, data);
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - begin).count());
+
+        transfersTotal++;
+        transferBytesTotal += static_cast<uint64_t>(bytes);
+        transferNanoseconds += ns;
+        uint64_t previous = minTransferBytes.load();
+        while (bytes > 0 && (previous == 0 || static_cast<uint64_t>(bytes) < previous) && !minTransferBytes.compare_exchange_weak(previous, static_cast<uint64_t>(bytes))) {
         }
+        return bytes;
+    }
+
+    /** \brief Memory held by the acquisition buffers, and how full the waveform RAM is.
+     *
+     *  Safe to call from any thread, including while another thread is reading.  The read queue's size is the one
+     *  measured after the last read.
+     *
+     *  \returns The byte and word counts
+     */
+    MemoryUsage Board::getMemoryUsage() const {
+        MemoryUsage result;
+        result.readQueueBytes = static_cast<std::size_t>(readQueueBytes.load());
+        result.readQueueAllocations = readQueueAllocations.load();
+        result.usbBufferBytes = static_cast<std::size_t>(usbBufferBytes.load());
+        result.waveformWordsUsed = waveformRAM.getWordsInUse();
+        result.waveformWordsTotal = waveformRAM.getSize();
+        return result;
+    }
+
+    /// Resets the counts returned by getTimestampGaps().
+    void Board::resetTimestampGaps() {
+        readQueue.resetTimestampGaps();
     }
 
     /** \brief The number of words in the FPGA's FIFO.
      *  \returns See above.
      */
     uint32_t Board::numWordsInFifo() {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         okb.updateWiresOut();
         return okb.getWireOutDWord(WireOut::NumWordsFIFOHigh, WireOut::NumWordsFIFOLow);
     }
 
+    /** \brief Starts a background thread that does the USB transfers for read().
+     *
+     *  Once started, read() takes its data from blocks already transferred by the thread (see USBReaderThread) rather than
+     *  reading over USB itself, so the FPGA's FIFO continues to drain while the caller is parsing and processing data.
+     *
+     *  Call this after the channels and data transfers have been configured and the board has been started (e.g., with
+     *  runContinuously()), and call stopReaderThread() before stopping or reconfiguring the board.
+     */
+    void Board::startReaderThread() {
+        stopReaderThread();
+
+        const USBPacketLayout& layout = getPacketLayout();
+        readerThread.reset(new USBReaderThread(*this, layout.packetSize, transferPolicy.getMaxPackets()));
+        readerThread->setScheduling(readerPriority, readerCpu);
+        readerThread->start();
+    }
+
+    /** \brief How the reader thread (see startReaderThread) is scheduled, from the next time it's started.
+     *
+     *  Real-time priority, and a core of its own, keep GUI activity and background jobs from delaying the USB transfers
+     *  and letting the FPGA's FIFO fill up.  See Thread::setScheduling.
+     *
+     *  \param[in] priority  Priority class; normal by default
+     *  \param[in] cpu       Core to pin the thread to, or -1 (the default) for any core
+     */
+    void Board::setReaderThreadScheduling(Thread::Priority priority, int cpu) {
+        readerPriority = priority;
+        readerCpu = cpu;
+    }
+
+    /** \brief Stops the thread started by startReaderThread(), if any.
+     *
+     *  Any data that was transferred but not yet returned by read() is discarded; subsequent calls to read() transfer data
+     *  directly.
+     */
+    void Board::stopReaderThread() {
+        if (readerThread) {
+            readerThread->close();
+            readerThread.reset();
+        }
+    }
+
     /** \brief Reads up to numPackets packets into the ReadQueue.  Doesn't block.
      *
      *  Always reads at least a minimum chunk size worth of data, if it is available.
      *  May loop while waiting for the minimum chunk size.  (If, after looping, still
-     *  not enough data is available, throws an exception.)
+     *  not enough data is available, throws an exception.)  The chunk size is chosen by
+     *  transferPolicy, which adapts it to the FIFO level and the time spent per read.
      *
      *  If the FPGA board has some data (more than minimum chunk size), but less than
      *  the requested amount, reads that amount of data.
      *
      *  \param[in] packetsToRead  Maximum number of packets to read
+     *  \param[in] cancel         If given, a stop requested on it ends the wait for data at once, and read() returns 0
+     *                            (e.g., pass a Thread's keepGoing, so that stopping the thread doesn't wait for the board)
      *  \returns The actual number of packets read
      */
-    unsigned int Board::read(unsigned int packetsToRead) {
-        unsigned int perPacketSizeWords = (USBPacket::getPerChannelSize() * numActiveChannels() * channelRepetition + USBPacket::getChannelIndependentSize(*this)) / 2;
-        unsigned int minChunkPackets = static_cast<unsigned int>(getSamplingRateHz())/30;
-        setUSBBufferSize(minChunkPackets * perPacketSizeWords * 2 * 10);
-        unsigned int maxPacketsPerRead = usbBufferSize / 2 / perPacketSizeWords;
+    unsigned int Board::read(unsigned int packetsToRead, StopToken* cancel) {
+        CLAMP_TRACE_SPAN("Board::read");
+        using std::chrono::steady_clock;
+        steady_clock::time_point readBegin = steady_clock::now();
+
+        if (readerThread) {
+            unsigned char* data = nullptr;
+            unsigned int packetsThisRead = readerThread->next(packetsToRead, data, cancel);
+            if (packetsThisRead == 0) {
+                return 0; // Cancelled
+            }
+            double arrivalSeconds = ClockSync::hostNow();
+            if (usbCapture) {
+                usbCapture->write(*this, data, packetsThisRead * getPacketLayout().packetSize);
+            }
+            parsePackets(data, packetsThisRead);
+            readDone(packetsThisRead, std::chrono::duration<double>(steady_clock::now() - readBegin).count(), arrivalSeconds);
+            return packetsThisRead;
+        }
+
+
+        unsigned int perPacketSizeWords = getPacketLayout().packetSize / 2;
+        unsigned int minChunkPackets = std::min(transferPolicy.getChunkPackets(), packetsToRead);
+        setUSBBufferSize(minChunkPackets * perPacketSizeWords * 2); // Normally already done, by sizeUSBBufferForRun
+        unsigned int maxPacketsPerRead = std::min(static_cast<unsigned int>(usbBuffer.size() / 2 / perPacketSizeWords), transferPolicy.getMaxPackets());
 
-        minChunkPackets = std::min(minChunkPackets, packetsToRead);
         unsigned int minChunkWords = perPacketSizeWords * minChunkPackets;
 
         // Wait until we have minChunk words available
-        uint32_t inFIFO = numWordsInFifo();
-        clock_t begin = clock();
-        while (inFIFO < minChunkWords) {
-            inFIFO = numWordsInFifo();
-            clock_t now = clock();
-            double elapsed = double(now - begin) / CLOCKS_PER_SEC;
-            if (elapsed > 10.0) { // A chunk should take 1,000/200,000; if it takes 10 s, we're definitely having trouble
-                throw runtime_error("Not getting a minimum chunk size.");
-            }
+        uint32_t inFIFO = waitForFifo(minChunkWords, perPacketSizeWords, cancel);
+        if (inFIFO < minChunkWords) {
+            return 0; // Cancelled
         }
 
         // Now read however many complete packets we can from the FIFO
         unsigned int packetsThisRead = inFIFO / perPacketSizeWords;
         packetsThisRead = std::min(packetsThisRead, packetsToRead);
         packetsThisRead = std::min(packetsThisRead, maxPacketsPerRead);
-        okb.readFromPipeOut(PipeOut::Data, 2 * perPacketSizeWords * packetsThisRead, usbBuffer);
+        steady_clock::time_point begin = steady_clock::now();
+        readDataPipe(2 * perPacketSizeWords * packetsThisRead, usbBuffer.get());
+        double arrivalSeconds = ClockSync::hostNow();
+        if (usbCapture) {
+            usbCapture->write(*this, usbBuffer.get(), 2 * perPacketSizeWords * packetsThisRead);
+        }
 
-        readQueue.parse(usbBuffer, packetsThisRead);
+        parsePackets(usbBuffer.get(), packetsThisRead);
+        double busySeconds = std::chrono::duration<double>(steady_clock::now() - begin).count();
 
         updateFIFOStats(perPacketSizeWords);
+        transferPolicy.update(packetsThisRead, busySeconds, fifoPercentageFull, latency);
 
+        readDone(packetsThisRead, std::chrono::duration<double>(steady_clock::now() - readBegin).count(), arrivalSeconds);
         return packetsThisRead;
     }
 
+    // Tells loopTiming and clockSync about a read that returned numPackets packets, which were in host memory at
+    // arrivalSeconds (ClockSync::hostNow())
+    void Board::readDone(unsigned int numPackets, double readSeconds, double arrivalSeconds) {
+        const std::vector<uint32_t>& timestamps = readQueue.getTimeStamps();
+        if (numPackets > 0 && !timestamps.empty()) {
+            clockSync.addSample(timestamps.back(), arrivalSeconds);
+            loopTiming.readDone(timestamps.back(), readSeconds);
+        }
+    }
+
+    // Decodes packets into readQueue, adding to the totals returned by getReadStatistics()
+    void Board::parsePackets(unsigned char* data, unsigned int numPackets) {
+        using std::chrono::steady_clock;
+
+        lock_guard<mutex> lockCallbacks(sampleCallbackMutex);
+        markNewSamples();
+        steady_clock::time_point begin = steady_clock::now();
+        readQueue.parse(data, numPackets);
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - begin).count());
+
+        bytesReadTotal += static_cast<uint64_t>(numPackets) * getPacketLayout().packetSize;
+        packetsReadTotal += numPackets;
+        decodeNanoseconds += ns;
+        readQueueBytes = readQueue.memoryBytes();
+        readQueueAllocations = readQueue.getAllocationCount();
+        deliverSamples();
+    }
+
+    // Notes where each subscribed channel's data ends, before a parse adds to it
+    void Board::markNewSamples() {
+        for (auto& element : sampleSubscriptions) {
+            element.second.firstNew = readQueue.getRawData(element.second.channel).size();
+        }
+        firstNewPacket = readQueue.getTimeStamps().size();
+    }
+
+    const vector<Sample>& Board::getQuantity(const ChipChannel& channel, SampleQuantity quantity) {
+        switch (quantity) {
+        case MEASURED_CURRENT: return readQueue.getMeasuredCurrents(channel);
+        case MEASURED_VOLTAGE: return readQueue.getMeasuredVoltages(channel);
+        case CLAMP_VOLTAGE: return readQueue.getClampVoltages(channel);
+        case CLAMP_CURRENT: return readQueue.getClampCurrents(channel);
+        default: return readQueue.getMuxData(channel);
+        }
+    }
+
+    // Passes each subscriber the samples added since markNewSamples()
+    void Board::deliverSamples() {
+        if (sampleSubscriptions.empty() && packetSubscriptions.empty()) {
+            return;
+        }
+        const std::vector<uint32_t>& timestamps = readQueue.getTimeStamps();
+        if (!packetSubscriptions.empty() && timestamps.size() > firstNewPacket) {
+            PacketSpan span;
+            span.length = timestamps.size() - firstNewPacket;
+            span.timestamps = timestamps.data() + firstNewPacket;
+            const vector<uint16_t>& digIns = readQueue.getDigIns();
+            const vector<uint16_t>& digOuts = readQueue.getDigOuts();
+            if (digIns.size() == timestamps.size()) {
+                span.digIns = digIns.data() + firstNewPacket;
+            }
+            if (digOuts.size() == timestamps.size()) {
+                span.digOuts = digOuts.data() + firstNewPacket;
+            }
+            const vector<vector<uint16_t>>& adcs = readQueue.getADCs();
+            for (unsigned int adc = 0; adc < 8 && adc < adcs.size(); adc++) {
+                if (adcTransfer[adc] && adcs[adc].size() == timestamps.size()) {
+                    span.adcs[adc] = adcs[adc].data() + firstNewPacket;
+                }
+            }
+            for (auto& element : packetSubscriptions) {
+                element.second(span);
+            }
+        }
+
+        for (auto& element : sampleSubscriptions) {
+            SampleSubscription& subscription = element.second;
+            const std::vector<Sample>& samples = getQuantity(subscription.channel, subscription.quantity);
+            const std::vector<uint32_t>& sampleTimestamps = readQueue.getTimeStamps(subscription.channel);
+            if (samples.size() <= subscription.firstNew || samples.size() > sampleTimestamps.size()) {
+                continue;
+            }
+            // A channel's samples are the last samples.size() timesteps (it may have been enabled after the others)
+            std::size_t timestampOffset = sampleTimestamps.size() - samples.size();
+
+            SampleSpan span;
+            span.channel = subscription.channel;
+            span.samples = samples.data() + subscription.firstNew;
+            span.timestamps = sampleTimestamps.data() + timestampOffset + subscription.firstNew;
+            span.length = samples.size() - subscription.firstNew;
+            span.firstTimestamp = span.timestamps[0];
+            subscription.callback(span);
+        }
+    }
+
+    /** \brief Waits until the FPGA's FIFO contains at least minWords words.
+     *
+     *  How it waits is controlled by setFifoWaitStrategy().  Throws an exception if the data doesn't arrive within 10 s.
+     *
+     *  \param[in] minWords            Number of words to wait for
+     *  \param[in] perPacketSizeWords  Size of one packet, in words; used to estimate how long to sleep
+     *  \returns The number of words in the FIFO
+     */
+    uint32_t Board::waitForFifo(uint32_t minWords, unsigned int perPacketSizeWords, StopToken* cancel) {
+        using std::chrono::steady_clock;
+
+        // Measured in wall-clock time; clock() measures CPU time, which doesn't advance while sleeping
+        const steady_clock::time_point begin = steady_clock::now();
+
+        uint32_t inFIFO = numWordsInFifo();
+        while (inFIFO < minWords) {
+            if (cancel && cancel->stopRequested()) {
+                break;
+            }
+            fifoWaitSleep(minWords - inFIFO, perPacketSizeWords, cancel);
+
+            inFIFO = numWordsInFifo();
+            double elapsed = std::chrono::duration<double>(steady_clock::now() - begin).count();
+            if (elapsed > 10.0) { // A chunk should take 1,000/200,000; if it takes 10 s, we're definitely having trouble
+                throw runtime_error("Not getting a minimum chunk size.");
+            }
+        }
+        return inFIFO;
+    }
+
+    /** \brief Pauses between FIFO polls, according to the FIFO wait strategy.
+     *
+     *  With SLEEP_BACKOFF, sleeps about as long as it should take to acquire the missing packets, bounded so that we
+     *  don't oversleep past the FIFO filling; a stop requested on cancel ends the sleep at once.  With SPIN, returns
+     *  immediately.
+     *
+     *  \param[in] missingWords        Number of words still needed
+     *  \param[in] perPacketSizeWords  Size of one packet, in words
+     *  \param[in] cancel              Stop token to wake up for, or null
+     */
+    void Board::fifoWaitSleep(uint32_t missingWords, unsigned int perPacketSizeWords, StopToken* cancel) {
+        if (fifoWaitStrategy == SLEEP_BACKOFF) {
+            double missingPackets = static_cast<double>(missingWords) / perPacketSizeWords;
+            long long sleepUs = static_cast<long long>(missingPackets * 1.0e6 / getSamplingRateHz());
+            sleepUs = std::max(100LL, std::min(sleepUs, 20000LL));
+            if (cancel) {
+                cancel->waitFor(std::chrono::microseconds(sleepUs));
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+            }
+        }
+    }
+
+    /** \brief Sets how read() waits for data to arrive in the FPGA's FIFO.
+     *
+     *  The default, SLEEP_BACKOFF, sleeps between polls so that an idle or slow acquisition doesn't pin a CPU core,
+     *  and doesn't hold commandMutex continuously (which would starve commands sent from other threads).  SPIN gives the
+     *  lowest latency at the cost of a busy core.
+     *
+     *  \param[in] strategy  The strategy to use
+     */
+    void Board::setFifoWaitStrategy(FifoWaitStrategy strategy) {
+        fifoWaitStrategy = strategy;
+    }
+
+    /** \brief Returns how read() waits for data to arrive in the FPGA's FIFO.
+     *
+     *  \returns See setFifoWaitStrategy().
+     */
+    Board::FifoWaitStrategy Board::getFifoWaitStrategy() const {
+        return fifoWaitStrategy;
+    }
+
     /** \brief Reads numPackets packets into the ReadQueue.  Blocks.
      *
      *  If the FPGA board doesn't have enough data, loops until it does.
@@ -320,7 +731,25 @@ namespace CLAMP {
 
         // For blockingRead, we need to push the last data onto the ReadQueue (since there isn't more coming).
         // If there is more coming and you want to loop, you should do read() instead (essentially copy this loop).
+        lock_guard<mutex> lockCallbacks(sampleCallbackMutex);
+        markNewSamples();
         readQueue.pushLast();
+        deliverSamples();
+    }
+
+    /** \brief Byte layout of the USB packets currently being returned.
+     *
+     *  Recomputed only when the channel loop, channel enables, or data transfer settings have changed
+     *  since the last call, so it's cheap to call once per read.
+     *
+     *  \returns The layout.
+     */
+    const USBPacketLayout& Board::getPacketLayout() {
+        if (packetLayoutDirty) {
+            packetLayout.update(*this, channels);
+            packetLayoutDirty = false;
+        }
+        return packetLayout;
     }
 
     void Board::updateFIFOStats(unsigned int perPacketSizeWords) {
@@ -332,10 +761,11 @@ namespace CLAMP {
         double samplePeriod = 1.0 / boardSampleRate;
         latency = 1000.0 * (wordsInFifo / perPacketSizeWords) * samplePeriod;
         // LOG(false) << "LAG: " << latency << " ms.\n";
+        fifoMonitor.addSample(wordsInFifo, fifoPercentageFull, latency);
     }
 
     void Board::writeRAM(uint16_t start_addr, const vector<uint32_t>& data) {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         uint16_t length = data.size();
         okb.setWireIn(WireIn::RAMWriteStart, start_addr);
         okb.setWireIn(WireIn::RAMWriteEnd, start_addr + length - 1);
@@ -380,9 +810,27 @@ namespace CLAMP {
      * the board.
      */
     void Board::runContinuously() {
-        lock_guard<mutex> lockio(commandMutex);
+        armContinuous();
+        triggerStart();
+    }
+
+    // First half of runContinuously: everything but the start trigger
+    void Board::armContinuous() {
+        forgetRunWrites();
+        applyDataTransfer();
+        sizeUSBBufferForRun(transferPolicy.getMaxPackets());
+        readQueue.reserve(transferPolicy.getMaxPackets() + 1);
+        readQueue.restartTimestamps();
+        loopTiming.startRun(getSamplingRateHz());
+        clockSync.startRun(getSamplingRateHz());
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         okb.setWireInBit(WireIn::RunControl, BitMask::RunContinuouslyBitMask, true);
         okb.updateWiresIn();
+    }
+
+    // Starts the board running with whatever run control is set up (i.e., by armContinuous)
+    void Board::triggerStart() {
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         okb.activateTriggerIn(Triggers::Start, Bit::StartBit);
     }
 
@@ -398,7 +846,7 @@ namespace CLAMP {
      * Note: A board is automatically stopped when the Board object is deleted.
      */
     void Board::stop() {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         if (okb.isOpen()) {
             okb.setWireIn(WireIn::MaxTimestepLow, 0);
             okb.setWireIn(WireIn::MaxTimestepHigh, 0);
@@ -418,11 +866,12 @@ namespace CLAMP {
     {
         try {
             if (okb.isOpen()) {
-                while (numWordsInFifo() >= usbBufferSize / 2) {
-                    okb.readFromPipeOut(PipeOut::Data, usbBufferSize, usbBuffer);
+                unsigned int bufferSize = static_cast<unsigned int>(usbBuffer.size());
+                while (numWordsInFifo() >= bufferSize / 2) {
+                    readDataPipe(bufferSize, usbBuffer.get());
                 }
                 while (numWordsInFifo() > 0) {
-                    okb.readFromPipeOut(PipeOut::Data, 2 * numWordsInFifo(), usbBuffer);
+                    readDataPipe(2 * numWordsInFifo(), usbBuffer.get());
                 }
             }
         }
@@ -433,12 +882,47 @@ namespace CLAMP {
     }
 
     void Board::reset() {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         okb.setWireInBit(WireIn::RunControl, BitMask::ResetBitMask, true);
         okb.updateWiresIn();
 
         okb.setWireInBit(WireIn::RunControl, BitMask::ResetBitMask, false);
         okb.updateWiresIn();
+
+        forgetWrittenSettings();
+    }
+
+    /* Forgets the chips' confirmed values (see Chip::confirmWrites) of the registers that the enabled channels' commands
+     * write, since nothing here knows how far a run gets.  ClampController::runImmediate confirms its writes again
+     * once its run is done.  A channel with no commands may still be pointed at an older list, so that forgets all.
+     */
+    void Board::forgetRunWrites() {
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            for (unsigned int channelIndex = 0; channelIndex < MAX_NUM_CHANNELS; channelIndex++) {
+                Channel& thisChannel = *chip[chipIndex]->channel[channelIndex];
+                if (!thisChannel.getEnable()) {
+                    continue;
+                }
+                if (thisChannel.writtenCommands.empty()) {
+                    chip[chipIndex]->forgetAllWrites();
+                }
+                else {
+                    chip[chipIndex]->forgetWrites(channelIndex, thisChannel.writtenCommands);
+                }
+            }
+        }
+    }
+
+    // After a reset, nothing is known about what's on the FPGA, so the next writes of each setting go through
+    void Board::forgetWrittenSettings() {
+        channelLoopWritten = false;
+        samplingRateWritten = false;
+        dataTransferWritten = false;
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            for (unsigned int channelIndex = 0; channelIndex < MAX_NUM_CHANNELS; channelIndex++) {
+                chip[chipIndex]->channel[channelIndex]->enableWritten = false;
+            }
+        }
     }
 
     /** \brief Sets the values of the 8 on-FPGA-board LEDs
@@ -448,7 +932,7 @@ namespace CLAMP {
      *  \param[in] value   8-bit value corresponding to 8 LEDs OR-ed together.
      */
     void Board::setFpgaLeds(uint8_t value) {
-        lock_guard<mutex> lockio(commandMutex);
+        lock_guard<ProfiledMutex> lockio(commandMutex);
         okb.setWireIn(WireIn::LedDisplay, value);
         okb.updateWiresIn();
     }
@@ -460,7 +944,7 @@ namespace CLAMP {
 	*  \param[in] value   8-bit value corresponding to 8 LEDs OR-ed together.
 	*/
 	void Board::setSpiPortLeds(uint8_t value) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		okb.setWireIn(WireIn::SpiPortLeds, value);
 		okb.updateWiresIn();
 	}
@@ -473,12 +957,15 @@ namespace CLAMP {
 	*  \param[in] value   8-bit value corresponding to 3 LEDs OR-ed together.
 	*/
 	void Board::setStatusLeds(bool digitalInControl, uint8_t value) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		okb.setWireIn(WireIn::StatusLeds, value | (digitalInControl ? (1 << 3) : 0));
 		okb.updateWiresIn();
 	}
 
     void Board::setChannelLoopOrder(const std::vector<ChannelNumber>& channels_) {
+        if (channelLoopWritten && channels == channels_) {
+            return;
+        }
         bool differentNumberOfChannels = (channels.size() != channels_.size());
 
         struct {
@@ -521,16 +1008,19 @@ namespace CLAMP {
         }
 
         {
-            lock_guard<mutex> lockio(commandMutex);
+            lock_guard<ProfiledMutex> lockio(commandMutex);
             char* tmp = reinterpret_cast<char*>(&wireInValue);
             okb.setWireIn(WireIn::Channels, *reinterpret_cast<uint16_t*>(tmp));
             okb.updateWiresIn();
         }
 
         channels = channels_;
+        channelLoopWritten = true;
+        packetLayoutDirty = true;
         if (differentNumberOfChannels) {
-            setSamplingRate();
+            samplingRateWritten = false;
         }
+        setSamplingRate();
     }
 
     /** \brief Runs the board for a fixed number of time steps.
@@ -541,7 +1031,14 @@ namespace CLAMP {
      * \param[in] numTimesteps  Number of timesteps to run for.  Frequently the result of getNumTimesteps().
      */
     void Board::runFixed(uint32_t numTimesteps) {
-        lock_guard<mutex> lockio(commandMutex);
+        forgetRunWrites();
+        applyDataTransfer();
+        sizeUSBBufferForRun(numTimesteps + 1); // A read can pick up one packet left over from the previous run
+        readQueue.reserve(numTimesteps + 1);
+        readQueue.restartTimestamps();
+        loopTiming.startRun(getSamplingRateHz());
+        clockSync.startRun(getSamplingRateHz());
+        lock_guard<ProfiledMutex> lockio(commandMutex);
 
         uint32_t maxTimestep = numTimesteps - 1;
         okb.setWireIn(WireIn::MaxTimestepLow, (maxTimestep & 0xFFFF));
@@ -553,6 +1050,9 @@ namespace CLAMP {
     }
 
     void Board::setSamplingRate() {
+        if (samplingRateWritten) {
+            return; // Already set for this number of channels; reprogramming the clock synthesizer is slow
+        }
         switch (channels.size()) {
         case 1:
             setClockFreq_internal(7, 20);
@@ -566,6 +1066,7 @@ namespace CLAMP {
         default:
             throw invalid_argument("Invalid number of channels");
         }
+        samplingRateWritten = true;
     }
 
     /** \brief Board sampling rate, in Hz.
@@ -575,6 +1076,34 @@ namespace CLAMP {
         return 50000;
     }
 
+    /** \brief Keeps only every factor'th timestep of a chip's data, low-pass filtered, so a slow recording (e.g., a
+     *  current clamp baseline) hands fewer samples to everything downstream.
+     *
+     *  The decimation happens in the ReadQueue's conversion, in the same filter that takes out channelRepetition (see
+     *  enableChannels()), so it costs nothing extra; the other chips still get every timestep.  Each channel of the chip
+     *  then has its own timestamps, ReadQueue::getTimeStamps(const ClampConfig::ChipChannel&), one per sample kept, and
+     *  sample callbacks (see addSampleCallback()) get those.
+     *
+     *  The calibration routines and the temperature sensor expect every timestep, so only set this around recordings,
+     *  with the board stopped, and set it back to 1 afterwards.  It takes effect from the next read.
+     *
+     *  \param[in] chipIndex  %Chip index [0-7]
+     *  \param[in] factor     Timesteps per sample kept; 1 (the default) keeps them all
+     */
+    void Board::setOutputDecimation(unsigned int chipIndex, unsigned int factor) {
+        if (chipIndex >= MAX_NUM_CHIPS || factor == 0) {
+            throw invalid_argument("Invalid chip or decimation factor");
+        }
+        outputDecimation[chipIndex] = factor;
+    }
+
+    /** \brief Rate of a chip's samples, after any output decimation (see setOutputDecimation()), in Hz.
+     *  \returns The rate.
+     */
+    double Board::getOutputSamplingRateHz(unsigned int chipIndex) const {
+        return getSamplingRateHz() / outputDecimation[chipIndex];
+    }
+
     /** \brief Returns the number of enabled channels.
      *
      *  See enableChannels() for more information.
@@ -646,16 +1175,31 @@ namespace CLAMP {
      *
      *  Sets the chip[i].present value, and sets optimal cable delays for chips that are present.
      *
+     *  Scanning tries every cable delay on every chip, one run each.  If cableDelayHints is set, one run checks them
+     *  first (see confirmCableDelays()), and the full scan only happens if they no longer hold.
+     *
      *  This is called internally in open().  You could call it again later if you wanted to rescan for newly attached chips.
      */
     void Board::scanForChips() {
+        ReadQueue::CommandRetention retention(readQueue); // For readBackAll
         for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
             chip[chipIndex]->present = true;
+            chip[chipIndex]->forgetAllWrites(); // Could be a different chip by now
         }
 
         vector<WaveformCommand> commands = CommonWaveForms::readROMCommands();
         configurePerChipCommands(commands);
 
+        cableDelaysConfirmed = confirmCableDelays(commands);
+        if (cableDelaysConfirmed) {
+            // The confirming run read the ROM values at the chosen delays
+            clearCommands();
+            for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+                chip[chipIndex]->numChannels = chip[chipIndex]->chipRegisters.numUnits.value;
+            }
+            return;
+        }
+
         bool isGood[MAX_NUM_CHIPS][MAX_NUM_DELAYS];
 
         for (unsigned int delay = 0; delay < MAX_NUM_DELAYS; delay++) {
@@ -715,8 +1259,83 @@ namespace CLAMP {
 		}
     }
 
+    /* The quick path of scanForChips: in one run, checks that every chip in cableDelayHints still answers at its delay.
+     * The ports that had no chip are tried at the delay most of the chips use (cables tend to be the same length), and
+     * must still not answer.  Returns false, leaving present and the delays for the full scan to set, if there are no
+     * hints or anything differs; otherwise sets present from the hints.
+     *
+     * A chip newly attached to an empty port that doesn't answer at that delay goes unnoticed; clear cableDelayHints to
+     * find it.
+     */
+    bool Board::confirmCableDelays(const vector<WaveformCommand>& commands) {
+        if (cableDelayHints.size() != MAX_NUM_CHIPS) {
+            return false;
+        }
+        unsigned int uses[MAX_NUM_DELAYS] = {};
+        for (int delay : cableDelayHints) {
+            if (delay >= static_cast<int>(MAX_NUM_DELAYS)) {
+                return false;
+            }
+            if (delay >= 0) {
+                uses[delay]++;
+            }
+        }
+        unsigned int commonDelay = static_cast<unsigned int>(std::max_element(uses, uses + MAX_NUM_DELAYS) - uses);
+        if (uses[commonDelay] == 0) {
+            return false; // No chips last time; nothing to go on
+        }
+
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            int hint = cableDelayHints[chipIndex];
+            chip[chipIndex]->setCableDelay(static_cast<uint8_t>((hint >= 0) ? hint : commonDelay));
+        }
+        runFixed(commands.size());
+        blockingRead(commands.size());
+        readBackAll();
+
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            bool isGood = (chip[chipIndex]->chipRegisters.getCompanyDesignation() == L"INTAN");
+            if (isGood != (cableDelayHints[chipIndex] >= 0)) {
+                return false;
+            }
+        }
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            chip[chipIndex]->present = (cableDelayHints[chipIndex] >= 0);
+            if (!chip[chipIndex]->present) {
+                chip[chipIndex]->channel[0]->setEnable(false);
+            }
+        }
+        return true;
+    }
+
+    /** \brief Uploads the FPGA bitfile in open() even if the FPGA already runs it.
+     *
+     *  By default, open() leaves an FPGA that was configured with the same bitfile alone; see OpalKellyBoard::open().
+     */
+    void Board::setForceBitfileUpload(bool force) {
+        okb.setForceBitfileUpload(force);
+    }
+
+    /// True if the last open() found the FPGA already configured, and didn't upload the bitfile
+    bool Board::wasBitfileReused() const {
+        return okb.wasBitfileReused();
+    }
+
+    /** \brief Returns each chip's cable delay, as chosen by scanForChips(), or -1 for a chip that isn't present.
+     *
+     *  Saved, these make good cableDelayHints for the next session.
+     */
+    vector<int> Board::getCableDelays() const {
+        vector<int> delays;
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            delays.push_back(chip[chipIndex]->present ? chip[chipIndex]->cableDelay : -1);
+        }
+        return delays;
+    }
+
     /** \brief Stores the result of all register READ commands in the ReadQueue in the appropriate in-RAM registers.
      *
+     *  The ReadQueue must have been keeping the commands when the data was read; see ReadQueue::CommandRetention.
      *  Clears the ReadQueue.
      */
     void Board::readBackAll() {
@@ -733,7 +1352,7 @@ namespace CLAMP {
     }
 
 	void Board::readDigitalInManual() {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		okb.updateWiresOut();
 		expanderBoardDetected = okb.getWireOutBit(WireOut::SerialDigitalIn, BitMask::ExpanderDetectBitMask);
@@ -894,6 +1513,11 @@ namespace CLAMP {
 
         // Now figure out which chips are actually present
         scanForChips();
+        for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+            if (chip[chipIndex]->present) {
+                chip[chipIndex]->confirmWrites(commands);
+            }
+        }
 
         enableChannels(getPresentChannels());
     }
@@ -926,33 +1550,94 @@ namespace CLAMP {
 
     /// Pushes all in-memory command lists to the FPGA.
     void Board::commandsToFPGA() {
-		ChipChannelList channelList = getAllChannels();
-
-        for (auto& index : channelList) {
-            Channel& thisChannel = *chip[index.chip]->channel[index.channel];
-            thisChannel.commandsToFPGA();
-        }
+        commandsToFPGA(getAllChannels());
     }
 
 	/// Pushes in-memory command lists for particular chips/channels to the FPGA.
 	void Board::commandsToFPGA(const ChipChannelList &channelList) {
+		vector<Channel*> targets;
 		for (auto& index : channelList) {
-			Channel& thisChannel = *chip[index.chip]->channel[index.channel];
-			thisChannel.commandsToFPGA();
+			targets.push_back(chip[index.chip]->channel[index.channel]);
 		}
+		commandsToFPGA(targets);
 	}
 
 	/// Pushes in-memory command lists for one chip only to FPGA; send null commands (reading from ROM) on other chips.
 	void Board::commandsToFPGASinglePort(int port) {
+		vector<Channel*> targets;
 		for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-			if (i == port) {
-				Channel& thisChannel = *chip[i]->channel[0];
-				thisChannel.commandsToFPGA();
+			Channel& thisChannel = *chip[i]->channel[0];
+			if (i != port) {
+				thisChannel.setNullCommands();
 			}
-			else {
-				Channel& thisChannel = *chip[i]->channel[0];
-				thisChannel.nullCommandToFPGA();
+			targets.push_back(&thisChannel);
+		}
+		commandsToFPGA(targets);
+	}
+
+	/** \brief Pushes all in-memory command lists to the FPGA while it's running, to take effect at the next loop.
+	 *
+	 *  Commands that changed go to new locations in Waveform RAM, and only the channels' start and end addresses are
+	 *  rewritten.  The FPGA picks those up when a channel's waveform gets to its end and loops (see
+	 *  Channel::setStartAddress), so each channel switches cleanly at a waveform boundary, without stopping the board.
+	 *
+	 *  The RAM holding the old commands stays allocated, since it may still be playing; call releaseRetiredCommands()
+	 *  once the new commands are known to have taken effect (or the board has stopped).
+	 *
+	 *  Each channel's start and end addresses go to the board together, in one RAM write (see Channel::writeAddresses),
+	 *  so a channel that loops during the update plays either its old commands or its new ones, never a mix.
+	 */
+	void Board::commandsToFPGAAtBoundary() {
+		commandsToFPGAAtBoundary(getAllChannels());
+	}
+
+	/// As commandsToFPGAAtBoundary(), for particular chips/channels (e.g., those a WaveformControl::CommandStream plays on).
+	void Board::commandsToFPGAAtBoundary(const ChipChannelList& channelList) {
+		vector<Channel*> targets;
+		for (auto& index : channelList) {
+			targets.push_back(chip[index.chip]->channel[index.channel]);
+		}
+		commandsToFPGA(targets, true);
+	}
+
+	/// Frees the Waveform RAM left allocated by commandsToFPGAAtBoundary().
+	void Board::releaseRetiredCommands() {
+		releaseRetiredCommands(getAllChannels());
+	}
+
+	/// Frees the Waveform RAM left allocated by commandsToFPGAAtBoundary() for particular chips/channels.
+	void Board::releaseRetiredCommands(const ChipChannelList& channelList) {
+		for (auto& index : channelList) {
+			chip[index.chip]->channel[index.channel]->retiredExtents.clear();
+		}
+	}
+
+	/* Writes the channels' commands to Waveform RAM in one batch, so the board gets a single upload of the merged
+	 * changes, then points the channels that moved at their new commands.  The addresses are only written once the
+	 * commands are on the board, so a channel never starts playing RAM that hasn't been uploaded yet.  The commands only
+	 * count as written once all that has succeeded; if it throws, the next call writes them again.
+	 */
+	void Board::commandsToFPGA(const vector<Channel*>& targets, bool atBoundary) {
+		vector<Channel*> written;
+		vector<Channel*> moved;
+		{
+			WaveformControl::WaveformRAM::Batch batch(waveformRAM);
+			for (Channel* channel : targets) {
+				if (channel->commands == channel->writtenCommands) {
+					continue;
+				}
+				written.push_back(channel);
+				if (channel->writeCommandsToRAM(atBoundary)) {
+					moved.push_back(channel);
+				}
 			}
+			batch.commit();
+		}
+		for (Channel* channel : moved) {
+			channel->writeAddresses();
+		}
+		for (Channel* channel : written) {
+			channel->setWrittenCommands();
 		}
 	}
 
@@ -1004,13 +1689,125 @@ namespace CLAMP {
 
     /** \brief Enables/disables board-level data coming back over the USB
      *
-     *  This is analogous to Channel::setEnable().
+     *  This is analogous to Channel::setEnable().  The values given here are always transferred; anything registered
+     *  with addDataConsumer() is transferred as well.  Board::open() starts with nothing transferred.
      *
      *  \param[in] adcs     Return board-level ADC values (8 booleans let you return anywhere from 0 to 8 of them)
      *  \param[in] digin    Return digital input values (single 16-bit return value contains all digital inputs)
      *  \param[in] digout   Return digital output values (single 16-bit return value contains all digital outputs)
      */
     void Board::setDataTransfer(bool adcs[8], bool digin, bool digout) {
+        std::copy(adcs, adcs + 8, baseDataTransfer.adcs);
+        baseDataTransfer.digin = digin;
+        baseDataTransfer.digout = digout;
+        applyDataTransfer();
+    }
+
+    /** \brief Registers a consumer of board-level data (ADCs, digital inputs, digital outputs).
+     *
+     *  Each USB packet only carries the board-level words that some consumer (or setDataTransfer()) asked for, so
+     *  registering only what's actually plotted or saved keeps the packets small.  Changes take effect the next time
+     *  the board starts running.
+     *
+     *  \param[in] adcs     ADCs this consumer uses
+     *  \param[in] digin    True if it uses the digital inputs
+     *  \param[in] digout   True if it uses the digital outputs
+     *  \returns An id to pass to removeDataConsumer() when the data is no longer needed.
+     */
+    unsigned int Board::addDataConsumer(const bool adcs[8], bool digin, bool digout) {
+        DataConsumer consumer;
+        std::copy(adcs, adcs + 8, consumer.adcs);
+        consumer.digin = digin;
+        consumer.digout = digout;
+        unsigned int id = nextDataConsumerId++;
+        dataConsumers[id] = consumer;
+        return id;
+    }
+
+    /** \brief Unregisters a consumer added by addDataConsumer().
+     *
+     *  \param[in] id  Value returned by addDataConsumer().
+     */
+    void Board::removeDataConsumer(unsigned int id) {
+        dataConsumers.erase(id);
+    }
+
+    /** \brief Registers a callback that receives a channel's new samples as soon as they're decoded.
+     *
+     *  After every read() (and blockingRead()), each callback is passed a SampleSpan of the samples that read added,
+     *  pointing straight into readQueue's buffers.  Any number of consumers can subscribe to the same channel, and none
+     *  of them has to copy the data out of readQueue or clear it.
+     *
+     *  Callbacks run on the thread that calls read(), while it holds a lock; they should be quick (hand the data to
+     *  another thread if there's real work to do), and mustn't call addSampleCallback() or removeSampleCallback().
+     *  The channel must also be enabled (see enableChannels()) for any data to arrive.
+     *
+     *  \param[in] channel   Channel whose samples to receive
+     *  \param[in] quantity  Which quantity to receive
+     *  \param[in] callback  Function to call with each read's new samples
+     *  \returns An id to pass to removeSampleCallback().
+     */
+    unsigned int Board::addSampleCallback(const ChipChannel& channel, SampleQuantity quantity, const SampleCallback& callback) {
+        if (channel.chip >= MAX_NUM_CHIPS || channel.channel >= MAX_NUM_CHANNELS) {
+            throw invalid_argument("Invalid channel");
+        }
+        lock_guard<mutex> lockCallbacks(sampleCallbackMutex);
+        SampleSubscription subscription;
+        subscription.channel = channel;
+        subscription.quantity = quantity;
+        subscription.callback = callback;
+        subscription.firstNew = 0;
+        unsigned int id = nextSampleCallbackId++;
+        sampleSubscriptions[id] = subscription;
+        return id;
+    }
+
+    /** \brief Registers a callback that receives the board-level data (timestamps, digital I/O, ADCs) of each read.
+     *
+     *  Called after every read() and blockingRead(), before the sample callbacks, under the same rules as
+     *  addSampleCallback().
+     *
+     *  \param[in] callback  Function to call with each read's new packets
+     *  \returns An id to pass to removeSampleCallback().
+     */
+    unsigned int Board::addPacketCallback(const PacketCallback& callback) {
+        lock_guard<mutex> lockCallbacks(sampleCallbackMutex);
+        unsigned int id = nextSampleCallbackId++;
+        packetSubscriptions[id] = callback;
+        return id;
+    }
+
+    /** \brief Unregisters a callback added by addSampleCallback() or addPacketCallback().
+     *
+     *  Once this returns, the callback won't be called again.
+     *
+     *  \param[in] id  Value returned by addSampleCallback() or addPacketCallback().
+     */
+    void Board::removeSampleCallback(unsigned int id) {
+        lock_guard<mutex> lockCallbacks(sampleCallbackMutex);
+        sampleSubscriptions.erase(id);
+        packetSubscriptions.erase(id);
+    }
+
+    // Transfers the union of what setDataTransfer() and the registered consumers asked for
+    void Board::applyDataTransfer() {
+        DataConsumer wanted = baseDataTransfer;
+        for (auto& element : dataConsumers) {
+            const DataConsumer& consumer = element.second;
+            for (unsigned int i = 0; i < 8; i++) {
+                wanted.adcs[i] = wanted.adcs[i] || consumer.adcs[i];
+            }
+            wanted.digin = wanted.digin || consumer.digin;
+            wanted.digout = wanted.digout || consumer.digout;
+        }
+        writeDataTransfer(wanted.adcs, wanted.digin, wanted.digout);
+    }
+
+    void Board::writeDataTransfer(const bool adcs[8], bool digin, bool digout) {
+        if (dataTransferWritten && digin == diginTransfer && digout == digoutTransfer &&
+            std::equal(adcs, adcs + 8, adcTransfer)) {
+            return;
+        }
         uint8_t adcUint = 0;
         for (unsigned int i = 0; i < 8; i++) {
             adcTransfer[i] = adcs[i];
@@ -1030,6 +1827,8 @@ namespace CLAMP {
             digUint |= 2;
         }
         writeGlobalVirtualRegister(1, digUint);
+        dataTransferWritten = true;
+        packetLayoutDirty = true;
     }
 
     void Board::setDigitalCommandOffset(uint16_t offset) {
@@ -1082,7 +1881,7 @@ namespace CLAMP {
 	*  merely tells the DACs on the interface box how to interpret ADC results from the headstages.
 	*/
 	void Board::configureDac(int dac, bool enable, int port, int channel, bool outputClamp) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		uint16_t commandWord = 
 			static_cast<uint16_t>((enable ? (1 << 0) : 0) + (outputClamp ? (1 << 1) : 0) + (channel << 2) + (port << 4) + (is18bitADC ? (1 << 7) : 0));
@@ -1113,7 +1912,7 @@ namespace CLAMP {
 	*  \param[in] gain   Voltage scale factor.
 	*/
 	void Board::setDacVoltageMultiplier(int dac, double gain) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		// TODO: What about 5 mV DAC step size?
 		double gainAbs = (gain < 0.0) ? -gain : gain;
 		unsigned int gainAbsFixedPoint = static_cast<unsigned int>(gainAbs * 1024.0);
@@ -1138,7 +1937,7 @@ namespace CLAMP {
 	*  \param[in] gain   Current-to-voltage scale factor, in units of mV/step.
 	*/
 	void Board::setDacCurrentMultiplier(int dac, double gain) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		double gainAbs = (gain < 0.0) ? -gain : gain;
 		unsigned int gainAbsFixedPoint = static_cast<unsigned int>(gainAbs * 204.8);
 		if (gainAbsFixedPoint > 32767) {
@@ -1164,7 +1963,7 @@ namespace CLAMP {
 	*  \param[in] value    Signed 16-bit offset.
 	*/
 	void Board::setDacVoltageOffset(int dac, int16_t value) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		okb.setWireIn(WireIn::DacConfigWord, value);
 		okb.updateWiresIn();
 		okb.activateTriggerIn(Triggers::DacVoltageOffsetLoad, dac);
@@ -1178,7 +1977,7 @@ namespace CLAMP {
 	*  \param[in] value    Signed 16-bit offset.
 	*/
 	void Board::setDacCurrentOffset(int dac, int16_t value) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		okb.setWireIn(WireIn::DacConfigWord, value);
 		okb.updateWiresIn();
 		okb.activateTriggerIn(Triggers::DacCurrentOffsetLoad, dac);
@@ -1190,7 +1989,7 @@ namespace CLAMP {
 	*  \param[in] gain   Voltage scale factor.
 	*/
 	void Board::setVoltageMultiplier(int port, double gain) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		// TODO: What about 5 mV DAC step size?
 		double gainAbs = (gain < 0.0) ? -gain : gain;
 		unsigned int gainAbsFixedPoint = static_cast<unsigned int>(gainAbs * 16384.0);
@@ -1215,7 +2014,7 @@ namespace CLAMP {
 	*  \param[in] value   16-bit value corresponding to signed fixed-point scale factor.
 	*/
 	void Board::setCurrentMultiplier(int port, uint16_t value) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 		okb.setWireIn(WireIn::AdcConfigWord, value);
 		okb.updateWiresIn();
 		okb.activateTriggerIn(Triggers::AdcCurrentMultiplierLoad, port);
@@ -1232,7 +2031,7 @@ namespace CLAMP {
 	}
 
 	void Board::updateAdcClampControl() {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		okb.setWireIn(WireIn::AdcSelectEnChip0,
 			(adcClampControlEnable[0][3] << 15) + (adcClampControlSelect[0][3] << 12) +
@@ -1304,7 +2103,7 @@ namespace CLAMP {
 	}
 
 	void Board::updateDigOutConfig() {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		okb.setWireIn(WireIn::DigOutEnable,
 			(digOutEnabled[7] << 7) + (digOutEnabled[6] << 6) + (digOutEnabled[5] << 5) + (digOutEnabled[4] << 4) +
@@ -1317,14 +2116,14 @@ namespace CLAMP {
 	}
 
 	void Board::enableAllPorts() {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		okb.setWireIn(WireIn::DisablePorts, 0);
 		okb.updateWiresIn();
 	}
 
 	void Board::enableOnePortOnly(int port) {
-		lock_guard<mutex> lockio(commandMutex);
+		lock_guard<ProfiledMutex> lockio(commandMutex);
 
 		okb.setWireIn(WireIn::DisablePorts, 0xff ^ (1 << port));
 		okb.updateWiresIn();
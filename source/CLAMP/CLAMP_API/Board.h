@@ -4,13 +4,96 @@
 #include <vector>
 #include <deque>
 #include <memory>
+#include <map>
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include "Waveform.h"
 #include "Channel.h"
 #include "Chip.h"
 #include "Constants.h"
 #include "ReadQueue.h"
+#include "USBPacket.h"
+#include "TransferPolicy.h"
+#include "AlignedBuffer.h"
+#include "LoopTiming.h"
+#include "ClockSync.h"
+#include "FifoMonitor.h"
+#include "LockProfiler.h"
+#include "streams.h"
+#include "Thread.h"
 
 namespace CLAMP {
+    class USBReaderThread;
+    class USBCaptureWriter;
+    struct CaptureConfiguration;
+    class MultiBoard;
+    namespace ClampConfig {
+        class ResidentSequence;
+    }
+
+    /** \brief Running totals of the data read by Board::read(), for throughput monitoring.
+     *
+     *  Take the difference between two calls to Board::getReadStatistics() to get rates.
+     */
+    struct ReadStatistics {
+        uint64_t bytesRead;   ///< Bytes transferred from the board
+        uint64_t packetsRead; ///< Packets (one per timestep) transferred
+        double decodeSeconds; ///< Time spent decoding packets (ReadQueue::parse)
+
+        uint64_t transfers;        ///< Data pipe reads (calls to ReadFromPipeOut), including those of flush() and the reader thread
+        uint64_t transferBytes;    ///< Bytes returned by those reads
+        uint64_t minTransferBytes; ///< Smallest read since Board::resetTransferMinimum() (0 if none)
+        double transferSeconds;    ///< Time spent inside ReadFromPipeOut
+
+        ReadStatistics() : bytesRead(0), packetsRead(0), decodeSeconds(0), transfers(0), transferBytes(0), minTransferBytes(0), transferSeconds(0) {}
+    };
+
+    /** \brief Host memory held by the board's acquisition buffers, and use of the on-FPGA waveform RAM.
+     *
+     *  Returned by Board::getMemoryUsage().
+     */
+    struct MemoryUsage {
+        std::size_t readQueueBytes;      ///< Buffers in Board::readQueue, as of the last read
+        uint64_t readQueueAllocations;   ///< Heap allocations by Board::readQueue, as of the last read; see ReadQueue::getAllocationCount()
+        std::size_t usbBufferBytes;      ///< Buffer that raw USB data is read into
+        unsigned int waveformWordsUsed;  ///< Waveform RAM words holding commands
+        unsigned int waveformWordsTotal; ///< Size of the waveform RAM, in words
+
+        MemoryUsage() : readQueueBytes(0), readQueueAllocations(0), usbBufferBytes(0), waveformWordsUsed(0), waveformWordsTotal(0) {}
+    };
+
+    /** \brief The samples of one channel that one read added, passed to callbacks registered with Board::addSampleCallback().
+     *
+     *  samples and timestamps point into Board::readQueue, so they're only valid during the callback; copy anything
+     *  that's needed later.
+     */
+    struct SampleSpan {
+        ClampConfig::ChipChannel channel; ///< Channel the samples are from
+        const Sample* samples;            ///< First new sample
+        const uint32_t* timestamps;       ///< Timestamp of each sample
+        std::size_t length;               ///< Number of samples (and of timestamps)
+        uint32_t firstTimestamp;          ///< timestamps[0], for convenience
+
+        SampleSpan() : samples(nullptr), timestamps(nullptr), length(0), firstTimestamp(0) {}
+    };
+
+    /** \brief The board-level data (timestamps, digital I/O, ADCs) that one read added, passed to callbacks registered
+     *  with Board::addPacketCallback().
+     *
+     *  Like SampleSpan, the pointers are only valid during the callback.  ADCs that aren't being transferred (see
+     *  Board::addDataConsumer()) are null.
+     */
+    struct PacketSpan {
+        const uint32_t* timestamps; ///< Timestamp of each packet
+        const uint16_t* digIns;     ///< Digital inputs of each packet
+        const uint16_t* digOuts;    ///< Digital outputs of each packet
+        const uint16_t* adcs[8];    ///< Each ADC's value in each packet, or null
+        std::size_t length;         ///< Number of packets
+
+        PacketSpan();
+    };
+
     /** \brief In-memory representation of a CLAMP evaluation board.
      *
      *  This class contains functionality for controlling the chips attached to the board, the ADCS and digital I/O, the
@@ -24,12 +107,23 @@ namespace CLAMP {
     class Board {
     public:
         Board(bool is18bit=true);
+        Board(std::unique_ptr<OpalKellyBoard> backend, bool is18bit=true);
         ~Board();
 
         /// \name Initialization
         //@{
-        bool open(const std::string& dllPath = "", const std::string& bitfilePath = "");
+        bool open(const std::string& dllPath = "", const std::string& bitfilePath = "", const std::string& serialNumber = "");
         void scanForChips();
+        std::vector<int> getCableDelays() const;
+        void setForceBitfileUpload(bool force);
+        bool wasBitfileReused() const;
+
+        /** \brief Cable delays for scanForChips() to try first, one per chip (-1 for a port with no chip), e.g., what
+         *  getCableDelays() returned last session.  Empty (the default) for a full scan.
+         */
+        std::vector<int> cableDelayHints;
+        /// True if the last scanForChips() confirmed cableDelayHints, rather than scanning every delay
+        bool cableDelaysConfirmed;
         //@}
 
         /** Alternate interface for accessing chip- and channel-level functionality.
@@ -56,6 +150,15 @@ namespace CLAMP {
         /// Read queue that buffers and interprets USB data coming back from the FPGA
         ReadQueue readQueue;
 
+        /// Intervals between reads, and read-to-processed latency; see LoopTiming
+        LoopTiming loopTiming;
+
+        /// Mapping from board timestamps to host time, with the drift between the clocks; see ClockSync
+        ClockSync clockSync;
+
+        /// FIFO level after every read, with watermark callbacks and a per-run history; see FifoMonitor
+        FifoMonitor fifoMonitor;
+
         /** \name Channels
          */
         //@{
@@ -65,6 +168,9 @@ namespace CLAMP {
         unsigned int channelRepetition;
         ClampConfig::ChipChannelList getPresentChannels() const;
         unsigned int numActiveChannels() const;
+        void setOutputDecimation(unsigned int chipIndex, unsigned int factor);
+        unsigned int getOutputDecimation(unsigned int chipIndex) const { return outputDecimation[chipIndex]; }
+        double getOutputSamplingRateHz(unsigned int chipIndex) const;
         //@}
 
         /** \name Board-level I/Os
@@ -76,6 +182,8 @@ namespace CLAMP {
 		void setSpiPortLeds(uint8_t value);
 		void setStatusLeds(bool digitalInControl, uint8_t value);
         void setDataTransfer(bool adcs[8], bool digin, bool digout);
+        unsigned int addDataConsumer(const bool adcs[8], bool digin, bool digout);
+        void removeDataConsumer(unsigned int id);
 //        void writeDigitalOutputRAM(int port, const std::vector<uint16_t>& data);
 //        void enableDigitalOutputs(bool enable[16]);
 //        void enableCommandControlOfDigitalOutputs(bool enable);
@@ -110,14 +218,27 @@ namespace CLAMP {
 
         /// \name Reading
         //@{
-        unsigned int read(unsigned int numPackets);
+        /// How Board::read waits for the FPGA's FIFO to fill up to a minimum chunk.
+        enum FifoWaitStrategy {
+            SPIN,           ///< Poll the FIFO level continuously.  Lowest latency, but uses a full core and keeps the USB control channel busy.
+            SLEEP_BACKOFF   ///< Sleep for roughly the time needed to acquire the missing data, then poll again.
+        };
+        void setFifoWaitStrategy(FifoWaitStrategy strategy);
+        FifoWaitStrategy getFifoWaitStrategy() const;
+
+        void startReaderThread();
+        void stopReaderThread();
+        void setReaderThreadScheduling(Thread::Priority priority, int cpu = -1);
+
+        unsigned int read(unsigned int numPackets, StopToken* cancel = nullptr);
         void blockingRead(unsigned int numPackets);
         uint32_t numWordsInFifo();
         void readBackAll(); // Looping version of readBack
 
         /** \brief How full the FIFO is, as a percentage [0-100]
          *
-         *  Only updated whenever data is read.
+         *  Only updated whenever data is read, by the thread that reads (the USBReaderThread, if it's running); other
+         *  threads should use fifoMonitor.getLatest().
          */
         double fifoPercentageFull;
         /** \brief The latency of the FPGA's FIFO queue, in ms.
@@ -125,9 +246,38 @@ namespace CLAMP {
          * This can be interpreted as amount of data (in milliseconds worth) that is in
          * the board's FIFO and has not yet been transferred to the computer.
          *
-         *  Only updated whenever data is read.
+         *  Only updated whenever data is read, like fifoPercentageFull.
          */
         double latency;
+
+        /// How much data read() waits for before each USB transfer; see TransferPolicy.
+        TransferPolicy transferPolicy;
+        void setHugePageBuffers(bool value);
+        void startUSBCapture(const FILENAME& filename);
+        void stopUSBCapture();
+
+        uint64_t getNumControlTransactions() const;
+        TimestampGaps getTimestampGaps() const;
+        void resetTimestampGaps();
+        ReadStatistics getReadStatistics() const;
+
+        /// Quantity a callback registered with addSampleCallback() receives; see the corresponding ReadQueue getters
+        enum SampleQuantity {
+            MEASURED_CURRENT, ///< ReadQueue::getMeasuredCurrents
+            MEASURED_VOLTAGE, ///< ReadQueue::getMeasuredVoltages
+            CLAMP_VOLTAGE,    ///< ReadQueue::getClampVoltages
+            CLAMP_CURRENT,    ///< ReadQueue::getClampCurrents
+            MUX_VOLTAGE       ///< ReadQueue::getMuxData
+        };
+        typedef std::function<void(const SampleSpan&)> SampleCallback;
+        typedef std::function<void(const PacketSpan&)> PacketCallback;
+        unsigned int addSampleCallback(const ClampConfig::ChipChannel& channel, SampleQuantity quantity, const SampleCallback& callback);
+        unsigned int addPacketCallback(const PacketCallback& callback);
+        void removeSampleCallback(unsigned int id);
+        void resetTransferMinimum();
+        /// USB 2.0 high-speed signalling rate, in bytes per second; pipe throughput can't exceed this
+        static const double MAX_USB_BYTES_PER_SECOND;
+        MemoryUsage getMemoryUsage() const;
         //@}
 
 
@@ -141,6 +291,10 @@ namespace CLAMP {
         void commandsToFPGA();
 		void commandsToFPGA(const ClampConfig::ChipChannelList& channelList);
 		void commandsToFPGASinglePort(int port);
+        void commandsToFPGAAtBoundary();
+        void commandsToFPGAAtBoundary(const ClampConfig::ChipChannelList& channelList);
+        void releaseRetiredCommands();
+        void releaseRetiredCommands(const ClampConfig::ChipChannelList& channelList);
         //@}
 
 		bool isDacInUse(int dac, ClampConfig::ChipChannel& chipChannel, bool& outputClamp);
@@ -151,15 +305,19 @@ namespace CLAMP {
 		void enableOnePortOnly(int port);
 
     private:
-        OpalKellyBoard okb;
+        // The evaluation board; normally an OpalKellyBoard, but may be a stand-in like SimulatedBoard
+        std::unique_ptr<OpalKellyBoard> okbOwner;
+        OpalKellyBoard& okb;
 
         // Functions in this class are designed to be thread-safe.  This variable is used to ensure that.
         // Note that the OpalKellyBoard class is also thread-safe; this variable is used for commands that
         // require more than one OpalKellyBoard call.
-        std::mutex commandMutex;
+        ProfiledMutex commandMutex;
 
         std::vector<ChannelNumber> channels;
 
+        void commandsToFPGA(const std::vector<Channel*>& targets, bool atBoundary = false);
+
         bool is18bitADC;
 		bool expanderBoardDetected;
 		int expanderBoardIdNumber;
@@ -169,15 +327,49 @@ namespace CLAMP {
 		bool digOutEnabled[8];
 		int digOutDestination[8];
 		std::vector<ClampConfig::ChipChannel> usingDac;
+        unsigned int outputDecimation[MAX_NUM_CHIPS]; // See setOutputDecimation
+
+        // Buffer for reading bytes from USB interface (when there's no reader thread); sized at the start of each run
+        AlignedBuffer usbBuffer;
+        bool hugePageBuffers;
+        std::unique_ptr<USBCaptureWriter> usbCapture; // Raw USB data is copied here, if set; see startUSBCapture
+
+        // Totals for getReadStatistics; written by whichever thread calls read(), read by anyone
+        std::atomic<uint64_t> bytesReadTotal;
+        std::atomic<uint64_t> packetsReadTotal;
+        std::atomic<uint64_t> decodeNanoseconds;
+        std::atomic<uint64_t> transfersTotal;
+        std::atomic<uint64_t> transferBytesTotal;
+        std::atomic<uint64_t> minTransferBytes;
+        std::atomic<uint64_t> transferNanoseconds;
+        long readDataPipe(long length, unsigned char* data);
+        // For getMemoryUsage; updated when packets are parsed or the USB buffer is resized
+        std::atomic<uint64_t> readQueueBytes;
+        std::atomic<uint64_t> readQueueAllocations;
+        std::atomic<uint64_t> usbBufferBytes;
+        void parsePackets(unsigned char* data, unsigned int numPackets);
+        void readDone(unsigned int numPackets, double readSeconds, double arrivalSeconds);
 
-        // Buffer for reading bytes from USB interface
-        unsigned char* usbBuffer;
-        unsigned int usbBufferSize;
+        // Byte layout of USB packets for the current channel loop and data transfer settings.
+        // Rebuilt lazily (see getPacketLayout) whenever packetLayoutDirty is set.
+        USBPacketLayout packetLayout;
+        bool packetLayoutDirty;
+        const USBPacketLayout& getPacketLayout();
+
+        FifoWaitStrategy fifoWaitStrategy;
+        uint32_t waitForFifo(uint32_t minWords, unsigned int perPacketSizeWords, StopToken* cancel);
+        void fifoWaitSleep(uint32_t missingWords, unsigned int perPacketSizeWords, StopToken* cancel);
+
+        // Non-null while a background thread owns the USB data pipe; see startReaderThread()
+        std::unique_ptr<USBReaderThread> readerThread;
+        Thread::Priority readerPriority;
+        int readerCpu;
 
         std::shared_ptr<WaveformControl::WaveformExtent> digitalOutputExtent;
 
         void setChannelLoopOrder(const std::vector<ChannelNumber>& channels_);
         void setUSBBufferSize(unsigned int size);
+        void sizeUSBBufferForRun(unsigned int numTimesteps);
         void setClockFreq_internal(uint8_t M, uint8_t D);
         void updateFIFOStats(unsigned int perPacketSizeWords);
         void writeGlobalVirtualRegister(uint8_t address, uint16_t value);
@@ -185,6 +377,7 @@ namespace CLAMP {
         ClampConfig::ChipChannelList getAllChannels() const;
 		void readDigitalInManual();
         void initialize();
+        bool confirmCableDelays(const std::vector<WaveformControl::WaveformCommand>& commands);
 		void updateAdcClampControl();
 
 		bool adcClampControlEnable[MAX_NUM_CHIPS][MAX_NUM_CHANNELS];
@@ -193,16 +386,62 @@ namespace CLAMP {
         bool adcTransfer[8];
         bool diginTransfer;
         bool digoutTransfer;
+
+        // Whether the FPGA is known to hold the settings above (channels, the clock set for channels.size(),
+        // and the data transfer flags), so unchanged values needn't be re-sent.  Cleared by reset().
+        bool channelLoopWritten;
+        bool samplingRateWritten;
+        bool dataTransferWritten;
+        void forgetWrittenSettings();
+        void forgetRunWrites();
+
+        // Board-level data wanted by each consumer (see addDataConsumer), plus the set from setDataTransfer
+        struct DataConsumer {
+            bool adcs[8];
+            bool digin;
+            bool digout;
+        };
+        DataConsumer baseDataTransfer;
+        std::map<unsigned int, DataConsumer> dataConsumers;
+        unsigned int nextDataConsumerId;
+        void applyDataTransfer();
+
+        // Callbacks registered with addSampleCallback, called by parsePackets; guarded by sampleCallbackMutex
+        struct SampleSubscription {
+            ClampConfig::ChipChannel channel;
+            SampleQuantity quantity;
+            SampleCallback callback;
+            std::size_t firstNew; // Index of the first sample the current parse added
+        };
+        std::map<unsigned int, SampleSubscription> sampleSubscriptions;
+        std::map<unsigned int, PacketCallback> packetSubscriptions;
+        std::size_t firstNewPacket; // Index of the first timestamp the current parse added
+        unsigned int nextSampleCallbackId;
+        std::mutex sampleCallbackMutex;
+        const std::vector<Sample>& getQuantity(const ClampConfig::ChipChannel& channel, SampleQuantity quantity);
+        void markNewSamples();
+        void deliverSamples();
+        void writeDataTransfer(const bool adcs[8], bool digin, bool digout);
         void setDigitalCommandOffset(uint16_t offset);
         friend class USBPacket;
+        friend class USBPacketLayout;
+        friend class USBReaderThread;
         friend class ReadQueue;
+        friend struct CaptureConfiguration;
 
         WaveformControl::WaveformRAM waveformRAM;
         void writeRAM(uint16_t start_addr, const std::vector<uint32_t>& data);
         friend class Chip;
         friend class Channel;
         friend class WaveformControl::WaveformRAM;
+        friend class ClampConfig::ClampController;
+        friend class ClampConfig::ResidentSequence;
+        friend class MultiBoard;
+        friend class SimulatedBoard;
+        friend class ModelCellSource;
 
         void reset();
+        void armContinuous();
+        void triggerStart();
     };
 }
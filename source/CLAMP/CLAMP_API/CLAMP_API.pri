@@ -4,46 +4,151 @@ include ("../../Common/Common.pri")
 INCLUDEPATH += $$PWD
 
 HEADERS       += \
+    $$PWD/AlignedBuffer.h \
+    $$PWD/BatchAnalyzer.h \
+    $$PWD/BatchExponentialFit.h \
     $$PWD/BesselFilter.h \
     $$PWD/Board.h \
+    $$PWD/CalibrationCache.h \
+    $$PWD/CapacitanceTuner.h \
+    $$PWD/CellTracker.h \
     $$PWD/Channel.h \
     $$PWD/Chip.h \
     $$PWD/ChipProtocol.h \
     $$PWD/ClampController.h \
+    $$PWD/ClockSync.h \
+    $$PWD/CommandStream.h \
     $$PWD/Constants.h \
     $$PWD/DataAnalysis.h \
+    $$PWD/DirectFileOutStream.h \
+    $$PWD/DynamicClamp.h \
+    $$PWD/EventDetector.h \
+    $$PWD/ExponentialModels.h \
+    $$PWD/FifoMonitor.h \
+    $$PWD/FileCloser.h \
+    $$PWD/HealthMonitor.h \
+    $$PWD/LeakSubtractor.h \
+    $$PWD/LevenbergMarquardt.h \
+    $$PWD/LockProfiler.h \
+    $$PWD/LoopTiming.h \
+    $$PWD/MultiBoard.h \
+    $$PWD/MultiplexedSaveFile.h \
+    $$PWD/NWBFile.h \
+    $$PWD/NoiseSpectrum.h \
     $$PWD/OpalKellyBoard.h \
     $$PWD/OpalKellyLibraryHandle.h \
+    $$PWD/ProtocolRunner.h \
     $$PWD/RAM.h \
     $$PWD/ReadQueue.h \
+    $$PWD/ResidentSequence.h \
     $$PWD/Registers.h \
     $$PWD/SaveFile.h \
+    $$PWD/SaveFileConverter.h \
+    $$PWD/SaveFileReader.h \
+    $$PWD/SaveJournal.h \
+    $$PWD/SaveWriterThread.h \
+    $$PWD/SealTest.h \
+    $$PWD/SharedMemoryRing.h \
     $$PWD/SimplifiedWaveform.h \
+    $$PWD/SimulatedBoard.h \
+    $$PWD/SpikeDetector.h \
+    $$PWD/SPSCQueue.h \
+    $$PWD/StopToken.h \
+    $$PWD/StreamFramer.h \
+    $$PWD/StreamServer.h \
+    $$PWD/SweepAnalysis.h \
+    $$PWD/TaskLane.h \
     $$PWD/Thread.h \
+    $$PWD/Trace.h \
+    $$PWD/TransferPolicy.h \
+    $$PWD/ThreadPool.h \
+    $$PWD/USBCapture.h \
     $$PWD/USBPacket.h \
+    $$PWD/USBReaderThread.h \
     $$PWD/Waveform.h \
     $$PWD/WaveformCommand.h
 
 SOURCES += \
+    $$PWD/AlignedBuffer.cpp \
+    $$PWD/BatchAnalyzer.cpp \
+    $$PWD/BatchExponentialFit.cpp \
     $$PWD/BesselFilter.cpp \
     $$PWD/Board.cpp \
+    $$PWD/CalibrationCache.cpp \
+    $$PWD/CapacitanceTuner.cpp \
+    $$PWD/CellTracker.cpp \
     $$PWD/Channel.cpp \
     $$PWD/Chip.cpp \
     $$PWD/ChipProtocol.cpp \
     $$PWD/ClampController.cpp \
+    $$PWD/ClockSync.cpp \
+    $$PWD/CommandStream.cpp \
     $$PWD/DataAnalysis.cpp \
+    $$PWD/DirectFileOutStream.cpp \
+    $$PWD/DynamicClamp.cpp \
+    $$PWD/EventDetector.cpp \
+    $$PWD/ExponentialModels.cpp \
+    $$PWD/FifoMonitor.cpp \
+    $$PWD/FileCloser.cpp \
+    $$PWD/HealthMonitor.cpp \
+    $$PWD/LeakSubtractor.cpp \
+    $$PWD/LockProfiler.cpp \
+    $$PWD/LoopTiming.cpp \
+    $$PWD/MultiBoard.cpp \
+    $$PWD/MultiplexedSaveFile.cpp \
+    $$PWD/NWBFile.cpp \
+    $$PWD/NoiseSpectrum.cpp \
     $$PWD/OpalKellyBoard.cpp \
     $$PWD/OpalKellyLibraryHandle.cpp \
+    $$PWD/ProtocolRunner.cpp \
     $$PWD/RAM.cpp \
     $$PWD/ReadQueue.cpp \
+    $$PWD/ResidentSequence.cpp \
     $$PWD/Registers.cpp \
     $$PWD/SaveFile.cpp \
+    $$PWD/SaveFileConverter.cpp \
+    $$PWD/SaveFileReader.cpp \
+    $$PWD/SaveJournal.cpp \
+    $$PWD/SaveWriterThread.cpp \
+    $$PWD/SealTest.cpp \
+    $$PWD/SharedMemoryRing.cpp \
     $$PWD/SimplifiedWaveform.cpp \
+    $$PWD/SimulatedBoard.cpp \
+    $$PWD/SpikeDetector.cpp \
+    $$PWD/StopToken.cpp \
+    $$PWD/StreamFramer.cpp \
+    $$PWD/StreamServer.cpp \
+    $$PWD/SweepAnalysis.cpp \
+    $$PWD/TaskLane.cpp \
     $$PWD/Thread.cpp \
+    $$PWD/Trace.cpp \
+    $$PWD/TransferPolicy.cpp \
+    $$PWD/ThreadPool.cpp \
+    $$PWD/USBCapture.cpp \
     $$PWD/USBPacket.cpp \
+    $$PWD/USBReaderThread.cpp \
     $$PWD/Waveform.cpp \
     $$PWD/WaveformCommand.cpp
     
+win32:LIBS += -lws2_32
+# MMCSS, for real-time thread priority
+win32:LIBS += -lavrt
+# shm_open
+linux-g++:LIBS += -lrt
+
+# NWB (HDF5) save files: qmake CONFIG+=clamp_hdf5 (on Windows, with HDF5_DIR set to the HDF5 installation)
+clamp_hdf5 {
+    DEFINES += CLAMP_HDF5
+    win32 {
+        INCLUDEPATH += $$HDF5_DIR/include
+        LIBS += -L$$HDF5_DIR/lib -lhdf5
+    }
+    else {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += hdf5
+    }
+}
+
 linux-g++ {
 	EXTRA_BINFILES += $$PWD/../FPGA/main.bit
 	for(FILE, EXTRA_BINFILES){
@@ -0,0 +1,16 @@
+# The acquisition engine (Board, ClampController, ReadQueue, SaveFile, SignalProcessing, ...) as a static library
+# without Qt, for headless programs such as ClampRunner.  ClampUI still compiles the sources in directly.
+include ("CLAMP_API.pri")
+
+TARGET = CLAMP_API
+
+TEMPLATE = lib
+
+CONFIG += staticlib console
+CONFIG -= qt
+
+# Position-independent, so the ClampPython shared library can link it too
+unix:QMAKE_CXXFLAGS += -fPIC
+
+# Match the CLAMP::Sample type of the program linking the library
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
@@ -0,0 +1,269 @@
+#include "CalibrationCache.h"
+#include "Board.h"
+#include "Chip.h"
+#include "Channel.h"
+#include "common.h"
+#include <set>
+#include <cmath>
+#include <stdexcept>
+
+using std::vector;
+using std::set;
+using std::unique_ptr;
+using std::runtime_error;
+
+namespace CLAMP {
+    namespace ClampConfig {
+        // File layout: magic, version, number of headstages, then each headstage (see save())
+        static const uint32_t CALIBRATION_MAGIC_NUMBER = 0xC1A3CA1B;
+        static const uint32_t CALIBRATION_VERSION = 1;
+
+        const double CalibrationCache::MAX_TEMPERATURE_CHANGE = 3.0;
+
+        static vector<unsigned int> chipsIn(const ChipChannelList& channelList) {
+            set<unsigned int> chips;
+            for (auto& index : channelList) {
+                chips.insert(index.chip);
+            }
+            return vector<unsigned int>(chips.begin(), chips.end());
+        }
+
+        // Identifies the headstage on the given port: board ID bits, port, and number of channels
+        uint32_t CalibrationCache::headstageId(const Board& board, unsigned int chip) {
+            uint32_t id = 0;
+            for (unsigned int i = 0; i < 4; i++) {
+                id |= (board.serialId[i] ? 1 : 0) << i;
+            }
+            for (unsigned int i = 0; i < 3; i++) {
+                id |= (board.userId[i] ? 1 : 0) << (4 + i);
+            }
+            id |= chip << 8;
+            id |= static_cast<uint32_t>(board.chip[chip]->numChannels) << 16;
+            return id;
+        }
+
+        CalibrationCache::HeadstageValues* CalibrationCache::find(uint32_t id) {
+            for (HeadstageValues& headstage : headstages) {
+                if (headstage.id == id) {
+                    return &headstage;
+                }
+            }
+            return nullptr;
+        }
+
+        /** \brief Reads saved calibration values from a file.
+         *
+         *  \param[in] filename  File written by save()
+         *  \returns true if the file was read; false if it doesn't exist or isn't a valid calibration file.
+         */
+        bool CalibrationCache::load(const FILENAME& filename) {
+            headstages.clear();
+
+            unique_ptr<FileInStream> fs(new FileInStream());
+            try {
+                if (!fs->open(filename)) {
+                    return false;
+                }
+            }
+            catch (runtime_error&) {
+                return false; // Most likely, there's no saved calibration yet
+            }
+
+            BinaryReader in(std::move(fs));
+            try {
+                uint32_t magic, version, numHeadstages;
+                in >> magic >> version >> numHeadstages;
+                if (magic != CALIBRATION_MAGIC_NUMBER || version != CALIBRATION_VERSION || numHeadstages > MAX_NUM_CHIPS) {
+                    return false;
+                }
+
+                headstages.resize(numHeadstages);
+                for (HeadstageValues& headstage : headstages) {
+                    in >> headstage.id >> headstage.temperature;
+                    for (ChannelValues& channel : headstage.channel) {
+                        uint8_t valid;
+                        in >> valid;
+                        channel.valid = (valid != 0);
+                        in >> channel.differenceAmpResidual >> channel.voltageAmpResidual;
+                        in >> channel.diffAmpOffsetTrim >> channel.clampVoltageOffsetTrim;
+                        for (double& r : channel.rFeedback) {
+                            in >> r;
+                        }
+                        for (auto& sign : channel.bestCalibration) {
+                            for (CurrentCalibration& calibration : sign) {
+                                in >> calibration.coarse >> calibration.fine;
+                            }
+                        }
+                    }
+                }
+            }
+            catch (runtime_error&) {
+                headstages.clear(); // Truncated
+                return false;
+            }
+            return true;
+        }
+
+        /** \brief Writes the stored calibration values to a file.
+         *
+         *  \param[in] filename  File to write; it is overwritten.
+         */
+        void CalibrationCache::save(const FILENAME& filename) const {
+            unique_ptr<FileOutStream> fs(new FileOutStream());
+            fs->open(filename);
+            BinaryWriter out(std::move(fs), 4096);
+
+            out << CALIBRATION_MAGIC_NUMBER << CALIBRATION_VERSION << static_cast<uint32_t>(headstages.size());
+            for (const HeadstageValues& headstage : headstages) {
+                out << headstage.id << headstage.temperature;
+                for (const ChannelValues& channel : headstage.channel) {
+                    out << static_cast<uint8_t>(channel.valid ? 1 : 0);
+                    out << channel.differenceAmpResidual << channel.voltageAmpResidual;
+                    out << channel.diffAmpOffsetTrim << channel.clampVoltageOffsetTrim;
+                    for (double r : channel.rFeedback) {
+                        out << r;
+                    }
+                    for (auto& sign : channel.bestCalibration) {
+                        for (const CurrentCalibration& calibration : sign) {
+                            out << calibration.coarse << calibration.fine;
+                        }
+                    }
+                }
+            }
+            out.flush();
+        }
+
+        /** \brief Stores the current calibration values of the given channels.
+         *
+         *  Call this after calibrating.  Also measures each chip's temperature, for comparison in restore().
+         *
+         *  \param[in] board        Board whose channels were calibrated.
+         *  \param[in] channelList  List of chip/channel pairs that were calibrated.
+         */
+        void CalibrationCache::store(Board& board, const ChipChannelList& channelList) {
+            vector<unsigned int> chips = chipsIn(channelList);
+            vector<double> temperatures = board.controller.temperatureSensor.readTemperatures(chips);
+            for (std::size_t i = 0; i < chips.size(); i++) {
+                unsigned int chip = chips[i];
+                uint32_t id = headstageId(board, chip);
+                HeadstageValues* headstage = find(id);
+                if (!headstage) {
+                    headstages.push_back(HeadstageValues());
+                    headstage = &headstages.back();
+                    headstage->id = id;
+                    for (ChannelValues& channel : headstage->channel) {
+                        channel.valid = false;
+                    }
+                }
+                headstage->temperature = temperatures[i];
+            }
+
+            for (auto& index : channelList) {
+                Channel& source = board.controller.getChannel(index);
+                ChannelValues& channel = find(headstageId(board, index.chip))->channel[index.channel];
+                channel.valid = true;
+                channel.differenceAmpResidual = source.differenceAmpResidual;
+                channel.voltageAmpResidual = source.voltageAmpResidual;
+                channel.diffAmpOffsetTrim = static_cast<uint8_t>(source.registers.r5.value.diffAmpOffsetTrim);
+                channel.clampVoltageOffsetTrim = static_cast<uint8_t>(source.registers.r2.value.clampVoltageOffsetTrim);
+                for (unsigned int i = 0; i < 6; i++) {
+                    channel.rFeedback[i] = source.rFeedback[i];
+                }
+                for (unsigned int sign = 0; sign < 2; sign++) {
+                    for (unsigned int scale = 0; scale < 4; scale++) {
+                        channel.bestCalibration[sign][scale] = source.bestCalibration[sign][scale];
+                    }
+                }
+            }
+        }
+
+        /** \brief Applies saved calibration values to the given channels, if they're still valid.
+         *
+         *  The saved values are used if every chip in channelList has saved values for all its channels in the list,
+         *  its temperature is within MAX_TEMPERATURE_CHANGE of the saved one, and re-running the (quick) voltage amplifier
+         *  calibration gives residuals within MAX_RESIDUAL_CHANGE of the saved ones.
+         *
+         *  \param[in] board        Board whose channels to restore.
+         *  \param[in] channelList  List of chip/channel pairs to restore.
+         *  \returns true if the saved values were applied; false if the channels need a full calibration.
+         */
+        bool CalibrationCache::restore(Board& board, const ChipChannelList& channelList) {
+            if (channelList.empty()) {
+                return false;
+            }
+
+            vector<unsigned int> chips = chipsIn(channelList);
+            for (unsigned int chip : chips) {
+                if (!find(headstageId(board, chip))) {
+                    return false;
+                }
+            }
+            vector<double> temperatures = board.controller.temperatureSensor.readTemperatures(chips);
+            for (std::size_t i = 0; i < chips.size(); i++) {
+                unsigned int chip = chips[i];
+                HeadstageValues* headstage = find(headstageId(board, chip));
+                double temperature = temperatures[i];
+                if (std::abs(temperature - headstage->temperature) > MAX_TEMPERATURE_CHANGE) {
+                    LOG(true) << "Chip " << chip << " temperature changed from " << headstage->temperature << "C to " << temperature << "C; recalibrating\n";
+                    return false;
+                }
+            }
+            for (auto& index : channelList) {
+                if (!find(headstageId(board, index.chip))->channel[index.channel].valid) {
+                    return false;
+                }
+            }
+
+            // Apply the values, and push the offset trims to the chips
+            for (auto& index : channelList) {
+                const ChannelValues& channel = find(headstageId(board, index.chip))->channel[index.channel];
+                Channel& target = board.controller.getChannel(index);
+                target.differenceAmpResidual = channel.differenceAmpResidual;
+                target.voltageAmpResidual = channel.voltageAmpResidual;
+                for (unsigned int i = 0; i < 6; i++) {
+                    target.rFeedback[i] = channel.rFeedback[i];
+                }
+                for (unsigned int sign = 0; sign < 2; sign++) {
+                    for (unsigned int scale = 0; scale < 4; scale++) {
+                        target.bestCalibration[sign][scale] = channel.bestCalibration[sign][scale];
+                    }
+                }
+
+                target.registers.r5.value.diffAmpOffsetTrim = channel.diffAmpOffsetTrim;
+                target.commands.push_back(target.registers.r5.writeCommand());
+                target.registers.r2.value.clampVoltageOffsetTrim = channel.clampVoltageOffsetTrim;
+                target.commands.push_back(target.registers.r2.writeCommand());
+            }
+            board.controller.executeImmediate(channelList);
+
+            // Verify: the voltage amplifier calibration is a single measurement cycle
+            board.controller.voltageAmplifier.calibrate(channelList);
+            for (auto& index : channelList) {
+                const ChannelValues& channel = find(headstageId(board, index.chip))->channel[index.channel];
+                int32_t measured = board.controller.getChannel(index).voltageAmpResidual;
+                if (std::abs(measured - channel.voltageAmpResidual) > MAX_RESIDUAL_CHANGE) {
+                    LOG(true) << "Chip " << index.chip << " channel " << index.channel << " voltage amplifier residual changed from "
+                              << channel.voltageAmpResidual << " to " << measured << "; recalibrating\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /** \brief The temperature a headstage was calibrated at, e.g., as the reference for HealthMonitor.
+         *
+         *  \param[in] board         Board the headstage is on.
+         *  \param[in] chip          Port it's on.
+         *  \param[out] temperature  Its temperature when its values were stored, in &deg;C.
+         *  \returns false if there are no saved values for it.
+         */
+        bool CalibrationCache::getTemperature(const Board& board, unsigned int chip, double& temperature) {
+            HeadstageValues* headstage = find(headstageId(board, chip));
+            if (!headstage) {
+                return false;
+            }
+            temperature = headstage->temperature;
+            return true;
+        }
+    }
+}
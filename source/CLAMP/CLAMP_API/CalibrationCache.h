@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "ClampController.h"
+#include "Constants.h"
+#include "streams.h"
+
+namespace CLAMP {
+    class Board;
+
+    namespace ClampConfig {
+        /** \brief Calibration results saved between runs of the software.
+         *
+         *  Full calibration takes a long time, and its results only change slowly.  This class saves the results
+         *  of calibration (residuals, offset trims, feedback resistor values, and current generator calibrations)
+         *  for each headstage, so they can be reused the next time the software starts with the same headstages attached.
+         *
+         *  Typical use:
+         \code
+            CalibrationCache cache;
+            if (!cache.load(filename) || !cache.restore(board, channelList)) {
+                // ... full calibration ...
+                cache.store(board, channelList);
+                cache.save(filename);
+            }
+         \endcode
+         *
+         *  Saved values are only reused if the headstage is identified the same way (board ID bits, port, and
+         *  number of channels), its temperature hasn't changed much, and a quick re-measurement of the voltage
+         *  amplifier residual agrees with the saved value.
+         */
+        class CalibrationCache {
+        public:
+            /// Largest change in chip temperature, in &deg;C, for which saved values are reused
+            static const double MAX_TEMPERATURE_CHANGE;
+            /// Largest change in the voltage amplifier residual, in ADC steps, for which saved values are reused
+            static const int32_t MAX_RESIDUAL_CHANGE = 50;
+
+            bool load(const FILENAME& filename);
+            void save(const FILENAME& filename) const;
+
+            void store(Board& board, const ChipChannelList& channelList);
+            bool restore(Board& board, const ChipChannelList& channelList);
+            bool getTemperature(const Board& board, unsigned int chip, double& temperature);
+
+        private:
+            /// \cond private
+            struct ChannelValues {
+                bool valid;
+                int32_t differenceAmpResidual;
+                int32_t voltageAmpResidual;
+                uint8_t diffAmpOffsetTrim;
+                uint8_t clampVoltageOffsetTrim;
+                double rFeedback[6];
+                CurrentCalibration bestCalibration[2][4];
+            };
+
+            struct HeadstageValues {
+                uint32_t id;
+                double temperature;
+                ChannelValues channel[MAX_NUM_CHANNELS];
+            };
+            /// \endcond
+
+            std::vector<HeadstageValues> headstages;
+
+            static uint32_t headstageId(const Board& board, unsigned int chip);
+            HeadstageValues* find(uint32_t id);
+        };
+    }
+}
@@ -0,0 +1,433 @@
+#include "CapacitanceTuner.h"
+#include "SimplifiedWaveform.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::ChipProtocol;
+using namespace CLAMP::WaveformControl;
+using std::vector;
+using std::invalid_argument;
+using std::runtime_error;
+
+namespace CLAMP {
+    // Range of Registers::Register6::fastTransCapCompensation
+    static const unsigned int NO_COMPENSATION = 55;
+    static const unsigned int MAX_COMPENSATION = 255;
+
+    CapacitanceTuner::ChannelState::ChannelState() :
+        havePrevious(false),
+        lastPhase(0),
+        lastTimestamp(0),
+        pulseStart(0),
+        pulses(0),
+        low(NO_COMPENSATION),
+        high(MAX_COMPENSATION),
+        value(NO_COMPENSATION),
+        done(false),
+        writeIndex(0),
+        originalValue(NO_COMPENSATION)
+    {
+        startPulse();
+        std::fill(fallSum, fallSum + EDGE_SAMPLES, 0.0);
+        std::fill(riseSum, riseSum + EDGE_SAMPLES, 0.0);
+    }
+
+    void CapacitanceTuner::ChannelState::startPulse() {
+        holdingSum = 0;
+        holdingCount = 0;
+        stepSum = 0;
+        stepCount = 0;
+        fallCount = 0;
+        riseCount = 0;
+    }
+
+    /** \brief Constructor.
+     *
+     *  \param[in] board_     Board the channels are on
+     *  \param[in] channels_  Channels to tune; they should already be in voltage clamp
+     */
+    CapacitanceTuner::CapacitanceTuner(Board& board_, const ChipChannelList& channels_) :
+        board(board_),
+        channels(channels_),
+        holdingSteps(0),
+        amplitudeSteps(4),
+        stepSize(2.5e-3),
+        halfPeriodSeconds(1e-3),
+        halfPeriod(0),
+        period(0),
+        settle(0),
+        samplingRate(0),
+        measureFrom(0),
+        haveMeasureFrom(false),
+        pulseCount(0)
+    {
+        if (channels.empty()) {
+            throw invalid_argument("Capacitance tuning needs at least one channel");
+        }
+    }
+
+    CapacitanceTuner::~CapacitanceTuner() {
+        removeCallbacks();
+    }
+
+    /** \brief Sets the test pulse.  Call this before run().
+     *
+     *  \param[in] holdingSteps_       Holding voltage, in clamp steps
+     *  \param[in] amplitudeSteps_     Pulse amplitude, relative to holding, in clamp steps (default 4, i.e., 10 mV)
+     *  \param[in] stepSize_           Clamp step size the channels are set to, in volts (2.5 mV or 5 mV)
+     *  \param[in] halfPeriodSeconds_  Length of each half of the pulse (holding, then the step), in seconds (default 1 ms)
+     */
+    void CapacitanceTuner::setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_) {
+        if (amplitudeSteps_ == 0 || stepSize_ <= 0 || halfPeriodSeconds_ <= 0) {
+            throw invalid_argument("Capacitance tuning pulse needs a nonzero amplitude and a positive length");
+        }
+        holdingSteps = holdingSteps_;
+        amplitudeSteps = amplitudeSteps_;
+        stepSize = stepSize_;
+        halfPeriodSeconds = halfPeriodSeconds_;
+    }
+
+    /** \brief Tunes every channel's compensation magnitude, and leaves it set.
+     *
+     *  Replaces the channels' command lists and enables only these channels; the caller restores whatever it needs
+     *  afterwards.  If stop() is called first, each channel's magnitude is put back as it was, and nothing is returned.
+     *
+     *  \returns One result per channel, in the order given to the constructor.
+     */
+    vector<CapacitanceTuningResult> CapacitanceTuner::run() {
+        samplingRate = board.getSamplingRateHz();
+        halfPeriod = static_cast<unsigned int>(std::lround(halfPeriodSeconds * samplingRate));
+        period = 2 * halfPeriod;
+        settle = halfPeriod / 2; // As SealTest: the settled current is the second half of each half
+        if (settle < EDGE_SAMPLES) {
+            throw invalid_argument("Capacitance tuning pulse is too short for the sampling rate");
+        }
+
+        keepGoing.reset();
+        pulseCount = 0;
+        states.clear();
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            state.originalValue = board.controller.getChannel(channel).registers.r6.value.fastTransCapCompensation;
+        }
+
+        // Compensation on, following the clamp voltage
+        for (const ChipChannel& channel : channels) {
+            board.controller.fastTransientCapacitiveCompensation.setInSelect(channel, false);
+            board.controller.fastTransientCapacitiveCompensation.setConnect(channel, true);
+        }
+        board.controller.executeImmediate(channels);
+        loadPulse();
+
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            callbackIds.push_back(board.addSampleCallback(channel, Board::MEASURED_CURRENT, [this, &state](const SampleSpan& span) {
+                onSamples(state, span);
+            }));
+        }
+
+        // Small transfers, as DynamicClamp uses, so the data read is never far behind the values written
+        unsigned int oldMinPackets = board.transferPolicy.getMinPackets();
+        unsigned int oldMaxPackets = board.transferPolicy.getMaxPackets();
+        board.transferPolicy.setBounds(halfPeriod, halfPeriod);
+
+        board.readQueue.clear(true);
+        board.runContinuously();
+        bool tuned = true;
+        try {
+            for (;;) {
+                bool tuning = false;
+                for (auto& element : states) {
+                    tuning = tuning || !element.second.done;
+                }
+                if (!tuning) {
+                    break;
+                }
+                if (!measure()) {
+                    tuned = false;
+                    break;
+                }
+                for (auto& element : states) {
+                    if (!element.second.done) {
+                        nextValue(element.second);
+                    }
+                }
+                writeValues();
+            }
+        }
+        catch (...) {
+            board.stop();
+            board.flush();
+            board.readQueue.clear(true);
+            removeCallbacks();
+            board.transferPolicy.setBounds(oldMinPackets, oldMaxPackets);
+            finish(false);
+            throw;
+        }
+        board.stop();
+        board.flush();
+        board.readQueue.clear(true);
+        removeCallbacks();
+        board.transferPolicy.setBounds(oldMinPackets, oldMaxPackets);
+        finish(tuned);
+
+        vector<CapacitanceTuningResult> results;
+        if (!tuned) {
+            return results;
+        }
+        for (const ChipChannel& channel : channels) {
+            const ChannelState& state = states[channel];
+            CapacitanceTuningResult result;
+            result.channel = channel;
+            result.registerValue = state.value;
+            result.magnitude = board.controller.fastTransientCapacitiveCompensation.getMagnitude(channel);
+            result.residual = state.residuals.at(state.value);
+            result.valuesTried = static_cast<unsigned int>(state.residuals.size());
+            results.push_back(result);
+        }
+        return results;
+    }
+
+    /// Makes run() return, without waiting for the current read to finish; may be called from any thread.
+    void CapacitanceTuner::stop() {
+        keepGoing.requestStop();
+    }
+
+    // Loads the looped pulse: holding, then the step, with the compensation write one timestep into the settled part of
+    // the holding half, where there's no edge for it to disturb.  It takes the place of a holding timestep, so the
+    // pulse is the same length as SealTest's.
+    void CapacitanceTuner::loadPulse() {
+        unsigned int beforeWrite = settle;
+        SimplifiedWaveform waveform;
+        waveform.push_back(WaveformSegment(0, holdingSteps, beforeWrite, 0, false, false));
+        waveform.push_back(WaveformSegment(0, holdingSteps, halfPeriod - beforeWrite - 1, 0, false, false));
+        waveform.push_back(WaveformSegment(0, holdingSteps + amplitudeSteps, halfPeriod, 0, true, true));
+        waveform.setStepSize(stepSize, 0);
+
+        board.enableChannels(channels, true);
+        for (const ChipChannel& channel : channels) {
+            board.controller.getChannel(channel).commands.clear();
+        }
+        board.controller.simplifiedWaveformToWaveform(channels, true, waveform);
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            state.writeIndex = waveform.waveform[0].numCommands;
+            Channel& target = board.controller.getChannel(channel);
+            WaveformCommand write = target.registers.r6.writeCommand(); // Filled in by writeValues()
+            target.commands.insert(target.commands.begin() + state.writeIndex, board.channelRepetition, write);
+        }
+        writeValues();
+    }
+
+    // Puts each channel's value in its compensation write, and sends it to the board.  While the board runs, only the
+    // write's words in Waveform RAM change (see Channel::commandsToFPGA); a channel whose commands are the same as
+    // another's (the same unit on another chip, at the same value) shares its run, and moves to a new one instead,
+    // which the board picks up when the pulse loops (see Board::commandsToFPGAAtBoundary).
+    void CapacitanceTuner::writeValues() {
+        for (const ChipChannel& channel : channels) {
+            const ChannelState& state = states[channel];
+            Channel& target = board.controller.getChannel(channel);
+            target.registers.r6.value.fastTransCapCompensation = state.value;
+            // A conversion of this unit's current, so the timestep still has its sample
+            WaveformCommand write = target.registers.r6.writeConvertCommand(static_cast<MuxSelection>(2 * channel.channel));
+            std::fill(target.commands.begin() + state.writeIndex, target.commands.begin() + state.writeIndex + board.channelRepetition, write);
+        }
+        board.commandsToFPGA(channels);
+    }
+
+    // Reads until every channel still tuning has MEASURE_PULSES pulses at its current value.  A pulse counts if it starts
+    // after the newest sample read so far, plus whatever the board's FIFO held, plus one more pulse, for the write to
+    // have reached the chip; or, before anything has been read, once START_PULSES pulses have gone by.  Returns false if
+    // stop() was called.
+    bool CapacitanceTuner::measure() {
+        bool seen = false;
+        uint32_t newest = 0;
+        for (auto& element : states) {
+            ChannelState& state = element.second;
+            if (state.havePrevious && (!seen || static_cast<int32_t>(state.lastTimestamp - newest) > 0)) {
+                newest = state.lastTimestamp;
+                seen = true;
+            }
+            std::fill(state.fallSum, state.fallSum + EDGE_SAMPLES, 0.0);
+            std::fill(state.riseSum, state.riseSum + EDGE_SAMPLES, 0.0);
+            state.pulses = 0;
+        }
+        uint32_t backlog = static_cast<uint32_t>(std::ceil(board.latency * 1e-3 * samplingRate));
+        measureFrom = seen ? newest + backlog + period : 0;
+        haveMeasureFrom = seen;
+
+        // Without data for this long, something's wrong with the board
+        uint64_t maxTimesteps = 20 * static_cast<uint64_t>(period) + backlog + static_cast<uint64_t>(samplingRate);
+        uint64_t timesteps = 0;
+        for (;;) {
+            bool measured = true;
+            for (auto& element : states) {
+                measured = measured && (element.second.done || element.second.pulses >= MEASURE_PULSES);
+            }
+            if (measured) {
+                return true;
+            }
+            if (!keepGoing) {
+                return false;
+            }
+            if (timesteps > maxTimesteps) {
+                throw runtime_error("Capacitance tuning isn't getting any complete pulses");
+            }
+            timesteps += board.read(halfPeriod, &keepGoing);
+            board.readQueue.clear(false);
+        }
+    }
+
+    // Records the value just measured, and picks the next one: the middle of the range left, then, once that's down to
+    // two neighbors, whichever of them leaves the smaller transient (measuring an end of the range first, if need be).
+    void CapacitanceTuner::nextValue(ChannelState& state) {
+        double r = residual(state);
+        state.residuals[state.value] = r;
+        if (r > 0) {
+            state.low = state.value;
+        }
+        else {
+            state.high = state.value;
+        }
+
+        if (state.high - state.low > 1) {
+            state.value = (state.low + state.high) / 2;
+            return;
+        }
+        if (state.residuals.count(state.low) == 0) {
+            state.value = state.low;
+            return;
+        }
+        if (state.residuals.count(state.high) == 0) {
+            state.value = state.high;
+            return;
+        }
+        bool lowIsBetter = std::abs(state.residuals[state.low]) <= std::abs(state.residuals[state.high]);
+        state.value = lowIsBetter ? state.low : state.high;
+        state.done = true;
+    }
+
+    // Leaves each channel's compensation at its result (or, if tuning didn't finish, where it was), written with the
+    // ordinary immediate commands, since the board no longer loops the pulse that wrote the values tried.
+    void CapacitanceTuner::finish(bool tuned) {
+        board.clearSelectedCommands(channels);
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            if (!tuned) {
+                state.value = state.originalValue;
+            }
+            Channel& target = board.controller.getChannel(channel);
+            target.registers.r6.value.fastTransCapCompensation = state.value;
+            target.commands.push_back(target.registers.r6.writeCommand());
+        }
+        board.controller.executeImmediate(channels);
+    }
+
+    void CapacitanceTuner::removeCallbacks() {
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+        callbackIds.clear();
+    }
+
+    // Adds one chunk to the pulse being read.  As in SealTest, the phase within the pulse comes from the timestamp, and
+    // a pulse is complete when the phase wraps around.
+    void CapacitanceTuner::onSamples(ChannelState& state, const SampleSpan& span) {
+        const Sample* v = span.samples;
+        const uint32_t* t = span.timestamps;
+        for (std::size_t i = 0; i < span.length; i++) {
+            uint32_t phase = t[i] % period;
+            if (state.havePrevious && (phase < state.lastPhase || t[i] - state.lastTimestamp >= period)) {
+                finishPulse(state);
+            }
+            if (!state.havePrevious || phase < state.lastPhase || t[i] - state.lastTimestamp >= period) {
+                state.pulseStart = t[i] - phase;
+            }
+            if (!haveMeasureFrom) {
+                measureFrom = state.pulseStart + START_PULSES * period;
+                haveMeasureFrom = true;
+            }
+
+            if (phase < EDGE_SAMPLES) {
+                state.fallEdge[phase] = v[i];
+                state.fallCount++;
+            }
+            else if (phase >= halfPeriod && phase < halfPeriod + EDGE_SAMPLES) {
+                state.riseEdge[phase - halfPeriod] = v[i];
+                state.riseCount++;
+            }
+            if (phase >= halfPeriod + settle) {
+                state.stepSum += v[i];
+                state.stepCount++;
+            }
+            else if (phase >= settle && phase < halfPeriod) {
+                state.holdingSum += v[i];
+                state.holdingCount++;
+            }
+            state.havePrevious = true;
+            state.lastPhase = phase;
+            state.lastTimestamp = t[i];
+        }
+    }
+
+    // Adds the pulse just ended to the current value's sums, if it's complete and started late enough to have run with
+    // that value.  The falling edge at the start of a pulse follows the previous pulse's step; both pulses ran after the
+    // write, since the write comes between them.
+    void CapacitanceTuner::finishPulse(ChannelState& state) {
+        bool complete = state.fallCount == EDGE_SAMPLES && state.riseCount == EDGE_SAMPLES && state.holdingCount > 0 && state.stepCount > 0;
+        if (complete && !state.done && static_cast<int32_t>(state.pulseStart - measureFrom) >= 0) {
+            double holding = state.holdingSum / state.holdingCount;
+            double step = state.stepSum / state.stepCount;
+            for (unsigned int k = 0; k < EDGE_SAMPLES; k++) {
+                state.fallSum[k] += state.fallEdge[k] - holding;
+                state.riseSum[k] += state.riseEdge[k] - step;
+            }
+            state.pulses++;
+            pulseCount++;
+        }
+        state.startPulse();
+    }
+
+    // Fast transient charge left at the value measured, per volt of step: the rising edge's, less the falling edge's
+    // (which is the same, reversed), averaged over the pulses
+    double CapacitanceTuner::residual(const ChannelState& state) const {
+        double fall[EDGE_SAMPLES], rise[EDGE_SAMPLES];
+        for (unsigned int k = 0; k < EDGE_SAMPLES; k++) {
+            fall[k] = state.fallSum[k] / state.pulses;
+            rise[k] = state.riseSum[k] / state.pulses;
+        }
+        double charge = (fastCharge(rise) - fastCharge(fall)) / 2 / samplingRate;
+        return charge / (amplitudeSteps * stepSize);
+    }
+
+    /* Charge of the fast transient after one edge, in amp-samples, from the samples relative to the settled current.
+     * The slower transient under it is extrapolated back from the means of the two windows after it, as an
+     * exponential; if they don't look like one that lasts a few samples or more (including when there's no slower
+     * transient, and they're just noise), it's left at nothing, so noise isn't blown up by the extrapolation.
+     */
+    double CapacitanceTuner::fastCharge(const double* edge) {
+        const unsigned int F = FAST_SAMPLES;
+        double a = 0, b = 0;
+        for (unsigned int k = 0; k < F; k++) {
+            a += edge[F + k] / F;
+            b += edge[2 * F + k] / F;
+        }
+        double slow = 0;
+        double ratio = (a != 0) ? b / a : 0;
+        if (ratio >= std::pow(0.8, F) && ratio < 1) {
+            double decay = std::pow(ratio, 1.0 / F); // Per sample
+            double center = F + (F - 1) / 2.0;      // Of the first window
+            for (unsigned int k = 0; k < F; k++) {
+                slow += a * std::pow(decay, k - center);
+            }
+        }
+
+        double charge = 0;
+        for (unsigned int k = 0; k < F; k++) {
+            charge += edge[k];
+        }
+        return charge - slow;
+    }
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Board.h"
+#include "StopToken.h"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace CLAMP {
+    /// One channel's result from CapacitanceTuner
+    struct CapacitanceTuningResult {
+        ClampConfig::ChipChannel channel; ///< Channel it's for
+        unsigned int registerValue;       ///< Chosen Registers::Register6::fastTransCapCompensation: 55 (none) to 255
+        double magnitude;                 ///< Compensation at that value, in F (as FastTransientCapacitiveCompensation::getMagnitude())
+        double residual;                  ///< Fast transient charge left at that value per volt of step, in F; positive if undercompensated
+        unsigned int valuesTried;         ///< Register values measured to get there
+
+        CapacitanceTuningResult() : registerValue(55), magnitude(0), residual(0), valuesTried(0) {}
+    };
+
+    /** \brief Automatic fast transient capacitive compensation: bisects each channel's compensation magnitude against
+     *  the transient it measures.
+     *
+     *  run() loops a short square test pulse in voltage clamp, as SealTest does, and measures the charge of each
+     *  channel's fast transient from the samples as ReadQueue decodes them (see Board::addSampleCallback()).  The
+     *  compensation magnitude (Registers::Register6) is written by a command inside the looped pulse itself, in the
+     *  middle of the holding half, so trying a new value only changes that command's word in Waveform RAM (see
+     *  Channel::commandsToFPGA): the board never stops, and the pulses after it run with the new value.  Each channel's
+     *  value is bisected over the register's whole range, 55 to 255, which takes nine or ten values; each is measured
+     *  over MEASURE_PULSES pulses, once the pulses that may have started before it was written have gone by.  With the
+     *  default 1 ms + 1 ms pulse, tuning takes on the order of 100 ms.
+     *
+     *  The fast transient is the charge in the first FAST_SAMPLES samples after each edge, less the settled current and
+     *  less the slower membrane charging transient, extrapolated back from the samples after them.  The rising and
+     *  falling edges are averaged, so an offset doesn't count.  Like an amplifier's automatic C-fast, it's best run on a
+     *  sealed pipette, before going whole-cell; with a cell, the membrane time constant should be several samples long.
+     *
+     *  Fast transient compensation is connected, in voltage clamp mode, on every channel, and the chosen magnitude is
+     *  left set; its range (Registers::Register8::fastTransRange) is left as it is.
+     \code
+        board.controller.switchToVoltageClampImmediate(channelList, holding, bandwidth, resistance, 0);
+        CapacitanceTuner tuner(board, channelList);
+        tuner.setPulse(holding, 4, 2.5e-3); // 10 mV
+        for (const CapacitanceTuningResult& result : tuner.run()) {
+            // ... result.magnitude ...
+        }
+     \endcode
+     */
+    class CapacitanceTuner {
+    public:
+        CapacitanceTuner(Board& board_, const ClampConfig::ChipChannelList& channels_);
+        ~CapacitanceTuner();
+
+        void setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_ = 1e-3);
+
+        std::vector<CapacitanceTuningResult> run();
+        void stop();
+
+        /// Pulses measured since run() started, over all channels
+        uint64_t getPulseCount() const { return pulseCount; }
+
+        /// Samples after each edge counted as the fast transient
+        static const unsigned int FAST_SAMPLES = 4;
+        /// Pulses averaged for each value tried
+        static const unsigned int MEASURE_PULSES = 2;
+        /// Pulses left out at the start, while the channels settle at the holding voltage
+        static const unsigned int START_PULSES = 5;
+
+    private:
+        /// \cond private
+        static const unsigned int EDGE_SAMPLES = 3 * FAST_SAMPLES; // The fast transient, then two windows to extrapolate the slow one from
+
+        struct ChannelState {
+            // Pulse being read
+            double holdingSum;     // Settled holding samples
+            unsigned int holdingCount;
+            double stepSum;        // Settled step samples
+            unsigned int stepCount;
+            double fallEdge[EDGE_SAMPLES]; // Samples after each edge
+            double riseEdge[EDGE_SAMPLES];
+            unsigned int fallCount;
+            unsigned int riseCount;
+            bool havePrevious;
+            uint32_t lastPhase;    // Phase and timestamp of the newest sample
+            uint32_t lastTimestamp;
+            uint32_t pulseStart;   // Timestamp of the pulse's first sample
+
+            // Pulses measured at the current value: edges relative to the settled currents, summed
+            double fallSum[EDGE_SAMPLES];
+            double riseSum[EDGE_SAMPLES];
+            unsigned int pulses;
+
+            // Bisection: low undercompensates, high overcompensates (or hasn't been measured)
+            unsigned int low;
+            unsigned int high;
+            unsigned int value;    // Value being measured
+            std::map<unsigned int, double> residuals; // By value
+            bool done;
+
+            // Position of the compensation write in the channel's commands, and the value to put back if tuning stops
+            std::size_t writeIndex;
+            unsigned int originalValue;
+
+            ChannelState();
+            void startPulse();
+        };
+        /// \endcond
+
+        Board& board;
+        ClampConfig::ChipChannelList channels;
+        int holdingSteps;
+        int amplitudeSteps;
+        double stepSize;
+        double halfPeriodSeconds;
+
+        // Pulse timing, in timesteps; set by run()
+        uint32_t halfPeriod;
+        uint32_t period;
+        uint32_t settle;
+        double samplingRate;
+
+        std::map<ClampConfig::ChipChannel, ChannelState> states;
+        std::vector<unsigned int> callbackIds;
+        uint32_t measureFrom; // Pulses starting before this timestamp may have run with an older value
+        bool haveMeasureFrom; // False until the first sample, which measureFrom is then counted from
+        std::atomic<uint64_t> pulseCount;
+        StopToken keepGoing;
+
+        void loadPulse();
+        void writeValues();
+        bool measure();
+        void nextValue(ChannelState& state);
+        void finish(bool tuned);
+        void removeCallbacks();
+
+        void onSamples(ChannelState& state, const SampleSpan& span);
+        void finishPulse(ChannelState& state);
+        double residual(const ChannelState& state) const;
+        static double fastCharge(const double* edge);
+
+        // Not copyable
+        CapacitanceTuner(const CapacitanceTuner&);
+        CapacitanceTuner& operator=(const CapacitanceTuner&);
+    };
+}
@@ -0,0 +1,306 @@
+#include "CellTracker.h"
+#include "DataAnalysis.h"
+#include "SimplifiedWaveform.h"
+#include "SweepAnalysis.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::SignalProcessing;
+using std::vector;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+
+namespace CLAMP {
+    static const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+    CellTrackingReading::CellTrackingReading() :
+        timestamp(0),
+        resistance(NaN),
+        Ra(NaN),
+        Rm(NaN),
+        Cm(NaN),
+        holdingCurrent(NaN),
+        chi2(NaN),
+        tauFast(NaN),
+        tauSlow(NaN),
+        iterations(0)
+    {
+    }
+
+    bool CellTrackingReading::isValid() const {
+        return !std::isnan(Ra);
+    }
+
+    /** \brief Constructor.
+     *
+     *  \param[in] board_     Board the channels are on
+     *  \param[in] channels_  Channels to track; they should already be in voltage clamp
+     */
+    CellTracker::CellTracker(Board& board_, const ChipChannelList& channels_) :
+        board(board_),
+        channels(channels_),
+        holdingSteps(0),
+        amplitudeSteps(4),
+        stepSize(2.5e-3),
+        halfPeriodSeconds(5e-3),
+        maxIterations(MAX_ITERATIONS),
+        doubleExponential(false),
+        halfPeriod(0),
+        period(0),
+        settle(0),
+        samplingRate(0),
+        pulseCount(0)
+    {
+        if (channels.empty()) {
+            throw invalid_argument("Cell tracking needs at least one channel");
+        }
+    }
+
+    CellTracker::~CellTracker() {
+        removeCallbacks();
+    }
+
+    /** \brief Sets the test pulse.  Call this before run().
+     *
+     *  \param[in] holdingSteps_       Holding voltage, in clamp steps
+     *  \param[in] amplitudeSteps_     Pulse amplitude, relative to holding, in clamp steps (default 4, i.e., 10 mV)
+     *  \param[in] stepSize_           Clamp step size the channels are set to, in volts (2.5 mV or 5 mV)
+     *  \param[in] halfPeriodSeconds_  Length of each half of the pulse (holding, then the step), in seconds (default 5 ms)
+     */
+    void CellTracker::setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_) {
+        if (amplitudeSteps_ == 0 || stepSize_ <= 0 || halfPeriodSeconds_ <= 0) {
+            throw invalid_argument("Cell tracking pulse needs a nonzero amplitude and a positive length");
+        }
+        holdingSteps = holdingSteps_;
+        amplitudeSteps = amplitudeSteps_;
+        stepSize = stepSize_;
+        halfPeriodSeconds = halfPeriodSeconds_;
+    }
+
+    /// Sets the most fit steps taken for a pulse after the first (default MAX_ITERATIONS)
+    void CellTracker::setMaxIterations(unsigned int value) {
+        maxIterations = std::max(1u, value);
+    }
+
+    /// Sets whether transients are fitted with two exponentials rather than one (default false).  Call this before run().
+    void CellTracker::setDoubleExponential(bool enabled) {
+        doubleExponential = enabled;
+    }
+
+    /** \brief Runs the test pulse until the time is up or stop() is called.
+     *
+     *  Replaces the channels' command lists and enables only these channels; the caller restores whatever it needs
+     *  afterwards.
+     *
+     *  \param[in] seconds   How long to run; 0 to run until stop() is called
+     *  \param[in] callback  If given, called with each pulse's readings; see ReadingCallback
+     */
+    void CellTracker::run(double seconds, const ReadingCallback& callback) {
+        samplingRate = board.getSamplingRateHz();
+        halfPeriod = std::max(2 * SweepAnalysis::FIT_SKIP_SAMPLES, static_cast<unsigned int>(std::lround(halfPeriodSeconds * samplingRate)));
+        period = 2 * halfPeriod;
+        settle = halfPeriod / 2;
+        uint64_t timestepsToRun = (seconds > 0) ? static_cast<uint64_t>(std::llround(seconds * samplingRate)) : 0;
+
+        SimplifiedWaveform waveform;
+        waveform.push_back(WaveformSegment(0, holdingSteps, halfPeriod, 0, false, false));
+        waveform.push_back(WaveformSegment(0, holdingSteps + amplitudeSteps, halfPeriod, 0, true, true));
+        waveform.setStepSize(stepSize, 0);
+
+        keepGoing.reset();
+        pulseCount = 0;
+        states.clear();
+        pending.clear();
+        {
+            lock_guard<mutex> lock(readingMutex);
+            readings.clear();
+        }
+
+        board.enableChannels(channels, true);
+        board.controller.simplifiedWaveformToWaveform(channels, true, waveform);
+        board.commandsToFPGA();
+
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            // Reserved once, so collecting a pulse never allocates
+            state.xs.reserve(halfPeriod);
+            state.ys.reserve(halfPeriod);
+            const ChipChannel& key = states.find(channel)->first;
+            callbackIds.push_back(board.addSampleCallback(channel, Board::MEASURED_CURRENT, [this, &key, &state](const SampleSpan& span) {
+                onSamples(key, state, span);
+            }));
+        }
+
+        board.readQueue.clear(true);
+        board.runContinuously();
+        try {
+            uint64_t timesteps = 0;
+            while (keepGoing && (timestepsToRun == 0 || timesteps < timestepsToRun)) {
+                timesteps += board.read(halfPeriod, &keepGoing);
+                board.readQueue.clear(false);
+                publish(callback);
+            }
+        }
+        catch (...) {
+            board.stop();
+            board.flush();
+            board.readQueue.clear(true);
+            removeCallbacks();
+            throw;
+        }
+        board.stop();
+        board.flush();
+        board.readQueue.clear(true);
+        removeCallbacks();
+    }
+
+    /// Makes run() return, without waiting for the current read to finish; may be called from any thread.
+    void CellTracker::stop() {
+        keepGoing.requestStop();
+    }
+
+    /// The channel's latest reading; its parameters are NaN if none has been published yet.  May be called from any thread.
+    CellTrackingReading CellTracker::getReading(const ChipChannel& channel) const {
+        lock_guard<mutex> lock(readingMutex);
+        auto found = readings.find(channel);
+        if (found == readings.end()) {
+            CellTrackingReading none;
+            none.channel = channel;
+            return none;
+        }
+        return found->second;
+    }
+
+    void CellTracker::removeCallbacks() {
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+        callbackIds.clear();
+    }
+
+    // Collects one chunk.  The phase within the pulse comes from the timestamp, as in SealTest::onSamples(); a pulse
+    // is complete when the phase wraps around.
+    void CellTracker::onSamples(const ChipChannel& channel, ChannelState& state, const SampleSpan& span) {
+        const Sample* v = span.samples;
+        const uint32_t* t = span.timestamps;
+        for (std::size_t i = 0; i < span.length; i++) {
+            uint32_t phase = t[i] % period;
+            if (state.havePrevious && (phase < state.lastPhase || t[i] - state.lastTimestamp >= period)) {
+                finishPulse(channel, state);
+            }
+            if (phase >= halfPeriod + SweepAnalysis::FIT_SKIP_SAMPLES) {
+                state.xs.push_back((phase - halfPeriod) / samplingRate);
+                state.ys.push_back(v[i]);
+            }
+            else if (phase >= settle && phase < halfPeriod) {
+                state.holdingSum += v[i];
+                state.holdingCount++;
+            }
+            state.havePrevious = true;
+            state.lastPhase = phase;
+            state.lastTimestamp = t[i];
+        }
+    }
+
+    // Fits the pulse just ended and queues its reading.  Pulses missing samples (the first, if the data started
+    // partway through, or any cut short by a gap in the timestamps) are dropped.
+    void CellTracker::finishPulse(const ChipChannel& channel, ChannelState& state) {
+        if (state.holdingCount > 0 && state.xs.size() == halfPeriod - SweepAnalysis::FIT_SKIP_SAMPLES) {
+            CellTrackingReading reading;
+            reading.channel = channel;
+            reading.timestamp = state.lastTimestamp;
+            reading.holdingCurrent = state.holdingSum / state.holdingCount;
+
+            double chi2 = NaN;
+            reading.iterations = doubleExponential ? fitDoubleExponential(state, chi2) : fit(state, chi2);
+            reading.chi2 = chi2;
+
+            // As SweepAnalysis: the resistance from the fitted steady state, then the cell from the transient
+            double dV = amplitudeSteps * stepSize;
+            double resistance = dV / (state.beta[0] - reading.holdingCurrent);
+            double Ra = NaN, Rm = NaN, Cm = NaN;
+            if (std::isfinite(state.beta[0]) && std::isfinite(state.beta[2]) && state.beta[1] < 0 && std::isnormal(resistance) && resistance > 0) {
+                SweepAnalysis::getRsAndCs(state.beta, dV, resistance, Ra, Rm, Cm);
+            }
+            state.haveFit = std::isfinite(Ra) && std::isfinite(Rm) && std::isfinite(Cm) && Ra > 0 && Rm > 0 && Cm > 0;
+            if (state.haveFit) {
+                reading.resistance = resistance;
+                reading.Ra = Ra;
+                reading.Rm = Rm;
+                reading.Cm = Cm;
+                if (doubleExponential && DoubleExponentialFit::hasTwoComponents(state.fullBeta)) {
+                    reading.tauFast = -1.0 / state.fullBeta[1];
+                    reading.tauSlow = -1.0 / state.fullBeta[3];
+                }
+                else {
+                    reading.tauFast = -1.0 / state.beta[1];
+                }
+            }
+            pending.push_back(reading);
+            pulseCount++;
+        }
+        state.holdingSum = 0;
+        state.holdingCount = 0;
+        state.xs.clear();
+        state.ys.clear();
+    }
+
+    // Fits the pulse's transient into state.beta, returning the steps taken.  Starting from the previous pulse's fit,
+    // with the convergence test of ExponentialFit::lm(), but stopping after maxIterations steps.
+    unsigned int CellTracker::fit(ChannelState& state, double& chi2) const {
+        if (!state.haveFit) {
+            return ExponentialFit::lm(state.xs, state.ys, state.beta, chi2);
+        }
+
+        double lambda = 0.001;
+        unsigned int iterations = 0;
+        while (iterations < maxIterations) {
+            double oldChi2 = chi2;
+            double oldBeta[3] = { state.beta[0], state.beta[1], state.beta[2] };
+            bool tookAStep = ExponentialFit::lmOneStep(lambda, state.beta, state.xs, state.ys, chi2);
+            iterations++;
+            if (lambda < 1e-9) {
+                break;
+            }
+            if (tookAStep && iterations > 1) {
+                double fracChangeChi2 = std::abs((chi2 - oldChi2) / oldChi2);
+                double fracChangeBeta = std::abs((state.beta[0] - oldBeta[0]) / oldBeta[0]) + std::abs((state.beta[1] - oldBeta[1]) / oldBeta[1]) +
+                                        std::abs((state.beta[2] - oldBeta[2]) / oldBeta[2]);
+                if (fracChangeChi2 < 1e-6 && fracChangeBeta < 1e-6) {
+                    break;
+                }
+            }
+        }
+        return iterations;
+    }
+
+    // As fit(), with two exponentials: the fit goes into state.fullBeta, and its equivalent single exponential into
+    // state.beta
+    unsigned int CellTracker::fitDoubleExponential(ChannelState& state, double& chi2) const {
+        unsigned int iterations = state.haveFit ? DoubleExponentialFit::refine(state.xs, state.ys, nullptr, state.fullBeta, chi2, state.workspace, maxIterations)
+                                                : DoubleExponentialFit::fit(state.xs, state.ys, nullptr, state.fullBeta, chi2, state.workspace);
+        DoubleExponentialFit::equivalentSingle(state.fullBeta, state.beta);
+        return iterations;
+    }
+
+    // Passes the readings since the previous call to the callback, and keeps each channel's latest for getReading()
+    void CellTracker::publish(const ReadingCallback& callback) {
+        if (pending.empty()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(readingMutex);
+            for (const CellTrackingReading& reading : pending) {
+                readings[reading.channel] = reading;
+            }
+        }
+        if (callback) {
+            callback(pending);
+        }
+        pending.clear();
+    }
+}
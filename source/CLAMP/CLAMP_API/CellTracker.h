@@ -0,0 +1,144 @@
+#pragma once
+
+#include "Board.h"
+#include "ExponentialModels.h"
+#include "StopToken.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    /// One channel's whole-cell parameters from one test pulse, as published by CellTracker
+    struct CellTrackingReading {
+        ClampConfig::ChipChannel channel; ///< Channel it's for
+        uint32_t timestamp;               ///< Timestamp of the pulse's last sample
+        double resistance;                ///< Total resistance (access plus membrane), in ohms
+        double Ra;                        ///< Access resistance, in ohms
+        double Rm;                        ///< Membrane resistance, in ohms
+        double Cm;                        ///< Membrane capacitance, in farads
+        double holdingCurrent;            ///< Mean settled current at the holding voltage, in amps
+        double chi2;                      ///< Mean squared residual of the fit, in amps squared
+        double tauFast;                   ///< Time constant of the fit's faster component, in seconds (the only one, for a single exponential)
+        double tauSlow;                   ///< Time constant of the slower component, in seconds; NaN for a single exponential
+        unsigned int iterations;          ///< Fit steps taken for this pulse
+
+        CellTrackingReading();
+        /// False if the pulse's fit failed, in which case the parameters are NaN
+        bool isValid() const;
+    };
+
+    /** \brief Continuous whole-cell tracking: access resistance, membrane resistance and membrane capacitance from
+     *  every pulse of a looped test pulse.
+     *
+     *  run() loops a square pulse in voltage clamp, as SealTest does, and collects each channel's current as
+     *  ReadQueue decodes it (see Board::addSampleCallback()).  As soon as a pulse's last sample is read, the charging
+     *  transient of its step half is fitted with ExponentialFit, as SweepAnalysis fits a sweep's segments, and Ra, Rm
+     *  and Cm follow from SweepAnalysis::getRsAndCs().  Rather than fitting from scratch, each fit starts from the
+     *  channel's previous pulse's parameters and takes at most setMaxIterations() steps, so a pulse costs a bounded,
+     *  small multiple of its sample count; while the cell doesn't change, one or two steps are enough.  Only a channel's
+     *  first pulse, and the first after a failed fit, is fitted from scratch, with ExponentialFit::lm().
+     *
+     *  Every reading is kept, so the parameters are a time series at the pulse rate (100 a second with the default
+     *  5 ms + 5 ms pulse); they're passed to the callback after each read and the latest is kept for getReading().
+     *  The step half should be several membrane time constants long.
+     *
+     *  With setDoubleExponential(), transients are fitted with two exponentials (see DoubleExponentialFit), e.g., for
+     *  cells with a slowly charging dendritic compartment; Ra, Rm and Cm then come from the equivalent single
+     *  exponential, and both time constants are reported.
+     \code
+        board.controller.switchToVoltageClampImmediate(channelList, holding, bandwidth, resistance, 0);
+        CellTracker tracker(board, channelList);
+        tracker.setPulse(holding, 4, 2.5e-3); // 10 mV
+        tracker.run(0, [&](const std::vector<CellTrackingReading>& readings) {
+            // ... readings[i].Ra, readings[i].Rm, readings[i].Cm ...
+        });
+     \endcode
+     */
+    class CellTracker {
+    public:
+        /// Called after each read on the thread that called run(), with the readings of every pulse completed since the previous call
+        typedef std::function<void(const std::vector<CellTrackingReading>&)> ReadingCallback;
+
+        CellTracker(Board& board_, const ClampConfig::ChipChannelList& channels_);
+        ~CellTracker();
+
+        void setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_ = 5e-3);
+        void setMaxIterations(unsigned int value);
+        void setDoubleExponential(bool enabled);
+        /// True if transients are fitted with two exponentials; see setDoubleExponential()
+        bool getDoubleExponential() const { return doubleExponential; }
+
+        void run(double seconds = 0, const ReadingCallback& callback = ReadingCallback());
+        void stop();
+
+        CellTrackingReading getReading(const ClampConfig::ChipChannel& channel) const;
+        /// Pulses fitted since run() started, over all channels
+        uint64_t getPulseCount() const { return pulseCount; }
+
+        /// Default for setMaxIterations()
+        static const unsigned int MAX_ITERATIONS = 8;
+
+    private:
+        /// \cond private
+        struct ChannelState {
+            // Pulse being read
+            double holdingSum;       // Settled holding samples
+            unsigned int holdingCount;
+            std::vector<double> xs;  // Step half, from FIT_SKIP_SAMPLES on: seconds from the step, and current
+            std::vector<double> ys;
+            bool havePrevious;
+            uint32_t lastPhase;      // Phase and timestamp of the newest sample
+            uint32_t lastTimestamp;
+
+            // Previous pulse's fit, to start the next one from.  With two exponentials, the fit is in fullBeta and beta is
+            // its equivalent single exponential.
+            double beta[3];
+            double fullBeta[5];
+            bool haveFit;
+            SignalProcessing::DoubleExponentialFit::Workspace workspace;
+
+            ChannelState() : holdingSum(0), holdingCount(0), havePrevious(false), lastPhase(0), lastTimestamp(0), haveFit(false) {
+                beta[0] = beta[1] = beta[2] = 0;
+                fullBeta[0] = fullBeta[1] = fullBeta[2] = fullBeta[3] = fullBeta[4] = 0;
+            }
+        };
+        /// \endcond
+
+        Board& board;
+        ClampConfig::ChipChannelList channels;
+        int holdingSteps;
+        int amplitudeSteps;
+        double stepSize;
+        double halfPeriodSeconds;
+        unsigned int maxIterations;
+        bool doubleExponential;
+
+        // Pulse timing, in timesteps; set by run()
+        uint32_t halfPeriod;
+        uint32_t period;
+        uint32_t settle;
+        double samplingRate;
+
+        std::map<ClampConfig::ChipChannel, ChannelState> states;
+        std::vector<unsigned int> callbackIds;
+        std::vector<CellTrackingReading> pending; // Since the last callback
+        mutable std::mutex readingMutex;
+        std::map<ClampConfig::ChipChannel, CellTrackingReading> readings; // Guarded by readingMutex
+        std::atomic<uint64_t> pulseCount;
+        StopToken keepGoing;
+
+        void onSamples(const ClampConfig::ChipChannel& channel, ChannelState& state, const SampleSpan& span);
+        void finishPulse(const ClampConfig::ChipChannel& channel, ChannelState& state);
+        unsigned int fit(ChannelState& state, double& chi2) const;
+        unsigned int fitDoubleExponential(ChannelState& state, double& chi2) const;
+        void publish(const ReadingCallback& callback);
+        void removeCallbacks();
+
+        // Not copyable
+        CellTracker(const CellTracker&);
+        CellTracker& operator=(const CellTracker&);
+    };
+}
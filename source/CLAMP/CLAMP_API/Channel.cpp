@@ -3,7 +3,9 @@
 #include "RAM.h"
 #include "common.h"
 #include "WaveformCommand.h"
+#include "SaveWriterThread.h"
 #include <stdexcept>
+#include <exception>
 #include <cmath>
 #include <sstream>
 
@@ -19,7 +21,7 @@ using namespace CLAMP::WaveformControl;
 using namespace CLAMP::ChipProtocol;
 
 namespace CLAMP {
-    static bool logBandwidth = false;
+    static const bool logBandwidth = false;
 
     /// \cond private
     double BandwidthHelper::getBandwidth(double r, double c) {
@@ -31,6 +33,14 @@ namespace CLAMP {
     }
     /// \endcond
 
+    //-----------------------------------------------------------------------------------------------------
+    bool MeasurementCorrection::operator==(const MeasurementCorrection& other) const {
+        return voltageGain == other.voltageGain &&
+               voltageOffset == other.voltageOffset &&
+               currentGain == other.currentGain &&
+               currentOffset == other.currentOffset;
+    }
+
     //-----------------------------------------------------------------------------------------------------
 
     /// Constructor
@@ -41,7 +51,11 @@ namespace CLAMP {
         differenceAmpResidual(0),
         voltageAmpResidual(0),
         calibrationHelper(chip_.board.controller),
-        desiredBandwidth(10000)
+        desiredBandwidth(10000),
+        enable(false),
+        enableWritten(false),
+        maskByte(0),
+        maskBits(0)
     {
         registers.setChannelIndex(channelIndex_);
 
@@ -55,7 +69,11 @@ namespace CLAMP {
 	}
 
     Channel::~Channel() {
-
+        try {
+            closeRawFile();
+        }
+        catch (...) {
+        }
     }
 
     /** \brief Sets the start address of the waveform on this channel.
@@ -146,8 +164,13 @@ namespace CLAMP {
      *  \param[in] value  True to enable data return for this channel
      */
     void Channel::setEnable(bool value) {
+        if (enableWritten && enable == value) {
+            return;
+        }
         writeVirtualRegister(3, value);
         enable = value;
+        enableWritten = true;
+        chip.board.packetLayoutDirty = true;
     }
 
     /** \brief Does this channel return data when running?
@@ -171,36 +194,109 @@ namespace CLAMP {
      *  Adjusts start and end address appropriately.
      */
     void Channel::commandsToFPGA() {
-        if (commands != writtenCommands) {
-            extent.reset();
-
-//			if (commands.empty()) {
-//				// If the command list for this channel is empty, add a repeating "read from ROM" command since controller always sends SOMETHING when running.
-//				commands.push_back(NonrepeatingCommand::create(READ, None, 0xFF, 0));
-//			}
-            if (!commands.empty()) {
-                vector<uint32_t> cmdsAsUint;
-                cmdsAsUint.insert(cmdsAsUint.end(), commands.begin(), commands.end());
-                extent = chip.board.waveformRAM.write(cmdsAsUint);
-                setStartAddress(extent->start);
-                setEndAddress(extent->end);
-			}
-            writtenCommands = commands;
+        if (commands == writtenCommands) {
+            return;
+        }
+        if (writeCommandsToRAM()) {
+            writeAddresses();
         }
+        setWrittenCommands();
     }
 
 	void Channel::nullCommandToFPGA() {
+		setNullCommands();
+		commandsToFPGA();
+	}
+
+	void Channel::setNullCommands() {
 		commands.clear();
 		// Add a repeating "read from ROM" command since controller always sends SOMETHING when running.
 		commands.push_back(NonrepeatingCommand::create(READ, None, 0xFF, 0));
-		vector<uint32_t> cmdsAsUint;
-		cmdsAsUint.insert(cmdsAsUint.end(), commands.begin(), commands.end());
-		extent = chip.board.waveformRAM.write(cmdsAsUint);
-		setStartAddress(extent->start);
-		setEndAddress(extent->end);
-		writtenCommands = commands;
 	}
 
+    /* First half of commandsToFPGA: puts commands, which differ from writtenCommands, in Waveform RAM.  Inside a
+     * WaveformRAM::Batch, they only reach the board when the batch commits.
+     *
+     * With atBoundary, the board is assumed to be playing the current extent: the commands always go to a new extent,
+     * and the old one is kept (in retiredExtents) until Board::releaseRetiredCommands.
+     *
+     * Returns true if the channel needs to be pointed at a new extent (see writeAddresses).  Either way, the caller
+     * calls setWrittenCommands once the commands are on the board and the channel points at them.
+     */
+    bool Channel::writeCommandsToRAM(bool atBoundary) {
+        // Same length (e.g., one amplitude changed): patch the changed words in place, rather than moving the waveform
+        if (!atBoundary && extent && !commands.empty() && commands.size() == writtenCommands.size()) {
+            vector<uint32_t> cmdsAsUint(commands.begin(), commands.end());
+            if (chip.board.waveformRAM.rewrite(*extent, cmdsAsUint)) {
+                return false;
+            }
+        }
+
+        // Keep the old extent until the new one has been written, so identical runs can be shared rather than rewritten
+        std::shared_ptr<WaveformExtent> oldExtent = std::move(extent);
+
+//			if (commands.empty()) {
+//				// If the command list for this channel is empty, add a repeating "read from ROM" command since controller always sends SOMETHING when running.
+//				commands.push_back(NonrepeatingCommand::create(READ, None, 0xFF, 0));
+//			}
+        bool changed = false;
+        if (!commands.empty()) {
+            vector<uint32_t> cmdsAsUint;
+            cmdsAsUint.insert(cmdsAsUint.end(), commands.begin(), commands.end());
+            extent = chip.board.waveformRAM.write(cmdsAsUint);
+            changed = true;
+        }
+        if (atBoundary && oldExtent) {
+            retiredExtents.push_back(std::move(oldExtent));
+        }
+        return changed;
+    }
+
+    /** \brief Points the channel at commands that are already in Waveform RAM (e.g., a ClampConfig::ResidentSequence).
+     *
+     *  Like commandsToFPGA(), but the write always goes through WaveformRAM::write, which finds the identical run and
+     *  shares it, so nothing is uploaded.  commandsToFPGA() could instead patch the channel's previous commands in place.
+     */
+    void Channel::residentCommandsToFPGA() {
+        if (commands == writtenCommands || commands.empty()) {
+            return;
+        }
+        // Keep the old extent until the new one has been found, as writeCommandsToRAM does
+        std::shared_ptr<WaveformExtent> oldExtent = std::move(extent);
+        vector<uint32_t> cmdsAsUint(commands.begin(), commands.end());
+        extent = chip.board.waveformRAM.write(cmdsAsUint);
+        writeAddresses();
+        setWrittenCommands();
+    }
+
+    // Records commands as written, with their start timesteps
+    void Channel::setWrittenCommands() {
+        writtenCommands = commands;
+        writtenStarts.resize(writtenCommands.size() + 1);
+        uint32_t index = 0;
+        for (std::size_t i = 0; i < writtenCommands.size(); i++) {
+            writtenStarts[i] = index;
+            index += repetitionsOf(writtenCommands[i]);
+        }
+        writtenStarts.back() = index;
+    }
+
+    /* Second half of commandsToFPGA: points the channel at its extent in Waveform RAM.
+     *
+     * The start and end virtual registers (1 and 2) are adjacent, so both go in a single RAM write - one trigger and
+     * one pipe transfer - rather than through setStartAddress and setEndAddress.  A running channel that loops while
+     * they're being written then can't pick up a new start with the old end, or the other way around.
+     */
+    void Channel::writeAddresses() {
+        VirtualRegisterAddress addr(chip.index, channelIndex, 1);
+
+        vector<uint32_t> data;
+        data.push_back(CheckBits(extent->start, 15));
+        data.push_back(CheckBits(extent->end, 15));
+
+        chip.board.writeRAM(addr, data);
+    }
+
     /** \brief Length, in timesteps, of the current command sequence on this channel
      *
      *  For simple/non-repeating commands, there is a one-to-one correspondence between command and timestep.
@@ -208,14 +304,12 @@ namespace CLAMP {
      *  the total length in timesteps of the command sequence.  It's useful for knowing how many timesteps to run
      *  for, in order to run the complete command sequence, for example.
      *
+     *  The count is kept when the commands are written, so this is cheap however many commands there are.
+     *
      *  \returns The number of timesteps it will take the current command sequence to execute fully.
      */
     uint32_t Channel::numTimesteps() {
-        uint32_t sum = 0;
-        for (const WaveformCommand& command : writtenCommands) {
-            sum += command.numRepetitions();
-        }
-        return sum;
+        return writtenStarts.empty() ? 0 : writtenStarts.back();
     }
 
     /** \brief Returns an augmented version of the waveform commands.
@@ -232,6 +326,14 @@ namespace CLAMP {
         vector<IndexedWaveformCommand> indexedWaveform;
         indexedWaveform.insert(indexedWaveform.end(), commands.begin(), commands.end());
 
+        if (commands == writtenCommands) {
+            // Already counted when they were written
+            for (std::size_t i = 0; i < indexedWaveform.size(); i++) {
+                indexedWaveform[i].index = writtenStarts[i];
+            }
+            return indexedWaveform;
+        }
+
         uint32_t index = 0;
         for (IndexedWaveformCommand& indexedCommand : indexedWaveform)
         {
@@ -354,41 +456,127 @@ namespace CLAMP {
         LOG(logBandwidth) << "Actual bandwidth:" << "\t" << getActualBandwidth() << "\n";
     }
 
+    // Buffer size for the logging files; logs are written in bulk, so this is large
+    static const unsigned int RAW_LOG_BUFFER_SIZE = 256 * KILO;
+
+    static unique_ptr<BinaryWriter> openRawWriter(const FILENAME& filename, bool async) {
+        unique_ptr<FileOutStream> out(new FileOutStream());
+        out->open(filename);
+        if (async) {
+            out.reset(new IO::AsyncFileOutStream(std::move(out)));
+        }
+        return unique_ptr<BinaryWriter>(new BinaryWriter(std::move(out), RAW_LOG_BUFFER_SIZE));
+    }
+
     /** \brief Open a logging file
      *
-     *  \param[in] filename  File name.  Wide string to support Unicode on Windows.
+     *  The log holds the valid (non-NaN) samples, as floats.  To tell where the NaNs were, give a mask file too: it gets
+     *  a bit per logged sample, 1 for a NaN (which isn't in the log), packed least significant bit first.
+     *
+     *  \param[in] filename      File name.  Wide string to support Unicode on Windows.
+     *  \param[in] async         True to do the disk writes on SaveWriterThread
+     *  \param[in] maskFilename  File name for the NaN mask; empty for none
      */
-    void Channel::openRawFile(const FILENAME& filename) {
-        unique_ptr<FileOutStream> out(new FileOutStream());
-        out->open(filename);
-        writer.reset(new BinaryWriter(std::move(out), KILO));
+    void Channel::openRawFile(const FILENAME& filename, bool async, const FILENAME& maskFilename) {
+        closeRawFile();
+        writer = openRawWriter(filename, async);
+        if (!maskFilename.empty()) {
+            maskWriter = openRawWriter(maskFilename, async);
+        }
     }
 
     /** \brief Log data to channel-specific logging file, if one is open
      *
      *  \param[in] data  Data to log
      */
-    void Channel::log(const vector<double>& data) {
-        if (writer.get() != nullptr) {
-            for (double value : data) {
-                if (!std::isnan(value)) {
-                    *writer << value;
+    void Channel::log(const vector<Sample>& data) {
+        if (writer.get() == nullptr) {
+            return;
+        }
+        // Write each run of valid samples as one span
+        const Sample* p = data.data();
+        std::size_t n = data.size();
+        std::size_t i = 0;
+        while (i < n) {
+            std::size_t start = i;
+            while (i < n && !std::isnan(p[i])) {
+                i++;
+            }
+            if (i > start) {
+                writer->writeArray(p + start, static_cast<unsigned int>(i - start));
+                if (maskWriter) {
+                    logMask(false, i - start);
                 }
             }
+
+            start = i;
+            while (i < n && std::isnan(p[i])) {
+                i++;
+            }
+            if (i > start && maskWriter) {
+                logMask(true, i - start);
+            }
         }
     }
 
-    /// Close the logging file
+    // Appends count bits of value to the NaN mask
+    void Channel::logMask(bool nan, std::size_t count) {
+        auto appendBit = [&]() {
+            maskByte |= (nan ? 1 : 0) << maskBits;
+            if (++maskBits == 8) {
+                *maskWriter << maskByte;
+                maskByte = 0;
+                maskBits = 0;
+            }
+        };
+        // Up to a byte boundary, then whole bytes, then the rest
+        for (; count > 0 && maskBits != 0; count--) {
+            appendBit();
+        }
+        uint8_t fill = nan ? 0xff : 0;
+        for (; count >= 8; count -= 8) {
+            *maskWriter << fill;
+        }
+        for (; count > 0; count--) {
+            appendBit();
+        }
+    }
+
+    /// Close the logging file; throws if what was still to be written (with async, still queued) couldn't be
     void Channel::closeRawFile() {
-        writer.reset();
+        unique_ptr<BinaryWriter> closingMask(std::move(maskWriter));
+        unique_ptr<BinaryWriter> closing(std::move(writer));
+        if (closingMask && maskBits != 0) {
+            *closingMask << maskByte;
+        }
+        maskByte = 0;
+        maskBits = 0;
+
+        std::exception_ptr failure;
+        BinaryWriter* writers[] = { closing.get(), closingMask.get() };
+        for (BinaryWriter* w : writers) {
+            try {
+                if (w) {
+                    w->close();
+                }
+            }
+            catch (...) {
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+        }
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
     }
 
     /** Size of this object on disk
      *  \returns The size in bytes
      */
-    unsigned int Channel::onDiskSize() const {
+    unsigned int Channel::onDiskSize() {
         return 14 * sizeof(uint16_t) /* registers */
-               + sizeof(differenceAmpResidual) + sizeof(voltageAmpResidual) + 8 * (sizeof(bestCalibration[0][0].coarse) + sizeof(bestCalibration[0][0].fine)) /* calibration */
+               + 2 * sizeof(int32_t) /* residuals */ + 8 * 2 * sizeof(uint8_t) /* calibration */
                + 5 * sizeof(float) /* feedback resistors */
                +sizeof(float); /* desired bandwidth */
     }
@@ -8,6 +8,7 @@
 #include "ClampController.h"
 #include <string>
 #include "streams.h"
+#include "Constants.h"
 
 class BinaryWriter;
 
@@ -32,6 +33,27 @@ namespace CLAMP {
     };
     /// \endcond
 
+    /** \brief Affine correction applied to a channel's measured voltages and currents as ReadQueue converts them:
+     *  corrected = gain * measured + offset.
+     *
+     *  Because it's part of the conversion, a correction costs nothing extra per read, and everything downstream of
+     *  ReadQueue (sample callbacks, saving, display) sees corrected values.  Like the other channel settings,
+     *  it's captured when the data is parsed, so changing it only affects data read afterwards.  For example, to
+     *  take out a 5 mV pipette offset in current clamp:
+     \code
+        board.controller.getChannel(chipChannel).measurementCorrection.voltageOffset = -5e-3;
+     \endcode
+     */
+    struct MeasurementCorrection {
+        double voltageGain;   ///< Scale applied to measured voltages (default 1)
+        double voltageOffset; ///< Added to measured voltages after scaling, in volts (default 0)
+        double currentGain;   ///< Scale applied to measured currents (default 1)
+        double currentOffset; ///< Added to measured currents after scaling, in amps (default 0)
+
+        MeasurementCorrection() : voltageGain(1), voltageOffset(0), currentGain(1), currentOffset(0) {}
+        bool operator==(const MeasurementCorrection& other) const;
+    };
+
     class Chip;
     /** \brief In-memory representation of one channel on one chip.
      *
@@ -91,6 +113,7 @@ namespace CLAMP {
         std::vector<WaveformControl::WaveformCommand> commands;
         void commandsToFPGA();
 		void nullCommandToFPGA();
+        void residentCommandsToFPGA();
         uint32_t numTimesteps();
         std::vector<WaveformControl::IndexedWaveformCommand> getIndexedWaveform();
         //@}
@@ -127,6 +150,9 @@ namespace CLAMP {
          *  rFeedback[2] the 2 M&Omega;, rFeedback[3] the 20 M&Omega;, rFeedback[4] the 40 M&Omega;, rFeedback[5] is the 80 M&Omega;.
          */
         double rFeedback[6];
+
+        /// Correction ReadQueue applies to this channel's measured voltages and currents; see MeasurementCorrection
+        MeasurementCorrection measurementCorrection;
         //@}
 
         /** \name Voltage clamp resistor and bandwidth
@@ -168,26 +194,41 @@ namespace CLAMP {
          *  These members control that, and logging code is found throughout the API that uses them.
          */
         //@{
-        void openRawFile(const FILENAME& filename);
-        void log(const std::vector<double>& data);
+        void openRawFile(const FILENAME& filename, bool async = false, const FILENAME& maskFilename = FILENAME());
+        void log(const std::vector<Sample>& data);
         void closeRawFile();
         //@}
 
-        unsigned int onDiskSize() const;
+        static unsigned int onDiskSize();
         friend BinaryWriter& operator<<(BinaryWriter& out, const Channel& channel);
 
     private:
         void writeVirtualRegister(uint8_t address, uint16_t value);
+        bool writeCommandsToRAM(bool atBoundary = false);
+        void writeAddresses();
+        void setNullCommands();
         bool enable;
+        bool enableWritten; // Whether the FPGA's enable register is known to hold enable; see Board::forgetWrittenSettings
         void getBestCapacitorInMemory();
 
         std::vector<WaveformControl::WaveformCommand> writtenCommands;
+        // Timestep each of writtenCommands starts at, followed by the total, so numTimesteps and getIndexedWaveform don't recount
+        std::vector<uint32_t> writtenStarts;
+        void setWrittenCommands();
         std::shared_ptr<WaveformControl::WaveformExtent> extent;
+        // Extents the board may still be playing; see Board::commandsToFPGAAtBoundary
+        std::vector<std::shared_ptr<WaveformControl::WaveformExtent>> retiredExtents;
 
         // Writer used for file logging
         std::unique_ptr<BinaryWriter> writer;
+        // Writer for the NaN mask of the log, if there is one, and the bits of its next byte
+        std::unique_ptr<BinaryWriter> maskWriter;
+        uint8_t maskByte;
+        unsigned int maskBits;
+        void logMask(bool nan, std::size_t count);
 
         friend class Chip;
+        friend class Board;
 
 		double rememberedCurrentStep;
     };
@@ -3,6 +3,8 @@
 #include "common.h"
 #include <sstream>
 #include <exception>
+#include <algorithm>
+#include <cstddef>
 #include "RAM.h"
 
 using std::string;
@@ -24,11 +26,13 @@ namespace CLAMP {
         board(board_),
         RCal1(10e6), 
         RCal2(1e6),
-		numChannels(0)
+		numChannels(0),
+		cableDelay(0)
     {
         for (unsigned int i = 0; i < MAX_NUM_CHANNELS; i++) {
             channel[i] = new Channel(*this, static_cast<ChannelNumber>(i));
         }
+        forgetAllWrites();
     }
 
     Chip::~Chip()
@@ -54,6 +58,7 @@ namespace CLAMP {
      */
     void Chip::setCableDelay(uint8_t value) {
         writeVirtualRegister(0, CheckBits(value, 4));
+        cableDelay = value;
     }
 
     void Chip::writeVirtualRegister(uint8_t address, uint16_t value) {
@@ -80,6 +85,7 @@ namespace CLAMP {
         if (mosi.C == READ) {
             Register& reg = getRegister(mosi.A);
             reg.value = miso.read.value;
+            confirmed[mosi.A] = reg.value;
         }
     }
 
@@ -111,21 +117,97 @@ namespace CLAMP {
      *  This is used at startup to establish initial values of all registers, for instance.
      *  Subsequently, most register updates affect a handful of registers only, not all.
      *
+     *  \param[in] changedOnly  If true, leave out registers whose in-memory value is already confirmed on the chip (see
+     *                          confirmWrites), e.g., to push a set of changed settings without rewriting the rest.
      *  \returns The command list.
      */
-    vector<WaveformCommand> Chip::writeAllRegistersCommands() {
+    vector<WaveformCommand> Chip::writeAllRegistersCommands(bool changedOnly) {
         vector<WaveformCommand> data;
 
+        auto add = [&](const NonrepeatingCommand& command) {
+            if (!changedOnly || confirmed[command.A] != static_cast<int16_t>(command.D)) {
+                data.push_back(command);
+            }
+        };
         for (unsigned int unit = 0; unit < MAX_NUM_CHANNELS; unit++) {
             for (unsigned int registerIndex = 0; registerIndex <= 13; registerIndex++) {
-                data.push_back(channel[unit]->registers.get(registerIndex).writeCommand());
+                add(channel[unit]->registers.get(registerIndex).writeCommand());
             }
         }
 
         for (unsigned int registerIndex = 0; registerIndex <= 3; registerIndex++) {
-            data.push_back(chipRegisters.get(registerIndex).writeCommand());
+            add(chipRegisters.get(registerIndex).writeCommand());
         }
 
         return data;
     }
+
+    /** \brief Records the values written by commands that are known to have run on this chip
+     *
+     *  \param[in] commands  Commands for any channel of this chip; the WRITE and WRITE_AND_CONVERT ones are recorded.
+     */
+    void Chip::confirmWrites(const vector<WaveformCommand>& commands) {
+        for (const WaveformCommand& command : commands) {
+            const NonrepeatingCommand& nr = command.nonrepeating;
+            if (!nr.repeating && (nr.C == WRITE || nr.C == WRITE_AND_CONVERT)) {
+                confirmed[nr.A] = nr.D;
+            }
+        }
+    }
+
+    /** \brief Forgets the values of the registers that commands write
+     *
+     *  Used when commands run in a way that doesn't tell whether (or how far) they ran, e.g., a waveform that's stopped
+     *  partway.
+     *
+     *  \param[in] channelIndex  Channel the commands belong to; repeating commands write that channel's DAC registers.
+     *  \param[in] commands      The commands.
+     */
+    void Chip::forgetWrites(unsigned int channelIndex, const vector<WaveformCommand>& commands) {
+        for (const WaveformCommand& command : commands) {
+            if (command.repeating.repeating) {
+                uint8_t index = (command.repeating.registerToWrite == RepeatingCommand::WRITE_CURRENT) ? 9 : 0;
+                confirmed[(channelIndex << 4) | index] = -1;
+            }
+            else if (command.nonrepeating.C == WRITE || command.nonrepeating.C == WRITE_AND_CONVERT) {
+                confirmed[command.nonrepeating.A] = -1;
+            }
+        }
+    }
+
+    /// Forgets every confirmed value, e.g., when the chip may have been replaced or power cycled
+    void Chip::forgetAllWrites() {
+        std::fill(confirmed, confirmed + 256, static_cast<int16_t>(-1));
+    }
+
+    /** \brief Removes writes that wouldn't change anything from the start of a command list
+     *
+     *  A plain WRITE is dropped while its register's value is confirmed to be the one being written.  Once a register has
+     *  been written with a different value, later writes to it are kept, even repeated ones, since a sequence may
+     *  repeat a write to time something (e.g., FastTransientCapacitiveCompensation::buzz).  Writes to the DAC registers
+     *  are always kept; they're repeated so the DACs settle.  WRITE_AND_CONVERT commands are kept for their conversions.
+     *
+     *  \param[in,out] commands  Command list for one channel of this chip.
+     */
+    void Chip::dropConfirmedWrites(vector<WaveformCommand>& commands) const {
+        bool changed[256] = {};
+        std::size_t kept = 0;
+        for (const WaveformCommand& command : commands) {
+            const NonrepeatingCommand& nr = command.nonrepeating;
+            if (!nr.repeating && (nr.C == WRITE || nr.C == WRITE_AND_CONVERT)) {
+                if (nr.C == WRITE && !changed[nr.A] && !isDACRegister(nr.A) && confirmed[nr.A] == static_cast<int16_t>(nr.D)) {
+                    continue;
+                }
+                changed[nr.A] = true;
+            }
+            commands[kept++] = command;
+        }
+        commands.resize(kept);
+    }
+
+    // Register N,0 (Clamp Voltage DAC) and Register N,9 (Clamp Current Source)
+    bool Chip::isDACRegister(uint8_t address) {
+        uint8_t index = address & 0xF;
+        return (address >> 4) < MAX_NUM_CHANNELS && (index == 0 || index == 9);
+    }
 }
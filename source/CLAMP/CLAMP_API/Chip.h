@@ -39,6 +39,8 @@ namespace CLAMP {
 		*  Board::initialize().
 		*/
 		int numChannels;
+		/// Cable delay last set with setCableDelay() [0-15]
+		uint8_t cableDelay;
         /** \brief In-memory representation of on-chip registers.
          *
          *  Frequently, these registers are not manipulated directly here, but rather via the ClampConfig::ClampController and its members.
@@ -53,7 +55,19 @@ namespace CLAMP {
         void setCableDelay(uint8_t value);
 
         void readBackRegister(const ChipProtocol::MOSICommand& mosi, const ChipProtocol::MISOReturn& miso);
-        std::vector<WaveformControl::WaveformCommand> writeAllRegistersCommands();
+        std::vector<WaveformControl::WaveformCommand> writeAllRegistersCommands(bool changedOnly = false);
+
+        /** \name Confirmed register values
+         *
+         *  What each register is known to hold on the chip: values read back from it, and writes that are known to have
+         *  run.  Writes of those same values again can be left out of command lists (see dropConfirmedWrites).
+         */
+        //@{
+        void confirmWrites(const std::vector<WaveformControl::WaveformCommand>& commands);
+        void forgetWrites(unsigned int channelIndex, const std::vector<WaveformControl::WaveformCommand>& commands);
+        void forgetAllWrites();
+        void dropConfirmedWrites(std::vector<WaveformControl::WaveformCommand>& commands) const;
+        //@}
 
         /// Value, in &Omega;s of RCal1 attached to this chip
         double RCal1;
@@ -61,7 +75,11 @@ namespace CLAMP {
         double RCal2;
 
     private:
+        // Last value confirmed for each register, by address (as in ChipProtocol::MOSICommand::A); -1 if unknown
+        int16_t confirmed[256];
+
         void writeVirtualRegister(uint8_t address, uint16_t value);
         Registers::Register& getRegister(uint8_t address);
+        static bool isDACRegister(uint8_t address);
     };
 }
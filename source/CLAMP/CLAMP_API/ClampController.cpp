@@ -10,6 +10,7 @@
 #include "Board.h"
 #include "streams.h"
 #include "SimplifiedWaveform.h"
+#include "Waveform.h"
 
 // TEMP
 // #include "../Common/Unit Tests/Util.h"
@@ -28,14 +29,14 @@ using namespace CLAMP::SignalProcessing;
 
 namespace CLAMP {
     namespace ClampConfig {
-        static bool logCalibrateVoltageAmplifier = true;
-        static bool logCalibrateCurrentToVoltageConverter = true;
-        static bool logCalibrateCurrentToVoltageConverterDetails = false;
-        static bool logCalibrateDifferenceAmplifier1 = true;
-        static bool logCalibrateClampVoltage = true;
-        static bool logCalibrateDifferenceAmplifier2 = true;
-        static bool logClampCurrent = true;
-        static bool logCurrentCalibrationDetails = false;
+        static const bool logCalibrateVoltageAmplifier = true;
+        static const bool logCalibrateCurrentToVoltageConverter = true;
+        static const bool logCalibrateCurrentToVoltageConverterDetails = false;
+        static const bool logCalibrateDifferenceAmplifier1 = true;
+        static const bool logCalibrateClampVoltage = true;
+        static const bool logCalibrateDifferenceAmplifier2 = true;
+        static const bool logClampCurrent = true;
+        static const bool logCurrentCalibrationDetails = false;
 
         /** \brief Constructor
          *
@@ -151,6 +152,35 @@ namespace CLAMP {
             controller.executeImmediate(channelList);
         }
 
+        // Where each of the 64 trim values' reads are in the raw data (see createOffsetTrimCommands and
+        // createCommandsToCalibrateClampVoltage): every channel gets the same commands, so the first one's say for all
+        static vector<CaptureWindow> trimWindows(ClampController& controller, const ChipChannelList& channelList) {
+            vector<IndexedWaveformCommand> waveform = controller.getChannel(channelList.front()).getIndexedWaveform();
+            vector<CaptureWindow> windows;
+            for (int index = 0; index < 64; index++) {
+                std::size_t begin = waveform[2 * index + 1].index;
+                std::size_t end = begin + waveform[2 * index + 1].command.numRepetitions() - 1;
+                assert((end - begin) > 10);
+                windows.push_back(CaptureWindow(begin, end));
+            }
+            for (auto& index : channelList) {
+                assert(controller.getChannel(index).commands.size() == waveform.size());
+                assert(controller.getBoard().readQueue.getRawData(index)[windows.front().begin] != INVALID_MUX_VALUE);
+                assert(controller.getBoard().readQueue.getRawData(index)[windows.back().end - 1] != INVALID_MUX_VALUE);
+                (void)index;
+            }
+            return windows;
+        }
+
+        // Each channel's raw data from the last run
+        static vector<const int32_t*> rawData(ClampController& controller, const ChipChannelList& channelList) {
+            vector<const int32_t*> channels;
+            for (auto& index : channelList) {
+                channels.push_back(controller.getBoard().readQueue.getRawData(index).data());
+            }
+            return channels;
+        }
+
         void DifferenceAmplifier::setOffsetTrim(const ChipChannel& chipChannel, uint8_t value) {
             registers(chipChannel).r5.value.diffAmpOffsetTrim = value;
             commands(chipChannel).push_back(registers(chipChannel).r5.writeCommand());
@@ -170,30 +200,20 @@ namespace CLAMP {
             }
         }
 
-        void DifferenceAmplifier::getBestOffsetTrimAndResidual(const ChipChannel& chipChannel) {
+        void DifferenceAmplifier::getBestOffsetTrimsAndResiduals(const ChipChannelList& channelList) {
             // 3. Adjust diff amp offset trim and repeat Step 2 until the output of the difference amplifier is as close to zero as possible.
             //    Any residual offset must be subtracted in software.
 
-            const vector<int32_t>& allRawData = controller.getBoard().readQueue.getRawData(chipChannel);
+            vector<pair<unsigned int, int32_t>> bestTrims;
+            DataAnalysis::calculateBestTrims(rawData(controller, channelList), trimWindows(controller, channelList), bestTrims);
 
-            vector<int32_t> values(64);
-            vector<IndexedWaveformCommand> waveform = controller.getChannel(chipChannel).getIndexedWaveform();
-            for (int index = 0; index < 64; index++) {
-                auto begin = allRawData.begin() + waveform[2 * index + 1].index,
-                     end = begin + waveform[2 * index + 1].command.numRepetitions() - 1;
-                assert((end - begin) > 10);
-                assert(*begin != INVALID_MUX_VALUE);
-                assert(*(end - 1) != INVALID_MUX_VALUE);
-                values[index] = DataAnalysis::calculateBestResidual(begin, end);
-            }
-
-            pair<unsigned int, int32_t> bestTrim = DataAnalysis::calculateBestTrim(values);
-
-            // Set diffAmpOffsetTrim in memory and on the chips
-            commands(chipChannel).clear();
-            setOffsetTrim(chipChannel, bestTrim.first);
+            for (std::size_t i = 0; i < channelList.size(); i++) {
+                // Set diffAmpOffsetTrim in memory and on the chips
+                commands(channelList[i]).clear();
+                setOffsetTrim(channelList[i], bestTrims[i].first);
 
-            controller.getChannel(chipChannel).differenceAmpResidual = bestTrim.second;
+                controller.getChannel(channelList[i]).differenceAmpResidual = bestTrims[i].second;
+            }
         }
 
         /** \brief Executes the "Difference Amplifier Calibration: Part 1" routine in the data sheet.
@@ -207,8 +227,11 @@ namespace CLAMP {
         void DifferenceAmplifier::calibrate1(const ChipChannelList& channelList) {
 
             // 1. Connect the diff amp in + select and diff amp in - select switches to ground.
-            setInPlusImmediate(channelList, true);
-            setInMinusImmediate(channelList, true);
+            for (auto& index : channelList) {
+                setInPlus(index, true);
+                setInMinus(index, true);
+            }
+            controller.executeImmediate(channelList);
 
             controller.getBoard().enableChannels(channelList);
 
@@ -224,8 +247,8 @@ namespace CLAMP {
 
             LOG(logCalibrateDifferenceAmplifier1) << "Chan" << "\t" << "Cal" << "\t" << "Res" << "\n";
 
+            getBestOffsetTrimsAndResiduals(channelList);
             for (auto& index : channelList) {
-                getBestOffsetTrimAndResidual(index);
                 uint16_t value = registers(index).r5.value.diffAmpOffsetTrim;
                 LOG(logCalibrateDifferenceAmplifier1) << controller.getChannel(index).channelIndex << "\t" << value << "\t" << controller.getChannel(index).differenceAmpResidual << "\n";
                 if (value == 0 || value == 63) {
@@ -233,13 +256,16 @@ namespace CLAMP {
                 }
             }
 
-            // Now push the values to the chips (they're set in getBestOffsetTrimAndResidual)
+            // Now push the values to the chips (they're set in getBestOffsetTrimsAndResiduals)
             controller.executeImmediate(channelList);
             LOG(logCalibrateDifferenceAmplifier1) << "\n";
 
             // 4. Restore the diff amp in + select and diff amp in - select switches to their default positions.
-            setInPlusImmediate(channelList, false);
-            setInMinusImmediate(channelList, false);
+            for (auto& index : channelList) {
+                setInPlus(index, false);
+                setInMinus(index, false);
+            }
+            controller.executeImmediate(channelList);
         }
 
         /** \brief Executes the "Difference Amplifier Calibration: Part 2" routine in the data sheet.
@@ -251,15 +277,19 @@ namespace CLAMP {
          *  \param[in] channelList  List of chip/channel pairs to apply this operation to.
          */
         void DifferenceAmplifier::calibrate2(const ChipChannelList& channelList) {
-            // 1. Open the voltage clamp connect switch. 
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, false);
-            //    Select the smallest value of the feedback resistance (i.e., 200 kOhms).  
-            controller.currentToVoltageConverter.setFeedbackResistanceImmediate(channelList, Register3::R200k);
-            //    Select the largest value of feedback capacitance (i.e., 51 pF).
-            controller.currentToVoltageConverter.setFeedbackCapacitanceImmediate(channelList, MAX_FEEDBACK_CAPACITANCE);
+            // Steps 1 and 2 go out as a single command sequence
+            for (auto& index : channelList) {
+                // 1. Open the voltage clamp connect switch. 
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, false);
+                //    Select the smallest value of the feedback resistance (i.e., 200 kOhms).  
+                controller.currentToVoltageConverter.setFeedbackResistance(index, Register3::R200k);
+                //    Select the largest value of feedback capacitance (i.e., 51 pF).
+                controller.currentToVoltageConverter.setFeedbackCapacitance(index, MAX_FEEDBACK_CAPACITANCE);
 
-            // 2. Set the clamp voltage magnitude to zero.
-            controller.clampVoltageGenerator.setClampVoltageImmediate(channelList, 0);
+                // 2. Set the clamp voltage magnitude to zero.
+                controller.clampVoltageGenerator.setClampVoltage(index, 0);
+            }
+            controller.executeImmediate(channelList);
 
 
             controller.getBoard().enableChannels(channelList);
@@ -275,8 +305,8 @@ namespace CLAMP {
 
             LOG(logCalibrateDifferenceAmplifier2) << "Chan" << "\t" << "Cal" << "\t" << "Res" << "\n";
 
+            getBestOffsetTrimsAndResiduals(channelList);
             for (auto& index : channelList) {
-                getBestOffsetTrimAndResidual(index);
                 uint16_t value = registers(index).r5.value.diffAmpOffsetTrim;
                 LOG(logCalibrateDifferenceAmplifier2) << controller.getChannel(index).channelIndex << "\t" << value << "\t" << controller.getChannel(index).differenceAmpResidual << "\n";
                 if (value == 0 || value == 63) {
@@ -284,7 +314,7 @@ namespace CLAMP {
                 }
             }
 
-            // Now push the values to the chips (they're set in getBestOffsetTrimAndResidual)
+            // Now push the values to the chips (they're set in getBestOffsetTrimsAndResiduals)
             controller.executeImmediate(channelList);
             LOG(logCalibrateDifferenceAmplifier2) << "\n";
 
@@ -487,7 +517,7 @@ namespace CLAMP {
         }
 
         void CurrentToVoltageConverter::calculateMeasuredRValue(const ChipChannel& chipChannel, Register3::Resistance r) {
-            const vector<double>& allMuxData = controller.getBoard().readQueue.getMuxData(chipChannel);
+            const vector<Sample>& allMuxData = controller.getBoard().readQueue.getMuxData(chipChannel);
 
             vector<double> appliedVoltage;
             vector<double> measuredVoltage;
@@ -561,11 +591,14 @@ namespace CLAMP {
         }
 
         void CurrentToVoltageConverter::calibrateOneR(const ChipChannelList& channelList, Register3::Resistance r) {
-            // 1. Close the voltage clamp connect switch.
-            setVoltageClampConnectImmediate(channelList, true);
+            // Steps 1 and 2, and the switch settings below, go out as a single command sequence
+            for (auto& index : channelList) {
+                // 1. Close the voltage clamp connect switch.
+                setVoltageClampConnect(index, true);
 
-            // 2. Set the clamp step size of the clamp voltage generator to the 5 mV step size, which is more accurate than the 2.5 mV step size.
-            controller.clampVoltageGenerator.setClampStepSizeImmediate(channelList, true);
+                // 2. Set the clamp step size of the clamp voltage generator to the 5 mV step size, which is more accurate than the 2.5 mV step size.
+                controller.clampVoltageGenerator.setClampStepSize(index, true);
+            }
 
             // Set the input select switch to one of the calibration resistors(Rcal1 or Rcal2).
             // . . .
@@ -591,11 +624,15 @@ namespace CLAMP {
 			// Override above algorithm and force calibration routine to use RCal1 ONLY.  (Headstage board does not have RCal2 populated.)
 			mostRecentCalibrationResistor = Register8::InputSelect::RCal1;
 
-			controller.offChipComponents.setInputImmediate(channelList, mostRecentCalibrationResistor);
 			LOG(logCalibrateCurrentToVoltageConverterDetails) << "Calibration resistor: " << mostRecentCalibrationResistor << "\n";
 
-            // Set the feedback resistor and capacitor values
-            controller.currentToVoltageConverter.setFeedbackResistanceAndCapacitanceImmediate(channelList, r);
+            for (auto& index : channelList) {
+                controller.offChipComponents.setInput(index, mostRecentCalibrationResistor);
+
+                // Set the feedback resistor and capacitor values
+                setFeedbackResistanceAndCapacitance(index, r);
+            }
+            controller.executeImmediate(channelList);
 
 
 
@@ -614,10 +651,13 @@ namespace CLAMP {
             controller.getBoard().clearCommands();
 
             // Restore 0 voltage, clamp step size, and connection
-            controller.clampVoltageGenerator.setClampVoltageImmediate(channelList, 0);
-            controller.offChipComponents.setInputImmediate(channelList, Register8::Open0);
-            controller.clampVoltageGenerator.setClampStepSizeImmediate(channelList, false);
-            setVoltageClampConnectImmediate(channelList, false);
+            for (auto& index : channelList) {
+                controller.clampVoltageGenerator.setClampVoltage(index, 0);
+                controller.offChipComponents.setInput(index, Register8::Open0);
+                controller.clampVoltageGenerator.setClampStepSize(index, false);
+                setVoltageClampConnect(index, false);
+            }
+            controller.executeImmediate(channelList);
         }
 
         /** \brief Executes the "Current-to-Voltage Converter Calibration" routine in the data sheet.
@@ -751,32 +791,21 @@ namespace CLAMP {
             }
         }
 
-        void ClampVoltageGenerator::getBestOffsetTrim(const ChipChannel& chipChannel) {
+        void ClampVoltageGenerator::getBestOffsetTrims(const ChipChannelList& channelList) {
             // 4. Measure the output of the difference amplifier.
             // 5. Adjust clamp voltage offset trim and repeat Step 4 until the output of the difference amplifier is as close to zero as possible.
 
-            const vector<int32_t>& allRawData = controller.getBoard().readQueue.getRawData(chipChannel);
-
-
-            vector<int32_t> values(64);
-            vector<IndexedWaveformCommand> waveform = controller.getChannel(chipChannel).getIndexedWaveform();
-            for (int index = 0; index < 64; index++) {
-                auto begin = allRawData.begin() + waveform[2 * index + 1].index,
-                     end = begin + waveform[2 * index + 1].command.numRepetitions() - 1;
-                assert((end - begin) > 10);
-                assert(*begin != INVALID_MUX_VALUE);
-                assert(*(end - 1) != INVALID_MUX_VALUE);
-                values[index] = DataAnalysis::calculateBestResidual(begin, end);
-            }
-
-            pair<unsigned int, int32_t> bestTrim = DataAnalysis::calculateBestTrim(values);
+            vector<pair<unsigned int, int32_t>> bestTrims;
+            DataAnalysis::calculateBestTrims(rawData(controller, channelList), trimWindows(controller, channelList), bestTrims);
 
-            // Set diffAmpOffsetTrim in memory and on the chips
-            commands(chipChannel).clear();
-            setClampVoltageOffsetTrim(chipChannel, bestTrim.first);
-            LOG(logCalibrateClampVoltage) << "Channel: " << controller.getChannel(chipChannel).channelIndex << "\t" << bestTrim.first << "\n";
-            if (bestTrim.first == 0 || bestTrim.first == 63) {
-                LOG(true) << "Warning: best trim is at limit " << bestTrim.first << "\n";
+            for (std::size_t i = 0; i < channelList.size(); i++) {
+                // Set diffAmpOffsetTrim in memory and on the chips
+                commands(channelList[i]).clear();
+                setClampVoltageOffsetTrim(channelList[i], bestTrims[i].first);
+                LOG(logCalibrateClampVoltage) << "Channel: " << controller.getChannel(channelList[i]).channelIndex << "\t" << bestTrims[i].first << "\n";
+                if (bestTrims[i].first == 0 || bestTrims[i].first == 63) {
+                    LOG(true) << "Warning: best trim is at limit " << bestTrims[i].first << "\n";
+                }
             }
         }
 
@@ -788,19 +817,23 @@ namespace CLAMP {
          *  \param[in] channelList  List of chip/channel pairs to apply this operation to.
          */
         void ClampVoltageGenerator::calibrate(const ChipChannelList& channelList) {
-            // 1. Connect the diff amp in- select switch to ground.
-            controller.differenceAmplifier.setInMinusImmediate(channelList, true);
+            // Steps 1-3 go out as a single command sequence
+            for (auto& index : channelList) {
+                // 1. Connect the diff amp in- select switch to ground.
+                controller.differenceAmplifier.setInMinus(index, true);
 
-            // 2. Open the voltage clamp connect switch.  
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, false);
+                // 2. Open the voltage clamp connect switch.  
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, false);
 
-            //    Select the smallest value of the feedback resistance (i.e., 200 kOhms).  
-            controller.currentToVoltageConverter.setFeedbackResistanceImmediate(channelList, Register3::R200k);
-            //    Select the largest value of feedback capacitance (i.e., 51 pF).
-            controller.currentToVoltageConverter.setFeedbackCapacitanceImmediate(channelList, MAX_FEEDBACK_CAPACITANCE);
+                //    Select the smallest value of the feedback resistance (i.e., 200 kOhms).  
+                controller.currentToVoltageConverter.setFeedbackResistance(index, Register3::R200k);
+                //    Select the largest value of feedback capacitance (i.e., 51 pF).
+                controller.currentToVoltageConverter.setFeedbackCapacitance(index, MAX_FEEDBACK_CAPACITANCE);
 
-            // 3. Set the clamp voltage magnitude to zero.  The settings of clamp voltage sign and clamp step size do not matter.
-            setClampVoltageImmediate(channelList, 0);
+                // 3. Set the clamp voltage magnitude to zero.  The settings of clamp voltage sign and clamp step size do not matter.
+                setClampVoltage(index, 0);
+            }
+            controller.executeImmediate(channelList);
 
             controller.getBoard().enableChannels(channelList);
 
@@ -813,11 +846,9 @@ namespace CLAMP {
             controller.getBoard().commandsToFPGA();
             controller.getBoard().runAndReadOneCycle(0);
 
-            for (auto& index : channelList) {
-                getBestOffsetTrim(index);
-            }
+            getBestOffsetTrims(channelList);
 
-            // Now push the values to the chips (they're set in getBestOffsetTrim)
+            // Now push the values to the chips (they're set in getBestOffsetTrims)
             controller.executeImmediate(channelList);
             LOG(logCalibrateClampVoltage) << "\n";
 
@@ -1074,17 +1105,19 @@ namespace CLAMP {
             controller.createRepeatingWriteVoltage(chipChannel, RepeatingCommand::READ_VOLTAGE, false, false, 0, numRepeats);
         }
 
-        void VoltageAmplifier::getBestResidual(const ChipChannel& chipChannel) {
+        void VoltageAmplifier::getBestResiduals(const ChipChannelList& channelList) {
             //4. Store this value in software and subtract it from successive voltage amplifier measurements.
-            const vector<int32_t>& allRawData = controller.getBoard().readQueue.getRawData(chipChannel);
-            auto begin = allRawData.begin(),
-                    end = allRawData.end() - 1;
+            std::size_t end = controller.getBoard().readQueue.getRawData(channelList.front()).size() - 1;
+            assert(end > 10);
+            vector<CaptureWindow> windows(1, CaptureWindow(0, end));
 
-            assert((end - begin) > 10);
-            assert(*begin != INVALID_MUX_VALUE);
-            assert(*(end - 1) != INVALID_MUX_VALUE);
-
-            controller.getChannel(chipChannel).voltageAmpResidual = DataAnalysis::calculateBestResidual(begin, end);
+            vector<int32_t> residuals;
+            DataAnalysis::calculateBestResiduals(rawData(controller, channelList), windows, residuals);
+            for (std::size_t i = 0; i < channelList.size(); i++) {
+                assert(controller.getBoard().readQueue.getRawData(channelList[i])[0] != INVALID_MUX_VALUE);
+                assert(controller.getBoard().readQueue.getRawData(channelList[i])[end - 1] != INVALID_MUX_VALUE);
+                controller.getChannel(channelList[i]).voltageAmpResidual = residuals[i];
+            }
         }
 
         /** \brief Executes the "Voltage Amplifier Calibration" routine in the data sheet.
@@ -1099,20 +1132,24 @@ namespace CLAMP {
         void VoltageAmplifier::calibrate(const ChipChannelList& channelList) {
             LOG(logCalibrateVoltageAmplifier) << "Calibrating Voltage Amplifier\n";
 
-            //2. Open the voltage clamp connect switch.
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, false);
+            // The switch settings go out as a single command sequence
+            for (auto& index : channelList) {
+                //2. Open the voltage clamp connect switch.
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, false);
 
-            //   Set the input select switch to ground.
-            controller.offChipComponents.setInputImmediate(channelList, Register8::InputSelect::Ground);
+                //   Set the input select switch to ground.
+                controller.offChipComponents.setInput(index, Register8::InputSelect::Ground);
 
-            //1. Disable fast transient compensation. (Make sure the fast trans connect switch is open.) 
-            controller.fastTransientCapacitiveCompensation.setConnectImmediate(channelList, false);
+                //1. Disable fast transient compensation. (Make sure the fast trans connect switch is open.) 
+                controller.fastTransientCapacitiveCompensation.setConnect(index, false);
 
-            //   Make sure the voltage amp power bit is set.
-            controller.voltageAmplifier.setPowerImmediate(channelList, true);
+                //   Make sure the voltage amp power bit is set.
+                setPower(index, true);
 
-            //   Make sure the clamp current enable switch is open. 
-            controller.clampCurrentGenerator.setEnableImmediate(channelList, false);
+                //   Make sure the clamp current enable switch is open. 
+                controller.clampCurrentGenerator.setEnable(index, false);
+            }
+            controller.executeImmediate(channelList);
 
             controller.getBoard().enableChannels(channelList);
 
@@ -1130,9 +1167,9 @@ namespace CLAMP {
 
             LOG(logCalibrateVoltageAmplifier) << "Chan" << "\t" << "Res" << "\n";
 
+            //4. Store this value in software and subtract it from successive voltage amplifier measurements.
+            getBestResiduals(channelList);
             for (auto& index : channelList) {
-                //4. Store this value in software and subtract it from successive voltage amplifier measurements.
-                getBestResidual(index);
                 LOG(logCalibrateVoltageAmplifier) << controller.getChannel(index).channelIndex << "\t" << controller.getChannel(index).voltageAmpResidual << "\n";
             }
             LOG(logCalibrateVoltageAmplifier) << "\n";
@@ -1143,8 +1180,11 @@ namespace CLAMP {
             controller.getBoard().clearCommands();
 
             //5. Restore the voltage clamp connect and input select switches to their default positions.
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, false);
-            controller.offChipComponents.setInputImmediate(channelList, Register8::InputSelect::Open0);
+            for (auto& index : channelList) {
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, false);
+                controller.offChipComponents.setInput(index, Register8::InputSelect::Open0);
+            }
+            controller.executeImmediate(channelList);
 
 			// TEMP
 			// controller.getChannel(channelList[0]).closeRawFile();
@@ -1210,7 +1250,7 @@ namespace CLAMP {
             return false;
         }
 
-        bool ClampCurrentCalibrationHelper::binaryStepInit(const ChipChannel& chipChannel) {
+        bool ClampCurrentCalibrationHelper::binaryStepInit(const ChipChannel& chipChannel, unsigned int numCandidates) {
             if ((left.coarse >= right.coarse) && (left.fine >= right.fine)) {
                 // Kind of a no-op
                 mid = left;
@@ -1218,20 +1258,27 @@ namespace CLAMP {
                 return false;
             }
 
-            if (left.coarse < right.coarse) {
-                mid.coarse = (left.coarse + right.coarse) / 2;
-                mid.fine = 64;
-            } else {
-                // left.first = right.first
-                // left.second < right.second
-                mid.coarse = left.coarse;
-                mid.fine = (left.fine + right.fine) / 2;
+            // numCandidates evenly spaced points; with one, that's the midpoint
+            candidates.clear();
+            for (unsigned int i = 1; i <= numCandidates; i++) {
+                CurrentCalibration candidate;
+                if (left.coarse < right.coarse) {
+                    candidate.coarse = left.coarse + (right.coarse - left.coarse) * i / (numCandidates + 1);
+                    candidate.fine = 64;
+                } else {
+                    // left.first = right.first
+                    // left.second < right.second
+                    candidate.coarse = left.coarse;
+                    candidate.fine = left.fine + (right.fine - left.fine) * i / (numCandidates + 1);
+                }
+                if (candidates.empty() || candidates.back().coarse != candidate.coarse || candidates.back().fine != candidate.fine) {
+                    candidates.push_back(candidate);
+                }
             }
-
-            vector<CurrentCalibration> bounds = { mid };
+            mid = candidates.front();
 
             controller.getChannel(chipChannel).commands.clear();
-            controller.clampCurrentGenerator.createCommandsToCalibrateClampCurrent(chipChannel, positiveCurrent, stepSize, bounds);
+            controller.clampCurrentGenerator.createCommandsToCalibrateClampCurrent(chipChannel, positiveCurrent, stepSize, candidates);
             return true;
         }
 
@@ -1256,9 +1303,29 @@ namespace CLAMP {
 
 
         void ClampCurrentCalibrationHelper::binaryOneStep(const ChipChannel& chipChannel) {
-            vector<double> tmp = controller.clampCurrentGenerator.getMeasuredCurrentsForCalibration(chipChannel, controller.getChannel(chipChannel));
-            double midCurrent = tmp[0];
+            vector<double> currents = controller.clampCurrentGenerator.getMeasuredCurrentsForCalibration(chipChannel, controller.getChannel(chipChannel));
+
+            // |current| decreases as the setting increases, so apply the measurements in order until one lands at or below target;
+            // the ones after that are outside the new interval
+            for (std::size_t i = 0; i < candidates.size() && i < currents.size(); i++) {
+                bool pastRight = (candidates[i].coarse > right.coarse) || (candidates[i].coarse == right.coarse && candidates[i].fine > right.fine);
+                if (pastRight) {
+                    break;
+                }
+                bool beforeLeft = (candidates[i].coarse < left.coarse) || (candidates[i].coarse == left.coarse && candidates[i].fine < left.fine);
+                if (beforeLeft) {
+                    continue;
+                }
+                mid = candidates[i];
+                narrow(currents[i]);
+                if (fabs(currents[i]) <= target) {
+                    break;
+                }
+            }
+        }
 
+        // One binary search step: shrinks [left, right] given the current measured at mid
+        void ClampCurrentCalibrationHelper::narrow(double midCurrent) {
             LOG(logCurrentCalibrationDetails) << "(" << (int)left.coarse << "," << (int)left.fine << ")" << "\t" << leftCurrent << "\t"
                 << "(" << (int)mid.coarse << "," << (int)mid.fine << ")" << "\t" << midCurrent << "\t"
                 << "(" << (int)right.coarse << "," << (int)right.fine << ")" << "\t" << rightCurrent << "\t"
@@ -1360,7 +1427,8 @@ namespace CLAMP {
         //-------------------------------------------------------------------------
         /// Constructor
         ClampCurrentGenerator::ClampCurrentGenerator(ClampController& c) :
-            ChipComponent(c)
+            ChipComponent(c),
+            searchCandidatesPerStep(1)
         {
 
         }
@@ -1585,7 +1653,7 @@ namespace CLAMP {
                 bool keepGoing = false;
                 for (auto& index : channelList) {
                     Channel& thisChannel = controller.getChannel(index);
-                    bool stepNeeded = thisChannel.calibrationHelper.binaryStepInit(index);
+                    bool stepNeeded = thisChannel.calibrationHelper.binaryStepInit(index, std::max(searchCandidatesPerStep, 1u));
                     keepGoing = keepGoing || stepNeeded;
                 }
 
@@ -1682,15 +1750,19 @@ namespace CLAMP {
         }
 
         void ClampCurrentGenerator::calibrateClampCurrent_Internal(const ChipChannelList& channelList, CurrentScale scale, bool positiveCurrent_) {
-            //    Close the voltage clamp connect switch.
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, true);
-            //    Set the clamp voltage magnitude to zero.
-            controller.clampVoltageGenerator.setClampVoltageImmediate(channelList, 0);
-            // 1. Set the input select switch to open circuit.
-            controller.offChipComponents.setInputImmediate(channelList, Register8::Open0);
+            // The setup goes out as a single command sequence
+            for (auto& index : channelList) {
+                //    Close the voltage clamp connect switch.
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, true);
+                //    Set the clamp voltage magnitude to zero.
+                controller.clampVoltageGenerator.setClampVoltage(index, 0);
+                // 1. Set the input select switch to open circuit.
+                controller.offChipComponents.setInput(index, Register8::Open0);
 
-            // 2. Close the clamp current enable switch.
-            setEnableImmediate(channelList, true);
+                // 2. Close the clamp current enable switch.
+                setEnable(index, true);
+            }
+            controller.executeImmediate(channelList);
 
             for (auto& index : channelList) {
                 Channel& thisChannel = controller.getChannel(index);
@@ -1723,14 +1795,17 @@ namespace CLAMP {
             }
             controller.getBoard().clearCommands();
 
-            // Restore 0 current
-            setEnableImmediate(channelList, false);
-            // Open the voltage clamp connect switch.
-            controller.currentToVoltageConverter.setVoltageClampConnectImmediate(channelList, false);
+            for (auto& index : channelList) {
+                // Restore 0 current
+                setEnable(index, false);
+                // Open the voltage clamp connect switch.
+                controller.currentToVoltageConverter.setVoltageClampConnect(index, false);
+            }
+            controller.executeImmediate(channelList);
         }
 
         vector<double> ClampCurrentGenerator::getMeasuredCurrentsForCalibration(const ChipChannel& chipChannel, Channel& thisChannel) {
-            const vector<double>& allCurrents = controller.getBoard().readQueue.getMeasuredCurrents(chipChannel);
+            const vector<Sample>& allCurrents = controller.getBoard().readQueue.getMeasuredCurrents(chipChannel);
 
             vector<IndexedWaveformCommand> waveform = thisChannel.getIndexedWaveform();
 
@@ -1841,21 +1916,63 @@ namespace CLAMP {
          * \returns Temperature in C.
          */
         double TemperatureSensor::readTemperature(unsigned int chip) {
-            ChipChannelList channelList = { ChipChannel(chip, 0) };
-            controller.getBoard().enableChannels(channelList);
+            return readTemperatures({ chip }).front();
+        }
+
+        /** \brief Reads the temperatures of several chips, in one run.
+         *
+         *  Each chip runs the same sensing sequence, so this takes no longer than reading one of them.
+         *
+         *  \param[in] chips     %Chip indices [0-7]
+         *  \param[in] checkRom  Also read each chip's ROM registers at the end of the run
+         *  \param[out] romOk    With checkRom, whether each chip's ROM read back as "INTAN" (i.e., it still answers correctly)
+         *  \returns Temperatures in C, in the order of chips.
+         */
+        vector<double> TemperatureSensor::readTemperatures(const vector<unsigned int>& chips, bool checkRom, vector<bool>* romOk) {
+            vector<double> temperaturesC;
+            if (chips.empty()) {
+                return temperaturesC;
+            }
+            Board& board = controller.getBoard();
+            ChipChannelList channelList;
+            for (unsigned int chip : chips) {
+                channelList.push_back(ChipChannel(chip, 0));
+            }
+            board.enableChannels(channelList);
 
             // Create commands
-            createTemperatureSenseCommands(channelList.front());
+            vector<WaveformCommand> romCommands = checkRom ? CommonWaveForms::readROMCommands() : vector<WaveformCommand>();
+            for (auto& index : channelList) {
+                createTemperatureSenseCommands(index);
+                if (checkRom) {
+                    commands(index).insert(commands(index).end(), romCommands.begin(), romCommands.end());
+                }
+            }
 
-            controller.getBoard().commandsToFPGA();
-            controller.getBoard().runAndReadOneCycle(0);
+            board.commandsToFPGA();
+            {
+                ReadQueue::CommandRetention retention(board.readQueue); // For the ROM check's readBackAll
+                board.runAndReadOneCycle(chips.front());
+            }
 
-            double temperatureC = getTemperature(channelList.front());
+            for (auto& index : channelList) {
+                temperaturesC.push_back(getTemperature(index));
+            }
 
-            controller.getBoard().readQueue.clear();
-            controller.getBoard().clearCommands();
+            if (checkRom) {
+                board.readBackAll();
+                if (romOk) {
+                    romOk->clear();
+                    for (auto& index : channelList) {
+                        romOk->push_back(controller.getChip(index).chipRegisters.getCompanyDesignation() == L"INTAN");
+                    }
+                }
+            }
 
-            return temperatureC;
+            board.readQueue.clear();
+            board.clearCommands();
+
+            return temperaturesC;
         }
 
         unsigned int TemperatureSensor::numCycles(double time) {
@@ -1908,7 +2025,7 @@ namespace CLAMP {
         }
 
         double TemperatureSensor::getTemperature(const ChipChannel& chipChannel) {
-            const vector<double>& result = controller.getBoard().readQueue.getMuxData(chipChannel);
+            const vector<Sample>& result = controller.getBoard().readQueue.getMuxData(chipChannel);
             double avg = DataAnalysis::average(result.begin() + startOffset + 1, result.begin() + endOffset + 1);
 
             // Convert from Volts to degrees C
@@ -1927,7 +2044,9 @@ namespace CLAMP {
             fastTransientCapacitiveCompensation(*this),
             mux(*this),
             temperatureSensor(*this),
-            theBoard(board)
+            theBoard(board),
+            transactionDepth(0),
+            waveformCacheClock(0)
         {
         }
 
@@ -2006,15 +2125,113 @@ namespace CLAMP {
          *  \param[in] channelList  List of chip/channel pairs to apply this operation to.
          */
         void ClampController::executeImmediate(const ChipChannelList& channelList) {
-            getBoard().enableChannels(channelList);
+            if (transactionDepth > 0) {
+                for (auto& index : channelList) {
+                    auto same = [&index](const ChipChannel& other) { return other.chip == index.chip && other.channel == index.channel; };
+                    if (std::find_if(pendingImmediate.begin(), pendingImmediate.end(), same) == pendingImmediate.end()) {
+                        pendingImmediate.push_back(index);
+                    }
+                }
+                return;
+            }
+            runImmediate(channelList);
+        }
+
+        void ClampController::runImmediate(const ChipChannelList& channelList) {
+            if (channelList.empty()) {
+                return;
+            }
+            ChipChannelList toRun = dropConfirmedWrites(channelList);
+            if (!toRun.empty()) {
+                getBoard().enableChannels(toRun);
 
-            getBoard().commandsToFPGA();
-            getBoard().runAndReadOneCycle(channelList.front().chip); // TODO: What about other chips?
-            getBoard().readQueue.clear();
+                // Run long enough for the chip with the most commands
+                unsigned int longestChip = toRun.front().chip;
+                for (auto& index : toRun) {
+                    if (getBoard().getNumTimesteps(index.chip) > getBoard().getNumTimesteps(longestChip)) {
+                        longestChip = index.chip;
+                    }
+                }
+
+                getBoard().commandsToFPGA();
+                getBoard().runAndReadOneCycle(longestChip);
+                getBoard().readQueue.clear();
+                for (auto& index : toRun) {
+                    getChip(index).confirmWrites(getChannel(index).commands);
+                }
+            }
             //getBoard().clearCommands();
 			getBoard().clearSelectedCommands(channelList);
         }
 
+        /* Takes the writes the chips already have out of the channels' command lists (see Chip::dropConfirmedWrites).
+         * A chip's channels are padded back to one length with ROM reads, so that the run is long enough for all of
+         * them; chips with nothing left to write are left out.  Returns the channels that still need to run.
+         */
+        ChipChannelList ClampController::dropConfirmedWrites(const ChipChannelList& channelList) {
+            uint32_t longest[MAX_NUM_CHIPS] = {};
+            for (auto& index : channelList) {
+                vector<WaveformCommand>& commands = getChannel(index).commands;
+                getChip(index).dropConfirmedWrites(commands);
+                longest[index.chip] = std::max(longest[index.chip], numRepetitions(commands));
+            }
+
+            ChipChannelList toRun;
+            for (auto& index : channelList) {
+                if (longest[index.chip] == 0) {
+                    continue;
+                }
+                vector<WaveformCommand>& commands = getChannel(index).commands;
+                uint32_t length = numRepetitions(commands);
+                commands.insert(commands.end(), longest[index.chip] - length, NonrepeatingCommand::create(READ, None, 0xFF, 0));
+                toRun.push_back(index);
+            }
+            return toRun;
+        }
+
+        /// Constructor; see ImmediateTransaction
+        ClampController::ImmediateTransaction::ImmediateTransaction(ClampController& c) :
+            controller(c),
+            committed(false)
+        {
+            if (controller.transactionDepth++ == 0) {
+                for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+                    for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                        numCommands[chip][channel] = controller.getChannel(ChipChannel(chip, channel)).commands.size();
+                    }
+                }
+            }
+        }
+
+        /// Destructor; operations that weren't committed are dropped, and their commands taken back out
+        ClampController::ImmediateTransaction::~ImmediateTransaction() {
+            if (--controller.transactionDepth == 0 && !committed) {
+                for (auto& index : controller.pendingImmediate) {
+                    vector<WaveformCommand>& commands = controller.getChannel(index).commands;
+                    if (commands.size() > numCommands[index.chip][index.channel]) {
+                        commands.resize(numCommands[index.chip][index.channel]);
+                    }
+                }
+                controller.pendingImmediate.clear();
+            }
+        }
+
+        /** \brief Runs the queued operations.
+         *
+         *  For a nested transaction, this only marks it as done; the outermost one runs everything.
+         */
+        void ClampController::ImmediateTransaction::commit() {
+            if (committed) {
+                return;
+            }
+            committed = true;
+            if (controller.transactionDepth == 1) {
+                ChipChannelList pending;
+                pending.swap(controller.pendingImmediate);
+                controller.runImmediate(pending);
+            }
+        }
+
         void ClampController::createRepeating(const ChipChannel& chipChannel, RepeatingCommand::WriteType write, RepeatingCommand::ReadType read, bool markerOut, bool digOut, uint16_t L, uint32_t numRepeats) {
             if (numRepeats > 0xFFFF) {
                 getChannel(chipChannel).commands.push_back(RepeatingCommand::create(write, read, RepeatingCommand::LITERAL, true, markerOut, digOut, L, numRepeats >> 16));
@@ -2030,10 +2247,7 @@ namespace CLAMP {
          *  \param[in] numRepeats   How many timesteps it should repeat for
          */
         void ClampController::createRepeatingWriteCurrent(const ChipChannel& chipChannel, RepeatingCommand::ReadType read, bool markerOut, bool digOut, int8_t value, uint32_t numRepeats) {
-            Register9 r9;
-            r9.setValue(value);
-
-            createRepeating(chipChannel, RepeatingCommand::WRITE_CURRENT, read, markerOut, digOut, static_cast<uint16_t>(r9), numRepeats);
+            createRepeating(chipChannel, RepeatingCommand::WRITE_CURRENT, read, markerOut, digOut, static_cast<uint16_t>(encodeClampCurrent(value)), numRepeats);
         }
 
         /** \brief Helper function to create a repeating command in voltage clamp mode
@@ -2044,10 +2258,7 @@ namespace CLAMP {
          *  \param[in] numRepeats   How many timesteps it should repeat for
          */
         void ClampController::createRepeatingWriteVoltage(const ChipChannel& chipChannel, RepeatingCommand::ReadType read, bool markerOut, bool digOut, int16_t value, uint32_t numRepeats) {
-            Register0 r0;
-            r0.setValue(value);
-
-            createRepeating(chipChannel, RepeatingCommand::WRITE_VOLTAGE, read, markerOut, digOut, static_cast<uint16_t>(r0), numRepeats);
+            createRepeating(chipChannel, RepeatingCommand::WRITE_VOLTAGE, read, markerOut, digOut, static_cast<uint16_t>(encodeClampVoltage(value)), numRepeats);
         }
 
         /** \brief Switches to Voltage Clamp mode
@@ -2180,25 +2391,124 @@ namespace CLAMP {
          *  \param[in] isVoltageClamp           True for voltage clamp (command list will write voltage and read current),
          *                                      false for current clamp (command list will write current and read voltage).
          *  \param[in] simplifiedWaveform       SimplifiedWaveform to convert.
+         *
+         *  Conversions are cached (see clearWaveformCache), so running the same waveform again doesn't regenerate the
+         *  commands.  When the waveform makes up a channel's whole command list, the cache also keeps the commands
+         *  resident in Waveform RAM, so the following Board::commandsToFPGA shares them rather than uploading them again.
          */
         void ClampController::simplifiedWaveformToWaveform(const ChipChannelList& channelList, bool isVoltageClamp, SimplifiedWaveform& simplifiedWaveform) {
+            if (channelList.empty()) {
+                return;
+            }
+            CompiledWaveform& compiled = compileWaveform(isVoltageClamp, simplifiedWaveform);
+
             for (auto& index : channelList) {
                 Channel& channel = getChannel(index);
-                for (unsigned int i = 0; i < simplifiedWaveform.size(); i++) {
-                    unsigned int sz = channel.commands.size();
-
-                    int value = simplifiedWaveform.waveform[i].appliedDiscreteValue;
-					bool markerOut = simplifiedWaveform.waveform[i].markerOut;
-					bool digOut = simplifiedWaveform.waveform[i].digOut;
-                    unsigned int numReps = getBoard().channelRepetition * simplifiedWaveform.waveform[i].numReps();
-                    if (isVoltageClamp) {
-                        createRepeatingWriteVoltage(index, RepeatingCommand::READ_CURRENT, markerOut, digOut, value, numReps);
-                    }
-                    else {
-                        createRepeatingWriteCurrent(index, RepeatingCommand::READ_VOLTAGE, markerOut, digOut, value, numReps);
-                    }
+                bool wholeCommandList = channel.commands.empty();
+                channel.commands.insert(channel.commands.end(), compiled.commands.begin(), compiled.commands.end());
+                if (wholeCommandList) {
+                    pinWaveform(compiled);
+                }
+            }
+            for (unsigned int i = 0; i < simplifiedWaveform.size(); i++) {
+                simplifiedWaveform.waveform[i].numCommands = compiled.segments[i].numCommands;
+            }
+        }
+
+        /** \brief Discards the cached conversions made by simplifiedWaveformToWaveform.
+         *
+         *  This also releases the Waveform RAM they were keeping resident.
+         */
+        void ClampController::clearWaveformCache() {
+            waveformCache.clear();
+        }
+
+        // Returns the cached conversion of simplifiedWaveform, creating it (and evicting the least recently used one) if needed
+        ClampController::CompiledWaveform& ClampController::compileWaveform(bool isVoltageClamp, const SimplifiedWaveform& simplifiedWaveform) {
+            const unsigned int MAX_CACHED_WAVEFORMS = 2 * MAX_NUM_CHIPS;
+            unsigned int channelRepetition = getBoard().channelRepetition;
+
+            vector<CompiledSegment> segments(simplifiedWaveform.size());
+            for (unsigned int i = 0; i < simplifiedWaveform.size(); i++) {
+                const WaveformSegment& segment = simplifiedWaveform.waveform[i];
+                segments[i].value = segment.appliedDiscreteValue;
+                segments[i].markerOut = segment.markerOut;
+                segments[i].digOut = segment.digOut;
+                segments[i].numReps = channelRepetition * segment.numReps();
+                segments[i].numCommands = 0;
+            }
+
+            for (CompiledWaveform& compiled : waveformCache) {
+                if (compiled.isVoltageClamp != isVoltageClamp || compiled.channelRepetition != channelRepetition || compiled.segments.size() != segments.size()) {
+                    continue;
+                }
+                bool same = std::equal(segments.begin(), segments.end(), compiled.segments.begin(), [](const CompiledSegment& a, const CompiledSegment& b) {
+                    return a.value == b.value && a.markerOut == b.markerOut && a.digOut == b.digOut && a.numReps == b.numReps;
+                });
+                if (same) {
+                    compiled.lastUsed = ++waveformCacheClock;
+                    return compiled;
+                }
+            }
+
+            if (waveformCache.size() >= MAX_CACHED_WAVEFORMS) {
+                auto oldest = std::min_element(waveformCache.begin(), waveformCache.end(), [](const CompiledWaveform& a, const CompiledWaveform& b) {
+                    return a.lastUsed < b.lastUsed;
+                });
+                waveformCache.erase(oldest);
+            }
+
+            CompiledWaveform compiled;
+            compiled.isVoltageClamp = isVoltageClamp;
+            compiled.channelRepetition = channelRepetition;
+            compiled.lastUsed = ++waveformCacheClock;
+            for (CompiledSegment& segment : segments) {
+                unsigned int sz = compiled.commands.size();
+                uint16_t L;
+                RepeatingCommand::WriteType write;
+                RepeatingCommand::ReadType read;
+                if (isVoltageClamp) {
+                    L = static_cast<uint16_t>(encodeClampVoltage(segment.value));
+                    write = RepeatingCommand::WRITE_VOLTAGE;
+                    read = RepeatingCommand::READ_CURRENT;
+                }
+                else {
+                    L = static_cast<uint16_t>(encodeClampCurrent(static_cast<int8_t>(segment.value)));
+                    write = RepeatingCommand::WRITE_CURRENT;
+                    read = RepeatingCommand::READ_VOLTAGE;
+                }
+                // Same as createRepeating
+                if (segment.numReps > 0xFFFF) {
+                    compiled.commands.push_back(RepeatingCommand::create(write, read, RepeatingCommand::LITERAL, true, segment.markerOut, segment.digOut, L, segment.numReps >> 16));
+                }
+                compiled.commands.push_back(RepeatingCommand::create(write, read, RepeatingCommand::LITERAL, false, segment.markerOut, segment.digOut, L, segment.numReps & 0xFFFF));
+                segment.numCommands = compiled.commands.size() - sz;
+            }
+            compiled.segments = std::move(segments);
 
-                    simplifiedWaveform.waveform[i].numCommands = channel.commands.size() - sz;
+            waveformCache.push_back(std::move(compiled));
+            return waveformCache.back();
+        }
+
+        // Writes compiled's commands to Waveform RAM (once) and holds on to the run, so later identical writes share it
+        void ClampController::pinWaveform(CompiledWaveform& compiled) {
+            if (compiled.extent || compiled.commands.empty()) {
+                return;
+            }
+            vector<uint32_t> cmdsAsUint(compiled.commands.begin(), compiled.commands.end());
+            try {
+                compiled.extent = getBoard().waveformRAM.write(cmdsAsUint);
+            }
+            catch (runtime_error&) {
+                // Pinned runs must never crowd out live ones; let go of the others and try once more
+                for (CompiledWaveform& other : waveformCache) {
+                    other.extent.reset();
+                }
+                try {
+                    compiled.extent = getBoard().waveformRAM.write(cmdsAsUint);
+                }
+                catch (runtime_error&) {
+                    // Not enough room even so; the channel's own write will report it
                 }
             }
         }
@@ -1,5 +1,6 @@
 #pragma once
 #include "Registers.h"
+#include "Constants.h"
 #include <memory>
 
 struct GetResistorAndStepForCalibrationTest;
@@ -11,6 +12,10 @@ namespace CLAMP {
     class Chip;
     class SimplifiedWaveform;
 
+    namespace WaveformControl {
+        class WaveformExtent;
+    }
+
     /** \brief High-level functions for configuring CLAMP chips and channels.
      *
      *  The ClampController class contains a series of members that mimics the structures on
@@ -140,7 +145,7 @@ namespace CLAMP {
         private:
             void setOffsetTrim(const ChipChannel& chipChannel, uint8_t value);
             void createOffsetTrimCommands(const ChipChannel& chipChannel);
-            void getBestOffsetTrimAndResidual(const ChipChannel& chipChannel);
+            void getBestOffsetTrimsAndResiduals(const ChipChannelList& channelList);
         };
 
         /** \brief Configuration of current-to-voltage converter.
@@ -212,7 +217,7 @@ namespace CLAMP {
 
         private:
             void createCommandsToCalibrateClampVoltage(const ChipChannel& chipChannel);
-            void getBestOffsetTrim(const ChipChannel& chipChannel);
+            void getBestOffsetTrims(const ChipChannelList& channelList);
             void setClampVoltageOffsetTrim(const ChipChannel& chipChannel, uint8_t value);
         };
 
@@ -269,7 +274,7 @@ namespace CLAMP {
 
         private:
             void createCommandsToCalibrateVoltageAmplifier(const ChipChannel& chipChannel);
-            void getBestResidual(const ChipChannel& chipChannel);
+            void getBestResiduals(const ChipChannelList& channelList);
         };
 
         /** \brief A pair of (coarse, fine) calibration values for calibrating the current scale.
@@ -328,7 +333,7 @@ namespace CLAMP {
             bool bracketOneStep(const ChipChannel& chipChannel);
 
             // Binary search commands
-            bool binaryStepInit(const ChipChannel& chipChannel);
+            bool binaryStepInit(const ChipChannel& chipChannel, unsigned int numCandidates);
             bool binaryStepReInit();
             void binaryOneStep(const ChipChannel& chipChannel);
 
@@ -336,6 +341,9 @@ namespace CLAMP {
 
         private:
             ClampController& controller;
+            std::vector<CurrentCalibration> candidates; // Settings being measured in this binary search step, in increasing order
+
+            void narrow(double midCurrent);
         };
         /// \endcond
 
@@ -378,6 +386,13 @@ namespace CLAMP {
 
             void calibrate(const ChipChannelList& channelList);
 
+            /** \brief Number of settings the binary search measures per FPGA round trip.
+             *
+             *  With 1, this is a plain binary search.  With n, each step measures n evenly spaced settings in one command
+             *  sequence and narrows the interval (n + 1)-fold, so fewer (somewhat longer) round trips are needed.
+             */
+            unsigned int searchCandidatesPerStep;
+
             friend class ClampCurrentCalibrationHelper;
         private:
             std::vector<double> getMeasuredCurrentsForCalibration(const ChipChannel& chipChannel, Channel& thisChannel);
@@ -413,6 +428,7 @@ namespace CLAMP {
             TemperatureSensor(ClampController& c);
 
             double readTemperature(unsigned int chip);
+            std::vector<double> readTemperatures(const std::vector<unsigned int>& chips, bool checkRom = false, std::vector<bool>* romOk = nullptr);
 
         private:
             unsigned int numCycles(double time);
@@ -517,6 +533,41 @@ namespace CLAMP {
             Board& getBoard() const;
 
             void executeImmediate(const ChipChannelList& channelList);
+
+            /** \brief Groups several *Immediate operations into a single FPGA run.
+             *
+             *  While one of these exists, executeImmediate (and so every *Immediate function) only queues its
+             *  commands.  commit() on the outermost transaction then runs everything queued since, for all the channels
+             *  involved, in one cycle.  Each channel's commands still execute in the order they were added.
+             *
+             *  Don't clear command lists (e.g., Board::clearCommands) while a transaction is open.  If the outermost
+             *  transaction goes away without commit() (e.g., because of an exception), the queued operations are not run:
+             *  the channels they were queued for get their command lists back as they were when it began.  Register values
+             *  kept in memory (e.g., by the setters of Channel::registers) aren't put back, though.
+             *
+             \code
+                {
+                    ClampController::ImmediateTransaction transaction(board.controller);
+                    board.controller.fastTransientCapacitiveCompensation.setMagnitudeImmediate(list, magnitude);
+                    board.controller.fastTransientCapacitiveCompensation.setConnectImmediate(list, true);
+                    transaction.commit();
+                }
+             \endcode
+             */
+            class ImmediateTransaction {
+            public:
+                explicit ImmediateTransaction(ClampController& c);
+                ~ImmediateTransaction();
+                void commit();
+
+            private:
+                ClampController& controller;
+                bool committed;
+                // Length of each channel's command list when the outermost transaction began
+                std::size_t numCommands[MAX_NUM_CHIPS][MAX_NUM_CHANNELS];
+                ImmediateTransaction(const ImmediateTransaction&);
+                ImmediateTransaction& operator=(const ImmediateTransaction&);
+            };
             void createRepeatingWriteCurrent(const ChipChannel& chipChannel, WaveformControl::RepeatingCommand::ReadType read, bool MarkerOut, bool digOut, int8_t value, uint32_t numRepeats);
             void createRepeatingWriteVoltage(const ChipChannel& chipChannel, WaveformControl::RepeatingCommand::ReadType read, bool MarkerOut, bool digOut, int16_t value, uint32_t numRepeats);
 
@@ -529,10 +580,43 @@ namespace CLAMP {
             void switchToCurrentClampImmediate(const ChipChannelList& channelList, CurrentScale scale, int holdingCurrent, double capacitiveCompensation);
 
             void simplifiedWaveformToWaveform(const ChipChannelList& channelList, bool isVoltageClamp, SimplifiedWaveform& simplifiedWaveform);
+            void clearWaveformCache();
 
         private:
             Board& theBoard;
 
+            /// \cond private
+            // The parts of a WaveformSegment that determine its commands
+            struct CompiledSegment {
+                int value;
+                bool markerOut;
+                bool digOut;
+                unsigned int numReps;
+                unsigned int numCommands; // Output, not part of the key
+            };
+
+            // A SimplifiedWaveform converted to commands, along with the RAM run holding them (if any)
+            struct CompiledWaveform {
+                bool isVoltageClamp;
+                unsigned int channelRepetition;
+                std::vector<CompiledSegment> segments;
+                std::vector<WaveformControl::WaveformCommand> commands;
+                std::shared_ptr<WaveformControl::WaveformExtent> extent;
+                unsigned int lastUsed;
+            };
+            /// \endcond
+
+            unsigned int transactionDepth;
+            ChipChannelList pendingImmediate;
+            void runImmediate(const ChipChannelList& channelList);
+            ChipChannelList dropConfirmedWrites(const ChipChannelList& channelList);
+
+            std::vector<CompiledWaveform> waveformCache;
+            unsigned int waveformCacheClock;
+
+            CompiledWaveform& compileWaveform(bool isVoltageClamp, const SimplifiedWaveform& simplifiedWaveform);
+            void pinWaveform(CompiledWaveform& compiled);
+
             void createRepeating(const ChipChannel& chipChannel, WaveformControl::RepeatingCommand::WriteType write, WaveformControl::RepeatingCommand::ReadType read, bool MarkerOut, bool DigOut, uint16_t L, uint32_t numRepeats);
         };
     }
@@ -0,0 +1,285 @@
+#include "ClockSync.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+namespace CLAMP {
+    const double ClockSync::WINDOW_SECONDS = 1.0;
+    const double ClockSync::MIN_FIT_SECONDS = 10.0;
+
+    ClockModel::ClockModel() :
+        valid(false),
+        driftMeasured(false),
+        offsetSeconds(0),
+        samplingRateHz(0),
+        driftPPM(0),
+        residualSeconds(0),
+        numWindows(0),
+        spanSeconds(0)
+    {
+    }
+
+    ClockSync::ClockSync() :
+        nominalRate(0),
+        haveTimestamp(false),
+        lastTimestamp(0),
+        lastTimestep(0),
+        windowStart(0),
+        carriedDrift(0)
+    {
+    }
+
+    /// Host time now, in seconds: the monotonic clock the host times of addSample() and the model are on
+    double ClockSync::hostNow() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Converts a host time (see hostNow()) to seconds since the system clock's epoch
+    double ClockSync::hostToWall(double hostSeconds) {
+        double wallNow = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+        return hostSeconds + (wallNow - hostNow());
+    }
+
+    /** \brief Starts a new run, whose timestamps restart from 0.  Board calls this when it starts the board.
+     *
+     *  The windows are discarded, since the offset is different for each run, but the drift is kept as the starting
+     *  point for the new run.
+     *
+     *  \param[in] samplingRateHz  Nominal sampling rate of the run
+     */
+    void ClockSync::startRun(double samplingRateHz) {
+        lock_guard<mutex> lock(modelMutex);
+        if (model.driftMeasured) {
+            carriedDrift = model.driftPPM * 1e-6;
+        }
+        nominalRate = samplingRateHz;
+        haveTimestamp = false;
+        windows.clear();
+        model = ClockModel();
+    }
+
+    /** \brief Adds a (board timestamp, host time) pair.  Board calls this after each read.
+     *
+     *  \param[in] timestamp    Timestamp of a sample
+     *  \param[in] hostSeconds  Host time (see hostNow()) at which that sample was known to have arrived
+     */
+    void ClockSync::addSample(uint32_t timestamp, double hostSeconds) {
+        lock_guard<mutex> lock(modelMutex);
+        if (nominalRate <= 0) {
+            return;
+        }
+
+        uint64_t timestep = timestamp;
+        if (haveTimestamp) {
+            if (static_cast<int32_t>(timestamp - lastTimestamp) < 0) {
+                // Went backwards without wrapping: the board restarted without startRun()
+                haveTimestamp = false;
+                windows.clear();
+                model = ClockModel();
+            }
+            else {
+                timestep = unwrap(timestamp);
+            }
+        }
+        haveTimestamp = true;
+        lastTimestamp = timestamp;
+        lastTimestep = timestep;
+
+        double boardSeconds = timestep / nominalRate;
+        double offset = hostSeconds - boardSeconds;
+        if (windows.empty() || boardSeconds >= windowStart + WINDOW_SECONDS) {
+            windowStart = windows.empty() ? boardSeconds : windowStart + WINDOW_SECONDS * std::floor((boardSeconds - windowStart) / WINDOW_SECONDS);
+            Window window = { boardSeconds, offset };
+            windows.push_back(window);
+            if (windows.size() > MAX_WINDOWS) {
+                windows.pop_front();
+            }
+        }
+        else if (offset < windows.back().offset) {
+            windows.back().boardSeconds = boardSeconds;
+            windows.back().offset = offset;
+        }
+        else {
+            return; // Nothing changed
+        }
+        fit();
+    }
+
+    /// Forgets everything, including the drift carried between runs.
+    void ClockSync::reset() {
+        lock_guard<mutex> lock(modelMutex);
+        haveTimestamp = false;
+        windows.clear();
+        carriedDrift = 0;
+        model = ClockModel();
+    }
+
+    // The timestep nearest lastTimestep with the given low 32 bits
+    uint64_t ClockSync::unwrap(uint32_t timestamp) const {
+        int32_t step = static_cast<int32_t>(timestamp - lastTimestamp);
+        if (step < 0 && lastTimestep < static_cast<uint64_t>(-static_cast<int64_t>(step))) {
+            return timestamp;
+        }
+        return lastTimestep + step;
+    }
+
+    // Refits the model to the windows.  Least squares over the minima; windows more than three RMS above the line (a
+    // whole window of delayed reads) are dropped and the line refitted once.
+    void ClockSync::fit() {
+        model.valid = true;
+        model.numWindows = static_cast<unsigned int>(windows.size());
+        model.spanSeconds = windows.back().boardSeconds - windows.front().boardSeconds;
+
+        double drift = carriedDrift;
+        double intercept = 0;
+        double residual = 0;
+        bool measured = false;
+        if (model.spanSeconds >= MIN_FIT_SECONDS && windows.size() >= 3) {
+            vector<bool> use(windows.size(), true);
+            for (int pass = 0; pass < 2; pass++) {
+                double n = 0, sx = 0, sy = 0;
+                for (std::size_t i = 0; i < windows.size(); i++) {
+                    if (use[i]) {
+                        n++;
+                        sx += windows[i].boardSeconds;
+                        sy += windows[i].offset;
+                    }
+                }
+                double mx = sx / n, my = sy / n;
+                double sxx = 0, sxy = 0;
+                for (std::size_t i = 0; i < windows.size(); i++) {
+                    if (use[i]) {
+                        double dx = windows[i].boardSeconds - mx;
+                        sxx += dx * dx;
+                        sxy += dx * (windows[i].offset - my);
+                    }
+                }
+                if (sxx <= 0) {
+                    break;
+                }
+                drift = sxy / sxx;
+                intercept = my - drift * mx;
+                measured = true;
+
+                double ss = 0;
+                for (std::size_t i = 0; i < windows.size(); i++) {
+                    if (use[i]) {
+                        double r = windows[i].offset - (intercept + drift * windows[i].boardSeconds);
+                        ss += r * r;
+                    }
+                }
+                residual = std::sqrt(ss / n);
+                bool dropped = false;
+                for (std::size_t i = 0; i < windows.size(); i++) {
+                    if (use[i] && windows[i].offset - (intercept + drift * windows[i].boardSeconds) > 3 * residual && n > 3) {
+                        use[i] = false;
+                        dropped = true;
+                    }
+                }
+                if (!dropped) {
+                    break;
+                }
+            }
+        }
+
+        if (!measured) {
+            // Too little to fit: the line with the carried-over drift through the smallest offset
+            drift = carriedDrift;
+            intercept = windows.front().offset - drift * windows.front().boardSeconds;
+            for (const Window& window : windows) {
+                intercept = std::min(intercept, window.offset - drift * window.boardSeconds);
+            }
+            double ss = 0;
+            for (const Window& window : windows) {
+                double r = window.offset - (intercept + drift * window.boardSeconds);
+                ss += r * r;
+            }
+            residual = std::sqrt(ss / windows.size());
+        }
+
+        model.driftMeasured = measured;
+        model.offsetSeconds = intercept;
+        model.driftPPM = drift * 1e6;
+        model.samplingRateHz = nominalRate / (1 + drift);
+        model.residualSeconds = residual;
+    }
+
+    // Host time of an unwrapped timestep, from the current model
+    double ClockSync::hostOf(uint64_t timestep) const {
+        return model.offsetSeconds + timestep / model.samplingRateHz;
+    }
+
+    /// The current model; see ClockModel
+    ClockModel ClockSync::getModel() const {
+        lock_guard<mutex> lock(modelMutex);
+        return model;
+    }
+
+    /// True once a pair has been added this run; until then, the conversions return NaN
+    bool ClockSync::isValid() const {
+        lock_guard<mutex> lock(modelMutex);
+        return model.valid;
+    }
+
+    /** \brief Host time (see hostNow()) of a timestamp in the current run.
+     *
+     *  \param[in] timestamp  Timestamp as read from the board; it's unwrapped to the timestep nearest the newest one added
+     *  \returns Host time in seconds, or NaN if there's no model yet
+     */
+    double ClockSync::toHostSeconds(uint32_t timestamp) const {
+        lock_guard<mutex> lock(modelMutex);
+        if (!model.valid) {
+            return std::nan("");
+        }
+        return hostOf(unwrap(timestamp));
+    }
+
+    /** \brief Host time (see hostNow()) of a timestep in the current run.
+     *
+     *  \param[in] timestep  Timesteps since the start of the run, past 32 bits if need be
+     *  \returns Host time in seconds, or NaN if there's no model yet
+     */
+    double ClockSync::toHostSeconds(uint64_t timestep) const {
+        lock_guard<mutex> lock(modelMutex);
+        if (!model.valid) {
+            return std::nan("");
+        }
+        return hostOf(timestep);
+    }
+
+    /// As toHostSeconds(), but in seconds since the system clock's epoch (see hostToWall())
+    double ClockSync::toWallSeconds(uint32_t timestamp) const {
+        return hostToWall(toHostSeconds(timestamp));
+    }
+
+    /** \brief Timestep of the current run that the board was at, at the given host time.
+     *
+     *  \param[in] hostSeconds  Host time (see hostNow())
+     *  \returns Timesteps since the start of the run (fractional, and negative before it), or NaN if there's no model yet
+     */
+    double ClockSync::toBoardTimestep(double hostSeconds) const {
+        lock_guard<mutex> lock(modelMutex);
+        if (!model.valid) {
+            return std::nan("");
+        }
+        return (hostSeconds - model.offsetSeconds) * model.samplingRateHz;
+    }
+
+    /** \brief How long after the model's arrival time for a sample the given host time is.
+     *
+     *  E.g., pass a sample's timestamp and hostNow() once it has been processed, to get the processing latency, or the
+     *  host time of a read to get the transfer's delay beyond its floor.
+     *
+     *  \param[in] timestamp    Timestamp of the sample
+     *  \param[in] hostSeconds  Host time (see hostNow())
+     *  \returns Latency in seconds, or NaN if there's no model yet
+     */
+    double ClockSync::latencySeconds(uint32_t timestamp, double hostSeconds) const {
+        return hostSeconds - toHostSeconds(timestamp);
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace CLAMP {
+    /// Mapping from board time to host time, as fitted by ClockSync
+    struct ClockModel {
+        bool valid;              ///< False until the first pair of the run has been seen
+        bool driftMeasured;      ///< True if driftPPM was fitted this run, false if it was carried over from an earlier run (or is 0)
+        double offsetSeconds;    ///< Host time (see ClockSync::hostNow()) of timestamp 0 of the current run
+        double samplingRateHz;   ///< Board timesteps per host second, i.e., the nominal rate corrected for drift
+        double driftPPM;         ///< How much faster the host clock runs than the board's, in parts per million
+        double residualSeconds;  ///< RMS distance of the windows' minima from the fit
+        unsigned int numWindows; ///< Windows the fit is over
+        double spanSeconds;      ///< Board time the windows cover
+
+        ClockModel();
+    };
+
+    /** \brief Maps board timestamps to host time, with a fitted drift between the two clocks.
+     *
+     *  Board::read() passes the newest timestamp of every read to addSample(), with the host time the transfer finished.
+     *  Each pair's offset (host time minus board time) is the true offset plus however long the sample took to reach
+     *  the host, so, as in NTP, only the smallest offset in each WINDOW_SECONDS of board time is kept: that's the read
+     *  that waited least, and its delay is close to the USB transfer's floor.  A straight line is fitted to the last
+     *  MAX_WINDOWS minima by least squares; its slope is the drift between the clocks (crystals differ by tens of ppm,
+     *  i.e., several ms an hour), and its intercept the host time of timestamp 0.  Until MIN_FIT_SECONDS of board time
+     *  have been seen, the line goes through the smallest offset so far with the drift measured in the previous run.
+     *
+     *  The board's timestamps restart with each run (see startRun()); they're unwrapped past 32 bits within a run.
+     *  A host time from the model is the earliest the host could have had that sample, so latencySeconds() measures
+     *  delay beyond the transfer floor, and toWallSeconds() lines samples up with other systems' wall-clock timestamps to
+     *  within that floor plus residualSeconds.  Queries may be made from any thread.
+     \code
+        board.read(n);
+        const std::vector<uint32_t>& timestamps = board.readQueue.getTimeStamps();
+        double wall = board.clockSync.toWallSeconds(timestamps.front()); // Seconds since the system clock's epoch
+     \endcode
+     */
+    class ClockSync {
+    public:
+        ClockSync();
+
+        /// Board time each window's minimum offset is taken over
+        static const double WINDOW_SECONDS;
+        /// Board time before the drift is fitted rather than carried over
+        static const double MIN_FIT_SECONDS;
+        /// Windows kept, i.e., how far back the fit looks
+        static const unsigned int MAX_WINDOWS = 120;
+
+        void startRun(double samplingRateHz);
+        void addSample(uint32_t timestamp, double hostSeconds);
+        void reset();
+
+        static double hostNow();
+        static double hostToWall(double hostSeconds);
+
+        ClockModel getModel() const;
+        bool isValid() const;
+        double toHostSeconds(uint32_t timestamp) const;
+        double toHostSeconds(uint64_t timestep) const;
+        double toWallSeconds(uint32_t timestamp) const;
+        double toBoardTimestep(double hostSeconds) const;
+        double latencySeconds(uint32_t timestamp, double hostSeconds) const;
+
+    private:
+        /// \cond private
+        struct Window {
+            double boardSeconds; // Board time of the pair with the least offset
+            double offset;       // Host time minus board time, for that pair
+        };
+        /// \endcond
+
+        mutable std::mutex modelMutex;
+        double nominalRate;
+        bool haveTimestamp;
+        uint32_t lastTimestamp;
+        uint64_t lastTimestep;    // lastTimestamp, unwrapped
+        double windowStart;       // Board time the newest window began at
+        std::deque<Window> windows;
+        double carriedDrift;      // Fractional drift from the previous run, as a starting point
+        ClockModel model;
+
+        uint64_t unwrap(uint32_t timestamp) const;
+        void fit();
+        double hostOf(uint64_t timestep) const;
+
+        // Not copyable
+        ClockSync(const ClockSync&);
+        ClockSync& operator=(const ClockSync&);
+    };
+}
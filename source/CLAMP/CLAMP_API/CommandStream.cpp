@@ -0,0 +1,225 @@
+#include "CommandStream.h"
+#include "Board.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+using std::runtime_error;
+using std::vector;
+using namespace CLAMP::ClampConfig;
+
+namespace CLAMP {
+    namespace WaveformControl {
+        /** \brief Constructor
+         *
+         *  \param[in] board_        Board to play the sequence on
+         *  \param[in] channelList_  Channels to play it on
+         *  \param[in] source_       Called for more of the sequence as the board plays it; see Source
+         */
+        CommandStream::CommandStream(Board& board_, const ChipChannelList& channelList_, const Source& source_) :
+            board(board_),
+            channelList(channelList_),
+            source(source_),
+            maxChunkWords(4096),
+            minChunkSeconds(0.25),
+            pendingStart(0),
+            sourceDone(false),
+            tailQueued(false),
+            queued(false),
+            haveEnd(false),
+            endTimestep(0),
+            haveTimestamp(false),
+            lastTimestamp(0),
+            lastTimestep(0),
+            chunksPlayed(0),
+            underruns(0)
+        {
+            playing.start = playing.length = 0;
+            next.start = next.length = 0;
+        }
+
+        /** \brief Constructor for a sequence that's already been generated, but is too long for Waveform RAM
+         *
+         *  \param[in] board_        Board to play the sequence on
+         *  \param[in] channelList_  Channels to play it on
+         *  \param[in] commands      The whole sequence
+         */
+        CommandStream::CommandStream(Board& board_, const ChipChannelList& channelList_, const vector<WaveformCommand>& commands) :
+            CommandStream(board_, channelList_, Source())
+        {
+            pending = commands;
+            sourceDone = true;
+        }
+
+        /** \brief Sets how the sequence is cut into chunks.
+         *
+         *  Two chunks must fit in Waveform RAM alongside whatever else is there.  A chunk is only cut short of maxWords
+         *  when that's all the source has ready and it already lasts minSeconds, or at the end of the sequence.
+         *
+         *  \param[in] maxWords    Most commands in one chunk (default 4096, an eighth of Waveform RAM)
+         *  \param[in] minSeconds  Least duration of a chunk while more of the sequence is coming (default 0.25 s)
+         */
+        void CommandStream::setChunkLimits(unsigned int maxWords, double minSeconds) {
+            maxChunkWords = std::max(maxWords, 1u);
+            minChunkSeconds = minSeconds;
+        }
+
+        /** \brief Sets commands to loop once the sequence is over, e.g., a holding level.
+         *
+         *  Without a tail, the board keeps looping the sequence's last chunk until it's stopped.
+         */
+        void CommandStream::setTail(const vector<WaveformCommand>& commands) {
+            tail = commands;
+        }
+
+        /** \brief Loads the first chunk, and queues the second, before the board starts.
+         *
+         *  Call once, with the board stopped, right before Board::runContinuously(); timesteps are counted from the start
+         *  of that run.
+         */
+        void CommandStream::prime() {
+            board.releaseRetiredCommands(channelList);
+            queued = false;
+            haveTimestamp = false;
+            chunksPlayed = 0;
+            underruns = 0;
+
+            vector<WaveformCommand> chunk;
+            bool haveChunk = takeChunk(chunk, true);
+            if (!haveChunk) {
+                if (tail.empty()) {
+                    throw runtime_error("Command stream has no commands.");
+                }
+                chunk = tail;
+                tailQueued = true;
+            }
+            loadChannels(chunk);
+            board.commandsToFPGA(channelList);
+            playing.start = 0;
+            playing.length = lengthOf(chunk.begin(), chunk.end());
+            if (isExhausted()) {
+                haveEnd = true;
+                endTimestep = haveChunk ? playing.length : 0;
+            }
+            queueNext();
+        }
+
+        /** \brief Moves the stream along; call after each read while the board runs.
+         *
+         *  Once the timestamps show the board has moved on to the queued chunk, the chunk before is released and the next
+         *  one queued in its place.
+         *
+         *  \param[in] timestamp  Newest timestamp read, e.g., the last of ReadQueue::getTimeStamps()
+         */
+        void CommandStream::service(uint32_t timestamp) {
+            lastTimestep = haveTimestamp ? lastTimestep + static_cast<uint32_t>(timestamp - lastTimestamp) : timestamp;
+            lastTimestamp = timestamp;
+            haveTimestamp = true;
+
+            while (queued && lastTimestep >= next.start) {
+                playing = next;
+                queued = false;
+                chunksPlayed++;
+                board.releaseRetiredCommands(channelList);
+                queueNext();
+            }
+            if (!queued) {
+                queueNext(); // E.g., the source had nothing ready last time
+            }
+        }
+
+        /// True once the whole sequence has been put in chunks (the last of them may not have played yet)
+        bool CommandStream::isExhausted() const {
+            return sourceDone && numPending() == 0;
+        }
+
+        /// True once the board has played the whole sequence, according to the timestamps passed to service()
+        bool CommandStream::isFinished() const {
+            return haveEnd && haveTimestamp && lastTimestep >= endTimestep;
+        }
+
+        /// Timestep the sequence ends (and the tail, if any, starts) at; the largest uint64_t until the end is known
+        uint64_t CommandStream::getEndTimestep() const {
+            return haveEnd ? endTimestep : std::numeric_limits<uint64_t>::max();
+        }
+
+        // Moves the next chunk's commands from pending to chunk.  Unless force is set, a chunk too short to upload the
+        // one after behind it is held back while the source may still add to it.  Returns false if there's no chunk.
+        bool CommandStream::takeChunk(vector<WaveformCommand>& chunk, bool force) {
+            uint64_t minLength = static_cast<uint64_t>(minChunkSeconds * board.getSamplingRateHz());
+            auto enough = [&]() {
+                return numPending() >= maxChunkWords || lengthOf(pending.begin() + pendingStart, pending.end()) >= minLength;
+            };
+            while (!sourceDone && !enough()) {
+                std::size_t before = pending.size();
+                if (!source(pending)) {
+                    sourceDone = true;
+                }
+                else if (pending.size() == before) {
+                    break; // Nothing ready
+                }
+            }
+            if (numPending() == 0 || (!force && !sourceDone && !enough())) {
+                return false;
+            }
+
+            std::size_t n = std::min<std::size_t>(numPending(), maxChunkWords);
+            chunk.assign(pending.begin() + pendingStart, pending.begin() + pendingStart + n);
+            pendingStart += n;
+            if (pendingStart >= pending.size() / 2) {
+                pending.erase(pending.begin(), pending.begin() + pendingStart);
+                pendingStart = 0;
+            }
+            return true;
+        }
+
+        // Uploads the chunk after the playing one and points the channels at it, if there is one
+        void CommandStream::queueNext() {
+            vector<WaveformCommand> chunk;
+            bool last = false;
+            if (takeChunk(chunk, false)) {
+                last = isExhausted();
+            }
+            else if (isExhausted() && !tail.empty() && !tailQueued) {
+                chunk = tail;
+                tailQueued = true;
+            }
+            else {
+                return;
+            }
+
+            loadChannels(chunk);
+            board.commandsToFPGAAtBoundary(channelList);
+
+            uint64_t end = playing.start + playing.length;
+            next.start = end;
+            if (haveTimestamp && lastTimestep >= end) {
+                // Too late: the board has gone round the playing chunk again, and moves on at the end of this pass
+                underruns++;
+                next.start = playing.start + playing.length * ((lastTimestep - playing.start) / playing.length + 1);
+            }
+            next.length = lengthOf(chunk.begin(), chunk.end());
+            queued = true;
+            if (last) {
+                haveEnd = true;
+                endTimestep = next.start + next.length;
+            }
+        }
+
+        // Makes commands the command list of each channel in the stream
+        void CommandStream::loadChannels(const vector<WaveformCommand>& commands) {
+            for (auto& index : channelList) {
+                board.controller.getChannel(index).commands = commands;
+            }
+        }
+
+        // Timesteps the commands take to play, as in Board::getNumTimesteps; at least 1
+        uint64_t CommandStream::lengthOf(vector<WaveformCommand>::const_iterator first, vector<WaveformCommand>::const_iterator last) const {
+            uint64_t repetitions = 0;
+            for (; first != last; ++first) {
+                repetitions += repetitionsOf(*first);
+            }
+            return std::max<uint64_t>(repetitions / board.channelRepetition, 1);
+        }
+    }
+}
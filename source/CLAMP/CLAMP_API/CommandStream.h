@@ -0,0 +1,115 @@
+#pragma once
+
+#include "ClampController.h"
+#include "WaveformCommand.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace CLAMP {
+    class Board;
+
+    namespace WaveformControl {
+        /** \brief Plays a command sequence that's too long for Waveform RAM, or generated as it goes, without stopping
+         *  the board.
+         *
+         *  The sequence is cut into chunks, and at most two are in Waveform RAM at once: the one the board is playing, and
+         *  the next, which the channels are pointed at with Board::commandsToFPGAAtBoundary so the FPGA moves on to it when
+         *  the playing chunk ends.  Once the timestamps show the board has moved on, the old chunk's RAM is released and
+         *  the chunk after is uploaded, so the host always has one chunk's worth of time to upload the next.
+         *
+         *  Chunks are at most getMaxChunkWords() commands and, while more of the sequence is coming, at least
+         *  getMinChunkSeconds() long; the second should comfortably exceed the read latency, since a chunk that isn't
+         *  queued by the time the playing one ends makes the board loop the playing one again (counted in getUnderruns()).
+         *
+         *  The same commands go to every channel in the list; identical chunks share RAM, as in WaveformRAM::write.  The
+         *  Source is called from prime() and service(), i.e., on the thread that reads the board.
+         \code
+            CommandStream stream(board, channelList, [&](std::vector<WaveformCommand>& commands) {
+                return generateNextSegment(commands); // false once the protocol is over
+            });
+            stream.prime();
+            board.runContinuously();
+            while (!stream.isFinished()) {
+                board.read(n);
+                stream.service(board.readQueue.getTimeStamps().back());
+                ...
+            }
+            board.stop();
+         \endcode
+         */
+        class CommandStream {
+        public:
+            /** \brief Appends the next part of the sequence to commands.
+             *
+             *  Returns false once the sequence is over (anything added in that call still plays).  Returning true without
+             *  adding anything means nothing is ready yet; the stream asks again on the next service().
+             */
+            typedef std::function<bool(std::vector<WaveformCommand>& commands)> Source;
+
+            CommandStream(Board& board_, const ClampConfig::ChipChannelList& channelList_, const Source& source_);
+            CommandStream(Board& board_, const ClampConfig::ChipChannelList& channelList_, const std::vector<WaveformCommand>& commands);
+
+            void setChunkLimits(unsigned int maxWords, double minSeconds);
+            /// Most commands in one chunk; see setChunkLimits()
+            unsigned int getMaxChunkWords() const { return maxChunkWords; }
+            /// Least duration of a chunk while more of the sequence is coming; see setChunkLimits()
+            double getMinChunkSeconds() const { return minChunkSeconds; }
+            void setTail(const std::vector<WaveformCommand>& commands);
+
+            void prime();
+            void service(uint32_t timestamp);
+
+            bool isExhausted() const;
+            bool isFinished() const;
+            uint64_t getEndTimestep() const;
+            /// Chunks the board has moved on to since prime(), not counting the first
+            unsigned int getChunksPlayed() const { return chunksPlayed; }
+            /// Times the next chunk was queued after the playing one had already ended, so the board looped it again
+            unsigned int getUnderruns() const { return underruns; }
+
+        private:
+            /// \cond private
+            struct Chunk {
+                uint64_t start;  // Timestep the board starts the chunk at
+                uint64_t length; // In timesteps
+            };
+            /// \endcond
+
+            Board& board;
+            ClampConfig::ChipChannelList channelList;
+            Source source;
+            std::vector<WaveformCommand> tail;
+
+            unsigned int maxChunkWords;
+            double minChunkSeconds;
+
+            std::vector<WaveformCommand> pending; // From the source; the ones from pendingStart on aren't in a chunk yet
+            std::size_t pendingStart;
+            bool sourceDone;
+            bool tailQueued;
+            Chunk playing;
+            Chunk next;
+            bool queued;    // Whether next is in RAM with the channels pointed at it
+            bool haveEnd;   // Whether the last chunk of the sequence has been queued (or is playing); see getEndTimestep
+            uint64_t endTimestep;
+
+            bool haveTimestamp;
+            uint32_t lastTimestamp;
+            uint64_t lastTimestep;  // lastTimestamp, unwrapped
+
+            unsigned int chunksPlayed;
+            unsigned int underruns;
+
+            std::size_t numPending() const { return pending.size() - pendingStart; }
+            bool takeChunk(std::vector<WaveformCommand>& chunk, bool force);
+            void queueNext();
+            void loadChannels(const std::vector<WaveformCommand>& commands);
+            uint64_t lengthOf(std::vector<WaveformCommand>::const_iterator first, std::vector<WaveformCommand>::const_iterator last) const;
+
+            // Not copyable
+            CommandStream(const CommandStream&);
+            CommandStream& operator=(const CommandStream&);
+        };
+    }
+}
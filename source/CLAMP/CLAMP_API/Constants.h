@@ -14,6 +14,18 @@ namespace CLAMP {
 
     const double PI = 3.141592653;
 
+    /** \brief Type of the sample values in the acquisition and display pipeline (ReadQueue through the UI's DataStore).
+     *
+     *  The measurements are 18-bit ADC codes, so single precision loses nothing significant; build with
+     *  CLAMP_SINGLE_PRECISION_SAMPLES defined to halve the memory used (and the memory bandwidth needed) by the sample
+     *  buffers.  Calculations on the samples (filters, fits, calibration) are still done in double precision.
+     */
+#ifdef CLAMP_SINGLE_PRECISION_SAMPLES
+    typedef float Sample;
+#else
+    typedef double Sample;
+#endif
+
     const double STEP16 = 2.56 / (1 << 15); // Full range is +/-, so we want 1/2 that for 2.56 V
     const double STEP18 = 2.56 / (1 << 17); // Full range is +/-, so we want 1/2 that for 2.56 V
     const double STEPADC = 3.3 / (1 << 16); // Full range is 0 .. 3.3V, and they are 16-bit
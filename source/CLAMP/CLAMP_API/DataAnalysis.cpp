@@ -1,10 +1,15 @@
 #include "DataAnalysis.h"
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
 #include "common.h"
 
 using std::vector;
+using std::invalid_argument;
 using std::pair;
 using std::array;
+using std::complex;
 
 namespace CLAMP {
     namespace SignalProcessing {
@@ -38,6 +43,20 @@ namespace CLAMP {
             return 1.0 * sum / (end - begin);
         }
 
+        /** \brief Average (arithmetic mean) of single precision data
+         *
+         *  The sum is accumulated in double precision.
+         *
+         *  \details \copydetails DataAnalysis::average(std::vector<int32_t>::const_iterator,std::vector<int32_t>::const_iterator)
+         */
+        double DataAnalysis::average(vector<float>::const_iterator begin, vector<float>::const_iterator end) {
+            double sum = 0;
+            for (vector<float>::const_iterator iter = begin; iter != end; iter++) {
+                sum += *iter;
+            }
+            return 1.0 * sum / (end - begin);
+        }
+
         /** \brief Calculates slope, given x and y vectors.
          *
          *  The slope is calculated using least squares, which gives the formula
@@ -123,6 +142,17 @@ namespace CLAMP {
             return average(begin, end);
         }
 
+        /** \brief Calculated best residual of single precision data
+         *
+         *  \details \copydetails DataAnalysis::calculateBestResidual(std::vector<double>::const_iterator,std::vector<double>::const_iterator)
+         */
+        double DataAnalysis::calculateBestResidual(vector<float>::const_iterator begin, vector<float>::const_iterator end) {
+            // Use the second half of the points
+            begin += (end - begin) / 2;
+
+            return average(begin, end);
+        }
+
         /** \brief Calculated best residual of integer data
          *
          *  \details \copydetails DataAnalysis::calculateBestResidual(std::vector<double>::const_iterator,std::vector<double>::const_iterator)
@@ -157,6 +187,454 @@ namespace CLAMP {
             return result;
         }
 
+        /** \brief calculateBestResidual() of every capture of every channel, in one pass.
+         *
+         *  Calibration captures the same windows on every channel in one run (e.g., one per trim candidate), so the
+         *  windows are given once.  Each capture's second half is summed over its contiguous samples into a 64-bit
+         *  integer, which the compiler can vectorize; the results are the same as calculateBestResidual()'s.
+         *
+         *  \param[in] channels    Raw data of each channel (e.g., ReadQueue::getRawData(...).data()), covering every window
+         *  \param[in] windows     Captures, the same in every channel
+         *  \param[out] residuals  Resized to channels.size() * windows.size(): the residual of window w of channel c is at c * windows.size() + w
+         */
+        void DataAnalysis::calculateBestResiduals(const vector<const int32_t*>& channels, const vector<CaptureWindow>& windows, vector<int32_t>& residuals) {
+            residuals.resize(channels.size() * windows.size());
+            for (std::size_t w = 0; w < windows.size(); w++) {
+                // Use the second half of the points
+                std::size_t begin = windows[w].begin + (windows[w].end - windows[w].begin) / 2;
+                std::size_t count = windows[w].end - begin;
+                for (std::size_t c = 0; c < channels.size(); c++) {
+                    const int32_t* data = channels[c] + begin;
+                    int64_t sum = 0;
+                    for (std::size_t i = 0; i < count; i++) {
+                        sum += data[i];
+                    }
+                    residuals[c * windows.size() + w] = lround(1.0 * sum / count);
+                }
+            }
+        }
+
+        /** \brief calculateBestTrim() of every channel, from captures at trim = 0, 1, 2, etc., in one pass.
+         *
+         *  \param[in] channels  Raw data of each channel, as for calculateBestResiduals()
+         *  \param[in] windows   Captures at each trim value, in order, the same in every channel
+         *  \param[out] trims    One (best trim index, best residual value) pair per channel
+         */
+        void DataAnalysis::calculateBestTrims(const vector<const int32_t*>& channels, const vector<CaptureWindow>& windows, vector<pair<unsigned int, int32_t>>& trims) {
+            vector<int32_t> residuals;
+            calculateBestResiduals(channels, windows, residuals);
+            trims.resize(channels.size());
+            for (std::size_t c = 0; c < channels.size(); c++) {
+                const int32_t* values = residuals.data() + c * windows.size();
+                std::size_t best = 0;
+                for (std::size_t w = 1; w < windows.size(); w++) {
+                    if (std::abs(values[w]) < std::abs(values[best])) {
+                        best = w;
+                    }
+                }
+                trims[c] = pair<unsigned int, int32_t>(static_cast<unsigned int>(best), values[best]);
+            }
+        }
+
+        //----------------------------------------------------------------------------------------------------------------
+        /** \brief Constructor.
+         *
+         *  \param[in] window_  Samples in the window
+         */
+        SlidingMoments::SlidingMoments(std::size_t window_) :
+            ring(window_)
+        {
+            if (window_ == 0) {
+                throw invalid_argument("Sliding window needs at least one sample");
+            }
+            clear();
+        }
+
+        /// Empties the window.
+        void SlidingMoments::clear() {
+            std::fill(ring.begin(), ring.end(), 0.0); // So that pushRun can subtract every slot it overwrites
+            next = 0;
+            filled = 0;
+            sinceExact = 0;
+            shift = 0;
+            sum = 0;
+            sumSquares = 0;
+        }
+
+        /// Adds a sample, pushing out the oldest one if the window is full.
+        void SlidingMoments::push(double value) {
+            if (filled == 0) {
+                shift = value;
+            }
+            double d = value - shift;
+            double old = ring[next];
+            sum += d - old;
+            sumSquares += d * d - old * old;
+            ring[next] = d;
+            next = (next + 1 == ring.size()) ? 0 : next + 1;
+            filled = std::min(filled + 1, ring.size());
+            if (++sinceExact >= ring.size()) {
+                recompute();
+            }
+        }
+
+        /// Adds n samples, oldest first; the same as pushing them one at a time, but faster.
+        void SlidingMoments::push(const Sample* values, std::size_t n) {
+            while (n > 0) {
+                if (filled == 0) {
+                    shift = values[0];
+                }
+                std::size_t run = std::min(n, ring.size() - next);
+                pushRun(values, run);
+                values += run;
+                n -= run;
+            }
+        }
+
+        // Pushes samples into ring[next, next + n), which doesn't wrap.  Slots that aren't filled yet hold 0, so every
+        // slot can be treated as evicted.  Four independent partial sums let the compiler vectorize the loop.
+        void SlidingMoments::pushRun(const Sample* values, std::size_t n) {
+            double* slots = ring.data() + next;
+            double delta[4] = { 0, 0, 0, 0 };
+            double deltaSquares[4] = { 0, 0, 0, 0 };
+            std::size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                for (unsigned int k = 0; k < 4; k++) {
+                    double old = slots[i + k];
+                    double d = values[i + k] - shift;
+                    delta[k] += d - old;
+                    deltaSquares[k] += d * d - old * old;
+                    slots[i + k] = d;
+                }
+            }
+            for (; i < n; i++) {
+                double old = slots[i];
+                double d = values[i] - shift;
+                delta[0] += d - old;
+                deltaSquares[0] += d * d - old * old;
+                slots[i] = d;
+            }
+            sum += (delta[0] + delta[1]) + (delta[2] + delta[3]);
+            sumSquares += (deltaSquares[0] + deltaSquares[1]) + (deltaSquares[2] + deltaSquares[3]);
+
+            next += n;
+            if (next == ring.size()) {
+                next = 0;
+            }
+            filled = std::min(filled + n, ring.size());
+            sinceExact += n;
+            if (sinceExact >= ring.size()) {
+                recompute();
+            }
+        }
+
+        // Recomputes the sums from the window, after moving the reference value to the window's mean (so data that
+        // drifts away from the first sample doesn't lose precision).  O(window), but only once per window's worth of samples.
+        void SlidingMoments::recompute() {
+            sinceExact = 0;
+            if (filled == 0) {
+                return;
+            }
+            double total = 0;
+            for (std::size_t i = 0; i < filled; i++) {
+                total += ring[i];
+            }
+            double rebase = total / filled;
+            shift += rebase;
+
+            sum = 0;
+            sumSquares = 0;
+            for (std::size_t i = 0; i < filled; i++) {
+                double d = ring[i] - rebase;
+                ring[i] = d;
+                sum += d;
+                sumSquares += d * d;
+            }
+        }
+
+        /// Mean of the samples in the window, or 0 if it's empty
+        double SlidingMoments::mean() const {
+            return (filled > 0) ? shift + sum / filled : 0.0;
+        }
+
+        /// Sample variance (dividing by count() - 1) of the samples in the window, or 0 if there are fewer than two
+        double SlidingMoments::variance() const {
+            if (filled < 2) {
+                return 0.0;
+            }
+            return std::max(0.0, (sumSquares - sum * sum / filled) / (filled - 1));
+        }
+
+        //----------------------------------------------------------------------------------------------------------------
+        /// Constructor
+        RunningRegression::RunningRegression() {
+            clear();
+        }
+
+        /// Forgets every pair added
+        void RunningRegression::clear() {
+            n = 0;
+            mx = my = 0;
+            sxx = syy = sxy = 0;
+        }
+
+        /// Adds a pair
+        void RunningRegression::add(double x, double y) {
+            n++;
+            double dx = x - mx;
+            double dy = y - my;
+            mx += dx / n;
+            my += dy / n;
+            // dx * (x - new mean x) = dx^2 * (n - 1) / n, the increase in the sum of squares; likewise for the others
+            sxx += dx * (x - mx);
+            syy += dy * (y - my);
+            sxy += dx * (y - my);
+        }
+
+        /// Adds every pair added to other, as if they'd been added to this one
+        void RunningRegression::merge(const RunningRegression& other) {
+            if (other.n == 0) {
+                return;
+            }
+            if (n == 0) {
+                *this = other;
+                return;
+            }
+            double total = static_cast<double>(n + other.n);
+            double dx = other.mx - mx;
+            double dy = other.my - my;
+            double weight = static_cast<double>(n) * other.n / total;
+            sxx += other.sxx + dx * dx * weight;
+            syy += other.syy + dy * dy * weight;
+            sxy += other.sxy + dx * dy * weight;
+            mx += dx * other.n / total;
+            my += dy * other.n / total;
+            n += other.n;
+        }
+
+        /// Slope of the least-squares line of y against x; NaN unless there are two different x values
+        double RunningRegression::slope() const {
+            return sxy / sxx;
+        }
+
+        /// Intercept of the least-squares line of y against x; NaN unless there are two different x values
+        double RunningRegression::intercept() const {
+            return my - slope() * mx;
+        }
+
+        /// Pearson correlation coefficient of the pairs; NaN unless both x and y vary
+        double RunningRegression::pearson() const {
+            return sxy / std::sqrt(sxx * syy);
+        }
+
+        //----------------------------------------------------------------------------------------------------------------
+        /** \brief Constructor.
+         *
+         *  \param[in] window_  Samples in the window
+         */
+        SlidingMinMax::SlidingMinMax(std::size_t window_) :
+            window(window_)
+        {
+            if (window == 0) {
+                throw invalid_argument("Sliding window needs at least one sample");
+            }
+            for (Deque* deque : { &mins, &maxes }) {
+                deque->values.resize(window);
+                deque->positions.resize(window);
+            }
+            clear();
+        }
+
+        /// Empties the window.
+        void SlidingMinMax::clear() {
+            pushed = 0;
+            mins.head = mins.size = 0;
+            maxes.head = maxes.size = 0;
+        }
+
+        /// Adds a sample, pushing out the oldest one if the window is full.
+        void SlidingMinMax::push(double value) {
+            pushTo(maxes, value, [](double back, double v) { return back <= v; });
+            pushTo(mins, value, [](double back, double v) { return back >= v; });
+            pushed++;
+        }
+
+        /// Adds n samples, oldest first.
+        void SlidingMinMax::push(const Sample* values, std::size_t n) {
+            for (std::size_t i = 0; i < n; i++) {
+                push(values[i]);
+            }
+        }
+
+        // Drops the front if it has left the window, and the values at the back that the new one supersedes (before()
+        // is true), then appends it.  Positions only increase, so at most one value leaves the front per push.
+        template <typename Before>
+        void SlidingMinMax::pushTo(Deque& deque, double value, Before before) {
+            if (deque.size > 0 && deque.positions[deque.head] + window <= pushed) {
+                deque.head = (deque.head + 1 == window) ? 0 : deque.head + 1;
+                deque.size--;
+            }
+            while (deque.size > 0) {
+                std::size_t back = (deque.head + deque.size - 1) % window;
+                if (!before(deque.values[back], value)) {
+                    break;
+                }
+                deque.size--;
+            }
+            std::size_t slot = (deque.head + deque.size) % window;
+            deque.values[slot] = value;
+            deque.positions[slot] = pushed;
+            deque.size++;
+        }
+
+        //----------------------------------------------------------------------------------------------------------------
+        /** \brief Constructor.
+         *
+         *  \param[in] window_  Samples in the window
+         *  \param[in] low_     Bottom of the histogram's range
+         *  \param[in] high_    Top of the histogram's range
+         *  \param[in] bins     Bins in the histogram; the median's resolution is (high - low) / bins
+         */
+        SlidingMedian::SlidingMedian(std::size_t window_, double low_, double high_, unsigned int bins) :
+            ring(window_),
+            histogram(bins),
+            low(low_),
+            binWidth((high_ - low_) / bins)
+        {
+            if (window_ == 0 || bins == 0 || !(high_ > low_)) {
+                throw invalid_argument("Sliding median needs at least one sample, one bin, and a range");
+            }
+            clear();
+        }
+
+        /// Empties the window.
+        void SlidingMedian::clear() {
+            std::fill(histogram.begin(), histogram.end(), 0);
+            next = 0;
+            filled = 0;
+            medianBin = static_cast<uint32_t>(histogram.size() / 2);
+            below = 0;
+        }
+
+        uint32_t SlidingMedian::binOf(double value) const {
+            double bin = (value - low) / binWidth;
+            if (!(bin >= 0)) {
+                return 0; // Also NaN
+            }
+            uint32_t last = static_cast<uint32_t>(histogram.size() - 1);
+            return (bin >= last) ? last : static_cast<uint32_t>(bin);
+        }
+
+        /// Adds a sample, pushing out the oldest one if the window is full.
+        void SlidingMedian::push(double value) {
+            if (filled == ring.size()) {
+                uint32_t old = ring[next];
+                histogram[old]--;
+                if (old < medianBin) {
+                    below--;
+                }
+            }
+            else {
+                filled++;
+            }
+            uint32_t bin = binOf(value);
+            ring[next] = bin;
+            histogram[bin]++;
+            if (bin < medianBin) {
+                below++;
+            }
+            next = (next + 1 == ring.size()) ? 0 : next + 1;
+            settle();
+        }
+
+        /// Adds n samples, oldest first.
+        void SlidingMedian::push(const Sample* values, std::size_t n) {
+            for (std::size_t i = 0; i < n; i++) {
+                push(values[i]);
+            }
+        }
+
+        // Moves the cursor to the bin holding the lower median, i.e., the sample of rank (filled - 1) / 2
+        void SlidingMedian::settle() {
+            std::size_t rank = (filled - 1) / 2;
+            while (below > rank) {
+                medianBin--;
+                below -= histogram[medianBin];
+            }
+            while (below + histogram[medianBin] <= rank) {
+                below += histogram[medianBin];
+                medianBin++;
+            }
+        }
+
+        /// Approximate median of the samples in the window (assuming they're spread evenly within each bin), or NaN if it's empty
+        double SlidingMedian::median() const {
+            if (filled == 0) {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+            std::size_t rank = (filled - 1) / 2;
+            double fraction = (rank - below + 0.5) / histogram[medianBin];
+            return low + (medianBin + fraction) * binWidth;
+        }
+
+        //----------------------------------------------------------------------------------------------------------------
+        /** \brief In-place, radix-2 fast Fourier transform: X[k] = sum over n of x[n] e^(-2 pi i k n / N).
+         *
+         *  \param[in,out] data  The N input samples, replaced by the N coefficients; N must be a power of 2
+         */
+        void fft(vector<complex<double>>& data) {
+            std::size_t n = data.size();
+            if (n == 0 || (n & (n - 1)) != 0) {
+                throw invalid_argument("FFT length must be a power of 2");
+            }
+
+            // Bit-reversal permutation
+            for (std::size_t i = 1, j = 0; i < n; i++) {
+                std::size_t bit = n >> 1;
+                for (; j & bit; bit >>= 1) {
+                    j ^= bit;
+                }
+                j ^= bit;
+                if (i < j) {
+                    std::swap(data[i], data[j]);
+                }
+            }
+
+            // Butterflies, the twiddle factors of each stage computed once
+            vector<complex<double>> twiddles(n / 2);
+            for (std::size_t k = 0; k < n / 2; k++) {
+                double angle = -2 * PI * k / n;
+                twiddles[k] = complex<double>(cos(angle), sin(angle));
+            }
+            for (std::size_t length = 2; length <= n; length <<= 1) {
+                std::size_t half = length / 2;
+                std::size_t stride = n / length;
+                for (std::size_t start = 0; start < n; start += length) {
+                    for (std::size_t k = 0; k < half; k++) {
+                        complex<double> odd = twiddles[k * stride] * data[start + k + half];
+                        data[start + k + half] = data[start + k] - odd;
+                        data[start + k] += odd;
+                    }
+                }
+            }
+        }
+
+        /** \brief In-place inverse of fft(), including the 1/N: x[n] = (1/N) sum over k of X[k] e^(2 pi i k n / N).
+         *
+         *  \param[in,out] data  The N coefficients, replaced by the N samples; N must be a power of 2
+         */
+        void inverseFFT(vector<complex<double>>& data) {
+            // conj(fft(conj(X))) / N
+            for (complex<double>& x : data) {
+                x = std::conj(x);
+            }
+            fft(data);
+            double scale = 1.0 / data.size();
+            for (complex<double>& x : data) {
+                x = std::conj(x) * scale;
+            }
+        }
+
         //----------------------------------------------------------------------------------------------------------------
 
         /// \cond private
@@ -258,23 +736,115 @@ namespace CLAMP {
         }
 
         /// \cond private
-        bool ExponentialFit::lmOneStep(double& lambda, double beta[3], const vector<double>& xs, const vector<double>& ys, double& chi2) {
-            vector<array<double, 3>> J = getJ(xs, beta);
-            vector<double> diff = getDifference(xs, ys, beta);
-
-            // J: n x 3
-            // JtJ = J'*J;
-            double JtJ[3][3] = { 0, 0, 0,
-                0, 0, 0,
-                0, 0, 0 };
-            for (unsigned int i = 0; i < 3; i++) {
-                for (unsigned int j = 0; j < 3; j++) {
-                    for (unsigned int k = 0; k < J.size(); k++) {
-                        JtJ[i][j] += J[k][i] * J[k][j];
+        /* The fused kernels work on blocks of FIT_BLOCK samples: first exp(B * x) for the whole block (a loop compilers
+         * with a vector math library, e.g., MSVC, turn into SIMD exp calls), then the products, summed into FIT_LANES
+         * independent partial sums so that loop vectorizes too without reassociating floating point math.
+         */
+        static const std::size_t FIT_BLOCK = 256;
+        static const std::size_t FIT_LANES = 4;
+
+        void ExponentialFit::accumulateNormalEquations(const double* xs, const double* ys, std::size_t n, const double beta[3], double JtJ[3][3], double Jtr[3], double& sumSquares) {
+            const double A = beta[0];
+            const double B = beta[1];
+            const double C = beta[2];
+
+            // Partial sums.  J = { 1, C * x * e, e } for e = exp(B * x), so J'*J[0][0] is just n.
+            double s01[FIT_LANES] = {}, s02[FIT_LANES] = {}, s11[FIT_LANES] = {}, s12[FIT_LANES] = {}, s22[FIT_LANES] = {};
+            double b0[FIT_LANES] = {}, b1[FIT_LANES] = {}, b2[FIT_LANES] = {}, c[FIT_LANES] = {};
+            double e[FIT_BLOCK];
+
+            for (std::size_t first = 0; first < n; first += FIT_BLOCK) {
+                std::size_t len = std::min(FIT_BLOCK, n - first);
+                const double* x = xs + first;
+                const double* y = ys + first;
+                for (std::size_t k = 0; k < len; k++) {
+                    e[k] = exp(B * x[k]);
+                }
+                // Pad to a whole number of lanes with samples that contribute nothing
+                std::size_t padded = (len + FIT_LANES - 1) / FIT_LANES * FIT_LANES;
+                for (std::size_t k = 0; k < padded; k += FIT_LANES) {
+                    for (std::size_t l = 0; l < FIT_LANES; l++) {
+                        bool valid = k + l < len;
+                        double ek = valid ? e[k + l] : 0.0;
+                        double xk = valid ? x[k + l] : 0.0;
+                        double r = valid ? y[k + l] - (C * ek + A) : 0.0;
+                        double g1 = C * xk * ek;
+                        double g2 = ek;
+                        s01[l] += g1;
+                        s02[l] += g2;
+                        s11[l] += g1 * g1;
+                        s12[l] += g1 * g2;
+                        s22[l] += g2 * g2;
+                        b0[l] += r;
+                        b1[l] += g1 * r;
+                        b2[l] += g2 * r;
+                        c[l] += r * r;
+                    }
+                }
+            }
+
+            double sum[9] = {};
+            for (std::size_t l = 0; l < FIT_LANES; l++) {
+                sum[0] += s01[l];
+                sum[1] += s02[l];
+                sum[2] += s11[l];
+                sum[3] += s12[l];
+                sum[4] += s22[l];
+                sum[5] += b0[l];
+                sum[6] += b1[l];
+                sum[7] += b2[l];
+                sum[8] += c[l];
+            }
+            JtJ[0][0] = static_cast<double>(n);
+            JtJ[0][1] = JtJ[1][0] = sum[0];
+            JtJ[0][2] = JtJ[2][0] = sum[1];
+            JtJ[1][1] = sum[2];
+            JtJ[1][2] = JtJ[2][1] = sum[3];
+            JtJ[2][2] = sum[4];
+            Jtr[0] = sum[5];
+            Jtr[1] = sum[6];
+            Jtr[2] = sum[7];
+            sumSquares = sum[8];
+        }
+
+        double ExponentialFit::sumOfSquares(const double* xs, const double* ys, std::size_t n, const double beta[3]) {
+            const double A = beta[0];
+            const double B = beta[1];
+            const double C = beta[2];
+
+            double c[FIT_LANES] = {};
+            double e[FIT_BLOCK];
+            for (std::size_t first = 0; first < n; first += FIT_BLOCK) {
+                std::size_t len = std::min(FIT_BLOCK, n - first);
+                const double* x = xs + first;
+                const double* y = ys + first;
+                for (std::size_t k = 0; k < len; k++) {
+                    e[k] = exp(B * x[k]);
+                }
+                std::size_t padded = (len + FIT_LANES - 1) / FIT_LANES * FIT_LANES;
+                for (std::size_t k = 0; k < padded; k += FIT_LANES) {
+                    for (std::size_t l = 0; l < FIT_LANES; l++) {
+                        bool valid = k + l < len;
+                        double r = valid ? y[k + l] - (C * e[k + l] + A) : 0.0;
+                        c[l] += r * r;
                     }
                 }
             }
 
+            double sum = 0;
+            for (std::size_t l = 0; l < FIT_LANES; l++) {
+                sum += c[l];
+            }
+            return sum;
+        }
+
+        bool ExponentialFit::lmOneStep(double& lambda, double beta[3], const vector<double>& xs, const vector<double>& ys, double& chi2) {
+            // JtJ = J'*J, b = J'*diff, chi2 = diff'*diff / length(x); J is n x 3
+            double JtJ[3][3];
+            double b[3];
+            accumulateNormalEquations(xs.data(), ys.data(), xs.size(), beta, JtJ, b, chi2);
+            chi2 /= xs.size();
+
             // A = JtJ + lambda * diag(diag(JtJ));
             double A[3][3];
             for (unsigned int i = 0; i < 3; i++) {
@@ -284,14 +854,6 @@ namespace CLAMP {
                 A[i][i] += lambda * JtJ[i][i];
             }
 
-            // b = J'*diff;
-            double b[3] = { 0, 0, 0 };
-            for (unsigned int i = 0; i < 3; i++) {
-                for (unsigned int k = 0; k < J.size(); k++) {
-                    b[i] += J[k][i] * diff[k];
-                }
-            }
-
             // Now, A * delta = b
             // So let delta = inverse(A) * b
             double Ainv[3][3];
@@ -311,21 +873,8 @@ namespace CLAMP {
                 new_beta[i] = beta[i] + delta[i];
             }
 
-            vector<double> new_diff = getDifference(xs, ys, new_beta);
-
-            // chi2 = diff'*diff / length(x)
-            chi2 = 0;
-            for (unsigned int i = 0; i < diff.size(); i++) {
-                chi2 += diff[i] * diff[i];
-            }
-            chi2 /= diff.size();
-
             // new_chi2 = new_diff' * new_diff / length(x)
-            double new_chi2 = 0;
-            for (unsigned int i = 0; i < new_diff.size(); i++) {
-                new_chi2 += new_diff[i] * new_diff[i];
-            }
-            new_chi2 /= new_diff.size();
+            double new_chi2 = sumOfSquares(xs.data(), ys.data(), xs.size(), new_beta) / xs.size();
 
             if (new_chi2 >= chi2) {
                 if (lambda < 10) {
@@ -345,6 +894,76 @@ namespace CLAMP {
         }
         /// \endcond
 
+        /** \brief Non-iterative estimate of the exponential through xs and ys, for seeding lm()
+         *
+         *  Uses the integral equation method: since f(x) = C * exp(B * x) + A satisfies
+         \code
+            f(x) - f(x0) = B * integral(x0..x) f dt - A * B * (x - x0)
+         \endcode
+         *  a linear regression of y - y0 on the running (trapezoidal) integral of y and on x - x0 gives B.  With B fixed,
+         *  f is linear in A and C, so a second regression gives those.
+         *
+         * \param[in] xs    X values, in increasing order
+         * \param[in] ys    Y values
+         * \param[out] beta Estimated parameters (see lm); only written if the estimate succeeded
+         * \returns True if the estimate is usable (a decaying exponential, from a well-conditioned regression)
+         */
+        bool ExponentialFit::initialGuess(const vector<double>& xs, const vector<double>& ys, /* out: */ double beta[3]) {
+            std::size_t n = xs.size();
+            if (n < 3 || ys.size() != n) {
+                return false;
+            }
+
+            // First regression: (y - y0) = c1 * (x - x0) + c2 * S, where S is the integral of y from x0
+            double x0 = xs[0], y0 = ys[0];
+            double S = 0;
+            double uu = 0, us = 0, ss = 0, uy = 0, sy = 0;
+            for (std::size_t k = 0; k < n; k++) {
+                if (k > 0) {
+                    S += 0.5 * (ys[k] + ys[k - 1]) * (xs[k] - xs[k - 1]);
+                }
+                double u = xs[k] - x0;
+                double dy = ys[k] - y0;
+                uu += u * u;
+                us += u * S;
+                ss += S * S;
+                uy += u * dy;
+                sy += S * dy;
+            }
+            double d = uu * ss - us * us;
+            if (!(d > 0)) {
+                return false;
+            }
+            double B = (uu * sy - us * uy) / d;
+            if (!(B < 0) || !std::isfinite(B)) {
+                return false;
+            }
+
+            // Second regression: y = A + C * exp(B * x)
+            double se = 0, see = 0, sy2 = 0, sey = 0;
+            for (std::size_t k = 0; k < n; k++) {
+                double e = exp(B * xs[k]);
+                se += e;
+                see += e * e;
+                sy2 += ys[k];
+                sey += e * ys[k];
+            }
+            double d2 = n * see - se * se;
+            if (!(d2 > 0)) {
+                return false;
+            }
+            double C = (n * sey - se * sy2) / d2;
+            double A = (sy2 - C * se) / n;
+            if (!std::isfinite(A) || !std::isfinite(C)) {
+                return false;
+            }
+
+            beta[0] = A;
+            beta[1] = B;
+            beta[2] = C;
+            return true;
+        }
+
         /** \brief Fits xs and ys with an exponential using the Levenberg-Marquardt optimization algorithm
          *
          *  This function applies the Levenberg-Marquardt algorithm to find *beta* values that minimize
@@ -357,36 +976,43 @@ namespace CLAMP {
             f(x) = beta[2] * exp( beta[1] * x ) + beta[0]
          \endcode
          *
+         * The search starts from initialGuess(), or from a typical model cell if that fails.
+         *
          * \param[in] xs    X values (in our application, these are time, adjusted with t = 0 the time of the step)
          * \param[in] ys    Y values (in our application, these are measured voltages or currents)
          * \param[out] beta Fitted parameters (see above)
          * \param[out] chi2 chi^2 value
+         * \returns Number of Levenberg-Marquardt iterations taken
          */
-        void ExponentialFit::lm(const std::vector<double>& xs, const std::vector<double>& ys, /* out: */ double beta[3], double& chi2) {
+        unsigned int ExponentialFit::lm(const std::vector<double>& xs, const std::vector<double>& ys, /* out: */ double beta[3], double& chi2) {
             // Initial guess
-            beta[0] = ys.back();
-            beta[1] = -3000;   // Corresponds to model cell parameters: Ra = 10 M, Rm = 500 M => Rp ~= 10M.  Cm = 33pF.  Tau = -1/RpCm ~= -3000
-            beta[2] = ys.front() - ys.back();
+            if (!initialGuess(xs, ys, beta)) {
+                beta[0] = ys.back();
+                beta[1] = -3000;   // Corresponds to model cell parameters: Ra = 10 M, Rm = 500 M => Rp ~= 10M.  Cm = 33pF.  Tau = -1/RpCm ~= -3000
+                beta[2] = ys.front() - ys.back();
+            }
 
             double lambda = 0.001;
 
             unsigned int consecutiveNonSteps = 0;
 
             unsigned int numSteps = 0;
+            unsigned int iterations = 0;
             bool first = true;
             for (;;) {
                 double old_chi2 = chi2;
                 double old_beta[3] = { beta[0], beta[1], beta[2] };
 
                 bool tookAStep = lmOneStep(lambda, beta, xs, ys, chi2);
+                iterations++;
                 if (lambda < 1e-9) {
                     break;
                 }
                 if (tookAStep) {
                     consecutiveNonSteps = 0;
                     if (!first) {
-                        double fracChangeChi2 = abs((chi2 - old_chi2) / old_chi2);
-                        double fracChangeBeta = abs((beta[0] - old_beta[0]) / old_beta[0]) + abs((beta[1] - old_beta[1]) / old_beta[1]) + abs((beta[2] - old_beta[2]) / old_beta[2]);
+                        double fracChangeChi2 = std::abs((chi2 - old_chi2) / old_chi2);
+                        double fracChangeBeta = std::abs((beta[0] - old_beta[0]) / old_beta[0]) + std::abs((beta[1] - old_beta[1]) / old_beta[1]) + std::abs((beta[2] - old_beta[2]) / old_beta[2]);
                         if (fracChangeChi2 < 1e-6 && fracChangeBeta < 1e-6) {
                             break;
                         }
@@ -404,6 +1030,7 @@ namespace CLAMP {
                 }
                 first = false;
             }
+            return iterations;
         }
     }
 }
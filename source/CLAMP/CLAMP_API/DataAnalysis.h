@@ -1,23 +1,198 @@
 #pragma once
 
+#include <complex>
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 #include <array>
+#include "Constants.h"
 
 namespace CLAMP {
     namespace SignalProcessing {
+        /// Samples [begin, end) of a channel's raw data holding one capture, e.g., one trim candidate's; see DataAnalysis::calculateBestTrims()
+        struct CaptureWindow {
+            std::size_t begin;
+            std::size_t end;
+
+            CaptureWindow(std::size_t begin_, std::size_t end_) : begin(begin_), end(end_) {}
+        };
+
         /// Miscellaneous data analysis/numerical routines
         class DataAnalysis {
         public:
             static double average(std::vector<int32_t>::const_iterator begin, std::vector<int32_t>::const_iterator end);
             static double average(std::vector<double>::const_iterator begin, std::vector<double>::const_iterator end);
+            static double average(std::vector<float>::const_iterator begin, std::vector<float>::const_iterator end);
             static double slope(std::vector<double>::const_iterator xbegin, std::vector<double>::const_iterator xend, std::vector<double>::const_iterator ybegin, std::vector<double>::const_iterator yend);
             static double pearson(std::vector<double>::const_iterator xbegin, std::vector<double>::const_iterator xend, std::vector<double>::const_iterator ybegin, std::vector<double>::const_iterator yend);
             static double calculateBestResidual(std::vector<double>::const_iterator begin, std::vector<double>::const_iterator end);
+            static double calculateBestResidual(std::vector<float>::const_iterator begin, std::vector<float>::const_iterator end);
             static int32_t calculateBestResidual(std::vector<int32_t>::const_iterator begin, std::vector<int32_t>::const_iterator end);
             static std::pair<unsigned int, int32_t> calculateBestTrim(std::vector<int32_t>& values);
+            static void calculateBestResiduals(const std::vector<const int32_t*>& channels, const std::vector<CaptureWindow>& windows, std::vector<int32_t>& residuals);
+            static void calculateBestTrims(const std::vector<const int32_t*>& channels, const std::vector<CaptureWindow>& windows, std::vector<std::pair<unsigned int, int32_t>>& trims);
+        };
+
+        /** \brief Mean and variance over the last *window* samples, updated in O(1) per sample.
+         *
+         *  Keeps the running sum and sum of squares of the window, adding each new sample and subtracting the one it
+         *  pushes out.  To keep that accurate, the samples are stored less a reference value (the first sample pushed),
+         *  which keeps the sums small for data sitting on a large offset, and the sums are recomputed from scratch once
+         *  per window's worth of samples, so rounding errors can't accumulate.
+         *
+         *  push(const Sample*, std::size_t) takes a whole chunk, e.g., the span passed to a Board sample callback; its
+         *  inner loops run over contiguous ranges with independent partial sums, which the compiler can vectorize.
+         \code
+            SlidingMoments noise(500); // 10 ms at 50 kHz
+            // ... for each chunk:
+            noise.push(span.samples, span.length);
+            double rms = std::sqrt(noise.variance());
+         \endcode
+         */
+        class SlidingMoments {
+        public:
+            explicit SlidingMoments(std::size_t window_);
+
+            void clear();
+            void push(double value);
+            void push(const Sample* values, std::size_t n);
+
+            /// Samples in the window: those pushed so far, up to the window length
+            std::size_t count() const { return filled; }
+            double mean() const;
+            double variance() const;
+
+        private:
+            std::vector<double> ring; // Window, less shift; the oldest sample is at next once the window is full
+            std::size_t next;
+            std::size_t filled;
+            std::size_t sinceExact;   // Samples pushed since the sums were last recomputed
+            double shift;
+            double sum;
+            double sumSquares;
+
+            void pushRun(const Sample* values, std::size_t n);
+            void recompute();
+        };
+
+        /** \brief Least-squares line and Pearson correlation of (x, y) pairs, updated in O(1) per pair.
+         *
+         *  Keeps the means and the sums of squared and cross deviations from them, updated as in Welford's method, so
+         *  there's no cancellation as there would be in sum(x^2) - n * mean(x)^2 for data far from zero (e.g., currents
+         *  on a holding offset).  The results agree with DataAnalysis::slope() and DataAnalysis::pearson() of the
+         *  same pairs (to rounding), without keeping the pairs or going over them again.  merge() combines two accumulators, e.g., ones filled on
+         *  different threads.
+         \code
+            RunningRegression iv;
+            // ... as each step completes:
+            iv.add(current, voltage);
+            double resistance = iv.slope(); // dV/dI
+         \endcode
+         */
+        class RunningRegression {
+        public:
+            RunningRegression();
+
+            void clear();
+            void add(double x, double y);
+            void merge(const RunningRegression& other);
+
+            /// Pairs added
+            std::size_t count() const { return n; }
+            /// Mean of the x values, or 0 if there are none
+            double meanX() const { return mx; }
+            /// Mean of the y values, or 0 if there are none
+            double meanY() const { return my; }
+            double slope() const;
+            double intercept() const;
+            double pearson() const;
+
+        private:
+            std::size_t n;
+            double mx;
+            double my;
+            double sxx; // Sum of (x - mean x)^2
+            double syy; // Sum of (y - mean y)^2
+            double sxy; // Sum of (x - mean x) * (y - mean y)
         };
 
+        /** \brief Minimum and maximum over the last *window* samples, in amortized O(1) per sample.
+         *
+         *  Uses the monotone deque method: the maximum deque holds the samples that are larger than every sample pushed
+         *  after them, in order, so its front is the window's maximum; each sample enters and leaves it once.  Likewise
+         *  for the minimum.  Both deques are ring buffers of the window length, allocated once.
+         */
+        class SlidingMinMax {
+        public:
+            explicit SlidingMinMax(std::size_t window_);
+
+            void clear();
+            void push(double value);
+            void push(const Sample* values, std::size_t n);
+
+            /// Samples in the window: those pushed so far, up to the window length
+            std::size_t count() const { return (pushed < window) ? static_cast<std::size_t>(pushed) : window; }
+            /// Least sample in the window; only valid if count() > 0
+            double min() const { return mins.values[mins.head]; }
+            /// Greatest sample in the window; only valid if count() > 0
+            double max() const { return maxes.values[maxes.head]; }
+
+        private:
+            /// \cond private
+            struct Deque {
+                std::vector<double> values;
+                std::vector<uint64_t> positions; // Which sample (counting from clear()) each value was
+                std::size_t head;
+                std::size_t size;
+            };
+            /// \endcond
+
+            std::size_t window;
+            uint64_t pushed;
+            Deque mins;
+            Deque maxes;
+
+            template <typename Before>
+            void pushTo(Deque& deque, double value, Before before);
+        };
+
+        /** \brief Approximate median over the last *window* samples, in O(1) per sample for slowly varying data.
+         *
+         *  Samples are counted in a histogram of equal bins spanning [low, high) (samples outside it count in the end
+         *  bins), and a cursor is kept on the bin holding the median; each new or departing sample moves the cursor by at
+         *  most a bin or so.  The result is the median bin's center, interpolated within the bin, so its resolution is
+         *  (high - low) / bins.  Useful for baselines that mustn't be pulled by spikes or transients, e.g., the holding
+         *  current of a voltage clamp recording.
+         */
+        class SlidingMedian {
+        public:
+            SlidingMedian(std::size_t window_, double low_, double high_, unsigned int bins = 1024);
+
+            void clear();
+            void push(double value);
+            void push(const Sample* values, std::size_t n);
+
+            /// Samples in the window: those pushed so far, up to the window length
+            std::size_t count() const { return filled; }
+            double median() const;
+
+        private:
+            std::vector<uint32_t> ring; // Bin of each sample in the window
+            std::vector<uint32_t> histogram;
+            std::size_t next;
+            std::size_t filled;
+            double low;
+            double binWidth;
+            uint32_t medianBin; // Bin holding the median...
+            std::size_t below;  // ...and how many samples are in lower bins
+
+            uint32_t binOf(double value) const;
+            void settle();
+        };
+
+        void fft(std::vector<std::complex<double>>& data);
+        void inverseFFT(std::vector<std::complex<double>>& data);
+
         /** \brief Numerical routines used in fitting an exponential distribution to data.
          *
          *  This uses the Levenberg-Marquardt algorithm.  It takes inspiration from Numerical Recipes in C, and from the
@@ -32,7 +207,8 @@ namespace CLAMP {
          */
         class ExponentialFit {
         public:
-            static void lm(const std::vector<double>& xs, const std::vector<double>& ys, /* out: */ double beta[3], double& chi2);
+            static unsigned int lm(const std::vector<double>& xs, const std::vector<double>& ys, /* out: */ double beta[3], double& chi2);
+            static bool initialGuess(const std::vector<double>& xs, const std::vector<double>& ys, /* out: */ double beta[3]);
             static double f(double x, double beta[3]);
 
             /* These functions are essentially private.  But, because the logic of lm is sufficiently complicated, I made
@@ -53,6 +229,10 @@ namespace CLAMP {
             static std::vector<std::array<double,3>> getJ(const std::vector<double>& xs, double beta[3]);
             // Returns a vector where v[i] = { y[i] - predicted_y[i] }
             static std::vector<double> getDifference(const std::vector<double>& xs, const std::vector<double>& ys, double beta[3]);
+            // Single pass over the data computing J'*J, J'*diff, and sum(diff^2), without materializing J or diff
+            static void accumulateNormalEquations(const double* xs, const double* ys, std::size_t n, const double beta[3], double JtJ[3][3], double Jtr[3], double& sumSquares);
+            // sum(diff^2), without materializing diff
+            static double sumOfSquares(const double* xs, const double* ys, std::size_t n, const double beta[3]);
             // One step of the Levenberg-Marquardt algorithm
             static bool lmOneStep(double& lambda, double beta[3], const std::vector<double>& xs, const std::vector<double>& ys, double& chi2);
 
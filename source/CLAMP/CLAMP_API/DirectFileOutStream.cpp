@@ -0,0 +1,289 @@
+#include "DirectFileOutStream.h"
+#include "SaveWriterThread.h"
+#include "common.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+using std::unique_lock;
+using std::mutex;
+using std::invalid_argument;
+using std::runtime_error;
+
+namespace CLAMP {
+    namespace IO {
+        /** \brief Constructor
+         *
+         *  \param[in] async       Write full buffers on SaveWriterThread rather than on the calling thread
+         *  \param[in] blockSize_  Size of each write; rounded up to a multiple of ALIGNMENT
+         */
+        DirectFileOutStream::DirectFileOutStream(bool async, unsigned int blockSize_) :
+            FileOutStream(),
+#if defined(_WIN32)
+            handle(INVALID_HANDLE_VALUE),
+#else
+            fd(-1),
+#endif
+            direct(false),
+            blockSize((std::max(blockSize_, 1u) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+            writer(async ? &SaveWriterThread::instance() : nullptr),
+            slots(async ? ASYNC_BUFFERS : 1),
+            current(0),
+            fill(0),
+            offset(0)
+        {
+            for (Slot& slot : slots) {
+                slot.buffer.reserve(blockSize);
+                slot.busy = false;
+            }
+        }
+
+        /// Writes what's left and closes the file
+        DirectFileOutStream::~DirectFileOutStream() {
+            try {
+                finish();
+            }
+            catch (...) {
+            }
+        }
+
+        /// Writes the last buffer and closes the file, throwing if that (or a queued write) failed
+        void DirectFileOutStream::close() {
+            finish();
+        }
+
+        bool DirectFileOutStream::isOpen() const {
+#if defined(_WIN32)
+            return handle != INVALID_HANDLE_VALUE;
+#else
+            return fd >= 0;
+#endif
+        }
+
+        /// Creates the file, or empties it if it exists
+        void DirectFileOutStream::open(const FILENAME& path) {
+            if (isOpen()) {
+                throw runtime_error("DirectFileOutStream is already open");
+            }
+#if defined(_WIN32)
+            // Shared for writing, so SaveFile can reserve space for it through another handle
+            DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    #if defined(_UNICODE)
+            handle = CreateFileW(path.c_str(), GENERIC_WRITE, share, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+    #else
+            handle = CreateFileA(path.c_str(), GENERIC_WRITE, share, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+    #endif
+            if (handle == INVALID_HANDLE_VALUE) {
+                throw std::system_error(static_cast<int>(GetLastError()), std::system_category());
+            }
+            direct = true;
+#else
+            int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    #if defined(O_DIRECT)
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0666);
+            direct = (fd >= 0);
+            if (fd < 0 && errno == EINVAL) {
+                // The filesystem doesn't do direct I/O
+                fd = ::open(path.c_str(), flags, 0666);
+            }
+    #else
+            fd = ::open(path.c_str(), flags, 0666);
+    #endif
+            if (fd < 0) {
+                throw std::system_error(errno, std::system_category());
+            }
+    #if defined(__APPLE__)
+            direct = (fcntl(fd, F_NOCACHE, 1) != -1);
+    #endif
+#endif
+            current = 0;
+            fill = 0;
+            offset = 0;
+        }
+
+        int DirectFileOutStream::write(const char* data, int len) {
+            if (!isOpen()) {
+                throw runtime_error("DirectFileOutStream isn't open");
+            }
+            if (len < 0) {
+                throw invalid_argument("Negative length");
+            }
+
+            int remaining = len;
+            while (remaining > 0) {
+                Slot& slot = slots[current];
+                if (fill == 0 && writer) {
+                    // Wait for the disk to finish with this buffer from the last time around the ring
+                    unique_lock<mutex> lock(slotMutex);
+                    while (slot.busy) {
+                        slotFree.wait(lock);
+                    }
+                }
+
+                unsigned int n = std::min(static_cast<unsigned int>(remaining), blockSize - fill);
+                memcpy(slot.buffer.get() + fill, data, n);
+                fill += n;
+                data += n;
+                remaining -= n;
+                if (fill == blockSize) {
+                    submit();
+                }
+            }
+            return len;
+        }
+
+        // Writes the full current slot (here, or on the writer thread) and moves on to the next one
+        void DirectFileOutStream::submit() {
+            unsigned int index = current;
+            uint64_t position = offset;
+            offset += fill;
+            current = (current + 1) % slots.size();
+            fill = 0;
+
+            if (!writer) {
+                writeBlock(slots[index].buffer.get(), position, blockSize);
+                return;
+            }
+
+            {
+                unique_lock<mutex> lock(slotMutex);
+                slots[index].busy = true;
+            }
+            auto task = [this, index, position]() {
+                std::exception_ptr failure;
+                try {
+                    writeBlock(slots[index].buffer.get(), position, blockSize);
+                }
+                catch (...) {
+                    failure = std::current_exception();
+                }
+                {
+                    unique_lock<mutex> lock(slotMutex);
+                    slots[index].busy = false;
+                }
+                slotFree.notify_all();
+                if (failure) {
+                    std::rethrow_exception(failure);
+                }
+            };
+            try {
+                writer->enqueueTask(this, task, blockSize, &error);
+            }
+            catch (...) {
+                // An earlier block failed, so this one wasn't queued
+                unique_lock<mutex> lock(slotMutex);
+                slots[index].busy = false;
+                throw;
+            }
+        }
+
+        // Writes len bytes (a multiple of ALIGNMENT, from an aligned buffer) at file offset position
+        void DirectFileOutStream::writeBlock(const unsigned char* data, uint64_t position, unsigned int len) {
+#if defined(_WIN32)
+            while (len > 0) {
+                OVERLAPPED where = {};
+                where.Offset = static_cast<DWORD>(position);
+                where.OffsetHigh = static_cast<DWORD>(position >> 32);
+                DWORD written = 0;
+                if (!WriteFile(handle, data, len, &written, &where) || written == 0) {
+                    throw std::system_error(static_cast<int>(GetLastError()), std::system_category());
+                }
+                data += written;
+                position += written;
+                len -= written;
+            }
+#else
+            off_t start = static_cast<off_t>(position);
+            unsigned int total = len;
+            while (len > 0) {
+                ssize_t written = pwrite(fd, data, len, static_cast<off_t>(position));
+                if (written < 0) {
+    #if defined(O_DIRECT)
+                    if (errno == EINVAL && direct) {
+                        // Some filesystems accept O_DIRECT in open() but not in write(); carry on through the cache
+                        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                        direct = false;
+                        continue;
+                    }
+    #endif
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category());
+                }
+                data += written;
+                position += static_cast<uint64_t>(written);
+                len -= static_cast<unsigned int>(written);
+            }
+    #if defined(__linux__)
+            if (!direct) {
+                // Drop the block from the cache once it's on the disk (dirty pages can't be dropped)
+                sync_file_range(fd, start, total, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd, start, total, POSIX_FADV_DONTNEED);
+            }
+    #else
+            (void)start;
+            (void)total;
+    #endif
+#endif
+        }
+
+        // Waits for queued blocks, writes the partial last one, sets the file's length and closes it
+        void DirectFileOutStream::finish() {
+            if (!isOpen()) {
+                return;
+            }
+            std::exception_ptr failure;
+            if (writer) {
+                writer->drain(this);
+                failure = error;
+                error = nullptr;
+            }
+
+            uint64_t length = offset + fill;
+            try {
+                if (fill > 0) {
+                    unsigned int padded = (fill + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+                    memset(slots[current].buffer.get() + fill, 0, padded - fill);
+                    writeBlock(slots[current].buffer.get(), offset, padded);
+                }
+            }
+            catch (...) {
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+            fill = 0;
+
+#if defined(_WIN32)
+            FILE_END_OF_FILE_INFO info;
+            info.EndOfFile.QuadPart = static_cast<LONGLONG>(length);
+            SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info));
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+#else
+            if (ftruncate(fd, static_cast<off_t>(length)) != 0 && !failure) {
+                failure = std::make_exception_ptr(std::system_error(errno, std::system_category()));
+            }
+            ::close(fd);
+            fd = -1;
+#endif
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "streams.h"
+#include "AlignedBuffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        class SaveWriterThread;
+
+        /** \brief FileOutStream that writes around the operating system's file cache.
+         *
+         *  Data is collected in a ring of page-aligned buffers, and each full buffer goes to the disk in one aligned
+         *  write, with O_DIRECT (Linux), F_NOCACHE (macOS) or FILE_FLAG_NO_BUFFERING (Windows).  Compared with
+         *  FileOutStream, the data isn't copied through std::ofstream's buffer and the page cache, and a long recording
+         *  doesn't fill the acquisition PC's memory with file data that won't be read back.
+         *
+         *  In asynchronous mode, full buffers are written on SaveWriterThread (counting against its memory budget) while
+         *  the caller fills the next one, and write() only waits if every buffer in the ring is still being written.
+         *  Otherwise, each buffer is written on the calling thread as soon as it's full.
+         *
+         *  The last, partial buffer is written when the stream is destroyed: padded to ALIGNMENT, after which the file
+         *  is cut back to the length that was written.  Until then, up to a ring's worth of data is only in memory.
+         *
+         *  If the filesystem doesn't support direct I/O, the file is written through the cache in the same large blocks
+         *  (on Linux, each block is then dropped from the cache once it's on the disk); see isDirect().
+         *
+         *  Errors are thrown from write(), in asynchronous mode from the first write() after they happen.  close() writes
+         *  the last buffer and throws if that fails; if it isn't called, the destructor writes it, and errors are lost.
+         */
+        class DirectFileOutStream : public FileOutStream {
+        public:
+            /// File offsets and write sizes are multiples of this, which covers the sector size of current disks
+            static const unsigned int ALIGNMENT = 4096;
+            /// Default size of each buffer in the ring (a multiple of ALIGNMENT)
+            static const unsigned int DEFAULT_BLOCK_SIZE = 1024 * KILO;
+            /// Buffers in the ring in asynchronous mode; synchronous mode needs only one
+            static const unsigned int ASYNC_BUFFERS = 4;
+
+            explicit DirectFileOutStream(bool async = false, unsigned int blockSize_ = DEFAULT_BLOCK_SIZE);
+            ~DirectFileOutStream();
+
+            void open(const FILENAME& path);
+            int write(const char* data, int len) override;
+            void close() override;
+
+            /// True if the file bypasses the cache; false if the filesystem didn't allow it
+            bool isDirect() const { return direct; }
+
+        private:
+            /// \cond private
+            struct Slot {
+                AlignedBuffer buffer;
+                bool busy; // Queued or being written on SaveWriterThread
+            };
+            /// \endcond
+
+#if defined(_WIN32)
+            void* handle;
+#else
+            int fd;
+#endif
+            std::atomic<bool> direct;
+            unsigned int blockSize;
+            SaveWriterThread* writer; // Null in synchronous mode
+            std::vector<Slot> slots;
+            unsigned int current;     // Slot being filled
+            unsigned int fill;        // Bytes in the current slot
+            uint64_t offset;          // File offset of the current slot
+
+            std::mutex slotMutex;
+            std::condition_variable slotFree;
+            std::exception_ptr error; // From the writer thread; guarded by SaveWriterThread's queue mutex
+
+            bool isOpen() const;
+            void submit();
+            void writeBlock(const unsigned char* data, uint64_t position, unsigned int len);
+            void finish();
+
+            // Not copyable
+            DirectFileOutStream(const DirectFileOutStream&);
+            DirectFileOutStream& operator=(const DirectFileOutStream&);
+        };
+    }
+}
@@ -0,0 +1,176 @@
+#include "DynamicClamp.h"
+#include "Board.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using CLAMP::WaveformControl::RepeatingCommand;
+using std::vector;
+using std::invalid_argument;
+
+namespace CLAMP {
+    // Largest current magnitude the clamp current generator takes, in steps
+    static const int MAX_CURRENT_STEPS = 127;
+    // Default chunk, in seconds' worth of packets; small, but enough to keep up with the per-transfer cost of USB
+    static const double DEFAULT_CHUNK_SECONDS = 0.25e-3;
+
+    /** \brief Constructor.
+     *
+     *  \param[in] board_    Board the channel is on
+     *  \param[in] channel_  Channel to clamp
+     */
+    DynamicClamp::DynamicClamp(Board& board_, const ChipChannel& channel_) :
+        board(board_),
+        channel(channel_),
+        chunkPackets(0),
+        latencyBudget(0),
+        overruns(0),
+        injectedSteps(0),
+        currentStep(0)
+    {
+    }
+
+    /// Sets the conductance model; see CurrentModel and conductance().  Call this before run().
+    void DynamicClamp::setModel(const CurrentModel& model_) {
+        model = model_;
+    }
+
+    /** \brief Sets how many packets (i.e., timesteps) are read per loop.  Call this before run().
+     *
+     *  Smaller chunks mean the current follows the voltage more closely, but every read has a fixed cost, so if the
+     *  chunks are too small for the computer to keep up, the board's FIFO backs up and the latency grows; watch
+     *  Board::latency or the overrun count.
+     *
+     *  \param[in] packets  Packets per read; 0 (the default) for about a quarter of a millisecond's worth
+     */
+    void DynamicClamp::setChunkPackets(unsigned int packets) {
+        chunkPackets = packets;
+    }
+
+    /** \brief Sets the latency that counts as an overrun (see getOverruns()).
+     *
+     *  \param[in] seconds  Budget for each loop, from the newest sample read to the current being sent; 0 for none
+     */
+    void DynamicClamp::setLatencyBudget(double seconds) {
+        latencyBudget = seconds;
+    }
+
+    /** \brief Runs the dynamic clamp until the time is up or stop() is called.
+     *
+     *  Replaces the channel's command list and enables only this channel; the caller restores whatever it needs
+     *  afterwards.  The injected current is set back to zero before this returns.
+     *
+     *  \param[in] seconds   How long to run; 0 to run until stop() is called
+     *  \param[in] callback  If given, called once per chunk; see ChunkCallback
+     */
+    void DynamicClamp::run(double seconds, const ChunkCallback& callback) {
+        if (!model) {
+            throw invalid_argument("No conductance model set for dynamic clamp");
+        }
+        Channel& target = board.controller.getChannel(channel);
+        currentStep = target.recallCurrentStep();
+        if (currentStep <= 0) {
+            throw invalid_argument("Dynamic clamp needs the channel in current clamp, with a current scale set");
+        }
+
+        keepGoing.reset();
+        overruns = 0;
+        latencies.reset();
+
+        board.enableChannels(ChipChannelList(1, channel));
+        double samplingRate = board.getSamplingRateHz();
+        unsigned int chunk = chunkPackets;
+        if (chunk == 0) {
+            chunk = std::max(1u, static_cast<unsigned int>(samplingRate * DEFAULT_CHUNK_SECONDS));
+        }
+        uint64_t timestepsToRun = (seconds > 0) ? static_cast<uint64_t>(std::llround(seconds * samplingRate)) : 0;
+
+        // Fixed chunks: TransferPolicy would otherwise grow them, since small reads are mostly overhead
+        unsigned int oldMinPackets = board.transferPolicy.getMinPackets();
+        unsigned int oldMaxPackets = board.transferPolicy.getMaxPackets();
+        board.transferPolicy.setBounds(chunk, chunk);
+
+        writeCurrent(0);
+        board.readQueue.clear(true);
+        board.runContinuously();
+        try {
+            uint64_t timesteps = 0;
+            double sinceModel = 0;
+            while (keepGoing && (timestepsToRun == 0 || timesteps < timestepsToRun)) {
+                unsigned int n = board.read(chunk, &keepGoing);
+                timesteps += n;
+                sinceModel += n / samplingRate;
+
+                // The read queue holds back the latest packet, so the very first read may not have a sample yet
+                const vector<Sample>& voltages = board.readQueue.getMeasuredVoltages(channel);
+                if (n == 0 || voltages.empty()) {
+                    continue;
+                }
+                double voltage = voltages.back();
+                double current = model(voltage, sinceModel);
+                sinceModel = 0;
+
+                int steps = 0;
+                if (std::isfinite(current)) {
+                    double clipped = std::max<double>(-MAX_CURRENT_STEPS, std::min<double>(MAX_CURRENT_STEPS, current / currentStep));
+                    steps = static_cast<int>(std::lround(clipped));
+                }
+                if (steps != injectedSteps) {
+                    writeCurrent(steps);
+                }
+
+                double latency = board.loopTiming.processed();
+                if (latency >= 0) {
+                    latencies.record(latency);
+                    if (latencyBudget > 0 && latency > latencyBudget) {
+                        overruns++;
+                    }
+                }
+                if (callback) {
+                    callback(voltage, steps * currentStep);
+                }
+                board.readQueue.clear(false);
+            }
+        }
+        catch (...) {
+            board.stop();
+            board.flush();
+            board.readQueue.clear(true);
+            writeCurrent(0);
+            board.transferPolicy.setBounds(oldMinPackets, oldMaxPackets);
+            throw;
+        }
+        board.stop();
+        board.flush();
+        board.readQueue.clear(true);
+        writeCurrent(0);
+        board.transferPolicy.setBounds(oldMinPackets, oldMaxPackets);
+    }
+
+    /// Makes run() return, without waiting for the current read to finish; may be called from any thread.
+    void DynamicClamp::stop() {
+        keepGoing.requestStop();
+    }
+
+    /** \brief A fixed conductance, e.g., a synaptic or leak conductance: I = g (E - V).
+     *
+     *  \param[in] siemens            Conductance g, in siemens
+     *  \param[in] reversalPotential  Reversal potential E, in volts
+     */
+    DynamicClamp::CurrentModel DynamicClamp::conductance(double siemens, double reversalPotential) {
+        return [siemens, reversalPotential](double voltage, double) {
+            return siemens * (reversalPotential - voltage);
+        };
+    }
+
+    // Replaces the channel's command with one that injects the given current, and sends it to the board.  While the
+    // board runs, only the command's word in Waveform RAM changes; see Channel::commandsToFPGA.
+    void DynamicClamp::writeCurrent(int steps) {
+        Channel& target = board.controller.getChannel(channel);
+        target.commands.clear();
+        board.controller.createRepeatingWriteCurrent(channel, RepeatingCommand::READ_VOLTAGE, false, false, static_cast<int8_t>(steps), 1);
+        target.commandsToFPGA();
+        injectedSteps = steps;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "ClampController.h"
+#include "LoopTiming.h"
+#include "StopToken.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace CLAMP {
+    class Board;
+
+    /** \brief Dynamic clamp: injects a current computed from the measured membrane voltage, with as little delay as the
+     *  USB link allows.
+     *
+     *  The channel runs a single command, repeated every timestep, that writes the clamp current and converts the
+     *  membrane voltage.  run() puts only that channel in the channel loop (so packets are small and only it is decoded),
+     *  starts the board, and reads it in small fixed chunks (see setChunkPackets()).  After each chunk it passes the newest
+     *  voltage to the conductance model, and if the current (rounded to the channel's current step) changed, patches
+     *  it into the command in Waveform RAM: one word, rewritten in place, which the board applies the next time it
+     *  fetches the command.
+     *
+     *  The loop latency, from the newest sample a chunk held to its current reaching the board, is recorded in
+     *  latencies (the host and board clocks are aligned as in LoopTiming), and loops that take longer than the budget
+     *  set with setLatencyBudget() are counted as overruns.
+     *
+     *  The channel must already be in current clamp, at the current scale to inject with.  For example:
+     \code
+        board.controller.switchToCurrentClampImmediate(channelList, ClampConfig::I_50pA, 0, 0);
+        DynamicClamp clamp(board, channelList.front());
+        clamp.setModel(DynamicClamp::conductance(5e-9, 0.0)); // 5 nS, reversing at 0 mV
+        clamp.run(10.0);
+        LOG(true) << "99th percentile latency: " << clamp.latencies.percentile(99) * 1e6 << " us\n";
+     \endcode
+     */
+    class DynamicClamp {
+    public:
+        /** \brief Conductance model: returns the current to inject, in amps (positive out of the chip, i.e., into the
+         *  cell), given the membrane voltage in volts and the time since the previous call in seconds.
+         *
+         *  Called on the thread that called run(), once per chunk read; it's in the loop, so it should be quick.
+         */
+        typedef std::function<double(double voltage, double dt)> CurrentModel;
+        /** \brief Called once per chunk, after the chunk's current has been sent, with the voltage the model was given
+         *  and the current injected (in amps).  Board::readQueue holds the chunk's data meanwhile.
+         */
+        typedef std::function<void(double voltage, double current)> ChunkCallback;
+
+        DynamicClamp(Board& board_, const ClampConfig::ChipChannel& channel_);
+
+        void setModel(const CurrentModel& model_);
+        void setChunkPackets(unsigned int packets);
+        /// Packets (i.e., timesteps) read per loop, or 0 for the default; see setChunkPackets()
+        unsigned int getChunkPackets() const { return chunkPackets; }
+        void setLatencyBudget(double seconds);
+
+        void run(double seconds = 0, const ChunkCallback& callback = ChunkCallback());
+        void stop();
+
+        /// Loops in the current (or last) run whose latency exceeded the budget; see setLatencyBudget()
+        uint64_t getOverruns() const { return overruns; }
+        /// Current being injected, in amps, after rounding to the current step and clipping to its range
+        double getInjectedCurrent() const { return injectedSteps * currentStep; }
+
+        static CurrentModel conductance(double siemens, double reversalPotential);
+
+        /// Latency of each loop of the current (or last) run: from the newest sample read to its current being sent
+        Histogram latencies;
+
+    private:
+        Board& board;
+        ClampConfig::ChipChannel channel;
+        CurrentModel model;
+        unsigned int chunkPackets;
+        double latencyBudget;
+        std::atomic<uint64_t> overruns;
+        std::atomic<int> injectedSteps;
+        double currentStep;
+        StopToken keepGoing;
+
+        void writeCurrent(int steps);
+
+        // Not copyable
+        DynamicClamp(const DynamicClamp&);
+        DynamicClamp& operator=(const DynamicClamp&);
+    };
+}
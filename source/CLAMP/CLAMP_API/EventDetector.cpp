@@ -0,0 +1,360 @@
+#include "EventDetector.h"
+#include "DataAnalysis.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::complex;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Constructor
+         *
+         *  \param[in] eventTemplate  The event's shape, in samples, including a little baseline before its onset
+         *  \param[in] fftLength_     Longest block to match at once; a power of 2, at least twice the template length
+         */
+        TemplateMatcher::TemplateMatcher(const vector<double>& eventTemplate, std::size_t fftLength_) :
+            length(eventTemplate.size()),
+            fftLength(fftLength_)
+        {
+            if (length < 2 || fftLength < 2 * length || (fftLength & (fftLength - 1)) != 0) {
+                throw invalid_argument("Template matching needs a power-of-2 block length of at least twice the template length");
+            }
+
+            sumT = 0;
+            sumTT = 0;
+            for (double t : eventTemplate) {
+                sumT += t;
+                sumTT += t * t;
+            }
+            denominator = sumTT - sumT * sumT / length;
+            if (denominator <= 0) {
+                throw invalid_argument("Event template is flat");
+            }
+
+            templateSpectrum.assign(fftLength, complex<double>(0, 0));
+            for (std::size_t i = 0; i < length; i++) {
+                templateSpectrum[i] = complex<double>(eventTemplate[i], 0);
+            }
+            fft(templateSpectrum);
+            for (complex<double>& x : templateSpectrum) {
+                x = std::conj(x);
+            }
+        }
+
+        /** \brief Fits the template at every offset within a block.
+         *
+         *  \param[in] data       The block
+         *  \param[in] n          Its length, from templateLength() to getFFTLength()
+         *  \param[in] work       Scratch space, reused between calls; each thread needs its own
+         *  \param[out] criterion Detection criterion at each of the n - templateLength() + 1 offsets: the fitted scale over
+         *                        the standard error of the fit
+         *  \param[out] scale     Fitted scale of the template at each offset
+         */
+        void TemplateMatcher::match(const double* data, std::size_t n, vector<complex<double>>& work, double* criterion, double* scale) const {
+            if (n < length || n > fftLength) {
+                throw invalid_argument("Block doesn't fit the template matcher");
+            }
+
+            // The fit doesn't depend on the baseline, so take out the block's mean to keep the sums small
+            double mean = 0;
+            for (std::size_t i = 0; i < n; i++) {
+                mean += data[i];
+            }
+            mean /= n;
+
+            // Cross-correlation of the block with the template: sum over j of d[k + j] t[j], for every offset k
+            work.assign(fftLength, complex<double>(0, 0));
+            for (std::size_t i = 0; i < n; i++) {
+                work[i] = complex<double>(data[i] - mean, 0);
+            }
+            fft(work);
+            for (std::size_t i = 0; i < fftLength; i++) {
+                work[i] *= templateSpectrum[i];
+            }
+            inverseFFT(work);
+
+            double sumD = 0;
+            double sumDD = 0;
+            for (std::size_t j = 0; j < length - 1; j++) {
+                double d = data[j] - mean;
+                sumD += d;
+                sumDD += d * d;
+            }
+            std::size_t count = n - length + 1;
+            for (std::size_t k = 0; k < count; k++) {
+                double entering = data[k + length - 1] - mean;
+                sumD += entering;
+                sumDD += entering * entering;
+
+                // Least squares fit of d = scale * t + offset over the window
+                double sumTD = work[k].real() - sumT * sumD / length;
+                double s = sumTD / denominator;
+                double sse = std::max(0.0, sumDD - sumD * sumD / length - s * sumTD);
+                double standardError = std::sqrt(sse / (length - 1));
+                scale[k] = s;
+                criterion[k] = (standardError > 0) ? s / standardError : 0.0;
+
+                double leaving = data[k] - mean;
+                sumD -= leaving;
+                sumDD -= leaving * leaving;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------------------------------------------------------------------------
+    /** \brief Constructor.
+     *
+     *  \param[in] board_  Board whose channels to watch
+     */
+    EventDetector::EventDetector(Board& board_) :
+        board(board_),
+        running(false),
+        baselineLength(0),
+        maxInput(0),
+        worker(*this),
+        eventCount(0),
+        droppedSamples(0),
+        samplesMatched(0),
+        matchNanoseconds(0)
+    {
+    }
+
+    EventDetector::~EventDetector() {
+        stop();
+    }
+
+    /** \brief Starts looking for events in the channels' measured currents, from the board's next read on.
+     *
+     *  The channels must be enabled on the board (see Board::enableChannels()) and in voltage clamp.  The template is
+     *  (1 - e^(-t / riseTime)) e^(-t / decayTime), over 5 decay time constants, after one rise time constant of baseline.
+     *  Forgets the events of any previous run.
+     *
+     *  \param[in] channels_  Channels to watch
+     *  \param[in] settings_  Template and criterion
+     */
+    void EventDetector::start(const ChipChannelList& channels_, const Settings& settings_) {
+        stop();
+        if (channels_.empty()) {
+            throw invalid_argument("Event detection needs at least one channel");
+        }
+        if (settings_.riseTime <= 0 || settings_.decayTime <= 0 || settings_.threshold <= 0 || (settings_.polarity != 1 && settings_.polarity != -1)) {
+            throw invalid_argument("Event detection needs positive time constants and threshold, and a polarity of 1 or -1");
+        }
+
+        double samplingRate = board.getSamplingRateHz();
+        std::size_t baseline = std::max<std::size_t>(2, static_cast<std::size_t>(std::lround(settings_.riseTime * samplingRate)));
+        std::size_t decay = std::max<std::size_t>(2, static_cast<std::size_t>(std::lround(5 * settings_.decayTime * samplingRate)));
+        vector<double> eventTemplate(baseline + decay, 0.0);
+        double peak = 0;
+        for (std::size_t i = 0; i < decay; i++) {
+            double t = i / samplingRate;
+            eventTemplate[baseline + i] = (1 - std::exp(-t / settings_.riseTime)) * std::exp(-t / settings_.decayTime);
+            peak = std::max(peak, eventTemplate[baseline + i]);
+        }
+        // Peak of 1, in the events' direction, so the fitted scale is the amplitude's magnitude
+        for (double& t : eventTemplate) {
+            t *= settings_.polarity / peak;
+        }
+        matcher.reset(new SignalProcessing::TemplateMatcher(eventTemplate, settings_.fftLength));
+
+        settings = settings_;
+        baselineLength = baseline;
+        maxInput = 8 * settings.fftLength;
+        channels.clear();
+        {
+            lock_guard<mutex> lock(eventMutex);
+            events.clear();
+        }
+        eventCount = 0;
+        droppedSamples = 0;
+        samplesMatched = 0;
+        matchNanoseconds = 0;
+
+        for (const ChipChannel& channel : channels_) {
+            channels[channel];
+        }
+        worker.start();
+        for (auto& element : channels) {
+            ChannelState& state = element.second;
+            callbackIds.push_back(board.addSampleCallback(element.first, Board::MEASURED_CURRENT, [this, &state](const SampleSpan& span) {
+                onSamples(state, span);
+            }));
+        }
+        running = true;
+    }
+
+    /// Unsubscribes from the board, stops the worker, and matches the data it hadn't got to, so their events are available from takeEvents().
+    void EventDetector::stop() {
+        if (!running) {
+            return;
+        }
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+        callbackIds.clear();
+        worker.close();
+        matchAvailable(true);
+        running = false;
+    }
+
+    /// Returns the events found since the last call (or since start()), and forgets them.  May be called from any thread.
+    vector<SynapticEvent> EventDetector::takeEvents() {
+        vector<SynapticEvent> taken;
+        lock_guard<mutex> lock(eventMutex);
+        taken.swap(events);
+        return taken;
+    }
+
+    // Called on the reading thread: only queues the chunk for the worker.  Invalid (NaN) samples are left out, which
+    // leaves a gap in the timestamps.
+    void EventDetector::onSamples(ChannelState& state, const SampleSpan& span) {
+        lock_guard<mutex> lock(inputMutex);
+        if (state.incoming.size() + span.length > maxInput) {
+            droppedSamples += span.length;
+            return;
+        }
+        for (std::size_t i = 0; i < span.length; i++) {
+            if (!std::isnan(span.samples[i])) {
+                state.incoming.push_back(span.samples[i]);
+                state.incomingTimestamps.push_back(span.timestamps[i]);
+            }
+        }
+    }
+
+    // Takes every channel's input and matches what it can, the channels in parallel.  If final, matches everything,
+    // including the last partial block.
+    void EventDetector::matchAvailable(bool final) {
+        using std::chrono::steady_clock;
+
+        vector<std::function<void()>> tasks;
+        {
+            lock_guard<mutex> lock(inputMutex);
+            for (auto& element : channels) {
+                ChannelState& state = element.second;
+                if (state.incoming.empty() && !final) {
+                    continue;
+                }
+                state.samples.insert(state.samples.end(), state.incoming.begin(), state.incoming.end());
+                state.timestamps.insert(state.timestamps.end(), state.incomingTimestamps.begin(), state.incomingTimestamps.end());
+                state.incoming.clear();
+                state.incomingTimestamps.clear();
+                const ChipChannel& channel = element.first;
+                tasks.push_back([this, &channel, &state, final]() {
+                    matchChannel(channel, state, final);
+                });
+            }
+        }
+        if (tasks.empty()) {
+            return;
+        }
+
+        steady_clock::time_point begin = steady_clock::now();
+        ThreadPool::instance().run(tasks);
+        matchNanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - begin).count());
+
+        vector<SynapticEvent> found;
+        for (auto& element : channels) {
+            ChannelState& state = element.second;
+            found.insert(found.end(), state.found.begin(), state.found.end());
+            state.found.clear();
+        }
+        if (!found.empty()) {
+            std::stable_sort(found.begin(), found.end(), [](const SynapticEvent& a, const SynapticEvent& b) {
+                return static_cast<int32_t>(a.timestamp - b.timestamp) < 0;
+            });
+            eventCount += found.size();
+            lock_guard<mutex> lock(eventMutex);
+            events.insert(events.end(), found.begin(), found.end());
+        }
+    }
+
+    // Matches every complete block of the channel's samples, keeping the overlap for the next one.  A gap in the
+    // timestamps ends a stream, which is matched to the end before carrying on after the gap.
+    void EventDetector::matchChannel(const ChipChannel& channel, ChannelState& state, bool final) {
+        std::size_t blockLength = matcher->getFFTLength();
+        std::size_t length = matcher->templateLength();
+        std::size_t step = blockLength - length + 1;
+
+        for (;;) {
+            std::size_t n = state.samples.size();
+            if (state.contiguous == 0 && n > 0) {
+                state.contiguous = 1;
+            }
+            while (state.contiguous < n && state.timestamps[state.contiguous] - state.timestamps[state.contiguous - 1] == 1) {
+                state.contiguous++;
+            }
+            bool ended = final || state.contiguous < n;
+
+            std::size_t first = 0;
+            while (state.contiguous - first >= blockLength) {
+                matchBlock(channel, state, first, blockLength);
+                first += step;
+            }
+            if (!ended) {
+                state.samples.erase(state.samples.begin(), state.samples.begin() + first);
+                state.timestamps.erase(state.timestamps.begin(), state.timestamps.begin() + first);
+                state.contiguous -= first;
+                return;
+            }
+
+            if (state.contiguous - first >= length) {
+                matchBlock(channel, state, first, state.contiguous - first);
+            }
+            endEvent(state);
+            state.samples.erase(state.samples.begin(), state.samples.begin() + state.contiguous);
+            state.timestamps.erase(state.timestamps.begin(), state.timestamps.begin() + state.contiguous);
+            state.contiguous = 0;
+            if (state.samples.empty()) {
+                return;
+            }
+        }
+    }
+
+    // Matches samples[first .. first + n) and turns the runs of offsets over the threshold into events
+    void EventDetector::matchBlock(const ChipChannel& channel, ChannelState& state, std::size_t first, std::size_t n) {
+        std::size_t count = n - matcher->templateLength() + 1;
+        state.criterion.resize(count);
+        state.scale.resize(count);
+        matcher->match(state.samples.data() + first, n, state.work, state.criterion.data(), state.scale.data());
+
+        const double* criterion = state.criterion.data();
+        const double threshold = settings.threshold;
+        for (std::size_t k = 0; k < count; k++) {
+            if (criterion[k] < threshold) {
+                endEvent(state);
+                continue;
+            }
+            if (!state.inEvent || criterion[k] > state.best.criterion) {
+                state.best.channel = channel;
+                state.best.timestamp = state.timestamps[first + k + baselineLength];
+                state.best.amplitude = state.scale[k] * settings.polarity;
+                state.best.criterion = criterion[k];
+                state.inEvent = true;
+            }
+        }
+        samplesMatched += count;
+    }
+
+    void EventDetector::endEvent(ChannelState& state) {
+        if (state.inEvent) {
+            state.found.push_back(state.best);
+            state.inEvent = false;
+        }
+    }
+
+    // Matches every few tens of milliseconds until stopped
+    void EventDetector::Worker::run() {
+        while (keepGoing.waitFor(std::chrono::milliseconds(20))) {
+            owner.matchAvailable(false);
+        }
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Board.h"
+#include "Thread.h"
+#include <atomic>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    /// A spontaneous synaptic event (e.g., an mEPSC) found by EventDetector
+    struct SynapticEvent {
+        ClampConfig::ChipChannel channel; ///< Channel it's on
+        uint32_t timestamp;               ///< Timestamp of its onset
+        double amplitude;                 ///< Peak of the fitted template, relative to the baseline, in amps (negative for inward currents)
+        double criterion;                 ///< Detection criterion at the onset (see SignalProcessing::TemplateMatcher)
+
+        SynapticEvent() : timestamp(0), amplitude(0), criterion(0) {}
+    };
+
+    namespace SignalProcessing {
+        /** \brief Template matching of a signal against an event template (Clements & Bekkers, Biophys J 73:220, 1997).
+         *
+         *  At every offset, the template is scaled and offset to fit the data under it by least squares, and the detection
+         *  criterion is the fitted scale over the standard error of the fit: large where the data look like the template,
+         *  whatever the baseline.  With a template whose peak is 1, that is roughly the event's amplitude over the RMS noise.
+         *
+         *  The fit at each offset only needs the sums of the data, of its square, and of its product with the template
+         *  over the template's length.  The first two are running sums; the third is a cross-correlation, computed for a
+         *  whole block of offsets at once with FFTs (overlap-save), so the cost per sample grows with the log of the block
+         *  length rather than with the template length.
+         */
+        class TemplateMatcher {
+        public:
+            TemplateMatcher(const std::vector<double>& eventTemplate, std::size_t fftLength_);
+
+            void match(const double* data, std::size_t n, std::vector<std::complex<double>>& work, double* criterion, double* scale) const;
+
+            /// Template length, in samples; a block of n samples gives n - templateLength() + 1 offsets
+            std::size_t templateLength() const { return length; }
+            /// Longest block match() takes
+            std::size_t getFFTLength() const { return fftLength; }
+
+        private:
+            std::size_t length;
+            std::size_t fftLength;
+            std::vector<std::complex<double>> templateSpectrum; // Conjugated FFT of the zero-padded template
+            double sumT;    // Sum of the template
+            double sumTT;   // Sum of its square
+            double denominator; // sumTT - sumT^2 / length
+        };
+    }
+
+    /** \brief Online detection of miniature synaptic events (mEPSCs/mIPSCs) in gap-free voltage clamp recordings.
+     *
+     *  Each channel's measured current is collected as ReadQueue decodes it (see Board::addSampleCallback()); the
+     *  reading thread only appends it to the channel's input.  A worker thread takes the input every few tens of
+     *  milliseconds, and once a channel has a block's worth, matches it against a biexponential template with a
+     *  SignalProcessing::TemplateMatcher.  Channels are matched in parallel on the shared ThreadPool.  Consecutive
+     *  offsets whose criterion reaches the threshold make one event, at the offset with the highest criterion.
+     *
+     *  Blocks overlap by one template length, so every offset is tested once, and events that straddle two blocks are
+     *  found whole.  A gap in a channel's timestamps (the board was stopped and started again) ends its stream: the data
+     *  before the gap are matched to the end, and matching starts over after it.  If the worker falls so far behind that
+     *  a channel's input reaches its limit, new data for that channel are dropped (see getDroppedSamples()) rather than
+     *  holding up the read; the drop shows up as a gap.
+     \code
+        EventDetector detector(board);
+        EventDetector::Settings settings;
+        settings.threshold = 4;
+        detector.start(channelList, settings);
+        // ... board.read() as usual; now and then:
+        for (const SynapticEvent& event : detector.takeEvents()) {
+            // ...
+        }
+        detector.stop(); // Matches what's left
+     \endcode
+     */
+    class EventDetector {
+    public:
+        /// Template and criterion
+        struct Settings {
+            double riseTime;        ///< Template rise time constant, in seconds
+            double decayTime;       ///< Template decay time constant, in seconds
+            double threshold;       ///< Criterion an event must reach (about its amplitude over the RMS noise); 3-5 is typical
+            int polarity;           ///< -1 for inward (negative) currents, e.g., mEPSCs at rest; +1 for outward
+            std::size_t fftLength;  ///< Block length, in samples; a power of 2, several times the template length
+
+            Settings() : riseTime(0.5e-3), decayTime(3e-3), threshold(4), polarity(-1), fftLength(16384) {}
+        };
+
+        explicit EventDetector(Board& board_);
+        ~EventDetector();
+
+        void start(const ClampConfig::ChipChannelList& channels_, const Settings& settings_ = Settings());
+        void stop();
+
+        std::vector<SynapticEvent> takeEvents();
+        /// Events found since start()
+        uint64_t getEventCount() const { return eventCount; }
+        /// Samples dropped because the worker fell behind, since start()
+        uint64_t getDroppedSamples() const { return droppedSamples; }
+        /// Samples matched since start(), over all channels
+        uint64_t getSamplesMatched() const { return samplesMatched; }
+        /// Time spent matching since start(), in seconds (wall clock, so parallel matching counts once)
+        double getMatchSeconds() const { return matchNanoseconds * 1e-9; }
+
+    private:
+        /// \cond private
+        struct ChannelState {
+            // Reading thread to worker; guarded by inputMutex
+            std::vector<double> incoming;
+            std::vector<uint32_t> incomingTimestamps;
+
+            // Worker only: samples not matched yet, starting with the previous block's last templateLength - 1
+            std::vector<double> samples;
+            std::vector<uint32_t> timestamps;
+            std::size_t contiguous;  // samples[0 .. contiguous) have consecutive timestamps
+            bool inEvent;            // The last offset matched was over the threshold...
+            SynapticEvent best;      //   and the best offset of that run so far
+            std::vector<SynapticEvent> found;
+            std::vector<std::complex<double>> work;
+            std::vector<double> criterion;
+            std::vector<double> scale;
+
+            ChannelState() : contiguous(0), inEvent(false) {}
+        };
+
+        // Takes the channels' input and matches it, every few tens of milliseconds
+        class Worker : public Thread {
+        public:
+            explicit Worker(EventDetector& owner_) : owner(owner_) {}
+            void run() override;
+
+        private:
+            EventDetector& owner;
+        };
+        /// \endcond
+
+        Board& board;
+        Settings settings;
+        bool running;
+        std::unique_ptr<SignalProcessing::TemplateMatcher> matcher;
+        std::size_t baselineLength; // Template samples before the onset
+        std::size_t maxInput;       // Most samples a channel's input may hold
+        std::map<ClampConfig::ChipChannel, ChannelState> channels;
+        std::vector<unsigned int> callbackIds;
+        std::mutex inputMutex;
+        Worker worker;
+
+        std::mutex eventMutex;
+        std::vector<SynapticEvent> events; // Guarded by eventMutex
+        std::atomic<uint64_t> eventCount;
+        std::atomic<uint64_t> droppedSamples;
+        std::atomic<uint64_t> samplesMatched;
+        std::atomic<uint64_t> matchNanoseconds;
+
+        void onSamples(ChannelState& state, const SampleSpan& span);
+        void matchAvailable(bool final);
+        void matchChannel(const ClampConfig::ChipChannel& channel, ChannelState& state, bool final);
+        void matchBlock(const ClampConfig::ChipChannel& channel, ChannelState& state, std::size_t first, std::size_t n);
+        void endEvent(ChannelState& state);
+
+        // Not copyable
+        EventDetector(const EventDetector&);
+        EventDetector& operator=(const EventDetector&);
+    };
+}
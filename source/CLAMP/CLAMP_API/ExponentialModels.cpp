@@ -0,0 +1,122 @@
+#include "ExponentialModels.h"
+#include "DataAnalysis.h"
+#include <algorithm>
+#include <cmath>
+
+using std::vector;
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Fits a two-exponential transient from scratch.
+         *
+         *  \param[in] xs         X values (time from the step)
+         *  \param[in] ys         Y values, as many as xs
+         *  \param[in] weights    Weight of each sample, or nullptr to weigh them equally
+         *  \param[out] beta      Fitted { A, B1, C1, B2, C2 }, fast component first; C2 is 0 if one exponential fits as well
+         *  \param[out] chi2      Mean squared residual, weighted as the samples are
+         *  \param[in] workspace  Buffers to use
+         *  \returns Number of Levenberg-Marquardt iterations taken, over both fits
+         */
+        unsigned int DoubleExponentialFit::fit(const vector<double>& xs, const vector<double>& ys, const double* weights,
+                                               /* out: */ double beta[5], double& chi2, Workspace& workspace) {
+            // The single exponential, started as ExponentialFit::lm() starts
+            double single[3];
+            if (!ExponentialFit::initialGuess(xs, ys, single)) {
+                single[0] = ys.back();
+                single[1] = -3000;
+                single[2] = ys.front() - ys.back();
+            }
+            double singleChi2 = 0;
+            unsigned int iterations = LevenbergMarquardt<SingleExponential>::fit(xs.data(), ys.data(), weights, xs.size(), single, singleChi2, workspace.single);
+
+            // Split it into a faster and a slower component of half the amplitude each
+            beta[0] = single[0];
+            beta[1] = 3 * single[1];
+            beta[2] = single[2] / 2;
+            beta[3] = single[1] / 3;
+            beta[4] = single[2] / 2;
+            iterations += LevenbergMarquardt<DoubleExponential>::fit(xs.data(), ys.data(), weights, xs.size(), beta, chi2, workspace.twoExponential);
+
+            bool finite = true;
+            for (unsigned int i = 0; i < 5; i++) {
+                finite = finite && std::isfinite(beta[i]);
+            }
+            if (finite && beta[1] < 0 && beta[3] < 0 && beta[1] != beta[3] && beta[2] != 0 && beta[4] != 0 && chi2 < singleChi2) {
+                order(beta);
+            }
+            else {
+                beta[0] = single[0];
+                beta[1] = single[1];
+                beta[2] = single[2];
+                beta[3] = single[1];
+                beta[4] = 0;
+                chi2 = singleChi2;
+            }
+            return iterations;
+        }
+
+        /** \brief Refits a two-exponential transient, starting from the parameters of a previous, similar one.
+         *
+         *  A fit without a slow component (see hasTwoComponents()) is refined as the single exponential it is.  Call
+         *  fit() instead if the result isn't usable.
+         *
+         *  \param[in] xs             X values (time from the step)
+         *  \param[in] ys             Y values, as many as xs
+         *  \param[in] weights        Weight of each sample, or nullptr to weigh them equally
+         *  \param[in,out] beta       Previous fit's { A, B1, C1, B2, C2 }; the new fit on return
+         *  \param[out] chi2          Mean squared residual, weighted as the samples are
+         *  \param[in] workspace      Buffers to use
+         *  \param[in] maxIterations  Most steps to take
+         *  \returns Number of Levenberg-Marquardt iterations taken
+         */
+        unsigned int DoubleExponentialFit::refine(const vector<double>& xs, const vector<double>& ys, const double* weights,
+                                                  /* in, out: */ double beta[5], double& chi2, Workspace& workspace, unsigned int maxIterations) {
+            if (!hasTwoComponents(beta)) {
+                double single[3] = { beta[0], beta[1], beta[2] };
+                unsigned int iterations = LevenbergMarquardt<SingleExponential>::fit(xs.data(), ys.data(), weights, xs.size(), single, chi2, workspace.single, maxIterations);
+                beta[0] = single[0];
+                beta[1] = single[1];
+                beta[2] = single[2];
+                beta[3] = single[1];
+                return iterations;
+            }
+            unsigned int iterations = LevenbergMarquardt<DoubleExponential>::fit(xs.data(), ys.data(), weights, xs.size(), beta, chi2, workspace.twoExponential, maxIterations);
+            order(beta);
+            return iterations;
+        }
+
+        /// True unless the fit fell back to a single exponential (C2 = 0)
+        bool DoubleExponentialFit::hasTwoComponents(const double beta[5]) {
+            return beta[4] != 0;
+        }
+
+        /** \brief The single exponential equivalent to a two-exponential fit, for SweepAnalysis::getRsAndCs().
+         *
+         *  The single exponential has the same steady state and the same amplitude (so the same peak current, which gives
+         *  the access resistance), and the same area (so the same charge, which gives the capacitance): its time constant
+         *  is the amplitude-weighted mean of the two.
+         *
+         *  \param[in] beta     Two-exponential parameters { A, B1, C1, B2, C2 }
+         *  \param[out] single  ExponentialFit parameters { A, B, C }
+         */
+        void DoubleExponentialFit::equivalentSingle(const double beta[5], /* out: */ double single[3]) {
+            double C = beta[2] + beta[4];
+            single[0] = beta[0];
+            single[2] = C;
+            if (!hasTwoComponents(beta) || C == 0) {
+                single[1] = beta[1];
+                return;
+            }
+            double tau = (beta[2] * (-1.0 / beta[1]) + beta[4] * (-1.0 / beta[3])) / C;
+            single[1] = -1.0 / tau;
+        }
+
+        // Puts the faster component first
+        void DoubleExponentialFit::order(double beta[5]) {
+            if (beta[3] < beta[1]) {
+                std::swap(beta[1], beta[3]);
+                std::swap(beta[2], beta[4]);
+            }
+        }
+    }
+}
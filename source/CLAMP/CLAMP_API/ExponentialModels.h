@@ -0,0 +1,86 @@
+#pragma once
+
+#include "LevenbergMarquardt.h"
+#include <cmath>
+#include <vector>
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief f(x) = C * exp(B * x) + A, as ExponentialFit, for LevenbergMarquardt.
+         *
+         *  Parameters are { A, B, C }, in ExponentialFit's order.
+         */
+        class SingleExponential {
+        public:
+            /// Number of parameters
+            static const unsigned int NUM_PARAMETERS = 3;
+
+            /// Value at x, with the gradient with respect to { A, B, C } in gradient
+            static double evaluate(double x, const double beta[3], double gradient[3]) {
+                double e = std::exp(beta[1] * x);
+                gradient[0] = 1;
+                gradient[1] = beta[2] * x * e;
+                gradient[2] = e;
+                return beta[2] * e + beta[0];
+            }
+        };
+
+        /** \brief f(x) = C1 * exp(B1 * x) + C2 * exp(B2 * x) + A, for LevenbergMarquardt.
+         *
+         *  Parameters are { A, B1, C1, B2, C2 }.  DoubleExponentialFit returns them with the faster component first
+         *  (B1 <= B2).
+         */
+        class DoubleExponential {
+        public:
+            /// Number of parameters
+            static const unsigned int NUM_PARAMETERS = 5;
+
+            /// Value at x, with the gradient with respect to { A, B1, C1, B2, C2 } in gradient
+            static double evaluate(double x, const double beta[5], double gradient[5]) {
+                double e1 = std::exp(beta[1] * x);
+                double e2 = std::exp(beta[3] * x);
+                gradient[0] = 1;
+                gradient[1] = beta[2] * x * e1;
+                gradient[2] = e1;
+                gradient[3] = beta[4] * x * e2;
+                gradient[4] = e2;
+                return beta[2] * e1 + beta[4] * e2 + beta[0];
+            }
+
+            /// Value at x
+            static double f(double x, const double beta[5]) {
+                return beta[2] * std::exp(beta[1] * x) + beta[4] * std::exp(beta[3] * x) + beta[0];
+            }
+        };
+
+        /** \brief Fits of two-exponential transients, e.g., a cell whose dendrites charge more slowly than its soma.
+         *
+         *  fit() starts from a single exponential fitted with LevenbergMarquardt<SingleExponential>, splits it into a
+         *  fast and a slow component, and fits all five parameters from there.  If that doesn't give two decaying
+         *  components that fit better, the single exponential is returned as a two-exponential with no slow component
+         *  (C2 = 0), so callers can use the result either way.  refine() is the cheap follow-up for the next, similar
+         *  transient: a few steps from the previous parameters.
+         *
+         *  Whole-cell parameters come from equivalentSingle(), which reduces the fit to the single exponential with the
+         *  same peak current and the same charge, for SweepAnalysis::getRsAndCs().
+         */
+        class DoubleExponentialFit {
+        public:
+            /// Buffers for the fits, reusable from fit to fit
+            struct Workspace {
+                LevenbergMarquardt<SingleExponential>::Workspace single;
+                LevenbergMarquardt<DoubleExponential>::Workspace twoExponential;
+            };
+
+            static unsigned int fit(const std::vector<double>& xs, const std::vector<double>& ys, const double* weights,
+                                    /* out: */ double beta[5], double& chi2, Workspace& workspace);
+            static unsigned int refine(const std::vector<double>& xs, const std::vector<double>& ys, const double* weights,
+                                       /* in, out: */ double beta[5], double& chi2, Workspace& workspace, unsigned int maxIterations);
+            static bool hasTwoComponents(const double beta[5]);
+            static void equivalentSingle(const double beta[5], /* out: */ double single[3]);
+
+        private:
+            static void order(double beta[5]);
+        };
+    }
+}
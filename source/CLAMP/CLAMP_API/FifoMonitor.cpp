@@ -0,0 +1,214 @@
+#include "FifoMonitor.h"
+#include "ClockSync.h"
+#include <ostream>
+#include <stdexcept>
+
+using std::invalid_argument;
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+namespace CLAMP {
+    FifoMonitor::FifoMonitor() :
+        highPercent(25),
+        lowPercent(5),
+        nextCallbackId(0),
+        runStart(ClockSync::hostNow()),
+        latest(),
+        aboveHigh(false),
+        peakPercentage(0),
+        highCrossings(0),
+        historyLimit(100000),
+        stride(1),
+        merged(0)
+    {
+    }
+
+    /** \brief Sets the levels that call the callbacks.
+     *
+     *  \param[in] highPercent_  FIFO percentage full at or above which HIGH is reported (default 25)
+     *  \param[in] lowPercent_   Percentage at or below which LOW is reported, after a HIGH (default 5)
+     */
+    void FifoMonitor::setWatermarks(double highPercent_, double lowPercent_) {
+        if (lowPercent_ < 0 || highPercent_ > 100 || lowPercent_ >= highPercent_) {
+            throw invalid_argument("FIFO watermarks must satisfy 0 <= low < high <= 100.");
+        }
+        lock_guard<mutex> lock(monitorMutex);
+        highPercent = highPercent_;
+        lowPercent = lowPercent_;
+    }
+
+    /// FIFO percentage full at or above which HIGH is reported
+    double FifoMonitor::getHighWatermark() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return highPercent;
+    }
+
+    /// FIFO percentage full at or below which LOW is reported, after a HIGH
+    double FifoMonitor::getLowWatermark() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return lowPercent;
+    }
+
+    /** \brief Registers a callback for watermark crossings.
+     *
+     *  \param[in] callback  Called on the reading thread; see the class description
+     *  \returns An id to pass to removeCallback()
+     */
+    unsigned int FifoMonitor::addCallback(const Callback& callback) {
+        lock_guard<mutex> lock(monitorMutex);
+        unsigned int id = nextCallbackId++;
+        callbacks[id] = callback;
+        return id;
+    }
+
+    /// Unregisters a callback added by addCallback()
+    void FifoMonitor::removeCallback(unsigned int id) {
+        lock_guard<mutex> lock(monitorMutex);
+        callbacks.erase(id);
+    }
+
+    /** \brief Sets how many samples the history keeps before merging them.
+     *
+     *  \param[in] samples  At least 2 (default 100000, about 2 MB)
+     */
+    void FifoMonitor::setHistoryLimit(std::size_t samples) {
+        if (samples < 2) {
+            throw invalid_argument("FIFO history must hold at least 2 samples.");
+        }
+        lock_guard<mutex> lock(monitorMutex);
+        historyLimit = samples;
+    }
+
+    /// Samples the history keeps before merging them; see setHistoryLimit()
+    std::size_t FifoMonitor::getHistoryLimit() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return historyLimit;
+    }
+
+    /** \brief Starts a new run: clears the history, the peak and the crossing count.
+     *
+     *  The watermarks and callbacks are kept.  Times in the history are from here.
+     */
+    void FifoMonitor::startRun() {
+        lock_guard<mutex> lock(monitorMutex);
+        runStart = ClockSync::hostNow();
+        aboveHigh = false;
+        peakPercentage = 0;
+        highCrossings = 0;
+        history.clear();
+        stride = 1;
+        merged = 0;
+    }
+
+    /** \brief Adds the FIFO level after a read; Board calls this.
+     *
+     *  \param[in] wordsInFifo     Words in the FIFO
+     *  \param[in] percentageFull  Percentage of the FIFO's capacity they are
+     *  \param[in] latencyMs       Time they took to acquire, in ms
+     */
+    void FifoMonitor::addSample(uint32_t wordsInFifo, double percentageFull, double latencyMs) {
+        FifoSample sample;
+        sample.wordsInFifo = wordsInFifo;
+        sample.percentageFull = percentageFull;
+        sample.latencyMs = latencyMs;
+
+        bool crossed = false;
+        Watermark watermark = HIGH;
+        vector<Callback> toCall;
+        {
+            lock_guard<mutex> lock(monitorMutex);
+            sample.seconds = ClockSync::hostNow() - runStart;
+            latest = sample;
+            record(sample);
+            if (percentageFull > peakPercentage) {
+                peakPercentage = percentageFull;
+            }
+            if (!aboveHigh && percentageFull >= highPercent) {
+                aboveHigh = true;
+                highCrossings++;
+                crossed = true;
+                watermark = HIGH;
+            }
+            else if (aboveHigh && percentageFull <= lowPercent) {
+                aboveHigh = false;
+                crossed = true;
+                watermark = LOW;
+            }
+            if (crossed) {
+                for (auto& entry : callbacks) {
+                    toCall.push_back(entry.second);
+                }
+            }
+        }
+        // Outside the lock, so a callback can query the monitor
+        for (const Callback& callback : toCall) {
+            callback(watermark, sample);
+        }
+    }
+
+    // Appends sample to the history, merging once it's full; the caller holds monitorMutex
+    void FifoMonitor::record(const FifoSample& sample) {
+        if (merged > 0 && merged < stride) {
+            // Still filling the last entry: keep the fuller sample
+            if (sample.percentageFull >= history.back().percentageFull) {
+                history.back() = sample;
+            }
+            merged++;
+            return;
+        }
+        if (history.size() >= historyLimit) {
+            // Merge neighbouring pairs, halving the history and doubling the samples per entry
+            std::size_t n = 0;
+            for (std::size_t i = 0; i + 1 < history.size(); i += 2) {
+                history[n++] = (history[i + 1].percentageFull > history[i].percentageFull) ? history[i + 1] : history[i];
+            }
+            if (history.size() % 2 == 1) {
+                history[n++] = history.back();
+            }
+            history.resize(n);
+            stride *= 2;
+        }
+        history.push_back(sample);
+        merged = 1;
+    }
+
+    /// The FIFO level after the last read (all zeros before the first)
+    FifoSample FifoMonitor::getLatest() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return latest;
+    }
+
+    /// True between a HIGH and the LOW after it
+    bool FifoMonitor::isAboveHigh() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return aboveHigh;
+    }
+
+    /// Fullest the FIFO has been this run, as a percentage
+    double FifoMonitor::getPeakPercentage() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return peakPercentage;
+    }
+
+    /// Times the FIFO crossed the high watermark this run
+    unsigned int FifoMonitor::getHighCrossings() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return highCrossings;
+    }
+
+    /// The FIFO levels recorded this run, oldest first; see the class description
+    vector<FifoSample> FifoMonitor::getHistory() const {
+        lock_guard<mutex> lock(monitorMutex);
+        return history;
+    }
+
+    /// Writes the history as CSV: a header line, then one line per sample
+    void FifoMonitor::writeHistory(std::ostream& out) const {
+        vector<FifoSample> samples = getHistory();
+        out << "seconds,words_in_fifo,percentage_full,latency_ms\n";
+        for (const FifoSample& sample : samples) {
+            out << sample.seconds << ',' << sample.wordsInFifo << ',' << sample.percentageFull << ',' << sample.latencyMs << '\n';
+        }
+    }
+}
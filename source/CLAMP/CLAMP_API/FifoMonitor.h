@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    /// FIFO level after one read; see FifoMonitor
+    struct FifoSample {
+        double seconds;         ///< Host time since FifoMonitor::startRun()
+        uint32_t wordsInFifo;   ///< Words left in the board's FIFO after the read
+        double percentageFull;  ///< As Board::fifoPercentageFull
+        double latencyMs;       ///< As Board::latency
+    };
+
+    /** \brief Watches the level of the board's FIFO, and records it for later analysis.
+     *
+     *  Board::read() (or the USBReaderThread) passes the level after each read to addSample().  Crossing the high
+     *  watermark calls the callbacks with HIGH, once, well before the FIFO overflows (which loses data and leaves the board
+     *  in a bad state; see Board::runContinuously); falling back to the low watermark calls them with LOW.  Callbacks can,
+     *  e.g., shed optional processing, enlarge the transfer chunks, or warn the user.  They run on the thread that reads,
+     *  so they should be quick, and mustn't call addCallback() or removeCallback().
+     *
+     *  Every sample since startRun() is kept, up to getHistoryLimit() of them; past that, neighbouring samples are merged,
+     *  keeping the fuller, so a long run is still covered from start to end with its peaks intact.  writeHistory() writes
+     *  the series out as CSV.  Queries may be made from any thread; e.g., getLatest() is the way for a thread other
+     *  than the one reading to see the FIFO level (Board::fifoPercentageFull and Board::latency belong to that thread).
+     \code
+        board.fifoMonitor.setWatermarks(50, 10);
+        board.fifoMonitor.addCallback([](FifoMonitor::Watermark crossed, const FifoSample& sample) {
+            if (crossed == FifoMonitor::HIGH) {
+                ... // Do less
+            }
+        });
+     \endcode
+     */
+    class FifoMonitor {
+    public:
+        /// Watermark that a sample crossed
+        enum Watermark {
+            HIGH, ///< The FIFO filled past the high watermark
+            LOW   ///< After a HIGH, it drained to the low watermark
+        };
+        typedef std::function<void(Watermark crossed, const FifoSample& sample)> Callback;
+
+        FifoMonitor();
+
+        void setWatermarks(double highPercent, double lowPercent);
+        double getHighWatermark() const;
+        double getLowWatermark() const;
+        unsigned int addCallback(const Callback& callback);
+        void removeCallback(unsigned int id);
+
+        void setHistoryLimit(std::size_t samples);
+        std::size_t getHistoryLimit() const;
+
+        void startRun();
+        void addSample(uint32_t wordsInFifo, double percentageFull, double latencyMs);
+
+        FifoSample getLatest() const;
+        bool isAboveHigh() const;
+        double getPeakPercentage() const;
+        unsigned int getHighCrossings() const;
+        std::vector<FifoSample> getHistory() const;
+        void writeHistory(std::ostream& out) const;
+
+    private:
+        mutable std::mutex monitorMutex;
+        double highPercent;
+        double lowPercent;
+        std::map<unsigned int, Callback> callbacks;
+        unsigned int nextCallbackId;
+
+        double runStart;        // Host time of startRun()
+        FifoSample latest;      // Last sample added, this run or before
+        bool aboveHigh;         // Between a HIGH and the LOW after it
+        double peakPercentage;  // This run
+        unsigned int highCrossings;
+
+        std::size_t historyLimit;
+        std::vector<FifoSample> history;
+        unsigned int stride;    // Samples merged into each entry of history
+        unsigned int merged;    // Samples merged into the last entry so far
+
+        void record(const FifoSample& sample);
+
+        // Not copyable
+        FifoMonitor(const FifoMonitor&);
+        FifoMonitor& operator=(const FifoMonitor&);
+    };
+}
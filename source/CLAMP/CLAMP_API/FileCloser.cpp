@@ -0,0 +1,136 @@
+#include "FileCloser.h"
+#include "MultiplexedSaveFile.h"
+#include "SaveFile.h"
+#include <algorithm>
+
+using std::shared_ptr;
+using std::unique_lock;
+using std::unique_ptr;
+using std::mutex;
+
+namespace CLAMP {
+    namespace IO {
+        /// The closer thread shared by all save files
+        FileCloser& FileCloser::instance() {
+            static FileCloser theInstance;
+            return theInstance;
+        }
+
+        FileCloser::FileCloser() :
+            Thread(),
+            closing(nullptr),
+            running(false)
+        {
+            // Closing can wait; acquisition can't
+            setScheduling(LOW_PRIORITY);
+        }
+
+        FileCloser::~FileCloser() {
+            // Closes everything that's still queued before returning
+            Thread::close();
+        }
+
+        void FileCloser::run() {
+            while (true) {
+                unique_lock<mutex> lock(queueMutex);
+                while (queue.empty() && keepGoing) {
+                    // keepGoing isn't protected by the mutex, so don't wait forever
+                    jobAvailable.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                if (queue.empty()) {
+                    break; // Stopped, and everything has been closed
+                }
+
+                Job job = std::move(queue.front());
+                queue.pop_front();
+                closing = &job;
+                lock.unlock();
+
+                std::exception_ptr error;
+                try {
+                    job.close();
+                    job.close = nullptr; // Destroys the file here too, rather than on whichever thread is last
+                }
+                catch (...) {
+                    error = std::current_exception();
+                    job.close = nullptr;
+                }
+                if (job.done) {
+                    job.done(error);
+                }
+
+                lock.lock();
+                closing = nullptr;
+                jobDone.notify_all();
+            }
+        }
+
+        /** \brief Closes and destroys a save file in the background.
+         *
+         *  \param[in] file  Open (or already closed) file; nothing else may use it after this
+         *  \param[in] path  Path it was opened with, for waitFor()
+         *  \param[in] done  Called on the closer thread once the file is closed; may be empty
+         */
+        void FileCloser::close(unique_ptr<SaveFile>&& file, const FILENAME& path, const Callback& done) {
+            shared_ptr<SaveFile> closing(std::move(file));
+            Job job;
+            job.path = path;
+            job.close = [closing]() { closing->close(); };
+            job.done = done;
+            push(std::move(job));
+        }
+
+        /** \brief Closes and destroys a multiplexed save file in the background.
+         *
+         *  \param[in] file  Open (or already closed) file; nothing else may use it after this
+         *  \param[in] path  Path it was opened with, for waitFor()
+         *  \param[in] done  Called on the closer thread once the file is closed; may be empty
+         */
+        void FileCloser::close(unique_ptr<MultiplexedSaveFile>&& file, const FILENAME& path, const Callback& done) {
+            shared_ptr<MultiplexedSaveFile> closing(std::move(file));
+            Job job;
+            job.path = path;
+            job.close = [closing]() { closing->close(); };
+            job.done = done;
+            push(std::move(job));
+        }
+
+        /// Waits until no file with the given path is waiting to be closed, e.g., before opening it again
+        void FileCloser::waitFor(const FILENAME& path) {
+            unique_lock<mutex> lock(queueMutex);
+            while (isPending(path)) {
+                jobDone.wait(lock);
+            }
+        }
+
+        /// Waits until every file handed over has been closed, and its callback has returned
+        void FileCloser::waitAll() {
+            unique_lock<mutex> lock(queueMutex);
+            while (closing || !queue.empty()) {
+                jobDone.wait(lock);
+            }
+        }
+
+        /// Files handed over and not yet closed, including the one being closed
+        unsigned int FileCloser::getNumPending() const {
+            unique_lock<mutex> lock(queueMutex);
+            return static_cast<unsigned int>(queue.size()) + (closing ? 1 : 0);
+        }
+
+        void FileCloser::push(Job&& job) {
+            unique_lock<mutex> lock(queueMutex);
+            if (!running) {
+                start();
+                running = true;
+            }
+            queue.push_back(std::move(job));
+            jobAvailable.notify_one();
+        }
+
+        // True if a file with the given path is queued or being closed; the caller holds queueMutex
+        bool FileCloser::isPending(const FILENAME& path) const {
+            return (closing && closing->path == path) ||
+                   std::any_of(queue.begin(), queue.end(), [&path](const Job& job) { return job.path == path; });
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Thread.h"
+#include "streams.h"
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+namespace CLAMP {
+    namespace IO {
+        class SaveFile;
+        class MultiplexedSaveFile;
+
+        /** \brief Background thread that closes save files, so ending a recording doesn't wait for the disk.
+         *
+         *  Closing a save file flushes its buffers, waits for SaveWriterThread to write what it queued, and writes the
+         *  chunk index, sweep index and manifest; with big buffers on a slow disk that takes seconds.  A file handed to
+         *  close() is closed and destroyed here instead, in the order handed over, and the caller can start the next
+         *  recording right away.  The completion callback runs on this thread once the file is closed, with the
+         *  exception close() threw, if any.
+         *
+         *  A file with the same path can't be opened until the old one is closed: call waitFor() before opening one.
+         *  Whoever owns what the callbacks refer to should call waitAll() before it goes away.
+         \code
+            FileCloser::instance().close(std::move(saveFile), [](std::exception_ptr error) {
+                if (error) {
+                    ... // Report it
+                }
+            });
+         \endcode
+         */
+        class FileCloser : public Thread {
+        public:
+            /// Called once a file has been closed; error is null if it closed cleanly
+            typedef std::function<void(std::exception_ptr error)> Callback;
+
+            static FileCloser& instance();
+
+            ~FileCloser();
+
+            void run() override;
+
+            void close(std::unique_ptr<SaveFile>&& file, const FILENAME& path, const Callback& done = Callback());
+            void close(std::unique_ptr<MultiplexedSaveFile>&& file, const FILENAME& path, const Callback& done = Callback());
+            void waitFor(const FILENAME& path);
+            void waitAll();
+            unsigned int getNumPending() const;
+
+        private:
+            FileCloser();
+
+            /// \cond private
+            struct Job {
+                FILENAME path;
+                std::function<void()> close; // Closes the file; the file goes when this does
+                Callback done;
+            };
+            /// \endcond
+
+            mutable std::mutex queueMutex;
+            std::condition_variable jobAvailable; // Signalled when a job is queued
+            std::condition_variable jobDone;      // Signalled when a job has finished
+            std::deque<Job> queue;
+            const Job* closing; // Job being run right now, if any
+            bool running;
+
+            void push(Job&& job);
+            bool isPending(const FILENAME& path) const;
+
+            // Not copyable
+            FileCloser(const FileCloser&);
+            FileCloser& operator=(const FileCloser&);
+        };
+    }
+}
@@ -0,0 +1,128 @@
+#include "HealthMonitor.h"
+#include "Board.h"
+#include <stdexcept>
+
+using std::vector;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+using std::chrono::steady_clock;
+
+namespace CLAMP {
+    /** \brief Constructor.  Checks every minute, and is due straight away.
+     *
+     *  \param[in] board_  Board whose chips to check
+     */
+    HealthMonitor::HealthMonitor(Board& board_) :
+        board(board_),
+        interval(std::chrono::seconds(60)),
+        checked(false)
+    {
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            hasReference[chip] = false;
+            reference[chip] = 0;
+            readings[chip].chip = chip;
+        }
+    }
+
+    /** \brief Sets how often check() is due.
+     *
+     *  \param[in] seconds  Interval between checks, in seconds
+     */
+    void HealthMonitor::setInterval(double seconds) {
+        if (seconds <= 0) {
+            throw invalid_argument("Health check interval must be positive");
+        }
+        lock_guard<mutex> lock(readingMutex);
+        interval = std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    /// Interval between checks, in seconds
+    double HealthMonitor::getInterval() const {
+        lock_guard<mutex> lock(readingMutex);
+        return std::chrono::duration<double>(interval).count();
+    }
+
+    /** \brief Sets the function check() passes its readings to.
+     *
+     *  It's called on the thread that calls check(), which is usually not the GUI thread.
+     */
+    void HealthMonitor::setCallback(const Callback& callback_) {
+        lock_guard<mutex> lock(readingMutex);
+        callback = callback_;
+    }
+
+    /** \brief Sets the temperature a chip's drift is measured from, typically the one it was calibrated at.
+     *
+     *  \param[in] chip         %Chip index [0-7]
+     *  \param[in] temperature  Reference temperature, in &deg;C
+     */
+    void HealthMonitor::setReference(unsigned int chip, double temperature) {
+        lock_guard<mutex> lock(readingMutex);
+        hasReference[chip] = true;
+        reference[chip] = temperature;
+    }
+
+    /// Forgets a chip's reference temperature, e.g., when it's recalibrated without one being saved
+    void HealthMonitor::clearReference(unsigned int chip) {
+        lock_guard<mutex> lock(readingMutex);
+        hasReference[chip] = false;
+    }
+
+    /// True if the interval has passed since the last check(), or there hasn't been one
+    bool HealthMonitor::due() const {
+        lock_guard<mutex> lock(readingMutex);
+        return !checked || steady_clock::now() - lastCheck >= interval;
+    }
+
+    /** \brief Reads every present chip's temperature and ROM registers, in one run.
+     *
+     *  The board must not be running: call this between runs.  The chips' command lists are cleared and their channel 0
+     *  is left enabled (as TemperatureSensor::readTemperature() does), so whatever runs next needs to set up its
+     *  commands and channels again.  Most run loops do that every sweep anyway.
+     */
+    void HealthMonitor::check() {
+        vector<unsigned int> chips;
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            if (board.chip[chip]->present) {
+                chips.push_back(chip);
+            }
+        }
+
+        vector<bool> romOk;
+        vector<double> temperatures = board.controller.temperatureSensor.readTemperatures(chips, true, &romOk);
+        steady_clock::time_point now = steady_clock::now();
+
+        vector<HealthReading> results;
+        Callback notify;
+        {
+            lock_guard<mutex> lock(readingMutex);
+            for (std::size_t i = 0; i < chips.size(); i++) {
+                HealthReading& reading = readings[chips[i]];
+                reading.valid = true;
+                reading.temperature = temperatures[i];
+                reading.hasReference = hasReference[chips[i]];
+                reading.drift = reading.hasReference ? temperatures[i] - reference[chips[i]] : 0;
+                reading.responding = romOk[i];
+                reading.when = now;
+                results.push_back(reading);
+            }
+            lastCheck = now;
+            checked = true;
+            notify = callback;
+        }
+        if (notify) {
+            notify(results);
+        }
+    }
+
+    /** \brief The most recent reading for a chip.
+     *
+     *  \param[in] chip  %Chip index [0-7]
+     *  \returns The reading; HealthReading::valid is false if the chip hasn't been checked.
+     */
+    HealthReading HealthMonitor::getReading(unsigned int chip) const {
+        lock_guard<mutex> lock(readingMutex);
+        return readings[chip];
+    }
+}
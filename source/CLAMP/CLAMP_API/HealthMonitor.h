@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Constants.h"
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    class Board;
+
+    /// One headstage's state, as checked by HealthMonitor
+    struct HealthReading {
+        unsigned int chip;        ///< %Chip it's for
+        bool valid;               ///< False until the chip has been checked
+        double temperature;       ///< %Chip temperature, in &deg;C
+        bool hasReference;        ///< Whether a reference temperature was set (see HealthMonitor::setReference())
+        double drift;             ///< temperature minus the reference temperature, in &deg;C; 0 without one
+        bool responding;          ///< The chip's ROM registers read back correctly
+        std::chrono::steady_clock::time_point when; ///< When it was checked
+
+        HealthReading() : chip(0), valid(false), temperature(0), hasReference(false), drift(0), responding(false) {}
+    };
+
+    /** \brief Low-rate check of the headstages' temperatures and register readback, fitted in between runs.
+     *
+     *  Reading the temperature sensor takes a run of its own (see TemperatureSensor), which would interrupt acquisition.
+     *  Instead, whatever drives the board calls check() in time it would otherwise spend idle - e.g., between the sweeps
+     *  of a batch - once due() says the interval has passed.  One short run reads every present chip's temperature and
+     *  ROM registers; the results go to the callback and are kept for getReading(), which any thread can call.
+     *
+     *  With reference temperatures from calibration (see CalibrationCache::getTemperature()), each reading's drift says
+     *  how far the chip has moved since, so a calibration that has gone stale (drift beyond
+     *  CalibrationCache::MAX_TEMPERATURE_CHANGE) shows up while the runs carry on.
+     \code
+        HealthMonitor monitor(board);
+        monitor.setCallback([](const std::vector<HealthReading>& readings) { ... });
+        while (running) {
+            // ... run a sweep ...
+            if (monitor.due()) {
+                monitor.check();
+            }
+            // ... sleep until the next sweep ...
+        }
+     \endcode
+     */
+    class HealthMonitor {
+    public:
+        /// Called by check(), on its thread, with one reading per present chip
+        typedef std::function<void(const std::vector<HealthReading>&)> Callback;
+
+        explicit HealthMonitor(Board& board_);
+
+        void setInterval(double seconds);
+        double getInterval() const;
+        void setCallback(const Callback& callback_);
+        void setReference(unsigned int chip, double temperature);
+        void clearReference(unsigned int chip);
+
+        bool due() const;
+        void check();
+
+        HealthReading getReading(unsigned int chip) const;
+
+    private:
+        Board& board;
+        mutable std::mutex readingMutex;
+        std::chrono::steady_clock::duration interval;   // Guarded by readingMutex, like everything below
+        std::chrono::steady_clock::time_point lastCheck;
+        bool checked;
+        Callback callback;
+        bool hasReference[MAX_NUM_CHIPS];
+        double reference[MAX_NUM_CHIPS];
+        HealthReading readings[MAX_NUM_CHIPS];
+
+        // Not copyable
+        HealthMonitor(const HealthMonitor&);
+        HealthMonitor& operator=(const HealthMonitor&);
+    };
+}
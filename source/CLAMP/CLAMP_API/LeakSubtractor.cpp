@@ -0,0 +1,145 @@
+#include "LeakSubtractor.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::invalid_argument;
+
+namespace CLAMP {
+    /** \brief Constructor.
+     *
+     *  \param[in] numSubPulses_  Sub-pulses per test sweep (N)
+     *  \param[in] fraction_      Sub-pulse amplitude, as a fraction of the test sweep's; typically -1/N (P/-N), which
+     *                            keeps the sub-pulses below the resting potential, away from the channels' activation
+     */
+    LeakSubtractor::LeakSubtractor(unsigned int numSubPulses_, double fraction_) :
+        numSubPulses(numSubPulses_),
+        fraction(fraction_)
+    {
+        if (numSubPulses == 0 || fraction == 0 || std::abs(fraction) > 1) {
+            throw invalid_argument("Leak subtraction needs at least one sub-pulse, of a nonzero fraction of the test amplitude");
+        }
+    }
+
+    /** \brief Returns the protocol to load into ProtocolRunner: each test sweep, preceded by its sub-pulses.
+     *
+     *  The sub-pulses keep the test sweep's timing and interval.  Their steps are rounded to whole clamp steps (at least
+     *  one step, so small test steps still get a measurable sub-pulse), and the template is scaled by the ratio actually
+     *  applied, at the test sweep's largest step.  Sub-pulses don't raise the marker output.  Forgets any partly built
+     *  templates.
+     *
+     *  \param[in] testSweeps  The protocol's sweeps, as they'd be passed to ProtocolRunner::load()
+     */
+    vector<SimplifiedWaveform> LeakSubtractor::interleave(const vector<SimplifiedWaveform>& testSweeps) {
+        plan.clear();
+        templates.clear();
+
+        vector<SimplifiedWaveform> sweeps;
+        sweeps.reserve(testSweeps.size() * (numSubPulses + 1));
+        for (std::size_t t = 0; t < testSweeps.size(); t++) {
+            const SimplifiedWaveform& test = testSweeps[t];
+            if (test.size() == 0) {
+                throw invalid_argument("Empty sweep in protocol");
+            }
+            const WaveformSegment& holding = test.waveform.front();
+
+            SimplifiedWaveform sub(test);
+            int largestTest = 0;
+            int largestSub = 0;
+            for (WaveformSegment& segment : sub.waveform) {
+                int departure = segment.appliedDiscreteValue - holding.appliedDiscreteValue;
+                if (departure == 0) {
+                    continue;
+                }
+                int scaled = static_cast<int>(std::lround(departure * fraction));
+                if (scaled == 0) {
+                    scaled = ((departure > 0) == (fraction > 0)) ? 1 : -1;
+                }
+                segment.appliedValue = holding.appliedValue + (segment.appliedValue - holding.appliedValue) * scaled / departure;
+                segment.appliedDiscreteValue = holding.appliedDiscreteValue + scaled;
+                segment.markerOut = false;
+                if (std::abs(departure) > std::abs(largestTest)) {
+                    largestTest = departure;
+                    largestSub = scaled;
+                }
+            }
+
+            SweepPlan sweepPlan;
+            sweepPlan.test = false;
+            sweepPlan.testIndex = t;
+            sweepPlan.holdingLength = holding.numReps();
+            sweepPlan.scale = (largestSub != 0) ? static_cast<double>(largestTest) / largestSub : 0.0;
+            for (unsigned int i = 0; i < numSubPulses; i++) {
+                sweeps.push_back(sub);
+                plan.push_back(sweepPlan);
+            }
+            sweepPlan.test = true;
+            sweeps.push_back(test);
+            plan.push_back(sweepPlan);
+        }
+        return sweeps;
+    }
+
+    /** \brief Takes one channel's currents for a sweep of the interleaved protocol, e.g., from a ProtocolRunner callback.
+     *
+     *  \param[in] sweep     The sweep, as passed to the callback
+     *  \param[in] channel   Channel the currents are from
+     *  \param[in] currents  Its measured currents for the sweep (e.g., Board::readQueue.getMeasuredCurrents(channel))
+     *  \returns True if this was a test sweep, whose corrected currents getCorrected() now returns; false for a sub-pulse
+     */
+    bool LeakSubtractor::addSweep(const ProtocolSweep& sweep, const ChipChannel& channel, const vector<Sample>& currents) {
+        if (sweep.index >= plan.size()) {
+            throw invalid_argument("Sweep isn't part of the interleaved protocol");
+        }
+        const SweepPlan& sweepPlan = plan[sweep.index];
+        Template& leak = templates[channel];
+
+        if (!sweepPlan.test) {
+            std::size_t n = std::min<std::size_t>(sweepPlan.holdingLength, currents.size());
+            double holdingCurrent = 0;
+            for (std::size_t i = 0; i < n; i++) {
+                holdingCurrent += currents[i];
+            }
+            if (n > 0) {
+                holdingCurrent /= n;
+            }
+
+            if (leak.count == 0) {
+                leak.sum.assign(currents.size(), 0.0);
+            }
+            std::size_t m = std::min(leak.sum.size(), currents.size());
+            double* sum = leak.sum.data();
+            for (std::size_t i = 0; i < m; i++) {
+                sum[i] += currents[i] - holdingCurrent;
+            }
+            leak.count++;
+            return false;
+        }
+
+        // A test sweep whose sub-pulses were missed (e.g., the run was stopped between them) is passed on as it is
+        leak.corrected.assign(currents.begin(), currents.end());
+        if (leak.count > 0) {
+            double k = sweepPlan.scale / leak.count;
+            std::size_t m = std::min(leak.sum.size(), currents.size());
+            const double* sum = leak.sum.data();
+            Sample* corrected = leak.corrected.data();
+            for (std::size_t i = 0; i < m; i++) {
+                corrected[i] = static_cast<Sample>(currents[i] - k * sum[i]);
+            }
+        }
+        leak.count = 0;
+        return true;
+    }
+
+    /// The leak-subtracted currents of the channel's latest test sweep; see addSweep()
+    const vector<Sample>& LeakSubtractor::getCorrected(const ChipChannel& channel) const {
+        auto found = templates.find(channel);
+        if (found == templates.end()) {
+            throw invalid_argument("No sweeps added for this channel");
+        }
+        return found->second.corrected;
+    }
+}
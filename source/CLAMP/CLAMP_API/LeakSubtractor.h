@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ClampController.h"
+#include "Constants.h"
+#include "ProtocolRunner.h"
+#include "SimplifiedWaveform.h"
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace CLAMP {
+    /** \brief Online P/N leak subtraction for voltage-clamp protocols run by ProtocolRunner.
+     *
+     *  interleave() puts N sub-pulse sweeps before each test sweep.  A sub-pulse is a copy of the test sweep with its
+     *  departures from holding (the sweep's first segment) scaled down by a small fraction, e.g., -1/4, so that the
+     *  voltage-gated channels stay shut and only the passive (leak and capacitive) current flows.
+     *
+     *  As the protocol runs, pass each sweep's currents to addSweep().  A sub-pulse's current, less its own holding
+     *  current, is added to a running leak template for the channel; when the test sweep arrives, the template is
+     *  scaled up to the test sweep's amplitude and subtracted from it, and the template starts over for the next test
+     *  sweep.  So each corrected sweep is ready as soon as it has been read, and no raw sweeps are kept: only one
+     *  sweep's worth of template per channel.
+     \code
+        LeakSubtractor leak(4, -0.25);
+        protocol.load(leak.interleave(sweeps), true);
+        protocol.run([&](const ProtocolSweep& sweep) {
+            if (leak.addSweep(sweep, channel, board.readQueue.getMeasuredCurrents(channel))) {
+                // ... leak.getCorrected(channel) is test sweep leak.testIndex(sweep.index), leak-subtracted ...
+            }
+        });
+     \endcode
+     */
+    class LeakSubtractor {
+    public:
+        LeakSubtractor(unsigned int numSubPulses_, double fraction_);
+
+        std::vector<SimplifiedWaveform> interleave(const std::vector<SimplifiedWaveform>& testSweeps);
+        bool addSweep(const ProtocolSweep& sweep, const ClampConfig::ChipChannel& channel, const std::vector<Sample>& currents);
+        const std::vector<Sample>& getCorrected(const ClampConfig::ChipChannel& channel) const;
+
+        /// Whether protocol sweep *index* (see ProtocolSweep::index) is a test sweep, rather than a sub-pulse
+        bool isTestSweep(std::size_t index) const { return plan[index].test; }
+        /// Which of the sweeps passed to interleave() protocol sweep *index* is, or is a sub-pulse for
+        std::size_t testIndex(std::size_t index) const { return plan[index].testIndex; }
+        /// Sub-pulses run before each test sweep
+        unsigned int getNumSubPulses() const { return numSubPulses; }
+
+    private:
+        /// \cond private
+        // What interleave() made of each sweep of the protocol
+        struct SweepPlan {
+            bool test;
+            std::size_t testIndex;
+            unsigned int holdingLength; // Timesteps of the first segment, which the holding current is measured over
+            double scale;               // Test sweep's amplitude over its sub-pulses' amplitude
+        };
+        // Per-channel leak template, for the test sweep being built up to
+        struct Template {
+            std::vector<double> sum; // Sub-pulse currents so far, each less its holding current
+            unsigned int count;      // Sub-pulses in sum
+            std::vector<Sample> corrected;
+
+            Template() : count(0) {}
+        };
+        /// \endcond
+
+        unsigned int numSubPulses;
+        double fraction;
+        std::vector<SweepPlan> plan;
+        std::map<ClampConfig::ChipChannel, Template> templates;
+    };
+}
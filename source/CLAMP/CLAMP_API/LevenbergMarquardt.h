@@ -0,0 +1,231 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Levenberg-Marquardt least squares for any model with a fixed number of parameters.
+         *
+         *  ExponentialFit::lm() hard-codes its three parameters, down to the 3x3 inverse.  This is the same algorithm
+         *  for a Model given as a template parameter, so the normal equations are fixed-size arrays the compiler
+         *  unrolls, whatever the number of parameters.  A Model is a class with
+         \code
+            static const unsigned int NUM_PARAMETERS = N;
+            // The model's value at x, with its gradient with respect to beta in gradient
+            static double evaluate(double x, const double beta[N], double gradient[N]);
+         \endcode
+         *  See SingleExponential and DoubleExponential in ExponentialModels.h.
+         *
+         *  Each iteration evaluates the model once per sample, where lm() evaluates it twice: the values and gradients at
+         *  a trial step are kept in the Workspace, and become the current ones if the step is accepted.  The Workspace
+         *  is the only memory a fit needs, so keeping one (per thread) between fits means fitting segment after segment
+         *  doesn't allocate.
+         *
+         *  The steps, the adjustments of lambda, and the stopping rules are lm()'s, except that a trial step whose
+         *  residual isn't a number is rejected, and chi2 is that of the parameters returned.  With weights, samples
+         *  count in proportion to them (e.g., 1 / variance); chi2 is then the weighted mean squared residual.
+         */
+        template <typename Model>
+        class LevenbergMarquardt {
+        public:
+            /// Number of parameters
+            static const unsigned int N = Model::NUM_PARAMETERS;
+            /// Iterations fit() takes at most, by default: lm()'s limit
+            static const unsigned int MAX_ITERATIONS = 201;
+
+            /// Buffers for fit(), reusable from fit to fit
+            class Workspace {
+            public:
+                /// Bytes held
+                std::size_t memoryBytes() const { return (current.capacity() + trial.capacity()) * sizeof(double); }
+
+            private:
+                friend class LevenbergMarquardt;
+                // Per sample, the model's value then its gradient (N + 1 values): at the current beta, and at the trial one
+                std::vector<double> current;
+                std::vector<double> trial;
+            };
+
+            /** \brief Fits the model to the samples, starting from the parameters in beta.
+             *
+             *  \param[in] xs             Independent variable
+             *  \param[in] ys             Values to fit
+             *  \param[in] weights        Weight of each sample, or nullptr to weigh them equally
+             *  \param[in] n              Number of samples
+             *  \param[in,out] beta       Initial guess; the fitted parameters on return
+             *  \param[out] chi2          Mean squared residual at the fitted parameters, weighted as the samples are
+             *  \param[in] workspace      Buffers to use
+             *  \param[in] maxIterations  Most iterations to take, e.g., a few when starting from the previous fit of a
+             *                            similar transient
+             *  \returns Number of iterations taken
+             */
+            static unsigned int fit(const double* xs, const double* ys, const double* weights, std::size_t n, double beta[N], double& chi2,
+                                    Workspace& workspace, unsigned int maxIterations = MAX_ITERATIONS) {
+                const std::size_t stride = N + 1;
+                workspace.current.resize(n * stride);
+                workspace.trial.resize(n * stride);
+
+                double totalWeight = 0;
+                for (std::size_t k = 0; k < n; k++) {
+                    totalWeight += weights ? weights[k] : 1.0;
+                }
+                chi2 = evaluate(xs, ys, weights, n, beta, workspace.current.data()) / totalWeight;
+
+                double lambda = 0.001;
+                unsigned int consecutiveNonSteps = 0;
+                unsigned int iterations = 0;
+                bool first = true;
+                while (iterations < maxIterations) {
+                    // (J'WJ + lambda * diag(J'WJ)) * delta = J'W * diff
+                    Matrix A;
+                    Vector b;
+                    accumulate(ys, weights, n, workspace.current.data(), A, b);
+                    for (unsigned int i = 0; i < N; i++) {
+                        A[i][i] += lambda * A[i][i];
+                    }
+                    Vector delta;
+                    bool solved = solve(A, b, delta);
+
+                    double newBeta[N];
+                    for (unsigned int i = 0; i < N; i++) {
+                        newBeta[i] = beta[i] + delta[i];
+                    }
+                    double newChi2 = solved ? evaluate(xs, ys, weights, n, newBeta, workspace.trial.data()) / totalWeight : NAN;
+
+                    double oldChi2 = chi2;
+                    double oldBeta[N];
+                    bool tookAStep = newChi2 < chi2; // False for NaN
+                    if (tookAStep) {
+                        if (lambda / 10 > 1e-10) {
+                            lambda = lambda / 10;
+                        }
+                        for (unsigned int i = 0; i < N; i++) {
+                            oldBeta[i] = beta[i];
+                            beta[i] = newBeta[i];
+                        }
+                        chi2 = newChi2;
+                        std::swap(workspace.current, workspace.trial);
+                    }
+                    else if (lambda < 10) {
+                        lambda = 10 * lambda;
+                    }
+                    iterations++;
+
+                    if (lambda < 1e-9) {
+                        break;
+                    }
+                    if (tookAStep) {
+                        consecutiveNonSteps = 0;
+                        if (!first) {
+                            double fracChangeChi2 = std::abs((chi2 - oldChi2) / oldChi2);
+                            double fracChangeBeta = 0;
+                            for (unsigned int i = 0; i < N; i++) {
+                                fracChangeBeta += std::abs((beta[i] - oldBeta[i]) / oldBeta[i]);
+                            }
+                            if (fracChangeChi2 < 1e-6 && fracChangeBeta < 1e-6) {
+                                break;
+                            }
+                        }
+                    }
+                    else {
+                        consecutiveNonSteps++;
+                        if (consecutiveNonSteps > 10) {
+                            break;
+                        }
+                    }
+                    first = false;
+                }
+                return iterations;
+            }
+
+            /// fit(), with every sample weighted equally
+            static unsigned int fit(const std::vector<double>& xs, const std::vector<double>& ys, double beta[N], double& chi2,
+                                    Workspace& workspace, unsigned int maxIterations = MAX_ITERATIONS) {
+                return fit(xs.data(), ys.data(), nullptr, xs.size(), beta, chi2, workspace, maxIterations);
+            }
+
+            /// \cond private
+            typedef std::array<double, N> Vector;
+            typedef std::array<std::array<double, N>, N> Matrix;
+
+            // Solves A * x = b by Gaussian elimination with partial pivoting; false if A is singular
+            static bool solve(Matrix A, Vector b, Vector& x) {
+                for (unsigned int col = 0; col < N; col++) {
+                    unsigned int pivot = col;
+                    for (unsigned int row = col + 1; row < N; row++) {
+                        if (std::abs(A[row][col]) > std::abs(A[pivot][col])) {
+                            pivot = row;
+                        }
+                    }
+                    if (!(A[pivot][col] != 0)) {
+                        return false; // Zero or NaN
+                    }
+                    std::swap(A[col], A[pivot]);
+                    std::swap(b[col], b[pivot]);
+                    for (unsigned int row = col + 1; row < N; row++) {
+                        double factor = A[row][col] / A[col][col];
+                        for (unsigned int k = col; k < N; k++) {
+                            A[row][k] -= factor * A[col][k];
+                        }
+                        b[row] -= factor * b[col];
+                    }
+                }
+                for (unsigned int i = N; i-- > 0;) {
+                    double sum = b[i];
+                    for (unsigned int k = i + 1; k < N; k++) {
+                        sum -= A[i][k] * x[k];
+                    }
+                    x[i] = sum / A[i][i];
+                }
+                return true;
+            }
+            /// \endcond
+
+        private:
+            // Evaluates the model at every sample into values (value, then gradient, per sample), returning the weighted
+            // sum of squared residuals
+            static double evaluate(const double* xs, const double* ys, const double* weights, std::size_t n, const double beta[N], double* values) {
+                double sum = 0;
+                for (std::size_t k = 0; k < n; k++) {
+                    double* v = values + k * (N + 1);
+                    v[0] = Model::evaluate(xs[k], beta, v + 1);
+                    double r = ys[k] - v[0];
+                    sum += (weights ? weights[k] : 1.0) * r * r;
+                }
+                return sum;
+            }
+
+            // J'WJ and J'W * diff, from the values and gradients evaluate() stored
+            static void accumulate(const double* ys, const double* weights, std::size_t n, const double* values, Matrix& A, Vector& b) {
+                for (unsigned int i = 0; i < N; i++) {
+                    b[i] = 0;
+                    for (unsigned int j = 0; j < N; j++) {
+                        A[i][j] = 0;
+                    }
+                }
+                for (std::size_t k = 0; k < n; k++) {
+                    const double* v = values + k * (N + 1);
+                    const double* g = v + 1;
+                    double w = weights ? weights[k] : 1.0;
+                    double r = w * (ys[k] - v[0]);
+                    for (unsigned int i = 0; i < N; i++) {
+                        double wg = w * g[i];
+                        for (unsigned int j = 0; j <= i; j++) {
+                            A[i][j] += wg * g[j];
+                        }
+                        b[i] += g[i] * r;
+                    }
+                }
+                for (unsigned int i = 0; i < N; i++) {
+                    for (unsigned int j = i + 1; j < N; j++) {
+                        A[i][j] = A[j][i];
+                    }
+                }
+            }
+        };
+    }
+}
@@ -0,0 +1,138 @@
+#include "LockProfiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+using std::vector;
+using std::string;
+using std::mutex;
+using std::lock_guard;
+using std::unique_ptr;
+
+namespace CLAMP {
+    namespace LockProfiling {
+        std::atomic<bool> enabledFlag(false);
+
+        static mutex registryMutex;
+        static vector<unique_ptr<Site>>& registry() {
+            static vector<unique_ptr<Site>> sites; // Constructed on first use, since locks can be static objects too
+            return sites;
+        }
+
+        Site::Site(const char* name_) :
+            name(name_),
+            acquisitions(0),
+            contended(0),
+            waitNs(0),
+            maxWaitNs(0),
+            holdNs(0),
+            maxHoldNs(0)
+        {
+        }
+
+        static void updateMax(std::atomic<uint64_t>& max, uint64_t value) {
+            uint64_t previous = max.load(std::memory_order_relaxed);
+            while (value > previous && !max.compare_exchange_weak(previous, value, std::memory_order_relaxed)) {
+            }
+        }
+
+        void Site::recordWait(uint64_t ns) {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            waitNs.fetch_add(ns, std::memory_order_relaxed);
+            updateMax(maxWaitNs, ns);
+        }
+
+        void Site::recordHold(uint64_t ns) {
+            holdNs.fetch_add(ns, std::memory_order_relaxed);
+            updateMax(maxHoldNs, ns);
+        }
+
+        // The counters for the given name, created the first time it's used
+        Site& site(const char* name) {
+            lock_guard<mutex> lock(registryMutex);
+            for (auto& s : registry()) {
+                if (std::strcmp(s->name, name) == 0) {
+                    return *s;
+                }
+            }
+            registry().push_back(unique_ptr<Site>(new Site(name)));
+            return *registry().back();
+        }
+
+        uint64_t nowNs() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /** \brief Turns profiling of the locks on or off.
+         *
+         *  Counts already recorded are kept; see reset().
+         */
+        void setEnabled(bool enabled) {
+            enabledFlag.store(enabled, std::memory_order_relaxed);
+        }
+
+        /// \returns true if lock acquisitions are being profiled.
+        bool isEnabled() {
+            return enabledFlag.load(std::memory_order_relaxed);
+        }
+
+        /// Zeroes all the counts.
+        void reset() {
+            lock_guard<mutex> lock(registryMutex);
+            for (auto& s : registry()) {
+                s->acquisitions = 0;
+                s->contended = 0;
+                s->waitNs = 0;
+                s->maxWaitNs = 0;
+                s->holdNs = 0;
+                s->maxHoldNs = 0;
+            }
+        }
+
+        /** \brief Counts for every lock site, most total waiting first.
+         *
+         *  \returns One entry per site
+         */
+        vector<LockStatistics> getStatistics() {
+            vector<LockStatistics> result;
+            {
+                lock_guard<mutex> lock(registryMutex);
+                for (auto& s : registry()) {
+                    LockStatistics stats;
+                    stats.name = s->name;
+                    stats.acquisitions = s->acquisitions.load(std::memory_order_relaxed);
+                    stats.contended = s->contended.load(std::memory_order_relaxed);
+                    stats.waitSeconds = s->waitNs.load(std::memory_order_relaxed) * 1e-9;
+                    stats.maxWaitSeconds = s->maxWaitNs.load(std::memory_order_relaxed) * 1e-9;
+                    stats.holdSeconds = s->holdNs.load(std::memory_order_relaxed) * 1e-9;
+                    stats.maxHoldSeconds = s->maxHoldNs.load(std::memory_order_relaxed) * 1e-9;
+                    result.push_back(stats);
+                }
+            }
+            std::sort(result.begin(), result.end(), [](const LockStatistics& a, const LockStatistics& b) { return a.waitSeconds > b.waitSeconds; });
+            return result;
+        }
+
+        /** \brief Table of the most contended locks.
+         *
+         *  \param[in] maxLocks  Most sites to list
+         *  \returns One line per site, most total waiting first
+         */
+        string report(unsigned int maxLocks) {
+            vector<LockStatistics> stats = getStatistics();
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(3);
+            out << "Lock contention (times in ms):\n";
+            for (unsigned int i = 0; i < stats.size() && i < maxLocks; i++) {
+                const LockStatistics& s = stats[i];
+                out << "  " << s.name << ": " << s.acquisitions << " acquisitions, " << s.contended << " contended, wait "
+                    << s.waitSeconds * 1000 << " (max " << s.maxWaitSeconds * 1000 << "), hold " << s.holdSeconds * 1000
+                    << " (max " << s.maxHoldSeconds * 1000 << ")\n";
+            }
+            return out.str();
+        }
+    }
+}
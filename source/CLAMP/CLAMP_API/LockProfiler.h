@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace CLAMP {
+    /** \brief Optional profiling of the coarse locks (Board::commandMutex, the DataStore and Plot mutexes, etc.).
+     *
+     *  The locks are ProfiledMutex or ProfiledRecursiveMutex objects, each named for its site (e.g., "Board::commandMutex");
+     *  all the locks with the same name are counted together.  Once profiling is enabled, every acquisition records
+     *  whether it had to wait, how long it waited, and how long the lock was then held.  When profiling is off (the
+     *  default), locking costs one relaxed atomic load more than a plain std::mutex.
+     \code
+        CLAMP::LockProfiling::setEnabled(true);
+        // ... acquire data while redrawing ...
+        std::cerr << CLAMP::LockProfiling::report();
+     \endcode
+     */
+    namespace LockProfiling {
+        /// Totals for all the locks with one name
+        struct LockStatistics {
+            std::string name;
+            uint64_t acquisitions; ///< Times the lock was taken (recursive re-entries aren't counted)
+            uint64_t contended;    ///< Acquisitions that had to wait for another thread
+            double waitSeconds;    ///< Total time spent waiting to acquire
+            double maxWaitSeconds; ///< Longest single wait
+            double holdSeconds;    ///< Total time the lock was held
+            double maxHoldSeconds; ///< Longest single hold
+        };
+
+        void setEnabled(bool enabled);
+        bool isEnabled();
+        void reset();
+        std::vector<LockStatistics> getStatistics();
+        std::string report(unsigned int maxLocks = 10);
+
+        /// \cond private
+        // Counters shared by the locks with one name; never freed, so they stay valid wherever they're used
+        struct Site {
+            const char* name;
+            std::atomic<uint64_t> acquisitions;
+            std::atomic<uint64_t> contended;
+            std::atomic<uint64_t> waitNs;
+            std::atomic<uint64_t> maxWaitNs;
+            std::atomic<uint64_t> holdNs;
+            std::atomic<uint64_t> maxHoldNs;
+
+            explicit Site(const char* name_);
+            void recordWait(uint64_t ns);
+            void recordHold(uint64_t ns);
+        };
+
+        Site& site(const char* name);
+        uint64_t nowNs();
+        extern std::atomic<bool> enabledFlag;
+        /// \endcond
+    }
+
+    /** \brief Drop-in replacement for std::mutex or std::recursive_mutex that feeds LockProfiling.
+     *
+     *  Use ProfiledMutex and ProfiledRecursiveMutex, with std::lock_guard and std::unique_lock as usual.
+     */
+    template <class Mutex>
+    class ProfiledMutexBase {
+    public:
+        /// \param[in] name  Site name the lock is reported under; must be a string literal.
+        explicit ProfiledMutexBase(const char* name) : site(LockProfiling::site(name)), depth(0), holdBeginNs(0), timingHold(false) {}
+
+        void lock() {
+            if (!LockProfiling::enabledFlag.load(std::memory_order_relaxed)) {
+                m.lock();
+                entered(false);
+                return;
+            }
+            if (!m.try_lock()) {
+                uint64_t begin = LockProfiling::nowNs();
+                m.lock();
+                site.recordWait(LockProfiling::nowNs() - begin);
+            }
+            entered(true);
+        }
+
+        bool try_lock() {
+            if (!m.try_lock()) {
+                return false;
+            }
+            entered(LockProfiling::enabledFlag.load(std::memory_order_relaxed));
+            return true;
+        }
+
+        void unlock() {
+            if (--depth == 0 && timingHold) {
+                timingHold = false;
+                site.recordHold(LockProfiling::nowNs() - holdBeginNs);
+            }
+            m.unlock();
+        }
+
+    private:
+        Mutex m;
+        LockProfiling::Site& site;
+        // Only touched by the thread holding m
+        unsigned int depth;
+        uint64_t holdBeginNs;
+        bool timingHold;
+
+        void entered(bool profile) {
+            if (depth++ == 0 && profile) {
+                site.acquisitions.fetch_add(1, std::memory_order_relaxed);
+                timingHold = true;
+                holdBeginNs = LockProfiling::nowNs();
+            }
+        }
+
+        ProfiledMutexBase(const ProfiledMutexBase&);
+        ProfiledMutexBase& operator=(const ProfiledMutexBase&);
+    };
+
+    typedef ProfiledMutexBase<std::mutex> ProfiledMutex;
+    typedef ProfiledMutexBase<std::recursive_mutex> ProfiledRecursiveMutex;
+}
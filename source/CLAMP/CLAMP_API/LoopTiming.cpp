@@ -0,0 +1,258 @@
+#include "LoopTiming.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+namespace CLAMP {
+    static double nowSeconds() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t toMicroseconds(double seconds) {
+        return (seconds > 0) ? static_cast<uint64_t>(seconds * 1e6 + 0.5) : 0;
+    }
+
+    // Loop whose thread this is (set by the latest readDone), and the innermost Phase open on this thread
+    static thread_local LoopTiming* activeTiming = nullptr;
+    static thread_local LoopTiming::Phase* activePhase = nullptr;
+
+    //-----------------------------------------------------------------------------------------------------
+    Histogram::Histogram() {
+        reset();
+    }
+
+    // Values below 2 * SUB_BUCKETS get a bucket each; above that, the top log2(SUB_BUCKETS) + 1 bits pick the bucket
+    unsigned int Histogram::bucketOf(uint64_t microseconds) {
+        if (microseconds < 2 * SUB_BUCKETS) {
+            return static_cast<unsigned int>(microseconds);
+        }
+        unsigned int shift = 0;
+        while ((microseconds >> shift) >= 2 * SUB_BUCKETS) {
+            shift++;
+        }
+        unsigned int bucket = 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + static_cast<unsigned int>((microseconds >> shift) - SUB_BUCKETS);
+        return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+    }
+
+    // Middle of the range of values (in seconds) that fall in the given bucket
+    double Histogram::bucketMidpoint(unsigned int bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket * 1e-6;
+        }
+        unsigned int shift = (bucket - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+        uint64_t sub = (bucket - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+        uint64_t low = sub << shift;
+        uint64_t width = uint64_t(1) << shift;
+        return (low + (width - 1) / 2.0) * 1e-6;
+    }
+
+    /// \param[in] seconds  Duration to count
+    void Histogram::record(double seconds) {
+        uint64_t us = toMicroseconds(seconds);
+        counts[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sumMicroseconds.fetch_add(us, std::memory_order_relaxed);
+        uint64_t previous = maxMicroseconds.load(std::memory_order_relaxed);
+        while (us > previous && !maxMicroseconds.compare_exchange_weak(previous, us, std::memory_order_relaxed)) {
+        }
+    }
+
+    /// Discards everything recorded so far.
+    void Histogram::reset() {
+        for (auto& count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sumMicroseconds.store(0, std::memory_order_relaxed);
+        maxMicroseconds.store(0, std::memory_order_relaxed);
+    }
+
+    /// \returns Number of durations recorded
+    uint64_t Histogram::count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    /** \brief Duration that the given fraction of the recorded durations are at or below.
+     *
+     *  \param[in] p  Fraction, from 0 to 1 (e.g., 0.99 for the 99th percentile)
+     *  \returns The duration, in seconds (the middle of its bucket); 0 if nothing has been recorded.
+     */
+    double Histogram::percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p * n));
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (unsigned int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+            seen += counts[bucket].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucketMidpoint(bucket), max());
+            }
+        }
+        return max();
+    }
+
+    /// \returns Mean of the recorded durations, in seconds
+    double Histogram::mean() const {
+        uint64_t n = count();
+        return (n > 0) ? sumMicroseconds.load(std::memory_order_relaxed) * 1e-6 / n : 0;
+    }
+
+    /// \returns Longest recorded duration, in seconds
+    double Histogram::max() const {
+        return maxMicroseconds.load(std::memory_order_relaxed) * 1e-6;
+    }
+
+    //-----------------------------------------------------------------------------------------------------
+    LoopTiming::LoopTiming() :
+        samplingRate(0),
+        haveLastRead(false),
+        lastReadTime(0),
+        minOffset(std::numeric_limits<double>::infinity()),
+        havePending(false),
+        pendingDataTime(0),
+        numPhases(0),
+        outlierThresholdMicroseconds(0)
+    {
+    }
+
+    /** \brief Starts timing a new run.
+     *
+     *  Called by Board when the board starts running, since the timestamps start over.  The histograms keep
+     *  accumulating; see reset().
+     *
+     *  \param[in] samplingRateHz  Timestamps per second
+     */
+    void LoopTiming::startRun(double samplingRateHz) {
+        samplingRate = samplingRateHz;
+        haveLastRead = false;
+        minOffset = std::numeric_limits<double>::infinity();
+        havePending = false;
+        numPhases = 0;
+    }
+
+    /** \brief Records the end of a read.
+     *
+     *  Called by Board::read() on the thread that reads.
+     *
+     *  \param[in] lastTimestamp  Timestamp of the newest packet read
+     *  \param[in] readSeconds    Time the read took (counted as the "read" phase)
+     */
+    void LoopTiming::readDone(uint32_t lastTimestamp, double readSeconds) {
+        activeTiming = this;
+        double now = nowSeconds();
+        addPhase("read", readSeconds);
+        if (haveLastRead) {
+            double interval = now - lastReadTime;
+            intervals.record(interval);
+            uint64_t threshold = outlierThresholdMicroseconds.load(std::memory_order_relaxed);
+            if (threshold > 0 && toMicroseconds(interval) > threshold) {
+                logOutlier(interval);
+            }
+        }
+        haveLastRead = true;
+        lastReadTime = now;
+        numPhases = 0;
+
+        if (samplingRate > 0) {
+            double dataTime = lastTimestamp / samplingRate;
+            minOffset = std::min(minOffset, now - dataTime);
+            pendingDataTime = dataTime;
+            havePending = true;
+        }
+    }
+
+    /** \brief Records the latency of the data from the last read; call when you've finished processing it.
+     *
+     *  \returns The latency recorded, in seconds, or a negative number if there was no new data to record it for
+     */
+    double LoopTiming::processed() {
+        if (!havePending) {
+            return -1;
+        }
+        havePending = false;
+        double latency = nowSeconds() - pendingDataTime - minOffset;
+        latencies.record(latency);
+        return latency;
+    }
+
+    /// Discards the recorded intervals and latencies.
+    void LoopTiming::reset() {
+        intervals.reset();
+        latencies.reset();
+    }
+
+    /** \brief Logs every interval between reads longer than the given one.
+     *
+     *  Can be called from any thread.
+     *
+     *  \param[in] seconds  Threshold; 0 to stop logging outliers.
+     */
+    void LoopTiming::setOutlierThreshold(double seconds) {
+        outlierThresholdMicroseconds.store(toMicroseconds(seconds), std::memory_order_relaxed);
+    }
+
+    /// \returns The threshold set by setOutlierThreshold(), in seconds
+    double LoopTiming::getOutlierThreshold() const {
+        return outlierThresholdMicroseconds.load(std::memory_order_relaxed) * 1e-6;
+    }
+
+    void LoopTiming::addPhase(const char* name, double seconds) {
+        for (unsigned int i = 0; i < numPhases; i++) {
+            if (std::strcmp(phases[i].name, name) == 0) {
+                phases[i].seconds += seconds;
+                return;
+            }
+        }
+        if (numPhases < MAX_PHASES) {
+            phases[numPhases].name = name;
+            phases[numPhases].seconds = seconds;
+            numPhases++;
+        }
+    }
+
+    void LoopTiming::logOutlier(double interval) {
+        double accounted = 0;
+        std::ostringstream breakdown;
+        for (unsigned int i = 0; i < numPhases; i++) {
+            breakdown << phases[i].name << " " << phases[i].seconds * 1000 << " ms, ";
+            accounted += phases[i].seconds;
+        }
+        breakdown << "other " << std::max(0.0, interval - accounted) * 1000 << " ms";
+        LOG(true) << "Read loop outlier: " << interval * 1000 << " ms between reads (" << breakdown.str() << ")\n";
+    }
+
+    //-----------------------------------------------------------------------------------------------------
+    LoopTiming::Phase::Phase(const char* name_) :
+        timing(activeTiming),
+        parent(nullptr),
+        name(name_),
+        begin(0),
+        childSeconds(0)
+    {
+        if (timing) {
+            parent = activePhase;
+            activePhase = this;
+            begin = nowSeconds();
+        }
+    }
+
+    LoopTiming::Phase::~Phase() {
+        if (timing) {
+            double elapsed = nowSeconds() - begin;
+            timing->addPhase(name, elapsed - childSeconds);
+            if (parent) {
+                parent->childSeconds += elapsed;
+            }
+            activePhase = parent;
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace CLAMP {
+    /** \brief Histogram of durations, with buckets whose width grows with the value (as in HdrHistogram).
+     *
+     *  Durations are recorded at 1 &micro;s resolution.  Below 2 * SUB_BUCKETS &micro;s every value has its own bucket; above that,
+     *  each power of two is split into SUB_BUCKETS buckets, so any recorded value is known to within about 3%, up to
+     *  days.  Recording is lock-free and allocation-free, so one thread can record while another reads.
+     */
+    class Histogram {
+    public:
+        /// Buckets per power of two
+        static const unsigned int SUB_BUCKETS = 32;
+
+        Histogram();
+
+        void record(double seconds);
+        void reset();
+
+        uint64_t count() const;
+        double percentile(double p) const;
+        double mean() const;
+        double max() const;
+
+    private:
+        /// \cond private
+        static const unsigned int NUM_BUCKETS = 2 * SUB_BUCKETS + 35 * SUB_BUCKETS;
+        /// \endcond
+
+        std::atomic<uint64_t> counts[NUM_BUCKETS];
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> sumMicroseconds;
+        std::atomic<uint64_t> maxMicroseconds;
+
+        static unsigned int bucketOf(uint64_t microseconds);
+        static double bucketMidpoint(unsigned int bucket);
+
+        Histogram(const Histogram&);
+        Histogram& operator=(const Histogram&);
+    };
+
+    /** \brief Regularity of the acquisition loop: time between reads, and how old the newest data is once it's processed.
+     *
+     *  Board::read() calls readDone() after every read, so the intervals are recorded for any program that reads the
+     *  board.  The program calls processed() once it has finished with the data from a read; the latency recorded is
+     *  the time from the newest sample's timestamp to then.  Board and host clocks are aligned at the quickest read of
+     *  the run, so the latency is relative to that read (which is as close to zero as the USB transfer allows).
+     *
+     *  Code in the loop can mark what it's doing with Phase.  If an outlier threshold is set, every interval longer
+     *  than that is logged, along with how the time since the previous read was split among the phases.
+     \code
+        board.loopTiming.setOutlierThreshold(0.005); // Log intervals over 5 ms
+        while (running) {
+            board.read(n);
+            {
+                CLAMP::LoopTiming::Phase phase("processing");
+                // ... process the data ...
+            }
+            board.loopTiming.processed();
+        }
+     \endcode
+     */
+    class LoopTiming {
+    public:
+        LoopTiming();
+
+        void startRun(double samplingRateHz);
+        void readDone(uint32_t lastTimestamp, double readSeconds);
+        double processed();
+
+        void reset();
+        void setOutlierThreshold(double seconds);
+        double getOutlierThreshold() const;
+
+        /// Time between the ends of successive reads
+        Histogram intervals;
+        /// Time from the newest sample of a read to the end of its processing (see processed())
+        Histogram latencies;
+
+        /** \brief Marks the time from construction to destruction as spent on the named activity.
+         *
+         *  Only counted on the thread that reads the board (the thread whose last read() call was on a LoopTiming); it
+         *  does nothing elsewhere.  Phases can nest; time in an inner phase isn't counted in the outer one.
+         */
+        class Phase {
+        public:
+            /// \param[in] name_  Name of the activity; must be a string literal (or otherwise outlive the LoopTiming).
+            explicit Phase(const char* name_);
+            ~Phase();
+
+        private:
+            LoopTiming* timing;
+            Phase* parent;
+            const char* name;
+            double begin;
+            double childSeconds;
+
+            Phase(const Phase&);
+            Phase& operator=(const Phase&);
+        };
+
+    private:
+        /// \cond private
+        static const unsigned int MAX_PHASES = 8;
+        struct PhaseTotal {
+            const char* name;
+            double seconds;
+        };
+        /// \endcond
+
+        // Only used by the reading thread
+        double samplingRate;
+        bool haveLastRead;
+        double lastReadTime;
+        double minOffset;        // Least (host time - board time) seen this run
+        bool havePending;
+        double pendingDataTime;  // Board time of the newest sample not yet processed
+        PhaseTotal phases[MAX_PHASES];
+        unsigned int numPhases;
+
+        std::atomic<uint64_t> outlierThresholdMicroseconds;
+
+        void addPhase(const char* name, double seconds);
+        void logOutlier(double interval);
+    };
+}
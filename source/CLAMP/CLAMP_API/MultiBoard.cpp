@@ -0,0 +1,226 @@
+#include "MultiBoard.h"
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::out_of_range;
+using std::runtime_error;
+using std::chrono::steady_clock;
+using namespace CLAMP::ClampConfig;
+
+namespace CLAMP {
+    /** \brief Constructor
+     *
+     *  \param[in] is18bit_  True if 18-bit ADCs are used; false for 16-bit ADCs.  Applies to all the boards.
+     */
+    MultiBoard::MultiBoard(bool is18bit_) :
+        is18bit(is18bit_),
+        firstTimestamp(0),
+        haveFirstTimestamp(false)
+    {
+    }
+
+    MultiBoard::~MultiBoard() {
+        stop();
+    }
+
+    /** \brief Lists the serial numbers of the Opal Kelly boards attached to USB ports.
+     *
+     *  \returns The serial numbers, suitable for passing to open().
+     */
+    std::vector<std::string> MultiBoard::listSerialNumbers() {
+        OpalKellyBoard scanner;
+        return scanner.listSerialNumbers();
+    }
+
+    /** \brief Opens the boards with the given serial numbers.
+     *
+     *  Boards are numbered in the order given.  Boards that fail to open are skipped, and any previously opened boards
+     *  are closed first.
+     *
+     *  \param[in] serialNumbers  Opal Kelly serial numbers; see listSerialNumbers().
+     *  \param[in] dllPath        Path of the Opal Kelly dll.  "" to use default path.
+     *  \param[in] bitfilePath    Path of the bit file to upload.  "" to use default path, "main.bit".
+     *  \returns The number of boards opened.
+     */
+    unsigned int MultiBoard::open(const vector<string>& serialNumbers, const string& dllPath, const string& bitfilePath) {
+        boards.clear();
+        for (const string& serialNumber : serialNumbers) {
+            unique_ptr<Board> b(new Board(is18bit));
+            if (b->open(dllPath, bitfilePath, serialNumber)) {
+                b->scanForChips();
+                boards.push_back(std::move(b));
+            }
+        }
+        return numBoards();
+    }
+
+    /// Number of boards opened.
+    unsigned int MultiBoard::numBoards() const {
+        return static_cast<unsigned int>(boards.size());
+    }
+
+    /// Number of chips (i.e., headstage slots) across all the boards.
+    unsigned int MultiBoard::numChips() const {
+        return numBoards() * MAX_NUM_CHIPS;
+    }
+
+    /** \brief One of the boards, for configuration.
+     *
+     *  \param[in] index  Board index [0, numBoards())
+     *  \returns The board.
+     */
+    Board& MultiBoard::board(unsigned int index) {
+        if (index >= boards.size()) {
+            throw out_of_range("Board index out of range.");
+        }
+        return *boards[index];
+    }
+
+    /** \brief Starts all the boards running continuously, as close to simultaneously as possible.
+     *
+     *  The run control on all boards is set up first, so that starting each is a single trigger; the time each trigger
+     *  goes out is used to line up the boards' data (see read()).  Each board's USB data is then transferred by its own
+     *  reader thread (see Board::startReaderThread).
+     */
+    void MultiBoard::runContinuously() {
+        for (auto& b : boards) {
+            b->stopReaderThread();
+            b->armContinuous();
+        }
+
+        vector<steady_clock::time_point> started;
+        for (auto& b : boards) {
+            b->triggerStart();
+            started.push_back(steady_clock::now());
+        }
+
+        // Later boards started later; drop the earlier boards' first few packets so everything lines up
+        packetsToSkip.assign(boards.size(), 0);
+        if (!boards.empty()) {
+            double rate = boards[0]->getSamplingRateHz();
+            for (unsigned int i = 0; i < boards.size(); i++) {
+                double delay = std::chrono::duration<double>(started.back() - started[i]).count();
+                packetsToSkip[i] = static_cast<unsigned int>(std::lround(delay * rate));
+            }
+        }
+        haveFirstTimestamp = false;
+
+        for (auto& b : boards) {
+            b->startReaderThread();
+        }
+    }
+
+    /// Stops all the boards, and discards any data left in their FIFOs.
+    void MultiBoard::stop() {
+        for (auto& b : boards) {
+            b->stopReaderThread();
+            b->stop();
+            b->flush();
+        }
+    }
+
+    // Reads exactly numPackets packets from one board into its ReadQueue
+    void MultiBoard::readFrom(Board& b, unsigned int numPackets) {
+        while (numPackets > 0) {
+            numPackets -= b.read(numPackets);
+        }
+    }
+
+    /** \brief Reads numPackets timesteps of data from every board.  Blocks until they're all available.
+     *
+     *  Data accumulates (as with Board::read) until clear() is called.
+     *
+     *  \param[in] numPackets  Number of timesteps to read.
+     */
+    void MultiBoard::read(unsigned int numPackets) {
+        for (unsigned int i = 0; i < boards.size(); i++) {
+            Board& b = *boards[i];
+            if (i < packetsToSkip.size() && packetsToSkip[i] > 0) {
+                readFrom(b, packetsToSkip[i]);
+                b.readQueue.clear(false);
+                packetsToSkip[i] = 0;
+            }
+            readFrom(b, numPackets);
+        }
+
+        // Count timestamps from the start of the (aligned) run
+        timestamps = boards.empty() ? vector<uint32_t>() : boards[0]->readQueue.getTimeStamps();
+        if (!timestamps.empty() && !haveFirstTimestamp) {
+            firstTimestamp = timestamps[0];
+            haveFirstTimestamp = true;
+        }
+        for (uint32_t& t : timestamps) {
+            t -= firstTimestamp;
+        }
+    }
+
+    /** \brief Clears the data read from every board.
+     *
+     *  \param[in] filtersToo  See ReadQueue::clear().
+     */
+    void MultiBoard::clear(bool filtersToo) {
+        for (auto& b : boards) {
+            b->readQueue.clear(filtersToo);
+        }
+        timestamps.clear();
+    }
+
+    // Board holding the given chip, and the chip/channel index on that board
+    Board& MultiBoard::boardFor(const ChipChannel& chipChannel, ChipChannel& local) {
+        local = ChipChannel{ chipChannel.chip % MAX_NUM_CHIPS, chipChannel.channel };
+        return board(chipChannel.chip / MAX_NUM_CHIPS);
+    }
+
+    /** \brief Timestamps of the data read, counted from the start of the run.
+     *
+     *  These are board 0's timestamps; the other boards' data is aligned with them.
+     */
+    const vector<uint32_t>& MultiBoard::getTimeStamps() {
+        return timestamps;
+    }
+
+    /// Digital inputs of one board.  See ReadQueue::getDigIns().
+    const vector<uint16_t>& MultiBoard::getDigIns(unsigned int boardIndex) {
+        return board(boardIndex).readQueue.getDigIns();
+    }
+
+    /// Digital outputs of one board.  See ReadQueue::getDigOuts().
+    const vector<uint16_t>& MultiBoard::getDigOuts(unsigned int boardIndex) {
+        return board(boardIndex).readQueue.getDigOuts();
+    }
+
+    /// See ReadQueue::getMuxData().  chipChannel.chip is numbered across all boards.
+    const vector<Sample>& MultiBoard::getMuxData(const ChipChannel& chipChannel) {
+        ChipChannel local;
+        return boardFor(chipChannel, local).readQueue.getMuxData(local);
+    }
+
+    /// See ReadQueue::getMeasuredVoltages().  chipChannel.chip is numbered across all boards.
+    const vector<Sample>& MultiBoard::getMeasuredVoltages(const ChipChannel& chipChannel) {
+        ChipChannel local;
+        return boardFor(chipChannel, local).readQueue.getMeasuredVoltages(local);
+    }
+
+    /// See ReadQueue::getMeasuredCurrents().  chipChannel.chip is numbered across all boards.
+    const vector<Sample>& MultiBoard::getMeasuredCurrents(const ChipChannel& chipChannel) {
+        ChipChannel local;
+        return boardFor(chipChannel, local).readQueue.getMeasuredCurrents(local);
+    }
+
+    /// See ReadQueue::getClampVoltages().  chipChannel.chip is numbered across all boards.
+    const vector<Sample>& MultiBoard::getClampVoltages(const ChipChannel& chipChannel) {
+        ChipChannel local;
+        return boardFor(chipChannel, local).readQueue.getClampVoltages(local);
+    }
+
+    /// See ReadQueue::getClampCurrents().  chipChannel.chip is numbered across all boards.
+    const vector<Sample>& MultiBoard::getClampCurrents(const ChipChannel& chipChannel) {
+        ChipChannel local;
+        return boardFor(chipChannel, local).readQueue.getClampCurrents(local);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include "Board.h"
+
+namespace CLAMP {
+    /** \brief Several CLAMP Evaluation Boards used together, for more headstages than one board supports.
+     *
+     *  Each board handles MAX_NUM_CHIPS headstages.  A MultiBoard numbers the chips across all its boards: chip
+     *  <i>c</i> is chip <tt>c % MAX_NUM_CHIPS</tt> on board <tt>c / MAX_NUM_CHIPS</tt>.  Configuration (waveforms,
+     *  calibration, etc.) is still done board by board, through board(); the MultiBoard handles starting the boards
+     *  together and reading their data as one stream.
+     *
+     *  Typical use:
+     \code
+        MultiBoard boards;
+        boards.open(boards.listSerialNumbers());
+        // ... configure each boards.board(i) ...
+        boards.runContinuously();
+        while (...) {
+            boards.read(numTimesteps);
+            const std::vector<Sample>& v = boards.getMeasuredVoltages(ChipChannel{ 12, 0 }); // Chip 4 on board 1
+            // ...
+            boards.clear(false);
+        }
+        boards.stop();
+     \endcode
+     *
+     *  The boards have no shared hardware trigger, so they're started by back-to-back start triggers over USB, and their
+     *  data is aligned using the host's measurement of when each trigger went out.  That alignment is good to within the
+     *  USB latency of the trigger (typically a few timesteps), and the boards' clocks aren't locked together, so very
+     *  long runs can drift by a few timesteps more.
+     */
+    class MultiBoard {
+    public:
+        explicit MultiBoard(bool is18bit = true);
+        ~MultiBoard();
+
+        /// \name Initialization
+        //@{
+        std::vector<std::string> listSerialNumbers();
+        unsigned int open(const std::vector<std::string>& serialNumbers, const std::string& dllPath = "", const std::string& bitfilePath = "");
+        unsigned int numBoards() const;
+        unsigned int numChips() const;
+        Board& board(unsigned int index);
+        //@}
+
+        /// \name Run control
+        //@{
+        void runContinuously();
+        void stop();
+        //@}
+
+        /// \name Reading
+        //@{
+        void read(unsigned int numPackets);
+        void clear(bool filtersToo = true);
+
+        const std::vector<uint32_t>& getTimeStamps();
+        const std::vector<uint16_t>& getDigIns(unsigned int boardIndex);
+        const std::vector<uint16_t>& getDigOuts(unsigned int boardIndex);
+        const std::vector<Sample>& getMuxData(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getMeasuredVoltages(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getMeasuredCurrents(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getClampVoltages(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getClampCurrents(const ClampConfig::ChipChannel& chipChannel);
+        //@}
+
+    private:
+        bool is18bit;
+        std::vector<std::unique_ptr<Board>> boards;
+
+        // Per board: packets still to drop after starting, so that all boards' data starts at the same moment
+        std::vector<unsigned int> packetsToSkip;
+        // Timestamps of board 0, counted from the start of the run
+        std::vector<uint32_t> timestamps;
+        uint32_t firstTimestamp;
+        bool haveFirstTimestamp;
+
+        Board& boardFor(const ClampConfig::ChipChannel& chipChannel, ClampConfig::ChipChannel& local);
+        void readFrom(Board& b, unsigned int numPackets);
+    };
+}
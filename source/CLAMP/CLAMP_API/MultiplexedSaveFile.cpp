@@ -0,0 +1,200 @@
+#include "MultiplexedSaveFile.h"
+#include "DirectFileOutStream.h"
+#include "SaveWriterThread.h"
+#include "Trace.h"
+#include <limits>
+#include <stdexcept>
+
+using std::unique_ptr;
+using std::vector;
+using std::invalid_argument;
+using std::runtime_error;
+
+namespace CLAMP {
+    namespace IO {
+        // Buffer sizes for the file; see SaveFile
+        static const unsigned int SAVE_BUFFER_SIZE = 4 * CLAMP::KILO;
+        static const unsigned int ASYNC_SAVE_BUFFER_SIZE = 64 * CLAMP::KILO;
+
+        /// Constructor
+        MultiplexedSaveFile::MultiplexedSaveFile() :
+            directIO(false),
+            channelCount(0),
+            numAdcs(-1)
+        {
+        }
+
+        MultiplexedSaveFile::~MultiplexedSaveFile() {
+            try {
+                close();
+            }
+            catch (...) {
+            }
+        }
+
+        /** \brief Write the file around the operating system's file cache; see SaveFile::setDirectIO().
+         *
+         *  \param[in] enable  True to bypass the cache
+         */
+        void MultiplexedSaveFile::setDirectIO(bool enable) {
+            if (file) {
+                throw runtime_error("Direct I/O must be set before the save file is opened");
+            }
+            directIO = enable;
+        }
+
+        /** \brief Open the save file.
+         *
+         *  \param[in] path   Path of the file
+         *  \param[in] async  Write on SaveWriterThread rather than on the calling thread
+         */
+        void MultiplexedSaveFile::open(const FILENAME& path, bool async) {
+            unique_ptr<FileOutStream> fs;
+            if (directIO) {
+                unique_ptr<DirectFileOutStream> direct(new DirectFileOutStream(async));
+                direct->open(path);
+                fs.reset(direct.release());
+            }
+            else {
+                fs.reset(new FileOutStream());
+                fs->open(path);
+                if (async) {
+                    fs.reset(new AsyncFileOutStream(std::move(fs)));
+                }
+            }
+            file.reset(new BinaryWriter(std::move(fs), async ? ASYNC_SAVE_BUFFER_SIZE : SAVE_BUFFER_SIZE));
+            channelCount = 0;
+            numAdcs = -1;
+        }
+
+        /// Close the save file; throws if what was still to be written (in asynchronous mode, still queued) couldn't be
+        void MultiplexedSaveFile::close() {
+            unique_ptr<BinaryWriter> closing(std::move(file));
+            if (closing) {
+                closing->close();
+            }
+        }
+
+        /** \brief Write the header of the save file.
+         *
+         *  Call once, after open() and before any writeData() calls.
+         *
+         *  \param[in] headers    Header of each channel, in the order their values will be given to writeData()
+         *  \param[in] auxHeader  Header for the aux columns; null if the records don't have them
+         */
+        void MultiplexedSaveFile::writeHeader(const vector<const HeaderData*>& headers, const AuxHeaderData* auxHeader) {
+            if (!file) {
+                throw runtime_error("Save file isn't open");
+            }
+            if (headers.empty() || headers.size() > std::numeric_limits<uint16_t>::max()) {
+                throw invalid_argument("Multiplexed save files need at least one channel");
+            }
+
+            // The channels' own headers, as they'd start a SaveFile::FLOAT_RECORDS file
+            vector<char> headerBytes;
+            {
+                BinaryWriter out(unique_ptr<FileOutStream>(new MemoryOutStream(headerBytes)), SAVE_BUFFER_SIZE);
+                for (const HeaderData* header : headers) {
+                    out << static_cast<uint16_t>(header->getChannel().chip) << static_cast<uint16_t>(header->getChannel().channel);
+                }
+                for (const HeaderData* header : headers) {
+                    HeaderData floatHeader(*header);
+                    floatHeader.version = Version(DATA_FILE_MAIN_VERSION_NUMBER, DATA_FILE_SECONDARY_VERSION_NUMBER);
+                    out << floatHeader;
+                }
+                if (auxHeader) {
+                    out << *auxHeader;
+                }
+            }
+
+            uint32_t headerSize = sizeof(uint32_t) + 5 * sizeof(uint16_t) + sizeof(uint32_t) + static_cast<uint32_t>(headerBytes.size());
+            *file << static_cast<uint32_t>(DATA_FILE_MAGIC_NUMBER);
+            *file << static_cast<uint16_t>(DATA_FILE_MULTIPLEXED_MAIN_VERSION_NUMBER) << static_cast<uint16_t>(0);
+            *file << static_cast<uint16_t>(DATA_FILE_MULTIPLEXED_KIND);
+            *file << static_cast<uint16_t>(headers.size());
+            *file << static_cast<uint16_t>(auxHeader ? 1 : 0);
+            *file << headerSize;
+            file->writeBytes(headerBytes.data(), static_cast<unsigned int>(headerBytes.size()));
+
+            channelCount = headers.size();
+            numAdcs = auxHeader ? auxHeader->numAdcs : -1;
+        }
+
+        /** \brief Write a block of data for a file without aux columns.
+         *
+         *  \param[in] timestamps    Timestamps
+         *  \param[in] measuredData  Each channel's measured values (see SaveFile::writeData), in the order of the headers
+         *  \param[in] clampValues   Each channel's clamp values
+         *  \param[in] first         Index of the first element to write
+         */
+        void MultiplexedSaveFile::writeData(const vector<uint32_t>& timestamps, const vector<const vector<Sample>*>& measuredData,
+                                            const vector<const vector<Sample>*>& clampValues, unsigned int first) {
+            if (numAdcs >= 0) {
+                throw invalid_argument("This save file's records have aux columns");
+            }
+            writeRecords(timestamps, measuredData, clampValues, nullptr, nullptr, nullptr, first);
+        }
+
+        /** \brief Write a block of data for a file with aux columns.
+         *
+         *  \param[in] timestamps    Timestamps
+         *  \param[in] measuredData  Each channel's measured values (see SaveFile::writeData), in the order of the headers
+         *  \param[in] clampValues   Each channel's clamp values
+         *  \param[in] adcs          ADC values, as for SaveFile::writeDataAux
+         *  \param[in] digIns        Digital inputs
+         *  \param[in] digOuts       Digital outputs
+         *  \param[in] first         Index of the first element to write
+         */
+        void MultiplexedSaveFile::writeData(const vector<uint32_t>& timestamps, const vector<const vector<Sample>*>& measuredData,
+                                            const vector<const vector<Sample>*>& clampValues, const vector<vector<uint16_t>>& adcs,
+                                            const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts, unsigned int first) {
+            if (numAdcs < 0) {
+                throw invalid_argument("This save file's records have no aux columns");
+            }
+            writeRecords(timestamps, measuredData, clampValues, &adcs, &digIns, &digOuts, first);
+        }
+
+        void MultiplexedSaveFile::writeRecords(const vector<uint32_t>& timestamps, const vector<const vector<Sample>*>& measuredData,
+                                               const vector<const vector<Sample>*>& clampValues, const vector<vector<uint16_t>>* adcs,
+                                               const vector<uint16_t>* digIns, const vector<uint16_t>* digOuts, unsigned int first) {
+            CLAMP_TRACE_SPAN("MultiplexedSaveFile::writeData");
+            if (!file || channelCount == 0) {
+                throw runtime_error("The header must be written before the data");
+            }
+            if (measuredData.size() != channelCount || clampValues.size() != channelCount) {
+                throw invalid_argument("Wrong number of channels");
+            }
+            std::size_t n = timestamps.size();
+            for (std::size_t i = 0; i < channelCount; i++) {
+                if (measuredData[i]->size() != n || clampValues[i]->size() != n) {
+                    throw invalid_argument("Size mismatch");
+                }
+            }
+            if (adcs && (digIns->size() != n || digOuts->size() != n || adcs->size() < static_cast<std::size_t>(numAdcs))) {
+                throw invalid_argument("Size mismatch");
+            }
+            if (first >= n) {
+                return;
+            }
+
+            // Each record is: timestamp, then clamp value and measured value for each channel, then digital in, digital out, ADCs
+            columns.clear();
+            columns.push_back(BinaryColumn(timestamps.data() + first));
+            for (std::size_t i = 0; i < channelCount; i++) {
+                columns.push_back(BinaryColumn(clampValues[i]->data() + first));
+                columns.push_back(BinaryColumn(measuredData[i]->data() + first));
+            }
+            if (adcs) {
+                columns.push_back(BinaryColumn(digIns->data() + first));
+                columns.push_back(BinaryColumn(digOuts->data() + first));
+                for (int adc = 0; adc < numAdcs; adc++) {
+                    if ((*adcs)[adc].size() != n) {
+                        throw invalid_argument("Size mismatch");
+                    }
+                    columns.push_back(BinaryColumn((*adcs)[adc].data() + first));
+                }
+            }
+            file->writeRecords(columns.data(), static_cast<unsigned int>(columns.size()), static_cast<unsigned int>(n - first));
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "SaveFile.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /** \brief One save file for several channels (e.g., every headstage of a run) and, optionally, the aux I/O.
+         *
+         *  SaveFile writes a file per channel, plus an aux file, each with its own copy of the timestamps.  Here each
+         *  record holds one timestamp, then every channel's values, then the aux values, so recording eight headstages
+         *  writes one stream instead of nine, and the timestamps once instead of nine times.  The file (version 4) is:
+         *  \code
+              uint32  DATA_FILE_MAGIC_NUMBER
+              uint16  DATA_FILE_MULTIPLEXED_MAIN_VERSION_NUMBER, uint16 0
+              uint16  DATA_FILE_MULTIPLEXED_KIND (where other files have 0 for headstage data or 1 for aux data)
+              uint16  number of channels
+              uint16  1 if the records have the aux columns, else 0
+              uint32  header size, in bytes, up to the first record
+              uint16  chip, uint16 channel                     for each channel
+              the header of a SaveFile::FLOAT_RECORDS file     for each channel, with its own settings and waveform
+              the header of an aux file                        if the records have the aux columns
+              records
+         *  \endcode
+         *  Each record is uint32 timestamp; float clamp value, float measured value for each channel (the same values and
+         *  units as in SaveFile::FLOAT_RECORDS; the applied value is described by the channel's waveform); then, with the
+         *  aux columns, uint16 digital in, uint16 digital out and a uint16 for each ADC, as in an aux file.
+         *
+         *  SaveFileReader reads these files (see SaveFileReader::isMultiplexed).  Recordings can't be split into
+         *  segments; see SaveFile::setRollover().
+         */
+        class MultiplexedSaveFile {
+        public:
+            MultiplexedSaveFile();
+            ~MultiplexedSaveFile();
+            void setDirectIO(bool enable);
+            void open(const FILENAME& path, bool async = false);
+            void close();
+            void writeHeader(const std::vector<const HeaderData*>& headers, const AuxHeaderData* auxHeader = nullptr);
+            void writeData(const std::vector<uint32_t>& timestamps, const std::vector<const std::vector<Sample>*>& measuredData,
+                           const std::vector<const std::vector<Sample>*>& clampValues, unsigned int first = 0);
+            void writeData(const std::vector<uint32_t>& timestamps, const std::vector<const std::vector<Sample>*>& measuredData,
+                           const std::vector<const std::vector<Sample>*>& clampValues, const std::vector<std::vector<uint16_t>>& adcs,
+                           const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts, unsigned int first = 0);
+
+            /// Number of channels, once the header has been written
+            std::size_t numChannels() const { return channelCount; }
+
+        private:
+            std::unique_ptr<BinaryWriter> file;
+            bool directIO;
+            std::size_t channelCount;
+            int numAdcs; // -1 if the records have no aux columns
+            std::vector<BinaryColumn> columns;
+
+            void writeRecords(const std::vector<uint32_t>& timestamps, const std::vector<const std::vector<Sample>*>& measuredData,
+                              const std::vector<const std::vector<Sample>*>& clampValues, const std::vector<std::vector<uint16_t>>* adcs,
+                              const std::vector<uint16_t>* digIns, const std::vector<uint16_t>* digOuts, unsigned int first);
+
+            // Not copyable
+            MultiplexedSaveFile(const MultiplexedSaveFile&);
+            MultiplexedSaveFile& operator=(const MultiplexedSaveFile&);
+        };
+    }
+}
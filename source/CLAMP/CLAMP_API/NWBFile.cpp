@@ -0,0 +1,664 @@
+#include "NWBFile.h"
+#include "SaveWriterThread.h"
+#include "common.h"
+#include "Constants.h"
+#include "Trace.h"
+#include <stdexcept>
+
+#ifdef CLAMP_HDF5
+#include <hdf5.h>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <random>
+#include <string>
+#endif
+
+using std::vector;
+using std::string;
+using std::shared_ptr;
+using std::runtime_error;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace IO {
+        uint64_t NWBFile::Columns::bytes() const {
+            uint64_t total = timestamps.size() * sizeof(double) + (measured.size() + clamp.size() + applied.size()) * sizeof(float) +
+                             (digIns.size() + digOuts.size()) * sizeof(uint16_t);
+            for (const vector<uint16_t>& adc : adcs) {
+                total += adc.size() * sizeof(uint16_t);
+            }
+            return total;
+        }
+
+#ifdef CLAMP_HDF5
+        using std::lock_guard;
+        using std::mutex;
+
+        // The serial HDF5 library isn't thread-safe; every call into it holds this
+        static mutex& hdf5Mutex() {
+            static mutex theMutex;
+            return theMutex;
+        }
+
+        static void check(herr_t status, const char* what) {
+            if (status < 0) {
+                throw runtime_error(string("HDF5: couldn't ") + what);
+            }
+        }
+
+        // Closes an HDF5 identifier when it goes out of scope
+        class Handle {
+        public:
+            Handle(hid_t id_, herr_t (*closer_)(hid_t), const char* what) : id(id_), closer(closer_) {
+                if (id < 0) {
+                    throw runtime_error(string("HDF5: couldn't ") + what);
+                }
+            }
+            ~Handle() { closer(id); }
+            operator hid_t() const { return id; }
+
+        private:
+            hid_t id;
+            herr_t (*closer)(hid_t);
+
+            Handle(const Handle&);
+            Handle& operator=(const Handle&);
+        };
+
+        // Variable-length UTF-8 strings, which is how NWB stores text
+        static hid_t createStringType() {
+            hid_t type = H5Tcopy(H5T_C_S1);
+            if (type >= 0) {
+                H5Tset_size(type, H5T_VARIABLE);
+                H5Tset_cset(type, H5T_CSET_UTF8);
+            }
+            return type;
+        }
+
+        static void setAttribute(hid_t object, const char* name, const string& value) {
+            Handle type(createStringType(), H5Tclose, "create a string type");
+            Handle space(H5Screate(H5S_SCALAR), H5Sclose, "create a dataspace");
+            Handle attribute(H5Acreate2(object, name, type, space, H5P_DEFAULT, H5P_DEFAULT), H5Aclose, "create an attribute");
+            const char* text = value.c_str();
+            check(H5Awrite(attribute, type, &text), "write an attribute");
+        }
+
+        static void setAttribute(hid_t object, const char* name, hid_t fileType, hid_t memoryType, const void* value) {
+            Handle space(H5Screate(H5S_SCALAR), H5Sclose, "create a dataspace");
+            Handle attribute(H5Acreate2(object, name, fileType, space, H5P_DEFAULT, H5P_DEFAULT), H5Aclose, "create an attribute");
+            check(H5Awrite(attribute, memoryType, value), "write an attribute");
+        }
+
+        static void setAttribute(hid_t object, const char* name, double value) {
+            setAttribute(object, name, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, &value);
+        }
+
+        // NWB wants float32 for conversion, resolution and offset
+        static void setFloatAttribute(hid_t object, const char* name, float value) {
+            setAttribute(object, name, H5T_IEEE_F32LE, H5T_NATIVE_FLOAT, &value);
+        }
+
+        static void setIntAttribute(hid_t object, const char* name, int32_t value) {
+            setAttribute(object, name, H5T_STD_I32LE, H5T_NATIVE_INT32, &value);
+        }
+
+        static void writeString(hid_t location, const char* name, const string& value) {
+            Handle type(createStringType(), H5Tclose, "create a string type");
+            Handle space(H5Screate(H5S_SCALAR), H5Sclose, "create a dataspace");
+            Handle dataset(H5Dcreate2(location, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Dclose, "create a dataset");
+            const char* text = value.c_str();
+            check(H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &text), "write a dataset");
+        }
+
+        // A one-element list of strings (e.g., file_create_date)
+        static void writeStringList(hid_t location, const char* name, const string& value) {
+            hsize_t dims[1] = { 1 };
+            Handle type(createStringType(), H5Tclose, "create a string type");
+            Handle space(H5Screate_simple(1, dims, nullptr), H5Sclose, "create a dataspace");
+            Handle dataset(H5Dcreate2(location, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Dclose, "create a dataset");
+            const char* text = value.c_str();
+            check(H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &text), "write a dataset");
+        }
+
+        // A float32 scalar with a unit, as in VoltageClampSeries.capacitance_fast
+        static void writeQuantity(hid_t location, const char* name, double value, const char* unit) {
+            Handle space(H5Screate(H5S_SCALAR), H5Sclose, "create a dataspace");
+            Handle dataset(H5Dcreate2(location, name, H5T_IEEE_F32LE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Dclose, "create a dataset");
+            check(H5Dwrite(dataset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &value), "write a dataset");
+            setAttribute(dataset, "unit", unit);
+        }
+
+        static hid_t createGroup(hid_t location, const char* name) {
+            return H5Gcreate2(location, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        }
+
+        // Random (version 4) UUID, which NWB uses for object IDs and the file identifier
+        static string newUUID() {
+            static std::mt19937_64 generator(std::random_device{}());
+            uint64_t high = generator();
+            uint64_t low = generator();
+            high = (high & ~0xf000ull) | 0x4000ull;
+            low = (low & ~(0xc000ull << 48)) | (0x8000ull << 48);
+            char text[40];
+            snprintf(text, sizeof(text), "%08x-%04x-%04x-%04x-%012llx",
+                     static_cast<unsigned int>(high >> 32), static_cast<unsigned int>((high >> 16) & 0xffff), static_cast<unsigned int>(high & 0xffff),
+                     static_cast<unsigned int>(low >> 48), static_cast<unsigned long long>(low & 0xffffffffffffull));
+            return text;
+        }
+
+        // Marks an HDF5 object as an instance of an NWB core type
+        static void setType(hid_t object, const char* type) {
+            setAttribute(object, "namespace", "core");
+            setAttribute(object, "neurodata_type", type);
+            setAttribute(object, "object_id", newUUID());
+        }
+
+        // ISO 8601, with the local UTC offset, which NWB requires
+        static string isoTime(const TimeDate& t) {
+            std::time_t now = std::time(0);
+            std::tm local = *std::localtime(&now);
+            std::tm utc = *std::gmtime(&now);
+            utc.tm_isdst = local.tm_isdst;
+            long offset = static_cast<long>(std::difftime(std::mktime(&local), std::mktime(&utc))) / 60;
+            char sign = (offset < 0) ? '-' : '+';
+            offset = (offset < 0) ? -offset : offset;
+            char text[40];
+            snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d%c%02ld:%02ld", t.year, t.month, t.day, t.hour, t.minute, t.second,
+                     sign, offset / 60, offset % 60);
+            return text;
+        }
+
+        // HDF5 takes narrow file names; see FILENAME
+#if defined(_WIN32) && defined(_UNICODE)
+        static string narrowFileName(const std::wstring& name) {
+            return toString(name);
+        }
+#else
+        static string narrowFileName(const std::string& name) {
+            return name;
+        }
+#endif
+
+        // An empty 1-D dataset that grows as samples are appended
+        static hid_t createExtendable(hid_t location, const char* name, hid_t fileType) {
+            hsize_t dims[1] = { 0 };
+            hsize_t maxDims[1] = { H5S_UNLIMITED };
+            hsize_t chunk[1] = { NWBFile::CHUNK_SAMPLES };
+            Handle space(H5Screate_simple(1, dims, maxDims), H5Sclose, "create a dataspace");
+            Handle properties(H5Pcreate(H5P_DATASET_CREATE), H5Pclose, "create dataset properties");
+            check(H5Pset_chunk(properties, 1, chunk), "set the chunk size");
+            return H5Dcreate2(location, name, fileType, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// \cond private
+        struct NWBFile::File {
+            struct Dataset {
+                hid_t id;
+                uint64_t length;
+
+                Dataset() : id(-1), length(0) {}
+                void append(hid_t memoryType, const void* data, std::size_t n);
+            };
+
+            hid_t id;
+            Dataset timestamps; // Created with the first series; the others link to it
+            string timestampsPath;
+            Dataset measured;
+            Dataset clamp;
+            Dataset applied;
+            vector<Dataset> adcs;
+            Dataset digIns;
+            Dataset digOuts;
+
+            File() : id(-1) {}
+            ~File() { close(); }
+
+            void writeRoot(const TimeDate& start);
+            hid_t createSeries(const string& path, const char* type, const string& description, hid_t fileType, const char* unit,
+                               float conversion, float resolution, Dataset& data);
+            void writeHeadstage(const HeaderData& header);
+            void writeAux(const AuxHeaderData& header);
+            void append(const Columns& columns);
+            void close();
+        };
+        /// \endcond
+
+        void NWBFile::File::Dataset::append(hid_t memoryType, const void* data, std::size_t n) {
+            if (id < 0 || n == 0) {
+                return;
+            }
+            hsize_t newLength[1] = { length + n };
+            check(H5Dset_extent(id, newLength), "extend a dataset");
+            Handle fileSpace(H5Dget_space(id), H5Sclose, "get a dataspace");
+            hsize_t start[1] = { length };
+            hsize_t count[1] = { n };
+            check(H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, nullptr, count, nullptr), "select the end of a dataset");
+            Handle memorySpace(H5Screate_simple(1, count, nullptr), H5Sclose, "create a dataspace");
+            check(H5Dwrite(id, memoryType, memorySpace, fileSpace, H5P_DEFAULT, data), "write a dataset");
+            length += n;
+        }
+
+        // The datasets and groups every NWB file has
+        void NWBFile::File::writeRoot(const TimeDate& start) {
+            setType(id, "NWBFile");
+            setAttribute(id, "nwb_version", "2.5.0");
+            writeString(id, "identifier", newUUID());
+            writeString(id, "session_description", "CLAMP recording");
+            string startTime = isoTime(start);
+            writeString(id, "session_start_time", startTime);
+            writeString(id, "timestamps_reference_time", startTime);
+            writeStringList(id, "file_create_date", isoTime(TimeDate()));
+
+            const char* groups[] = { "acquisition", "analysis", "general", "processing", "stimulus", "stimulus/presentation", "stimulus/templates" };
+            for (const char* name : groups) {
+                Handle group(createGroup(id, name), H5Gclose, "create a group");
+            }
+        }
+
+        // A TimeSeries (or subtype) group with an empty data dataset.  The first series gets the timestamps dataset,
+        // and later ones a hard link to it.  Returns the group, for the caller to close.
+        hid_t NWBFile::File::createSeries(const string& path, const char* type, const string& description, hid_t fileType, const char* unit,
+                                          float conversion, float resolution, Dataset& data) {
+            hid_t group = createGroup(id, path.c_str());
+            if (group < 0) {
+                throw runtime_error("HDF5: couldn't create " + path);
+            }
+            try {
+                setType(group, type);
+                setAttribute(group, "description", description);
+                setAttribute(group, "comments", "no comments");
+
+                data.id = createExtendable(group, "data", fileType);
+                if (data.id < 0) {
+                    throw runtime_error("HDF5: couldn't create " + path + "/data");
+                }
+                setAttribute(data.id, "unit", unit);
+                setFloatAttribute(data.id, "conversion", conversion);
+                setFloatAttribute(data.id, "resolution", resolution);
+                setFloatAttribute(data.id, "offset", 0.0f);
+
+                if (timestamps.id < 0) {
+                    timestamps.id = createExtendable(group, "timestamps", H5T_IEEE_F64LE);
+                    if (timestamps.id < 0) {
+                        throw runtime_error("HDF5: couldn't create " + path + "/timestamps");
+                    }
+                    setIntAttribute(timestamps.id, "interval", 1);
+                    setAttribute(timestamps.id, "unit", "seconds");
+                    timestampsPath = "/" + path + "/timestamps";
+                }
+                else {
+                    check(H5Lcreate_hard(id, timestampsPath.c_str(), group, "timestamps", H5P_DEFAULT, H5P_DEFAULT), "link the timestamps");
+                }
+            }
+            catch (...) {
+                H5Gclose(group);
+                throw;
+            }
+            return group;
+        }
+
+        // Settings as attributes, so nothing in a .clp header is lost
+        static void writeSettings(hid_t group, const Settings& settings) {
+            setAttribute(group, "clamp_sampling_rate_Hz", settings.samplingRate);
+            setIntAttribute(group, "clamp_voltage_clamp", settings.isVoltageClamp ? 1 : 0);
+            setIntAttribute(group, "clamp_voltage_clamp_x2", settings.vClampX2mode ? 1 : 0);
+            setIntAttribute(group, "clamp_capacitive_compensation", settings.enableCapacitiveCompensation ? 1 : 0);
+            setAttribute(group, "clamp_capacitive_compensation_pF", settings.capCompensationMagnitude);
+            setAttribute(group, "clamp_filter_cutoff_Hz", settings.filterCutoff);
+            setAttribute(group, "clamp_pipette_offset_mV", settings.pipetteOffset);
+            setAttribute(group, "clamp_Ra", settings.Ra);
+            setAttribute(group, "clamp_Rm", settings.Rm);
+            setAttribute(group, "clamp_Cm", settings.Cm);
+            if (settings.isVoltageClamp) {
+                setAttribute(group, "clamp_holding_voltage_V", settings.voltageClamp.holdingVoltage);
+                setAttribute(group, "clamp_feedback_resistance_nominal_ohms", settings.voltageClamp.nominalResistance);
+                setAttribute(group, "clamp_feedback_resistance_ohms", settings.voltageClamp.resistance);
+                setAttribute(group, "clamp_bandwidth_desired_Hz", settings.voltageClamp.desiredBandwidth);
+                setAttribute(group, "clamp_bandwidth_Hz", settings.voltageClamp.actualBandwidth);
+            }
+            else {
+                setAttribute(group, "clamp_holding_current_A", settings.currentClamp.holdingCurrent);
+                setAttribute(group, "clamp_current_step_A", settings.currentClamp.stepSize);
+            }
+        }
+
+        void NWBFile::File::writeHeadstage(const HeaderData& header) {
+            const Settings& settings = header.settings;
+            const ClampConfig::ChipChannel& channel = header.getChannel();
+            writeRoot(header.timestamp);
+
+            {
+                Handle devices(createGroup(id, "general/devices"), H5Gclose, "create a group");
+                Handle device(createGroup(devices, "CLAMP"), H5Gclose, "create a group");
+                setType(device, "Device");
+                setAttribute(device, "description", "Intan CLAMP system");
+                setAttribute(device, "manufacturer", "Intan Technologies");
+            }
+            {
+                Handle electrodes(createGroup(id, "general/intracellular_ephys"), H5Gclose, "create a group");
+                Handle electrode(createGroup(electrodes, "electrode"), H5Gclose, "create a group");
+                setType(electrode, "IntracellularElectrode");
+                writeString(electrode, "description", "Chip " + std::to_string(channel.chip) + ", channel " + std::to_string(channel.channel));
+                string filtering;
+                if (settings.isVoltageClamp) {
+                    filtering = "On-chip low-pass at " + std::to_string(settings.voltageClamp.actualBandwidth) + " Hz";
+                }
+                if (settings.filterCutoff > 0) {
+                    filtering += (filtering.empty() ? "" : "; ") + string("software low-pass at ") + std::to_string(settings.filterCutoff) + " Hz";
+                }
+                if (!filtering.empty()) {
+                    writeString(electrode, "filtering", filtering);
+                }
+                check(H5Lcreate_soft("/general/devices/CLAMP", electrode, "device", H5P_DEFAULT, H5P_DEFAULT), "link the device");
+            }
+
+            bool vc = settings.isVoltageClamp;
+            const char* measuredUnit = vc ? "amperes" : "volts";
+            const char* clampUnit = vc ? "volts" : "amperes";
+            const char* stimulusType = vc ? "VoltageClampStimulusSeries" : "CurrentClampStimulusSeries";
+            Handle measuredGroup(createSeries("acquisition/measured", vc ? "VoltageClampSeries" : "CurrentClampSeries",
+                                              vc ? "Measured current" : "Measured voltage", H5T_IEEE_F32LE, measuredUnit, 1.0f, -1.0f, measured),
+                                 H5Gclose, "create the measured series");
+            Handle clampGroup(createSeries("stimulus/presentation/clamp", stimulusType, vc ? "Clamp voltage sent to the chip" : "Clamp current sent to the chip",
+                                           H5T_IEEE_F32LE, clampUnit, 1.0f, -1.0f, clamp),
+                              H5Gclose, "create the clamp series");
+            vector<hid_t> series = { measuredGroup, clampGroup };
+            // Without a waveform (e.g., just holding), there's nothing applied to describe
+            std::unique_ptr<Handle> appliedGroup;
+            if (!settings.waveform.waveform.empty()) {
+                appliedGroup.reset(new Handle(createSeries("stimulus/presentation/applied", stimulusType, "Applied waveform",
+                                                           H5T_IEEE_F32LE, clampUnit, 1.0f, -1.0f, applied),
+                                              H5Gclose, "create the applied series"));
+                series.push_back(*appliedGroup);
+            }
+            for (hid_t group : series) {
+                setAttribute(group, "stimulus_description", "CLAMP waveform");
+                check(H5Lcreate_soft("/general/intracellular_ephys/electrode", group, "electrode", H5P_DEFAULT, H5P_DEFAULT), "link the electrode");
+                setIntAttribute(group, "clamp_chip", channel.chip);
+                setIntAttribute(group, "clamp_channel", channel.channel);
+                writeSettings(group, settings);
+            }
+
+            if (vc) {
+                if (settings.enableCapacitiveCompensation) {
+                    writeQuantity(measuredGroup, "capacitance_fast", settings.capCompensationMagnitude * 1e-12, "farads");
+                }
+            }
+            else {
+                writeQuantity(measuredGroup, "bias_current", settings.currentClamp.holdingCurrent, "amperes");
+                if (settings.enableCapacitiveCompensation) {
+                    writeQuantity(measuredGroup, "capacitance_compensation", settings.capCompensationMagnitude * 1e-12, "farads");
+                }
+            }
+        }
+
+        void NWBFile::File::writeAux(const AuxHeaderData& header) {
+            writeRoot(header.timestamp);
+
+            adcs.resize(header.numAdcs);
+            for (int adc = 0; adc < header.numAdcs; adc++) {
+                string name = "adc_" + std::to_string(adc);
+                Handle group(createSeries("acquisition/" + name, "TimeSeries", "ADC " + std::to_string(adc), H5T_STD_U16LE, "volts",
+                                          static_cast<float>(STEPADC), static_cast<float>(STEPADC), adcs[adc]),
+                             H5Gclose, "create an ADC series");
+                writeSettings(group, header.settings);
+            }
+            Handle inGroup(createSeries("acquisition/digital_in", "TimeSeries", "Digital inputs, one bit per line", H5T_STD_U16LE, "n/a", 1.0f, 1.0f, digIns),
+                           H5Gclose, "create the digital input series");
+            Handle outGroup(createSeries("acquisition/digital_out", "TimeSeries", "Digital outputs, one bit per line", H5T_STD_U16LE, "n/a", 1.0f, 1.0f, digOuts),
+                            H5Gclose, "create the digital output series");
+            writeSettings(inGroup, header.settings);
+            writeSettings(outGroup, header.settings);
+        }
+
+        void NWBFile::File::append(const Columns& columns) {
+            CLAMP_TRACE_SPAN("NWBFile::append");
+            lock_guard<mutex> lock(hdf5Mutex());
+            timestamps.append(H5T_NATIVE_DOUBLE, columns.timestamps.data(), columns.timestamps.size());
+            measured.append(H5T_NATIVE_FLOAT, columns.measured.data(), columns.measured.size());
+            clamp.append(H5T_NATIVE_FLOAT, columns.clamp.data(), columns.clamp.size());
+            applied.append(H5T_NATIVE_FLOAT, columns.applied.data(), columns.applied.size());
+            for (std::size_t adc = 0; adc < adcs.size() && adc < columns.adcs.size(); adc++) {
+                adcs[adc].append(H5T_NATIVE_UINT16, columns.adcs[adc].data(), columns.adcs[adc].size());
+            }
+            digIns.append(H5T_NATIVE_UINT16, columns.digIns.data(), columns.digIns.size());
+            digOuts.append(H5T_NATIVE_UINT16, columns.digOuts.data(), columns.digOuts.size());
+        }
+
+        // Closes every dataset and the file; call with hdf5Mutex held
+        void NWBFile::File::close() {
+            Dataset* datasets[] = { &timestamps, &measured, &clamp, &applied, &digIns, &digOuts };
+            for (Dataset* dataset : datasets) {
+                if (dataset->id >= 0) {
+                    H5Dclose(dataset->id);
+                    dataset->id = -1;
+                }
+            }
+            for (Dataset& adc : adcs) {
+                if (adc.id >= 0) {
+                    H5Dclose(adc.id);
+                    adc.id = -1;
+                }
+            }
+            if (id >= 0) {
+                H5Fclose(id);
+                id = -1;
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// True if this build can write NWB files
+        bool NWBFile::isAvailable() {
+            return true;
+        }
+
+        /// Constructor
+        NWBFile::NWBFile() :
+            async(false),
+            samplingRate(1.0)
+        {
+        }
+
+        NWBFile::~NWBFile() {
+            try {
+                close();
+            }
+            catch (...) {
+                // Nowhere to report it
+            }
+        }
+
+        /** \brief Creates the file, replacing any file of the same name.
+         *
+         *  \param[in] path   Path of the file
+         *  \param[in] async  True to append the data on SaveWriterThread rather than on the thread calling writeData()
+         */
+        void NWBFile::open(const FILENAME& path, bool async_) {
+            close();
+            string name = narrowFileName(path);
+            shared_ptr<File> created(new File());
+            {
+                lock_guard<mutex> lock(hdf5Mutex());
+                H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr); // Errors are thrown, not printed
+                created->id = H5Fcreate(name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+            }
+            if (created->id < 0) {
+                throw runtime_error("Couldn't create NWB file " + name);
+            }
+            file = created;
+            async = async_;
+            pending.reset(new Columns());
+        }
+
+        /** \brief Writes what's left and closes the file.
+         *
+         *  In asynchronous mode, waits for the writer thread to append everything queued; an error it ran into is
+         *  thrown from here, if not from an earlier writeData().
+         */
+        void NWBFile::close() {
+            if (!file) {
+                return;
+            }
+            std::exception_ptr failure;
+            try {
+                flush();
+            }
+            catch (...) {
+                failure = std::current_exception();
+            }
+            if (async) {
+                SaveWriterThread::instance().drain(this);
+                if (!failure) {
+                    failure = error;
+                }
+                error = nullptr;
+            }
+            {
+                lock_guard<mutex> lock(hdf5Mutex());
+                file->close();
+            }
+            file.reset();
+            pending.reset();
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+
+        /** \brief Writes the file's metadata and creates the headstage series.  Call once, after open().
+         *
+         *  \param[in] header  Header data; its settings decide whether the series are voltage or current clamp ones
+         */
+        void NWBFile::writeHeader(const HeaderData& header) {
+            samplingRate = header.settings.samplingRate;
+            waveform = header.settings.waveform;
+            lock_guard<mutex> lock(hdf5Mutex());
+            file->writeHeadstage(header);
+        }
+
+        /** \brief Writes the file's metadata and creates the ADC and digital I/O series.  Call once, after open().
+         *
+         *  \param[in] auxHeader  Header data
+         */
+        void NWBFile::writeHeaderAux(const AuxHeaderData& auxHeader) {
+            samplingRate = auxHeader.settings.samplingRate;
+            pending->adcs.resize(auxHeader.numAdcs);
+            lock_guard<mutex> lock(hdf5Mutex());
+            file->writeAux(auxHeader);
+        }
+
+        /** \brief Adds headstage samples; see SaveFile::writeData().
+         *
+         *  The samples are appended to the file once a chunk's worth has been collected, or on close().
+         */
+        void NWBFile::writeData(const vector<uint32_t>& timestamps, const vector<Sample>& measuredData, const vector<Sample>& clampValues, unsigned int first) {
+            if (timestamps.size() != measuredData.size() || timestamps.size() != clampValues.size()) {
+                throw invalid_argument("Size mismatch");
+            }
+            if (first >= timestamps.size()) {
+                return;
+            }
+
+            waveform.getAppliedRuns(timestamps, first, static_cast<unsigned int>(timestamps.size()), appliedRuns);
+            Columns& columns = *pending;
+            for (std::size_t i = first; i < timestamps.size(); i++) {
+                columns.timestamps.push_back(timestamps[i] / samplingRate);
+                columns.measured.push_back(static_cast<float>(measuredData[i]));
+                columns.clamp.push_back(static_cast<float>(clampValues[i]));
+            }
+            if (appliedRuns.empty()) {
+                // No waveform
+                columns.applied.insert(columns.applied.end(), timestamps.size() - first, 0.0f);
+            }
+            for (const CLAMP::AppliedRun& run : appliedRuns) {
+                columns.applied.insert(columns.applied.end(), run.end - run.first, static_cast<float>(run.value));
+            }
+            if (columns.timestamps.size() >= CHUNK_SAMPLES) {
+                flush();
+            }
+        }
+
+        /// Adds ADC and digital I/O samples; see SaveFile::writeDataAux().
+        void NWBFile::writeDataAux(const vector<uint32_t>& timestamps, const vector<vector<uint16_t>>& adcs, int numAdcs, const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts, unsigned int first) {
+            if (first >= timestamps.size()) {
+                return;
+            }
+
+            Columns& columns = *pending;
+            for (std::size_t i = first; i < timestamps.size(); i++) {
+                columns.timestamps.push_back(timestamps[i] / samplingRate);
+            }
+            for (int adc = 0; adc < numAdcs && adc < static_cast<int>(columns.adcs.size()); adc++) {
+                columns.adcs[adc].insert(columns.adcs[adc].end(), adcs[adc].begin() + first, adcs[adc].end());
+            }
+            columns.digIns.insert(columns.digIns.end(), digIns.begin() + first, digIns.end());
+            columns.digOuts.insert(columns.digOuts.end(), digOuts.begin() + first, digOuts.end());
+            if (columns.timestamps.size() >= CHUNK_SAMPLES) {
+                flush();
+            }
+        }
+
+        // Appends the collected samples, here or on the writer thread
+        void NWBFile::flush() {
+            if (!pending || pending->timestamps.empty()) {
+                return;
+            }
+            shared_ptr<Columns> columns = pending;
+            pending.reset(new Columns());
+            pending->adcs.resize(columns->adcs.size());
+
+            shared_ptr<File> target = file;
+            if (async) {
+                SaveWriterThread::instance().enqueueTask(this, [target, columns]() { target->append(*columns); }, columns->bytes(), &error);
+            }
+            else {
+                target->append(*columns);
+            }
+        }
+
+#else
+        //------------------------------------------------------------------------------------------------------
+        // Built without HDF5: there's nothing to write with
+        /// \cond private
+        struct NWBFile::File {
+        };
+        /// \endcond
+
+        bool NWBFile::isAvailable() {
+            return false;
+        }
+
+        NWBFile::NWBFile() :
+            async(false),
+            samplingRate(1.0)
+        {
+        }
+
+        NWBFile::~NWBFile() {
+        }
+
+        void NWBFile::open(const FILENAME&, bool) {
+            throw runtime_error("This build can't write NWB files; rebuild with CONFIG += clamp_hdf5");
+        }
+
+        void NWBFile::close() {
+        }
+
+        void NWBFile::writeHeader(const HeaderData&) {
+        }
+
+        void NWBFile::writeHeaderAux(const AuxHeaderData&) {
+        }
+
+        void NWBFile::writeData(const vector<uint32_t>&, const vector<Sample>&, const vector<Sample>&, unsigned int) {
+        }
+
+        void NWBFile::writeDataAux(const vector<uint32_t>&, const vector<vector<uint16_t>>&, int, const vector<uint16_t>&, const vector<uint16_t>&, unsigned int) {
+        }
+
+        void NWBFile::flush() {
+        }
+#endif
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "SaveFile.h"
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /** \brief A save file in the Neurodata Without Borders format (NWB 2), which is an HDF5 file.
+         *
+         *  Has the same calls as SaveFile, which uses it for SaveFile::NWB_RECORDS; a headstage file and an aux file
+         *  are separate NWB files, as with .clp files.
+         *
+         *  A headstage file has one electrode (general/intracellular_ephys/electrode) and three series:
+         *  \code
+              acquisition/measured            VoltageClampSeries (A) or CurrentClampSeries (V)
+              stimulus/presentation/clamp     VoltageClampStimulusSeries (V) or CurrentClampStimulusSeries (A): the clamp values sent
+              stimulus/presentation/applied   Same type: the applied waveform, as SaveFile::FLOAT_RECORDS stores it (if there is one)
+         *  \endcode
+         *  An aux file has TimeSeries acquisition/adc_0 .. adc_<n-1> (raw codes; conversion gives volts),
+         *  acquisition/digital_in and acquisition/digital_out.  All series in a file share one timestamps dataset,
+         *  in seconds, so gaps in the recording are kept.  The Settings from the header are stored in the standard
+         *  fields where NWB has them, and all of them as clamp_* attributes on each series.
+         *
+         *  Every series is a chunked, extendable dataset.  Samples are collected in memory, and each full chunk is
+         *  appended to the datasets in one go: on the calling thread, or in asynchronous mode on SaveWriterThread,
+         *  where it counts against the writer's memory budget like any other save file data.
+         *
+         *  The HDF5 library can only be used from one thread at a time; all NWBFile objects share a lock around it.
+         *
+         *  Only built with HDF5 when CLAMP_HDF5 is defined (CONFIG += clamp_hdf5); otherwise isAvailable() is false,
+         *  and open() throws.
+         */
+        class NWBFile {
+        public:
+            /// Samples per HDF5 chunk, and per append
+            static const unsigned int CHUNK_SAMPLES = 16384;
+
+            static bool isAvailable();
+
+            NWBFile();
+            ~NWBFile();
+            void open(const FILENAME& path, bool async = false);
+            void close();
+            void writeHeader(const HeaderData& header);
+            void writeHeaderAux(const AuxHeaderData& auxHeader);
+            void writeData(const std::vector<uint32_t>& timestamps, const std::vector<Sample>& measuredData, const std::vector<Sample>& clampValues, unsigned int first = 0);
+            void writeDataAux(const std::vector<uint32_t>& timestamps, const std::vector<std::vector<uint16_t>>& adcs, int numAdcs, const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts, unsigned int first = 0);
+
+        private:
+            /// \cond private
+            struct File; // The HDF5 objects; see NWBFile.cpp
+
+            // Samples not yet appended to the file
+            struct Columns {
+                std::vector<double> timestamps;
+                std::vector<float> measured;
+                std::vector<float> clamp;
+                std::vector<float> applied;
+                std::vector<std::vector<uint16_t>> adcs;
+                std::vector<uint16_t> digIns;
+                std::vector<uint16_t> digOuts;
+
+                uint64_t bytes() const;
+            };
+            /// \endcond
+
+            std::shared_ptr<File> file;
+            bool async;
+            double samplingRate;
+            CLAMP::SimplifiedWaveform waveform;
+            std::shared_ptr<Columns> pending;
+            std::vector<CLAMP::AppliedRun> appliedRuns; // writeData's, reused from call to call
+            std::exception_ptr error; // From the writer thread; guarded by SaveWriterThread's queue mutex
+
+            void flush();
+
+            // Not copyable
+            NWBFile(const NWBFile&);
+            NWBFile& operator=(const NWBFile&);
+        };
+    }
+}
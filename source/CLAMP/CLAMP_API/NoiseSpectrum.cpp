@@ -0,0 +1,302 @@
+#include "NoiseSpectrum.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::complex;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Constructor
+         *
+         *  \param[in] segmentLength_  Samples per segment (the FFT length); a power of 2, at least 4
+         *  \param[in] sampleRate_     Sampling rate of the stream, in Hz
+         *  \param[in] averages_       Segments averaged
+         */
+        WelchSpectrum::WelchSpectrum(std::size_t segmentLength_, double sampleRate_, unsigned int averages_) :
+            segmentLength(segmentLength_),
+            sampleRate(sampleRate_),
+            averages(averages_)
+        {
+            if (segmentLength < 4 || (segmentLength & (segmentLength - 1)) != 0) {
+                throw invalid_argument("Spectrum segment length must be a power of 2");
+            }
+            if (sampleRate <= 0 || averages == 0) {
+                throw invalid_argument("Spectrum needs a positive sampling rate and at least one average");
+            }
+
+            // Periodic Hann window, which makes the half-overlapped windows sum to a constant
+            window.resize(segmentLength);
+            double windowPower = 0;
+            for (std::size_t i = 0; i < segmentLength; i++) {
+                window[i] = 0.5 - 0.5 * cos(2 * PI * i / segmentLength);
+                windowPower += window[i] * window[i];
+            }
+            scale = 2.0 / (sampleRate * windowPower);
+
+            segment.resize(segmentLength);
+            work.resize(segmentLength);
+            reset();
+        }
+
+        /** \brief Adds samples to the stream.
+         *
+         *  \param[in] values  Samples
+         *  \param[in] n       Number of samples
+         *  \returns Segments completed (and averaged into the spectrum) by these samples
+         */
+        unsigned int WelchSpectrum::push(const double* values, std::size_t n) {
+            unsigned int completed = 0;
+            while (n > 0) {
+                std::size_t count = std::min(n, segmentLength - filled);
+                std::copy(values, values + count, segment.begin() + filled);
+                filled += count;
+                values += count;
+                n -= count;
+                if (filled == segmentLength) {
+                    addSegment();
+                    completed++;
+                    // The second half starts the next segment
+                    std::copy(segment.begin() + segmentLength / 2, segment.end(), segment.begin());
+                    filled = segmentLength / 2;
+                }
+            }
+            return completed;
+        }
+
+        /// Discards the partly filled segment, e.g., after a gap in the stream; the spectrum so far is kept
+        void WelchSpectrum::restartSegment() {
+            filled = 0;
+        }
+
+        /// Discards the partly filled segment and the spectrum
+        void WelchSpectrum::reset() {
+            filled = 0;
+            segments = 0;
+            psd.clear();
+        }
+
+        // Windows the full segment, transforms it, and averages its periodogram into psd
+        void WelchSpectrum::addSegment() {
+            // The segment's mean would leak into the lowest bins through the window's side lobes
+            double mean = 0;
+            for (double x : segment) {
+                mean += x;
+            }
+            mean /= segmentLength;
+            for (std::size_t i = 0; i < segmentLength; i++) {
+                work[i] = complex<double>((segment[i] - mean) * window[i], 0.0);
+            }
+            fft(work);
+
+            std::size_t bins = segmentLength / 2 + 1;
+            if (psd.empty()) {
+                psd.assign(bins, 0.0);
+            }
+            segments++;
+            double weight = 1.0 / std::min<uint64_t>(segments, averages);
+            for (std::size_t k = 0; k < bins; k++) {
+                double density = std::norm(work[k]) * scale;
+                if (k == 0 || k == bins - 1) {
+                    density /= 2; // DC and Nyquist have no negative-frequency twin
+                }
+                psd[k] += weight * (density - psd[k]);
+            }
+        }
+    }
+
+    //--------------------------------------------------------------------------------------------------------------------------------
+    /** \brief Constructor.
+     *
+     *  \param[in] board_  Board whose channel to watch
+     */
+    NoiseSpectrum::NoiseSpectrum(Board& board_) :
+        board(board_),
+        quantity(Board::MEASURED_CURRENT),
+        running(false),
+        callbackId(0),
+        phase(0),
+        havePrevious(false),
+        lastTimestamp(0),
+        gap(false),
+        droppedBlocks(0),
+        paused(false),
+        worker(*this),
+        publishedSegments(0)
+    {
+        pending.length = 0;
+        pending.restart = false;
+    }
+
+    NoiseSpectrum::~NoiseSpectrum() {
+        stop();
+    }
+
+    /** \brief Starts computing the spectrum of a channel, from the board's next read on.
+     *
+     *  The channel must be enabled on the board (see Board::enableChannels()).  Forgets any previous spectrum.
+     *
+     *  \param[in] channel_   Channel to watch
+     *  \param[in] quantity_  Which of its values (normally MEASURED_CURRENT in voltage clamp, MEASURED_VOLTAGE in current clamp)
+     *  \param[in] settings_  How to compute the spectrum
+     */
+    void NoiseSpectrum::start(const ChipChannel& channel_, Board::SampleQuantity quantity_, const Settings& settings_) {
+        stop();
+        if (settings_.decimation == 0) {
+            throw invalid_argument("Spectrum decimation factor must be positive");
+        }
+        // Checks the other settings, before anything is subscribed
+        SignalProcessing::WelchSpectrum check(settings_.segmentLength, board.getSamplingRateHz() / settings_.decimation, settings_.averages);
+
+        channel = channel_;
+        quantity = quantity_;
+        settings = settings_;
+        if (settings.decimation > 1) {
+            // Cut off a little below the decimated Nyquist frequency, so the top of the spectrum isn't aliased
+            double ts = 1.0 / board.getSamplingRateHz();
+            double fc = 0.4 * board.getSamplingRateHz() / settings.decimation;
+            filter.reset(new SignalProcessing::DecimatingLowPassFilter(settings.decimation, fc, ts));
+        }
+        else {
+            filter.reset();
+        }
+        phase = 0;
+        havePrevious = false;
+        gap = false;
+        pending.length = 0;
+        pending.restart = false;
+        droppedBlocks = 0;
+        {
+            lock_guard<mutex> lock(spectrumMutex);
+            frequencies.clear();
+            publishedPSD.clear();
+            publishedSegments = 0;
+        }
+
+        worker.setScheduling(Thread::LOW_PRIORITY);
+        worker.start();
+        callbackId = board.addSampleCallback(channel, quantity, [this](const SampleSpan& span) {
+            onSamples(span);
+        });
+        running = true;
+    }
+
+    /// Unsubscribes from the board and stops the worker thread; the last spectrum stays available from getSpectrum().
+    void NoiseSpectrum::stop() {
+        if (!running) {
+            return;
+        }
+        board.removeSampleCallback(callbackId);
+        worker.close();
+        // Both ends of the queue are stopped, so this thread may empty it
+        Block discard;
+        while (queue.pop(discard)) {
+        }
+        running = false;
+    }
+
+    /** \brief Copies out the latest spectrum.  May be called from any thread.
+     *
+     *  \param[out] frequencies_  Frequency of each bin, in Hz, from 0 to the decimated Nyquist frequency
+     *  \param[out] psd           Power spectral density at each frequency, in units of the quantity squared per Hz (e.g., A²/Hz)
+     *  \param[out] segments      If not null, the number of segments averaged into it so far
+     *  \returns False if no segment has been completed yet since start(); the outputs are then empty
+     */
+    bool NoiseSpectrum::getSpectrum(vector<double>& frequencies_, vector<double>& psd, uint64_t* segments) const {
+        lock_guard<mutex> lock(spectrumMutex);
+        frequencies_ = frequencies;
+        psd = publishedPSD;
+        if (segments) {
+            *segments = publishedSegments;
+        }
+        return !psd.empty();
+    }
+
+    // Called on the reading thread: decimates one chunk into blocks for the worker.  Never blocks.
+    void NoiseSpectrum::onSamples(const SampleSpan& span) {
+        if (paused) {
+            // The skipped samples show up as a gap in the timestamps once resumed
+            return;
+        }
+        const Sample* v = span.samples;
+        const uint32_t* t = span.timestamps;
+        for (std::size_t i = 0; i < span.length; i++) {
+            if (havePrevious && t[i] - lastTimestamp != 1) {
+                // Start over, rather than splice the two sides of the gap together
+                gap = true;
+                pending.length = 0;
+                phase = 0;
+                if (filter) {
+                    filter->reset();
+                }
+            }
+            havePrevious = true;
+            lastTimestamp = t[i];
+
+            double value = v[i];
+            if (filter) {
+                filter->push(value);
+                if (++phase < settings.decimation) {
+                    continue;
+                }
+                phase = 0;
+                value = filter->output();
+            }
+            if (std::isnan(value)) {
+                continue;
+            }
+
+            if (pending.length == 0) {
+                pending.restart = gap;
+                gap = false;
+            }
+            pending.values[pending.length++] = value;
+            if (pending.length == BLOCK_SAMPLES) {
+                if (!queue.push(pending)) {
+                    droppedBlocks++;
+                    gap = true; // The worker mustn't splice across the missing block either
+                }
+                pending.length = 0;
+            }
+        }
+    }
+
+    // Turns queued blocks into spectra until stopped
+    void NoiseSpectrum::Worker::run() {
+        const Settings& settings = owner.settings;
+        double rate = owner.board.getSamplingRateHz() / settings.decimation;
+        SignalProcessing::WelchSpectrum welch(settings.segmentLength, rate, settings.averages);
+
+        vector<double> bins(settings.segmentLength / 2 + 1);
+        for (std::size_t k = 0; k < bins.size(); k++) {
+            bins[k] = welch.frequency(k);
+        }
+
+        Block block;
+        while (keepGoing) {
+            bool updated = false;
+            while (keepGoing && owner.queue.pop(block)) {
+                if (block.restart) {
+                    welch.restartSegment();
+                }
+                if (welch.push(block.values, block.length) > 0) {
+                    updated = true;
+                }
+            }
+            if (updated) {
+                lock_guard<mutex> lock(owner.spectrumMutex);
+                owner.frequencies = bins;
+                owner.publishedPSD = welch.getPSD();
+                owner.publishedSegments = welch.getSegments();
+            }
+            // The reading thread doesn't wake us (that would take a lock), so poll; this is short next to a segment
+            keepGoing.waitFor(std::chrono::milliseconds(10));
+        }
+    }
+}
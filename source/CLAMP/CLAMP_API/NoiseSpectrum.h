@@ -0,0 +1,166 @@
+#pragma once
+
+#include "Board.h"
+#include "BesselFilter.h"
+#include "DataAnalysis.h"
+#include "SPSCQueue.h"
+#include "Thread.h"
+#include <atomic>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /** \brief Welch power spectral density estimate of a stream, updated as samples arrive.
+         *
+         *  The stream is cut into segments of segmentLength samples that overlap by half.  Each segment is Hann windowed
+         *  and transformed, and its periodogram is averaged into the spectrum: a plain mean over the first \a averages
+         *  segments, then an exponential average with the same weight, so the spectrum follows changes in the noise
+         *  with a time constant of about averages / 2 segment lengths.
+         *
+         *  The spectrum is one-sided, in units² per Hz, so summing it over the bins times the bin width gives the
+         *  variance of the (windowed) signal.
+         */
+        class WelchSpectrum {
+        public:
+            WelchSpectrum(std::size_t segmentLength_, double sampleRate_, unsigned int averages_);
+
+            unsigned int push(const double* values, std::size_t n);
+            void restartSegment();
+            void reset();
+
+            /// The averaged spectrum, for bins 0 (DC) to segmentLength / 2 (Nyquist); empty until a segment is complete
+            const std::vector<double>& getPSD() const { return psd; }
+            /// Frequency of a bin of getPSD(), in Hz
+            double frequency(std::size_t bin) const { return bin * sampleRate / segmentLength; }
+            /// Segments averaged into the spectrum since reset()
+            uint64_t getSegments() const { return segments; }
+
+        private:
+            std::size_t segmentLength;
+            double sampleRate;
+            unsigned int averages;
+            std::vector<double> window;
+            double scale;                             // Turns |X|^2 into a one-sided density
+            std::vector<double> segment;              // Samples of the segment being filled
+            std::size_t filled;
+            std::vector<std::complex<double>> work;
+            std::vector<double> psd;
+            uint64_t segments;
+
+            void addSegment();
+        };
+    }
+
+    /** \brief Background noise spectrum of one channel's measured current or voltage.
+     *
+     *  Subscribes to the channel's samples with Board::addSampleCallback(), so it sees exactly what the acquisition
+     *  reads, without adding to or waiting for the main plots.  On the reading thread, each chunk is only low-pass
+     *  filtered and decimated (see SignalProcessing::DecimatingLowPassFilter) into fixed-size blocks, which are handed
+     *  to a low-priority worker thread through a lock-free queue.  If the worker falls behind, whole blocks are dropped
+     *  (see getDroppedBlocks()) rather than holding up the read.
+     *
+     *  The worker runs the blocks through a SignalProcessing::WelchSpectrum and publishes the spectrum whenever a
+     *  segment completes; getSpectrum() copies out the latest one from any thread, e.g., a GUI timer a few times a
+     *  second.  A gap in the timestamps (the board was stopped and started again) starts a new segment, so no segment
+     *  straddles it.
+     \code
+        NoiseSpectrum spectrum(board);
+        spectrum.start(ChipChannel(0, 0), Board::MEASURED_CURRENT);
+        // ... board.read() as usual ...
+        std::vector<double> frequencies, psd;
+        if (spectrum.getSpectrum(frequencies, psd)) {
+            // ... psd[i] is the noise density at frequencies[i], in A²/Hz ...
+        }
+     \endcode
+     */
+    class NoiseSpectrum {
+    public:
+        /// How the spectrum is computed
+        struct Settings {
+            unsigned int decimation;   ///< Decimation factor; the spectrum extends to sampling rate / (2 * decimation)
+            std::size_t segmentLength; ///< FFT length, in decimated samples; a power of 2
+            unsigned int averages;     ///< Segments averaged (see SignalProcessing::WelchSpectrum)
+
+            Settings() : decimation(4), segmentLength(2048), averages(16) {}
+        };
+
+        explicit NoiseSpectrum(Board& board_);
+        ~NoiseSpectrum();
+
+        void start(const ClampConfig::ChipChannel& channel_, Board::SampleQuantity quantity_, const Settings& settings_ = Settings());
+        void stop();
+        /// True between start() and stop()
+        bool isRunning() const { return running; }
+
+        bool getSpectrum(std::vector<double>& frequencies, std::vector<double>& psd, uint64_t* segments = nullptr) const;
+        /// Blocks of decimated samples dropped because the worker thread fell behind, since start()
+        uint64_t getDroppedBlocks() const { return droppedBlocks; }
+        /** \brief Skips the samples read while paused, without unsubscribing; the spectrum so far stays available.  May be
+         *  called from any thread.
+         *
+         *  Once resumed, a new segment starts, as after any gap in the data.
+         */
+        void setPaused(bool pause) { paused = pause; }
+
+    private:
+        /// \cond private
+        // Decimated samples per block handed to the worker
+        static const std::size_t BLOCK_SAMPLES = 256;
+        // Blocks the queue holds; at the default settings, over a second of data
+        static const std::size_t QUEUE_BLOCKS = 64;
+
+        struct Block {
+            double values[BLOCK_SAMPLES];
+            std::size_t length;
+            bool restart; // A gap in the data preceded these samples
+        };
+
+        // Runs the FFTs, at low priority
+        class Worker : public Thread {
+        public:
+            explicit Worker(NoiseSpectrum& owner_) : owner(owner_) {}
+            void run() override;
+
+        private:
+            NoiseSpectrum& owner;
+        };
+        /// \endcond
+
+        Board& board;
+        ClampConfig::ChipChannel channel;
+        Board::SampleQuantity quantity;
+        Settings settings;
+        bool running;
+        unsigned int callbackId;
+
+        // Used on the reading thread only
+        std::unique_ptr<SignalProcessing::DecimatingLowPassFilter> filter;
+        unsigned int phase;          // Input samples since the last one kept
+        bool havePrevious;
+        uint32_t lastTimestamp;
+        bool gap;                    // The next block should restart the segment
+        Block pending;
+
+        SPSCQueue<Block, QUEUE_BLOCKS> queue;
+        std::atomic<uint64_t> droppedBlocks;
+        std::atomic<bool> paused;
+        Worker worker;
+
+        // Latest spectrum, written by the worker
+        mutable std::mutex spectrumMutex;
+        std::vector<double> frequencies;    // Guarded by spectrumMutex
+        std::vector<double> publishedPSD;   // Guarded by spectrumMutex
+        uint64_t publishedSegments;         // Guarded by spectrumMutex
+
+        void onSamples(const SampleSpan& span);
+
+        // Not copyable
+        NoiseSpectrum(const NoiseSpectrum&);
+        NoiseSpectrum& operator=(const NoiseSpectrum&);
+    };
+}
@@ -2,8 +2,13 @@
 #include "OpalKellyLibraryHandle.h"
 #include "Constants.h"
 #include "common.h"
+#include "Trace.h"
 #include <exception>
 #include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
 
 using std::string;
 using std::endl;
@@ -13,6 +18,7 @@ using std::runtime_error;
 using std::ostringstream;
 using std::invalid_argument;
 using std::lock_guard;
+using std::unique_lock;
 using std::mutex;
 using namespace CLAMP;
 
@@ -35,21 +41,21 @@ void OpalKellyBoard::loadLibrary(okFP_dll_pchar dllPath) {
 	}
 }
 
-vector<string> OpalKellyBoard::getSerialNumbers() {
+vector<string> OpalKellyBoard::getSerialNumbers(okCFrontPanel& panel) {
 	vector<string> results;
 
 	LOG(logOpalKelly) << endl << "Scanning USB for Opal Kelly devices..." << endl << endl;
 
-	int nDevices = frontPanel->GetDeviceCount();
+	int nDevices = panel.GetDeviceCount();
 	LOG(logOpalKelly) << "Found " << nDevices << " Opal Kelly device" << ((nDevices == 1) ? "" : "s") << " connected:" << endl;
 
 	// Log devices, and store devices in list of type XEM6010LX45.
 	for (int i = 0; i < nDevices; ++i) {
-		LOG(logOpalKelly) << "  Device #" << i + 1 << ": Opal Kelly " << opalKellyModelName(frontPanel->GetDeviceListModel(i)).c_str() <<
-			" with serial number " << frontPanel->GetDeviceListSerial(i).c_str() << endl;
+		LOG(logOpalKelly) << "  Device #" << i + 1 << ": Opal Kelly " << opalKellyModelName(panel.GetDeviceListModel(i)).c_str() <<
+			" with serial number " << panel.GetDeviceListSerial(i).c_str() << endl;
 
-		if (frontPanel->GetDeviceListModel(i) == OK_PRODUCT_XEM6010LX45) {
-			results.push_back(frontPanel->GetDeviceListSerial(i));
+		if (panel.GetDeviceListModel(i) == OK_PRODUCT_XEM6010LX45) {
+			results.push_back(panel.GetDeviceListSerial(i));
 		}
 	}
 	LOG(logOpalKelly) << endl;
@@ -57,6 +63,19 @@ vector<string> OpalKellyBoard::getSerialNumbers() {
 	return results;
 }
 
+/** \brief Lists the serial numbers of the XEM6010 - LX45 boards attached to USB ports.
+
+	Doesn't open any of them, or change which board (if any) this object has open.  Pass one of the results to open() to
+	open a particular board, e.g., when using several boards at once (see CLAMP::MultiBoard).
+
+	@return  The serial numbers.
+*/
+vector<string> OpalKellyBoard::listSerialNumbers() {
+	loadLibrary(nullptr);
+	okCFrontPanel panel;
+	return getSerialNumbers(panel);
+}
+
 // Return name of Opal Kelly board based on model code.
 string OpalKellyBoard::opalKellyModelName(int model)
 {
@@ -144,7 +163,7 @@ bool OpalKellyBoard::open(const string& dllPath, const string& bitfilePath, cons
 		serialNumbers.push_back(serialNumber);
 	}
 	else {
-		serialNumbers = getSerialNumbers();
+		serialNumbers = getSerialNumbers(*frontPanel);
 	}
 
 	if (!serialNumbers.empty()) {
@@ -161,7 +180,17 @@ bool OpalKellyBoard::open(const string& dllPath, const string& bitfilePath, cons
 				LOG(logOpalKelly) << "Opal Kelly device serial number: " << frontPanel->GetSerialNumber().c_str() << endl;
 				LOG(logOpalKelly) << "Opal Kelly device ID string: " << frontPanel->GetDeviceID().c_str() << endl << endl;
 
-				uploadFpgaBitfile(bitfilePath == "" ? "main.bit" : bitfilePath);
+				// Reconfiguring takes seconds; if the FPGA still runs this bitfile from last time, it's left as it is
+				string bitfile = (bitfilePath == "") ? "main.bit" : bitfilePath;
+				string signature = bitfileSignature(bitfile);
+				bitfileReused = !forceBitfileUpload && isConfiguredWith(bitfile, serialNumber, signature);
+				if (bitfileReused) {
+					LOG(logOpalKelly) << "FPGA already configured with " << bitfile << "; not uploading it again" << endl;
+				}
+				else {
+					uploadFpgaBitfile(bitfile);
+					rememberConfiguration(bitfile, serialNumber, signature);
+				}
 
 				updateWiresOut();
 				int boardMode = getWireOutWord(WireOut::BoardMode);
@@ -241,10 +270,110 @@ void OpalKellyBoard::uploadFpgaBitfile(const string& filename)
 	}
 }
 
+/* Size and 64-bit FNV-1a hash of the bitfile's contents, e.g., "1484404-9c0d5e...", to tell one build from another;
+ * "" if it can't be read.
+ */
+string OpalKellyBoard::bitfileSignature(const string& filename) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (!in) {
+		return "";
+	}
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t size = 0;
+	char buffer[64 * 1024];
+	while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+		std::streamsize n = in.gcount();
+		for (std::streamsize i = 0; i < n; i++) {
+			hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ULL;
+		}
+		size += static_cast<uint64_t>(n);
+	}
+	ostringstream signature;
+	signature << size << "-" << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return signature.str();
+}
+
+/* Where rememberConfiguration records which boards were configured with a bitfile: next to it, one line per board
+ * ("serial-number signature board-version")
+ */
+string OpalKellyBoard::configurationRecordFile(const string& bitfile) {
+	return bitfile + ".loaded";
+}
+
+/* True if the open board is running the bitfile with this signature.  The FPGA can't report which bitfile it has, so
+ * this goes by its record of the last upload to this board: the FPGA must answer as a CLAMP board (FrontPanel enabled,
+ * board mode and ID), with the board version that was read back then.  A power cycle clears the FPGA, which then fails
+ * these checks; another program's bitfile has a different board ID or version.
+ */
+bool OpalKellyBoard::isConfiguredWith(const string& bitfile, const string& serialNumber, const string& signature) {
+	if (signature.empty() || !frontPanel->IsFrontPanelEnabled()) {
+		return false;
+	}
+	updateWiresOut();
+	if (getWireOutWord(WireOut::BoardMode) != CLAMP_BOARD_MODE || getWireOutWord(WireOut::BoardId) != CLAMP_BOARD_ID) {
+		return false;
+	}
+	int boardVersion = getWireOutWord(WireOut::BoardVersion);
+
+	std::ifstream in(configurationRecordFile(bitfile).c_str());
+	string serial, recordedSignature;
+	int recordedVersion;
+	while (in >> serial >> recordedSignature >> recordedVersion) {
+		if (serial == serialNumber) {
+			return recordedSignature == signature && recordedVersion == boardVersion;
+		}
+	}
+	return false;
+}
+
+// Records that the open board was just configured with the bitfile (see isConfiguredWith).  Failing to is harmless:
+// the bitfile is uploaded again next time.
+void OpalKellyBoard::rememberConfiguration(const string& bitfile, const string& serialNumber, const string& signature) {
+	if (signature.empty()) {
+		return;
+	}
+	updateWiresOut();
+	if (getWireOutWord(WireOut::BoardMode) != CLAMP_BOARD_MODE || getWireOutWord(WireOut::BoardId) != CLAMP_BOARD_ID) {
+		return; // Not a CLAMP board; open() moves on to the next one
+	}
+
+	// The other boards' lines are kept
+	vector<string> lines;
+	{
+		std::ifstream in(configurationRecordFile(bitfile).c_str());
+		string line;
+		while (std::getline(in, line)) {
+			if (!line.empty() && line.compare(0, serialNumber.size() + 1, serialNumber + " ") != 0) {
+				lines.push_back(line);
+			}
+		}
+	}
+	ostringstream line;
+	line << serialNumber << " " << signature << " " << getWireOutWord(WireOut::BoardVersion);
+	lines.push_back(line.str());
+
+	std::ofstream out(configurationRecordFile(bitfile).c_str(), std::ios::trunc);
+	for (const string& l : lines) {
+		out << l << "\n";
+	}
+}
+
+// Largest single pipe-out transfer; about 2 ms of USB 2.0 bandwidth.  Must be a multiple of 8.
+static const long MAX_PIPE_OUT_PIECE = 64 * 1024;
+
+// Takes ioMutex for a control transfer, ahead of any data read that's between pieces
+unique_lock<CLAMP::ProfiledMutex> OpalKellyBoard::lockForControl() {
+	controlWaiting++;
+	unique_lock<CLAMP::ProfiledMutex> lock(ioMutex);
+	controlWaiting--;
+	numControlTransactions++;
+	return lock;
+}
+
 /** \brief Call frontPanel's UpdateWireIns.
 */
 void OpalKellyBoard::updateWiresIn() {
-	lock_guard<mutex> lockio(ioMutex);
+	unique_lock<CLAMP::ProfiledMutex> lockio = lockForControl();
 
 	frontPanel->UpdateWireIns();
 }
@@ -280,14 +409,14 @@ void OpalKellyBoard::setWireInBit(int wirein, unsigned long bit, bool value) {
 	@param[in] bit      Mask of which bit it is
 */
 void OpalKellyBoard::activateTriggerIn(int epAddr, int bit) {
-	lock_guard<mutex> lockio(ioMutex);
+	unique_lock<CLAMP::ProfiledMutex> lockio = lockForControl();
 	checkError(frontPanel->ActivateTriggerIn(epAddr, bit));
 }
 
 /** \brief Call frontPanel's UpdateWireOuts.
 */
 void OpalKellyBoard::updateWiresOut() {
-	lock_guard<mutex> lockio(ioMutex);
+	unique_lock<CLAMP::ProfiledMutex> lockio = lockForControl();
 	frontPanel->UpdateWireOuts();
 }
 
@@ -328,22 +457,39 @@ uint32_t OpalKellyBoard::getWireOutDWord(int wireoutMSB, int wireoutLSB) {
 
 	Throws an exception on error.
 
+	Large reads are done as several transfers of at most MAX_PIPE_OUT_PIECE bytes.  Between them, any control transfers
+	(wire updates, triggers, pipe-in writes) waiting on other threads go first, so e.g. FIFO polling or register writes
+	from another thread aren't held up for the whole read.
+
 	@param[in] epAddr   PipeOut address
 	@param[in] length   Number of bytes to read
 	@param[in] data     Buffer to put the data into
 	@returns The number of bytes read (may be different than length if not enough data was available).
 */
 long OpalKellyBoard::readFromPipeOut(int epAddr, long length, unsigned char *data) {
+	CLAMP_TRACE_SPAN("OpalKellyBoard::readFromPipeOut");
 	if (length % 8 != 0) {
 		throw invalid_argument("Read length must be divisible by 8.");
 	}
 
-	lock_guard<mutex> lockio(ioMutex);
-	long ret = frontPanel->ReadFromPipeOut(epAddr, length, data);
-	if (ret < 0) {
-		checkError(static_cast<okCFrontPanel::ErrorCode>(ret));
+	long total = 0;
+	while (total < length) {
+		long piece = std::min(length - total, MAX_PIPE_OUT_PIECE);
+		while (controlWaiting > 0) {
+			std::this_thread::yield();
+		}
+
+		lock_guard<CLAMP::ProfiledMutex> lockio(ioMutex);
+		long ret = frontPanel->ReadFromPipeOut(epAddr, piece, data + total);
+		if (ret < 0) {
+			checkError(static_cast<okCFrontPanel::ErrorCode>(ret));
+		}
+		total += ret;
+		if (ret < piece) {
+			break; // Not enough data available
+		}
 	}
-	return ret;
+	return total;
 }
 
 /** \brief Call frontPanel's WriteToPipeIn.
@@ -356,7 +502,7 @@ long OpalKellyBoard::readFromPipeOut(int epAddr, long length, unsigned char *dat
 	@returns The number of bytes written.
 */
 long OpalKellyBoard::writeToPipeIn(int epAddr, long length, unsigned char *data) {
-	lock_guard<mutex> lockio(ioMutex);
+	unique_lock<CLAMP::ProfiledMutex> lockio = lockForControl();
 	long ret = frontPanel->WriteToPipeIn(epAddr, length, data);
 	if (ret < 0) {
 		checkError(static_cast<okCFrontPanel::ErrorCode>(ret));
@@ -371,3 +517,14 @@ long OpalKellyBoard::writeToPipeIn(int epAddr, long length, unsigned char *data)
 bool OpalKellyBoard::isOpen() const {
 	return frontPanel.get() != nullptr;
 }
+
+/** \brief Number of control transfers (wire updates, triggers, and pipe-in writes) made so far.
+	*
+	*  Pipe-out reads (i.e., data coming back from the board) aren't counted.  Useful for checking how much USB
+	*  traffic a piece of configuration code causes: compare the values before and after.
+	*
+	*  @return  The count, since this object was created.
+	*/
+uint64_t OpalKellyBoard::getNumControlTransactions() const {
+	return numControlTransactions;
+}
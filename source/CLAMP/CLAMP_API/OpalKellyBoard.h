@@ -5,6 +5,8 @@
 #include "OpalKellyLibraryHandle.h"
 #include <cstdint>
 #include <mutex>
+#include <atomic>
+#include "LockProfiler.h"
 
 /** \brief This class provides access to and control of the Opal Kelly XEM6010 USB/FPGA interface board running the Clamp interface Verilog code.
 	*
@@ -18,12 +20,16 @@
 */
 class OpalKellyBoard {
 public:
-	OpalKellyBoard() {}
+	OpalKellyBoard() : ioMutex("OpalKellyBoard::ioMutex"), numControlTransactions(0), controlWaiting(0), forceBitfileUpload(false), bitfileReused(false) {}
 	virtual ~OpalKellyBoard();
 
 	virtual void loadLibrary(okFP_dll_pchar dllPath);
 	virtual bool open(const std::string& dllPath = "", const std::string& bitfilePath = "", const std::string& requestedSerialNumber = "");
 	virtual void uploadFpgaBitfile(const std::string& filename);
+	// open() skips the upload if the FPGA already runs the same bitfile (see isConfiguredWith); this uploads it anyway
+	void setForceBitfileUpload(bool force) { forceBitfileUpload = force; }
+	// Whether the last open() found the bitfile already loaded
+	bool wasBitfileReused() const { return bitfileReused; }
 
 	// Wires In
 	virtual void updateWiresIn();
@@ -47,15 +53,35 @@ public:
 
 	virtual bool isOpen() const;
 
+	std::vector<std::string> listSerialNumbers();
+
+	uint64_t getNumControlTransactions() const;
+
 private:
 	// Functions in this class are designed to be thread-safe.  This variable is used to ensure that.
-	std::mutex ioMutex;
+	CLAMP::ProfiledMutex ioMutex;
+
+	// Wire, trigger and pipe-in transfers so far (i.e., everything but pipe-out data reads)
+	std::atomic<uint64_t> numControlTransactions;
+
+	// Control transfers waiting for ioMutex.  Large pipe-out reads are split into pieces, and give way to these
+	// between pieces, so control latency is bounded by one piece rather than a whole read.
+	std::atomic<int> controlWaiting;
+	std::unique_lock<CLAMP::ProfiledMutex> lockForControl();
 
 	std::unique_ptr<OpalKellyLibraryHandle> library;
 	std::unique_ptr<okCFrontPanel> frontPanel;
 
-	std::vector<std::string> getSerialNumbers();
+	bool forceBitfileUpload;
+	bool bitfileReused;
+
+	std::vector<std::string> getSerialNumbers(okCFrontPanel& panel);
 	double getSystemClockFreq() const;
+	bool isConfiguredWith(const std::string& bitfile, const std::string& serialNumber, const std::string& signature);
+	void rememberConfiguration(const std::string& bitfile, const std::string& serialNumber, const std::string& signature);
+
+	static std::string bitfileSignature(const std::string& filename);
+	static std::string configurationRecordFile(const std::string& bitfile);
 
 	static std::string opalKellyModelName(int model);
 	static void checkError(okCFrontPanel::ErrorCode code);
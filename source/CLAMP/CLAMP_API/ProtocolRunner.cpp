@@ -0,0 +1,139 @@
+#include "ProtocolRunner.h"
+#include "Board.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::invalid_argument;
+
+namespace CLAMP {
+    /** \brief Constructor.
+     *
+     *  \param[in] board_        Board to run the protocol on
+     *  \param[in] channelList_  Channels that all run the protocol
+     */
+    ProtocolRunner::ProtocolRunner(Board& board_, const ChipChannelList& channelList_) :
+        board(board_),
+        channelList(channelList_),
+        totalTimesteps(0)
+    {
+    }
+
+    /** \brief Joins the sweeps into one command list and sends it to the board.
+     *
+     *  Replaces the channels' command lists.  Throws an exception if the sweeps don't fit in Waveform RAM.
+     *
+     *  \param[in] sweeps          Waveforms to run, in order.  Each sweep's interval, if longer than the sweep, is the
+     *                             time from its start to the start of the next sweep (or of the next repetition).
+     *  \param[in] isVoltageClamp  True for voltage clamp, false for current clamp
+     */
+    void ProtocolRunner::load(const vector<SimplifiedWaveform>& sweeps, bool isVoltageClamp) {
+        if (sweeps.empty() || channelList.empty()) {
+            throw invalid_argument("A protocol needs at least one sweep and one channel");
+        }
+        double samplingRate = board.getSamplingRateHz();
+        program.erase();
+        sweepStarts.clear();
+        sweepLengths.clear();
+
+        uint64_t start = 0;
+        for (const SimplifiedWaveform& sweep : sweeps) {
+            if (sweep.size() == 0) {
+                throw invalid_argument("Empty sweep in protocol");
+            }
+            sweepStarts.push_back(static_cast<unsigned int>(start));
+            unsigned int length = 0;
+            for (const WaveformSegment& segment : sweep.waveform) {
+                // push_back renumbers startIndex and endIndex from the end of the program
+                WaveformSegment copy(segment);
+                copy.startIndex = 0;
+                copy.endIndex = segment.numReps() - 1;
+                program.push_back(copy);
+                length += segment.numReps();
+            }
+            sweepLengths.push_back(length);
+
+            uint64_t slot = std::max<uint64_t>(length, static_cast<uint64_t>(std::llround(sweep.interval * samplingRate)));
+            if (slot > length) {
+                const WaveformSegment& holding = sweep.waveform.front();
+                WaveformSegment pad(holding.waveformNumber, holding.appliedDiscreteValue, static_cast<unsigned int>(slot - length), holding.tOffset, false, false);
+                pad.appliedValue = holding.appliedValue;
+                program.push_back(pad);
+            }
+            start += slot;
+        }
+        if (start >= std::numeric_limits<uint32_t>::max()) {
+            throw invalid_argument("Protocol is too long");
+        }
+        totalTimesteps = static_cast<unsigned int>(start);
+
+        for (auto& index : channelList) {
+            board.controller.getChannel(index).commands.clear();
+        }
+        board.enableChannels(channelList, true);
+        board.controller.simplifiedWaveformToWaveform(channelList, isVoltageClamp, program);
+        board.commandsToFPGA();
+    }
+
+    /** \brief Runs the loaded protocol, and calls callback once per sweep, as soon as the sweep's data has been read.
+     *
+     *  Blocks until the protocol is done or stop() is called.  The callback runs on this thread, so it can use
+     *  Board::readQueue directly (see ProtocolSweep); the read queue is cleared after each sweep.  Meanwhile the board
+     *  keeps running, so the callback needn't be fast, as long as it keeps up on average.
+     *
+     *  \param[in] callback     Called with each sweep
+     *  \param[in] repetitions  Number of times to run the whole protocol
+     */
+    void ProtocolRunner::run(const SweepCallback& callback, unsigned int repetitions) {
+        if (totalTimesteps == 0) {
+            throw invalid_argument("No protocol loaded");
+        }
+        if (static_cast<uint64_t>(totalTimesteps) * repetitions >= std::numeric_limits<uint32_t>::max()) {
+            throw invalid_argument("Too many repetitions");
+        }
+        keepGoing.reset();
+        board.readQueue.clear(true);
+        // One extra timestep, since the last command's result comes back a timestep late (see Board::runOneCycle)
+        board.runFixed(totalTimesteps * repetitions + 1);
+        try {
+            bool first = true;
+            for (unsigned int repetition = 0; repetition < repetitions && keepGoing; repetition++) {
+                for (std::size_t i = 0; i < sweepLengths.size() && keepGoing; i++) {
+                    ProtocolSweep sweep;
+                    sweep.index = i;
+                    sweep.repetition = repetition;
+                    sweep.numTimesteps = sweepLengths[i];
+                    sweep.numRead = ((i + 1 < sweepStarts.size()) ? sweepStarts[i + 1] : totalTimesteps) - sweepStarts[i];
+
+                    // The read queue keeps back the latest packet, so the first read needs one more
+                    unsigned int packetsToRead = sweep.numRead + (first ? 1 : 0);
+                    first = false;
+                    while (keepGoing && packetsToRead > 0) {
+                        packetsToRead -= board.read(packetsToRead, &keepGoing);
+                    }
+                    if (keepGoing) {
+                        callback(sweep);
+                    }
+                    board.readQueue.clear(false);
+                }
+            }
+        }
+        catch (...) {
+            board.stop();
+            board.flush();
+            board.readQueue.clear(true);
+            throw;
+        }
+        board.stop();
+        board.flush();
+        board.readQueue.clear(true);
+    }
+
+    /// Makes run() return, without waiting for the current read to finish; may be called from any thread.
+    void ProtocolRunner::stop() {
+        keepGoing.requestStop();
+    }
+}
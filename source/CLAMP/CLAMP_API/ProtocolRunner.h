@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ClampController.h"
+#include "SimplifiedWaveform.h"
+#include "StopToken.h"
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace CLAMP {
+    class Board;
+
+    /** \brief One sweep of a protocol run by ProtocolRunner, passed to its SweepCallback.
+     *
+     *  While the callback runs, Board::readQueue holds exactly this sweep's data: numTimesteps timesteps of the sweep's
+     *  waveform, followed by the holding timesteps until the next sweep starts (numRead in all).
+     */
+    struct ProtocolSweep {
+        std::size_t index;         ///< Which of the protocol's sweeps this is
+        unsigned int repetition;   ///< Which repetition of the whole protocol
+        unsigned int numTimesteps; ///< Timesteps of the sweep's waveform
+        unsigned int numRead;      ///< Timesteps in the read queue
+
+        ProtocolSweep() : index(0), repetition(0), numTimesteps(0), numRead(0) {}
+    };
+
+    /** \brief Runs a list of waveforms (an I-V family, a pharmacology time course, ...) back to back, timed by the board.
+     *
+     *  load() joins the sweeps into a single command list, with each sweep's interval (SimplifiedWaveform::interval,
+     *  from the start of one sweep to the start of the next) filled by holding at the sweep's first value, and uploads it
+     *  to Waveform RAM once.  run() then runs the whole list as one fixed-length run, so the inter-sweep timing is exact
+     *  and nothing is rebuilt or re-sent between sweeps; it reads the data a sweep at a time and passes each sweep to a
+     *  callback.
+     *
+     *  Typical use:
+     \code
+        ProtocolRunner protocol(board, channelList);
+        protocol.load(sweeps, true);
+        protocol.run([&](const ProtocolSweep& sweep) {
+            // ... board.readQueue.getMeasuredCurrents(...) ...
+        });
+     \endcode
+     */
+    class ProtocolRunner {
+    public:
+        typedef std::function<void(const ProtocolSweep&)> SweepCallback;
+
+        ProtocolRunner(Board& board_, const ClampConfig::ChipChannelList& channelList_);
+
+        void load(const std::vector<SimplifiedWaveform>& sweeps, bool isVoltageClamp);
+        void run(const SweepCallback& callback, unsigned int repetitions = 1);
+        void stop();
+
+        /// Number of sweeps loaded
+        std::size_t numSweeps() const { return sweepLengths.size(); }
+        /// Timestep at which sweep *index* starts, counting from the start of the protocol
+        unsigned int sweepStart(std::size_t index) const { return sweepStarts[index]; }
+        /// Timesteps of one repetition of the protocol, intervals included
+        unsigned int numTimesteps() const { return totalTimesteps; }
+        /// The joined waveform that was loaded, e.g., for a save file header
+        const SimplifiedWaveform& getProgram() const { return program; }
+
+    private:
+        Board& board;
+        ClampConfig::ChipChannelList channelList;
+        SimplifiedWaveform program;
+        std::vector<unsigned int> sweepStarts;
+        std::vector<unsigned int> sweepLengths;
+        unsigned int totalTimesteps;
+        StopToken keepGoing;
+    };
+}
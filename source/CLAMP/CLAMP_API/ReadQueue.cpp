@@ -4,7 +4,11 @@
 #include "ChipProtocol.h"
 #include "common.h"
 #include "Board.h"
+#include "Trace.h"
+#include <algorithm>
 
+using std::lock_guard;
+using std::mutex;
 using std::unique_ptr;
 using std::vector;
 using std::wstring;
@@ -13,119 +17,323 @@ using namespace CLAMP::ClampConfig;
 using namespace CLAMP::SignalProcessing;
 
 namespace CLAMP {
+    // Bytes of heap storage held by v (its capacity, not just what's in use)
+    template <class T>
+    static std::size_t vectorBytes(const vector<T>& v) {
+        return v.capacity() * sizeof(T);
+    }
+
     /// \cond private
     void ChannelIndexData::clear() {
         mosi.erase(mosi.begin(), mosi.end());
         miso.erase(miso.begin(), miso.end());
     }
 
+    void ChannelIndexData::reserve(std::size_t n) {
+        mosi.reserve(n);
+        miso.reserve(n);
+    }
+
+    std::size_t ChannelIndexData::memoryBytes() const {
+        return vectorBytes(mosi) + vectorBytes(miso);
+    }
+
+    //-----------------------------------------------------------------------------------------------------
+    SampleCommand::SampleCommand(MOSICommand command) {
+        Kind kind = (command.M == MuxSelection::Temperature) ? OTHER : ((command.M % 2) == 1) ? VOLTAGE : CURRENT;
+        bits = static_cast<uint16_t>((kind << 9) | command.D);
+    }
+
+    //-----------------------------------------------------------------------------------------------------
+    bool ChannelScaling::operator==(const ChannelScaling& other) const {
+        return muxStep == other.muxStep &&
+               feedbackResistance == other.feedbackResistance &&
+               voltageClampStep == other.voltageClampStep &&
+               currentStep == other.currentStep &&
+               correction == other.correction;
+    }
+
     //-----------------------------------------------------------------------------------------------------
     ChannelData::ChannelData() :
-		// TO FIX: Does not work correctly for 100 kS/s!  Filters at 12500 Hz instead of 25000 Hz in this case.
-        muxFilter(new NthOrderBesselLowPassFilter(4, 25000, 1.0 / 200000)),
-        voltageFilter(new NthOrderBesselLowPassFilter(4, 25000, 1.0 / 200000)), /* TEMP */
-        currentFilter(new NthOrderBesselLowPassFilter(4, 25000, 1.0 / 200000))
+        filterSamplingRate(0)
     {
         clear(false); 
     }
 
+    /** \brief Sets up the downsampling filter for the current board configuration.
+     *
+     *  Does nothing if the filter is already set up for this configuration.
+     *
+     *  \param[in] samplingRate       Board sampling rate (i.e., per timestamp), in Hz
+     *  \param[in] channelRepetition  Number of samples of this channel per timestamp (see Board::channelRepetition)
+     *  \param[in] decimation         Timestamps per sample kept (see Board::setOutputDecimation)
+     */
+    void ChannelData::configureFilters(double samplingRate, unsigned int channelRepetition, unsigned int decimation) {
+        unsigned int factor = channelRepetition * decimation;
+        if (factor <= 1) {
+            index = 0; // Every sample is kept, even if this channel was downsampled before
+            return;
+        }
+        double outputRate = samplingRate / decimation;
+        if (muxFilter && muxFilter->getFactor() == factor && filterSamplingRate == outputRate) {
+            return;
+        }
+
+        // Cut off at the Nyquist frequency of the downsampled data
+        double fc = outputRate / 2;
+        double ts = 1.0 / (samplingRate * channelRepetition);
+        muxFilter.reset(new DecimatingLowPassFilter(factor, fc, ts));
+        filterSamplingRate = outputRate;
+        index = 0;
+    }
+
     void ChannelData::clear(bool filtersToo) {
         index = 0;
         raw.erase(raw.begin(), raw.end());
+        timestamps.erase(timestamps.begin(), timestamps.end());
+        commands.erase(commands.begin(), commands.end());
+        filteredMux.erase(filteredMux.begin(), filteredMux.end());
+        scalings.erase(scalings.begin(), scalings.end());
+
         mux.erase(mux.begin(), mux.end());
         voltages.erase(voltages.begin(), voltages.end());
         currents.erase(currents.begin(), currents.end());
 		clampVoltages.erase(clampVoltages.begin(), clampVoltages.end());
 		clampCurrents.erase(clampCurrents.begin(), clampCurrents.end());
 
-        if (filtersToo) {
+        if (filtersToo && muxFilter) {
             muxFilter->reset();
-            voltageFilter->reset();
-            currentFilter->reset();
         }
     }
 
-    void ChannelData::push1(int32_t value, double muxVoltage, double voltage, double current, double clampVoltage, double clampCurrent, unsigned int channelRepetition) {
-        if (channelRepetition == 1) {
-            raw.push_back(value);
-            mux.push_back(muxVoltage);
-            voltages.push_back(voltage);
-            currents.push_back(current);
-			clampVoltages.push_back(clampVoltage);
-			clampCurrents.push_back(clampCurrent);
+    std::size_t ChannelData::memoryBytes() const {
+        return vectorBytes(raw) + vectorBytes(timestamps) + vectorBytes(commands) + vectorBytes(filteredMux) + vectorBytes(scalings) +
+               vectorBytes(mux) + vectorBytes(voltages) + vectorBytes(currents) + vectorBytes(clampVoltages) + vectorBytes(clampCurrents);
+    }
+
+    template <class Visit>
+    void ChannelData::forEachBuffer(Visit visit) const {
+        visit(raw.capacity());
+        visit(timestamps.capacity());
+        visit(commands.capacity());
+        visit(filteredMux.capacity());
+        visit(scalings.capacity());
+        visit(mux.capacity());
+        visit(voltages.capacity());
+        visit(currents.capacity());
+        visit(clampVoltages.capacity());
+        visit(clampCurrents.capacity());
+    }
+
+    // Room for n timesteps of samples (downsampled by channelRepetition), including the cached conversions
+    void ChannelData::reserve(std::size_t n, unsigned int channelRepetition, unsigned int decimation) {
+        n = (n + decimation - 1) / decimation;
+        raw.reserve(n);
+        commands.reserve(n);
+        if (decimation > 1) {
+            timestamps.reserve(n);
         }
-        else {
-			// TEMP - eliminate 25 kHz Bessel filters
-            double filteredMuxVoltage = muxFilter->filterOne(muxVoltage);
-            double filteredVoltage = voltageFilter->filterOne(voltage);
-            double filteredCurrent = currentFilter->filterOne(current);
-			//double filteredMuxVoltage = muxVoltage;
-			//double filteredVoltage = voltage;
-			//double filteredCurrent = current;
-
-			// Downsample by a factor of channelRepetition
-            if (index == 0) {
-                raw.push_back(value);
-                mux.push_back(filteredMuxVoltage);
-                voltages.push_back(filteredVoltage);
-                currents.push_back(filteredCurrent);
-				clampVoltages.push_back(clampVoltage);
-				clampCurrents.push_back(clampCurrent);
+        if (channelRepetition * decimation > 1) {
+            filteredMux.reserve(n);
+        }
+
+        mux.reserve(n);
+        voltages.reserve(n);
+        currents.reserve(n);
+        clampVoltages.reserve(n);
+        clampCurrents.reserve(n);
+    }
+
+    /* factor is the channel repetition times the output decimation; decimated says whether the latter is more than 1, in
+     * which case the timestamps of the samples kept are stored too.
+     */
+    void ChannelData::push1(int32_t value, MOSICommand command, double muxVoltage, const ChannelScaling& scaling, unsigned int factor, bool decimated, uint32_t timestamp) {
+        if (factor > 1) {
+            muxFilter->push(muxVoltage);
+        }
+
+		// Downsample by factor; the filter is only evaluated for the samples we keep
+        if (index == 0) {
+            if (scalings.empty() || !(scalings.back().second == scaling)) {
+                scalings.push_back(std::make_pair(raw.size(), scaling));
+            }
+            raw.push_back(value);
+            commands.push_back(SampleCommand(command));
+            if (decimated) {
+                timestamps.push_back(timestamp);
+            }
+            if (factor > 1) {
+                filteredMux.push_back(static_cast<Sample>(muxFilter->output()));
             }
+        }
+        if (factor > 1) {
             index++;
-            if (index == channelRepetition) {
+            if (index == factor) {
                 index = 0;
             }
         }
     }
 
-    void ChannelData::pushChannelData(ClampController& controller, ChipChannel chipChannel, const USBPerChannel& usbchannel, unsigned int channelRepetition) {
-        Channel& channel = controller.getChannel(chipChannel);
-        Mux& mux = controller.mux;
-        if (channel.getEnable()) {
-            double rF = channel.getFeedbackResistance();
+    /* Same conversion as Mux::getValue, with the residuals taken from plan.  The ADC value itself was already extracted
+     * for the board's ADC width when the packets were decoded (see USBPacketLayout::slotDecoder).
+     */
+    void ChannelData::pushChannelData(const ConversionPlan& plan, const USBPerChannel& usbchannel, uint32_t timestamp) {
+        if (!plan.enabled) {
+            return;
+        }
 
-            int32_t value = INVALID_MUX_VALUE;
-            double muxVoltage = std::numeric_limits<double>::quiet_NaN();
-            double voltage = std::numeric_limits<double>::quiet_NaN();
-            double current = std::numeric_limits<double>::quiet_NaN();
-			double clampVoltage = std::numeric_limits<double>::quiet_NaN();
-			double clampCurrent = std::numeric_limits<double>::quiet_NaN();
+        int32_t value = usbchannel.convertAdcValue;
+        if (usbchannel.MOSI.M != MuxSelection::Temperature) {
+            bool isVoltage = (usbchannel.MOSI.M % 2) == 1;
+            value -= isVoltage ? plan.voltageAmpResidual : plan.differenceAmpResidual;
+        }
 
-            if (usbchannel.MOSI.M == MuxSelection::Temperature) {
-                value = mux.getValue(chipChannel, usbchannel.convertValue, 0);
-                muxVoltage = mux.toVoltage(chipChannel, value);
-            }
-            else {
-                bool isVoltage = (usbchannel.MOSI.M % 2) == 1;
-
-                if (isVoltage) {
-                    value = mux.getValue(chipChannel, usbchannel.convertValue, channel.voltageAmpResidual);
-                    muxVoltage = mux.toVoltage(chipChannel, value);
-                    voltage = muxVoltage / 8.0;
-					clampCurrent = ((usbchannel.MOSI.D & 128) ? 1.0 : -1.0) * (usbchannel.MOSI.D & 127) * channel.recallCurrentStep();
-                } else {
-                    value = mux.getValue(chipChannel, usbchannel.convertValue, channel.differenceAmpResidual);
-                    muxVoltage = mux.toVoltage(chipChannel, value);
-                    current = muxVoltage / 10.0 / rF;
-					clampVoltage = ((usbchannel.MOSI.D & 256) ? 1.0 : -1.0) * (usbchannel.MOSI.D & 255) * channel.getVoltageClampStep();
-                }
+        // The unfiltered mux voltage is only needed if we're filtering; otherwise it's calculated from value when needed
+        unsigned int factor = plan.channelRepetition * plan.decimation;
+        double muxVoltage = (factor > 1) ? value * plan.scaling.muxStep : 0.0;
+        push1(value, usbchannel.MOSI, muxVoltage, plan.scaling, factor, plan.decimation > 1, timestamp);
+    }
+
+    /* Converts samples [cache.size(), raw.size()) and appends them to cache.  f(i, muxVoltage, scaling) returns the
+     * quantity for sample i.
+     */
+    template <typename Convert>
+    const vector<Sample>& ChannelData::convert(vector<Sample>& cache, Convert f) {
+        if (cache.size() < raw.size()) {
+            cache.reserve(raw.size());
+            convertRange(cache.size(), raw.size(), cache, f);
+        }
+        return cache;
+    }
+
+    /* Appends samples [first, first + n) to out: copied from cache if they've been converted already, otherwise
+     * converted straight into out, so that each sample is only written once.
+     */
+    template <typename Convert>
+    void ChannelData::appendConverted(const vector<Sample>& cache, vector<Sample>& out, std::size_t first, std::size_t n, Convert f) const {
+        if (first + n <= cache.size()) {
+            out.insert(out.end(), cache.begin() + first, cache.begin() + first + n);
+        }
+        else {
+            convertRange(first, first + n, out, f);
+        }
+    }
+
+    // Converts samples [i, end) and appends them to out
+    template <typename Convert>
+    void ChannelData::convertRange(std::size_t i, std::size_t end, vector<Sample>& out, Convert f) const {
+        // Find the scaling in effect for the first sample to convert
+        std::size_t segment = 0;
+        while (segment + 1 < scalings.size() && scalings[segment + 1].first <= i) {
+            segment++;
+        }
+
+        bool filtered = !filteredMux.empty();
+        for (; segment < scalings.size() && i < end; segment++) {
+            std::size_t segmentEnd = (segment + 1 < scalings.size()) ? std::min(end, scalings[segment + 1].first) : end;
+            const ChannelScaling& scaling = scalings[segment].second;
+            for (; i < segmentEnd; i++) {
+                double muxVoltage = filtered ? filteredMux[i] : raw[i] * scaling.muxStep;
+                out.push_back(static_cast<Sample>(f(commands[i], muxVoltage, scaling)));
             }
-            push1(value, muxVoltage, voltage, current, clampVoltage, clampCurrent, channelRepetition);
         }
     }
+
+    static double toMux(SampleCommand, double muxVoltage, const ChannelScaling&) {
+        return muxVoltage;
+    }
+
+    static double toVoltage(SampleCommand command, double muxVoltage, const ChannelScaling& scaling) {
+        bool isVoltage = command.kind() == SampleCommand::VOLTAGE;
+        return isVoltage ? scaling.correction.voltageGain * (muxVoltage / 8.0) + scaling.correction.voltageOffset : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    static double toCurrent(SampleCommand command, double muxVoltage, const ChannelScaling& scaling) {
+        bool isCurrent = command.kind() == SampleCommand::CURRENT;
+        return isCurrent ? scaling.correction.currentGain * (muxVoltage / 10.0 / scaling.feedbackResistance) + scaling.correction.currentOffset :
+                           std::numeric_limits<double>::quiet_NaN();
+    }
+
+    static double toClampVoltage(SampleCommand command, double, const ChannelScaling& scaling) {
+        bool isCurrent = command.kind() == SampleCommand::CURRENT;
+        unsigned int D = command.data();
+        return isCurrent ? ((D & 256) ? 1.0 : -1.0) * (D & 255) * scaling.voltageClampStep : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    static double toClampCurrent(SampleCommand command, double, const ChannelScaling& scaling) {
+        bool isVoltage = command.kind() == SampleCommand::VOLTAGE;
+        unsigned int D = command.data();
+        return isVoltage ? ((D & 128) ? 1.0 : -1.0) * (D & 127) * scaling.currentStep : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    const vector<Sample>& ChannelData::getMux() {
+        return convert(mux, toMux);
+    }
+
+    const vector<Sample>& ChannelData::getVoltages() {
+        return convert(voltages, toVoltage);
+    }
+
+    const vector<Sample>& ChannelData::getCurrents() {
+        return convert(currents, toCurrent);
+    }
+
+    const vector<Sample>& ChannelData::getClampVoltages() {
+        return convert(clampVoltages, toClampVoltage);
+    }
+
+    const vector<Sample>& ChannelData::getClampCurrents() {
+        return convert(clampCurrents, toClampCurrent);
+    }
+
+    void ChannelData::appendVoltages(vector<Sample>& out, std::size_t first, std::size_t n) const {
+        appendConverted(voltages, out, first, n, toVoltage);
+    }
+
+    void ChannelData::appendCurrents(vector<Sample>& out, std::size_t first, std::size_t n) const {
+        appendConverted(currents, out, first, n, toCurrent);
+    }
+
+    void ChannelData::appendClampVoltages(vector<Sample>& out, std::size_t first, std::size_t n) const {
+        appendConverted(clampVoltages, out, first, n, toClampVoltage);
+    }
+
+    void ChannelData::appendClampCurrents(vector<Sample>& out, std::size_t first, std::size_t n) const {
+        appendConverted(clampCurrents, out, first, n, toClampCurrent);
+    }
     /// \endcond
 
+    //-----------------------------------------------------------------------------------------------------
+    /// Constructor
+    TimestampGaps::TimestampGaps() :
+        numGaps(0),
+        samplesMissing(0),
+        worstGap(0)
+    {
+    }
+
     //-----------------------------------------------------------------------------------------------------
     /// Constructor
     ReadQueue::ReadQueue(std::vector<ChannelNumber>& channels_, ClampController& controller_) :
         controller(controller_),
-        channels(channels_)
+        channels(channels_),
+        packetSlots(new USBPacket[2]),
+        nextSlot(0),
+        onDeck(nullptr),
+        retainCommands(false),
+        haveLastTimestamp(false),
+        lastTimestamp(0),
+        allocations(1) // The packet slots
     {
         adcs.reserve(8);
         for (unsigned int adc = 0; adc < 8; adc++) {
             adcs.push_back(vector<uint16_t>());
         }
+
+        std::size_t numBuffers = 0;
+        forEachBuffer([&](std::size_t) { numBuffers++; });
+        capacities.resize(numBuffers);
+        recordCapacities();
     }
 
     ReadQueue::~ReadQueue() {
@@ -135,24 +343,162 @@ namespace CLAMP {
      *
      *  Called by Board::read; you probably wouldn't need to call it directly.
      *
+     *  The whole buffer is first decoded column-wise using the Board's precomputed packet layout; packets are
+     *  then assembled into two preallocated slots that alternate between "being parsed" and "on deck"
+     *  (see ReadQueue::pushLast), so this does no per-packet heap allocation.
+     *
      *  \param[in] usbBuffer   Raw USB data
      *  \param[in] numPackets  The number of packets to parse
      */
-    void ReadQueue::parse(unsigned char* usbBuffer, unsigned int numPackets) {
-        unsigned char* p = usbBuffer;
+    void ReadQueue::parse(const unsigned char* usbBuffer, unsigned int numPackets) {
+        CLAMP_TRACE_SPAN("ReadQueue::parse");
+        recordCapacities();
+        updateConversionPlans();
+        const USBPacketLayout& layout = controller.getBoard().getPacketLayout();
+        layout.decode(usbBuffer, numPackets, columns);
+
         for (unsigned int i = 0; i < numPackets; i++) {
-            unique_ptr<USBPacket> packet(new USBPacket());
-            p = packet->read(p, controller.getBoard(), channels);
+            USBPacket* packet = &packetSlots[nextSlot];
+            nextSlot = 1 - nextSlot;
+            packet->reset();
+            packet->fromColumns(columns, i, layout);
             push(packet);
         }
+        countAllocations();
     }
 
-    void ReadQueue::push(unique_ptr<USBPacket>& packet) {
+    /** \brief Bytes of storage held by the queue's buffers.
+     *
+     *  Counts the capacity of every buffer (per-channel data and cached conversions, the decoded columns, timestamps,
+     *  digital I/O, and ADCs), since clear() keeps it for the next run.  Like the rest of the queue, only call this from
+     *  the thread that reads the board; Board::getMemoryUsage() is safe to call from anywhere.
+     *
+     *  \returns Bytes allocated
+     */
+    std::size_t ReadQueue::memoryBytes() const {
+        std::size_t total = 2 * sizeof(USBPacket);
+        total += vectorBytes(columns.timestamps) + vectorBytes(columns.mosi) + vectorBytes(columns.miso) + vectorBytes(columns.adcValues) +
+                 vectorBytes(columns.adcs) + vectorBytes(columns.digIns) + vectorBytes(columns.digOuts);
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                total += rawDataIndexed[chip][channel].memoryBytes() + rawData[chip][channel].memoryBytes();
+            }
+        }
+        for (auto& adc : adcs) {
+            total += vectorBytes(adc);
+        }
+        return total + vectorBytes(timestamps) + vectorBytes(digIns) + vectorBytes(digOuts);
+    }
+
+    /** \brief Number of heap allocations made by the queue's buffers since construction.
+     *
+     *  Counts the packet slots, allocated once at construction, plus every time parse(), pushLast() or reserve() had to
+     *  grow one of the buffers counted by memoryBytes().  Once reserve() has made room for a run, this should stop
+     *  increasing, which confirms that the steady-state read path doesn't allocate.  Like memoryBytes(), only call this
+     *  from the thread that reads the board; Board::getMemoryUsage() is safe to call from anywhere.
+     *
+     *  \returns Number of allocations
+     */
+    uint64_t ReadQueue::getAllocationCount() const {
+        return allocations;
+    }
+
+    // The capacity of every buffer counted by memoryBytes(), in a fixed order; see countAllocations()
+    template <class Visit>
+    void ReadQueue::forEachBuffer(Visit visit) const {
+        visit(columns.timestamps.capacity());
+        visit(columns.mosi.capacity());
+        visit(columns.miso.capacity());
+        visit(columns.adcValues.capacity());
+        visit(columns.adcs.capacity());
+        visit(columns.digIns.capacity());
+        visit(columns.digOuts.capacity());
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                visit(rawDataIndexed[chip][channel].mosi.capacity());
+                visit(rawDataIndexed[chip][channel].miso.capacity());
+                rawData[chip][channel].forEachBuffer(visit);
+            }
+        }
+        for (auto& adc : adcs) {
+            visit(adc.capacity());
+        }
+        visit(timestamps.capacity());
+        visit(digIns.capacity());
+        visit(digOuts.capacity());
+    }
+
+    void ReadQueue::recordCapacities() {
+        std::size_t i = 0;
+        forEachBuffer([&](std::size_t capacity) { capacities[i++] = capacity; });
+    }
+
+    /* Counts the buffers that grew since recordCapacities().  The conversions cached by the getters also grow these, so
+     * the capacities are recorded at the start of each operation counted rather than at the end of the previous one.
+     */
+    void ReadQueue::countAllocations() {
+        std::size_t i = 0;
+        forEachBuffer([&](std::size_t capacity) {
+            if (capacity > capacities[i]) {
+                allocations++;
+            }
+            capacities[i++] = capacity;
+        });
+    }
+
+    /** \brief Gaps found in the timestamps of the data read so far.
+     *
+     *  Counts accumulate across runs, until resetTimestampGaps() is called.  Safe to call from any thread.
+     *
+     *  \returns A copy of the counts
+     */
+    TimestampGaps ReadQueue::getTimestampGaps() const {
+        lock_guard<mutex> lock(gapsMutex);
+        return gaps;
+    }
+
+    /// Resets the counts returned by getTimestampGaps().
+    void ReadQueue::resetTimestampGaps() {
+        lock_guard<mutex> lock(gapsMutex);
+        gaps = TimestampGaps();
+    }
+
+    /** \brief Starts checking timestamps afresh, because the board is starting a new run.
+     *
+     *  Called by Board when it starts running; the first packet of the run isn't compared with the last one of the
+     *  previous run.
+     */
+    void ReadQueue::restartTimestamps() {
+        haveLastTimestamp = false;
+    }
+
+    /* Counts a gap if timestamp isn't the one after the previous packet's.  A timestamp that doesn't increase means the
+     * board was restarted (or a packet was left over from the previous run), so it's not counted.
+     */
+    void ReadQueue::checkTimestamp(uint32_t timestamp) {
+        if (haveLastTimestamp && timestamp > lastTimestamp + 1) {
+            uint32_t missing = timestamp - lastTimestamp - 1;
+            {
+                lock_guard<mutex> lock(gapsMutex);
+                gaps.numGaps++;
+                gaps.samplesMissing += missing;
+                if (missing > gaps.worstGap) {
+                    gaps.worstGap = missing;
+                }
+            }
+            LOG(true) << "Timestamp gap: " << missing << " timesteps missing after " << lastTimestamp << "\n";
+        }
+        lastTimestamp = timestamp;
+        haveLastTimestamp = true;
+    }
+
+    void ReadQueue::push(USBPacket* packet) {
+        checkTimestamp(packet->timestamp);
 
         // Populate the converted values; these are pipelined one step behind the MOSI commands
         for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
             USBPerChannel* p2 = nullptr;
-            if (onDeck.get() != nullptr) {
+            if (onDeck != nullptr) {
                 p2 = &onDeck->chip[chip].channel[channels.size() - 1];
             }
 
@@ -171,6 +517,7 @@ namespace CLAMP {
                     if (p2) {
                         p2->nextIsConvert = true;
                         p2->convertValue = miso;
+                        p2->convertAdcValue = usbChannel.adcValue;
                     }
                     break;
                 }
@@ -179,8 +526,8 @@ namespace CLAMP {
         }
 
         // Now push the packet onto the queue
-        pushLast();
-        onDeck = std::move(packet);
+        pushOnDeck();
+        onDeck = packet;
     }
 
     /** \brief Clear data from the read queue.
@@ -212,6 +559,43 @@ namespace CLAMP {
         }
     }
 
+    /** \brief Preallocates room for the given number of timesteps of data.
+     *
+     *  Called by Board when it starts a run, with the most timesteps that can be read between calls to clear().  clear()
+     *  keeps the capacity, so in steady state, reading into the queue doesn't reallocate.  Only the enabled channels
+     *  (and the ADCs being transferred) get storage.
+     *
+     *  \param[in] numTimesteps  Number of timesteps to make room for
+     */
+    void ReadQueue::reserve(unsigned int numTimesteps) {
+        recordCapacities();
+        Board& board = controller.getBoard();
+        timestamps.reserve(numTimesteps);
+        digIns.reserve(numTimesteps);
+        digOuts.reserve(numTimesteps);
+        for (unsigned int adc = 0; adc < 8; adc++) {
+            if (board.adcTransfer[adc]) {
+                adcs[adc].reserve(numTimesteps);
+            }
+        }
+
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            bool anyEnabled = false;
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                if (controller.getChannel(ChipChannel(chip, channel)).getEnable()) {
+                    rawData[chip][channel].reserve(numTimesteps, board.channelRepetition, board.getOutputDecimation(chip));
+                    anyEnabled = true;
+                }
+            }
+            if (anyEnabled && retainCommands) {
+                for (unsigned int channelIndex = 0; channelIndex < channels.size(); channelIndex++) {
+                    rawDataIndexed[chip][channelIndex].reserve(numTimesteps);
+                }
+            }
+        }
+        countAllocations();
+    }
+
     /** \brief Pushes the on-deck member of the read queue into the data set.
      *
      *  Due to the nature of the CLAMP chip, data returns are delayed by one timestep from commands.  So if you send a
@@ -227,7 +611,19 @@ namespace CLAMP {
      *  be missing convert values from the very last command.  This function causes that flush to occur.
      */
     void ReadQueue::pushLast() {
-        if (onDeck.get() != nullptr) {
+        if (onDeck != nullptr) {
+            recordCapacities();
+            updateConversionPlans();
+            pushOnDeck();
+            countAllocations();
+        }
+    }
+
+    /* Pushes the on-deck packet's data, converted with the current plans.  parse() refreshes the plans once, before
+     * its first packet, so this doesn't.
+     */
+    void ReadQueue::pushOnDeck() {
+        if (onDeck != nullptr) {
             timestamps.push_back(onDeck->timestamp);
             for (unsigned int adc = 0; adc < 8; adc++) {
                 if (controller.getBoard().adcTransfer[adc]) {
@@ -242,9 +638,11 @@ namespace CLAMP {
                 for (unsigned int channelIndex = 0; channelIndex < channels.size(); channelIndex++) {
                     ChipChannel chipChannelUSB(chip, channelIndex);
                     const USBPerChannel& usbchannel = onDeck->extractChannel(chipChannelUSB);
-                    ChannelIndexData& cid = getIndexedChannelData(chipChannelUSB);
-                    cid.mosi.push_back(usbchannel.MOSI);
-                    cid.miso.push_back(usbchannel.MISO);
+                    if (retainCommands) {
+                        ChannelIndexData& cid = getIndexedChannelData(chipChannelUSB);
+                        cid.mosi.push_back(usbchannel.MOSI);
+                        cid.miso.push_back(usbchannel.MISO);
+                    }
 
                     unsigned int channelNumber;
                     switch (usbchannel.MOSI.M)
@@ -274,12 +672,41 @@ namespace CLAMP {
                         break;
                     }
 
-                    ChipChannel chipChannel(chip, channelNumber);
-                    ChannelData& cd = getChannelData(chipChannel);
-                    cd.pushChannelData(controller, chipChannel, usbchannel, controller.getBoard().channelRepetition);
+                    ChannelData& cd = rawData[chip][channelNumber];
+                    cd.pushChannelData(plans[chip][channelNumber], usbchannel, onDeck->timestamp);
                 }
             }
-            onDeck.reset();
+            onDeck = nullptr;
+        }
+    }
+
+    /* Takes a snapshot of each channel's conversion settings (enable, residuals, scalings) for the data about
+     * to be pushed, and sets up the downsampling filters.  These can't change in the middle of a USB read, so this is done
+     * once per parse rather than per sample.
+     */
+    void ReadQueue::updateConversionPlans() {
+        Board& board = controller.getBoard();
+        double samplingRate = board.getSamplingRateHz();
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                ChipChannel chipChannel(chip, channel);
+                const Channel& c = controller.getChannel(chipChannel);
+                ConversionPlan& plan = plans[chip][channel];
+                plan.enabled = c.getEnable();
+                if (!plan.enabled) {
+                    continue;
+                }
+                plan.voltageAmpResidual = c.voltageAmpResidual;
+                plan.differenceAmpResidual = c.differenceAmpResidual;
+                plan.channelRepetition = board.channelRepetition;
+                plan.decimation = board.getOutputDecimation(chip);
+                plan.scaling.muxStep = controller.mux.toVoltage(chipChannel, 1);
+                plan.scaling.feedbackResistance = c.getFeedbackResistance();
+                plan.scaling.voltageClampStep = c.getVoltageClampStep();
+                plan.scaling.currentStep = c.recallCurrentStep();
+                plan.scaling.correction = c.measurementCorrection;
+                rawData[chip][channel].configureFilters(samplingRate, plan.channelRepetition, plan.decimation);
+            }
         }
     }
 
@@ -291,9 +718,35 @@ namespace CLAMP {
         return rawDataIndexed[chipChannel.chip][chipChannel.channel];
     }
 
+    /** \brief Keeps (or stops keeping) every MOSI command and MISO return, by channel index, for getMOSI() and getMISO().
+     *
+     *  They're only needed to read back registers (Board::readBackAll()), so by default they're dropped as the data is
+     *  parsed: in acquisition they'd be 8 bytes per channel per timestep that nobody reads.  The measured and clamp values
+     *  don't depend on this setting.  Code that reads back registers turns this on for the run (see CommandRetention).
+     *  Takes effect from the next packet parsed.
+     *
+     *  \param[in] retain  True to keep them
+     */
+    void ReadQueue::setRetainCommands(bool retain) {
+        retainCommands = retain;
+    }
+
+    /// \param[in] queue_  Queue whose MOSI commands and MISO returns are kept while this exists
+    ReadQueue::CommandRetention::CommandRetention(ReadQueue& queue_) :
+        queue(queue_),
+        previous(queue_.retainCommands)
+    {
+        queue.retainCommands = true;
+    }
+
+    ReadQueue::CommandRetention::~CommandRetention() {
+        queue.retainCommands = previous;
+    }
+
     /** \brief Get raw MOSI (i.e., command) data from the read data
      *
-     *  Primarily used internally.  May also be useful for debugging command/return sequences.
+     *  Primarily used internally.  May also be useful for debugging command/return sequences.  Empty unless the
+     *  commands were being retained when the data was read; see setRetainCommands().
      *
      *  \param[in] chipChannel  ChipChannel index
      *  \returns A vector of MOSI commands that have been sent to the chip
@@ -304,7 +757,8 @@ namespace CLAMP {
 
     /** \brief Get raw MISO (i.e., chip return) data from the read data
      *
-     *  Primarily used internally.  May also be useful for debugging command/return sequences.
+     *  Primarily used internally.  May also be useful for debugging command/return sequences.  Empty unless the
+     *  commands were being retained when the data was read; see setRetainCommands().
      *
      *  \param[in] chipChannel  ChipChannel index
      *  \returns A vector of MISO values that have been returned from the chip
@@ -332,8 +786,8 @@ namespace CLAMP {
      *  \param[in] chipChannel  ChipChannel index
      *  \returns A vector of mux voltages that have been returned from the chip
      */
-    const vector<double>& ReadQueue::getMuxData(const ChipChannel& chipChannel) {
-        return rawData[chipChannel.chip][chipChannel.channel].mux;
+    const vector<Sample>& ReadQueue::getMuxData(const ChipChannel& chipChannel) {
+        return rawData[chipChannel.chip][chipChannel.channel].getMux();
     }
 
     /** \brief Get voltages measured at the electrode (current clamp mode)
@@ -341,8 +795,8 @@ namespace CLAMP {
      *  \param[in] chipChannel  ChipChannel index
      *  \returns A vector of measured voltages that have been returned from the chip
      */
-    const vector<double>& ReadQueue::getMeasuredVoltages(const ChipChannel& chipChannel) {
-        return rawData[chipChannel.chip][chipChannel.channel].voltages;
+    const vector<Sample>& ReadQueue::getMeasuredVoltages(const ChipChannel& chipChannel) {
+        return rawData[chipChannel.chip][chipChannel.channel].getVoltages();
     }
 
     /** \brief Get currents measured at the electrode (voltage clamp mode)
@@ -350,8 +804,8 @@ namespace CLAMP {
      *  \param[in] chipChannel  ChipChannel index
      *  \returns A vector of measured currents that have been returned from the chip
      */
-    const vector<double>& ReadQueue::getMeasuredCurrents(const ChipChannel& chipChannel) {
-		return rawData[chipChannel.chip][chipChannel.channel].currents;
+    const vector<Sample>& ReadQueue::getMeasuredCurrents(const ChipChannel& chipChannel) {
+		return rawData[chipChannel.chip][chipChannel.channel].getCurrents();
     }
 
 	/** \brief Get clamp voltages directly from the MOSI command stream (voltage clamp mode)
@@ -359,8 +813,8 @@ namespace CLAMP {
 	*  \param[in] chipChannel  ChipChannel index
 	*  \returns A vector of clamp voltages according to the MOSI command stream
 	*/
-	const vector<double>& ReadQueue::getClampVoltages(const ChipChannel& chipChannel) {
-		return rawData[chipChannel.chip][chipChannel.channel].clampVoltages;
+	const vector<Sample>& ReadQueue::getClampVoltages(const ChipChannel& chipChannel) {
+		return rawData[chipChannel.chip][chipChannel.channel].getClampVoltages();
 	}
 
 	/** \brief Get clamp currents directly from the MOSI command stream (current clamp mode)
@@ -368,16 +822,65 @@ namespace CLAMP {
 	*  \param[in] chipChannel  ChipChannel index
 	*  \returns A vector of clamp currents according to the MOSI command stream
 	*/
-	const vector<double>& ReadQueue::getClampCurrents(const ChipChannel& chipChannel) {
-		return rawData[chipChannel.chip][chipChannel.channel].clampCurrents;
+	const vector<Sample>& ReadQueue::getClampCurrents(const ChipChannel& chipChannel) {
+		return rawData[chipChannel.chip][chipChannel.channel].getClampCurrents();
 	}
 
+    /// Number of samples of one channel's data; the length of the vectors from getMeasuredVoltages(), etc.
+    std::size_t ReadQueue::getNumSamples(const ChipChannel& chipChannel) const {
+        return rawData[chipChannel.chip][chipChannel.channel].raw.size();
+    }
+
+    /** \brief Appends some of the measured voltages to a vector
+     *
+     *  The same values as getMeasuredVoltages(), but converted straight into the caller's storage (unless they've been
+     *  requested already), rather than into this queue's and then copied.  Use to keep the data past clear().
+     *
+     *  \param[in] chipChannel  ChipChannel index
+     *  \param[in,out] out      Vector to append to
+     *  \param[in] first        Index of the first sample to append
+     *  \param[in] n            Number of samples; first + n must be at most getNumSamples()
+     */
+    void ReadQueue::appendMeasuredVoltages(const ChipChannel& chipChannel, vector<Sample>& out, std::size_t first, std::size_t n) const {
+        rawData[chipChannel.chip][chipChannel.channel].appendVoltages(out, first, n);
+    }
+
+    /// As appendMeasuredVoltages(), for getMeasuredCurrents()
+    void ReadQueue::appendMeasuredCurrents(const ChipChannel& chipChannel, vector<Sample>& out, std::size_t first, std::size_t n) const {
+        rawData[chipChannel.chip][chipChannel.channel].appendCurrents(out, first, n);
+    }
+
+    /// As appendMeasuredVoltages(), for getClampVoltages()
+    void ReadQueue::appendClampVoltages(const ChipChannel& chipChannel, vector<Sample>& out, std::size_t first, std::size_t n) const {
+        rawData[chipChannel.chip][chipChannel.channel].appendClampVoltages(out, first, n);
+    }
+
+    /// As appendMeasuredVoltages(), for getClampCurrents()
+    void ReadQueue::appendClampCurrents(const ChipChannel& chipChannel, vector<Sample>& out, std::size_t first, std::size_t n) const {
+        rawData[chipChannel.chip][chipChannel.channel].appendClampCurrents(out, first, n);
+    }
+
 
     /// Get the timestamps from the read data
     const vector<uint32_t>& ReadQueue::getTimeStamps() {
         return timestamps;
     }
 
+    /** \brief Get the timestamps of one channel's samples
+     *
+     *  Those are the timestamps from getTimeStamps(), unless the channel's chip has its output decimated (see
+     *  Board::setOutputDecimation()); then they're the timestamps of the samples kept.
+     *
+     *  \param[in] chipChannel  ChipChannel index
+     *  \returns A vector with one timestamp per sample of the channel's data
+     */
+    const vector<uint32_t>& ReadQueue::getTimeStamps(const ChipChannel& chipChannel) {
+        if (controller.getBoard().getOutputDecimation(chipChannel.chip) > 1) {
+            return rawData[chipChannel.chip][chipChannel.channel].timestamps;
+        }
+        return timestamps;
+    }
+
 	/// Get the digital inputs from the read data
 	const vector<uint16_t>& ReadQueue::getDigIns() {
 		return digIns;
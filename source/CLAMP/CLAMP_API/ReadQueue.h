@@ -5,9 +5,11 @@
 #include "Channel.h"
 #include <queue>
 #include <map>
+#include <mutex>
 #include "ChipProtocol.h"
 #include "Constants.h"
 #include "BesselFilter.h"
+#include "USBPacket.h"
 
 namespace CLAMP {
     /// \cond private
@@ -18,29 +20,121 @@ namespace CLAMP {
         std::vector<ChipProtocol::MISOReturn> miso;
 
         void clear();
+        void reserve(std::size_t n);
+        std::size_t memoryBytes() const;
     };
 
-    struct ChannelData { // Data indexed by channel
+    /* What the conversions need of the MOSI command that produced a sample: what the mux measured, and the clamp value
+     * the command set (its data bits).  Half the size of the MOSICommand it's taken from.
+     */
+    struct SampleCommand {
+        enum Kind { CURRENT = 0, VOLTAGE = 1, OTHER = 2 };
+
+        SampleCommand(ChipProtocol::MOSICommand command);
+        Kind kind() const { return static_cast<Kind>(bits >> 9); }
+        unsigned int data() const { return bits & 0x1FF; }
+
+    private:
+        uint16_t bits; // Data in the low 9 bits, Kind above
+    };
+
+    /* Scale factors (and any measurement correction) for converting a channel's raw values and MOSI commands to physical quantities.  These are captured
+     * when the data is read, since the channel's settings may have changed by the time a quantity is requested.
+     */
+    struct ChannelScaling {
+        double muxStep; // Volts at the mux per raw value
+        double feedbackResistance;
+        double voltageClampStep;
+        double currentStep;
+        MeasurementCorrection correction;
+
+        bool operator==(const ChannelScaling& other) const;
+    };
+
+    /* Snapshot of the channel settings needed to convert one channel's incoming data, taken once per parse (see
+     * ReadQueue::updateConversionPlans) rather than looked up from the Channel and Chip for every sample.
+     */
+    struct ConversionPlan {
+        bool enabled;
+        int32_t voltageAmpResidual;
+        int32_t differenceAmpResidual;
+        unsigned int channelRepetition;
+        unsigned int decimation; // Of the chip's output, on top of channelRepetition (see Board::setOutputDecimation)
+        ChannelScaling scaling;
+    };
+
+    /* Data indexed by channel.
+     *
+     * Only the raw values and what's needed of the MOSI commands (see SampleCommand; plus the filtered mux voltages, when downsampling, and the timestamps of the
+     * samples kept, when decimating the output) are stored as the data comes in.  The quantities returned by ReadQueue (mux voltages, measured voltages and currents, clamp voltages and
+     * currents) are converted when they're first requested and cached; later requests only convert the samples that have
+     * arrived since.
+     */
+    struct ChannelData {
         std::vector<int32_t> raw; // Raw numbers measured at the mux (corrected by any software correction)
-        std::vector<double> mux; // Voltages measured at mux
-        std::vector<double> voltages; // Voltages before voltage amplifier
-        std::vector<double> currents; // Currents across feedback resistor
-		std::vector<double> clampVoltages; // Clamp voltages, directly from MOSI command stream
-		std::vector<double> clampCurrents; // Clamp currents, directly from MOSI command stream
+        std::vector<uint32_t> timestamps; // Timestamp of each value in raw; only kept when decimating the output
 
         ChannelData();
         void clear(bool filtersToo);
-        void pushChannelData(ClampConfig::ClampController& controller, ClampConfig::ChipChannel chipChannel, const USBPerChannel& usbchannel, unsigned int channelRepetition);
-        void push1(int32_t value, double muxVoltage, double voltage, double current, double clampVoltage, double clampCurrent, unsigned int channelRepetition);
+        void reserve(std::size_t n, unsigned int channelRepetition, unsigned int decimation);
+        void pushChannelData(const ConversionPlan& plan, const USBPerChannel& usbchannel, uint32_t timestamp);
+        void push1(int32_t value, ChipProtocol::MOSICommand mosi, double muxVoltage, const ChannelScaling& scaling, unsigned int factor, bool decimated, uint32_t timestamp);
+        void configureFilters(double samplingRate, unsigned int channelRepetition, unsigned int decimation);
+        std::size_t memoryBytes() const;
+        template <class Visit>
+        void forEachBuffer(Visit visit) const; // Calls visit with the capacity of each vector, in a fixed order
+
+        const std::vector<Sample>& getMux(); // Voltages measured at mux
+        const std::vector<Sample>& getVoltages(); // Voltages before voltage amplifier
+        const std::vector<Sample>& getCurrents(); // Currents across feedback resistor
+        const std::vector<Sample>& getClampVoltages(); // Clamp voltages, derived from the MOSI command stream
+        const std::vector<Sample>& getClampCurrents(); // Clamp currents, derived from the MOSI command stream
+
+        // Append samples [first, first + n) of the same quantities to out, without caching them
+        void appendVoltages(std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendCurrents(std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendClampVoltages(std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendClampCurrents(std::vector<Sample>& out, std::size_t first, std::size_t n) const;
 
     private:
+        std::vector<SampleCommand> commands; // Command that produced each value in raw
+        std::vector<Sample> filteredMux; // Filtered mux voltages; only used when downsampling
+        // Scalings in effect, and the index of the first sample each applies to
+        std::vector<std::pair<std::size_t, ChannelScaling>> scalings;
+
+        // Cached conversions
+        std::vector<Sample> mux;
+        std::vector<Sample> voltages;
+        std::vector<Sample> currents;
+        std::vector<Sample> clampVoltages;
+        std::vector<Sample> clampCurrents;
+
+        template <typename Convert>
+        const std::vector<Sample>& convert(std::vector<Sample>& cache, Convert f);
+        template <typename Convert>
+        void appendConverted(const std::vector<Sample>& cache, std::vector<Sample>& out, std::size_t first, std::size_t n, Convert f) const;
+        template <typename Convert>
+        void convertRange(std::size_t i, std::size_t end, std::vector<Sample>& out, Convert f) const;
+
         unsigned int index;
-        std::unique_ptr<SignalProcessing::Filter> muxFilter;
-        std::unique_ptr<SignalProcessing::Filter> voltageFilter;
-        std::unique_ptr<SignalProcessing::Filter> currentFilter;
+        double filterSamplingRate; // Sampling rate the filter was designed for, or 0 if there is none
+        std::unique_ptr<SignalProcessing::DecimatingLowPassFilter> muxFilter;
     };
     /// \endcond
 
+    /** \brief Counts of gaps in the timestamps of the data read from the board.
+     *
+     *  Timestamps of successive packets should differ by one.  A larger difference means packets were lost (e.g., the
+     *  FPGA's FIFO overflowed), and the data around the gap isn't contiguous in time.
+     */
+    struct TimestampGaps {
+        uint64_t numGaps;         ///< Number of places where samples were missing
+        uint64_t samplesMissing;  ///< Total number of missing timesteps
+        uint32_t worstGap;        ///< Most timesteps missing in any one gap
+
+        TimestampGaps();
+    };
+
     class USBPacket;
     /** \brief Main class used in interpreting data returned from the Board.
      *
@@ -55,36 +149,95 @@ namespace CLAMP {
         ReadQueue(std::vector<ChannelNumber>& channels_, ClampConfig::ClampController& controller_);
         ~ReadQueue();
 
-        void parse(unsigned char* usbBuffer, unsigned int numPackets);
+        void parse(const unsigned char* usbBuffer, unsigned int numPackets);
         void clear(bool filtersToo = true);
+        void reserve(unsigned int numTimesteps);
         void pushLast();
 
         const std::vector<uint32_t>& getTimeStamps();
+        const std::vector<uint32_t>& getTimeStamps(const ClampConfig::ChipChannel& chipChannel);
 		const std::vector<uint16_t>& getDigIns();
 		const std::vector<uint16_t>& getDigOuts();
         const std::vector<ChipProtocol::MOSICommand>& getMOSI(const ClampConfig::ChipChannel& chipChannel);
         const std::vector<ChipProtocol::MISOReturn>& getMISO(const ClampConfig::ChipChannel& chipChannel);
         const std::vector<int32_t>& getRawData(const ClampConfig::ChipChannel& chipChannel);
-        const std::vector<double>& getMuxData(const ClampConfig::ChipChannel& chipChannel);
-        const std::vector<double>& getMeasuredVoltages(const ClampConfig::ChipChannel& chipChannel);
-        const std::vector<double>& getMeasuredCurrents(const ClampConfig::ChipChannel& chipChannel);
-		const std::vector<double>& getClampVoltages(const ClampConfig::ChipChannel& chipChannel);
-		const std::vector<double>& getClampCurrents(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getMuxData(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getMeasuredVoltages(const ClampConfig::ChipChannel& chipChannel);
+        const std::vector<Sample>& getMeasuredCurrents(const ClampConfig::ChipChannel& chipChannel);
+		const std::vector<Sample>& getClampVoltages(const ClampConfig::ChipChannel& chipChannel);
+		const std::vector<Sample>& getClampCurrents(const ClampConfig::ChipChannel& chipChannel);
 		const std::vector<std::vector<uint16_t>>& getADCs();
 
+        std::size_t getNumSamples(const ClampConfig::ChipChannel& chipChannel) const;
+        void appendMeasuredVoltages(const ClampConfig::ChipChannel& chipChannel, std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendMeasuredCurrents(const ClampConfig::ChipChannel& chipChannel, std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendClampVoltages(const ClampConfig::ChipChannel& chipChannel, std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+        void appendClampCurrents(const ClampConfig::ChipChannel& chipChannel, std::vector<Sample>& out, std::size_t first, std::size_t n) const;
+
+        void setRetainCommands(bool retain);
+        /// Whether the MOSI commands and MISO returns are being kept; see setRetainCommands()
+        bool getRetainCommands() const { return retainCommands; }
+
+        /** \brief Keeps the MOSI commands and MISO returns from construction to destruction, then puts the setting back.
+         *
+         *  For code that reads back registers (see Board::readBackAll()):
+         \code
+            ReadQueue::CommandRetention retention(board.readQueue);
+            board.runAndReadOneCycle(chip);
+            board.readBackAll();
+         \endcode
+         */
+        class CommandRetention {
+        public:
+            explicit CommandRetention(ReadQueue& queue_);
+            ~CommandRetention();
+
+        private:
+            ReadQueue& queue;
+            bool previous;
+            CommandRetention(const CommandRetention&);
+            CommandRetention& operator=(const CommandRetention&);
+        };
+
+        std::size_t memoryBytes() const;
+        uint64_t getAllocationCount() const;
+
+        TimestampGaps getTimestampGaps() const;
+        void resetTimestampGaps();
+        void restartTimestamps();
+
     private:
         ClampConfig::ClampController& controller;
         std::vector<ChannelNumber>& channels;
-        std::unique_ptr<USBPacket> onDeck;
-        ChannelIndexData rawDataIndexed[MAX_NUM_CHIPS][MAX_NUM_CHANNELS]; // Data stored indexed by channel index
+        // Two preallocated packet slots; one holds the on-deck packet while the other is parsed into.
+        std::unique_ptr<USBPacket[]> packetSlots;
+        unsigned int nextSlot;
+        USBPacket* onDeck;
+        USBColumns columns;
+        ChannelIndexData rawDataIndexed[MAX_NUM_CHIPS][MAX_NUM_CHANNELS]; // Data stored indexed by channel index; only kept with retainCommands
+        bool retainCommands;
         ChannelData rawData[MAX_NUM_CHIPS][MAX_NUM_CHANNELS]; // Data stored indexed by actual channel
+        ConversionPlan plans[MAX_NUM_CHIPS][MAX_NUM_CHANNELS]; // Indexed by actual channel, like rawData
         std::vector<std::vector<uint16_t>> adcs;
         std::vector<uint32_t> timestamps;
 		std::vector<uint16_t> digIns;
 		std::vector<uint16_t> digOuts;
+        mutable std::mutex gapsMutex; // gaps is read from other threads, e.g., for a status display
+        TimestampGaps gaps;
+        bool haveLastTimestamp;
+        uint32_t lastTimestamp;
+        uint64_t allocations; // See getAllocationCount()
+        std::vector<std::size_t> capacities; // Of each buffer, in forEachBuffer's order, as of recordCapacities()
 
         ChannelData& getChannelData(const ClampConfig::ChipChannel& chipChannel);
         ChannelIndexData& getIndexedChannelData(const ClampConfig::ChipChannel& chipChannel);
-        void push(std::unique_ptr<USBPacket>& packet);
+        void push(USBPacket* packet);
+        void pushOnDeck();
+        void checkTimestamp(uint32_t timestamp);
+        void updateConversionPlans();
+        template <class Visit>
+        void forEachBuffer(Visit visit) const;
+        void recordCapacities();
+        void countAllocations();
     };
 }
@@ -0,0 +1,149 @@
+#include "ResidentSequence.h"
+#include "Board.h"
+#include "Channel.h"
+#include "Chip.h"
+#include "Waveform.h"
+#include <algorithm>
+#include <stdexcept>
+
+using std::vector;
+using std::runtime_error;
+using namespace CLAMP::ChipProtocol;
+using namespace CLAMP::WaveformControl;
+
+namespace CLAMP {
+    namespace ClampConfig {
+        static void getRegisters(Channel& channel, uint16_t (&values)[14]) {
+            for (uint8_t i = 0; i < 14; i++) {
+                values[i] = channel.registers.get(i).value.value;
+            }
+        }
+
+        static void setRegisters(Channel& channel, const uint16_t (&values)[14]) {
+            for (uint8_t i = 0; i < 14; i++) {
+                channel.registers.get(i).value.value = values[i];
+            }
+        }
+
+        /** \brief Constructor.  Nothing is built until run().
+         *
+         *  \param[in] controller_  Controller of the board the sequence runs on
+         *  \param[in] build_       Adds the sequence's commands for one channel; see Builder
+         */
+        ResidentSequence::ResidentSequence(ClampController& controller_, const Builder& build_) :
+            controller(controller_),
+            build(build_)
+        {
+        }
+
+        /** \brief Runs the sequence once on the given channels, building it first where needed.
+         *
+         *  As with executeImmediate(), only these channels are enabled afterwards, and their command lists are cleared.
+         *
+         *  \param[in] channelList  Channels to run it on
+         *  \param[in] key          The build function's parameters; the sequence is rebuilt when they change
+         */
+        void ResidentSequence::run(const ChipChannelList& channelList, const vector<double>& key) {
+            if (channelList.empty()) {
+                return;
+            }
+            if (key != builtKey) {
+                clear();
+                builtKey = key;
+            }
+
+            for (auto& index : channelList) {
+                uint16_t current[NUM_REGISTERS];
+                getRegisters(controller.getChannel(index), current);
+                auto found = sequences.find(index);
+                if (found == sequences.end() || !std::equal(current, current + NUM_REGISTERS, found->second.before)) {
+                    compile(index, sequences[index]);
+                }
+            }
+            padChips(channelList);
+
+            Board& board = controller.getBoard();
+            board.enableChannels(channelList);
+            unsigned int longestChip = channelList.front().chip;
+            for (auto& index : channelList) {
+                Channel& channel = controller.getChannel(index);
+                channel.commands = sequences[index].commands;
+                channel.residentCommandsToFPGA();
+                if (board.getNumTimesteps(index.chip) > board.getNumTimesteps(longestChip)) {
+                    longestChip = index.chip;
+                }
+            }
+
+            board.runAndReadOneCycle(longestChip);
+            board.readQueue.clear();
+            for (auto& index : channelList) {
+                const CompiledSequence& sequence = sequences[index];
+                controller.getChip(index).confirmWrites(sequence.commands);
+                setRegisters(controller.getChannel(index), sequence.after);
+            }
+            board.clearSelectedCommands(channelList);
+        }
+
+        /// Drops every built sequence, letting go of its Waveform RAM; the next run() builds them again
+        void ResidentSequence::clear() {
+            sequences.clear();
+            builtKey.clear();
+        }
+
+        // Builds the channel's sequence from its current registers, leaving the channel's registers and commands as they were
+        void ResidentSequence::compile(const ChipChannel& index, CompiledSequence& sequence) {
+            Channel& channel = controller.getChannel(index);
+            getRegisters(channel, sequence.before);
+            vector<WaveformCommand> saved;
+            saved.swap(channel.commands);
+
+            try {
+                build(index);
+            }
+            catch (...) {
+                setRegisters(channel, sequence.before);
+                channel.commands.swap(saved);
+                sequences.erase(index);
+                throw;
+            }
+
+            getRegisters(channel, sequence.after);
+            setRegisters(channel, sequence.before);
+            sequence.commands.swap(channel.commands);
+            channel.commands.swap(saved);
+            sequence.extent.reset();
+            pin(sequence);
+        }
+
+        // Writes the sequence to Waveform RAM and holds on to the run, as ClampController::pinWaveform does
+        void ResidentSequence::pin(CompiledSequence& sequence) {
+            if (sequence.extent || sequence.commands.empty()) {
+                return;
+            }
+            vector<uint32_t> cmdsAsUint(sequence.commands.begin(), sequence.commands.end());
+            try {
+                sequence.extent = controller.getBoard().waveformRAM.write(cmdsAsUint);
+            }
+            catch (runtime_error&) {
+                // Not enough room; the channel's own write in run() will report it
+            }
+        }
+
+        // The channels of a chip run in lockstep, so each chip's sequences are padded with ROM reads to the longest
+        void ResidentSequence::padChips(const ChipChannelList& channelList) {
+            uint32_t longest[MAX_NUM_CHIPS] = {};
+            for (auto& index : channelList) {
+                longest[index.chip] = std::max(longest[index.chip], numRepetitions(sequences[index].commands));
+            }
+            for (auto& index : channelList) {
+                CompiledSequence& sequence = sequences[index];
+                uint32_t length = numRepetitions(sequence.commands);
+                if (length < longest[index.chip]) {
+                    sequence.commands.insert(sequence.commands.end(), longest[index.chip] - length, NonrepeatingCommand::create(READ, None, 0xFF, 0));
+                    sequence.extent.reset();
+                    pin(sequence);
+                }
+            }
+        }
+    }
+}
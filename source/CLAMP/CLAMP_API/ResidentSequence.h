@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ClampController.h"
+#include "WaveformCommand.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace CLAMP {
+    namespace ClampConfig {
+        /** \brief A one-shot command sequence (e.g., a zap or a buzz) that's compiled once and kept in Waveform RAM, so
+         *  that triggering it is a single run.
+         *
+         *  The sequence is built by a function that uses the ordinary (not *Immediate) ClampController functions to add
+         *  to a channel's command list, e.g., switching to voltage clamp, a waveform, then switching back.  The first
+         *  run() builds it for each channel and writes it to Waveform RAM, where it stays (as ClampController's
+         *  compiled waveforms do).  Later runs just point the channels at it and run one cycle: no commands are
+         *  generated, nothing is uploaded, and, unlike executeImmediate(), the chips' confirmed writes aren't consulted.
+         *
+         *  The sequence is rebuilt when the key passed to run() changes (it should hold whatever the build function's
+         *  parameters are, e.g., amplitude and duration), or when a channel's registers aren't what they were when
+         *  it was built, since the commands a build generates depend on them.  Afterwards, the channels' in-memory
+         *  registers are as the sequence leaves them, just as if it had been run with executeImmediate().
+         \code
+            ResidentSequence zap(board.controller, [&](const ChipChannel& index) {
+                board.controller.clampVoltageGenerator.setClampStepSize(index, true);
+                board.controller.simplifiedWaveformToWaveform({ index }, true, waveform);
+                board.controller.clampVoltageGenerator.setClampStepSize(index, false);
+            });
+            zap.run(channelList, { amplitude, duration });
+         \endcode
+         *  Don't run() one inside a ClampController::ImmediateTransaction.
+         */
+        class ResidentSequence {
+        public:
+            /// Adds the sequence's commands for one channel to that channel's (empty) command list
+            typedef std::function<void(const ChipChannel&)> Builder;
+
+            ResidentSequence(ClampController& controller_, const Builder& build_);
+
+            void run(const ChipChannelList& channelList, const std::vector<double>& key = std::vector<double>());
+            void clear();
+
+        private:
+            /// \cond private
+            static const unsigned int NUM_REGISTERS = 14;
+
+            struct CompiledSequence {
+                uint16_t before[NUM_REGISTERS]; // Registers it was built from
+                uint16_t after[NUM_REGISTERS];  // Registers it leaves behind
+                std::vector<WaveformControl::WaveformCommand> commands;
+                std::shared_ptr<WaveformControl::WaveformExtent> extent;
+            };
+            /// \endcond
+
+            ClampController& controller;
+            Builder build;
+            std::vector<double> builtKey;
+            std::map<ChipChannel, CompiledSequence> sequences;
+
+            void compile(const ChipChannel& index, CompiledSequence& sequence);
+            void pin(CompiledSequence& sequence);
+            void padChips(const ChipChannelList& channelList);
+
+            // Not copyable
+            ResidentSequence(const ResidentSequence&);
+            ResidentSequence& operator=(const ResidentSequence&);
+        };
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace CLAMP {
+    /// \cond private
+    /** \brief Fixed-capacity, lock-free, single-producer/single-consumer queue.
+     *
+     *  Exactly one thread may call push() and exactly one (other) thread may call pop().  Neither call blocks
+     *  or allocates; they return false if the queue is full or empty, respectively.
+     */
+    template <typename T, std::size_t Capacity>
+    class SPSCQueue {
+    public:
+        SPSCQueue() : head(0), tail(0) {}
+
+        bool push(const T& value) {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            std::size_t next = increment(t);
+            if (next == head.load(std::memory_order_acquire)) {
+                return false; // Full
+            }
+            items[t] = value;
+            tail.store(next, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& value) {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false; // Empty
+            }
+            value = items[h];
+            head.store(increment(h), std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        // One slot is always left empty, to distinguish full from empty
+        T items[Capacity + 1];
+        std::atomic<std::size_t> head;
+        std::atomic<std::size_t> tail;
+
+        static std::size_t increment(std::size_t i) { return (i + 1) % (Capacity + 1); }
+
+        SPSCQueue(const SPSCQueue&) = delete;
+        SPSCQueue& operator=(const SPSCQueue&) = delete;
+    };
+    /// \endcond
+}
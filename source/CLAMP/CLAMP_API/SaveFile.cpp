@@ -3,7 +3,31 @@
 #include "common.h"
 #include "Constants.h"
 #include "streams.h"
+#include "NWBFile.h"
+#include "SaveWriterThread.h"
+#include "DirectFileOutStream.h"
+#include "SaveJournal.h"
+#include "SweepAnalysis.h"
+#include "Trace.h"
 #include <ctime>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 #ifdef WIN32
 #pragma warning(disable: 4996) // On Windows, disable the warning about localtime being bad.
@@ -15,6 +39,8 @@ using namespace CLAMP;
 using namespace CLAMP::ClampConfig;
 using std::vector;
 using std::invalid_argument;
+using std::runtime_error;
+using std::string;
 using std::time_t;
 
 namespace CLAMP {
@@ -22,11 +48,8 @@ namespace CLAMP {
         // Save files are buffered in memory, i.e., data is written to a big block in memory, then to disk.  This is the
         // size of that big block of memory.
         static const unsigned int SAVE_BUFFER_SIZE = 4 * CLAMP::KILO;
-
-        // Saved data file constants
-		#define DATA_FILE_MAGIC_NUMBER  0xf3b1a481
-		#define DATA_FILE_MAIN_VERSION_NUMBER  1
-		#define DATA_FILE_SECONDARY_VERSION_NUMBER  0
+        // Larger blocks in asynchronous mode, so the writer thread's queue doesn't churn on small allocations
+        static const unsigned int ASYNC_SAVE_BUFFER_SIZE = 64 * CLAMP::KILO;
 
         //------------------------------------------------------------------------------------------------------
         /// Constructor
@@ -73,7 +96,8 @@ namespace CLAMP {
          *  \param[in] board  Used for register settings, calibration settings, etc.
          *  \param[in] index  Which ChipChannel the settings correspond to
          */
-        VoltageClampSettings::VoltageClampSettings(Board& board, const ChipChannel& index)
+        VoltageClampSettings::VoltageClampSettings(Board& board, const ChipChannel& index) :
+            holdingVoltage(0)
         {
             Channel& channel = board.controller.getChannel(index);
 
@@ -135,8 +159,19 @@ namespace CLAMP {
          *  \param[in] index  Which ChipChannel the settings correspond to
          */
         Settings::Settings(Board& board, const ChipChannel& index) :
-            voltageClamp(board, index)
+            isVoltageClamp(true),
+            vClampX2mode(false),
+            voltageClamp(board, index),
+            filterCutoff(0),
+            pipetteOffset(0),
+            Ra(0),
+            Rm(0),
+            Cm(0)
         {
+            // Callers that don't fill in the rest (e.g., headless recording in voltage clamp) still get defined values
+            currentClamp.holdingCurrent = 0;
+            currentClamp.stepSize = 0;
+
             ClampController& controller = board.controller;
 
             enableCapacitiveCompensation = controller.fastTransientCapacitiveCompensation.getConnect(index);
@@ -182,19 +217,90 @@ namespace CLAMP {
             return out;
         }
 
+        //------------------------------------------------------------------------------------------------------
+        bool operator<(const Version& a, const Version& b) {
+            if (a.majorVersion != b.majorVersion) {
+                return a.majorVersion < b.majorVersion;
+            }
+            return a.minorVersion < b.minorVersion;
+        }
+
+        bool operator>=(const Version& a, const Version& b) {
+            return !(a < b);
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// Constructor
+        CompactScaling::CompactScaling() :
+            measuredScale(1.0),
+            measuredOffset(0.0),
+            clampScale(1.0)
+        {
+        }
+
+        /** Size of this object on disk
+         *  \returns The size in bytes
+         */
+        unsigned int CompactScaling::onDiskSize() const {
+            return 3 * sizeof(uint64_t);
+        }
+
+        // Doubles are normally written as floats; the scale factors need the full precision.
+        static uint64_t doubleBits(double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        /** \brief Write the scale factors to a BinaryWriter stream
+         *
+         * \param[in] out      Output stream
+         * \param[in] scaling  Scale factors to write
+         * \returns Updated output stream
+         */
+        BinaryWriter& operator<<(BinaryWriter& out, const CompactScaling& scaling) {
+            out << doubleBits(scaling.measuredScale);
+            out << doubleBits(scaling.measuredOffset);
+            out << doubleBits(scaling.clampScale);
+
+            return out;
+        }
+
         //------------------------------------------------------------------------------------------------------
         /** \brief Constructor
         *
         *  \param[in] b      Board.  Used for register settings, calibration settings, etc.
         *  \param[in] index  Which ChipChannel the settings correspond to
         */
-        HeaderData::HeaderData(Board& b, const ChipChannel& index) :
+        HeaderData::HeaderData(Board& b, const ChipChannel& index_) :
             board(b),
+            index(index_),
             version(DATA_FILE_MAIN_VERSION_NUMBER, DATA_FILE_SECONDARY_VERSION_NUMBER),
-            settings(b, index)
+            settings(b, index_)
         {
         }
 
+        /** \brief Fill in compactScaling from the board's current configuration and the settings.
+         *
+         *  Call this after the settings are filled in, since the current clamp offset comes from settings.pipetteOffset.
+         *  The scale factors mirror the conversions in ReadQueue.
+         */
+        void HeaderData::computeCompactScaling() {
+            Channel& channel = board.controller.getChannel(index);
+            double muxStep = board.controller.mux.toVoltage(index, 1);
+
+            if (settings.isVoltageClamp) {
+                compactScaling.measuredScale = muxStep / 10.0 / channel.getFeedbackResistance();
+                compactScaling.measuredOffset = 0.0;
+                compactScaling.clampScale = channel.getVoltageClampStep();
+            }
+            else {
+                compactScaling.measuredScale = muxStep / 8.0;
+                compactScaling.measuredOffset = -settings.pipetteOffset / 1000.0; // settings.pipetteOffset is in mV
+                compactScaling.clampScale = channel.recallCurrentStep();
+            }
+        }
+
         /** \brief Write the header to a BinaryWriter stream
          *
          * \param[in] out   Output stream
@@ -211,7 +317,8 @@ namespace CLAMP {
             uint16_t headerSizeBytes = sizeof(uint32_t)+sizeof(header.version.majorVersion) + sizeof(header.version.minorVersion) + 2*sizeof(uint16_t) /* signature and this field */
                 + header.timestamp.onDiskSize()
                 + 2 * sizeof(uint16_t) + MAX_NUM_CHIPS * (MAX_NUM_CHANNELS * header.board.chip[0]->channel[0]->onDiskSize() + 4 * sizeof(uint16_t)) /* chip and channel data */
-                + header.settings.onDiskSize() /* Settings */;
+                + header.settings.onDiskSize() /* Settings */
+                + ((header.version >= Version(DATA_FILE_COMPACT_MAIN_VERSION_NUMBER, 0)) ? header.compactScaling.onDiskSize() : 0);
 
 			int timestampSize = header.timestamp.onDiskSize();
 			int channelSize = header.board.chip[0]->channel[0]->onDiskSize();
@@ -240,6 +347,9 @@ namespace CLAMP {
             }
 
             out << header.settings;
+            if (header.version >= Version(DATA_FILE_COMPACT_MAIN_VERSION_NUMBER, 0)) {
+                out << header.compactScaling;
+            }
 
             return out;
         }
@@ -251,6 +361,7 @@ namespace CLAMP {
 		*/
 		AuxHeaderData::AuxHeaderData(Board& b, const ChipChannel& index, int numAdcs_) :
 			numAdcs(numAdcs_),
+			adcMask(static_cast<uint16_t>((1u << numAdcs_) - 1)),
 			version(DATA_FILE_MAIN_VERSION_NUMBER, DATA_FILE_SECONDARY_VERSION_NUMBER),
 			settings(b, index)
 		{
@@ -270,44 +381,505 @@ namespace CLAMP {
 			out << (uint16_t)1; // 1 = aux data header
 			out << (uint16_t)header.numAdcs;
 
+			bool hasMask = (header.version >= Version(DATA_FILE_AUX_EVENTS_MAIN_VERSION_NUMBER, 0));
 			uint16_t headerSizeBytes = sizeof(uint32_t) + sizeof(header.version.majorVersion) + sizeof(header.version.minorVersion) + 3*sizeof(uint16_t) /* signature and this field */
-				+ header.timestamp.onDiskSize() + sizeof(float);
+				+ header.timestamp.onDiskSize() + sizeof(float) + (hasMask ? sizeof(uint16_t) : 0);
 
 			out << headerSizeBytes;
 
 			out << header.timestamp;
 
 			out << header.settings.samplingRate;
+			if (hasMask) {
+				out << header.adcMask;
+			}
 
 			return out;
 		}
 
         //------------------------------------------------------------------------------------------------------
-        SaveFile::SaveFile()
+        /** \brief Constructor
+         *
+         *  \param[in] format_  Record format for headstage data.  Aux files always use the same format.
+         */
+        SaveFile::SaveFile(Format format_) :
+            format(format_),
+            asyncMode(false),
+            directIO(false),
+            samplingRate(0),
+            recordBytes(0),
+            auxFormat(AUX_RECORDS),
+            auxAdcMask(0xff),
+            digitalKnown(false),
+            lastDigIn(0),
+            lastDigOut(0),
+            journalSeconds(0),
+            journal(nullptr),
+            sweepIndexEnabled(false),
+            sweepPeriod(0),
+            repetitionStart(0),
+            sweepPending(false),
+            sweepCount(0),
+            fileRecords(0),
+            measuredSum(0),
+            summarizing(false),
+            voltageClamp(true),
+            sweepOffset(0),
+            sweepFirstTimestep(0)
         {
 
         }
 
         SaveFile::~SaveFile()
         {
-            close();
+            try {
+                close();
+            }
+            catch (...) {
+            }
+        }
+
+        /** \brief Split the recording into several files (segments) by size or duration.
+         *
+         *  Once a segment reaches policy.maxBytes, or spans policy.maxSeconds of timestamps, the next record starts a new
+         *  segment, with the same header, so each segment can be read on its own.  The first segment of a recording
+         *  opened as <name>.clp is <name>_seg0001.clp, the next <name>_seg0002.clp, and so on (see segmentPath()).
+         *  A manifest, <name>_manifest.csv (see manifestPath()), lists the segments in order, with their first and last
+         *  timestamps, number of records and size, and whether they're complete.  It's rewritten (atomically, by
+         *  renaming) whenever a segment starts or ends, so another process can upload completed segments while the
+         *  recording continues.  In asynchronous mode, starting a new segment waits for the last one's queued data to
+         *  be written.
+         *
+         *  With policy.preallocate, each segment's expected size is reserved on disk when it's opened, without changing
+         *  the file's size (fallocate with FALLOC_FL_KEEP_SIZE on Linux, F_PREALLOCATE on macOS, the allocation size on
+         *  Windows), so the filesystem can lay it out in one piece rather than fragmenting it as it grows.  What isn't
+         *  used is given back when the segment is closed.  On filesystems that can't reserve space, nothing is.
+         *
+         *  Call before open().  Only .clp formats can be split; NWB_RECORDS files can't.
+         *
+         *  \param[in] policy  When to start a new segment; the default policy doesn't split recordings
+         */
+        void SaveFile::setRollover(const RolloverPolicy& policy) {
+            if (file || nwb) {
+                throw runtime_error("The rollover policy must be set before the save file is opened");
+            }
+            if (policy.isEnabled() && format == NWB_RECORDS) {
+                throw invalid_argument("Only .clp save files can be split into segments");
+            }
+            rollover = policy;
+        }
+
+        /** \brief Write the file around the operating system's file cache, in large aligned blocks (see DirectFileOutStream).
+         *
+         *  For sustained recording of many channels: the data isn't copied through the cache, and doesn't crowd
+         *  everything else out of the acquisition PC's memory.  In asynchronous mode, the blocks are written on
+         *  SaveWriterThread.  The last few megabytes are only written when the file (or segment) is closed.
+         *  Ignored for SaveFile::NWB_RECORDS, whose files are written by the HDF5 library.
+         *
+         *  \param[in] enable  True to bypass the cache
+         */
+        void SaveFile::setDirectIO(bool enable) {
+            if (file || nwb) {
+                throw runtime_error("Direct I/O must be set before the save file is opened");
+            }
+            directIO = enable;
+        }
+
+        /** \brief Write the file as a journal (see JournalOutStream), so it can be recovered if the program crashes.
+         *
+         *  Every checkpointSeconds, at the end of a call to writeData() or writeDataAux(), whatever has been written is
+         *  handed to the operating system along with a checkpoint; recoverJournal() (or SaveFileConverter) rebuilds the
+         *  file up to the last checkpoint.  In asynchronous mode, the disk writes still happen on SaveWriterThread.  A
+         *  CHUNKED_RECORDS file's pending chunk is written at each checkpoint, so its chunks may be smaller.
+         *
+         *  Direct I/O (see setDirectIO()) isn't used for journals, since it holds data back for large blocks.  Call before
+         *  open().  Ignored for SaveFile::NWB_RECORDS.
+         *
+         *  \param[in] checkpointSeconds  Time between checkpoints, e.g., 1; 0 to write an ordinary file
+         */
+        void SaveFile::setJournal(double checkpointSeconds) {
+            if (file || nwb) {
+                throw runtime_error("Journaling must be set before the save file is opened");
+            }
+            if (checkpointSeconds < 0) {
+                throw invalid_argument("Negative checkpoint interval");
+            }
+            journalSeconds = checkpointSeconds;
+        }
+
+        /** \brief Choose the record format for an aux file (see AuxFormat).
+         *
+         *  Call before writeHeaderAux().  Ignored for headstage files and SaveFile::NWB_RECORDS.
+         *
+         *  \param[in] auxFormat_  Record format
+         *  \param[in] adcMask     For AUX_EVENTS, the ADCs to store (bit i for ADC i); 0 to store only the digital I/O
+         */
+        void SaveFile::setAuxFormat(AuxFormat auxFormat_, unsigned int adcMask) {
+            auxFormat = auxFormat_;
+            auxAdcMask = adcMask;
+        }
+
+        /** \brief Keep an index of the recording's sweeps, written next to each file when it's closed.
+         *
+         *  A sweep starts with the first record, with each repetition of the header's waveform (by the timestamps, as
+         *  for the applied values; see SimplifiedWaveform::getApplied()), wherever the timestamps start over, and at
+         *  the next record after each startSweep() call.  For each file (or segment) <name>.clp, <name>_sweeps.csv (see
+         *  sweepIndexPath()) lists its sweeps in order: number, first and last timestamps, first record, number of
+         *  records, the byte offset of the first record, and the number, minimum, maximum and mean of the valid
+         *  measured values (see SweepIndexEntry).  SaveFileReader loads it, if it's there, so a reader can go straight
+         *  to any sweep.  A sweep split between two segments is listed in both.
+         *
+         *  If the header has a waveform, each sweep is also summarized as it's written: its baseline and noise, peak,
+         *  steady state, and (in voltage clamp) cell parameters, as the data display would calculate them.  The sweep's
+         *  values are kept until it ends, and analyzed then, so selecting sweeps by these (e.g., every sweep with Ra
+         *  under 20 MOhm) needs only the index, not the records.  In a file that ends partway through a sweep, that
+         *  sweep is summarized as far as it got.
+         *
+         *  Call before open().  Only headstage files are indexed, and only in the .clp formats.
+         *
+         *  \param[in] enable  True to write the index
+         */
+        void SaveFile::setSweepIndex(bool enable) {
+            if (file || nwb) {
+                throw runtime_error("The sweep index must be set before the save file is opened");
+            }
+            sweepIndexEnabled = enable;
+        }
+
+        /// Start a new sweep at the next record written (e.g., at each sweep of a ProtocolRunner program); see setSweepIndex()
+        void SaveFile::startSweep() {
+            sweepPending = true;
+        }
+
+        /// Constructor
+        SweepIndexEntry::SweepIndexEntry() :
+            sweep(0),
+            firstTimestamp(0),
+            lastTimestamp(0),
+            firstRecord(0),
+            records(0),
+            offset(0),
+            validRecords(0),
+            measuredMin(std::numeric_limits<double>::quiet_NaN()),
+            measuredMax(std::numeric_limits<double>::quiet_NaN()),
+            measuredMean(std::numeric_limits<double>::quiet_NaN()),
+            baseline(std::numeric_limits<double>::quiet_NaN()),
+            noiseRms(std::numeric_limits<double>::quiet_NaN()),
+            peak(std::numeric_limits<double>::quiet_NaN()),
+            steadyState(std::numeric_limits<double>::quiet_NaN()),
+            Ra(std::numeric_limits<double>::quiet_NaN()),
+            Rm(std::numeric_limits<double>::quiet_NaN()),
+            Cm(std::numeric_limits<double>::quiet_NaN())
+        {
+        }
+
+        // Start of the extension in path (its end if there's none)
+        static std::size_t extensionStart(const FILENAME& path) {
+            std::size_t dot = path.find_last_of(FILENAME::value_type('.'));
+            std::size_t slash = path.find_last_of(toFileName(string("/\\")));
+            return (dot == FILENAME::npos || (slash != FILENAME::npos && dot < slash)) ? path.size() : dot;
+        }
+
+        /** \brief Path of a segment of a split recording.
+         *
+         *  \param[in] path   Path the recording was opened with, e.g., rec.clp
+         *  \param[in] index  Number of the segment, counting from 1
+         *  \returns E.g., rec_seg0001.clp
+         */
+        FILENAME SaveFile::segmentPath(const FILENAME& path, unsigned int index) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_seg%04u", index);
+            std::size_t dot = extensionStart(path);
+            return path.substr(0, dot) + toFileName(string(suffix)) + path.substr(dot);
+        }
+
+        /** \brief Path of the manifest of a split recording.
+         *
+         *  \param[in] path   Path the recording was opened with, e.g., rec.clp
+         *  \returns E.g., rec_manifest.csv
+         */
+        FILENAME SaveFile::manifestPath(const FILENAME& path) {
+            return path.substr(0, extensionStart(path)) + toFileName(string("_manifest.csv"));
+        }
+
+        /** \brief Path of the sweep index of a save file (see setSweepIndex()).
+         *
+         *  \param[in] path   Path of the file, e.g., rec.clp or rec_seg0001.clp
+         *  \returns E.g., rec_sweeps.csv or rec_seg0001_sweeps.csv
+         */
+        FILENAME SaveFile::sweepIndexPath(const FILENAME& path) {
+            return path.substr(0, extensionStart(path)) + toFileName(string("_sweeps.csv"));
         }
 
         /** \brief Open a file for saving.
          *
-         *  \param[in] path  Path of the file
+         *  In asynchronous mode, the disk writes happen on SaveWriterThread rather than on the thread calling writeData().
+         *
+         *  \param[in] path   Path of the file; if the recording is split (see setRollover()), the segments are named after it
+         *  \param[in] async  True to write the file asynchronously
          */
-        void SaveFile::open(const FILENAME& path) {
-            unique_ptr<FileOutStream> fs(new FileOutStream());
-            fs->open(path);
+        void SaveFile::open(const FILENAME& path, bool async) {
+            if (format == NWB_RECORDS) {
+                nwb.reset(new NWBFile());
+                nwb->open(path, async);
+                return;
+            }
+
+            basePath = path;
+            asyncMode = async;
+            segments.clear();
+            sweepCount = 0;
+            sweepPending = false;
+            if (rollover.isEnabled()) {
+                segments.push_back(Segment());
+                segments.back().path = segmentPath(path, 1);
+                openStream(segments.back().path);
+            }
+            else {
+                openStream(path);
+            }
+        }
+
+        void SaveFile::openStream(const FILENAME& path) {
+            unique_ptr<FileOutStream> fs;
+            if (directIO && journalSeconds == 0) {
+                // Does its own asynchronous writing, from its aligned buffers
+                unique_ptr<DirectFileOutStream> direct(new DirectFileOutStream(asyncMode));
+                direct->open(path);
+                fs.reset(direct.release());
+            }
+            else {
+                fs.reset(new FileOutStream());
+                fs->open(path);
+                if (asyncMode) {
+                    fs.reset(new AsyncFileOutStream(std::move(fs)));
+                }
+            }
+            journal = nullptr;
+            if (journalSeconds > 0) {
+                // Wrapped on this thread, so checkpoints fall between the right blocks
+                unique_ptr<JournalOutStream> journalStream(new JournalOutStream(std::move(fs)));
+                journal = journalStream.get();
+                fs.reset(journalStream.release());
+            }
 
-            unique_ptr<BinaryWriter> bs(new BinaryWriter(std::move(fs), SAVE_BUFFER_SIZE));
+            digitalKnown = false;
+            sweeps.clear();
+            fileRecords = 0;
+            unique_ptr<BinaryWriter> bs(new BinaryWriter(std::move(fs), asyncMode ? ASYNC_SAVE_BUFFER_SIZE : SAVE_BUFFER_SIZE));
             file.reset(bs.release());
         }
 
-        /// Close the save file
+        /// Close the save file; throws if what was still to be written (in asynchronous mode, still queued) couldn't be
         void SaveFile::close() {
-            file.reset(nullptr);
+            if (nwb) {
+                unique_ptr<NWBFile> closing(std::move(nwb));
+                closing->close();
+                return;
+            }
+            if (file) {
+                closeSegment();
+                if (rollover.isEnabled()) {
+                    writeManifest();
+                }
+            }
+        }
+
+        static uint64_t fileSize(const FILENAME& path) {
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            return in ? static_cast<uint64_t>(in.tellg()) : 0;
+        }
+
+        // Reserves disk space for a file without changing its size, so the filesystem can lay it out in one piece as
+        // it grows, while readers still see only what's been written.  Best effort: if the filesystem can't, it doesn't.
+        static void reserveSpace(const FILENAME& path, uint64_t bytes) {
+#if defined(_WIN32)
+            // Not SetFileValidData: that moves the end of the file, so whatever was on the disk would read as records
+            // (and it needs an administrator privilege).  The allocation size lasts while the file is open.
+    #if defined(_UNICODE)
+            HANDLE handle = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    #else
+            HANDLE handle = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    #endif
+            if (handle != INVALID_HANDLE_VALUE) {
+                FILE_ALLOCATION_INFO info;
+                info.AllocationSize.QuadPart = static_cast<LONGLONG>(bytes);
+                SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info));
+                CloseHandle(handle);
+            }
+#elif defined(__linux__)
+            int fd = ::open(path.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(bytes));
+                ::close(fd);
+            }
+#elif defined(__APPLE__)
+            int fd = ::open(path.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(bytes), 0 };
+                if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+                    store.fst_flags = F_ALLOCATEALL;
+                    fcntl(fd, F_PREALLOCATE, &store);
+                }
+                ::close(fd);
+            }
+#else
+            (void)path;
+            (void)bytes;
+#endif
+        }
+
+        // Gives back the space reserveSpace() reserved beyond the end of a closed file; false if it couldn't
+        static bool releaseSpace(const FILENAME& path) {
+#if defined(_WIN32)
+            (void)path; // Released when the file was closed
+            return true;
+#else
+            // Truncating to the current size frees the blocks past it
+            struct stat info;
+            return stat(path.c_str(), &info) == 0 && truncate(path.c_str(), info.st_size) == 0;
+#endif
+        }
+
+        // Finishes the file being written (the current segment, if the recording is split)
+        void SaveFile::closeSegment() {
+            if (format == CHUNKED_RECORDS) {
+                flushChunk();
+                writeChunkIndex();
+            }
+            if (sweepIndexEnabled) {
+                writeSweepIndex(segments.empty() ? basePath : segments.back().path);
+            }
+            unique_ptr<BinaryWriter> closing(std::move(file));
+            journal = nullptr;
+            pendingChunk.clear();
+            chunkIndex.clear();
+            closing->close();
+
+            if (!segments.empty()) {
+                Segment& segment = segments.back();
+                if (rollover.preallocate) {
+                    releaseSpace(segment.path);
+                }
+                segment.bytes = fileSize(segment.path);
+                segment.complete = true;
+            }
+        }
+
+        // The manifest's name for a segment: just its file name, since the manifest is next to it
+        static string segmentName(const FILENAME& path) {
+            std::size_t slash = path.find_last_of(toFileName(string("/\\")));
+            FILENAME name = (slash == FILENAME::npos) ? path : path.substr(slash + 1);
+#if defined(_WIN32) && defined(_UNICODE)
+            return toString(name);
+#else
+            return name;
+#endif
+        }
+
+        // Writes the manifest to a temporary file and renames it over the old one, so readers never see half of it
+        void SaveFile::writeManifest() const {
+            FILENAME path = manifestPath(basePath);
+            FILENAME temporary = path + toFileName(string(".tmp"));
+            {
+                std::ofstream out(temporary.c_str());
+                out << "file,first_timestamp,last_timestamp,records,bytes,complete\n";
+                for (const Segment& segment : segments) {
+                    out << segmentName(segment.path) << "," << segment.firstTimestamp << "," << segment.lastTimestamp << ","
+                        << segment.records << "," << segment.bytes << "," << (segment.complete ? 1 : 0) << "\n";
+                }
+                if (!out) {
+                    throw runtime_error("Couldn't write the save file manifest");
+                }
+            }
+#if defined(_WIN32) && defined(_UNICODE)
+            bool renamed = MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#elif defined(_WIN32)
+            bool renamed = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            bool renamed = (std::rename(temporary.c_str(), path.c_str()) == 0);
+#endif
+            if (!renamed) {
+                throw runtime_error("Couldn't write the save file manifest");
+            }
+        }
+
+        // Writes the header to the file being written, and for a split recording, reserves the segment's space and
+        // lists it in the manifest
+        void SaveFile::writeHeaderBytes() {
+            file->writeBytes(headerBytes.data(), static_cast<unsigned int>(headerBytes.size()));
+            if (journal) {
+                checkpoint();
+            }
+            if (!rollover.isEnabled()) {
+                return;
+            }
+
+            if (rollover.preallocate) {
+                uint64_t expected = rollover.maxBytes;
+                if (rollover.maxSeconds > 0) {
+                    uint64_t forDuration = headerBytes.size() + static_cast<uint64_t>(std::ceil(rollover.maxSeconds * samplingRate)) * recordBytes;
+                    expected = (expected > 0) ? std::min(expected, forDuration) : forDuration;
+                }
+                reserveSpace(segments.back().path, expected);
+            }
+            writeManifest();
+        }
+
+        // Index of the first record from *first* on that belongs in the next segment (timestamps.size() if none does)
+        unsigned int SaveFile::segmentEnd(const vector<uint32_t>& timestamps, unsigned int first) {
+            const Segment& segment = segments.back();
+            bool empty = (segment.records == 0);
+            unsigned int end = static_cast<unsigned int>(timestamps.size());
+
+            if (rollover.maxSeconds > 0) {
+                uint32_t start = empty ? timestamps[first] : segment.firstTimestamp;
+                uint64_t span = static_cast<uint64_t>(std::ceil(rollover.maxSeconds * samplingRate));
+                for (unsigned int i = first; i < end; i++) {
+                    // Unsigned, so timestamps that start over (the board was restarted) start a new segment too
+                    if (static_cast<uint32_t>(timestamps[i] - start) >= span) {
+                        end = i;
+                        break;
+                    }
+                }
+            }
+            if (rollover.maxBytes > 0) {
+                uint64_t used = file->position() + pendingChunk.size() * recordBytes;
+                uint64_t room = (used < rollover.maxBytes) ? (rollover.maxBytes - used) / recordBytes : 0;
+                if (room < end - first) {
+                    end = first + static_cast<unsigned int>(room);
+                }
+            }
+
+            if (empty && end == first) {
+                end = first + 1; // Every segment holds at least one record
+            }
+            return end;
+        }
+
+        // Writes out everything so far, which ends with a whole record, and marks it as recoverable in the journal
+        void SaveFile::checkpoint() {
+            if (format == CHUNKED_RECORDS) {
+                flushChunk();
+            }
+            file->flush();
+            journal->checkpoint(headerBytes);
+            lastCheckpoint = std::chrono::steady_clock::now();
+        }
+
+        void SaveFile::checkpointIfDue() {
+            if (journal && std::chrono::duration<double>(std::chrono::steady_clock::now() - lastCheckpoint).count() >= journalSeconds) {
+                checkpoint();
+            }
+        }
+
+        void SaveFile::addToSegment(const vector<uint32_t>& timestamps, unsigned int first, unsigned int end) {
+            Segment& segment = segments.back();
+            if (segment.records == 0) {
+                segment.firstTimestamp = timestamps[first];
+            }
+            segment.lastTimestamp = timestamps[end - 1];
+            segment.records += end - first;
         }
 
         /** \brief Write the header of the save file.
@@ -318,52 +890,625 @@ namespace CLAMP {
          * \param[in] header   The header data to write
          */
         void SaveFile::writeHeader(HeaderData& header) {
-            *file << header;
+            if (nwb) {
+                nwb->writeHeader(header);
+                return;
+            }
+            if (format != FLOAT_RECORDS) {
+                header.version = Version((format == CHUNKED_RECORDS) ? DATA_FILE_CHUNKED_MAIN_VERSION_NUMBER : DATA_FILE_COMPACT_MAIN_VERSION_NUMBER, 0);
+                header.computeCompactScaling();
+                scaling = header.compactScaling;
+            }
+
+            // Kept, to start each segment of a split recording with
+            headerBytes.clear();
+            {
+                BinaryWriter out(unique_ptr<FileOutStream>(new MemoryOutStream(headerBytes)), SAVE_BUFFER_SIZE);
+                out << header;
+            }
+            samplingRate = header.settings.samplingRate;
+            recordBytes = (format == FLOAT_RECORDS) ? sizeof(uint32_t) + 3 * sizeof(float) : sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t);
+            writeHeaderBytes();
 
             waveform = header.settings.waveform;
+            sweepPeriod = waveform.waveform.empty() ? 0 : static_cast<uint64_t>(waveform.waveform.back().endIndex) + 1;
+            summarizing = sweepIndexEnabled && sweepPeriod > 0;
+            voltageClamp = header.settings.isVoltageClamp;
         }
 
 		void SaveFile::writeHeaderAux(AuxHeaderData& auxHeader) {
-			*file << auxHeader;
+			if (nwb) {
+				nwb->writeHeaderAux(auxHeader);
+				return;
+			}
+
+			if (auxFormat == AUX_EVENTS) {
+				auxHeader.version = Version(DATA_FILE_AUX_EVENTS_MAIN_VERSION_NUMBER, 0);
+				auxHeader.adcMask = static_cast<uint16_t>(auxAdcMask & ((1u << auxHeader.numAdcs) - 1));
+				auxAdcMask = auxHeader.adcMask;
+			}
+
+			headerBytes.clear();
+			{
+				BinaryWriter out(unique_ptr<FileOutStream>(new MemoryOutStream(headerBytes)), SAVE_BUFFER_SIZE);
+				out << auxHeader;
+			}
+			samplingRate = auxHeader.settings.samplingRate;
+			if (auxFormat == AUX_EVENTS) {
+				// Runs and events are small; at least a byte per sample keeps the rollover estimates meaningful
+				unsigned int storedAdcs = 0;
+				for (unsigned int mask = auxAdcMask; mask != 0; mask >>= 1) {
+					storedAdcs += mask & 1;
+				}
+				recordBytes = std::max(1u, storedAdcs * static_cast<unsigned int>(sizeof(uint16_t)));
+			}
+			else {
+				recordBytes = sizeof(uint32_t) + (2 + auxHeader.numAdcs) * sizeof(uint16_t);
+			}
+			writeHeaderBytes();
 		}
 
+        // Starts the next segment of a split recording
+        void SaveFile::startSegment() {
+            closeSegment();
+            segments.push_back(Segment());
+            segments.back().path = segmentPath(basePath, static_cast<unsigned int>(segments.size()));
+            openStream(segments.back().path);
+            writeHeaderBytes();
+        }
+
         /** \brief Write a block of data to the file.
          *
          *  If you're looping over the same waveform multiple times, you should call this once per time you loop over it.  The
          *  waveform length is stored in the header, and code reading files will look for this structure to match that.
          *
+         *  Only elements from index *first* onwards are written, so a caller that accumulates data can write just what
+         *  it has appended since its last call.
+         *
          * \param[in] timestamps    Timestamps
          * \param[in] measuredData  Measured current in voltage clamp mode or measured voltage in current clamp mode
-         * \param[in] adcs          Values of the ADCs
+         * \param[in] clampValues   Clamp voltage in voltage clamp mode or clamp current in current clamp mode
+         * \param[in] first         Index of the first element to write
          */
-        void SaveFile::writeData(const vector<uint32_t>& timestamps, const vector<double>& measuredData, const vector<double>& clampValues) {
+        void SaveFile::writeData(const vector<uint32_t>& timestamps, const vector<Sample>& measuredData, const vector<Sample>& clampValues, unsigned int first) {
+            CLAMP_TRACE_SPAN("SaveFile::writeData");
             bool sizesMatch = (timestamps.size() == measuredData.size());
             if (!sizesMatch) {
                 throw invalid_argument("Size mismatch");
             }
 
-            vector<double> applied = waveform.getApplied(timestamps);
+            if (first >= timestamps.size()) {
+                return;
+            }
+
+            if (nwb) {
+                nwb->writeData(timestamps, measuredData, clampValues, first);
+                return;
+            }
+            if (!rollover.isEnabled()) {
+                writeRecords(timestamps, measuredData, clampValues, first, timestamps.size());
+                checkpointIfDue();
+                return;
+            }
+
+            while (first < timestamps.size()) {
+                unsigned int end = segmentEnd(timestamps, first);
+                if (end == first) {
+                    startSegment();
+                    continue;
+                }
+                writeRecords(timestamps, measuredData, clampValues, first, end);
+                addToSegment(timestamps, first, end);
+                first = end;
+            }
+            checkpointIfDue();
+        }
+
+        // Writes records [first, end) to the file being written
+        void SaveFile::writeRecords(const vector<uint32_t>& timestamps, const vector<Sample>& measuredData, const vector<Sample>& clampValues, unsigned int first, unsigned int end) {
+            if (sweepIndexEnabled) {
+                indexSweeps(timestamps, measuredData, first, end);
+            }
+            if (format != FLOAT_RECORDS) {
+                writeCompactData(timestamps, measuredData, clampValues, first, end);
+                return;
+            }
+
+            waveform.getApplied(timestamps, first, end, appliedValues);
+
+            // Each record is: timestamp, applied, clamp value, measured
+            BinaryColumn columns[] = {
+                BinaryColumn(timestamps.data() + first),
+                BinaryColumn(appliedValues.data()),
+                BinaryColumn(clampValues.data() + first),
+                BinaryColumn(measuredData.data() + first)
+            };
+            file->writeRecords(columns, 4, end - first);
+        }
+
+        // Adds records [first, end), about to be written to the file, to the sweep index
+        void SaveFile::indexSweeps(const vector<uint32_t>& timestamps, const vector<Sample>& measuredData, unsigned int first, unsigned int end) {
+            for (unsigned int i = first; i < end; i++) {
+                uint64_t t = timestamps[i];
+                bool boundary = sweepPending || sweepCount == 0 ||
+                                (sweepPeriod > 0 && (t < repetitionStart || t >= repetitionStart + sweepPeriod));
+                if (boundary) {
+                    sweepCount++;
+                    sweepPending = false;
+                    if (sweepPeriod > 0) {
+                        repetitionStart = t - t % sweepPeriod;
+                    }
+                }
+                if (boundary || sweeps.empty()) {
+                    // A new sweep, or the rest of one in a new segment
+                    if (!sweeps.empty()) {
+                        finishSweep();
+                    }
+                    if (boundary && summarizing) {
+                        sweepOffset = t - repetitionStart;
+                        sweepFirstTimestep = t;
+                        sweepValues.clear();
+                    }
+                    SweepIndexEntry entry;
+                    entry.sweep = sweepCount - 1;
+                    entry.firstTimestamp = timestamps[i];
+                    entry.firstRecord = fileRecords + (i - first);
+                    entry.offset = (format == CHUNKED_RECORDS) ? 0 : headerBytes.size() + entry.firstRecord * recordBytes;
+                    sweeps.push_back(entry);
+                    measuredSum = 0;
+                }
+
+                SweepIndexEntry& sweep = sweeps.back();
+                sweep.lastTimestamp = timestamps[i];
+                sweep.records++;
+                double value = measuredData[i];
+                if (summarizing) {
+                    // Within the repetition, so at most sweepPeriod long
+                    std::size_t j = static_cast<std::size_t>(t - sweepFirstTimestep);
+                    if (j >= sweepValues.size()) {
+                        sweepValues.resize(j + 1, std::numeric_limits<double>::quiet_NaN());
+                    }
+                    sweepValues[j] = value;
+                }
+                if (!std::isnan(value)) {
+                    if (sweep.validRecords == 0 || value < sweep.measuredMin) {
+                        sweep.measuredMin = value;
+                    }
+                    if (sweep.validRecords == 0 || value > sweep.measuredMax) {
+                        sweep.measuredMax = value;
+                    }
+                    sweep.validRecords++;
+                    measuredSum += value;
+                }
+            }
+            fileRecords += end - first;
+        }
+
+        void SaveFile::finishSweep() {
+            SweepIndexEntry& sweep = sweeps.back();
+            if (sweep.validRecords > 0) {
+                sweep.measuredMean = measuredSum / sweep.validRecords;
+            }
+            if (summarizing) {
+                summarizeSweep(sweep);
+            }
+        }
+
+        // Fills in the sweep's summary from its values so far.  It's analyzed as a waveform of its own: the segments of the
+        // header's waveform it covers, from where it starts (e.g., one sweep of a ProtocolRunner program).
+        void SaveFile::summarizeSweep(SweepIndexEntry& sweep) {
+            sweepWaveform.waveform.clear();
+            for (const WaveformSegment& segment : waveform.waveform) {
+                if (segment.endIndex < sweepOffset || segment.startIndex >= sweepOffset + sweepValues.size()) {
+                    continue;
+                }
+                WaveformSegment shifted(segment);
+                shifted.startIndex = static_cast<unsigned int>(std::max<uint64_t>(segment.startIndex, sweepOffset) - sweepOffset);
+                shifted.endIndex = static_cast<unsigned int>(segment.endIndex - sweepOffset);
+                sweepWaveform.waveform.push_back(shifted);
+            }
+            if (sweepWaveform.waveform.empty()) {
+                return;
+            }
+
+            SignalProcessing::SweepAnalysis analysis(sweepWaveform, voltageClamp, samplingRate);
+            SignalProcessing::SweepAnalysisResult result;
+            SignalProcessing::SweepAnalysis::Scratch scratch;
+            analysis.analyze(sweepValues, result, scratch);
+            const SignalProcessing::SegmentAnalysis& first = result.segments.front();
+            if (!first.dcValid) {
+                return;
+            }
+            sweep.baseline = first.steadyState;
+            bool maxIsPeak = std::abs(sweep.measuredMax - sweep.baseline) >= std::abs(sweep.measuredMin - sweep.baseline);
+            sweep.peak = maxIsPeak ? sweep.measuredMax : sweep.measuredMin;
+
+            // Over the same samples as the baseline
+            const WaveformSegment& element = sweepWaveform.waveform.front();
+            double sumSquares = 0;
+            std::size_t count = 0;
+            std::size_t windowEnd = std::min<std::size_t>(sweepValues.size(), element.endIndex);
+            for (std::size_t j = element.startIndex + (element.endIndex - element.startIndex) / 2; j < windowEnd; j++) {
+                if (!std::isnan(sweepValues[j])) {
+                    sumSquares += (sweepValues[j] - sweep.baseline) * (sweepValues[j] - sweep.baseline);
+                    count++;
+                }
+            }
+            sweep.noiseRms = std::sqrt(sumSquares / count);
+
+            sweep.steadyState = sweep.baseline;
+            for (std::size_t i = result.segments.size(); i-- > 1; ) {
+                if (result.segments[i].dcValid && sweepWaveform.waveform[i].appliedValue != element.appliedValue) {
+                    sweep.steadyState = result.segments[i].steadyState;
+                    break;
+                }
+            }
+            sweep.Ra = result.Ra;
+            sweep.Rm = result.Rm;
+            sweep.Cm = result.Cm;
+        }
+
+        // Writes the sweep index of the file at path, which is being closed
+        void SaveFile::writeSweepIndex(const FILENAME& path) {
+            if (!sweeps.empty()) {
+                finishSweep();
+            }
+            std::ofstream out(sweepIndexPath(path).c_str());
+            out.precision(9);
+            out << "sweep,first_timestamp,last_timestamp,first_record,records,byte_offset,valid_records,measured_min,measured_max,measured_mean,"
+                << "baseline,noise_rms,peak,steady_state,Ra,Rm,Cm\n";
+            for (const SweepIndexEntry& sweep : sweeps) {
+                out << sweep.sweep << "," << sweep.firstTimestamp << "," << sweep.lastTimestamp << "," << sweep.firstRecord << ","
+                    << sweep.records << "," << sweep.offset << "," << sweep.validRecords << "," << sweep.measuredMin << ","
+                    << sweep.measuredMax << "," << sweep.measuredMean << "," << sweep.baseline << "," << sweep.noiseRms << ","
+                    << sweep.peak << "," << sweep.steadyState << "," << sweep.Ra << "," << sweep.Rm << "," << sweep.Cm << "\n";
+            }
+            sweeps.clear();
+            if (!out) {
+                throw runtime_error("Couldn't write the save file's sweep index");
+            }
+        }
+
+        void SaveFile::writeCompactData(const vector<uint32_t>& timestamps, const vector<Sample>& measuredData, const vector<Sample>& clampValues, unsigned int first, unsigned int end) {
+            unsigned int numRecords = end - first;
+
+            if (format == CHUNKED_RECORDS) {
+                for (unsigned int i = 0; i < numRecords; i++) {
+                    double measured = measuredData[first + i];
+                    double clamp = clampValues[first + i];
+                    appendToChunk(timestamps[first + i],
+                                  std::isnan(measured) ? INVALID_MEASURED_CODE : static_cast<int32_t>(std::lround((measured - scaling.measuredOffset) / scaling.measuredScale)),
+                                  std::isnan(clamp) ? INVALID_CLAMP_CODE : static_cast<int16_t>(std::lround(clamp / scaling.clampScale)));
+                }
+                return;
+            }
+
+            // Stored as their unsigned bit patterns, since that's what BinaryWriter records hold
+            vector<uint32_t> measuredCodes(numRecords);
+            vector<uint16_t> clampCodes(numRecords);
+            for (unsigned int i = 0; i < numRecords; i++) {
+                double measured = measuredData[first + i];
+                int32_t code = std::isnan(measured) ? INVALID_MEASURED_CODE : static_cast<int32_t>(std::lround((measured - scaling.measuredOffset) / scaling.measuredScale));
+                measuredCodes[i] = static_cast<uint32_t>(code);
+
+                double clamp = clampValues[first + i];
+                int16_t clampCode = std::isnan(clamp) ? INVALID_CLAMP_CODE : static_cast<int16_t>(std::lround(clamp / scaling.clampScale));
+                clampCodes[i] = static_cast<uint16_t>(clampCode);
+            }
+
+            // Each record is: timestamp, measured code, clamp code
+            BinaryColumn columns[] = {
+                BinaryColumn(timestamps.data() + first),
+                BinaryColumn(measuredCodes.data()),
+                BinaryColumn(clampCodes.data())
+            };
+            file->writeRecords(columns, 3, numRecords);
+        }
+
+        void SaveFile::appendToChunk(uint32_t timestamp, int32_t measuredCode, int16_t clampCode) {
+            pendingChunk.timestamps.push_back(timestamp);
+            pendingChunk.measuredCodes.push_back(measuredCode);
+            pendingChunk.clampCodes.push_back(clampCode);
+            if (pendingChunk.size() >= CHUNK_RECORDS) {
+                flushChunk();
+            }
+        }
+
+        // Writes the pending chunk and pushes it to disk, so a crash loses at most the chunk being accumulated.
+        void SaveFile::flushChunk() {
+            if (pendingChunk.size() == 0) {
+                return;
+            }
+
+            ChunkIndexEntry entry;
+            entry.offset = file->position();
+            entry.firstTimestamp = pendingChunk.timestamps.front();
+            entry.numRecords = pendingChunk.size();
+            chunkIndex.push_back(entry);
+
+            writeChunk(*file, pendingChunk, chunkPayload);
+            file->flush();
+
+            pendingChunk.clear();
+        }
 
-            unsigned int size = timestamps.size();
-            for (unsigned int i = 0; i < size; i++) {
-                *file << timestamps[i];
-                *file << applied[i];
-				*file << clampValues[i];
-                *file << measuredData[i];
+        void SaveFile::writeChunkIndex() {
+            IO::writeChunkIndex(*file, chunkIndex, file->position());
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// \cond private
+        // Writes a chunk (header and payload), compressed unless that doesn't make it smaller; payload is scratch space
+        void writeChunk(BinaryWriter& out, const Chunk& chunk, vector<char>& payload) {
+            ChunkEncoding encoding = CHUNK_DELTA_VARINT;
+            encodeChunk(chunk, encoding, payload);
+            std::size_t rawSize = chunk.size() * (sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t));
+            if (payload.size() >= rawSize) {
+                encoding = CHUNK_RAW;
+                encodeChunk(chunk, encoding, payload);
             }
+
+            out << (uint32_t)DATA_FILE_CHUNK_MAGIC_NUMBER;
+            out << (uint32_t)chunk.size();
+            out << chunk.timestamps.front();
+            out << (uint8_t)encoding;
+            out << (uint32_t)payload.size();
+            out << chunkChecksum(reinterpret_cast<const unsigned char*>(payload.data()), payload.size());
+            out.writeBytes(payload.data(), payload.size());
         }
 
-		void SaveFile::writeDataAux(const vector<uint32_t>& timestamps, const vector<vector<uint16_t>>& adcs, int numAdcs, const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts) {
+        // Writes the index of chunks and the footer; indexOffset is where in the file the index starts
+        void writeChunkIndex(BinaryWriter& out, const vector<ChunkIndexEntry>& index, uint64_t indexOffset) {
+            out << (uint32_t)DATA_FILE_INDEX_MAGIC_NUMBER;
+            out << (uint32_t)index.size();
+            for (const ChunkIndexEntry& entry : index) {
+                out << entry.offset;
+                out << entry.firstTimestamp;
+                out << entry.numRecords;
+            }
+            out << indexOffset;
+            out << (uint32_t)DATA_FILE_FOOTER_MAGIC_NUMBER;
+        }
+
+        void Chunk::clear() {
+            timestamps.clear();
+            measuredCodes.clear();
+            clampCodes.clear();
+        }
+
+        static void putVarint(vector<char>& out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        static bool getVarint(const unsigned char*& p, const unsigned char* end, uint64_t& value) {
+            value = 0;
+            for (unsigned int shift = 0; shift < 64; shift += 7) {
+                if (p >= end) {
+                    return false;
+                }
+                uint8_t byte = *p++;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Zigzag encoding maps small negative and positive deltas to small unsigned values
+        static uint64_t zigzag(int64_t value) {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        static int64_t unzigzag(uint64_t value) {
+            return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+        }
+
+        template <typename T>
+        static void putRaw(vector<char>& out, T value) {
+            const char* p = reinterpret_cast<const char*>(&value);
+            out.insert(out.end(), p, p + sizeof(T));
+        }
+
+        template <typename T>
+        static void putDeltas(vector<char>& out, const vector<T>& values, int64_t previous) {
+            for (T value : values) {
+                putVarint(out, zigzag(static_cast<int64_t>(value) - previous));
+                previous = value;
+            }
+        }
+
+        template <typename T>
+        static bool getDeltas(const unsigned char*& p, const unsigned char* end, vector<T>& values, uint32_t numRecords, int64_t previous) {
+            values.resize(numRecords);
+            for (uint32_t i = 0; i < numRecords; i++) {
+                uint64_t v;
+                if (!getVarint(p, end, v)) {
+                    return false;
+                }
+                previous += unzigzag(v);
+                values[i] = static_cast<T>(previous);
+            }
+            return true;
+        }
+
+        /** \brief Encode the payload of a chunk.
+         *
+         *  \param[in] chunk      Chunk to encode
+         *  \param[in] encoding   How to encode it
+         *  \param[out] payload   Encoded bytes
+         */
+        void encodeChunk(const Chunk& chunk, ChunkEncoding encoding, vector<char>& payload) {
+            payload.clear();
+            if (chunk.size() == 0) {
+                return;
+            }
+            if (encoding == CHUNK_RAW) {
+                payload.reserve(chunk.size() * (sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t)));
+                for (uint32_t t : chunk.timestamps) {
+                    putRaw(payload, t);
+                }
+                for (int32_t m : chunk.measuredCodes) {
+                    putRaw(payload, m);
+                }
+                for (int16_t c : chunk.clampCodes) {
+                    putRaw(payload, c);
+                }
+            }
+            else {
+                // Timestamps usually step by 1, and clamp codes rarely change, so most deltas fit in a single byte
+                putDeltas(payload, chunk.timestamps, chunk.timestamps.front());
+                putDeltas(payload, chunk.measuredCodes, 0);
+                putDeltas(payload, chunk.clampCodes, 0);
+            }
+        }
+
+        /** \brief Decode the payload of a chunk.
+         *
+         *  \param[in] payload         Encoded bytes
+         *  \param[in] len             Number of encoded bytes
+         *  \param[in] encoding        How the payload was encoded
+         *  \param[in] firstTimestamp  First timestamp, from the chunk header
+         *  \param[in] numRecords      Number of records, from the chunk header
+         *  \param[out] chunk          Decoded records
+         *  \returns False if the payload is malformed
+         */
+        bool decodeChunk(const unsigned char* payload, std::size_t len, ChunkEncoding encoding, uint32_t firstTimestamp, uint32_t numRecords, Chunk& chunk) {
+            const unsigned char* p = payload;
+            const unsigned char* end = payload + len;
+            if (encoding == CHUNK_RAW) {
+                std::size_t expected = static_cast<std::size_t>(numRecords) * (sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t));
+                if (len != expected) {
+                    return false;
+                }
+                chunk.timestamps.resize(numRecords);
+                chunk.measuredCodes.resize(numRecords);
+                chunk.clampCodes.resize(numRecords);
+                if (numRecords > 0) {
+                    std::memcpy(chunk.timestamps.data(), p, numRecords * sizeof(uint32_t));
+                    p += numRecords * sizeof(uint32_t);
+                    std::memcpy(chunk.measuredCodes.data(), p, numRecords * sizeof(int32_t));
+                    p += numRecords * sizeof(int32_t);
+                    std::memcpy(chunk.clampCodes.data(), p, numRecords * sizeof(int16_t));
+                }
+                return true;
+            }
+            if (encoding == CHUNK_DELTA_VARINT) {
+                return getDeltas(p, end, chunk.timestamps, numRecords, firstTimestamp) &&
+                       getDeltas(p, end, chunk.measuredCodes, numRecords, 0) &&
+                       getDeltas(p, end, chunk.clampCodes, numRecords, 0) &&
+                       (p == end);
+            }
+            return false;
+        }
+
+        /// Adler-32 checksum, used to detect chunks (and journal blocks) that were only partially written
+        uint32_t chunkChecksum(const unsigned char* data, std::size_t len) {
+            uint32_t a = 1;
+            uint32_t b = 0;
+            while (len > 0) {
+                // The sums are reduced every 5552 bytes, the most that can't overflow b
+                std::size_t n = std::min<std::size_t>(len, 5552);
+                len -= n;
+                for (; n > 0; n--) {
+                    a += *data++;
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+            }
+            return (b << 16) | a;
+        }
+        /// \endcond
+
+		void SaveFile::writeDataAux(const vector<uint32_t>& timestamps, const vector<vector<uint16_t>>& adcs, int numAdcs, const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts, unsigned int first) {
 			bool sizesMatch = (adcs[0].size() == timestamps.size());  // If we were being really pedantic, we'd do a loop and check adcs[i] for all i
 
-			unsigned int size = timestamps.size();
-			for (unsigned int i = 0; i < size; i++) {
-				*file << timestamps[i];
-				*file << digIns[i];
-				*file << digOuts[i];
+			if (first >= timestamps.size()) {
+				return;
+			}
+
+			if (nwb) {
+				nwb->writeDataAux(timestamps, adcs, numAdcs, digIns, digOuts, first);
+				return;
+			}
+			if (!rollover.isEnabled()) {
+				writeRecordsAux(timestamps, adcs, numAdcs, digIns, digOuts, first, timestamps.size());
+				checkpointIfDue();
+				return;
+			}
+
+			while (first < timestamps.size()) {
+				unsigned int end = segmentEnd(timestamps, first);
+				if (end == first) {
+					startSegment();
+					continue;
+				}
+				writeRecordsAux(timestamps, adcs, numAdcs, digIns, digOuts, first, end);
+				addToSegment(timestamps, first, end);
+				first = end;
+			}
+			checkpointIfDue();
+		}
+
+		void SaveFile::writeRecordsAux(const vector<uint32_t>& timestamps, const vector<vector<uint16_t>>& adcs, int numAdcs, const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts, unsigned int first, unsigned int end) {
+			if (auxFormat == AUX_EVENTS) {
+				writeAuxEvents(timestamps, adcs, numAdcs, digIns, digOuts, first, end);
+				return;
+			}
+
+			// Each record is: timestamp, digital in, digital out, ADCs
+			vector<BinaryColumn> columns;
+			columns.reserve(3 + numAdcs);
+			columns.push_back(BinaryColumn(timestamps.data() + first));
+			columns.push_back(BinaryColumn(digIns.data() + first));
+			columns.push_back(BinaryColumn(digOuts.data() + first));
+			for (int adc = 0; adc < numAdcs; adc++) {
+				columns.push_back(BinaryColumn(adcs[adc].data() + first));
+			}
+			file->writeRecords(columns.data(), columns.size(), end - first);
+		}
+
+		// Writes samples [first, end) as runs of consecutive timestamps, each followed by the digital changes in it
+		void SaveFile::writeAuxEvents(const vector<uint32_t>& timestamps, const vector<vector<uint16_t>>& adcs, int numAdcs, const vector<uint16_t>& digIns, const vector<uint16_t>& digOuts, unsigned int first, unsigned int end) {
+			unsigned int runStart = first;
+			for (unsigned int i = first + 1; i <= end; i++) {
+				if (i < end && timestamps[i] == timestamps[i - 1] + 1) {
+					continue;
+				}
+
+				*file << (uint8_t)AUX_ITEM_RUN << timestamps[runStart] << (uint32_t)(i - runStart);
+				auxColumns.clear();
 				for (int adc = 0; adc < numAdcs; adc++) {
-					*file << adcs[adc][i];
+					if (auxAdcMask & (1u << adc)) {
+						auxColumns.push_back(BinaryColumn(adcs[adc].data() + runStart));
+					}
+				}
+				if (!auxColumns.empty()) {
+					file->writeRecords(auxColumns.data(), static_cast<unsigned int>(auxColumns.size()), i - runStart);
+				}
+
+				writeDigitalEvents(digIns, lastDigIn, 0, timestamps, runStart, i);
+				writeDigitalEvents(digOuts, lastDigOut, 1, timestamps, runStart, i);
+				digitalKnown = true;
+				runStart = i;
+			}
+		}
+
+		// Writes an event for each sample in [first, end) where line's value differs from the one before (and for the first sample of the file)
+		void SaveFile::writeDigitalEvents(const vector<uint16_t>& values, uint16_t& last, uint8_t line, const vector<uint32_t>& timestamps, unsigned int first, unsigned int end) {
+			bool known = digitalKnown;
+			for (unsigned int i = first; i < end; i++) {
+				if (known && values[i] == last) {
+					continue;
 				}
+				*file << (uint8_t)AUX_ITEM_EVENT << timestamps[i] << line << values[i];
+				last = values[i];
+				known = true;
 			}
 		}
     }
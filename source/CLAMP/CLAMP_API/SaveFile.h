@@ -1,14 +1,37 @@
 #pragma once
 
+#include <chrono>
 #include <string>
+#include <limits>
 #include <memory>
 #include <vector>
 
 #include "streams.h"
+#include "Constants.h"
 #include "ClampController.h"
 #include "SimplifiedWaveform.h"
 
 class BinaryWriter;
+
+// Saved data file constants
+#define DATA_FILE_MAGIC_NUMBER  0xf3b1a481
+#define DATA_FILE_MAIN_VERSION_NUMBER  1
+#define DATA_FILE_SECONDARY_VERSION_NUMBER  0
+// Headstage files in SaveFile::COMPACT_RECORDS format; see CompactScaling
+#define DATA_FILE_COMPACT_MAIN_VERSION_NUMBER  2
+// Headstage files in SaveFile::CHUNKED_RECORDS format; see Chunk
+#define DATA_FILE_CHUNKED_MAIN_VERSION_NUMBER  3
+// Aux files in SaveFile::AUX_EVENTS format; see AuxItemType
+#define DATA_FILE_AUX_EVENTS_MAIN_VERSION_NUMBER  2
+// Files with several channels and the aux I/O in one; see MultiplexedSaveFile
+#define DATA_FILE_MULTIPLEXED_MAIN_VERSION_NUMBER  4
+#define DATA_FILE_MULTIPLEXED_KIND  2
+#define DATA_FILE_CHUNK_MAGIC_NUMBER  0x4b4e4843  // "CHNK"
+#define DATA_FILE_INDEX_MAGIC_NUMBER  0x58444943  // "CIDX"
+#define DATA_FILE_FOOTER_MAGIC_NUMBER  0x444e4543  // "CEND"
+// Save files written as a journal; see JournalOutStream
+#define DATA_FILE_JOURNAL_MAGIC_NUMBER  0x4c4e524a  // "JRNL"
+
 namespace CLAMP {
     class Board;
 
@@ -141,10 +164,110 @@ namespace CLAMP {
         bool operator>=(const Version& a, const Version& b);
 
 
+        /** \brief Scale factors for the integer samples in a compact (version 2) save file.
+         *
+         *  Each sample is stored as integer codes; the values are:
+         *  \code
+              measured = measuredCode * measuredScale + measuredOffset
+              clamp    = clampCode * clampScale
+         *  \endcode
+         *  measuredScale is one step of the ADC at the mux, converted to amps (voltage clamp) or volts (current
+         *  clamp), so the codes are the mux values.  clampScale is the clamp voltage or current step, so the codes are
+         *  the values sent in the MOSI commands.  The scale factors are stored at full double precision.
+         */
+        struct CompactScaling {
+            /// Measured value per code (A in voltage clamp mode, V in current clamp mode)
+            double measuredScale;
+            /// Offset added to measured values (e.g., the pipette offset in current clamp mode)
+            double measuredOffset;
+            /// Clamp value per code (V in voltage clamp mode, A in current clamp mode)
+            double clampScale;
+
+            CompactScaling();
+
+            unsigned int onDiskSize() const;
+            friend BinaryWriter& operator<<(BinaryWriter& out, const CompactScaling& scaling);
+        };
+
+        /// \cond private
+        /** \brief One chunk of a chunked (version 3) save file, decoded.
+         *
+         *  On disk, each chunk is self-contained:
+         *  \code
+              uint32  DATA_FILE_CHUNK_MAGIC_NUMBER
+              uint32  number of records
+              uint32  first timestamp
+              uint8   encoding (ChunkEncoding)
+              uint32  payload size, in bytes
+              uint32  checksum of the payload
+              ...     payload
+         *  \endcode
+         *  When the file is closed, an index of all chunks (DATA_FILE_INDEX_MAGIC_NUMBER, count, then offset/first
+         *  timestamp/number of records for each chunk) is appended, followed by a footer (offset of the index,
+         *  DATA_FILE_FOOTER_MAGIC_NUMBER).  If the file wasn't closed cleanly, readers can recover every complete chunk by
+         *  scanning from the end of the header.
+         */
+        struct Chunk {
+            std::vector<uint32_t> timestamps;
+            std::vector<int32_t> measuredCodes;
+            std::vector<int16_t> clampCodes;
+
+            void clear();
+            std::size_t size() const { return timestamps.size(); }
+        };
+
+        enum ChunkEncoding {
+            CHUNK_RAW = 0,          // Columns of uint32 timestamps, int32 measured codes, int16 clamp codes
+            CHUNK_DELTA_VARINT = 1  // Each column delta-encoded, then zigzag varint-encoded
+        };
+
+        // Size of everything in a chunk before the payload
+        const unsigned int CHUNK_HEADER_SIZE = 5 * sizeof(uint32_t) + sizeof(uint8_t);
+
+        struct ChunkIndexEntry {
+            uint64_t offset;
+            uint32_t firstTimestamp;
+            uint32_t numRecords;
+        };
+
+        // Codes used for NaN values (e.g., when the mux was reading temperature)
+        const int32_t INVALID_MEASURED_CODE = std::numeric_limits<int32_t>::min();
+        const int16_t INVALID_CLAMP_CODE = std::numeric_limits<int16_t>::min();
+
+        void encodeChunk(const Chunk& chunk, ChunkEncoding encoding, std::vector<char>& payload);
+        bool decodeChunk(const unsigned char* payload, std::size_t len, ChunkEncoding encoding, uint32_t firstTimestamp, uint32_t numRecords, Chunk& chunk);
+        uint32_t chunkChecksum(const unsigned char* data, std::size_t len);
+        void writeChunk(BinaryWriter& out, const Chunk& chunk, std::vector<char>& payload);
+        void writeChunkIndex(BinaryWriter& out, const std::vector<ChunkIndexEntry>& index, uint64_t indexOffset);
+
+        /** \brief Items in the body of an aux file in SaveFile::AUX_EVENTS (version 2) format.
+         *
+         *  The body is a sequence of items, each starting with its type:
+         *  \code
+              uint8   AUX_ITEM_RUN
+              uint32  first timestamp
+              uint32  number of samples n; their timestamps are consecutive
+              uint16  value of each stored ADC (see AuxHeaderData::adcMask), in order, for each of the n samples
+
+              uint8   AUX_ITEM_EVENT
+              uint32  timestamp of the sample where the value changed, which is in the run before the event
+              uint8   line: 0 for the digital inputs, 1 for the digital outputs
+              uint16  new value
+         *  \endcode
+         *  The first run of each file (or segment) is followed by an event for each line, giving its value at the first
+         *  sample.  SaveFileReader::readAuxRecords() turns these back into one value per sample.
+         */
+        enum AuxItemType {
+            AUX_ITEM_RUN = 1,
+            AUX_ITEM_EVENT = 2
+        };
+        /// \endcond
+
         /// Data that is stored in the header of a save file
         struct HeaderData {
         private:
             CLAMP::Board& board;
+            CLAMP::ClampConfig::ChipChannel index;
 
         public:
             /// Version
@@ -154,9 +277,15 @@ namespace CLAMP {
             TimeDate timestamp;
             /// Settings that control the waveform that was run
             Settings settings;
+            /// Scale factors; only written for version 2 (compact) files
+            CompactScaling compactScaling;
 
             HeaderData(CLAMP::Board& b, const CLAMP::ClampConfig::ChipChannel& index);
 
+            void computeCompactScaling();
+            /// Channel the header describes
+            const CLAMP::ClampConfig::ChipChannel& getChannel() const { return index; }
+
             friend BinaryWriter& operator<<(BinaryWriter& out, const HeaderData& header);
         };
 
@@ -170,6 +299,8 @@ namespace CLAMP {
 
 			/// Number of ADCs
 			int numAdcs;
+			/// ADCs whose values are stored (bit i for ADC i); only written for version 2 (SaveFile::AUX_EVENTS) files
+			uint16_t adcMask;
 
 			/// Time stamp when the data file was started
 			TimeDate timestamp;
@@ -181,26 +312,209 @@ namespace CLAMP {
 			friend BinaryWriter& operator<<(BinaryWriter& out, const AuxHeaderData& header);
 		};
 
+        /// One sweep of a save file, as listed in its sweep index; see SaveFile::setSweepIndex()
+        struct SweepIndexEntry {
+            uint64_t sweep;          ///< Number of the sweep in the recording, counting from 0
+            uint32_t firstTimestamp; ///< Timestamp of its first record
+            uint32_t lastTimestamp;  ///< Timestamp of its last record
+            uint64_t firstRecord;    ///< Index of its first record in the file
+            uint64_t records;        ///< Number of records
+            uint64_t offset;         ///< Byte offset of its first record in the file; 0 for CHUNKED_RECORDS (see SaveFileReader::findChunk())
+            uint64_t validRecords;   ///< Records whose measured value isn't NaN
+            double measuredMin;      ///< Smallest valid measured value; NaN if there are none
+            double measuredMax;      ///< Largest valid measured value; NaN if there are none
+            double measuredMean;     ///< Mean of the valid measured values; NaN if there are none
+
+            /** \name Summary
+             *
+             *  Calculated as the sweep is written, from the header's waveform, as SignalProcessing::SweepAnalysis does;
+             *  NaN if the file has no waveform, or the sweep doesn't reach far enough into it.
+             */
+            //@{
+            double baseline;         ///< Steady state of the first segment (the mean of its second half)
+            double noiseRms;         ///< RMS deviation from baseline over the second half of the first segment
+            double peak;             ///< Valid measured value farthest from baseline
+            double steadyState;      ///< Steady state of the last segment applying a different value than the first; else baseline
+            double Ra;               ///< Access resistance, in voltage clamp (see SweepAnalysisResult)
+            double Rm;               ///< Membrane resistance, likewise
+            double Cm;               ///< Membrane capacitance, likewise
+            //@}
+
+            SweepIndexEntry();
+        };
+
+        class NWBFile;
+        class JournalOutStream;
+
         /** \brief A CLAMP save file
          *
-         *  Right now, we only have a single file format.  If the software is modified to support multiple formats,
-         *  this class should become an abstract base class, the members should become virtual, and the subclasses
-         *  should implement open(), close(), writeHeader(), and writeData() in their own formats.
+         *  Headstage files can be written in one of several record formats (see Format); aux files always use the same one.
+         *  If the software is modified to support substantially different formats, this class should become an abstract
+         *  base class, the members should become virtual, and the subclasses should implement open(), close(),
+         *  writeHeader(), and writeData() in their own formats.
+         *
+         *  A long recording can be split into several files (segments) by size or duration; see setRollover().  Files
+         *  can be written as journals, which can be recovered up to a few seconds before a crash; see setJournal().
+         *  Headstage files can have a sweep index, so a reader can go straight to any sweep; see setSweepIndex().
          */
         class SaveFile {
         public:
-            SaveFile();
+            /// Record format for headstage data
+            enum Format {
+                /// Version 1: timestamp, applied, clamp value, measured value as uint32 + 3 floats (16 bytes per sample)
+                FLOAT_RECORDS,
+                /** \brief Version 2: timestamp, measured code, clamp code as uint32 + int32 + int16 (10 bytes per sample).
+                 *
+                 *  The applied value is omitted, since it's described by the waveform in the header.  See CompactScaling.
+                 */
+                COMPACT_RECORDS,
+                /** \brief Version 3: the same codes as COMPACT_RECORDS, grouped into fixed-size, self-contained chunks.
+                 *
+                 *  Each chunk is compressed (delta + varint) unless that doesn't make it smaller, and a trailing index of
+                 *  chunk offsets and first timestamps allows seeking without reading the whole file.  See Chunk.
+                 */
+                CHUNKED_RECORDS,
+                /** \brief An NWB 2 (HDF5) file instead of a .clp file, for headstage and aux files alike.  See NWBFile.
+                 *
+                 *  Only available in builds with HDF5 (see NWBFile::isAvailable()); otherwise open() throws.
+                 */
+                NWB_RECORDS
+            };
+
+            /// Record format for aux files; see setAuxFormat()
+            enum AuxFormat {
+                /// Version 1: timestamp, digital in, digital out, and every ADC as uint16 (8 + 2 * numAdcs bytes per sample)
+                AUX_RECORDS,
+                /** \brief Version 2: the digital I/O as change events, and only the selected ADCs.  See AuxItemType.
+                 *
+                 *  Without ADCs, a recording's aux file is a few bytes per digital change, plus a few per writeDataAux().
+                 */
+                AUX_EVENTS
+            };
+
+            /// Number of records per chunk in CHUNKED_RECORDS files
+            static const unsigned int CHUNK_RECORDS = 16384;
+
+            /// When to start a new segment of a long recording; see setRollover()
+            struct RolloverPolicy {
+                /// Start a new segment rather than let one grow past this many bytes; 0 for no size limit
+                uint64_t maxBytes;
+                /// Start a new segment once one spans this long, by its timestamps, in seconds; 0 for no time limit
+                double maxSeconds;
+                /// Reserve each segment's disk space when it's opened (see setRollover())
+                bool preallocate;
+
+                RolloverPolicy() : maxBytes(0), maxSeconds(0), preallocate(true) {}
+                /// True if recordings are split at all
+                bool isEnabled() const { return maxBytes > 0 || maxSeconds > 0; }
+            };
+
+            /// One segment of a split recording, as listed in its manifest
+            struct Segment {
+                FILENAME path;
+                uint32_t firstTimestamp; ///< Timestamp of its first record
+                uint32_t lastTimestamp;  ///< Timestamp of its last record
+                uint64_t records;        ///< Number of records
+                uint64_t bytes;          ///< File size; only known once it's complete
+                bool complete;           ///< Closed, so it won't change again (e.g., it can be uploaded)
+
+                Segment() : firstTimestamp(0), lastTimestamp(0), records(0), bytes(0), complete(false) {}
+            };
+
+            SaveFile(Format format_ = FLOAT_RECORDS);
             ~SaveFile();
-            void open(const FILENAME& path);
+            void setRollover(const RolloverPolicy& policy);
+            void setDirectIO(bool enable);
+            void setJournal(double checkpointSeconds);
+            void setAuxFormat(AuxFormat auxFormat_, unsigned int adcMask = 0xff);
+            void setSweepIndex(bool enable);
+            void startSweep();
+            /// Segments written so far, if the recording is being split; the last one is being written
+            const std::vector<Segment>& getSegments() const { return segments; }
+            static FILENAME segmentPath(const FILENAME& path, unsigned int index);
+            static FILENAME manifestPath(const FILENAME& path);
+            static FILENAME sweepIndexPath(const FILENAME& path);
+            void open(const FILENAME& path, bool async = false);
             void close();
             void writeHeader(HeaderData& header);
 			void writeHeaderAux(AuxHeaderData& auxHeader);
-            void writeData(const std::vector<uint32_t>& timestamps, const std::vector<double>& measuredData, const std::vector<double>& clampValues);
-			void writeDataAux(const std::vector<uint32_t>& timestamps, const std::vector<std::vector<uint16_t>>& adcs, int numAdcs, const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts);
+            void writeData(const std::vector<uint32_t>& timestamps, const std::vector<Sample>& measuredData, const std::vector<Sample>& clampValues, unsigned int first = 0);
+			void writeDataAux(const std::vector<uint32_t>& timestamps, const std::vector<std::vector<uint16_t>>& adcs, int numAdcs, const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts, unsigned int first = 0);
 
         private:
             std::unique_ptr<BinaryWriter> file;
+            std::unique_ptr<NWBFile> nwb; // Instead of file, for NWB_RECORDS
             CLAMP::SimplifiedWaveform waveform;
+            std::vector<double> appliedValues; // FLOAT_RECORDS: the applied column of the records being written
+            Format format;
+            CompactScaling scaling;
+
+            // Rollover state
+            RolloverPolicy rollover;
+            FILENAME basePath;              // Path given to open(); the segments and manifest are named after it
+            bool asyncMode;
+            bool directIO;                  // Write through DirectFileOutStream; see setDirectIO()
+            std::vector<char> headerBytes;  // Written again at the start of each segment
+            double samplingRate;
+            unsigned int recordBytes;       // Size of a record (an upper bound for CHUNKED_RECORDS)
+            std::vector<Segment> segments;
+
+            // AUX_EVENTS state
+            AuxFormat auxFormat;
+            unsigned int auxAdcMask;
+            bool digitalKnown;              // False until the first sample of a file (or segment) has been written
+            uint16_t lastDigIn;
+            uint16_t lastDigOut;
+            std::vector<BinaryColumn> auxColumns;
+            void writeAuxEvents(const std::vector<uint32_t>& timestamps, const std::vector<std::vector<uint16_t>>& adcs, int numAdcs, const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts, unsigned int first, unsigned int end);
+            void writeDigitalEvents(const std::vector<uint16_t>& values, uint16_t& last, uint8_t line, const std::vector<uint32_t>& timestamps, unsigned int first, unsigned int end);
+
+            // Journal state; see setJournal()
+            double journalSeconds;          // 0 if the file isn't a journal
+            JournalOutStream* journal;      // The stream under file, if it's a journal
+            std::chrono::steady_clock::time_point lastCheckpoint;
+            void checkpoint();
+            void checkpointIfDue();
+
+            // Sweep index state; see setSweepIndex()
+            bool sweepIndexEnabled;
+            uint64_t sweepPeriod;           // Timesteps per repetition of the waveform; 0 if there's no waveform
+            uint64_t repetitionStart;       // First timestep of the repetition the current sweep is in
+            bool sweepPending;              // startSweep() was called since the last record
+            uint64_t sweepCount;            // Sweeps started in the recording
+            uint64_t fileRecords;           // Records written to the file being written
+            double measuredSum;             // Of the current sweep's valid measured values
+            bool summarizing;               // Summarizing each sweep: there's a sweep index and a waveform
+            bool voltageClamp;              // From the header, for the summaries
+            uint64_t sweepOffset;           // Timestep in the repetition that the current sweep starts at
+            uint64_t sweepFirstTimestep;    // Timestamp it starts at
+            std::vector<double> sweepValues; // Its measured values so far, by timestep from its start
+            CLAMP::SimplifiedWaveform sweepWaveform; // The part of the waveform it covers, from its start
+            std::vector<SweepIndexEntry> sweeps; // Of the file being written
+            void indexSweeps(const std::vector<uint32_t>& timestamps, const std::vector<Sample>& measuredData, unsigned int first, unsigned int end);
+            void finishSweep();
+            void summarizeSweep(SweepIndexEntry& sweep);
+            void writeSweepIndex(const FILENAME& path);
+
+            void openStream(const FILENAME& path);
+            void writeHeaderBytes();
+            void startSegment();
+            unsigned int segmentEnd(const std::vector<uint32_t>& timestamps, unsigned int first);
+            void addToSegment(const std::vector<uint32_t>& timestamps, unsigned int first, unsigned int end);
+            void closeSegment();
+            void writeManifest() const;
+
+            // CHUNKED_RECORDS state
+            Chunk pendingChunk;
+            std::vector<ChunkIndexEntry> chunkIndex;
+            std::vector<char> chunkPayload;
+            void appendToChunk(uint32_t timestamp, int32_t measuredCode, int16_t clampCode);
+            void flushChunk();
+            void writeChunkIndex();
+
+            void writeRecords(const std::vector<uint32_t>& timestamps, const std::vector<Sample>& measuredData, const std::vector<Sample>& clampValues, unsigned int first, unsigned int end);
+            void writeCompactData(const std::vector<uint32_t>& timestamps, const std::vector<Sample>& measuredData, const std::vector<Sample>& clampValues, unsigned int first, unsigned int end);
+            void writeRecordsAux(const std::vector<uint32_t>& timestamps, const std::vector<std::vector<uint16_t>>& adcs, int numAdcs, const std::vector<uint16_t>& digIns, const std::vector<uint16_t>& digOuts, unsigned int first, unsigned int end);
         };
     }
 }
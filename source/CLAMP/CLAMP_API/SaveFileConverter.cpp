@@ -0,0 +1,358 @@
+#include "SaveFileConverter.h"
+#include "SaveJournal.h"
+#include "Constants.h"
+#include "streams.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::function;
+using std::runtime_error;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace IO {
+        /// \cond private
+        // Records per block when the source isn't chunked; the same as SaveFile's chunks, so a chunked output matches
+        static const std::size_t BLOCK_RECORDS = SaveFile::CHUNK_RECORDS;
+
+        // How far from a whole code a value from a float file may be and still count as that code.  Float rounding
+        // alone stays under 0.01 code for any value the hardware can produce.
+        static const double CODE_TOLERANCE = 0.1;
+
+        // A block of records on its way from the source to the destination
+        struct SaveFileConverter::Block {
+            Chunk codes;
+            std::vector<double> values;  // Float sources: scratch space for one column
+            std::vector<char> payload;   // Chunked destinations: scratch space for the encoded chunk
+            std::vector<char> bytes;     // The block, encoded as the destination expects it
+        };
+
+        static uint64_t fileSize(const FILENAME& path) {
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            return in ? static_cast<uint64_t>(in.tellg()) : 0;
+        }
+
+        static void removeFile(const FILENAME& path) {
+#if defined(_WIN32) && defined(_UNICODE)
+            _wremove(path.c_str());
+#else
+            std::remove(path.c_str());
+#endif
+        }
+
+        static void copyFile(const FILENAME& source, const FILENAME& destination) {
+            std::ifstream in(source, std::ios::binary);
+            if (!in) {
+                throw runtime_error("Couldn't open the source file");
+            }
+            FileOutStream out;
+            out.open(destination);
+            vector<char> buffer(1024 * KILO);
+            while (in) {
+                in.read(buffer.data(), buffer.size());
+                if (in.gcount() > 0) {
+                    out.write(buffer.data(), static_cast<int>(in.gcount()));
+                }
+            }
+            if (in.bad()) {
+                throw runtime_error("Couldn't read the source file");
+            }
+        }
+
+        // Converts values to codes, or throws if a value isn't (close to) a whole code
+        template <typename Code>
+        static void toCodes(const double* values, std::size_t n, double scale, double offset, Code invalid, Code* codes, const char* what) {
+            for (std::size_t i = 0; i < n; i++) {
+                if (std::isnan(values[i])) {
+                    codes[i] = invalid;
+                    continue;
+                }
+                double code = (values[i] - offset) / scale;
+                double rounded = std::floor(code + 0.5);
+                if (std::fabs(code - rounded) > CODE_TOLERANCE || rounded <= std::numeric_limits<Code>::min() || rounded > std::numeric_limits<Code>::max()) {
+                    throw runtime_error(string("The ") + what + " values don't fit the scaling in the header; the file can't be stored as codes");
+                }
+                codes[i] = static_cast<Code>(rounded);
+            }
+        }
+        /// \endcond
+
+        //------------------------------------------------------------------------------------------------------
+        /** \brief Constructor
+         *
+         *  \param[in] target_  Record format to convert to: SaveFile::FLOAT_RECORDS, COMPACT_RECORDS, or CHUNKED_RECORDS
+         *  \param[in] pool_    Pool to convert on
+         */
+        SaveFileConverter::SaveFileConverter(SaveFile::Format target_, ThreadPool& pool_) :
+            target(target_),
+            pool(pool_)
+        {
+            if (target != SaveFile::FLOAT_RECORDS && target != SaveFile::COMPACT_RECORDS && target != SaveFile::CHUNKED_RECORDS) {
+                throw invalid_argument("Save files can only be converted to the .clp record formats");
+            }
+        }
+
+        /** \brief Scale factors for storing the values of a SaveFile::FLOAT_RECORDS file as codes.
+         *
+         *  The same factors as HeaderData::computeCompactScaling(), from what the header records: the feedback
+         *  resistance and clamp step in voltage clamp mode, the pipette offset and current step in current clamp mode.
+         *  The measured scale is always the 18-bit mux step; 16-bit values are multiples of it.
+         *
+         *  \param[in] settings  Settings from the file's header
+         */
+        CompactScaling SaveFileConverter::deriveCompactScaling(const SavedSettings& settings) {
+            CompactScaling scaling;
+            if (settings.isVoltageClamp) {
+                if (!(settings.resistance > 0)) {
+                    throw runtime_error("The header has no feedback resistance");
+                }
+                scaling.measuredScale = STEP18 / 10.0 / settings.resistance;
+                scaling.measuredOffset = 0.0;
+                scaling.clampScale = settings.vClampX2mode ? 5.0e-3 : 2.5e-3;
+            }
+            else {
+                if (!(settings.stepSize > 0)) {
+                    throw runtime_error("The header has no clamp current step");
+                }
+                scaling.measuredScale = STEP18 / 8.0;
+                scaling.measuredOffset = -settings.pipetteOffset / 1000.0; // In mV; see HeaderData::computeCompactScaling
+                scaling.clampScale = settings.stepSize;
+            }
+            return scaling;
+        }
+
+        bool SaveFileConverter::isTargetFormat(const SaveFileReader& reader) const {
+            switch (target) {
+            case SaveFile::FLOAT_RECORDS:
+                return !reader.isCompact;
+            case SaveFile::COMPACT_RECORDS:
+                return reader.isCompact && !reader.isChunked;
+            default:
+                return reader.isChunked;
+            }
+        }
+
+        // Reads block *index* of the source and encodes it into block.bytes
+        void SaveFileConverter::convertBlock(const SaveFileReader& reader, const CompactScaling& scaling, std::size_t index, Block& block) const {
+            Chunk& codes = block.codes;
+            if (reader.isChunked) {
+                reader.readChunk(index, codes);
+            }
+            else {
+                std::size_t first = index * BLOCK_RECORDS;
+                std::size_t n = std::min(BLOCK_RECORDS, reader.numRecords() - first);
+                if (reader.isCompact) {
+                    reader.readRecords(first, n, codes);
+                }
+                else {
+                    codes.timestamps.resize(n);
+                    codes.measuredCodes.resize(n);
+                    codes.clampCodes.resize(n);
+                    block.values.resize(n);
+                    reader.timestamps().copyTo(codes.timestamps.data(), first, n);
+
+                    RecordView<float> measured = reader.measured();
+                    for (std::size_t i = 0; i < n; i++) {
+                        block.values[i] = measured[first + i];
+                    }
+                    toCodes(block.values.data(), n, scaling.measuredScale, scaling.measuredOffset, INVALID_MEASURED_CODE, codes.measuredCodes.data(), "measured");
+
+                    RecordView<float> clamp = reader.clampValues();
+                    for (std::size_t i = 0; i < n; i++) {
+                        block.values[i] = clamp[first + i];
+                    }
+                    toCodes(block.values.data(), n, scaling.clampScale, 0.0, INVALID_CLAMP_CODE, codes.clampCodes.data(), "clamp");
+                }
+            }
+
+            // Encoded in memory by BinaryWriter, so the bytes come out exactly as SaveFile writes them
+            block.bytes.clear();
+            BinaryWriter out(unique_ptr<FileOutStream>(new MemoryOutStream(block.bytes)), 64 * KILO);
+            if (target == SaveFile::FLOAT_RECORDS) {
+                SimplifiedWaveform waveform(reader.settings.waveform);
+                reader.writeFloatRecords(out, codes, waveform);
+            }
+            else if (target == SaveFile::CHUNKED_RECORDS) {
+                if (codes.size() > 0) {
+                    writeChunk(out, codes, block.payload);
+                }
+            }
+            else {
+                // Stored as their unsigned bit patterns, as in SaveFile::writeCompactData
+                vector<uint32_t> measuredBits(codes.measuredCodes.begin(), codes.measuredCodes.end());
+                vector<uint16_t> clampBits(codes.clampCodes.begin(), codes.clampCodes.end());
+                BinaryColumn columns[] = {
+                    BinaryColumn(codes.timestamps.data()),
+                    BinaryColumn(measuredBits.data()),
+                    BinaryColumn(clampBits.data())
+                };
+                out.writeRecords(columns, 3, static_cast<unsigned int>(codes.size()));
+            }
+            out.flush();
+        }
+
+        /** \brief Convert one file.
+         *
+         *  The blocks of the file are converted in parallel on the pool.  If the conversion fails, the partly written
+         *  destination is deleted.
+         *
+         *  \param[in] source       File to convert
+         *  \param[in] destination  File to write; overwritten if it exists
+         *  \returns What was converted, and how fast
+         *  \throws std::runtime_error (or std::system_error) if the source can't be read or converted, or the
+         *          destination can't be written
+         */
+        ConversionResult SaveFileConverter::convertFile(const FILENAME& source, const FILENAME& destination) const {
+            auto start = std::chrono::steady_clock::now();
+            if (isJournal(source)) {
+                // Rebuilt next to the destination, then converted like any other file
+                FILENAME recovered = destination + toFileName(string(".recovered"));
+                ConversionResult result;
+                try {
+                    recoverJournal(source, recovered);
+                    result = convertFile(recovered, destination);
+                }
+                catch (...) {
+                    removeFile(recovered);
+                    throw;
+                }
+                removeFile(recovered);
+                result.source = source;
+                result.recovered = true;
+                result.bytesRead = fileSize(source);
+                result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                return result;
+            }
+
+            ConversionResult result;
+            result.source = source;
+            result.destination = destination;
+            result.bytesRead = fileSize(source);
+
+            SaveFileReader reader;
+            reader.open(source);
+            if (reader.isAux || reader.isMultiplexed || isTargetFormat(reader)) {
+                if (reader.isChunked) {
+                    for (std::size_t i = 0; i < reader.numChunks(); i++) {
+                        result.records += reader.chunkEntry(i).numRecords;
+                    }
+                }
+                else {
+                    result.records = reader.numRecords();
+                }
+                try {
+                    copyFile(source, destination);
+                }
+                catch (...) {
+                    removeFile(destination);
+                    throw;
+                }
+                result.copied = true;
+            }
+            else {
+                try {
+                    CompactScaling scaling = reader.isCompact ? reader.compactScaling : deriveCompactScaling(reader.settings);
+                    vector<char> header = reader.convertedHeader(target, scaling);
+                    unique_ptr<FileOutStream> fs(new FileOutStream());
+                    fs->open(destination);
+                    BinaryWriter out(std::move(fs), 1024 * KILO);
+                    out.writeBytes(header.data(), static_cast<unsigned int>(header.size()));
+
+                    std::size_t numBlocks = reader.isChunked ? reader.numChunks() : (reader.numRecords() + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+                    // Enough blocks per batch to keep every thread busy while a few straggle
+                    std::size_t batchSize = 2 * (pool.numThreads() + 1);
+                    vector<Block> blocks(std::min(batchSize, numBlocks));
+                    vector<ChunkIndexEntry> index;
+                    for (std::size_t first = 0; first < numBlocks; first += batchSize) {
+                        std::size_t n = std::min(batchSize, numBlocks - first);
+                        vector<function<void()>> tasks;
+                        tasks.reserve(n);
+                        for (std::size_t i = 0; i < n; i++) {
+                            Block& block = blocks[i];
+                            std::size_t blockIndex = first + i;
+                            tasks.push_back([this, &reader, &scaling, blockIndex, &block]() {
+                                convertBlock(reader, scaling, blockIndex, block);
+                            });
+                        }
+                        pool.run(tasks);
+
+                        for (std::size_t i = 0; i < n; i++) {
+                            const Block& block = blocks[i];
+                            if (target == SaveFile::CHUNKED_RECORDS && block.codes.size() > 0) {
+                                ChunkIndexEntry entry;
+                                entry.offset = out.position();
+                                entry.firstTimestamp = block.codes.timestamps.front();
+                                entry.numRecords = static_cast<uint32_t>(block.codes.size());
+                                index.push_back(entry);
+                            }
+                            out.writeBytes(block.bytes.data(), static_cast<unsigned int>(block.bytes.size()));
+                            result.records += block.codes.size();
+                        }
+                    }
+                    if (target == SaveFile::CHUNKED_RECORDS) {
+                        writeChunkIndex(out, index, out.position());
+                    }
+                    out.flush();
+                }
+                catch (...) {
+                    removeFile(destination);
+                    throw;
+                }
+            }
+            result.bytesWritten = fileSize(destination);
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        /** \brief Convert several files, in parallel.
+         *
+         *  Each file is one task on the pool, and its blocks are further tasks, so small and large files alike keep
+         *  the pool busy.  A file that fails doesn't stop the others; its result has the error.
+         *
+         *  \param[in] sources       Files to convert
+         *  \param[in] destinations  Where to write each of them; the same length as sources
+         *  \param[in] finished      Called as each file finishes, e.g., to report progress
+         *  \returns One result per file, in the order of sources
+         */
+        vector<ConversionResult> SaveFileConverter::convertFiles(const vector<FILENAME>& sources, const vector<FILENAME>& destinations, const FinishedCallback& finished) const {
+            if (sources.size() != destinations.size()) {
+                throw invalid_argument("Size mismatch");
+            }
+
+            vector<ConversionResult> results(sources.size());
+            std::mutex callbackMutex;
+            vector<function<void()>> tasks;
+            tasks.reserve(sources.size());
+            for (std::size_t i = 0; i < sources.size(); i++) {
+                tasks.push_back([this, &sources, &destinations, &results, &finished, &callbackMutex, i]() {
+                    ConversionResult& result = results[i];
+                    try {
+                        result = convertFile(sources[i], destinations[i]);
+                    }
+                    catch (const std::exception& e) {
+                        result = ConversionResult();
+                        result.source = sources[i];
+                        result.destination = destinations[i];
+                        result.error = e.what();
+                    }
+                    if (finished) {
+                        std::lock_guard<std::mutex> lock(callbackMutex);
+                        finished(result);
+                    }
+                });
+            }
+            pool.run(tasks);
+            return results;
+        }
+    }
+}
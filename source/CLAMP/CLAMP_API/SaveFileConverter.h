@@ -0,0 +1,73 @@
+#pragma once
+
+#include "SaveFile.h"
+#include "SaveFileReader.h"
+#include "ThreadPool.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /// Outcome of converting one file with SaveFileConverter
+        struct ConversionResult {
+            FILENAME source;
+            FILENAME destination;
+            bool copied;            ///< The file was already in the target format (or is an aux or multiplexed file), so it was copied as-is
+            bool recovered;         ///< The source was a journal (see JournalOutStream), which was recovered, then converted
+            std::string error;      ///< Why the conversion failed; empty if it succeeded
+            uint64_t records;       ///< Records converted
+            uint64_t bytesRead;     ///< Size of the source file
+            uint64_t bytesWritten;  ///< Size of the destination file
+            double seconds;         ///< Wall-clock time taken
+
+            ConversionResult() : copied(false), recovered(false), records(0), bytesRead(0), bytesWritten(0), seconds(0) {}
+        };
+
+        /** \brief Converts headstage save files between the .clp record formats, in parallel.
+         *
+         *  Files are read with SaveFileReader, so the source is memory-mapped rather than read into memory.  Each file
+         *  is cut into blocks (the source's chunks, or SaveFile::CHUNK_RECORDS records), and the blocks are converted
+         *  and encoded in batches on a ThreadPool, then written to the destination in order.  convertFiles() also runs
+         *  one pool task per file, so a directory of small files keeps every core busy, and a single large file does too.
+         *
+         *  The output is byte-for-byte what SaveFile would have written in the target format (or what
+         *  SaveFileReader::convertToFloatRecords() writes), apart from the version and scaling in the header:
+         *  \li Compact and chunked files convert to each other losslessly, since both store the same integer codes.
+         *  \li Compact and chunked files convert to SaveFile::FLOAT_RECORDS through CompactScaling, like
+         *      convertToFloatRecords().
+         *  \li SaveFile::FLOAT_RECORDS files convert to the compact formats with scale factors derived from the header
+         *      (see deriveCompactScaling()).  Every value is checked to land on a whole code, so the conversion is
+         *      lossless or fails; it fails, e.g., for files whose values were rescaled after they were recorded.
+         *
+         *  Files already in the target format, and aux and multiplexed files (which have one format each), are copied
+         *  unchanged.  Journals (see SaveFile::setJournal()) are first recovered with recoverJournal().
+         *  SaveFile::NWB_RECORDS can't be converted to: NWBFile needs the live Board's HeaderData.
+         */
+        class SaveFileConverter {
+        public:
+            /// Called as each file of convertFiles() finishes, on whichever thread converted it, one call at a time
+            typedef std::function<void(const ConversionResult&)> FinishedCallback;
+
+            explicit SaveFileConverter(SaveFile::Format target_, ThreadPool& pool_ = ThreadPool::instance());
+
+            ConversionResult convertFile(const FILENAME& source, const FILENAME& destination) const;
+            std::vector<ConversionResult> convertFiles(const std::vector<FILENAME>& sources, const std::vector<FILENAME>& destinations, const FinishedCallback& finished = FinishedCallback()) const;
+
+            static CompactScaling deriveCompactScaling(const SavedSettings& settings);
+
+        private:
+            /// \cond private
+            struct Block;
+            /// \endcond
+
+            SaveFile::Format target;
+            ThreadPool& pool;
+
+            bool isTargetFormat(const SaveFileReader& reader) const;
+            void convertBlock(const SaveFileReader& reader, const CompactScaling& scaling, std::size_t index, Block& block) const;
+        };
+    }
+}
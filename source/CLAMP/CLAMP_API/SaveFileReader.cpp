@@ -0,0 +1,1062 @@
+#include "SaveFileReader.h"
+#include "Channel.h"
+#include "Constants.h"
+#include "common.h"
+#include <stdexcept>
+#include <system_error>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <cerrno>
+#endif
+
+using std::runtime_error;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace IO {
+        // Record layouts; see SaveFile::writeData and SaveFile::writeDataAux
+        static const unsigned int MAIN_RECORD_SIZE = sizeof(uint32_t) + 3 * sizeof(float);
+        static const unsigned int AUX_RECORD_FIXED_SIZE = sizeof(uint32_t) + 2 * sizeof(uint16_t);
+        static const unsigned int COMPACT_RECORD_SIZE = sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t);
+
+        // Reads a little-endian value from the header and advances p
+        template <typename T>
+        static T take(const unsigned char*& p, const unsigned char* end) {
+            if (p + sizeof(T) > end) {
+                throw runtime_error("Save file header is truncated");
+            }
+            T value;
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return value;
+        }
+
+        static TimeDate takeTimeDate(const unsigned char*& p, const unsigned char* end) {
+            TimeDate t;
+            t.year = take<int16_t>(p, end);
+            t.month = take<int16_t>(p, end);
+            t.day = take<int16_t>(p, end);
+            t.hour = take<int16_t>(p, end);
+            t.minute = take<int16_t>(p, end);
+            t.second = take<int16_t>(p, end);
+            return t;
+        }
+
+        // Skips over the per-chip and per-channel register and calibration data in a headstage header
+        static void skipChipData(const unsigned char*& p, const unsigned char* end) {
+            unsigned int numChips = take<uint16_t>(p, end);
+            unsigned int numChannels = take<uint16_t>(p, end);
+            std::size_t chipDataSize = numChips * (numChannels * Channel::onDiskSize() + 4 * sizeof(uint16_t));
+            if (p + chipDataSize > end) {
+                throw runtime_error("Save file header is truncated");
+            }
+            p += chipDataSize;
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// Constructor
+        SavedSettings::SavedSettings() :
+            enableCapacitiveCompensation(false),
+            capCompensationMagnitude(0),
+            filterCutoff(0),
+            pipetteOffset(0),
+            samplingRate(0),
+            Ra(0),
+            Rm(0),
+            Cm(0),
+            isVoltageClamp(true),
+            vClampX2mode(false),
+            holdingVoltage(0),
+            nominalResistance(0),
+            resistance(0),
+            desiredBandwidth(0),
+            actualBandwidth(0),
+            holdingCurrent(0),
+            stepSize(0)
+        {
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// Constructor
+        SaveFileReader::SaveFileReader() :
+            version(0, 0),
+            isAux(false),
+            numAdcs(0),
+            samplingRate(0),
+            isCompact(false),
+            isChunked(false),
+            isMultiplexed(false),
+            hasAux(false),
+            isAuxEvents(false),
+            adcMask(0),
+            data(nullptr),
+            fileSize(0),
+            headerSize(0),
+            settingsEnd(0),
+            recordSize(0),
+            auxOffset(0),
+            recordCount(0),
+#if defined(_WIN32)
+            fileHandle(INVALID_HANDLE_VALUE),
+            mappingHandle(nullptr)
+#else
+            fd(-1)
+#endif
+        {
+        }
+
+        SaveFileReader::~SaveFileReader() {
+            close();
+        }
+
+        /** \brief Open a save file and parse its header.
+         *
+         *  \param[in] path  Path of the file
+         */
+        void SaveFileReader::open(const FILENAME& path) {
+            close();
+            map(path);
+            try {
+                parseHeader();
+                loadSweepIndex(SaveFile::sweepIndexPath(path));
+            }
+            catch (...) {
+                close();
+                throw;
+            }
+        }
+
+        /// Close the file.  Any RecordView objects obtained from this reader become invalid.
+        void SaveFileReader::close() {
+            unmap();
+            headerSize = 0;
+            recordSize = 0;
+            recordCount = 0;
+            chunks.clear();
+            chunkFirstRecord.clear();
+            auxRuns.clear();
+            events.clear();
+            sweeps.clear();
+        }
+
+#if defined(_WIN32)
+        void SaveFileReader::map(const FILENAME& path) {
+    #if defined(_UNICODE)
+            HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    #else
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    #endif
+            if (file == INVALID_HANDLE_VALUE) {
+                throw std::system_error(GetLastError(), std::system_category());
+            }
+            fileHandle = file;
+
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+                unmap();
+                throw runtime_error("Save file is empty");
+            }
+            fileSize = size.QuadPart;
+
+            mappingHandle = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mappingHandle == nullptr) {
+                DWORD error = GetLastError();
+                unmap();
+                throw std::system_error(error, std::system_category());
+            }
+            data = static_cast<const unsigned char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+            if (data == nullptr) {
+                DWORD error = GetLastError();
+                unmap();
+                throw std::system_error(error, std::system_category());
+            }
+        }
+
+        void SaveFileReader::unmap() {
+            if (data) {
+                UnmapViewOfFile(data);
+                data = nullptr;
+            }
+            if (mappingHandle) {
+                CloseHandle(mappingHandle);
+                mappingHandle = nullptr;
+            }
+            if (fileHandle != INVALID_HANDLE_VALUE) {
+                CloseHandle(fileHandle);
+                fileHandle = INVALID_HANDLE_VALUE;
+            }
+            fileSize = 0;
+        }
+#else
+        void SaveFileReader::map(const FILENAME& path) {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::system_error(errno, std::system_category());
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                unmap();
+                throw runtime_error("Save file is empty");
+            }
+            fileSize = st.st_size;
+
+            void* p = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                int error = errno;
+                unmap();
+                throw std::system_error(error, std::system_category());
+            }
+            data = static_cast<const unsigned char*>(p);
+            // Reads are mostly sequential sweeps through the records
+            madvise(p, fileSize, MADV_SEQUENTIAL);
+        }
+
+        void SaveFileReader::unmap() {
+            if (data) {
+                munmap(const_cast<unsigned char*>(data), fileSize);
+                data = nullptr;
+            }
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+            fileSize = 0;
+        }
+#endif
+
+        void SaveFileReader::parseHeader() {
+            const unsigned char* p = data;
+            const unsigned char* end = data + fileSize;
+
+            uint32_t magic = take<uint32_t>(p, end);
+            if (magic == DATA_FILE_JOURNAL_MAGIC_NUMBER) {
+                throw runtime_error("This save file is a journal; recover it first (see recoverJournal)");
+            }
+            if (magic != DATA_FILE_MAGIC_NUMBER) {
+                throw runtime_error("Not a CLAMP save file");
+            }
+            version.majorVersion = take<uint16_t>(p, end);
+            version.minorVersion = take<uint16_t>(p, end);
+            uint16_t kind = take<uint16_t>(p, end);
+            isAux = false;
+            isCompact = false;
+            isChunked = false;
+            isMultiplexed = false;
+            isAuxEvents = false;
+            adcMask = 0;
+            channels.clear();
+            channelSettings.clear();
+            if (kind == DATA_FILE_MULTIPLEXED_KIND) {
+                parseMultiplexedHeader(p);
+                return;
+            }
+            isAux = (kind != 0);
+            hasAux = isAux;
+            auxOffset = sizeof(uint32_t);
+
+            if (isAux) {
+                numAdcs = take<uint16_t>(p, end);
+            }
+            else {
+                numAdcs = 0;
+            }
+            headerSize = take<uint16_t>(p, end);
+            if (headerSize > fileSize) {
+                throw runtime_error("Save file header is truncated");
+            }
+            end = data + headerSize;
+
+            timestamp = takeTimeDate(p, end);
+
+            if (isAux) {
+                samplingRate = take<float>(p, end);
+                recordSize = AUX_RECORD_FIXED_SIZE + numAdcs * sizeof(uint16_t);
+                isAuxEvents = (version >= Version(DATA_FILE_AUX_EVENTS_MAIN_VERSION_NUMBER, 0));
+                adcMask = isAuxEvents ? take<uint16_t>(p, end) : static_cast<uint16_t>((1u << numAdcs) - 1);
+            }
+            else {
+                skipChipData(p, end);
+                parseSettings(p, end);
+                samplingRate = settings.samplingRate;
+                settingsEnd = static_cast<unsigned int>(p - data);
+
+                isCompact = (version >= Version(DATA_FILE_COMPACT_MAIN_VERSION_NUMBER, 0));
+                isChunked = (version >= Version(DATA_FILE_CHUNKED_MAIN_VERSION_NUMBER, 0));
+                if (isCompact) {
+                    compactScaling.measuredScale = take<double>(p, end);
+                    compactScaling.measuredOffset = take<double>(p, end);
+                    compactScaling.clampScale = take<double>(p, end);
+                    recordSize = COMPACT_RECORD_SIZE;
+                }
+                else {
+                    recordSize = MAIN_RECORD_SIZE;
+                }
+            }
+
+            if (isChunked) {
+                loadChunkIndex();
+            }
+            else if (isAuxEvents) {
+                loadAuxItems();
+            }
+            else {
+                recordCount = static_cast<std::size_t>((fileSize - headerSize) / recordSize);
+            }
+        }
+
+        // The rest of a multiplexed file's header, from just after the kind field; see MultiplexedSaveFile
+        void SaveFileReader::parseMultiplexedHeader(const unsigned char*& p) {
+            const unsigned char* end = data + fileSize;
+            isMultiplexed = true;
+            unsigned int numChannels = take<uint16_t>(p, end);
+            hasAux = (take<uint16_t>(p, end) != 0);
+            uint32_t size = take<uint32_t>(p, end);
+            if (size > fileSize) {
+                throw runtime_error("Save file header is truncated");
+            }
+            headerSize = size;
+            end = data + headerSize;
+            if (numChannels == 0) {
+                throw runtime_error("Multiplexed save file has no channels");
+            }
+
+            for (unsigned int i = 0; i < numChannels; i++) {
+                unsigned int chip = take<uint16_t>(p, end);
+                unsigned int channel = take<uint16_t>(p, end);
+                channels.push_back(ClampConfig::ChipChannel(chip, channel));
+            }
+
+            // Each channel's header is a complete version 1 headstage header
+            for (unsigned int i = 0; i < numChannels; i++) {
+                const unsigned char* start = p;
+                if (take<uint32_t>(p, end) != DATA_FILE_MAGIC_NUMBER) {
+                    throw runtime_error("Multiplexed save file header is corrupt");
+                }
+                take<uint32_t>(p, end); // Version
+                if (take<uint16_t>(p, end) != 0) {
+                    throw runtime_error("Multiplexed save file header is corrupt");
+                }
+                unsigned int channelHeaderSize = take<uint16_t>(p, end);
+                if (start + channelHeaderSize > end) {
+                    throw runtime_error("Save file header is truncated");
+                }
+                const unsigned char* channelEnd = start + channelHeaderSize;
+                TimeDate started = takeTimeDate(p, channelEnd);
+                if (i == 0) {
+                    timestamp = started;
+                }
+                skipChipData(p, channelEnd);
+                parseSettings(p, channelEnd);
+                channelSettings.push_back(settings);
+                p = channelEnd;
+            }
+            settings = channelSettings.front();
+            samplingRate = settings.samplingRate;
+
+            numAdcs = 0;
+            if (hasAux) {
+                const unsigned char* start = p;
+                if (take<uint32_t>(p, end) != DATA_FILE_MAGIC_NUMBER) {
+                    throw runtime_error("Multiplexed save file header is corrupt");
+                }
+                take<uint32_t>(p, end); // Version
+                if (take<uint16_t>(p, end) != 1) {
+                    throw runtime_error("Multiplexed save file header is corrupt");
+                }
+                numAdcs = take<uint16_t>(p, end);
+                adcMask = static_cast<uint16_t>((1u << numAdcs) - 1);
+                unsigned int auxHeaderSize = take<uint16_t>(p, end);
+                if (start + auxHeaderSize > end) {
+                    throw runtime_error("Save file header is truncated");
+                }
+            }
+
+            // Timestamp, clamp and measured values for each channel, then the aux columns without their timestamp
+            auxOffset = static_cast<unsigned int>(sizeof(uint32_t) + numChannels * 2 * sizeof(float));
+            recordSize = auxOffset + (hasAux ? AUX_RECORD_FIXED_SIZE - sizeof(uint32_t) + numAdcs * sizeof(uint16_t) : 0);
+            recordCount = static_cast<std::size_t>((fileSize - headerSize) / recordSize);
+        }
+
+        void SaveFileReader::parseSettings(const unsigned char*& p, const unsigned char* end) {
+            settings.enableCapacitiveCompensation = (take<uint8_t>(p, end) != 0);
+            settings.capCompensationMagnitude = take<float>(p, end);
+            settings.filterCutoff = take<float>(p, end);
+            settings.pipetteOffset = take<float>(p, end);
+            settings.samplingRate = take<float>(p, end);
+            settings.Ra = take<float>(p, end);
+            settings.Rm = take<float>(p, end);
+            settings.Cm = take<float>(p, end);
+            settings.isVoltageClamp = (take<uint8_t>(p, end) != 0);
+            settings.vClampX2mode = (take<uint8_t>(p, end) != 0);
+            if (settings.isVoltageClamp) {
+                settings.holdingVoltage = take<float>(p, end);
+                settings.nominalResistance = take<float>(p, end);
+                settings.resistance = take<float>(p, end);
+                settings.desiredBandwidth = take<float>(p, end);
+                settings.actualBandwidth = take<float>(p, end);
+            }
+            else {
+                settings.holdingCurrent = take<float>(p, end);
+                settings.stepSize = take<float>(p, end);
+            }
+
+            settings.waveform.erase();
+            settings.waveform.interval = take<float>(p, end);
+            unsigned int numSegments = take<uint16_t>(p, end);
+            for (unsigned int i = 0; i < numSegments; i++) {
+                unsigned int waveformNumber = take<uint8_t>(p, end);
+                unsigned int tOffset = take<uint32_t>(p, end);
+                WaveformSegment segment(waveformNumber, 0, 1, tOffset, false, false);
+                segment.startIndex = take<uint32_t>(p, end);
+                segment.endIndex = take<uint32_t>(p, end);
+                segment.appliedValue = take<float>(p, end);
+                // Indices are already absolute, so bypass SimplifiedWaveform::push_back
+                settings.waveform.waveform.push_back(segment);
+            }
+        }
+
+        /// Timestamps of all records (headstage and aux files)
+        RecordView<uint32_t> SaveFileReader::timestamps() const {
+            return field<uint32_t>(0);
+        }
+
+        /// Applied voltage (voltage clamp) or current (current clamp), from the waveform.  Headstage files only.
+        RecordView<float> SaveFileReader::applied() const {
+            if (isAux) {
+                throw runtime_error("Aux save files don't contain applied values");
+            }
+            if (isMultiplexed) {
+                throw runtime_error("Multiplexed save files don't store applied values; use channelSettings[channel].waveform");
+            }
+            if (isCompact) {
+                throw runtime_error("Compact save files don't store applied values; use settings.waveform");
+            }
+            return field<float>(sizeof(uint32_t));
+        }
+
+        /// Clamp voltage (voltage clamp) or current (current clamp).  Headstage files only.
+        RecordView<float> SaveFileReader::clampValues() const {
+            if (isAux) {
+                throw runtime_error("Aux save files don't contain clamp values");
+            }
+            if (isMultiplexed) {
+                throw runtime_error("Multiplexed save files have a column per channel; use clampValues(channel)");
+            }
+            if (isCompact) {
+                throw runtime_error("Compact save files store clamp codes; use clampCodes()");
+            }
+            return field<float>(sizeof(uint32_t) + sizeof(float));
+        }
+
+        /// Measured current (voltage clamp) or voltage (current clamp).  Headstage files only.
+        RecordView<float> SaveFileReader::measured() const {
+            if (isAux) {
+                throw runtime_error("Aux save files don't contain measured values");
+            }
+            if (isMultiplexed) {
+                throw runtime_error("Multiplexed save files have a column per channel; use measured(channel)");
+            }
+            if (isCompact) {
+                throw runtime_error("Compact save files store measured codes; use measuredCodes()");
+            }
+            return field<float>(sizeof(uint32_t) + 2 * sizeof(float));
+        }
+
+        /** \brief Clamp values of one channel of a multiplexed file.
+         *
+         *  \param[in] channel  Index of the channel [0, channels.size())
+         */
+        RecordView<float> SaveFileReader::clampValues(std::size_t channel) const {
+            if (!isMultiplexed) {
+                throw runtime_error("Only multiplexed save files have several channels");
+            }
+            if (channel >= channels.size()) {
+                throw invalid_argument("Channel index out of range");
+            }
+            return field<float>(static_cast<unsigned int>(sizeof(uint32_t) + channel * 2 * sizeof(float)));
+        }
+
+        /** \brief Measured values of one channel of a multiplexed file.
+         *
+         *  \param[in] channel  Index of the channel [0, channels.size())
+         */
+        RecordView<float> SaveFileReader::measured(std::size_t channel) const {
+            if (!isMultiplexed) {
+                throw runtime_error("Only multiplexed save files have several channels");
+            }
+            if (channel >= channels.size()) {
+                throw invalid_argument("Channel index out of range");
+            }
+            return field<float>(static_cast<unsigned int>(sizeof(uint32_t) + (channel * 2 + 1) * sizeof(float)));
+        }
+
+        /// Measured values as integer codes; see CompactScaling.  Compact files only.
+        RecordView<int32_t> SaveFileReader::measuredCodes() const {
+            if (!isCompact) {
+                throw runtime_error("Only compact save files contain measured codes");
+            }
+            return field<int32_t>(sizeof(uint32_t));
+        }
+
+        /// Clamp values as integer codes; see CompactScaling.  Compact files only.
+        RecordView<int16_t> SaveFileReader::clampCodes() const {
+            if (!isCompact) {
+                throw runtime_error("Only compact save files contain clamp codes");
+            }
+            return field<int16_t>(sizeof(uint32_t) + sizeof(int32_t));
+        }
+
+        /** \brief Copy records [first, first + n) of a compact (version 2) file into a block of codes.
+         *
+         *  Chunked files are read with readChunk() instead.
+         *
+         *  \param[in] first   Index of the first record
+         *  \param[in] n       Number of records
+         *  \param[out] block  Receives the records
+         */
+        void SaveFileReader::readRecords(std::size_t first, std::size_t n, Chunk& block) const {
+            if (first > recordCount || n > recordCount - first) {
+                throw invalid_argument("Record range out of range");
+            }
+            block.timestamps.resize(n);
+            block.measuredCodes.resize(n);
+            block.clampCodes.resize(n);
+            timestamps().copyTo(block.timestamps.data(), first, n);
+            measuredCodes().copyTo(block.measuredCodes.data(), first, n);
+            clampCodes().copyTo(block.clampCodes.data(), first, n);
+        }
+
+        /** \brief Write a copy of a compact or chunked file in the version 1 (SaveFile::FLOAT_RECORDS) format.
+         *
+         *  The header is copied as-is, apart from the version and the compact scale factors; the records are expanded
+         *  with the applied values from the waveform, exactly as SaveFile::writeData would have written them.
+         *
+         *  \param[in] path  Path of the file to write
+         */
+        void SaveFileReader::convertToFloatRecords(const FILENAME& path) const {
+            if (!isCompact) {
+                throw runtime_error("Only compact save files need converting");
+            }
+
+            std::vector<char> header = convertedHeader(SaveFile::FLOAT_RECORDS);
+            std::unique_ptr<FileOutStream> fs(new FileOutStream());
+            fs->open(path);
+            fs->write(header.data(), static_cast<int>(header.size()));
+            BinaryWriter out(std::move(fs), 64 * KILO);
+
+            SimplifiedWaveform waveform(settings.waveform);
+            Chunk block;
+            if (isChunked) {
+                for (std::size_t i = 0; i < chunks.size(); i++) {
+                    readChunk(i, block);
+                    writeFloatRecords(out, block, waveform);
+                }
+            }
+            else {
+                const std::size_t blockSize = 64 * KILO;
+                for (std::size_t first = 0; first < recordCount; first += blockSize) {
+                    readRecords(first, std::min(blockSize, recordCount - first), block);
+                    writeFloatRecords(out, block, waveform);
+                }
+            }
+        }
+
+        /** \brief Write a block of codes as version 1 (SaveFile::FLOAT_RECORDS) records, using this file's scaling.
+         *
+         *  \param[in] out       Where to write the records
+         *  \param[in] block     Records, as read by readChunk() or readRecords()
+         *  \param[in] waveform  The file's waveform (settings.waveform), for the applied values
+         */
+        void SaveFileReader::writeFloatRecords(BinaryWriter& out, const Chunk& block, SimplifiedWaveform& waveform) const {
+            std::size_t n = block.size();
+            std::vector<double> measuredOut(n);
+            std::vector<double> clampOut(n);
+            for (std::size_t i = 0; i < n; i++) {
+                measuredOut[i] = toMeasured(block.measuredCodes[i]);
+                clampOut[i] = toClamp(block.clampCodes[i]);
+            }
+            std::vector<double> applied;
+            waveform.getApplied(block.timestamps, 0, static_cast<unsigned int>(n), applied);
+
+            BinaryColumn columns[] = {
+                BinaryColumn(block.timestamps.data()),
+                BinaryColumn(applied.data()),
+                BinaryColumn(clampOut.data()),
+                BinaryColumn(measuredOut.data())
+            };
+            out.writeRecords(columns, 4, static_cast<unsigned int>(n));
+        }
+
+        /** \brief Header for a copy of this headstage file in another record format.
+         *
+         *  The bytes are this file's header up to the end of the settings, with the version and header size patched,
+         *  followed by the scale factors for the compact formats.
+         *
+         *  \param[in] format   SaveFile::FLOAT_RECORDS, COMPACT_RECORDS, or CHUNKED_RECORDS
+         *  \param[in] scaling  Scale factors for the compact formats; ignored for FLOAT_RECORDS
+         */
+        std::vector<char> SaveFileReader::convertedHeader(SaveFile::Format format, const CompactScaling& scaling) const {
+            if (isAux) {
+                throw runtime_error("Aux files have only one record format");
+            }
+            if (isMultiplexed) {
+                throw runtime_error("Multiplexed files have only one record format");
+            }
+
+            Version newVersion(DATA_FILE_MAIN_VERSION_NUMBER, DATA_FILE_SECONDARY_VERSION_NUMBER);
+            unsigned int newHeaderSize = settingsEnd;
+            if (format == SaveFile::COMPACT_RECORDS || format == SaveFile::CHUNKED_RECORDS) {
+                newVersion = Version((format == SaveFile::CHUNKED_RECORDS) ? DATA_FILE_CHUNKED_MAIN_VERSION_NUMBER : DATA_FILE_COMPACT_MAIN_VERSION_NUMBER, 0);
+                newHeaderSize += scaling.onDiskSize();
+            }
+            else if (format != SaveFile::FLOAT_RECORDS) {
+                throw invalid_argument("Only .clp record formats can be converted to");
+            }
+
+            std::vector<char> header(data, data + settingsEnd);
+            uint16_t v[2] = { newVersion.majorVersion, newVersion.minorVersion };
+            memcpy(&header[sizeof(uint32_t)], v, sizeof(v));
+            uint16_t size16 = static_cast<uint16_t>(newHeaderSize);
+            memcpy(&header[sizeof(uint32_t) + 3 * sizeof(uint16_t)], &size16, sizeof(size16));
+            if (newHeaderSize > settingsEnd) {
+                const double factors[] = { scaling.measuredScale, scaling.measuredOffset, scaling.clampScale };
+                const char* bytes = reinterpret_cast<const char*>(factors);
+                header.insert(header.end(), bytes, bytes + sizeof(factors));
+            }
+            return header;
+        }
+
+        /// Convert a measured code to amps (voltage clamp) or volts (current clamp).  Compact and chunked files only.
+        double SaveFileReader::toMeasured(int32_t code) const {
+            return (code == INVALID_MEASURED_CODE) ? std::numeric_limits<double>::quiet_NaN() : code * compactScaling.measuredScale + compactScaling.measuredOffset;
+        }
+
+        /// Convert a clamp code to volts (voltage clamp) or amps (current clamp).  Compact and chunked files only.
+        double SaveFileReader::toClamp(int16_t code) const {
+            return (code == INVALID_CLAMP_CODE) ? std::numeric_limits<double>::quiet_NaN() : code * compactScaling.clampScale;
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        // Reads the trailing index if the file was closed cleanly; otherwise recovers every complete chunk by scanning.
+        void SaveFileReader::loadChunkIndex() {
+            chunks.clear();
+            chunkFirstRecord.clear();
+
+            const unsigned char* end = data + fileSize;
+            const unsigned int footerSize = sizeof(uint64_t) + sizeof(uint32_t);
+            bool haveIndex = false;
+            if (fileSize >= headerSize + footerSize) {
+                const unsigned char* p = end - footerSize;
+                uint64_t indexOffset = take<uint64_t>(p, end);
+                uint32_t footerMagic = take<uint32_t>(p, end);
+                if (footerMagic == DATA_FILE_FOOTER_MAGIC_NUMBER && indexOffset >= headerSize && indexOffset + 2 * sizeof(uint32_t) <= fileSize - footerSize) {
+                    p = data + indexOffset;
+                    const unsigned char* indexEnd = end - footerSize;
+                    uint32_t indexMagic = take<uint32_t>(p, indexEnd);
+                    uint32_t count = take<uint32_t>(p, indexEnd);
+                    if (indexMagic == DATA_FILE_INDEX_MAGIC_NUMBER && static_cast<uint64_t>(indexEnd - p) == static_cast<uint64_t>(count) * 16) {
+                        chunks.resize(count);
+                        for (uint32_t i = 0; i < count; i++) {
+                            chunks[i].offset = take<uint64_t>(p, indexEnd);
+                            chunks[i].firstTimestamp = take<uint32_t>(p, indexEnd);
+                            chunks[i].numRecords = take<uint32_t>(p, indexEnd);
+                        }
+                        haveIndex = true;
+                    }
+                }
+            }
+
+            if (!haveIndex) {
+                uint64_t offset = headerSize;
+                while (offset + CHUNK_HEADER_SIZE <= fileSize) {
+                    const unsigned char* p = data + offset;
+                    if (take<uint32_t>(p, end) != DATA_FILE_CHUNK_MAGIC_NUMBER) {
+                        break;
+                    }
+                    ChunkIndexEntry entry;
+                    entry.offset = offset;
+                    entry.numRecords = take<uint32_t>(p, end);
+                    entry.firstTimestamp = take<uint32_t>(p, end);
+                    take<uint8_t>(p, end);
+                    uint32_t payloadSize = take<uint32_t>(p, end);
+                    uint32_t checksum = take<uint32_t>(p, end);
+                    if (static_cast<uint64_t>(end - p) < payloadSize || chunkChecksum(p, payloadSize) != checksum) {
+                        break; // Partially written; everything before it is intact
+                    }
+                    chunks.push_back(entry);
+                    offset += CHUNK_HEADER_SIZE + payloadSize;
+                }
+            }
+
+            recordCount = 0;
+            for (const ChunkIndexEntry& entry : chunks) {
+                chunkFirstRecord.push_back(recordCount);
+                recordCount += entry.numRecords;
+            }
+        }
+
+        /** \brief Decode one chunk of a chunked file.
+         *
+         *  \param[in] index   Chunk index [0, numChunks())
+         *  \param[out] chunk  Decoded records
+         */
+        void SaveFileReader::readChunk(std::size_t index, Chunk& chunk) const {
+            if (index >= chunks.size()) {
+                throw invalid_argument("Chunk index out of range");
+            }
+            const unsigned char* end = data + fileSize;
+            const unsigned char* p = data + chunks[index].offset;
+            if (take<uint32_t>(p, end) != DATA_FILE_CHUNK_MAGIC_NUMBER) {
+                throw runtime_error("Corrupt chunk in save file");
+            }
+            uint32_t numRecords = take<uint32_t>(p, end);
+            uint32_t firstTimestamp = take<uint32_t>(p, end);
+            ChunkEncoding encoding = static_cast<ChunkEncoding>(take<uint8_t>(p, end));
+            uint32_t payloadSize = take<uint32_t>(p, end);
+            uint32_t checksum = take<uint32_t>(p, end);
+            if (static_cast<uint64_t>(end - p) < payloadSize || chunkChecksum(p, payloadSize) != checksum ||
+                !decodeChunk(p, payloadSize, encoding, firstTimestamp, numRecords, chunk)) {
+                throw runtime_error("Corrupt chunk in save file");
+            }
+        }
+
+        /** \brief Find the chunk containing a timestamp, using the index; no chunk data is read.
+         *
+         *  \param[in] t  Timestamp to look for
+         *  \returns Index of the last chunk whose first timestamp is <= t (0 if t precedes all chunks)
+         */
+        std::size_t SaveFileReader::findChunk(uint32_t t) const {
+            std::size_t lo = 0;
+            std::size_t hi = chunks.size();
+            while (lo < hi) {
+                std::size_t mid = lo + (hi - lo) / 2;
+                if (chunks[mid].firstTimestamp <= t) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            return (lo == 0) ? 0 : lo - 1;
+        }
+
+        /// Digital inputs.  Files with aux columns only.
+        RecordView<uint16_t> SaveFileReader::digIns() const {
+            if (!hasAux) {
+                throw runtime_error("Only aux save files contain digital inputs");
+            }
+            return field<uint16_t>(auxOffset);
+        }
+
+        /// Digital outputs.  Files with aux columns only.
+        RecordView<uint16_t> SaveFileReader::digOuts() const {
+            if (!hasAux) {
+                throw runtime_error("Only aux save files contain digital outputs");
+            }
+            return field<uint16_t>(auxOffset + sizeof(uint16_t));
+        }
+
+        /** \brief Raw values of one ADC.  Files with aux columns only.
+         *
+         *  \param[in] index  ADC index [0, numAdcs)
+         *  \returns View of the ADC's values
+         */
+        RecordView<uint16_t> SaveFileReader::adc(unsigned int index) const {
+            if (!hasAux) {
+                throw runtime_error("Only aux save files contain ADC values");
+            }
+            if (index >= numAdcs) {
+                throw invalid_argument("ADC index out of range");
+            }
+            return field<uint16_t>(auxOffset + 2 * sizeof(uint16_t) + index * sizeof(uint16_t));
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        // Finds the runs and digital events of an aux event file.  Stops at a partially written item; everything before it is intact.
+        void SaveFileReader::loadAuxItems() {
+            auxRuns.clear();
+            events.clear();
+            recordCount = 0;
+
+            unsigned int storedAdcs = 0;
+            for (unsigned int mask = adcMask; mask != 0; mask >>= 1) {
+                storedAdcs += mask & 1;
+            }
+            const unsigned int runHeaderSize = sizeof(uint8_t) + 2 * sizeof(uint32_t);
+            const unsigned int eventSize = 2 * sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint16_t);
+
+            const unsigned char* end = data + fileSize;
+            const unsigned char* p = data + headerSize;
+            while (p < end) {
+                uint8_t type = *p;
+                if (type == AUX_ITEM_RUN) {
+                    if (static_cast<std::size_t>(end - p) < runHeaderSize) {
+                        break;
+                    }
+                    p++;
+                    AuxRun run;
+                    run.firstTimestamp = take<uint32_t>(p, end);
+                    run.numRecords = take<uint32_t>(p, end);
+                    run.offset = static_cast<uint64_t>(p - data);
+                    run.firstRecord = recordCount;
+                    uint64_t bytes = static_cast<uint64_t>(run.numRecords) * storedAdcs * sizeof(uint16_t);
+                    if (static_cast<uint64_t>(end - p) < bytes) {
+                        // Its digital events are missing too, so none of it can be trusted
+                        break;
+                    }
+                    auxRuns.push_back(run);
+                    recordCount += run.numRecords;
+                    p += bytes;
+                }
+                else if (type == AUX_ITEM_EVENT) {
+                    if (static_cast<std::size_t>(end - p) < eventSize) {
+                        break;
+                    }
+                    p++;
+                    DigitalEvent event;
+                    event.timestamp = take<uint32_t>(p, end);
+                    event.line = take<uint8_t>(p, end);
+                    event.value = take<uint16_t>(p, end);
+                    if (auxRuns.empty() || event.line > 1 || event.timestamp - auxRuns.back().firstTimestamp >= auxRuns.back().numRecords) {
+                        throw runtime_error("Corrupt aux event file");
+                    }
+                    event.recordIndex = auxRuns.back().firstRecord + (event.timestamp - auxRuns.back().firstTimestamp);
+                    events.push_back(event);
+                }
+                else {
+                    break;
+                }
+            }
+
+            // Each run's events are written a line at a time; put them in order of the records
+            std::stable_sort(events.begin(), events.end(),
+                [](const DigitalEvent& a, const DigitalEvent& b) { return a.recordIndex < b.recordIndex; });
+        }
+
+        /** \brief Decode a block of aux records (aux files, or multiplexed files with the aux columns).
+         *
+         *  Works for every version of the aux file; for aux event files, this is the only way to get the records, with
+         *  the digital values filled in from the events.
+         *
+         *  \param[in] first     Index of the first record
+         *  \param[in] n         Number of records
+         *  \param[out] records  Decoded records
+         */
+        void SaveFileReader::readAuxRecords(std::size_t first, std::size_t n, AuxRecords& records) const {
+            if (!hasAux) {
+                throw runtime_error("Only aux save files contain aux records");
+            }
+            if (first > recordCount || n > recordCount - first) {
+                throw invalid_argument("Records out of range");
+            }
+
+            records.timestamps.resize(n);
+            records.digIns.resize(n);
+            records.digOuts.resize(n);
+            records.adcs.resize(numAdcs);
+            std::vector<unsigned int> stored;
+            for (unsigned int i = 0; i < numAdcs; i++) {
+                if (adcMask & (1u << i)) {
+                    stored.push_back(i);
+                    records.adcs[i].resize(n);
+                }
+                else {
+                    records.adcs[i].clear();
+                }
+            }
+
+            if (!isAuxEvents) {
+                timestamps().copyTo(records.timestamps.data(), first, n);
+                digIns().copyTo(records.digIns.data(), first, n);
+                digOuts().copyTo(records.digOuts.data(), first, n);
+                for (unsigned int i : stored) {
+                    adc(i).copyTo(records.adcs[i].data(), first, n);
+                }
+                return;
+            }
+            if (n == 0) {
+                return;
+            }
+
+            // Each line's value at the first record is that of its last event at or before it
+            std::vector<DigitalEvent>::const_iterator next = std::partition_point(events.begin(), events.end(),
+                [first](const DigitalEvent& event) { return event.recordIndex <= first; });
+            uint16_t value[2] = { 0, 0 };
+            bool found[2] = { false, false };
+            for (std::vector<DigitalEvent>::const_iterator it = next; it != events.begin() && !(found[0] && found[1]);) {
+                --it;
+                if (!found[it->line]) {
+                    value[it->line] = it->value;
+                    found[it->line] = true;
+                }
+            }
+
+            std::size_t run = std::upper_bound(auxRuns.begin(), auxRuns.end(), first,
+                [](std::size_t record, const AuxRun& r) { return record < r.firstRecord; }) - auxRuns.begin() - 1;
+            std::size_t i = 0;
+            while (i < n) {
+                const AuxRun& r = auxRuns[run];
+                std::size_t within = first + i - r.firstRecord;
+                std::size_t count = std::min(static_cast<std::size_t>(r.numRecords) - within, n - i);
+                const unsigned char* p = data + r.offset + within * stored.size() * sizeof(uint16_t);
+                for (std::size_t k = 0; k < count; k++, i++) {
+                    while (next != events.end() && next->recordIndex <= first + i) {
+                        value[next->line] = next->value;
+                        ++next;
+                    }
+                    records.timestamps[i] = r.firstTimestamp + static_cast<uint32_t>(within + k);
+                    records.digIns[i] = value[0];
+                    records.digOuts[i] = value[1];
+                    for (unsigned int adcIndex : stored) {
+                        memcpy(&records.adcs[adcIndex][i], p, sizeof(uint16_t));
+                        p += sizeof(uint16_t);
+                    }
+                }
+                run++;
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        // Reads the sweep index written next to the file, if there is one
+        void SaveFileReader::loadSweepIndex(const FILENAME& path) {
+            sweeps = readSweepIndex(path);
+        }
+
+        /** \brief Reads a save file's sweep index, without opening the file itself.
+         *
+         *  Enough to select sweeps by their summaries (see SaveFile::setSweepIndex()) across many recordings without
+         *  touching their records.  Indexes written before the summaries were added load with them all NaN.
+         *
+         *  \param[in] path  Path of the sweep index (see SaveFile::sweepIndexPath())
+         *  \returns Its sweeps, in order; empty if there's no index at path
+         */
+        std::vector<SweepIndexEntry> SaveFileReader::readSweepIndex(const FILENAME& path) {
+            std::vector<SweepIndexEntry> sweeps;
+            std::ifstream in(path.c_str());
+            std::string line;
+            if (!in || !std::getline(in, line)) {
+                return sweeps;
+            }
+            while (std::getline(in, line)) {
+                if (line.empty()) {
+                    continue;
+                }
+                std::istringstream fields(line);
+                std::string field;
+                std::vector<std::string> values;
+                while (std::getline(fields, field, ',')) {
+                    values.push_back(field);
+                }
+                if (values.size() < 10) {
+                    throw runtime_error("Corrupt sweep index");
+                }
+                SweepIndexEntry entry;
+                entry.sweep = std::stoull(values[0]);
+                entry.firstTimestamp = static_cast<uint32_t>(std::stoul(values[1]));
+                entry.lastTimestamp = static_cast<uint32_t>(std::stoul(values[2]));
+                entry.firstRecord = std::stoull(values[3]);
+                entry.records = std::stoull(values[4]);
+                entry.offset = std::stoull(values[5]);
+                entry.validRecords = std::stoull(values[6]);
+                entry.measuredMin = std::strtod(values[7].c_str(), nullptr);
+                entry.measuredMax = std::strtod(values[8].c_str(), nullptr);
+                entry.measuredMean = std::strtod(values[9].c_str(), nullptr);
+                if (values.size() >= 17) {
+                    entry.baseline = std::strtod(values[10].c_str(), nullptr);
+                    entry.noiseRms = std::strtod(values[11].c_str(), nullptr);
+                    entry.peak = std::strtod(values[12].c_str(), nullptr);
+                    entry.steadyState = std::strtod(values[13].c_str(), nullptr);
+                    entry.Ra = std::strtod(values[14].c_str(), nullptr);
+                    entry.Rm = std::strtod(values[15].c_str(), nullptr);
+                    entry.Cm = std::strtod(values[16].c_str(), nullptr);
+                }
+                sweeps.push_back(entry);
+            }
+            return sweeps;
+        }
+
+        /** \brief Look up a sweep in the sweep index.
+         *
+         *  A file's sweeps are numbered consecutively, so this is a constant-time lookup.
+         *
+         *  \param[in] sweep  Number of the sweep in the recording (see SweepIndexEntry::sweep)
+         *  \returns The sweep's entry, or null if it isn't in this file
+         */
+        const SweepIndexEntry* SaveFileReader::findSweep(uint64_t sweep) const {
+            if (sweeps.empty() || sweep < sweeps.front().sweep) {
+                return nullptr;
+            }
+            uint64_t index = sweep - sweeps.front().sweep;
+            if (index < sweeps.size() && sweeps[index].sweep == sweep) {
+                return &sweeps[index];
+            }
+            // Not consecutive (e.g., an edited index); search instead
+            auto found = std::lower_bound(sweeps.begin(), sweeps.end(), sweep,
+                [](const SweepIndexEntry& entry, uint64_t value) { return entry.sweep < value; });
+            return (found != sweeps.end() && found->sweep == sweep) ? &*found : nullptr;
+        }
+
+        /** \brief Random access by timestamp.
+         *
+         *  Timestamps are non-decreasing within a recording, so this is a binary search.  For chunked files, the chunk index
+         *  is searched first and only the one chunk is decoded.
+         *
+         *  \param[in] t  Timestamp to look for
+         *  \returns Index of the first record whose timestamp is >= t, or numRecords() if there is none.
+         */
+        std::size_t SaveFileReader::findTimestamp(uint32_t t) const {
+            if (isChunked) {
+                // Jump to the right chunk with the index, then search within it
+                if (chunks.empty()) {
+                    return 0;
+                }
+                std::size_t c = findChunk(t);
+                Chunk chunk;
+                readChunk(c, chunk);
+                std::size_t within = std::lower_bound(chunk.timestamps.begin(), chunk.timestamps.end(), t) - chunk.timestamps.begin();
+                return chunkFirstRecord[c] + within;
+            }
+            if (isAuxEvents) {
+                // Timestamps are consecutive within a run
+                std::vector<AuxRun>::const_iterator run = std::upper_bound(auxRuns.begin(), auxRuns.end(), t,
+                    [](uint32_t value, const AuxRun& r) { return value < r.firstTimestamp; });
+                if (run == auxRuns.begin()) {
+                    return 0;
+                }
+                --run;
+                return run->firstRecord + std::min(static_cast<std::size_t>(t - run->firstTimestamp), static_cast<std::size_t>(run->numRecords));
+            }
+
+            RecordView<uint32_t> ts = timestamps();
+            std::size_t lo = 0;
+            std::size_t hi = ts.size();
+            while (lo < hi) {
+                std::size_t mid = lo + (hi - lo) / 2;
+                if (ts[mid] < t) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+    }
+}
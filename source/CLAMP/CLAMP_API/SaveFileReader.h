@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+#include "streams.h"
+#include "SaveFile.h"
+#include "SimplifiedWaveform.h"
+
+namespace CLAMP {
+    namespace IO {
+        /** \brief Read-only, zero-copy view of one field of the fixed-size records in a save file.
+         *
+         *  Element *i* is read directly out of the memory-mapped file; nothing is copied up front.  Records in the aux
+         *  file aren't 4-byte aligned, so elements are read with memcpy rather than by dereferencing a pointer.
+         */
+        template <typename T>
+        class RecordView {
+        public:
+            RecordView() : base(nullptr), strideBytes(0), count(0) {}
+            RecordView(const unsigned char* base_, std::size_t stride_, std::size_t count_) : base(base_), strideBytes(stride_), count(count_) {}
+
+            /// Number of elements
+            std::size_t size() const { return count; }
+            /// True if there are no elements
+            bool empty() const { return count == 0; }
+            /// Address of element 0 in the mapping, for wrapping the view in place (e.g., as a strided NumPy array)
+            const unsigned char* data() const { return base; }
+            /// Bytes from one element to the next
+            std::size_t stride() const { return strideBytes; }
+
+            /// Element *i*; no bounds checking
+            T operator[](std::size_t i) const {
+                T value;
+                memcpy(&value, base + i * strideBytes, sizeof(T));
+                return value;
+            }
+
+            /** \brief Copy elements [first, first + n) into a caller-supplied array.
+             *
+             *  \param[out] out    Destination; must have room for *n* elements
+             *  \param[in] first   Index of the first element to copy
+             *  \param[in] n       Number of elements to copy
+             */
+            void copyTo(T* out, std::size_t first, std::size_t n) const {
+                const unsigned char* p = base + first * strideBytes;
+                for (std::size_t i = 0; i < n; i++, p += strideBytes) {
+                    memcpy(out + i, p, sizeof(T));
+                }
+            }
+
+        private:
+            const unsigned char* base;
+            std::size_t strideBytes;
+            std::size_t count;
+        };
+
+        /** \brief Settings from the header of a headstage save file.
+         *
+         *  This mirrors the on-disk contents of Settings, which can only be constructed from a live Board.
+         */
+        struct SavedSettings {
+            /// True if fast transient capacitive compensation was enabled
+            bool enableCapacitiveCompensation;
+            /// Magnitude of fast transient capacitive compensation, in pF
+            double capCompensationMagnitude;
+            /// Filter cutoff frequency, in Hz.  0 means 'no filtering.'
+            double filterCutoff;
+            /// Pipette voltage offset, in volts
+            double pipetteOffset;
+            /// Sampling rate, in Hz
+            double samplingRate;
+            /// Last measured values of cell parameters Rm, Cm, and Ra
+            double Ra;
+            double Rm;
+            double Cm;
+            /// True for voltage clamp mode, false for current clamp mode
+            bool isVoltageClamp;
+            /// True for 2x voltage clamp mode
+            bool vClampX2mode;
+
+            /// \name Voltage clamp settings (isVoltageClamp = true); see VoltageClampSettings
+            //@{
+            double holdingVoltage;
+            double nominalResistance;
+            double resistance;
+            double desiredBandwidth;
+            double actualBandwidth;
+            //@}
+
+            /// \name Current clamp settings (isVoltageClamp = false); see CurrentClampSettings
+            //@{
+            double holdingCurrent;
+            double stepSize;
+            //@}
+
+            /// Waveform that was applied
+            CLAMP::SimplifiedWaveform waveform;
+
+            SavedSettings();
+        };
+
+        /// A change in one of the digital lines of an aux event file; see SaveFile::AUX_EVENTS
+        struct DigitalEvent {
+            /// Timestamp of the sample where the line took the value
+            uint32_t timestamp;
+            /// 0 for the digital inputs, 1 for the digital outputs
+            uint8_t line;
+            /// Value of all 16 bits of the line
+            uint16_t value;
+            /// Index of that sample among the file's records
+            uint64_t recordIndex;
+        };
+
+        /// A block of aux records, decoded; see SaveFileReader::readAuxRecords()
+        struct AuxRecords {
+            std::vector<uint32_t> timestamps;
+            std::vector<uint16_t> digIns;
+            std::vector<uint16_t> digOuts;
+            /// One vector per ADC; empty for ADCs the file doesn't store (see SaveFileReader::adcMask)
+            std::vector<std::vector<uint16_t>> adcs;
+        };
+
+        /** \brief Reader for CLAMP save files (both headstage files and aux files).
+         *
+         *  The file is memory-mapped and the header is parsed once, when the file is opened.  The data records are
+         *  exposed as RecordView objects that read straight out of the mapping, so opening a multi-GB recording doesn't
+         *  read it into memory.
+         *
+         *  The reader uses the file size at the time it was opened; a trailing partial record (e.g., from a file that's
+         *  still being written) is ignored.
+         *
+         *  Multiplexed files (see MultiplexedSaveFile) have a column of measured and clamp values per channel, read with
+         *  measured(channel) and clampValues(channel), and may also have the aux columns.
+         *
+         *  Aux event files (see SaveFile::AUX_EVENTS) don't have fixed-size records, so they can't be viewed as arrays;
+         *  read them with readAuxRecords(), or look at the digital changes alone with digitalEvents().
+         */
+        class SaveFileReader {
+        public:
+            SaveFileReader();
+            ~SaveFileReader();
+
+            void open(const FILENAME& path);
+            void close();
+            bool isOpen() const { return data != nullptr; }
+
+            /// \name Header
+            //@{
+            /// Version of the file format
+            Version version;
+            /// True for an aux file (ADCs and digital I/O), false for a headstage file
+            bool isAux;
+            /// Time stamp when the data file was started
+            TimeDate timestamp;
+            /// Number of ADCs in each record of an aux file
+            unsigned int numAdcs;
+            /// Sampling rate, in Hz
+            double samplingRate;
+            /// Settings; only valid for headstage files
+            SavedSettings settings;
+            /// True for a compact (version 2) headstage file; see SaveFile::COMPACT_RECORDS
+            bool isCompact;
+            /// True for a chunked (version 3) headstage file; see SaveFile::CHUNKED_RECORDS.  isCompact is also true.
+            bool isChunked;
+            /// Scale factors; only valid if isCompact
+            CompactScaling compactScaling;
+            /// True for a multiplexed (version 4) file, with several channels; see MultiplexedSaveFile.  settings are the first channel's.
+            bool isMultiplexed;
+            /// True if the records have the aux columns (digital I/O and ADCs): aux files, and some multiplexed files
+            bool hasAux;
+            /// True for an aux event (version 2) file; see SaveFile::AUX_EVENTS
+            bool isAuxEvents;
+            /// ADCs stored in the file, bit i for ADC i; all numAdcs of them, except in aux event files
+            uint16_t adcMask;
+            /// Multiplexed files: chip and channel of each channel's columns
+            std::vector<CLAMP::ClampConfig::ChipChannel> channels;
+            /// Multiplexed files: settings of each channel
+            std::vector<SavedSettings> channelSettings;
+            //@}
+
+            /** \name Sweeps
+             *
+             *  Loaded from the file's sweep index, if it was written with one (see SaveFile::setSweepIndex()).
+             */
+            //@{
+            /// Every sweep in the file, in order; empty if there's no sweep index
+            std::vector<SweepIndexEntry> sweeps;
+            const SweepIndexEntry* findSweep(uint64_t sweep) const;
+            static std::vector<SweepIndexEntry> readSweepIndex(const FILENAME& path);
+            //@}
+
+            /// \name Data records
+            //@{
+            std::size_t numRecords() const { return recordCount; }
+
+            RecordView<uint32_t> timestamps() const;
+            RecordView<float> applied() const;
+            RecordView<float> clampValues() const;
+            RecordView<float> measured() const;
+            RecordView<float> clampValues(std::size_t channel) const;
+            RecordView<float> measured(std::size_t channel) const;
+
+            RecordView<int32_t> measuredCodes() const;
+            RecordView<int16_t> clampCodes() const;
+            void readRecords(std::size_t first, std::size_t n, Chunk& block) const;
+            void convertToFloatRecords(const FILENAME& path) const;
+            void writeFloatRecords(BinaryWriter& out, const Chunk& block, SimplifiedWaveform& waveform) const;
+            std::vector<char> convertedHeader(SaveFile::Format format, const CompactScaling& scaling = CompactScaling()) const;
+            double toMeasured(int32_t code) const;
+            double toClamp(int16_t code) const;
+
+            std::size_t findTimestamp(uint32_t t) const;
+            //@}
+
+            /** \name Chunks
+             *
+             *  Chunked files can't be viewed as a single array of records; read them a chunk at a time instead.
+             */
+            //@{
+            std::size_t numChunks() const { return chunks.size(); }
+            const ChunkIndexEntry& chunkEntry(std::size_t index) const { return chunks[index]; }
+            /// Index of the first record of chunk *index*, counting from the start of the file
+            std::size_t chunkFirstRecordIndex(std::size_t index) const { return chunkFirstRecord[index]; }
+            void readChunk(std::size_t index, Chunk& chunk) const;
+            std::size_t findChunk(uint32_t t) const;
+
+            RecordView<uint16_t> digIns() const;
+            RecordView<uint16_t> digOuts() const;
+            RecordView<uint16_t> adc(unsigned int index) const;
+            //@}
+
+            /// \name Aux records
+            //@{
+            void readAuxRecords(std::size_t first, std::size_t n, AuxRecords& records) const;
+            /// Aux event files: every change of the digital lines, in order, starting with each line's first value
+            const std::vector<DigitalEvent>& digitalEvents() const { return events; }
+            //@}
+
+        private:
+            const unsigned char* data;
+            uint64_t fileSize;
+            unsigned int headerSize;
+            unsigned int settingsEnd; // Offset of the end of the version 1 part of the header
+            unsigned int recordSize;
+            unsigned int auxOffset;   // Offset of the aux columns in each record
+            std::size_t recordCount;
+            std::vector<ChunkIndexEntry> chunks;
+            std::vector<std::size_t> chunkFirstRecord;
+
+            // A run of an aux event file: consecutive records, whose stored ADC values start at offset
+            struct AuxRun {
+                uint64_t offset;
+                uint32_t firstTimestamp;
+                uint32_t numRecords;
+                std::size_t firstRecord;
+            };
+            std::vector<AuxRun> auxRuns;
+            std::vector<DigitalEvent> events;
+
+#if defined(_WIN32)
+            void* fileHandle;
+            void* mappingHandle;
+#else
+            int fd;
+#endif
+
+            void map(const FILENAME& path);
+            void unmap();
+            void parseHeader();
+            void parseMultiplexedHeader(const unsigned char*& p);
+            void parseSettings(const unsigned char*& p, const unsigned char* end);
+            void loadChunkIndex();
+            void loadAuxItems();
+            void loadSweepIndex(const FILENAME& path);
+
+            template <typename T>
+            RecordView<T> field(unsigned int offset) const {
+                if (isChunked) {
+                    throw std::runtime_error("Chunked save files must be read with readChunk()");
+                }
+                if (isAuxEvents) {
+                    throw std::runtime_error("Aux event files must be read with readAuxRecords()");
+                }
+                return RecordView<T>(data + headerSize + offset, recordSize, recordCount);
+            }
+
+            // Not copyable
+            SaveFileReader(const SaveFileReader&);
+            SaveFileReader& operator=(const SaveFileReader&);
+        };
+    }
+}
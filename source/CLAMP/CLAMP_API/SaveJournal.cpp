@@ -0,0 +1,204 @@
+#include "SaveJournal.h"
+#include "SaveFile.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using std::unique_ptr;
+using std::vector;
+using std::runtime_error;
+
+namespace CLAMP {
+    namespace IO {
+        // Checkpoints are a header's size, and data blocks a BinaryWriter buffer's; anything much larger is damage
+        static const uint32_t MAX_JOURNAL_PAYLOAD = 256 * KILO * KILO;
+
+        template <typename T>
+        static unsigned char* put(unsigned char* p, T value) {
+            memcpy(p, &value, sizeof(T));
+            return p + sizeof(T);
+        }
+
+        template <typename T>
+        static T get(const unsigned char*& p) {
+            T value;
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return value;
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /** \brief Constructor
+         *
+         *  \param[in] target_  Already-opened stream that the journal is written to
+         */
+        JournalOutStream::JournalOutStream(unique_ptr<FileOutStream>&& target_) :
+            FileOutStream(),
+            target(std::move(target_)),
+            sequence(0),
+            offset(0),
+            closed(false)
+        {
+        }
+
+        /// Marks the journal as closed cleanly, then closes the underlying file
+        JournalOutStream::~JournalOutStream() {
+            if (closed) {
+                return;
+            }
+            try {
+                writeBlock(JOURNAL_END, offset, nullptr, 0);
+                target->flush();
+            }
+            catch (...) {
+            }
+        }
+
+        int JournalOutStream::write(const char* data, int len) {
+            if (len < 0) {
+                throw std::invalid_argument("Negative length");
+            }
+            writeBlock(JOURNAL_DATA, offset, data, static_cast<uint32_t>(len));
+            offset += len;
+            return len;
+        }
+
+        void JournalOutStream::flush() {
+            target->flush();
+        }
+
+        /// Marks the journal as closed cleanly and closes the underlying file, throwing if either fails
+        void JournalOutStream::close() {
+            if (!closed) {
+                closed = true;
+                writeBlock(JOURNAL_END, offset, nullptr, 0);
+            }
+            target->close();
+        }
+
+        /** \brief Mark the file written so far as recoverable, and hand it to the operating system.
+         *
+         *  Call at the end of a whole record, after flushing the BinaryWriter writing to this stream.
+         *
+         *  \param[in] header  The save file's header, repeated in the checkpoint
+         */
+        void JournalOutStream::checkpoint(const vector<char>& header) {
+            writeBlock(JOURNAL_CHECKPOINT, offset, header.data(), static_cast<uint32_t>(header.size()));
+            target->flush();
+        }
+
+        void JournalOutStream::writeBlock(JournalBlockType type, uint64_t position, const char* payload, uint32_t len) {
+            unsigned char header[JOURNAL_BLOCK_HEADER_SIZE];
+            unsigned char* p = header;
+            p = put<uint32_t>(p, DATA_FILE_JOURNAL_MAGIC_NUMBER);
+            p = put<uint8_t>(p, static_cast<uint8_t>(type));
+            p = put<uint32_t>(p, sequence);
+            p = put<uint64_t>(p, position);
+            p = put<uint32_t>(p, len);
+            p = put<uint32_t>(p, chunkChecksum(reinterpret_cast<const unsigned char*>(payload), len));
+            put<uint32_t>(p, chunkChecksum(header, p - header));
+
+            target->write(reinterpret_cast<const char*>(header), JOURNAL_BLOCK_HEADER_SIZE);
+            if (len > 0) {
+                target->write(payload, static_cast<int>(len));
+            }
+            sequence++;
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /** \brief Check whether a file is a journal (see JournalOutStream) rather than an ordinary save file.
+         *
+         *  \param[in] path  Path of the file
+         *  \returns True if the file starts with a journal block
+         */
+        bool isJournal(const FILENAME& path) {
+            std::ifstream in(path, std::ios::binary);
+            unsigned char magic[sizeof(uint32_t)];
+            if (!in.read(reinterpret_cast<char*>(magic), sizeof(magic))) {
+                return false;
+            }
+            const unsigned char* p = magic;
+            return get<uint32_t>(p) == DATA_FILE_JOURNAL_MAGIC_NUMBER;
+        }
+
+        /** \brief Rebuild an ordinary save file from a journal (see JournalOutStream).
+         *
+         *  The blocks are read in order until one is missing, damaged, or out of sequence, e.g., the one being
+         *  written when the program crashed.  The save file is written up to the last intact checkpoint (or to the end,
+         *  if the journal was closed cleanly), so it ends with a whole record.  Only the data since the last checkpoint
+         *  is held in memory.
+         *
+         *  \param[in] path         Path of the journal
+         *  \param[in] destination  Path of the save file to write
+         *  \returns What was recovered
+         */
+        JournalRecovery recoverJournal(const FILENAME& path, const FILENAME& destination) {
+            if (!isJournal(path)) {
+                throw runtime_error("Not a save file journal");
+            }
+            std::ifstream in(path, std::ios::binary);
+            unique_ptr<FileOutStream> out(new FileOutStream());
+            out->open(destination);
+
+            JournalRecovery result;
+            vector<char> pending;  // Data since the last checkpoint
+            vector<char> payload;
+            uint64_t written = 0;  // Length of the file up to the last checkpoint
+            unsigned char header[JOURNAL_BLOCK_HEADER_SIZE];
+            for (uint32_t expected = 0; in.read(reinterpret_cast<char*>(header), JOURNAL_BLOCK_HEADER_SIZE); expected++) {
+                const unsigned char* p = header;
+                uint32_t magic = get<uint32_t>(p);
+                uint8_t type = get<uint8_t>(p);
+                uint32_t sequence = get<uint32_t>(p);
+                uint64_t position = get<uint64_t>(p);
+                uint32_t len = get<uint32_t>(p);
+                uint32_t payloadChecksum = get<uint32_t>(p);
+                uint32_t headerChecksum = chunkChecksum(header, p - header);
+                if (magic != DATA_FILE_JOURNAL_MAGIC_NUMBER || get<uint32_t>(p) != headerChecksum || sequence != expected ||
+                    type > JOURNAL_END || len > MAX_JOURNAL_PAYLOAD) {
+                    break;
+                }
+                payload.resize(len);
+                if (len > 0 && !in.read(payload.data(), len)) {
+                    break;
+                }
+                if (chunkChecksum(reinterpret_cast<const unsigned char*>(payload.data()), len) != payloadChecksum) {
+                    break;
+                }
+
+                uint64_t end = written + pending.size();
+                if (type == JOURNAL_DATA) {
+                    if (position != end) {
+                        break;
+                    }
+                    pending.insert(pending.end(), payload.begin(), payload.end());
+                }
+                else {
+                    if (position < written || position > end) {
+                        break;
+                    }
+                    // Everything up to here is whole records
+                    std::size_t n = static_cast<std::size_t>(position - written);
+                    if (n > 0) {
+                        out->write(pending.data(), static_cast<int>(n));
+                        pending.erase(pending.begin(), pending.begin() + n);
+                    }
+                    written = position;
+                    if (type == JOURNAL_CHECKPOINT) {
+                        result.checkpoints++;
+                    }
+                }
+                result.blocks++;
+                if (type == JOURNAL_END) {
+                    result.complete = true;
+                    break;
+                }
+            }
+
+            result.bytes = written;
+            result.discarded = pending.size();
+            return result;
+        }
+    }
+}
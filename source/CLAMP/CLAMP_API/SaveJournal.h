@@ -0,0 +1,87 @@
+#pragma once
+
+#include "streams.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /// \cond private
+        enum JournalBlockType {
+            JOURNAL_DATA = 0,       // The next bytes of the file
+            JOURNAL_CHECKPOINT = 1, // The file's header; everything before the block's offset is whole records
+            JOURNAL_END = 2         // The file was closed cleanly; its length is the block's offset
+        };
+
+        // Size of everything in a journal block before the payload
+        const unsigned int JOURNAL_BLOCK_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t) + 3 * sizeof(uint32_t);
+        /// \endcond
+
+        /** \brief FileOutStream that writes a save file as a journal, which can be recovered after a crash.
+         *
+         *  Normally, if the program crashes during a recording, whatever is still in the save file's buffers is lost,
+         *  and what's on the disk ends wherever the last buffer happened to end, possibly partway through a record (or
+         *  a chunk, in a SaveFile::CHUNKED_RECORDS file).  A journal is the same bytes, wrapped in self-describing
+         *  blocks:
+         *  \code
+              uint32  DATA_FILE_JOURNAL_MAGIC_NUMBER
+              uint8   type (JournalBlockType)
+              uint32  sequence number, counting from 0
+              uint64  offset of the payload in the file (data blocks); length of the file so far (other blocks)
+              uint32  payload size, in bytes
+              uint32  checksum of the payload (see chunkChecksum())
+              uint32  checksum of the fields above
+              ...     payload
+         *  \endcode
+         *  Each write from the BinaryWriter's buffer becomes a data block.  SaveFile adds a checkpoint block (see
+         *  checkpoint()) right after the header and then periodically, always at the end of a whole record; each holds
+         *  a copy of the header, and is handed to the operating system at once.  A final block marks a clean close.
+         *
+         *  recoverJournal() rebuilds the file as an ordinary save file, up to the last checkpoint whose blocks all
+         *  arrived intact; SaveFileConverter does this for journals it's given.  SaveFileReader can't read journals
+         *  directly.
+         *
+         *  Checkpoints survive the program crashing, not the computer losing power: they aren't synced to the disk.
+         */
+        class JournalOutStream : public FileOutStream {
+        public:
+            explicit JournalOutStream(std::unique_ptr<FileOutStream>&& target_);
+            ~JournalOutStream();
+
+            int write(const char* data, int len) override;
+            void flush() override;
+            void close() override;
+            void checkpoint(const std::vector<char>& header);
+
+            /// Length of the file written so far, not counting the journal's own block headers
+            uint64_t length() const { return offset; }
+
+        private:
+            std::unique_ptr<FileOutStream> target;
+            uint32_t sequence;
+            uint64_t offset;
+            bool closed; // The end block has been written
+
+            void writeBlock(JournalBlockType type, uint64_t position, const char* payload, uint32_t len);
+
+            // Not copyable
+            JournalOutStream(const JournalOutStream&);
+            JournalOutStream& operator=(const JournalOutStream&);
+        };
+
+        /// What recoverJournal() found
+        struct JournalRecovery {
+            uint64_t blocks;      ///< Intact blocks, of all types
+            uint64_t checkpoints; ///< Intact checkpoint blocks
+            uint64_t bytes;       ///< Length of the recovered file
+            uint64_t discarded;   ///< Bytes of intact data blocks after the last checkpoint, which were left out
+            bool complete;        ///< The journal was closed cleanly, so nothing was lost
+
+            JournalRecovery() : blocks(0), checkpoints(0), bytes(0), discarded(0), complete(false) {}
+        };
+
+        bool isJournal(const FILENAME& path);
+        JournalRecovery recoverJournal(const FILENAME& path, const FILENAME& destination);
+    }
+}
@@ -0,0 +1,231 @@
+#include "SaveWriterThread.h"
+#include "common.h"
+#include <chrono>
+#include <algorithm>
+
+using std::unique_ptr;
+using std::unique_lock;
+using std::mutex;
+using std::chrono::steady_clock;
+
+namespace CLAMP {
+    namespace IO {
+        static const uint64_t DEFAULT_MEMORY_BUDGET = 64 * KILO * KILO;
+
+        SaveQueueStatistics::SaveQueueStatistics() :
+            bytesQueued(0),
+            peakBytesQueued(0),
+            memoryBudget(DEFAULT_MEMORY_BUDGET),
+            bytesWritten(0),
+            stalls(0),
+            stallSeconds(0)
+        {
+        }
+
+        double SaveQueueStatistics::percentageFull() const {
+            return (memoryBudget == 0) ? 0.0 : 100.0 * bytesQueued / memoryBudget;
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /// The writer thread shared by all asynchronous save files
+        SaveWriterThread& SaveWriterThread::instance() {
+            static SaveWriterThread theInstance;
+            return theInstance;
+        }
+
+        SaveWriterThread::SaveWriterThread() :
+            Thread(),
+            writing(nullptr),
+            running(false)
+        {
+            // Disk writes can wait; queued data is bounded by the memory budget
+            setScheduling(LOW_PRIORITY);
+        }
+
+        SaveWriterThread::~SaveWriterThread() {
+            // Writes everything that's still queued before returning
+            close();
+        }
+
+        /** \brief Set the maximum amount of data that can be queued.
+         *
+         *  \param[in] bytes  Memory budget, in bytes
+         */
+        void SaveWriterThread::setMemoryBudget(uint64_t bytes) {
+            unique_lock<mutex> lock(queueMutex);
+            stats.memoryBudget = bytes;
+            spaceAvailable.notify_all();
+        }
+
+        /// Current backpressure statistics
+        SaveQueueStatistics SaveWriterThread::getStatistics() const {
+            unique_lock<mutex> lock(queueMutex);
+            return stats;
+        }
+
+        /// Reset the peak and stall statistics (e.g., at the start of a recording)
+        void SaveWriterThread::resetStatistics() {
+            unique_lock<mutex> lock(queueMutex);
+            stats.peakBytesQueued = stats.bytesQueued;
+            stats.bytesWritten = 0;
+            stats.stalls = 0;
+            stats.stallSeconds = 0;
+        }
+
+        void SaveWriterThread::run() {
+            while (true) {
+                unique_lock<mutex> lock(queueMutex);
+                while (queue.empty() && keepGoing) {
+                    // keepGoing isn't protected by the mutex, so don't wait forever
+                    dataAvailable.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                if (queue.empty()) {
+                    break; // Stopped, and everything has been written
+                }
+
+                Block block = std::move(queue.front());
+                queue.pop_front();
+                writing = block.owner;
+                lock.unlock();
+
+                std::exception_ptr error;
+                try {
+                    if (block.stream) {
+                        block.stream->target->write(block.data.data(), static_cast<int>(block.data.size()));
+                    }
+                    else {
+                        block.task();
+                    }
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                lock.lock();
+                if (error && !*block.error) {
+                    *block.error = error;
+                }
+                stats.bytesQueued -= block.bytes;
+                stats.bytesWritten += block.bytes;
+                writing = nullptr;
+                spaceAvailable.notify_all();
+            }
+        }
+
+        void SaveWriterThread::enqueue(AsyncFileOutStream* stream, const char* data, int len) {
+            Block block;
+            block.owner = stream;
+            block.stream = stream;
+            block.data.assign(data, data + len);
+            block.bytes = len;
+            block.error = &stream->error;
+            push(std::move(block));
+        }
+
+        /** \brief Queues a task to run on the writer thread.
+         *
+         *  \param[in] owner  Identifies the writer, for drain(); tasks with the same owner run in the order queued
+         *  \param[in] task   Task; if it throws, the exception is stored in *error
+         *  \param[in] bytes  Size of the data the task holds, counted against the memory budget until it has run
+         *  \param[in] error  The owner's error slot, guarded by queueMutex; a stored error is rethrown here
+         */
+        void SaveWriterThread::enqueueTask(const void* owner, const std::function<void()>& task, uint64_t bytes, std::exception_ptr* error) {
+            Block block;
+            block.owner = owner;
+            block.stream = nullptr;
+            block.task = task;
+            block.bytes = bytes;
+            block.error = error;
+            push(std::move(block));
+        }
+
+        void SaveWriterThread::push(Block&& block) {
+            unique_lock<mutex> lock(queueMutex);
+            if (*block.error) {
+                std::rethrow_exception(*block.error);
+            }
+            if (!running) {
+                start();
+                running = true;
+            }
+
+            // Backpressure: wait for the disk to catch up.  A block that's bigger than the whole budget is let through
+            // once the queue is empty, rather than blocking forever.
+            uint64_t len = block.bytes;
+            if (stats.bytesQueued > 0 && stats.bytesQueued + len > stats.memoryBudget) {
+                steady_clock::time_point stallStart = steady_clock::now();
+                while (stats.bytesQueued > 0 && stats.bytesQueued + len > stats.memoryBudget) {
+                    spaceAvailable.wait(lock);
+                }
+                stats.stalls++;
+                stats.stallSeconds += std::chrono::duration<double>(steady_clock::now() - stallStart).count();
+            }
+
+            queue.push_back(std::move(block));
+
+            stats.bytesQueued += len;
+            stats.peakBytesQueued = std::max(stats.peakBytesQueued, stats.bytesQueued);
+            dataAvailable.notify_one();
+        }
+
+        // Waits until everything owner has queued has been written
+        void SaveWriterThread::drain(const void* owner) {
+            unique_lock<mutex> lock(queueMutex);
+            while (true) {
+                bool pending = (writing == owner) ||
+                               std::any_of(queue.begin(), queue.end(), [owner](const Block& b) { return b.owner == owner; });
+                if (!pending) {
+                    break;
+                }
+                spaceAvailable.wait(lock);
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------
+        /** \brief Constructor
+         *
+         *  \param[in] target_  Already-opened stream that the writer thread writes to
+         */
+        AsyncFileOutStream::AsyncFileOutStream(unique_ptr<FileOutStream>&& target_) :
+            FileOutStream(),
+            target(std::move(target_)),
+            writer(SaveWriterThread::instance())
+        {
+        }
+
+        /// Waits until all of this stream's queued data has been written, then closes the underlying file.
+        AsyncFileOutStream::~AsyncFileOutStream() {
+            writer.drain(this);
+        }
+
+        int AsyncFileOutStream::write(const char* data, int len) {
+            writer.enqueue(this, data, len);
+            return len;
+        }
+
+        /// Flushes the underlying file on the writer thread, once the data queued before it has been written
+        void AsyncFileOutStream::flush() {
+            FileOutStream* file = target.get();
+            writer.enqueueTask(this, [file]() { file->flush(); }, 0, &error);
+        }
+
+        /// Waits until all of this stream's queued data has been written, then closes the underlying file; throws the
+        /// first error the writer thread ran into, if it wasn't already thrown from write() or flush().
+        void AsyncFileOutStream::close() {
+            writer.drain(this);
+            std::exception_ptr failure = error;
+            error = nullptr;
+            try {
+                target->close();
+            }
+            catch (...) {
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+    }
+}
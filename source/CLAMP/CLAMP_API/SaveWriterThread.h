@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Thread.h"
+#include "streams.h"
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+namespace CLAMP {
+    namespace IO {
+        class AsyncFileOutStream;
+
+        /// Backpressure statistics for SaveWriterThread
+        struct SaveQueueStatistics {
+            /// Bytes currently queued and not yet written to disk
+            uint64_t bytesQueued;
+            /// Largest value of bytesQueued seen since the statistics were last reset
+            uint64_t peakBytesQueued;
+            /// Memory budget; writers block when bytesQueued would exceed this
+            uint64_t memoryBudget;
+            /// Total bytes written to disk by the writer thread
+            uint64_t bytesWritten;
+            /// Number of times a writer had to wait because the queue was over budget
+            unsigned int stalls;
+            /// Total time writers spent waiting because the queue was over budget, in seconds
+            double stallSeconds;
+
+            SaveQueueStatistics();
+
+            /// How full the queue is, as a percentage [0-100] of the memory budget
+            double percentageFull() const;
+        };
+
+        /** \brief Background thread that does the disk I/O for save files.
+         *
+         *  When a SaveFile (or a Channel's raw log) is opened in asynchronous mode, its data blocks are handed to this thread
+         *  rather than written to disk on the caller's thread, so a slow disk or network share doesn't stall acquisition.
+         *
+         *  Queued data is limited to a memory budget (see setMemoryBudget).  When the budget is used up, writers block until
+         *  the disk catches up; how often and for how long that happens is recorded in SaveQueueStatistics, which can be
+         *  displayed alongside the FPGA's FIFO statistics.
+         *
+         *  Writers that don't go through a stream (e.g., NWBFile, whose library does its own file I/O) queue tasks instead;
+         *  a task runs on this thread, in order with everything else its owner queued, and counts against the budget with
+         *  the size of the data it captured.
+         *
+         *  There is a single instance, shared by all open files; it's started the first time data is queued.
+         */
+        class SaveWriterThread : public Thread {
+        public:
+            static SaveWriterThread& instance();
+
+            ~SaveWriterThread();
+
+            void run() override;
+
+            void setMemoryBudget(uint64_t bytes);
+            SaveQueueStatistics getStatistics() const;
+            void resetStatistics();
+
+        private:
+            SaveWriterThread();
+
+            /// \cond private
+            struct Block {
+                const void* owner;              // Stream or other writer that queued it
+                AsyncFileOutStream* stream;     // Set for data blocks...
+                std::vector<char> data;
+                std::function<void()> task;     //   and null for tasks
+                uint64_t bytes;                 // Counted against the memory budget
+                std::exception_ptr* error;      // Where a failure is reported
+            };
+            /// \endcond
+
+            mutable std::mutex queueMutex;
+            std::condition_variable dataAvailable; // Signalled when a block is queued
+            std::condition_variable spaceAvailable; // Signalled when a block has been written
+            std::deque<Block> queue;
+            const void* writing; // Owner whose block is being written right now, if any
+            SaveQueueStatistics stats;
+            bool running;
+
+            void enqueue(AsyncFileOutStream* stream, const char* data, int len);
+            void enqueueTask(const void* owner, const std::function<void()>& task, uint64_t bytes, std::exception_ptr* error);
+            void push(Block&& block);
+            void drain(const void* owner);
+            friend class AsyncFileOutStream;
+            friend class DirectFileOutStream;
+            friend class NWBFile;
+        };
+
+        /** \brief FileOutStream that hands its data to SaveWriterThread instead of writing it directly.
+         *
+         *  Errors from the underlying file are thrown from the next write() or flush() after they occur.  close() waits for
+         *  everything queued to be written, so an error from the last write is thrown from there; the destructor waits
+         *  too, but can't report it.
+         */
+        class AsyncFileOutStream : public FileOutStream {
+        public:
+            AsyncFileOutStream(std::unique_ptr<FileOutStream>&& target_);
+            ~AsyncFileOutStream();
+
+            int write(const char* data, int len) override;
+            void flush() override;
+            void close() override;
+
+        private:
+            std::unique_ptr<FileOutStream> target;
+            SaveWriterThread& writer;
+
+            // Set by the writer thread if writing to target fails
+            std::exception_ptr error;
+
+            friend class SaveWriterThread;
+        };
+    }
+}
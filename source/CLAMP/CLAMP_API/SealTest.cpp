@@ -0,0 +1,231 @@
+#include "SealTest.h"
+#include "SimplifiedWaveform.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+
+namespace CLAMP {
+    /** \brief Constructor.
+     *
+     *  \param[in] board_     Board the channels are on
+     *  \param[in] channels_  Channels to test; they should already be in voltage clamp
+     */
+    SealTest::SealTest(Board& board_, const ChipChannelList& channels_) :
+        board(board_),
+        channels(channels_),
+        holdingSteps(0),
+        amplitudeSteps(4),
+        stepSize(2.5e-3),
+        halfPeriodSeconds(5e-3),
+        updateInterval(0.05),
+        halfPeriod(0),
+        period(0),
+        settle(0),
+        pulseCount(0)
+    {
+        if (channels.empty()) {
+            throw invalid_argument("Seal test needs at least one channel");
+        }
+    }
+
+    SealTest::~SealTest() {
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+    }
+
+    /** \brief Sets the test pulse.  Call this before run().
+     *
+     *  \param[in] holdingSteps_       Holding voltage, in clamp steps
+     *  \param[in] amplitudeSteps_     Pulse amplitude, relative to holding, in clamp steps (default 4, i.e., 10 mV)
+     *  \param[in] stepSize_           Clamp step size the channels are set to, in volts (2.5 mV or 5 mV)
+     *  \param[in] halfPeriodSeconds_  Length of each half of the pulse (holding, then the step), in seconds (default 5 ms)
+     */
+    void SealTest::setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_) {
+        if (amplitudeSteps_ == 0 || stepSize_ <= 0 || halfPeriodSeconds_ <= 0) {
+            throw invalid_argument("Seal test pulse needs a nonzero amplitude and a positive length");
+        }
+        holdingSteps = holdingSteps_;
+        amplitudeSteps = amplitudeSteps_;
+        stepSize = stepSize_;
+        halfPeriodSeconds = halfPeriodSeconds_;
+    }
+
+    /// Sets how often readings are published, in seconds (default 50 ms, i.e., 20 updates a second)
+    void SealTest::setUpdateInterval(double seconds) {
+        updateInterval = seconds;
+    }
+
+    /** \brief Runs the seal test until the time is up or stop() is called.
+     *
+     *  Replaces the channels' command lists and enables only these channels; the caller restores whatever it needs
+     *  afterwards.
+     *
+     *  \param[in] seconds   How long to run; 0 to run until stop() is called
+     *  \param[in] callback  If given, called with each update's readings; see UpdateCallback
+     */
+    void SealTest::run(double seconds, const UpdateCallback& callback) {
+        double samplingRate = board.getSamplingRateHz();
+        halfPeriod = std::max(2u, static_cast<unsigned int>(std::lround(halfPeriodSeconds * samplingRate)));
+        period = 2 * halfPeriod;
+        settle = halfPeriod / 2; // The capacitive transient has died away by the second half of each half
+        uint64_t timestepsToRun = (seconds > 0) ? static_cast<uint64_t>(std::llround(seconds * samplingRate)) : 0;
+        uint64_t updateTimesteps = std::max<uint64_t>(1, static_cast<uint64_t>(std::llround(updateInterval * samplingRate)));
+
+        SimplifiedWaveform waveform;
+        waveform.push_back(WaveformSegment(0, holdingSteps, halfPeriod, 0, false, false));
+        waveform.push_back(WaveformSegment(0, holdingSteps + amplitudeSteps, halfPeriod, 0, true, true));
+        waveform.setStepSize(stepSize, 0);
+
+        keepGoing.reset();
+        pulseCount = 0;
+        states.clear();
+        {
+            lock_guard<mutex> lock(readingMutex);
+            readings.clear();
+        }
+
+        board.enableChannels(channels, true);
+        board.controller.simplifiedWaveformToWaveform(channels, true, waveform);
+        board.commandsToFPGA();
+
+        for (const ChipChannel& channel : channels) {
+            ChannelState& state = states[channel];
+            callbackIds.push_back(board.addSampleCallback(channel, Board::MEASURED_CURRENT, [this, &state](const SampleSpan& span) {
+                onSamples(state, span);
+            }));
+        }
+
+        board.readQueue.clear(true);
+        board.runContinuously();
+        try {
+            uint64_t timesteps = 0;
+            uint64_t nextUpdate = updateTimesteps;
+            while (keepGoing && (timestepsToRun == 0 || timesteps < timestepsToRun)) {
+                timesteps += board.read(halfPeriod, &keepGoing);
+                board.readQueue.clear(false);
+                if (timesteps >= nextUpdate) {
+                    nextUpdate = timesteps + updateTimesteps;
+                    vector<SealTestReading> update = publish();
+                    if (callback && !update.empty()) {
+                        callback(update);
+                    }
+                }
+            }
+        }
+        catch (...) {
+            board.stop();
+            board.flush();
+            board.readQueue.clear(true);
+            for (unsigned int id : callbackIds) {
+                board.removeSampleCallback(id);
+            }
+            callbackIds.clear();
+            throw;
+        }
+        board.stop();
+        board.flush();
+        board.readQueue.clear(true);
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+        callbackIds.clear();
+    }
+
+    /// Makes run() return, without waiting for the current read to finish; may be called from any thread.
+    void SealTest::stop() {
+        keepGoing.requestStop();
+    }
+
+    /// The channel's latest reading; its pulse count is 0 if none has been published yet.  May be called from any thread.
+    SealTestReading SealTest::getReading(const ChipChannel& channel) const {
+        lock_guard<mutex> lock(readingMutex);
+        auto found = readings.find(channel);
+        if (found == readings.end()) {
+            SealTestReading none;
+            none.channel = channel;
+            return none;
+        }
+        return found->second;
+    }
+
+    // Adds one chunk to the running sums.  The phase within the pulse comes from the timestamp, as in
+    // SimplifiedWaveform::getApplied(); a pulse is complete when the phase wraps around.
+    void SealTest::onSamples(ChannelState& state, const SampleSpan& span) {
+        const Sample* v = span.samples;
+        const uint32_t* t = span.timestamps;
+        for (std::size_t i = 0; i < span.length; i++) {
+            uint32_t phase = t[i] % period;
+            if (state.havePrevious && (phase < state.lastPhase || t[i] - state.lastTimestamp >= period)) {
+                finishPulse(state);
+            }
+            if (phase >= halfPeriod + settle) {
+                state.stepSum += v[i];
+                state.stepCount++;
+            }
+            else if (phase >= settle && phase < halfPeriod) {
+                state.holdingSum += v[i];
+                state.holdingCount++;
+            }
+            state.havePrevious = true;
+            state.lastPhase = phase;
+            state.lastTimestamp = t[i];
+        }
+    }
+
+    // Folds the pulse just ended into the update's sums.  Pulses missing either half (the first, if the data started
+    // partway through, or any cut short by a gap in the timestamps) are dropped.
+    void SealTest::finishPulse(ChannelState& state) {
+        if (state.holdingCount > 0 && state.stepCount > 0) {
+            double holding = state.holdingSum / state.holdingCount;
+            state.deltaSum += state.stepSum / state.stepCount - holding;
+            state.holdingTotal += holding;
+            state.pulses++;
+            state.pulseTimestamp = state.lastTimestamp;
+            pulseCount++;
+        }
+        state.holdingSum = 0;
+        state.holdingCount = 0;
+        state.stepSum = 0;
+        state.stepCount = 0;
+    }
+
+    // Turns each channel's pulses since the previous update into a reading.  Averaging the current steps before
+    // dividing keeps a noisy pulse with a near-zero step from throwing the resistance off.
+    vector<SealTestReading> SealTest::publish() {
+        vector<SealTestReading> update;
+        double amplitude = amplitudeSteps * stepSize;
+        for (auto& element : states) {
+            ChannelState& state = element.second;
+            if (state.pulses == 0) {
+                continue;
+            }
+            SealTestReading reading;
+            reading.channel = element.first;
+            double delta = state.deltaSum / state.pulses;
+            reading.resistance = (delta != 0) ? amplitude / delta : std::numeric_limits<double>::infinity();
+            reading.holdingCurrent = state.holdingTotal / state.pulses;
+            reading.pulses = state.pulses;
+            reading.timestamp = state.pulseTimestamp;
+            update.push_back(reading);
+
+            state.deltaSum = 0;
+            state.holdingTotal = 0;
+            state.pulses = 0;
+        }
+        if (!update.empty()) {
+            lock_guard<mutex> lock(readingMutex);
+            for (const SealTestReading& reading : update) {
+                readings[reading.channel] = reading;
+            }
+        }
+        return update;
+    }
+}
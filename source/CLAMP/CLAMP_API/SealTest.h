@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Board.h"
+#include "StopToken.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    /// One channel's resistance, as published by SealTest
+    struct SealTestReading {
+        ClampConfig::ChipChannel channel; ///< Channel it's for
+        double resistance;                ///< Step amplitude over the mean steady-state current step, in ohms; infinite if the current didn't change
+        double holdingCurrent;            ///< Mean steady-state current at the holding voltage, in amps
+        unsigned int pulses;              ///< Pulses averaged into this reading
+        uint32_t timestamp;               ///< Timestamp of the last of those pulses
+
+        SealTestReading() : resistance(0), holdingCurrent(0), pulses(0), timestamp(0) {}
+    };
+
+    /** \brief High-rate seal test: pipette or seal resistance from a short voltage pulse, looped continuously.
+     *
+     *  run() loads a square pulse (the holding voltage, then the holding voltage plus the test amplitude, for one half
+     *  period each) into Waveform RAM and runs the board continuously, so the pulse repeats with no host involvement:
+     *  at the default 5 ms per half, that's 100 pulses a second.
+     *
+     *  Each channel's measured current is averaged as ReadQueue decodes it (see Board::addSampleCallback()), over the
+     *  settled end of each half, so a pulse's current step is known as soon as its last sample is read, and only a few
+     *  running sums are kept.  Every update interval, the pulses since the previous update are combined into one
+     *  SealTestReading per channel, passed to the callback and kept for getReading(); nothing goes through DataStore
+     *  or the plots.
+     \code
+        board.controller.switchToVoltageClampImmediate(channelList, holding, bandwidth, resistance, 0);
+        SealTest sealTest(board, channelList);
+        sealTest.setPulse(holding, 4, 2.5e-3); // 10 mV
+        sealTest.run(0, [&](const std::vector<SealTestReading>& readings) {
+            // ... readings[i].resistance ...
+        });
+     \endcode
+     */
+    class SealTest {
+    public:
+        /// Called every update interval on the thread that called run(), with one reading per channel that completed a pulse
+        typedef std::function<void(const std::vector<SealTestReading>&)> UpdateCallback;
+
+        SealTest(Board& board_, const ClampConfig::ChipChannelList& channels_);
+        ~SealTest();
+
+        void setPulse(int holdingSteps_, int amplitudeSteps_, double stepSize_, double halfPeriodSeconds_ = 5e-3);
+        void setUpdateInterval(double seconds);
+
+        void run(double seconds = 0, const UpdateCallback& callback = UpdateCallback());
+        void stop();
+
+        SealTestReading getReading(const ClampConfig::ChipChannel& channel) const;
+        /// Pulses measured since run() started, over all channels
+        uint64_t getPulseCount() const { return pulseCount; }
+
+    private:
+        /// \cond private
+        // Per-channel sums, carried from one chunk to the next
+        struct ChannelState {
+            double holdingSum;    // Current pulse: settled holding samples
+            unsigned int holdingCount;
+            double stepSum;       // Current pulse: settled step samples
+            unsigned int stepCount;
+            bool havePrevious;
+            uint32_t lastPhase;   // Phase and timestamp of the newest sample
+            uint32_t lastTimestamp;
+            double deltaSum;      // Completed pulses since the last update: current steps
+            double holdingTotal;  //   and holding currents
+            unsigned int pulses;
+            uint32_t pulseTimestamp; // Newest sample of the last completed pulse
+
+            ChannelState() : holdingSum(0), holdingCount(0), stepSum(0), stepCount(0), havePrevious(false), lastPhase(0), lastTimestamp(0),
+                deltaSum(0), holdingTotal(0), pulses(0), pulseTimestamp(0) {}
+        };
+        /// \endcond
+
+        Board& board;
+        ClampConfig::ChipChannelList channels;
+        int holdingSteps;
+        int amplitudeSteps;
+        double stepSize;
+        double halfPeriodSeconds;
+        double updateInterval;
+
+        // Pulse timing, in timesteps; set by run()
+        uint32_t halfPeriod;
+        uint32_t period;
+        uint32_t settle;
+
+        std::map<ClampConfig::ChipChannel, ChannelState> states;
+        std::vector<unsigned int> callbackIds;
+        mutable std::mutex readingMutex;
+        std::map<ClampConfig::ChipChannel, SealTestReading> readings; // Guarded by readingMutex
+        std::atomic<uint64_t> pulseCount;
+        StopToken keepGoing;
+
+        void onSamples(ChannelState& state, const SampleSpan& span);
+        void finishPulse(ChannelState& state);
+        std::vector<SealTestReading> publish();
+
+        // Not copyable
+        SealTest(const SealTest&);
+        SealTest& operator=(const SealTest&);
+    };
+}
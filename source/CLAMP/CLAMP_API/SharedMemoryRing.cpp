@@ -0,0 +1,265 @@
+#include "SharedMemoryRing.h"
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::runtime_error;
+using std::invalid_argument;
+
+namespace CLAMP {
+    namespace IO {
+        static const std::size_t WRITE_INDEX_OFFSET = 64;
+
+        /// \cond private
+        // A named shared memory region, created by the ring or opened by a reader
+        struct SharedMapping {
+            uint8_t* base;
+            std::size_t bytes;
+            bool owner;
+#if defined(_WIN32)
+            HANDLE handle;
+#else
+            string name;
+#endif
+
+            SharedMapping(const string& name_, std::size_t bytes_, bool create);
+            ~SharedMapping();
+        };
+        /// \endcond
+
+        // Creates the region (create = true, with the given size) or opens an existing one (the size is read from it)
+        SharedMapping::SharedMapping(const string& name_, std::size_t bytes_, bool create) :
+            base(nullptr),
+            bytes(bytes_),
+            owner(create)
+        {
+            if (name_.empty() || name_.find('/') != string::npos || name_.find('\\') != string::npos) {
+                throw invalid_argument("Invalid shared memory name " + name_);
+            }
+#if defined(_WIN32)
+            string fullName = "Local\\" + name_;
+            if (create) {
+                uint64_t size = bytes;
+                handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32),
+                                            static_cast<DWORD>(size), fullName.c_str());
+            }
+            else {
+                handle = OpenFileMappingA(FILE_MAP_READ, FALSE, fullName.c_str());
+            }
+            if (!handle) {
+                throw runtime_error("Couldn't open shared memory " + fullName);
+            }
+            base = static_cast<uint8_t*>(MapViewOfFile(handle, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, create ? bytes : 0));
+            if (!base) {
+                CloseHandle(handle);
+                throw runtime_error("Couldn't map shared memory " + fullName);
+            }
+            if (!create) {
+                MEMORY_BASIC_INFORMATION info;
+                VirtualQuery(base, &info, sizeof(info));
+                bytes = info.RegionSize;
+            }
+#else
+            name = "/" + name_;
+            int fd = create ? shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600) : shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) {
+                throw runtime_error("Couldn't open shared memory " + name);
+            }
+            if (create) {
+                if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+                    ::close(fd);
+                    shm_unlink(name.c_str());
+                    throw runtime_error("Couldn't size shared memory " + name);
+                }
+            }
+            else {
+                struct stat info;
+                fstat(fd, &info);
+                bytes = static_cast<std::size_t>(info.st_size);
+            }
+            void* address = mmap(nullptr, bytes, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd); // The mapping keeps the memory
+            if (address == MAP_FAILED) {
+                if (create) {
+                    shm_unlink(name.c_str());
+                }
+                throw runtime_error("Couldn't map shared memory " + name);
+            }
+            base = static_cast<uint8_t*>(address);
+#endif
+        }
+
+        SharedMapping::~SharedMapping() {
+#if defined(_WIN32)
+            UnmapViewOfFile(base);
+            CloseHandle(handle);
+#else
+            munmap(base, bytes);
+            if (owner) {
+                shm_unlink(name.c_str()); // Readers that still have it mapped keep it until they unmap it
+            }
+#endif
+        }
+
+        static uint32_t get32(const uint8_t* p) {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+
+        static void put32(uint8_t* p, uint32_t value) {
+            for (unsigned int i = 0; i < 4; i++) {
+                p[i] = static_cast<uint8_t>(value >> (8 * i));
+            }
+        }
+
+        static std::atomic<uint64_t>* atomicAt(uint8_t* p) {
+            return reinterpret_cast<std::atomic<uint64_t>*>(p);
+        }
+
+        /** \brief Creates the shared memory region, replacing any left over with the same name.
+         *
+         *  \param[in] board_    Board whose data to publish
+         *  \param[in] name      Name of the region; readers open it with this name.
+         *  \param[in] numSlots  Number of frames the ring holds
+         */
+        SharedMemoryRing::SharedMemoryRing(Board& board_, const string& name, std::size_t numSlots_) :
+            StreamFramer(board_),
+            mapping(new SharedMapping(name, HEADER_BYTES + numSlots_ * SLOT_BYTES, true)),
+            numSlots(numSlots_),
+            writeIndex(nullptr)
+        {
+            if (numSlots == 0) {
+                throw invalid_argument("A shared memory ring needs at least one slot");
+            }
+            uint8_t* header = mapping->base;
+            std::memset(header, 0, HEADER_BYTES);
+            put32(header + 4, RING_VERSION);
+            put32(header + 8, static_cast<uint32_t>(HEADER_BYTES));
+            put32(header + 12, static_cast<uint32_t>(SLOT_BYTES));
+            put32(header + 16, static_cast<uint32_t>(numSlots));
+            put32(header + 20, static_cast<uint32_t>(numSlots >> 32));
+            writeIndex = new (header + WRITE_INDEX_OFFSET) std::atomic<uint64_t>(0);
+            for (uint64_t i = 0; i < numSlots; i++) {
+                new (header + HEADER_BYTES + i * SLOT_BYTES) std::atomic<uint64_t>(0);
+            }
+            // The magic number goes in last, so a reader never sees a half-initialized ring
+            std::atomic_thread_fence(std::memory_order_release);
+            put32(header, RING_MAGIC);
+        }
+
+        SharedMemoryRing::~SharedMemoryRing() {
+            detach();
+        }
+
+        /// Number of frames written so far
+        uint64_t SharedMemoryRing::getFramesWritten() const {
+            return writeIndex->load(std::memory_order_relaxed);
+        }
+
+        // Called on the reading thread; overwrites the oldest slot, without waiting for anyone
+        void SharedMemoryRing::publish(StreamFrame& frame) {
+            uint64_t n = writeIndex->load(std::memory_order_relaxed);
+            uint8_t* slot = mapping->base + HEADER_BYTES + (n % numSlots) * SLOT_BYTES;
+            std::atomic<uint64_t>* stamp = atomicAt(slot);
+
+            stamp->store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release); // Readers see the 0 before any of the new frame
+            put32(slot + 8, static_cast<uint32_t>(frame.size));
+            std::memcpy(slot + SLOT_HEADER_BYTES, frame.bytes, frame.size);
+            stamp->store(n + 1, std::memory_order_release);
+            writeIndex->store(n + 1, std::memory_order_release);
+        }
+
+        //------------------------------------------------------------------------------
+
+        /** \brief Opens a ring created by SharedMemoryRing.
+         *
+         *  Reading starts with the next frame written.  Throws an exception if there is no such ring.
+         *
+         *  \param[in] name  Name the ring was created with
+         */
+        SharedMemoryRingReader::SharedMemoryRingReader(const string& name) :
+            mapping(new SharedMapping(name, 0, false)),
+            numSlots(0),
+            writeIndex(nullptr),
+            nextFrame(0),
+            currentFrame(0),
+            framesLost(0)
+        {
+            const uint8_t* header = mapping->base;
+            if (mapping->bytes < SharedMemoryRing::HEADER_BYTES || get32(header) != SharedMemoryRing::RING_MAGIC ||
+                get32(header + 4) != SharedMemoryRing::RING_VERSION || get32(header + 12) != SharedMemoryRing::SLOT_BYTES) {
+                throw runtime_error("Shared memory " + name + " isn't a CLAMP ring");
+            }
+            numSlots = get32(header + 16) | (static_cast<uint64_t>(get32(header + 20)) << 32);
+            if (mapping->bytes < SharedMemoryRing::HEADER_BYTES + numSlots * SharedMemoryRing::SLOT_BYTES) {
+                throw runtime_error("Shared memory " + name + " is truncated");
+            }
+            writeIndex = reinterpret_cast<const std::atomic<uint64_t>*>(header + WRITE_INDEX_OFFSET);
+            nextFrame = writeIndex->load(std::memory_order_acquire);
+            currentFrame = nextFrame;
+        }
+
+        SharedMemoryRingReader::~SharedMemoryRingReader() {
+        }
+
+        const uint8_t* SharedMemoryRingReader::slot(uint64_t frame) const {
+            return mapping->base + SharedMemoryRing::HEADER_BYTES + (frame % numSlots) * SharedMemoryRing::SLOT_BYTES;
+        }
+
+        uint64_t SharedMemoryRingReader::stamp(uint64_t frame) const {
+            return reinterpret_cast<const std::atomic<uint64_t>*>(slot(frame))->load(std::memory_order_acquire);
+        }
+
+        /** \brief Returns the next frame, in place.
+         *
+         *  \param[out] frame  Start of the frame, in the shared memory; it stays there until the ring wraps around, but
+         *                     check valid() after using it.
+         *  \param[out] size   Size of the frame, in bytes
+         *  \returns FRAME, EMPTY, or OVERRUN; frame and size are only set for FRAME.
+         */
+        SharedMemoryRingReader::Result SharedMemoryRingReader::next(const uint8_t*& frame, std::size_t& size) {
+            uint64_t written = writeIndex->load(std::memory_order_acquire);
+            if (nextFrame >= written) {
+                return EMPTY;
+            }
+            // Leave one slot of slack; the writer may already be overwriting the oldest one
+            if (written - nextFrame >= numSlots) {
+                uint64_t resume = written - numSlots + 1;
+                framesLost += resume - nextFrame;
+                nextFrame = resume;
+                return OVERRUN;
+            }
+            if (stamp(nextFrame) != nextFrame + 1) {
+                framesLost++;
+                nextFrame++;
+                return OVERRUN;
+            }
+            const uint8_t* s = slot(nextFrame);
+            size = get32(s + 8);
+            frame = s + SharedMemoryRing::SLOT_HEADER_BYTES;
+            currentFrame = nextFrame++;
+            return FRAME;
+        }
+
+        /// True if the frame last returned by next() hasn't been overwritten (so far).
+        bool SharedMemoryRingReader::valid() const {
+            std::atomic_thread_fence(std::memory_order_acquire); // Order the reads of the frame before the stamp's
+            return stamp(currentFrame) == currentFrame + 1;
+        }
+
+        /// Number of frames the reader missed because it fell behind
+        uint64_t SharedMemoryRingReader::getFramesLost() const {
+            return framesLost;
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "StreamFramer.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace CLAMP {
+    namespace IO {
+        /// \cond private
+        struct SharedMapping;
+        /// \endcond
+
+        /** \brief Publishes live data through shared memory, for analysis processes on the same computer.
+         *
+         *  The acquisition side writes the frames built by StreamFramer (see there for the frame format) into a ring of
+         *  fixed-size slots in a named shared memory region; any number of other processes can map it and read the frames
+         *  in place.  Writing never waits for the readers: a reader that falls more than a ring's worth behind loses
+         *  frames, and can tell that it did (see SharedMemoryRingReader).  Any program that can map shared memory can
+         *  read the ring; SharedMemoryRingReader does it for C++.
+         *
+         *  The region is named POSIX shared memory ("/name", under /dev/shm on Linux) or, on Windows, a named file mapping
+         *  ("Local\\name").  It starts with a HEADER_BYTES header, followed by the slots; all fields are little-endian:
+         \verbatim
+            offset  size  field
+            0       4     magic number (RING_MAGIC: the bytes "CLSR")
+            4       4     version (RING_VERSION)
+            8       4     offset of the first slot (HEADER_BYTES)
+            12      4     size of each slot (SLOT_BYTES)
+            16      8     number of slots
+            64      8     write index: number of frames written so far (64-bit atomic)
+         \endverbatim
+         *  Frame n is in slot n % (number of slots), which holds:
+         \verbatim
+            offset  size  field
+            0       8     stamp: n + 1 once frame n is completely written, 0 while it's being written (64-bit atomic)
+            8       4     frame size, in bytes
+            16      ...   the frame
+         \endverbatim
+         *  To read frame n: check that n < write index; read the stamp, and skip ahead if it isn't n + 1 (the slot has
+         *  been reused); use the frame; then read the stamp again, and discard what was read if it changed.
+         */
+        class SharedMemoryRing : public StreamFramer {
+        public:
+            static const uint32_t RING_MAGIC = 0x52534C43;
+            static const uint32_t RING_VERSION = 1;
+            static const std::size_t HEADER_BYTES = 128;
+            static const std::size_t SLOT_BYTES = 1472;
+            static const std::size_t SLOT_HEADER_BYTES = 16;
+            /// Default number of slots: about 12 MB, or several seconds of 8 headstages
+            static const std::size_t DEFAULT_SLOTS = 8192;
+
+            SharedMemoryRing(Board& board_, const std::string& name, std::size_t numSlots = DEFAULT_SLOTS);
+            ~SharedMemoryRing();
+
+            uint64_t getFramesWritten() const;
+
+        protected:
+            void publish(StreamFrame& frame) override;
+
+        private:
+            std::unique_ptr<SharedMapping> mapping;
+            uint64_t numSlots;
+            std::atomic<uint64_t>* writeIndex;
+        };
+
+        /** \brief Reads the frames a SharedMemoryRing (in any process) writes.
+         *
+         *  Frames are returned in place, without copying:
+         \code
+            SharedMemoryRingReader reader("clamp");
+            const uint8_t* frame;
+            std::size_t size;
+            while (running) {
+                if (reader.next(frame, size) == SharedMemoryRingReader::FRAME) {
+                    // ... use frame ...
+                    if (!reader.valid()) {
+                        // The writer overwrote the frame while we used it; discard what we got from it
+                    }
+                }
+            }
+         \endcode
+         */
+        class SharedMemoryRingReader {
+        public:
+            /// Results of next()
+            enum Result {
+                FRAME,   ///< A frame was returned
+                EMPTY,   ///< No new frame has been written yet
+                OVERRUN  ///< The reader fell behind and frames were lost; the next call continues with the oldest frame left
+            };
+
+            explicit SharedMemoryRingReader(const std::string& name);
+            ~SharedMemoryRingReader();
+
+            Result next(const uint8_t*& frame, std::size_t& size);
+            bool valid() const;
+            uint64_t getFramesLost() const;
+
+        private:
+            std::unique_ptr<SharedMapping> mapping;
+            uint64_t numSlots;
+            const std::atomic<uint64_t>* writeIndex;
+            uint64_t nextFrame;
+            uint64_t currentFrame; // Frame most recently returned by next()
+            uint64_t framesLost;
+
+            const uint8_t* slot(uint64_t frame) const;
+            uint64_t stamp(uint64_t frame) const;
+        };
+    }
+}
@@ -6,6 +6,34 @@
 using std::vector;
 
 namespace CLAMP {
+    namespace {
+        /* Calls f(run) for each AppliedRun in timestamps [first, end), which must not be empty.
+         *
+         * A segment is looked up once per run of consecutive timestamps within it, rather than once per sample.
+         */
+        template <class F>
+        void forEachAppliedRun(const vector<WaveformSegment>& waveform, const vector<uint32_t>& timestamps, unsigned int first, unsigned int end, F f) {
+            // The waveform repeats every period timesteps
+            uint64_t period = static_cast<uint64_t>(waveform.back().endIndex) + 1;
+            unsigned int i = first;
+            while (i < end) {
+                uint32_t phase = static_cast<uint32_t>(timestamps[i] % period);
+                auto segment = std::lower_bound(waveform.begin(), waveform.end(), phase,
+                    [](const WaveformSegment& s, uint32_t value) { return s.endIndex < value; });
+
+                // The run ends with the segment, or where the timestamps skip
+                uint64_t room = static_cast<uint64_t>(segment->endIndex) - phase + 1;
+                unsigned int runEnd = i + 1;
+                while (runEnd < end && runEnd - i < room && timestamps[runEnd] == timestamps[runEnd - 1] + 1) {
+                    runEnd++;
+                }
+                AppliedRun run = { i, runEnd, static_cast<unsigned int>(segment - waveform.begin()), segment->appliedValue };
+                f(run);
+                i = runEnd;
+            }
+        }
+    }
+
     //------------------------------------------------------------------------------------------
     /** \brief Constructor
      *
@@ -144,27 +172,62 @@ namespace CLAMP {
     /** \brief Returns a vector containing the applied voltage or current
      *
      *  \param[in] timestamps  The timestamps for which to reconstruct the applied voltage or current
-     *  \returns The (partial) applied waveform
+     *  \param[in] first       Index of the first timestamp to use; earlier timestamps are skipped
+     *  \returns The (partial) applied waveform, for timestamps[first] onwards
      */
-    vector<double> SimplifiedWaveform::getApplied(const vector<uint32_t>& timestamps) {
+    vector<double> SimplifiedWaveform::getApplied(const vector<uint32_t>& timestamps, unsigned int first) const {
         vector<double> result;
-        result.reserve(timestamps.size());
-
         if (!waveform.empty()) {
-            uint32_t maxTimestamp = waveform.back().endIndex;
-            auto iter = waveform.begin();
-            for (uint32_t timestamp : timestamps) {
-                timestamp = timestamp % (maxTimestamp + 1);
-                while (iter->endIndex < timestamp) {
-                    iter++;
-                }
-                result.push_back(iter->appliedValue);
-            }
+            getApplied(timestamps, first, static_cast<unsigned int>(timestamps.size()), result);
         }
-
         return result;
     }
 
+    /** \brief Fills a caller-supplied vector with the applied voltage or current, so it can be reused from call to call
+     *
+     *  Each of getAppliedRuns()' runs is filled in with its value.  Use that instead where a value per sample isn't
+     *  needed.
+     *
+     *  \param[in] timestamps  The timestamps for which to reconstruct the applied voltage or current
+     *  \param[in] first       Index of the first timestamp to use
+     *  \param[in] end         One past the index of the last timestamp to use
+     *  \param[out] applied    The applied values for timestamps [first, end); 0 if there's no waveform
+     */
+    void SimplifiedWaveform::getApplied(const vector<uint32_t>& timestamps, unsigned int first, unsigned int end, vector<double>& applied) const {
+        end = std::min(end, static_cast<unsigned int>(timestamps.size()));
+        if (first >= end) {
+            applied.clear();
+            return;
+        }
+        applied.assign(end - first, 0.0);
+        if (waveform.empty()) {
+            return;
+        }
+        forEachAppliedRun(waveform, timestamps, first, end, [&](const AppliedRun& run) {
+            std::fill(applied.begin() + (run.first - first), applied.begin() + (run.end - first), run.value);
+        });
+    }
+
+    /** \brief The applied voltage or current as steps: one run per stretch of consecutive timestamps within a segment
+     *
+     *  Runs break at segment boundaries and wherever the timestamps skip (e.g., between sweeps run at an interval), so
+     *  neighboring runs can have the same value.
+     *
+     *  \param[in] timestamps  The timestamps for which to reconstruct the applied voltage or current
+     *  \param[in] first       Index of the first timestamp to use
+     *  \param[in] end         One past the index of the last timestamp to use
+     *  \param[out] runs       The runs covering timestamps [first, end), in order; none if there's no waveform.  Cleared
+     *                         first, so the caller can reuse it.
+     */
+    void SimplifiedWaveform::getAppliedRuns(const vector<uint32_t>& timestamps, unsigned int first, unsigned int end, vector<AppliedRun>& runs) const {
+        runs.clear();
+        end = std::min(end, static_cast<unsigned int>(timestamps.size()));
+        if (first >= end || waveform.empty()) {
+            return;
+        }
+        forEachAppliedRun(waveform, timestamps, first, end, [&](const AppliedRun& run) { runs.push_back(run); });
+    }
+
     /** Size of this object on disk
      *  \returns The size in bytes
      */
@@ -107,6 +107,22 @@ namespace CLAMP {
     };
     bool operator==(const WaveformSegment& a, const WaveformSegment& b);
 
+    /** \brief A run of consecutive samples during which the applied voltage or current doesn't change.
+     *
+     *  Returned by SimplifiedWaveform::getAppliedRuns(), for code that can use the applied waveform as steps rather than
+     *  a value per sample.
+     */
+    struct AppliedRun {
+        /// Index of the run's first sample
+        unsigned int first;
+        /// One past the index of the run's last sample
+        unsigned int end;
+        /// Index of the WaveformSegment the run is in
+        unsigned int segment;
+        /// Applied voltage or current (the segment's appliedValue)
+        double value;
+    };
+
     /** \brief A logical description of a current or voltage waveform.
      *
      *  Consists of a number of WaveformSegments, each of which corresponds to a piecewise-constant voltage/current step.
@@ -138,7 +154,9 @@ namespace CLAMP {
         void erase();
         unsigned int numWaveforms() const;
         void setStepSize(double value, double offset);
-        std::vector<double> getApplied(const std::vector<uint32_t>& timestamps);
+        std::vector<double> getApplied(const std::vector<uint32_t>& timestamps, unsigned int first = 0) const;
+        void getApplied(const std::vector<uint32_t>& timestamps, unsigned int first, unsigned int end, std::vector<double>& applied) const;
+        void getAppliedRuns(const std::vector<uint32_t>& timestamps, unsigned int first, unsigned int end, std::vector<AppliedRun>& runs) const;
         unsigned int lastIndex(bool overlay) const;
 
         unsigned int onDiskSize() const;
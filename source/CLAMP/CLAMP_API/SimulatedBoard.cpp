@@ -0,0 +1,544 @@
+#include "SimulatedBoard.h"
+#include "Board.h"
+#include "Chip.h"
+#include "Channel.h"
+#include "WaveformCommand.h"
+#include "USBCapture.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::lock_guard;
+using std::mutex;
+using std::runtime_error;
+using std::invalid_argument;
+using std::chrono::steady_clock;
+using namespace CLAMP::ChipProtocol;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::WaveformControl;
+
+namespace CLAMP {
+    /// Constructor
+    SimulatedBoard::SimulatedBoard() :
+        opened(false),
+        board(nullptr),
+        speed(1.0),
+        numWordsInFifo(0),
+        virtualClock(false),
+        clock(0),
+        pollSeconds(0),
+        nextHostDelay(0),
+        running(false),
+        runStartClock(0),
+        runLength(0),
+        produced(0),
+        consumed(0),
+        overflowing(false)
+    {
+    }
+
+    /** \brief Connects the simulated board to the Board that uses it, and to the source of its data.
+     *
+     *  Call this before Board::open().  The board is needed for the packet layout (which depends on the enabled
+     *  channels and data transfer settings).
+     *
+     *  \param[in] board_   Board constructed with this SimulatedBoard
+     *  \param[in] source_  Where the data comes from
+     */
+    void SimulatedBoard::attach(Board& board_, unique_ptr<PacketSource> source_) {
+        lock_guard<mutex> lock(simMutex);
+        board = &board_;
+        source = std::move(source_);
+    }
+
+    /** \brief Sets how fast data is produced, relative to the board's sampling rate.
+     *
+     *  \param[in] factor  1 for real time (the default), 2 for twice as fast, etc.  0 produces data as fast as it's read,
+     *                     for measuring how fast the software can go.
+     */
+    void SimulatedBoard::setSpeed(double factor) {
+        if (factor < 0) {
+            throw invalid_argument("Speed must not be negative");
+        }
+        lock_guard<mutex> lock(simMutex);
+        speed = factor;
+    }
+
+    /** \brief Runs on a simulated clock instead of real time, so runs are reproducible.
+     *
+     *  See the class description.  Takes effect from the next run.
+     *
+     *  \param[in] enable        True for the virtual clock, false for real time (the default)
+     *  \param[in] pollSeconds_  Time each poll of the FIFO level takes on the virtual clock, standing for the USB control
+     *                           transfer and the host's wait before polling again
+     */
+    void SimulatedBoard::setVirtualClock(bool enable, double pollSeconds_) {
+        if (pollSeconds_ < 0) {
+            throw invalid_argument("Poll time must not be negative");
+        }
+        lock_guard<mutex> lock(simMutex);
+        virtualClock = enable;
+        pollSeconds = pollSeconds_;
+    }
+
+    /** \brief Scripts how long the host is busy after each read, on the virtual clock.
+     *
+     *  After each read from the FIFO, the virtual clock advances by the next delay in the list, starting over at the end
+     *  of it, as if the host had spent that long processing the data before reading again.  Starts from the beginning of
+     *  the list.  Ignored in real time.
+     *
+     *  \param[in] seconds  Delays, in seconds; empty for none
+     */
+    void SimulatedBoard::setHostDelays(const vector<double>& seconds) {
+        for (double delay : seconds) {
+            if (delay < 0) {
+                throw invalid_argument("Host delays must not be negative");
+            }
+        }
+        lock_guard<mutex> lock(simMutex);
+        hostDelays = seconds;
+        nextHostDelay = 0;
+    }
+
+    /** \brief Advances the virtual clock, e.g., by the time the host would take to do something.  Ignored in real time.
+     *
+     *  \param[in] seconds  Time to advance by
+     */
+    void SimulatedBoard::advanceClock(double seconds) {
+        if (seconds < 0) {
+            throw invalid_argument("The clock can't go backward");
+        }
+        lock_guard<mutex> lock(simMutex);
+        if (virtualClock) {
+            clock += seconds;
+        }
+    }
+
+    /// What has happened in the FIFO since the current (or last) run started
+    SimulatedFifoStatistics SimulatedBoard::getFifoStatistics() {
+        lock_guard<mutex> lock(simMutex);
+        updateProduced();
+        statistics.runSeconds = runSeconds();
+        return statistics;
+    }
+
+    bool SimulatedBoard::open(const string&, const string&, const string&) {
+        if (!board || !source) {
+            throw runtime_error("SimulatedBoard::attach must be called before opening the board");
+        }
+        opened = true;
+        return true;
+    }
+
+    void SimulatedBoard::uploadFpgaBitfile(const string&) {
+    }
+
+    bool SimulatedBoard::isOpen() const {
+        return opened;
+    }
+
+    //------------------------------------------------------------------------------
+    uint16_t SimulatedBoard::wireIn(int wirein) const {
+        auto iter = wiresIn.find(wirein);
+        return (iter == wiresIn.end()) ? 0 : iter->second;
+    }
+
+    void SimulatedBoard::setWireIn(int wirein, uint16_t value) {
+        lock_guard<mutex> lock(simMutex);
+        wiresIn[wirein] = value;
+    }
+
+    void SimulatedBoard::setWireInBit(int wirein, unsigned long bit, bool value) {
+        lock_guard<mutex> lock(simMutex);
+        uint16_t& word = wiresIn[wirein];
+        word = value ? (word | bit) : (word & ~bit);
+    }
+
+    // Board::stop() clears the run-continuously bit and the maximum timestep; that ends the run
+    void SimulatedBoard::updateWiresIn() {
+        lock_guard<mutex> lock(simMutex);
+        bool continuous = (wireIn(WireIn::RunControl) & BitMask::RunContinuouslyBitMask) != 0;
+        if (running && !continuous && wireIn(WireIn::MaxTimestepLow) == 0 && wireIn(WireIn::MaxTimestepHigh) == 0) {
+            updateProduced();
+            runLength = produced;
+        }
+    }
+
+    // Starts a run; the simulated FIFO starts empty
+    void SimulatedBoard::activateTriggerIn(int epAddr, int bit) {
+        if (epAddr != Triggers::Start || bit != Bit::StartBit) {
+            return;
+        }
+        lock_guard<mutex> lock(simMutex);
+        bool continuous = (wireIn(WireIn::RunControl) & BitMask::RunContinuouslyBitMask) != 0;
+        uint32_t maxTimestep = (static_cast<uint32_t>(wireIn(WireIn::MaxTimestepHigh)) << 16) | wireIn(WireIn::MaxTimestepLow);
+        runLength = continuous ? std::numeric_limits<uint64_t>::max() : maxTimestep + 1ULL;
+        produced = 0;
+        consumed = 0;
+        overflowing = false;
+        statistics = SimulatedFifoStatistics();
+        runStart = steady_clock::now();
+        runStartClock = clock;
+        running = true;
+        source->start();
+    }
+
+    // The waveform RAM isn't simulated; ModelCellSource plays the channels' commands instead
+    long SimulatedBoard::writeToPipeIn(int, long length, unsigned char*) {
+        return length;
+    }
+
+    //------------------------------------------------------------------------------
+    unsigned int SimulatedBoard::packetSize() {
+        return board->getPacketLayout().packetSize;
+    }
+
+    // Seconds since the run started, on whichever clock is in use
+    double SimulatedBoard::runSeconds() const {
+        return virtualClock ? clock - runStartClock : std::chrono::duration<double>(steady_clock::now() - runStart).count();
+    }
+
+    // Brings produced up to date with the time since the run started.  Packets that don't fit in the FIFO are dropped.
+    void SimulatedBoard::updateProduced() {
+        if (!running) {
+            return;
+        }
+        unsigned int packetWords = packetSize() / 2;
+        uint64_t capacity = FIFO_CAPACITY_WORDS / packetWords;
+        if (speed == 0) {
+            // As fast as it's read: keep the FIFO full
+            produced = std::min(runLength, consumed + capacity);
+        }
+        else {
+            double timesteps = runSeconds() * board->getSamplingRateHz() * speed;
+            produced = std::min(runLength, static_cast<uint64_t>(timesteps));
+            if (produced - consumed > capacity) {
+                // Overflow; the oldest data is lost
+                statistics.droppedTimesteps += produced - capacity - consumed;
+                if (!overflowing) {
+                    statistics.overflows++;
+                    overflowing = true;
+                }
+                consumed = produced - capacity;
+            }
+        }
+        statistics.highWaterWords = std::max(statistics.highWaterWords, static_cast<uint32_t>((produced - consumed) * packetWords));
+    }
+
+    // On the virtual clock, moves time on until numPackets are in the FIFO, or the run has produced all it will
+    void SimulatedBoard::waitForPackets(unsigned int numPackets) {
+        if (!running || speed == 0) {
+            return;
+        }
+        uint64_t target = std::min(runLength, consumed + numPackets);
+        // Half a timestep later, so rounding can't leave produced one short of the target
+        double when = runStartClock + (target + 0.5) / (board->getSamplingRateHz() * speed);
+        clock = std::max(clock, when);
+    }
+
+    void SimulatedBoard::updateWiresOut() {
+        lock_guard<mutex> lock(simMutex);
+        if (virtualClock && running) {
+            clock += pollSeconds;
+        }
+        updateProduced();
+        numWordsInFifo = static_cast<uint32_t>((produced - consumed) * (packetSize() / 2));
+    }
+
+    bool SimulatedBoard::getWireOutBit(int wireout, unsigned long bit) {
+        return (getWireOutWord(wireout) & bit) != 0;
+    }
+
+    uint16_t SimulatedBoard::getWireOutWord(int wireout) {
+        lock_guard<mutex> lock(simMutex);
+        switch (wireout) {
+        case WireOut::Programming:
+            return BitMask::DataClkLockedBitMask | BitMask::DcmProgDoneBitMask; // Clock is always ready
+        case WireOut::NumWordsFIFOLow:
+            return numWordsInFifo & 0xFFFF;
+        case WireOut::NumWordsFIFOHigh:
+            return numWordsInFifo >> 16;
+        case WireOut::BoardMode:
+            return CLAMP_BOARD_MODE;
+        case WireOut::BoardId:
+            return CLAMP_BOARD_ID;
+        default:
+            return 0; // No digital inputs, expander board, etc.
+        }
+    }
+
+    uint32_t SimulatedBoard::getWireOutDWord(int wireoutMSB, int wireoutLSB) {
+        return (static_cast<uint32_t>(getWireOutWord(wireoutMSB)) << 16) | getWireOutWord(wireoutLSB);
+    }
+
+    /* Fills data with the next packets of the run.  The real board blocks until enough data is available; so does this,
+     * except that it gives up (and returns zeros past the end) if the run won't produce that much.
+     */
+    long SimulatedBoard::readFromPipeOut(int, long length, unsigned char *data) {
+        unsigned int size = 0;
+        unsigned int numPackets = 0;
+        for (;;) {
+            {
+                lock_guard<mutex> lock(simMutex);
+                size = packetSize();
+                numPackets = static_cast<unsigned int>(length / size);
+                if (virtualClock) {
+                    waitForPackets(numPackets);
+                }
+                updateProduced();
+                if (!running || produced - consumed >= numPackets || produced == runLength) {
+                    numPackets = running ? static_cast<unsigned int>(std::min<uint64_t>(numPackets, produced - consumed)) : 0;
+                    source->generate(data, static_cast<uint32_t>(consumed), numPackets, size);
+                    consumed += numPackets;
+                    overflowing = false;
+                    if (virtualClock && !hostDelays.empty()) {
+                        clock += hostDelays[nextHostDelay];
+                        nextHostDelay = (nextHostDelay + 1) % hostDelays.size();
+                    }
+                    break;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::memset(data + numPackets * size, 0, length - numPackets * size);
+        return length;
+    }
+
+    //------------------------------------------------------------------------------
+    // The pipette charges through the clamp amplifier in a few microseconds, so its transient lasts a sample or two
+    static const double PIPETTE_TIME_CONSTANT = 10e-6;
+
+    /// Constructor, with default parameters for a typical small cell
+    ModelCellSource::Cell::Cell() :
+        accessResistance(10e6),
+        membraneResistance(200e6),
+        membraneCapacitance(30e-12),
+        restingPotential(-0.065),
+        pipetteCapacitance(0),
+        noiseSteps(2.0)
+    {
+    }
+
+    /** \brief Constructor
+     *
+     *  \param[in] board_  Board whose channels' commands are played
+     *  \param[in] cell_   Model cell attached to every channel
+     */
+    ModelCellSource::ModelCellSource(Board& board_, const Cell& cell_) :
+        board(board_),
+        cell(cell_),
+        dt(0),
+        pipetteDecay(0),
+        noise(0.0, (cell_.noiseSteps > 0) ? cell_.noiseSteps : 1.0)
+    {
+        std::memset(registers, 0, sizeof(registers));
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            // ROM registers
+            const char* company = "INTAN";
+            for (unsigned int i = 0; i < 5; i++) {
+                registers[chip][Registers::Global][7 + i] = company[i];
+            }
+            registers[chip][Registers::Global][13] = 1;   // Die revision
+            registers[chip][Registers::Global][14] = 4;   // Number of units
+            registers[chip][Registers::Global][15] = 128; // Chip ID
+            previous[chip] = MOSICommand();
+        }
+        start();
+    }
+
+    // Starts every channel's waveform from the beginning, with the cell at rest
+    void ModelCellSource::start() {
+        dt = 1.0 / (board.getSamplingRateHz() * board.channelRepetition);
+        pipetteDecay = std::exp(-dt / PIPETTE_TIME_CONSTANT);
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                ChipChannel chipChannel(chip, channel);
+                const Channel& c = *board.chip[chip]->channel[channel];
+                Unit& unit = units[chip][channel];
+                unit.commandIndex = 0;
+                unit.repetition = 0;
+                unit.currentClamp = false;
+                unit.commandVoltage = 0;
+                unit.commandCurrent = 0;
+                unit.membranePotential = cell.restingPotential;
+                unit.pipetteCurrent = 0;
+                unit.muxStep = board.controller.mux.toVoltage(chipChannel, 1);
+                unit.feedbackResistance = c.getFeedbackResistance();
+                unit.voltageClampStep = c.getVoltageClampStep();
+                unit.currentStep = c.recallCurrentStep();
+            }
+        }
+    }
+
+    // The MOSI command the FPGA would send next on the given channel, stepping through its (looping) command list
+    MOSICommand ModelCellSource::nextCommand(unsigned int chip, unsigned int channel) {
+        const vector<WaveformCommand>& commands = board.chip[chip]->channel[channel]->commands;
+        MuxSelection voltageMux = static_cast<MuxSelection>(2 * channel + 1);
+        if (commands.empty()) {
+            return MOSICommand(CONVERT, voltageMux, 0, 0);
+        }
+
+        Unit& unit = units[chip][channel];
+        if (unit.commandIndex >= commands.size()) {
+            unit.commandIndex = 0;
+            unit.repetition = 0;
+        }
+        const WaveformCommand& command = commands[unit.commandIndex];
+        if (++unit.repetition >= command.numRepetitions()) {
+            unit.commandIndex++;
+            unit.repetition = 0;
+        }
+
+        if (!command.repeating.repeating) {
+            const NonrepeatingCommand& c = command.nonrepeating;
+            return MOSICommand(static_cast<Commands>(c.C), static_cast<MuxSelection>(c.M), c.A, c.D);
+        }
+        const RepeatingCommand& c = command.repeating;
+        uint8_t address = static_cast<uint8_t>((channel << 4) | (c.registerToWrite == RepeatingCommand::WRITE_CURRENT ? 9 : 0));
+        MuxSelection mux = static_cast<MuxSelection>(2 * channel + (c.muxToRead == RepeatingCommand::READ_VOLTAGE ? 1 : 0));
+        return MOSICommand(WRITE_AND_CONVERT, mux, address, c.L); // ADC-sourced values aren't simulated
+    }
+
+    // Applies a register write, and advances the cell attached to the command's unit by one command period
+    void ModelCellSource::execute(unsigned int chip, const MOSICommand& command) {
+        unsigned int address = command.A;
+        unsigned int unitIndex = address >> 4;
+        if (command.C == WRITE || command.C == WRITE_AND_CONVERT) {
+            registers[chip][unitIndex][address & 0xF] = command.D;
+
+            if (unitIndex < MAX_NUM_CHANNELS) {
+                Unit& unit = units[chip][unitIndex];
+                if ((address & 0xF) == 0) {
+                    double voltage = ((command.D & 256) ? 1.0 : -1.0) * (command.D & 255) * unit.voltageClampStep;
+                    if (!unit.currentClamp) {
+                        double charge = (cell.pipetteCapacitance - compensatedCapacitance(chip, unitIndex)) * (voltage - unit.commandVoltage);
+                        unit.pipetteCurrent += charge / PIPETTE_TIME_CONSTANT;
+                    }
+                    unit.currentClamp = false;
+                    unit.commandVoltage = voltage;
+                }
+                else if ((address & 0xF) == 9) {
+                    unit.currentClamp = true;
+                    unit.commandCurrent = ((command.D & 128) ? 1.0 : -1.0) * (command.D & 127) * unit.currentStep;
+                }
+            }
+        }
+
+        // Each unit gets one command per command period; step its cell
+        if (unitIndex < MAX_NUM_CHANNELS) {
+            Unit& unit = units[chip][unitIndex];
+            double current = unit.currentClamp ? unit.commandCurrent : (unit.commandVoltage - unit.membranePotential) / cell.accessResistance;
+            double leak = (unit.membranePotential - cell.restingPotential) / cell.membraneResistance;
+            unit.membranePotential += dt * (current - leak) / cell.membraneCapacitance;
+            unit.pipetteCurrent *= pipetteDecay;
+        }
+    }
+
+    // Capacitance the unit's fast transient compensation supplies, in voltage clamp, from its registers
+    double ModelCellSource::compensatedCapacitance(unsigned int chip, unsigned int unitIndex) const {
+        Registers::Register6 r6 = *reinterpret_cast<const Registers::Register6*>(&registers[chip][unitIndex][6]);
+        Registers::Register7 r7 = *reinterpret_cast<const Registers::Register7*>(&registers[chip][unitIndex][7]);
+        Registers::Register8 r8 = *reinterpret_cast<const Registers::Register8*>(&registers[chip][unitIndex][8]);
+        if (!r7.fastTransConnect || r6.fastTransInSelect) {
+            return 0;
+        }
+        return std::max(0, r6.getMagnitude()) * r8.getStepSize();
+    }
+
+    // ADC value the chip would return for the given mux, as a MISO word
+    uint32_t ModelCellSource::convert(unsigned int chip, MuxSelection mux) {
+        double steps = (cell.noiseSteps > 0) ? noise(random) : 0.0;
+        if (mux != Temperature && static_cast<unsigned int>(mux) / 2 < MAX_NUM_CHANNELS) {
+            const Unit& unit = units[chip][mux / 2];
+            double current = unit.currentClamp ? unit.commandCurrent : (unit.commandVoltage - unit.membranePotential) / cell.accessResistance;
+            double muxVoltage;
+            if (mux % 2 == 1) {
+                double voltage = unit.membranePotential + current * cell.accessResistance;
+                muxVoltage = voltage * 8.0;
+            }
+            else {
+                double pipetteCurrent = unit.currentClamp ? 0.0 : unit.pipetteCurrent;
+                muxVoltage = (current + pipetteCurrent) * 10.0 * unit.feedbackResistance;
+            }
+            if (unit.muxStep != 0) {
+                steps += muxVoltage / unit.muxStep;
+            }
+        }
+
+        int32_t limit = board.is18bitADC ? 131071 : 32767;
+        double clipped = std::max(-static_cast<double>(limit), std::min(static_cast<double>(limit), steps));
+        int32_t value = static_cast<int32_t>(std::lround(clipped));
+        return static_cast<uint32_t>(value) & (board.is18bitADC ? 0x3FFFF : 0xFFFF);
+    }
+
+    void ModelCellSource::generate(unsigned char* data, uint32_t firstTimestamp, unsigned int numPackets, unsigned int packetSize) {
+        const USBPacketLayout& layout = board.getPacketLayout();
+        for (unsigned int i = 0; i < numPackets; i++) {
+            unsigned char* p = data + i * packetSize;
+            std::memset(p, 0, packetSize);
+            *reinterpret_cast<uint32_t*>(p) = firstTimestamp + i;
+
+            for (const USBPacketLayout::Slot& slot : layout.slots) {
+                unsigned int chip = slot.chip;
+                MOSICommand mosi = nextCommand(chip, board.channels[slot.channelIndex]);
+                execute(chip, mosi);
+
+                // READ results come back with the command; conversions are of the previous command's mux
+                uint32_t miso = 0;
+                if (mosi.C == READ) {
+                    miso = registers[chip][mosi.A >> 4][mosi.A & 0xF];
+                }
+                else if (mosi.C == CONVERT || mosi.C == WRITE_AND_CONVERT) {
+                    miso = convert(chip, static_cast<MuxSelection>(previous[chip].M));
+                }
+                previous[chip] = mosi;
+
+                uint32_t* words = reinterpret_cast<uint32_t*>(p + slot.offset);
+                words[0] = mosi;
+                words[1] = miso;
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    /** \brief Constructor
+     *
+     *  \param[in] filename  File written by Board::startUSBCapture
+     */
+    ReplaySource::ReplaySource(const FILENAME& filename) :
+        position(0)
+    {
+        USBCapture capture(filename);
+        bytes.reserve(static_cast<std::size_t>(capture.getDataBytes()));
+        for (const USBCapture::Read& read : capture.getReads()) {
+            bytes.insert(bytes.end(), read.data, read.data + read.numBytes);
+        }
+        if (bytes.empty()) {
+            throw runtime_error("USB capture has no data");
+        }
+    }
+
+    void ReplaySource::start() {
+    }
+
+    void ReplaySource::generate(unsigned char* data, uint32_t, unsigned int numPackets, unsigned int packetSize) {
+        // Only whole packets are played back, in case the capture was cut off mid-packet
+        std::size_t usable = bytes.size() - bytes.size() % packetSize;
+        if (usable == 0) {
+            throw runtime_error("USB capture is shorter than one packet");
+        }
+        for (unsigned int i = 0; i < numPackets; i++) {
+            if (position + packetSize > usable) {
+                position = 0;
+            }
+            std::memcpy(data + i * packetSize, bytes.data() + position, packetSize);
+            position += packetSize;
+        }
+    }
+}
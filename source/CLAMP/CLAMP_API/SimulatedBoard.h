@@ -0,0 +1,229 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include "OpalKellyBoard.h"
+#include "ChipProtocol.h"
+#include "Constants.h"
+#include "streams.h"
+
+namespace CLAMP {
+    class Board;
+
+    /** \brief Produces the USB data returned by a SimulatedBoard.
+     *
+     *  See ModelCellSource and ReplaySource.
+     */
+    class PacketSource {
+    public:
+        virtual ~PacketSource() {}
+
+        /// Called when the board starts running (i.e., on the start trigger)
+        virtual void start() = 0;
+
+        /** \brief Fills numPackets consecutive packets.
+         *
+         *  \param[out] data            Buffer of numPackets * packetSize bytes
+         *  \param[in]  firstTimestamp  Timestamp of the first packet
+         *  \param[in]  numPackets      Number of packets
+         *  \param[in]  packetSize      Bytes per packet, for the board's current packet layout
+         */
+        virtual void generate(unsigned char* data, uint32_t firstTimestamp, unsigned int numPackets, unsigned int packetSize) = 0;
+    };
+
+    /// What happened in a SimulatedBoard's FIFO during the current (or last) run
+    struct SimulatedFifoStatistics {
+        uint64_t overflows;        ///< Times the FIFO overflowed; one overflow lasts until the next read
+        uint64_t droppedTimesteps; ///< Timesteps lost to overflows
+        uint32_t highWaterWords;   ///< Most words the FIFO has held
+        double runSeconds;         ///< Time since the run started, on the virtual clock if it's enabled
+
+        SimulatedFifoStatistics() : overflows(0), droppedTimesteps(0), highWaterWords(0), runSeconds(0) {}
+    };
+
+    /** \brief Stand-in for the evaluation board, for running the software without hardware.
+     *
+     *  Pass one to the Board constructor in place of the default OpalKellyBoard.  Wires, triggers, and pipe-in writes are
+     *  accepted (and mostly ignored); once the board is started, packets appear in the "FIFO" at the board's sampling rate,
+     *  and are filled in by the PacketSource when they're read, so they go through the same Board::read and
+     *  ReadQueue::parse path as real data.
+     *
+     *  Typical use:
+     \code
+        SimulatedBoard* simulated = new SimulatedBoard();
+        std::unique_ptr<OpalKellyBoard> backend(simulated);
+        Board board(std::move(backend));
+        simulated->attach(board, std::unique_ptr<PacketSource>(new ModelCellSource(board)));
+        board.open();
+     \endcode
+     *
+     *  The simulated FIFO holds FIFO_CAPACITY_WORDS.  If it would overflow, the oldest packets are dropped, as on the real
+     *  board, so a reader that can't keep up sees gaps in the timestamps.
+     *
+     *  With setVirtualClock(), time is simulated too, so a run plays out the same way every time, however fast the host
+     *  really is: the FIFO fills at the sampling rate on the virtual clock, which only advances
+     *  - when the host waits for data (a read of more than is in the FIFO takes until it's there),
+     *  - by a fixed time for each poll of the FIFO level,
+     *  - by the scripted host delays (see setHostDelays()) after each read, and
+     *  - with advanceClock().
+     *  Host delays long enough to overflow the FIFO then reproduce an overrun exactly; getFifoStatistics() tells what was
+     *  lost.  That needs the reads to be the same from run to run: read on one thread (not with a USBReaderThread, whose
+     *  polls and transfers interleave with the caller by how the threads are scheduled), with a fixed chunk size (see
+     *  TransferPolicy::setBounds), and for a length of board time (timestamps) rather than real time.
+     */
+    class SimulatedBoard : public OpalKellyBoard {
+    public:
+        SimulatedBoard();
+
+        void attach(Board& board_, std::unique_ptr<PacketSource> source_);
+        void setSpeed(double factor);
+        void setVirtualClock(bool enable, double pollSeconds_ = 0.0002);
+        void setHostDelays(const std::vector<double>& seconds);
+        void advanceClock(double seconds);
+        SimulatedFifoStatistics getFifoStatistics();
+
+        bool open(const std::string& dllPath = "", const std::string& bitfilePath = "", const std::string& requestedSerialNumber = "") override;
+        void uploadFpgaBitfile(const std::string& filename) override;
+
+        void updateWiresIn() override;
+        void setWireIn(int wirein, uint16_t value) override;
+        void setWireInBit(int wirein, unsigned long bit, bool value) override;
+        void activateTriggerIn(int epAddr, int bit) override;
+        long writeToPipeIn(int epAddr, long length, unsigned char *data) override;
+
+        void updateWiresOut() override;
+        bool getWireOutBit(int wireout, unsigned long bit) override;
+        uint16_t getWireOutWord(int wireout) override;
+        uint32_t getWireOutDWord(int wireoutMSB, int wireoutLSB) override;
+
+        long readFromPipeOut(int epAddr, long length, unsigned char *data) override;
+
+        bool isOpen() const override;
+
+    private:
+        std::mutex simMutex;
+        bool opened;
+        Board* board;
+        std::unique_ptr<PacketSource> source;
+        double speed; // Multiple of real time; 0 for as fast as the data is read
+
+        std::map<int, uint16_t> wiresIn;
+        uint32_t numWordsInFifo; // As of the last updateWiresOut
+
+        // Virtual clock; see setVirtualClock
+        bool virtualClock;
+        double clock;              // Seconds
+        double pollSeconds;        // Clock time per FIFO poll
+        std::vector<double> hostDelays;
+        std::size_t nextHostDelay;
+
+        // State of the current run
+        bool running;
+        std::chrono::steady_clock::time_point runStart;
+        double runStartClock;
+        uint64_t runLength;      // Timesteps the run will produce (UINT64_MAX if continuous)
+        uint64_t produced;       // Timesteps produced so far in this run
+        uint64_t consumed;       // Timesteps read or dropped so far in this run
+        bool overflowing;        // Data has been dropped since the last read
+        SimulatedFifoStatistics statistics;
+
+        unsigned int packetSize();
+        double runSeconds() const;
+        void waitForPackets(unsigned int numPackets);
+        void updateProduced();
+        uint16_t wireIn(int wirein) const;
+    };
+
+    /** \brief PacketSource that simulates a simple cell on every channel.
+     *
+     *  Plays each enabled channel's waveform commands (Channel::commands, as last sent with Board::commandsToFPGA) the way
+     *  the FPGA would, and answers them like a chip with a cell attached: READs return the register values written
+     *  (and the chip's ROM), and conversions return the voltage or current of a cell modeled as an access resistance
+     *  in series with a parallel membrane resistance and capacitance, plus Gaussian noise.  A pipette capacitance, if
+     *  given, adds a fast transient to the measured current at each voltage step, less whatever fast transient
+     *  capacitive compensation the unit's registers (N,6 to N,8) supply.
+     *
+     *  Amplifier offsets, trims, and the like aren't modeled, so calibration doesn't find anything to correct.
+     */
+    class ModelCellSource : public PacketSource {
+    public:
+        /// Parameters of the model cell
+        struct Cell {
+            double accessResistance;     ///< In ohms
+            double membraneResistance;   ///< In ohms
+            double membraneCapacitance;  ///< In farads
+            double restingPotential;     ///< In volts
+            double pipetteCapacitance;   ///< From the electrode to ground, in farads; 0 (the default) for none
+            double noiseSteps;           ///< Standard deviation of the noise added to each conversion, in ADC steps
+
+            Cell();
+        };
+
+        explicit ModelCellSource(Board& board_, const Cell& cell_ = Cell());
+
+        void start() override;
+        void generate(unsigned char* data, uint32_t firstTimestamp, unsigned int numPackets, unsigned int packetSize) override;
+
+    private:
+        /// \cond private
+        // One patch clamp unit, with the cell attached to it
+        struct Unit {
+            // Position in the channel's waveform commands
+            std::size_t commandIndex;
+            uint32_t repetition;
+
+            // Clamp state
+            bool currentClamp;
+            double commandVoltage;
+            double commandCurrent;
+            double membranePotential;
+            double pipetteCurrent;   // Charging the pipette capacitance, after a voltage step
+
+            // Scalings, captured at start()
+            double muxStep;
+            double feedbackResistance;
+            double voltageClampStep;
+            double currentStep;
+        };
+        /// \endcond
+
+        Board& board;
+        Cell cell;
+        uint16_t registers[MAX_NUM_CHIPS][16][16]; // [chip][unit (15 = global)][register]
+        Unit units[MAX_NUM_CHIPS][MAX_NUM_CHANNELS];
+        ChipProtocol::MOSICommand previous[MAX_NUM_CHIPS]; // Previous command on each chip; its mux is converted next
+        double dt; // Seconds per command on a channel
+        double pipetteDecay; // Of the pipette's charging current, per command
+        std::mt19937 random;
+        std::normal_distribution<double> noise;
+
+        ChipProtocol::MOSICommand nextCommand(unsigned int chip, unsigned int channel);
+        void execute(unsigned int chip, const ChipProtocol::MOSICommand& command);
+        uint32_t convert(unsigned int chip, ChipProtocol::MuxSelection mux);
+        double compensatedCapacitance(unsigned int chip, unsigned int unitIndex) const;
+    };
+
+    /** \brief PacketSource that plays back raw USB data captured from a real board (see Board::startUSBCapture).
+     *
+     *  The data of every read in the capture is played back, in a loop.  The board should be configured the same way as
+     *  when the data was captured (same enabled channels and data transfer settings), so that the packet layout matches;
+     *  the capture's own configuration can be put on the board with CaptureConfiguration::applyTo (see USBCapture).  The
+     *  captured timestamps are returned as they are.
+     */
+    class ReplaySource : public PacketSource {
+    public:
+        explicit ReplaySource(const FILENAME& filename);
+
+        void start() override;
+        void generate(unsigned char* data, uint32_t firstTimestamp, unsigned int numPackets, unsigned int packetSize) override;
+
+    private:
+        std::vector<unsigned char> bytes;
+        std::size_t position;
+    };
+}
@@ -0,0 +1,209 @@
+#include "SpikeDetector.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+using namespace CLAMP::ClampConfig;
+using std::vector;
+using std::lock_guard;
+using std::mutex;
+using std::invalid_argument;
+
+namespace CLAMP {
+    // Samples per block when looking for blocks that reach the threshold; a few vector registers' worth
+    static const std::size_t BLOCK_SAMPLES = 32;
+
+    /** \brief Constructor.
+     *
+     *  \param[in] board_  Board whose channels to watch
+     */
+    SpikeDetector::SpikeDetector(Board& board_) :
+        board(board_),
+        samplingRate(0),
+        triggerPort(-1),
+        triggerDigOut(0),
+        triggerPulse(0),
+        triggerHigh(false),
+        triggerEnd(0),
+        spikeCount(0),
+        detectNanoseconds(0)
+    {
+    }
+
+    SpikeDetector::~SpikeDetector() {
+        stop();
+    }
+
+    /** \brief Watches a channel for spikes, from the next start() on.
+     *
+     *  The channel must be enabled on the board (see Board::enableChannels()) and reading its voltage, i.e., in current
+     *  clamp.  Adding a channel again replaces its settings.
+     *
+     *  \param[in] channel   Channel to watch
+     *  \param[in] settings  Detection criteria
+     */
+    void SpikeDetector::addChannel(const ChipChannel& channel, const Settings& settings) {
+        if (!callbackIds.empty()) {
+            throw invalid_argument("Add spike detector channels before starting it");
+        }
+        ChannelState& state = channels[channel];
+        state.settings = settings;
+    }
+
+    /// Sets a function to call for each spike, as soon as it's found; see EventCallback.  Call this before start().
+    void SpikeDetector::setEventCallback(const EventCallback& callback) {
+        eventCallback = callback;
+    }
+
+    /** \brief Raises a digital output for a while after each spike (on any channel).  Call this before start().
+     *
+     *  The output is a port's second digital marker (the digOut bit of the commands its channel is running; see
+     *  WaveformSegment::digOut), routed to a DIGITAL OUT line with Board::setDigitalMarkerDestination() and gated with
+     *  Board::enableDigitalMarker().  The detector keeps the gate closed, and opens it for pulseSeconds after each
+     *  spike; opening it is a single USB control transfer, so the output follows the spike by little more than the
+     *  read latency.  The port's commands must therefore carry the digOut bit whenever a spike should be able to
+     *  trigger, e.g., a waveform whose segments all have it set.
+     *
+     *  Takes over that port's marker settings while running; stop() leaves the gate closed.
+     *
+     *  \param[in] port          Port (i.e., chip) whose marker to use, or -1 for no trigger output
+     *  \param[in] digOut        DIGITAL OUT line to route it to (0 for DIGITAL OUT 1, etc.)
+     *  \param[in] pulseSeconds  How long the output stays up after a spike; a spike while it's up extends it
+     */
+    void SpikeDetector::setTriggerOutput(int port, int digOut, double pulseSeconds) {
+        if (port < -1 || (port >= 0 && static_cast<unsigned int>(port) >= MAX_NUM_CHIPS)) {
+            throw invalid_argument("Invalid trigger port");
+        }
+        triggerPort = port;
+        triggerDigOut = digOut;
+        triggerPulse = pulseSeconds;
+    }
+
+    /// Subscribes to the channels' data; spikes are detected in every read from then on.
+    void SpikeDetector::start() {
+        stop();
+        samplingRate = board.getSamplingRateHz();
+        spikeCount = 0;
+        detectNanoseconds = 0;
+        {
+            lock_guard<mutex> lock(eventMutex);
+            events.clear();
+        }
+        if (triggerPort >= 0) {
+            board.setDigitalMarkerDestination(triggerPort, triggerDigOut);
+            setTrigger(false);
+        }
+        for (auto& element : channels) {
+            ChannelState& state = element.second;
+            state.threshold = static_cast<Sample>(state.settings.threshold);
+            state.havePrevious = false;
+            state.refractory = false;
+            callbackIds.push_back(board.addSampleCallback(element.first, Board::MEASURED_VOLTAGE, [this, &state](const SampleSpan& span) {
+                onSamples(state, span);
+            }));
+        }
+    }
+
+    /// Unsubscribes from the board; once this returns, no more spikes are detected.
+    void SpikeDetector::stop() {
+        for (unsigned int id : callbackIds) {
+            board.removeSampleCallback(id);
+        }
+        callbackIds.clear();
+        if (triggerHigh) {
+            setTrigger(false);
+        }
+    }
+
+    /// Returns the spikes found since the last call (or since start()), and forgets them.  May be called from any thread.
+    vector<SpikeEvent> SpikeDetector::takeEvents() {
+        vector<SpikeEvent> taken;
+        lock_guard<mutex> lock(eventMutex);
+        taken.swap(events);
+        return taken;
+    }
+
+    // Scans one chunk.  Blocks that stay below the threshold (nearly all of them) only cost the vectorized maximum.
+    void SpikeDetector::onSamples(ChannelState& state, const SampleSpan& span) {
+        using std::chrono::steady_clock;
+        steady_clock::time_point begin = steady_clock::now();
+
+        const Sample* v = span.samples;
+        const uint32_t* t = span.timestamps;
+        std::size_t n = span.length;
+        std::size_t i = 0;
+        if (!state.havePrevious) {
+            // Nothing to cross from yet
+            state.previous = v[0];
+            state.previousTimestamp = t[0];
+            state.havePrevious = true;
+            i = 1;
+        }
+        const Sample threshold = state.threshold;
+
+        while (i < n) {
+            std::size_t end = std::min(n, i + BLOCK_SAMPLES);
+            Sample blockMax = v[i];
+            for (std::size_t j = i + 1; j < end; j++) {
+                blockMax = (v[j] > blockMax) ? v[j] : blockMax;
+            }
+            if (blockMax >= threshold) {
+                for (std::size_t j = i; j < end; j++) {
+                    Sample before = (j > 0) ? v[j - 1] : state.previous;
+                    if (!(v[j] >= threshold && before < threshold)) {
+                        continue;
+                    }
+                    if (state.refractory && static_cast<int32_t>(t[j] - state.refractoryEnd) < 0) {
+                        continue;
+                    }
+                    uint32_t beforeTimestamp = (j > 0) ? t[j - 1] : state.previousTimestamp;
+                    double dt = std::max<uint32_t>(1, t[j] - beforeTimestamp) / samplingRate;
+                    double slope = (v[j] - before) / dt;
+                    if (slope >= state.settings.minSlope) {
+                        spike(state, span, j, slope);
+                    }
+                }
+            }
+            i = end;
+        }
+        state.previous = v[n - 1];
+        state.previousTimestamp = t[n - 1];
+
+        if (triggerHigh && static_cast<int32_t>(t[n - 1] - triggerEnd) >= 0) {
+            setTrigger(false);
+        }
+        detectNanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - begin).count());
+    }
+
+    void SpikeDetector::spike(ChannelState& state, const SampleSpan& span, std::size_t i, double slope) {
+        SpikeEvent event;
+        event.channel = span.channel;
+        event.timestamp = span.timestamps[i];
+        event.voltage = span.samples[i];
+        event.slope = slope;
+
+        state.refractory = true;
+        state.refractoryEnd = event.timestamp + static_cast<uint32_t>(std::lround(state.settings.refractory * samplingRate));
+        spikeCount++;
+
+        if (triggerPort >= 0) {
+            triggerEnd = event.timestamp + static_cast<uint32_t>(std::lround(triggerPulse * samplingRate));
+            if (!triggerHigh) {
+                setTrigger(true);
+            }
+        }
+        {
+            lock_guard<mutex> lock(eventMutex);
+            events.push_back(event);
+        }
+        if (eventCallback) {
+            eventCallback(event);
+        }
+    }
+
+    void SpikeDetector::setTrigger(bool high) {
+        board.enableDigitalMarker(triggerPort, high);
+        triggerHigh = high;
+    }
+}
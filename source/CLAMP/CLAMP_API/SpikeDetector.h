@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Board.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace CLAMP {
+    /// An action potential found by SpikeDetector
+    struct SpikeEvent {
+        ClampConfig::ChipChannel channel; ///< Channel it was on
+        uint32_t timestamp;               ///< Timestamp of the first sample at or above the threshold
+        Sample voltage;                   ///< That sample's membrane voltage, in volts
+        double slope;                     ///< dV/dt into that sample, in volts per second
+
+        SpikeEvent() : timestamp(0), voltage(0), slope(0) {}
+    };
+
+    /** \brief Online spike detection on the membrane voltage, for current clamp.
+     *
+     *  A spike is an upward crossing of a voltage threshold, rising at least as fast as a minimum slope, at least a
+     *  refractory period after the channel's previous spike.  The detector subscribes to each channel's measured
+     *  voltage (see Board::addSampleCallback()), so it sees every chunk as soon as ReadQueue has decoded it, before
+     *  anything downstream (DataStore, saving) does.
+     *
+     *  Most samples are nowhere near threshold, so each chunk is scanned in short blocks for their maximum, which the
+     *  compiler vectorizes; only blocks that reach the threshold are examined sample by sample.  getDetectSeconds()
+     *  totals the time spent, for comparison with ReadStatistics::decodeSeconds.
+     *
+     *  Optionally, each spike also raises a digital output for a while (see setTriggerOutput()).
+     \code
+        SpikeDetector spikes(board);
+        SpikeDetector::Settings settings;
+        settings.threshold = -0.010;
+        for (auto& index : channelList) {
+            spikes.addChannel(index, settings);
+        }
+        spikes.start();
+        // ... run and read the board ...
+        for (const SpikeEvent& spike : spikes.takeEvents()) {
+            // ...
+        }
+     \endcode
+     */
+    class SpikeDetector {
+    public:
+        /// Detection criteria for one channel
+        struct Settings {
+            double threshold;   ///< Voltage to cross upward, in volts (default 0 mV)
+            double minSlope;    ///< Least dV/dt at the crossing, in volts per second (default 10 V/s, i.e., 10 mV/ms); 0 for any
+            double refractory;  ///< Dead time after a spike, in seconds (default 2 ms)
+
+            Settings() : threshold(0), minSlope(10), refractory(2e-3) {}
+        };
+        /// Called for each spike, on the thread that reads the board, while it holds Board's callback lock; keep it short
+        typedef std::function<void(const SpikeEvent&)> EventCallback;
+
+        explicit SpikeDetector(Board& board_);
+        ~SpikeDetector();
+
+        void addChannel(const ClampConfig::ChipChannel& channel, const Settings& settings = Settings());
+        void setEventCallback(const EventCallback& callback);
+        void setTriggerOutput(int port, int digOut, double pulseSeconds);
+
+        void start();
+        void stop();
+
+        std::vector<SpikeEvent> takeEvents();
+        /// Spikes found since start()
+        uint64_t getSpikeCount() const { return spikeCount; }
+        /// Time spent scanning for spikes since start(), in seconds
+        double getDetectSeconds() const { return detectNanoseconds * 1e-9; }
+
+    private:
+        /// \cond private
+        // Per-channel state, carried from one chunk to the next
+        struct ChannelState {
+            Settings settings;
+            Sample threshold;
+            bool havePrevious;
+            Sample previous;
+            uint32_t previousTimestamp;
+            bool refractory;
+            uint32_t refractoryEnd;
+        };
+        /// \endcond
+
+        Board& board;
+        std::map<ClampConfig::ChipChannel, ChannelState> channels;
+        std::vector<unsigned int> callbackIds;
+        EventCallback eventCallback;
+        double samplingRate;
+
+        // Trigger output; see setTriggerOutput
+        int triggerPort;
+        int triggerDigOut;
+        double triggerPulse;
+        bool triggerHigh;
+        uint32_t triggerEnd;
+
+        std::mutex eventMutex;
+        std::vector<SpikeEvent> events; // Not yet taken; guarded by eventMutex
+        std::atomic<uint64_t> spikeCount;
+        std::atomic<uint64_t> detectNanoseconds;
+
+        void onSamples(ChannelState& state, const SampleSpan& span);
+        void spike(ChannelState& state, const SampleSpan& span, std::size_t i, double slope);
+        void setTrigger(bool high);
+
+        // Not copyable
+        SpikeDetector(const SpikeDetector&);
+        SpikeDetector& operator=(const SpikeDetector&);
+    };
+}
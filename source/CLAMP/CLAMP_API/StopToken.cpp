@@ -0,0 +1,38 @@
+#include "StopToken.h"
+
+using std::lock_guard;
+using std::mutex;
+
+namespace CLAMP {
+    /// Constructor: no stop requested
+    StopToken::StopToken() :
+        stopped(false),
+        notifications(0)
+    {
+    }
+
+    /// Requests a stop, and wakes every thread in waitFor().  May be called from any thread.
+    void StopToken::requestStop() {
+        {
+            // Under the mutex, so a waiter can't miss it between checking and sleeping
+            lock_guard<mutex> lock(wakeupMutex);
+            stopped.store(true, std::memory_order_release);
+        }
+        wakeup.notify_all();
+    }
+
+    /// Clears the stop request, e.g., before a thread is started again
+    void StopToken::reset() {
+        lock_guard<mutex> lock(wakeupMutex);
+        stopped.store(false, std::memory_order_release);
+    }
+
+    /// Wakes every thread in waitFor() without requesting a stop (e.g., because there's new work)
+    void StopToken::notify() {
+        {
+            lock_guard<mutex> lock(wakeupMutex);
+            notifications++;
+        }
+        wakeup.notify_all();
+    }
+}
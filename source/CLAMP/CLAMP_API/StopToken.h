@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace CLAMP {
+    /** \brief A stop request that sleeping threads wake up for.
+     *
+     *  Replaces a plain "keep going" flag plus sleeps in short slices: a thread that waits with waitFor() returns as
+     *  soon as another thread calls requestStop() (or notify()), rather than at the end of its current slice.  Checking
+     *  the flag is a single atomic load, so polling loops can still test it as often as they like.
+     *
+     *  Converts to true until a stop is requested, so it reads like the flag it replaces:
+     \code
+        while (keepGoing) {
+            // ... work ...
+            keepGoing.waitFor(std::chrono::seconds(5)); // Returns early when stopped
+        }
+     \endcode
+     */
+    class StopToken {
+    public:
+        StopToken();
+
+        void requestStop();
+        void reset();
+        void notify();
+
+        /// True once requestStop() has been called (and reset() hasn't since)
+        bool stopRequested() const { return stopped.load(std::memory_order_acquire); }
+        /// True until a stop is requested
+        explicit operator bool() const { return !stopRequested(); }
+
+        /** \brief Sleeps for up to timeout, returning early if a stop is requested or notify() is called.
+         *
+         *  \param[in] timeout  Longest time to sleep
+         *  \returns False if a stop has been requested, i.e., whether to keep going
+         */
+        template<class Rep, class Period>
+        bool waitFor(const std::chrono::duration<Rep, Period>& timeout) {
+            std::unique_lock<std::mutex> lock(wakeupMutex);
+            uint64_t seen = notifications;
+            wakeup.wait_for(lock, timeout, [&]() { return stopRequested() || notifications != seen; });
+            return !stopRequested();
+        }
+
+    private:
+        std::atomic<bool> stopped;
+        uint64_t notifications; // Protected by wakeupMutex
+        std::mutex wakeupMutex;
+        std::condition_variable wakeup;
+
+        // Not copyable
+        StopToken(const StopToken&);
+        StopToken& operator=(const StopToken&);
+    };
+}
@@ -0,0 +1,162 @@
+#include "StreamFramer.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace CLAMP::ClampConfig;
+
+namespace CLAMP {
+    namespace IO {
+        static void put16(uint8_t* p, uint16_t value) {
+            p[0] = static_cast<uint8_t>(value);
+            p[1] = static_cast<uint8_t>(value >> 8);
+        }
+
+        static void put32(uint8_t* p, uint32_t value) {
+            put16(p, static_cast<uint16_t>(value));
+            put16(p + 2, static_cast<uint16_t>(value >> 16));
+        }
+
+        /** \brief Constructor.
+         *
+         *  \param[in] board_  Board whose data to publish.
+         */
+        StreamFramer::StreamFramer(Board& board_) :
+            board(board_),
+            boardDataConsumerRegistered(false),
+            boardDataConsumerId(0),
+            packetCallbackRegistered(false),
+            streamDigIn(false),
+            streamDigOut(false),
+            sequence(0)
+        {
+            std::fill(streamAdcs, streamAdcs + 8, false);
+        }
+
+        StreamFramer::~StreamFramer() {
+            detach();
+        }
+
+        /// Unsubscribes from the board; publish() isn't called once this returns.
+        void StreamFramer::detach() {
+            for (unsigned int id : callbackIds) {
+                board.removeSampleCallback(id);
+            }
+            callbackIds.clear();
+            packetCallbackRegistered = false;
+            if (boardDataConsumerRegistered) {
+                board.removeDataConsumer(boardDataConsumerId);
+                boardDataConsumerRegistered = false;
+            }
+        }
+
+        /** \brief Publishes one quantity of one channel.
+         *
+         *  The channel must also be enabled on the board (see Board::enableChannels()).
+         *
+         *  \param[in] channel   Channel to publish
+         *  \param[in] quantity  Quantity to publish; call again to publish several quantities of the same channel.
+         */
+        void StreamFramer::addChannel(const ChipChannel& channel, Board::SampleQuantity quantity) {
+            callbackIds.push_back(board.addSampleCallback(channel, quantity, [this, quantity](const SampleSpan& span) {
+                onSamples(span, quantity);
+            }));
+        }
+
+        /** \brief Publishes board-level data as well: ADCs and digital inputs and outputs.
+         *
+         *  The board is asked to transfer this data (see Board::addDataConsumer()); that takes effect the next time it
+         *  starts running.
+         *
+         *  \param[in] adcs    ADCs to publish
+         *  \param[in] digin   True to publish the digital inputs
+         *  \param[in] digout  True to publish the digital outputs
+         */
+        void StreamFramer::setBoardData(const bool adcs[8], bool digin, bool digout) {
+            if (boardDataConsumerRegistered) {
+                board.removeDataConsumer(boardDataConsumerId);
+            }
+            std::copy(adcs, adcs + 8, streamAdcs);
+            streamDigIn = digin;
+            streamDigOut = digout;
+            boardDataConsumerId = board.addDataConsumer(adcs, digin, digout);
+            boardDataConsumerRegistered = true;
+
+            if (!packetCallbackRegistered) {
+                callbackIds.push_back(board.addPacketCallback([this](const PacketSpan& span) {
+                    onPackets(span);
+                }));
+                packetCallbackRegistered = true;
+            }
+        }
+
+        void StreamFramer::startFrame(StreamFrame& frame, FrameType type, uint32_t firstTimestamp, std::size_t count, uint8_t chip, uint8_t channel, uint16_t contents) {
+            put32(frame.bytes, FRAME_MAGIC);
+            put32(frame.bytes + 8, firstTimestamp);
+            put16(frame.bytes + 12, static_cast<uint16_t>(count));
+            frame.bytes[14] = static_cast<uint8_t>(type);
+            frame.bytes[15] = FRAME_VERSION;
+            frame.bytes[16] = chip;
+            frame.bytes[17] = channel;
+            put16(frame.bytes + 18, contents);
+            frame.size = HEADER_BYTES;
+        }
+
+        // Numbers the frame and hands it to the subclass
+        void StreamFramer::finishFrame(StreamFrame& frame) {
+            put32(frame.bytes + 4, sequence++);
+            publish(frame);
+        }
+
+        void StreamFramer::onSamples(const SampleSpan& span, Board::SampleQuantity quantity) {
+            const std::size_t perFrame = (StreamFrame::MAX_BYTES - HEADER_BYTES) / 4;
+            StreamFrame frame;
+            for (std::size_t first = 0; first < span.length; first += perFrame) {
+                std::size_t count = std::min(perFrame, span.length - first);
+                startFrame(frame, SAMPLES, span.timestamps[first], count, static_cast<uint8_t>(span.channel.chip),
+                           static_cast<uint8_t>(span.channel.channel), static_cast<uint16_t>(quantity));
+                for (std::size_t i = 0; i < count; i++) {
+                    float value = static_cast<float>(span.samples[first + i]);
+                    uint32_t bits;
+                    std::memcpy(&bits, &value, sizeof(bits));
+                    put32(frame.bytes + frame.size, bits);
+                    frame.size += 4;
+                }
+                finishFrame(frame);
+            }
+        }
+
+        void StreamFramer::onPackets(const PacketSpan& span) {
+            // Fields present, in bit order
+            const uint16_t* fields[10];
+            uint16_t contents = 0;
+            unsigned int numFields = 0;
+            const uint16_t* candidates[10] = { streamDigIn ? span.digIns : nullptr, streamDigOut ? span.digOuts : nullptr };
+            for (unsigned int adc = 0; adc < 8; adc++) {
+                candidates[2 + adc] = streamAdcs[adc] ? span.adcs[adc] : nullptr;
+            }
+            for (unsigned int bit = 0; bit < 10; bit++) {
+                if (candidates[bit]) {
+                    contents |= (1 << bit);
+                    fields[numFields++] = candidates[bit];
+                }
+            }
+            if (numFields == 0) {
+                return;
+            }
+
+            const std::size_t perFrame = (StreamFrame::MAX_BYTES - HEADER_BYTES) / (2 * numFields);
+            StreamFrame frame;
+            for (std::size_t first = 0; first < span.length; first += perFrame) {
+                std::size_t count = std::min(perFrame, span.length - first);
+                startFrame(frame, BOARD_IO, span.timestamps[first], count, 0, 0, contents);
+                for (unsigned int f = 0; f < numFields; f++) {
+                    for (std::size_t i = 0; i < count; i++) {
+                        put16(frame.bytes + frame.size, fields[f][first + i]);
+                        frame.size += 2;
+                    }
+                }
+                finishFrame(frame);
+            }
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Board.h"
+#include <cstdint>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /// One frame of live data, as built by StreamFramer
+        struct StreamFrame {
+            static const std::size_t MAX_BYTES = 1400; ///< Small enough for one UDP datagram on Ethernet
+
+            std::size_t size;
+            uint8_t bytes[MAX_BYTES];
+        };
+
+        /** \brief Packs live data from a Board into compact, sequence-numbered binary frames, for StreamServer and
+         *  SharedMemoryRing.
+         *
+         *  The framer subscribes to the Board's sample and packet callbacks (see Board::addSampleCallback()), so the data
+         *  comes straight from the ReadQueue after each read, and calls publish() on the reading thread for each frame.
+         *  Each frame is at most StreamFrame::MAX_BYTES and starts with a 20-byte header; all fields are little-endian:
+         \verbatim
+            offset  size  field
+            0       4     magic number (FRAME_MAGIC: the bytes "CLST")
+            4       4     sequence number; increases by one per frame
+            8       4     timestamp of the first sample
+            12      2     number of samples
+            14      1     frame type (SAMPLES or BOARD_IO)
+            15      1     version (FRAME_VERSION)
+            16      1     chip (SAMPLES frames; otherwise 0)
+            17      1     channel (SAMPLES frames; otherwise 0)
+            18      2     SAMPLES: the Board::SampleQuantity
+                          BOARD_IO: which fields follow; bit 0 digital inputs, bit 1 digital outputs, bit 2 + i ADC i
+         \endverbatim
+         *  SAMPLES frames then hold one 32-bit float per sample.  BOARD_IO frames hold, for each field present in bit order,
+         *  one uint16 per sample.
+         *
+         *  Configure the framer (addChannel(), setBoardData()) before the board starts running.  Subclasses must call
+         *  detach() in their destructors, so publish() isn't called while they're being destroyed.
+         */
+        class StreamFramer {
+        public:
+            static const uint32_t FRAME_MAGIC = 0x54534C43;
+            static const uint8_t FRAME_VERSION = 1;
+            /// Values of the frame type field
+            enum FrameType {
+                SAMPLES = 1,  ///< One channel's samples
+                BOARD_IO = 2  ///< Digital inputs and outputs, and ADCs
+            };
+            static const std::size_t HEADER_BYTES = 20;
+
+            explicit StreamFramer(Board& board_);
+            virtual ~StreamFramer();
+
+            void addChannel(const ClampConfig::ChipChannel& channel, Board::SampleQuantity quantity);
+            void setBoardData(const bool adcs[8], bool digin, bool digout);
+
+        protected:
+            /// Called on the reading thread with each frame; must not wait.
+            virtual void publish(StreamFrame& frame) = 0;
+            void detach();
+
+        private:
+            Board& board;
+            std::vector<unsigned int> callbackIds;
+            bool boardDataConsumerRegistered;
+            unsigned int boardDataConsumerId;
+            bool packetCallbackRegistered;
+            bool streamAdcs[8];
+            bool streamDigIn;
+            bool streamDigOut;
+            uint32_t sequence; // Only used on the reading thread
+
+            void onSamples(const SampleSpan& span, Board::SampleQuantity quantity);
+            void onPackets(const PacketSpan& span);
+            void startFrame(StreamFrame& frame, FrameType type, uint32_t firstTimestamp, std::size_t count, uint8_t chip, uint8_t channel, uint16_t contents);
+            void finishFrame(StreamFrame& frame);
+
+            StreamFramer(const StreamFramer&) = delete;
+            StreamFramer& operator=(const StreamFramer&) = delete;
+        };
+    }
+}
@@ -0,0 +1,318 @@
+#include "StreamServer.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SocketHandle;
+#define INVALID_SOCKET (-1)
+#endif
+
+using std::vector;
+using std::string;
+using std::runtime_error;
+using std::invalid_argument;
+using namespace CLAMP::ClampConfig;
+
+namespace CLAMP {
+    namespace IO {
+        // How long the server thread waits for the sockets before checking the queue again, in ms
+        static const long POLL_MS = 2;
+        // Sent bytes are removed from the front of a client's buffer once there are this many
+        static const std::size_t COMPACT_BYTES = 64 * 1024;
+
+        static void closeSocket(SocketHandle s) {
+#if defined(_WIN32)
+            closesocket(s);
+#else
+            ::close(s);
+#endif
+        }
+
+        static void setNonBlocking(SocketHandle s) {
+#if defined(_WIN32)
+            u_long yes = 1;
+            ioctlsocket(s, FIONBIO, &yes);
+#else
+            fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        }
+
+        static bool wouldBlock() {
+#if defined(_WIN32)
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+        }
+
+        // Write to a socket whose peer may have gone away, without raising SIGPIPE
+        static int sendBytes(SocketHandle s, const char* data, std::size_t length) {
+#if defined(__linux__)
+            return static_cast<int>(::send(s, data, length, MSG_NOSIGNAL));
+#else
+            return static_cast<int>(::send(s, data, static_cast<int>(length), 0));
+#endif
+        }
+
+        /// \cond private
+        struct StreamServer::Network {
+            struct Client {
+                SocketHandle socket;
+                vector<char> pending; // Frames not yet sent; the first sent bytes of it have been
+                std::size_t sent;
+            };
+
+            SocketHandle listenSocket;
+            SocketHandle multicastSocket;
+            sockaddr_in multicastAddress;
+            vector<Client> clients;
+
+            Network() : listenSocket(INVALID_SOCKET), multicastSocket(INVALID_SOCKET) {
+#if defined(_WIN32)
+                WSADATA data;
+                WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+                std::memset(&multicastAddress, 0, sizeof(multicastAddress));
+            }
+
+            ~Network() {
+                for (Client& client : clients) {
+                    closeSocket(client.socket);
+                }
+                if (listenSocket != INVALID_SOCKET) {
+                    closeSocket(listenSocket);
+                }
+                if (multicastSocket != INVALID_SOCKET) {
+                    closeSocket(multicastSocket);
+                }
+#if defined(_WIN32)
+                WSACleanup();
+#endif
+            }
+        };
+        /// \endcond
+
+        StreamStatistics::StreamStatistics() :
+            framesSent(0),
+            framesDropped(0),
+            clientFramesDropped(0),
+            clients(0)
+        {
+        }
+
+        /** \brief Constructor.
+         *
+         *  \param[in] board_  Board whose data to publish.
+         */
+        StreamServer::StreamServer(Board& board_) :
+            StreamFramer(board_),
+            queue(new SPSCQueue<StreamFrame, QUEUE_FRAMES>()),
+            network(new Network()),
+            framesSent(0),
+            framesDropped(0),
+            clientFramesDropped(0),
+            numClients(0)
+        {
+        }
+
+        StreamServer::~StreamServer() {
+            // No more frames once the callbacks are gone; then the thread can stop
+            detach();
+            close();
+        }
+
+        /** \brief Accepts TCP clients on the given port.
+         *
+         *  Call before start().  Throws an exception if the port can't be opened.
+         *
+         *  \param[in] port  TCP port to listen on, on all interfaces.
+         */
+        void StreamServer::listen(uint16_t port) {
+            SocketHandle s = socket(AF_INET, SOCK_STREAM, 0);
+            if (s == INVALID_SOCKET) {
+                throw runtime_error("Couldn't create the streaming socket.");
+            }
+            int yes = 1;
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&yes), sizeof(yes));
+
+            sockaddr_in address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(port);
+            if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(s, 8) != 0) {
+                closeSocket(s);
+                throw runtime_error("Couldn't listen on streaming port " + std::to_string(port) + ".");
+            }
+            setNonBlocking(s);
+            network->listenSocket = s;
+        }
+
+        /** \brief Also sends every frame to a UDP multicast group.
+         *
+         *  Call before start().  Datagrams that can't be sent right away are dropped.
+         *
+         *  \param[in] group  Multicast address, e.g., "239.255.0.1"
+         *  \param[in] port   UDP port
+         *  \param[in] ttl    Number of router hops the datagrams may cross; 1 keeps them on the local network.
+         */
+        void StreamServer::enableMulticast(const string& group, uint16_t port, unsigned int ttl) {
+            sockaddr_in address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            if (inet_pton(AF_INET, group.c_str(), &address.sin_addr) != 1) {
+                throw invalid_argument("Invalid multicast address " + group);
+            }
+
+            SocketHandle s = socket(AF_INET, SOCK_DGRAM, 0);
+            if (s == INVALID_SOCKET) {
+                throw runtime_error("Couldn't create the multicast socket.");
+            }
+            unsigned char hops = static_cast<unsigned char>(std::min(ttl, 255u));
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char*>(&hops), sizeof(hops));
+            setNonBlocking(s);
+            network->multicastSocket = s;
+            network->multicastAddress = address;
+        }
+
+        /// Totals since the server was created.
+        StreamStatistics StreamServer::getStatistics() const {
+            StreamStatistics stats;
+            stats.framesSent = framesSent;
+            stats.framesDropped = framesDropped;
+            stats.clientFramesDropped = clientFramesDropped;
+            stats.clients = numClients;
+            return stats;
+        }
+
+        // Hands the frame to the server thread; never waits (called on the reading thread)
+        void StreamServer::publish(StreamFrame& frame) {
+            if (!queue->push(frame)) {
+                framesDropped++;
+            }
+        }
+
+        // Sends the frame to the multicast group, and adds it to each client's buffer
+        void StreamServer::distribute(const StreamFrame& frame) {
+            framesSent++;
+            if (network->multicastSocket != INVALID_SOCKET) {
+                sendto(network->multicastSocket, reinterpret_cast<const char*>(frame.bytes), static_cast<int>(frame.size), 0,
+                       reinterpret_cast<const sockaddr*>(&network->multicastAddress), sizeof(network->multicastAddress));
+            }
+            for (Network::Client& client : network->clients) {
+                if (client.pending.size() - client.sent + frame.size > MAX_CLIENT_BUFFER_BYTES) {
+                    clientFramesDropped++;
+                    continue;
+                }
+                client.pending.insert(client.pending.end(), frame.bytes, frame.bytes + frame.size);
+            }
+        }
+
+        void StreamServer::run() {
+            StreamFrame frame;
+            char discard[256];
+            while (keepGoing) {
+                numClients = static_cast<unsigned int>(network->clients.size());
+                while (queue->pop(frame)) {
+                    distribute(frame);
+                }
+
+                fd_set readable, writable;
+                FD_ZERO(&readable);
+                FD_ZERO(&writable);
+                SocketHandle highest = 0;
+                auto watch = [&highest](SocketHandle s, fd_set& set) {
+                    FD_SET(s, &set);
+                    highest = std::max(highest, s);
+                };
+                if (network->listenSocket != INVALID_SOCKET) {
+                    watch(network->listenSocket, readable);
+                }
+                for (Network::Client& client : network->clients) {
+                    watch(client.socket, readable); // Only to notice when the client disconnects
+                    if (client.sent < client.pending.size()) {
+                        watch(client.socket, writable);
+                    }
+                }
+                timeval timeout;
+                timeout.tv_sec = 0;
+                timeout.tv_usec = POLL_MS * 1000;
+                if (network->listenSocket == INVALID_SOCKET && network->clients.empty()) {
+                    // Only multicasting; select() with no sockets isn't portable, so just wait
+                    keepGoing.waitFor(std::chrono::milliseconds(POLL_MS));
+                    continue;
+                }
+                if (select(static_cast<int>(highest + 1), &readable, &writable, nullptr, &timeout) <= 0) {
+                    continue;
+                }
+
+                if (network->listenSocket != INVALID_SOCKET && FD_ISSET(network->listenSocket, &readable)) {
+                    SocketHandle s = accept(network->listenSocket, nullptr, nullptr);
+                    if (s != INVALID_SOCKET) {
+                        setNonBlocking(s);
+#if defined(__APPLE__)
+                        int yes = 1;
+                        setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+                        Network::Client client;
+                        client.socket = s;
+                        client.sent = 0;
+                        network->clients.push_back(client);
+                        LOG(true) << "Streaming client connected\n";
+                    }
+                }
+
+                for (std::size_t i = 0; i < network->clients.size();) {
+                    Network::Client& client = network->clients[i];
+                    bool closed = false;
+                    if (FD_ISSET(client.socket, &readable)) {
+                        int n = static_cast<int>(recv(client.socket, discard, sizeof(discard), 0));
+                        closed = (n == 0) || (n < 0 && !wouldBlock());
+                    }
+                    if (!closed && FD_ISSET(client.socket, &writable)) {
+                        int n = sendBytes(client.socket, client.pending.data() + client.sent, client.pending.size() - client.sent);
+                        if (n > 0) {
+                            client.sent += n;
+                            if (client.sent == client.pending.size()) {
+                                client.pending.clear();
+                                client.sent = 0;
+                            }
+                            else if (client.sent >= COMPACT_BYTES) {
+                                client.pending.erase(client.pending.begin(), client.pending.begin() + client.sent);
+                                client.sent = 0;
+                            }
+                        }
+                        else if (n < 0 && !wouldBlock()) {
+                            closed = true;
+                        }
+                    }
+                    if (closed) {
+                        closeSocket(client.socket);
+                        network->clients.erase(network->clients.begin() + i);
+                        LOG(true) << "Streaming client disconnected\n";
+                    }
+                    else {
+                        i++;
+                    }
+                }
+            }
+        }
+    }
+}
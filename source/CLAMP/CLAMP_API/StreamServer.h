@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Thread.h"
+#include "StreamFramer.h"
+#include "SPSCQueue.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace CLAMP {
+    namespace IO {
+        /// Running totals for a StreamServer
+        struct StreamStatistics {
+            uint64_t framesSent;          ///< Frames handed to the network
+            uint64_t framesDropped;       ///< Frames dropped because the send queue was full (the network thread fell behind)
+            uint64_t clientFramesDropped; ///< Frames dropped for single clients whose send buffers were full
+            unsigned int clients;         ///< TCP clients currently connected
+
+            StreamStatistics();
+        };
+
+        /** \brief Publishes live data over TCP, and optionally UDP multicast, for analysis on other machines.
+         *
+         *  The frames are built by StreamFramer (see there for the format); over TCP they're simply sent back to back,
+         *  and each multicast datagram holds one frame.  The framer's callbacks only push the frames onto a fixed-size
+         *  queue; a background thread does the networking.  If the network thread falls behind, or a client's send buffer
+         *  (MAX_CLIENT_BUFFER_BYTES) fills up, frames are dropped rather than making the reads wait.  Clients can tell from
+         *  the gaps in the sequence numbers.
+         *
+         *  Typical use:
+         \code
+            StreamServer server(board);
+            server.addChannel(ChipChannel(0, 0), Board::MEASURED_CURRENT);
+            server.listen(5025);
+            server.start();
+            // ... run the board ...
+         \endcode
+         */
+        class StreamServer : public Thread, public StreamFramer {
+        public:
+            static const std::size_t MAX_CLIENT_BUFFER_BYTES = 4 * 1024 * 1024;
+
+            explicit StreamServer(Board& board_);
+            ~StreamServer();
+
+            void listen(uint16_t port);
+            void enableMulticast(const std::string& group, uint16_t port, unsigned int ttl = 1);
+
+            StreamStatistics getStatistics() const;
+
+            void run() override;
+
+        protected:
+            void publish(StreamFrame& frame) override;
+
+        private:
+            /// \cond private
+            static const std::size_t QUEUE_FRAMES = 1024;
+            struct Network;
+            /// \endcond
+
+            std::unique_ptr<SPSCQueue<StreamFrame, QUEUE_FRAMES>> queue;
+            std::unique_ptr<Network> network; // Sockets; only used on the server thread once it's started
+
+            std::atomic<uint64_t> framesSent;
+            std::atomic<uint64_t> framesDropped;
+            std::atomic<uint64_t> clientFramesDropped;
+            std::atomic<unsigned int> numClients;
+
+            void distribute(const StreamFrame& frame);
+        };
+    }
+}
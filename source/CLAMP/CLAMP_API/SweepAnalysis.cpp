@@ -0,0 +1,231 @@
+#include "SweepAnalysis.h"
+#include "DataAnalysis.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using std::vector;
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        static const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+        SegmentAnalysis::SegmentAnalysis() :
+            dcValid(false),
+            steadyState(NaN),
+            peak(NaN),
+            fitValid(false),
+            chi2(NaN),
+            iterations(0)
+        {
+            beta[0] = beta[1] = beta[2] = NaN;
+        }
+
+        SweepAnalysisResult::SweepAnalysisResult() :
+            resistance(NaN),
+            Ra(NaN),
+            Rm(NaN),
+            Cm(NaN)
+        {
+        }
+
+        /** \brief Constructor
+         *
+         *  \param[in] waveform_       The sweep's waveform; must outlive this object
+         *  \param[in] applyVoltages_  True for voltage clamp (the measured values are currents), false for current clamp
+         *  \param[in] samplingRate_   Sampling rate, in Hz
+         */
+        SweepAnalysis::SweepAnalysis(const SimplifiedWaveform& waveform_, bool applyVoltages_, double samplingRate_) :
+            waveform(waveform_),
+            applyVoltages(applyVoltages_),
+            samplingRate(samplingRate_)
+        {
+        }
+
+        /** \brief Analyzes one sweep.
+         *
+         *  \param[in] values    Measured values, indexed by timestep from the start of the sweep, NaN where missing.  May
+         *                       be shorter than the waveform, in which case the segments past its end aren't analyzed.
+         *  \param[out] result   The results; every member is overwritten
+         *  \param[in] scratch   Buffers to use
+         */
+        void SweepAnalysis::analyze(const vector<double>& values, SweepAnalysisResult& result, Scratch& scratch) const {
+            analyzeSegments(values, result, scratch, nullptr, nullptr);
+            finish(result);
+        }
+
+        /** \brief The first part of analyze(): everything but the fits, which are queued in a batch instead.
+         *
+         *  \param[in] values    As for analyze()
+         *  \param[out] result   The results, but for the fits and what depends on them; see finish()
+         *  \param[in] scratch   Buffers to use
+         *  \param[in] fits      Batch to add the segments to fit to
+         *  \param[out] pending  For each segment added to fits, in order, the SegmentAnalysis its fit belongs in
+         */
+        void SweepAnalysis::analyzeDeferred(const vector<double>& values, SweepAnalysisResult& result, Scratch& scratch,
+                                            BatchExponentialFit& fits, vector<SegmentAnalysis*>& pending) const {
+            analyzeSegments(values, result, scratch, &fits, &pending);
+        }
+
+        /// The last part of analyze(): resistance and cell parameters, from a result whose fits have been filled in
+        void SweepAnalysis::finish(SweepAnalysisResult& result) const {
+            fitResistance(result);
+            calculateCellParameters(result);
+        }
+
+        // DC analysis of every segment, and a fit of each one with a transient: right away, or, if fits is given, queued
+        void SweepAnalysis::analyzeSegments(const vector<double>& values, SweepAnalysisResult& result, Scratch& scratch,
+                                            BatchExponentialFit* fits, vector<SegmentAnalysis*>* pending) const {
+            result = SweepAnalysisResult();
+            result.segments.resize(waveform.size());
+            for (unsigned int i = 0; i < waveform.size(); i++) {
+                const WaveformSegment& element = waveform.waveform[i];
+                if (element.numReps() <= 1) {
+                    continue;
+                }
+                analyzeDC(values, i, result);
+
+                // By appliedValue, since waveforms read from save files don't have appliedDiscreteValue
+                bool hasTransient = i > 0 && element.appliedValue != waveform.waveform[i - 1].appliedValue;
+                if (!hasTransient || !getFitSamples(values, i, scratch)) {
+                    continue;
+                }
+                SegmentAnalysis& segment = result.segments[i];
+                if (fits) {
+                    fits->add(scratch.xs, scratch.ys);
+                    pending->push_back(&segment);
+                }
+                else {
+                    segment.iterations = ExponentialFit::lm(scratch.xs, scratch.ys, segment.beta, segment.chi2);
+                    segment.fitValid = true;
+                }
+            }
+        }
+
+        void SweepAnalysis::analyzeDC(const vector<double>& values, unsigned int i, SweepAnalysisResult& result) const {
+            const WaveformSegment& element = waveform.waveform[i];
+            std::size_t end = std::min<std::size_t>(values.size(), element.endIndex + 1);
+            double min = std::numeric_limits<double>::infinity();
+            double max = -std::numeric_limits<double>::infinity();
+            for (std::size_t j = element.startIndex; j < end; j++) {
+                if (!std::isnan(values[j])) {
+                    min = std::min(min, values[j]);
+                    max = std::max(max, values[j]);
+                }
+            }
+
+            // The second half, not counting the last sample, as DCCalculationProcessor does
+            double sum = 0;
+            std::size_t count = 0;
+            std::size_t windowEnd = std::min<std::size_t>(values.size(), element.endIndex);
+            for (std::size_t j = element.startIndex + (element.endIndex - element.startIndex) / 2; j < windowEnd; j++) {
+                if (!std::isnan(values[j])) {
+                    sum += values[j];
+                    count++;
+                }
+            }
+            if (count == 0) {
+                return;
+            }
+
+            SegmentAnalysis& segment = result.segments[i];
+            segment.steadyState = sum / count;
+            double reference = (i > 0 && result.segments[i - 1].dcValid) ? result.segments[i - 1].steadyState : segment.steadyState;
+            bool maxIsPeak = std::abs(max - reference) >= std::abs(min - reference);
+            segment.peak = maxIsPeak ? max : min;
+            segment.dcValid = true;
+        }
+
+        // Puts segment i's samples to fit in scratch; false if there are too few
+        bool SweepAnalysis::getFitSamples(const vector<double>& values, unsigned int i, Scratch& scratch) const {
+            const WaveformSegment& element = waveform.waveform[i];
+            vector<double>& xs = scratch.xs;
+            vector<double>& ys = scratch.ys;
+            xs.clear();
+            ys.clear();
+            std::size_t end = std::min<std::size_t>(values.size(), element.endIndex + 1);
+            for (std::size_t j = element.startIndex + FIT_SKIP_SAMPLES; j < end; j++) {
+                if (!std::isnan(values[j])) {
+                    xs.push_back((j - element.startIndex) / samplingRate);
+                    ys.push_back(values[j]);
+                }
+            }
+            return xs.size() >= 3;
+        }
+
+        // Least-squares slope of voltage against current (i.e., dV/dI), accumulated one segment at a time
+        void SweepAnalysis::fitResistance(SweepAnalysisResult& result) const {
+            unsigned int numPoints = 0;
+            double meanCurrent = 0, meanVoltage = 0, sxx = 0, sxy = 0;
+            for (unsigned int i = 0; i < waveform.size(); i++) {
+                const SegmentAnalysis& segment = result.segments[i];
+                if (!segment.fitValid && !segment.dcValid) {
+                    continue;
+                }
+                double measured = segment.fitValid ? segment.beta[0] : segment.steadyState;
+                double applied = waveform.waveform[i].appliedValue;
+                double current = applyVoltages ? measured : applied;
+                double voltage = applyVoltages ? applied : measured;
+
+                numPoints++;
+                double dx = current - meanCurrent;
+                meanCurrent += dx / numPoints;
+                meanVoltage += (voltage - meanVoltage) / numPoints;
+                sxx += dx * (current - meanCurrent);
+                sxy += dx * (voltage - meanVoltage);
+            }
+
+            if (numPoints >= 2) {
+                double resistance = sxy / sxx;
+                if (std::isnormal(resistance) && resistance > 0) {
+                    result.resistance = resistance;
+                }
+            }
+        }
+
+        void SweepAnalysis::calculateCellParameters(SweepAnalysisResult& result) const {
+            if (std::isnan(result.resistance)) {
+                return;
+            }
+            vector<double> Ras, Rms, Cms;
+            for (unsigned int i = 1; i < waveform.size(); i++) {
+                const SegmentAnalysis& segment = result.segments[i];
+                if (segment.fitValid) {
+                    double Ra, Rm, Cm;
+                    double dV = waveform.waveform[i].appliedValue - waveform.waveform[i - 1].appliedValue;
+                    getRsAndCs(segment.beta, dV, result.resistance, Ra, Rm, Cm);
+                    Ras.push_back(Ra);
+                    Rms.push_back(Rm);
+                    Cms.push_back(Cm);
+                }
+            }
+            if (!Ras.empty()) {
+                result.Ra = DataAnalysis::average(Ras.begin(), Ras.end());
+                result.Rm = DataAnalysis::average(Rms.begin(), Rms.end());
+                result.Cm = DataAnalysis::average(Cms.begin(), Cms.end());
+            }
+        }
+
+        /** \brief Whole-cell parameters from the fit of one step's transient.
+         *
+         *  \param[in] beta        ExponentialFit parameters of the transient
+         *  \param[in] dV          Size of the step
+         *  \param[in] resistance  Total resistance (access plus membrane), e.g., from the steady states
+         *  \param[out] Ra         Access resistance
+         *  \param[out] Rm         Membrane resistance
+         *  \param[out] Cm         Membrane capacitance
+         */
+        void SweepAnalysis::getRsAndCs(const double beta[3], double dV, double resistance, double& Ra, double& Rm, double& Cm) {
+            //double A = beta[0];
+            double B = beta[1];
+            double C = beta[2];
+            double X = resistance;
+            double Y = C / dV;
+            double tau = -1.0 / B;
+            Ra = X / (1.0 + X * Y);
+            Rm = X - Ra;
+            double RaPRm = 1.0 / (1.0 / Ra + 1.0 / Rm);
+            Cm = tau / RaPRm;
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "BatchExponentialFit.h"
+#include "SimplifiedWaveform.h"
+#include <cstddef>
+#include <vector>
+
+namespace CLAMP {
+    namespace SignalProcessing {
+        /// Results for one segment of a sweep; see SweepAnalysis
+        struct SegmentAnalysis {
+            bool dcValid;            ///< steadyState and peak are set: the segment lasts more than one timestep, and has valid samples
+            double steadyState;      ///< Mean of the second half of the segment
+            double peak;             ///< The sample farthest from the previous segment's steady state (or this one's, for the first)
+            bool fitValid;           ///< beta, chi2, and iterations are set: the segment steps away from the previous one, and was fitted
+            double beta[3];          ///< ExponentialFit parameters, with time counted from the start of the segment
+            double chi2;             ///< Mean squared residual of the fit
+            unsigned int iterations; ///< Number of Levenberg-Marquardt iterations the fit took
+
+            SegmentAnalysis();
+        };
+
+        /// Results for one sweep; see SweepAnalysis
+        struct SweepAnalysisResult {
+            std::vector<SegmentAnalysis> segments; ///< One per segment of the waveform
+            double resistance;                     ///< Slope of voltage against current over the segments; NaN if there aren't two
+            double Ra;                             ///< Access resistance, averaged over the fitted segments; NaN if there are none
+            double Rm;                             ///< Membrane resistance, likewise
+            double Cm;                             ///< Membrane capacitance, likewise
+
+            SweepAnalysisResult();
+        };
+
+        /** \brief The per-sweep analysis of the data display, on a whole sweep at once.
+         *
+         *  DataStore's processors work on a sweep as it arrives; this does the same calculations on a sweep that's
+         *  already complete, e.g., one read back from a save file, without Qt or any of the GUI's state.  See
+         *  IO::BatchAnalyzer.
+         *  \li DC: each segment's steady state is the mean of its second half, and its peak is its sample farthest from
+         *      the previous segment's steady state.
+         *  \li Exponentials: each segment that steps away from the previous one is fitted with ExponentialFit, from
+         *      FIT_SKIP_SAMPLES timesteps after it starts.
+         *  \li Resistance: the slope of a least-squares line of voltage against current, through the segments' fitted
+         *      asymptotes (or steady states, where there's no fit).
+         *  \li Cell parameters: getRsAndCs() for each fit, averaged.
+         *
+         *  The samples are given by timestep within the sweep, with NaN for missing ones (e.g., where the mux read
+         *  temperature, or the sweep was cut short); those are left out of every calculation.  Thread-safe: analyze()
+         *  only reads the object, so one SweepAnalysis can serve every thread, each with its own Scratch.
+         *
+         *  To fit many sweeps' transients together with BatchExponentialFit, call analyzeDeferred() on each sweep, then
+         *  BatchExponentialFit::fit(), copy each result into the segment it was queued for, and call finish() on each
+         *  sweep; the results are those of analyze() but for the fits' rounding.
+         */
+        class SweepAnalysis {
+        public:
+            /// Reusable buffers for analyze(), so analyzing sweep after sweep doesn't allocate
+            struct Scratch {
+                std::vector<double> xs;
+                std::vector<double> ys;
+            };
+
+            SweepAnalysis(const SimplifiedWaveform& waveform_, bool applyVoltages_, double samplingRate_);
+
+            void analyze(const std::vector<double>& values, SweepAnalysisResult& result, Scratch& scratch) const;
+            void analyzeDeferred(const std::vector<double>& values, SweepAnalysisResult& result, Scratch& scratch,
+                                 BatchExponentialFit& fits, std::vector<SegmentAnalysis*>& pending) const;
+            void finish(SweepAnalysisResult& result) const;
+
+            static void getRsAndCs(const double beta[3], double dV, double resistance, double& Ra, double& Rm, double& Cm);
+
+            /// Timesteps at the start of a segment left out of its fit, while the clamp settles
+            static const unsigned int FIT_SKIP_SAMPLES = 12;
+
+        private:
+            const SimplifiedWaveform& waveform;
+            bool applyVoltages;
+            double samplingRate;
+
+            void analyzeDC(const std::vector<double>& values, unsigned int i, SweepAnalysisResult& result) const;
+            void analyzeSegments(const std::vector<double>& values, SweepAnalysisResult& result, Scratch& scratch,
+                                 BatchExponentialFit* fits, std::vector<SegmentAnalysis*>* pending) const;
+            bool getFitSamples(const std::vector<double>& values, unsigned int i, Scratch& scratch) const;
+            void fitResistance(SweepAnalysisResult& result) const;
+            void calculateCellParameters(SweepAnalysisResult& result) const;
+        };
+    }
+}
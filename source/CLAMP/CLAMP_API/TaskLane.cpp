@@ -0,0 +1,59 @@
+#include "TaskLane.h"
+#include "common.h"
+
+using std::unique_lock;
+using std::lock_guard;
+using std::mutex;
+
+/** \brief Constructor; starts the worker thread.
+ *
+ *  \param[in] priority  Priority of the worker thread; see Thread::setScheduling
+ *  \param[in] cpu       Core to pin it to, or -1 for any core
+ */
+TaskLane::TaskLane(Thread::Priority priority, int cpu) :
+    stopping(false)
+{
+    worker = std::thread(&TaskLane::work, this, priority, cpu);
+}
+
+/// Runs whatever is still queued (normally nothing), then ends the worker thread.
+TaskLane::~TaskLane() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    worker.join();
+}
+
+// Queues task, whose onLane flag the caller has already set
+void TaskLane::post(Thread* task) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        queue.push_back(task);
+    }
+    workAvailable.notify_one();
+}
+
+void TaskLane::work(Thread::Priority priority, int cpu) {
+    if ((priority != Thread::NORMAL_PRIORITY || cpu >= 0) && !Thread::scheduleCurrentThread(priority, cpu)) {
+        LOG(true) << "Warning: could not set a task lane's priority or CPU affinity\n";
+    }
+
+    unique_lock<mutex> lock(queueMutex);
+    while (true) {
+        while (queue.empty() && !stopping) {
+            workAvailable.wait(lock);
+        }
+        if (queue.empty()) {
+            break;
+        }
+        Thread* task = queue.front();
+        queue.pop_front();
+
+        lock.unlock();
+        task->runOnLane(); // May delete task (by letting its close() return)
+        lock.lock();
+    }
+    Thread::unscheduleCurrentThread();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Thread.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/** \brief A persistent worker thread that runs Thread objects one at a time, in the order they're started.
+ *
+ *  Starting a Thread on a lane (Thread::start(TaskLane&)) is a queue operation rather than an OS thread creation, and a
+ *  lane gives related jobs a thread of their own: e.g., an acquisition lane for clamp runs, zaps and buzzes, which must
+ *  never overlap, and another for housekeeping such as blinking LEDs.  Since tasks on a lane run in turn, a task that
+ *  should take over from the running one is started on the lane and the running one stopped; the new task starts as soon
+ *  as the old one returns.
+ *
+ *  Tasks must be closed (Thread::close, or their destructor) before the lane is destroyed.
+ */
+class TaskLane {
+public:
+    explicit TaskLane(Thread::Priority priority = Thread::NORMAL_PRIORITY, int cpu = -1);
+    ~TaskLane();
+
+private:
+    std::mutex queueMutex;
+    std::condition_variable workAvailable;
+    std::deque<Thread*> queue;
+    bool stopping;
+    std::thread worker;
+
+    void post(Thread* task);
+    void work(Thread::Priority priority, int cpu);
+
+    friend class Thread;
+
+    // Not copyable
+    TaskLane(const TaskLane&);
+    TaskLane& operator=(const TaskLane&);
+};
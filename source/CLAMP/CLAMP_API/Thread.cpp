@@ -1,9 +1,41 @@
 #include "Thread.h"
+#include "TaskLane.h"
 #include "common.h"
+#include <algorithm>
+#include <exception>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <avrt.h>
+#else
+    #include <pthread.h>
+    #include <sched.h>
+    #if defined(__linux__)
+        #include <sys/resource.h>
+        #include <sys/syscall.h>
+        #include <unistd.h>
+    #endif
+#endif
+
+#if defined(_WIN32)
+// The calling thread's MMCSS registration, if it has one; see unscheduleCurrentThread
+static thread_local HANDLE mmcssHandle = nullptr;
+#else
+// SCHED_FIFO priority for REALTIME_PRIORITY: above ordinary threads, below the kernel's interrupt threads (50 on PREEMPT_RT)
+static const int REALTIME_FIFO_PRIORITY = 40;
+#endif
+// Nice value for LOW_PRIORITY, on Linux
+static const int LOW_PRIORITY_NICE = 5;
 
 Thread::Thread() :
-    keepGoing(true),
-    thread(nullptr)
+    thread(nullptr),
+    priority(NORMAL_PRIORITY),
+    cpu(-1),
+    failedScheduling(false),
+    onLane(false)
 {
 }
 
@@ -12,33 +44,152 @@ Thread::~Thread() {
 }
 
 void callFromThread(Thread* threadWrapper) {
+    if (threadWrapper->priority != Thread::NORMAL_PRIORITY || threadWrapper->cpu >= 0) {
+        if (!Thread::scheduleCurrentThread(threadWrapper->priority, threadWrapper->cpu)) {
+            threadWrapper->failedScheduling = true;
+            LOG(true) << "Warning: could not set a thread's priority or CPU affinity\n";
+        }
+    }
     threadWrapper->run();
     threadWrapper->done();
+    Thread::unscheduleCurrentThread();
 }
 
 /// Start the thread
 void Thread::start() {
     close();
-    keepGoing = true;
+    keepGoing.reset();
+    failedScheduling = false;
     thread = new std::thread(callFromThread, this);
 }
 
+/** \brief Start the thread on lane's worker thread, once the tasks queued before it are done.
+ *
+ *  The priority and CPU affinity set with setScheduling() don't apply; the lane's own do.  If the thread is stopped before
+ *  its turn comes, run() is skipped; done() is still called, so whoever waits for it to finish hears about it.
+ */
+void Thread::start(TaskLane& lane) {
+    close();
+    keepGoing.reset();
+    {
+        std::lock_guard<std::mutex> lock(laneMutex);
+        onLane = true;
+    }
+    lane.post(this);
+}
+
+// Called by the lane's worker thread
+void Thread::runOnLane() {
+    if (keepGoing) {
+        // An exception mustn't take the lane's worker down with it
+        try {
+            run();
+        }
+        catch (std::exception& e) {
+            LOG(true) << "Task failed: " << e.what() << "\n";
+        }
+    }
+    done();
+    // Notified under the lock, since close() may delete this as soon as it sees onLane cleared
+    std::lock_guard<std::mutex> lock(laneMutex);
+    onLane = false;
+    laneDone.notify_all();
+}
+
 /** \brief Tell the thread to stop.  
  * 
- *  It notifies the thread to stop.  Subclasses can check the keepGoing flag and end early if it becomes false.
+ *  It notifies the thread to stop, waking it if it's waiting on keepGoing.  Subclasses can check keepGoing and end early
+ *  if it becomes false.
  *
  *  *This function does not do a hard stop on the thread.*
  */
 void Thread::stop() {
-    keepGoing = false;
+    keepGoing.requestStop();
 }
 
 /// Tell the thread to stop and wait until it does.
 void Thread::close() {
-    keepGoing = false;
+    keepGoing.requestStop();
     if (thread) {
         thread->join();
         delete thread;
         thread = nullptr;
     }
+    std::unique_lock<std::mutex> lock(laneMutex);
+    laneDone.wait(lock, [this]() { return !onLane; });
+}
+
+/** \brief Sets how the thread is scheduled, from the next start() on.
+ *
+ *  The thread applies the settings to itself as it starts.  If the operating system refuses (e.g., real-time priority
+ *  without the privileges for it), the thread runs anyway, a warning is logged, and schedulingFailed() returns true.
+ *
+ *  \param[in] priority_  Priority class
+ *  \param[in] cpu_       Core to pin the thread to, or -1 to let it run on any core
+ */
+void Thread::setScheduling(Priority priority_, int cpu_) {
+    priority = priority_;
+    cpu = cpu_;
+}
+
+/** \brief Applies a priority and CPU affinity to the calling thread.
+ *
+ *  For threads not made with this class, e.g., ThreadPool's workers.  Threads that ask for REALTIME_PRIORITY should call
+ *  unscheduleCurrentThread() before they end.
+ *
+ *  \param[in] priority  Priority class; NORMAL_PRIORITY leaves the priority alone
+ *  \param[in] cpu       Core to pin the thread to, or -1 to leave the affinity alone
+ *  \returns False if any of it couldn't be applied
+ */
+bool Thread::scheduleCurrentThread(Priority priority, int cpu) {
+    bool ok = true;
+#if defined(_WIN32)
+    if (cpu >= 0) {
+        ok = (cpu < 8 * static_cast<int>(sizeof(DWORD_PTR))) && (SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0);
+    }
+    if (priority == REALTIME_PRIORITY && !mmcssHandle) {
+        // The Multimedia Class Scheduler boosts registered threads without needing administrator rights
+        DWORD taskIndex = 0;
+        mmcssHandle = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+        ok = mmcssHandle && AvSetMmThreadPriority(mmcssHandle, AVRT_PRIORITY_HIGH) && ok;
+    }
+    else if (priority == LOW_PRIORITY) {
+        ok = SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL) && ok;
+    }
+#else
+    if (cpu >= 0) {
+#if defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        ok = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+#else
+        ok = false; // No thread affinity on macOS
+#endif
+    }
+    if (priority == REALTIME_PRIORITY) {
+        sched_param param;
+        param.sched_priority = std::min(REALTIME_FIFO_PRIORITY, sched_get_priority_max(SCHED_FIFO));
+        ok = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) && ok;
+    }
+    else if (priority == LOW_PRIORITY) {
+#if defined(__linux__)
+        // Linux nice values are per thread
+        ok = (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), LOW_PRIORITY_NICE) == 0) && ok;
+#else
+        ok = false;
+#endif
+    }
+#endif
+    return ok;
+}
+
+/// Undoes the calling thread's REALTIME_PRIORITY registration, where the operating system needs that (Windows' MMCSS).
+void Thread::unscheduleCurrentThread() {
+#if defined(_WIN32)
+    if (mmcssHandle) {
+        AvRevertMmThreadCharacteristics(mmcssHandle);
+        mmcssHandle = nullptr;
+    }
+#endif
 }
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "StopToken.h"
+
+class TaskLane;
 
 /** \brief Class-based wrapper for threads
  *
@@ -8,31 +14,61 @@
  *
  *  To implement a thread with some kind of internal state, make a subclass of this class and implement the
  *  run method.
+ *
+ *  start() runs it on a new OS thread of its own; start(TaskLane&) runs it on a lane's persistent worker thread instead,
+ *  after whatever is queued there, which saves creating a thread for short, frequent jobs.
  */
 class Thread {
 public:
+    /// How the operating system should schedule a thread; see setScheduling()
+    enum Priority {
+        LOW_PRIORITY,       ///< Below normal, for background work (saving, analysis) that mustn't hold up acquisition
+        NORMAL_PRIORITY,    ///< The operating system's default
+        REALTIME_PRIORITY   ///< SCHED_FIFO on Linux, MMCSS ("Pro Audio") on Windows, for acquisition.  On Linux this needs CAP_SYS_NICE or an rtprio limit.
+    };
+
     Thread();
     virtual ~Thread();
     void start();
+    void start(TaskLane& lane);
     void stop();
     void close();
+    void setScheduling(Priority priority_, int cpu_ = -1);
+    /// True if the last start() couldn't apply the priority or CPU affinity (the thread then runs normally)
+    bool schedulingFailed() const { return failedScheduling; }
+    static bool scheduleCurrentThread(Priority priority, int cpu = -1);
+    static void unscheduleCurrentThread();
     /// Implement this in a subclass to do the thread's logic
     virtual void run() {}
     /// Implement this in a subclass to do anything the thread needs to do when it finishes
     virtual void done() {}
 
 protected:
-    /** \brief Subclasses that do long computations can check this periodically; it's set to false when the thread is requested to stop.
+    /** \brief Subclasses that do long computations can check this periodically; it becomes false when the thread is requested to stop.
      *
-     *  For example:
+     *  Waits should use keepGoing.waitFor() (or pass &keepGoing to Board::read) rather than sleeping, so that stop()
+     *  wakes them right away.  For example:
      * \code
         while (keepGoing) {
           // do some calcuations
+          keepGoing.waitFor(std::chrono::milliseconds(500));
         }
      * \endcode
     */
-    volatile bool keepGoing;
+    CLAMP::StopToken keepGoing;
 
 private:
     std::thread* thread;
+    Priority priority;
+    int cpu;
+    std::atomic<bool> failedScheduling; // Set on the new thread, read on any
+
+    // Set while queued on or running on a TaskLane; close() waits for it to clear
+    bool onLane;
+    std::mutex laneMutex;
+    std::condition_variable laneDone;
+    void runOnLane();
+
+    friend void callFromThread(Thread* threadWrapper);
+    friend class TaskLane;
 };
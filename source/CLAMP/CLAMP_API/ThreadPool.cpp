@@ -0,0 +1,126 @@
+#include "ThreadPool.h"
+#include "Thread.h"
+#include <algorithm>
+
+using std::unique_lock;
+using std::mutex;
+using std::vector;
+using std::function;
+
+namespace CLAMP {
+    /** \brief Constructor
+     *
+     *  \param[in] numThreads  Number of worker threads.  0 means one fewer than the number of cores (since the thread
+     *                         calling run() also works on the tasks), but at least one.
+     */
+    ThreadPool::ThreadPool(unsigned int numThreads) :
+        stopping(false)
+    {
+        if (numThreads == 0) {
+            unsigned int cores = std::thread::hardware_concurrency();
+            numThreads = (cores > 2) ? cores - 1 : 1;
+        }
+        threads.reserve(numThreads);
+        for (unsigned int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread(&ThreadPool::worker, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            unique_lock<mutex> lock(poolMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    /// The pool shared by the whole application
+    ThreadPool& ThreadPool::instance() {
+        static ThreadPool theInstance;
+        return theInstance;
+    }
+
+    /** \brief Run a batch of tasks, and wait for all of them to finish.
+     *
+     *  The tasks may run in any order, and in parallel with each other.  If any task throws, the remaining tasks still
+     *  run, and the first exception is rethrown here.
+     *
+     *  \param[in] tasks  Tasks to run
+     */
+    void ThreadPool::run(const vector<function<void()>>& tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+        if (tasks.size() == 1 || threads.empty()) {
+            for (auto& task : tasks) {
+                task();
+            }
+            return;
+        }
+
+        Batch batch;
+        batch.tasks = &tasks;
+        batch.next = 0;
+        batch.remaining = tasks.size();
+
+        unique_lock<mutex> lock(poolMutex);
+        batches.push_back(&batch);
+        workAvailable.notify_all();
+
+        // Help out, rather than just waiting
+        while (batch.next < tasks.size()) {
+            runOne(lock, batch);
+        }
+        while (batch.remaining > 0) {
+            batch.done.wait(lock);
+        }
+
+        if (batch.error) {
+            std::rethrow_exception(batch.error);
+        }
+    }
+
+    void ThreadPool::worker() {
+        // Analysis runs below the threads that read from the board (the caller of run() works on its batch too)
+        Thread::scheduleCurrentThread(Thread::LOW_PRIORITY);
+        unique_lock<mutex> lock(poolMutex);
+        while (true) {
+            while (batches.empty() && !stopping) {
+                workAvailable.wait(lock);
+            }
+            if (batches.empty()) {
+                return;
+            }
+            runOne(lock, *batches.front());
+        }
+    }
+
+    // Starts the next task in batch; called (and returns) with lock held.
+    void ThreadPool::runOne(unique_lock<mutex>& lock, Batch& batch) {
+        std::size_t index = batch.next++;
+        if (batch.next == batch.tasks->size()) {
+            batches.erase(std::find(batches.begin(), batches.end(), &batch));
+        }
+        const function<void()>& task = (*batch.tasks)[index];
+
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        if (error && !batch.error) {
+            batch.error = error;
+        }
+        if (--batch.remaining == 0) {
+            batch.done.notify_all();
+        }
+    }
+}
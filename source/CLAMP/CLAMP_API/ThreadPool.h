@@ -0,0 +1,56 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace CLAMP {
+    /** \brief Small pool of worker threads for running independent tasks in parallel.
+     *
+     *  Tasks are handed to the pool in batches with run(), which returns once every task in the batch has finished.
+     *  The calling thread works on its own batch too, so run() can safely be called from inside a task (e.g., a
+     *  DataProcessor that fits several segments in parallel) without running out of threads.
+     *
+     *  There is a shared instance (see instance()), sized to the number of cores; it's started the first time it's used.
+     */
+    class ThreadPool {
+    public:
+        explicit ThreadPool(unsigned int numThreads = 0);
+        ~ThreadPool();
+
+        static ThreadPool& instance();
+
+        void run(const std::vector<std::function<void()>>& tasks);
+
+        /// Number of worker threads (not counting threads that call run())
+        unsigned int numThreads() const { return static_cast<unsigned int>(threads.size()); }
+
+    private:
+        /// \cond private
+        struct Batch {
+            const std::vector<std::function<void()>>* tasks;
+            std::size_t next;        // Index of the next task to start
+            std::size_t remaining;   // Number of tasks that haven't finished
+            std::exception_ptr error; // First exception thrown by a task
+            std::condition_variable done;
+        };
+        /// \endcond
+
+        std::mutex poolMutex;
+        std::condition_variable workAvailable;
+        std::deque<Batch*> batches; // Batches that still have tasks to start
+        std::vector<std::thread> threads;
+        bool stopping;
+
+        void worker();
+        void runOne(std::unique_lock<std::mutex>& lock, Batch& batch);
+
+        // Not copyable
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+    };
+}
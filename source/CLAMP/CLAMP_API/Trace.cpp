@@ -0,0 +1,146 @@
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+using std::vector;
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+
+namespace CLAMP {
+    namespace Tracing {
+        /// \cond private
+        struct Event {
+            const char* name;
+            uint64_t beginNs;
+            uint64_t endNs;
+        };
+
+        // One per thread; written only by its own thread
+        struct ThreadBuffer {
+            unsigned int tid;
+            vector<Event> events;
+            std::atomic<uint64_t> numWritten;
+
+            explicit ThreadBuffer(unsigned int tid_) : tid(tid_), events(TRACE_BUFFER_SIZE), numWritten(0) {}
+        };
+        /// \endcond
+
+        static std::atomic<bool> enabledFlag(false);
+
+        // The registry keeps the buffers alive after their threads exit, so their spans can still be exported
+        static mutex registryMutex;
+        static vector<shared_ptr<ThreadBuffer>> registry;
+
+        static uint64_t nowNs() {
+            static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        static ThreadBuffer& threadBuffer() {
+            thread_local ThreadBuffer* buffer = nullptr;
+            if (!buffer) {
+                lock_guard<mutex> lock(registryMutex);
+                registry.push_back(std::make_shared<ThreadBuffer>(static_cast<unsigned int>(registry.size()) + 1));
+                buffer = registry.back().get();
+            }
+            return *buffer;
+        }
+
+        /** \brief Turns recording of spans on or off.
+         *
+         *  Spans already recorded are kept; see clear().
+         */
+        void setEnabled(bool enabled) {
+            nowNs(); // Fix the time origin before the first span
+            enabledFlag.store(enabled, std::memory_order_relaxed);
+        }
+
+        /// \returns true if spans are being recorded.
+        bool isEnabled() {
+            return enabledFlag.load(std::memory_order_relaxed);
+        }
+
+        /** \brief Discards all recorded spans.
+         *
+         *  Call only while tracing is disabled and the traced threads are idle.
+         */
+        void clear() {
+            lock_guard<mutex> lock(registryMutex);
+            for (auto& buffer : registry) {
+                buffer->numWritten.store(0, std::memory_order_release);
+            }
+        }
+
+        static void writeEscaped(std::ostringstream& out, const char* s) {
+            for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                    out << '\\';
+                }
+                out << *s;
+            }
+        }
+
+        /** \brief Writes the recorded spans as a Chrome trace event (JSON) file.
+         *
+         *  Best called with tracing disabled; spans being recorded while exporting may be torn.
+         *
+         *  \param[in] filename  File to write; it is overwritten.
+         */
+        void exportChromeTrace(const FILENAME& filename) {
+            std::ostringstream out;
+            out << "{\"traceEvents\":[";
+            bool first = true;
+            {
+                lock_guard<mutex> lock(registryMutex);
+                for (auto& buffer : registry) {
+                    uint64_t end = buffer->numWritten.load(std::memory_order_acquire);
+                    uint64_t begin = (end > TRACE_BUFFER_SIZE) ? end - TRACE_BUFFER_SIZE : 0;
+                    for (uint64_t i = begin; i < end; i++) {
+                        const Event& event = buffer->events[i % TRACE_BUFFER_SIZE];
+                        out << (first ? "\n" : ",\n") << "{\"name\":\"";
+                        writeEscaped(out, event.name);
+                        out << "\",\"ph\":\"X\",\"ts\":" << (event.beginNs / 1000) << "." << ((event.beginNs / 100) % 10)
+                            << ",\"dur\":" << ((event.endNs - event.beginNs) / 1000) << "." << (((event.endNs - event.beginNs) / 100) % 10)
+                            << ",\"pid\":1,\"tid\":" << buffer->tid << "}";
+                        first = false;
+                    }
+                }
+            }
+            out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+            std::string text = out.str();
+            FileOutStream fs;
+            fs.open(filename);
+            fs.write(text.data(), static_cast<int>(text.size()));
+        }
+
+        Span::Span(const char* name_) :
+            name(name_),
+            beginNs(0)
+        {
+            if (enabledFlag.load(std::memory_order_relaxed)) {
+                beginNs = nowNs();
+            }
+            else {
+                name = nullptr;
+            }
+        }
+
+        Span::~Span() {
+            if (name) {
+                ThreadBuffer& buffer = threadBuffer();
+                uint64_t index = buffer.numWritten.load(std::memory_order_relaxed);
+                Event& event = buffer.events[index % TRACE_BUFFER_SIZE];
+                event.name = name;
+                event.beginNs = beginNs;
+                event.endNs = nowNs();
+                buffer.numWritten.store(index + 1, std::memory_order_release);
+            }
+        }
+    }
+}
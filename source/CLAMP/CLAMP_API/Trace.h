@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include "streams.h"
+
+namespace CLAMP {
+    /** \brief Lightweight tracing of the acquisition hot path.
+     *
+     *  Each thread records timestamped spans into its own ring buffer (the most recent TRACE_BUFFER_SIZE spans are
+     *  kept), so recording takes no locks.  Tracing is off until setEnabled(true) is called; when it's off, a span
+     *  costs one relaxed atomic load.  Defining CLAMP_NO_TRACING removes the spans from the build entirely.
+     *
+     *  The recorded spans can be written in the Chrome trace event format, which chrome://tracing and
+     *  https://ui.perfetto.dev can open:
+     \code
+        CLAMP::Tracing::setEnabled(true);
+        // ... acquire data ...
+        CLAMP::Tracing::setEnabled(false);
+        CLAMP::Tracing::exportChromeTrace(filename);
+     \endcode
+     */
+    namespace Tracing {
+        /// Number of spans kept per thread
+        const unsigned int TRACE_BUFFER_SIZE = 65536;
+
+        void setEnabled(bool enabled);
+        bool isEnabled();
+        void clear();
+        void exportChromeTrace(const FILENAME& filename);
+
+        /** \brief Records the time from construction to destruction as a span.
+         *
+         *  Use the CLAMP_TRACE_SPAN macro rather than constructing these directly.
+         */
+        class Span {
+        public:
+            /// \param[in] name_  Name of the span; must be a string literal (or otherwise outlive the trace).
+            explicit Span(const char* name_);
+            ~Span();
+
+        private:
+            const char* name;
+            uint64_t beginNs;
+        };
+    }
+}
+
+/// \cond private
+#define CLAMP_TRACE_CONCAT2(a, b) a##b
+#define CLAMP_TRACE_CONCAT(a, b) CLAMP_TRACE_CONCAT2(a, b)
+/// \endcond
+
+#ifdef CLAMP_NO_TRACING
+#define CLAMP_TRACE_SPAN(name)
+#else
+/// Records a span from here to the end of the enclosing scope
+#define CLAMP_TRACE_SPAN(name) CLAMP::Tracing::Span CLAMP_TRACE_CONCAT(clampTraceSpan_, __LINE__)(name)
+#endif
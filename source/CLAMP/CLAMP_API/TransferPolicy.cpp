@@ -0,0 +1,83 @@
+#include "TransferPolicy.h"
+#include <algorithm>
+#include <stdexcept>
+
+using std::invalid_argument;
+
+namespace CLAMP {
+    // Above this, the FIFO is considered to be backing up
+    static const double BACKLOG_PERCENT = 10.0;
+    // Fractions of the acquisition time spent transferring and processing, at which the chunk size grows or shrinks
+    static const double GROW_BUSY_FRACTION = 0.5;
+    static const double SHRINK_BUSY_FRACTION = 0.1;
+
+    /** \brief Constructor
+     *
+     *  The default bounds are 1 ms to 250 ms worth of data.
+     *
+     *  \param[in] samplingRate_  Board sampling rate, in Hz.  See Board::getSamplingRateHz().
+     */
+    TransferPolicy::TransferPolicy(double samplingRate_) :
+        samplingRate(samplingRate_),
+        minPackets(static_cast<unsigned int>(samplingRate_ / 1000)),
+        maxPackets(static_cast<unsigned int>(samplingRate_ / 4)),
+        chunkPackets(static_cast<unsigned int>(samplingRate_ / 30))
+    {
+    }
+
+    /** \brief Sets the range the chunk size is adapted within.
+     *
+     *  Call this while nothing is reading.  The USB buffers are sized for maxPackets_; the USBReaderThread picks up a new
+     *  maximum the next time it's started.
+     *
+     *  \param[in] minPackets_  Smallest chunk, in packets (i.e., timesteps).  Must be at least 1.
+     *  \param[in] maxPackets_  Largest chunk, in packets.  Must be at least minPackets_.
+     */
+    void TransferPolicy::setBounds(unsigned int minPackets_, unsigned int maxPackets_) {
+        if (minPackets_ == 0 || maxPackets_ < minPackets_) {
+            throw invalid_argument("Transfer size bounds must satisfy 0 < min <= max.");
+        }
+        minPackets = minPackets_;
+        maxPackets = maxPackets_;
+        chunkPackets = std::max(minPackets, std::min(chunkPackets.load(), maxPackets));
+    }
+
+    /// Smallest chunk size, in packets.  See setBounds().
+    unsigned int TransferPolicy::getMinPackets() const {
+        return minPackets;
+    }
+
+    /// Largest chunk size, in packets.  See setBounds().
+    unsigned int TransferPolicy::getMaxPackets() const {
+        return maxPackets;
+    }
+
+    /// Number of packets to wait for before the next transfer.
+    unsigned int TransferPolicy::getChunkPackets() const {
+        return chunkPackets;
+    }
+
+    /** \brief Adjusts the chunk size after a transfer.
+     *
+     *  \param[in] packetsRead         Number of packets in the transfer
+     *  \param[in] busySeconds         Time spent on the transfer and parsing it (i.e., not waiting for data)
+     *  \param[in] fifoPercentageFull  FIFO level after the transfer; see Board::fifoPercentageFull
+     *  \param[in] latencyMs           FIFO latency after the transfer; see Board::latency
+     */
+    void TransferPolicy::update(unsigned int packetsRead, double busySeconds, double fifoPercentageFull, double latencyMs) {
+        if (packetsRead == 0) {
+            return;
+        }
+        unsigned int chunk = chunkPackets;
+        double busyFraction = busySeconds * samplingRate / packetsRead;
+        double chunkMs = 1000.0 * chunk / samplingRate;
+
+        if (fifoPercentageFull > BACKLOG_PERCENT || busyFraction > GROW_BUSY_FRACTION) {
+            chunk = std::min(2 * chunk, maxPackets);
+        }
+        else if (latencyMs < chunkMs && busyFraction < SHRINK_BUSY_FRACTION) {
+            chunk = std::max(chunk / 2, minPackets);
+        }
+        chunkPackets = chunk;
+    }
+}
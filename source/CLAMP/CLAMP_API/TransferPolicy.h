@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+
+namespace CLAMP {
+    /** \brief Chooses how much data Board::read (or the USBReaderThread) waits for before each USB transfer.
+     *
+     *  Small transfers give low latency, which matters for short sweeps like a membrane test, but each transfer has a
+     *  fixed cost (polling the FIFO level, USB overhead, parsing setup).  Large transfers amortize that cost, which
+     *  matters for long continuous recordings.  This class starts at about 33 ms worth of data and, after every transfer,
+     *  adjusts the chunk size by a factor of 2 within [getMinPackets(), getMaxPackets()]:
+     *    - if the FIFO is backing up, or the transfer plus the caller's processing took more than half as long as the data
+     *      took to acquire, the chunk size grows;
+     *    - if the FIFO is nearly empty and that time was under a tenth of the acquisition time, it shrinks.
+     *
+     *  Setting equal bounds disables the adaptation.
+     */
+    class TransferPolicy {
+    public:
+        explicit TransferPolicy(double samplingRate_);
+
+        void setBounds(unsigned int minPackets_, unsigned int maxPackets_);
+        unsigned int getMinPackets() const;
+        unsigned int getMaxPackets() const;
+        unsigned int getChunkPackets() const;
+
+        void update(unsigned int packetsRead, double busySeconds, double fifoPercentageFull, double latencyMs);
+
+    private:
+        double samplingRate;
+        unsigned int minPackets;
+        unsigned int maxPackets;
+        std::atomic<unsigned int> chunkPackets; // Read by whichever thread is reading; see Board::startReaderThread
+    };
+}
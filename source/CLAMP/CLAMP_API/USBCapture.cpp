@@ -0,0 +1,339 @@
+#include "USBCapture.h"
+#include "Board.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using std::vector;
+using std::unique_ptr;
+using std::runtime_error;
+using namespace CLAMP::ClampConfig;
+
+namespace CLAMP {
+    template <typename T>
+    static void put(vector<unsigned char>& bytes, T value) {
+        std::size_t size = bytes.size();
+        bytes.resize(size + sizeof(T));
+        memcpy(&bytes[size], &value, sizeof(T));
+    }
+
+    // Reads a value and advances p
+    template <typename T>
+    static T take(const unsigned char*& p, const unsigned char* end) {
+        if (p + sizeof(T) > end) {
+            throw runtime_error("USB capture is truncated");
+        }
+        T value;
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return value;
+    }
+
+    //------------------------------------------------------------------------------------------------------
+    /// Constructor
+    CaptureConfiguration::ChannelSettings::ChannelSettings() :
+        enabled(false),
+        voltageAmpResidual(0),
+        differenceAmpResidual(0),
+        resistance(0),
+        feedbackResistance(0),
+        largeClampStep(false),
+        currentStep(0)
+    {
+    }
+
+    /// Constructor: nothing enabled
+    CaptureConfiguration::CaptureConfiguration() :
+        is18bitADC(true),
+        channelRepetition(1),
+        digin(false),
+        digout(false),
+        packetSize(0)
+    {
+        for (unsigned int i = 0; i < 8; i++) {
+            adcs[i] = false;
+        }
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            outputDecimation[chip] = 1;
+        }
+    }
+
+    /** \brief Constructor: the board's current settings.
+     *
+     *  \param[in] board  Board whose data is being captured
+     */
+    CaptureConfiguration::CaptureConfiguration(Board& board) :
+        is18bitADC(board.is18bitADC),
+        channelLoop(board.channels),
+        channelRepetition(board.channelRepetition),
+        digin(board.diginTransfer),
+        digout(board.digoutTransfer),
+        packetSize(board.getPacketLayout().packetSize)
+    {
+        for (unsigned int i = 0; i < 8; i++) {
+            adcs[i] = board.adcTransfer[i];
+        }
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            outputDecimation[chip] = board.getOutputDecimation(chip);
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                const Channel& c = *board.chip[chip]->channel[channel];
+                ChannelSettings& s = channels[chip][channel];
+                s.enabled = c.getEnable();
+                if (!s.enabled) {
+                    continue;
+                }
+                s.voltageAmpResidual = c.voltageAmpResidual;
+                s.differenceAmpResidual = c.differenceAmpResidual;
+                s.resistance = static_cast<uint8_t>(c.registers.r3.value.feedbackResistance);
+                s.feedbackResistance = c.getFeedbackResistance();
+                s.largeClampStep = c.registers.r1.value.clampStepSize != 0;
+                s.currentStep = c.recallCurrentStep();
+                s.correction = c.measurementCorrection;
+            }
+        }
+    }
+
+    /** \brief Configures a board to decode data as the captured one did.
+     *
+     *  Sets the channel loop, the enabled channels, the data transfer, the output decimation, and the settings of each
+     *  enabled channel that its conversions use.  The board must be open, and have the same ADC width.  Nothing else
+     *  (waveforms, other registers) is changed.
+     *
+     *  \param[in] board  Board to configure, e.g., one with a SimulatedBoard
+     */
+    void CaptureConfiguration::applyTo(Board& board) const {
+        if (board.is18bitADC != is18bitADC) {
+            throw runtime_error("The board's ADC width isn't the captured one's");
+        }
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            board.setOutputDecimation(chip, outputDecimation[chip]);
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                Channel& c = *board.chip[chip]->channel[channel];
+                const ChannelSettings& s = channels[chip][channel];
+                c.setEnable(s.enabled);
+                if (!s.enabled) {
+                    continue;
+                }
+                if (s.resistance >= sizeof(c.rFeedback) / sizeof(c.rFeedback[0])) {
+                    throw runtime_error("Invalid feedback resistor in USB capture");
+                }
+                c.voltageAmpResidual = s.voltageAmpResidual;
+                c.differenceAmpResidual = s.differenceAmpResidual;
+                c.registers.r3.value.feedbackResistance = s.resistance;
+                c.rFeedback[s.resistance] = s.feedbackResistance;
+                c.registers.r1.value.clampStepSize = s.largeClampStep ? 1 : 0;
+                c.rememberCurrentStep(s.currentStep);
+                c.measurementCorrection = s.correction;
+            }
+        }
+        board.channelRepetition = channelRepetition;
+        board.setChannelLoopOrder(channelLoop);
+        bool transfer[8];
+        std::copy(adcs, adcs + 8, transfer);
+        board.setDataTransfer(transfer, digin, digout);
+        if (board.getPacketLayout().packetSize != packetSize) {
+            throw runtime_error("USB capture's packet size doesn't match its configuration");
+        }
+    }
+
+    /// The channels that return data
+    ChipChannelList CaptureConfiguration::getEnabledChannels() const {
+        ChipChannelList result;
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                if (channels[chip][channel].enabled) {
+                    result.push_back(ChipChannel(chip, channel));
+                }
+            }
+        }
+        return result;
+    }
+
+    /** \brief Appends the configuration to bytes, in the form deserialize() reads.
+     *
+     *  Values are stored as they are in memory (so doubles round trip exactly).
+     */
+    void CaptureConfiguration::serialize(vector<unsigned char>& bytes) const {
+        put<uint8_t>(bytes, is18bitADC ? 1 : 0);
+        put<uint8_t>(bytes, static_cast<uint8_t>(channelLoop.size()));
+        for (ChannelNumber channel : channelLoop) {
+            put<uint8_t>(bytes, static_cast<uint8_t>(channel));
+        }
+        put<uint8_t>(bytes, static_cast<uint8_t>(channelRepetition));
+        uint8_t adcMask = 0;
+        for (unsigned int i = 0; i < 8; i++) {
+            if (adcs[i]) {
+                adcMask |= (1 << i);
+            }
+        }
+        put<uint8_t>(bytes, adcMask);
+        put<uint8_t>(bytes, (digin ? 1 : 0) | (digout ? 2 : 0));
+        put<uint32_t>(bytes, packetSize);
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            put<uint16_t>(bytes, static_cast<uint16_t>(outputDecimation[chip]));
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                const ChannelSettings& s = channels[chip][channel];
+                put<uint8_t>(bytes, s.enabled ? 1 : 0);
+                if (!s.enabled) {
+                    continue;
+                }
+                put<int32_t>(bytes, s.voltageAmpResidual);
+                put<int32_t>(bytes, s.differenceAmpResidual);
+                put<uint8_t>(bytes, s.resistance);
+                put<double>(bytes, s.feedbackResistance);
+                put<uint8_t>(bytes, s.largeClampStep ? 1 : 0);
+                put<double>(bytes, s.currentStep);
+                put<double>(bytes, s.correction.voltageGain);
+                put<double>(bytes, s.correction.voltageOffset);
+                put<double>(bytes, s.correction.currentGain);
+                put<double>(bytes, s.correction.currentOffset);
+            }
+        }
+    }
+
+    /** \brief Reads a configuration written by serialize().
+     *
+     *  \param[in] p    First byte
+     *  \param[in] end  Past the last byte
+     *  \returns The configuration
+     */
+    CaptureConfiguration CaptureConfiguration::deserialize(const unsigned char* p, const unsigned char* end) {
+        CaptureConfiguration c;
+        c.is18bitADC = take<uint8_t>(p, end) != 0;
+        unsigned int loopSize = take<uint8_t>(p, end);
+        for (unsigned int i = 0; i < loopSize; i++) {
+            unsigned int channel = take<uint8_t>(p, end);
+            if (channel >= MAX_NUM_CHANNELS) {
+                throw runtime_error("Invalid channel in USB capture");
+            }
+            c.channelLoop.push_back(static_cast<ChannelNumber>(channel));
+        }
+        c.channelRepetition = take<uint8_t>(p, end);
+        uint8_t adcMask = take<uint8_t>(p, end);
+        for (unsigned int i = 0; i < 8; i++) {
+            c.adcs[i] = (adcMask & (1 << i)) != 0;
+        }
+        uint8_t digital = take<uint8_t>(p, end);
+        c.digin = (digital & 1) != 0;
+        c.digout = (digital & 2) != 0;
+        c.packetSize = take<uint32_t>(p, end);
+        for (unsigned int chip = 0; chip < MAX_NUM_CHIPS; chip++) {
+            c.outputDecimation[chip] = take<uint16_t>(p, end);
+            for (unsigned int channel = 0; channel < MAX_NUM_CHANNELS; channel++) {
+                ChannelSettings& s = c.channels[chip][channel];
+                s.enabled = take<uint8_t>(p, end) != 0;
+                if (!s.enabled) {
+                    continue;
+                }
+                s.voltageAmpResidual = take<int32_t>(p, end);
+                s.differenceAmpResidual = take<int32_t>(p, end);
+                s.resistance = take<uint8_t>(p, end);
+                s.feedbackResistance = take<double>(p, end);
+                s.largeClampStep = take<uint8_t>(p, end) != 0;
+                s.currentStep = take<double>(p, end);
+                s.correction.voltageGain = take<double>(p, end);
+                s.correction.voltageOffset = take<double>(p, end);
+                s.correction.currentGain = take<double>(p, end);
+                s.correction.currentOffset = take<double>(p, end);
+            }
+        }
+        if (c.packetSize == 0) {
+            throw runtime_error("Invalid configuration in USB capture");
+        }
+        return c;
+    }
+
+    //------------------------------------------------------------------------------------------------------
+    /** \brief Constructor
+     *
+     *  \param[in] filename  File to write; it is overwritten.
+     */
+    USBCaptureWriter::USBCaptureWriter(const FILENAME& filename) :
+        out(new FileOutStream())
+    {
+        out->open(filename);
+        vector<unsigned char> header;
+        put<uint32_t>(header, USBCapture::MAGIC);
+        put<uint16_t>(header, USBCapture::VERSION);
+        out->write(reinterpret_cast<const char*>(header.data()), static_cast<int>(header.size()));
+    }
+
+    /** \brief Writes one read's data, preceded by the board's configuration if it has changed since the last read.
+     *
+     *  \param[in] board     Board the data was read from
+     *  \param[in] data      The packets, as read
+     *  \param[in] numBytes  Size of data
+     */
+    void USBCaptureWriter::write(Board& board, const unsigned char* data, unsigned int numBytes) {
+        scratch.clear();
+        CaptureConfiguration(board).serialize(scratch);
+        if (scratch != configuration) {
+            writeRecord(USBCapture::CONFIGURATION, scratch.data(), static_cast<uint32_t>(scratch.size()));
+            configuration.swap(scratch);
+        }
+        writeRecord(USBCapture::DATA, data, numBytes);
+    }
+
+    void USBCaptureWriter::writeRecord(uint8_t kind, const unsigned char* payload, uint32_t length) {
+        char header[sizeof(uint8_t) + sizeof(uint32_t)];
+        header[0] = static_cast<char>(kind);
+        memcpy(header + 1, &length, sizeof(length));
+        out->write(header, sizeof(header));
+        out->write(reinterpret_cast<const char*>(payload), static_cast<int>(length));
+    }
+
+    //------------------------------------------------------------------------------------------------------
+    /** \brief Constructor: loads the capture.
+     *
+     *  \param[in] filename  File written by Board::startUSBCapture
+     */
+    USBCapture::USBCapture(const FILENAME& filename) {
+        FileInStream in;
+        if (!in.open(filename)) {
+            throw runtime_error("Could not open USB capture file");
+        }
+        bytes.resize(static_cast<std::size_t>(in.bytesRemaining()));
+        if (bytes.empty()) {
+            throw runtime_error("USB capture file is empty");
+        }
+        in.read(reinterpret_cast<char*>(bytes.data()), static_cast<int>(bytes.size()));
+
+        const unsigned char* p = bytes.data();
+        const unsigned char* end = p + bytes.size();
+        if (bytes.size() < sizeof(uint32_t) + sizeof(uint16_t) || take<uint32_t>(p, end) != MAGIC) {
+            Read read = { 0, bytes.data(), bytes.size() }; // Raw packets, from before captures had a header
+            reads.push_back(read);
+            return;
+        }
+        if (take<uint16_t>(p, end) > VERSION) {
+            throw runtime_error("USB capture is from a newer version");
+        }
+        while (static_cast<std::size_t>(end - p) >= sizeof(uint8_t) + sizeof(uint32_t)) {
+            uint8_t kind = take<uint8_t>(p, end);
+            uint32_t length = take<uint32_t>(p, end);
+            if (static_cast<std::size_t>(end - p) < length) {
+                break; // Cut off mid-record, e.g., by a crash; keep what's complete
+            }
+            if (kind == CONFIGURATION) {
+                configurations.push_back(CaptureConfiguration::deserialize(p, p + length));
+            }
+            else if (kind == DATA) {
+                if (configurations.empty()) {
+                    throw runtime_error("USB capture has data before its configuration");
+                }
+                Read read = { configurations.size() - 1, p, length };
+                reads.push_back(read);
+            }
+            p += length;
+        }
+    }
+
+    /// Total size of the reads' data
+    uint64_t USBCapture::getDataBytes() const {
+        uint64_t total = 0;
+        for (const Read& read : reads) {
+            total += read.numBytes;
+        }
+        return total;
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "Constants.h"
+#include "Channel.h"
+#include "streams.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace CLAMP {
+    class Board;
+
+    /** \brief The board settings that USB data is decoded with: the packet layout, and each channel's conversions.
+     *
+     *  Saved in USB captures (see Board::startUSBCapture), so that a capture decodes the same way when it's replayed as
+     *  it did when it was read: applyTo() puts the settings on another Board, e.g., one with a SimulatedBoard, whose
+     *  ReadQueue then produces what the original Board's did.
+     */
+    struct CaptureConfiguration {
+        /// A channel's settings, as ReadQueue::updateConversionPlans uses them
+        struct ChannelSettings {
+            bool enabled;
+            int32_t voltageAmpResidual;
+            int32_t differenceAmpResidual;
+            uint8_t resistance;          ///< Registers::Register3::feedbackResistance
+            double feedbackResistance;   ///< Channel::rFeedback of that resistor
+            bool largeClampStep;         ///< Registers::Register1::clampStepSize
+            double currentStep;          ///< Channel::recallCurrentStep
+            MeasurementCorrection correction;
+
+            ChannelSettings();
+        };
+
+        bool is18bitADC;
+        std::vector<ChannelNumber> channelLoop;
+        unsigned int channelRepetition;
+        bool adcs[8];
+        bool digin;
+        bool digout;
+        unsigned int packetSize;        ///< Bytes per packet, for checking the layout
+        unsigned int outputDecimation[MAX_NUM_CHIPS];
+        ChannelSettings channels[MAX_NUM_CHIPS][MAX_NUM_CHANNELS];
+
+        CaptureConfiguration();
+        explicit CaptureConfiguration(Board& board);
+
+        void applyTo(Board& board) const;
+        ClampConfig::ChipChannelList getEnabledChannels() const;
+
+        void serialize(std::vector<unsigned char>& bytes) const;
+        static CaptureConfiguration deserialize(const unsigned char* p, const unsigned char* end);
+    };
+
+    /** \brief Writes a USB capture: the raw data of each read, preceded by the configuration it was read with.
+     *
+     *  A capture starts with a magic number and a version, then has one record per read, plus one for the configuration
+     *  before the first read and whenever it changes (e.g., channels were enabled between runs).  Each record is a kind
+     *  (CONFIGURATION or DATA), a payload length, and the payload; a DATA payload is the read's packets, as they came
+     *  from the board.  Keeping the reads separate lets a replay parse the data in the same chunks.  See USBCapture.
+     */
+    class USBCaptureWriter {
+    public:
+        explicit USBCaptureWriter(const FILENAME& filename);
+
+        void write(Board& board, const unsigned char* data, unsigned int numBytes);
+
+    private:
+        std::unique_ptr<FileOutStream> out;
+        std::vector<unsigned char> configuration; // Last one written, serialized
+        std::vector<unsigned char> scratch;
+
+        void writeRecord(uint8_t kind, const unsigned char* payload, uint32_t length);
+
+        // Not copyable
+        USBCaptureWriter(const USBCaptureWriter&);
+        USBCaptureWriter& operator=(const USBCaptureWriter&);
+    };
+
+    /** \brief A USB capture, loaded into memory: the reads, in order, each with the configuration it was read with.
+     *
+     *  Captures from before configurations were recorded are raw packets with no header; they load as one read with no
+     *  configuration (hasConfiguration() is false), to be replayed on a board that's configured as the original was.
+     */
+    class USBCapture {
+    public:
+        static const uint32_t MAGIC = 0x42535543; // "CUSB"
+        static const uint16_t VERSION = 1;
+
+        /// Kinds of record
+        enum RecordKind {
+            CONFIGURATION = 1,
+            DATA = 2
+        };
+
+        /// One read's worth of data
+        struct Read {
+            std::size_t configuration;  ///< Index into getConfigurations(); meaningless without hasConfiguration()
+            const unsigned char* data;  ///< The packets, as the board sent them
+            std::size_t numBytes;
+        };
+
+        explicit USBCapture(const FILENAME& filename);
+
+        bool hasConfiguration() const { return !configurations.empty(); }
+        const std::vector<CaptureConfiguration>& getConfigurations() const { return configurations; }
+        const std::vector<Read>& getReads() const { return reads; }
+        uint64_t getDataBytes() const;
+
+    private:
+        std::vector<unsigned char> bytes;
+        std::vector<CaptureConfiguration> configurations;
+        std::vector<Read> reads;
+
+        // Not copyable; reads point into bytes
+        USBCapture(const USBCapture&);
+        USBCapture& operator=(const USBCapture&);
+    };
+}
@@ -14,8 +14,10 @@ namespace CLAMP {
         enabled = false;
         MOSI = MOSICommand();
         MISO = MISOReturn();
+        adcValue = 0;
         nextIsConvert = false;
         convertValue = 0;
+        convertAdcValue = 0;
     }
 
     unsigned char* USBPerChannel::read(unsigned char* input, const Channel& channel) {
@@ -106,6 +108,30 @@ namespace CLAMP {
         return input;
     }
 
+    void USBPacket::fromColumns(const USBColumns& columns, unsigned int packetIndex, const USBPacketLayout& layout) {
+        timestamp = columns.timestamps[packetIndex];
+
+        unsigned int base = packetIndex * layout.slots.size();
+        for (unsigned int slotIndex = 0; slotIndex < layout.slots.size(); slotIndex++) {
+            const USBPacketLayout::Slot& slot = layout.slots[slotIndex];
+            USBPerChannel& usbChannel = chip[slot.chip].channel[slot.channelIndex];
+            usbChannel.enabled = true;
+            usbChannel.MOSI = columns.mosi[base + slotIndex];
+            usbChannel.MISO = columns.miso[base + slotIndex];
+            usbChannel.adcValue = columns.adcValues[base + slotIndex];
+        }
+
+        for (unsigned int i = 0; i < layout.numADCs; i++) {
+            adcs[layout.adcNumber[i]] = columns.adcs[packetIndex * layout.numADCs + i];
+        }
+        if (layout.digInOffset >= 0) {
+            digIn = columns.digIns[packetIndex];
+        }
+        if (layout.digOutOffset >= 0) {
+            digOut = columns.digOuts[packetIndex];
+        }
+    }
+
     USBPerChannel& USBPacket::extractChannel(const ChipChannel& chipChannel) {
         return chip[chipChannel.chip].channel[chipChannel.channel];
     }
@@ -113,5 +139,150 @@ namespace CLAMP {
     USBPerChip& USBPacket::extractChip(const ChipChannel& chipChannel) {
         return chip[chipChannel.chip];
     }
+
+    //------------------------------------------------------------------------------
+    // Signed ADC value in a MISO word (i.e., Mux::getValue without the residual)
+    template <bool Is18bit>
+    static inline int32_t adcValueOf(uint32_t word) {
+        // Sign-extend the low 16 or 18 bits
+        const unsigned int shift = Is18bit ? 14 : 16;
+        return static_cast<int32_t>(word << shift) >> shift;
+    }
+
+    /* Splits the contiguous MOSI/MISO words after each packet's timestamp into columns.  NumSlots = 0 means the number
+     * of slots is only known at run time (numSlots); otherwise numSlots == NumSlots, and the inner loop has a fixed count.
+     */
+    template <bool Is18bit, unsigned int NumSlots>
+    static void decodeSlots(const unsigned char* input, unsigned int numPackets, unsigned int packetSize, unsigned int numSlots,
+                            MOSICommand* mosi, MISOReturn* miso, int32_t* adcValues) {
+        const unsigned int n = (NumSlots == 0) ? numSlots : NumSlots;
+        const unsigned char* p = input + sizeof(uint32_t);
+        for (unsigned int i = 0; i < numPackets; i++, p += packetSize) {
+            const uint32_t* words = reinterpret_cast<const uint32_t*>(p);
+            for (unsigned int s = 0; s < n; s++) {
+                uint32_t misoWord = words[2 * s + 1];
+                *reinterpret_cast<uint32_t*>(mosi++) = words[2 * s];
+                *reinterpret_cast<uint32_t*>(miso++) = misoWord;
+                *adcValues++ = adcValueOf<Is18bit>(misoWord);
+            }
+        }
+    }
+
+    // Decoders for 1, 2, or 4 channels per chip on 1-8 chips; other slot counts use the run-time loop
+    template <bool Is18bit>
+    static USBPacketLayout::SlotDecoder selectSlotDecoder(unsigned int numSlots) {
+        switch (numSlots) {
+        case 1: return &decodeSlots<Is18bit, 1>;
+        case 2: return &decodeSlots<Is18bit, 2>;
+        case 3: return &decodeSlots<Is18bit, 3>;
+        case 4: return &decodeSlots<Is18bit, 4>;
+        case 5: return &decodeSlots<Is18bit, 5>;
+        case 6: return &decodeSlots<Is18bit, 6>;
+        case 7: return &decodeSlots<Is18bit, 7>;
+        case 8: return &decodeSlots<Is18bit, 8>;
+        case 12: return &decodeSlots<Is18bit, 12>;
+        case 16: return &decodeSlots<Is18bit, 16>;
+        case 24: return &decodeSlots<Is18bit, 24>;
+        case 32: return &decodeSlots<Is18bit, 32>;
+        default: return &decodeSlots<Is18bit, 0>;
+        }
+    }
+
+    USBPacketLayout::USBPacketLayout() :
+        numADCs(0),
+        adcOffset(0),
+        digInOffset(-1),
+        digOutOffset(-1),
+        packetSize(0),
+        slotDecoder(&decodeSlots<false, 0>)
+    {
+    }
+
+    void USBPacketLayout::update(const Board& board, const std::vector<ChannelNumber>& channels) {
+        unsigned int offset = sizeof(uint32_t); // timestamp
+
+        slots.clear();
+        for (unsigned int channelIndex = 0; channelIndex < channels.size(); channelIndex++) {
+            for (unsigned int chipIndex = 0; chipIndex < MAX_NUM_CHIPS; chipIndex++) {
+                const Channel& channel = *board.chip[chipIndex]->channel[channels[channelIndex]];
+                if (channel.getEnable()) {
+                    Slot slot = { offset, chipIndex, channelIndex };
+                    slots.push_back(slot);
+                    offset += USBPacket::getPerChannelSize();
+                }
+            }
+        }
+
+        adcOffset = offset;
+        numADCs = 0;
+        for (unsigned int adc = 0; adc < 8; adc++) {
+            if (board.adcTransfer[adc]) {
+                adcNumber[numADCs++] = adc;
+                offset += sizeof(uint16_t);
+            }
+        }
+        digInOffset = -1;
+        if (board.diginTransfer) {
+            digInOffset = offset;
+            offset += sizeof(uint16_t);
+        }
+        digOutOffset = -1;
+        if (board.digoutTransfer) {
+            digOutOffset = offset;
+            offset += sizeof(uint16_t);
+        }
+
+        packetSize = (offset % 8 == 0) ? offset : (offset / 8 + 1) * 8;
+
+        unsigned int numSlots = static_cast<unsigned int>(slots.size());
+        slotDecoder = board.is18bitADC ? selectSlotDecoder<true>(numSlots) : selectSlotDecoder<false>(numSlots);
+    }
+
+    void USBPacketLayout::decode(const unsigned char* input, unsigned int numPackets, USBColumns& columns) const {
+        const unsigned int numSlots = slots.size();
+
+        // resize() only reallocates when the block grows past its previous maximum
+        columns.numPackets = numPackets;
+        columns.timestamps.resize(numPackets);
+        columns.mosi.resize(numPackets * numSlots);
+        columns.miso.resize(numPackets * numSlots);
+        columns.adcValues.resize(numPackets * numSlots);
+        columns.adcs.resize(numPackets * numADCs);
+        columns.digIns.resize(digInOffset >= 0 ? numPackets : 0);
+        columns.digOuts.resize(digOutOffset >= 0 ? numPackets : 0);
+
+        // Timestamps
+        const unsigned char* p = input;
+        for (unsigned int i = 0; i < numPackets; i++, p += packetSize) {
+            columns.timestamps[i] = *reinterpret_cast<const uint32_t*>(p);
+        }
+
+        // MOSI/MISO words
+        slotDecoder(input, numPackets, packetSize, numSlots, columns.mosi.data(), columns.miso.data(), columns.adcValues.data());
+
+        // Board-level values
+        if (numADCs > 0) {
+            uint16_t* adc = columns.adcs.data();
+            p = input + adcOffset;
+            for (unsigned int i = 0; i < numPackets; i++, p += packetSize) {
+                const uint16_t* q = reinterpret_cast<const uint16_t*>(p);
+                for (unsigned int j = 0; j < numADCs; j++) {
+                    *adc++ = q[j];
+                }
+            }
+        }
+        if (digInOffset >= 0) {
+            p = input + digInOffset;
+            for (unsigned int i = 0; i < numPackets; i++, p += packetSize) {
+                columns.digIns[i] = *reinterpret_cast<const uint16_t*>(p);
+            }
+        }
+        if (digOutOffset >= 0) {
+            p = input + digOutOffset;
+            for (unsigned int i = 0; i < numPackets; i++, p += packetSize) {
+                columns.digOuts[i] = *reinterpret_cast<const uint16_t*>(p);
+            }
+        }
+    }
     /// \endcond
 }
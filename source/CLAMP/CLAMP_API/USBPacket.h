@@ -27,10 +27,12 @@ namespace CLAMP {
         bool     enabled;
         ChipProtocol::MOSICommand MOSI;
         ChipProtocol::MISOReturn MISO;   // Raw MISO value
+        int32_t  adcValue;               // MISO interpreted as an ADC conversion, for the board's ADC width
 
         // Processed values
         bool nextIsConvert;
         uint32_t convertValue;
+        int32_t  convertAdcValue;        // adcValue of the MISO word holding this command's conversion
 
         USBPerChannel() { reset();  }
 
@@ -49,6 +51,9 @@ namespace CLAMP {
         void setMuxConvertValue(ChipProtocol::MuxSelection mux, uint32_t value);
     };
 
+    class USBPacketLayout;
+    struct USBColumns;
+
     class USBPacket {
     public:
         uint32_t timestamp;
@@ -60,6 +65,7 @@ namespace CLAMP {
 
         void reset();
         unsigned char* read(unsigned char* input, const Board& board, std::vector<ChannelNumber>& channels);
+        void fromColumns(const USBColumns& columns, unsigned int packetIndex, const USBPacketLayout& layout);
 
         USBPerChannel& extractChannel(const ClampConfig::ChipChannel& chipChannel);
         USBPerChip& extractChip(const ClampConfig::ChipChannel& chipChannel);
@@ -67,5 +73,52 @@ namespace CLAMP {
         static unsigned int getPerChannelSize();
         static unsigned int getChannelIndependentSize(const Board& board);
     };
+
+    // Column-oriented (struct-of-arrays) version of a block of USB packets.  Per-slot values are stored
+    // packet-major, i.e., element [packetIndex * numSlots + slotIndex].
+    struct USBColumns {
+        unsigned int numPackets;
+        std::vector<uint32_t> timestamps;
+        std::vector<ChipProtocol::MOSICommand> mosi;
+        std::vector<ChipProtocol::MISOReturn> miso;
+        std::vector<int32_t> adcValues; // Same layout as miso; each MISO word read as an ADC conversion
+        std::vector<uint16_t> adcs;    // [packetIndex * numADCs + i]
+        std::vector<uint16_t> digIns;
+        std::vector<uint16_t> digOuts;
+
+        USBColumns() : numPackets(0) {}
+    };
+
+    // Byte offsets of everything in a USB packet, for a given channel loop and set of enabled channels/ADCs.
+    // Computing these once (rather than per packet) lets decode() run without touching the Board's Chip/Channel objects.
+    //
+    // The MOSI/MISO words of all the slots are contiguous, right after the timestamp.  update() picks a decoder for them
+    // that's compiled for the board's ADC width and (for the usual channel loop/chip combinations) the number of slots,
+    // so the per-packet loop is unrolled and has no branches.
+    class USBPacketLayout {
+    public:
+        typedef void (*SlotDecoder)(const unsigned char* input, unsigned int numPackets, unsigned int packetSize, unsigned int numSlots,
+                                    ChipProtocol::MOSICommand* mosi, ChipProtocol::MISOReturn* miso, int32_t* adcValues);
+
+        struct Slot {
+            unsigned int offset;        // Byte offset of the MOSI word; the MISO word follows it
+            unsigned int chip;
+            unsigned int channelIndex;  // Index into the channel loop, not the channel number
+        };
+
+        std::vector<Slot> slots;
+        unsigned int numADCs;
+        unsigned int adcNumber[8];      // Board ADC number for the i-th ADC value in the packet
+        unsigned int adcOffset;
+        int digInOffset;                // -1 if not transferred
+        int digOutOffset;               // -1 if not transferred
+        unsigned int packetSize;        // Bytes, including padding
+        SlotDecoder slotDecoder;
+
+        USBPacketLayout();
+
+        void update(const Board& board, const std::vector<ChannelNumber>& channels);
+        void decode(const unsigned char* input, unsigned int numPackets, USBColumns& columns) const;
+    };
     /// \endcond
 }
@@ -0,0 +1,121 @@
+#include "USBReaderThread.h"
+#include "Board.h"
+#include "Constants.h"
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+
+using std::runtime_error;
+using std::chrono::steady_clock;
+
+namespace CLAMP {
+    /** \brief Constructor
+     *
+     *  \param[in] board_            Board to read from
+     *  \param[in] packetSizeBytes_  Size of one USB packet, in bytes.  See USBPacketLayout.
+     *  \param[in] packetsPerBlock_  Maximum number of packets to read in a single USB transfer
+     */
+    USBReaderThread::USBReaderThread(Board& board_, unsigned int packetSizeBytes_, unsigned int packetsPerBlock_) :
+        Thread(),
+        board(board_),
+        packetSizeBytes(packetSizeBytes_),
+        packetsPerBlock(packetsPerBlock_),
+        haveCurrent(false),
+        currentOffset(0),
+        failed(false)
+    {
+        for (unsigned int i = 0; i < NUM_BUFFERS; i++) {
+            buffers[i].reserve(packetSizeBytes * packetsPerBlock, board.hugePageBuffers);
+            empty.push(i);
+        }
+    }
+
+    void USBReaderThread::run() {
+        const unsigned int perPacketSizeWords = packetSizeBytes / 2;
+
+        try {
+            while (keepGoing) {
+                unsigned int buffer;
+                if (!empty.pop(buffer)) {
+                    // The consumer is behind; data accumulates in the FPGA's FIFO until it catches up
+                    keepGoing.waitFor(std::chrono::microseconds(200));
+                    continue;
+                }
+
+                const unsigned int minChunkPackets = std::min(board.transferPolicy.getChunkPackets(), packetsPerBlock);
+                const uint32_t minChunkWords = minChunkPackets * perPacketSizeWords;
+                uint32_t inFIFO = board.numWordsInFifo();
+                while (keepGoing && inFIFO < minChunkWords) {
+                    board.fifoWaitSleep(minChunkWords - inFIFO, perPacketSizeWords, &keepGoing);
+                    inFIFO = board.numWordsInFifo();
+                }
+                if (!keepGoing) {
+                    empty.push(buffer);
+                    break;
+                }
+
+                unsigned int numPackets = std::min(inFIFO / perPacketSizeWords, packetsPerBlock);
+                steady_clock::time_point begin = steady_clock::now();
+                board.readDataPipe(packetSizeBytes * numPackets, buffers[buffer].get());
+                double busySeconds = std::chrono::duration<double>(steady_clock::now() - begin).count();
+                board.updateFIFOStats(perPacketSizeWords);
+                board.transferPolicy.update(numPackets, busySeconds, board.fifoPercentageFull, board.latency);
+
+                Block block = { buffer, numPackets };
+                filled.push(block); // Can't fail: there are only NUM_BUFFERS buffers
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+            failed.store(true, std::memory_order_release);
+        }
+    }
+
+    /** \brief Returns (up to) the next maxPackets packets of data transferred by the reader thread.
+     *
+     *  Waits for data if none is available.  The returned pointer is valid until the next call to next(), or until the
+     *  thread is stopped (Board::stopReaderThread).  Rethrows any error that occurred on the reader thread, and throws if no
+     *  data arrives within 10 s.
+     *
+     *  \param[in]  maxPackets  Maximum number of packets to return
+     *  \param[out] data        Set to point to the first returned packet
+     *  \param[in]  cancel      If given, a stop requested on it ends the wait, and 0 is returned
+     *  \returns Number of packets returned
+     */
+    unsigned int USBReaderThread::next(unsigned int maxPackets, unsigned char*& data, StopToken* cancel) {
+        if (haveCurrent && currentOffset == current.numPackets) {
+            empty.push(current.buffer);
+            haveCurrent = false;
+        }
+
+        if (!haveCurrent) {
+            steady_clock::time_point begin = steady_clock::now();
+            while (!filled.pop(current)) {
+                if (failed.load(std::memory_order_acquire)) {
+                    std::rethrow_exception(error);
+                }
+                if (cancel && cancel->stopRequested()) {
+                    data = nullptr;
+                    return 0;
+                }
+                double elapsed = std::chrono::duration<double>(steady_clock::now() - begin).count();
+                if (elapsed > 10.0) {
+                    throw runtime_error("Not getting a minimum chunk size.");
+                }
+                if (cancel) {
+                    cancel->waitFor(std::chrono::microseconds(200));
+                }
+                else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+            }
+            haveCurrent = true;
+            currentOffset = 0;
+        }
+
+        unsigned int numPackets = std::min(maxPackets, current.numPackets - currentOffset);
+        data = buffers[current.buffer].get() + currentOffset * packetSizeBytes;
+        currentOffset += numPackets;
+        return numPackets;
+    }
+}
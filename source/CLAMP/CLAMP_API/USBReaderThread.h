@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Thread.h"
+#include "SPSCQueue.h"
+#include "AlignedBuffer.h"
+#include <vector>
+#include <memory>
+#include <exception>
+#include <atomic>
+
+namespace CLAMP {
+    class Board;
+
+    /** \brief Background thread that transfers data from the FPGA's FIFO over USB.
+     *
+     *  Normally Board::read does the USB transfer, then parses the data, then returns so the caller can process it -
+     *  all on one thread, so no data is transferred while the caller is busy.  When this thread is running (see
+     *  Board::startReaderThread), it owns the USB data pipe: it reads blocks of whole packets into a fixed pool of page-aligned buffers
+     *  and hands filled buffers to Board::read through a lock-free queue, so the USB transfer overlaps with parsing and with
+     *  whatever the caller does with the data.
+     *
+     *  The packet layout must not change while this thread is running; stop it (Board::stopReaderThread) before
+     *  calling Board::enableChannels, Board::setDataTransfer, etc.
+     */
+    class USBReaderThread : public Thread {
+    public:
+        USBReaderThread(Board& board_, unsigned int packetSizeBytes_, unsigned int packetsPerBlock_);
+
+        void run() override;
+
+        unsigned int next(unsigned int maxPackets, unsigned char*& data, StopToken* cancel = nullptr);
+
+    private:
+        static const unsigned int NUM_BUFFERS = 4;
+
+        /// \cond private
+        struct Block {
+            unsigned int buffer;
+            unsigned int numPackets;
+        };
+        /// \endcond
+
+        Board& board;
+        unsigned int packetSizeBytes;
+        unsigned int packetsPerBlock;
+        AlignedBuffer buffers[NUM_BUFFERS];
+
+        SPSCQueue<Block, NUM_BUFFERS> filled; // Reader thread -> consumer
+        SPSCQueue<unsigned int, NUM_BUFFERS> empty; // Consumer -> reader thread
+
+        // Block currently being consumed by next()
+        bool haveCurrent;
+        Block current;
+        unsigned int currentOffset;
+
+        // Set by the reader thread if the transfer fails; rethrown by next().  error is written before failed is set
+        // (release), so next() sees it once it sees failed (acquire).
+        std::exception_ptr error;
+        std::atomic<bool> failed;
+    };
+}
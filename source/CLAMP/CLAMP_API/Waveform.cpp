@@ -5,6 +5,8 @@
 #include "Channel.h"
 #include "Registers.h"
 #include <stdexcept>
+#include <algorithm>
+#include <iterator>
 #include "ChipProtocol.h"
 #include "WaveformCommand.h"
 
@@ -23,78 +25,208 @@ namespace CLAMP {
         }
 
         //----------------------------------------------------------------------------------------
+        WaveformRAM::WaveformRAM(Board& clampBoard) :
+            m_clampBoard(clampBoard),
+            ram(1 << 15),
+            batchDepth(0),
+            wordsInUse(0)
+        {
+            // The last address has never been handed out
+            release(0, static_cast<unsigned int>(ram.size() - 1));
+            wordsInUse = 0;
+        }
+
+        // FNV-1a hash of a run of commands
+        uint64_t WaveformRAM::hash(const vector<uint32_t>& data) {
+            uint64_t h = 14695981039346656037ULL;
+            for (uint32_t word : data) {
+                for (unsigned int byte = 0; byte < 4; byte++) {
+                    h ^= (word >> (8 * byte)) & 0xFF;
+                    h *= 1099511628211ULL;
+                }
+            }
+            return h;
+        }
+
+        // Takes length cells from the smallest free interval that has room (best fit); returns the start address
+        unsigned int WaveformRAM::allocate(unsigned int length) {
+            auto bySize = freeBySize.lower_bound(length);
+            if (bySize == freeBySize.end()) {
+                throw runtime_error("Out of Waveform RAM");
+            }
+            unsigned int start = bySize->second;
+            unsigned int freeLength = bySize->first;
+            removeFree(freeByStart.find(start));
+            wordsInUse += length;
+            if (freeLength > length) {
+                freeByStart[start + length] = freeLength - length;
+                freeBySize.insert(std::make_pair(freeLength - length, start + length));
+            }
+            return start;
+        }
+
+        void WaveformRAM::removeFree(std::map<unsigned int, unsigned int>::iterator it) {
+            auto range = freeBySize.equal_range(it->second);
+            for (auto bySize = range.first; bySize != range.second; ++bySize) {
+                if (bySize->second == it->first) {
+                    freeBySize.erase(bySize);
+                    break;
+                }
+            }
+            freeByStart.erase(it);
+        }
+
+        // Returns an interval to the free list, merging it with free neighbors
+        void WaveformRAM::release(unsigned int start, unsigned int length) {
+            wordsInUse -= length;
+            auto next = freeByStart.lower_bound(start);
+            if (next != freeByStart.end() && next->first == start + length) {
+                length += next->second;
+                removeFree(next);
+            }
+            auto next2 = freeByStart.lower_bound(start);
+            if (next2 != freeByStart.begin()) {
+                auto previous = std::prev(next2);
+                if (previous->first + previous->second == start) {
+                    start = previous->first;
+                    length += previous->second;
+                    removeFree(previous);
+                }
+            }
+            freeByStart[start] = length;
+            freeBySize.insert(std::make_pair(length, start));
+        }
+
         shared_ptr<WaveformExtent> WaveformRAM::write(const vector<uint32_t>& data) {
             if (data.empty()) {
                 throw runtime_error("Error - you shouldn't call this without any data");
             }
+            unsigned int length = static_cast<unsigned int>(data.size());
+            uint64_t h = hash(data);
 
-            // Note: this isn't the world's fastest comparison algorithm.  But the faster ones are much more complicated.
-            unsigned int rampos = 0;
-            bool good = false;
-            while (!good && (rampos + data.size() < ram.size())) {
-                bool conflict = false;
-                for (unsigned int i = 0; !conflict && i < data.size(); i++) {
-                    conflict = (ram[rampos + i].numRefs != 0) &&
-                        (ram[rampos + i].content != data[i]);
+            // Share an identical run, if there is one
+            auto range = byHash.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it) {
+                unsigned int start = it->second;
+                Run& run = runs[start];
+                if (run.length == length && std::equal(data.begin(), data.end(), ram.begin() + start)) {
+                    run.numRefs++;
+                    return shared_ptr<WaveformExtent>(new WaveformExtent(*this, start, start + length - 1));
                 }
-                if (conflict) {
-                    rampos++;
+            }
+
+            unsigned int start = allocate(length);
+            std::copy(data.begin(), data.end(), ram.begin() + start);
+            Run run = { length, h, 1 };
+            runs[start] = run;
+            byHash.insert(std::make_pair(h, start));
+            dirty.push_back(std::make_pair(start, length));
+
+            // Made first, so the run is released if the upload throws
+            shared_ptr<WaveformExtent> extent(new WaveformExtent(*this, start, start + length - 1));
+            if (batchDepth == 0) {
+                toFPGA();
+            }
+            return extent;
+        }
+
+        // Uploads what the batch staged, unless it's nested in another batch, which uploads it all when it commits
+        void WaveformRAM::Batch::commit() {
+            if (ram.batchDepth == 1) {
+                ram.toFPGA();
+            }
+        }
+
+        // Uploads the dirty runs, merging ones that touch or are separated by small gaps into a single transfer
+        void WaveformRAM::toFPGA() {
+            if (dirty.empty()) {
+                return;
+            }
+            std::sort(dirty.begin(), dirty.end());
+
+            unsigned int start = dirty.front().first;
+            unsigned int end = start + dirty.front().second; // One past the end
+            for (std::size_t i = 1; i <= dirty.size(); i++) {
+                if (i < dirty.size() && dirty[i].first <= end + MAX_BRIDGED_GAP) {
+                    end = std::max(end, dirty[i].first + dirty[i].second);
+                    continue;
                 }
-                else {
-                    good = true;
+
+                // Cells in a bridged gap are either in use (and already on the board) or free, so rewriting them is harmless
+                vector<uint32_t> tmp(ram.begin() + start, ram.begin() + end);
+                WaveformRAMAddress addr(start);
+                m_clampBoard.writeRAM(addr, tmp);
+
+                if (i < dirty.size()) {
+                    start = dirty[i].first;
+                    end = start + dirty[i].second;
                 }
             }
+            dirty.clear();
+        }
 
-            if (!good) {
-                throw runtime_error("Out of Waveform RAM");
+        /* Replaces the contents of extent with data (which must be the same length), uploading only the words that
+         * changed.  Since the addresses stay the same, a running waveform picks up the change the next time it plays
+         * those words.
+         *
+         * Only possible if no one else shares the run; returns false (and changes nothing) otherwise.
+         */
+        bool WaveformRAM::rewrite(const WaveformExtent& extent, const vector<uint32_t>& data) {
+            auto it = runs.find(extent.start);
+            if (it == runs.end() || it->second.length != data.size() || it->second.numRefs != 1) {
+                return false;
             }
+            unsigned int start = it->first;
+            Run& run = it->second;
 
-            for (unsigned int i = 0; i < data.size(); i++) {
-                bool same = (ram[rampos + i].content == data[i]);
-                ram[rampos + i].content = data[i];
-                ram[rampos + i].dirty = (ram[rampos + i].numRefs == 0) || !same;
-                ram[rampos + i].numRefs++;
+            for (unsigned int i = 0; i < data.size();) {
+                if (ram[start + i] == data[i]) {
+                    i++;
+                    continue;
+                }
+                unsigned int changedStart = i;
+                for (; i < data.size() && ram[start + i] != data[i]; i++) {
+                    ram[start + i] = data[i];
+                }
+                dirty.push_back(std::make_pair(start + changedStart, i - changedStart));
             }
 
-            toFPGA();
+            uint64_t h = hash(data);
+            if (h != run.hash) {
+                removeFromHashIndex(start, run.hash);
+                run.hash = h;
+                byHash.insert(std::make_pair(h, start));
+            }
 
-            shared_ptr<WaveformExtent> current(new WaveformExtent(*this, rampos, rampos + data.size() - 1));
-            return current;
+            if (batchDepth == 0) {
+                toFPGA();
+            }
+            return true;
         }
 
-        void WaveformRAM::toFPGA() {
-            const unsigned int RAMSIZE = ram.size();
-            for (unsigned int startPos = 0; startPos < RAMSIZE;) {
-                if (!ram[startPos].dirty) {
-                    startPos++;
-                }
-                else {
-                    unsigned int endPosPlus1;
-                    for (endPosPlus1 = startPos; (endPosPlus1 < RAMSIZE) && (ram[endPosPlus1].dirty); endPosPlus1++) {
-                        ; // Do nothing
-                    }
-
-                    vector<uint32_t> tmp;
-                    for (unsigned int pos = startPos; pos < endPosPlus1; pos++) {
-                        tmp.push_back(ram[pos].content);
-                        ram[pos].dirty = false;
-                    }
-
-                    WaveformRAMAddress addr(startPos);
-                    m_clampBoard.writeRAM(addr, tmp);
-
-                    startPos = endPosPlus1 + 1;
+        void WaveformRAM::removeFromHashIndex(unsigned int start, uint64_t h) {
+            auto range = byHash.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == start) {
+                    byHash.erase(it);
+                    return;
                 }
             }
         }
 
         void WaveformRAM::clear(const WaveformExtent& extent) {
-            for (unsigned int position = extent.start; position <= extent.end; position++) {
-                if (ram[position].numRefs == 0) {
-                    throw runtime_error("Trying to clear to a part of RAM that's already clear.");
-                }
-                ram[position].numRefs--;
+            auto it = runs.find(extent.start);
+            if (it == runs.end() || it->second.length != static_cast<unsigned int>(extent.end - extent.start + 1)) {
+                throw runtime_error("Trying to clear to a part of RAM that's already clear.");
             }
+            Run& run = it->second;
+            if (--run.numRefs > 0) {
+                return;
+            }
+
+            removeFromHashIndex(it->first, run.hash);
+            release(it->first, run.length);
+            runs.erase(it);
         }
         /// \endcond
 
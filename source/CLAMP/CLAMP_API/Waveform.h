@@ -2,6 +2,10 @@
 
 #include <cstdint>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
 #include "Registers.h"
 
 namespace CLAMP {
@@ -14,9 +18,10 @@ namespace CLAMP {
          *
          * If you're using multiple channels and those channels use the same waveforms, there's no need to store multiple
          * copies of the waveform in the global Waveform RAM - the various channels can refer to the same common copy.
-         * To handle this, we have WaveformRAMCell, which is one memory position in Waveform RAM, but also keeps a reference
-         * count of how many channels depend on that data.  Once the count goes to 0, that part of RAM is available, and may
-         * be used by any channel.
+         * To handle this, WaveformRAM keeps track of the runs of commands that have been written, with a reference count of
+         * how many channels depend on each.  Writing a run identical to one that's already there (found by a hash of its
+         * contents) just adds a reference.  Once the count goes to 0, that part of RAM is available, and may be used by
+         * any channel.  Free space is kept as a list of intervals, indexed by size, so that finding space is O(log n).
          *
          * The other piece is the WaveformExtent - on the one hand, it's the object you hand off to a calling class that
          * contains the start and end addresses of the waveform.  On the other hand, it has a role in the reference counting:
@@ -25,14 +30,6 @@ namespace CLAMP {
          * the part of the Waveform RAM that it marked.
          */
 
-        struct WaveformRAMCell {
-            uint32_t content;
-            uint8_t  numRefs;
-            bool     dirty;
-
-            WaveformRAMCell() : content(0), numRefs(0), dirty(false) {}
-        };
-
         class WaveformRAM;
         class WaveformExtent {
         public:
@@ -48,16 +45,56 @@ namespace CLAMP {
 
         class WaveformRAM {
         public:
-            WaveformRAM(Board& clampBoard) : m_clampBoard(clampBoard), ram(1 << 15) {}
+            WaveformRAM(Board& clampBoard);
 
             std::shared_ptr<WaveformExtent> write(const std::vector<uint32_t>& data);
             // std::shared_ptr<WaveformExtent> writeDigitalOutputs(const std::vector<uint16_t>& data, uint16_t commandStart, uint16_t& offset);
             void clear(const WaveformExtent& command);
+            bool rewrite(const WaveformExtent& extent, const std::vector<uint32_t>& data);
             void toFPGA();
+            unsigned int getWordsInUse() const { return wordsInUse; }
+            unsigned int getSize() const { return static_cast<unsigned int>(ram.size()); }
+
+            /* While one of these exists, writes are only staged; commit() on the outermost one uploads everything written
+             * in the meantime in one pass.  Use around a loop that writes several channels' commands.  If the batch goes
+             * away without being committed (e.g., a write threw), the staged runs go with the next upload.
+             */
+            class Batch {
+            public:
+                explicit Batch(WaveformRAM& ram_) : ram(ram_) { ram.batchDepth++; }
+                ~Batch() { ram.batchDepth--; }
+                void commit();
+            private:
+                WaveformRAM& ram;
+                Batch(const Batch&);
+                Batch& operator=(const Batch&);
+            };
+
+            // Clean gaps up to this many words between dirty runs are uploaded too, to save a transfer
+            static const unsigned int MAX_BRIDGED_GAP = 64;
 
         private:
+            struct Run {
+                unsigned int length;
+                uint64_t hash;
+                unsigned int numRefs;
+            };
+
             Board& m_clampBoard;
-            std::vector<WaveformRAMCell> ram;
+            std::vector<uint32_t> ram;
+            std::map<unsigned int, Run> runs;                      // Runs in use, by start address
+            std::unordered_multimap<uint64_t, unsigned int> byHash; // Start addresses of runs in use, by hash of contents
+            std::map<unsigned int, unsigned int> freeByStart;       // Free intervals: start -> length
+            std::multimap<unsigned int, unsigned int> freeBySize;   // Free intervals: length -> start
+            std::vector<std::pair<unsigned int, unsigned int>> dirty; // (start, length) of runs not yet sent to the board
+            unsigned int batchDepth;
+            std::atomic<unsigned int> wordsInUse; // Allocated words, shared runs counted once; read by any thread
+
+            static uint64_t hash(const std::vector<uint32_t>& data);
+            void removeFromHashIndex(unsigned int start, uint64_t h);
+            unsigned int allocate(unsigned int length);
+            void release(unsigned int start, unsigned int length);
+            void removeFree(std::map<unsigned int, unsigned int>::iterator it);
         };
         /// \endcond
 
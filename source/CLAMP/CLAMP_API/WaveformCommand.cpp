@@ -22,17 +22,7 @@ namespace CLAMP {
          * \returns The filled-in NonrepeatingCommand.
          */
         NonrepeatingCommand NonrepeatingCommand::create(ChipProtocol::Commands C_, MuxSelection M_, uint8_t A_, uint16_t D_) {
-            NonrepeatingCommand result;
-            result.A = CheckBits(A_, 8);
-            result.M = CheckBits(static_cast<uint8_t>(M_), 6);
-            result.C = CheckBits(static_cast<uint8_t>(C_), 2);
-            result.D = CheckBits(D_, 9);
-			result.digOut = false;
-			result.markerOut = false;
-            result.unused = CheckBits(0, 4);
-            result.repeating = false;
-
-            return result;
+            return WaveformCommand(encodeNonrepeating(C_, M_, A_, D_)).nonrepeating;
         }
 
         //----------------------------------------------------------------------------------------
@@ -48,17 +38,7 @@ namespace CLAMP {
          * \returns The filled-in RepeatingCommand.
          */
         RepeatingCommand RepeatingCommand::create(WriteType write, ReadType read, ValueSourceType valueSource, bool longTimescale, bool markerOut, bool digOut, uint16_t L, uint16_t T) {
-            RepeatingCommand result;
-            result.T = CheckBits(T, 16);
-            result.L = CheckBits(L, 9);
-			result.digOut = digOut;
-			result.markerOut = markerOut;
-            result.longTimescale = longTimescale;
-            result.valueSource = valueSource;
-            result.muxToRead = read;
-            result.registerToWrite = write;
-            result.repeating = true;
-            return result;
+            return WaveformCommand(encodeRepeating(write, read, valueSource, longTimescale, markerOut, digOut, L, T)).repeating;
         }
 
         /** \brief Number of time steps that this command will take to execute.
@@ -70,23 +50,13 @@ namespace CLAMP {
          * \returns The number of time steps.
          */
         uint32_t RepeatingCommand::numRepetitions() const {
-            uint32_t result;
-            result = longTimescale ? (T << 16) : T;
-            if (result == 0) {
-                result = 1;
-            }
-            return result;
+            return repetitionsOf(*this);
         }
 
         /** \copydoc RepeatingCommand::numRepetitions
          */
         uint32_t WaveformCommand::numRepetitions() const {
-            if (repeating.repeating) {
-                return repeating.numRepetitions();
-            }
-            else {
-                return 1;
-            }
+            return repetitionsOf(*this);
         }
 
         /** \brief Number of time steps that a command list will take to execute.
@@ -99,7 +69,7 @@ namespace CLAMP {
 
             for (const WaveformCommand& command : commands)
             {
-                index += command.numRepetitions();
+                index += repetitionsOf(command);
             }
 
             return index;
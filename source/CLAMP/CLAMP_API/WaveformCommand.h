@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <vector>
 #include <memory>
+#include <stdexcept>
 #include "ChipProtocol.h"
 
 namespace CLAMP {
@@ -176,6 +177,66 @@ namespace CLAMP {
 
         uint32_t numRepetitions(std::vector<WaveformCommand>& commands);
 
+        /** \name Compile-time command encoding
+         *
+         *  The same words NonrepeatingCommand::create and RepeatingCommand::create produce, built with shifts rather than
+         *  bit fields, so they can be used in constant expressions and cost a few instructions when they can't.  Values
+         *  that don't fit their fields throw std::invalid_argument, like CheckBits.
+         */
+        //@{
+        /// \cond private
+        // value, if it fits in numBits
+        constexpr uint32_t checkedField(uint32_t value, unsigned int numBits) {
+            return (value >> numBits) == 0 ? value : throw std::invalid_argument("Invalid value with too many bits set.");
+        }
+        /// \endcond
+
+        /// Word of a NonrepeatingCommand; see NonrepeatingCommand::create
+        constexpr uint32_t encodeNonrepeating(ChipProtocol::Commands C, ChipProtocol::MuxSelection M, uint32_t A, uint32_t D, bool markerOut = false, bool digOut = false) {
+            return checkedField(A, 8) |
+                (checkedField(static_cast<uint32_t>(M), 6) << 8) |
+                (checkedField(static_cast<uint32_t>(C), 2) << 14) |
+                (checkedField(D, 9) << 16) |
+                (static_cast<uint32_t>(digOut) << 25) |
+                (static_cast<uint32_t>(markerOut) << 26);
+        }
+
+        /// Word of a RepeatingCommand; see RepeatingCommand::create
+        constexpr uint32_t encodeRepeating(RepeatingCommand::WriteType write, RepeatingCommand::ReadType read, RepeatingCommand::ValueSourceType valueSource,
+                                           bool longTimescale, bool markerOut, bool digOut, uint32_t L, uint32_t T) {
+            return checkedField(T, 16) |
+                (checkedField(L, 9) << 16) |
+                (static_cast<uint32_t>(digOut) << 25) |
+                (static_cast<uint32_t>(markerOut) << 26) |
+                (static_cast<uint32_t>(longTimescale) << 27) |
+                (static_cast<uint32_t>(valueSource) << 28) |
+                (static_cast<uint32_t>(read) << 29) |
+                (static_cast<uint32_t>(write) << 30) |
+                (1u << 31);
+        }
+
+        /// L of a repeating write to the Clamp Voltage DAC (Register N,0): value is signed steps, -255...255
+        constexpr uint32_t encodeClampVoltage(int value) {
+            return checkedField(static_cast<uint32_t>(value < 0 ? -value : value), 8) | (value >= 0 ? 1u << 8 : 0u);
+        }
+
+        /// L of a repeating write to the Clamp Current Source (Register N,9): value is signed steps, -127...127
+        constexpr uint32_t encodeClampCurrent(int value) {
+            return checkedField(static_cast<uint32_t>(value < 0 ? -value : value), 7) | (value >= 0 ? 1u << 7 : 0u);
+        }
+
+        /// Timesteps a command word takes to execute; see WaveformCommand::numRepetitions
+        constexpr uint32_t repetitionsOf(uint32_t word) {
+            return (word >> 31) == 0 ? 1u :
+                (word & (1u << 27)) != 0 ? ((word & 0xFFFF) == 0 ? 1u : (word & 0xFFFF) << 16) :
+                ((word & 0xFFFF) == 0 ? 1u : (word & 0xFFFF));
+        }
+        //@}
+
+        static_assert(encodeNonrepeating(ChipProtocol::READ, ChipProtocol::None, 0xFF, 0) == 0x000000FF, "Nonrepeating command encoding");
+        static_assert(repetitionsOf(encodeRepeating(RepeatingCommand::WRITE_CURRENT, RepeatingCommand::READ_VOLTAGE, RepeatingCommand::LITERAL, true, false, false, encodeClampCurrent(-1), 2)) == 0x20000,
+                      "Repeating command encoding");
+
         /** \brief Augmented version of WaveformCommand.
         *
         *  For interpreting the results of a waveform command, it's frequently useful to have the commands that execute
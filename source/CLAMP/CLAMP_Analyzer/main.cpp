@@ -0,0 +1,252 @@
+// Offline analysis of save files: reruns the data display's analysis (steady states and peaks, exponential fits,
+// resistance, and cell parameters; see CLAMP::IO::BatchAnalyzer) over every sweep of a day's recordings, and writes the
+// results as tables for a spreadsheet or analysis script.  Needs only the CLAMP_API library.
+//
+// Usage: ClampAnalyze --output dir [--threads n] [--serial-fits] file-or-directory...
+//
+// Directories are searched recursively for .clp files.  Two CSV files are written to --output, overwriting any that are
+// there: segments.csv, with a row per segment of every sweep, and sweeps.csv, with a row per sweep.  Each row starts
+// with the file's path as it was found, and missing values (e.g., the fit of a segment without a step) are left empty.
+// Files and sweeps are analyzed in parallel; --threads sets the number of worker threads (default: one fewer than the
+// number of cores).  The exponential fits are batched across sweeps (see CLAMP::SignalProcessing::BatchExponentialFit);
+// --serial-fits fits them one at a time instead, as the reference to check the batched results against.  Each file is
+// reported as it finishes, then the total throughput.  Aux files are skipped.  The exit code is 1 if any file failed.
+
+#include "BatchAnalyzer.h"
+#include "ThreadPool.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <direct.h>
+#else
+    #include <dirent.h>
+    #include <sys/stat.h>
+    #include <cerrno>
+#endif
+
+using namespace CLAMP;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::runtime_error;
+
+struct Options {
+    string output;
+    unsigned int threads; // 0 for the default
+    bool serialFits;
+    vector<string> inputs;
+
+    Options() : threads(0), serialFits(false) {}
+};
+
+static void usage() {
+    std::cerr << "Usage: ClampAnalyze --output dir [--threads n] [--serial-fits] file-or-directory...\n";
+}
+
+static bool parseArguments(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = static_cast<unsigned int>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--serial-fits") {
+            options.serialFits = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+        else {
+            options.inputs.push_back(arg);
+        }
+    }
+    return !options.output.empty() && !options.inputs.empty();
+}
+
+static bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool isDirectory(const string& path) {
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// Appends the .clp files under directory to files
+static void findSaveFiles(const string& directory, vector<string>& files) {
+    vector<string> names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((directory + "/*").c_str(), &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        throw runtime_error("Can't read directory " + directory);
+    }
+    do {
+        names.push_back(entry.cFileName);
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        throw runtime_error("Can't read directory " + directory);
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
+    std::sort(names.begin(), names.end());
+
+    for (const string& name : names) {
+        if (name == "." || name == "..") {
+            continue;
+        }
+        string child = directory + "/" + name;
+        if (isDirectory(child)) {
+            findSaveFiles(child, files);
+        }
+        else if (endsWith(name, ".clp")) {
+            files.push_back(child);
+        }
+    }
+}
+
+// Creates path and the directories leading up to it
+static void createDirectories(const string& path) {
+    for (std::size_t slash = path.find_first_of("/\\", 1); ; slash = path.find_first_of("/\\", slash + 1)) {
+        string parent = path.substr(0, slash);
+        if (!isDirectory(parent)) {
+#if defined(_WIN32)
+            if (_mkdir(parent.c_str()) != 0 && errno != EEXIST) {
+#else
+            if (mkdir(parent.c_str(), 0777) != 0 && errno != EEXIST) {
+#endif
+                throw runtime_error("Can't create directory " + parent);
+            }
+        }
+        if (slash == string::npos) {
+            break;
+        }
+    }
+}
+
+static string displayName(const FILENAME& path) {
+#if defined(_WIN32) && defined(_UNICODE)
+    return toString(path);
+#else
+    return path;
+#endif
+}
+
+template <typename Table>
+static void writeTable(const Table& table, const string& path, const vector<string>& fileNames) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw runtime_error("Can't write " + path);
+    }
+    table.writeCSV(out, fileNames);
+    if (!out) {
+        throw runtime_error("Can't write " + path);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    try {
+        vector<string> files;
+        for (const string& input : options.inputs) {
+            if (isDirectory(input)) {
+                findSaveFiles(input, files);
+            }
+            else {
+                files.push_back(input);
+            }
+        }
+        if (files.empty()) {
+            std::cerr << "No .clp files found\n";
+            return 1;
+        }
+        vector<FILENAME> sources;
+        for (const string& file : files) {
+            sources.push_back(toFileName(file));
+        }
+        createDirectories(options.output);
+
+        unique_ptr<ThreadPool> ownPool;
+        if (options.threads > 0) {
+            ownPool.reset(new ThreadPool(options.threads));
+        }
+        ThreadPool& pool = ownPool ? *ownPool : ThreadPool::instance();
+        std::cout << "Analyzing " << sources.size() << " file(s) on " << pool.numThreads() << " worker threads\n";
+
+        BatchAnalyzer analyzer(pool);
+        if (options.serialFits) {
+            analyzer.setFitMode(SignalProcessing::BatchExponentialFit::SERIAL);
+        }
+        SegmentTable segments;
+        SweepTable sweeps;
+        auto start = std::chrono::steady_clock::now();
+        vector<AnalysisResult> results = analyzer.analyzeFiles(sources, segments, sweeps, [](const AnalysisResult& result) {
+            std::cout << displayName(result.source) << ": ";
+            if (!result.error.empty()) {
+                std::cout << "FAILED: " << result.error << "\n";
+            }
+            else if (result.skipped) {
+                std::cout << "skipped (aux file)\n";
+            }
+            else {
+                std::cout << result.sweeps << " sweeps, " << result.records << " records in " << std::fixed << std::setprecision(2) << result.seconds << " s\n";
+            }
+            std::cout.flush();
+        });
+        double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+        writeTable(segments, options.output + "/segments.csv", files);
+        writeTable(sweeps, options.output + "/sweeps.csv", files);
+
+        uint64_t records = 0;
+        unsigned int failed = 0;
+        for (const AnalysisResult& result : results) {
+            if (!result.error.empty()) {
+                failed++;
+            }
+            records += result.records;
+        }
+        std::cout << std::fixed << std::setprecision(2)
+                  << sweeps.size() << " sweeps, " << segments.size() << " segments from " << (results.size() - failed) << " file(s) in " << seconds << " s ("
+                  << std::setprecision(1) << sweeps.size() / seconds << " sweeps/s, " << records / seconds / 1e6 << " M records/s), " << failed << " failed\n";
+        return (failed == 0) ? 0 : 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
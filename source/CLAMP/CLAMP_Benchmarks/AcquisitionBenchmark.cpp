@@ -0,0 +1,467 @@
+// End-to-end acquisition benchmark, for sizing workstations.
+//
+// Drives the board the way ClampThread does (once, batch, continuous, and semicontinuous runs), with every headstage
+// the simulated board has running, its data low-pass filtered and saved, and raises the simulated board's speed until
+// the software can't keep up.  "Keeping up" means no samples were dropped (see Board::getTimestampGaps), the FIFO
+// stayed below FIFO_LIMIT, and the data was processed at (nearly) the rate it was produced.  The last matters for
+// once and batch runs, where a whole cycle may fit in the FIFO.
+//
+// Usage: ClampBenchmarks --acquisition [once|batch|continuous|semicontinuous|all] [--seconds s] [--async] [--no-save]
+
+#include "AcquisitionBenchmark.h"
+#include "Board.h"
+#include "SimulatedBoard.h"
+#include "BesselFilter.h"
+#include "SimplifiedWaveform.h"
+#include "SaveFile.h"
+#include "streams.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::SignalProcessing;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::map;
+using std::unique_ptr;
+
+// A run fails if the FIFO gets this full, even if nothing was dropped yet
+static const double FIFO_LIMIT = 90.0;
+// A run fails if it processes data at less than this fraction of the speed it's produced at
+static const double MIN_THROUGHPUT = 0.9;
+// Highest speed tried, as a multiple of real time
+static const double MAX_SPEED = 64.0;
+// Number of bisection steps between the last speed that kept up and the first that didn't
+static const unsigned int BISECTION_STEPS = 3;
+
+enum RunMode {
+    ONCE,
+    BATCH,
+    CONTINUOUS,
+    SEMICONTINUOUS
+};
+
+static const char* modeName(RunMode mode) {
+    switch (mode) {
+    case ONCE: return "once";
+    case BATCH: return "batch";
+    case CONTINUOUS: return "continuous";
+    default: return "semicontinuous";
+    }
+}
+
+struct Options {
+    double seconds;
+    bool save;
+    bool async;
+
+    Options() : seconds(2.0), save(true), async(false) {}
+};
+
+//------------------------------------------------------------------------------
+// Process resources
+
+static double processCpuSeconds() {
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    auto seconds = [](const FILETIME& t) { return ((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 1e-7; };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+// Peak resident memory of the process so far, in MB
+static double peakMemoryMB() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1e6;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1e6; // Bytes
+#else
+    return usage.ru_maxrss / 1e3; // KB
+#endif
+#endif
+}
+
+// CPU time used by each thread so far, in seconds, keyed by "name (id)"; only available on Linux
+static map<string, double> threadCpuSeconds() {
+    map<string, double> result;
+#if defined(__linux__)
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+        return result;
+    }
+    double ticks = static_cast<double>(sysconf(_SC_CLK_TCK));
+    while (dirent* entry = readdir(dir)) {
+        string tid = entry->d_name;
+        if (tid == "." || tid == "..") {
+            continue;
+        }
+        string name;
+        std::ifstream comm("/proc/self/task/" + tid + "/comm");
+        std::getline(comm, name);
+
+        std::ifstream statFile("/proc/self/task/" + tid + "/stat");
+        string stat;
+        std::getline(statFile, stat);
+        // Fields after the (parenthesized, possibly space-containing) name; utime and stime are fields 14 and 15
+        std::size_t close = stat.rfind(')');
+        if (close == string::npos) {
+            continue;
+        }
+        std::istringstream fields(stat.substr(close + 2));
+        string field;
+        double utime = 0, stime = 0;
+        for (int i = 3; i <= 15 && (fields >> field); i++) {
+            if (i == 14) {
+                utime = std::stod(field);
+            }
+            else if (i == 15) {
+                stime = std::stod(field);
+            }
+        }
+        result[name + " (" + tid + ")"] = (utime + stime) / ticks;
+    }
+    closedir(dir);
+#endif
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// The acquisition itself
+
+struct TrialResult {
+    bool keptUp;
+    double wallSeconds;
+    uint64_t timesteps;
+    double throughput;               // Multiple of real time the data was processed at
+    double cpuCores;                 // Process CPU time / wall time
+    map<string, double> threadCores; // Per-thread CPU time / wall time
+    double fifoHighWater;            // %
+    TimestampGaps gaps;
+};
+
+class Acquisition {
+public:
+    Acquisition(const Options& options_) :
+        options(options_)
+    {
+        simulated = new SimulatedBoard();
+        unique_ptr<OpalKellyBoard> backend(simulated);
+        board.reset(new Board(std::move(backend)));
+        simulated->attach(*board, unique_ptr<PacketSource>(new ModelCellSource(*board)));
+        if (!board->open()) {
+            throw std::runtime_error("Couldn't open the simulated board");
+        }
+        for (auto& index : board->getPresentChannels()) {
+            if (index.channel == 0) {
+                headstages.push_back(index);
+            }
+        }
+        if (headstages.empty()) {
+            throw std::runtime_error("No headstages found");
+        }
+        amplitude = 4;
+        createWaveform();
+    }
+
+    unsigned int numHeadstages() const { return static_cast<unsigned int>(headstages.size()); }
+    double samplingRateHz() const { return board->getSamplingRateHz(); }
+    double cycleSeconds() const { return board->getNumTimesteps(headstages.front().chip) / samplingRateHz(); }
+
+    TrialResult run(RunMode mode, double speed);
+
+private:
+    Options options;
+    SimulatedBoard* simulated;
+    unique_ptr<Board> board;
+    ChipChannelList headstages; // Channel 0 of each chip
+    int amplitude;              // Step size of the waveform, in voltage clamp steps
+
+    vector<unique_ptr<SaveFile>> saveFiles;
+    vector<unique_ptr<NthOrderBesselLowPassFilter>> filters;
+    vector<Sample> filtered;
+
+    void createWaveform();
+    void openFiles();
+    void closeFiles();
+    void processRead();
+    void readCycle(bool first, const std::chrono::steady_clock::time_point& end);
+    void finishLastCycle();
+};
+
+// A family of voltage steps, like a typical I-V protocol, on every headstage
+void Acquisition::createWaveform() {
+    board->enableChannels(headstages, true);
+    for (auto& index : headstages) {
+        SimplifiedWaveform waveform;
+        for (int step = 1; step <= 5; step++) {
+            waveform.push_back(WaveformSegment(0, 0, 1000, 0, false, false));
+            waveform.push_back(WaveformSegment(step, step * amplitude, 2000, 0, true, false));
+        }
+        waveform.setStepSize(2.5e-3, 0);
+        board->controller.simplifiedWaveformToWaveform({ index }, true, waveform);
+    }
+    board->commandsToFPGA();
+}
+
+void Acquisition::openFiles() {
+    filters.clear();
+    saveFiles.clear();
+    for (auto& index : headstages) {
+        filters.emplace_back(new NthOrderBesselLowPassFilter(4, 5000, 1.0 / board->getSamplingRateHz()));
+        if (options.save) {
+            unique_ptr<SaveFile> saveFile(new SaveFile(SaveFile::COMPACT_RECORDS));
+            saveFile->open(toFileName("acquisition_benchmark_" + std::to_string(index.chip) + ".clp"), options.async);
+            HeaderData header(*board, index);
+            saveFile->writeHeader(header);
+            saveFiles.push_back(std::move(saveFile));
+        }
+    }
+}
+
+void Acquisition::closeFiles() {
+    for (auto& saveFile : saveFiles) {
+        saveFile->close();
+    }
+    saveFiles.clear(); // close() waits for any background writes
+    for (auto& index : headstages) {
+        std::remove(("acquisition_benchmark_" + std::to_string(index.chip) + ".clp").c_str());
+    }
+}
+
+// What ClampThread and the DataStores do with each read: filter each headstage's data, and save it
+void Acquisition::processRead() {
+    const vector<uint32_t>& timestamps = board->readQueue.getTimeStamps();
+    for (unsigned int i = 0; i < headstages.size(); i++) {
+        const vector<Sample>& measured = board->readQueue.getMeasuredCurrents(headstages[i]);
+        filtered.resize(measured.size());
+        filters[i]->process(measured.data(), filtered.data(), measured.size());
+        if (options.save) {
+            saveFiles[i]->writeData(timestamps, measured, board->readQueue.getClampVoltages(headstages[i]));
+        }
+    }
+    board->readQueue.clear(false);
+}
+
+// Like ClampThread::readAvailable, a sweep at a time; stops early if end passes, so a stalled run can't go on forever
+void Acquisition::readCycle(bool first, const std::chrono::steady_clock::time_point& end) {
+    unsigned int packetsToRead = board->getNumTimesteps(headstages.front().chip);
+    if (first) {
+        packetsToRead++;
+    }
+    while (packetsToRead > 0 && std::chrono::steady_clock::now() < end + std::chrono::seconds(10)) {
+        packetsToRead -= board->read(packetsToRead);
+        processRead();
+    }
+}
+
+void Acquisition::finishLastCycle() {
+    board->stopReaderThread();
+    board->stop();
+    board->flush();
+    board->readQueue.clear(true);
+}
+
+TrialResult Acquisition::run(RunMode mode, double speed) {
+    using std::chrono::steady_clock;
+
+    simulated->setSpeed(speed);
+    openFiles();
+    board->resetTimestampGaps();
+    board->fifoMonitor.startRun();
+
+    double cpuStart = processCpuSeconds();
+    map<string, double> threadsStart = threadCpuSeconds();
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point end = start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(options.seconds));
+    uint64_t timesteps = 0;
+    unsigned int cycleLength = board->getNumTimesteps(headstages.front().chip);
+    map<string, double> threadsEnd;
+
+    switch (mode) {
+    case ONCE:
+        board->runOneCycle(headstages.front().chip, 1);
+        readCycle(true, end);
+        timesteps += cycleLength;
+        threadsEnd = threadCpuSeconds();
+        finishLastCycle();
+        break;
+    case BATCH:
+        while (steady_clock::now() < end) {
+            board->runOneCycle(headstages.front().chip, 1);
+            readCycle(true, end);
+            timesteps += cycleLength;
+            finishLastCycle();
+        }
+        threadsEnd = threadCpuSeconds();
+        break;
+    case CONTINUOUS:
+    case SEMICONTINUOUS: {
+        board->runContinuously();
+        board->startReaderThread();
+        bool first = true;
+        unsigned int cycle = 0;
+        while (steady_clock::now() < end) {
+            // Semicontinuous runs restart whenever the waveform changes; change it every few cycles
+            if (mode == SEMICONTINUOUS && cycle > 0 && cycle % 5 == 0) {
+                finishLastCycle();
+                board->clearSelectedCommands(headstages);
+                amplitude = (amplitude == 4) ? 8 : 4;
+                createWaveform();
+                board->runContinuously();
+                board->startReaderThread();
+                first = true;
+            }
+            readCycle(first, end);
+            first = false;
+            timesteps += cycleLength;
+            cycle++;
+        }
+        threadsEnd = threadCpuSeconds();
+        finishLastCycle();
+        break;
+    }
+    }
+
+    TrialResult result;
+    result.wallSeconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+    closeFiles();
+    result.timesteps = timesteps;
+    result.cpuCores = (processCpuSeconds() - cpuStart) / result.wallSeconds;
+    for (auto& thread : threadsEnd) {
+        double before = threadsStart.count(thread.first) ? threadsStart[thread.first] : 0;
+        result.threadCores[thread.first] = (thread.second - before) / result.wallSeconds;
+    }
+    result.fifoHighWater = board->fifoMonitor.getPeakPercentage();
+    result.gaps = board->getTimestampGaps();
+    result.throughput = timesteps / (result.wallSeconds * board->getSamplingRateHz());
+    result.keptUp = (result.gaps.numGaps == 0) && (result.fifoHighWater < FIFO_LIMIT) && (result.throughput >= MIN_THROUGHPUT * speed);
+    board->clearSelectedCommands(headstages);
+    createWaveform();
+    return result;
+}
+
+//------------------------------------------------------------------------------
+
+static void printTrial(double speed, const TrialResult& result) {
+    std::printf("  %6.2fx: %s, processed at %.2fx, %.2f cores, FIFO high water %.1f%%, %llu samples dropped\n", speed,
+                result.keptUp ? "kept up" : "FELL BEHIND", result.throughput, result.cpuCores, result.fifoHighWater,
+                static_cast<unsigned long long>(result.gaps.samplesMissing));
+}
+
+// Finds the fastest speed that keeps up, and reports the resources used there
+static void benchmarkMode(Acquisition& acquisition, RunMode mode, double samplingRateHz) {
+    std::printf("%s:\n", modeName(mode));
+
+    double good = 0, bad = 0;
+    TrialResult best;
+    for (double speed = 1; speed <= MAX_SPEED; speed *= 2) {
+        TrialResult result = acquisition.run(mode, speed);
+        printTrial(speed, result);
+        if (!result.keptUp) {
+            bad = speed;
+            break;
+        }
+        good = speed;
+        best = result;
+    }
+    if (good == 0) {
+        std::printf("  Can't keep up in real time\n\n");
+        return;
+    }
+    if (bad > 0) {
+        for (unsigned int i = 0; i < BISECTION_STEPS; i++) {
+            double speed = (good + bad) / 2;
+            TrialResult result = acquisition.run(mode, speed);
+            printTrial(speed, result);
+            if (result.keptUp) {
+                good = speed;
+                best = result;
+            }
+            else {
+                bad = speed;
+            }
+        }
+    }
+
+    std::printf("  Max sustainable sampling rate: %.0f Hz per headstage (%.2fx real time%s)\n", good * samplingRateHz, good,
+                (bad == 0) ? ", the highest tried" : "");
+    std::printf("  At that rate: %.2f cores, FIFO high water %.1f%%, peak memory %.0f MB\n", best.cpuCores, best.fifoHighWater, peakMemoryMB());
+    for (auto& thread : best.threadCores) {
+        if (thread.second >= 0.01) {
+            std::printf("    %-30s %5.1f%% of a core\n", thread.first.c_str(), 100 * thread.second);
+        }
+    }
+    std::printf("\n");
+}
+
+int runAcquisitionBenchmark(const vector<string>& args) {
+    Options options;
+    vector<RunMode> modes;
+    for (std::size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--seconds" && i + 1 < args.size()) {
+            options.seconds = std::stod(args[++i]);
+        }
+        else if (args[i] == "--async") {
+            options.async = true;
+        }
+        else if (args[i] == "--no-save") {
+            options.save = false;
+        }
+        else if (args[i] == "once") {
+            modes.push_back(ONCE);
+        }
+        else if (args[i] == "batch") {
+            modes.push_back(BATCH);
+        }
+        else if (args[i] == "continuous") {
+            modes.push_back(CONTINUOUS);
+        }
+        else if (args[i] == "semicontinuous") {
+            modes.push_back(SEMICONTINUOUS);
+        }
+        else if (args[i] != "all") {
+            std::cerr << "Unknown argument " << args[i] << "\n";
+            return 1;
+        }
+    }
+    if (modes.empty()) {
+        modes = { ONCE, BATCH, CONTINUOUS, SEMICONTINUOUS };
+    }
+
+    Acquisition acquisition(options);
+    std::printf("%u headstages, %.2f s cycles, saving %s\n\n", acquisition.numHeadstages(), acquisition.cycleSeconds(),
+                options.save ? (options.async ? "in the background" : "on the acquisition thread") : "off");
+    for (RunMode mode : modes) {
+        benchmarkMode(acquisition, mode, acquisition.samplingRateHz());
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// End-to-end acquisition against the simulated board, in the run modes ClampThread uses; see AcquisitionBenchmark.cpp
+int runAcquisitionBenchmark(const std::vector<std::string>& args);
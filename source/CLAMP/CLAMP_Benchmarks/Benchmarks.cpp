@@ -0,0 +1,279 @@
+// Microbenchmarks for the acquisition hot path, reported as ns per sample.
+//
+// Usage: ClampBenchmarks [filter]
+// Only benchmarks whose names contain filter are run.
+//
+// ClampBenchmarks --acquisition ... runs the end-to-end acquisition benchmark instead; see AcquisitionBenchmark.cpp.
+// ClampBenchmarks --save ... runs the save throughput benchmark instead; see SaveBenchmark.cpp.
+// ClampBenchmarks --replay ... replays a USB capture against a golden decode instead; see ReplayBenchmark.cpp.
+
+#include "Board.h"
+#include "SimulatedBoard.h"
+#include "BesselFilter.h"
+#include "DataAnalysis.h"
+#include "SimplifiedWaveform.h"
+#include "Waveform.h"
+#include "SaveFile.h"
+#include "USBCapture.h"
+#include "streams.h"
+#include "common.h"
+#include "Line.h"
+#include "AcquisitionBenchmark.h"
+#include "SaveBenchmark.h"
+#include "ReplayBenchmark.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::SignalProcessing;
+using namespace CLAMP::WaveformControl;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::function;
+
+// Each benchmark is repeated for at least this long
+static const double MIN_SECONDS = 0.5;
+
+static string filter;
+
+// Runs body, which processes samplesPerCall samples, until MIN_SECONDS have passed, and prints the time per sample
+static void run(const string& name, uint64_t samplesPerCall, const function<void()>& body) {
+    if (name.find(filter) == string::npos) {
+        return;
+    }
+    using std::chrono::steady_clock;
+
+    body(); // Warm up caches and allocations
+    uint64_t calls = 0;
+    double seconds = 0;
+    steady_clock::time_point begin = steady_clock::now();
+    while (seconds < MIN_SECONDS) {
+        body();
+        calls++;
+        seconds = std::chrono::duration<double>(steady_clock::now() - begin).count();
+    }
+    double nsPerSample = 1e9 * seconds / (calls * samplesPerCall);
+    std::printf("%-40s %10.2f ns/sample  (%llu calls of %llu samples)\n", name.c_str(), nsPerSample,
+                static_cast<unsigned long long>(calls), static_cast<unsigned long long>(samplesPerCall));
+}
+
+// A simulated board, opened, with every channel in the channel loop
+struct SimulatedRig {
+    SimulatedBoard* simulated;
+    unique_ptr<Board> board;
+    ChipChannelList channels;
+
+    SimulatedRig() {
+        simulated = new SimulatedBoard();
+        unique_ptr<OpalKellyBoard> backend(simulated);
+        board.reset(new Board(std::move(backend)));
+        simulated->attach(*board, unique_ptr<PacketSource>(new ModelCellSource(*board)));
+        simulated->setSpeed(0);
+        if (!board->open()) {
+            throw std::runtime_error("Couldn't open the simulated board");
+        }
+        channels = board->getPresentChannels();
+        board->enableChannels(channels, true);
+    }
+};
+
+// ReadQueue::parse (USBPacketLayout::decode plus conversion) on packets captured from the simulated board
+static void benchmarkParse(SimulatedRig& rig) {
+    const unsigned int NUM_PACKETS = 20000;
+    const FILENAME captureName = toFileName(string("benchmark_capture.dat"));
+
+    Board& board = *rig.board;
+    board.startUSBCapture(captureName);
+    board.runContinuously();
+    unsigned int packetsRead = 0;
+    while (packetsRead < NUM_PACKETS) {
+        packetsRead += board.read(NUM_PACKETS - packetsRead);
+    }
+    board.stop();
+    board.stopUSBCapture();
+
+    vector<unsigned char> captured;
+    {
+        USBCapture capture(captureName);
+        for (const USBCapture::Read& read : capture.getReads()) {
+            captured.insert(captured.end(), read.data, read.data + read.numBytes);
+        }
+    }
+    std::remove(string(captureName.begin(), captureName.end()).c_str());
+
+    board.readQueue.reserve(NUM_PACKETS);
+    uint64_t samples = static_cast<uint64_t>(NUM_PACKETS) * rig.channels.size();
+    run("ReadQueue::parse", samples, [&]() {
+        board.readQueue.clear(false);
+        board.readQueue.restartTimestamps();
+        board.readQueue.parse(captured.data(), NUM_PACKETS);
+    });
+}
+
+static void benchmarkBessel() {
+    const std::size_t N = 100000;
+    vector<double> in(N), out(N);
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise;
+    for (double& x : in) {
+        x = noise(random);
+    }
+    for (unsigned int order : { 4, 8 }) {
+        NthOrderBesselLowPassFilter bessel(order, 5000, 1.0 / 50000);
+        run("NthOrderBesselLowPassFilter order " + std::to_string(order), N, [&]() { bessel.process(in.data(), out.data(), N); });
+    }
+}
+
+// A noisy charging transient, like a fitted capacitive transient
+static void benchmarkExponentialFit() {
+    const unsigned int N = 2000;
+    vector<double> xs(N), ys(N);
+    std::mt19937 random(2);
+    std::normal_distribution<double> noise(0, 0.01);
+    for (unsigned int i = 0; i < N; i++) {
+        xs[i] = i * 20e-6;
+        ys[i] = 1.0 + 2.0 * std::exp(-xs[i] / 2e-3) + noise(random);
+    }
+    run("ExponentialFit::lm", N, [&]() {
+        double beta[3] = { 0.5, 1.0, 1e-3 };
+        double chi2;
+        ExponentialFit::lm(xs, ys, beta, chi2);
+    });
+}
+
+static void benchmarkGetApplied() {
+    SimplifiedWaveform waveform;
+    for (int step = 0; step < 10; step++) {
+        waveform.push_back(WaveformSegment(0, 0, 1000, 0, false, false));
+        waveform.push_back(WaveformSegment(step, 4 * step, 2000, 0, true, false));
+    }
+    waveform.setStepSize(2.5e-3, 0);
+
+    const uint32_t N = 1000000;
+    vector<uint32_t> timestamps(N);
+    for (uint32_t i = 0; i < N; i++) {
+        timestamps[i] = i % (waveform.waveform.back().endIndex + 1);
+    }
+    run("SimplifiedWaveform::getApplied", N, [&]() { waveform.getApplied(timestamps); });
+    vector<AppliedRun> runs;
+    run("SimplifiedWaveform::getAppliedRuns", N, [&]() { waveform.getAppliedRuns(timestamps, 0, N, runs); });
+}
+
+// Uploading one channel's worth of commands, including the transfer to the (simulated) board
+static void benchmarkWaveformRAM(SimulatedRig& rig) {
+    WaveformRAM ram(*rig.board);
+    const unsigned int N = 256;
+    vector<uint32_t> commands(N);
+    uint32_t counter = 0;
+    run("WaveformRAM::write", N, [&]() {
+        // Different contents each time, so the RAM can't share an earlier run
+        for (uint32_t& word : commands) {
+            word = counter++;
+        }
+        ram.write(commands);
+    });
+}
+
+static void benchmarkSaveFile(SimulatedRig& rig) {
+    const unsigned int N = 50000;
+    vector<uint32_t> timestamps(N);
+    vector<Sample> measured(N), clamp(N);
+    for (unsigned int i = 0; i < N; i++) {
+        timestamps[i] = i;
+        measured[i] = static_cast<Sample>(1e-9 * std::sin(i * 1e-3));
+        clamp[i] = static_cast<Sample>(i % 2000 < 1000 ? 0 : 10e-3);
+    }
+
+    const char* formatNames[] = { "float", "compact", "chunked" };
+    const SaveFile::Format formats[] = { SaveFile::FLOAT_RECORDS, SaveFile::COMPACT_RECORDS, SaveFile::CHUNKED_RECORDS };
+    for (unsigned int i = 0; i < 3; i++) {
+        string filename = string("benchmark_save_") + formatNames[i] + ".clp";
+        {
+            SaveFile saveFile(formats[i]);
+            saveFile.open(toFileName(filename));
+            HeaderData header(*rig.board, rig.channels.front());
+            saveFile.writeHeader(header);
+            run(string("SaveFile::writeData (") + formatNames[i] + ")", N, [&]() { saveFile.writeData(timestamps, measured, clamp); });
+            saveFile.close();
+        }
+        std::remove(filename.c_str());
+    }
+}
+
+// Appending to a LineSegment and building its levels of detail, which is what each Plot redraw of a large Lines pays for
+static void benchmarkLine() {
+    const unsigned int N = 1000000;
+    vector<double> t(N), y(N);
+    for (unsigned int i = 0; i < N; i++) {
+        t[i] = i * 20e-6;
+        y[i] = std::sin(i * 1e-3);
+    }
+    run("LineSegment::append + levels of detail", N, [&]() {
+        LineSegment segment;
+        const unsigned int CHUNK = 500; // About one read's worth
+        for (unsigned int i = 0; i < N; i += CHUNK) {
+            segment.append(&t[i], &y[i], CHUNK);
+        }
+        segment.numLevels();
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--acquisition") {
+        try {
+            return runAcquisitionBenchmark(vector<string>(argv + 2, argv + argc));
+        }
+        catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (argc > 1 && string(argv[1]) == "--save") {
+        try {
+            return runSaveBenchmark(vector<string>(argv + 2, argv + argc));
+        }
+        catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (argc > 1 && string(argv[1]) == "--replay") {
+        try {
+            return runReplayBenchmark(vector<string>(argv + 2, argv + argc));
+        }
+        catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    try {
+        SimulatedRig rig;
+        std::cout << "Simulated board, " << rig.channels.size() << " channels\n";
+
+        benchmarkParse(rig);
+        benchmarkBessel();
+        benchmarkExponentialFit();
+        benchmarkGetApplied();
+        benchmarkWaveformRAM(rig);
+        benchmarkSaveFile(rig);
+        benchmarkLine();
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+# Microbenchmarks for the CLAMP_API hot path.  Runs against a SimulatedBoard, so no hardware is needed.
+include ("../CLAMP_API/CLAMP_API.pri")
+
+unix:LIBS += -ldl
+win32:LIBS += -lpsapi
+
+TARGET = ClampBenchmarks
+
+TEMPLATE = app
+
+# Line (the plotting data structure) uses QColor
+QT += gui
+
+CONFIG += console
+
+# Match the CLAMP::Sample type of the build being measured
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
+
+INCLUDEPATH += ../CLAMP_UI/Display
+
+SOURCES += \
+    AcquisitionBenchmark.cpp \
+    Benchmarks.cpp \
+    ReplayBenchmark.cpp \
+    SaveBenchmark.cpp \
+    ../CLAMP_UI/Display/Line.cpp
+
+HEADERS += \
+    AcquisitionBenchmark.h \
+    ReplayBenchmark.h \
+    SaveBenchmark.h \
+    ../CLAMP_UI/Display/Line.h
@@ -0,0 +1,486 @@
+// Golden replay of USB captures, for checking that changes to the decoding (USBPacket, ReadQueue, the conversions,
+// the filters) don't change its results, and for measuring its speed on real data.
+//
+// A capture is made during a real run with CLAMP --capture <file> (see Board::startUSBCapture): every read's raw data,
+// with the configuration it decodes with.  This replays it on a simulated board configured the same way (see
+// CaptureConfiguration), as fast as it goes: each read is parsed by ReadQueue::parse in the chunk it was read in, then
+// every enabled channel's measured current and voltage and clamp voltage and current are converted, and with --lowpass,
+// the measured currents are filtered as ClampThread filters them.  The results are written to a golden file
+// (--write-golden), or compared with one written before (--golden), e.g., by the build before a change.  Comparisons
+// are exact unless --tolerance gives a relative tolerance for the converted values; the first mismatches are listed,
+// and the exit code is 1 if there are any.
+//
+// Throughput is timed over the decoding only (not the comparison), on the best of --passes replays.
+//
+// Usage: ClampBenchmarks --replay capture [--golden file | --write-golden file] [--lowpass hz] [--tolerance x] [--passes n]
+
+#include "ReplayBenchmark.h"
+#include "Board.h"
+#include "SimulatedBoard.h"
+#include "BesselFilter.h"
+#include "USBCapture.h"
+#include "streams.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::SignalProcessing;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+
+static const uint32_t GOLDEN_MAGIC = 0x444C4743; // "CGLD"
+static const uint16_t GOLDEN_VERSION = 1;
+// Order of the low-pass filter, as ClampThread's
+static const unsigned int FILTER_ORDER = 4;
+// Mismatches listed in full; the rest are only counted
+static const unsigned int MAX_LISTED_MISMATCHES = 10;
+
+// What a stream of values in the golden file is
+enum Quantity {
+    TIMESTAMPS,
+    DIG_INS,
+    DIG_OUTS,
+    ADC,                // channel is the ADC number
+    CHANNEL_TIMESTAMPS, // Only for chips with decimated output
+    MEASURED_CURRENT,
+    MEASURED_VOLTAGE,
+    CLAMP_VOLTAGE,
+    CLAMP_CURRENT,
+    FILTERED_CURRENT
+};
+
+static const char* quantityName(Quantity quantity) {
+    switch (quantity) {
+    case TIMESTAMPS: return "timestamps";
+    case DIG_INS: return "digital inputs";
+    case DIG_OUTS: return "digital outputs";
+    case ADC: return "ADC";
+    case CHANNEL_TIMESTAMPS: return "timestamps";
+    case MEASURED_CURRENT: return "measured current";
+    case MEASURED_VOLTAGE: return "measured voltage";
+    case CLAMP_VOLTAGE: return "clamp voltage";
+    case CLAMP_CURRENT: return "clamp current";
+    default: return "filtered current";
+    }
+}
+
+struct Options {
+    string capture;
+    string golden;
+    bool writeGolden;
+    double lowpass;   // Hz; 0 for no filtering
+    double tolerance; // Relative, for converted values
+    unsigned int passes;
+
+    Options() : writeGolden(false), lowpass(0), tolerance(0), passes(1) {}
+};
+
+// One read's results: pointers into the ReadQueue (or the filter output), valid until the next read
+struct Output {
+    Quantity quantity;
+    unsigned int chip;
+    unsigned int channel;
+    const void* data;
+    std::size_t count;
+    unsigned int valueSize; // sizeof(uint32_t), sizeof(uint16_t), or sizeof(Sample)
+
+    string name() const {
+        char buffer[64];
+        if (quantity == TIMESTAMPS || quantity == DIG_INS || quantity == DIG_OUTS) {
+            return quantityName(quantity);
+        }
+        if (quantity == ADC) {
+            std::snprintf(buffer, sizeof(buffer), "ADC %u", channel);
+            return buffer;
+        }
+        std::snprintf(buffer, sizeof(buffer), "chip %u channel %u %s", chip, channel, quantityName(quantity));
+        return buffer;
+    }
+};
+
+template <typename T>
+static void put(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static T take(std::istream& in) {
+    T value;
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    if (!in) {
+        throw std::runtime_error("Golden file is truncated");
+    }
+    return value;
+}
+
+//------------------------------------------------------------------------------
+
+// Checks the outputs of each read against a golden file, or writes them to one
+class Golden {
+public:
+    Golden(const Options& options_, uint64_t numReads) :
+        options(options_),
+        mismatches(0),
+        listed(0)
+    {
+        if (options.golden.empty()) {
+            return;
+        }
+        if (options.writeGolden) {
+            out.open(options.golden.c_str(), std::ios::binary);
+            if (!out) {
+                throw std::runtime_error("Could not create " + options.golden);
+            }
+            put<uint32_t>(out, GOLDEN_MAGIC);
+            put<uint16_t>(out, GOLDEN_VERSION);
+            put<uint8_t>(out, sizeof(Sample));
+            put<double>(out, options.lowpass);
+            put<uint64_t>(out, numReads);
+            return;
+        }
+        in.open(options.golden.c_str(), std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Could not open " + options.golden);
+        }
+        if (take<uint32_t>(in) != GOLDEN_MAGIC || take<uint16_t>(in) > GOLDEN_VERSION) {
+            throw std::runtime_error(options.golden + " isn't a golden file this version can read");
+        }
+        if (take<uint8_t>(in) != sizeof(Sample)) {
+            throw std::runtime_error("The golden file was written by a build with a different CLAMP::Sample type");
+        }
+        if (take<double>(in) != options.lowpass) {
+            throw std::runtime_error("The golden file was written with a different --lowpass");
+        }
+        if (take<uint64_t>(in) != numReads) {
+            throw std::runtime_error("The golden file is of a different capture");
+        }
+    }
+
+    void check(uint64_t read, const vector<Output>& outputs) {
+        if (out.is_open()) {
+            put<uint32_t>(out, static_cast<uint32_t>(outputs.size()));
+            for (const Output& output : outputs) {
+                put<uint32_t>(out, key(output));
+                put<uint8_t>(out, static_cast<uint8_t>(output.valueSize));
+                put<uint64_t>(out, output.count);
+                out.write(static_cast<const char*>(output.data), output.count * output.valueSize);
+            }
+            return;
+        }
+        if (!in.is_open()) {
+            return;
+        }
+        uint32_t numOutputs = take<uint32_t>(in);
+        if (numOutputs != outputs.size()) {
+            mismatch(read, "number of outputs", numOutputs, outputs.size());
+        }
+        for (uint32_t i = 0; i < numOutputs; i++) {
+            uint32_t expectedKey = take<uint32_t>(in);
+            unsigned int valueSize = take<uint8_t>(in);
+            uint64_t count = take<uint64_t>(in);
+            expected.resize(static_cast<std::size_t>(count * valueSize));
+            in.read(expected.data(), expected.size());
+            if (!in) {
+                throw std::runtime_error("Golden file is truncated");
+            }
+            if (i >= outputs.size()) {
+                continue;
+            }
+            const Output& output = outputs[i];
+            if (expectedKey != key(output) || valueSize != output.valueSize) {
+                mismatch(read, "output " + std::to_string(i) + " (" + output.name() + ")", expectedKey, key(output));
+                continue;
+            }
+            if (count != output.count) {
+                mismatch(read, output.name() + " count", count, output.count);
+            }
+            compare(read, output, std::min<uint64_t>(count, output.count));
+        }
+    }
+
+    void finish() {
+        if (out.is_open()) {
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Could not write " + options.golden);
+            }
+        }
+        else if (in.is_open() && in.peek() != std::char_traits<char>::eof()) {
+            mismatches++;
+            std::printf("The golden file has more data than the replay produced\n");
+        }
+    }
+
+    bool comparing() const { return in.is_open(); }
+    uint64_t getMismatches() const { return mismatches; }
+
+private:
+    Options options;
+    std::ofstream out;
+    std::ifstream in;
+    vector<char> expected;
+    uint64_t mismatches;
+    unsigned int listed;
+
+    static uint32_t key(const Output& output) {
+        return (static_cast<uint32_t>(output.quantity) << 16) | (output.chip << 8) | output.channel;
+    }
+
+    void mismatch(uint64_t read, const string& what, uint64_t expectedValue, uint64_t actual) {
+        mismatches++;
+        if (listed++ < MAX_LISTED_MISMATCHES) {
+            std::printf("Read %llu, %s: expected %llu, got %llu\n", static_cast<unsigned long long>(read), what.c_str(),
+                        static_cast<unsigned long long>(expectedValue), static_cast<unsigned long long>(actual));
+        }
+    }
+
+    void compare(uint64_t read, const Output& output, uint64_t count) {
+        if (std::memcmp(expected.data(), output.data, static_cast<std::size_t>(count * output.valueSize)) == 0) {
+            return;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            if (output.valueSize == sizeof(Sample) && output.quantity >= MEASURED_CURRENT) {
+                Sample e, a;
+                std::memcpy(&e, &expected[static_cast<std::size_t>(i * sizeof(Sample))], sizeof(Sample));
+                a = static_cast<const Sample*>(output.data)[i];
+                if (!sampleMatches(e, a)) {
+                    mismatches++;
+                    if (listed++ < MAX_LISTED_MISMATCHES) {
+                        std::printf("Read %llu, %s, sample %llu: expected %.17g, got %.17g\n", static_cast<unsigned long long>(read),
+                                    output.name().c_str(), static_cast<unsigned long long>(i), static_cast<double>(e), static_cast<double>(a));
+                    }
+                }
+                continue;
+            }
+            uint64_t e = 0, a = 0;
+            std::memcpy(&e, &expected[static_cast<std::size_t>(i * output.valueSize)], output.valueSize);
+            std::memcpy(&a, static_cast<const char*>(output.data) + i * output.valueSize, output.valueSize);
+            if (e != a) {
+                mismatch(read, output.name() + " value " + std::to_string(i), e, a);
+            }
+        }
+    }
+
+    bool sampleMatches(Sample e, Sample a) const {
+        if (std::isnan(e) || std::isnan(a)) {
+            return std::isnan(e) && std::isnan(a);
+        }
+        if (std::memcmp(&e, &a, sizeof(Sample)) == 0) {
+            return true;
+        }
+        return std::abs(a - e) <= options.tolerance * std::max(std::abs(a), std::abs(e));
+    }
+};
+
+//------------------------------------------------------------------------------
+
+// Decodes a capture's reads as the original board did
+class Replay {
+public:
+    explicit Replay(const USBCapture& capture_) :
+        capture(capture_),
+        configuration(-1)
+    {
+        const CaptureConfiguration& first = capture.getConfigurations().front();
+        simulated = new SimulatedBoard();
+        unique_ptr<OpalKellyBoard> backend(simulated);
+        board.reset(new Board(std::move(backend), first.is18bitADC));
+        simulated->attach(*board, unique_ptr<PacketSource>(new ModelCellSource(*board)));
+        if (!board->open()) {
+            throw std::runtime_error("Couldn't open the simulated board");
+        }
+    }
+
+    double samplingRateHz() const { return board->getSamplingRateHz(); }
+
+    // Starts from the beginning of the capture, with fresh state
+    void restart(double lowpass) {
+        configuration = -1;
+        cutoff = lowpass;
+    }
+
+    // Decodes one read; outputs are valid until the next call
+    void decode(const USBCapture::Read& read, vector<Output>& outputs, uint64_t& channelSamples);
+
+private:
+    const USBCapture& capture;
+    SimulatedBoard* simulated;
+    unique_ptr<Board> board;
+    int configuration; // Index of the one applied, or -1
+    ChipChannelList channels;
+    unsigned int packetSize;
+    double cutoff;
+    vector<unique_ptr<NthOrderBesselLowPassFilter>> filters; // One per channel
+    vector<vector<Sample>> filtered;
+
+    void configure(std::size_t index);
+};
+
+void Replay::configure(std::size_t index) {
+    const CaptureConfiguration& c = capture.getConfigurations()[index];
+    c.applyTo(*board);
+    board->readQueue.clear(true);
+    board->readQueue.restartTimestamps();
+    channels = c.getEnabledChannels();
+    packetSize = c.packetSize;
+    configuration = static_cast<int>(index);
+
+    filters.clear();
+    filtered.assign(channels.size(), vector<Sample>());
+    if (cutoff > 0) {
+        for (std::size_t i = 0; i < channels.size(); i++) {
+            filters.emplace_back(new NthOrderBesselLowPassFilter(FILTER_ORDER, cutoff, c.outputDecimation[channels[i].chip] / samplingRateHz()));
+        }
+    }
+}
+
+void Replay::decode(const USBCapture::Read& read, vector<Output>& outputs, uint64_t& channelSamples) {
+    if (configuration != static_cast<int>(read.configuration)) {
+        configure(read.configuration);
+    }
+    ReadQueue& queue = board->readQueue;
+    queue.clear(false);
+    queue.parse(read.data, static_cast<unsigned int>(read.numBytes / packetSize));
+
+    outputs.clear();
+    auto add = [&](Quantity quantity, unsigned int chip, unsigned int channel, const void* data, std::size_t count, unsigned int valueSize) {
+        Output output = { quantity, chip, channel, data, count, valueSize };
+        outputs.push_back(output);
+    };
+    const vector<uint32_t>& timestamps = queue.getTimeStamps();
+    add(TIMESTAMPS, 0, 0, timestamps.data(), timestamps.size(), sizeof(uint32_t));
+    add(DIG_INS, 0, 0, queue.getDigIns().data(), queue.getDigIns().size(), sizeof(uint16_t));
+    add(DIG_OUTS, 0, 0, queue.getDigOuts().data(), queue.getDigOuts().size(), sizeof(uint16_t));
+    const CaptureConfiguration& c = capture.getConfigurations()[read.configuration];
+    for (unsigned int adc = 0; adc < 8; adc++) {
+        if (c.adcs[adc]) {
+            const vector<uint16_t>& values = queue.getADCs()[adc];
+            add(ADC, 0, adc, values.data(), values.size(), sizeof(uint16_t));
+        }
+    }
+    for (std::size_t i = 0; i < channels.size(); i++) {
+        const ChipChannel& index = channels[i];
+        unsigned int chip = index.chip;
+        unsigned int channel = index.channel;
+        if (c.outputDecimation[chip] > 1) {
+            const vector<uint32_t>& channelTimestamps = queue.getTimeStamps(index);
+            add(CHANNEL_TIMESTAMPS, chip, channel, channelTimestamps.data(), channelTimestamps.size(), sizeof(uint32_t));
+        }
+        const vector<Sample>& currents = queue.getMeasuredCurrents(index);
+        const vector<Sample>& voltages = queue.getMeasuredVoltages(index);
+        const vector<Sample>& clampVoltages = queue.getClampVoltages(index);
+        const vector<Sample>& clampCurrents = queue.getClampCurrents(index);
+        add(MEASURED_CURRENT, chip, channel, currents.data(), currents.size(), sizeof(Sample));
+        add(MEASURED_VOLTAGE, chip, channel, voltages.data(), voltages.size(), sizeof(Sample));
+        add(CLAMP_VOLTAGE, chip, channel, clampVoltages.data(), clampVoltages.size(), sizeof(Sample));
+        add(CLAMP_CURRENT, chip, channel, clampCurrents.data(), clampCurrents.size(), sizeof(Sample));
+        if (!filters.empty()) {
+            filtered[i].resize(currents.size());
+            filters[i]->process(currents.data(), filtered[i].data(), currents.size());
+            add(FILTERED_CURRENT, chip, channel, filtered[i].data(), filtered[i].size(), sizeof(Sample));
+        }
+        channelSamples += currents.size();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int runReplayBenchmark(const vector<string>& args) {
+    Options options;
+    for (std::size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--golden" && i + 1 < args.size()) {
+            options.golden = args[++i];
+            options.writeGolden = false;
+        }
+        else if (args[i] == "--write-golden" && i + 1 < args.size()) {
+            options.golden = args[++i];
+            options.writeGolden = true;
+        }
+        else if (args[i] == "--lowpass" && i + 1 < args.size()) {
+            options.lowpass = std::stod(args[++i]);
+        }
+        else if (args[i] == "--tolerance" && i + 1 < args.size()) {
+            options.tolerance = std::stod(args[++i]);
+        }
+        else if (args[i] == "--passes" && i + 1 < args.size()) {
+            options.passes = std::max(1, std::stoi(args[++i]));
+        }
+        else if (options.capture.empty() && args[i].compare(0, 2, "--") != 0) {
+            options.capture = args[i];
+        }
+        else {
+            std::cerr << "Unknown argument " << args[i] << "\n";
+            return 1;
+        }
+    }
+    if (options.capture.empty()) {
+        std::cerr << "Usage: ClampBenchmarks --replay capture [--golden file | --write-golden file] [--lowpass hz] [--tolerance x] [--passes n]\n";
+        return 1;
+    }
+
+    USBCapture capture(toFileName(options.capture));
+    if (!capture.hasConfiguration()) {
+        throw std::runtime_error("The capture has no configuration (it's from before captures recorded one); replay it with a "
+                                 "ReplaySource on a board configured as the original was");
+    }
+    const vector<USBCapture::Read>& reads = capture.getReads();
+    uint64_t numPackets = 0;
+    for (const USBCapture::Read& read : reads) {
+        numPackets += read.numBytes / capture.getConfigurations()[read.configuration].packetSize;
+    }
+
+    Replay replay(capture);
+    Golden golden(options, reads.size());
+    using std::chrono::steady_clock;
+    vector<Output> outputs;
+    double bestSeconds = 0;
+    uint64_t channelSamples = 0;
+    for (unsigned int pass = 0; pass < options.passes; pass++) {
+        replay.restart(options.lowpass);
+        double seconds = 0;
+        channelSamples = 0;
+        for (std::size_t r = 0; r < reads.size(); r++) {
+            steady_clock::time_point begin = steady_clock::now();
+            replay.decode(reads[r], outputs, channelSamples);
+            seconds += std::chrono::duration<double>(steady_clock::now() - begin).count();
+            if (pass == 0) {
+                golden.check(r, outputs);
+            }
+        }
+        if (pass == 0 || seconds < bestSeconds) {
+            bestSeconds = seconds;
+        }
+    }
+    golden.finish();
+
+    double captureSeconds = numPackets / replay.samplingRateHz();
+    std::printf("%s: %llu reads, %llu packets (%.1f s), %.1f MB, %u configuration(s)\n", options.capture.c_str(),
+                static_cast<unsigned long long>(reads.size()), static_cast<unsigned long long>(numPackets), captureSeconds,
+                capture.getDataBytes() / 1e6, static_cast<unsigned int>(capture.getConfigurations().size()));
+    if (bestSeconds > 0) {
+        std::printf("Decoded in %.3f s (best of %u): %.2f Mpackets/s, %.1f MB/s, %.2f Msamples/s, %.1fx real time\n", bestSeconds,
+                    options.passes, numPackets / bestSeconds / 1e6, capture.getDataBytes() / bestSeconds / 1e6,
+                    channelSamples / bestSeconds / 1e6, captureSeconds / bestSeconds);
+    }
+    if (options.writeGolden) {
+        std::printf("Wrote golden decode to %s\n", options.golden.c_str());
+    }
+    else if (golden.comparing()) {
+        if (golden.getMismatches() > 0) {
+            std::printf("FAILED: %llu mismatches with %s\n", static_cast<unsigned long long>(golden.getMismatches()), options.golden.c_str());
+            return 1;
+        }
+        std::printf("Matches %s\n", options.golden.c_str());
+    }
+    return 0;
+}
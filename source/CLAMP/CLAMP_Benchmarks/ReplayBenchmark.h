@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Replays a USB capture through the decoding pipeline, checking it against a golden decode; see ReplayBenchmark.cpp
+int runReplayBenchmark(const std::vector<std::string>& args);
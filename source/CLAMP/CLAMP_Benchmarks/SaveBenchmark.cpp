@@ -0,0 +1,400 @@
+// Save throughput benchmark, for choosing storage for a rig.
+//
+// Writes a synthetic recording of several headstages (8 by default) through each SaveFile format and write strategy,
+// into the given directory, for a few seconds each, the way the DataStores do: every headstage's file gets a read's
+// worth of samples in turn.  For each combination it reports:
+//   MB/s      Bytes on disk per second, counting the time to close the files (i.e., until the data is all written)
+//   x rt      The same as a multiple of real time: how many rigs like this one the disk and CPU could keep up with
+//   CPU ms/MB Process CPU time (on every thread, including the background writers) per MB on disk
+//   p99/max   Time writeData() held up the acquisition thread, over all calls: the 99th percentile and the worst
+//
+// "legacy" is the version 1 record format written one value at a time through BinaryWriter's operator<<, as SaveFile
+// wrote before its bulk paths, for comparison with "float", the same bytes written a column at a time.  Legacy files
+// are only written buffered.  Direct I/O doesn't apply to NWB files (SaveFile::setDirectIO()), and NWB is skipped in
+// builds without HDF5.
+//
+// Unpaced (the default), the writes go as fast as they can, so the stalls are those of a saturated disk.  With --paced,
+// the data is produced at that multiple of real time, so the stalls are those of a rig at that load.
+//
+// Usage: ClampBenchmarks --save [--dir path] [--seconds s] [--headstages n] [--paced x]
+//                               [--format legacy|float|compact|chunked|nwb]... [--strategy buffered|async|direct]...
+
+#include "SaveBenchmark.h"
+#include "Board.h"
+#include "SimulatedBoard.h"
+#include "SaveFile.h"
+#include "NWBFile.h"
+#include "SimplifiedWaveform.h"
+#include "streams.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+
+// Samples per headstage per writeData() call: a 50 ms read at 50 kHz
+static const unsigned int READ_SAMPLES = 2500;
+// Samples of synthetic data per headstage, cycled through; long enough that chunked compression sees varied data
+static const unsigned int SYNTHETIC_SAMPLES = 20 * READ_SAMPLES;
+// BinaryWriter buffer for the legacy writer, as SaveFile's
+static const unsigned int LEGACY_BUFFER_SIZE = 4096;
+
+enum Backend {
+    LEGACY,
+    FLOAT,
+    COMPACT,
+    CHUNKED,
+    NWB
+};
+
+enum Strategy {
+    BUFFERED,
+    ASYNC,
+    DIRECT
+};
+
+static const char* backendName(Backend backend) {
+    switch (backend) {
+    case LEGACY: return "legacy";
+    case FLOAT: return "float";
+    case COMPACT: return "compact";
+    case CHUNKED: return "chunked";
+    default: return "nwb";
+    }
+}
+
+static const char* strategyName(Strategy strategy) {
+    switch (strategy) {
+    case BUFFERED: return "buffered";
+    case ASYNC: return "async";
+    default: return "direct";
+    }
+}
+
+struct Options {
+    string directory;
+    double seconds;
+    unsigned int headstages;
+    double paced; // Multiple of real time to produce the data at; 0 for as fast as possible
+
+    Options() : directory("."), seconds(2.0), headstages(8), paced(0) {}
+};
+
+struct SaveResult {
+    double wallSeconds;  // Including closing the files
+    double cpuSeconds;
+    uint64_t bytes;      // On disk
+    uint64_t samples;    // Per headstage
+    vector<double> stalls; // Seconds in each writeData() call
+};
+
+static double processCpuSeconds() {
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    auto seconds = [](const FILETIME& t) { return ((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 1e-7; };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+static uint64_t fileBytes(const string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    return in ? static_cast<uint64_t>(in.tellg()) : 0;
+}
+
+//------------------------------------------------------------------------------
+
+// One headstage's synthetic recording: a model cell's response to a family of voltage steps, with noise
+struct SyntheticHeadstage {
+    vector<uint32_t> timestamps; // READ_SAMPLES of them, advanced for each read
+    vector<Sample> measured;     // SYNTHETIC_SAMPLES of each
+    vector<Sample> clamp;
+    vector<Sample> measuredRead; // The current read's
+    vector<Sample> clampRead;
+
+    explicit SyntheticHeadstage(unsigned int seed) :
+        timestamps(READ_SAMPLES),
+        measured(SYNTHETIC_SAMPLES),
+        clamp(SYNTHETIC_SAMPLES),
+        measuredRead(READ_SAMPLES),
+        clampRead(READ_SAMPLES)
+    {
+        std::mt19937 random(seed);
+        std::normal_distribution<double> noise(0, 2e-12);
+        const unsigned int STEP = 3000;
+        for (unsigned int i = 0; i < SYNTHETIC_SAMPLES; i++) {
+            unsigned int step = i / STEP;
+            unsigned int t = i % STEP;
+            double v = (step % 2) ? 10e-3 * (step % 5) : 0;
+            double previous = (step % 2) ? 0 : 10e-3 * ((step - 1) % 5);
+            // 100 MOhm cell behind 10 MOhm access, 1 ms time constant
+            double current = v / 110e6 + (v - previous) / 10e6 * std::exp(-t / 50.0);
+            measured[i] = static_cast<Sample>(current + noise(random));
+            clamp[i] = static_cast<Sample>(v);
+        }
+    }
+
+    // Fills in read number n
+    void read(uint64_t n) {
+        std::size_t first = static_cast<std::size_t>((n * READ_SAMPLES) % SYNTHETIC_SAMPLES);
+        std::copy(measured.begin() + first, measured.begin() + first + READ_SAMPLES, measuredRead.begin());
+        std::copy(clamp.begin() + first, clamp.begin() + first + READ_SAMPLES, clampRead.begin());
+        for (unsigned int i = 0; i < READ_SAMPLES; i++) {
+            timestamps[i] = static_cast<uint32_t>(n * READ_SAMPLES + i);
+        }
+    }
+};
+
+// The version 1 format, one value at a time
+class LegacyWriter {
+public:
+    LegacyWriter(const FILENAME& path, HeaderData& header) :
+        waveform(header.settings.waveform)
+    {
+        unique_ptr<FileOutStream> fs(new FileOutStream());
+        fs->open(path);
+        out.reset(new BinaryWriter(std::move(fs), LEGACY_BUFFER_SIZE));
+        *out << header;
+    }
+
+    void writeData(const vector<uint32_t>& timestamps, const vector<Sample>& measured, const vector<Sample>& clamp) {
+        waveform.getApplied(timestamps, 0, static_cast<unsigned int>(timestamps.size()), applied);
+        for (std::size_t i = 0; i < timestamps.size(); i++) {
+            *out << timestamps[i] << static_cast<float>(applied[i]) << static_cast<float>(clamp[i]) << static_cast<float>(measured[i]);
+        }
+    }
+
+    void close() {
+        out.reset();
+    }
+
+private:
+    unique_ptr<BinaryWriter> out;
+    SimplifiedWaveform waveform;
+    vector<double> applied;
+};
+
+class SaveBenchmark {
+public:
+    explicit SaveBenchmark(const Options& options_) :
+        options(options_)
+    {
+        simulated = new SimulatedBoard();
+        unique_ptr<OpalKellyBoard> backend(simulated);
+        board.reset(new Board(std::move(backend)));
+        simulated->attach(*board, unique_ptr<PacketSource>(new ModelCellSource(*board)));
+        if (!board->open()) {
+            throw std::runtime_error("Couldn't open the simulated board");
+        }
+        for (auto& index : board->getPresentChannels()) {
+            if (index.channel == 0) {
+                channels.push_back(index);
+            }
+        }
+        if (channels.empty()) {
+            throw std::runtime_error("No headstages found");
+        }
+        for (unsigned int i = 0; i < options.headstages; i++) {
+            data.emplace_back(new SyntheticHeadstage(i + 1));
+        }
+    }
+
+    double samplingRateHz() const { return board->getSamplingRateHz(); }
+    SaveResult run(Backend backend, Strategy strategy);
+
+private:
+    Options options;
+    SimulatedBoard* simulated;
+    unique_ptr<Board> board;
+    ChipChannelList channels; // Channel 0 of each chip; headstage i's header is that of channels[i % size]
+    vector<unique_ptr<SyntheticHeadstage>> data;
+
+    string pathOf(Backend backend, unsigned int headstage) const;
+};
+
+string SaveBenchmark::pathOf(Backend backend, unsigned int headstage) const {
+    return options.directory + "/save_benchmark_" + std::to_string(headstage) + ((backend == NWB) ? ".nwb" : ".clp");
+}
+
+SaveResult SaveBenchmark::run(Backend backend, Strategy strategy) {
+    using std::chrono::steady_clock;
+
+    vector<unique_ptr<SaveFile>> saveFiles;
+    vector<unique_ptr<LegacyWriter>> legacyWriters;
+    for (unsigned int i = 0; i < options.headstages; i++) {
+        HeaderData header(*board, channels[i % channels.size()]);
+        FILENAME path = toFileName(pathOf(backend, i));
+        if (backend == LEGACY) {
+            legacyWriters.emplace_back(new LegacyWriter(path, header));
+            continue;
+        }
+        const SaveFile::Format formats[] = { SaveFile::FLOAT_RECORDS, SaveFile::FLOAT_RECORDS, SaveFile::COMPACT_RECORDS, SaveFile::CHUNKED_RECORDS, SaveFile::NWB_RECORDS };
+        unique_ptr<SaveFile> saveFile(new SaveFile(formats[backend]));
+        saveFile->setDirectIO(strategy == DIRECT);
+        saveFile->open(path, strategy != BUFFERED);
+        saveFile->writeHeader(header);
+        saveFiles.push_back(std::move(saveFile));
+    }
+
+    SaveResult result;
+    result.samples = 0;
+    double readSeconds = READ_SAMPLES / samplingRateHz();
+    double cpuStart = processCpuSeconds();
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point end = start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(options.seconds));
+    for (uint64_t n = 0; steady_clock::now() < end; n++) {
+        if (options.paced > 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(n * readSeconds / options.paced)));
+        }
+        for (unsigned int i = 0; i < options.headstages; i++) {
+            SyntheticHeadstage& headstage = *data[i];
+            headstage.read(n);
+            steady_clock::time_point before = steady_clock::now();
+            if (backend == LEGACY) {
+                legacyWriters[i]->writeData(headstage.timestamps, headstage.measuredRead, headstage.clampRead);
+            }
+            else {
+                saveFiles[i]->writeData(headstage.timestamps, headstage.measuredRead, headstage.clampRead);
+            }
+            result.stalls.push_back(std::chrono::duration<double>(steady_clock::now() - before).count());
+        }
+        result.samples += READ_SAMPLES;
+    }
+    for (auto& writer : legacyWriters) {
+        writer->close();
+    }
+    for (auto& saveFile : saveFiles) {
+        saveFile->close();
+    }
+    saveFiles.clear(); // close() waits for any background writes
+    result.wallSeconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+    result.cpuSeconds = processCpuSeconds() - cpuStart;
+
+    result.bytes = 0;
+    for (unsigned int i = 0; i < options.headstages; i++) {
+        result.bytes += fileBytes(pathOf(backend, i));
+        std::remove(pathOf(backend, i).c_str());
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+
+// The q-th quantile of the values (which are sorted), or 0 if there are none
+static double quantile(vector<double>& values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    std::size_t index = std::min(values.size() - 1, static_cast<std::size_t>(std::ceil(q * values.size())) - (q > 0 ? 1 : 0));
+    return values[index];
+}
+
+int runSaveBenchmark(const vector<string>& args) {
+    Options options;
+    vector<Backend> backends;
+    vector<Strategy> strategies;
+    for (std::size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--dir" && i + 1 < args.size()) {
+            options.directory = args[++i];
+        }
+        else if (args[i] == "--seconds" && i + 1 < args.size()) {
+            options.seconds = std::stod(args[++i]);
+        }
+        else if (args[i] == "--headstages" && i + 1 < args.size()) {
+            options.headstages = std::max(1, std::stoi(args[++i]));
+        }
+        else if (args[i] == "--paced" && i + 1 < args.size()) {
+            options.paced = std::stod(args[++i]);
+        }
+        else if (args[i] == "--format" && i + 1 < args.size()) {
+            string name = args[++i];
+            bool found = false;
+            for (Backend backend : { LEGACY, FLOAT, COMPACT, CHUNKED, NWB }) {
+                if (name == backendName(backend)) {
+                    backends.push_back(backend);
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::cerr << "Unknown format " << name << "\n";
+                return 1;
+            }
+        }
+        else if (args[i] == "--strategy" && i + 1 < args.size()) {
+            string name = args[++i];
+            bool found = false;
+            for (Strategy strategy : { BUFFERED, ASYNC, DIRECT }) {
+                if (name == strategyName(strategy)) {
+                    strategies.push_back(strategy);
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::cerr << "Unknown strategy " << name << "\n";
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "Unknown argument " << args[i] << "\n";
+            return 1;
+        }
+    }
+    if (backends.empty()) {
+        backends = { LEGACY, FLOAT, COMPACT, CHUNKED, NWB };
+    }
+    if (strategies.empty()) {
+        strategies = { BUFFERED, ASYNC, DIRECT };
+    }
+
+    SaveBenchmark benchmark(options);
+    char pacing[64] = "unpaced";
+    if (options.paced > 0) {
+        std::snprintf(pacing, sizeof(pacing), "paced at %gx real time", options.paced);
+    }
+    std::printf("%u headstages at %.0f Hz into %s, %.1f s per combination, %s\n\n", options.headstages, benchmark.samplingRateHz(),
+                options.directory.c_str(), options.seconds, pacing);
+    std::printf("%-8s %-9s %9s %8s %10s %10s %10s\n", "format", "strategy", "MB/s", "x rt", "CPU ms/MB", "p99 ms", "max ms");
+    for (Backend backend : backends) {
+        if (backend == NWB && !NWBFile::isAvailable()) {
+            std::printf("%-8s (not available: built without HDF5)\n", backendName(backend));
+            continue;
+        }
+        for (Strategy strategy : strategies) {
+            if ((backend == LEGACY && strategy != BUFFERED) || (backend == NWB && strategy == DIRECT)) {
+                continue;
+            }
+            SaveResult result = benchmark.run(backend, strategy);
+            double mb = result.bytes / 1e6;
+            double realTime = result.samples / (result.wallSeconds * benchmark.samplingRateHz());
+            double p99 = quantile(result.stalls, 0.99);
+            double worst = result.stalls.empty() ? 0 : result.stalls.back();
+            std::printf("%-8s %-9s %9.1f %8.2f %10.2f %10.3f %10.3f\n", backendName(backend), strategyName(strategy), mb / result.wallSeconds,
+                        realTime, (mb > 0) ? 1e3 * result.cpuSeconds / mb : 0.0, 1e3 * p99, 1e3 * worst);
+        }
+    }
+    return 0;
+}
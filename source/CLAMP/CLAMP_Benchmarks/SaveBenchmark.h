@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Save throughput of each SaveFile format and write strategy, for choosing disks; see SaveBenchmark.cpp
+int runSaveBenchmark(const std::vector<std::string>& args);
@@ -0,0 +1,40 @@
+# Batch conversion of save files between record formats from the command line.  Links the CLAMP_API library, so it
+# doesn't need Qt.
+INCLUDEPATH += ../CLAMP_API ../../Common ../../OpalKelly
+
+unix:QMAKE_CXXFLAGS += -std=c++11
+
+win32:CONFIG(release, debug|release): CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API/release
+else:win32:CONFIG(debug, debug|release): CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API/debug
+else: CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API
+
+LIBS += -L$$CLAMP_API_DIR -lCLAMP_API
+unix:LIBS += -ldl -lpthread
+win32:LIBS += -lws2_32
+# MMCSS, for real-time thread priority
+win32:LIBS += -lavrt
+linux-g++:LIBS += -lrt
+win32:PRE_TARGETDEPS += $$CLAMP_API_DIR/CLAMP_API.lib
+else:PRE_TARGETDEPS += $$CLAMP_API_DIR/libCLAMP_API.a
+
+# HDF5, if the library was built with CONFIG+=clamp_hdf5 for NWB save files (see CLAMP_API.pri)
+clamp_hdf5 {
+    win32:LIBS += -L$$HDF5_DIR/lib -lhdf5
+    else {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += hdf5
+    }
+}
+
+TARGET = ClampConvert
+
+TEMPLATE = app
+
+CONFIG += console
+CONFIG -= qt
+
+# Must match the setting the CLAMP_API library was built with
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
+
+SOURCES += \
+    main.cpp
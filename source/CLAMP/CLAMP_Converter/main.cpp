@@ -0,0 +1,264 @@
+// Batch conversion of save files between the .clp record formats (see CLAMP::IO::SaveFileConverter), e.g., to turn a
+// day's compact recordings into float files for analysis software that reads only those, or to compress a directory of
+// float recordings into chunked files.  Needs only the CLAMP_API library.
+//
+// Usage: ClampConvert --format float|compact|chunked --output dir [--threads n] file-or-directory...
+//
+// Directories are searched recursively for .clp files, and each file is written to the same relative path under
+// --output (files given directly go straight into it); existing files there are overwritten.  Files are converted in
+// parallel, and large files are themselves converted a block at a time in parallel.  Each file is reported as it
+// finishes, then the total throughput.  --threads sets the number of worker threads (default: one fewer than the
+// number of cores).  Journals (see CLAMP::IO::JournalOutStream), e.g., from a recording that crashed, are recovered up to
+// their last checkpoint and then converted.  The exit code is 1 if any file failed.
+
+#include "SaveFileConverter.h"
+#include "ThreadPool.h"
+#include "streams.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <direct.h>
+#else
+    #include <dirent.h>
+    #include <sys/stat.h>
+    #include <cerrno>
+#endif
+
+using namespace CLAMP;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::runtime_error;
+
+struct Options {
+    SaveFile::Format format;
+    bool haveFormat;
+    string output;
+    unsigned int threads; // 0 for the default
+    vector<string> inputs;
+
+    Options() : format(SaveFile::FLOAT_RECORDS), haveFormat(false), threads(0) {}
+};
+
+static void usage() {
+    std::cerr << "Usage: ClampConvert --format float|compact|chunked --output dir [--threads n] file-or-directory...\n";
+}
+
+static bool parseArguments(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--format" && hasValue) {
+            string format = argv[++i];
+            if (format == "float") {
+                options.format = SaveFile::FLOAT_RECORDS;
+            }
+            else if (format == "compact") {
+                options.format = SaveFile::COMPACT_RECORDS;
+            }
+            else if (format == "chunked") {
+                options.format = SaveFile::CHUNKED_RECORDS;
+            }
+            else {
+                std::cerr << "Unknown format " << format << "\n";
+                return false;
+            }
+            options.haveFormat = true;
+        }
+        else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = static_cast<unsigned int>(std::stoul(argv[++i]));
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+        else {
+            options.inputs.push_back(arg);
+        }
+    }
+    return options.haveFormat && !options.output.empty() && !options.inputs.empty();
+}
+
+static bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool isDirectory(const string& path) {
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// Appends the .clp files under directory/relative to files, as paths relative to directory
+static void findSaveFiles(const string& directory, const string& relative, vector<string>& files) {
+    string path = relative.empty() ? directory : directory + "/" + relative;
+    vector<string> names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((path + "/*").c_str(), &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        throw runtime_error("Can't read directory " + path);
+    }
+    do {
+        names.push_back(entry.cFileName);
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        throw runtime_error("Can't read directory " + path);
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
+    std::sort(names.begin(), names.end());
+
+    for (const string& name : names) {
+        if (name == "." || name == "..") {
+            continue;
+        }
+        string child = relative.empty() ? name : relative + "/" + name;
+        if (isDirectory(directory + "/" + child)) {
+            findSaveFiles(directory, child, files);
+        }
+        else if (endsWith(name, ".clp")) {
+            files.push_back(child);
+        }
+    }
+}
+
+// Creates the directories leading up to path (but not path itself)
+static void createParentDirectories(const string& path) {
+    for (std::size_t slash = path.find_first_of("/\\", 1); slash != string::npos; slash = path.find_first_of("/\\", slash + 1)) {
+        string parent = path.substr(0, slash);
+        if (isDirectory(parent)) {
+            continue;
+        }
+#if defined(_WIN32)
+        if (_mkdir(parent.c_str()) != 0 && errno != EEXIST) {
+#else
+        if (mkdir(parent.c_str(), 0777) != 0 && errno != EEXIST) {
+#endif
+            throw runtime_error("Can't create directory " + parent);
+        }
+    }
+}
+
+static string baseName(const string& path) {
+    std::size_t slash = path.find_last_of("/\\");
+    return (slash == string::npos) ? path : path.substr(slash + 1);
+}
+
+static string displayName(const FILENAME& path) {
+#if defined(_WIN32) && defined(_UNICODE)
+    return toString(path);
+#else
+    return path;
+#endif
+}
+
+static double megabytes(uint64_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    try {
+        vector<FILENAME> sources;
+        vector<FILENAME> destinations;
+        for (const string& input : options.inputs) {
+            if (isDirectory(input)) {
+                vector<string> files;
+                findSaveFiles(input, "", files);
+                for (const string& file : files) {
+                    sources.push_back(toFileName(input + "/" + file));
+                    string destination = options.output + "/" + file;
+                    createParentDirectories(destination);
+                    destinations.push_back(toFileName(destination));
+                }
+            }
+            else {
+                sources.push_back(toFileName(input));
+                string destination = options.output + "/" + baseName(input);
+                createParentDirectories(destination);
+                destinations.push_back(toFileName(destination));
+            }
+        }
+        if (sources.empty()) {
+            std::cerr << "No .clp files found\n";
+            return 1;
+        }
+
+        unique_ptr<ThreadPool> ownPool;
+        if (options.threads > 0) {
+            ownPool.reset(new ThreadPool(options.threads));
+        }
+        ThreadPool& pool = ownPool ? *ownPool : ThreadPool::instance();
+        std::cout << "Converting " << sources.size() << " file(s) on " << pool.numThreads() << " worker threads\n";
+
+        SaveFileConverter converter(options.format, pool);
+        auto start = std::chrono::steady_clock::now();
+        vector<ConversionResult> results = converter.convertFiles(sources, destinations, [](const ConversionResult& result) {
+            std::cout << displayName(result.source) << ": ";
+            if (!result.error.empty()) {
+                std::cout << "FAILED: " << result.error << "\n";
+            }
+            else {
+                std::cout << (result.recovered ? "recovered, " : "") << (result.copied ? "copied, " : "") << result.records << " records, " << std::fixed << std::setprecision(1)
+                          << megabytes(result.bytesRead) << " -> " << megabytes(result.bytesWritten) << " MB in " << std::setprecision(2)
+                          << result.seconds << " s\n";
+            }
+            std::cout.flush();
+        });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t records = 0, bytesRead = 0, bytesWritten = 0;
+        unsigned int failed = 0;
+        for (const ConversionResult& result : results) {
+            if (!result.error.empty()) {
+                failed++;
+                continue;
+            }
+            records += result.records;
+            bytesRead += result.bytesRead;
+            bytesWritten += result.bytesWritten;
+        }
+        seconds = std::max(seconds, 1e-9);
+        std::cout << std::fixed << std::setprecision(1)
+                  << (results.size() - failed) << " converted, " << failed << " failed in " << std::setprecision(2) << seconds << " s: "
+                  << std::setprecision(1) << megabytes(bytesRead) / seconds << " MB/s read, " << megabytes(bytesWritten) / seconds << " MB/s written, "
+                  << records / seconds / 1e6 << " M records/s\n";
+        return (failed == 0) ? 0 : 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
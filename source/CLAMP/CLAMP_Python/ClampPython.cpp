@@ -0,0 +1,342 @@
+#include "ClampPython.h"
+#include "Board.h"
+#include "SimulatedBoard.h"
+#include "SimplifiedWaveform.h"
+#include "SaveFileReader.h"
+#include "streams.h"
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::IO;
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::runtime_error;
+using std::invalid_argument;
+
+struct ClampBoard {
+    unique_ptr<Board> board;
+};
+
+struct ClampSaveFile {
+    SaveFileReader reader;
+    Chunk chunk; // Most recent chunk returned by clamp_savefile_read_chunk
+};
+
+static thread_local string lastError;
+
+// Runs f, turning any exception into a clamp_last_error() message and the return value failed
+template <typename R, typename F>
+static R guard(R failed, F f) {
+    try {
+        return f();
+    }
+    catch (std::exception& e) {
+        lastError = e.what();
+    }
+    catch (...) {
+        lastError = "Unknown error";
+    }
+    return failed;
+}
+
+static Board& boardOf(ClampBoard* board) {
+    if (!board || !board->board) {
+        throw invalid_argument("No board");
+    }
+    return *board->board;
+}
+
+static ChipChannelList toChannelList(const int* chips, const int* channels, int numChannels) {
+    ChipChannelList channelList;
+    for (int i = 0; i < numChannels; i++) {
+        if (chips[i] < 0 || chips[i] >= static_cast<int>(MAX_NUM_CHIPS) || channels[i] < 0 || channels[i] >= static_cast<int>(MAX_NUM_CHANNELS)) {
+            throw invalid_argument("Channel out of range");
+        }
+        channelList.push_back(ChipChannel(chips[i], channels[i]));
+    }
+    return channelList;
+}
+
+template <typename T>
+static int64_t exposeVector(const vector<T>& v, const T** data) {
+    *data = v.data();
+    return static_cast<int64_t>(v.size());
+}
+
+const char* clamp_last_error(void) {
+    return lastError.c_str();
+}
+
+int clamp_sample_bytes(void) {
+    return static_cast<int>(sizeof(Sample));
+}
+
+//------------------------------------------------------------------------------
+
+ClampBoard* clamp_board_open(int simulate, const char* dllPath, const char* bitfilePath, const char* serialNumber) {
+    return guard<ClampBoard*>(nullptr, [&]() {
+        unique_ptr<ClampBoard> handle(new ClampBoard());
+        if (simulate) {
+            SimulatedBoard* simulatedBoard = new SimulatedBoard();
+            handle->board.reset(new Board(unique_ptr<OpalKellyBoard>(simulatedBoard)));
+            simulatedBoard->attach(*handle->board, unique_ptr<PacketSource>(new ModelCellSource(*handle->board)));
+        }
+        else {
+            handle->board.reset(new Board());
+        }
+        if (!handle->board->open(dllPath ? dllPath : "", bitfilePath ? bitfilePath : "", serialNumber ? serialNumber : "")) {
+            throw runtime_error("Intan Technologies CLAMP Controller not found on any USB port.");
+        }
+        return handle.release();
+    });
+}
+
+void clamp_board_close(ClampBoard* board) {
+    delete board;
+}
+
+/// Fills chips and channels with up to maxChannels present channels; returns the number of present channels
+int clamp_board_present_channels(ClampBoard* board, int* chips, int* channels, int maxChannels) {
+    return guard(-1, [&]() {
+        ChipChannelList present = boardOf(board).getPresentChannels();
+        for (int i = 0; i < maxChannels && i < static_cast<int>(present.size()); i++) {
+            chips[i] = present[i].chip;
+            channels[i] = present[i].channel;
+        }
+        return static_cast<int>(present.size());
+    });
+}
+
+int clamp_board_enable_channels(ClampBoard* board, const int* chips, const int* channels, int numChannels) {
+    return guard(-1, [&]() {
+        boardOf(board).enableChannels(toChannelList(chips, channels, numChannels), true);
+        return 0;
+    });
+}
+
+int clamp_board_set_data_transfer(ClampBoard* board, const int adcs[8], int digin, int digout) {
+    return guard(-1, [&]() {
+        bool transfer[8];
+        for (unsigned int i = 0; i < 8; i++) {
+            transfer[i] = adcs[i] != 0;
+        }
+        boardOf(board).setDataTransfer(transfer, digin != 0, digout != 0);
+        return 0;
+    });
+}
+
+double clamp_board_sampling_rate(ClampBoard* board) {
+    return guard(-1.0, [&]() { return boardOf(board).getSamplingRateHz(); });
+}
+
+int clamp_board_num_timesteps(ClampBoard* board, int chip) {
+    return guard(-1, [&]() { return static_cast<int>(boardOf(board).getNumTimesteps(chip)); });
+}
+
+int clamp_board_run_continuously(ClampBoard* board) {
+    return guard(-1, [&]() { boardOf(board).runContinuously(); return 0; });
+}
+
+int clamp_board_run_fixed(ClampBoard* board, uint32_t numTimesteps) {
+    return guard(-1, [&]() { boardOf(board).runFixed(numTimesteps); return 0; });
+}
+
+/// Stops the board and discards whatever is left in its FIFO
+int clamp_board_stop(ClampBoard* board) {
+    return guard(-1, [&]() {
+        boardOf(board).stop();
+        boardOf(board).flush();
+        return 0;
+    });
+}
+
+int clamp_board_start_reader_thread(ClampBoard* board) {
+    return guard(-1, [&]() { boardOf(board).startReaderThread(); return 0; });
+}
+
+int clamp_board_stop_reader_thread(ClampBoard* board) {
+    return guard(-1, [&]() { boardOf(board).stopReaderThread(); return 0; });
+}
+
+/// Board::read; returns the number of packets read
+int64_t clamp_board_read(ClampBoard* board, unsigned int numPackets) {
+    return guard<int64_t>(-1, [&]() { return static_cast<int64_t>(boardOf(board).read(numPackets)); });
+}
+
+int clamp_board_blocking_read(ClampBoard* board, unsigned int numPackets) {
+    return guard(-1, [&]() { boardOf(board).blockingRead(numPackets); return 0; });
+}
+
+double clamp_board_fifo_percentage_full(ClampBoard* board) {
+    return guard(-1.0, [&]() { return boardOf(board).fifoMonitor.getLatest().percentageFull; });
+}
+
+//------------------------------------------------------------------------------
+
+int clamp_readqueue_clear(ClampBoard* board, int filtersToo) {
+    return guard(-1, [&]() { boardOf(board).readQueue.clear(filtersToo != 0); return 0; });
+}
+
+int64_t clamp_readqueue_timestamps(ClampBoard* board, const uint32_t** data) {
+    return guard<int64_t>(-1, [&]() { return exposeVector(boardOf(board).readQueue.getTimeStamps(), data); });
+}
+
+int64_t clamp_readqueue_digins(ClampBoard* board, const uint16_t** data) {
+    return guard<int64_t>(-1, [&]() { return exposeVector(boardOf(board).readQueue.getDigIns(), data); });
+}
+
+int64_t clamp_readqueue_digouts(ClampBoard* board, const uint16_t** data) {
+    return guard<int64_t>(-1, [&]() { return exposeVector(boardOf(board).readQueue.getDigOuts(), data); });
+}
+
+int64_t clamp_readqueue_adc(ClampBoard* board, int adc, const uint16_t** data) {
+    return guard<int64_t>(-1, [&]() {
+        const vector<vector<uint16_t>>& adcs = boardOf(board).readQueue.getADCs();
+        if (adc < 0 || adc >= static_cast<int>(adcs.size())) {
+            throw invalid_argument("ADC index out of range");
+        }
+        return exposeVector(adcs[adc], data);
+    });
+}
+
+int64_t clamp_readqueue_samples(ClampBoard* board, int chip, int channel, int quantity, const void** data) {
+    return guard<int64_t>(-1, [&]() {
+        ChipChannel index = toChannelList(&chip, &channel, 1).front();
+        ReadQueue& readQueue = boardOf(board).readQueue;
+        const vector<Sample>* samples;
+        switch (quantity) {
+        case Board::MEASURED_CURRENT: samples = &readQueue.getMeasuredCurrents(index); break;
+        case Board::MEASURED_VOLTAGE: samples = &readQueue.getMeasuredVoltages(index); break;
+        case Board::CLAMP_VOLTAGE: samples = &readQueue.getClampVoltages(index); break;
+        case Board::CLAMP_CURRENT: samples = &readQueue.getClampCurrents(index); break;
+        case Board::MUX_VOLTAGE: samples = &readQueue.getMuxData(index); break;
+        default: throw invalid_argument("Unknown sample quantity");
+        }
+        *data = samples->data();
+        return static_cast<int64_t>(samples->size());
+    });
+}
+
+//------------------------------------------------------------------------------
+
+/// Full calibration, in the order the GUI does it
+int clamp_controller_calibrate(ClampBoard* board, const int* chips, const int* channels, int numChannels) {
+    return guard(-1, [&]() {
+        ChipChannelList channelList = toChannelList(chips, channels, numChannels);
+        ClampController& controller = boardOf(board).controller;
+        controller.voltageAmplifier.calibrate(channelList);
+        controller.differenceAmplifier.calibrate1(channelList);
+        controller.clampVoltageGenerator.calibrate(channelList);
+        controller.differenceAmplifier.calibrate2(channelList);
+        controller.currentToVoltageConverter.calibrate(channelList);
+        controller.clampCurrentGenerator.searchCandidatesPerStep = 3;
+        controller.clampCurrentGenerator.calibrate(channelList);
+        return 0;
+    });
+}
+
+/** Builds a SimplifiedWaveform from one array per WaveformSegment field (values are appliedDiscreteValue), loads it for
+ *  the given channels, and sends the commands to the FPGA.
+ */
+int clamp_controller_apply_waveform(ClampBoard* board, const int* chips, const int* channels, int numChannels,
+                                    int isVoltageClamp, double stepSize, double offset, double interval,
+                                    const int* values, const unsigned int* numTimesteps, const unsigned int* waveformNumbers,
+                                    const unsigned int* tOffsets, const int* markerOut, const int* digOut, int numSegments) {
+    return guard(-1, [&]() {
+        ChipChannelList channelList = toChannelList(chips, channels, numChannels);
+        SimplifiedWaveform waveform;
+        for (int i = 0; i < numSegments; i++) {
+            if (numTimesteps[i] == 0) {
+                throw invalid_argument("Waveform segments must be at least one timestep long");
+            }
+            waveform.push_back(WaveformSegment(waveformNumbers[i], values[i], numTimesteps[i], tOffsets[i], markerOut[i] != 0, digOut[i] != 0));
+        }
+        waveform.setStepSize(stepSize, offset);
+        waveform.interval = interval;
+
+        Board& b = boardOf(board);
+        b.enableChannels(channelList, true);
+        b.controller.simplifiedWaveformToWaveform(channelList, isVoltageClamp != 0, waveform);
+        b.commandsToFPGA();
+        return 0;
+    });
+}
+
+//------------------------------------------------------------------------------
+
+ClampSaveFile* clamp_savefile_open(const char* path) {
+    return guard<ClampSaveFile*>(nullptr, [&]() {
+        unique_ptr<ClampSaveFile> file(new ClampSaveFile());
+        file->reader.open(toFileName(path));
+        return file.release();
+    });
+}
+
+void clamp_savefile_close(ClampSaveFile* file) {
+    delete file;
+}
+
+int clamp_savefile_info(ClampSaveFile* file, int* isAux, int* isCompact, int* isChunked, double* samplingRate,
+                        double* measuredScale, double* measuredOffset, double* clampScale, int64_t* numRecords, int64_t* numChunks) {
+    return guard(-1, [&]() {
+        const SaveFileReader& reader = file->reader;
+        *isAux = reader.isAux;
+        *isCompact = reader.isCompact;
+        *isChunked = reader.isChunked;
+        *samplingRate = reader.samplingRate;
+        *measuredScale = reader.compactScaling.measuredScale;
+        *measuredOffset = reader.compactScaling.measuredOffset;
+        *clampScale = reader.compactScaling.clampScale;
+        *numRecords = static_cast<int64_t>(reader.numRecords());
+        *numChunks = static_cast<int64_t>(reader.numChunks());
+        return 0;
+    });
+}
+
+template <typename T>
+static int64_t exposeView(const RecordView<T>& view, const void** data, int64_t* stride) {
+    *data = view.data();
+    *stride = static_cast<int64_t>(view.stride());
+    return static_cast<int64_t>(view.size());
+}
+
+/// One field of every record, in place; returns the number of records
+int64_t clamp_savefile_field(ClampSaveFile* file, const char* field, const void** data, int64_t* stride) {
+    return guard<int64_t>(-1, [&]() {
+        const SaveFileReader& reader = file->reader;
+        string name = field;
+        if (name == "timestamps") return exposeView(reader.timestamps(), data, stride);
+        if (name == "applied") return exposeView(reader.applied(), data, stride);
+        if (name == "clamp") return exposeView(reader.clampValues(), data, stride);
+        if (name == "measured") return exposeView(reader.measured(), data, stride);
+        if (name == "measured_codes") return exposeView(reader.measuredCodes(), data, stride);
+        if (name == "clamp_codes") return exposeView(reader.clampCodes(), data, stride);
+        if (name == "digins") return exposeView(reader.digIns(), data, stride);
+        if (name == "digouts") return exposeView(reader.digOuts(), data, stride);
+        if (name.size() == 4 && name.compare(0, 3, "adc") == 0 && name[3] >= '0' && name[3] <= '7') {
+            return exposeView(reader.adc(name[3] - '0'), data, stride);
+        }
+        throw invalid_argument("Unknown save file field " + name);
+    });
+}
+
+/// Decodes one chunk of a chunked file; the columns stay valid until the next call or the file is closed
+int64_t clamp_savefile_read_chunk(ClampSaveFile* file, int64_t index, const uint32_t** timestamps,
+                                  const int32_t** measuredCodes, const int16_t** clampCodes) {
+    return guard<int64_t>(-1, [&]() {
+        if (index < 0 || index >= static_cast<int64_t>(file->reader.numChunks())) {
+            throw invalid_argument("Chunk index out of range");
+        }
+        file->reader.readChunk(static_cast<std::size_t>(index), file->chunk);
+        *timestamps = file->chunk.timestamps.data();
+        *measuredCodes = file->chunk.measuredCodes.data();
+        *clampCodes = file->chunk.clampCodes.data();
+        return static_cast<int64_t>(file->chunk.size());
+    });
+}
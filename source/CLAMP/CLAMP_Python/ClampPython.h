@@ -0,0 +1,79 @@
+#pragma once
+
+/* Plain C interface to CLAMP_API, for clamp.py (which loads it with ctypes) and other languages' foreign function
+ * interfaces.
+ *
+ * Functions that can fail return a negative number or null, and clamp_last_error() then describes the failure.  Arrays
+ * are returned as a pointer and a length into the library's own memory, so callers can wrap them without copying:
+ *  - clamp_readqueue_* arrays point into Board::readQueue, and are only valid until the next read or clear.
+ *  - clamp_savefile_* arrays point into the memory-mapped file, and are valid until the file is closed.  Their elements
+ *    are stride bytes apart and not necessarily aligned.
+ *
+ * Nothing here holds on to the caller's thread; ctypes releases the GIL for the duration of every call.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define CLAMP_C_API __declspec(dllexport)
+#else
+#define CLAMP_C_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ClampBoard ClampBoard;
+typedef struct ClampSaveFile ClampSaveFile;
+
+CLAMP_C_API const char* clamp_last_error(void);
+/* sizeof(CLAMP::Sample): 4 or 8, depending on CLAMP_SINGLE_PRECISION_SAMPLES */
+CLAMP_C_API int clamp_sample_bytes(void);
+
+/* Board */
+CLAMP_C_API ClampBoard* clamp_board_open(int simulate, const char* dllPath, const char* bitfilePath, const char* serialNumber);
+CLAMP_C_API void clamp_board_close(ClampBoard* board);
+CLAMP_C_API int clamp_board_present_channels(ClampBoard* board, int* chips, int* channels, int maxChannels);
+CLAMP_C_API int clamp_board_enable_channels(ClampBoard* board, const int* chips, const int* channels, int numChannels);
+CLAMP_C_API int clamp_board_set_data_transfer(ClampBoard* board, const int adcs[8], int digin, int digout);
+CLAMP_C_API double clamp_board_sampling_rate(ClampBoard* board);
+CLAMP_C_API int clamp_board_num_timesteps(ClampBoard* board, int chip);
+CLAMP_C_API int clamp_board_run_continuously(ClampBoard* board);
+CLAMP_C_API int clamp_board_run_fixed(ClampBoard* board, uint32_t numTimesteps);
+CLAMP_C_API int clamp_board_stop(ClampBoard* board);
+CLAMP_C_API int clamp_board_start_reader_thread(ClampBoard* board);
+CLAMP_C_API int clamp_board_stop_reader_thread(ClampBoard* board);
+CLAMP_C_API int64_t clamp_board_read(ClampBoard* board, unsigned int numPackets);
+CLAMP_C_API int clamp_board_blocking_read(ClampBoard* board, unsigned int numPackets);
+CLAMP_C_API double clamp_board_fifo_percentage_full(ClampBoard* board);
+
+/* Board::readQueue.  quantity is a CLAMP::Board::SampleQuantity. */
+CLAMP_C_API int clamp_readqueue_clear(ClampBoard* board, int filtersToo);
+CLAMP_C_API int64_t clamp_readqueue_timestamps(ClampBoard* board, const uint32_t** data);
+CLAMP_C_API int64_t clamp_readqueue_digins(ClampBoard* board, const uint16_t** data);
+CLAMP_C_API int64_t clamp_readqueue_digouts(ClampBoard* board, const uint16_t** data);
+CLAMP_C_API int64_t clamp_readqueue_adc(ClampBoard* board, int adc, const uint16_t** data);
+CLAMP_C_API int64_t clamp_readqueue_samples(ClampBoard* board, int chip, int channel, int quantity, const void** data);
+
+/* Board::controller */
+CLAMP_C_API int clamp_controller_calibrate(ClampBoard* board, const int* chips, const int* channels, int numChannels);
+CLAMP_C_API int clamp_controller_apply_waveform(ClampBoard* board, const int* chips, const int* channels, int numChannels,
+                                                int isVoltageClamp, double stepSize, double offset, double interval,
+                                                const int* values, const unsigned int* numTimesteps, const unsigned int* waveformNumbers,
+                                                const unsigned int* tOffsets, const int* markerOut, const int* digOut, int numSegments);
+
+/* SaveFileReader.  field is one of "timestamps", "applied", "clamp", "measured", "measured_codes", "clamp_codes",
+ * "digins", "digouts", or "adc0".."adc7".  For chunked files use clamp_savefile_read_chunk instead. */
+CLAMP_C_API ClampSaveFile* clamp_savefile_open(const char* path);
+CLAMP_C_API void clamp_savefile_close(ClampSaveFile* file);
+CLAMP_C_API int clamp_savefile_info(ClampSaveFile* file, int* isAux, int* isCompact, int* isChunked, double* samplingRate,
+                                    double* measuredScale, double* measuredOffset, double* clampScale, int64_t* numRecords, int64_t* numChunks);
+CLAMP_C_API int64_t clamp_savefile_field(ClampSaveFile* file, const char* field, const void** data, int64_t* stride);
+CLAMP_C_API int64_t clamp_savefile_read_chunk(ClampSaveFile* file, int64_t index, const uint32_t** timestamps,
+                                              const int32_t** measuredCodes, const int16_t** clampCodes);
+
+#ifdef __cplusplus
+}
+#endif
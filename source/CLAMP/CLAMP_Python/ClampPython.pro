@@ -0,0 +1,53 @@
+# Shared library with a plain C interface to CLAMP_API, for the Python bindings in clamp.py.  Links the CLAMP_API
+# library, so it doesn't need Qt.
+INCLUDEPATH += ../CLAMP_API ../../Common ../../OpalKelly
+
+unix:QMAKE_CXXFLAGS += -std=c++11 -fvisibility=hidden
+
+win32:CONFIG(release, debug|release): CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API/release
+else:win32:CONFIG(debug, debug|release): CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API/debug
+else: CLAMP_API_DIR = $$OUT_PWD/../CLAMP_API
+
+LIBS += -L$$CLAMP_API_DIR -lCLAMP_API
+unix:LIBS += -ldl -lpthread
+win32:LIBS += -lws2_32
+# MMCSS, for real-time thread priority
+win32:LIBS += -lavrt
+linux-g++:LIBS += -lrt
+win32:PRE_TARGETDEPS += $$CLAMP_API_DIR/CLAMP_API.lib
+else:PRE_TARGETDEPS += $$CLAMP_API_DIR/libCLAMP_API.a
+
+# HDF5, if the library was built with CONFIG+=clamp_hdf5 for NWB save files (see CLAMP_API.pri)
+clamp_hdf5 {
+    win32:LIBS += -L$$HDF5_DIR/lib -lhdf5
+    else {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += hdf5
+    }
+}
+
+# clamp.py looks for libClampPython.so / ClampPython.dll next to itself
+TARGET = ClampPython
+
+TEMPLATE = lib
+
+# No version number in the file name
+CONFIG += plugin
+CONFIG -= qt
+
+# Must match the setting the CLAMP_API library was built with
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
+
+HEADERS += \
+    ClampPython.h
+
+SOURCES += \
+    ClampPython.cpp
+
+# The FPGA bitfile, Opal Kelly library, and Python module go next to the library
+linux-g++ {
+	EXTRA_BINFILES += $$PWD/../FPGA/main.bit $$PWD/../../OpalKelly/"Opal Kelly library files/Linux 64-bit/libokFrontPanel.so" $$PWD/clamp.py
+	for(FILE, EXTRA_BINFILES){
+		QMAKE_PRE_LINK += $$quote($(COPY_FILE) \"$${FILE}\" ./ $$escape_expand(\\n\\t))
+	}
+}
@@ -0,0 +1,304 @@
+"""Python bindings for CLAMP_API: Board, its controller, and SaveFileReader.
+
+Loads libClampPython.so (ClampPython.dll on Windows) from the same directory via ctypes; see ClampPython.h.  Data
+comes back as NumPy arrays that wrap the library's memory rather than copies of it:
+
+  - Board.timestamps(), Board.samples(), ... wrap the vectors in Board::readQueue.  They're only valid until the next
+    read() or clear(); call .copy() on anything that must outlive that.
+  - SaveFile fields wrap the memory-mapped file, and are valid until the SaveFile is closed.
+
+ctypes releases the GIL for every call into the library, so read() and blocking_read() let other Python threads run
+while they wait for the board.
+
+Typical use:
+
+    import clamp
+    with clamp.Board(simulate=True) as board:
+        channels = board.present_channels()
+        board.apply_waveform(channels, [(0, 20000)], step_size=2.5e-3)
+        board.run_continuously()
+        for _ in range(10):
+            board.read(board.num_timesteps(channels[0][0]))
+            currents = board.samples(channels[0], clamp.MEASURED_CURRENT).copy()
+            board.clear()
+        board.stop()
+
+    with clamp.SaveFile("recording_0_0.clp") as f:
+        t, i = f.field("timestamps"), f.measured()
+"""
+
+import ctypes
+import os
+import sys
+
+import numpy as np
+
+# Board::SampleQuantity
+MEASURED_CURRENT = 0
+MEASURED_VOLTAGE = 1
+CLAMP_VOLTAGE = 2
+CLAMP_CURRENT = 3
+MUX_VOLTAGE = 4
+
+_c_int_p = ctypes.POINTER(ctypes.c_int)
+_c_uint_p = ctypes.POINTER(ctypes.c_uint)
+_c_int64_p = ctypes.POINTER(ctypes.c_int64)
+_c_double_p = ctypes.POINTER(ctypes.c_double)
+_c_void_pp = ctypes.POINTER(ctypes.c_void_p)
+
+
+def _load():
+    name = "ClampPython.dll" if sys.platform == "win32" else "libClampPython.so"
+    lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), name))
+
+    def declare(function, restype, *argtypes):
+        f = getattr(lib, function)
+        f.restype = restype
+        f.argtypes = argtypes
+
+    board, savefile = ctypes.c_void_p, ctypes.c_void_p
+    declare("clamp_last_error", ctypes.c_char_p)
+    declare("clamp_sample_bytes", ctypes.c_int)
+    declare("clamp_board_open", board, ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p)
+    declare("clamp_board_close", None, board)
+    declare("clamp_board_present_channels", ctypes.c_int, board, _c_int_p, _c_int_p, ctypes.c_int)
+    declare("clamp_board_enable_channels", ctypes.c_int, board, _c_int_p, _c_int_p, ctypes.c_int)
+    declare("clamp_board_set_data_transfer", ctypes.c_int, board, _c_int_p, ctypes.c_int, ctypes.c_int)
+    declare("clamp_board_sampling_rate", ctypes.c_double, board)
+    declare("clamp_board_num_timesteps", ctypes.c_int, board, ctypes.c_int)
+    declare("clamp_board_run_continuously", ctypes.c_int, board)
+    declare("clamp_board_run_fixed", ctypes.c_int, board, ctypes.c_uint32)
+    declare("clamp_board_stop", ctypes.c_int, board)
+    declare("clamp_board_start_reader_thread", ctypes.c_int, board)
+    declare("clamp_board_stop_reader_thread", ctypes.c_int, board)
+    declare("clamp_board_read", ctypes.c_int64, board, ctypes.c_uint)
+    declare("clamp_board_blocking_read", ctypes.c_int, board, ctypes.c_uint)
+    declare("clamp_board_fifo_percentage_full", ctypes.c_double, board)
+    declare("clamp_readqueue_clear", ctypes.c_int, board, ctypes.c_int)
+    declare("clamp_readqueue_timestamps", ctypes.c_int64, board, _c_void_pp)
+    declare("clamp_readqueue_digins", ctypes.c_int64, board, _c_void_pp)
+    declare("clamp_readqueue_digouts", ctypes.c_int64, board, _c_void_pp)
+    declare("clamp_readqueue_adc", ctypes.c_int64, board, ctypes.c_int, _c_void_pp)
+    declare("clamp_readqueue_samples", ctypes.c_int64, board, ctypes.c_int, ctypes.c_int, ctypes.c_int, _c_void_pp)
+    declare("clamp_controller_calibrate", ctypes.c_int, board, _c_int_p, _c_int_p, ctypes.c_int)
+    declare("clamp_controller_apply_waveform", ctypes.c_int, board, _c_int_p, _c_int_p, ctypes.c_int,
+            ctypes.c_int, ctypes.c_double, ctypes.c_double, ctypes.c_double,
+            _c_int_p, _c_uint_p, _c_uint_p, _c_uint_p, _c_int_p, _c_int_p, ctypes.c_int)
+    declare("clamp_savefile_open", savefile, ctypes.c_char_p)
+    declare("clamp_savefile_close", None, savefile)
+    declare("clamp_savefile_info", ctypes.c_int, savefile, _c_int_p, _c_int_p, _c_int_p, _c_double_p,
+            _c_double_p, _c_double_p, _c_double_p, _c_int64_p, _c_int64_p)
+    declare("clamp_savefile_field", ctypes.c_int64, savefile, ctypes.c_char_p, _c_void_pp, _c_int64_p)
+    declare("clamp_savefile_read_chunk", ctypes.c_int64, savefile, ctypes.c_int64, _c_void_pp, _c_void_pp, _c_void_pp)
+    return lib
+
+
+_lib = _load()
+SAMPLE_DTYPE = np.dtype(np.float32 if _lib.clamp_sample_bytes() == 4 else np.float64)
+
+
+def _check(result):
+    if result < 0:
+        raise RuntimeError(_lib.clamp_last_error().decode(errors="replace"))
+    return result
+
+
+def _wrap(address, count, dtype, stride=None):
+    """Read-only NumPy view of count elements at address, without copying."""
+    dtype = np.dtype(dtype)
+    if count == 0:
+        return np.empty(0, dtype)
+    stride = dtype.itemsize if stride is None else stride
+    span = (count - 1) * stride + dtype.itemsize
+    buffer = (ctypes.c_char * span).from_address(address)
+    array = np.ndarray((count,), dtype, buffer, 0, (stride,))
+    array.flags.writeable = False
+    return array
+
+
+def _channel_arrays(channels):
+    chips = (ctypes.c_int * len(channels))(*[chip for chip, _ in channels])
+    numbers = (ctypes.c_int * len(channels))(*[channel for _, channel in channels])
+    return chips, numbers, len(channels)
+
+
+class Board:
+    """A CLAMP evaluation board (or, with simulate=True, a SimulatedBoard with a model cell on each channel).
+
+    Channels are (chip, channel) tuples.
+    """
+
+    def __init__(self, simulate=False, dll_path="", bitfile_path="", serial_number=""):
+        self._handle = _lib.clamp_board_open(int(simulate), dll_path.encode(), bitfile_path.encode(), serial_number.encode())
+        if not self._handle:
+            raise RuntimeError(_lib.clamp_last_error().decode(errors="replace"))
+
+    def close(self):
+        if self._handle:
+            _lib.clamp_board_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    # Board
+
+    def present_channels(self):
+        chips, numbers = (ctypes.c_int * 64)(), (ctypes.c_int * 64)()
+        n = _check(_lib.clamp_board_present_channels(self._handle, chips, numbers, 64))
+        return [(chips[i], numbers[i]) for i in range(min(n, 64))]
+
+    def enable_channels(self, channels):
+        _check(_lib.clamp_board_enable_channels(self._handle, *_channel_arrays(channels)))
+
+    def set_data_transfer(self, adcs=(False,) * 8, digin=False, digout=False):
+        _check(_lib.clamp_board_set_data_transfer(self._handle, (ctypes.c_int * 8)(*[int(a) for a in adcs]), int(digin), int(digout)))
+
+    def sampling_rate(self):
+        return _lib.clamp_board_sampling_rate(self._handle)
+
+    def num_timesteps(self, chip):
+        """Length of the chip's waveform, in timesteps."""
+        return _check(_lib.clamp_board_num_timesteps(self._handle, chip))
+
+    def run_continuously(self):
+        _check(_lib.clamp_board_run_continuously(self._handle))
+
+    def run_fixed(self, num_timesteps):
+        _check(_lib.clamp_board_run_fixed(self._handle, num_timesteps))
+
+    def stop(self):
+        _check(_lib.clamp_board_stop(self._handle))
+
+    def start_reader_thread(self):
+        _check(_lib.clamp_board_start_reader_thread(self._handle))
+
+    def stop_reader_thread(self):
+        _check(_lib.clamp_board_stop_reader_thread(self._handle))
+
+    def read(self, num_packets):
+        """Board::read: waits for and decodes num_packets timesteps into the read queue; returns the number read."""
+        return _check(_lib.clamp_board_read(self._handle, num_packets))
+
+    def blocking_read(self, num_packets):
+        _check(_lib.clamp_board_blocking_read(self._handle, num_packets))
+
+    def fifo_percentage_full(self):
+        return _lib.clamp_board_fifo_percentage_full(self._handle)
+
+    # Read queue; the arrays are only valid until the next read() or clear()
+
+    def clear(self, filters_too=False):
+        _check(_lib.clamp_readqueue_clear(self._handle, int(filters_too)))
+
+    def _column(self, function, dtype, *args):
+        data = ctypes.c_void_p()
+        n = _check(function(self._handle, *args, ctypes.byref(data)))
+        return _wrap(data.value, n, dtype)
+
+    def timestamps(self):
+        return self._column(_lib.clamp_readqueue_timestamps, np.uint32)
+
+    def digins(self):
+        return self._column(_lib.clamp_readqueue_digins, np.uint16)
+
+    def digouts(self):
+        return self._column(_lib.clamp_readqueue_digouts, np.uint16)
+
+    def adc(self, index):
+        return self._column(_lib.clamp_readqueue_adc, np.uint16, index)
+
+    def samples(self, channel, quantity=MEASURED_CURRENT):
+        """One channel's samples of the given quantity (MEASURED_CURRENT, CLAMP_VOLTAGE, ...)."""
+        return self._column(_lib.clamp_readqueue_samples, SAMPLE_DTYPE, channel[0], channel[1], quantity)
+
+    # Controller
+
+    def calibrate(self, channels):
+        """Full calibration of the given channels, in the order the GUI does it."""
+        _check(_lib.clamp_controller_calibrate(self._handle, *_channel_arrays(channels)))
+
+    def apply_waveform(self, channels, segments, step_size, offset=0.0, voltage_clamp=True, interval=0.0):
+        """Loads a SimplifiedWaveform on the given channels and sends it to the FPGA.
+
+        segments is a list of (value, num_timesteps) or (value, num_timesteps, waveform_number, t_offset, marker_out,
+        dig_out) tuples; value is the discrete value applied to the chip, and step_size converts it to volts (or
+        amperes, in current clamp).
+        """
+        full = [tuple(s) + (0, 0, False, False)[len(s) - 2:] for s in segments]
+        n = len(full)
+
+        def column(ctype, index):
+            return (ctype * n)(*[int(s[index]) for s in full])
+
+        _check(_lib.clamp_controller_apply_waveform(
+            self._handle, *_channel_arrays(channels), int(voltage_clamp), step_size, offset, interval,
+            column(ctypes.c_int, 0), column(ctypes.c_uint, 1), column(ctypes.c_uint, 2), column(ctypes.c_uint, 3),
+            column(ctypes.c_int, 4), column(ctypes.c_int, 5), n))
+
+
+class SaveFile:
+    """A CLAMP save file (headstage or aux), memory-mapped by SaveFileReader.
+
+    field() returns one field of every record as a strided, read-only view of the mapping.  Compact files store
+    codes; measured() and clamp_values() convert them (which does copy).  Chunked files are read with chunk().
+    """
+
+    def __init__(self, path):
+        self._handle = _lib.clamp_savefile_open(os.fsencode(path))
+        if not self._handle:
+            raise RuntimeError(_lib.clamp_last_error().decode(errors="replace"))
+        ints = [ctypes.c_int() for _ in range(3)]
+        doubles = [ctypes.c_double() for _ in range(4)]
+        counts = [ctypes.c_int64() for _ in range(2)]
+        _check(_lib.clamp_savefile_info(self._handle, *[ctypes.byref(v) for v in ints + doubles + counts]))
+        self.is_aux, self.is_compact, self.is_chunked = (bool(v.value) for v in ints)
+        self.sampling_rate, self.measured_scale, self.measured_offset, self.clamp_scale = (v.value for v in doubles)
+        self.num_records, self.num_chunks = (v.value for v in counts)
+
+    def close(self):
+        """Closes the file; arrays returned by field() must not be used afterwards."""
+        if self._handle:
+            _lib.clamp_savefile_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    _DTYPES = {"timestamps": np.uint32, "applied": np.float32, "clamp": np.float32, "measured": np.float32,
+               "measured_codes": np.int32, "clamp_codes": np.int16, "digins": np.uint16, "digouts": np.uint16}
+
+    def field(self, name):
+        """One field of every record, in place: timestamps, applied, clamp, measured, measured_codes, clamp_codes,
+        digins, digouts, or adc0..adc7."""
+        data, stride = ctypes.c_void_p(), ctypes.c_int64()
+        n = _check(_lib.clamp_savefile_field(self._handle, name.encode(), ctypes.byref(data), ctypes.byref(stride)))
+        return _wrap(data.value, n, self._DTYPES.get(name, np.uint16), stride.value)
+
+    def measured(self):
+        if self.is_compact:
+            return self.field("measured_codes") * self.measured_scale + self.measured_offset
+        return self.field("measured")
+
+    def clamp_values(self):
+        if self.is_compact:
+            return self.field("clamp_codes") * self.clamp_scale
+        return self.field("clamp")
+
+    def chunk(self, index):
+        """Decodes one chunk of a chunked file; returns copies of its (timestamps, measured codes, clamp codes)."""
+        t, m, c = ctypes.c_void_p(), ctypes.c_void_p(), ctypes.c_void_p()
+        n = _check(_lib.clamp_savefile_read_chunk(self._handle, index, ctypes.byref(t), ctypes.byref(m), ctypes.byref(c)))
+        return _wrap(t.value, n, np.uint32).copy(), _wrap(m.value, n, np.int32).copy(), _wrap(c.value, n, np.int16).copy()
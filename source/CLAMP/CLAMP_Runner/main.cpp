@@ -0,0 +1,981 @@
+// Headless recording: calibrates the attached headstages (or reuses the GUI's saved calibration), holds every present
+// channel at a fixed voltage, and saves what it measures until the time is up or Ctrl-C is pressed.  Needs only the
+// CLAMP_API library, so it can run on acquisition machines without Qt.
+//
+// Usage: ClampRunner [--seconds s] [--output base] [--holding mV] [--format float|compact|chunked|nwb] [--async]
+//                    [--recalibrate] [--simulate] [--stream port] [--multicast group:port] [--shared-memory name]
+//                    [--iv first:last:step] [--interval s] [--leak-subtract n] [--realtime] [--reader-cpu n]
+//                    [--dynamic-clamp nS:mV] [--seal-test mV] [--tune-capacitance mV] [--track-cell mV]
+//                    [--noise-spectrum] [--detect-events criterion] [--rollover-mb n] [--rollover-minutes m] [--direct-io]
+//                    [--multiplex] [--journal s] [--sweep-index] [--reload-fpga] [--decimate n] [--host-delays ms[,ms...]]
+//
+// Each channel is saved to <base>_<chip>_<channel>.clp (.nwb with --format nwb, in builds with HDF5; see
+// CLAMP::IO::NWBFile).  --seconds 0 (the default) records until Ctrl-C.
+// --rollover-mb and --rollover-minutes split each channel's recording into segments of at most n MB or m minutes,
+// <base>_<chip>_<channel>_seg0001.clp and so on, each preallocated on disk, and list them in
+// <base>_<chip>_<channel>_manifest.csv (see CLAMP::IO::SaveFile::setRollover()).
+// --direct-io writes .clp files in large aligned blocks that bypass the operating system's file cache (see
+// CLAMP::IO::DirectFileOutStream); with --async, the blocks are written in the background.
+// --multiplex saves every channel, with the ADCs and digital I/O, to the one file <base>.clp while holding, instead of a
+// file per channel (see CLAMP::IO::MultiplexedSaveFile); its records are always floating point, whatever --format.
+// --journal writes each .clp file as a journal with a checkpoint every s seconds (see CLAMP::IO::SaveFile::setJournal()),
+// so if the program crashes, ClampConvert can recover the recording up to the last checkpoint.
+// --sweep-index writes <file>_sweeps.csv next to each .clp file, listing where each sweep (each --iv sweep, or each
+// repetition of the holding waveform) starts, with its measured minimum, maximum and mean, and a summary (baseline,
+// noise, peak, steady state, and cell parameters) calculated as it's recorded (see CLAMP::IO::SaveFile::setSweepIndex()).
+// --stream publishes each channel's measured current and clamp voltage, and the digital I/O, on a TCP port (see
+// CLAMP::IO::StreamFramer for the format); --multicast sends the same frames to a UDP multicast group, and
+// --shared-memory writes them to a CLAMP::IO::SharedMemoryRing for other processes on this computer.
+//
+// --iv runs an I-V family instead of holding: one sweep per step from first to last mV, each starting --interval s
+// (default 1) after the previous one, timed by the board (see CLAMP::ProtocolRunner).  It runs once, unless
+// --seconds asks for more.  --leak-subtract n adds P/-N leak subtraction: n sub-pulses of -1/n the amplitude run before
+// each sweep (see CLAMP::LeakSubtractor), and each sweep, less the scaled-up sub-pulse response, is also saved to
+// <base>_<chip>_<channel>_leaksub.clp as soon as it's read.
+//
+// --realtime runs the USB reader thread at real-time priority (SCHED_FIFO, which needs CAP_SYS_NICE or an rtprio limit,
+// or MMCSS on Windows), and --reader-cpu pins it to a core, so other activity on the machine can't stall the reads.
+//
+// --dynamic-clamp g:E puts the first channel in current clamp and injects a conductance of g nS reversing at E mV (see
+// CLAMP::DynamicClamp), saving its membrane voltage and injected current, then reports the loop latency.  --realtime
+// applies to the dynamic clamp loop, which does its own reads.
+//
+// --seal-test a loops a 5 ms + 5 ms test pulse of a mV from --holding on every channel (see CLAMP::SealTest) and logs
+// each channel's resistance 10 times a second, for --seconds (or until Ctrl-C).  Nothing is saved.
+//
+// --tune-capacitance a sets every channel's fast transient capacitive compensation automatically, with a looped 1 ms +
+// 1 ms test pulse of a mV from --holding (see CLAMP::CapacitanceTuner), and logs the magnitude chosen for each.  With
+// --simulate, the model cell has a pipette capacitance of SIMULATED_PIPETTE_PF for it to find.
+//
+// --track-cell a loops a 5 ms + 5 ms test pulse of a mV from --holding on every channel and fits each pulse for the
+// cell's access resistance, membrane resistance and capacitance (see CLAMP::CellTracker), for --seconds (or until
+// Ctrl-C).  Every pulse's parameters are saved to <base>_cell.csv, and the latest are logged twice a second.
+//
+// --noise-spectrum computes the first channel's current noise spectrum in the background while holding (see
+// CLAMP::NoiseSpectrum), logs its RMS noise every few seconds, and saves the final spectrum to <base>_spectrum.csv.
+//
+// --detect-events c looks for spontaneous synaptic events (mEPSCs) on every channel while holding, by template matching
+// with a detection criterion of c (see CLAMP::EventDetector), and saves each channel's events, as they're found, to
+// <base>_<chip>_<channel>_events.csv next to its recording.
+//
+// --reload-fpga uploads the FPGA bitfile even if the board still runs it from an earlier start (see OpalKellyBoard::open).
+//
+// --decimate n keeps every n'th sample of each channel, low-pass filtered, when holding (see
+// CLAMP::Board::setOutputDecimation), for long, slow recordings; each record keeps its own timestamp.  It only applies to
+// a file per channel, without streaming, event detection or the noise spectrum.
+//
+// --host-delays runs simulated (as --simulate) on a virtual clock, with the host taking the given times, in turn, after
+// each read from the board (see CLAMP::SimulatedBoard::setHostDelays), and logs what the simulated FIFO lost.  Delays
+// long enough to overflow the FIFO reproduce an overrun the same way every time: the reads are done on the main thread,
+// in chunks of a fixed size, and --seconds counts board time (timestamps) rather than real time.
+
+#include "Board.h"
+#include "CalibrationCache.h"
+#include "SimulatedBoard.h"
+#include "SimplifiedWaveform.h"
+#include "SaveFile.h"
+#include "MultiplexedSaveFile.h"
+#include "StreamServer.h"
+#include "SharedMemoryRing.h"
+#include "ProtocolRunner.h"
+#include "DynamicClamp.h"
+#include "LeakSubtractor.h"
+#include "SealTest.h"
+#include "CapacitanceTuner.h"
+#include "CellTracker.h"
+#include "NoiseSpectrum.h"
+#include "EventDetector.h"
+#include "Registers.h"
+#include "streams.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
+using namespace CLAMP::IO;
+using CLAMP::Registers::Register8;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::runtime_error;
+
+// Clamp voltage steps are 2.5 mV (see ClampVoltageGenerator::setClampStepSizeImmediate)
+static const double CLAMP_STEP_MV = 2.5;
+// Length of the repeated holding waveform, in timesteps
+static const unsigned int CYCLE_TIMESTEPS = 50000;
+// Timing of each --iv sweep: holding, step, holding
+static const double IV_HOLD_SECONDS = 0.1;
+static const double IV_STEP_SECONDS = 0.2;
+// Pipette capacitance of the simulated cell, for --tune-capacitance to compensate
+static const double SIMULATED_PIPETTE_PF = 5;
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+struct Options {
+    double seconds;
+    string output;
+    double holdingMV;
+    SaveFile::Format format;
+    bool async;
+    bool recalibrate;
+    bool simulate;
+    unsigned int streamPort; // 0 for none
+    string multicast;        // group:port, or empty for none
+    string sharedMemory;     // Name of the ring, or empty for none
+    bool iv;
+    double ivFirstMV, ivLastMV, ivStepMV;
+    double interval;
+    unsigned int leakSubPulses; // 0 for no leak subtraction
+    bool realtime;
+    int readerCpu;           // -1 for any core
+    bool dynamicClamp;
+    double conductanceNS, reversalMV;
+    double sealTestMV;       // 0 for no seal test
+    double tuneCapacitanceMV; // 0 for no capacitance tuning
+    double trackCellMV;      // 0 for no cell tracking
+    bool noiseSpectrum;
+    double eventCriterion;   // 0 for no event detection
+    SaveFile::RolloverPolicy rollover;
+    bool directIO;
+    bool multiplex;
+    double journalSeconds;   // 0 for ordinary save files
+    bool sweepIndex;
+    bool reloadFpga;
+    unsigned int decimate;   // Timesteps per sample saved
+    vector<double> hostDelays; // Seconds; simulated on a virtual clock if not empty
+
+    Options() : seconds(0), output("recording"), holdingMV(0), format(SaveFile::COMPACT_RECORDS), async(false), recalibrate(false), simulate(false),
+        streamPort(0), iv(false), ivFirstMV(0), ivLastMV(0), ivStepMV(0), interval(1), leakSubPulses(0), realtime(false), readerCpu(-1), dynamicClamp(false),
+        conductanceNS(0), reversalMV(0), sealTestMV(0), tuneCapacitanceMV(0), trackCellMV(0), noiseSpectrum(false), eventCriterion(0), directIO(false), multiplex(false),
+        journalSeconds(0), sweepIndex(false), reloadFpga(false), decimate(1) {}
+};
+
+static void usage() {
+    std::cerr << "Usage: ClampRunner [--seconds s] [--output base] [--holding mV] [--format float|compact|chunked|nwb] [--async]\n"
+              << "                   [--recalibrate] [--simulate] [--stream port] [--multicast group:port] [--shared-memory name]\n"
+              << "                   [--iv first:last:step] [--interval s] [--leak-subtract n] [--realtime] [--reader-cpu n]\n"
+              << "                   [--dynamic-clamp nS:mV] [--seal-test mV] [--tune-capacitance mV] [--track-cell mV]\n"
+              << "                   [--noise-spectrum] [--detect-events criterion] [--rollover-mb n] [--rollover-minutes m] [--direct-io]\n"
+              << "                   [--multiplex] [--journal s] [--sweep-index] [--reload-fpga] [--decimate n] [--host-delays ms[,ms...]]\n";
+}
+
+static bool parseArguments(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--seconds" && hasValue) {
+            options.seconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--holding" && hasValue) {
+            options.holdingMV = std::stod(argv[++i]);
+        }
+        else if (arg == "--format" && hasValue) {
+            string format = argv[++i];
+            if (format == "float") {
+                options.format = SaveFile::FLOAT_RECORDS;
+            }
+            else if (format == "compact") {
+                options.format = SaveFile::COMPACT_RECORDS;
+            }
+            else if (format == "chunked") {
+                options.format = SaveFile::CHUNKED_RECORDS;
+            }
+            else if (format == "nwb") {
+                options.format = SaveFile::NWB_RECORDS;
+            }
+            else {
+                std::cerr << "Unknown format " << format << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--async") {
+            options.async = true;
+        }
+        else if (arg == "--direct-io") {
+            options.directIO = true;
+        }
+        else if (arg == "--sweep-index") {
+            options.sweepIndex = true;
+        }
+        else if (arg == "--multiplex") {
+            options.multiplex = true;
+        }
+        else if (arg == "--recalibrate") {
+            options.recalibrate = true;
+        }
+        else if (arg == "--reload-fpga") {
+            options.reloadFpga = true;
+        }
+        else if (arg == "--simulate") {
+            options.simulate = true;
+        }
+        else if (arg == "--stream" && hasValue) {
+            options.streamPort = static_cast<unsigned int>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--shared-memory" && hasValue) {
+            options.sharedMemory = argv[++i];
+        }
+        else if (arg == "--iv" && hasValue) {
+            char colon1, colon2;
+            std::istringstream in(argv[++i]);
+            if (!(in >> options.ivFirstMV >> colon1 >> options.ivLastMV >> colon2 >> options.ivStepMV) || colon1 != ':' || colon2 != ':' ||
+                options.ivStepMV == 0 || (options.ivLastMV - options.ivFirstMV) / options.ivStepMV < 0) {
+                std::cerr << "--iv needs first:last:step, in mV, with step going from first towards last\n";
+                return false;
+            }
+            options.iv = true;
+        }
+        else if (arg == "--host-delays" && hasValue) {
+            std::istringstream in(argv[++i]);
+            string item;
+            while (std::getline(in, item, ',')) {
+                double ms = -1;
+                if (!(std::istringstream(item) >> ms) || ms < 0) {
+                    options.hostDelays.clear();
+                    break;
+                }
+                options.hostDelays.push_back(ms / 1000);
+            }
+            if (options.hostDelays.empty()) {
+                std::cerr << "--host-delays needs a comma-separated list of times, in ms, none negative\n";
+                return false;
+            }
+            options.simulate = true;
+        }
+        else if (arg == "--interval" && hasValue) {
+            options.interval = std::stod(argv[++i]);
+        }
+        else if (arg == "--leak-subtract" && hasValue) {
+            options.leakSubPulses = static_cast<unsigned int>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--realtime") {
+            options.realtime = true;
+        }
+        else if (arg == "--reader-cpu" && hasValue) {
+            options.readerCpu = std::stoi(argv[++i]);
+        }
+        else if (arg == "--dynamic-clamp" && hasValue) {
+            char colon;
+            std::istringstream in(argv[++i]);
+            if (!(in >> options.conductanceNS >> colon >> options.reversalMV) || colon != ':') {
+                std::cerr << "--dynamic-clamp needs conductance:reversal, in nS and mV\n";
+                return false;
+            }
+            options.dynamicClamp = true;
+        }
+        else if (arg == "--seal-test" && hasValue) {
+            options.sealTestMV = std::stod(argv[++i]);
+            if (std::lround(options.sealTestMV / CLAMP_STEP_MV) == 0) {
+                std::cerr << "--seal-test needs a pulse amplitude of at least one clamp step (" << CLAMP_STEP_MV << " mV)\n";
+                return false;
+            }
+        }
+        else if (arg == "--tune-capacitance" && hasValue) {
+            options.tuneCapacitanceMV = std::stod(argv[++i]);
+            if (std::lround(options.tuneCapacitanceMV / CLAMP_STEP_MV) == 0) {
+                std::cerr << "--tune-capacitance needs a pulse amplitude of at least one clamp step (" << CLAMP_STEP_MV << " mV)\n";
+                return false;
+            }
+        }
+        else if (arg == "--track-cell" && hasValue) {
+            options.trackCellMV = std::stod(argv[++i]);
+            if (std::lround(options.trackCellMV / CLAMP_STEP_MV) == 0) {
+                std::cerr << "--track-cell needs a pulse amplitude of at least one clamp step (" << CLAMP_STEP_MV << " mV)\n";
+                return false;
+            }
+        }
+        else if (arg == "--noise-spectrum") {
+            options.noiseSpectrum = true;
+        }
+        else if (arg == "--detect-events" && hasValue) {
+            options.eventCriterion = std::stod(argv[++i]);
+            if (options.eventCriterion <= 0) {
+                std::cerr << "--detect-events needs a positive detection criterion\n";
+                return false;
+            }
+        }
+        else if (arg == "--multicast" && hasValue) {
+            options.multicast = argv[++i];
+            if (options.multicast.find(':') == string::npos) {
+                std::cerr << "--multicast needs group:port\n";
+                return false;
+            }
+        }
+        else if (arg == "--rollover-mb" && hasValue) {
+            options.rollover.maxBytes = static_cast<uint64_t>(std::stod(argv[++i]) * 1024 * 1024);
+        }
+        else if (arg == "--rollover-minutes" && hasValue) {
+            options.rollover.maxSeconds = std::stod(argv[++i]) * 60;
+        }
+        else if (arg == "--decimate" && hasValue) {
+            options.decimate = static_cast<unsigned int>(std::stoul(argv[++i]));
+            if (options.decimate == 0) {
+                std::cerr << "--decimate needs a factor of at least 1\n";
+                return false;
+            }
+        }
+        else if (arg == "--journal" && hasValue) {
+            options.journalSeconds = std::stod(argv[++i]);
+            if (options.journalSeconds <= 0) {
+                std::cerr << "--journal needs a positive checkpoint interval\n";
+                return false;
+            }
+        }
+        else {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+    }
+    if (options.rollover.isEnabled() && options.format == SaveFile::NWB_RECORDS) {
+        std::cerr << "--rollover-mb and --rollover-minutes only apply to .clp formats\n";
+        return false;
+    }
+    if (options.multiplex && (options.rollover.isEnabled() || options.format == SaveFile::NWB_RECORDS || options.journalSeconds > 0 || options.sweepIndex)) {
+        std::cerr << "--multiplex can't be combined with --rollover-mb, --rollover-minutes, --journal, --sweep-index or --format nwb\n";
+        return false;
+    }
+    if (options.sweepIndex && options.format == SaveFile::NWB_RECORDS) {
+        std::cerr << "--sweep-index only applies to .clp formats\n";
+        return false;
+    }
+    bool holdingToFiles = !options.iv && !options.dynamicClamp && options.sealTestMV == 0 && options.tuneCapacitanceMV == 0 &&
+                          options.trackCellMV == 0 && !options.multiplex;
+    bool sampleConsumers = options.streamPort != 0 || !options.multicast.empty() || !options.sharedMemory.empty() || options.noiseSpectrum ||
+                           options.eventCriterion > 0;
+    if (options.decimate > 1 && (!holdingToFiles || sampleConsumers)) {
+        std::cerr << "--decimate only applies to holding recordings to a file per channel, without streaming, --noise-spectrum or --detect-events\n";
+        return false;
+    }
+    return true;
+}
+
+// The same file the GUI keeps its calibration in, so either one can reuse the other's
+static FILENAME calibrationCacheFile() {
+#if defined(_WIN32)
+    const char* home = std::getenv("USERPROFILE");
+#else
+    const char* home = std::getenv("HOME");
+#endif
+    return toFileName(string(home ? home : ".") + "/.IntanCLAMPCalibration.dat");
+}
+
+// Full calibration of all present headstages, in the order the GUI does it
+static void calibrateAll(Board& board, const ChipChannelList& channelList) {
+    LOG(true) << "Calibrating...\n";
+    auto start = std::chrono::steady_clock::now();
+    board.controller.voltageAmplifier.calibrate(channelList);
+    board.controller.differenceAmplifier.calibrate1(channelList);
+    board.controller.clampVoltageGenerator.calibrate(channelList);
+    board.controller.differenceAmplifier.calibrate2(channelList);
+    board.controller.currentToVoltageConverter.calibrate(channelList);
+    board.controller.clampCurrentGenerator.searchCandidatesPerStep = 3;
+    board.controller.clampCurrentGenerator.calibrate(channelList);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(true) << "Calibration time:\t" << elapsed.count() << " s\n";
+}
+
+static void setupBoard(Board& board, const Options& options, const ChipChannelList& channelList) {
+    uint8_t spiLedByte = 0;
+    for (auto& index : channelList) {
+        spiLedByte |= (1 << index.chip);
+    }
+    board.setSpiPortLeds(spiLedByte);
+    board.setStatusLeds(true, 1);
+
+    if (options.simulate) {
+        LOG(true) << "Simulated board; not calibrating\n";
+    }
+    else {
+        CalibrationCache cache;
+        FILENAME cacheFile = calibrationCacheFile();
+        if (!options.recalibrate && cache.load(cacheFile) && cache.restore(board, channelList)) {
+            LOG(true) << "Using saved calibration\n";
+        }
+        else {
+            calibrateAll(board, channelList);
+            try {
+                cache.store(board, channelList);
+                cache.save(cacheFile);
+            }
+            catch (std::exception& e) {
+                LOG(true) << "Warning: could not save calibration: " << e.what() << "\n";
+            }
+        }
+    }
+
+    board.controller.clampVoltageGenerator.setClampStepSizeImmediate(channelList, false);
+    board.controller.offChipComponents.setInputImmediate(channelList, Register8::ElectrodePin);
+}
+
+// Each channel's measured current and clamp voltage, and the digital I/O
+static void addStreams(StreamFramer& framer, const ChipChannelList& channelList) {
+    for (auto& index : channelList) {
+        framer.addChannel(index, Board::MEASURED_CURRENT);
+        framer.addChannel(index, Board::CLAMP_VOLTAGE);
+    }
+    bool noAdcs[8] = { false, false, false, false, false, false, false, false };
+    framer.setBoardData(noAdcs, true, true);
+}
+
+// Must be set up before the board starts running, so the digital I/O is transferred
+static unique_ptr<StreamServer> startStreaming(Board& board, const Options& options, const ChipChannelList& channelList) {
+    if (options.streamPort == 0 && options.multicast.empty()) {
+        return nullptr;
+    }
+    unique_ptr<StreamServer> server(new StreamServer(board));
+    addStreams(*server, channelList);
+    if (options.streamPort != 0) {
+        server->listen(static_cast<uint16_t>(options.streamPort));
+        LOG(true) << "Streaming on TCP port " << options.streamPort << "\n";
+    }
+    if (!options.multicast.empty()) {
+        std::size_t colon = options.multicast.rfind(':');
+        server->enableMulticast(options.multicast.substr(0, colon), static_cast<uint16_t>(std::stoul(options.multicast.substr(colon + 1))));
+        LOG(true) << "Streaming to multicast group " << options.multicast << "\n";
+    }
+    server->start();
+    return server;
+}
+
+// A single segment at the holding voltage, repeated for as long as the board runs
+static void applyHoldingWaveform(Board& board, const Options& options, const ChipChannelList& channelList) {
+    board.enableChannels(channelList, true);
+    SimplifiedWaveform waveform;
+    int holding = static_cast<int>(std::lround(options.holdingMV / CLAMP_STEP_MV));
+    waveform.push_back(WaveformSegment(0, holding, CYCLE_TIMESTEPS, 0, false, false));
+    waveform.setStepSize(CLAMP_STEP_MV * 1e-3, 0);
+    board.controller.simplifiedWaveformToWaveform(channelList, true, waveform);
+    board.commandsToFPGA();
+}
+
+// One save file per channel, named with suffix before the extension; waveform, if given, goes in the headers
+static vector<unique_ptr<SaveFile>> openSaveFiles(Board& board, const Options& options, const ChipChannelList& channelList,
+                                                  const SimplifiedWaveform* waveform = nullptr, const string& suffix = "") {
+    vector<unique_ptr<SaveFile>> saveFiles;
+    for (auto& index : channelList) {
+        string path = options.output + "_" + std::to_string(index.chip) + "_" + std::to_string(index.channel) + suffix +
+                      ((options.format == SaveFile::NWB_RECORDS) ? ".nwb" : ".clp");
+        unique_ptr<SaveFile> saveFile(new SaveFile(options.format));
+        saveFile->setRollover(options.rollover);
+        saveFile->setDirectIO(options.directIO);
+        saveFile->setJournal(options.journalSeconds);
+        saveFile->setSweepIndex(options.sweepIndex);
+        saveFile->open(toFileName(path), options.async);
+        HeaderData header(board, index);
+        if (waveform) {
+            header.settings.waveform = *waveform;
+        }
+        saveFile->writeHeader(header);
+        saveFiles.push_back(std::move(saveFile));
+        LOG(true) << "Saving chip " << index.chip << " channel " << index.channel << " to " << path << "\n";
+    }
+    return saveFiles;
+}
+
+// The --iv sweeps, loaded on every channel, with leak's sub-pulses if it's given
+static void loadIVProtocol(Board& board, ProtocolRunner& protocol, const Options& options, LeakSubtractor* leak) {
+    double samplingRate = board.getSamplingRateHz();
+    unsigned int holdSteps = static_cast<unsigned int>(std::lround(IV_HOLD_SECONDS * samplingRate));
+    unsigned int stepSteps = static_cast<unsigned int>(std::lround(IV_STEP_SECONDS * samplingRate));
+    int holding = static_cast<int>(std::lround(options.holdingMV / CLAMP_STEP_MV));
+    unsigned int numSweeps = static_cast<unsigned int>(std::floor((options.ivLastMV - options.ivFirstMV) / options.ivStepMV + 1e-9)) + 1;
+
+    vector<SimplifiedWaveform> sweeps(numSweeps);
+    for (unsigned int i = 0; i < numSweeps; i++) {
+        int step = static_cast<int>(std::lround((options.ivFirstMV + i * options.ivStepMV) / CLAMP_STEP_MV));
+        sweeps[i].push_back(WaveformSegment(0, holding, holdSteps, 0, false, false));
+        sweeps[i].push_back(WaveformSegment(1 + i, step, stepSteps, holdSteps, true, false));
+        sweeps[i].push_back(WaveformSegment(0, holding, holdSteps, 0, false, false));
+        sweeps[i].setStepSize(CLAMP_STEP_MV * 1e-3, 0);
+        sweeps[i].interval = options.interval;
+    }
+    if (leak) {
+        protocol.load(leak->interleave(sweeps), true);
+        LOG(true) << "Loaded " << numSweeps << " sweeps, each after " << leak->getNumSubPulses() << " leak sub-pulses, "
+                  << protocol.numTimesteps() / samplingRate << " s in all\n";
+    }
+    else {
+        protocol.load(sweeps, true);
+        LOG(true) << "Loaded " << numSweeps << " sweeps, " << protocol.numTimesteps() / samplingRate << " s in all\n";
+    }
+}
+
+// Runs the loaded protocol (repeatedly, if --seconds asks for more than one run), saving each sweep as it's read, and
+// each leak-subtracted test sweep too if leak is given
+static void recordProtocol(Board& board, ProtocolRunner& protocol, const Options& options, const ChipChannelList& channelList,
+                           LeakSubtractor* leak) {
+    vector<unique_ptr<SaveFile>> saveFiles = openSaveFiles(board, options, channelList, &protocol.getProgram());
+    vector<unique_ptr<SaveFile>> leakFiles;
+    if (leak) {
+        leakFiles = openSaveFiles(board, options, channelList, nullptr, "_leaksub");
+    }
+    double protocolSeconds = protocol.numTimesteps() / board.getSamplingRateHz();
+    unsigned int repetitions = std::max(1u, static_cast<unsigned int>(std::ceil(options.seconds / protocolSeconds - 1e-9)));
+
+    std::signal(SIGINT, requestStop);
+    board.resetTimestampGaps();
+    auto start = std::chrono::steady_clock::now();
+    unsigned int numSweeps = 0;
+    protocol.run([&](const ProtocolSweep& sweep) {
+        const vector<uint32_t>& timestamps = board.readQueue.getTimeStamps();
+        for (std::size_t i = 0; i < channelList.size(); i++) {
+            const vector<Sample>& currents = board.readQueue.getMeasuredCurrents(channelList[i]);
+            saveFiles[i]->startSweep();
+            saveFiles[i]->writeData(timestamps, currents, board.readQueue.getClampVoltages(channelList[i]));
+            if (leak && leak->addSweep(sweep, channelList[i], currents)) {
+                leakFiles[i]->startSweep();
+                leakFiles[i]->writeData(timestamps, leak->getCorrected(channelList[i]), board.readQueue.getClampVoltages(channelList[i]));
+            }
+        }
+        numSweeps++;
+        if (stopRequested) {
+            protocol.stop();
+        }
+    }, repetitions);
+    for (auto& saveFile : saveFiles) {
+        saveFile->close();
+    }
+    for (auto& leakFile : leakFiles) {
+        leakFile->close();
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG(true) << "Recorded " << numSweeps << " sweeps in " << elapsed << " s; " << board.getTimestampGaps().samplesMissing << " samples dropped\n";
+}
+
+// --dynamic-clamp: a fixed conductance on the first channel, for --seconds (or until Ctrl-C)
+static void recordDynamicClamp(Board& board, const Options& options, const ChipChannelList& channelList) {
+    ChipChannelList target(1, channelList.front());
+    board.controller.switchToCurrentClampImmediate(target, I_50pA, 0, 0);
+    vector<unique_ptr<SaveFile>> saveFiles = openSaveFiles(board, options, target);
+
+    DynamicClamp clamp(board, target.front());
+    clamp.setModel(DynamicClamp::conductance(options.conductanceNS * 1e-9, options.reversalMV * 1e-3));
+    if (options.realtime && !Thread::scheduleCurrentThread(Thread::REALTIME_PRIORITY, options.readerCpu)) {
+        LOG(true) << "Warning: could not run the dynamic clamp loop at real-time priority\n";
+    }
+
+    std::signal(SIGINT, requestStop);
+    board.resetTimestampGaps();
+    clamp.run(options.seconds, [&](double, double) {
+        saveFiles[0]->writeData(board.readQueue.getTimeStamps(), board.readQueue.getMeasuredVoltages(target.front()),
+                                board.readQueue.getClampCurrents(target.front()));
+        if (stopRequested) {
+            clamp.stop();
+        }
+    });
+    Thread::unscheduleCurrentThread();
+    saveFiles[0]->close();
+
+    LOG(true) << "Dynamic clamp loop latency: median " << clamp.latencies.percentile(50) * 1e3 << " ms, 99th percentile "
+              << clamp.latencies.percentile(99) * 1e3 << " ms, max " << clamp.latencies.max() * 1e3 << " ms over "
+              << clamp.latencies.count() << " loops; " << board.getTimestampGaps().samplesMissing << " samples dropped\n";
+}
+
+// --seal-test: a looped test pulse on every channel, for --seconds (or until Ctrl-C)
+static void runSealTest(Board& board, const Options& options, const ChipChannelList& channelList) {
+    // Seal currents are a few picoamps, so use the largest feedback resistor
+    int holding = static_cast<int>(std::lround(options.holdingMV / CLAMP_STEP_MV));
+    board.controller.switchToVoltageClampImmediate(channelList, holding, 5e3, Registers::Register3::Resistance::R80M, 0);
+
+    SealTest sealTest(board, channelList);
+    sealTest.setPulse(holding, static_cast<int>(std::lround(options.sealTestMV / CLAMP_STEP_MV)), CLAMP_STEP_MV * 1e-3);
+    sealTest.setUpdateInterval(0.1);
+
+    std::signal(SIGINT, requestStop);
+    board.resetTimestampGaps();
+    sealTest.run(options.seconds, [&](const vector<SealTestReading>& readings) {
+        std::ostringstream line;
+        for (const SealTestReading& reading : readings) {
+            line << "  " << reading.channel.chip << "/" << reading.channel.channel << ": "
+                 << reading.resistance / 1e6 << " MOhm";
+        }
+        LOG(true) << "Seal test" << line.str() << "\n";
+        if (stopRequested) {
+            sealTest.stop();
+        }
+    });
+    LOG(true) << "Seal test: " << sealTest.getPulseCount() << " pulses; " << board.getTimestampGaps().samplesMissing << " samples dropped\n";
+}
+
+// --tune-capacitance: sets every channel's fast transient compensation, then stops
+static void tuneCapacitance(Board& board, const Options& options, const ChipChannelList& channelList) {
+    int holding = static_cast<int>(std::lround(options.holdingMV / CLAMP_STEP_MV));
+    board.controller.switchToVoltageClampImmediate(channelList, holding, 5e3, Registers::Register3::Resistance::R80M, 0);
+
+    CapacitanceTuner tuner(board, channelList);
+    tuner.setPulse(holding, static_cast<int>(std::lround(options.tuneCapacitanceMV / CLAMP_STEP_MV)), CLAMP_STEP_MV * 1e-3);
+
+    auto start = std::chrono::steady_clock::now();
+    vector<CapacitanceTuningResult> results = tuner.run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (const CapacitanceTuningResult& result : results) {
+        LOG(true) << "Capacitance " << result.channel.chip << "/" << result.channel.channel << ": " << result.magnitude * 1e12
+                  << " pF compensated, " << result.residual * 1e12 << " pF left (" << result.valuesTried << " values tried)\n";
+    }
+    LOG(true) << "Capacitance tuning: " << tuner.getPulseCount() << " pulses measured in " << seconds << " s\n";
+}
+
+// --track-cell: a looped test pulse on every channel, fitted pulse by pulse, for --seconds (or until Ctrl-C)
+static void trackCell(Board& board, const Options& options, const ChipChannelList& channelList) {
+    // Whole-cell transients are nanoamps, so a smaller feedback resistor than the seal test's
+    int holding = static_cast<int>(std::lround(options.holdingMV / CLAMP_STEP_MV));
+    board.controller.switchToVoltageClampImmediate(channelList, holding, 5e3, Registers::Register3::Resistance::R20M, 0);
+
+    CellTracker tracker(board, channelList);
+    tracker.setPulse(holding, static_cast<int>(std::lround(options.trackCellMV / CLAMP_STEP_MV)), CLAMP_STEP_MV * 1e-3);
+
+    string filename = options.output + "_cell.csv";
+    std::ofstream out(filename.c_str());
+    out << "timestamp,time_s,chip,channel,resistance,Ra,Rm,Cm,holding_current,iterations\n";
+    if (!out) {
+        throw runtime_error("Could not open " + filename);
+    }
+
+    std::signal(SIGINT, requestStop);
+    board.resetTimestampGaps();
+    double samplingRate = board.getSamplingRateHz();
+    uint64_t iterations = 0;
+    auto nextLog = std::chrono::steady_clock::now();
+    tracker.run(options.seconds, [&](const vector<CellTrackingReading>& readings) {
+        for (const CellTrackingReading& reading : readings) {
+            out << reading.timestamp << "," << reading.timestamp / samplingRate << "," << reading.channel.chip << "," << reading.channel.channel << ","
+                << reading.resistance << "," << reading.Ra << "," << reading.Rm << "," << reading.Cm << "," << reading.holdingCurrent << ","
+                << reading.iterations << "\n";
+            iterations += reading.iterations;
+        }
+        if (std::chrono::steady_clock::now() >= nextLog) {
+            nextLog += std::chrono::milliseconds(500);
+            std::ostringstream line;
+            for (auto& index : channelList) {
+                CellTrackingReading reading = tracker.getReading(index);
+                line << "  " << index.chip << "/" << index.channel << ": Ra " << reading.Ra / 1e6 << " MOhm, Rm " << reading.Rm / 1e6
+                     << " MOhm, Cm " << reading.Cm * 1e12 << " pF";
+            }
+            LOG(true) << "Cell" << line.str() << "\n";
+        }
+        if (stopRequested) {
+            tracker.stop();
+        }
+    });
+    if (!out) {
+        throw runtime_error("Could not write " + filename);
+    }
+    uint64_t pulses = tracker.getPulseCount();
+    LOG(true) << "Cell tracking: " << pulses << " pulses, " << (pulses > 0 ? static_cast<double>(iterations) / pulses : 0.0)
+              << " fit steps per pulse, saved to " << filename << "; " << board.getTimestampGaps().samplesMissing << " samples dropped\n";
+}
+
+// RMS noise over the whole spectrum, from its density
+static double rmsNoise(const vector<double>& frequencies, const vector<double>& psd) {
+    double variance = 0;
+    for (std::size_t i = 1; i < psd.size(); i++) {
+        variance += psd[i] * (frequencies[i] - frequencies[i - 1]);
+    }
+    return std::sqrt(variance);
+}
+
+// --noise-spectrum: the final spectrum, as frequency and density columns
+static void saveSpectrum(const NoiseSpectrum& spectrum, const Options& options) {
+    vector<double> frequencies, psd;
+    uint64_t segments = 0;
+    if (!spectrum.getSpectrum(frequencies, psd, &segments)) {
+        LOG(true) << "Noise spectrum: not enough data for a spectrum\n";
+        return;
+    }
+    string filename = options.output + "_spectrum.csv";
+    std::ofstream out(filename.c_str());
+    out << "frequency_Hz,psd_A2_per_Hz\n";
+    for (std::size_t i = 0; i < psd.size(); i++) {
+        out << frequencies[i] << "," << psd[i] << "\n";
+    }
+    if (!out) {
+        throw runtime_error("Could not write " + filename);
+    }
+    LOG(true) << "Noise spectrum: " << rmsNoise(frequencies, psd) * 1e12 << " pA RMS to " << frequencies.back() << " Hz over "
+              << segments << " segments, " << spectrum.getDroppedBlocks() << " blocks dropped; saved to " << filename << "\n";
+}
+
+// --detect-events: one file of events per channel, next to its recording
+typedef std::map<ChipChannel, unique_ptr<std::ofstream>> EventFiles;
+
+static EventFiles openEventFiles(const Options& options, const ChipChannelList& channelList) {
+    EventFiles files;
+    for (auto& index : channelList) {
+        string path = options.output + "_" + std::to_string(index.chip) + "_" + std::to_string(index.channel) + "_events.csv";
+        unique_ptr<std::ofstream> file(new std::ofstream(path.c_str()));
+        *file << "timestamp,time_s,amplitude_pA,criterion\n";
+        if (!*file) {
+            throw runtime_error("Could not open " + path);
+        }
+        files[index] = std::move(file);
+    }
+    return files;
+}
+
+// --multiplex: one file for every channel and the aux I/O, which the board must already be sending (numAdcs ADCs)
+static unique_ptr<MultiplexedSaveFile> openMultiplexedFile(Board& board, const Options& options, const ChipChannelList& channelList, int numAdcs) {
+    string path = options.output + ".clp";
+    unique_ptr<MultiplexedSaveFile> file(new MultiplexedSaveFile());
+    file->setDirectIO(options.directIO);
+    file->open(toFileName(path), options.async);
+
+    vector<unique_ptr<HeaderData>> headers;
+    vector<const HeaderData*> pointers;
+    for (auto& index : channelList) {
+        headers.emplace_back(new HeaderData(board, index));
+        pointers.push_back(headers.back().get());
+    }
+    AuxHeaderData auxHeader(board, channelList.front(), numAdcs);
+    file->writeHeader(pointers, &auxHeader);
+    LOG(true) << "Saving " << channelList.size() << " channels and the aux I/O to " << path << "\n";
+    return file;
+}
+
+static void writeEvents(Board& board, EventDetector& detector, EventFiles& files) {
+    double samplingRate = board.getSamplingRateHz();
+    for (const SynapticEvent& event : detector.takeEvents()) {
+        *files[event.channel] << event.timestamp << "," << event.timestamp / samplingRate << "," << event.amplitude * 1e12 << ","
+                              << event.criterion << "\n";
+    }
+}
+
+static void record(Board& board, const Options& options, const ChipChannelList& channelList) {
+    vector<unique_ptr<SaveFile>> saveFiles;
+    unique_ptr<MultiplexedSaveFile> multiplexed;
+    unsigned int auxConsumer = 0;
+    if (options.multiplex) {
+        // The board only sends the ADCs and digital I/O if something uses them
+        int numAdcs = board.expanderBoardPresent() ? 8 : 2;
+        bool adcs[8];
+        for (int i = 0; i < 8; i++) {
+            adcs[i] = (i < numAdcs);
+        }
+        auxConsumer = board.addDataConsumer(adcs, true, true);
+        multiplexed = openMultiplexedFile(board, options, channelList, numAdcs);
+    }
+    else {
+        saveFiles = openSaveFiles(board, options, channelList);
+    }
+    unique_ptr<EventDetector> detector;
+    EventFiles eventFiles;
+    if (options.eventCriterion > 0) {
+        eventFiles = openEventFiles(options, channelList);
+        EventDetector::Settings settings;
+        settings.threshold = options.eventCriterion;
+        detector.reset(new EventDetector(board));
+        detector->start(channelList, settings);
+    }
+    unique_ptr<NoiseSpectrum> spectrum;
+    if (options.noiseSpectrum) {
+        spectrum.reset(new NoiseSpectrum(board));
+        spectrum->start(channelList.front(), Board::MEASURED_CURRENT);
+    }
+
+    if (options.decimate > 1) {
+        for (auto& index : channelList) {
+            board.setOutputDecimation(index.chip, options.decimate);
+        }
+        LOG(true) << "Decimating by " << options.decimate << ", to " << board.getOutputSamplingRateHz(channelList.front().chip) << " Hz\n";
+    }
+
+    std::signal(SIGINT, requestStop);
+    board.resetTimestampGaps();
+    board.fifoMonitor.startRun();
+    board.runContinuously();
+    // On the virtual clock (--host-delays), the reader thread's transfers would depend on how the threads are scheduled
+    bool virtualTime = !options.hostDelays.empty();
+    if (!virtualTime) {
+        board.startReaderThread();
+    }
+
+    using std::chrono::steady_clock;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point nextSpectrumLog = start + std::chrono::seconds(5);
+    uint64_t timesteps = 0;
+    uint64_t boardTimesteps = 0; // Board time, including any data the FIFO dropped
+    uint64_t runTimesteps = static_cast<uint64_t>(std::ceil(options.seconds * board.getSamplingRateHz()));
+    bool first = true;
+    while (!stopRequested && (options.seconds <= 0 || (virtualTime ? boardTimesteps < runTimesteps :
+                                                       std::chrono::duration<double>(steady_clock::now() - start).count() < options.seconds))) {
+        // The first read of a run includes one extra timestep; see ClampThread::readAvailable
+        unsigned int packets = board.read(board.getNumTimesteps(channelList.front().chip) + (first ? 1 : 0));
+        first = false;
+        timesteps += packets;
+
+        const vector<uint32_t>& timestamps = board.readQueue.getTimeStamps();
+        if (!timestamps.empty()) {
+            boardTimesteps = timestamps.back() + 1ULL;
+        }
+        if (multiplexed) {
+            vector<const vector<Sample>*> measured, clamp;
+            for (auto& index : channelList) {
+                measured.push_back(&board.readQueue.getMeasuredCurrents(index));
+                clamp.push_back(&board.readQueue.getClampVoltages(index));
+            }
+            multiplexed->writeData(timestamps, measured, clamp, board.readQueue.getADCs(), board.readQueue.getDigIns(), board.readQueue.getDigOuts());
+        }
+        for (std::size_t i = 0; i < saveFiles.size(); i++) {
+            // Their own timestamps, in case they're decimated
+            saveFiles[i]->writeData(board.readQueue.getTimeStamps(channelList[i]), board.readQueue.getMeasuredCurrents(channelList[i]),
+                                    board.readQueue.getClampVoltages(channelList[i]));
+        }
+        board.readQueue.clear(false);
+
+        if (detector) {
+            writeEvents(board, *detector, eventFiles);
+        }
+
+        vector<double> frequencies, psd;
+        if (spectrum && steady_clock::now() >= nextSpectrumLog && spectrum->getSpectrum(frequencies, psd)) {
+            nextSpectrumLog += std::chrono::seconds(5);
+            LOG(true) << "Noise: " << rmsNoise(frequencies, psd) * 1e12 << " pA RMS\n";
+        }
+    }
+
+    board.stopReaderThread();
+    board.stop();
+    board.flush();
+    board.readQueue.clear(true);
+    for (auto& index : channelList) {
+        board.setOutputDecimation(index.chip, 1);
+    }
+    for (auto& saveFile : saveFiles) {
+        saveFile->close();
+    }
+    if (multiplexed) {
+        multiplexed->close();
+        board.removeDataConsumer(auxConsumer);
+    }
+    if (spectrum) {
+        spectrum->stop();
+        saveSpectrum(*spectrum, options);
+    }
+    if (detector) {
+        detector->stop();
+        writeEvents(board, *detector, eventFiles);
+        LOG(true) << "Event detection: " << detector->getEventCount() << " events; matched " << detector->getSamplesMatched()
+                  << " samples in " << detector->getMatchSeconds() << " s, " << detector->getDroppedSamples() << " dropped\n";
+    }
+
+    double elapsed = std::chrono::duration<double>(steady_clock::now() - start).count();
+    TimestampGaps gaps = board.getTimestampGaps();
+    LOG(true) << "Recorded " << timesteps / board.getSamplingRateHz() << " s in " << elapsed << " s; FIFO high water "
+              << board.fifoMonitor.getPeakPercentage() << "%, " << gaps.samplesMissing << " samples dropped\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+    SetLogger(&std::cerr);
+
+    try {
+        unique_ptr<Board> board;
+        SimulatedBoard* simulatedBoard = nullptr;
+        if (options.simulate) {
+            simulatedBoard = new SimulatedBoard();
+            board.reset(new Board(unique_ptr<OpalKellyBoard>(simulatedBoard)));
+            ModelCellSource::Cell cell;
+            if (options.tuneCapacitanceMV != 0) {
+                cell.pipetteCapacitance = SIMULATED_PIPETTE_PF * 1e-12;
+            }
+            simulatedBoard->attach(*board, unique_ptr<PacketSource>(new ModelCellSource(*board, cell)));
+            if (!options.hostDelays.empty()) {
+                simulatedBoard->setVirtualClock(true);
+                simulatedBoard->setHostDelays(options.hostDelays);
+                // The chunk size would otherwise adapt to how long reads really take
+                unsigned int chunk = board->transferPolicy.getChunkPackets();
+                board->transferPolicy.setBounds(chunk, chunk);
+            }
+        }
+        else {
+            board.reset(new Board());
+            board->setForceBitfileUpload(options.reloadFpga);
+        }
+        if (!board->open()) {
+            throw runtime_error("Intan Technologies CLAMP Controller not found on any USB port.");
+        }
+        ChipChannelList channelList = board->getPresentChannels();
+        if (channelList.empty()) {
+            throw runtime_error("No Intan CLAMP headstages detected.");
+        }
+
+        setupBoard(*board, options, channelList);
+        board->setReaderThreadScheduling(options.realtime ? Thread::REALTIME_PRIORITY : Thread::NORMAL_PRIORITY, options.readerCpu);
+        ProtocolRunner protocol(*board, channelList);
+        unique_ptr<LeakSubtractor> leak;
+        if (options.leakSubPulses > 0) {
+            leak.reset(new LeakSubtractor(options.leakSubPulses, -1.0 / options.leakSubPulses));
+        }
+        if (options.iv) {
+            loadIVProtocol(*board, protocol, options, leak.get());
+        }
+        else {
+            applyHoldingWaveform(*board, options, channelList);
+        }
+        unique_ptr<StreamServer> server = startStreaming(*board, options, channelList);
+        unique_ptr<SharedMemoryRing> ring;
+        if (!options.sharedMemory.empty()) {
+            ring.reset(new SharedMemoryRing(*board, options.sharedMemory));
+            addStreams(*ring, channelList);
+            LOG(true) << "Writing to shared memory " << options.sharedMemory << "\n";
+        }
+        if (options.dynamicClamp) {
+            recordDynamicClamp(*board, options, channelList);
+        }
+        else if (options.sealTestMV != 0) {
+            runSealTest(*board, options, channelList);
+        }
+        else if (options.tuneCapacitanceMV != 0) {
+            tuneCapacitance(*board, options, channelList);
+        }
+        else if (options.trackCellMV != 0) {
+            trackCell(*board, options, channelList);
+        }
+        else if (options.iv) {
+            recordProtocol(*board, protocol, options, channelList, leak.get());
+        }
+        else {
+            record(*board, options, channelList);
+        }
+        if (simulatedBoard && !options.hostDelays.empty()) {
+            SimulatedFifoStatistics fifo = simulatedBoard->getFifoStatistics();
+            LOG(true) << "Simulated FIFO: " << fifo.runSeconds << " s of virtual time; " << fifo.overflows << " overflows, "
+                      << fifo.droppedTimesteps << " timesteps dropped; high water " << fifo.highWaterWords << " words\n";
+        }
+        if (server) {
+            StreamStatistics stats = server->getStatistics();
+            LOG(true) << "Streamed " << stats.framesSent << " frames; " << stats.framesDropped << " dropped, " << stats.clientFramesDropped
+                      << " dropped for slow clients\n";
+        }
+    }
+    catch (std::exception& e) {
+        LOG(true) << "Error: " << e.what() << "\n";
+        FlushLog();
+        return 1;
+    }
+    FlushLog();
+    return 0;
+}
@@ -0,0 +1,30 @@
+# Contact sheets of the sweeps in a day's save files, for reviewing them offline.  Draws with the display's Axis and
+# PlotRenderer into images, so it needs Qt's gui module but never opens a window.
+include ("../CLAMP_API/CLAMP_API.pri")
+
+unix:LIBS += -ldl
+linux-g++:LIBS += -lrt
+
+TARGET = ClampThumbnails
+
+TEMPLATE = app
+
+QT += gui
+
+CONFIG += console
+
+# Must match the setting the recordings were made with
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
+
+INCLUDEPATH += ../CLAMP_UI ../CLAMP_UI/Display
+
+SOURCES += \
+    main.cpp \
+    ../CLAMP_UI/Display/Axis.cpp \
+    ../CLAMP_UI/Display/Line.cpp \
+    ../CLAMP_UI/Display/PlotRenderer.cpp
+
+HEADERS += \
+    ../CLAMP_UI/Display/Axis.h \
+    ../CLAMP_UI/Display/Line.h \
+    ../CLAMP_UI/Display/PlotRenderer.h
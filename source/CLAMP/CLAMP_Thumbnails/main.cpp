@@ -0,0 +1,538 @@
+// Contact sheets for reviewing a day's recordings: every sweep of every .clp file as a small plot, drawn the way the data
+// display draws its traces (scaled with Axis, and reduced to each pixel column's extremes by PlotRenderer), into images
+// rather than a window.
+//
+// Usage: ClampThumbnails --output dir [--columns n] [--size WxH] [--per-sheet n] [--threads n] file-or-directory...
+//
+// Directories are searched recursively for .clp files, and each file's sheets are written to the same relative path
+// under --output (files given directly go straight into it), as <name>.png, or as <name>_1.png, <name>_2.png, ... when
+// its sweeps fill more than one sheet of --per-sheet thumbnails (default 120).  Sweeps come from the file's sweep index
+// if it has one (see SaveFile::setSweepIndex); otherwise each repetition of the file's waveform is a sweep.  All the
+// thumbnails of a file share one scale, given at the top of each sheet, so they can be compared at a glance.  Files and
+// sweeps are read and drawn in parallel, a few files at a time so memory stays bounded.  Aux files are skipped, and
+// multiplexed files show their first channel.  The exit code is 1 if any file failed.
+
+#include "SaveFileReader.h"
+#include "ThreadPool.h"
+#include "Axis.h"
+#include "Line.h"
+#include "PlotRenderer.h"
+#include <QtGlobal>
+#if QT_VERSION >= 0x050000
+    #include <QGuiApplication>
+#else
+    #include <QApplication>
+#endif
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QImage>
+#include <QPainter>
+#include <QFont>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace CLAMP;
+using namespace CLAMP::IO;
+using std::vector;
+using std::string;
+using std::unique_ptr;
+
+// Files are drawn in groups of at most this many sheets, so a day's worth of them isn't in memory at once
+static const unsigned int MAX_SHEETS_PER_GROUP = 32;
+// Height of a thumbnail's label, and twice that for a sheet's header
+static const int LABEL_HEIGHT = 14;
+static const int GAP = 4;
+
+struct Options {
+    string output;
+    int columns;
+    QSize thumbnailSize;
+    unsigned int perSheet;
+    unsigned int threads; // 0 for the default
+    vector<string> inputs;
+
+    Options() : columns(8), thumbnailSize(200, 100), perSheet(120), threads(0) {}
+};
+
+// A run of records to draw as one thumbnail
+struct Sweep {
+    std::size_t first;
+    std::size_t count;
+    Range range; // Of the valid measured values; empty until known
+
+    Sweep(std::size_t first_, std::size_t count_) : first(first_), count(count_) {}
+};
+
+// One save file, and the sheets of its sweeps
+struct Job {
+    QString source;
+    QString destination; // Without the number and .png
+    unique_ptr<SaveFileReader> reader;
+    vector<Sweep> sweeps;
+    vector<QImage> sheets;
+    unique_ptr<Axis> tAxis;
+    unique_ptr<Axis> yAxis;
+    PlotGeometry geometry;
+
+    std::mutex errorMutex;
+    string error; // Guarded by errorMutex
+
+    void fail(const string& message) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (error.empty()) {
+            error = message;
+        }
+    }
+    bool failed() {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        return !error.empty();
+    }
+};
+
+static void usage() {
+    std::cerr << "Usage: ClampThumbnails --output dir [--columns n] [--size WxH] [--per-sheet n] [--threads n] file-or-directory...\n";
+}
+
+static bool parseArguments(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--columns" && hasValue) {
+            options.columns = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--size" && hasValue) {
+            string size = argv[++i];
+            std::size_t x = size.find('x');
+            if (x == string::npos) {
+                std::cerr << "Size must be WxH\n";
+                return false;
+            }
+            options.thumbnailSize = QSize(std::max(4 * LABEL_HEIGHT, std::stoi(size.substr(0, x))), std::max(2 * LABEL_HEIGHT, std::stoi(size.substr(x + 1))));
+        }
+        else if (arg == "--per-sheet" && hasValue) {
+            options.perSheet = std::max(1u, static_cast<unsigned int>(std::stoul(argv[++i])));
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = static_cast<unsigned int>(std::stoul(argv[++i]));
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+        else {
+            options.inputs.push_back(arg);
+        }
+    }
+    return !options.output.empty() && !options.inputs.empty();
+}
+
+// The .clp files under directory (or directory itself, if it's a file), and where their sheets go under output
+static void findSaveFiles(const QString& input, const QString& output, vector<unique_ptr<Job>>& jobs) {
+    QFileInfo info(input);
+    vector<QString> sources;
+    QDir root;
+    if (info.isDir()) {
+        root = QDir(input);
+        QDirIterator files(input, QStringList() << "*.clp", QDir::Files, QDirIterator::Subdirectories);
+        while (files.hasNext()) {
+            sources.push_back(files.next());
+        }
+        std::sort(sources.begin(), sources.end());
+    }
+    else {
+        root = info.dir();
+        sources.push_back(input);
+    }
+
+    for (const QString& source : sources) {
+        QString relative = root.relativeFilePath(source);
+        unique_ptr<Job> job(new Job);
+        job->source = source;
+        job->destination = QDir(output).filePath(relative.left(relative.length() - QFileInfo(relative).suffix().length() - 1));
+        jobs.push_back(std::move(job));
+    }
+}
+
+// Each sweep from the sweep index, or else each repetition of the waveform
+static vector<Sweep> findSweeps(const SaveFileReader& reader) {
+    vector<Sweep> sweeps;
+    if (!reader.sweeps.empty()) {
+        for (const SweepIndexEntry& entry : reader.sweeps) {
+            sweeps.push_back(Sweep(static_cast<std::size_t>(entry.firstRecord), static_cast<std::size_t>(entry.records)));
+            if (entry.validRecords > 0) {
+                sweeps.back().range = Range(entry.measuredMin, entry.measuredMax);
+            }
+        }
+        return sweeps;
+    }
+
+    std::size_t n = reader.numRecords();
+    const SimplifiedWaveform& waveform = reader.settings.waveform;
+    std::size_t length = waveform.waveform.empty() ? n : waveform.waveform.back().endIndex + 1;
+    if (length == 0) {
+        length = n;
+    }
+    for (std::size_t first = 0; first < n; first += length) {
+        sweeps.push_back(Sweep(first, std::min(length, n - first)));
+    }
+    return sweeps;
+}
+
+// Measured values of records [first, first + n), from whichever record format the file has
+static void readMeasured(const SaveFileReader& reader, std::size_t first, std::size_t n, vector<double>& values) {
+    values.clear();
+    values.reserve(n);
+    if (reader.isChunked) {
+        // The last chunk starting at or before first, and on from there
+        std::size_t lo = 0, hi = reader.numChunks();
+        while (hi - lo > 1) {
+            std::size_t mid = (lo + hi) / 2;
+            if (reader.chunkFirstRecordIndex(mid) <= first) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        Chunk chunk;
+        for (std::size_t c = lo; c < reader.numChunks() && values.size() < n; c++) {
+            reader.readChunk(c, chunk);
+            std::size_t base = reader.chunkFirstRecordIndex(c);
+            for (std::size_t i = std::max(first, base) - base; i < chunk.size() && values.size() < n; i++) {
+                values.push_back(reader.toMeasured(chunk.measuredCodes[i]));
+            }
+        }
+    }
+    else if (reader.isCompact) {
+        RecordView<int32_t> codes = reader.measuredCodes();
+        for (std::size_t i = 0; i < n; i++) {
+            values.push_back(reader.toMeasured(codes[first + i]));
+        }
+    }
+    else {
+        RecordView<float> measured = reader.isMultiplexed ? reader.measured(0) : reader.measured();
+        for (std::size_t i = 0; i < n; i++) {
+            values.push_back(measured[first + i]);
+        }
+    }
+}
+
+static Range validRange(const vector<double>& values) {
+    Range range;
+    for (double value : values) {
+        if (!std::isnan(value)) {
+            range.applyUnion(Range(value, value));
+        }
+    }
+    return range;
+}
+
+// Scales the axes to the longest sweep and to every sweep's values, the way Plot autoscales
+static void scaleAxes(Job& job) {
+    const int MAX_NUM_STEPS = 10;
+    bool current = job.reader->settings.isVoltageClamp;
+    job.tAxis.reset(new Axis(MAX_NUM_STEPS, 4, "s", "time", 2, -5, 1, 3, true));
+    if (current) {
+        job.yAxis.reset(new Axis(MAX_NUM_STEPS, 6, "A", "measured current", 2, -12, 2, -4, false));
+    }
+    else {
+        job.yAxis.reset(new Axis(MAX_NUM_STEPS, 11, "V", "measured voltage", 1, -5, 5, -1, false));
+    }
+
+    std::size_t longest = 0;
+    Range yRange;
+    for (const Sweep& sweep : job.sweeps) {
+        longest = std::max(longest, sweep.count);
+        if (sweep.range.min <= sweep.range.max) {
+            yRange.applyUnion(sweep.range);
+        }
+    }
+    job.tAxis->scale(0, longest / job.reader->samplingRate);
+    if (yRange.min <= yRange.max) {
+        double length = yRange.max - yRange.min;
+        if (length <= std::abs(yRange.max) * 0.001) {
+            length = std::abs(yRange.max) * 0.1;
+        }
+        if (length <= 0) {
+            length = job.yAxis->getStep();
+        }
+        job.yAxis->autoscale(yRange, Range(yRange.min - 0.1 * length, yRange.max + 0.1 * length), true);
+    }
+}
+
+// Lays out a thumbnail: its label at the top, and the plot area below, mapped by the axes as Plot::snapshotGeometry does
+static PlotGeometry thumbnailGeometry(const QSize& size, const Axis& tAxis, const Axis& yAxis) {
+    PlotGeometry geometry;
+    geometry.size = size;
+    geometry.plotArea = QRect(1, LABEL_HEIGHT, size.width() - 2, size.height() - LABEL_HEIGHT - 1);
+    geometry.xOffset = geometry.plotArea.left();
+    geometry.yOffset = size.height() - geometry.plotArea.bottom();
+    geometry.topMargin = geometry.plotArea.top() - 1;
+    geometry.rightMargin = size.width() - 1 - geometry.plotArea.right();
+    geometry.xStepSize = geometry.plotArea.width() / std::max(1, tAxis.numberOfSteps());
+    geometry.yStepSize = geometry.plotArea.height() / std::max(1, yAxis.numberOfSteps());
+    geometry.tStep = tAxis.getStep();
+    geometry.tMinStep = tAxis.minStepValue();
+    geometry.yStep = yAxis.getStep();
+    geometry.yMinStep = yAxis.minStepValue();
+    geometry.tMinAxis = tAxis.minAxisValue();
+    geometry.tMaxAxis = tAxis.maxAxisValue();
+    return geometry;
+}
+
+// Draws one sweep into image, which is the thumbnail's part of its sheet
+static void drawThumbnail(QImage& image, const PlotGeometry& geometry, const vector<double>& values, double samplingRate, const QString& label) {
+    // One piece per run of valid values, so gaps (e.g., NaN while the mux read temperature) aren't joined up
+    vector<Line> lines(1);
+    double dt = 1.0 / samplingRate;
+    bool inPiece = false;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        if (std::isnan(values[i])) {
+            inPiece = false;
+            continue;
+        }
+        if (!inPiece) {
+            lines[0].addLineSegment();
+            inPiece = true;
+        }
+        lines[0].addPoint(i * dt, values[i]);
+    }
+
+    QPainter painter(&image);
+    painter.fillRect(image.rect(), Qt::white);
+    painter.setPen(Qt::lightGray);
+    painter.drawRect(geometry.plotArea.adjusted(-1, -1, 0, 0));
+    if (geometry.yMinStep < 0 && geometry.yMinStep + geometry.plotArea.height() / std::max(1, geometry.yStepSize) > 0) {
+        int zero = geometry.yPixel(0);
+        painter.drawLine(geometry.plotArea.left(), zero, geometry.plotArea.right(), zero);
+    }
+    painter.setPen(Qt::black);
+    painter.drawText(QRect(2, 0, geometry.size.width() - 4, LABEL_HEIGHT), Qt::AlignLeft | Qt::AlignVCenter, label);
+
+    painter.setClipRect(geometry.plotArea);
+    PlotRenderer::drawLines(painter, geometry, lines);
+}
+
+static QString sheetPath(const Job& job, std::size_t sheet) {
+    if (job.sheets.size() == 1) {
+        return job.destination + ".png";
+    }
+    return QString("%1_%2.png").arg(job.destination).arg(sheet + 1);
+}
+
+// Opens the file and finds its sweeps; false if there's nothing to draw
+static bool openJob(Job& job) {
+    job.reader.reset(new SaveFileReader);
+    job.reader->open(toFileName(job.source.toStdString()));
+    if (job.reader->isAux) {
+        return false;
+    }
+    job.sweeps = findSweeps(*job.reader);
+    return !job.sweeps.empty();
+}
+
+// Allocates the sheets, and writes each one's header
+static void layOutSheets(Job& job, const Options& options) {
+    scaleAxes(job);
+    job.geometry = thumbnailGeometry(options.thumbnailSize, *job.tAxis, *job.yAxis);
+
+    const Axis& t = *job.tAxis;
+    const Axis& y = *job.yAxis;
+    QString scale = QString("%1: %2 to %3   %4: %5 to %6").arg(t.getLabel()).arg(t.getTickLabel(t.minStepValue())).arg(t.getTickLabel(t.maxStepValue()))
+                                                         .arg(y.getLabel()).arg(y.getTickLabel(y.minStepValue())).arg(y.getTickLabel(y.maxStepValue()));
+    std::size_t numSheets = (job.sweeps.size() + options.perSheet - 1) / options.perSheet;
+    for (std::size_t s = 0; s < numSheets; s++) {
+        std::size_t first = s * options.perSheet;
+        std::size_t count = std::min<std::size_t>(options.perSheet, job.sweeps.size() - first);
+        int rows = static_cast<int>((count + options.columns - 1) / options.columns);
+        int columns = static_cast<int>(std::min<std::size_t>(count, options.columns));
+        QSize size(GAP + columns * (options.thumbnailSize.width() + GAP), 2 * LABEL_HEIGHT + GAP + rows * (options.thumbnailSize.height() + GAP));
+        QImage sheet(size, QImage::Format_RGB32);
+        sheet.fill(QColor(Qt::gray).rgb());
+
+        QPainter painter(&sheet);
+        painter.setPen(Qt::white);
+        QString title = QString("%1   sweeps %2-%3 of %4   %5").arg(QFileInfo(job.source).fileName()).arg(first + 1).arg(first + count).arg(job.sweeps.size()).arg(scale);
+        painter.drawText(QRect(GAP, 0, size.width() - 2 * GAP, 2 * LABEL_HEIGHT), Qt::AlignLeft | Qt::AlignVCenter, title);
+        painter.end();
+        job.sheets.push_back(sheet);
+    }
+}
+
+// Reads and draws a group of files, in parallel across all their sweeps; returns the number that failed
+static unsigned int runGroup(vector<Job*>& group, const Options& options, ThreadPool& pool) {
+    vector<std::function<void()>> tasks;
+
+    // Sweeps without a range from the sweep index are scanned for one first, so each file's thumbnails share a scale
+    for (Job* job : group) {
+        for (Sweep& sweep : job->sweeps) {
+            if (sweep.range.min > sweep.range.max) {
+                Sweep* s = &sweep;
+                tasks.push_back([job, s]() {
+                    try {
+                        vector<double> values;
+                        readMeasured(*job->reader, s->first, s->count, values);
+                        s->range = validRange(values);
+                    }
+                    catch (const std::exception& e) {
+                        job->fail(e.what());
+                    }
+                });
+            }
+        }
+    }
+    pool.run(tasks);
+
+    tasks.clear();
+    for (Job* job : group) {
+        if (job->failed()) {
+            continue;
+        }
+        layOutSheets(*job, options);
+        for (std::size_t i = 0; i < job->sweeps.size(); i++) {
+            // Each thumbnail paints into its own part of the sheet, through an image that shares the sheet's pixels
+            QImage& sheet = job->sheets[i / options.perSheet];
+            int index = static_cast<int>(i % options.perSheet);
+            int x = GAP + (index % options.columns) * (options.thumbnailSize.width() + GAP);
+            int y = 2 * LABEL_HEIGHT + GAP + (index / options.columns) * (options.thumbnailSize.height() + GAP);
+            uchar* pixels = sheet.bits() + y * sheet.bytesPerLine() + x * 4;
+            int bytesPerLine = sheet.bytesPerLine();
+            const Sweep* s = &job->sweeps[i];
+            QString label = QString("%1").arg(i + 1);
+            tasks.push_back([job, s, pixels, bytesPerLine, label, &options]() {
+                try {
+                    vector<double> values;
+                    readMeasured(*job->reader, s->first, s->count, values);
+                    QImage thumbnail(pixels, options.thumbnailSize.width(), options.thumbnailSize.height(), bytesPerLine, QImage::Format_RGB32);
+                    drawThumbnail(thumbnail, job->geometry, values, job->reader->samplingRate, label);
+                }
+                catch (const std::exception& e) {
+                    job->fail(e.what());
+                }
+            });
+        }
+    }
+    pool.run(tasks);
+
+    tasks.clear();
+    for (Job* job : group) {
+        if (job->failed()) {
+            continue;
+        }
+        QDir().mkpath(QFileInfo(job->destination).path());
+        for (std::size_t s = 0; s < job->sheets.size(); s++) {
+            tasks.push_back([job, s]() {
+                QString path = sheetPath(*job, s);
+                if (!job->sheets[s].save(path, "PNG")) {
+                    job->fail("Can't write " + path.toStdString());
+                }
+            });
+        }
+    }
+    pool.run(tasks);
+
+    unsigned int failed = 0;
+    for (Job* job : group) {
+        std::cout << job->source.toStdString() << ": ";
+        if (job->failed()) {
+            std::cout << "FAILED: " << job->error << "\n";
+            failed++;
+        }
+        else {
+            std::cout << job->sweeps.size() << " sweeps, " << job->sheets.size() << " sheet(s)\n";
+        }
+        // Done with the mapping and the images
+        job->reader.reset();
+        job->sheets.clear();
+    }
+    std::cout.flush();
+    return failed;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    // Text is drawn with the application's fonts, which need a GUI application, but nothing here is ever shown
+#if QT_VERSION >= 0x050000
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+#else
+    QApplication app(argc, argv);
+#endif
+
+    try {
+        vector<unique_ptr<Job>> jobs;
+        for (const string& input : options.inputs) {
+            findSaveFiles(QString::fromStdString(input), QString::fromStdString(options.output), jobs);
+        }
+        if (jobs.empty()) {
+            std::cerr << "No .clp files found\n";
+            return 1;
+        }
+
+        unique_ptr<ThreadPool> ownPool;
+        if (options.threads > 0) {
+            ownPool.reset(new ThreadPool(options.threads));
+        }
+        ThreadPool& pool = ownPool ? *ownPool : ThreadPool::instance();
+        std::cout << "Drawing " << jobs.size() << " file(s) on " << pool.numThreads() << " worker threads\n";
+
+        auto start = std::chrono::steady_clock::now();
+        unsigned int failed = 0;
+        std::size_t sweeps = 0;
+        vector<Job*> group;
+        std::size_t groupSheets = 0;
+        for (std::size_t i = 0; i < jobs.size(); i++) {
+            Job& job = *jobs[i];
+            try {
+                if (!openJob(job)) {
+                    std::cout << job.source.toStdString() << ": skipped (" << (job.reader->isAux ? "aux file" : "no records") << ")\n";
+                    job.reader.reset();
+                    continue;
+                }
+            }
+            catch (const std::exception& e) {
+                std::cout << job.source.toStdString() << ": FAILED: " << e.what() << "\n";
+                job.reader.reset();
+                failed++;
+                continue;
+            }
+            group.push_back(&job);
+            sweeps += job.sweeps.size();
+            groupSheets += (job.sweeps.size() + options.perSheet - 1) / options.perSheet;
+            if (groupSheets >= MAX_SHEETS_PER_GROUP) {
+                failed += runGroup(group, options, pool);
+                group.clear();
+                groupSheets = 0;
+            }
+        }
+        if (!group.empty()) {
+            failed += runGroup(group, options, pool);
+        }
+
+        double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+        std::cout << sweeps << " sweeps in " << seconds << " s (" << sweeps / seconds << " sweeps/s), " << failed << " file(s) failed\n";
+        return (failed == 0) ? 0 : 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
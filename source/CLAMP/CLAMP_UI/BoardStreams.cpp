@@ -0,0 +1,69 @@
+#include "BoardStreams.h"
+
+using std::vector;
+using std::lock_guard;
+using std::recursive_mutex;
+
+BoardStreams::BoardStreams() :
+    adcs(8)
+{
+}
+
+// Empties the streams, but keeps their capacity, so the next cycle doesn't have to reallocate
+void BoardStreams::clear() {
+    lock_guard<recursive_mutex> lock(mutex);
+
+    timestamps.clear();
+    digIns.clear();
+    digOuts.clear();
+    for (auto& adc : adcs) {
+        adc.clear();
+    }
+}
+
+// Reserves room for n samples in each stream
+void BoardStreams::reserve(std::size_t n) {
+    lock_guard<recursive_mutex> lock(mutex);
+
+    timestamps.reserve(n);
+    digIns.reserve(n);
+    digOuts.reserve(n);
+    for (auto& adc : adcs) {
+        adc.reserve(n);
+    }
+}
+
+void BoardStreams::append(const vector<uint32_t>& timestamps_, const vector<uint16_t>& digIns_, const vector<uint16_t>& digOuts_, const vector<vector<uint16_t>>& adcs_) {
+    lock_guard<recursive_mutex> lock(mutex);
+
+    timestamps.insert(timestamps.end(), timestamps_.begin(), timestamps_.end());
+    digIns.insert(digIns.end(), digIns_.begin(), digIns_.end());
+    digOuts.insert(digOuts.end(), digOuts_.begin(), digOuts_.end());
+    for (unsigned int i = 0; i < adcs_.size() && i < adcs.size(); i++) {
+        adcs[i].insert(adcs[i].end(), adcs_[i].begin(), adcs_[i].end());
+    }
+}
+
+// Appends other's streams from index first on
+void BoardStreams::appendTail(BoardStreams& other, std::size_t first) {
+    lock_guard<recursive_mutex> lock(mutex);
+    lock_guard<recursive_mutex> lockOther(other.mutex);
+
+    timestamps.insert(timestamps.end(), other.timestamps.begin() + first, other.timestamps.end());
+    digIns.insert(digIns.end(), other.digIns.begin() + first, other.digIns.end());
+    digOuts.insert(digOuts.end(), other.digOuts.begin() + first, other.digOuts.end());
+    for (unsigned int i = 0; i < other.adcs.size() && i < adcs.size(); i++) {
+        adcs[i].insert(adcs[i].end(), other.adcs[i].begin() + first, other.adcs[i].end());
+    }
+}
+
+// Bytes allocated for the streams (their capacity, which clear() keeps)
+std::size_t BoardStreams::memoryBytes() {
+    lock_guard<recursive_mutex> lock(mutex);
+
+    std::size_t total = timestamps.capacity() * sizeof(uint32_t) + (digIns.capacity() + digOuts.capacity()) * sizeof(uint16_t);
+    for (auto& adc : adcs) {
+        total += adc.capacity() * sizeof(uint16_t);
+    }
+    return total;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+/* Streams that the board records once for all headstages: timestamps, digital inputs and outputs, and the ADCs.
+ *
+ * One instance (owned by GlobalState) is shared by every DataStore, so each chunk read from the board is stored once,
+ * rather than once per headstage.  The ClampThread appends each chunk before handing the headstage data to the
+ * DataStores, and clears it at the start of each cycle.  A DataStore views it from the index it was last cleared at
+ * (see DataStore::streamOffset).  When the headstages run concurrent waveforms, each DataStore has cycles of its own,
+ * so instead of being cleared the streams are replaced by the part that's still viewed (see ClampThread::trimStreams).
+ */
+class BoardStreams {
+public:
+    BoardStreams();
+
+    void clear();
+    void reserve(std::size_t n);
+    void append(const std::vector<uint32_t>& timestamps_, const std::vector<uint16_t>& digIns_, const std::vector<uint16_t>& digOuts_, const std::vector<std::vector<uint16_t>>& adcs_);
+    void appendTail(BoardStreams& other, std::size_t first);
+    std::size_t size() const { return timestamps.size(); }
+    std::size_t memoryBytes();
+
+    std::vector<uint32_t> timestamps;
+    std::vector<uint16_t> digIns;
+    std::vector<uint16_t> digOuts;
+    std::vector<std::vector<uint16_t>> adcs;
+
+    // Acquire this to read the streams from a thread other than the one appending (e.g., to save from the GUI)
+    std::recursive_mutex mutex;
+};
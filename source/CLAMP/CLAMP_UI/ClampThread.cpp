@@ -8,17 +8,25 @@
 #include "common.h"
 #include <QtGui>
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
 #include "Board.h"
+#include "MultiplexedSaveFile.h"
+#include "HealthMonitor.h"
 #include "ControlWindow.h"
 #include "WaveformAmplitudeWidget.h"
 
 using std::vector;
 using std::shared_ptr;
 using std::exception;
+using std::unique_ptr;
 using namespace CLAMP;
 using namespace CLAMP::ClampConfig;
 using namespace CLAMP::WaveformControl;
 
+// Logs the number of USB control transfers made during each sweep
+static const bool logControlTransactions = false;
+
 //------------------------------------------------------------------------------------------
 
 ClampThread::ClampThread(GlobalState& state_, VoltageClampWidget** voltageWidget_, CurrentClampWidget** currentWidget_, bool* voltageClampMode_, unsigned int unit_) :
@@ -34,8 +42,12 @@ ClampThread::ClampThread(GlobalState& state_, VoltageClampWidget** voltageWidget
 	currentWidget(currentWidget_),
     capControlWidget(state.datastore[unit_].controlWindow),
 	unit(unit_),
+	concurrent(false),
+	gapless(false),
+	idleTimesteps(0),
 	capCompensationMagnitude(board.controller.fastTransientCapacitiveCompensation.getMagnitude(ChipChannel{ unit_, 0 })),
-    capCompensationConnect(board.chip[unit_]->channel[0]->registers.r7.value.fastTransConnect)
+    capCompensationConnect(board.chip[unit_]->channel[0]->registers.r7.value.fastTransConnect),
+	seenWaveformVersion(0)
 {
 	for (int i = 0; i < MAX_NUM_CHIPS; i++) {
 		voltageClampMode[i] = voltageClampMode_[i];
@@ -47,6 +59,12 @@ ClampThread::ClampThread(GlobalState& state_, VoltageClampWidget** voltageWidget
 		controlWidget = currentWidget[unit_];
 	}
 	channelList = board.getPresentChannels();
+	for (auto& index : channelList) {
+		if (chipList.empty() || chipList.back() != index.chip) {
+			chipList.push_back(index.chip);
+		}
+	}
+	boundarySwap.pending = false;
 	feedback = voltageWidget[unit_]->feedback;
 	bandwidth = feedback->getDesiredBandwidth();
 	resistance = feedback->getResistanceEnum();
@@ -61,7 +79,7 @@ void ClampThread::done() {
 
 void ClampThread::run() {
 	controlWidget->startMessage(unit);
-	for (unsigned int i = 0; i < MAX_NUM_CHANNELS; i++) {
+	for (unsigned int i : chipList) {
 		if (i != unit) {
 			if (voltageClampMode[i]) {
 				voltageWidget[i]->endMessage(i);
@@ -73,49 +91,91 @@ void ClampThread::run() {
 	}
     startRunning();
 	unsigned int lastIndex = simplifiedWaveform[unit].lastIndex(state.datastore[unit].overlay);
-	for (unsigned int i = 0; i < MAX_NUM_CHANNELS; i++) {
-		if (state.board->chip[i]->present) {
-			if (i == unit) {
-				state.datastore[i].writeHeader(i);
-			}
-			else {
-				state.datastore[i].writeHeader(i, true, lastIndex);
-			}
+	for (unsigned int i : chipList) {
+		if (i == unit || concurrent) {
+			state.datastore[i].writeHeader(i);
+		}
+		else {
+			state.datastore[i].writeHeader(i, true, lastIndex);
 		}
 	}
+	if (state.multiplexedSaveFile) {
+		writeMultiplexedHeader(lastIndex);
+	}
 
     runWithType(runType);
     endRunning();
     controlWidget->endMessage(unit);
-	for (unsigned int i = 0; i < MAX_NUM_CHANNELS; i++) {
-		if (state.board->chip[i]->present) {
-			state.datastore[i].closeFile();
-		}
+	// The files are flushed and closed in the background, so stopping doesn't wait for the disk and the next run can
+	// start right away; errors show on the headstage's status line
+	GlobalState* globalState = &state;
+	for (unsigned int i : chipList) {
+		state.datastore[i].closeFileAsync([globalState, i](std::exception_ptr error) {
+			globalState->saveFileClosed(i, error);
+		});
+	}
+	state.closeMultiplexedFileAsync(unit);
+}
+
+// Writes the header of the multiplexed save file: each unit's settings, as DataStore::writeHeader would save them (the
+// units of a headstage share its controls, so they differ only in the chip and channel)
+void ClampThread::writeMultiplexedHeader(unsigned int lastIndex) {
+	vector<unique_ptr<IO::HeaderData>> headers;
+	vector<const IO::HeaderData*> headerPtrs;
+	for (auto& index : channelList) {
+		headers.emplace_back(new IO::HeaderData(*state.board, index));
+		bool holdingOnly = !(index.chip == unit || concurrent);
+		state.datastore[index.chip].fillSaveHeader(*headers.back(), index.chip, holdingOnly, lastIndex);
+		headerPtrs.push_back(headers.back().get());
+	}
+	unique_ptr<IO::AuxHeaderData> auxHeader;
+	if (state.multiplexedNumAdcs >= 0) {
+		auxHeader.reset(new IO::AuxHeaderData(*state.board, ChipChannel(unit, 0), state.multiplexedNumAdcs));
+	}
+	state.multiplexedSaveFile->writeHeader(headerPtrs, auxHeader.get());
+}
+
+// Writes what was just read, for every unit of every headstage, to the multiplexed save file
+void ClampThread::writeMultiplexedData() {
+	LoopTiming::Phase phase("save");
+	vector<const vector<Sample>*> measured;
+	vector<const vector<Sample>*> clampValues;
+	for (auto& index : channelList) {
+		measured.push_back(&getValues(index));
+		clampValues.push_back(&getClampValues(index));
+	}
+	if (state.multiplexedNumAdcs >= 0) {
+		state.multiplexedSaveFile->writeData(board.readQueue.getTimeStamps(), measured, clampValues, board.readQueue.getADCs(),
+		                                     board.readQueue.getDigIns(), board.readQueue.getDigOuts());
+	}
+	else {
+		state.multiplexedSaveFile->writeData(board.readQueue.getTimeStamps(), measured, clampValues);
 	}
 }
 
 void ClampThread::startRunning() {
-	ChipChannelList chList;
-	for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
-		chList.push_back(ChipChannel{ i, 0 });
-		if (voltageClampMode[i]) {
-			switchToVoltageClamp({ ChipChannel{ i, 0 } }, voltageWidget[i]->getHoldingValue());
+	state.overload.reset();
+	board.fifoMonitor.startRun();
+	// Only present headstages have controls; every unit of one is switched the same way
+	for (auto& index : channelList) {
+		if (voltageClampMode[index.chip]) {
+			switchToVoltageClamp(index, voltageWidget[index.chip]->getHoldingValue());
 		}
 		else {
-			switchToCurrentClamp({ ChipChannel{ i, 0 } }, static_cast<CurrentScale>(controlWidget->getCurrentScale()), currentWidget[i]->getHoldingValue());
+			switchToCurrentClamp(index, static_cast<CurrentScale>(controlWidget->getCurrentScale()), currentWidget[index.chip]->getHoldingValue());
 		}
 	}
-	board.controller.executeImmediate(chList);
+	board.controller.executeImmediate(channelList);
 	board.clearCommands();
 
 	// Set other channels to holding
-	for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
-		if (i != unit) {
-			if (voltageClampMode[i]) {
-				board.controller.clampVoltageGenerator.setClampVoltage({ ChipChannel{ i, 0 } }, voltageWidget[i]->getHoldingValue());
+	for (auto& index : channelList) {
+		if (index.chip != unit) {
+			if (voltageClampMode[index.chip]) {
+				board.controller.clampVoltageGenerator.setClampVoltage(index, voltageWidget[index.chip]->getHoldingValue());
 			}
 			else {
-				board.controller.clampCurrentGenerator.setCurrent({ ChipChannel{ i, 0 } }, currentWidget[i]->getHoldingValue());
+				board.controller.clampCurrentGenerator.setCurrent(index, currentWidget[index.chip]->getHoldingValue());
 			}
 		}
 	}
@@ -123,15 +183,25 @@ void ClampThread::startRunning() {
 	setCapacitiveCompensationImmediate();
 	board.clearCommands();
 
+	seenWaveformVersion = controlWidget->getWaveformVersion();
 	simplifiedWaveform[unit] = controlWidget->getSimplifiedWaveform(state.board->getSamplingRateHz());
 	unsigned int lastIndex = simplifiedWaveform[unit].lastIndex(state.datastore[unit].overlay);
-	for (int i = 0; i < MAX_NUM_CHIPS; i++) {
+
+	/* Every channel loops through its own command list, so the other headstages can run their own waveforms alongside
+	 * this one, each DataStore cutting its data into its own cycles.  That needs the board to run continuously: one-shot
+	 * runs and runs with an interval last one cycle of this unit's waveform, so the others hold for that long instead.
+	 * The other headstages' intervals are ignored; their waveforms repeat back to back.
+	 */
+	concurrent = state.concurrentProtocols && runType != ClampThread::ONCE && simplifiedWaveform[unit].interval <= 0;
+	gapless = state.gaplessIntervals && runType != ClampThread::ONCE && simplifiedWaveform[unit].interval > 0;
+	for (unsigned int i : chipList) {
 		if (i != unit) {
+			bool holdingOnly = !concurrent;
 			if (voltageClampMode[i]) {
-				simplifiedWaveform[i] = voltageWidget[i]->getSimplifiedWaveform(state.board->getSamplingRateHz(), i != unit, lastIndex);
+				simplifiedWaveform[i] = voltageWidget[i]->getSimplifiedWaveform(state.board->getSamplingRateHz(), holdingOnly, lastIndex);
                 //DEBUGOUT("simplifiedWaveform[i].waveform[0].appliedDiscreteValue = " << simplifiedWaveform[i].waveform[0].appliedDiscreteValue << endl);
             } else {
-				simplifiedWaveform[i] = currentWidget[i]->getSimplifiedWaveform(state.board->getSamplingRateHz(), i != unit, lastIndex);
+				simplifiedWaveform[i] = currentWidget[i]->getSimplifiedWaveform(state.board->getSamplingRateHz(), holdingOnly, lastIndex);
 			}
 		}
 	}
@@ -140,15 +210,15 @@ void ClampThread::startRunning() {
 
 void ClampThread::endRunning() {
 	// Set to holding voltage or current
-	for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
-		if (voltageClampMode[i]) {
+	for (auto& index : channelList) {
+		if (voltageClampMode[index.chip]) {
 			for (int repeat = 0; repeat < 60; repeat++) {	// we must send multiple SPI commands so that the DACs update properly
-				board.controller.clampVoltageGenerator.setClampVoltage({ ChipChannel{ i, 0 } }, voltageWidget[i]->getHoldingValue());
+				board.controller.clampVoltageGenerator.setClampVoltage(index, voltageWidget[index.chip]->getHoldingValue());
 			}
 		}
 		else {
 			for (int repeat = 0; repeat < 60; repeat++) {	// we must send multiple SPI commands so that the DACs update properly
-				board.controller.clampCurrentGenerator.setCurrent({ ChipChannel{ i, 0 } }, currentWidget[i]->getHoldingValue());
+				board.controller.clampCurrentGenerator.setCurrent(index, currentWidget[index.chip]->getHoldingValue());
 			}
 		}
 	}
@@ -157,47 +227,53 @@ void ClampThread::endRunning() {
 
 void ClampThread::clear(bool filtersToo) {
     board.readQueue.clear(filtersToo);
-	if (!voltageClampMode[unit]) {
-		clearOffsetVoltages();
-	}
 }
 
-const vector<double>& ClampThread::getValues(unsigned int headstage) {
-	if (voltageClampMode[headstage]) {
-		return board.readQueue.getMeasuredCurrents({ ChipChannel{headstage, 0} });
+// Measured voltages come out of the read queue with the pipette offset already taken out; see applyPipetteOffsets
+const vector<Sample>& ClampThread::getValues(const ChipChannel& index) {
+	if (voltageClampMode[index.chip]) {
+		return board.readQueue.getMeasuredCurrents(index);
 	}
 	else {
-		const vector<double>& fromBoard = board.readQueue.getMeasuredVoltages(ChipChannel{ headstage, 0 });
-
-		double offset = state.pipetteOffsetInmV[headstage] / 1000.0;
-		if (offset == 0.0) {
-			return fromBoard;
-		}
-		if (offset != voltageOffset) {
-			clearOffsetVoltages();
-			voltageOffset = offset;
-		}
-		if (offsetVoltages.size() != fromBoard.size()) {
-			offsetVoltages.reserve(fromBoard.size());
-			for (double v : fromBoard) {
-				offsetVoltages.push_back(v - voltageOffset);
-			}
-		}
-		return offsetVoltages;
+		return board.readQueue.getMeasuredVoltages(index);
 	}
 }
 
-const vector<double>& ClampThread::getClampValues(unsigned int headstage) {
-	if (voltageClampMode[headstage]) {
-		return board.readQueue.getClampVoltages(ChipChannel{ headstage, 0 });
+const vector<Sample>& ClampThread::getClampValues(const ChipChannel& index) {
+	if (voltageClampMode[index.chip]) {
+		return board.readQueue.getClampVoltages(index);
 	}
 	else {
-		return board.readQueue.getClampCurrents(ChipChannel{ headstage, 0 });
+		return board.readQueue.getClampCurrents(index);
 	}
 }
 
-void ClampThread::clearOffsetVoltages() {
-	offsetVoltages.erase(offsetVoltages.begin(), offsetVoltages.end());
+// The headstage's first unit, which is the one its DataStore shows and saves
+const vector<Sample>& ClampThread::getValues(unsigned int headstage) {
+	return getValues(ChipChannel{ headstage, 0 });
+}
+
+const vector<Sample>& ClampThread::getClampValues(unsigned int headstage) {
+	return getClampValues(ChipChannel{ headstage, 0 });
+}
+
+// This thread's channels on one headstage: all of its units
+ChipChannelList ClampThread::unitsOf(unsigned int headstage) const {
+	ChipChannelList units;
+	for (auto& index : channelList) {
+		if (index.chip == headstage) {
+			units.push_back(index);
+		}
+	}
+	return units;
+}
+
+// Has the read queue subtract each headstage's pipette offset from its measured voltages as it converts them, so the
+// corrected values don't need a copy of their own.  Picked up by the next read, so a change applies from then on.
+void ClampThread::applyPipetteOffsets() {
+	for (auto& index : channelList) {
+		board.controller.getChannel(index).measurementCorrection.voltageOffset = -state.pipetteOffsetInmV[index.chip] / 1000.0;
+	}
 }
 
 void ClampThread::switchToCurrentClamp(const ChipChannel& channel, CurrentScale scale, int holdingCurrent) {
@@ -213,9 +289,12 @@ void ClampThread::switchToVoltageClamp(const ChipChannel& channel, int holdingVo
 void ClampThread::setRCImmediate() {
 	// Set the feedback resistor and capacitor values
 	bandwidth = feedback->getDesiredBandwidth();
-	board.chip[unit]->channel[0]->desiredBandwidth = bandwidth;
+	ChipChannelList units = unitsOf(unit);
+	for (auto& index : units) {
+		board.controller.getChannel(index).desiredBandwidth = bandwidth;
+	}
 	resistance = feedback->getResistanceEnum();
-	board.controller.currentToVoltageConverter.setFeedbackResistanceAndCapacitanceImmediate({ ChipChannel{ unit, 0 } }, resistance);
+	board.controller.currentToVoltageConverter.setFeedbackResistanceAndCapacitanceImmediate(units, resistance);
 }
 
 void ClampThread::setScaleImmediate() {
@@ -229,10 +308,15 @@ bool ClampThread::scaleChanged() const {
 }
 
 void ClampThread::setCapacitiveCompensationImmediate() {
+    // Both settings go out in one run
+    // The headstage's controls set its first unit; the others follow it
+    ClampController::ImmediateTransaction transaction(board.controller);
+    ChipChannelList units = unitsOf(unit);
     capCompensationMagnitude = board.controller.fastTransientCapacitiveCompensation.getMagnitude({ ChipChannel{ unit, 0 } });
-    board.controller.fastTransientCapacitiveCompensation.setMagnitudeImmediate({ ChipChannel{ unit, 0 } }, capCompensationMagnitude);
+    board.controller.fastTransientCapacitiveCompensation.setMagnitudeImmediate(units, capCompensationMagnitude);
     capCompensationConnect = board.chip[unit]->channel[0]->registers.r7.value.fastTransConnect;
-    board.controller.fastTransientCapacitiveCompensation.setConnectImmediate({ ChipChannel{ unit, 0 } }, capCompensationConnect);
+    board.controller.fastTransientCapacitiveCompensation.setConnectImmediate(units, capCompensationConnect);
+    transaction.commit();
 }
 
 bool ClampThread::capCompensationChanged() const {
@@ -244,40 +328,240 @@ void ClampThread::createWaveform() {
     board.enableChannels(channelList, true);
 	// board.addEnabledChannels(channelList);
 
+	// Every unit of a headstage runs its waveform.  Its segments' markerOut and digOut flags are compiled into the
+	// commands themselves (and cached with them; see ClampController::simplifiedWaveformToWaveform), and the board
+	// routes them to the digital outputs chosen with Board::setDigitalMarkerDestination, so there's nothing more to
+	// upload for the markers.
 	for (unsigned int i = 0; i < MAX_NUM_CHIPS; i++) {
-		board.controller.simplifiedWaveformToWaveform({ ChipChannel{ i, 0 } }, voltageClampMode[i], simplifiedWaveform[i]);
+		if (board.chip[i]->present) {
+			waveformToCommands(i, simplifiedWaveform[i]);
+		}
+		else {
+			board.chip[i]->channel[0]->nullCommandToFPGA(); // Nothing there, and no controls to take a holding value from
+		}
 	}
     board.commandsToFPGA();
+}
+
+/* Adds a headstage's waveform to its units' command lists.
+ *
+ * In a gapless run, this unit's waveform is followed by holding for the rest of the interval, so that the board's loop
+ * is exactly one interval long and the board never has to stop between sweeps.  The holding is only in the commands:
+ * the DataStores keep the waveform as given, and the sweep reads skip the idle timesteps (see readIdle).  Intervals
+ * shorter than the waveform leave no holding, i.e., the sweeps run back to back.
+ */
+void ClampThread::waveformToCommands(unsigned int headstage, SimplifiedWaveform& waveform) {
+	ChipChannelList units = unitsOf(headstage);
+	if (headstage != unit || !gapless || waveform.waveform.empty()) {
+		board.controller.simplifiedWaveformToWaveform(units, voltageClampMode[headstage], waveform);
+		return;
+	}
+
+	unsigned int sweepTimesteps = waveform.waveform.back().endIndex + 1;
+	double intervalTimesteps = std::round(waveform.interval * board.getSamplingRateHz());
+	idleTimesteps = (intervalTimesteps > sweepTimesteps) ? static_cast<unsigned int>(intervalTimesteps) - sweepTimesteps : 0;
+	if (idleTimesteps == 0) {
+		board.controller.simplifiedWaveformToWaveform(units, voltageClampMode[headstage], waveform);
+		return;
+	}
+	SimplifiedWaveform padded = waveform;
+	padded.push_back(WaveformSegment(0, controlWidget->getHoldingValue(), idleTimesteps, 0, false, false));
+	board.controller.simplifiedWaveformToWaveform(units, voltageClampMode[headstage], padded);
+	for (unsigned int i = 0; i < waveform.size(); i++) {
+		waveform.waveform[i].numCommands = padded.waveform[i].numCommands;
+	}
+}
+
+// Starts a new cycle for every headstage being run, with (normally reused) empty board-wide streams
+void ClampThread::startCycles() {
+	for (unsigned int i : chipList) {
+		state.datastore[i].releaseStreams();
+	}
+	// Other DataStores may still be showing data from an earlier run, so only reuse the streams if nothing else views them
+	if (state.boardStreams.unique()) {
+		state.boardStreams->clear();
+	}
+	else {
+		state.boardStreams = std::make_shared<BoardStreams>();
+	}
+	for (unsigned int i : chipList) {
+		state.datastore[i].startCycle(state.boardStreams);
+	}
+}
+
+/* Drops the start of the board-wide streams that no DataStore views any more.
+ *
+ * Used instead of startCycles when the headstages run concurrently: then the DataStores start their cycles themselves,
+ * at different times, so the streams can't simply be cleared.  The part that's still viewed is copied to new streams,
+ * which each DataStore switches to in turn; the old streams live on until the last one has.
+ */
+void ClampThread::trimStreams() {
+	std::size_t unused = state.boardStreams->size();
+	for (unsigned int i : chipList) {
+		unused = std::min(unused, state.datastore[i].getStreamOffset());
+	}
+	if (unused == 0) {
+		return;
+	}
+	shared_ptr<BoardStreams> streams = std::make_shared<BoardStreams>();
+	streams->reserve(state.boardStreams->size() - unused + board.getNumTimesteps(unit) + 1);
+	streams->appendTail(*state.boardStreams, unused);
+	for (unsigned int i : chipList) {
+		state.datastore[i].rebaseStreams(streams, unused);
+	}
+	state.boardStreams = streams;
+}
+
+// Gives every headstage being run its waveform
+void ClampThread::initDataStores() {
+	for (unsigned int i : chipList) {
+		state.datastore[i].init(simplifiedWaveform[i], voltageClampMode[i], concurrent);
+	}
+}
+
+// Reads whatever has come in of the sweep, up to the rest of it, and hands it to the DataStores.  The first read of a
+// board run includes one extra timestep.
+void ClampThread::readAvailable(SweepSequence& seq) {
+    if (keepGoing && seq.packetsToRead > 0) {
+        unsigned int packetsThisRead = board.read(seq.packetsToRead, &keepGoing);
+        std::chrono::steady_clock::time_point processingStart = std::chrono::steady_clock::now();
+        if (boundarySwap.pending && !seq.first) {
+            checkBoundarySwap(getClampValues(unit), seq.packetsRead);
+        }
+        seq.packetsRead += packetsThisRead;
 
-    vector<uint16_t> digitalOutputs;
-    digitalOutputs.reserve(simplifiedWaveform[unit].size());
-    for (unsigned int i = 0; i < simplifiedWaveform[unit].size(); i++) {
-        for (unsigned int j = 0; j < simplifiedWaveform[unit].waveform[i].numCommands; j++) {
-			digitalOutputs.push_back((simplifiedWaveform[unit].waveform[i].appliedDiscreteValue == simplifiedWaveform[unit].waveform[0].appliedDiscreteValue) ? 
-				0 : (board.digitalMarkerEnabled(unit) << board.digitalMarkerDestination(unit)));
+		seq.packetsToRead -= packetsThisRead;
+		{
+			LoopTiming::Phase phase("streams");
+			// Timestamps, digital I/O, and ADCs are the same for every headstage, so they're stored once
+			state.boardStreams->append(board.readQueue.getTimeStamps(), board.readQueue.getDigIns(), board.readQueue.getDigOuts(), board.readQueue.getADCs());
+		}
+		for (unsigned int i : chipList) {
+			state.datastore[i].storeData(board.readQueue, ChipChannel{ i, 0 }, seq.time);
+		}
+		if (state.multiplexedSaveFile) {
+			writeMultiplexedData();
+		}
+        clear(false);
+        board.loopTiming.processed();
+        double processingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - processingStart).count();
+        state.overload.update(board.fifoMonitor.getLatest().percentageFull, processingSeconds, packetsThisRead / board.getSamplingRateHz());
+
+        {
+            LoopTiming::Phase phase("stats");
+            state.datastore[unit].controlWindow->updateStatsExt();
         }
     }
+    if (!keepGoing || seq.packetsToRead == 0) {
+        LOG(logControlTransactions) << "Control transfers this sweep: " << (board.getNumControlTransactions() - seq.controlTransactions) << "\n";
+        if (seq.perSweepRuns) {
+            finishLastCycle();
+        }
+        seq.first = false;
+        seq.step = SWEEP_COMPLETE;
+    }
 }
 
-void ClampThread::readAndProcessOneCycle(bool first, double time) {
-    unsigned int packetsToRead = board.getNumTimesteps(unit);
-    if (first) {
-        packetsToRead++;
+// Reads the holding between two sweeps of a gapless run, which isn't stored; see waveformToCommands
+void ClampThread::readIdle(SweepSequence& seq) {
+    if (keepGoing && seq.idleToRead > 0) {
+        unsigned int packetsThisRead = board.read(seq.idleToRead, &keepGoing);
+        seq.idleToRead -= packetsThisRead;
+        clear(false);
+        board.loopTiming.processed();
+    }
+    if (!keepGoing || seq.idleToRead == 0) {
+        seq.step = NEXT_SWEEP;
     }
-    while (keepGoing && packetsToRead > 0) {
-        unsigned int packetsThisRead = board.read(packetsToRead);
+}
 
-		packetsToRead -= packetsThisRead;
-		for (auto& index : channelList) {
-			state.datastore[index.chip].storeData(getValues(index.chip), getClampValues(index.chip), time);
-		}
-        clear(false);
+/* Sends a new waveform for this unit while the board keeps running, if only its amplitudes changed.
+ *
+ * The new commands go to fresh Waveform RAM, and the FPGA switches to them the next time the waveform loops, so the
+ * waveform changes at a sweep boundary instead of the board being stopped and restarted.  Since the read side doesn't
+ * know which sweep that is, the change is recorded in boundarySwap, and checkBoundarySwap watches the clamp values for
+ * the first changed segment; the DataStores switch to the new waveform in the sweep where it shows up.
+ *
+ * Returns false if the waveform can't be changed this way (different timing, or the old and new values can't be told
+ * apart in the data); then nothing has been changed.
+ */
+bool ClampThread::changeWaveformAtBoundary(const SimplifiedWaveform& newWaveform) {
+    const SimplifiedWaveform& oldWaveform = simplifiedWaveform[unit];
+    if (boundarySwap.pending || newWaveform.interval != oldWaveform.interval || newWaveform.size() != oldWaveform.size()) {
+        return false;
+    }
+    const WaveformSegment* changed = nullptr;
+    for (unsigned int i = 0; i < newWaveform.size(); i++) {
+        const WaveformSegment& a = oldWaveform.waveform[i];
+        const WaveformSegment& b = newWaveform.waveform[i];
+        if (a.startIndex != b.startIndex || a.endIndex != b.endIndex) {
+            return false;
+        }
+        if (!changed && a.appliedDiscreteValue != b.appliedDiscreteValue) {
+            changed = &b;
+            boundarySwap.oldValue = a.appliedDiscreteValue;
+        }
+    }
+    if (!changed) {
+        return false; // e.g., only the markers changed, which don't show up in the clamp values
+    }
 
-        state.datastore[unit].controlWindow->updateStatsExt();
+    const Channel& channel = *board.chip[unit]->channel[0];
+    double step = voltageClampMode[unit] ? channel.getVoltageClampStep() : channel.recallCurrentStep();
+    boundarySwap.firstIndex = changed->startIndex;
+    boundarySwap.lastIndex = changed->endIndex;
+    boundarySwap.newValue = changed->appliedDiscreteValue * step;
+    boundarySwap.oldValue *= step;
+
+    SimplifiedWaveform waveform = newWaveform;
+    ChipChannelList units = unitsOf(unit);
+    auto clearCommands = [&]() {
+        for (auto& index : units) {
+            board.controller.getChannel(index).commands.clear();
+        }
+    };
+    clearCommands();
+    try {
+        waveformToCommands(unit, waveform);
+        board.commandsToFPGAAtBoundary();
     }
+    catch (exception&) {
+        // E.g., not enough Waveform RAM for both waveforms at once; put back the old commands
+        clearCommands();
+        waveformToCommands(unit, simplifiedWaveform[unit]);
+        return false;
+    }
+    simplifiedWaveform[unit] = waveform;
+    boundarySwap.pending = true;
+    return true;
+}
+
+// Looks for the pending waveform change in clampValues, which start at timestep offset of the current sweep
+void ClampThread::checkBoundarySwap(const vector<Sample>& clampValues, unsigned int offset) {
+    unsigned int end = offset + static_cast<unsigned int>(clampValues.size());
+    for (unsigned int i = std::max(offset, boundarySwap.firstIndex); i <= boundarySwap.lastIndex && i < end; i++) {
+        double value = clampValues[i - offset];
+        if (std::isnan(value)) {
+            continue; // Not a clamp command
+        }
+        if (std::abs(value - boundarySwap.newValue) < std::abs(value - boundarySwap.oldValue)) {
+            // This sweep is the first with the new waveform
+            state.datastore[unit].init(simplifiedWaveform[unit], voltageClampMode[unit], concurrent);
+            board.releaseRetiredCommands();
+            boundarySwap.pending = false;
+        }
+        return;
+    }
+}
+
+// Drops a pending waveform change, once the board has stopped
+void ClampThread::cancelBoundarySwap() {
+    board.releaseRetiredCommands();
+    boundarySwap.pending = false;
 }
 
 void ClampThread::finishLastCycle() {
+    board.stopReaderThread();
     board.stop();
     board.flush();
 
@@ -286,161 +570,270 @@ void ClampThread::finishLastCycle() {
 }
 
 void ClampThread::runWithType(RunType runType) {
-    switch (runType)
-    {
-    case ClampThread::BATCH:
-        if (simplifiedWaveform[unit].interval > 0) {
-            // There's no way to run continuously if you're pausing between runs
-            runBatches();
+    SweepSequence seq = sequenceFor(runType);
+    runSequence(seq);
+}
+
+/* The steps each run type takes (see runSequence):
+ *   ONCE: one sweep, the board running for just that sweep.
+ *   With an interval (BATCH or CONTINUOUS): the board runs one sweep at a time, and the next one starts when the
+ *     interval is up.  The controls are picked up before each sweep.
+ *   With an interval, gapless (GlobalState::gaplessIntervals): the interval is holding at the end of the board's
+ *     waveform, so the board runs continuously and the sweeps are exactly one interval apart.  The holding is read
+ *     past between sweeps (IDLE).  The controls are picked up as in a continuous BATCH run.
+ *   BATCH without an interval: the board runs continuously, and is restarted if the controls change (or, if only
+ *     amplitudes changed, the new waveform takes over at a sweep boundary; see changeWaveformAtBoundary).
+ *   CONTINUOUS without an interval: the board runs continuously with the waveform it started with.
+ */
+ClampThread::SweepSequence ClampThread::sequenceFor(RunType runType) const {
+    bool interval = simplifiedWaveform[unit].interval > 0;
+    SweepSequence seq;
+    seq.perSweepRuns = (runType == ClampThread::ONCE) || (interval && !gapless);
+    seq.followControls = (runType == ClampThread::BATCH) || (runType == ClampThread::CONTINUOUS && interval);
+    seq.repeat = (runType != ClampThread::ONCE);
+    seq.step = NEXT_SWEEP;
+    seq.first = true;
+    seq.time = (seq.perSweepRuns || gapless) ? 0 : -1;
+    seq.idleToRead = 0;
+    seq.packetsToRead = 0;
+    seq.packetsRead = 0;
+    seq.controlTransactions = 0;
+    return seq;
+}
+
+/* Runs the sweeps, one step at a time.  Each step returns as soon as it has handled what it was waiting for (the
+ * sweep started, data read, the sweep complete, the interval up), so the run types share one sequence instead of
+ * each having a loop of its own, and the only waiting is in board.read() and in the INTERVAL step, both of which
+ * return as soon as the thread is stopped.
+ */
+void ClampThread::runSequence(SweepSequence& seq) {
+    if (!seq.perSweepRuns) {
+        board.runContinuously();
+        board.startReaderThread();
+    }
+    initDataStores();
+    if (!seq.perSweepRuns && concurrent) {
+        startCycles();
+    }
+    while (seq.step != DONE) {
+        try {
+            switch (seq.step) {
+            case NEXT_SWEEP:
+                startSweep(seq);
+                break;
+            case READ:
+                readAvailable(seq);
+                break;
+            case SWEEP_COMPLETE:
+                completeSweep(seq);
+                break;
+            case INTERVAL:
+                keepGoing.waitFor(seq.due - std::chrono::steady_clock::now());
+                seq.step = NEXT_SWEEP;
+                break;
+            case IDLE:
+                readIdle(seq);
+                break;
+            case DONE:
+                break;
+            }
         }
-        else {
-            runSemicontinuously();
+        catch (exception& e) {
+            if (!seq.perSweepRuns && !seq.followControls) {
+                throw;
+            }
+            sweepFailed(seq, e);
+        }
+    }
+    if (!seq.perSweepRuns) {
+        finishLastCycle();
+        cancelBoundarySwap();
+    }
+    board.clearCommands();
+}
+
+// Picks up any change to the controls, as the run type requires, and starts the next sweep
+void ClampThread::startSweep(SweepSequence& seq) {
+    if (seq.repeat && !keepGoing) {
+        seq.step = DONE;
+        return;
+    }
+    if (seq.followControls) {
+        controlWidget->startMessage(unit);
+    }
+    if (seq.perSweepRuns) {
+        if (seq.followControls) {
+            reloadControls();
+        }
+        board.runOneCycle(unit, 1);
+        seq.first = true;
+        startCycles();
+    }
+    else {
+        if (seq.followControls) {
+            restartIfChanged(seq);
         }
-        break;
-    case ClampThread::CONTINUOUS:
-        if (simplifiedWaveform[unit].interval > 0) {
-            // There's no way to run continuously if you're pausing between runs
-            runBatches();
+        if (concurrent) {
+            trimStreams();
         }
         else {
-            runContinuously();
+            startCycles();
         }
-        break;
-    case ClampThread::ONCE:
-        runOnce();
-        break;
-    default:
-        break;
     }
+    seq.packetsToRead = board.getNumTimesteps(unit) - idleTimesteps + (seq.first ? 1 : 0);
+    seq.packetsRead = 0;
+    seq.controlTransactions = board.getNumControlTransactions();
+    applyPipetteOffsets();
+    seq.step = READ;
 }
 
-void ClampThread::runOnce() {
-    double time = 0;
-    try {
-        board.runOneCycle(unit, 1);
-		for (auto& index : channelList) {
-			state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-		}
-		for (auto& index : channelList) {
-			state.datastore[index.chip].startCycle();
-		}
-        readAndProcessOneCycle(true, time);
-        finishLastCycle();
+/* Picks up the waveform the control widget has published since the last look (see Controller::publishWaveform).  Only
+ * the version is read each sweep; returns false, leaving waveform alone, if there's nothing new.
+ */
+bool ClampThread::takePublishedWaveform(SimplifiedWaveform& waveform) {
+    if (controlWidget->getWaveformVersion() == seenWaveformVersion) {
+        return false;
     }
-    catch (exception&) {
-        board.flush();
+    WaveformSnapshot snapshot = controlWidget->getWaveformSnapshot();
+    seenWaveformVersion = snapshot.version;
+    double samplingRate = state.board->getSamplingRateHz();
+    if (snapshot.samplingRate == samplingRate) {
+        waveform = *snapshot.waveform;
     }
-    board.clearCommands();
+    else {
+        waveform = controlWidget->getSimplifiedWaveform(samplingRate); // Published before the rate changed
+    }
+    return true;
 }
 
-void ClampThread::runContinuously() {
-    board.runContinuously();
-
-	for (auto& index : channelList) {
-		state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-	}
-    bool first = true;
-    while (keepGoing) {
-        // Now execute
-		for (auto& index : channelList) {
-			state.datastore[index.chip].startCycle();
-		}
-        readAndProcessOneCycle(first);
-        first = false;
+// Before each sweep of a run with an interval: the board is stopped, so the settings and the waveform are simply sent again
+void ClampThread::reloadControls() {
+    //board.clearCommands();
+	board.clearSelectedCommands(channelList);
+    {
+        // One FPGA run for all of these, rather than one each
+        ClampController::ImmediateTransaction transaction(board.controller);
+        setScaleImmediate();
+        setCapacitiveCompensationImmediate();
+        transaction.commit();
     }
-    finishLastCycle();
 
-    board.clearCommands();
+    SimplifiedWaveform newWaveform;
+    bool different = takePublishedWaveform(newWaveform) && simplifiedWaveform[unit] != newWaveform;
+    if (different) {
+        simplifiedWaveform[unit] = newWaveform;
+    }
+    createWaveform();
+    if (different) {
+		initDataStores();
+    }
 }
 
-void ClampThread::runSemicontinuously() {
-    board.runContinuously();
-	for (auto& index : channelList) {
-		state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-	}
-    bool first = true;
-    while (keepGoing) {
-        controlWidget->startMessage(unit);
-
-        SimplifiedWaveform newWaveform = controlWidget->getSimplifiedWaveform(state.board->getSamplingRateHz());
-        bool different = (simplifiedWaveform[unit] != newWaveform) || scaleChanged() || capCompensationChanged();
-        if (different) {
-            finishLastCycle();
-            //board.clearCommands();
-			board.clearSelectedCommands(channelList);
-            setScaleImmediate();
-            setCapacitiveCompensationImmediate();
-
-            simplifiedWaveform[unit] = newWaveform;
-            createWaveform();
-			for (auto& index : channelList) {
-				state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-			}
-            board.runContinuously();
-        }
-        try {
-			for (auto& index : channelList) {
-				state.datastore[index.chip].startCycle();
-			}
-            readAndProcessOneCycle(first);
-            first = false;
-        }
-        catch (exception& e) {
-            state.errorMessage("Error - not enough data", e.what());
-            board.flush();
-        }
+// Before each sweep of a continuous run that follows the controls: restarts the board if they've changed
+void ClampThread::restartIfChanged(SweepSequence& seq) {
+    SimplifiedWaveform newWaveform;
+    bool waveformChanged = takePublishedWaveform(newWaveform) && simplifiedWaveform[unit] != newWaveform;
+    bool different = waveformChanged || scaleChanged() || capCompensationChanged();
+    if (different && !scaleChanged() && !capCompensationChanged() && changeWaveformAtBoundary(newWaveform)) {
+        different = false;
+    }
+    if (!different) {
+        return;
+    }
+    if (!waveformChanged) {
+        newWaveform = simplifiedWaveform[unit];
     }
     finishLastCycle();
-    board.clearCommands();
-}
-
-void ClampThread::runBatches() {
-    double time = 0;
-	for (auto& index : channelList) {
-		state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-	}
-    while (keepGoing) {
-        controlWidget->startMessage(unit);
-        // Do these things each time through
-        //board.clearCommands();
-		board.clearSelectedCommands(channelList);
+    cancelBoundarySwap();
+    //board.clearCommands();
+	board.clearSelectedCommands(channelList);
+    {
+        ClampController::ImmediateTransaction transaction(board.controller);
         setScaleImmediate();
         setCapacitiveCompensationImmediate();
+        transaction.commit();
+    }
 
-        SimplifiedWaveform newWaveform = controlWidget->getSimplifiedWaveform(state.board->getSamplingRateHz());
-        bool different = simplifiedWaveform[unit] != newWaveform;
-        simplifiedWaveform[unit] = newWaveform;
-        createWaveform();
-        if (different) {
-			for (auto& index : channelList) {
-				state.datastore[index.chip].init(simplifiedWaveform[index.chip], voltageClampMode[index.chip]);
-			}
-        }
-        try {
-            board.runOneCycle(unit, 1);
-			for (auto& index : channelList) {
-				state.datastore[index.chip].startCycle();
-			}
-            readAndProcessOneCycle(true, time);
-            finishLastCycle();
+    simplifiedWaveform[unit] = newWaveform;
+    createWaveform();
+	initDataStores();
+	if (concurrent) {
+		// Every headstage's waveform starts over
+		startCycles();
+		seq.first = true;
+	}
+    board.runContinuously();
+    board.startReaderThread();
+}
+
+// Decides what follows a complete sweep: nothing, the next sweep, or, in a run with an interval, the wait for it
+void ClampThread::completeSweep(SweepSequence& seq) {
+    if (!seq.repeat) {
+        seq.step = DONE;
+        return;
+    }
+    seq.step = NEXT_SWEEP;
+    double intervalS = simplifiedWaveform[unit].interval;
+    if (gapless) {
+        // The board is already running the interval; no health checks, since they'd have to stop it
+        seq.time += board.getNumTimesteps(unit) / board.getSamplingRateHz();
+        seq.idleToRead = idleTimesteps;
+        if (seq.idleToRead > 0) {
+            seq.step = IDLE;
         }
-        catch (exception& e) {
+        return;
+    }
+    if (!seq.perSweepRuns || intervalS <= 0) {
+        return;
+    }
+    double readTimeMs = (state.board->getNumTimesteps(unit)) / state.board->getSamplingRateHz() * 1000;
+    double intervalMs = intervalS * 1000;
+    int sleepTime = intervalMs - readTimeMs;
+    seq.time += (sleepTime > 0) ? intervalS : 1;
+    if (sleepTime > 0) {
+        sleepTime -= checkHealth(sleepTime);
+    }
+    if (sleepTime > 0) {
+        seq.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(sleepTime);
+        seq.step = INTERVAL;
+    }
+}
+
+/* A sweep that failed: runs with the board started per sweep flush it and go on (reporting the error, unless it was
+ * the only sweep); continuous runs restart the reads.  Continuous runs that don't follow the controls don't get here;
+ * the error ends the run.
+ */
+void ClampThread::sweepFailed(SweepSequence& seq, const exception& e) {
+    if (seq.perSweepRuns) {
+        if (seq.repeat) {
             state.errorMessage("Error - not enough data", e.what());
-            board.flush();
         }
+        board.flush();
+    }
+    else {
+        state.errorMessage("Error - not enough data", e.what());
+        board.stopReaderThread();
+        board.flush();
+        board.startReaderThread();
+    }
+    seq.step = SWEEP_COMPLETE;
+}
 
-        double intervalS = simplifiedWaveform[unit].interval;
-        if (intervalS > 0) {
-            double readTimeMs = (state.board->getNumTimesteps(unit)) / state.board->getSamplingRateHz() * 1000;
-            double intervalMs = intervalS * 1000;
-            int sleepTime = intervalMs - readTimeMs;
-            time += (sleepTime > 0) ? intervalS : 1;
-            while (keepGoing && sleepTime > 0) {
-                int thisRound = std::min(sleepTime, 1000);
-                std::this_thread::sleep_for(std::chrono::milliseconds(thisRound));
-                sleepTime -= thisRound;
-            }
-        }
+/* Runs the health monitor's check in the idle time between two sweeps, if one is due and there's room for it.  The
+ * check leaves the board's commands cleared; reloadControls sets them up again for every sweep anyway.  Returns the
+ * milliseconds it took.
+ */
+int ClampThread::checkHealth(int idleMs) {
+    if (idleMs < MIN_HEALTH_CHECK_IDLE_MS || !state.healthMonitor->due()) {
+        return 0;
     }
-    board.clearCommands();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try {
+        state.healthMonitor->check();
+    }
+    catch (exception& e) {
+        state.errorMessage("Error - health check", e.what());
+        board.flush();
+    }
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Thread.h"
+#include <chrono>
+#include <cstdint>
+#include <exception>
 #include <memory>
 #include <vector>
 #include "ClampController.h"
@@ -46,7 +49,8 @@ protected:
     RunType runType;
     GlobalState& state;
     CLAMP::Board& board;
-    CLAMP::ClampConfig::ChipChannelList channelList;
+    CLAMP::ClampConfig::ChipChannelList channelList; // Every unit of every present headstage
+    std::vector<unsigned int> chipList;              // The present headstages, once each
     VoltageClampWidget** voltageWidget;
 	CurrentClampWidget** currentWidget;
 	bool voltageClampMode[CLAMP::MAX_NUM_CHIPS];
@@ -55,23 +59,63 @@ protected:
 
 	unsigned int unit;
     CLAMP::SimplifiedWaveform simplifiedWaveform[CLAMP::MAX_NUM_CHIPS];
+    // The other headstages run their own waveforms, rather than holding; see GlobalState::concurrentProtocols
+    bool concurrent;
+    // The interval is holding compiled into this unit's waveform, so the board runs continuously; see GlobalState::gaplessIntervals
+    bool gapless;
+    unsigned int idleTimesteps; // Holding after each sweep of a gapless run
 
     void createWaveform();
+    void waveformToCommands(unsigned int headstage, CLAMP::SimplifiedWaveform& waveform);
 
     virtual void clear(bool filtersToo);
     void setCapacitiveCompensationImmediate();
-    void readAndProcessOneCycle(bool first = true, double time = -1);
+    void startCycles();
+    void trimStreams();
+    void initDataStores();
     void finishLastCycle();
 
-    const std::vector<double>& getValues(unsigned int headstage);
-	const std::vector<double>& getClampValues(unsigned int headstage);
+    const std::vector<CLAMP::Sample>& getValues(unsigned int headstage);
+	const std::vector<CLAMP::Sample>& getClampValues(unsigned int headstage);
+    const std::vector<CLAMP::Sample>& getValues(const CLAMP::ClampConfig::ChipChannel& index);
+	const std::vector<CLAMP::Sample>& getClampValues(const CLAMP::ClampConfig::ChipChannel& index);
+    CLAMP::ClampConfig::ChipChannelList unitsOf(unsigned int headstage) const;
 	void setRCImmediate();
 
 protected:
-    void runContinuously();
-    void runSemicontinuously();
-    void runBatches();
-    void runOnce();
+    // Where a run is in its sweeps; see runSequence
+    enum SequenceStep {
+        NEXT_SWEEP,     // Start a sweep, picking up changes to the controls first if the run type does
+        READ,           // Read and process the sweep's data as it comes in
+        SWEEP_COMPLETE, // Decide what comes next
+        INTERVAL,       // Wait until the next sweep is due
+        IDLE,           // Read past the holding between two sweeps of a gapless run
+        DONE
+    };
+    struct SweepSequence {
+        bool perSweepRuns;   // The board runs one sweep at a time, rather than continuously
+        bool followControls; // Changes to the controls are picked up between sweeps
+        bool repeat;         // Sweeps repeat until the thread is stopped
+        SequenceStep step;
+        bool first;          // The sweep is the first of a board run
+        double time;         // Sweep time passed to the DataStores; -1 for continuous runs
+        std::chrono::steady_clock::time_point due; // Start of the next sweep, in INTERVAL
+        unsigned int idleToRead;                   // Holding timesteps left to read, in IDLE
+        // Sweep being read
+        unsigned int packetsToRead;
+        unsigned int packetsRead;
+        uint64_t controlTransactions;
+    };
+
+    SweepSequence sequenceFor(RunType runType) const;
+    void runSequence(SweepSequence& seq);
+    void startSweep(SweepSequence& seq);
+    void readAvailable(SweepSequence& seq);
+    void readIdle(SweepSequence& seq);
+    void completeSweep(SweepSequence& seq);
+    void sweepFailed(SweepSequence& seq, const std::exception& e);
+    void reloadControls();
+    void restartIfChanged(SweepSequence& seq);
     void setScaleImmediate();
     bool scaleChanged() const;
 
@@ -82,12 +126,30 @@ protected:
 private:
 	double bandwidth;
 	CLAMP::Registers::Register3::Resistance resistance;
-	double voltageOffset;
-	std::vector<double> offsetVoltages;
 	Controller* controlWidget;
+	unsigned int seenWaveformVersion; // Of controlWidget's published waveform; see takePublishedWaveform
+	bool takePublishedWaveform(CLAMP::SimplifiedWaveform& waveform);
+
+	// Amplitude change sent while running, not yet seen in the data; see changeWaveformAtBoundary
+	struct BoundarySwap {
+		bool pending;
+		unsigned int firstIndex; // Timesteps of the first segment whose value changed
+		unsigned int lastIndex;
+		double newValue;         // That segment's clamp value before and after the change
+		double oldValue;
+	} boundarySwap;
+
+	bool changeWaveformAtBoundary(const CLAMP::SimplifiedWaveform& newWaveform);
+	void checkBoundarySwap(const std::vector<CLAMP::Sample>& clampValues, unsigned int offset);
+	void cancelBoundarySwap();
 
 	void switchToVoltageClamp(const CLAMP::ClampConfig::ChipChannel& channel, int holdingVoltage);
 	void switchToCurrentClamp(const CLAMP::ClampConfig::ChipChannel& channel, CLAMP::ClampConfig::CurrentScale scale, int holdingCurrent);
-	void clearOffsetVoltages();
+	void applyPipetteOffsets();
+	// Sweep intervals leaving less idle time than this get no health checks
+	static const int MIN_HEALTH_CHECK_IDLE_MS = 50;
+	int checkHealth(int idleMs);
+	void writeMultiplexedHeader(unsigned int lastIndex);
+	void writeMultiplexedData();
 };
 
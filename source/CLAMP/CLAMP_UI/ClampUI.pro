@@ -12,20 +12,28 @@ QT += widgets gui
 
 CONFIG += static
 
+# Store acquired samples as float rather than double; see CLAMP::Sample
+# DEFINES += CLAMP_SINGLE_PRECISION_SAMPLES
+
 SOURCES += \
+    BoardStreams.cpp \
     ClampThread.cpp \
+    Controller.cpp \
     DataStore.cpp \
     GlobalState.cpp \
     GUIUtil.cpp \
-    main.cpp
+    main.cpp \
+    OverloadController.cpp
 
 HEADERS += \
+    BoardStreams.h \
     ClampThread.h \
     Controller.h \
     DataStore.h \
     globalconstants.h \
     GlobalState.h \
-    GUIUtil.h
+    GUIUtil.h \
+    OverloadController.h
 
 RESOURCES = ClampUI.qrc
 
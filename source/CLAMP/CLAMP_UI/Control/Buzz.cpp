@@ -105,7 +105,8 @@ BuzzWidget::BuzzWidget(GlobalState& state_, Controller& controller_, CapacitiveC
     cap(cap_),
     params(true, 0.5),
     buzzEnabled(false),
-	unit(unit_)
+	unit(unit_),
+    sequence(state_.board->controller, [this](const ChipChannel& index) { buildBuzz(index); })
 {
     button = new QPushButton("Buzz", this);
     connect(button, SIGNAL(clicked()), this, SLOT(doBuzz()));
@@ -124,7 +125,15 @@ BuzzWidget::BuzzWidget(GlobalState& state_, Controller& controller_, CapacitiveC
 }
 
 void BuzzWidget::doBuzz() {
-    state.preemptThread(new BuzzThread(state, controller, params, cap, unit));
+    state.preemptThread(new BuzzThread(state, controller, params, cap, sequence, unit));
+}
+
+// Adds the whole buzz to the channel's command list, so that it runs (and stays in Waveform RAM) as one sequence
+void BuzzWidget::buildBuzz(const ChipChannel& index) {
+    ClampController& clamp = state.board->controller;
+    clamp.switchToCurrentClamp(index, static_cast<CurrentScale>(controller.getCurrentScale()), controller.getHoldingValue(), cap.getCapCompensationValue());
+    clamp.fastTransientCapacitiveCompensation.buzz(index, params.useLarge.value(), params.durationMs.value() / 1000);
+    clamp.clampCurrentGenerator.setCurrent(index, static_cast<int16_t>(controller.getHoldingValue()));
 }
 
 void BuzzWidget::setControlsEnabled(bool enabled) {
@@ -139,12 +148,13 @@ void BuzzWidget::setControlsEnabled(bool enabled) {
 }
 
 //--------------------------------------------------------------------------
-BuzzThread::BuzzThread(GlobalState& state_, Controller& controller_, BuzzParams& params_, CapacitiveCompensationController& cap_, int unit_) :
+BuzzThread::BuzzThread(GlobalState& state_, Controller& controller_, BuzzParams& params_, CapacitiveCompensationController& cap_, ResidentSequence& sequence_, int unit_) :
     Thread(),
     state(state_),
     controller(controller_),
     cap(cap_),
     params(params_),
+    sequence(sequence_),
     sound(new QSound(QDir::tempPath() + "/beep.wav")),
 	unit(unit_)
 {
@@ -166,9 +176,11 @@ void BuzzThread::run() {
 	state.board->enableOnePortOnly(unit);
 
     ChipChannelList channelList = { ChipChannel(unit, 0) };
-    state.board->controller.switchToCurrentClampImmediate(channelList, static_cast<CurrentScale>(controller.getCurrentScale()), controller.getHoldingValue(), cap.getCapCompensationValue());
-    state.board->controller.fastTransientCapacitiveCompensation.buzzImmediate(channelList, params.useLarge.value(), params.durationMs.value() / 1000);
-    state.board->controller.clampCurrentGenerator.setCurrentImmediate(channelList, controller.getHoldingValue());
+
+    // One run of the resident buzz (see BuzzWidget::buildBuzz); it's only rebuilt when one of these changes
+    std::vector<double> key = { params.useLarge.value() ? 1.0 : 0.0, params.durationMs.value(), static_cast<double>(controller.getCurrentScale()),
+                                static_cast<double>(controller.getHoldingValue()), cap.getCapCompensationValue(), state.board->getSamplingRateHz() };
+    sequence.run(channelList, key);
 
 	state.board->enableAllPorts();
 
@@ -5,6 +5,7 @@
 #include "Thread.h"
 #include "MVC.h"
 #include "SimplifiedWaveform.h"
+#include "ResidentSequence.h"
 #include <string>
 #include <QDialog>
 
@@ -89,12 +90,16 @@ private:
 
     BoolHolder buzzEnabled;
 	int unit;
+
+    // The whole buzz, kept in Waveform RAM between buzzes; see buildBuzz
+    CLAMP::ClampConfig::ResidentSequence sequence;
+    void buildBuzz(const CLAMP::ClampConfig::ChipChannel& index);
 };
 
 
 class BuzzThread : public Thread {
 public:
-    BuzzThread(GlobalState& state_, Controller& controller_, BuzzParams& params_, CapacitiveCompensationController& cap_, int unit_);
+    BuzzThread(GlobalState& state_, Controller& controller_, BuzzParams& params_, CapacitiveCompensationController& cap_, CLAMP::ClampConfig::ResidentSequence& sequence_, int unit_);
     ~BuzzThread();
 
     void run() override;
@@ -105,6 +110,7 @@ private:
     Controller& controller;
     CapacitiveCompensationController& cap;
     BuzzParams& params;
+    CLAMP::ClampConfig::ResidentSequence& sequence;
     QSound* sound;
 	int unit;
 };
\ No newline at end of file
@@ -10,6 +10,7 @@ HEADERS       += \
     $$PWD/HoldingVoltageWidget.h \
     $$PWD/MarkerOutputWidget.h \
     $$PWD/MVC.h \
+    $$PWD/PerformancePanel.h \
     $$PWD/PipetteOffset.h \
     $$PWD/ResistanceWidget.h \
     $$PWD/SignalOutputWidget.h \
@@ -28,6 +29,7 @@ SOURCES += \
     $$PWD/HoldingVoltageWidget.cpp \
     $$PWD/MarkerOutputWidget.cpp \
     $$PWD/MVC.cpp \
+    $$PWD/PerformancePanel.cpp \
     $$PWD/PipetteOffset.cpp \
     $$PWD/ResistanceWidget.cpp \
     $$PWD/SignalOutputWidget.cpp \
@@ -14,10 +14,20 @@
 #include "ResistanceWidget.h"
 #include "HoldingVoltageWidget.h"
 #include "SaveFile.h"
+#include "NWBFile.h"
+#include "SaveWriterThread.h"
+#include "CalibrationCache.h"
+#include "HealthMonitor.h"
 #include "DisplayWindow.h"
 #include "VoltageClampWidget.h"
 #include "CurrentClampWidget.h"
 #include "PipetteOffset.h"
+#include "PerformancePanel.h"
+#include "LockProfiler.h"
+#include <QTableWidget>
+#include <QHeaderView>
+#include <QTimer>
+#include <QInputDialog>
 
 using std::exception;
 using std::unique_ptr;
@@ -27,8 +37,30 @@ using namespace CLAMP::IO;
 ControlWindow::ControlWindow(QWidget* parent, GlobalState& state_) :
     QMainWindow(parent),
     state(state_),
-    enableTabbing(true)
+    enableTabbing(true),
+    keyboardShortcutDialog(nullptr),
+    processorStatisticsDialog(nullptr)
 {
+    // Created up front, since the acquisition thread feeds it latencies through updateStatsExt
+    performancePanel = new PerformancePanel(state, this);
+
+	// Only present headstages get controls (see createHeadstageTab); the others' stay null
+	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+		tabWidget[i] = nullptr;
+		appliedVoltageWaveform[i] = nullptr;
+		appliedCurrentWaveform[i] = nullptr;
+		capCompensation[i] = nullptr;
+		capCompensationSpinBox[i] = nullptr;
+		statusLabel[i] = nullptr;
+		resistance[i] = nullptr;
+		resistanceCheckBox[i] = nullptr;
+		resistanceValue[i] = nullptr;
+		externalCommand[i] = nullptr;
+		signalOutput[i] = nullptr;
+		clampOutput[i] = nullptr;
+		markerOutput[i] = nullptr;
+	}
+
     createActions();
     createMenus();
     createStatusBar();
@@ -37,11 +69,8 @@ ControlWindow::ControlWindow(QWidget* parent, GlobalState& state_) :
     connect(this, SIGNAL(clampModeChanged(int)), this, SLOT(setClampMode(int)));
     connect(&state, SIGNAL(threadStatusChanged(bool)), this, SLOT(setThreadStatus(bool)));
     connect(&state, SIGNAL(statusMessage(int, QString)), this, SLOT(setStatusMessage(int, QString)));
-
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		connect(appliedVoltageWaveform[i], SIGNAL(changeDisplay()), this, SLOT(setDisplayOptions()));
-		connect(appliedCurrentWaveform[i], SIGNAL(changeDisplay()), this, SLOT(setDisplayOptions()));
-	}
+    connect(&state, SIGNAL(healthChecked(int, double, double, bool)), this, SLOT(showHealth(int, double, double, bool)));
+    connect(&state, SIGNAL(fifoWatermarkCrossed(bool, double)), this, SLOT(showFifoWarning(bool, double)));
 
 	runningHeadstage = 0;
 	validFilename = false;
@@ -66,16 +95,109 @@ void ControlWindow::createActions() {
 	saveAuxAction->setCheckable(true);
 	saveAuxAction->setChecked(true);
 	connect(saveAuxAction, SIGNAL(toggled(bool)), this, SLOT(setSaveAux(bool)));
+	asyncSaveAction = new QAction("Write Save Files in Background", this);
+	asyncSaveAction->setCheckable(true);
+	asyncSaveAction->setChecked(false);
+	connect(asyncSaveAction, SIGNAL(toggled(bool)), this, SLOT(setAsyncSave(bool)));
+	directIOSaveAction = new QAction("Write Save Files Around the File Cache", this);
+	directIOSaveAction->setCheckable(true);
+	directIOSaveAction->setChecked(false);
+	connect(directIOSaveAction, SIGNAL(toggled(bool)), this, SLOT(setDirectIOSave(bool)));
+	journalSaveAction = new QAction("Write Save Files as Crash-Safe Journals", this);
+	journalSaveAction->setCheckable(true);
+	journalSaveAction->setChecked(false);
+	connect(journalSaveAction, SIGNAL(toggled(bool)), this, SLOT(setJournalSave(bool)));
+	sweepIndexSaveAction = new QAction("Write Sweep Index Files", this);
+	sweepIndexSaveAction->setCheckable(true);
+	sweepIndexSaveAction->setChecked(false);
+	connect(sweepIndexSaveAction, SIGNAL(toggled(bool)), this, SLOT(setSweepIndexSave(bool)));
+	multiplexedSaveAction = new QAction("Record All Headstages to One File", this);
+	multiplexedSaveAction->setCheckable(true);
+	multiplexedSaveAction->setChecked(false);
+	connect(multiplexedSaveAction, SIGNAL(toggled(bool)), this, SLOT(setMultiplexedSave(bool)));
+	saveFormatGroup = new QActionGroup(this);
+	const char* formatNames[] = { "Floating Point Samples", "Compact Integer Samples", "Compressed Chunks with Index", "NWB (HDF5)" };
+	const SaveFile::Format formats[] = { SaveFile::FLOAT_RECORDS, SaveFile::COMPACT_RECORDS, SaveFile::CHUNKED_RECORDS, SaveFile::NWB_RECORDS };
+	for (int i = 0; i < 4; i++) {
+		if (formats[i] == SaveFile::NWB_RECORDS && !NWBFile::isAvailable()) {
+			continue; // Built without HDF5
+		}
+		QAction* action = saveFormatGroup->addAction(formatNames[i]);
+		action->setCheckable(true);
+		action->setChecked(formats[i] == state.saveFormat);
+		action->setData(formats[i]);
+	}
+	connect(saveFormatGroup, SIGNAL(triggered(QAction*)), this, SLOT(setSaveFormat(QAction*)));
+	auxFormatGroup = new QActionGroup(this);
+	const char* auxFormatNames[] = { "Every Sample", "Digital Changes and ADCs", "Digital Changes Only" };
+	for (int i = 0; i < 3; i++) {
+		QAction* action = auxFormatGroup->addAction(auxFormatNames[i]);
+		action->setCheckable(true);
+		action->setChecked(i == 0);
+		action->setData(i);
+	}
+	connect(auxFormatGroup, SIGNAL(triggered(QAction*)), this, SLOT(setAuxFormat(QAction*)));
+	saveRolloverAction = new QAction(tr("Split Save Files..."), this);
+	connect(saveRolloverAction, SIGNAL(triggered()), this, SLOT(setSaveRollover()));
+	concurrentProtocolsAction = new QAction(tr("Run All Headstages' Waveforms"), this);
+	concurrentProtocolsAction->setCheckable(true);
+	concurrentProtocolsAction->setChecked(false);
+	connect(concurrentProtocolsAction, SIGNAL(toggled(bool)), this, SLOT(setConcurrentProtocols(bool)));
+	gaplessIntervalsAction = new QAction(tr("Exact Sweep Intervals (Board Runs Continuously)"), this);
+	gaplessIntervalsAction->setCheckable(true);
+	gaplessIntervalsAction->setChecked(false);
+	connect(gaplessIntervalsAction, SIGNAL(toggled(bool)), this, SLOT(setGaplessIntervals(bool)));
+	realtimeReaderAction = new QAction(tr("Real-Time Priority for USB Reads"), this);
+	realtimeReaderAction->setCheckable(true);
+	realtimeReaderAction->setChecked(false);
+	connect(realtimeReaderAction, SIGNAL(toggled(bool)), this, SLOT(setRealtimeReader(bool)));
 	vClampX2Action = new QAction(tr("2x Voltage Clamp Mode"), this);
 	vClampX2Action->setCheckable(true);
 	vClampX2Action->setChecked(false);
 	connect(vClampX2Action, SIGNAL(toggled(bool)), this, SLOT(setVClampX2(bool)));
+	processorStatisticsAction = new QAction(tr("Processing Statistics..."), this);
+	connect(processorStatisticsAction, SIGNAL(triggered()), this, SLOT(processorStatistics()));
+	performanceAction = new QAction(tr("Performance..."), this);
+	connect(performanceAction, SIGNAL(triggered()), this, SLOT(performance()));
+	logMemoryUsageAction = new QAction(tr("Log Memory Usage"), this);
+	connect(logMemoryUsageAction, SIGNAL(triggered()), this, SLOT(logMemoryUsage()));
+	displayMemoryCapAction = new QAction(tr("Plot Memory Limit..."), this);
+	connect(displayMemoryCapAction, SIGNAL(triggered()), this, SLOT(setDisplayMemoryCap()));
+	processingIntervalAction = new QAction(tr("Processing Interval..."), this);
+	connect(processingIntervalAction, SIGNAL(triggered()), this, SLOT(setProcessingInterval()));
+	profileLocksAction = new QAction(tr("Profile Locks"), this);
+	profileLocksAction->setCheckable(true);
+	profileLocksAction->setChecked(CLAMP::LockProfiling::isEnabled());
+	connect(profileLocksAction, SIGNAL(toggled(bool)), this, SLOT(setProfileLocks(bool)));
+	logLockContentionAction = new QAction(tr("Log Lock Contention"), this);
+	connect(logLockContentionAction, SIGNAL(triggered()), this, SLOT(logLockContention()));
 }
 
 void ControlWindow::createMenus() {
 	QMenu *optionsMenu = menuBar()->addMenu(tr("&Options"));
 	optionsMenu->addAction(saveAuxAction);
+	optionsMenu->addAction(asyncSaveAction);
+	optionsMenu->addAction(directIOSaveAction);
+	optionsMenu->addAction(journalSaveAction);
+	optionsMenu->addAction(sweepIndexSaveAction);
+	optionsMenu->addAction(multiplexedSaveAction);
+	QMenu *saveFormatMenu = optionsMenu->addMenu(tr("Save File Format"));
+	saveFormatMenu->addActions(saveFormatGroup->actions());
+	QMenu *auxFormatMenu = optionsMenu->addMenu(tr("Aux File Format"));
+	auxFormatMenu->addActions(auxFormatGroup->actions());
+	optionsMenu->addAction(saveRolloverAction);
+	optionsMenu->addAction(concurrentProtocolsAction);
+	optionsMenu->addAction(gaplessIntervalsAction);
+	optionsMenu->addAction(realtimeReaderAction);
 	optionsMenu->addAction(vClampX2Action);
+	optionsMenu->addSeparator();
+	optionsMenu->addAction(processorStatisticsAction);
+	optionsMenu->addAction(performanceAction);
+	optionsMenu->addAction(logMemoryUsageAction);
+	optionsMenu->addAction(displayMemoryCapAction);
+	optionsMenu->addAction(processingIntervalAction);
+	optionsMenu->addAction(profileLocksAction);
+	optionsMenu->addAction(logLockContentionAction);
 
 //    QMenu *actionMenu = menuBar()->addMenu(tr("&Actions"));
 //    actionMenu->addAction(measureTemperatureAction);
@@ -100,34 +222,33 @@ void ControlWindow::createLayout() {
     setCentralWidget(mainWidget);
 }
 
-void ControlWindow::createCapCompensation() {
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		capCompensationSpinBox[i] = new QDoubleSpinBox();
-		capCompensationSpinBox[i]->setRange(0.0, 20.0);
-		capCompensationSpinBox[i]->setSingleStep(0.10);
-		capCompensationSpinBox[i]->setDecimals(1);
-		capCompensationSpinBox[i]->setSuffix(" pF");
-		capCompensationSpinBox[i]->setValue(0);
-		capCompensationSpinBox[i]->setKeyboardTracking(true);
-		connect(capCompensationSpinBox[i], SIGNAL(valueChanged(double)), this, SLOT(setCapacitiveCompensation()));
-
-		QHBoxLayout *layout = new QHBoxLayout;
-		layout->addWidget(capCompensationSpinBox[i]);
-		layout->addStretch(1);
-
-		capCompensation[i] = new QGroupBox();
-		capCompensation[i]->setTitle(tr("Capacitance Compensation"));
-		capCompensation[i]->setLayout(layout);
-
-		capCompensation[i]->setCheckable(true);
-		capCompensation[i]->setChecked(false);
-		connect(capCompensation[i], SIGNAL(toggled(bool)), this, SLOT(enableCapacitiveCompensation(bool)));
-	}
+void ControlWindow::createCapCompensation(int unit) {
+	capCompensationSpinBox[unit] = new QDoubleSpinBox();
+	capCompensationSpinBox[unit]->setRange(0.0, 20.0);
+	capCompensationSpinBox[unit]->setSingleStep(0.10);
+	capCompensationSpinBox[unit]->setDecimals(1);
+	capCompensationSpinBox[unit]->setSuffix(" pF");
+	capCompensationSpinBox[unit]->setValue(0);
+	capCompensationSpinBox[unit]->setKeyboardTracking(true);
+	connect(capCompensationSpinBox[unit], SIGNAL(valueChanged(double)), this, SLOT(setCapacitiveCompensation()));
+
+	QHBoxLayout *layout = new QHBoxLayout;
+	layout->addWidget(capCompensationSpinBox[unit]);
+	layout->addStretch(1);
+
+	capCompensation[unit] = new QGroupBox();
+	capCompensation[unit]->setTitle(tr("Capacitance Compensation"));
+	capCompensation[unit]->setLayout(layout);
+
+	capCompensation[unit]->setCheckable(true);
+	capCompensation[unit]->setChecked(false);
+	connect(capCompensation[unit], SIGNAL(toggled(bool)), this, SLOT(enableCapacitiveCompensation(bool)));
 }
 
 void ControlWindow::updateStats() {
-    fifoLagLabel->setText(QString::number(state.board->latency, 'f', 0) + " ms");
-    if (state.board->latency > 50.0) {
+    CLAMP::FifoSample fifo = state.board->fifoMonitor.getLatest();
+    fifoLagLabel->setText(QString::number(fifo.latencyMs, 'f', 0) + " ms");
+    if (fifo.latencyMs > 50.0) {
         fifoLagLabel->setStyleSheet("color: red");
     }
     else {
@@ -135,14 +256,41 @@ void ControlWindow::updateStats() {
     }
     fifoLagLabel->update();
 
-    fifoFullLabel->setText("(" + QString::number(state.board->fifoPercentageFull, 'f', 0) + "% full)");
-    if (state.board->fifoPercentageFull > 75.0) {
+    fifoFullLabel->setText("(" + QString::number(fifo.percentageFull, 'f', 0) + "% full)");
+    if (fifo.percentageFull > 75.0) {
         fifoFullLabel->setStyleSheet("color: red");
     }
     else {
         fifoFullLabel->setStyleSheet("color: black");
     }
     fifoFullLabel->update();
+
+    SaveQueueStatistics saveStats = SaveWriterThread::instance().getStatistics();
+    saveQueueLabel->setText(QString::number(saveStats.percentageFull(), 'f', 0) + "% full, " + QString::number(saveStats.stalls) + " stalls");
+    if (saveStats.stalls > 0) {
+        saveQueueLabel->setStyleSheet("color: red");
+    }
+    else {
+        saveQueueLabel->setStyleSheet("color: black");
+    }
+    saveQueueLabel->update();
+
+    CLAMP::TimestampGaps gaps = state.board->getTimestampGaps();
+    droppedLabel->setText(QString::number(gaps.samplesMissing) + " samples in " + QString::number(gaps.numGaps) + " gaps");
+    droppedLabel->setToolTip(tr("Longest gap: ") + QString::number(gaps.worstGap) + tr(" samples"));
+    if (gaps.numGaps > 0) {
+        droppedLabel->setStyleSheet("color: red");
+    }
+    else {
+        droppedLabel->setStyleSheet("color: black");
+    }
+    droppedLabel->update();
+
+    OverloadController::Level level = state.overload.getLevel();
+    overloadLabel->setText(OverloadController::levelName(level));
+    overloadLabel->setToolTip(OverloadController::levelDescription(level));
+    overloadLabel->setStyleSheet((level == OverloadController::NORMAL) ? "color: green" : "color: red");
+    overloadLabel->update();
 }
 
 double ControlWindow::getCapCompensationValue() const {
@@ -193,6 +341,9 @@ void ControlWindow::setThreadStatus(bool running) {
     runOnceButton->setEnabled(!running);
     recordButton->setEnabled(!running && validFilename);
 	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+		if (!state.board->chip[i]->present) {
+			continue;
+		}
 		appliedVoltageWaveform[i]->pipetteOffset->autoButton->setEnabled(!running);
 		appliedCurrentWaveform[i]->currentStepSizeComboBox->setEnabled(!running);
 		appliedCurrentWaveform[i]->zeroCurrentButton->setEnabled(!running);
@@ -208,6 +359,9 @@ void ControlWindow::setThreadStatus(bool running) {
     // These controls may or may not be disabled when we run, but should always be enabled when we don't run
     if (!running) {
 		for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+			if (!state.board->chip[i]->present) {
+				continue;
+			}
 			tabWidget[i]->setEnabled(true);
 			capCompensation[i]->setEnabled(true);
 			appliedVoltageWaveform[i]->setControlsEnabled(true);
@@ -266,10 +420,19 @@ void ControlWindow::startRecording()
 
 		QDir subdir(fileInfo.path() + "/" + subdirName);
 
+		if (state.multiplexedSaveMode) {
+			// One file for every headstage and the aux I/O, written by the ClampThread as it reads
+			QString filename = subdir.filePath(fileInfo.baseName() + "_ALL_" + dateTime.toString("yyMMdd") + "_" +
+				dateTime.toString("HHmmss") + ".clp");
+			state.openMultiplexedFile(filename, state.saveAuxMode);
+		}
+
 		bool saveAux = true;
 		for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
 			if (state.board->chip[i]->present) {
-				state.datastore[i].openFile(subdirName, saveBaseFileName, dateTime, i, saveAux & state.saveAuxMode);
+				if (!state.multiplexedSaveMode) {
+					state.datastore[i].openFile(subdirName, saveBaseFileName, dateTime, i, saveAux & state.saveAuxMode);
+				}
 				saveAux = false;
 				tabWidget[i]->setEnabled(false);
 				capCompensation[i]->setEnabled(false);
@@ -278,6 +441,7 @@ void ControlWindow::startRecording()
         startRunningWithType(ClampThread::CONTINUOUS);
     }
     catch (exception& e) {
+        state.closeMultiplexedFile();
         QMessageBox::critical(this, "Error opening save file", e.what());
     }
 }
@@ -298,7 +462,7 @@ void ControlWindow::startRunningWithType(ClampThread::RunType runtype) {
 	unique_ptr<ClampThread> tmp;
 	bool voltageClampMode[CLAMP::MAX_NUM_CHIPS];
 	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		voltageClampMode[i] = (tabWidget[i]->currentIndex() == 0);
+		voltageClampMode[i] = !tabWidget[i] || (tabWidget[i]->currentIndex() == 0);
 	}
 	tmp.reset(new ClampThread(state, appliedVoltageWaveform, appliedCurrentWaveform, voltageClampMode, selectedHeadstage()));
 
@@ -363,7 +527,19 @@ QLayoutItem* ControlWindow::createFIFOStatsLayout() {
     fifoFullLabel = new QLabel(tr("(0% full)"), this);
     fifoFullLabel->setStyleSheet("color: black");
 
-    connect(this, SIGNAL(updateStatsSignal()), this, SLOT(updateStats()));
+    saveQueueLabel = new QLabel(tr("0% full, 0 stalls"), this);
+    saveQueueLabel->setStyleSheet("color: black");
+
+    droppedLabel = new QLabel(tr("0 samples in 0 gaps"), this);
+    droppedLabel->setStyleSheet("color: black");
+
+    overloadLabel = new QLabel(OverloadController::levelName(OverloadController::NORMAL), this);
+    overloadLabel->setStyleSheet("color: green");
+
+    // Refreshed at a fixed rate, rather than on every read
+    QTimer* statsTimer = new QTimer(this);
+    connect(statsTimer, SIGNAL(timeout()), this, SLOT(updateStats()));
+    statsTimer->start(PerformancePanel::REFRESH_MS);
 
     QHBoxLayout *layout = new QHBoxLayout;
     layout->addStretch(10);
@@ -372,6 +548,15 @@ QLayoutItem* ControlWindow::createFIFOStatsLayout() {
     layout->addWidget(fifoLagLabel);
     layout->addWidget(fifoFullLabel);
     layout->addStretch(1);
+    layout->addWidget(new QLabel(tr("Save queue:")));
+    layout->addWidget(saveQueueLabel);
+    layout->addStretch(1);
+    layout->addWidget(new QLabel(tr("Dropped:")));
+    layout->addWidget(droppedLabel);
+    layout->addStretch(1);
+    layout->addWidget(new QLabel(tr("Load:")));
+    layout->addWidget(overloadLabel);
+    layout->addStretch(1);
 
     return layout;
 }
@@ -380,8 +565,9 @@ void ControlWindow::setResistance(double value) {
     emit resistanceChanged(value);
 }
 
+// Called by the acquisition thread after each read
 void ControlWindow::updateStatsExt() {
-    emit updateStatsSignal();
+    performancePanel->recordLatency(state.board->fifoMonitor.getLatest().latencyMs);
 }
 
 QWidget* ControlWindow::createStateBox(int unit) {
@@ -397,76 +583,14 @@ QWidget* ControlWindow::createStateBox(int unit) {
 }
 
 QLayout* ControlWindow::createControlLayout() {
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		appliedVoltageWaveform[i] = new VoltageClampWidget(state, i);
-		appliedCurrentWaveform[i] = new CurrentClampWidget(state, *this, i);
-		tabWidget[i] = new QTabWidget();
-		tabWidget[i]->addTab(appliedVoltageWaveform[i], tr("Voltage Clamp"));
-		tabWidget[i]->addTab(appliedCurrentWaveform[i], tr("Current Clamp"));
-		connect(tabWidget[i], SIGNAL(currentChanged(int)), this, SLOT(tryToSetClampMode(int)));
-	}
-
-    // Run/stop/label
-
-    createResistanceLayout();
-	createExternalCommandLayout();
-	createSignalOutputLayout();
-    createCapCompensation();
-
-	QHBoxLayout* hLayout1[CLAMP::MAX_NUM_CHIPS];
-
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		hLayout1[i] = new QHBoxLayout;
-		hLayout1[i]->addWidget(capCompensation[i]);
-		hLayout1[i]->addStretch(1);
-		hLayout1[i]->addWidget(createStateBox(i));
-	}
+	connect(this, SIGNAL(resistanceChanged(double)), this, SLOT(setResistanceInternal(double)));
 
 	headstageTabWidget = new QTabWidget();
 	connect(headstageTabWidget, SIGNAL(currentChanged(int)), this, SLOT(setHeadstageFocus(int)));
 
 	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
 		if (state.board->chip[i]->present) {
-			QFrame *frameTab = new QFrame();
-			QVBoxLayout *vLayoutTab = new QVBoxLayout;
-			vLayoutTab->addItem(hLayout1[i]);
-			vLayoutTab->addWidget(tabWidget[i]);
-			vLayoutTab->addWidget(resistance[i]);
-			QTabWidget* ioWidget = new QTabWidget();
-			ioWidget->addTab(externalCommand[i], "External Command");
-			ioWidget->addTab(signalOutput[i], "Signal Out");
-			connect((QObject*)appliedVoltageWaveform[i]->feedback, SIGNAL(feedbackResistanceChanged(int)), signalOutput[i], SLOT(updateFeedbackResistance(int)));
-			ioWidget->addTab(clampOutput[i], "Clamp Out");
-			ioWidget->addTab(markerOutput[i], "Marker Out");
-			vLayoutTab->addWidget(ioWidget);
-			vLayoutTab->addStretch(1);
-			frameTab->setLayout(vLayoutTab);
-			switch (i) {
-			case 0:
-				headstageTabWidget->addTab(frameTab, tr("Port A"));
-				break;
-			case 1:
-				headstageTabWidget->addTab(frameTab, tr("Port B"));
-				break;
-			case 2:
-				headstageTabWidget->addTab(frameTab, tr("Port C"));
-				break;
-			case 3:
-				headstageTabWidget->addTab(frameTab, tr("Port D"));
-				break;
-			case 4:
-				headstageTabWidget->addTab(frameTab, tr("Port E"));
-				break;
-			case 5:
-				headstageTabWidget->addTab(frameTab, tr("Port F"));
-				break;
-			case 6:
-				headstageTabWidget->addTab(frameTab, tr("Port G"));
-				break;
-			case 7:
-				headstageTabWidget->addTab(frameTab, tr("Port H"));
-				break;
-			}
+			headstageTabWidget->addTab(createHeadstageTab(i), tr("Port %1").arg(QChar('A' + i)));
 		}
 	}
 
@@ -479,45 +603,86 @@ QLayout* ControlWindow::createControlLayout() {
     return vLayout;
 }
 
-void ControlWindow::createResistanceLayout() {
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		resistanceValue[i] = new QLabel(tr("-.- M") + QSTRING_OMEGA_SYMBOL, this);
-		QFont font = resistanceValue[i]->font();
-		font.setPointSize(16);
-		font.setBold(true);
-		resistanceValue[i]->setFont(font);
-	}
-	connect(this, SIGNAL(resistanceChanged(double)), this, SLOT(setResistanceInternal(double)));
+// All the controls of one headstage.  Only called for present headstages, so a small rig doesn't pay for eight.
+QWidget* ControlWindow::createHeadstageTab(int unit) {
+	appliedVoltageWaveform[unit] = new VoltageClampWidget(state, unit);
+	appliedCurrentWaveform[unit] = new CurrentClampWidget(state, *this, unit);
+	connect(appliedVoltageWaveform[unit], SIGNAL(changeDisplay()), this, SLOT(setDisplayOptions()));
+	connect(appliedCurrentWaveform[unit], SIGNAL(changeDisplay()), this, SLOT(setDisplayOptions()));
+	tabWidget[unit] = new QTabWidget();
+	tabWidget[unit]->addTab(appliedVoltageWaveform[unit], tr("Voltage Clamp"));
+	tabWidget[unit]->addTab(appliedCurrentWaveform[unit], tr("Current Clamp"));
+	connect(tabWidget[unit], SIGNAL(currentChanged(int)), this, SLOT(tryToSetClampMode(int)));
+
+	createResistanceLayout(unit);
+	createExternalCommandLayout(unit);
+	createSignalOutputLayout(unit);
+	createCapCompensation(unit);
+
+	QHBoxLayout* hLayout1 = new QHBoxLayout;
+	hLayout1->addWidget(capCompensation[unit]);
+	hLayout1->addStretch(1);
+	hLayout1->addWidget(createStateBox(unit));
+
+	QFrame *frameTab = new QFrame();
+	QVBoxLayout *vLayoutTab = new QVBoxLayout;
+	vLayoutTab->addItem(hLayout1);
+	vLayoutTab->addWidget(tabWidget[unit]);
+	vLayoutTab->addWidget(resistance[unit]);
+	QTabWidget* ioWidget = new QTabWidget();
+	ioWidget->addTab(externalCommand[unit], "External Command");
+	ioWidget->addTab(signalOutput[unit], "Signal Out");
+	connect((QObject*)appliedVoltageWaveform[unit]->feedback, SIGNAL(feedbackResistanceChanged(int)), signalOutput[unit], SLOT(updateFeedbackResistance(int)));
+	ioWidget->addTab(clampOutput[unit], "Clamp Out");
+	ioWidget->addTab(markerOutput[unit], "Marker Out");
+	vLayoutTab->addWidget(ioWidget);
+	vLayoutTab->addStretch(1);
+	frameTab->setLayout(vLayoutTab);
+	return frameTab;
+}
 
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		QHBoxLayout *hLayout = new QHBoxLayout;
-		resistanceCheckBox[i] = new QCheckBox(tr("Display Resistance"));
-		hLayout->addWidget(resistanceCheckBox[i]);
-		hLayout->addStretch(1);
-		hLayout->addWidget(resistanceValue[i]);
-
-		resistance[i] = new QGroupBox();
-		resistance[i]->setLayout(hLayout);
-		connect(resistanceCheckBox[i], SIGNAL(toggled(bool)), this, SLOT(setDisplayOptions()));
-	}
+void ControlWindow::createResistanceLayout(int unit) {
+	resistanceValue[unit] = new QLabel(tr("-.- M") + QSTRING_OMEGA_SYMBOL, this);
+	QFont font = resistanceValue[unit]->font();
+	font.setPointSize(16);
+	font.setBold(true);
+	resistanceValue[unit]->setFont(font);
+
+	QHBoxLayout *hLayout = new QHBoxLayout;
+	resistanceCheckBox[unit] = new QCheckBox(tr("Display Resistance"));
+	hLayout->addWidget(resistanceCheckBox[unit]);
+	hLayout->addStretch(1);
+	hLayout->addWidget(resistanceValue[unit]);
+
+	resistance[unit] = new QGroupBox();
+	resistance[unit]->setLayout(hLayout);
+	connect(resistanceCheckBox[unit], SIGNAL(toggled(bool)), this, SLOT(setDisplayOptions()));
 }
 
-void ControlWindow::createExternalCommandLayout() {
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		externalCommand[i] = new ExternalCommandWidget(*state.board, i);
-	}
+void ControlWindow::createExternalCommandLayout(int unit) {
+	externalCommand[unit] = new ExternalCommandWidget(*state.board, unit);
 }
 
-void ControlWindow::createSignalOutputLayout() {
-	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
-		signalOutput[i] = new SignalOutputWidget(*state.board, i, false);
-		clampOutput[i] = new SignalOutputWidget(*state.board, i, true);
-		markerOutput[i] = new MarkerOutputWidget(*state.board, i);
-	}
+void ControlWindow::createSignalOutputLayout(int unit) {
+	signalOutput[unit] = new SignalOutputWidget(*state.board, unit, false);
+	clampOutput[unit] = new SignalOutputWidget(*state.board, unit, true);
+	markerOutput[unit] = new MarkerOutputWidget(*state.board, unit);
 }
 
 void ControlWindow::measureTemperature() {
-    double temperatureC = state.board->controller.temperatureSensor.readTemperature(0);
+    double temperatureC;
+    if (state.isRunning()) {
+        // Reading it now would get in the way of the run; use the last background check
+        CLAMP::HealthReading reading = state.healthMonitor->getReading(selectedHeadstage());
+        if (!reading.valid) {
+            QMessageBox::information(this, "Info", "The temperature is checked between sweeps; it hasn't been yet.  Try again later, or stop running.");
+            return;
+        }
+        temperatureC = reading.temperature;
+    }
+    else {
+        temperatureC = state.board->controller.temperatureSensor.readTemperature(selectedHeadstage());
+    }
     double temperatureF = (temperatureC * 1.8) + 32;
     QMessageBox::information(this, "Info", QString("Temperature = ") + QString::number(temperatureC, 'f', 1) + QString(" C") + QString(" = ") + QString::number(temperatureF, 'f', 1) + QString(" F"));
 }
@@ -556,10 +721,36 @@ void ControlWindow::closeEvent(QCloseEvent *) {
 }
 
 void ControlWindow::setStatusMessage(int unit, QString message) {
+    if (!statusLabel[unit]) {
+        return; // Not present
+    }
     statusLabel[unit]->setText(message);
     statusLabel[unit]->update();
 }
 
+// Only says something when there's something wrong, so it doesn't replace the run's own status every minute
+void ControlWindow::showHealth(int unit, double temperature, double drift, bool responding) {
+    if (!responding) {
+        setStatusMessage(unit, tr("Headstage not responding correctly; check its cable"));
+    }
+    else if (std::abs(drift) > CLAMP::ClampConfig::CalibrationCache::MAX_TEMPERATURE_CHANGE) {
+        setStatusMessage(unit, tr("Temperature %1 C, %2 C from calibration; consider restarting with --recalibrate")
+                         .arg(temperature, 0, 'f', 1).arg(drift, 0, 'f', 1));
+    }
+}
+
+// Warns on the running headstage's status line when the board's FIFO fills past the high watermark, well before it
+// overflows; the Performance panel has the run's FIFO history
+void ControlWindow::showFifoWarning(bool high, double percentageFull) {
+    if (high) {
+        LOG(true) << "Warning: board FIFO " << percentageFull << "% full\n";
+        setStatusMessage(runningHeadstage, tr("Board FIFO %1% full; the computer isn't keeping up").arg(percentageFull, 0, 'f', 0));
+    }
+    else {
+        setStatusMessage(runningHeadstage, tr("Board FIFO back to %1% full").arg(percentageFull, 0, 'f', 0));
+    }
+}
+
 int ControlWindow::selectedHeadstage() const {
 	return headstageTabWidget->currentIndex();
 }
@@ -592,6 +783,63 @@ void ControlWindow::setSaveAux(bool enable)
 	state.saveAuxMode = enable;
 }
 
+void ControlWindow::setAsyncSave(bool enable)
+{
+	state.asyncSaveMode = enable;
+}
+
+void ControlWindow::setDirectIOSave(bool enable)
+{
+	state.directIOSaveMode = enable;
+}
+
+void ControlWindow::setJournalSave(bool enable)
+{
+	state.journalSaveMode = enable;
+}
+
+void ControlWindow::setSweepIndexSave(bool enable)
+{
+	state.sweepIndexSaveMode = enable;
+}
+
+void ControlWindow::setMultiplexedSave(bool enable)
+{
+	state.multiplexedSaveMode = enable;
+}
+
+void ControlWindow::setSaveFormat(QAction* action)
+{
+	state.saveFormat = action->data().toInt();
+}
+
+// 0: every sample; 1: digital changes and ADCs; 2: digital changes only (see SaveFile::AUX_EVENTS)
+void ControlWindow::setAuxFormat(QAction* action)
+{
+	int choice = action->data().toInt();
+	state.auxSaveFormat = (choice == 0) ? SaveFile::AUX_RECORDS : SaveFile::AUX_EVENTS;
+	state.auxSaveAdcs = (choice != 2);
+}
+
+// Takes effect the next time a headstage starts running
+void ControlWindow::setConcurrentProtocols(bool enable)
+{
+	state.concurrentProtocols = enable;
+}
+
+// Takes effect the next time a headstage starts running.  The holding between sweeps is recorded by the board but not
+// stored, and no health checks run between sweeps.
+void ControlWindow::setGaplessIntervals(bool enable)
+{
+	state.gaplessIntervals = enable;
+}
+
+// Takes effect the next time the board's reader thread starts (i.e., the next continuous run)
+void ControlWindow::setRealtimeReader(bool enable)
+{
+	state.board->setReaderThreadScheduling(enable ? Thread::REALTIME_PRIORITY : Thread::NORMAL_PRIORITY);
+}
+
 void ControlWindow::setVClampX2(bool x2Mode)
 {
 	if (x2Mode) {
@@ -632,6 +880,84 @@ void ControlWindow::keyboardShortcutsHelp()
 	keyboardShortcutDialog->activateWindow();
 }
 
+// Display live performance panel.
+void ControlWindow::performance()
+{
+	performancePanel->show();
+	performancePanel->raise();
+	performancePanel->activateWindow();
+}
+
+void ControlWindow::logMemoryUsage()
+{
+	state.logMemoryUsage();
+}
+
+// Start or stop timing waits on, and holds of, the shared locks; starting clears the previous counts.
+void ControlWindow::setProfileLocks(bool enable)
+{
+	if (enable) {
+		CLAMP::LockProfiling::reset();
+	}
+	CLAMP::LockProfiling::setEnabled(enable);
+}
+
+// Write the locks with the most time spent waiting to the log.
+void ControlWindow::logLockContention()
+{
+	LOG(true) << CLAMP::LockProfiling::report();
+}
+
+// Ask for the most memory each plot may use; past it, the oldest sweeps are dropped.
+void ControlWindow::setDisplayMemoryCap()
+{
+	bool ok;
+	int megabytes = QInputDialog::getInt(this, tr("Plot Memory Limit"), tr("Most memory per plot, in MB (0 for no limit):"),
+		static_cast<int>(state.displayMemoryCap / (1024 * 1024)), 0, 65536, 1, &ok);
+	if (ok) {
+		state.setDisplayMemoryCap(static_cast<std::size_t>(megabytes) * 1024 * 1024);
+	}
+}
+
+// Ask how often to run the processing and plotting of incoming data; 0 runs it on every read.
+void ControlWindow::setProcessingInterval()
+{
+	bool ok;
+	int milliseconds = QInputDialog::getInt(this, tr("Processing Interval"), tr("Process incoming data every (ms, 0 for every read):"),
+		static_cast<int>(state.processingIntervalMs), 0, 10000, 10, &ok);
+	if (ok) {
+		state.setProcessingInterval(milliseconds);
+	}
+}
+
+// Takes effect the next time a recording starts
+void ControlWindow::setSaveRollover()
+{
+	bool ok;
+	int megabytes = QInputDialog::getInt(this, tr("Split Save Files"), tr("Start a new file after this many MB (0 for no limit):"),
+		static_cast<int>(state.saveRolloverMB), 0, 1024 * 1024, 1, &ok);
+	if (!ok) {
+		return;
+	}
+	int minutes = QInputDialog::getInt(this, tr("Split Save Files"), tr("Start a new file after this many minutes (0 for no limit):"),
+		static_cast<int>(state.saveRolloverMinutes), 0, 7 * 24 * 60, 1, &ok);
+	if (ok) {
+		state.saveRolloverMB = megabytes;
+		state.saveRolloverMinutes = minutes;
+	}
+}
+
+// Display per-processor timing window.
+void ControlWindow::processorStatistics()
+{
+	if (!processorStatisticsDialog) {
+		processorStatisticsDialog = new ProcessorStatisticsDialog(state, this);
+	}
+	processorStatisticsDialog->show();
+	processorStatisticsDialog->raise();
+	processorStatisticsDialog->activateWindow();
+}
+
 // Display "About" message box.
 void ControlWindow::about()
 {
@@ -688,4 +1014,74 @@ KeyboardShortcutDialog::KeyboardShortcutDialog(QWidget *parent) :
 
 	setLayout(mainLayout);
 
-}
\ No newline at end of file
+}
+ProcessorStatisticsDialog::ProcessorStatisticsDialog(GlobalState& state_, QWidget *parent) :
+	QDialog(parent),
+	state(state_)
+{
+	setWindowTitle(tr("Processing Statistics"));
+
+	QStringList headings;
+	headings << tr("Headstage") << tr("Processor") << tr("Calls") << tr("Skipped") << tr("Mean (ms)") << tr("Max (ms)") << tr("Total (s)") << tr("Samples");
+	table = new QTableWidget(0, headings.size(), this);
+	table->setHorizontalHeaderLabels(headings);
+	table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+	table->verticalHeader()->hide();
+
+	QPushButton* resetButton = new QPushButton(tr("Reset"), this);
+	connect(resetButton, SIGNAL(clicked()), this, SLOT(reset()));
+
+	QHBoxLayout *buttonLayout = new QHBoxLayout;
+	buttonLayout->addStretch(1);
+	buttonLayout->addWidget(resetButton);
+
+	QVBoxLayout *mainLayout = new QVBoxLayout;
+	mainLayout->addWidget(table);
+	mainLayout->addLayout(buttonLayout);
+	setLayout(mainLayout);
+	resize(720, 400);
+
+	refreshTimer = new QTimer(this);
+	connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+	refreshTimer->start(1000);
+	refresh();
+}
+
+void ProcessorStatisticsDialog::refresh()
+{
+	if (!isVisible()) {
+		return;
+	}
+
+	int row = 0;
+	for (int unit = 0; unit < CLAMP::MAX_NUM_CHIPS; unit++) {
+		std::vector<ProcessorStatistics> statistics = state.datastore[unit].getProcessorStatistics();
+		for (const ProcessorStatistics& s : statistics) {
+			QStringList values;
+			values << QString::number(unit + 1) << s.name << QString::number(s.calls) << QString::number(s.skips)
+			       << QString::number(s.meanSeconds() * 1000, 'f', 3) << QString::number(s.maxSeconds * 1000, 'f', 3)
+			       << QString::number(s.totalSeconds, 'f', 2) << QString::number(s.samplesProcessed);
+			if (table->rowCount() <= row) {
+				table->insertRow(row);
+			}
+			for (int column = 0; column < values.size(); column++) {
+				QTableWidgetItem* item = table->item(row, column);
+				if (!item) {
+					item = new QTableWidgetItem();
+					table->setItem(row, column, item);
+				}
+				item->setText(values[column]);
+			}
+			row++;
+		}
+	}
+	table->setRowCount(row);
+}
+
+void ProcessorStatisticsDialog::reset()
+{
+	for (int unit = 0; unit < CLAMP::MAX_NUM_CHIPS; unit++) {
+		state.datastore[unit].resetProcessorStatistics();
+	}
+	refresh();
+}
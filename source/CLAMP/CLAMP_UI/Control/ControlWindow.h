@@ -18,10 +18,15 @@ class QCheckBox;
 class QDoubleSpinBox;
 class QTabWidget;
 class QAction;
+class QActionGroup;
 class QGroupBox;
 class GlobalState;
 class DisplayWindow;
 class KeyboardShortcutDialog;
+class ProcessorStatisticsDialog;
+class PerformancePanel;
+class QTableWidget;
+class QTimer;
 
 namespace CLAMP {
 	namespace IO {
@@ -42,7 +47,6 @@ public:
 	void fillSettings(CLAMP::IO::Settings& settings, int unit, bool holdingOnly = false, unsigned int lastIndex = 0);
 
 signals:
-	void updateStatsSignal();
 	void resistanceChanged(double value);
 	void clampModeChanged(int index);
 
@@ -65,11 +69,31 @@ signals:
 	void stopRunning();
 	void measureTemperature();
 	void setSaveAux(bool enable);
+	void setAsyncSave(bool enable);
+	void setDirectIOSave(bool enable);
+	void setJournalSave(bool enable);
+	void setSweepIndexSave(bool enable);
+	void setMultiplexedSave(bool enable);
+	void setSaveFormat(QAction* action);
+	void setAuxFormat(QAction* action);
+	void setConcurrentProtocols(bool enable);
+	void setGaplessIntervals(bool enable);
+	void setRealtimeReader(bool enable);
 	void setVClampX2(bool x2Mode);
 	void openIntanWebsite();
 	void keyboardShortcutsHelp();
+	void processorStatistics();
+	void performance();
+	void logMemoryUsage();
+	void setDisplayMemoryCap();
+	void setProcessingInterval();
+	void setSaveRollover();
+	void setProfileLocks(bool enable);
+	void logLockContention();
 	void about();
 	void setStatusMessage(int unit, QString message); // Note: should not be QString&
+	void showHealth(int unit, double temperature, double drift, bool responding);
+	void showFifoWarning(bool high, double percentageFull);
 
 	// Should be private some day
 public:
@@ -95,15 +119,37 @@ private:
 	QAction* intanWebsiteAction;
 	QAction* aboutAction;
 	QAction* saveAuxAction;
+	QAction* asyncSaveAction;
+	QAction* directIOSaveAction;
+	QAction* journalSaveAction;
+	QAction* sweepIndexSaveAction;
+	QAction* multiplexedSaveAction;
+	QActionGroup* saveFormatGroup;
+	QActionGroup* auxFormatGroup;
+	QAction* concurrentProtocolsAction;
+	QAction* gaplessIntervalsAction;
+	QAction* realtimeReaderAction;
 	QAction* vClampX2Action;
+	QAction* processorStatisticsAction;
+	QAction* performanceAction;
+	QAction* logMemoryUsageAction;
+	QAction* displayMemoryCapAction;
+	QAction* processingIntervalAction;
+	QAction* saveRolloverAction;
+	QAction* profileLocksAction;
+	QAction* logLockContentionAction;
 
 	QLayout* createControlLayout();
+	QWidget* createHeadstageTab(int unit);
 
 	// Run/Stop & label
 	QLayoutItem* createRunStopLayout();
 	QLayoutItem* createFIFOStatsLayout();
 	QLabel *fifoLagLabel;
 	QLabel *fifoFullLabel;
+	QLabel *saveQueueLabel;
+	QLabel *droppedLabel;
+	QLabel *overloadLabel;
 	QPushButton* runButton;
 	QPushButton* runOnceButton;
 	QPushButton* stopButton;
@@ -117,7 +163,7 @@ private:
 
 	// Capacitive compensation
 	QGroupBox* capCompensation[CLAMP::MAX_NUM_CHIPS];
-	void createCapCompensation();
+	void createCapCompensation(int unit);
 	QDoubleSpinBox* capCompensationSpinBox[CLAMP::MAX_NUM_CHIPS];
 
 	// What's happening
@@ -132,19 +178,21 @@ private:
 	QGroupBox* resistance[CLAMP::MAX_NUM_CHIPS];
 	QCheckBox* resistanceCheckBox[CLAMP::MAX_NUM_CHIPS];
 	QLabel* resistanceValue[CLAMP::MAX_NUM_CHIPS];
-	void createResistanceLayout();
+	void createResistanceLayout(int unit);
 
 	// External commands from ANALOG IN ports
 	ExternalCommandWidget* externalCommand[CLAMP::MAX_NUM_CHIPS];
-	void createExternalCommandLayout();
+	void createExternalCommandLayout(int unit);
 
 	// Signal outputs to ANALOG OUT and DIGITAL OUT ports
 	SignalOutputWidget* signalOutput[CLAMP::MAX_NUM_CHIPS];
 	SignalOutputWidget* clampOutput[CLAMP::MAX_NUM_CHIPS];
 	MarkerOutputWidget* markerOutput[CLAMP::MAX_NUM_CHIPS];
-	void createSignalOutputLayout();
+	void createSignalOutputLayout(int unit);
 
 	KeyboardShortcutDialog *keyboardShortcutDialog;
+	ProcessorStatisticsDialog* processorStatisticsDialog;
+	PerformancePanel* performancePanel;
 
 	void closeEvent(QCloseEvent *e) override;
 	DisplayWindow* getDisplayWindow() const;
@@ -163,3 +211,20 @@ signals:
 	public slots :
 
 };
+
+// Shows how long each headstage's data processors take, refreshed while the dialog is visible
+class ProcessorStatisticsDialog : public QDialog
+{
+	Q_OBJECT
+public:
+	ProcessorStatisticsDialog(GlobalState& state_, QWidget *parent = 0);
+
+	private slots:
+	void refresh();
+	void reset();
+
+private:
+	GlobalState& state;
+	QTableWidget* table;
+	QTimer* refreshTimer;
+};
@@ -176,6 +176,17 @@ CurrentClampWidget::CurrentClampWidget(GlobalState& state_, CapacitiveCompensati
     connect(&state.datastore[unit], SIGNAL(wholeCellParametersChanged(double, double, double)), this, SLOT(setWholeCell(double, double, double)));
 
     emit setCurrentStepSize(0);
+
+    // Everything the waveform is built from; see waveformChanged
+    connect(holdingAmplitudeSpinBox, SIGNAL(valueChanged(double)), this, SLOT(waveformChanged()));
+    connect(currentStepSizeComboBox, SIGNAL(currentIndexChanged(int)), this, SLOT(waveformChanged()));
+    connect(&applied->tuningParams, SIGNAL(valuesChanged()), this, SLOT(waveformChanged()));
+    connect(&applied->waveformParams, SIGNAL(valuesChanged()), this, SLOT(waveformChanged()));
+    connect(applied->arbWaveformParamsDisplay, SIGNAL(arbWaveformLoaded()), this, SLOT(waveformChanged()));
+    for (QRadioButton* button : { applied->holding, applied->tuning, applied->multistep, applied->arbWaveform }) {
+        connect(button, SIGNAL(toggled(bool)), this, SLOT(waveformChanged()));
+    }
+    waveformChanged();
 }
 
 QWidget* CurrentClampWidget::createHoldingWidget() {
@@ -271,6 +282,11 @@ void CurrentClampWidget::optionsChanged() {
     emit changeDisplay();
 }
 
+// Publishes the waveform for ClampThread to pick up between sweeps, rather than it reading these widgets itself
+void CurrentClampWidget::waveformChanged() {
+    publishWaveform(state.board->getSamplingRateHz());
+}
+
 void CurrentClampWidget::getDisplayConfig(PlotConfiguration& config) {
     config.showVcell = false;
 	config.showAppliedPlusAdc = appliedPlusAdc->isChecked();
@@ -84,6 +84,7 @@ private slots:
     void setCurrentStepSize(int index);
     void setZeroCurrent();
     void optionsChanged();
+    void waveformChanged();
     void setWholeCell(double Ra, double Rm, double Cm);
 
 private:
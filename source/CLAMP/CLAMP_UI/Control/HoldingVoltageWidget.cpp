@@ -41,6 +41,7 @@ zeroButton(nullptr)
     spinBox->setStyleSheet(QString::fromUtf8("color:blue; background:transparent; border:none;"));
     spinBox->setButtonSymbols(QAbstractSpinBox::NoButtons);
     connect(spinBox, SIGNAL(valueChanged(double)), this, SLOT(setHoldingVoltageInternal(double)));
+    connect(spinBox, SIGNAL(valueChanged(double)), this, SIGNAL(valueChanged(double)));
 
     QGridLayout *grid = new QGridLayout();
     grid->addWidget(spinBox, 0, 0, 2, 1);
@@ -19,6 +19,9 @@ public:
     int valueInSteps(double offset);
 	void setSliderEnabled(bool enabled);
 
+signals:
+    void valueChanged(double valueInmV);
+
 private slots:
     void setHoldingVoltageInternal(double valueInmV);
     void setSliderValue(int);
@@ -0,0 +1,251 @@
+#include "PerformancePanel.h"
+#include <QtGui>
+#include "GlobalState.h"
+#include "DataStore.h"
+#include "Plot.h"
+#include "SaveWriterThread.h"
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+using std::vector;
+using std::lock_guard;
+using std::mutex;
+using namespace CLAMP;
+using namespace CLAMP::IO;
+
+// Most latency samples kept, in case reads are very frequent
+static const std::size_t MAX_LATENCY_SAMPLES = 100000;
+
+PerformancePanel::PerformancePanel(GlobalState& state_, QWidget* parent) :
+    QDialog(parent),
+    state(state_)
+{
+    setWindowTitle(tr("Performance"));
+
+    throughputLabel = new QLabel(this);
+    packetRateLabel = new QLabel(this);
+    transfersLabel = new QLabel(this);
+    transferTimeLabel = new QLabel(this);
+    linkRateLabel = new QLabel(this);
+    decodeLabel = new QLabel(this);
+    processingLabel = new QLabel(this);
+    paintLabel = new QLabel(this);
+    saveQueueLabel = new QLabel(this);
+    latencyLabel = new QLabel(this);
+    readIntervalLabel = new QLabel(this);
+    processedLatencyLabel = new QLabel(this);
+    clockLabel = new QLabel(this);
+    fifoRunLabel = new QLabel(this);
+
+    outlierSpinBox = new QDoubleSpinBox(this);
+    outlierSpinBox->setRange(0, 10000);
+    outlierSpinBox->setDecimals(1);
+    outlierSpinBox->setSuffix(" ms");
+    outlierSpinBox->setSpecialValueText(tr("off"));
+    outlierSpinBox->setValue(state.board->loopTiming.getOutlierThreshold() * 1000);
+    connect(outlierSpinBox, SIGNAL(valueChanged(double)), this, SLOT(setOutlierThreshold(double)));
+
+    QPushButton* resetButton = new QPushButton(tr("Reset"), this);
+    connect(resetButton, SIGNAL(clicked()), this, SLOT(resetLoopTiming()));
+
+    fifoHighSpinBox = new QDoubleSpinBox(this);
+    fifoHighSpinBox->setRange(1, 100);
+    fifoHighSpinBox->setDecimals(0);
+    fifoHighSpinBox->setSuffix("%");
+    fifoHighSpinBox->setValue(state.board->fifoMonitor.getHighWatermark());
+    fifoLowSpinBox = new QDoubleSpinBox(this);
+    fifoLowSpinBox->setRange(0, 99);
+    fifoLowSpinBox->setDecimals(0);
+    fifoLowSpinBox->setSuffix("%");
+    fifoLowSpinBox->setValue(state.board->fifoMonitor.getLowWatermark());
+    connect(fifoHighSpinBox, SIGNAL(valueChanged(double)), this, SLOT(setFifoWatermarks()));
+    connect(fifoLowSpinBox, SIGNAL(valueChanged(double)), this, SLOT(setFifoWatermarks()));
+
+    QPushButton* saveFifoButton = new QPushButton(tr("Save FIFO History..."), this);
+    connect(saveFifoButton, SIGNAL(clicked()), this, SLOT(saveFifoHistory()));
+
+    QFormLayout* layout = new QFormLayout;
+    layout->addRow(tr("USB throughput:"), throughputLabel);
+    layout->addRow(tr("Packets:"), packetRateLabel);
+    layout->addRow(tr("USB transfers:"), transfersLabel);
+    layout->addRow(tr("Time in transfers:"), transferTimeLabel);
+    layout->addRow(tr("USB rate while transferring:"), linkRateLabel);
+    layout->addRow(tr("Decode time:"), decodeLabel);
+    layout->addRow(tr("Processing time:"), processingLabel);
+    layout->addRow(tr("Paint time:"), paintLabel);
+    layout->addRow(tr("Save queue:"), saveQueueLabel);
+    layout->addRow(tr("FIFO latency:"), latencyLabel);
+    layout->addRow(new QLabel(tr("Averaged over the last %1 s").arg(WINDOW_MS / 1000)));
+    layout->addRow(tr("Read interval:"), readIntervalLabel);
+    layout->addRow(tr("Read to processed:"), processedLatencyLabel);
+    layout->addRow(tr("Board clock:"), clockLabel);
+    layout->addRow(tr("Log intervals over:"), outlierSpinBox);
+    layout->addRow(resetButton);
+    layout->addRow(tr("FIFO this run:"), fifoRunLabel);
+    layout->addRow(tr("Warn when FIFO reaches:"), fifoHighSpinBox);
+    layout->addRow(tr("Clear warning at:"), fifoLowSpinBox);
+    layout->addRow(saveFifoButton);
+    setLayout(layout);
+
+    clock.start();
+    refreshTimer = new QTimer(this);
+    connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+    refreshTimer->start(REFRESH_MS);
+    refresh();
+}
+
+void PerformancePanel::recordLatency(double ms) {
+    lock_guard<mutex> lock(latencyMutex);
+    latencies.push_back(std::make_pair(clock.elapsed(), ms));
+    if (latencies.size() > MAX_LATENCY_SAMPLES) {
+        latencies.pop_front();
+    }
+}
+
+void PerformancePanel::resetLoopTiming() {
+    state.board->loopTiming.reset();
+    state.board->resetTransferMinimum();
+    refresh();
+}
+
+void PerformancePanel::setOutlierThreshold(double ms) {
+    state.board->loopTiming.setOutlierThreshold(ms / 1000);
+}
+
+void PerformancePanel::setFifoWatermarks() {
+    // Keep the low watermark under the high one
+    if (fifoLowSpinBox->value() >= fifoHighSpinBox->value()) {
+        fifoLowSpinBox->setValue(fifoHighSpinBox->value() - 1);
+        return; // Called again by the change
+    }
+    state.board->fifoMonitor.setWatermarks(fifoHighSpinBox->value(), fifoLowSpinBox->value());
+}
+
+void PerformancePanel::saveFifoHistory() {
+    QString filename = QFileDialog::getSaveFileName(this, tr("Save FIFO History"), ".", tr("CSV files (*.csv)"));
+    if (filename.isEmpty()) {
+        return;
+    }
+    std::ofstream out(toFileName(filename.toStdString()).c_str());
+    state.board->fifoMonitor.writeHistory(out);
+    if (!out) {
+        QMessageBox::critical(this, tr("Error"), tr("Could not write %1").arg(filename));
+    }
+}
+
+PerformancePanel::Snapshot PerformancePanel::takeSnapshot() {
+    Snapshot snapshot;
+    snapshot.ms = clock.elapsed();
+    snapshot.read = state.board->getReadStatistics();
+    snapshot.processingSeconds = 0;
+    for (int unit = 0; unit < MAX_NUM_CHIPS; unit++) {
+        for (const ProcessorStatistics& s : state.datastore[unit].getProcessorStatistics()) {
+            snapshot.processingSeconds += s.totalSeconds;
+        }
+    }
+    snapshot.paintSeconds = Plot::getPaintSeconds();
+    return snapshot;
+}
+
+// Percentage of wall-clock time that the given busy time represents
+static QString busyText(double seconds, double windowSeconds) {
+    return QString::number(1000 * seconds / windowSeconds, 'f', 1) + " ms/s (" + QString::number(100 * seconds / windowSeconds, 'f', 1) + "%)";
+}
+
+// Percentiles of a LoopTiming histogram, in ms
+static QString histogramText(const Histogram& histogram) {
+    if (histogram.count() == 0) {
+        return QObject::tr("no reads");
+    }
+    return "p50 " + QString::number(1000 * histogram.percentile(0.5), 'f', 2) + " ms, p99 " + QString::number(1000 * histogram.percentile(0.99), 'f', 2)
+           + " ms, p99.9 " + QString::number(1000 * histogram.percentile(0.999), 'f', 2) + " ms, max " + QString::number(1000 * histogram.max(), 'f', 2) + " ms";
+}
+
+void PerformancePanel::refresh() {
+    // Sample even while hidden, so the window is full as soon as the panel is shown
+    history.push_back(takeSnapshot());
+    while (history.size() > 2 && history[1].ms <= history.back().ms - WINDOW_MS) {
+        history.pop_front();
+    }
+
+    vector<double> window;
+    {
+        lock_guard<mutex> lock(latencyMutex);
+        while (!latencies.empty() && latencies.front().first < history.back().ms - WINDOW_MS) {
+            latencies.pop_front();
+        }
+        window.reserve(latencies.size());
+        for (auto& sample : latencies) {
+            window.push_back(sample.second);
+        }
+    }
+
+    if (!isVisible()) {
+        return;
+    }
+
+    const Snapshot& first = history.front();
+    const Snapshot& last = history.back();
+    double seconds = (last.ms - first.ms) / 1000.0;
+    if (seconds > 0) {
+        // Statistics may have been reset (see ProcessorStatisticsDialog) during the window
+        double processing = std::max(0.0, last.processingSeconds - first.processingSeconds);
+        throughputLabel->setText(QString::number((last.read.bytesRead - first.read.bytesRead) / seconds / 1e6, 'f', 2) + " MB/s");
+        packetRateLabel->setText(QString::number((last.read.packetsRead - first.read.packetsRead) / seconds, 'f', 0) + " /s");
+        decodeLabel->setText(busyText(last.read.decodeSeconds - first.read.decodeSeconds, seconds));
+
+        uint64_t transfers = last.read.transfers - first.read.transfers;
+        uint64_t transferBytes = last.read.transferBytes - first.read.transferBytes;
+        double transferSeconds = last.read.transferSeconds - first.read.transferSeconds;
+        if (transfers > 0) {
+            transfersLabel->setText(QString::number(transfers / seconds, 'f', 1) + " /s, average " + QString::number(transferBytes / 1024.0 / transfers, 'f', 1)
+                                    + " KB, smallest " + QString::number(last.read.minTransferBytes / 1024.0, 'f', 1) + " KB");
+        }
+        else {
+            transfersLabel->setText(tr("none"));
+        }
+        transferTimeLabel->setText(busyText(transferSeconds, seconds));
+        if (transferSeconds > 0) {
+            double rate = transferBytes / transferSeconds;
+            linkRateLabel->setText(QString::number(rate / 1e6, 'f', 2) + " MB/s (" + QString::number(100 * rate / Board::MAX_USB_BYTES_PER_SECOND, 'f', 0) + "% of USB 2.0)");
+        }
+        else {
+            linkRateLabel->setText(tr("no transfers"));
+        }
+        processingLabel->setText(busyText(processing, seconds));
+        paintLabel->setText(busyText(last.paintSeconds - first.paintSeconds, seconds));
+    }
+
+    SaveQueueStatistics saveStats = SaveWriterThread::instance().getStatistics();
+    saveQueueLabel->setText(QString::number(saveStats.bytesQueued / 1e6, 'f', 1) + " MB (" + QString::number(saveStats.percentageFull(), 'f', 0) + "% full), "
+                            + QString::number(saveStats.stalls) + " stalls");
+
+    if (window.empty()) {
+        latencyLabel->setText(tr("no reads"));
+    }
+    else {
+        std::size_t p50 = window.size() / 2;
+        std::size_t p99 = std::min(window.size() - 1, window.size() * 99 / 100);
+        std::nth_element(window.begin(), window.begin() + p50, window.end());
+        double median = window[p50];
+        std::nth_element(window.begin(), window.begin() + p99, window.end());
+        latencyLabel->setText("p50 " + QString::number(median, 'f', 1) + " ms, p99 " + QString::number(window[p99], 'f', 1) + " ms");
+    }
+
+    readIntervalLabel->setText(histogramText(state.board->loopTiming.intervals));
+    processedLatencyLabel->setText(histogramText(state.board->loopTiming.latencies));
+
+    ClockModel model = state.board->clockSync.getModel();
+    if (!model.valid) {
+        clockLabel->setText(tr("not running"));
+    }
+    else {
+        clockLabel->setText(QString::number(model.driftPPM, 'f', 2) + " ppm" + (model.driftMeasured ? QString() : tr(" (previous run)")) + ", fit to "
+                            + QString::number(1000 * model.residualSeconds, 'f', 3) + " ms over " + QString::number(model.spanSeconds, 'f', 0) + " s");
+    }
+
+    const FifoMonitor& fifo = state.board->fifoMonitor;
+    fifoRunLabel->setText("peak " + QString::number(fifo.getPeakPercentage(), 'f', 1) + "% full, " + QString::number(fifo.getHighCrossings())
+                          + tr(" warnings") + (fifo.isAboveHigh() ? tr(" (now over)") : QString()));
+}
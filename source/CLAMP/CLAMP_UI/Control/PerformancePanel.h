@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QDialog>
+#include <QElapsedTimer>
+#include <deque>
+#include <mutex>
+#include "Board.h"
+
+class GlobalState;
+class QLabel;
+class QTimer;
+class QDoubleSpinBox;
+
+/* Live view of where acquisition time goes: USB throughput, decode/processing/paint time, save queue depth, and
+ * FIFO latency percentiles, over a sliding window.  Also shows the read loop's jitter (Board::loopTiming), which is
+ * accumulated until reset rather than windowed, and the board clock's drift against the host's (Board::clockSync).
+ * The FIFO's watermarks are set here, and its history for the current run (Board::fifoMonitor) saved as CSV.
+ *
+ * The counters are sampled on a timer (REFRESH_MS), not per read, so watching them doesn't add to the load.  The only
+ * per-read work is recordLatency(), which the acquisition thread calls through ControlWindow::updateStatsExt.
+ */
+class PerformancePanel : public QDialog {
+    Q_OBJECT
+public:
+    PerformancePanel(GlobalState& state_, QWidget* parent = 0);
+
+    // Sliding window the rates and percentiles are computed over
+    static const int WINDOW_MS = 5000;
+    // How often the counters are sampled and the panel updated
+    static const int REFRESH_MS = 250;
+
+    void recordLatency(double ms); // Thread-safe
+
+private slots:
+    void refresh();
+    void resetLoopTiming();
+    void setOutlierThreshold(double ms);
+    void setFifoWatermarks();
+    void saveFifoHistory();
+
+private:
+    GlobalState& state;
+    QElapsedTimer clock;
+    QTimer* refreshTimer;
+
+    // Cumulative counters at one refresh
+    struct Snapshot {
+        qint64 ms;
+        CLAMP::ReadStatistics read;
+        double processingSeconds;
+        double paintSeconds;
+    };
+    std::deque<Snapshot> history;
+    Snapshot takeSnapshot();
+
+    // (time, latency in ms) for each read within the window
+    std::mutex latencyMutex;
+    std::deque<std::pair<qint64, double>> latencies;
+
+    QLabel* throughputLabel;
+    QLabel* packetRateLabel;
+    QLabel* transfersLabel;
+    QLabel* transferTimeLabel;
+    QLabel* linkRateLabel;
+    QLabel* decodeLabel;
+    QLabel* processingLabel;
+    QLabel* paintLabel;
+    QLabel* saveQueueLabel;
+    QLabel* latencyLabel;
+    QLabel* readIntervalLabel;
+    QLabel* processedLatencyLabel;
+    QLabel* clockLabel;
+    QLabel* fifoRunLabel;
+    QDoubleSpinBox* outlierSpinBox;
+    QDoubleSpinBox* fifoHighSpinBox;
+    QDoubleSpinBox* fifoLowSpinBox;
+};
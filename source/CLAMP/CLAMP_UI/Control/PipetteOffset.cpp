@@ -126,7 +126,7 @@ double PipetteOffsetThread::measureCurrent(CLAMP::ClampConfig::ChipChannelList&
     state.board->controller.simplifiedWaveformToWaveform(channelList, true, waveform);
 	state.board->commandsToFPGASinglePort(unit);
     state.board->runAndReadOneCycle(unit);  // TODO: should this be 0 instead of unit?
-    const vector<double>& results = state.board->readQueue.getMeasuredCurrents(channelList.front());
+    const vector<Sample>& results = state.board->readQueue.getMeasuredCurrents(channelList.front());
     double avg = DataAnalysis::calculateBestResidual(results.begin(), results.end() - 1);
 
     state.board->clearCommands();
@@ -5,11 +5,19 @@
 #include "GUIUtil.h"
 #include "GlobalState.h"
 #include "HoldingVoltageWidget.h"
+#include "FeedbackBandwidthWidget.h"
+#include "ControlWindow.h"
+#include "Board.h"
+#include "SealTest.h"
+#include "CellTracker.h"
+#include <chrono>
 #include <sstream>
 
 using std::string;
 using std::ostringstream;
+using std::vector;
 using namespace CLAMP;
+using namespace CLAMP::ClampConfig;
 
 //--------------------------------------------------------------------------
 ResistanceParams::ResistanceParams() :
@@ -119,3 +127,93 @@ ResistanceDialog::ResistanceDialog(QWidget* parent, ResistanceParams& params_) :
 
     setLayout(layout);
 }
+
+//--------------------------------------------------------------------------
+SealTestThread::SealTestThread(GlobalState& state_, ResistanceParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_) :
+    Thread(),
+    state(state_),
+    params(params_),
+    controller(controller_),
+    feedback(feedback_),
+    unit(unit_)
+{
+}
+
+void SealTestThread::done() {
+    state.threadDone();
+}
+
+void SealTestThread::run() {
+    state.stateMessage(unit, "High-rate seal test");
+
+    state.board->enableOnePortOnly(unit);
+
+    ChipChannelList channelList = { ChipChannel(unit, 0) };
+    CapacitiveCompensationController& cap = *state.datastore[unit].controlWindow;
+    state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+
+    SealTest sealTest(*state.board, channelList);
+    sealTest.setPulse(controller.getHoldingValue(), params.amplitudeInMv.valueAsSteps(), state.vClampX2mode ? 5e-3 : 2.5e-3);
+    sealTest.setUpdateInterval(0.05);
+    sealTest.run(0, [&](const vector<SealTestReading>& readings) {
+        state.datastore[unit].controlWindow->setResistance(readings.front().resistance); // Queued to the GUI thread
+        if (!keepGoing) {
+            sealTest.stop();
+        }
+    });
+
+    state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+
+    state.board->enableAllPorts();
+
+    controller.endMessage(unit);
+}
+
+//--------------------------------------------------------------------------
+CellTrackingThread::CellTrackingThread(GlobalState& state_, ResistanceParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_) :
+    Thread(),
+    state(state_),
+    params(params_),
+    controller(controller_),
+    feedback(feedback_),
+    unit(unit_)
+{
+}
+
+void CellTrackingThread::done() {
+    state.threadDone();
+}
+
+void CellTrackingThread::run() {
+    state.stateMessage(unit, "Tracking cell parameters");
+
+    state.board->enableOnePortOnly(unit);
+
+    ChipChannelList channelList = { ChipChannel(unit, 0) };
+    CapacitiveCompensationController& cap = *state.datastore[unit].controlWindow;
+    state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+
+    CellTracker tracker(*state.board, channelList);
+    tracker.setPulse(controller.getHoldingValue(), params.amplitudeInMv.valueAsSteps(), state.vClampX2mode ? 5e-3 : 2.5e-3);
+    auto nextUpdate = std::chrono::steady_clock::now();
+    tracker.run(0, [&](const vector<CellTrackingReading>& readings) {
+        // Every pulse is fitted, but the display only needs the latest
+        if (std::chrono::steady_clock::now() >= nextUpdate) {
+            nextUpdate += std::chrono::milliseconds(50);
+            const CellTrackingReading& reading = readings.back();
+            if (reading.isValid()) {
+                state.datastore[unit].controlWindow->setResistance(reading.resistance); // Queued to the GUI thread
+                state.datastore[unit].setWholeCell(reading.Ra, reading.Rm, reading.Cm);
+            }
+        }
+        if (!keepGoing) {
+            tracker.stop();
+        }
+    });
+
+    state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+
+    state.board->enableAllPorts();
+
+    controller.endMessage(unit);
+}
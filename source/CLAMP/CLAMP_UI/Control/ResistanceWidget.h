@@ -3,6 +3,7 @@
 #include <QDialog>
 #include "Controller.h"
 #include "MVC.h"
+#include "Thread.h"
 #include <string>
 #include "WaveformTimingWidget.h"
 
@@ -11,6 +12,7 @@ class QDoubleSpinBox;
 class GlobalState;
 class HoldingVoltageWidget;
 class QLabel;
+class FeedbackBandwidthWidget;
 
 class ResistanceParams : public QObject {
     Q_OBJECT
@@ -60,3 +62,37 @@ public:
 private:
     ResistanceParams& params;
 };
+
+// High-rate seal test: loops a short pulse of the resistance amplitude (see CLAMP::SealTest) and shows the resistance
+// in the control window 20 times a second, without going through the data store or the plots.  Runs until stopped.
+class SealTestThread : public Thread {
+public:
+    SealTestThread(GlobalState& state_, ResistanceParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_);
+
+    void run() override;
+    void done() override;
+
+private:
+    GlobalState& state;
+    ResistanceParams& params;
+    Controller& controller;
+    FeedbackBandwidthWidget& feedback;
+    int unit;
+};
+
+// Whole-cell tracking: loops a short pulse of the resistance amplitude (see CLAMP::CellTracker), fits every pulse, and
+// shows the latest access resistance, membrane resistance and capacitance 20 times a second.  Runs until stopped.
+class CellTrackingThread : public Thread {
+public:
+    CellTrackingThread(GlobalState& state_, ResistanceParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_);
+
+    void run() override;
+    void done() override;
+
+private:
+    GlobalState& state;
+    ResistanceParams& params;
+    Controller& controller;
+    FeedbackBandwidthWidget& feedback;
+    int unit;
+};
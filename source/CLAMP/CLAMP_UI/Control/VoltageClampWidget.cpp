@@ -143,6 +143,16 @@ VoltageClampWidget::VoltageClampWidget(GlobalState& state_, int unit_) :
 
     zap = new ZapWidget(state, *this, *feedback, unit);
 
+    fastSealTest = new QPushButton(tr("Fast Resistance"), this);
+    fastSealTest->setCheckable(true);
+    fastSealTest->setToolTip(tr("Measure the resistance at about 100 pulses per second, e.g., while approaching the cell"));
+    connect(fastSealTest, SIGNAL(toggled(bool)), this, SLOT(toggleFastSealTest(bool)));
+
+    trackCell = new QPushButton(tr("Track Cell"), this);
+    trackCell->setCheckable(true);
+    trackCell->setToolTip(tr("Fit Rs, Rm and Cm from every test pulse, about 100 times a second"));
+    connect(trackCell, SIGNAL(toggled(bool)), this, SLOT(toggleCellTracking(bool)));
+
 	QHBoxLayout *hlayout1 = new QHBoxLayout;
 	hlayout1->addStretch(1);
 	hlayout1->addWidget(appliedPlusAdc);
@@ -152,6 +162,8 @@ VoltageClampWidget::VoltageClampWidget(GlobalState& state_, int unit_) :
 	QVBoxLayout *vlayout = new QVBoxLayout;
 	vlayout->addStretch(1);
 	vlayout->addWidget(zap);
+	vlayout->addWidget(fastSealTest);
+	vlayout->addWidget(trackCell);
 	vlayout->addStretch(1);
 	vlayout->addItem(hlayout1);
 
@@ -172,6 +184,18 @@ VoltageClampWidget::VoltageClampWidget(GlobalState& state_, int unit_) :
     setLayout(layout);
 
     connect(applied->resistance, SIGNAL(toggled(bool)), this, SLOT(optionsChanged()));
+
+    // Everything the waveform is built from; see waveformChanged
+    connect(holdingVoltage, SIGNAL(valueChanged(double)), this, SLOT(waveformChanged()));
+    connect(&state, SIGNAL(pipetteOffsetChanged(int, double)), this, SLOT(waveformChanged()));
+    connect(&applied->sealTestParams, SIGNAL(valuesChanged()), this, SLOT(waveformChanged()));
+    connect(&applied->resistanceParams, SIGNAL(valuesChanged()), this, SLOT(waveformChanged()));
+    connect(&applied->multistepParams, SIGNAL(valuesChanged()), this, SLOT(waveformChanged()));
+    connect(applied->arbWaveformParamsDisplay, SIGNAL(arbWaveformLoaded()), this, SLOT(waveformChanged()));
+    for (QRadioButton* button : { applied->holding, applied->sealTest, applied->resistance, applied->multistep, applied->arbWaveform }) {
+        connect(button, SIGNAL(toggled(bool)), this, SLOT(waveformChanged()));
+    }
+    waveformChanged();
 }
 
 void VoltageClampWidget::createCellParametersLayout() {
@@ -241,6 +265,31 @@ void VoltageClampWidget::optionsChanged() {
     emit changeDisplay();
 }
 
+// Publishes the waveform for ClampThread to pick up between sweeps, rather than it reading these widgets itself
+void VoltageClampWidget::waveformChanged() {
+    publishWaveform(state.board->getSamplingRateHz());
+}
+
+// Runs a SealTestThread in place of whatever was running; stopping it goes back to that
+void VoltageClampWidget::toggleFastSealTest(bool checked) {
+    if (checked) {
+        state.preemptThread(new SealTestThread(state, applied->resistanceParams, *this, *feedback, unit));
+    }
+    else if (state.isRunning()) {
+        state.stopThreads();
+    }
+}
+
+// Runs a CellTrackingThread in place of whatever was running; stopping it goes back to that
+void VoltageClampWidget::toggleCellTracking(bool checked) {
+    if (checked) {
+        state.preemptThread(new CellTrackingThread(state, applied->resistanceParams, *this, *feedback, unit));
+    }
+    else if (state.isRunning()) {
+        state.stopThreads();
+    }
+}
+
 void VoltageClampWidget::setWholeCell(double Ra, double Rm, double Cm) {
     raValue->setText(tr("Rs = ") + QString::number(Ra / 1e6, 'f', 1) + " M" + QSTRING_OMEGA_SYMBOL);
     rmValue->setText(tr("Rm = ") + QString::number(Rm / 1e6, 'f', 1) + " M" + QSTRING_OMEGA_SYMBOL);
@@ -259,4 +308,6 @@ void VoltageClampWidget::setControlsEnabled(bool enabled) {
 	vCellCorrection->setEnabled(enabled);
 	cellParameters->setEnabled(enabled);
 	zap->setControlsEnabled(enabled);
+	fastSealTest->setEnabled(enabled);
+	trackCell->setEnabled(enabled);
 }
@@ -20,6 +20,7 @@ class HoldingVoltageWidget;
 struct PlotConfiguration;
 class ZapWidget;
 class QCheckBox;
+class QPushButton;
 
 namespace CLAMP {
     class ClampController;
@@ -88,6 +89,9 @@ public slots:
 
 private slots:
     void optionsChanged();
+    void waveformChanged();
+    void toggleFastSealTest(bool checked);
+    void toggleCellTracking(bool checked);
 
 private:
     GlobalState& state;
@@ -104,5 +108,7 @@ private:
 
     QCheckBox* vCellCorrection;
 	QCheckBox* appliedPlusAdc;
+    QPushButton* fastSealTest;
+    QPushButton* trackCell;
     std::string holdingText();
 };
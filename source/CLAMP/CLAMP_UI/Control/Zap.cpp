@@ -109,7 +109,8 @@ ZapWidget::ZapWidget(GlobalState& state_, Controller& controller_, FeedbackBandw
     feedback(feedback_),
     params(1.0, 0.5),
     zapEnabled(false),
-	unit(unit_)
+	unit(unit_),
+    sequence(state_.board->controller, [this](const ChipChannel& index) { buildZap(index); })
 {
     button = new QPushButton("Zap", this);
     connect(button, SIGNAL(clicked()), this, SLOT(doZap()));
@@ -128,7 +129,27 @@ ZapWidget::ZapWidget(GlobalState& state_, Controller& controller_, FeedbackBandw
 }
 
 void ZapWidget::doZap() {
-    state.preemptThread(new ZapThread(state, params, controller, feedback, unit));
+    state.preemptThread(new ZapThread(state, params, controller, feedback, sequence, unit));
+}
+
+// Adds the whole zap to the channel's command list, so that it runs (and stays in Waveform RAM) as one sequence
+void ZapWidget::buildZap(const ChipChannel& index) {
+    ClampController& clamp = state.board->controller;
+    CapacitiveCompensationController& cap = *state.datastore[unit].controlWindow;
+    clamp.switchToVoltageClamp(index, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+
+	// Switch to smallest feedback resistor to allow large currents to be delivered.
+    clamp.currentToVoltageConverter.setFeedbackResistance(index, CLAMP::Registers::Register3::Resistance::R200k);
+    clamp.currentToVoltageConverter.setFeedbackCapacitance(index, 20e-12);
+
+    SimplifiedWaveform waveform = params.getSimplifiedWaveform(state.board->getSamplingRateHz(), controller.getHoldingValue() / 2); // /2 is because we're using 5 mV steps
+
+    clamp.clampVoltageGenerator.setClampStepSize(index, true); // set voltage clamp DAC step size to 5.0 mV to accommodate large zap pulse
+    clamp.simplifiedWaveformToWaveform({ index }, true, waveform);
+	clamp.clampVoltageGenerator.setClampStepSize(index, state.vClampX2mode); // set voltage clamp DAC step size for normal operation
+
+    // Return to exact holding value - we may have been off by 1 step due to 5 mV steps instead of 2.5 mV steps.  Also, restore old value of feedback resistor.
+	clamp.switchToVoltageClamp(index, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
 }
 
 void ZapWidget::setControlsEnabled(bool enabled) {
@@ -142,12 +163,13 @@ void ZapWidget::setControlsEnabled(bool enabled) {
 }
 
 //--------------------------------------------------------------------------
-ZapThread::ZapThread(GlobalState& state_, ZapParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_) :
+ZapThread::ZapThread(GlobalState& state_, ZapParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, ResidentSequence& sequence_, int unit_) :
     Thread(),
     state(state_),
     params(params_),
     controller(controller_),
     feedback(feedback_),
+    sequence(sequence_),
     beep(new QSound(QDir::tempPath() + "/beep.wav")),
 	unit(unit_)
 {
@@ -171,22 +193,12 @@ void ZapThread::run() {
 	// TODO: What about other channels?
     ChipChannelList channelList = { ChipChannel(unit, 0) };
     CapacitiveCompensationController& cap = *state.datastore[unit].controlWindow;
-    state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
-
-	// Switch to smallest feedback resistor to allow large currents to be delivered.
-	state.board->controller.currentToVoltageConverter.setFeedbackResistanceImmediate(channelList, CLAMP::Registers::Register3::Resistance::R200k);
-	state.board->controller.currentToVoltageConverter.setFeedbackCapacitanceImmediate(channelList, 20e-12);
 
-    SimplifiedWaveform waveform = params.getSimplifiedWaveform(state.board->getSamplingRateHz(), controller.getHoldingValue() / 2); // /2 is because we're using 5 mV steps
-
-    state.board->controller.clampVoltageGenerator.setClampStepSize(channelList.front(), true); // set voltage clamp DAC step size to 5.0 mV to accommodate large zap pulse
-    state.board->controller.simplifiedWaveformToWaveform(channelList, true, waveform);
-    state.board->controller.executeImmediate(channelList);
-	state.board->controller.clampVoltageGenerator.setClampStepSize(channelList.front(), state.vClampX2mode); // set voltage clamp DAC step size for normal operation
-
-    // Return to exact holding value - we may have been off by 1 step due to 5 mV steps instead of 2.5 mV steps.  Also, restore old value of feedback resistor.
-    // state.board->controller.clampVoltageGenerator.setClampVoltageImmediate(channelList, controller.getHoldingValue());
-	state.board->controller.switchToVoltageClampImmediate(channelList, controller.getHoldingValue(), feedback.getDesiredBandwidth(), feedback.getResistanceEnum(), cap.getCapCompensationValue());
+    // One run of the resident zap (see ZapWidget::buildZap); it's only rebuilt when one of these changes
+    std::vector<double> key = { params.amplitudeV.value(), params.durationMs.value(), static_cast<double>(controller.getHoldingValue()),
+                                feedback.getDesiredBandwidth(), static_cast<double>(feedback.getResistanceEnum()), cap.getCapCompensationValue(),
+                                state.board->getSamplingRateHz(), state.vClampX2mode ? 1.0 : 0.0 };
+    sequence.run(channelList, key);
 
 	state.board->enableAllPorts();
 
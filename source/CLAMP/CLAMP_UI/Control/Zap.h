@@ -5,6 +5,7 @@
 #include "Thread.h"
 #include "MVC.h"
 #include "SimplifiedWaveform.h"
+#include "ResidentSequence.h"
 #include <string>
 #include <QDialog>
 
@@ -87,12 +88,16 @@ private:
 
     BoolHolder zapEnabled;
 	int unit;
+
+    // The whole zap, kept in Waveform RAM between zaps; see buildZap
+    CLAMP::ClampConfig::ResidentSequence sequence;
+    void buildZap(const CLAMP::ClampConfig::ChipChannel& index);
 };
 
 
 class ZapThread : public Thread {
 public:
-    ZapThread(GlobalState& state_, ZapParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, int unit_);
+    ZapThread(GlobalState& state_, ZapParams& params_, Controller& controller_, FeedbackBandwidthWidget& feedback_, CLAMP::ClampConfig::ResidentSequence& sequence_, int unit_);
     ~ZapThread();
 
     void run() override;
@@ -103,6 +108,7 @@ private:
     ZapParams& params;
     Controller& controller;
     FeedbackBandwidthWidget& feedback;
+    CLAMP::ClampConfig::ResidentSequence& sequence;
     QSound* beep;
 	int unit;
 };
\ No newline at end of file
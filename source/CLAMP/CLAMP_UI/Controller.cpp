@@ -0,0 +1,30 @@
+#include "Controller.h"
+#include "SimplifiedWaveform.h"
+
+using CLAMP::SimplifiedWaveform;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+
+/* Builds the waveform from the controls and, if it differs from the last one published, publishes it under the next
+ * version.  Call on the GUI thread whenever the controls that make up the waveform change, so the acquisition thread
+ * can check getWaveformVersion() each sweep rather than reading the widgets and comparing whole waveforms.
+ */
+void Controller::publishWaveform(double samplingRate) {
+    shared_ptr<const SimplifiedWaveform> waveform = std::make_shared<const SimplifiedWaveform>(getSimplifiedWaveform(samplingRate));
+
+    lock_guard<mutex> lock(snapshotMutex);
+    if (snapshot.waveform && snapshot.samplingRate == samplingRate && *snapshot.waveform == *waveform) {
+        return;
+    }
+    snapshot.version++;
+    snapshot.samplingRate = samplingRate;
+    snapshot.waveform = waveform;
+    waveformVersion = snapshot.version;
+}
+
+// The latest published waveform
+WaveformSnapshot Controller::getWaveformSnapshot() const {
+    lock_guard<mutex> lock(snapshotMutex);
+    return snapshot;
+}
@@ -1,11 +1,27 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+
 namespace CLAMP {
     class SimplifiedWaveform;
 }
 
+/* A waveform a Controller has published (see Controller::publishWaveform).  It's never modified once published, so it
+ * can be used from any thread.
+ */
+struct WaveformSnapshot {
+    unsigned int version;   // Goes up with each publish that changed the waveform; 0 before the first
+    double samplingRate;    // Rate the waveform was built for
+    std::shared_ptr<const CLAMP::SimplifiedWaveform> waveform;
+
+    WaveformSnapshot() : version(0), samplingRate(0) {}
+};
+
 class Controller {
 public:
+    Controller() : waveformVersion(0) {}
     virtual ~Controller() {}
 
     virtual int getHoldingValue() = 0;
@@ -13,6 +29,18 @@ public:
     virtual unsigned int getCurrentScale() { return 0; }
     virtual void startMessage(int unit) = 0;
     virtual void endMessage(int unit) = 0;
+
+    // Version of the latest published waveform; cheap, and safe from any thread
+    unsigned int getWaveformVersion() const { return waveformVersion; }
+    WaveformSnapshot getWaveformSnapshot() const;
+
+protected:
+    void publishWaveform(double samplingRate);
+
+private:
+    mutable std::mutex snapshotMutex;
+    WaveformSnapshot snapshot;
+    std::atomic<unsigned int> waveformVersion;
 };
 
 class CapacitiveCompensationController {
@@ -3,6 +3,7 @@
 #include "common.h"
 #include "DisplayWindow.h"
 #include "DataAnalysis.h"
+#include "SweepAnalysis.h"
 #include "BesselFilter.h"
 #include "Board.h"
 #include "ControlWindow.h"
@@ -11,10 +12,18 @@
 #include <assert.h>
 #include "Line.h"
 #include "VoltageClampWidget.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "LoopTiming.h"
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include "qstring.h"
 #include "qdatetime.h"
 #include "qfileinfo.h"
+#include "qfile.h"
+#include "qtextstream.h"
 
 using namespace CLAMP;
 using namespace CLAMP::SignalProcessing;
@@ -27,6 +36,7 @@ using std::lock_guard;
 using std::recursive_mutex;
 using std::isnormal;
 using std::isfinite;
+using std::function;
 
 //--------------------------------------------------------------------------
 DataProcessor::DataProcessor(DataStore& datastore_) :
@@ -34,11 +44,24 @@ DataProcessor::DataProcessor(DataStore& datastore_) :
 {
 }
 
+// Declare that this processor reads input's results, so it has to run after input.  Ignores nullptr.
+void DataProcessor::dependsOn(DataProcessor* input) {
+    if (input) {
+        inputs.push_back(input);
+    }
+}
+
+// Declare that this processor writes or reads state (e.g., a Lines object) that other processors also touch.
+void DataProcessor::touches(const void* state) {
+    sharedState.push_back(state);
+}
+
 //--------------------------------------------------------------------------
 AppliedWaveformProcessor::AppliedWaveformProcessor(DataStore& datastore_) :
     DataProcessor(datastore_)
 {
     waveforms.tStep = 1.0 / datastore.state->board->getSamplingRateHz();
+    touches(&waveforms);
 }
 
 AppliedWaveformProcessor::~AppliedWaveformProcessor() {
@@ -85,47 +108,92 @@ void AppliedWaveformProcessor::getAppliedWaveforms(double samplingRate) {
 
 void AppliedWaveformProcessor::createAppliedWaveformPlot() {
     getAppliedWaveforms(datastore.state->board->getSamplingRateHz());
-    waveforms.setLines(appliedWaveforms);
+    waveforms.setLines(std::move(appliedWaveforms)); // Rebuilt from scratch each time
+}
+
+static std::size_t linesBytes(const vector<Line>& lines) {
+    std::size_t total = lines.capacity() * sizeof(Line);
+    for (const Line& line : lines) {
+        total += line.dataBytes() + line.oldDataBytes();
+    }
+    return total;
+}
+
+std::size_t AppliedWaveformProcessor::memoryBytes() const {
+    return linesBytes(appliedWaveforms) + waveforms.memoryBytes();
 }
 
 //--------------------------------------------------------------------------
-LineIncrements seriesResistanceCorrect(DataStore& datastore, const std::vector<double>& values, double samplingRate, bool doCorrection, correctFunction f) {
-    LineIncrements results;
-    results.startIndices.resize(datastore.simplifiedWaveform.numWaveforms());
-    results.lines.resize(datastore.simplifiedWaveform.numWaveforms());
-    for (unsigned int i = 0; i < datastore.simplifiedWaveform.size(); i++) {
-        const WaveformSegment& segment = datastore.simplifiedWaveform.waveform[i];
-        if (segment.endIndex >= datastore.startAt && values.size() >= segment.startIndex) {
-            Line& w = results.lines[segment.waveformNumber];
-            if (w.data.empty()) {
-                results.startIndices[segment.waveformNumber] = segment.indexWithinWaveform;
-            }
-            if (i > 0 && (datastore.simplifiedWaveform.waveform[i - 1].waveformNumber != segment.waveformNumber)) {
-                w.addLineSegment();
-            }
-            for (unsigned int j = segment.startIndex; j < values.size() && j <= segment.endIndex; j++) {
-                if (j >= datastore.startAt) {
-                    double value = values[j];
-                    if (!std::isnan(value)) {
-                        unsigned int j2 = datastore.overlay ? j - segment.tOffset : j;
-                        double time = datastore.timestamps[j2] / samplingRate;
-                        time -= datastore.cycleStartTime;
-
-                        w.addPoint(time, (*f)(doCorrection, segment.appliedValue, value, datastore.Ra));
-                    }
-                }
+SeriesResistanceCorrector::SeriesResistanceCorrector(DataStore& datastore_, bool doCorrection_, correctFunction f_) :
+    datastore(datastore_),
+    doCorrection(doCorrection_),
+    f(f_),
+    firstSegment(0),
+    lastStartAt(0)
+{
+}
+
+void SeriesResistanceCorrector::reset() {
+    firstSegment = 0;
+    lastStartAt = 0;
+}
+
+// Returns the new points, for appending to destination (whose spent increments are reused; see Lines::takeIncrements)
+LineIncrements SeriesResistanceCorrector::process(const std::vector<Sample>& values, double samplingRate, Lines& destination) {
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    unsigned int startAt = datastore.startAt;
+    if (startAt < lastStartAt || firstSegment > waveform.size()) {
+        // Acquisition started over, so the cursor is stale
+        reset();
+    }
+    lastStartAt = startAt;
+
+    LineIncrements results = destination.takeIncrements(waveform.numWaveforms());
+
+    // Segments that ended before startAt are complete; don't look at them again
+    while (firstSegment < waveform.size() && waveform.waveform[firstSegment].endIndex < startAt) {
+        firstSegment++;
+    }
+
+    for (unsigned int i = firstSegment; i < waveform.size(); i++) {
+        const WaveformSegment& segment = waveform.waveform[i];
+        if (values.size() < segment.startIndex) {
+            break; // Segments are in order, so none of the later ones have data yet
+        }
+
+        Line& w = results.lines[segment.waveformNumber];
+        if (w.data.empty()) {
+            results.startIndices[segment.waveformNumber] = segment.indexWithinWaveform;
+        }
+        if (i > 0 && (waveform.waveform[i - 1].waveformNumber != segment.waveformNumber)) {
+            w.addLineSegment();
+        }
+
+        unsigned int first = std::max(segment.startIndex, startAt);
+        unsigned int end = std::min(static_cast<unsigned int>(values.size()), segment.endIndex + 1);
+        ts.clear();
+        ys.clear();
+        for (unsigned int j = first; j < end; j++) {
+            double value = values[j];
+            if (!std::isnan(value)) {
+                unsigned int j2 = datastore.overlay ? j - segment.tOffset : j;
+                ts.push_back(datastore.timestamp(j2) / samplingRate - datastore.cycleStartTime);
+                ys.push_back((*f)(doCorrection, segment.appliedValue, value, datastore.Ra));
             }
         }
+        w.addPoints(ts.data(), ys.data(), static_cast<unsigned int>(ts.size()));
     }
     return results;
 }
 
 //--------------------------------------------------------------------------
-AppliedPlusAdcProcessor::AppliedPlusAdcProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, std::vector<double>& clampValues_) :
+AppliedPlusAdcProcessor::AppliedPlusAdcProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, std::vector<Sample>& clampValues_) :
 	DataProcessor(datastore_),
 	applied(applied_),
-	clampValues(clampValues_)
+	clampValues(clampValues_),
+	corrector(datastore_, false, dummyFunction)
 {
+	touches(&applied.waveforms);
 }
 
 AppliedPlusAdcProcessor::~AppliedPlusAdcProcessor() {
@@ -138,7 +206,7 @@ double AppliedPlusAdcProcessor::dummyFunction(bool correct, double applied, doub
 void AppliedPlusAdcProcessor::process(bool overlayChanged, bool dataChanged) {
 	if (dataChanged || overlayChanged) {
 		double samplingRate = datastore.state->board->getSamplingRateHz();
-		applied.waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), seriesResistanceCorrect(datastore, clampValues, samplingRate, false, dummyFunction));
+		applied.waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), corrector.process(clampValues, samplingRate, applied.waveforms));
 	}
 }
 
@@ -146,8 +214,12 @@ void AppliedPlusAdcProcessor::process(bool overlayChanged, bool dataChanged) {
 VCellProcessor::VCellProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, FilterProcessor& source_) :
     DataProcessor(datastore_),
     applied(applied_),
-    source(source_)
+    source(source_),
+    corrector(datastore_, true, vCellCorrect)
 {
+    dependsOn(&source);
+    touches(&applied.waveforms);
+    touches(&datastore.Ra);
 }
 
 VCellProcessor::~VCellProcessor() {
@@ -166,8 +238,8 @@ double VCellProcessor::vCellCorrect(bool correct, double applied, double value,
 void VCellProcessor::process(bool overlayChanged, bool dataChanged) {
     if (dataChanged || overlayChanged) {
         double samplingRate = datastore.state->board->getSamplingRateHz();
-        const vector<double>& values = source.getValues();
-        applied.waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), seriesResistanceCorrect(datastore, values, samplingRate, true, vCellCorrect));
+        const vector<Sample>& values = source.getValues();
+        applied.waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), corrector.process(values, samplingRate, applied.waveforms));
     }
 }
 
@@ -175,9 +247,13 @@ void VCellProcessor::process(bool overlayChanged, bool dataChanged) {
 MeasuredWaveformProcessor::MeasuredWaveformProcessor(DataStore& datastore_, FilterProcessor& filter, bool bridgeBalance_) :
     DataProcessor(datastore_),
     source(filter),
-    bridgeBalance(bridgeBalance_)
+    bridgeBalance(bridgeBalance_),
+    corrector(datastore_, bridgeBalance_, bridgeBalanceCorrect)
 {
     waveforms.tStep = 1.0 / datastore.state->board->getSamplingRateHz();
+    dependsOn(&source);
+    touches(&waveforms);
+    touches(&datastore.Ra);
 }
 
 MeasuredWaveformProcessor::~MeasuredWaveformProcessor() {
@@ -185,16 +261,17 @@ MeasuredWaveformProcessor::~MeasuredWaveformProcessor() {
 
 void MeasuredWaveformProcessor::init() {
     waveforms.clearLines();
+    corrector.reset();
 }
 
 void MeasuredWaveformProcessor::reset() {
     waveforms.cycleLines();
+    corrector.reset();
 }
 
 void MeasuredWaveformProcessor::process(bool overlayChanged, bool dataChanged) {
     if (overlayChanged || dataChanged) {
-        LineIncrements measuredWaveforms = getMeasuredWaveforms(source.getValues(), datastore.state->board->getSamplingRateHz());
-        waveforms.appendLines(0, measuredWaveforms);
+        waveforms.appendLines(0, getMeasuredWaveforms(source.getValues(), datastore.state->board->getSamplingRateHz()));
     }
 }
 
@@ -208,28 +285,263 @@ double MeasuredWaveformProcessor::bridgeBalanceCorrect(bool correct, double appl
     }
 }
 
-LineIncrements MeasuredWaveformProcessor::getMeasuredWaveforms(const vector<double>& values, double samplingRate) {
-    return seriesResistanceCorrect(datastore, values, samplingRate, bridgeBalance, bridgeBalanceCorrect);
+LineIncrements MeasuredWaveformProcessor::getMeasuredWaveforms(const vector<Sample>& values, double samplingRate) {
+    return corrector.process(values, samplingRate, waveforms);
 }
 
 //--------------------------------------------------------------------------
+SweepAverageProcessor::SweepAverageProcessor(DataStore& datastore_, FilterProcessor& filter) :
+    DataProcessor(datastore_),
+    source(filter),
+    restartRequested(false)
+{
+    average.tStep = 1.0 / datastore.state->board->getSamplingRateHz();
+    dependsOn(&source);
+    touches(&average);
+}
+
+SweepAverageProcessor::~SweepAverageProcessor() {
+}
+
+double SweepAverageProcessor::Accumulator::sd(std::size_t k) const {
+    return (count[k] > 1) ? std::sqrt(m2[k] / (count[k] - 1)) : 0.0;
+}
+
+// New waveform, or the overlay setting changed.  The average carries on as long as the sweeps line up as before.
+void SweepAverageProcessor::init() {
+    if (!layoutSweeps() && datastore.rawValues.empty()) {
+        folded.assign(folded.size(), false);
+    }
+    plotAverage();
+}
+
+// Called at the start of each cycle, but also when the filter changes mid-cycle, whose sweeps are already folded in
+void SweepAverageProcessor::reset() {
+    if (datastore.rawValues.empty()) {
+        folded.assign(folded.size(), false);
+    }
+}
+
+void SweepAverageProcessor::process(bool overlayChanged, bool dataChanged) {
+    bool changed = overlayChanged;
+    if (restartRequested.exchange(false)) {
+        for (Accumulator& accumulator : accumulators) {
+            std::size_t length = accumulator.mean.size();
+            accumulator = Accumulator();
+            accumulator.count.assign(length, 0);
+            accumulator.mean.assign(length, 0.0);
+            accumulator.m2.assign(length, 0.0);
+        }
+        changed = true;
+    }
+    if (dataChanged) {
+        const vector<Sample>& values = source.getValues();
+        for (unsigned int w = 0; w < accumulators.size(); w++) {
+            if (!folded[w] && !sweepSegments[w].empty() && datastore.dataAvailable(lastSegment[w])) {
+                fold(w, values);
+                folded[w] = true;
+                changed = true;
+            }
+        }
+    }
+    if (changed) {
+        plotAverage();
+    }
+}
+
+// Starts the average over, from the next sweep to complete.  May be called from any thread.
+void SweepAverageProcessor::restart() {
+    restartRequested = true;
+}
+
+/* Works out where each segment's samples go within its sweep.  Returns true if that differs from before, in which case
+ * the accumulators are sized for the new sweeps and start out empty.
+ */
+bool SweepAverageProcessor::layoutSweeps() {
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    unsigned int numWaveforms = waveform.numWaveforms();
+
+    vector<vector<unsigned int>> newSweepSegments(numWaveforms);
+    for (unsigned int i = 0; i < waveform.size(); i++) {
+        newSweepSegments[waveform.waveform[i].waveformNumber].push_back(i);
+    }
+    vector<unsigned int> newOffsets(waveform.size(), 0);
+    vector<unsigned int> newLastSegment(numWaveforms, 0);
+    vector<std::size_t> lengths(numWaveforms, 0);
+    for (unsigned int w = 0; w < numWaveforms; w++) {
+        vector<unsigned int>& segments = newSweepSegments[w];
+        std::stable_sort(segments.begin(), segments.end(), [&waveform](unsigned int a, unsigned int b) {
+            return waveform.waveform[a].indexWithinWaveform < waveform.waveform[b].indexWithinWaveform;
+        });
+        for (unsigned int i : segments) {
+            const WaveformSegment& segment = waveform.waveform[i];
+            newOffsets[i] = static_cast<unsigned int>(lengths[w]);
+            lengths[w] += segment.endIndex - segment.startIndex + 1;
+            if (segment.endIndex >= waveform.waveform[newLastSegment[w]].endIndex || i == segments.front()) {
+                newLastSegment[w] = i;
+            }
+        }
+    }
+
+    bool changed = (newOffsets != offsets) || (accumulators.size() != numWaveforms);
+    for (unsigned int w = 0; !changed && w < numWaveforms; w++) {
+        changed = (accumulators[w].mean.size() != lengths[w]);
+    }
+    offsets.swap(newOffsets);
+    sweepSegments.swap(newSweepSegments);
+    lastSegment.swap(newLastSegment);
+
+    if (changed) {
+        accumulators.assign(numWaveforms, Accumulator());
+        for (unsigned int w = 0; w < numWaveforms; w++) {
+            accumulators[w].count.assign(lengths[w], 0);
+            accumulators[w].mean.assign(lengths[w], 0.0);
+            accumulators[w].m2.assign(lengths[w], 0.0);
+        }
+        folded.assign(numWaveforms, false);
+    }
+    return changed;
+}
+
+// Folds this cycle's sweep into the running mean and variance, one sample position at a time
+void SweepAverageProcessor::fold(unsigned int waveformNumber, const vector<Sample>& values) {
+    Accumulator& accumulator = accumulators[waveformNumber];
+    for (unsigned int i : sweepSegments[waveformNumber]) {
+        const WaveformSegment& segment = datastore.simplifiedWaveform.waveform[i];
+        std::size_t k = offsets[i];
+        for (unsigned int j = segment.startIndex; j <= segment.endIndex; j++, k++) {
+            double value = values[j];
+            if (std::isnan(value)) {
+                continue;
+            }
+            uint32_t n = ++accumulator.count[k];
+            double delta = value - accumulator.mean[k];
+            accumulator.mean[k] += delta / n;
+            accumulator.m2[k] += delta * (value - accumulator.mean[k]);
+        }
+    }
+    accumulator.sweeps++;
+}
+
+// Replaces the plotted average, laid out in time like the current cycle's sweeps
+void SweepAverageProcessor::plotAverage() {
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    double samplingRate = datastore.state->board->getSamplingRateHz();
+    vector<Line> lines(accumulators.size());
+    vector<double> ts;
+    vector<double> ys;
+
+    for (unsigned int i = 0; i < waveform.size(); i++) {
+        const WaveformSegment& segment = waveform.waveform[i];
+        const Accumulator& accumulator = accumulators[segment.waveformNumber];
+        if (accumulator.sweeps == 0) {
+            continue;
+        }
+        Line& line = lines[segment.waveformNumber];
+        if (i > 0 && (waveform.waveform[i - 1].waveformNumber != segment.waveformNumber)) {
+            line.addLineSegment();
+        }
+
+        ts.clear();
+        ys.clear();
+        std::size_t k = offsets[i];
+        for (unsigned int j = segment.startIndex; j <= segment.endIndex; j++, k++) {
+            if (accumulator.count[k] > 0) {
+                unsigned int j2 = datastore.overlay ? j - segment.tOffset : j;
+                ts.push_back(j2 / samplingRate);
+                ys.push_back(accumulator.mean[k]);
+            }
+        }
+        line.addPoints(ts.data(), ys.data(), static_cast<unsigned int>(ts.size()));
+    }
+    average.setLines(std::move(lines));
+}
+
+std::size_t SweepAverageProcessor::memoryBytes() const {
+    std::size_t total = average.memoryBytes();
+    for (const Accumulator& accumulator : accumulators) {
+        total += accumulator.count.capacity() * sizeof(uint32_t) + (accumulator.mean.capacity() + accumulator.m2.capacity()) * sizeof(double);
+    }
+    return total;
+}
+
+/* Writes the average to basePath_average.csv: one row per sample position of each waveform number's sweep, with its
+ * overlaid time (see WaveformSegment::tOffset), mean, standard deviation, and the number of sweeps averaged there.
+ */
+void SweepAverageProcessor::saveResults(const QString& basePath) {
+    bool any = false;
+    for (const Accumulator& accumulator : accumulators) {
+        any = any || (accumulator.sweeps > 0);
+    }
+    if (!any) {
+        return;
+    }
+
+    QString filename = basePath + "_average.csv";
+    QFile file(filename);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        LOG(true) << "Warning: could not write the sweep average to " << filename.toStdString() << "\n";
+        return;
+    }
+    QTextStream out(&file);
+    out.setRealNumberPrecision(9);
+
+    // Voltage clamp measures current, and vice versa
+    const char* unit = datastore.applyVoltages ? "A" : "V";
+    out << "waveform,time (s),mean (" << unit << "),sd (" << unit << "),sweeps\n";
+
+    double samplingRate = datastore.state->board->getSamplingRateHz();
+    for (unsigned int w = 0; w < accumulators.size(); w++) {
+        const Accumulator& accumulator = accumulators[w];
+        if (accumulator.sweeps == 0) {
+            continue;
+        }
+        for (unsigned int i : sweepSegments[w]) {
+            const WaveformSegment& segment = datastore.simplifiedWaveform.waveform[i];
+            std::size_t k = offsets[i];
+            for (unsigned int j = segment.startIndex; j <= segment.endIndex; j++, k++) {
+                if (accumulator.count[k] > 0) {
+                    out << w << "," << (j - segment.tOffset) / samplingRate << "," << accumulator.mean[k] << "," << accumulator.sd(k) << "," << accumulator.count[k] << "\n";
+                }
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+DCCalculationProcessor::SegmentSums::SegmentSums() :
+    sum(0),
+    count(0),
+    min(std::numeric_limits<double>::infinity()),
+    max(-std::numeric_limits<double>::infinity())
+{
+}
+
 DCCalculationProcessor::DCCalculationProcessor(DataStore& datastore_, FilterProcessor& filter) :
     DataProcessor(datastore_),
-    source(filter)
+    source(filter),
+    firstIncomplete(0)
 {
+    dependsOn(&source);
 }
 
 DCCalculationProcessor::~DCCalculationProcessor() {
 }
 
 void DCCalculationProcessor::init() {
-    waveformCalculations.clear();
-    waveformCalculations.resize(datastore.simplifiedWaveform.size());
+    restart();
 }
 
 void DCCalculationProcessor::reset() {
+    restart();
+}
+
+void DCCalculationProcessor::restart() {
     waveformCalculations.clear();
     waveformCalculations.resize(datastore.simplifiedWaveform.size());
+    sums.clear();
+    sums.resize(datastore.simplifiedWaveform.size());
+    firstIncomplete = 0;
 }
 
 void DCCalculationProcessor::process(bool, bool dataChanged) {
@@ -238,24 +550,72 @@ void DCCalculationProcessor::process(bool, bool dataChanged) {
     }
 }
 
-void DCCalculationProcessor::getSteadyStateValues(const vector<double>& values) {
-    for (unsigned int i = 0; i < datastore.simplifiedWaveform.size(); i++) {
-        const WaveformSegment& element = datastore.simplifiedWaveform.waveform[i];
-        bool needsCalculation = datastore.dataAvailable(i) && !waveformCalculations[i].valid;
-        bool nontrivial = datastore.simplifiedWaveform.waveform[i].numReps() > 1;
-        if (needsCalculation && nontrivial) {
-            waveformCalculations[i].steadyStateValue = DataAnalysis::calculateBestResidual(values.begin() + element.startIndex, values.begin() + element.endIndex);
-            waveformCalculations[i].valid = true;
+/* Adds the samples that arrived since the last call (from datastore.startAt on) to the running sums of the segments they
+ * belong to, and finishes the segments that are now complete.  So each sample is looked at once, and each segment's
+ * values are ready as soon as its last sample arrives.
+ */
+void DCCalculationProcessor::getSteadyStateValues(const vector<Sample>& values) {
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    if (datastore.startAt == 0) {
+        // All the data is new (e.g., the filter changed, or processing started mid-cycle)
+        restart();
+    }
+    unsigned int size = static_cast<unsigned int>(values.size());
+
+    for (unsigned int i = firstIncomplete; i < waveform.size(); i++) {
+        const WaveformSegment& element = waveform.waveform[i];
+        if (element.startIndex >= size) {
+            break; // Segments are in order, so none of the later ones have data yet
+        }
+        if (element.numReps() > 1) {
+            SegmentSums& segmentSums = sums[i];
+            unsigned int first = std::max(element.startIndex, datastore.startAt);
+            unsigned int end = std::min(size, element.endIndex + 1);
+            for (unsigned int j = first; j < end; j++) {
+                double value = values[j];
+                segmentSums.min = std::min(segmentSums.min, value);
+                segmentSums.max = std::max(segmentSums.max, value);
+            }
+
+            unsigned int windowStart = std::max(first, element.startIndex + (element.endIndex - element.startIndex) / 2);
+            unsigned int windowEnd = std::min(size, element.endIndex);
+            for (unsigned int j = windowStart; j < windowEnd; j++) {
+                segmentSums.sum += values[j];
+            }
+            if (windowEnd > windowStart) {
+                segmentSums.count += windowEnd - windowStart;
+            }
+        }
+
+        if (!datastore.dataAvailable(i)) {
+            break;
         }
+        if (element.numReps() > 1) {
+            finishSegment(i);
+        }
+        firstIncomplete = i + 1;
     }
 }
 
+void DCCalculationProcessor::finishSegment(unsigned int i) {
+    const SegmentSums& segmentSums = sums[i];
+    DCParameters& parameters = waveformCalculations[i];
+    parameters.steadyStateValue = segmentSums.sum / segmentSums.count;
+
+    double reference = (i > 0 && waveformCalculations[i - 1].valid) ? waveformCalculations[i - 1].steadyStateValue : parameters.steadyStateValue;
+    bool maxIsPeak = std::abs(segmentSums.max - reference) >= std::abs(segmentSums.min - reference);
+    parameters.peakValue = maxIsPeak ? segmentSums.max : segmentSums.min;
+    parameters.valid = true;
+}
+
 //--------------------------------------------------------------------------
 DCPlotProcessor::DCPlotProcessor(DataStore& datastore_, Lines& waveforms_, DCCalculationProcessor& calc) :
     DataProcessor(datastore_),
     waveforms(waveforms_),
     dcCalculation(calc)
 {
+    dependsOn(&dcCalculation);
+    touches(&waveforms);
 }
 
 DCPlotProcessor::~DCPlotProcessor() {
@@ -269,15 +629,12 @@ void DCPlotProcessor::reset() {
 
 void DCPlotProcessor::process(bool overlayChanged, bool dataChanged) {
     if (overlayChanged || dataChanged) {
-        LineIncrements residualWaveforms = getResidualWaveforms(datastore.state->board->getSamplingRateHz());
-        waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), residualWaveforms);
+        waveforms.appendLines(datastore.simplifiedWaveform.numWaveforms(), getResidualWaveforms(datastore.state->board->getSamplingRateHz()));
     }
 }
 
 LineIncrements DCPlotProcessor::getResidualWaveforms(double samplingRate) {
-    LineIncrements results;
-    results.startIndices.resize(datastore.simplifiedWaveform.numWaveforms());
-    results.lines.resize(datastore.simplifiedWaveform.numWaveforms());
+    LineIncrements results = waveforms.takeIncrements(datastore.simplifiedWaveform.numWaveforms());
     vector<Line>& residualWaveforms = results.lines;
 
     // Now we'll add waveforms for the residuals
@@ -313,6 +670,7 @@ ExponentialCalculationWaveformProcessor::ExponentialCalculationWaveformProcessor
     DataProcessor(datastore_),
     source(filter)
 {
+    dependsOn(&source);
 }
 
 ExponentialCalculationWaveformProcessor::~ExponentialCalculationWaveformProcessor() {
@@ -334,36 +692,67 @@ void ExponentialCalculationWaveformProcessor::process(bool, bool dataChanged) {
     }
 }
 
-void ExponentialCalculationWaveformProcessor::fitExponentials(const vector<double>& values, double samplingRate) {
+// Fits the segments that completed since the last call.  The fits are independent, so they run in parallel.
+void ExponentialCalculationWaveformProcessor::fitExponentials(const vector<Sample>& values, double samplingRate) {
+    toFit.clear();
     for (unsigned int i = 0; i < datastore.simplifiedWaveform.size(); i++) {
         bool needsCalculation = datastore.dataAvailable(i) && !exponentialParameters[i].valid;
         bool hasTransient = i > 0
             && datastore.simplifiedWaveform.waveform[i].numReps() > 1
             && (datastore.simplifiedWaveform.waveform[i].appliedDiscreteValue != datastore.simplifiedWaveform.waveform[i - 1].appliedDiscreteValue); // use simplifiedWaveform because it stores ints, not doubles
         if (needsCalculation && hasTransient) {
-            const WaveformSegment& element = datastore.simplifiedWaveform.waveform[i];
+            toFit.push_back(i);
+        }
+    }
 
-            vector<double> xs, ys;
-            unsigned int startIndex = element.startIndex;
-            unsigned int endIndex = element.endIndex;
-            if (isnan(values[endIndex])) {
-                endIndex--;
-            }
+    if (scratch.size() < toFit.size()) {
+        scratch.resize(toFit.size());
+    }
+    tasks.clear();
+    for (unsigned int k = 0; k < toFit.size(); k++) {
+        unsigned int i = toFit[k];
+        FitScratch& buffers = scratch[k];
+        tasks.push_back([this, i, &values, samplingRate, &buffers]() { fitSegment(i, values, samplingRate, buffers); });
+    }
+    ThreadPool::instance().run(tasks);
 
-            startIndex += 12;
+    // Only mark the results valid once they're all in, so readers never see a partial set
+    for (unsigned int i : toFit) {
+        exponentialParameters[i].valid = true;
+    }
+}
 
-            double t0 = datastore.timestamps[element.startIndex] / samplingRate;
-            for (unsigned int j = startIndex; j <= endIndex; j++) {
-                double y = values[j];
-                double t = datastore.timestamps[j] / samplingRate;
-                xs.push_back(t - t0);
-                ys.push_back(y);
-            }
-            double chi2;
-            ExponentialFit::lm(xs, ys, exponentialParameters[i].beta, chi2);
+void ExponentialCalculationWaveformProcessor::fitSegment(unsigned int i, const vector<Sample>& values, double samplingRate, FitScratch& buffers) {
+    const WaveformSegment& element = datastore.simplifiedWaveform.waveform[i];
 
-            exponentialParameters[i].valid = true;
-        }
+    vector<double>& xs = buffers.xs;
+    vector<double>& ys = buffers.ys;
+    xs.clear();
+    ys.clear();
+    unsigned int startIndex = element.startIndex;
+    unsigned int endIndex = element.endIndex;
+    if (isnan(values[endIndex])) {
+        endIndex--;
+    }
+
+    startIndex += SweepAnalysis::FIT_SKIP_SAMPLES;
+
+    double t0 = datastore.timestamp(element.startIndex) / samplingRate;
+    for (unsigned int j = startIndex; j <= endIndex; j++) {
+        double y = values[j];
+        double t = datastore.timestamp(j) / samplingRate;
+        xs.push_back(t - t0);
+        ys.push_back(y);
+    }
+    double chi2;
+    ExponentialParameters& parameters = exponentialParameters[i];
+    parameters.doubleExponential = datastore.doubleExponential;
+    if (parameters.doubleExponential) {
+        parameters.iterations = DoubleExponentialFit::fit(xs, ys, nullptr, parameters.fullBeta, chi2, buffers.workspace);
+        DoubleExponentialFit::equivalentSingle(parameters.fullBeta, parameters.beta);
+    }
+    else {
+        parameters.iterations = ExponentialFit::lm(xs, ys, parameters.beta, chi2);
     }
 }
 
@@ -373,6 +762,8 @@ ExponentialPlotProcessor::ExponentialPlotProcessor(DataStore& datastore_, Lines&
     waveforms(waveforms_),
     calculator(calc)
 {
+    dependsOn(&calculator);
+    touches(&waveforms);
 }
 
 ExponentialPlotProcessor::~ExponentialPlotProcessor() {
@@ -388,15 +779,12 @@ void ExponentialPlotProcessor::reset() {
 
 void ExponentialPlotProcessor::process(bool overlayChanged, bool dataChanged) {
     if (overlayChanged || dataChanged) {
-        LineIncrements exponentials = getExponentialWaveforms(datastore.state->board->getSamplingRateHz());
-        waveforms.appendLines(2 * datastore.simplifiedWaveform.numWaveforms(), exponentials);
+        waveforms.appendLines(2 * datastore.simplifiedWaveform.numWaveforms(), getExponentialWaveforms(datastore.state->board->getSamplingRateHz()));
     }
 }
 
 LineIncrements ExponentialPlotProcessor::getExponentialWaveforms(double samplingRate) {
-    LineIncrements results;
-    results.startIndices.resize(datastore.simplifiedWaveform.numWaveforms());
-    results.lines.resize(datastore.simplifiedWaveform.numWaveforms());
+    LineIncrements results = waveforms.takeIncrements(datastore.simplifiedWaveform.numWaveforms());
     vector<Line>& exponentials = results.lines;
 
     // Add waveform(s) for exponentials
@@ -411,12 +799,13 @@ LineIncrements ExponentialPlotProcessor::getExponentialWaveforms(double sampling
             }
             w.addLineSegment();
 
-            double t0 = datastore.timestamps[element.startIndex] / samplingRate;
-            double tElementOffset = datastore.timestamps[element.tOffset] / samplingRate;
+            double t0 = datastore.timestamp(element.startIndex) / samplingRate;
+            double tElementOffset = datastore.timestamp(element.tOffset) / samplingRate;
             for (unsigned int j = element.startIndex; j <= element.endIndex; j++) {
-                double t = datastore.timestamps[j] / samplingRate;
+                double t = datastore.timestamp(j) / samplingRate;
                 double tCorrected = t - t0;
-                double value = ExponentialFit::f(tCorrected, calculator.exponentialParameters[i].beta);
+                ExponentialParameters& parameters = calculator.exponentialParameters[i];
+                double value = parameters.doubleExponential ? DoubleExponential::f(tCorrected, parameters.fullBeta) : ExponentialFit::f(tCorrected, parameters.beta);
 
                 if (datastore.overlay) {
                     t -= tElementOffset;
@@ -435,58 +824,159 @@ LineIncrements ExponentialPlotProcessor::getExponentialWaveforms(double sampling
 ResistanceCalculationWaveformProcessor::ResistanceCalculationWaveformProcessor(DataStore& datastore_, DCCalculationProcessor* dc_, ExponentialCalculationWaveformProcessor* exp_) :
     DataProcessor(datastore_),
     dc(dc_),
-    exp(exp_)
+    exp(exp_),
+    nextSegment(0)
 {
     if (dc == nullptr && exp == nullptr) {
         throw invalid_argument("You need at least one source of resistance values");
     }
+    dependsOn(dc);
+    dependsOn(exp);
+    touches(&datastore.resistance);
 }
 
 ResistanceCalculationWaveformProcessor::~ResistanceCalculationWaveformProcessor() {
 }
 
+void ResistanceCalculationWaveformProcessor::init() {
+    restart();
+}
+
+void ResistanceCalculationWaveformProcessor::reset() {
+    restart();
+}
+
+void ResistanceCalculationWaveformProcessor::restart() {
+    nextSegment = 0;
+    fit.clear();
+}
+
+// Adds the segments completed since the last call to the fit; the resistance is its slope, dV/dI
 void ResistanceCalculationWaveformProcessor::process(bool, bool dataChanged) {
-    if (dataChanged) {
-        vector<double> applied, measured;
-        for (unsigned int i = 0; i < datastore.simplifiedWaveform.size(); i++) {
-            bool nontrivial = datastore.simplifiedWaveform.waveform[i].numReps() > 1;
-            if (nontrivial) {
-                bool hasValue = false;
-                double measuredValue;
-                if (exp && exp->exponentialParameters[i].valid) {
-                    measuredValue = exp->exponentialParameters[i].beta[0];
-                    hasValue = true;
-                }
-                else if (dc && dc->waveformCalculations[i].valid) {
-                    measuredValue = dc->waveformCalculations[i].steadyStateValue;
-                    hasValue = true;
+    if (!dataChanged) {
+        return;
+    }
+    if (datastore.startAt == 0) {
+        restart();
+    }
+
+    bool added = false;
+    for (; nextSegment < datastore.simplifiedWaveform.size() && datastore.dataAvailable(nextSegment); nextSegment++) {
+        unsigned int i = nextSegment;
+        bool nontrivial = datastore.simplifiedWaveform.waveform[i].numReps() > 1;
+        if (nontrivial) {
+            bool hasValue = false;
+            double measuredValue;
+            if (exp && exp->exponentialParameters[i].valid) {
+                measuredValue = exp->exponentialParameters[i].beta[0];
+                hasValue = true;
+            }
+            else if (dc && dc->waveformCalculations[i].valid) {
+                measuredValue = dc->waveformCalculations[i].steadyStateValue;
+                hasValue = true;
+            }
+            if (hasValue) {
+                double applied = datastore.simplifiedWaveform.waveform[i].appliedValue;
+                if (datastore.applyVoltages) {
+                    fit.add(measuredValue, applied);
                 }
-                if (hasValue) {
-                    applied.push_back(datastore.simplifiedWaveform.waveform[i].appliedValue);
-                    measured.push_back(measuredValue);
+                else {
+                    fit.add(applied, measuredValue);
                 }
+                added = true;
             }
         }
+    }
 
-        if (measured.size() >= 2) {
-            double resistance;
-            if (datastore.applyVoltages) {
-                resistance = calculateR(measured, applied);
-            }
-            else {
-                resistance = calculateR(applied, measured);
-            }
-            if (isnormal(resistance) && resistance > 0) {
-                datastore.resistance = resistance;
-                datastore.controlWindow->setResistance(resistance);
-            }
+    if (added && fit.count() >= 2) {
+        double resistance = fit.slope();
+        if (isnormal(resistance) && resistance > 0) {
+            datastore.resistance = resistance;
+            datastore.controlWindow->setResistance(resistance);
         }
     }
+}
+
+//--------------------------------------------------------------------------
+IVPlotProcessor::IVPlotProcessor(DataStore& datastore_, DCCalculationProcessor& calc) :
+    DataProcessor(datastore_),
+    dcCalculation(calc),
+    nextSegment(0)
+{
+    iv.tStep = 1.0;
+    dependsOn(&dcCalculation);
+    touches(&iv);
+}
+
+IVPlotProcessor::~IVPlotProcessor() {
+}
+
+void IVPlotProcessor::init() {
+    restart();
+    iv.clearLines();
+}
+
+void IVPlotProcessor::reset() {
+    restart();
+}
+
+void IVPlotProcessor::restart() {
+    points.clear();
+    nextSegment = 0;
+}
+
+void IVPlotProcessor::process(bool, bool dataChanged) {
+    if (!dataChanged) {
+        return;
+    }
+    if (datastore.startAt == 0) {
+        restart();
+    }
+
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    for (; nextSegment < waveform.size() && datastore.dataAvailable(nextSegment); nextSegment++) {
+        const WaveformSegment& segment = waveform.waveform[nextSegment];
+        const DCParameters& parameters = dcCalculation.waveformCalculations[nextSegment];
+        if (!parameters.valid) {
+            continue;
+        }
+        auto samePoint = std::find_if(points.begin(), points.end(), [&segment](const IVPoint& point) {
+            return point.appliedDiscreteValue == segment.appliedDiscreteValue;
+        });
+        if (samePoint != points.end()) {
+            continue;
+        }
 
+        IVPoint point;
+        point.appliedDiscreteValue = segment.appliedDiscreteValue;
+        point.applied = segment.appliedValue;
+        point.steadyState = parameters.steadyStateValue;
+        point.peak = parameters.peakValue;
+        auto position = std::upper_bound(points.begin(), points.end(), point, [](const IVPoint& a, const IVPoint& b) {
+            return a.applied < b.applied;
+        });
+        bool atEnd = (position == points.end());
+        points.insert(position, point);
+
+        if (atEnd && points.size() > 1) {
+            // The usual case, a protocol that steps upward: just extend the curves
+            iv.addToLine(0, point.applied, point.steadyState);
+            iv.addToLine(1, point.applied, point.peak);
+        }
+        else {
+            plotAll();
+        }
+    }
 }
 
-double ResistanceCalculationWaveformProcessor::calculateR(const std::vector<double>& currents, const std::vector<double>& voltages) {
-    return DataAnalysis::slope(currents.begin(), currents.end(), voltages.begin(), voltages.end());
+// Replaces the curves with this cycle's points, e.g., when a point lands in the middle of them
+void IVPlotProcessor::plotAll() {
+    vector<Line> lines(2);
+    for (const IVPoint& point : points) {
+        lines[0].addPoint(point.applied, point.steadyState);
+        lines[1].addPoint(point.applied, point.peak);
+    }
+    iv.setLines(std::move(lines));
 }
 
 //--------------------------------------------------------------------------
@@ -494,31 +984,21 @@ CellParameterProcessor::CellParameterProcessor(DataStore& datastore_, Exponentia
     DataProcessor(datastore_),
     exp(exp_)
 {
+    dependsOn(&exp);
+    touches(&datastore.resistance);
+    touches(&datastore.Ra);
 }
 
 CellParameterProcessor::~CellParameterProcessor() {
 }
 
-void CellParameterProcessor::getRsAndCs(double beta[3], double dV, double resistance, double& Ra, double& Rm, double& Cm) {
-    //double A = beta[0];
-    double B = beta[1];
-    double C = beta[2];
-    double X = resistance;
-    double Y = C / dV;
-    double tau = -1.0 / B;
-    Ra = X / (1.0 + X * Y);
-    Rm = X - Ra;
-    double RaPRm = 1.0 / (1.0 / Ra + 1.0 / Rm);
-    Cm = tau / RaPRm;
-}
-
 void CellParameterProcessor::calculateCellParameters(double& Ra, double& Rm, double& Cm) {
     vector<double> Ras, Rms, Cms;
     for (unsigned int i = 0; i < datastore.simplifiedWaveform.size(); i++) {
         if (exp.exponentialParameters[i].valid) {
             double Ra, Rm, Cm;
             double dV = datastore.simplifiedWaveform.waveform[i].appliedValue - datastore.simplifiedWaveform.waveform[i - 1].appliedValue;
-            getRsAndCs(exp.exponentialParameters[i].beta, dV, datastore.resistance, Ra, Rm, Cm);
+            SweepAnalysis::getRsAndCs(exp.exponentialParameters[i].beta, dV, datastore.resistance, Ra, Rm, Cm);
             Ras.push_back(Ra);
             Rms.push_back(Rm);
             Cms.push_back(Cm);
@@ -546,6 +1026,7 @@ ResistanceProcessor::ResistanceProcessor(DataStore& datastore_) :
     DataProcessor(datastore_)
 {
     waveform.tStep = 1.0;
+    touches(&datastore.resistance);
 }
 
 ResistanceProcessor::~ResistanceProcessor() {
@@ -559,7 +1040,151 @@ void ResistanceProcessor::process(bool, bool dataChanged) {
 }
 
 //--------------------------------------------------------------------------
-FilterProcessor::FilterProcessor(DataStore& datastore_, std::vector<double>& rawValues_) :
+AuxWaveformProcessor::AuxWaveformProcessor(DataStore& datastore_) :
+    DataProcessor(datastore_),
+    numAdcs(datastore_.state->board->expanderBoardPresent() ? 8 : 2),
+    adcsUpTo(0),
+    digitalUpTo(0),
+    lastDigIns(0)
+{
+    double tStep = 1.0 / datastore.state->board->getSamplingRateHz();
+    adcWaveforms.tStep = tStep;
+    digitalWaveforms.tStep = tStep;
+
+    bool adcs[8];
+    for (unsigned int i = 0; i < 8; i++) {
+        adcs[i] = (i < numAdcs);
+    }
+    consumerId = datastore.state->board->addDataConsumer(adcs, true, false);
+
+    touches(&adcWaveforms);
+    touches(&digitalWaveforms);
+}
+
+AuxWaveformProcessor::~AuxWaveformProcessor() {
+    datastore.state->board->removeDataConsumer(consumerId);
+}
+
+void AuxWaveformProcessor::init() {
+    adcWaveforms.clearLines();
+    digitalWaveforms.clearLines();
+    adcsUpTo = 0;
+    digitalUpTo = 0;
+}
+
+void AuxWaveformProcessor::reset() {
+    adcWaveforms.cycleLines();
+    digitalWaveforms.cycleLines();
+    adcsUpTo = 0;
+    digitalUpTo = 0;
+}
+
+void AuxWaveformProcessor::setDisplayMemoryCap(std::size_t bytes) {
+    adcWaveforms.setMemoryCap(bytes / 2);
+    digitalWaveforms.setMemoryCap(bytes / 2);
+}
+
+void AuxWaveformProcessor::process(bool, bool dataChanged) {
+    const SimplifiedWaveform& waveform = datastore.simplifiedWaveform;
+    if (!dataChanged || waveform.waveform.empty()) {
+        return;
+    }
+    unsigned int cycleLength = waveform.waveform.back().endIndex + 1;
+    unsigned int end = std::min(static_cast<unsigned int>(datastore.rawValues.size()), cycleLength);
+    if (end < adcsUpTo || end < digitalUpTo) {
+        // Acquisition started over
+        adcsUpTo = 0;
+        digitalUpTo = 0;
+    }
+
+    double samplingRate = datastore.state->board->getSamplingRateHz();
+    unsigned int groupSize = std::max(1u, cycleLength / MAX_ADC_GROUPS);
+    // Only whole groups, until the cycle is done
+    unsigned int adcEnd = (end == cycleLength) ? end : adcsUpTo + (end - adcsUpTo) / groupSize * groupSize;
+    if (adcEnd > adcsUpTo && datastore.adcValues(0)) {
+        adcWaveforms.appendLines(0, getAdcWaveforms(adcEnd, groupSize, samplingRate));
+        adcsUpTo = adcEnd;
+    }
+    if (end > digitalUpTo && datastore.digIns()) {
+        digitalWaveforms.appendLines(0, getDigitalWaveforms(end, samplingRate));
+        digitalUpTo = end;
+    }
+}
+
+// Each group of samples from adcsUpTo to end becomes its first, minimum, maximum, and last sample, in the order they occurred
+LineIncrements AuxWaveformProcessor::getAdcWaveforms(unsigned int end, unsigned int groupSize, double samplingRate) {
+    LineIncrements results = adcWaveforms.takeIncrements(numAdcs);
+
+    for (unsigned int adc = 0; adc < numAdcs; adc++) {
+        const uint16_t* values = datastore.adcValues(adc);
+        if (!values) {
+            continue;
+        }
+        ts.clear();
+        ys.clear();
+        for (unsigned int first = adcsUpTo; first < end; first += groupSize) {
+            unsigned int last = std::min(first + groupSize, end) - 1;
+            unsigned int iMin = first;
+            unsigned int iMax = first;
+            for (unsigned int i = first + 1; i <= last; i++) {
+                if (values[i] < values[iMin]) {
+                    iMin = i;
+                }
+                if (values[i] > values[iMax]) {
+                    iMax = i;
+                }
+            }
+            unsigned int indices[4] = { first, std::min(iMin, iMax), std::max(iMin, iMax), last };
+            for (unsigned int k = 0; k < 4; k++) {
+                if (k == 0 || indices[k] != indices[k - 1]) {
+                    ts.push_back(datastore.timestamp(indices[k]) / samplingRate - datastore.cycleStartTime);
+                    ys.push_back(values[indices[k]] * STEPADC);
+                }
+            }
+        }
+        results.lines[adc].addPoints(ts.data(), ys.data(), static_cast<unsigned int>(ts.size()));
+    }
+    return results;
+}
+
+// Points where the digital inputs from digitalUpTo to end change, plus one at end - 1 so the lines reach the newest sample
+LineIncrements AuxWaveformProcessor::getDigitalWaveforms(unsigned int end, double samplingRate) {
+    const uint16_t* values = datastore.digIns();
+    LineIncrements results = digitalWaveforms.takeIncrements(NUM_DIGITAL_INPUTS);
+
+    auto level = [](unsigned int input, uint16_t digIns) { return input + (((digIns >> input) & 1) ? 0.8 : 0.0); };
+    unsigned int i = digitalUpTo;
+    if (i == 0) {
+        double t = datastore.timestamp(0) / samplingRate - datastore.cycleStartTime;
+        lastDigIns = values[0];
+        for (unsigned int input = 0; input < NUM_DIGITAL_INPUTS; input++) {
+            results.lines[input].addPoint(t, level(input, lastDigIns));
+        }
+        i = 1;
+    }
+    for (; i < end; i++) {
+        uint16_t changed = values[i] ^ lastDigIns;
+        if (changed) {
+            double t = datastore.timestamp(i) / samplingRate - datastore.cycleStartTime;
+            for (unsigned int input = 0; input < NUM_DIGITAL_INPUTS; input++) {
+                if (changed & (1 << input)) {
+                    results.lines[input].addPoint(t, level(input, lastDigIns));
+                    results.lines[input].addPoint(t, level(input, values[i]));
+                }
+            }
+            lastDigIns = values[i];
+        }
+    }
+
+    double t = datastore.timestamp(end - 1) / samplingRate - datastore.cycleStartTime;
+    for (unsigned int input = 0; input < NUM_DIGITAL_INPUTS; input++) {
+        results.lines[input].addPoint(t, level(input, lastDigIns));
+    }
+    return results;
+}
+
+//--------------------------------------------------------------------------
+FilterProcessor::FilterProcessor(DataStore& datastore_, std::vector<Sample>& rawValues_) :
     DataProcessor(datastore_),
     filter(new NthOrderBesselLowPassFilter(4, 10800.0, 1 / datastore_.state->board->getSamplingRateHz())),
     lowPassFilterEnabled(false),
@@ -585,8 +1210,8 @@ void FilterProcessor::reset() {
 void FilterProcessor::process(bool, bool dataChanged) {
     if (dataChanged) {
         filteredValues.resize(rawValues.size());
-        for (unsigned int i = datastore.startAt; i < rawValues.size(); i++) {
-            filteredValues[i] = filter->filterOne(rawValues[i]);
+        if (datastore.startAt < rawValues.size()) {
+            filter->process(&rawValues[datastore.startAt], &filteredValues[datastore.startAt], rawValues.size() - datastore.startAt);
         }
     }
 }
@@ -599,7 +1224,7 @@ void FilterProcessor::setLowPassFilterCutoff(double fc) {
     filter.reset(new NthOrderBesselLowPassFilter(4, fc, 1 / datastore.state->board->getSamplingRateHz()));
 }
 
-const vector<double>& FilterProcessor::getValues() {
+const vector<Sample>& FilterProcessor::getValues() {
     return lowPassFilterEnabled ? filteredValues : rawValues;
 }
 //--------------------------------------------------------------------------
@@ -612,17 +1237,28 @@ DataStore::DataStore() :
 	controlWindow(nullptr),
 	cycleStartTime(0.0),
 	absoluteTime(-1),
+	doubleExponential(false),
 	cellParametersValue(false),
 	Ra(0), // was -1
 	Rm(0),
 	Cm(0),
 	saveFile(nullptr),
-	saveFileAux(nullptr)
+	saveFileAux(nullptr),
+	savedUpTo(0),
+	auxConsumerRegistered(false),
+	auxConsumerId(0),
+	streamOffset(0),
+	ownCycles(false),
+	datastoreMutex("DataStore::datastoreMutex"),
+	displayMemoryCap(0),
+	displayActive(true),
+	overloadLevel(OverloadController::NORMAL),
+	processingInterval(0),
+	processingPending(false),
+	processingDue(false),
+	stopWorker(false)
 {
-	lock_guard<recursive_mutex> lock(datastoreMutex);
-
-	adcs.resize(8);
-	adcsDouble.resize(8);
+	lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
 
 	numAdcs = 8;
 }
@@ -635,6 +1271,7 @@ DataStore::DataStore() :
 
 
 DataStore::~DataStore() {
+    stopProcessingWorker();
     closeFile();
 }
 
@@ -672,21 +1309,58 @@ void DataStore::openFile(const QString& subdirName, const QString& baseFilename,
 		unitDesignator = "X";
 	}
 
-	QString filename = fileInfo.path() +  "/" + subdirInfo.baseName() + "/" + fileInfo.baseName() + "_" + unitDesignator +
-		"_" +dateTime.toString("yyMMdd") + "_" + dateTime.toString("HHmmss") + ".clp";
-
-		saveFile = new SaveFile();
-		saveFile->open(toFileName(filename.toStdString()));
+	saveBasePath = fileInfo.path() +  "/" + subdirInfo.baseName() + "/" + fileInfo.baseName() + "_" + unitDesignator +
+		"_" +dateTime.toString("yyMMdd") + "_" + dateTime.toString("HHmmss");
+	SaveFile::Format format = static_cast<SaveFile::Format>(state->saveFormat);
+	QString extension = (format == SaveFile::NWB_RECORDS) ? ".nwb" : ".clp";
+	QString filename = saveBasePath + extension;
+	savePath = toFileName(filename.toStdString());
+
+	// Long recordings are split into preallocated segments, if asked for (NWB files can't be)
+	SaveFile::RolloverPolicy rollover;
+	if (format != SaveFile::NWB_RECORDS) {
+		rollover.maxBytes = static_cast<uint64_t>(state->saveRolloverMB * 1024 * 1024);
+		rollover.maxSeconds = state->saveRolloverMinutes * 60;
+	}
+	// A crashed recording loses about the last second
+	double journalSeconds = state->journalSaveMode ? 1.0 : 0.0;
+
+		// A run started within the same second as the last has the same name; its files may still be closing
+		FileCloser::instance().waitFor(savePath);
+		saveFile = new SaveFile(format);
+		saveFile->setRollover(rollover);
+		saveFile->setDirectIO(state->directIOSaveMode);
+		saveFile->setJournal(journalSeconds);
+		saveFile->setSweepIndex(state->sweepIndexSaveMode && format != SaveFile::NWB_RECORDS);
+		saveFile->open(savePath, state->asyncSaveMode);
 
 	if (auxDataToo) {
 		QString filenameAux = fileInfo.path() + "/" + subdirInfo.baseName() + "/" + fileInfo.baseName() + "_" + "AUX" +
-			"_" + dateTime.toString("yyMMdd") + "_" + dateTime.toString("HHmmss") + ".clp";
-
-		saveFileAux = new SaveFile();
-		saveFileAux->open(toFileName(filenameAux.toStdString()));
+			"_" + dateTime.toString("yyMMdd") + "_" + dateTime.toString("HHmmss") + extension;
+
+		// With NWB, the aux file is an NWB file too
+		saveAuxPath = toFileName(filenameAux.toStdString());
+		FileCloser::instance().waitFor(saveAuxPath);
+		saveFileAux = new SaveFile((format == SaveFile::NWB_RECORDS) ? SaveFile::NWB_RECORDS : SaveFile::FLOAT_RECORDS);
+		saveFileAux->setRollover(rollover);
+		saveFileAux->setDirectIO(state->directIOSaveMode);
+		saveFileAux->setJournal(journalSeconds);
+		saveFileAux->setAuxFormat(static_cast<SaveFile::AuxFormat>(state->auxSaveFormat), state->auxSaveAdcs ? 0xff : 0);
+		saveFileAux->open(saveAuxPath, state->asyncSaveMode);
 	}
 
 	numAdcs = state->board->expanderBoardPresent() ? 8 : 2;
+
+	// The board only sends the ADCs and digital I/O if something uses them
+	if (saveFileAux) {
+		bool adcs[8];
+		for (int i = 0; i < 8; i++) {
+			// NWB aux files store every ADC, whatever the aux format
+			adcs[i] = (i < numAdcs) && (format == SaveFile::NWB_RECORDS || state->auxSaveFormat == SaveFile::AUX_RECORDS || state->auxSaveAdcs);
+		}
+		auxConsumerId = state->board->addDataConsumer(adcs, true, true);
+		auxConsumerRegistered = true;
+	}
 }
 
 void DataStore::writeHeader(int unit, bool holdingOnly, unsigned int lastIndex) {
@@ -705,6 +1379,12 @@ void DataStore::writeHeader(int unit, bool holdingOnly, unsigned int lastIndex)
 
 void DataStore::closeFile() {
     if (saveFile) {
+        {
+            lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+            for (auto& processor : waveformProcessors) {
+                processor->saveResults(saveBasePath);
+            }
+        }
         saveFile->close();
         delete saveFile;
         saveFile = nullptr;
@@ -714,16 +1394,85 @@ void DataStore::closeFile() {
 		delete saveFileAux;
 		saveFileAux = nullptr;
 	}
+	if (auxConsumerRegistered) {
+		state->board->removeDataConsumer(auxConsumerId);
+		auxConsumerRegistered = false;
+	}
+}
+
+// As closeFile, but the files are flushed and closed in the background by FileCloser, so a new run can start (and open
+// new files) right away.  done is called on the closer thread once each file is closed.
+void DataStore::closeFileAsync(const FileCloser::Callback& done) {
+    if (saveFile) {
+        {
+            lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+            for (auto& processor : waveformProcessors) {
+                processor->saveResults(saveBasePath);
+            }
+        }
+        FileCloser::instance().close(std::unique_ptr<SaveFile>(saveFile), savePath, done);
+        saveFile = nullptr;
+    }
+	if (saveFileAux) {
+		FileCloser::instance().close(std::unique_ptr<SaveFile>(saveFileAux), saveAuxPath, done);
+		saveFileAux = nullptr;
+	}
+	if (auxConsumerRegistered) {
+		state->board->removeDataConsumer(auxConsumerId);
+		auxConsumerRegistered = false;
+	}
 }
 
+// Writes only the samples stored since the last call; the cursor is reset when the data is cleared.
 void DataStore::writeToFile() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    if (!streams || savedUpTo >= rawValues.size()) {
+        return;
+    }
+    lock_guard<recursive_mutex> lockStreams(streams->mutex);
+
+    // Normally this DataStore's samples are exactly the shared streams; if not (e.g., it was cleared mid-cycle, or the
+    // streams are ahead of it), save copies of just the part that goes with rawValues
+    std::size_t n = rawValues.size();
+    bool aligned = (streamOffset == 0 && streams->size() == n);
+    if (!aligned) {
+        fillSlices(n);
+    }
+    const vector<uint32_t>& timestamps = aligned ? streams->timestamps : timestampsSlice;
+
     if (saveFile) {
-        lock_guard<recursive_mutex> lock(datastoreMutex);
-        saveFile->writeData(timestamps, rawValues, clampValues);
+        saveFile->writeData(timestamps, rawValues, clampValues, savedUpTo);
     }
 	if (saveFileAux) {
-		saveFileAux->writeDataAux(timestamps, adcs, numAdcs, digIns, digOuts);
+		saveFileAux->writeDataAux(timestamps, aligned ? streams->adcs : adcsSlice, numAdcs, aligned ? streams->digIns : digInsSlice, aligned ? streams->digOuts : digOutsSlice, savedUpTo);
 	}
+    savedUpTo = n;
+}
+
+/* Brings the slices up to n samples, copying the streams' samples from savedUpTo on; earlier ones are already saved, so
+ * they're left as they are.  The ADCs and digital I/O are only copied for an aux file, and only the ADCs it saves.
+ * Each write copies only what it writes, rather than every headstage copying the whole cycle of every stream each time.
+ */
+void DataStore::fillSlices(std::size_t n) {
+    auto fill = [&](const vector<uint16_t>& from, vector<uint16_t>& to) {
+        to.resize(n);
+        std::copy(from.begin() + streamOffset + savedUpTo, from.begin() + streamOffset + n, to.begin() + savedUpTo);
+    };
+    timestampsSlice.resize(n);
+    std::copy(streams->timestamps.begin() + streamOffset + savedUpTo, streams->timestamps.begin() + streamOffset + n, timestampsSlice.begin() + savedUpTo);
+    if (saveFileAux) {
+        fill(streams->digIns, digInsSlice);
+        fill(streams->digOuts, digOutsSlice);
+        adcsSlice.resize(streams->adcs.size());
+        for (unsigned int adc = 0; adc < streams->adcs.size(); adc++) {
+            if (static_cast<int>(adc) < numAdcs) {
+                fill(streams->adcs[adc], adcsSlice[adc]);
+            }
+            else {
+                adcsSlice[adc].clear();
+            }
+        }
+    }
 }
 
 void DataStore::setOverlay(bool value) {
@@ -734,39 +1483,108 @@ void DataStore::setOverlay(bool value) {
     handleChange(true, true); // Hack: dataChanged should really be false, but reinitAll clears all the data.
 }
 
-void DataStore::init(const SimplifiedWaveform& simplifiedWaveform_, bool applyVoltages_) {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+// Fits transients with two exponentials, rather than one, from the next sweep on.  Cell parameters come from the
+// equivalent single exponential either way.
+void DataStore::setDoubleExponential(bool value) {
+    doubleExponential = value;
+}
+
+/* Sets the waveform that the data will be stored for.
+ *
+ * If ownCycles_, this headstage's waveform runs concurrently with the other headstages' (possibly different) ones, so
+ * storeData starts a new cycle whenever this waveform is done, wherever that falls in the chunks read; otherwise the
+ * ClampThread starts each cycle, with startCycle.
+ */
+void DataStore::init(const SimplifiedWaveform& simplifiedWaveform_, bool applyVoltages_, bool ownCycles_) {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    processPending();
 
     applyVoltages = applyVoltages_;
+    ownCycles = ownCycles_;
     simplifiedWaveform = simplifiedWaveform_;
+    reserveCycleStorage();
     emit timescaleChanged();
 
     reinitAll();
 }
 
-void DataStore::startCycle() {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+// Reserves room for n elements, releasing the memory first if v is empty and has much more than that
+template<class T>
+static void reserveFor(vector<T>& v, std::size_t n) {
+    if (v.empty() && v.capacity() > 2 * n) {
+        vector<T>().swap(v);
+    }
+    v.reserve(n);
+}
 
+/* Sizes the per-cycle storage for one cycle of the waveform, so that storeData never has to reallocate (and copy
+ * everything stored so far) in the middle of a cycle.  clear() keeps the capacity, so memory stays bounded by one cycle
+ * of the longest waveform run, however long the run goes on.
+ */
+void DataStore::reserveCycleStorage() {
+    // The first read of a run includes one extra timestep
+    std::size_t n = simplifiedWaveform.lastIndex(false) + 2;
+
+    reserveFor(rawValues, n);
+    reserveFor(clampValues, n);
+    if (streams) {
+        streams->reserve(n);
+    }
+}
+
+/* Starts a new cycle, whose board-wide data will be appended to streams_.
+ *
+ * The ClampThread calls this for every headstage that's part of the run, with the same streams_.
+ */
+void DataStore::startCycle(const std::shared_ptr<BoardStreams>& streams_) {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+
+    streams = streams_;
+    reserveCycleStorage();
     clear();
     resetAll();
 }
 
+// Stops viewing the shared streams (e.g., so that the ClampThread can reuse them for the next cycle)
+void DataStore::releaseStreams() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    processPending();
+
+    streams.reset();
+    rawValues.clear();
+    clampValues.clear();
+    savedUpTo = 0;
+    streamOffset = 0;
+}
+
+// Index in the shared streams of this DataStore's first sample; the streams before it aren't needed any more
+std::size_t DataStore::getStreamOffset() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    return streamOffset;
+}
+
+// Switches to streams_, which are the current streams without their first dropped samples (see ClampThread::trimStreams)
+void DataStore::rebaseStreams(const std::shared_ptr<BoardStreams>& streams_, std::size_t dropped) {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+
+    streams = streams_;
+    streamOffset -= dropped;
+}
+
 void DataStore::clear() {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    processPending();
 
-    rawValues.erase(rawValues.begin(), rawValues.end());
-	clampValues.erase(clampValues.begin(), clampValues.end());
-    timestamps.erase(timestamps.begin(), timestamps.end());
-	digIns.erase(digIns.begin(), digIns.end());
-	digOuts.erase(digOuts.begin(), digOuts.end());
-    adcs.erase(adcs.begin(), adcs.end());
-    adcs.resize(8);
-    adcsDouble.erase(adcsDouble.begin(), adcsDouble.end());
-    adcsDouble.resize(8);
+    // Clear the contents but keep the capacity (see reserveCycleStorage)
+    rawValues.clear();
+	clampValues.clear();
+    savedUpTo = 0;
+    // The shared streams may already have data from other headstages; this DataStore's data starts after it
+    streamOffset = streams ? streams->size() : 0;
 }
 
 void DataStore::reinitAll() {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
     for (auto& processor : waveformProcessors) {
         processor->init();
     }
@@ -774,43 +1592,163 @@ void DataStore::reinitAll() {
 }
 
 void DataStore::resetAll() {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
     for (auto& processor : waveformProcessors) {
         processor->reset();
     }
     startAt = 0;
 }
 
-void DataStore::storeData(const vector<double>& values_, const vector<double>& clampValues_, double absoluteTime_) {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+/* Stores the samples of index that the queue has just read: measured currents and clamp voltages in voltage clamp
+ * (see init's applyVoltages), measured voltages and clamp currents in current clamp.  They're converted straight into
+ * rawValues and clampValues (see ReadQueue::appendMeasuredCurrents), so each sample is written once after decoding.
+ */
+void DataStore::storeData(const ReadQueue& queue, const ChipChannel& index, double absoluteTime_) {
+    CLAMP_TRACE_SPAN("DataStore::storeData");
+    std::unique_lock<ProfiledRecursiveMutex> lock(datastoreMutex, std::defer_lock);
+    {
+        // The GUI thread takes this lock too, e.g., while it saves
+        LoopTiming::Phase phase("datastore lock wait");
+        lock.lock();
+    }
 
-    rawValues.insert(rawValues.end(), values_.begin(), values_.end());
-	clampValues.insert(clampValues.end(), clampValues_.begin(), clampValues_.end());
+    absoluteTime = absoluteTime_;
+    std::size_t numSamples = queue.getNumSamples(index);
+    if (!ownCycles || simplifiedWaveform.waveform.empty()) {
+        appendSamples(queue, index, 0, numSamples);
+        return;
+    }
 
-    const vector<uint32_t>& timestamps_ = state->board->readQueue.getTimeStamps();
-    if (timestamps.empty() && !timestamps_.empty()) {
-        cycleStartTime = timestamps_.front() / state->board->getSamplingRateHz();
+    // Split the chunk where this headstage's cycles end.  A finished cycle stays in place (e.g., on the display) until
+    // the next cycle's first sample arrives.
+    std::size_t cycleLength = simplifiedWaveform.waveform.back().endIndex + 1;
+    std::size_t first = 0;
+    while (first < numSamples) {
+        if (rawValues.size() >= cycleLength) {
+            nextCycle();
+        }
+        std::size_t n = std::min(numSamples - first, cycleLength - rawValues.size());
+        appendSamples(queue, index, first, n);
+        first += n;
     }
-    timestamps.insert(timestamps.end(), timestamps_.begin(), timestamps_.end());
+}
 
-	const vector<uint16_t>& digIns_ = state->board->readQueue.getDigIns();
-	digIns.insert(digIns.end(), digIns_.begin(), digIns_.end());
+// Stores the queue's samples [first, first + n) of index, and processes them
+void DataStore::appendSamples(const ReadQueue& queue, const ChipChannel& index, std::size_t first, std::size_t n) {
+    // The board-wide streams for these samples have already been appended to streams, by the ClampThread
+    if (rawValues.empty() && n > 0) {
+        cycleStartTime = timestamp(0) / state->board->getSamplingRateHz();
+    }
+    std::size_t oldSize = rawValues.size();
+    if (applyVoltages) {
+        queue.appendMeasuredCurrents(index, rawValues, first, n);
+        queue.appendClampVoltages(index, clampValues, first, n);
+    }
+    else {
+        queue.appendMeasuredVoltages(index, rawValues, first, n);
+        queue.appendClampCurrents(index, clampValues, first, n);
+    }
 
-	const vector<uint16_t>& digOuts_ = state->board->readQueue.getDigOuts();
-	digOuts.insert(digOuts.end(), digOuts_.begin(), digOuts_.end());
+    // Deferred, the worker catches up later; the end of a cycle (saving it, and nextCycle) is still handled here
+    bool cycleDone = !simplifiedWaveform.waveform.empty() && rawValues.size() > simplifiedWaveform.waveform.back().endIndex;
+    if (processingInterval > 0 && !cycleDone) {
+        processingPending = true;
+        if (completesSegment(oldSize)) {
+            {
+                lock_guard<std::mutex> workerLock(workerMutex);
+                processingDue = true;
+            }
+            workerWake.notify_one();
+        }
+        return;
+    }
+    handleChange(false, true);
+}
 
-    const vector<vector<uint16_t>>& adcs_ = state->board->readQueue.getADCs();
-    for (unsigned int i = 0; i < adcs_.size(); i++) {
-        adcs[i].insert(adcs[i].end(), adcs_[i].begin(), adcs_[i].end());
-        for (uint16_t value : adcs_[i]) {
-            adcsDouble[i].push_back(value * STEPADC);
+// True if the samples stored since rawValues had oldSize of them finish a segment of the waveform
+bool DataStore::completesSegment(std::size_t oldSize) const {
+    for (const WaveformSegment& segment : simplifiedWaveform.waveform) {
+        if (segment.endIndex >= oldSize && segment.endIndex < rawValues.size()) {
+            return true;
         }
     }
+    return false;
+}
+
+/* Sets how often the processors run while data comes in.  With 0 (the default), storeData runs them on every chunk it
+ * stores, on the acquisition thread.  Otherwise storeData only appends, and a worker runs them every interval on
+ * everything stored since, so each processor's per-call overhead is paid once per batch rather than once per read,
+ * and acquisition doesn't wait for them.  The worker runs at once when a waveform segment is completed, so the
+ * segment's fits aren't delayed, and the end of a cycle (saving it, waveformDone) is still handled by storeData.
+ * GUI thread only.
+ */
+void DataStore::setProcessingInterval(double seconds) {
+    stopProcessingWorker();
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    processPending();
+    processingInterval = std::max(0.0, seconds);
+    if (processingInterval > 0) {
+        stopWorker = false;
+        processingDue = false;
+        processingWorker = std::thread(&DataStore::processingLoop, this);
+    }
+}
 
-    absoluteTime = absoluteTime_;
+/* Runs the processors on whatever storeData has deferred.  Called from the worker and the GUI thread, while the
+ * ClampThread may be appending to the shared streams, which the processors read (e.g., timestamps); so, as in
+ * writeToFile, the streams are locked too.
+ */
+void DataStore::processPending() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    if (!processingPending) {
+        return;
+    }
+    std::unique_lock<recursive_mutex> lockStreams;
+    if (streams) {
+        lockStreams = std::unique_lock<recursive_mutex>(streams->mutex);
+    }
     handleChange(false, true);
 }
 
+void DataStore::processingLoop() {
+    std::unique_lock<std::mutex> lock(workerMutex);
+    std::chrono::duration<double> interval(processingInterval);
+    while (!stopWorker) {
+        workerWake.wait_for(lock, interval, [this]() { return stopWorker || processingDue; });
+        if (stopWorker) {
+            break;
+        }
+        processingDue = false;
+        lock.unlock();
+        processPending();
+        lock.lock();
+    }
+}
+
+void DataStore::stopProcessingWorker() {
+    if (!processingWorker.joinable()) {
+        return;
+    }
+    {
+        lock_guard<std::mutex> lock(workerMutex);
+        stopWorker = true;
+    }
+    workerWake.notify_one();
+    processingWorker.join();
+}
+
+// Starts this headstage's next cycle, which follows the last one in the shared streams (see init's ownCycles_)
+void DataStore::nextCycle() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+
+    // handleChange has already saved the finished cycle
+    streamOffset += rawValues.size();
+    rawValues.clear();
+    clampValues.clear();
+    savedUpTo = 0;
+    resetAll();
+}
+
 // Enable or disable low-pass filter.
 void DataStore::enableLowPassFilter(bool enable)
 {
@@ -828,22 +1766,100 @@ void DataStore::setLowPassFilterCutoff(double fc)
 }
 
 void DataStore::handleChange(bool overlayChanged, bool dataChanged) {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
-    for (auto& processor : waveformProcessors) {
-        processor->process(overlayChanged, dataChanged);
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    vector<function<void()>> tasks;
+    uint64_t newSamples = (dataChanged && rawValues.size() > startAt) ? rawValues.size() - startAt : 0;
+    LoopTiming::Phase phase("processing");
+
+    // Work is shed as soon as the host falls behind, but only restored after this change, when the processors coming
+    // back catch up on the whole cycle
+    OverloadController::Level level = state->overload.getLevel();
+    OverloadController::Level runLevel = std::max(level, overloadLevel);
+    for (auto& stage : schedule) {
+        tasks.clear();
+        for (DataProcessor* processor : stage) {
+            if (!isSuspended(processor, displayActive, runLevel) && processor->needsProcessing(overlayChanged, dataChanged)) {
+                // Each processor appears once in the schedule, so the tasks update different statistics
+                tasks.push_back([=]() { runProcessor(processor, overlayChanged, dataChanged, newSamples); });
+            }
+            else {
+                processor->statistics.skips++;
+            }
+        }
+        ThreadPool::instance().run(tasks);
+    }
+    overloadLevel = level;
+    if (level < runLevel) {
+        catchUp(displayActive, runLevel);
     }
 
     // This is true at the end of a cycle
     if (dataChanged && !simplifiedWaveform.waveform.empty() && (rawValues.size() > simplifiedWaveform.waveform.back().endIndex)) {
         emit waveformDone();
+        LoopTiming::Phase savePhase("save");
         writeToFile();
     }
 
     startAt = rawValues.size();
+    processingPending = false;
+}
+
+void DataStore::runProcessor(DataProcessor* processor, bool overlayChanged, bool dataChanged, uint64_t newSamples) {
+    CLAMP_TRACE_SPAN("DataProcessor::process");
+    auto start = std::chrono::steady_clock::now();
+    processor->process(overlayChanged, dataChanged);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ProcessorStatistics& statistics = processor->statistics;
+    statistics.calls++;
+    statistics.totalSeconds += seconds;
+    statistics.maxSeconds = std::max(statistics.maxSeconds, seconds);
+    statistics.samplesProcessed += newSamples;
+}
+
+/* Suspends the processors that only build plots (see DataProcessor::plotsOnly) while the display is hidden, e.g.,
+ * minimized.  When it's shown again, they start over and catch up on the cycle so far from rawValues, in one pass; the
+ * finished sweeps that were overlaid before aren't brought back.  GUI thread only.
+ */
+void DataStore::setDisplayActive(bool active) {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    if (active == displayActive) {
+        return;
+    }
+    displayActive = active;
+    if (active) {
+        catchUp(false, overloadLevel);
+    }
+}
+
+// True if processor is skipped, because the display is hidden and it only plots, or because it's shed at level
+bool DataStore::isSuspended(const DataProcessor* processor, bool display, OverloadController::Level level) {
+    return (!display && processor->plotsOnly()) || (level >= processor->shedLevel());
+}
+
+/* Starts over the processors that were suspended (given the display state and overload level they were last run with)
+ * but no longer are, and runs them on the cycle so far.
+ */
+void DataStore::catchUp(bool wasDisplayActive, OverloadController::Level wasLevel) {
+    // The other processors are already up to date (startAt == rawValues.size() between calls to handleChange), so
+    // only the resumed ones run, from the start of the cycle
+    vector<function<void()>> tasks;
+    startAt = 0;
+    for (auto& stage : schedule) {
+        tasks.clear();
+        for (DataProcessor* processor : stage) {
+            if (isSuspended(processor, wasDisplayActive, wasLevel) && !isSuspended(processor, displayActive, overloadLevel)) {
+                processor->init();
+                tasks.push_back([=]() { runProcessor(processor, true, true, rawValues.size()); });
+            }
+        }
+        ThreadPool::instance().run(tasks);
+    }
+    startAt = rawValues.size();
 }
 
+// Called by the processors from handleChange, which already holds datastoreMutex (possibly on another thread)
 bool DataStore::dataAvailable(unsigned int segmentNumber) {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
     return rawValues.size() > simplifiedWaveform.waveform[segmentNumber].endIndex;
 }
 
@@ -853,13 +1869,98 @@ void DataStore::fillSaveHeader(HeaderData& header, int unit, bool holdingOnly, u
 }
 
 void DataStore::setProcessors(std::vector<std::unique_ptr<DataProcessor>>& waveformProcessors_) {
-    lock_guard<recursive_mutex> lock(datastoreMutex);
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
 
     waveformProcessors = std::move(waveformProcessors_);
+    for (auto& processor : waveformProcessors) {
+        processor->setDisplayMemoryCap(displayMemoryCap);
+    }
+    buildSchedule();
     reinitAll();
     handleChange(false, true);
 }
 
+// Per-processor call counts and timings since the processors were set (or resetProcessorStatistics was called)
+vector<ProcessorStatistics> DataStore::getProcessorStatistics() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    vector<ProcessorStatistics> result;
+    for (auto& processor : waveformProcessors) {
+        result.push_back(processor->statistics);
+        result.back().name = processor->name();
+    }
+    return result;
+}
+
+void DataStore::resetProcessorStatistics() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    for (auto& processor : waveformProcessors) {
+        processor->statistics = ProcessorStatistics();
+    }
+}
+
+// Bytes held by the samples, the per-segment waveforms, and the processors.  GUI thread only (the processors' Lines are).
+DataStoreMemoryUsage DataStore::getMemoryUsage() {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    DataStoreMemoryUsage result;
+    result.sampleBytes = (rawValues.capacity() + clampValues.capacity()) * sizeof(Sample) + timestampsSlice.capacity() * sizeof(uint32_t) +
+                         (digInsSlice.capacity() + digOutsSlice.capacity()) * sizeof(uint16_t);
+    for (const vector<uint16_t>& adc : adcsSlice) {
+        result.sampleBytes += adc.capacity() * sizeof(uint16_t);
+    }
+    result.waveformBytes = linesBytes(waveforms);
+    for (auto& processor : waveformProcessors) {
+        result.processorBytes += processor->memoryBytes();
+    }
+    if (streams) {
+        result.streams = streams.get();
+        result.streamBytes = streams->memoryBytes();
+    }
+    return result;
+}
+
+// Limits the memory of each plot's Lines (0 for no limit); the oldest sweeps are dropped first.  GUI thread only.
+void DataStore::setDisplayMemoryCap(std::size_t bytes) {
+    lock_guard<ProfiledRecursiveMutex> lock(datastoreMutex);
+    displayMemoryCap = bytes;
+    for (auto& processor : waveformProcessors) {
+        processor->setDisplayMemoryCap(bytes);
+    }
+}
+
+/* Groups the processors into stages.  Each processor goes in the stage after the last one containing one of its inputs,
+ * or a processor added before it that touches the same state; the processors in a stage can then run in parallel.
+ */
+void DataStore::buildSchedule() {
+    schedule.clear();
+    vector<unsigned int> stageOf(waveformProcessors.size());
+    for (unsigned int i = 0; i < waveformProcessors.size(); i++) {
+        const DataProcessor& processor = *waveformProcessors[i];
+        unsigned int stage = 0;
+        unsigned int inputsFound = 0;
+        for (unsigned int j = 0; j < i; j++) {
+            const DataProcessor* earlier = waveformProcessors[j].get();
+            bool isInput = std::find(processor.getInputs().begin(), processor.getInputs().end(), earlier) != processor.getInputs().end();
+            bool sharesState = std::find_first_of(processor.getSharedState().begin(), processor.getSharedState().end(),
+                                                  earlier->getSharedState().begin(), earlier->getSharedState().end()) != processor.getSharedState().end();
+            if (isInput || sharesState) {
+                stage = std::max(stage, stageOf[j] + 1);
+            }
+            if (isInput) {
+                inputsFound++;
+            }
+        }
+        if (inputsFound != processor.getInputs().size()) {
+            throw invalid_argument("A DataProcessor's inputs must be added before it");
+        }
+
+        stageOf[i] = stage;
+        if (schedule.size() <= stage) {
+            schedule.resize(stage + 1);
+        }
+        schedule[stage].push_back(waveformProcessors[i].get());
+    }
+}
+
 void DataStore::setWholeCell(double Ra, double Rm, double Cm) {
     if (cellParametersValue.value()) {
         this->Ra = Ra;
@@ -2,13 +2,26 @@
 
 #include "Plot.h"
 #include <memory>
+#include <functional>
 #include "ClampThread.h"
 #include "MVC.h"
 #include "streams.h"
+#include "BoardStreams.h"
+#include "OverloadController.h"
+#include "FileCloser.h"
+#include "ExponentialModels.h"
+#include "DataAnalysis.h"
+#include <QString>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 class QDateTime;
 
 namespace CLAMP {
+    class ReadQueue;
     namespace SignalProcessing {
         class Filter;
     }
@@ -20,20 +33,57 @@ namespace CLAMP {
 
 struct DCParameters {
     double steadyStateValue;
+    double peakValue; // The sample farthest from the previous segment's steady state (or this one's, for the first)
     bool valid;
 
-    DCParameters() : valid(false) {}
+    DCParameters() : steadyStateValue(0), peakValue(0), valid(false) {}
 };
 
 struct ExponentialParameters {
-    double beta[3];
+    double beta[3];          // Single exponential; for a two-exponential fit, the equivalent one (see DoubleExponentialFit::equivalentSingle)
+    double fullBeta[5];      // Two-exponential fit, if doubleExponential
+    bool doubleExponential;
+    unsigned int iterations; // Number of Levenberg-Marquardt iterations the fit took
     bool valid;
 
-    ExponentialParameters() : valid(false) {}
+    ExponentialParameters() : doubleExponential(false), iterations(0), valid(false) {}
 };
 
 class DataStore;
 
+// Bytes held by one DataStore, returned by DataStore::getMemoryUsage
+struct DataStoreMemoryUsage {
+    std::size_t sampleBytes;    // rawValues and clampValues, and the copies of the streams kept for saving
+    std::size_t waveformBytes;  // Per-segment copies of the data, for saving and analysis
+    std::size_t processorBytes; // The processors' own buffers, including the Lines they plot
+    // Board-wide streams being viewed (shared with other DataStores, so not part of total()), and their size
+    const BoardStreams* streams;
+    std::size_t streamBytes;
+
+    DataStoreMemoryUsage() : sampleBytes(0), waveformBytes(0), processorBytes(0), streams(nullptr), streamBytes(0) {}
+    std::size_t total() const { return sampleBytes + waveformBytes + processorBytes; }
+};
+
+// Cost of one processor, accumulated by DataStore::handleChange
+struct ProcessorStatistics {
+    const char* name;
+    uint64_t calls;            // Times process() ran
+    uint64_t skips;            // Times needsProcessing() said there was nothing to do
+    double totalSeconds;       // Time spent in process()
+    double maxSeconds;         // Longest single call to process()
+    uint64_t samplesProcessed; // New samples that had arrived when process() ran
+
+    ProcessorStatistics() : name(""), calls(0), skips(0), totalSeconds(0), maxSeconds(0), samplesProcessed(0) {}
+    double meanSeconds() const { return (calls > 0) ? totalSeconds / calls : 0; }
+};
+
+/* One stage of the DataStore's processing pipeline.
+ *
+ * Processors declare the other processors whose results they read (dependsOn) and any shared state they write or read
+ * outside of those results, such as a Lines object or a DataStore field (touches).  The DataStore uses that to run
+ * independent processors in parallel; processors that touch the same state run one at a time, in the order they were
+ * added.
+ */
 class DataProcessor : public QObject {
     Q_OBJECT
 
@@ -44,9 +94,39 @@ public:
     virtual void init() = 0;
     virtual void reset() = 0;
     virtual void process(bool overlayChanged, bool dataChanged) = 0;
+    // False if process() would do nothing for this change, so the DataStore doesn't need to schedule it
+    virtual bool needsProcessing(bool overlayChanged, bool dataChanged) const { return overlayChanged || dataChanged; }
+    // Name shown in the processing statistics
+    virtual const char* name() const = 0;
+    // Bytes held by the processor's buffers and Lines; called from the GUI thread, with the DataStore locked
+    virtual std::size_t memoryBytes() const { return 0; }
+    // Limits the memory of the Lines the processor owns, if any (see Lines::setMemoryCap); GUI thread only
+    virtual void setDisplayMemoryCap(std::size_t) {}
+    // Writes any results worth keeping alongside a save file; basePath is the save file's name without its extension.
+    // Called with the DataStore locked, when the file is closed.
+    virtual void saveResults(const QString&) {}
+    // True if the processor only builds Lines for the plots, and can be rebuilt from rawValues, so it's suspended while
+    // the display is hidden (see DataStore::setDisplayActive)
+    virtual bool plotsOnly() const { return false; }
+    // Overload level (see OverloadController) from which the processor is suspended.  Must be no lower than that of any
+    // processor that depends on it.
+    virtual OverloadController::Level shedLevel() const { return plotsOnly() ? OverloadController::SHED_PLOTS : OverloadController::SHED_ANALYSIS; }
+
+    const std::vector<DataProcessor*>& getInputs() const { return inputs; }
+    const std::vector<const void*>& getSharedState() const { return sharedState; }
 
 protected:
     DataStore& datastore;
+
+    void dependsOn(DataProcessor* input);
+    void touches(const void* state);
+
+private:
+    friend class DataStore;
+
+    std::vector<DataProcessor*> inputs;
+    std::vector<const void*> sharedState;
+    ProcessorStatistics statistics; // Only written from DataStore::handleChange, which holds datastoreMutex
 };
 
 class AppliedWaveformProcessor : public DataProcessor {
@@ -59,6 +139,11 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "AppliedWaveformProcessor"; }
+    std::size_t memoryBytes() const override;
+    void setDisplayMemoryCap(std::size_t bytes) override { waveforms.setMemoryCap(bytes); }
+    bool needsProcessing(bool overlayChanged, bool) const override { return overlayChanged; }
+    bool plotsOnly() const override { return true; }
 
 private:
     std::vector<Line> appliedWaveforms;
@@ -68,21 +153,48 @@ private:
 };
 
 typedef double(*correctFunction)(bool correct, double applied, double value, double r);
-LineIncrements seriesResistanceCorrect(DataStore& datastore, const std::vector<double>& values, double samplingRate, bool doCorrection, correctFunction f);
+
+/* Converts newly arrived samples into points on the per-waveform Lines, applying a correction (e.g., for series resistance).
+ *
+ * Keeps a cursor to the first waveform segment that can still receive data, so each call only looks at the segments and
+ * samples that arrived since the last call (i.e., from datastore.startAt on).  Call reset() whenever the DataStore starts
+ * over (i.e., from the processor's init() and reset()).
+ */
+class SeriesResistanceCorrector {
+public:
+    SeriesResistanceCorrector(DataStore& datastore_, bool doCorrection_, correctFunction f_);
+
+    void reset();
+    LineIncrements process(const std::vector<CLAMP::Sample>& values, double samplingRate, Lines& destination);
+
+private:
+    DataStore& datastore;
+    bool doCorrection;
+    correctFunction f;
+    unsigned int firstSegment;
+    unsigned int lastStartAt;
+    std::vector<double> ts, ys; // Scratch space for one segment's points
+};
 
 class FilterProcessor;
+/* Plots the applied waveform plus the external command (see Board::enableAdcControl).  The board adds the ADC to the
+ * command in hardware, so the sum is the clamp value the chip reports, and is plotted straight from clampValues.
+ */
 class AppliedPlusAdcProcessor : public DataProcessor {
 public:
-	AppliedPlusAdcProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, std::vector<double>& clampValues_);
+	AppliedPlusAdcProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, std::vector<CLAMP::Sample>& clampValues_);
 	~AppliedPlusAdcProcessor();
 
-	void init() override {}
-	void reset() override {}
+	void init() override { corrector.reset(); }
+	void reset() override { corrector.reset(); }
 	void process(bool overlayChanged, bool dataChanged) override;
+	const char* name() const override { return "AppliedPlusAdcProcessor"; }
+	bool plotsOnly() const override { return true; }
 
 private:
 	AppliedWaveformProcessor& applied;
-	std::vector<double>& clampValues;
+	std::vector<CLAMP::Sample>& clampValues;
+	SeriesResistanceCorrector corrector;
 
 	static double dummyFunction(bool correct, double applied, double value, double r);
 };
@@ -92,13 +204,16 @@ public:
     VCellProcessor(DataStore& datastore_, AppliedWaveformProcessor& applied_, FilterProcessor& source_);
     ~VCellProcessor();
 
-    void init() override {}
-    void reset() override {}
+    void init() override { corrector.reset(); }
+    void reset() override { corrector.reset(); }
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "VCellProcessor"; }
+    bool plotsOnly() const override { return true; }
 
 private:
     AppliedWaveformProcessor& applied;
     FilterProcessor& source;
+    SeriesResistanceCorrector corrector;
 
     static double vCellCorrect(bool correct, double applied, double value, double r);
 };
@@ -113,13 +228,72 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "MeasuredWaveformProcessor"; }
+    std::size_t memoryBytes() const override { return waveforms.memoryBytes(); }
+    void setDisplayMemoryCap(std::size_t bytes) override { waveforms.setMemoryCap(bytes); }
+    bool plotsOnly() const override { return true; }
 
 private:
     static double bridgeBalanceCorrect(bool correct, double applied, double value, double r);
-    LineIncrements getMeasuredWaveforms(const std::vector<double>& values, double samplingRate);
+    LineIncrements getMeasuredWaveforms(const std::vector<CLAMP::Sample>& values, double samplingRate);
 
     FilterProcessor& source;
     bool bridgeBalance;
+    SeriesResistanceCorrector corrector;
+};
+
+/* Running average of the measured sweeps, one per waveform number (see WaveformSegment::waveformNumber).
+ *
+ * Each time a sweep completes, its samples are folded into a per-sample running mean and variance (Welford's method),
+ * aligned by position within the waveform, i.e., by indexWithinWaveform and the offset within the segment.  So memory
+ * is one cycle's worth of accumulators, however many sweeps are averaged, unlike the overlaid sweeps kept in
+ * Line::oldData.  The average is plotted in average, and written to <save file>_average.csv when a save file closes.
+ *
+ * A new waveform with a different layout starts the average over, as does restart() (e.g., the Clear button).
+ */
+class SweepAverageProcessor : public DataProcessor {
+    Q_OBJECT
+
+public:
+    SweepAverageProcessor(DataStore& datastore_, FilterProcessor& filter);
+    ~SweepAverageProcessor();
+
+    Lines average;
+
+    void init() override;
+    void reset() override;
+    void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "SweepAverageProcessor"; }
+    std::size_t memoryBytes() const override;
+    void setDisplayMemoryCap(std::size_t bytes) override { average.setMemoryCap(bytes); }
+    void saveResults(const QString& basePath) override;
+
+public slots:
+    void restart();
+
+private:
+    // Running statistics of one waveform number's sweeps; element k is the k-th sample within the sweep
+    struct Accumulator {
+        unsigned int sweeps;
+        std::vector<uint32_t> count; // Sweeps with a valid (non-NaN) sample here
+        std::vector<double> mean;
+        std::vector<double> m2;      // Sum of squared deviations from the mean
+
+        Accumulator() : sweeps(0) {}
+        double sd(std::size_t k) const;
+    };
+
+    FilterProcessor& source;
+    std::vector<Accumulator> accumulators; // By waveform number
+    std::vector<unsigned int> offsets;     // By segment: position of its first sample within its sweep
+    std::vector<std::vector<unsigned int>> sweepSegments; // By waveform number: its segments, in sweep order
+    std::vector<unsigned int> lastSegment; // By waveform number: the segment that ends its sweep
+    std::vector<bool> folded;              // By waveform number: already folded in this cycle
+    std::atomic<bool> restartRequested;
+
+    bool layoutSweeps();
+    void fold(unsigned int waveformNumber, const std::vector<CLAMP::Sample>& values);
+    void plotAverage();
 };
 
 class DCCalculationProcessor : public DataProcessor {
@@ -130,13 +304,29 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "DCCalculationProcessor"; }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
 
     std::vector<DCParameters> waveformCalculations;
 
 private:
+    // Running sums for a segment whose samples are still arriving
+    struct SegmentSums {
+        double sum;         // Of the steady-state window: the second half of the segment, as in calculateBestResidual
+        unsigned int count;
+        double min;         // Of the whole segment
+        double max;
+
+        SegmentSums();
+    };
+
     FilterProcessor& source;
+    std::vector<SegmentSums> sums;   // By segment
+    unsigned int firstIncomplete;    // Segments before this one are done
 
-    void getSteadyStateValues(const std::vector<double>& values);
+    void restart();
+    void getSteadyStateValues(const std::vector<CLAMP::Sample>& values);
+    void finishSegment(unsigned int i);
 };
 
 class DCPlotProcessor : public DataProcessor {
@@ -147,6 +337,8 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "DCPlotProcessor"; }
+    bool plotsOnly() const override { return true; }
 
 private:
     Lines& waveforms;
@@ -155,6 +347,42 @@ private:
     LineIncrements getResidualWaveforms(double samplingRate);
 };
 
+/* I-V curve: the steady-state and peak value of each completed segment against its applied value, one point per applied
+ * value (the first segment at that value), for the current cycle.  Points are added as segments complete; the previous
+ * cycle's curve stays up until the new cycle's first point.
+ */
+class IVPlotProcessor : public DataProcessor {
+public:
+    IVPlotProcessor(DataStore& datastore_, DCCalculationProcessor& calc);
+    ~IVPlotProcessor();
+
+    Lines iv; // Line 0 is the steady state, line 1 the peak
+
+    void init() override;
+    void reset() override;
+    void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "IVPlotProcessor"; }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+    std::size_t memoryBytes() const override { return iv.memoryBytes(); }
+    void setDisplayMemoryCap(std::size_t bytes) override { iv.setMemoryCap(bytes); }
+    bool plotsOnly() const override { return true; }
+
+private:
+    struct IVPoint {
+        int appliedDiscreteValue;
+        double applied;
+        double steadyState;
+        double peak;
+    };
+
+    DCCalculationProcessor& dcCalculation;
+    std::vector<IVPoint> points; // Sorted by applied value
+    unsigned int nextSegment;
+
+    void restart();
+    void plotAll();
+};
+
 class ExponentialCalculationWaveformProcessor : public DataProcessor {
 public:
     ExponentialCalculationWaveformProcessor(DataStore& datastore_, FilterProcessor& filter);
@@ -163,13 +391,25 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "ExponentialCalculationWaveformProcessor"; }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+    OverloadController::Level shedLevel() const override { return OverloadController::SHED_FITS; }
 
     std::vector<ExponentialParameters> exponentialParameters;
 
 private:
     FilterProcessor& source;
 
-    void fitExponentials(const std::vector<double>& values, double samplingRate);
+    struct FitScratch {
+        std::vector<double> xs, ys;
+        CLAMP::SignalProcessing::DoubleExponentialFit::Workspace workspace;
+    };
+    std::vector<FitScratch> scratch; // One per fit in flight; kept between calls so the buffers are reused
+    std::vector<unsigned int> toFit;                // Likewise, fitExponentials' list of segments and their tasks
+    std::vector<std::function<void()>> tasks;
+
+    void fitExponentials(const std::vector<CLAMP::Sample>& values, double samplingRate);
+    void fitSegment(unsigned int i, const std::vector<CLAMP::Sample>& values, double samplingRate, FitScratch& buffers);
 };
 
 class ExponentialPlotProcessor : public DataProcessor {
@@ -180,6 +420,8 @@ public:
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "ExponentialPlotProcessor"; }
+    bool plotsOnly() const override { return true; }
 
 private:
     Lines& waveforms;
@@ -193,15 +435,23 @@ public:
     ResistanceCalculationWaveformProcessor(DataStore& datastore_, DCCalculationProcessor* dc_, ExponentialCalculationWaveformProcessor* exp_);
     ~ResistanceCalculationWaveformProcessor();
 
-    void init() override {}
-    void reset() override {}
+    void init() override;
+    void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "ResistanceCalculationWaveformProcessor"; }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+    OverloadController::Level shedLevel() const override { return OverloadController::SHED_FITS; }
 
 private:
     DCCalculationProcessor* dc;
     ExponentialCalculationWaveformProcessor* exp;
 
-    static double calculateR(const std::vector<double>& currents, const std::vector<double>& voltages);
+    // Least-squares fit of voltage against current, to which each completed segment is added once, rather than every
+    // segment being revisited on every chunk
+    unsigned int nextSegment;
+    CLAMP::SignalProcessing::RunningRegression fit;
+
+    void restart();
 };
 
 class CellParameterProcessor : public DataProcessor {
@@ -212,12 +462,14 @@ public:
     void init() override {}
     void reset() override {}
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "CellParameterProcessor"; }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+    OverloadController::Level shedLevel() const override { return OverloadController::SHED_FITS; }
 
 private:
     ExponentialCalculationWaveformProcessor& exp;
 
     void calculateCellParameters(double& Ra, double& Rm, double& Cm);
-    static void getRsAndCs(double beta[3], double dV, double resistance, double& Ra, double& Rm, double& Cm);
 };
 
 class ResistanceProcessor : public DataProcessor {
@@ -230,20 +482,72 @@ public:
     void init() override {}
     void reset() override {}
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "ResistanceProcessor"; }
+    std::size_t memoryBytes() const override { return waveform.memoryBytes(); }
+    void setDisplayMemoryCap(std::size_t bytes) override { waveform.setMemoryCap(bytes); }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+};
+
+/* Plots the board's ADCs and digital inputs, which the board records once for all headstages (see BoardStreams).
+ *
+ * Both are drawn straight from the streams' integer columns, without converting every sample.  Each ADC is reduced to
+ * the first, minimum, maximum, and last value of each group of samples, with groups sized so that a cycle is at most
+ * MAX_ADC_GROUPS of them; each digital input is plotted from just the samples where it changes, stacked so that input
+ * i steps between i and i + 0.8.  So the cost of the plots depends on their width and the number of edges, not on the
+ * number of ADCs times the sampling rate.
+ *
+ * The board only sends the ADCs and digital inputs while something wants them, so this registers a data consumer
+ * (see Board::addDataConsumer) for as long as it exists, which takes effect the next time the board starts running.
+ * Times run from the start of the cycle; steps aren't overlaid.
+ */
+class AuxWaveformProcessor : public DataProcessor {
+public:
+    AuxWaveformProcessor(DataStore& datastore_);
+    ~AuxWaveformProcessor();
+
+    Lines adcWaveforms;     // One line per ADC, in volts
+    Lines digitalWaveforms; // One line per digital input
+
+    void init() override;
+    void reset() override;
+    void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "AuxWaveformProcessor"; }
+    std::size_t memoryBytes() const override { return adcWaveforms.memoryBytes() + digitalWaveforms.memoryBytes(); }
+    void setDisplayMemoryCap(std::size_t bytes) override;
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
+    bool plotsOnly() const override { return true; }
+
+private:
+    static const unsigned int MAX_ADC_GROUPS = 4096;
+    static const unsigned int NUM_DIGITAL_INPUTS = 16;
+
+    unsigned int numAdcs;
+    unsigned int consumerId;
+    unsigned int adcsUpTo;    // rawValues index of the first sample not yet plotted on the ADC lines
+    unsigned int digitalUpTo; //   and on the digital lines
+    uint16_t lastDigIns;      // Digital inputs at digitalUpTo - 1
+    std::vector<double> ts;   // Scratch space for the points of one line
+    std::vector<double> ys;
+
+    LineIncrements getAdcWaveforms(unsigned int end, unsigned int groupSize, double samplingRate);
+    LineIncrements getDigitalWaveforms(unsigned int end, double samplingRate);
 };
 
 class FilterProcessor : public DataProcessor {
     Q_OBJECT
 
 public:
-    FilterProcessor(DataStore& datastore_, std::vector<double>& rawValues_);
+    FilterProcessor(DataStore& datastore_, std::vector<CLAMP::Sample>& rawValues_);
     ~FilterProcessor();
 
     void init() override;
     void reset() override;
     void process(bool overlayChanged, bool dataChanged) override;
+    const char* name() const override { return "FilterProcessor"; }
+    std::size_t memoryBytes() const override { return filteredValues.capacity() * sizeof(CLAMP::Sample); }
+    bool needsProcessing(bool, bool dataChanged) const override { return dataChanged; }
 
-    const std::vector<double>& getValues();
+    const std::vector<CLAMP::Sample>& getValues();
 
 public slots:
     void enableLowPassFilter(bool enable);
@@ -252,8 +556,8 @@ public slots:
 private:
     std::unique_ptr<CLAMP::SignalProcessing::Filter> filter;
     bool lowPassFilterEnabled;
-    std::vector<double> filteredValues;
-    std::vector<double>& rawValues;
+    std::vector<CLAMP::Sample> filteredValues;
+    std::vector<CLAMP::Sample>& rawValues;
 };
 
 class DisplayWindow;
@@ -270,20 +574,32 @@ public:
     void openFile(const QString& subdirName, const QString& baseFilename, const QDateTime& dateTime, int unit, bool auxDataToo);
     void writeHeader(int unit, bool holdingOnly = false, unsigned int lastIndex = 0);
     void writeToFile();
+    void fillSaveHeader(CLAMP::IO::HeaderData& header, int unit, bool holdingOnly = false, unsigned int lastIndex = 0);
     void closeFile();
-    void init(const CLAMP::SimplifiedWaveform& simplifiedWaveform, bool applyVoltages);
-    void startCycle();
+    void closeFileAsync(const CLAMP::IO::FileCloser::Callback& done);
+    void init(const CLAMP::SimplifiedWaveform& simplifiedWaveform, bool applyVoltages, bool ownCycles_ = false);
+    void startCycle(const std::shared_ptr<BoardStreams>& streams_);
+    void releaseStreams();
+    std::size_t getStreamOffset();
+    void rebaseStreams(const std::shared_ptr<BoardStreams>& streams_, std::size_t dropped);
     void clear();
-    void storeData(const std::vector<double>& values, const std::vector<double>& clampValues, double absoluteTime);
+    void storeData(const CLAMP::ReadQueue& queue, const CLAMP::ClampConfig::ChipChannel& index, double absoluteTime);
 
     void enableLowPassFilter(bool enable);
     void setLowPassFilterCutoff(double fc);
     void setProcessors(std::vector<std::unique_ptr<DataProcessor>>& waveformProcessors_);
+    std::vector<ProcessorStatistics> getProcessorStatistics();
+    void resetProcessorStatistics();
+    DataStoreMemoryUsage getMemoryUsage();
+    void setDisplayMemoryCap(std::size_t bytes);
+    void setDisplayActive(bool active);
+    void setProcessingInterval(double seconds);
 
     double resistance;
 
 public slots:
     void setOverlay(bool value);
+    void setDoubleExponential(bool value);
     void setWholeCell(double Ra, double Rm, double Cm);
 	void adjustRa(double Ra);
 
@@ -299,13 +615,14 @@ public:
     ControlWindow* controlWindow;
     GlobalState* state;
 
-    std::vector<double> rawValues;
-	std::vector<double> clampValues;
-    std::vector<std::vector<double>> adcsDouble;
+    std::vector<CLAMP::Sample> rawValues;
+	std::vector<CLAMP::Sample> clampValues;
     double cycleStartTime;
-    std::vector<uint32_t> timestamps;
-	std::vector<uint16_t> digIns;
-	std::vector<uint16_t> digOuts;
+    // Board timestamp of rawValues[index]
+    uint32_t timestamp(unsigned int index) const { return streams->timestamps[streamOffset + index]; }
+    // Digital inputs and ADC values from rawValues[0] on; null if the board isn't sending them (see Board::addDataConsumer)
+    const uint16_t* digIns() const { return hasStream(streams->digIns) ? streams->digIns.data() + streamOffset : nullptr; }
+    const uint16_t* adcValues(unsigned int adc) const { return hasStream(streams->adcs.at(adc)) ? streams->adcs[adc].data() + streamOffset : nullptr; }
     CLAMP::SimplifiedWaveform simplifiedWaveform;
     double absoluteTime;
 
@@ -313,6 +630,7 @@ public:
 
     bool applyVoltages;
     bool overlay;
+    bool doubleExponential; // Fit transients with two exponentials
     unsigned int startAt;
 
     BoolHolder cellParametersValue;
@@ -323,15 +641,57 @@ public:
 private:
     CLAMP::IO::SaveFile* saveFile;
 	CLAMP::IO::SaveFile* saveFileAux;
+	unsigned int savedUpTo; // Samples before this index have already been written to the save file(s)
+	QString saveBasePath; // Save file's name without its extension, for the processors' saveResults
+	FILENAME savePath;    // Paths the save files were opened with, for FileCloser
+	FILENAME saveAuxPath;
     std::vector<Line> waveforms;
-    std::vector<std::vector<uint16_t>> adcs;
 	int numAdcs;
-
-    std::recursive_mutex datastoreMutex; // Acquire this when you need to be threadsafe
+	bool auxConsumerRegistered; // Whether the aux save file has asked the board for the ADCs and digital I/O
+	unsigned int auxConsumerId;
+
+    // Timestamps, digital I/O, and ADCs, shared with the other headstages; rawValues[i] goes with index streamOffset + i
+    std::shared_ptr<BoardStreams> streams;
+    std::size_t streamOffset;
+    // writeToFile's copies of the streams, indexed as rawValues, for when the streams don't line up with it.  Only the
+    // part not yet saved is filled in (the save files don't look before savedUpTo), and they keep their capacity.
+    std::vector<uint32_t> timestampsSlice;
+    std::vector<uint16_t> digInsSlice;
+    std::vector<uint16_t> digOutsSlice;
+    std::vector<std::vector<uint16_t>> adcsSlice;
+    void fillSlices(std::size_t n);
+    // Whether storeData ends each cycle itself, when the waveform is done, rather than the ClampThread calling startCycle
+    bool ownCycles;
+
+    CLAMP::ProfiledRecursiveMutex datastoreMutex; // Acquire this when you need to be threadsafe
     std::vector<std::unique_ptr<DataProcessor>> waveformProcessors;
-
+    std::vector<std::vector<DataProcessor*>> schedule; // waveformProcessors, grouped into stages that can run in parallel
+    std::size_t displayMemoryCap; // Passed to each processor's setDisplayMemoryCap
+    bool displayActive;           // False while nobody can see the plots, so the plotsOnly() processors are skipped
+    OverloadController::Level overloadLevel; // Level the processors were last run at (see handleChange)
+
+    // Deferred processing (see setProcessingInterval): storeData only appends, and this worker runs the processors
+    double processingInterval; // Seconds; 0 to run them on every chunk as it's stored
+    bool processingPending;    // Data has been stored that the processors haven't seen
+    std::thread processingWorker;
+    std::mutex workerMutex;
+    std::condition_variable workerWake;
+    bool processingDue; // Guarded by workerMutex: run the processors now, without waiting for the interval
+    bool stopWorker;    //   and end the worker
+
+    bool hasStream(const std::vector<uint16_t>& stream) const { return !stream.empty() && stream.size() == streams->timestamps.size(); }
+    void buildSchedule();
     void handleChange(bool overlayChanged, bool dataChanged);
+    static bool isSuspended(const DataProcessor* processor, bool display, OverloadController::Level level);
+    void catchUp(bool wasDisplayActive, OverloadController::Level wasLevel);
+    static void runProcessor(DataProcessor* processor, bool overlayChanged, bool dataChanged, uint64_t newSamples);
     void resetAll();
     void reinitAll();
-    void fillSaveHeader(CLAMP::IO::HeaderData& header, int unit, bool holdingOnly = false, unsigned int lastIndex = 0);
+    void reserveCycleStorage();
+    void appendSamples(const CLAMP::ReadQueue& queue, const CLAMP::ClampConfig::ChipChannel& index, std::size_t first, std::size_t n);
+    void nextCycle();
+    bool completesSegment(std::size_t oldSize) const;
+    void processPending();
+    void processingLoop();
+    void stopProcessingWorker();
 };
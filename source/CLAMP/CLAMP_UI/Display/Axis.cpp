@@ -0,0 +1,306 @@
+#include "Axis.h"
+#include "Line.h"
+#include "globalconstants.h"
+#include <QFont>
+#include <QFontMetrics>
+#include <algorithm>
+#include <cmath>
+
+AxisStep::AxisStep(int stepIndex_, int minStep_, int maxStep_) :
+    stepIndex(stepIndex_),
+    minStep(minStep_),
+    maxStep(maxStep_)
+{
+
+}
+
+// ----------------------------------------------------------------------------------------------------------
+Axis::Axis(unsigned int numSteps_, int stepIndex_, const QString& unit_, const QString& name_, unsigned int startValue, int startExponent, unsigned int endValue, int endExponent, bool positiveOnly_) :
+    autoscalable(true),
+    zoomIndex(0),
+    unit(unit_),
+    name(name_),
+    positiveOnly(positiveOnly_),
+    labelWidth(-1),
+    labelWidthScale(0, 0, 0)
+{
+    settings.push_back(AxisStep(stepIndex_, positiveOnly_ ? 0 : -static_cast<int>(numSteps_ / 2), positiveOnly_ ? numSteps_ : numSteps_ / 2));
+
+    unsigned int val = startValue;
+    int exp = startExponent;
+    for(;;) {
+        // val * 10^exp
+        stepValues.push_back(val * pow(10, exp));
+        if (val == endValue && exp == endExponent) {
+            break;
+        }
+        switch (val) {
+            case 1:
+                val = 2;
+                break;
+            case 2:
+                val = 5;
+                break;
+            case 5:
+                val = 1;
+                exp++;
+                break;
+        }
+    }
+
+}
+
+AxisStep& Axis::current() {
+    return settings[zoomIndex];
+}
+
+const AxisStep& Axis::current() const {
+    return settings[zoomIndex];
+}
+
+double Axis::getStep() const {
+    return stepValues[current().stepIndex];
+}
+
+double Axis::getAxisMagnitude() const {
+    return std::max(std::abs(minAxisValue()), std::abs(maxAxisValue()));
+}
+
+double Axis::minAxisValue() const {
+    return minStepValue() * getStep();
+}
+
+// Return maximum value of currently displayed axis.
+double Axis::maxAxisValue() const {
+    return maxStepValue() * getStep();
+}
+
+int Axis::minStepValue() const {
+    return current().minStep;
+}
+
+int Axis::maxStepValue() const {
+    return current().maxStep;
+}
+
+
+int Axis::numberOfSteps() const {
+    return current().maxStep - current().minStep;
+}
+
+void Axis::adjustStepIndex(int delta)
+{
+    int stepIndexNew = current().stepIndex + delta;
+
+    stepIndexNew = std::max(stepIndexNew, 0);
+    stepIndexNew = std::min(stepIndexNew, static_cast<int>(stepValues.size()) - 1);
+
+    changeScale(stepIndexNew, current().minStep, current().maxStep);
+}
+
+QString Axis::getLabel() const {
+    double step = getAxisMagnitude();
+    QString prefix;
+    if (step >= 0.2e9) { prefix = "G"; }
+    else if (step >= 0.2e6) { prefix = "M"; }
+    else if (step >= 0.2e3) { prefix = "k"; }
+    else if (step >= 0.2) { prefix = ""; }
+    else if (step >= 0.2e-3) { prefix = "m"; }
+    else if (step >= 0.2e-6) { prefix = QSTRING_MU_SYMBOL; }
+    else if (step >= 0.2e-9) { prefix = "n"; }
+    else { prefix = "p"; }
+
+    if (unit.isEmpty()) {
+        return name;
+    }
+    return name + " (" + prefix + unit + ")";
+}
+
+QString Axis::getTickLabel(int i) const {
+    if (i == 0) {
+        return "0";
+    }
+    else {
+        double step = getAxisMagnitude();
+        double scale;
+        if (step >= 0.2e9) { scale = 1e-9; }
+        else if (step >= 0.2e6) { scale = 1e-6; }
+        else if (step >= 0.2e3) { scale = 1e-3; }
+        else if (step >= 0.2) { scale = 1; }
+        else if (step >= 0.2e-3) { scale = 1.0e3; }
+        else if (step >= 0.2e-6) { scale = 1.0e6; }
+        else if (step >= 0.2e-9) { scale = 1.0e9; }
+        else { scale = 1.0e12; }
+
+        step = getStep();
+        double mark = step * scale;
+
+        double value = mark * i;
+
+        int numDecimals = 0;
+        if (mark < 0.9) {  // Would do 1.0, but let's be safe
+            double smallest = 1.0;
+            while (smallest > mark) {
+                numDecimals++;
+                smallest /= 10;
+            }
+        }
+
+        return QString::number(value, 'f', numDecimals);
+    }
+}
+
+void Axis::autoscale(const Range& actualRange, const Range& desiredRange, bool force) {
+    if (!autoscalable) {
+        return;
+    }
+
+    // The rule is that if there's data that doesn't fit into the window, we always autoscale.
+    // If there isn't (i.e., plot is entirely contained in the window), we only autoscale if force=true
+
+    // When checking whether there's data that doesn't fit in the window, use the actual data range...
+    double minValue = positiveOnly ? 0 : actualRange.min;
+    double maxValue = actualRange.max;
+
+    bool doAutoscale = force;
+    if (!doAutoscale) {
+        // Always autoscale if the data won't fit on the screen.
+        doAutoscale = (minValue < minAxisValue()) || (maxValue > maxAxisValue());
+    }
+
+    if (doAutoscale) {
+        // ... but when we go to autoscale, use the desired range (which may contain 10% or 20% more size)
+        minValue = positiveOnly ? 0 : desiredRange.min;
+        maxValue = desiredRange.max;
+
+        int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 10);
+        if (stepIndexNew != -1) {
+            int minStepNew = floor(minValue / stepValues[stepIndexNew]);
+            int maxStepNew = minStepNew + 10;
+            resetScale(stepIndexNew, minStepNew, maxStepNew);
+        }
+    }
+}
+
+void Axis::scale(double minValue, double maxValue) {
+    int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 20);
+    if (stepIndexNew != -1) {
+        int minStepNew = floor(minValue / stepValues[stepIndexNew]);
+        int maxStepNew = ceil(maxValue / stepValues[stepIndexNew]);
+        resetScale(stepIndexNew, minStepNew, maxStepNew);
+    }
+}
+
+void Axis::adjustZeroPosition(int delta)
+{
+    int minStepNew = current().minStep + delta;
+    int maxStepNew = current().maxStep + delta;
+
+    if (positiveOnly && (minStepNew < 0)) {
+        minStepNew++;
+        maxStepNew++;
+    }
+
+    changeScale(current().stepIndex, minStepNew, maxStepNew);
+}
+
+double Axis::valueToSteps(double value) const {
+    return value / getStep() - minStepValue();
+}
+
+void Axis::zoom(int minIndex, int maxIndex) {
+    double minValue = getStep() * (minIndex + minStepValue());
+    double maxValue = getStep() * (maxIndex + minStepValue());
+
+    int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 20);
+    if (stepIndexNew != -1) {
+        int minStepNew = floor(minValue / stepValues[stepIndexNew]);
+        int maxStepNew = ceil(maxValue / stepValues[stepIndexNew]);
+
+        changeScale(stepIndexNew, minStepNew, maxStepNew);
+    }
+}
+
+int Axis::findScaleForRange(double minValue, double maxValue, int minNumSteps, int maxNumSteps) {
+    double diff = maxValue - minValue;
+    int stepIndexNew = -1;
+    for (unsigned int i = 0; i < stepValues.size(); i++) {
+        double step = stepValues[i];
+        int numSteps = ceil(diff / step);
+        if (numSteps >= minNumSteps && numSteps <= maxNumSteps) {
+            stepIndexNew = i;
+            break;
+        }
+    }
+    return stepIndexNew;
+}
+
+void Axis::resetScale(int stepIndexNew, int minStepNew, int maxStepNew) {
+    bool changed = zoomIndex != 0;
+
+    zoomIndex = 0;
+    settings.erase(settings.begin() + zoomIndex + 1, settings.end());
+
+    if (current().stepIndex != stepIndexNew || current().minStep != minStepNew || current().maxStep != maxStepNew) {
+        settings[0] = AxisStep(stepIndexNew, minStepNew, maxStepNew);
+        changed = true;
+    }
+
+    if (changed) {
+        emit axisChanged();
+    }
+}
+
+void Axis::changeScale(int stepIndexNew, int minStepNew, int maxStepNew) {
+    if (current().stepIndex != stepIndexNew || current().minStep != minStepNew || current().maxStep != maxStepNew) {
+        settings.erase(settings.begin() + zoomIndex + 1, settings.end());
+        zoomIndex++;
+        settings.push_back(AxisStep(stepIndexNew, minStepNew, maxStepNew));
+
+        emit axisChanged();
+    }
+}
+
+bool Axis::canZoomIn() const {
+    return zoomIndex < settings.size() - 1;
+}
+
+bool Axis::canZoomOut() const {
+    return zoomIndex > 0;
+}
+
+void Axis::zoomIn() {
+    if (canZoomIn()) {
+        zoomIndex++;
+        emit axisChanged();
+    }
+}
+
+void Axis::zoomOut() {
+    if (canZoomOut()) {
+        zoomIndex--;
+        emit axisChanged();
+    }
+}
+
+// Width of the widest tick label; remembered until the scale or the font changes
+int Axis::maxLabelWidth(QFont& font) {
+    const AxisStep& scale = current();
+    QString fontKey = font.key();
+    if (labelWidth >= 0 && scale.stepIndex == labelWidthScale.stepIndex && scale.minStep == labelWidthScale.minStep &&
+        scale.maxStep == labelWidthScale.maxStep && fontKey == labelWidthFont) {
+        return labelWidth;
+    }
+
+    QFontMetrics fm(font);
+
+    int result = 0;
+    for (int i = minStepValue(); i <= maxStepValue(); ++i) {
+        result = std::max(result, fm.width(getTickLabel(i)));
+    }
+
+    labelWidth = result;
+    labelWidthScale = scale;
+    labelWidthFont = fontKey;
+    return result;
+}
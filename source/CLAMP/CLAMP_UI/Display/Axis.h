@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <vector>
+
+class QFont;
+struct Range;
+
+struct AxisStep {
+    int stepIndex;
+    int minStep;
+    int maxStep;
+
+    AxisStep(int stepIndex_, int minStep_, int maxStep_);
+};
+
+class Axis : public QObject {
+    Q_OBJECT
+
+public:
+    Axis(unsigned int numSteps_, int stepIndex_, const QString& unit_, const QString& name_, unsigned int startValue, int startExponent, unsigned int endValue, int endExponent, bool positiveOnly_);
+
+    void adjustStepIndex(int delta);
+    int numberOfSteps() const;
+    QString getLabel() const;
+    QString getTickLabel(int i) const;
+    double valueToSteps(double value) const;
+    void autoscale(const Range& actualRange, const Range& desiredRange, bool force);
+    void scale(double minValue, double maxValue);
+    void adjustZeroPosition(int delta);
+    int minStepValue() const;
+    int maxStepValue() const;
+    void zoom(int minIndex, int maxIndex);
+    bool canZoomIn() const;
+    bool canZoomOut() const;
+    int maxLabelWidth(QFont& font);
+    double minAxisValue() const;
+    double maxAxisValue() const;
+    double getStep() const;
+    bool autoscalable;
+
+signals:
+    void axisChanged();
+
+public slots:
+    void zoomIn();
+    void zoomOut();
+
+private:
+    std::vector<AxisStep> settings;
+    unsigned int zoomIndex;
+
+    std::vector<double> stepValues;
+    QString unit;
+    QString name;
+
+    bool positiveOnly;
+
+    // Last result of maxLabelWidth(), and the scale and font it was for
+    int labelWidth;
+    AxisStep labelWidthScale;
+    QString labelWidthFont;
+
+    AxisStep& current();
+    const AxisStep& current() const;
+    double getAxisMagnitude() const;
+    void resetScale(int stepIndexNew, int minStepNew, int maxStepNew);
+    void changeScale(int stepIndexNew, int minStepNew, int maxStepNew);
+    int findScaleForRange(double minValue, double maxValue, int minNumSteps, int maxNumSteps);
+};
@@ -1,11 +1,26 @@
 INCLUDEPATH += $$PWD
 
 HEADERS       += \
+    $$PWD/Axis.h \
     $$PWD/DisplayWindow.h \
     $$PWD/Line.h \
-    $$PWD/Plot.h
+    $$PWD/Plot.h \
+    $$PWD/PlotRenderer.h \
+    $$PWD/PlotScheduler.h \
+    $$PWD/SweepHistory.h
 
 SOURCES += \
+    $$PWD/Axis.cpp \
     $$PWD/DisplayWindow.cpp \
     $$PWD/Line.cpp \
-    $$PWD/Plot.cpp
+    $$PWD/Plot.cpp \
+    $$PWD/PlotRenderer.cpp \
+    $$PWD/PlotScheduler.cpp \
+    $$PWD/SweepHistory.cpp
+
+# QOpenGLWidget is only available in Qt 5
+greaterThan(QT_MAJOR_VERSION, 4) {
+    DEFINES += CLAMP_OPENGL_PLOTS
+    HEADERS += $$PWD/PlotGL.h
+    SOURCES += $$PWD/PlotGL.cpp
+}
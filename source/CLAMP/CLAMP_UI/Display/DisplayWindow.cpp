@@ -7,7 +7,11 @@
 #include "ResistanceWidget.h"
 #include "globalconstants.h"
 #include "Board.h"
+#include "NoiseSpectrum.h"
 #include "ControlWindow.h"
+#include "PlotScheduler.h"
+#include "SweepHistory.h"
+#include <algorithm>
 #include "Line.h" // TEMP
 
 using namespace CLAMP;
@@ -17,19 +21,29 @@ using std::shared_ptr;
 using std::unique_ptr;
 using std::vector;
 using std::deque;
+using std::pair;
 
 //--------------------------------------------------------------------------
 // Constructor.
-DisplayWindow::DisplayWindow(GlobalState& state_, const std::string& calibrationReport_, int unit_) :
+DisplayWindow::DisplayWindow(GlobalState& state_, int unit_) :
     state(state_),
-    calibrationReport(std::move(calibrationReport_)),
 	unit(unit_)
 {
-    LOG(true) << calibrationReport.c_str();
-
 	lastUnitRun = unit;
 	validFilename = false;
 
+    spectrumPort = -1;
+    spectrumCurrent = true;
+    measuredPlot = nullptr;
+    grid = nullptr;
+    gridScheduler = new PlotScheduler(this);
+    sweepHistory = new SweepHistory(this);
+    historyUnit = -1;
+    historyCurrent = false;
+    spectrumTimer = new QTimer(this);
+    spectrumTimer->setInterval(250);
+    connect(spectrumTimer, SIGNAL(timeout()), this, SLOT(updateNoiseSpectrum()));
+
     createActions();
     // createMenus();
     createStatusBar();
@@ -45,6 +59,12 @@ DisplayWindow::DisplayWindow(GlobalState& state_, const std::string& calibration
 DisplayWindow::~DisplayWindow() {
 }
 
+// The window is built while the board calibrates (see main.cpp); the report, shown from the menu, comes when it's done
+void DisplayWindow::setCalibrationReport(const std::string& report) {
+    calibrationReport = report;
+    LOG(true) << calibrationReport.c_str();
+}
+
 // Create GUI layout.  We create the user interface (UI) directly with code, so it
 // is not necessary to use Qt Designer or any other special software to modify the
 // UI.
@@ -67,6 +87,11 @@ void DisplayWindow::createLayout()
     appliedIAxis.reset(new Axis(MAX_NUM_Y_STEPS, 6, "A", "clamp current", 2, -12, 2, -4, false)); // 2e-12 .. 200e-6
     measuredIAxis.reset(new Axis(MAX_NUM_Y_STEPS, 6, "A", "measured current", 2, -12, 2, -4, false)); // 2e-12 .. 200e-6
     measuredVAxis.reset(new Axis(MAX_NUM_Y_STEPS, 11, "V", "measured voltage", 1, -5, 5, -1, false)); // 10e-6 .. 0.5
+    frequencyAxis.reset(new Axis(MAX_NUM_X_STEPS, 9, "Hz", "frequency", 1, 0, 1, 5, true)); // 1 .. 100e3
+    spectrumIAxis.reset(new Axis(MAX_NUM_Y_STEPS, 6, "A/" + QSTRING_SQRT_SYMBOL + "Hz", "current noise density", 1, -15, 1, -6, true)); // 1e-15 .. 1e-6
+    spectrumVAxis.reset(new Axis(MAX_NUM_Y_STEPS, 6, "V/" + QSTRING_SQRT_SYMBOL + "Hz", "voltage noise density", 1, -10, 1, -3, true)); // 1e-10 .. 1e-3
+    adcAxis.reset(new Axis(MAX_NUM_Y_STEPS, 8, "V", "ADC voltage", 1, -3, 5, -1, true)); // 1e-3 .. 0.5
+    digitalAxis.reset(new Axis(MAX_NUM_Y_STEPS, 1, "", "digital input", 1, 0, 5, 0, true)); // 1 .. 5
 
     QWidget *mainWidget = new QWidget;
     mainWidget->setLayout(layout);
@@ -80,10 +105,13 @@ void DisplayWindow::setUnit(int unit_)
 {
 	disconnect(&state.datastore[unit], SIGNAL(timescaleChanged()), this, SLOT(adjustTAxis()));
 	disconnect(overlayCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setOverlay(bool)));
+	disconnect(doubleExponentialCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setDoubleExponential(bool)));
 	unit = unit_;
 	connect(&state.datastore[unit], SIGNAL(timescaleChanged()), this, SLOT(adjustTAxis()));
 	connect(overlayCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setOverlay(bool)));
 	state.datastore[unit].setOverlay(overlayCheckBox->isChecked());
+	connect(doubleExponentialCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setDoubleExponential(bool)));
+	state.datastore[unit].setDoubleExponential(doubleExponentialCheckBox->isChecked());
 }
 
 // Create QActions linking menu items to functions.
@@ -111,6 +139,31 @@ void DisplayWindow::closeEvent(QCloseEvent *event)
     event->accept();
 }
 
+// Stop building the plots while the window is hidden or minimized (see DataStore::setDisplayActive)
+void DisplayWindow::showEvent(QShowEvent* event) {
+    QMainWindow::showEvent(event);
+    updateDisplayActive();
+}
+
+void DisplayWindow::hideEvent(QHideEvent* event) {
+    QMainWindow::hideEvent(event);
+    updateDisplayActive();
+}
+
+void DisplayWindow::changeEvent(QEvent* event) {
+    QMainWindow::changeEvent(event);
+    if (event->type() == QEvent::WindowStateChange) {
+        updateDisplayActive();
+    }
+}
+
+void DisplayWindow::updateDisplayActive() {
+    bool active = isVisible() && !isMinimized();
+    for (int i = 0; i < MAX_NUM_CHIPS; i++) {
+        state.datastore[i].setDisplayActive(active);
+    }
+}
+
 void DisplayWindow::viewCalibrationReport() {
     QMessageBox::information(this, "Calibration Report", calibrationReport.c_str());
 }
@@ -128,6 +181,61 @@ void DisplayWindow::createControls() {
     connect(overlayCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setOverlay(bool)));
     overlayCheckBox->setChecked(true);
 
+    doubleExponentialCheckBox = new QCheckBox(tr("Two-exponential fits"));
+    doubleExponentialCheckBox->setToolTip(tr("Fit each step's transient with two exponentials, e.g., for cells with a slowly charging compartment; cell parameters come from the equivalent single exponential"));
+    connect(doubleExponentialCheckBox, SIGNAL(toggled(bool)), &state.datastore[unit], SLOT(setDoubleExponential(bool)));
+
+    sweepAverageCheckBox = new QCheckBox(tr("Average sweeps"));
+    sweepAverageCheckBox->setToolTip(tr("Plot the running average of the measured sweeps, and save it with the data"));
+    connect(sweepAverageCheckBox, SIGNAL(toggled(bool)), this, SLOT(showSweepAverage()));
+
+    ivCheckBox = new QCheckBox(tr("I-V plot"));
+    ivCheckBox->setToolTip(tr("Plot each step's steady-state and peak value against its applied value, as the steps complete"));
+    connect(ivCheckBox, SIGNAL(toggled(bool)), this, SLOT(showIVPlot()));
+
+    auxCheckBox = new QCheckBox(tr("ADCs && digital in"));
+    auxCheckBox->setToolTip(tr("Plot the board's ADC inputs and digital inputs, starting the next time the board runs"));
+    connect(auxCheckBox, SIGNAL(toggled(bool)), this, SLOT(showAuxPlots()));
+
+    gridCheckBox = new QCheckBox(tr("Grid view"));
+    gridCheckBox->setToolTip(tr("Show the measured trace of every headstage at once, each in a tile of its own"));
+    connect(gridCheckBox, SIGNAL(toggled(bool)), this, SLOT(showGrid()));
+
+    historyCheckBox = new QCheckBox(tr("Sweep history:"));
+    historyCheckBox->setToolTip(tr("Keep the finished sweeps of the measured trace, to look back through them; older ones are kept on disk"));
+    connect(historyCheckBox, SIGNAL(toggled(bool)), this, SLOT(showHistory()));
+    historySpinBox = new QSpinBox();
+    historySpinBox->setToolTip(tr("Sweep to show, counting from the first one recorded"));
+    historySpinBox->setRange(0, 0);
+    historySpinBox->setSpecialValueText(tr("none"));
+    historySpinBox->setEnabled(false);
+    connect(historySpinBox, SIGNAL(valueChanged(int)), this, SLOT(showHistorySweep(int)));
+    connect(sweepHistory, SIGNAL(sizeChanged(unsigned int)), this, SLOT(historySizeChanged(unsigned int)));
+    QHBoxLayout* historyLayout = new QHBoxLayout;
+    historyLayout->addWidget(historyCheckBox);
+    historyLayout->addWidget(historySpinBox);
+
+    spectrumComboBox = new QComboBox();
+    spectrumComboBox->setToolTip(tr("Plot the noise spectrum of a headstage's measured current (or voltage, in current clamp), updated a few times a second"));
+    spectrumComboBox->addItem(tr("Off"), -1);
+    for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+        if (state.board->chip[i]->present) {
+            spectrumComboBox->addItem(tr("Port %1").arg(QChar('A' + i)), i);
+        }
+    }
+    connect(spectrumComboBox, SIGNAL(currentIndexChanged(int)), this, SLOT(changeNoiseSpectrum(int)));
+    QHBoxLayout* spectrumLayout = new QHBoxLayout;
+    spectrumLayout->addWidget(new QLabel(tr("Noise spectrum:")));
+    spectrumLayout->addWidget(spectrumComboBox);
+
+    stripChartCheckBox = new QCheckBox(tr("Strip chart"));
+    stripChartCheckBox->setToolTip(tr("Scroll the measured trace continuously from sweep to sweep, rather than drawing each sweep from the left"));
+
+#ifdef CLAMP_OPENGL_PLOTS
+    openGLCheckBox = new QCheckBox(tr("GPU plots"));
+    openGLCheckBox->setToolTip(tr("Draw the traces with OpenGL"));
+#endif
+
     saveButton = new QPushButton(tr("Save Displayed"), this);
     saveButton->setToolTip(tr("Save the waveforms and settings currently displayed"));
 	saveButton->setEnabled(false);
@@ -143,27 +251,77 @@ void DisplayWindow::createControls() {
     controls->addStretch(1);
     controls->addWidget(overlayCheckBox);
     controls->addStretch(1);
+    controls->addWidget(doubleExponentialCheckBox);
+    controls->addStretch(1);
+    controls->addWidget(sweepAverageCheckBox);
+    controls->addStretch(1);
+    controls->addWidget(ivCheckBox);
+    controls->addStretch(1);
+    controls->addWidget(auxCheckBox);
+    controls->addStretch(1);
+    controls->addWidget(gridCheckBox);
+    controls->addStretch(1);
+    controls->addItem(historyLayout);
+    controls->addStretch(1);
+    controls->addItem(spectrumLayout);
+    controls->addStretch(1);
+    controls->addWidget(stripChartCheckBox);
+    controls->addStretch(1);
+#ifdef CLAMP_OPENGL_PLOTS
+    controls->addWidget(openGLCheckBox);
+    controls->addStretch(1);
+#endif
     controls->addWidget(saveButton);
     controls->addStretch(1);
     controls->addWidget(clearButton);
     controls->addStretch(1);
 }
 
-void DisplayWindow::connectPlot(Plot* plot, int oldUnit) {
+void DisplayWindow::connectPlot(Plot* plot, int oldUnit, int plotUnit) {
     connect(clearButton, SIGNAL(clicked()), &plot->data, SLOT(clearLines()));
     connect(autoScaleCheckBox, SIGNAL(toggled(bool)), plot, SLOT(setAutoScaling(bool)));
+    if (plot == measuredPlot) {
+        connect(stripChartCheckBox, SIGNAL(toggled(bool)), plot, SLOT(setScrolling(bool)));
+    }
+#ifdef CLAMP_OPENGL_PLOTS
+    connect(openGLCheckBox, SIGNAL(toggled(bool)), plot, SLOT(setOpenGL(bool)));
+#endif
 	disconnect(&state.datastore[oldUnit], SIGNAL(waveformDone()), plot, SLOT(autoScaleForce()));  
-    connect(&state.datastore[unit], SIGNAL(waveformDone()), plot, SLOT(autoScaleForce()));  
+    connect(&state.datastore[plotUnit], SIGNAL(waveformDone()), plot, SLOT(autoScaleForce()));  
 }
 
 void DisplayWindow::recreateDisplayLayout(int oldUnit) {
     layout->removeItem(controls);
+    if (grid) {
+        // Only the layout; the plots in it are deleted with the old plots
+        layout->removeItem(grid);
+        delete grid;
+        grid = nullptr;
+    }
+    int columns = (tiles.size() <= 2) ? 1 : ((tiles.size() <= 4) ? 2 : 4);
 
     for (auto& plot : plots)
     {
-        connectPlot(plot.get(), oldUnit);
+        auto tile = std::find_if(tiles.begin(), tiles.end(), [&](const pair<Plot*, int>& t) { return t.first == plot.get(); });
+        connectPlot(plot.get(), oldUnit, (tile == tiles.end()) ? unit : tile->second);
         plot->setAutoScaling(autoScaleCheckBox->isChecked());
-        layout->addWidget(plot.get());
+        plot->setScrolling(plot.get() == measuredPlot && stripChartCheckBox->isChecked());
+        plot->setScheduler(gridCheckBox->isChecked() ? gridScheduler : nullptr);
+#ifdef CLAMP_OPENGL_PLOTS
+        plot->setOpenGL(openGLCheckBox->isChecked());
+#endif
+        if (tile == tiles.end()) {
+            layout->addWidget(plot.get());
+        }
+        else {
+            // The grid goes where the first tile would have
+            if (!grid) {
+                grid = new QGridLayout;
+                layout->addLayout(grid);
+            }
+            int index = static_cast<int>(tile - tiles.begin());
+            grid->addWidget(plot.get(), index / columns, index % columns);
+        }
     }
     layout->addItem(controls);
 }
@@ -230,6 +388,7 @@ void DisplayWindow::adjustTAxis() {
 void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
     vector<unique_ptr<DataProcessor>> waveformProcessorsTmp;
     deque<unique_ptr<Plot>> plotsTmp;
+    vector<pair<Plot*, int>> tilesTmp;
 
     plotsTmp.clear();
 	unique_ptr<FilterProcessor> filter(new FilterProcessor(state.datastore[unit], state.datastore[unit].rawValues));
@@ -261,6 +420,7 @@ void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
     }
 
     unique_ptr<MeasuredWaveformProcessor> measured;
+    Plot* measuredPlotTmp = nullptr;
     if (config.measuredPlot()) {
         shared_ptr<Axis> yAxis;
 
@@ -273,6 +433,28 @@ void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
             yAxis = measuredVAxis;
         }
         plotsTmp.push_front(std::move(unique_ptr<Plot>(new Plot(this, measured->waveforms, tAxis, yAxis))));
+        measuredPlotTmp = plotsTmp.front().get();
+        if (gridCheckBox->isChecked()) {
+            tilesTmp.push_back(std::make_pair(measuredPlotTmp, unit));
+        }
+    }
+
+    if (measured && historyCheckBox->isChecked()) {
+        if (unit != historyUnit || config.measuredCurrent != historyCurrent) {
+            sweepHistory->clear();
+            historyUnit = unit;
+            historyCurrent = config.measuredCurrent;
+        }
+        measured->waveforms.setHistory(sweepHistory);
+        plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, historyLines, tAxis, config.measuredCurrent ? measuredIAxis : measuredVAxis))));
+    }
+    historySpinBox->setEnabled(measured && historyCheckBox->isChecked());
+
+    unique_ptr<SweepAverageProcessor> sweepAverage;
+    if (config.measuredPlot() && sweepAverageCheckBox->isChecked()) {
+        sweepAverage.reset(new SweepAverageProcessor(state.datastore[unit], *filter));
+        connect(clearButton, SIGNAL(clicked()), sweepAverage.get(), SLOT(restart()));
+        plotsTmp.push_front(std::move(unique_ptr<Plot>(new Plot(this, sweepAverage->average, tAxis, config.measuredCurrent ? measuredIAxis : measuredVAxis))));
     }
 
     unique_ptr<DCCalculationProcessor> dcCalculation;
@@ -281,10 +463,25 @@ void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
     unique_ptr<ExponentialPlotProcessor> expPlot;
     unique_ptr<ResistanceCalculationWaveformProcessor> resistanceCalculations;
     unique_ptr<CellParameterProcessor> cellParameters;
+    unique_ptr<IVPlotProcessor> ivPlot;
 
-    if (config.dcCalculation()) {
+    if (config.dcCalculation() || ivCheckBox->isChecked()) {
         dcCalculation.reset(new DCCalculationProcessor(state.datastore[unit], *filter));
     }
+    if (ivCheckBox->isChecked()) {
+        ivPlot.reset(new IVPlotProcessor(state.datastore[unit], *dcCalculation));
+        // x is the applied value and y the measured one: the same ranges as the applied and measured plots' y axes, zoomed separately
+        const int MAX_NUM_STEPS = 10;
+        if (config.appliedVoltage) {
+            ivXAxis.reset(new Axis(MAX_NUM_STEPS, 11, "V", "clamp voltage", 1, -5, 5, -1, false));
+            ivYAxis.reset(new Axis(MAX_NUM_STEPS, 6, "A", "measured current", 2, -12, 2, -4, false));
+        }
+        else {
+            ivXAxis.reset(new Axis(MAX_NUM_STEPS, 6, "A", "clamp current", 2, -12, 2, -4, false));
+            ivYAxis.reset(new Axis(MAX_NUM_STEPS, 11, "V", "measured voltage", 1, -5, 5, -1, false));
+        }
+        plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, ivPlot->iv, ivXAxis, ivYAxis))));
+    }
     if (config.showDCCalculations) {
         dcPlotProcessor.reset(new DCPlotProcessor(state.datastore[unit], measured->waveforms, *dcCalculation));
     }
@@ -306,8 +503,10 @@ void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
 	add(waveformProcessorsTmp, appliedPlusAdc);
     add(waveformProcessorsTmp, vcell);
     add(waveformProcessorsTmp, measured);
+    add(waveformProcessorsTmp, sweepAverage);
     add(waveformProcessorsTmp, dcCalculation);
     add(waveformProcessorsTmp, dcPlotProcessor);
+    add(waveformProcessorsTmp, ivPlot);
     add(waveformProcessorsTmp, exp);
     add(waveformProcessorsTmp, expPlot);
     add(waveformProcessorsTmp, resistanceCalculations);
@@ -319,14 +518,167 @@ void DisplayWindow::setupPlotsAndCalculations(int oldUnit) {
         add(waveformProcessorsTmp, resistance);
     }
 
+    if (auxCheckBox->isChecked()) {
+        unique_ptr<AuxWaveformProcessor> aux(new AuxWaveformProcessor(state.datastore[unit]));
+        plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, aux->adcWaveforms, tAxis, adcAxis))));
+        plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, aux->digitalWaveforms, tAxis, digitalAxis))));
+        add(waveformProcessorsTmp, aux);
+    }
+
+    // The other headstages' tiles each need a filter and a measured waveform processor, in that headstage's DataStore
+    vector<unique_ptr<DataProcessor>> tileProcessors[CLAMP::MAX_NUM_CHIPS];
+    vector<int> gridUnitsTmp;
+    if (gridCheckBox->isChecked()) {
+        const int MAX_NUM_STEPS = 10;
+        for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+            if (i == unit || !state.board->chip[i]->present) {
+                continue;
+            }
+            unique_ptr<FilterProcessor> tileFilter(new FilterProcessor(state.datastore[i], state.datastore[i].rawValues));
+            applyLowPassFilter(state.datastore[i], lowPassFilterComboBox->currentIndex());
+            unique_ptr<MeasuredWaveformProcessor> tileMeasured(new MeasuredWaveformProcessor(state.datastore[i], *tileFilter, false));
+
+            QString port = QString("port %1").arg(QChar('A' + i));
+            shared_ptr<Axis>& yAxis = measuresCurrent(i) ? gridIAxes[i] : gridVAxes[i];
+            if (!yAxis) {
+                if (measuresCurrent(i)) {
+                    yAxis.reset(new Axis(MAX_NUM_STEPS, 6, "A", port + " current", 2, -12, 2, -4, false));
+                }
+                else {
+                    yAxis.reset(new Axis(MAX_NUM_STEPS, 11, "V", port + " voltage", 1, -5, 5, -1, false));
+                }
+            }
+            plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, tileMeasured->waveforms, tAxis, yAxis))));
+            tilesTmp.push_back(std::make_pair(plotsTmp.back().get(), i));
+
+            add(tileProcessors[i], tileFilter);
+            add(tileProcessors[i], tileMeasured);
+            gridUnitsTmp.push_back(i);
+        }
+        std::sort(tilesTmp.begin(), tilesTmp.end(), [](const pair<Plot*, int>& a, const pair<Plot*, int>& b) { return a.second < b.second; });
+    }
+
+    // Not a DataProcessor: the spectrum is computed from the board's reads, apart from the waveform processing
+    restartNoiseSpectrum();
+    if (noiseSpectrum) {
+        plotsTmp.push_back(std::move(unique_ptr<Plot>(new Plot(this, spectrumLines, frequencyAxis, spectrumCurrent ? spectrumIAxis : spectrumVAxis))));
+    }
+
     plots.swap(plotsTmp);
+    measuredPlot = measuredPlotTmp;
+    tiles.swap(tilesTmp);
     recreateDisplayLayout(oldUnit);
 	
     plotsTmp.clear();
     state.datastore[unit].setProcessors(waveformProcessorsTmp);
+
+    // Headstages whose tiles are gone don't need their processors any more
+    for (int i : gridUnits) {
+        if (i != unit && std::find(gridUnitsTmp.begin(), gridUnitsTmp.end(), i) == gridUnitsTmp.end()) {
+            vector<unique_ptr<DataProcessor>> none;
+            state.datastore[i].setProcessors(none);
+        }
+    }
+    for (int i : gridUnitsTmp) {
+        state.datastore[i].setProcessors(tileProcessors[i]);
+    }
+    gridUnits.swap(gridUnitsTmp);
 }
 
 
+void DisplayWindow::showSweepAverage() {
+    setupPlotsAndCalculations(unit);
+}
+
+void DisplayWindow::showIVPlot() {
+    setupPlotsAndCalculations(unit);
+}
+
+void DisplayWindow::showAuxPlots() {
+    setupPlotsAndCalculations(unit);
+}
+
+void DisplayWindow::showGrid() {
+    setupPlotsAndCalculations(unit);
+}
+
+void DisplayWindow::showHistory() {
+    if (!historyCheckBox->isChecked()) {
+        sweepHistory->clear();
+        historyUnit = -1;
+    }
+    setupPlotsAndCalculations(unit);
+}
+
+// Shows sweep number (from 1), or none for 0
+void DisplayWindow::showHistorySweep(int number) {
+    historyLines.setLines((number > 0) ? sweepHistory->sweep(number - 1) : vector<Line>());
+}
+
+// Follows the newest sweep, unless an older one was chosen
+void DisplayWindow::historySizeChanged(unsigned int count) {
+    bool following = (historySpinBox->value() == historySpinBox->maximum());
+    historySpinBox->setMaximum(static_cast<int>(count));
+    if (following) {
+        historySpinBox->setValue(static_cast<int>(count));
+    }
+}
+
+// Whether headstage unit_ is in voltage clamp, so that its measured trace is current (going by its tab in the ControlWindow)
+bool DisplayWindow::measuresCurrent(int unit_) const {
+    ControlWindow* control = state.datastore[unit_].controlWindow;
+    return (control && control->tabWidget[unit_]) ? (control->tabWidget[unit_]->currentIndex() == 0) : config.measuredCurrent;
+}
+
+void DisplayWindow::changeNoiseSpectrum(int) {
+    setupPlotsAndCalculations(unit);
+}
+
+// Starts, stops, or restarts noiseSpectrum to match the port chosen and the quantity the display is showing.  The port
+// is taken to be in the same clamp mode as the display's.
+void DisplayWindow::restartNoiseSpectrum() {
+    int port = spectrumComboBox->itemData(spectrumComboBox->currentIndex()).toInt();
+    bool current = config.measuredCurrent;
+    if (port == spectrumPort && current == spectrumCurrent) {
+        return;
+    }
+
+    spectrumTimer->stop();
+    noiseSpectrum.reset();
+    spectrumLines.clearLines();
+    spectrumPort = port;
+    spectrumCurrent = current;
+    if (port < 0) {
+        return;
+    }
+    try {
+        noiseSpectrum.reset(new NoiseSpectrum(*state.board));
+        noiseSpectrum->start(ClampConfig::ChipChannel(port, 0), current ? Board::MEASURED_CURRENT : Board::MEASURED_VOLTAGE);
+        spectrumTimer->start();
+    }
+    catch (exception& e) {
+        noiseSpectrum.reset();
+        QMessageBox::critical(this, "Error starting noise spectrum", e.what());
+    }
+}
+
+// Replots the latest spectrum, as amplitude density; the DC bin is left out
+void DisplayWindow::updateNoiseSpectrum() {
+    // Shed while the host can't keep up with the board (see OverloadController)
+    if (noiseSpectrum) {
+        noiseSpectrum->setPaused(state.overload.getLevel() >= OverloadController::SHED_SPECTRUM);
+    }
+    vector<double> frequencies, psd;
+    if (!noiseSpectrum || !noiseSpectrum->getSpectrum(frequencies, psd)) {
+        return;
+    }
+    vector<Line> lines(1);
+    for (std::size_t i = 1; i < psd.size(); i++) {
+        lines[0].addPoint(frequencies[i], std::sqrt(psd[i]));
+    }
+    spectrumLines.setLines(std::move(lines));
+}
+
 void DisplayWindow::setPlotOptions(const PlotConfiguration& config_, int unit_) {
 	int oldUnit = unit;
     config = config_;
@@ -339,10 +691,17 @@ void DisplayWindow::setPlotOptions(const PlotConfiguration& config_, int unit_)
 
 void DisplayWindow::changeLowPassFilter(int index)
 {
-    state.datastore[unit].enableLowPassFilter(index != 0);
+    applyLowPassFilter(state.datastore[unit], index);
+    for (int i : gridUnits) {
+        applyLowPassFilter(state.datastore[i], index);
+    }
+}
+
+void DisplayWindow::applyLowPassFilter(DataStore& datastore, int index) {
+    datastore.enableLowPassFilter(index != 0);
     if (index != 0) {
         const double freqs[] = { 0, 1000.0, 2000.0, 5100.0, 10800.0 };
-        state.datastore[unit].setLowPassFilterCutoff(freqs[index]);
+        datastore.setLowPassFilterCutoff(freqs[index]);
     }
 }
 
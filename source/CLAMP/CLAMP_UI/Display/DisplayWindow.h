@@ -11,11 +11,17 @@ class QLayoutItem;
 class QPushButton;
 class QCheckBox;
 class QComboBox;
+class QSpinBox;
 class QHBoxLayout;
+class QGridLayout;
+class PlotScheduler;
+class SweepHistory;
 class QVBoxLayout;
+class QTimer;
 
 namespace CLAMP {
     class Board;
+    class NoiseSpectrum;
     namespace IO {
         struct Settings;
     }
@@ -57,9 +63,11 @@ class DisplayWindow : public QMainWindow
 
     GlobalState& state;
 public:
-    DisplayWindow(GlobalState& state_, const std::string& calibrationReport_, int unit_);
+    DisplayWindow(GlobalState& state_, int unit_);
     ~DisplayWindow();
 
+    void setCalibrationReport(const std::string& report);
+
     void fillSettings(CLAMP::IO::Settings& settings);
     void setPlotOptions(const PlotConfiguration& config_, int unit_);
 	void setUnit(int unit_);
@@ -68,6 +76,9 @@ public:
 
 protected:
     void closeEvent(QCloseEvent *event);
+    void showEvent(QShowEvent* event);
+    void hideEvent(QHideEvent* event);
+    void changeEvent(QEvent* event);
 
 private slots:
     void viewCalibrationReport();
@@ -76,6 +87,15 @@ private slots:
     void setThreadStatus(bool running);
     void errorMessage(const char* title, const char* message);
     void adjustTAxis();
+    void showSweepAverage();
+    void showIVPlot();
+    void showAuxPlots();
+    void showGrid();
+    void showHistory();
+    void showHistorySweep(int number);
+    void historySizeChanged(unsigned int count);
+    void changeNoiseSpectrum(int index);
+    void updateNoiseSpectrum();
 
 private:
     DisplayWindow(const DisplayWindow&); // Don't do it
@@ -109,9 +129,46 @@ private:
     // Other
     QCheckBox* autoScaleCheckBox;
     QCheckBox* overlayCheckBox;
+    QCheckBox* doubleExponentialCheckBox;
+    QCheckBox* sweepAverageCheckBox;
+    QCheckBox* ivCheckBox;
+    QCheckBox* auxCheckBox;
+    QCheckBox* gridCheckBox;
+    QCheckBox* historyCheckBox;
+    QSpinBox* historySpinBox;
+    QComboBox* spectrumComboBox;
+    QCheckBox* stripChartCheckBox;
+#ifdef CLAMP_OPENGL_PLOTS
+    QCheckBox* openGLCheckBox;
+#endif
     QPushButton* clearButton;
 
+    // Noise spectrum of the headstage chosen in spectrumComboBox, computed in the background (see CLAMP::NoiseSpectrum)
+    // and plotted by spectrumTimer; declared before plots, which may hold a Plot of spectrumLines
+    std::unique_ptr<CLAMP::NoiseSpectrum> noiseSpectrum;
+    int spectrumPort;    // Port noiseSpectrum is watching, or -1
+    bool spectrumCurrent; //   and whether it's the measured current (rather than voltage)
+    QTimer* spectrumTimer;
+    Lines spectrumLines;
+    void restartNoiseSpectrum();
+
+    // Sweep history: the measured trace's finished sweeps, recorded in sweepHistory, and the one chosen in historySpinBox
+    // shown from historyLines (also declared before plots).  Started over when the headstage or what it measures changes.
+    SweepHistory* sweepHistory;
+    Lines historyLines;
+    int historyUnit;
+    bool historyCurrent;
+
     std::deque<std::unique_ptr<Plot>> plots;
+    Plot* measuredPlot; // The one in plots that stripChartCheckBox applies to, if any
+
+    // Grid view: the measured trace of each present headstage, as tiles in grid, all redrawn by gridScheduler
+    QGridLayout* grid;
+    PlotScheduler* gridScheduler;
+    std::vector<std::pair<Plot*, int>> tiles; // The plots in grid, by headstage, and each one's headstage
+    std::vector<int> gridUnits;               // Headstages other than unit whose DataStores have processors for tiles
+    bool measuresCurrent(int unit_) const;
+
     // Various axes, so that we can keep the zoom level(s)
     std::shared_ptr<Axis> tAxis;
     std::shared_ptr<Axis> tAxis2;
@@ -120,8 +177,19 @@ private:
     std::shared_ptr<Axis> measuredVAxis;
     std::shared_ptr<Axis> appliedIAxis;
     std::shared_ptr<Axis> measuredIAxis;
-
-    void connectPlot(Plot* plot, int oldUnit);
+    std::shared_ptr<Axis> ivXAxis;
+    std::shared_ptr<Axis> ivYAxis;
+    std::shared_ptr<Axis> frequencyAxis;
+    std::shared_ptr<Axis> spectrumIAxis;
+    std::shared_ptr<Axis> spectrumVAxis;
+    std::shared_ptr<Axis> adcAxis;
+    std::shared_ptr<Axis> digitalAxis;
+    std::shared_ptr<Axis> gridIAxes[CLAMP::MAX_NUM_CHIPS];
+    std::shared_ptr<Axis> gridVAxes[CLAMP::MAX_NUM_CHIPS];
+
+    void connectPlot(Plot* plot, int oldUnit, int plotUnit);
+    void applyLowPassFilter(DataStore& datastore, int index);
+    void updateDisplayActive();
 
     PlotConfiguration config;
     void setupPlotsAndCalculations(int oldUnit);
@@ -1,6 +1,9 @@
 #include "Line.h"
 #include "common.h"
 #include "streams.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 
 using std::vector;
 using std::deque;
@@ -19,9 +22,23 @@ void Range::applyUnion(const Range& other) {
 }
 //------------------------------------------------------------
 
+// Segments are built on the processing threads as well as the GUI thread
+uint64_t SegmentId::next() {
+    static std::atomic<uint64_t> lastId(0);
+    return ++lastId;
+}
+
+// Points within this fraction of dt of where uniform sampling puts them still count as uniformly sampled
+static const double UNIFORM_TOLERANCE = 1e-3;
+
 LineSegment::LineSegment() :
+    id(),
     tRange(),
-    yRange()
+    yRange(),
+    uniform(true),
+    t0(0),
+    dt(0),
+    levelsUpTo(0)
 {
 
 }
@@ -34,29 +51,231 @@ Range LineSegment::getYRange() const {
     return yRange;
 }
 
-unsigned int LineSegment::getFirstIndexToDraw(double tMin) {
-    auto res = std::upper_bound(t.begin(), t.end(), tMin);
-    unsigned int val = res - t.begin();
+// Number of points with t <= value, for a uniformly sampled segment
+static std::size_t uniformCount(double value, double t0, double dt, std::size_t n) {
+    if (n == 0 || value < t0) {
+        return 0;
+    }
+    if (dt <= 0) {
+        return 1;
+    }
+    double count = std::floor((value - t0) / dt) + 1;
+    return (count >= n) ? n : static_cast<std::size_t>(count);
+}
+
+// Index of the last point at or before tMin (or 0, if there isn't one)
+unsigned int LineSegment::getFirstIndexToDraw(double tMin) const {
+    std::size_t count = uniform ? uniformCount(tMin, t0, dt, y.size()) : std::upper_bound(t.begin(), t.end(), tMin) - t.begin();
+    unsigned int val = static_cast<unsigned int>(count);
     if (val > 0) {
         val--;
     }
     return val;
 }
 
+// Index of the first point after tMax (or the last point, if there isn't one)
+unsigned int LineSegment::getLastIndexToDraw(double tMax) const {
+    std::size_t count = uniform ? uniformCount(tMax, t0, dt, y.size()) : std::upper_bound(t.begin(), t.end(), tMax) - t.begin();
+    if (!y.empty() && count > y.size() - 1) {
+        count = y.size() - 1;
+    }
+    return static_cast<unsigned int>(count);
+}
+
+// Copy of the points that drawing [tMin, tMax] uses (see getFirstIndexToDraw and getLastIndexToDraw)
+LineSegment LineSegment::slice(double tMin, double tMax) const {
+    if (y.empty()) {
+        return LineSegment();
+    }
+    return sliceIndices(getFirstIndexToDraw(tMin), getLastIndexToDraw(tMax));
+}
+
+// Copy of points first through last
+LineSegment LineSegment::sliceIndices(std::size_t first, std::size_t last) const {
+    if (y.empty() || first > last) {
+        return LineSegment();
+    }
+    if (first == 0 && last + 1 == y.size()) {
+        // All of it, levels of detail included
+        return *this;
+    }
+
+    LineSegment result;
+    result.y.assign(y.begin() + first, y.begin() + last + 1);
+    result.uniform = uniform;
+    if (uniform) {
+        result.t0 = tAt(first);
+        result.dt = dt;
+    }
+    else {
+        result.t.assign(t.begin() + first, t.begin() + last + 1);
+    }
+    result.tRange = Range(result.tFront(), result.tBack());
+    auto extremes = std::minmax_element(result.y.begin(), result.y.end());
+    result.yRange = Range(*extremes.first, *extremes.second);
+    return result;
+}
+
+// Records the time of point #index, switching to explicit times if it isn't where uniform sampling would put it
+void LineSegment::appendT(std::size_t index, double tValue) {
+    if (uniform) {
+        if (index == 0) {
+            t0 = tValue;
+            return;
+        }
+        if (index == 1 && tValue > t0) {
+            dt = tValue - t0;
+            return;
+        }
+        if (index > 1 && std::abs(tValue - (t0 + index * dt)) <= UNIFORM_TOLERANCE * dt) {
+            return;
+        }
+
+        // Switch to explicit times
+        t.resize(index);
+        for (std::size_t i = 0; i < index; i++) {
+            t[i] = t0 + i * dt;
+        }
+        uniform = false;
+    }
+    t.push_back(tValue);
+}
+
 void LineSegment::append(const LineSegment& other) {
     tRange.applyUnion(other.getTRange());
     yRange.applyUnion(other.getYRange());
-    t.insert(t.end(), other.t.begin(), other.t.end());
+    for (std::size_t i = 0; i < other.size(); i++) {
+        appendT(y.size() + i, other.tAt(i));
+    }
     y.insert(y.end(), other.y.begin(), other.y.end());
 }
 
 void LineSegment::append(double t, double y) {
-    this->t.push_back(t);
+    appendT(this->y.size(), t);
     this->y.push_back(y);
     tRange.applyUnion(Range(t, t));
     yRange.applyUnion(Range(y, y));
 }
 
+// Append n points at once
+void LineSegment::append(const double* t, const double* y, unsigned int n) {
+    if (n == 0) {
+        return;
+    }
+    Range newY(y[0], y[0]);
+    for (unsigned int i = 1; i < n; i++) {
+        newY.min = std::min(newY.min, y[i]);
+        newY.max = std::max(newY.max, y[i]);
+    }
+    // Times are increasing
+    tRange.applyUnion(Range(t[0], t[n - 1]));
+    yRange.applyUnion(newY);
+    for (unsigned int i = 0; i < n; i++) {
+        appendT(this->y.size() + i, t[i]);
+    }
+    this->y.insert(this->y.end(), y, y + n);
+}
+
+template <class T>
+static std::size_t vectorBytes(const vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+// Heap storage held by the points, explicit times, and levels of detail
+std::size_t LineSegment::memoryBytes() const {
+    std::size_t total = vectorBytes(y) + vectorBytes(t) + vectorBytes(levels);
+    for (const vector<LineBucket>& level : levels) {
+        total += vectorBytes(level);
+    }
+    return total;
+}
+
+// Number of levels of detail, including level 0 (the points themselves)
+unsigned int LineSegment::numLevels() {
+    updateLevels();
+    return static_cast<unsigned int>(levels.size()) + 1;
+}
+
+// Buckets at the given level of detail (1 <= level < numLevels()); each covers LOD_FACTOR^level points
+const vector<LineBucket>& LineSegment::getLevel(unsigned int level) {
+    updateLevels();
+    return levels[level - 1];
+}
+
+// Folds src, which comes after everything already in b, into b
+static void mergeBucket(LineBucket& b, const LineBucket& src) {
+    b.tLast = src.tLast;
+    b.yLast = src.yLast;
+    bool newMin = src.yMin < b.yMin;
+    bool newMax = src.yMax > b.yMax;
+    if (newMin) {
+        b.yMin = src.yMin;
+    }
+    if (newMax) {
+        b.yMax = src.yMax;
+    }
+    if (newMin && newMax) {
+        b.minFirst = src.minFirst;
+    }
+    else if (newMin) {
+        b.minFirst = false;
+    }
+    else if (newMax) {
+        b.minFirst = true;
+    }
+}
+
+// Brings the levels of detail up to date with the points appended since the last call
+void LineSegment::updateLevels() {
+    std::size_t n = y.size();
+    if (n == levelsUpTo) {
+        return;
+    }
+    if (n < levelsUpTo) {
+        levels.clear();
+        levelsUpTo = 0;
+    }
+
+    // Only the buckets from the one containing the first changed item onward need recomputing
+    std::size_t firstChanged = levelsUpTo;
+    std::size_t sourceSize = n;
+    for (unsigned int level = 0; sourceSize > 1; level++) {
+        if (levels.size() <= level) {
+            levels.resize(level + 1);
+        }
+        vector<LineBucket>& buckets = levels[level];
+        std::size_t firstBucket = firstChanged / LOD_FACTOR;
+        std::size_t numBuckets = (sourceSize + LOD_FACTOR - 1) / LOD_FACTOR;
+        buckets.resize(numBuckets);
+
+        for (std::size_t b = firstBucket; b < numBuckets; b++) {
+            std::size_t begin = b * LOD_FACTOR;
+            std::size_t end = std::min(begin + LOD_FACTOR, sourceSize);
+            for (std::size_t i = begin; i < end; i++) {
+                LineBucket source;
+                if (level == 0) {
+                    source.tFirst = source.tLast = tAt(i);
+                    source.yFirst = source.yLast = source.yMin = source.yMax = y[i];
+                    source.minFirst = true;
+                }
+                else {
+                    source = levels[level - 1][i];
+                }
+                if (i == begin) {
+                    buckets[b] = source;
+                }
+                else {
+                    mergeBucket(buckets[b], source);
+                }
+            }
+        }
+
+        firstChanged = firstBucket;
+        sourceSize = numBuckets;
+    }
+    levelsUpTo = n;
+}
+
 //-------------------------------------------------------------------------
 
 // This is a class holding data for a waveform to be plotted by the
@@ -73,6 +292,13 @@ Line::~Line()
 {
 }
 
+// Empties the line, keeping the storage of its deques
+void Line::clear() {
+    data.clear();
+    oldData.clear();
+    currentIndex = 0;
+}
+
 void Line::addLineSegment() {
     data.push_back(LineSegment());
 }
@@ -86,12 +312,21 @@ void Line::addPoint(double t, double y)
     data.back().append(t, y);
 }
 
+// Add n (time, data) points to waveform.
+void Line::addPoints(const double* t, const double* y, unsigned int n)
+{
+    if (data.empty()) {
+        addLineSegment();
+    }
+    data.back().append(t, y, n);
+}
+
 // Return length of waveform.
 int Line::length() const
 {
     int value = 0;
     for (const LineSegment& lineSegment : data) {
-        value += lineSegment.t.size();
+        value += lineSegment.size();
     }
     return value;
 }
@@ -103,8 +338,8 @@ BinaryWriter& operator<<(BinaryWriter &outStream, const Line &a)
 
     // First write t vector...
     for (auto& piece : a.data) {
-        for (double value : piece.t) {
-            outStream << value;
+        for (std::size_t i = 0; i < piece.size(); i++) {
+            outStream << piece.tAt(i);
         }
     }
 
@@ -118,6 +353,24 @@ BinaryWriter& operator<<(BinaryWriter &outStream, const Line &a)
     return outStream;
 }
 
+static std::size_t segmentBytes(const deque<LineSegment>& segments) {
+    std::size_t total = 0;
+    for (const LineSegment& segment : segments) {
+        total += sizeof(LineSegment) + segment.memoryBytes();
+    }
+    return total;
+}
+
+// Bytes held by the current sweep's pieces
+std::size_t Line::dataBytes() const {
+    return segmentBytes(data);
+}
+
+// Bytes held by the finished sweep's pieces
+std::size_t Line::oldDataBytes() const {
+    return segmentBytes(oldData);
+}
+
 Range Line::getTRange() const {
     Range result;
     for (const LineSegment& lineSegment : data) {
@@ -132,10 +385,10 @@ Range Line::getTRange() const {
 }
 
 double Line::maxT() const {
-    if (data.empty() || data.back().t.empty()) {
+    if (data.empty() || data.back().empty()) {
         return 0;
     }
-    return data.back().t.back();
+    return data.back().tBack();
 }
 
 Range Line::getYRange() const {
@@ -149,38 +402,48 @@ Range Line::getYRange() const {
 
 unsigned int Line::getFirstPieceToDraw(double tMin) {
     unsigned int result = data.size() - 1;
-    while (result > 0 && !data[result].t.empty() && data[result].t[0] > tMin) {
+    while (result > 0 && !data[result].empty() && data[result].tFront() > tMin) {
         result--;
     }
     return result;
 }
 
-void Line::append(unsigned int startIndex, const Line& other) {
+// Appends other's pieces, moving them out of it; returns the time range of any finished pieces (oldData) that were
+// discarded as a result
+Range Line::append(unsigned int startIndex, Line&& other) {
+    Range removed;
     if (!other.data.empty()) {
         auto start = other.data.begin();
         if (currentIndex == startIndex) {
             if (!data.empty()) {
-                // We need to append the existing piece
-                data.back().append(*start);
+                // We need to append the existing piece; if it has no points yet, other's can simply take its place
+                if (data.back().empty()) {
+                    data.back() = std::move(*start);
+                }
+                else {
+                    data.back().append(*start);
+                }
                 start++;
             }
         }
 
         for (auto iter = start; iter != other.data.end(); iter++) {
-            if (!iter->t.empty()) {
-                data.insert(data.end(), *iter);
+            if (!iter->empty()) {
+                data.push_back(std::move(*iter));
             }
         }
         currentIndex = startIndex;
     }
     // Get rid of any pieces that are completely invalidated
     if (!data.empty()) {
-        auto& currentTs = data.back().t;
-        if (!currentTs.empty()) {
-            double tMax = currentTs.back();
-            while (!oldData.empty() && !oldData.front().t.empty() && (oldData.front().t.back() < tMax)) {
+        const LineSegment& current = data.back();
+        if (!current.empty()) {
+            double tMax = current.tBack();
+            while (!oldData.empty() && !oldData.front().empty() && (oldData.front().tBack() < tMax)) {
+                removed.applyUnion(oldData.front().getTRange());
                 oldData.pop_front();
             }
         }
     }
+    return removed;
 }
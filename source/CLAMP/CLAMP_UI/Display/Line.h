@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <deque>
+#include <cstdint>
 #include <QColor>
 
 struct Range {
@@ -15,21 +16,92 @@ struct Range {
 };
 
 class BinaryWriter;
+/* Summary of a run of consecutive points in a LineSegment, used to draw it at low zoom without looking at every point.
+ * Drawing first, the two extremes (in the order they occurred), and last looks the same as drawing every point in the run.
+ */
+struct LineBucket {
+    double tFirst;
+    double tLast;
+    double yFirst;
+    double yLast;
+    double yMin;
+    double yMax;
+    bool minFirst; // True if yMin occurred before yMax
+};
+
+/* Identifies a LineSegment's points, for caches of them (e.g., PlotCanvasGL's vertex buffers); a segment's address can
+ * be reused by a different one.  A new segment, or a copy, gets a new id; a moved segment keeps its id (the one moved from
+ * gets a new one), and so does a segment that's appended to, since its earlier points don't change.
+ */
+class SegmentId {
+public:
+    SegmentId() : value(next()) {}
+    SegmentId(const SegmentId&) : value(next()) {}
+    SegmentId(SegmentId&& other) : value(other.value) { other.value = next(); }
+    SegmentId& operator=(const SegmentId&) { value = next(); return *this; }
+    SegmentId& operator=(SegmentId&& other) { value = other.value; other.value = next(); return *this; }
+
+    uint64_t get() const { return value; }
+
+private:
+    uint64_t value;
+
+    static uint64_t next();
+};
+
+/* A run of (t, y) points, with t increasing.
+ *
+ * Most producers add uniformly sampled points, so as long as the points are evenly spaced in t, only t0 and dt are stored
+ * and t[i] = t0 + i * dt.  The first point that doesn't fit switches the segment to storing every t value.  Use tAt()
+ * and friends rather than assuming either representation.
+ */
 struct LineSegment {
-    std::vector<double> t;
     std::vector<double> y;
 
+    // Each level of detail summarizes LOD_FACTOR buckets of the level below it
+    static const unsigned int LOD_FACTOR = 8;
+
     LineSegment();
     Range getTRange() const;
     Range getYRange() const;
 
-    unsigned int getFirstIndexToDraw(double tMin);
+    std::size_t size() const { return y.size(); }
+    bool empty() const { return y.empty(); }
+    double tAt(std::size_t i) const { return uniform ? t0 + i * dt : t[i]; }
+    double tFront() const { return tAt(0); }
+    double tBack() const { return tAt(y.size() - 1); }
+    bool isUniform() const { return uniform; }
+    uint64_t getId() const { return id.get(); } // See SegmentId
+
+    unsigned int getFirstIndexToDraw(double tMin) const;
+    unsigned int getLastIndexToDraw(double tMax) const;
+    LineSegment slice(double tMin, double tMax) const;
+    LineSegment sliceIndices(std::size_t first, std::size_t last) const;
     void append(const LineSegment& other);
     void append(double t, double y);
+    void append(const double* t, const double* y, unsigned int n);
+
+    unsigned int numLevels();
+    const std::vector<LineBucket>& getLevel(unsigned int level);
+    std::size_t memoryBytes() const;
 
 private:
+    SegmentId id;
     Range tRange;
     Range yRange;
+
+    bool uniform;
+    double t0;
+    double dt;
+    std::vector<double> t; // Only used if !uniform
+
+    void appendT(std::size_t index, double tValue);
+
+    // levels[i] has buckets of LOD_FACTOR^(i+1) points; brought up to date lazily, from the points added since
+    std::vector<std::vector<LineBucket>> levels;
+    std::size_t levelsUpTo; // Number of points included in levels
+
+    void updateLevels();
 };
 
 class Line
@@ -45,12 +117,16 @@ public:
     QColor color;
 
     void addPoint(double t, double y);
+    void addPoints(const double* t, const double* y, unsigned int n);
     Range getTRange() const;
     Range getYRange() const;
     double maxT() const;
     void addLineSegment();
     unsigned int getFirstPieceToDraw(double tMin);
-    void append(unsigned int startIndex, const Line& other);
+    Range append(unsigned int startIndex, Line&& other);
+    void clear();
+    std::size_t dataBytes() const;
+    std::size_t oldDataBytes() const;
 
 private:
     int length() const;
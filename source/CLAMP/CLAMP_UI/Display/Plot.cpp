@@ -2,6 +2,8 @@
 #include <vector>
 #include <queue>
 #include <iostream>
+#include <limits>
+#include <cmath>
 
 #include "Plot.h"
 #include "globalconstants.h"
@@ -10,297 +12,21 @@
 #include "common.h"
 #include "SaveFile.h"
 #include "GUIUtil.h"
+#include "PlotGL.h"
+#include "PlotScheduler.h"
+#include "SweepHistory.h"
+#include "Trace.h"
+#include "LoopTiming.h"
+#include <atomic>
+#include <chrono>
 
 using std::lock_guard;
+using std::mutex;
 using std::recursive_mutex;
 using std::vector;
 using std::pair;
 using std::shared_ptr;
 
-// ----------------------------------------------------------------------------------------------------------
-AxisStep::AxisStep(int stepIndex_, int minStep_, int maxStep_) :
-    stepIndex(stepIndex_),
-    minStep(minStep_),
-    maxStep(maxStep_)
-{
-
-}
-
-// ----------------------------------------------------------------------------------------------------------
-Axis::Axis(unsigned int numSteps_, int stepIndex_, const QString& unit_, const QString& name_, unsigned int startValue, int startExponent, unsigned int endValue, int endExponent, bool positiveOnly_) :
-    autoscalable(true),
-    zoomIndex(0),
-    unit(unit_),
-    name(name_),
-    positiveOnly(positiveOnly_)
-{
-    settings.push_back(AxisStep(stepIndex_, positiveOnly_ ? 0 : -static_cast<int>(numSteps_ / 2), positiveOnly_ ? numSteps_ : numSteps_ / 2));
-
-    unsigned int val = startValue;
-    int exp = startExponent;
-    for(;;) {
-        // val * 10^exp
-        stepValues.push_back(val * pow(10, exp));
-        if (val == endValue && exp == endExponent) {
-            break;
-        }
-        switch (val) {
-            case 1:
-                val = 2;
-                break;
-            case 2:
-                val = 5;
-                break;
-            case 5:
-                val = 1;
-                exp++;
-                break;
-        }
-    }
-
-}
-
-AxisStep& Axis::current() {
-    return settings[zoomIndex];
-}
-
-const AxisStep& Axis::current() const {
-    return settings[zoomIndex];
-}
-
-double Axis::getStep() const {
-    return stepValues[current().stepIndex];
-}
-
-double Axis::getAxisMagnitude() const {
-    return std::max(std::abs(minAxisValue()), std::abs(maxAxisValue()));
-}
-
-double Axis::minAxisValue() const {
-    return minStepValue() * getStep();
-}
-
-// Return maximum value of currently displayed axis.
-double Axis::maxAxisValue() const {
-    return maxStepValue() * getStep();
-}
-
-int Axis::minStepValue() const {
-    return current().minStep;
-}
-
-int Axis::maxStepValue() const {
-    return current().maxStep;
-}
-
-
-int Axis::numberOfSteps() const {
-    return current().maxStep - current().minStep;
-}
-
-void Axis::adjustStepIndex(int delta)
-{
-    int stepIndexNew = current().stepIndex + delta;
-
-    stepIndexNew = std::max(stepIndexNew, 0);
-    stepIndexNew = std::min(stepIndexNew, static_cast<int>(stepValues.size()) - 1);
-
-    changeScale(stepIndexNew, current().minStep, current().maxStep);
-}
-
-QString Axis::getLabel() const {
-    double step = getAxisMagnitude();
-    QString prefix;
-    if (step >= 0.2e9) { prefix = "G"; }
-    else if (step >= 0.2e6) { prefix = "M"; }
-    else if (step >= 0.2e3) { prefix = "k"; }
-    else if (step >= 0.2) { prefix = ""; }
-    else if (step >= 0.2e-3) { prefix = "m"; }
-    else if (step >= 0.2e-6) { prefix = QSTRING_MU_SYMBOL; }
-    else if (step >= 0.2e-9) { prefix = "n"; }
-    else { prefix = "p"; }
-
-    return name + " (" + prefix + unit + ")";
-}
-
-QString Axis::getTickLabel(int i) const {
-    if (i == 0) {
-        return "0";
-    }
-    else {
-        double step = getAxisMagnitude();
-        double scale;
-        if (step >= 0.2e9) { scale = 1e-9; }
-        else if (step >= 0.2e6) { scale = 1e-6; }
-        else if (step >= 0.2e3) { scale = 1e-3; }
-        else if (step >= 0.2) { scale = 1; }
-        else if (step >= 0.2e-3) { scale = 1.0e3; }
-        else if (step >= 0.2e-6) { scale = 1.0e6; }
-        else if (step >= 0.2e-9) { scale = 1.0e9; }
-        else { scale = 1.0e12; }
-
-        step = getStep();
-        double mark = step * scale;
-
-        double value = mark * i;
-
-        int numDecimals = 0;
-        if (mark < 0.9) {  // Would do 1.0, but let's be safe
-            double smallest = 1.0;
-            while (smallest > mark) {
-                numDecimals++;
-                smallest /= 10;
-            }
-        }
-
-        return QString::number(value, 'f', numDecimals);
-    }
-}
-
-void Axis::autoscale(const Range& actualRange, const Range& desiredRange, bool force) {
-    if (!autoscalable) {
-        return;
-    }
-
-    // The rule is that if there's data that doesn't fit into the window, we always autoscale.
-    // If there isn't (i.e., plot is entirely contained in the window), we only autoscale if force=true
-
-    // When checking whether there's data that doesn't fit in the window, use the actual data range...
-    double minValue = positiveOnly ? 0 : actualRange.min;
-    double maxValue = actualRange.max;
-
-    bool doAutoscale = force;
-    if (!doAutoscale) {
-        // Always autoscale if the data won't fit on the screen.
-        doAutoscale = (minValue < minAxisValue()) || (maxValue > maxAxisValue());
-    }
-
-    if (doAutoscale) {
-        // ... but when we go to autoscale, use the desired range (which may contain 10% or 20% more size)
-        minValue = positiveOnly ? 0 : desiredRange.min;
-        maxValue = desiredRange.max;
-
-        int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 10);
-        if (stepIndexNew != -1) {
-            int minStepNew = floor(minValue / stepValues[stepIndexNew]);
-            int maxStepNew = minStepNew + 10;
-            resetScale(stepIndexNew, minStepNew, maxStepNew);
-        }
-    }
-}
-
-void Axis::scale(double minValue, double maxValue) {
-    int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 20);
-    if (stepIndexNew != -1) {
-        int minStepNew = floor(minValue / stepValues[stepIndexNew]);
-        int maxStepNew = ceil(maxValue / stepValues[stepIndexNew]);
-        resetScale(stepIndexNew, minStepNew, maxStepNew);
-    }
-}
-
-void Axis::adjustZeroPosition(int delta)
-{
-    int minStepNew = current().minStep + delta;
-    int maxStepNew = current().maxStep + delta;
-
-    if (positiveOnly && (minStepNew < 0)) {
-        minStepNew++;
-        maxStepNew++;
-    }
-
-    changeScale(current().stepIndex, minStepNew, maxStepNew);
-}
-
-double Axis::valueToSteps(double value) const {
-    return value / getStep() - minStepValue();
-}
-
-void Axis::zoom(int minIndex, int maxIndex) {
-    double minValue = getStep() * (minIndex + minStepValue());
-    double maxValue = getStep() * (maxIndex + minStepValue());
-
-    int stepIndexNew = findScaleForRange(minValue, maxValue, 5, 20);
-    if (stepIndexNew != -1) {
-        int minStepNew = floor(minValue / stepValues[stepIndexNew]);
-        int maxStepNew = ceil(maxValue / stepValues[stepIndexNew]);
-
-        changeScale(stepIndexNew, minStepNew, maxStepNew);
-    }
-}
-
-int Axis::findScaleForRange(double minValue, double maxValue, int minNumSteps, int maxNumSteps) {
-    double diff = maxValue - minValue;
-    int stepIndexNew = -1;
-    for (unsigned int i = 0; i < stepValues.size(); i++) {
-        double step = stepValues[i];
-        int numSteps = ceil(diff / step);
-        if (numSteps >= minNumSteps && numSteps <= maxNumSteps) {
-            stepIndexNew = i;
-            break;
-        }
-    }
-    return stepIndexNew;
-}
-
-void Axis::resetScale(int stepIndexNew, int minStepNew, int maxStepNew) {
-    bool changed = zoomIndex != 0;
-
-    zoomIndex = 0;
-    settings.erase(settings.begin() + zoomIndex + 1, settings.end());
-
-    if (current().stepIndex != stepIndexNew || current().minStep != minStepNew || current().maxStep != maxStepNew) {
-        settings[0] = AxisStep(stepIndexNew, minStepNew, maxStepNew);
-        changed = true;
-    }
-
-    if (changed) {
-        emit axisChanged();
-    }
-}
-
-void Axis::changeScale(int stepIndexNew, int minStepNew, int maxStepNew) {
-    if (current().stepIndex != stepIndexNew || current().minStep != minStepNew || current().maxStep != maxStepNew) {
-        settings.erase(settings.begin() + zoomIndex + 1, settings.end());
-        zoomIndex++;
-        settings.push_back(AxisStep(stepIndexNew, minStepNew, maxStepNew));
-
-        emit axisChanged();
-    }
-}
-
-bool Axis::canZoomIn() const {
-    return zoomIndex < settings.size() - 1;
-}
-
-bool Axis::canZoomOut() const {
-    return zoomIndex > 0;
-}
-
-void Axis::zoomIn() {
-    if (canZoomIn()) {
-        zoomIndex++;
-        emit axisChanged();
-    }
-}
-
-void Axis::zoomOut() {
-    if (canZoomOut()) {
-        zoomIndex--;
-        emit axisChanged();
-    }
-}
-
-int Axis::maxLabelWidth(QFont& font) {
-    QFontMetrics fm(font);
-
-    int result = 0;
-    for (int i = minStepValue(); i <= maxStepValue(); ++i) {
-        result = std::max(result, fm.width(getTickLabel(i)));
-    }
-
-    return result;
-}
-
 // ----------------------------------------------------------------------------------------------------------
 
 // Contructor.
@@ -315,7 +41,22 @@ Plot::Plot(QWidget *parent, Lines& data_, shared_ptr<Axis>& tAxis_, shared_ptr<A
     showYSelection(false),
     yClickStart(0),
     yClickCurrent(0),
-    inRect(false)
+    inRect(false),
+    pixmapMutex("Plot::pixmapMutex"),
+    renderer(nullptr),
+    scrolling(false),
+    oldLayerValid(false),
+    oldLayerGeneration(0),
+    oldLayerNumLines(0),
+    drawnValid(false),
+    drawnGeneration(0),
+    drawnMaxT(0),
+    fullRedrawPending(false),
+    partialRedrawPending(false),
+    pendingTMin(0),
+    pendingTMax(0),
+    scheduler(nullptr),
+    canvas(nullptr)
 {
     setBackgroundRole(QPalette::Window);
     setAutoFillBackground(true);
@@ -330,6 +71,15 @@ Plot::Plot(QWidget *parent, Lines& data_, shared_ptr<Axis>& tAxis_, shared_ptr<A
     connect(&data, SIGNAL(needPartialRedraw(double, double)), this, SLOT(scaleAndPartialRefresh(double, double)));
     connect(&data, SIGNAL(needFullRedraw()), this, SLOT(scaleAndFullRefresh()));
 
+    redrawTimer = new QTimer(this);
+    redrawTimer->setSingleShot(true);
+    setMaxFrameRate(DEFAULT_MAX_FRAME_RATE);
+    connect(redrawTimer, SIGNAL(timeout()), this, SLOT(flushRedraw()));
+    sinceLastRedraw.start();
+
+    renderer = new PlotRenderer(this);
+    connect(renderer, SIGNAL(frameReady()), this, SLOT(showRenderedFrame()), Qt::QueuedConnection);
+
     upButton = new QToolButton(this);
     upButton->setIcon(QIcon(":/images/Zoom_back.png"));
     upButton->adjustSize();
@@ -349,6 +99,12 @@ Plot::Plot(QWidget *parent, Lines& data_, shared_ptr<Axis>& tAxis_, shared_ptr<A
     connect(rightButton, SIGNAL(clicked()), tAxis.get(), SLOT(zoomIn()));
 }
 
+Plot::~Plot() {
+    if (scheduler) {
+        scheduler->remove(this);
+    }
+}
+
 void Plot::drawAxes(QPainter& painter)
 {
     // Draw vertical lines
@@ -431,54 +187,6 @@ unsigned int lastIndex(const vector<T>& data) {
     return data.size() - 1;
 }
 
-void Plot::drawPlotPiece(QPainter& painter, double tMin, double tMax, LineSegment& lineSegment) {
-    QVector<QPointF> p;
-    p.reserve(lineSegment.t.size());
-
-    const vector<double>& y = lineSegment.y;
-    const vector<double>& t = lineSegment.t;
-    auto iter = std::upper_bound(t.begin(), t.end(), tMax);
-    int maxIteration = std::min(static_cast<std::vector<double>::size_type>(iter - t.begin()), t.size() - 1);
-    for (int i = lineSegment.getFirstIndexToDraw(tMin); i <= maxIteration; ++i) {
-        double normalizedT = tAxis->valueToSteps(t[i]);
-        double normalizedY = yAxis->valueToSteps(y[i]);
-        p.push_back(QPointF(scaleToXPixel(normalizedT), scaleToYPixel(normalizedY)));
-    }
-
-    if (!p.empty()) {
-        painter.drawPoint(p.first());
-        painter.drawPolyline(p);
-    }
-}
-
-void Plot::drawPlotWaveform(QPainter& painter, double tMin, double tMax, Line& waveform) {
-    painter.setPen(waveform.color);
-
-    double tMax_newData = tMin;
-    auto piece = waveform.data.begin() + waveform.getFirstPieceToDraw(tMin);
-    for (; piece != waveform.data.end() && (piece->t[0] <= tMax); piece++) {
-        drawPlotPiece(painter, tMin, tMax, *piece);
-        if (!piece->t.empty()) {
-            tMax_newData = std::max(tMax_newData, piece->t.back());
-        }
-    }
-
-    // Draw any residual data
-    piece = waveform.oldData.begin();
-    for (; piece != waveform.oldData.end() && (piece->t[0] <= tMax); piece++) {
-        drawPlotPiece(painter, tMax_newData, tMax, *piece);
-    }
-}
-
-void Plot::drawPlots(QPainter& painter, double tMin, double tMax)
-{
-    for (Line& waveform : data.lines) {
-        if (!waveform.data.empty()) {
-            drawPlotWaveform(painter, tMin, tMax, waveform);
-        }
-    }
-}
-
 int Plot::maxXLabelWidth() const {
     QFont font = this->font();
     font.setPointSize(font.pointSize() + 2);
@@ -489,7 +197,6 @@ int Plot::maxXLabelWidth() const {
 int Plot::maxYLabelWidth() const {
     QFont font = this->font();
     font.setPointSize(font.pointSize() + 2);
-    QFontMetrics fm(font);
 
     return yAxis->maxLabelWidth(font);
 }
@@ -526,8 +233,7 @@ void Plot::setMargins() {
 }
 
 void Plot::resizeEvent(QResizeEvent*) {
-    lock_guard<recursive_mutex> lockw(data.linesMutex);
-    lock_guard<recursive_mutex> lockp(pixmapMutex);
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
 
     // Pixel map used for double buffering.
     if (pixmap.size() != size()) {
@@ -538,13 +244,43 @@ void Plot::resizeEvent(QResizeEvent*) {
     fullRedraw();
 }
 
+// Time spent drawing, summed over all plots
+static std::atomic<uint64_t> paintNanoseconds(0);
+
+// Adds the time from construction to destruction to paintNanoseconds
+struct PaintTimer {
+    std::chrono::steady_clock::time_point start;
+
+    PaintTimer() : start(std::chrono::steady_clock::now()) {}
+    ~PaintTimer() {
+        paintNanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+double Plot::getPaintSeconds() {
+    return paintNanoseconds.load() * 1e-9 + PlotRenderer::getRenderSeconds();
+}
+
 void Plot::paintEvent(QPaintEvent *)
 {
-    lock_guard<recursive_mutex> lockp(pixmapMutex);
+    PaintTimer timer;
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
 
     QStylePainter stylePainter(this);
     stylePainter.drawPixmap(0, 0, pixmap);
+    if (!canvas && traces.size() == pixmap.size()) {
+        stylePainter.drawImage(0, 0, traces);
+    }
+    drawSelection(stylePainter);
 
+    if (canvas) {
+        // The canvas covers the plot area, so the selection has to be drawn there too
+        canvas->update();
+    }
+}
+
+// Highlights the range being selected with the mouse, for zooming
+void Plot::drawSelection(QPainter& painter) {
     if (inRect) {
         if (showXSelection) {
             pair<int, int> range = getTZoomRange();
@@ -552,9 +288,9 @@ void Plot::paintEvent(QPaintEvent *)
             int maxIndex = range.second;
             for (int i = minIndex; i < maxIndex; i++) {
                 QRect r(scaleToXPixel(i) + 2, toYPixel(-2), xStepSize - 3, 5);
-                stylePainter.fillRect(r, Qt::blue);
+                painter.fillRect(r, Qt::blue);
             }
-            stylePainter.fillRect(scaleToXPixel(minIndex), topMargin, (maxIndex - minIndex) * xStepSize, height() - (topMargin + yOffset), QColor(0, 0, 255, 100));
+            painter.fillRect(scaleToXPixel(minIndex), topMargin, (maxIndex - minIndex) * xStepSize, height() - (topMargin + yOffset), QColor(0, 0, 255, 100));
         }
 
         if (showYSelection) {
@@ -563,9 +299,9 @@ void Plot::paintEvent(QPaintEvent *)
             int maxIndex = range.second;
             for (int i = minIndex; i < maxIndex; i++) {
                 QRect r(toXPixel(-7), scaleToYPixel(i + 1) + 2, 5, yStepSize - 3);
-                stylePainter.fillRect(r, Qt::blue);
+                painter.fillRect(r, Qt::blue);
             }
-            stylePainter.fillRect(toXPixel(0), scaleToYPixel(maxIndex), width() - (xOffset + rightMargin), (maxIndex - minIndex) * yStepSize, QColor(0, 0, 255, 50));
+            painter.fillRect(toXPixel(0), scaleToYPixel(maxIndex), width() - (xOffset + rightMargin), (maxIndex - minIndex) * yStepSize, QColor(0, 0, 255, 50));
         }
     }
 }
@@ -577,10 +313,42 @@ void Plot::refreshPixmap() {
     }
 }
 
+Plot::AxesLayout::AxesLayout() :
+    dpi(0),
+    tStep(0),
+    tMinStep(0),
+    tMaxStep(0),
+    yStep(0),
+    yMinStep(0),
+    yMaxStep(0)
+{
+}
+
+bool Plot::AxesLayout::operator==(const AxesLayout& other) const {
+    return size == other.size && font == other.font && dpi == other.dpi &&
+        tStep == other.tStep && tMinStep == other.tMinStep && tMaxStep == other.tMaxStep &&
+        yStep == other.yStep && yMinStep == other.yMinStep && yMaxStep == other.yMaxStep;
+}
+
+Plot::AxesLayout Plot::currentAxesLayout() const {
+    AxesLayout layout;
+    layout.size = pixmap.size();
+    layout.font = font().key();
+    layout.dpi = logicalDpiY();
+    layout.tStep = tAxis->getStep();
+    layout.tMinStep = tAxis->minStepValue();
+    layout.tMaxStep = tAxis->maxStepValue();
+    layout.yStep = yAxis->getStep();
+    layout.yMinStep = yAxis->minStepValue();
+    layout.yMaxStep = yAxis->maxStepValue();
+    return layout;
+}
+
 void Plot::fullRedraw()
 {
-    lock_guard<recursive_mutex> lockw(data.linesMutex);
-    lock_guard<recursive_mutex> lockp(pixmapMutex);
+    PaintTimer timer;
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
+    data.applyPending();
 
     showHideButtons();
     setMargins();
@@ -589,29 +357,166 @@ void Plot::fullRedraw()
         return;
     }
 
-    QPainter painter(&pixmap);
-    painter.initFrom(this);
+    // The frame, axes, and labels only change with the scales, the size, or the font
+    AxesLayout layout = currentAxesLayout();
+    if (!(layout == axesLayout)) {
+        QPainter painter(&pixmap);
+        painter.initFrom(this);
 
-    // Clear old display.
-    painter.eraseRect(rect());
+        // Clear old display.
+        painter.eraseRect(rect());
+        oldLayerValid = false;
 
-    // Draw box around entire display.
-    QRect rect(this->rect());
+        // Draw box around entire display.
+        QRect rect(this->rect());
 
-    rect.adjust(0, 0, -1, -1);
-    painter.setPen(Qt::darkGray);
-    painter.drawRect(rect);
+        rect.adjust(0, 0, -1, -1);
+        painter.setPen(Qt::darkGray);
+        painter.drawRect(rect);
 
-    rect.adjust(1, 1, -1, -1);
-    painter.fillRect(rect, Qt::white);
+        rect.adjust(1, 1, -1, -1);
+        painter.fillRect(rect, Qt::white);
 
-    drawAxes(painter);
-    
-    QRect clipRect;
-    clipRect.setCoords(toXPixel(1), topMargin + 1, width() - rightMargin - 1, toYPixel(1));
-    painter.setClipRect(clipRect);
-    drawPlots(painter, tAxis->minAxisValue(), tAxis->maxAxisValue());
+        drawAxes(painter);
+        axesLayout = layout;
+    }
+
+    if (canvas) {
+        canvas->setGeometry(getPlotArea());
+        canvas->update();
+    }
+    else {
+        renderer->queue(snapshot(true, tAxis->minAxisValue(), tAxis->maxAxisValue()));
+    }
+
+    update();
+}
+
+// Pixel mapping for the renderer
+PlotGeometry Plot::snapshotGeometry() {
+    PlotGeometry geometry;
+    geometry.size = size();
+    geometry.plotArea = getPlotArea();
+    geometry.xOffset = xOffset;
+    geometry.yOffset = yOffset;
+    geometry.topMargin = topMargin;
+    geometry.rightMargin = rightMargin;
+    geometry.xStepSize = xStepSize;
+    geometry.yStepSize = yStepSize;
+    geometry.tStep = tAxis->getStep();
+    geometry.tMinStep = tAxis->minStepValue();
+    geometry.yStep = yAxis->getStep();
+    geometry.yMinStep = yAxis->minStepValue();
+    geometry.tMinAxis = tAxis->minAxisValue();
+    geometry.tMaxAxis = tAxis->maxAxisValue();
+    return geometry;
+}
+
+// Copies what the renderer needs to redraw [tMin, tMax]: only the points drawn there, plus the finished sweeps if they changed
+PlotFrame Plot::snapshot(bool full, double tMin, double tMax) {
+    CLAMP_TRACE_SPAN("Plot::snapshot");
+    PlotFrame frame;
+    frame.full = full;
+    frame.geometry = snapshotGeometry();
+    frame.maxT = data.maxT();
+
+    // Range of the finished sweeps to draw
+    double oldTMin = frame.geometry.tMinAxis;
+    double oldTMax = frame.geometry.tMaxAxis;
+    if (scrolling) {
+        // The newest data goes at the right edge; a full redraw goes back as far as the plot is wide
+        PlotGeometry& geometry = frame.geometry;
+        geometry.scrolling = true;
+        geometry.tOffset = data.sweepStart;
+        geometry.scrollHead = geometry.column(frame.maxT);
+        geometry.tOffset = 0;
+        frame.sweepStart = data.sweepStart;
+        frame.oldSweepStart = data.oldSweepStart;
+        if (full) {
+            double windowStart = data.sweepStart + frame.maxT - (geometry.plotArea.width() + 1) * geometry.tStep / std::max(geometry.xStepSize, 1);
+            tMin = windowStart - data.sweepStart;
+            tMax = frame.maxT;
+            oldTMin = windowStart - data.oldSweepStart;
+            oldTMax = std::numeric_limits<double>::max();
+        }
+        // Finished sweeps scroll along with the rest of the image, so they're only needed when it starts over
+        frame.renderOldData = full;
+    }
+    else {
+        frame.cursorRect = full ? QRect() : getCursorRect();
+        frame.renderOldData = !(oldLayerValid && oldLayerGeneration == data.oldDataGeneration && oldLayerNumLines == data.lines.size());
+        oldLayerValid = true;
+        oldLayerGeneration = data.oldDataGeneration;
+        oldLayerNumLines = data.lines.size();
+    }
+
+    // Only data was appended since the last frame, so it's enough to draw the new points over it
+    frame.incremental = !full && !frame.renderOldData && drawnValid && drawnGeneration == data.dataGeneration;
+    if (frame.incremental) {
+        // What's left to clear is beyond the last frame's data, where the finished sweeps showed
+        tMin = drawnMaxT;
+        tMax = frame.maxT;
+        if (!frame.cursorRect.isEmpty()) {
+            // Not the column the live data ends in
+            frame.cursorRect.setLeft(frame.cursorRect.left() + 1);
+        }
+    }
+    frame.tMin = tMin;
+    frame.tMax = tMax;
+
+    frame.lines.resize(data.lines.size());
+    for (std::size_t i = 0; i < data.lines.size(); i++) {
+        Line& waveform = data.lines[i];
+        Line& copy = frame.lines[i];
+        copy.color = waveform.color;
+        if (frame.incremental) {
+            // The new points, and the last one drawn before them, so the segment joining them is drawn too
+            DrawnUpTo drawn = (i < drawnUpTo.size()) ? drawnUpTo[i] : DrawnUpTo();
+            for (std::size_t p = drawn.piece; p < waveform.data.size(); p++) {
+                const LineSegment& piece = waveform.data[p];
+                std::size_t from = (p == drawn.piece) ? drawn.points : 0;
+                if (from < piece.size()) {
+                    copy.data.push_back(piece.sliceIndices((from > 0) ? from - 1 : 0, piece.size() - 1));
+                }
+            }
+        }
+        else if (!waveform.data.empty()) {
+            auto piece = waveform.data.begin() + waveform.getFirstPieceToDraw(tMin);
+            for (; piece != waveform.data.end() && (piece->tFront() <= tMax); piece++) {
+                copy.data.push_back(piece->slice(tMin, tMax));
+            }
+        }
+        if (frame.renderOldData) {
+            for (auto piece = waveform.oldData.begin(); piece != waveform.oldData.end() && (piece->tFront() <= oldTMax); piece++) {
+                if (!piece->empty() && piece->tBack() >= oldTMin) {
+                    copy.oldData.push_back(piece->slice(oldTMin, oldTMax));
+                }
+            }
+        }
+    }
+    markAllDrawn();
+    return frame;
+}
 
+// Records that every point of every line has been sent to the renderer
+void Plot::markAllDrawn() {
+    drawnUpTo.resize(data.lines.size());
+    for (std::size_t i = 0; i < data.lines.size(); i++) {
+        const Line& waveform = data.lines[i];
+        drawnUpTo[i].piece = waveform.data.empty() ? 0 : waveform.data.size() - 1;
+        drawnUpTo[i].points = waveform.data.empty() ? 0 : waveform.data.back().size();
+    }
+    drawnValid = true;
+    drawnGeneration = data.dataGeneration;
+    drawnMaxT = data.maxT();
+}
+
+// Takes the traces the renderer just finished
+void Plot::showRenderedFrame() {
+    {
+        lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
+        traces = renderer->takeImage();
+    }
     update();
 }
 
@@ -624,6 +529,13 @@ QRect Plot::getRect(double tMin, double tMax) {
     return clipRect;
 }
 
+// The area inside the axes, where the traces are drawn
+QRect Plot::getPlotArea() {
+    QRect area;
+    area.setCoords(toXPixel(1), topMargin + 1, width() - rightMargin - 1, toYPixel(1));
+    return area;
+}
+
 const int CURSOR_WIDTH = 10;
 
 // Clear an area of CURSOR_WIDTH pixels past the end of the data, so that cycling looks good
@@ -640,51 +552,160 @@ QRect Plot::getCursorRect() {
 
 void Plot::partialRedraw(double tMin, double tMax)
 {
-    lock_guard<recursive_mutex> lockw(data.linesMutex);
-    lock_guard<recursive_mutex> lockp(pixmapMutex);
+    CLAMP_TRACE_SPAN("Plot::partialRedraw");
+    PaintTimer timer;
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
+    data.applyPending();
 
     if (pixmap.isNull()) {
         return;
     }
+    if (canvas) {
+        // Nothing in the pixmap depends on the data; the canvas uploads just the new points
+        canvas->update();
+        return;
+    }
 
-    QPainter painter(&pixmap);
-    painter.initFrom(this);
-
-    // Clear the cursor area
-    QRect clearRect = getCursorRect();
-    painter.eraseRect(clearRect);
-    painter.fillRect(clearRect, Qt::white);
-    painter.setClipRect(clearRect);
-    drawAxes(painter);
-
-    // Redraw a little extra
+    // Redraw a little extra, unless the frame turns out to be incremental (see snapshot), which starts where the last
+    // frame ended
     tMin -= tAxis->getStep() / xStepSize;
-    tMin = std::max(tMin, tAxis->minAxisValue());
-    tMax = std::min(tMax, tAxis->maxAxisValue());
-
-    QRect clipRect = getRect(tMin, tMax);
-    painter.setClipRect(clipRect);
-    painter.eraseRect(clipRect);
-    painter.fillRect(clipRect, Qt::white);
-
-    drawAxes(painter);
-    drawPlots(painter, tMin, tMax);
+    if (!scrolling) {
+        tMin = std::max(tMin, tAxis->minAxisValue());
+        tMax = std::min(tMax, tAxis->maxAxisValue());
+    }
 
-    update();
+    // The renderer clears the cursor area and the range, and the update comes when it's done
+    renderer->queue(snapshot(false, tMin, tMax));
 }
 
 void Plot::autoScaleForce() {
     autoScale(true);
 }
 
-void Plot::scaleAndFullRefresh() {
-    autoScale(false);
+/** \brief Switches between drawing the traces with OpenGL and drawing them with QPainter on a worker thread (see PlotRenderer).
+ *
+ *  Does nothing (i.e., stays with QPainter) if the software was built without OpenGL support; see CLAMP_OPENGL_PLOTS.
+ *
+ *  \param[in] enable  True to draw with OpenGL
+ */
+void Plot::setOpenGL(bool enable) {
+#ifdef CLAMP_OPENGL_PLOTS
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
+
+    if (enable == (canvas != nullptr)) {
+        return;
+    }
+    if (enable) {
+        canvas = new PlotCanvasGL(*this);
+        canvas->show();
+    }
+    else {
+        delete canvas;
+        canvas = nullptr;
+    }
     fullRedraw();
+#else
+    (void)enable;
+#endif
+}
+
+/** \brief Switches between sweep and strip-chart display.
+ *
+ *  Normally each sweep is drawn from the left edge of the plot, over the last one, with a gap ahead of the live data.
+ *  As a strip chart, sweeps follow on from one another (see Lines::sweepStart), and the newest data is always at the
+ *  right edge: each redraw shifts the image left by the columns the new data takes up and draws only those, so the cost
+ *  of a redraw doesn't depend on how much time the plot shows.  The time axis then gives the width of the window.
+ *
+ *  Data that scrolled off further back than the finished sweep isn't drawn again after a full redraw (e.g., zooming).
+ *  Has no effect while the traces are drawn with OpenGL (see setOpenGL).
+ *
+ *  \param[in] enable  True for a strip chart
+ */
+void Plot::setScrolling(bool enable) {
+    if (enable == scrolling) {
+        return;
+    }
+    scrolling = enable;
+    refreshPixmap();
+}
+
+void Plot::scaleAndFullRefresh() {
+    fullRedrawPending = true;
+    scheduleRedraw();
 }
 
 void Plot::scaleAndPartialRefresh(double tMin, double tMax) {
+    if (partialRedrawPending) {
+        pendingTMin = std::min(pendingTMin, tMin);
+        pendingTMax = std::max(pendingTMax, tMax);
+    }
+    else {
+        pendingTMin = tMin;
+        pendingTMax = tMax;
+        partialRedrawPending = true;
+    }
+    scheduleRedraw();
+}
+
+// Data arrives in many small chunks, much faster than it's worth repainting; this redraws once for all of them
+void Plot::scheduleRedraw() {
+    if (scheduler) {
+        scheduler->markDirty(this);
+        return;
+    }
+    if (redrawTimer->isActive()) {
+        return;
+    }
+    qint64 wait = minRedrawInterval - sinceLastRedraw.elapsed();
+    redrawTimer->start(static_cast<int>(std::max<qint64>(0, wait)));
+}
+
+void Plot::flushRedraw() {
+    bool full = fullRedrawPending;
+    bool partial = partialRedrawPending;
+    fullRedrawPending = false;
+    partialRedrawPending = false;
+    sinceLastRedraw.restart();
+
     autoScale(false);
-    partialRedraw(tMin, tMax);
+    if (full) {
+        fullRedraw();
+    }
+    else if (partial) {
+        partialRedraw(pendingTMin, pendingTMax);
+    }
+}
+
+/** \brief Sets how often the plot is redrawn as data arrives.
+ *
+ *  Changes to the data between redraws are combined into one redraw.  Redraws for other reasons (e.g., zooming)
+ *  happen right away.
+ *
+ *  \param[in] hz  Maximum number of redraws per second
+ */
+void Plot::setMaxFrameRate(unsigned int hz) {
+    minRedrawInterval = static_cast<int>(1000 / std::max(1u, hz));
+}
+
+/** \brief Hands the plot's redraws to a PlotScheduler, shared with other plots, rather than doing them on its own timer.
+ *
+ *  \param[in] scheduler_  Scheduler to use, or null for the plot's own timer (see setMaxFrameRate)
+ */
+void Plot::setScheduler(PlotScheduler* scheduler_) {
+    if (scheduler_ == scheduler) {
+        return;
+    }
+    if (scheduler) {
+        scheduler->remove(this);
+    }
+    scheduler = scheduler_;
+    if (scheduler) {
+        redrawTimer->stop();
+        scheduler->add(this);
+    }
+    if (fullRedrawPending || partialRedrawPending) {
+        scheduleRedraw();
+    }
 }
 
 // Parse keypress commands.
@@ -728,96 +749,306 @@ void Plot::closeEvent(QCloseEvent *event)
     event->accept();
 }
 
+// A scheduler skips hidden plots, so catch up on anything that arrived while this one was hidden
+void Plot::showEvent(QShowEvent*) {
+    if (scheduler && (fullRedrawPending || partialRedrawPending)) {
+        scheduleRedraw();
+    }
+}
+
+Lines::Lines() :
+    tStep(0),
+    oldDataGeneration(0),
+    dataGeneration(0),
+    sweepStart(0),
+    oldSweepStart(0),
+    pendingMutex("Lines::pendingMutex"),
+    rangesValid(false),
+    memoryCap(0),
+    evictedSegments(0),
+    history(nullptr)
+{
+}
+
 Lines::~Lines() {
 
 }
 
 void Lines::colorLines() {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
     for (unsigned int i = 0; i < lines.size(); i++) {
         lines[i].color = rainbow(1.0 * i / (lines.size() - 1));
     }
 }
 
+// Queues an update for the GUI thread; only holds pendingMutex long enough to add it to the queue
+// Locks pendingMutex for a producer; the wait shows up in the read loop's timing (see CLAMP::LoopTiming)
+std::unique_lock<CLAMP::ProfiledMutex> Lines::lockPending() {
+    CLAMP::LoopTiming::Phase phase("paint lock wait");
+    return std::unique_lock<CLAMP::ProfiledMutex>(pendingMutex);
+}
+
+void Lines::publish(PendingUpdate&& update) {
+    std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+    pending.push_back(std::move(update));
+}
+
 void Lines::addLine(const Line& line)
 {
-    lock_guard<recursive_mutex> lockw(linesMutex);
+    PendingUpdate update(PendingUpdate::ADD_LINE);
+    update.increments.lines.push_back(line);
+    publish(std::move(update));
 
-    lines.push_back(line);
-    colorLines();
     emit needFullRedraw();
 }
 
 void Lines::setLines(const std::vector<Line>& ls) {
-    lock_guard<recursive_mutex> lockw(linesMutex);
+    setLines(std::vector<Line>(ls));
+}
 
-    lines.clear();
-    for (const Line& line : ls) {
-        lines.push_back(line);
+// Takes the lines over, for producers that build them just to hand them to the plot
+void Lines::setLines(std::vector<Line>&& ls) {
+    PendingUpdate update(PendingUpdate::SET);
+    update.increments.lines = std::move(ls);
+    {
+        std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+        lastAddedT.clear();
+        pending.push_back(std::move(update));
     }
-    colorLines();
 
     emit needFullRedraw();
 }
 
-void Lines::appendLines(unsigned int firstLineIndex, const LineIncrements& ls) {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
-    if (lines.size() < firstLineIndex + ls.lines.size()) {
-        lines.resize(firstLineIndex + ls.lines.size());
-    }
+void Lines::appendLines(unsigned int firstLineIndex, LineIncrements&& ls) {
     Range range = getRange(ls.lines, &Line::getTRange);
 
-    for (unsigned int i = 0; i < ls.lines.size(); i++) {
-        const Line& input = ls.lines[i];
-        Line& line = lines[i + firstLineIndex];
-        line.append(ls.startIndices[i], input);
-    }
-
-    colorLines();
+    PendingUpdate update(PendingUpdate::APPEND);
+    update.firstLineIndex = firstLineIndex;
+    update.increments = std::move(ls);
+    publish(std::move(update));
 
     emit needPartialRedraw(range.min, range.max);
 }
 
-void Lines::addToLine(unsigned int lineIndex, double t, double y) {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
-    if (lines.size() <= lineIndex) {
-        lines.resize(lineIndex + 1);
+/** \brief Returns empty increments with numLines lines, for a producer to fill and pass to appendLines().
+ *
+ *  Reuses the storage of increments that applyPending() is done with, when there are any, so producers that append
+ *  every time data arrives don't allocate a fresh set of lines each time.
+ */
+LineIncrements Lines::takeIncrements(unsigned int numLines) {
+    LineIncrements increments;
+    {
+        std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+        if (!spare.empty()) {
+            increments = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    increments.startIndices.assign(numLines, 0);
+    increments.lines.resize(numLines);
+    for (Line& line : increments.lines) {
+        line.clear();
     }
-    colorLines();
+    return increments;
+}
 
-    Line& w = lines[lineIndex];
-    w.addPoint(t, y);
+void Lines::addToLine(unsigned int lineIndex, double t, double y) {
+    PendingUpdate update(PendingUpdate::ADD_POINT);
+    update.firstLineIndex = lineIndex;
+    update.t = t;
+    update.y = y;
 
+    // Redraw from the previous point on this line, so the segment joining them gets drawn
     double tMin = t;
-    auto& piece = w.data.back();
-    if (piece.t.size() > 1) {
-        tMin = piece.t[piece.t.size() - 2];
+    {
+        std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+        if (lastAddedT.size() <= lineIndex) {
+            lastAddedT.resize(lineIndex + 1, std::numeric_limits<double>::quiet_NaN());
+        }
+        if (!std::isnan(lastAddedT[lineIndex])) {
+            tMin = std::min(tMin, lastAddedT[lineIndex]);
+        }
+        lastAddedT[lineIndex] = t;
+        pending.push_back(std::move(update));
     }
     emit needPartialRedraw(tMin, t);
 }
 
 void Lines::cycleLines()
 {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
-    for (auto& line : lines) {
-        line.oldData.erase(line.oldData.begin(), line.oldData.end());
-        line.oldData.swap(line.data);
+    {
+        std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+        lastAddedT.clear();
+        pending.push_back(PendingUpdate(PendingUpdate::CYCLE));
     }
     emit needPartialRedraw(0, 0);
 }
 
 void Lines::clearLines()
 {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
-    lines.clear();
+    {
+        std::unique_lock<CLAMP::ProfiledMutex> lock = lockPending();
+        lastAddedT.clear();
+        pending.push_back(PendingUpdate(PendingUpdate::CLEAR));
+    }
     emit needFullRedraw();
 }
 
+/** \brief Applies the changes producers have published since the last call to lines.
+ *
+ *  Must only be called from the GUI thread, which is the only thread that reads or writes lines.  Producers never wait
+ *  on it (or on painting), other than to add to the queue.
+ *
+ *  \returns true if anything changed
+ */
+bool Lines::applyPending() {
+    {
+        lock_guard<CLAMP::ProfiledMutex> lock(pendingMutex);
+        if (pending.empty()) {
+            return false;
+        }
+        applying.swap(pending);
+    }
+
+    bool recolor = false;
+    for (PendingUpdate& update : applying) {
+        switch (update.kind) {
+        case PendingUpdate::SET:
+            lines.swap(update.increments.lines);
+            oldDataGeneration++;
+            dataGeneration++;
+            sweepStart = oldSweepStart = 0;
+            recolor = true;
+            rangesValid = false;
+            break;
+        case PendingUpdate::ADD_LINE:
+            lines.push_back(update.increments.lines.front());
+            recolor = true;
+            rangesValid = false;
+            break;
+        case PendingUpdate::APPEND:
+            if (lines.size() < update.firstLineIndex + update.increments.lines.size()) {
+                lines.resize(update.firstLineIndex + update.increments.lines.size());
+                recolor = true;
+            }
+            for (unsigned int i = 0; i < update.increments.lines.size(); i++) {
+                Line& input = update.increments.lines[i];
+                Line& line = lines[i + update.firstLineIndex];
+                // The pieces are moved into line, so take the input's ranges first
+                Range tRange = rangesValid ? input.getTRange() : Range();
+                Range yRange = rangesValid ? input.getYRange() : Range();
+                Range removed = line.append(update.increments.startIndices[i], std::move(input));
+                if (rangesValid) {
+                    tRangeCache.applyUnion(tRange);
+                    yRangeCache.applyUnion(yRange);
+                    // Discarded finished pieces only matter if they started before everything that's left
+                    if (removed.min <= removed.max && (line.data.empty() || removed.min < line.data.front().getTRange().min)) {
+                        rangesValid = false;
+                    }
+                }
+            }
+            break;
+        case PendingUpdate::ADD_POINT:
+            if (lines.size() <= update.firstLineIndex) {
+                lines.resize(update.firstLineIndex + 1);
+                recolor = true;
+            }
+            lines[update.firstLineIndex].addPoint(update.t, update.y);
+            tRangeCache.applyUnion(Range(update.t, update.t));
+            yRangeCache.applyUnion(Range(update.y, update.y));
+            break;
+        case PendingUpdate::CYCLE:
+            // The next sweep starts one sample after this one ends
+            oldSweepStart = sweepStart;
+            sweepStart += maxT() + tStep;
+            if (history) {
+                history->record(lines);
+            }
+            for (auto& line : lines) {
+                line.oldData.erase(line.oldData.begin(), line.oldData.end());
+                line.oldData.swap(line.data);
+            }
+            oldDataGeneration++;
+            dataGeneration++;
+            rangesValid = false;
+            break;
+        case PendingUpdate::CLEAR:
+            lines.clear();
+            oldDataGeneration++;
+            dataGeneration++;
+            sweepStart = oldSweepStart = 0;
+            rangesValid = false;
+            break;
+        }
+    }
+    // Hand the spent increments back for takeIncrements() to reuse
+    {
+        lock_guard<CLAMP::ProfiledMutex> lock(pendingMutex);
+        for (PendingUpdate& update : applying) {
+            if (update.kind == PendingUpdate::APPEND && spare.size() < MAX_SPARE_INCREMENTS) {
+                spare.push_back(std::move(update.increments));
+            }
+        }
+    }
+    applying.clear();
+
+    if (recolor) {
+        colorLines();
+    }
+    enforceMemoryCap();
+    return true;
+}
+
+// Bytes held by the lines' points, including the finished sweeps.  GUI thread only, like lines.
+std::size_t Lines::memoryBytes() const {
+    std::size_t total = lines.capacity() * sizeof(Line);
+    for (const Line& line : lines) {
+        total += line.dataBytes() + line.oldDataBytes();
+    }
+    return total;
+}
+
+/* Limits the memory the lines may hold; 0 means no limit.  Once past the limit, the finished sweeps (Line::oldData) are
+ * dropped first, oldest piece first, then the oldest pieces of the current sweep, but never the piece being added to.
+ * GUI thread only.
+ */
+void Lines::setMemoryCap(std::size_t bytes) {
+    memoryCap = bytes;
+    enforceMemoryCap();
+}
+
+void Lines::enforceMemoryCap() {
+    if (memoryCap == 0) {
+        return;
+    }
+    std::size_t total = memoryBytes();
+    if (total <= memoryCap) {
+        return;
+    }
+
+    bool droppedOld = false;
+    for (Line& line : lines) {
+        while (total > memoryCap && !line.oldData.empty()) {
+            total -= sizeof(LineSegment) + line.oldData.front().memoryBytes();
+            line.oldData.pop_front();
+            evictedSegments++;
+            droppedOld = true;
+        }
+    }
+    for (Line& line : lines) {
+        while (total > memoryCap && line.data.size() > 1) {
+            total -= sizeof(LineSegment) + line.data.front().memoryBytes();
+            line.data.pop_front();
+            evictedSegments++;
+            dataGeneration++;
+        }
+    }
+
+    if (droppedOld) {
+        oldDataGeneration++;
+    }
+    rangesValid = false;
+}
+
 Range Lines::getRange(const vector<Line>& ls, GetRange_t getter) {
     Range result;
     for (const Line& line : ls) {
@@ -827,15 +1058,24 @@ Range Lines::getRange(const vector<Line>& ls, GetRange_t getter) {
     return result;
 }
 
+void Lines::updateRanges() {
+    tRangeCache = getRange(lines, &Line::getTRange);
+    yRangeCache = getRange(lines, &Line::getYRange);
+    rangesValid = true;
+}
+
 Range Lines::getTRange() {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-    return getRange(lines, &Line::getTRange);
+    if (!rangesValid) {
+        updateRanges();
+    }
+    return tRangeCache;
 }
 
 Range Lines::getYRange() {
-    lock_guard<recursive_mutex> lockw(linesMutex);
-
-    return getRange(lines, &Line::getYRange);
+    if (!rangesValid) {
+        updateRanges();
+    }
+    return yRangeCache;
 }
 
 double Lines::maxT() const {
@@ -880,8 +1120,8 @@ void Plot::showHideButtons() {
 
 // Deal with scaling
 void Plot::autoScale(bool force) {
-    lock_guard<recursive_mutex> lockw(data.linesMutex);
-    lock_guard<recursive_mutex> lockp(pixmapMutex);
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(pixmapMutex);
+    data.applyPending();
 
     if (autoScaling) {
         tAxis->autoscale(data.getTRange(), data.getTRange(), force);
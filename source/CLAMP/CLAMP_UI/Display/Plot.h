@@ -2,71 +2,22 @@
 
 #include <QWidget>
 #include <QQueue>
+#include <QElapsedTimer>
 #include <vector>
 #include <mutex>
 #include <memory>
+#include <cstdint>
+#include "LockProfiler.h"
+#include "PlotRenderer.h"
+#include "Axis.h"
 
 class QToolButton;
+class QTimer;
+class PlotCanvasGL;
+class PlotScheduler;
+class SweepHistory;
 struct Range;
 
-struct AxisStep {
-    int stepIndex;
-    int minStep;
-    int maxStep;
-
-    AxisStep(int stepIndex_, int minStep_, int maxStep_);
-};
-
-class Axis : public QObject {
-    Q_OBJECT
-
-public:
-    Axis(unsigned int numSteps_, int stepIndex_, const QString& unit_, const QString& name_, unsigned int startValue, int startExponent, unsigned int endValue, int endExponent, bool positiveOnly_);
-
-    void adjustStepIndex(int delta);
-    int numberOfSteps() const;
-    QString getLabel() const;
-    QString getTickLabel(int i) const;
-    double valueToSteps(double value) const;
-    void autoscale(const Range& actualRange, const Range& desiredRange, bool force);
-    void scale(double minValue, double maxValue);
-    void adjustZeroPosition(int delta);
-    int minStepValue() const;
-    int maxStepValue() const;
-    void zoom(int minIndex, int maxIndex);
-    bool canZoomIn() const;
-    bool canZoomOut() const;
-    int maxLabelWidth(QFont& font);
-    double minAxisValue() const;
-    double maxAxisValue() const;
-    double getStep() const;
-    bool autoscalable;
-
-signals:
-    void axisChanged();
-
-public slots:
-    void zoomIn();
-    void zoomOut();
-
-private:
-    std::vector<AxisStep> settings;
-    unsigned int zoomIndex;
-
-    std::vector<double> stepValues;
-    QString unit;
-    QString name;
-
-    bool positiveOnly;
-
-    AxisStep& current();
-    const AxisStep& current() const;
-    double getAxisMagnitude() const;
-    void resetScale(int stepIndexNew, int minStepNew, int maxStepNew);
-    void changeScale(int stepIndexNew, int minStepNew, int maxStepNew);
-    int findScaleForRange(double minValue, double maxValue, int minNumSteps, int maxNumSteps);
-};
-
 class Line;
 struct LineSegment;
 struct Range;
@@ -85,24 +36,79 @@ public slots:
     void cycleLines();
 
 public:
+    Lines();
     ~Lines();
     void addToLine(unsigned int lineIndex, double t, double y);
     void setLines(const std::vector<Line>& ls);
-    void appendLines(unsigned int firstLineIndex, const LineIncrements& ls);
+    void setLines(std::vector<Line>&& ls);
+    void appendLines(unsigned int firstLineIndex, LineIncrements&& ls);
+    LineIncrements takeIncrements(unsigned int numLines);
     void addLine(const Line& line);
     Range getTRange();
     Range getYRange();
     double maxT() const;
+    bool applyPending();
+    std::size_t memoryBytes() const;
+    void setMemoryCap(std::size_t bytes);
+    std::size_t getMemoryCap() const { return memoryCap; }
+    uint64_t getEvictedSegments() const { return evictedSegments; }
+    void setHistory(SweepHistory* history_) { history = history_; }
 
     double tStep;
+    // Only used by the GUI thread.  The methods above that change it (called by the data processing threads) queue the
+    // change, and applyPending() makes it, so painting never blocks data processing or vice versa.
     std::vector<Line> lines;
-    std::recursive_mutex linesMutex;
+    // Incremented whenever the finished sweeps (Line::oldData) are replaced, so Plot knows to re-render its cache of them
+    unsigned int oldDataGeneration;
+    // Incremented whenever points of the current sweep (Line::data) are removed or replaced, rather than appended to, so
+    // Plot knows its record of how much of each line it has drawn is stale
+    unsigned int dataGeneration;
+    // Where t = 0 of the current sweep (and of the finished one, Line::oldData) falls on a timeline that runs on from
+    // sweep to sweep, for plots that scroll rather than start over each sweep (see Plot::setScrolling)
+    double sweepStart;
+    double oldSweepStart;
 
 signals:
     void needFullRedraw();
     void needPartialRedraw(double tMin, double tMax);
 
 private:
+    /// \cond private
+    struct PendingUpdate {
+        enum Kind { SET, ADD_LINE, APPEND, ADD_POINT, CYCLE, CLEAR } kind;
+        unsigned int firstLineIndex;
+        LineIncrements increments; // Lines for SET, ADD_LINE, and APPEND
+        double t;                  // Point for ADD_POINT
+        double y;
+
+        explicit PendingUpdate(Kind kind_) : kind(kind_), firstLineIndex(0), t(0), y(0) {}
+    };
+    /// \endcond
+
+    CLAMP::ProfiledMutex pendingMutex;
+    std::vector<PendingUpdate> pending;  // Guarded by pendingMutex
+    std::vector<PendingUpdate> applying; // Storage reused by applyPending()
+    std::vector<LineIncrements> spare;   // Applied increments, reused by takeIncrements(); guarded by pendingMutex
+    static const unsigned int MAX_SPARE_INCREMENTS = 4;
+    std::vector<double> lastAddedT;      // Time of the last point added by addToLine for each line; guarded by pendingMutex
+    void publish(PendingUpdate&& update);
+    std::unique_lock<CLAMP::ProfiledMutex> lockPending();
+
+    // Union of the ranges of all lines, kept up to date as points are appended, and recomputed only after changes that
+    // can shrink it
+    Range tRangeCache;
+    Range yRangeCache;
+    bool rangesValid;
+    void updateRanges();
+
+    // Most bytes the lines may hold (0 for no limit); past it, applyPending() drops the oldest pieces
+    std::size_t memoryCap;
+    uint64_t evictedSegments;
+    void enforceMemoryCap();
+
+    // Where finished sweeps are recorded, if anywhere; GUI thread only
+    SweepHistory* history;
+
     void colorLines();
     static QColor rainbow(double hue);
     static Range getRange(const std::vector<Line>& ls, GetRange_t getter);
@@ -111,28 +117,44 @@ private:
 class Plot : public QWidget
 {
     Q_OBJECT
+    friend class PlotCanvasGL;
+    friend class PlotScheduler;
 
 public:
     Lines& data;
 
     Plot(QWidget *parent, Lines& data_, std::shared_ptr<Axis>& tAxis_, std::shared_ptr<Axis>& yAxis_);
+    ~Plot();
     
     QSize minimumSizeHint() const;
     QSize sizeHint() const;
 
+    // Default for setMaxFrameRate
+    static const unsigned int DEFAULT_MAX_FRAME_RATE = 60;
+
+    // Total time all plots have spent drawing, for the performance panel
+    static double getPaintSeconds();
+
 public slots:
     void setAutoScaling(bool value);
     void autoScaleForce();
+    void setOpenGL(bool enable);
+    void setScrolling(bool enable);
+    void setMaxFrameRate(unsigned int hz);
+    void setScheduler(PlotScheduler* scheduler_);
 
 private slots:
     void refreshPixmap();
     void scaleAndFullRefresh();
     void scaleAndPartialRefresh(double tMin, double tMax);
+    void flushRedraw();
+    void showRenderedFrame();
 
 protected:
     void paintEvent(QPaintEvent *event) override;
     void keyPressEvent(QKeyEvent *event) override;
     void closeEvent(QCloseEvent *event) override;
+    void showEvent(QShowEvent *event) override;
     void resizeEvent(QResizeEvent* event) override;
     void mousePressEvent(QMouseEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
@@ -143,14 +165,77 @@ private:
     void partialRedraw(double tMin, double tMax);
     void setMargins();
     void drawAxes(QPainter& painter);
-    void drawPlots(QPainter& painter, double tMin, double tMax);
-    void drawPlotWaveform(QPainter& painter, double tMin, double tMax, Line& waveform);
-    void drawPlotPiece(QPainter& painter, double tMin, double tMax, LineSegment& lineSegment);
+    PlotGeometry snapshotGeometry();
+    PlotFrame snapshot(bool full, double tMin, double tMax);
     QRect getRect(double tMin, double tMax);
     QRect getCursorRect();
+    QRect getPlotArea();
+    void drawSelection(QPainter& painter);
 
+    // Frame, axes, and grid; the traces are drawn over it
     QPixmap pixmap;
-    std::recursive_mutex pixmapMutex;
+    CLAMP::ProfiledRecursiveMutex pixmapMutex;
+
+    /// \cond private
+    // What the frame, axes, and labels in pixmap were drawn for; they're only drawn again when it changes (zoom, resize, ...)
+    struct AxesLayout {
+        QSize size;
+        QString font;
+        int dpi;
+        double tStep;
+        int tMinStep;
+        int tMaxStep;
+        double yStep;
+        int yMinStep;
+        int yMaxStep;
+
+        AxesLayout();
+        bool operator==(const AxesLayout& other) const;
+    };
+    /// \endcond
+    AxesLayout axesLayout;
+    AxesLayout currentAxesLayout() const;
+
+    // Draws the traces on a worker thread, from copies of the data; traces is the last image it finished
+    PlotRenderer* renderer;
+    QImage traces;
+    bool scrolling;
+
+    // The renderer caches the finished sweeps (Line::oldData); they're only copied for it when these say they've changed
+    bool oldLayerValid;
+    unsigned int oldLayerGeneration;
+    std::size_t oldLayerNumLines;
+
+    /// \cond private
+    // How much of a line has been sent to the renderer: all the pieces before piece, and points points of it
+    struct DrawnUpTo {
+        std::size_t piece;
+        std::size_t points;
+
+        DrawnUpTo() : piece(0), points(0) {}
+    };
+    /// \endcond
+    // So a partial redraw copies just the points added since the last frame, instead of searching the lines by time;
+    // only valid while Lines::dataGeneration is still drawnGeneration
+    std::vector<DrawnUpTo> drawnUpTo;
+    bool drawnValid;
+    unsigned int drawnGeneration;
+    double drawnMaxT; // Lines::maxT() as of the last frame
+    void markAllDrawn();
+
+    // Redraws requested by data are collected here and done at most once per redrawTimer interval
+    QTimer* redrawTimer;
+    QElapsedTimer sinceLastRedraw;
+    int minRedrawInterval; // ms
+    bool fullRedrawPending;
+    bool partialRedrawPending;
+    double pendingTMin;
+    double pendingTMax;
+    void scheduleRedraw();
+    PlotScheduler* scheduler; // If not null, does the redraws instead of redrawTimer
+
+    // If not null, draws the traces with OpenGL instead of renderer
+    PlotCanvasGL* canvas;
 
     int xOffset;
     int topMargin;
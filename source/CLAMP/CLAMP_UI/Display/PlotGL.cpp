@@ -0,0 +1,209 @@
+#ifdef CLAMP_OPENGL_PLOTS
+
+#include "PlotGL.h"
+#include "Plot.h"
+#include "Line.h"
+#include <QPainter>
+#include <QVector2D>
+#include <algorithm>
+
+using std::lock_guard;
+using std::recursive_mutex;
+using std::unique_ptr;
+
+namespace {
+    // Vertices are (t - t0, y); the plot's pixel mapping is linear, so it's just a scale and offset per segment
+    const char* vertexShaderSource =
+        "attribute highp vec2 position;\n"
+        "uniform highp vec2 scale;\n"
+        "uniform highp vec2 offset;\n"
+        "void main() {\n"
+        "    gl_Position = vec4(position * scale + offset, 0.0, 1.0);\n"
+        "}\n";
+
+    const char* fragmentShaderSource =
+        "uniform lowp vec4 color;\n"
+        "void main() {\n"
+        "    gl_FragColor = color;\n"
+        "}\n";
+
+    const std::size_t MIN_BUFFER_POINTS = 1024;
+}
+
+// ----------------------------------------------------------------------------------------------------------
+PlotCanvasGL::PlotCanvasGL(Plot& plot_) :
+    QOpenGLWidget(&plot_),
+    plot(plot_),
+    generation(0),
+    numLines(0)
+{
+    // Zooming etc. are handled by the Plot underneath
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+}
+
+PlotCanvasGL::~PlotCanvasGL() {
+    cleanup();
+}
+
+// Vertex buffers belong to the context, so they have to be destroyed while it's current
+void PlotCanvasGL::cleanup() {
+    if (!context()) {
+        return;
+    }
+    makeCurrent();
+    buffers.clear();
+    program.removeAllShaders();
+    doneCurrent();
+}
+
+void PlotCanvasGL::initializeGL() {
+    initializeOpenGLFunctions();
+    connect(context(), &QOpenGLContext::aboutToBeDestroyed, this, &PlotCanvasGL::cleanup);
+
+    program.addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShaderSource);
+    program.addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShaderSource);
+    program.bindAttributeLocation("position", 0);
+    program.link();
+}
+
+// Brings the vertex buffer for segment up to date, uploading only the points appended since the last call
+PlotCanvasGL::SegmentBuffer& PlotCanvasGL::upload(const LineSegment& segment) {
+    unique_ptr<SegmentBuffer>& entry = buffers[segment.getId()];
+    if (!entry) {
+        entry.reset(new SegmentBuffer);
+        entry->t0 = segment.tFront();
+        entry->uploaded = 0;
+        entry->capacity = 0;
+    }
+    SegmentBuffer& buffer = *entry;
+    buffer.used = true;
+
+    if (segment.size() > buffer.capacity) {
+        // Grow geometrically, so a segment that's being appended to is only re-uploaded O(log n) times
+        buffer.capacity = std::max(std::max(segment.size(), 2 * buffer.capacity), MIN_BUFFER_POINTS);
+        if (!buffer.vbo.isCreated()) {
+            buffer.vbo.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+            buffer.vbo.create();
+        }
+        buffer.vbo.bind();
+        buffer.vbo.allocate(static_cast<int>(buffer.capacity * 2 * sizeof(float)));
+        buffer.uploaded = 0;
+    }
+    else {
+        buffer.vbo.bind();
+    }
+
+    if (buffer.uploaded < segment.size()) {
+        std::size_t n = segment.size() - buffer.uploaded;
+        vertices.resize(2 * n);
+        for (std::size_t i = 0; i < n; i++) {
+            std::size_t index = buffer.uploaded + i;
+            vertices[2 * i] = static_cast<float>(segment.tAt(index) - buffer.t0);
+            vertices[2 * i + 1] = static_cast<float>(segment.y[index]);
+        }
+        buffer.vbo.write(static_cast<int>(buffer.uploaded * 2 * sizeof(float)), vertices.data(), static_cast<int>(vertices.size() * sizeof(float)));
+        buffer.uploaded = segment.size();
+    }
+    return buffer;
+}
+
+void PlotCanvasGL::drawSegment(const LineSegment& segment, double tMin, double tMax) {
+    if (segment.empty()) {
+        return;
+    }
+    SegmentBuffer& buffer = upload(segment);
+
+    // Same mapping as Plot::scaleToXPixel and Plot::scaleToYPixel, but in floating point and in this widget's coordinates
+    double xPixel0 = plot.xOffset + plot.tAxis->valueToSteps(buffer.t0) * plot.xStepSize - x();
+    double xPixelsPerT = plot.xStepSize / plot.tAxis->getStep();
+    double yPixel0 = plot.height() - (plot.yOffset + plot.yAxis->valueToSteps(0) * plot.yStepSize) - y();
+    double yPixelsPerY = -plot.yStepSize / plot.yAxis->getStep();
+
+    program.setUniformValue("scale", QVector2D(2.0 * xPixelsPerT / width(), -2.0 * yPixelsPerY / height()));
+    program.setUniformValue("offset", QVector2D(2.0 * xPixel0 / width() - 1.0, 1.0 - 2.0 * yPixel0 / height()));
+
+    LineSegment& s = const_cast<LineSegment&>(segment);
+    unsigned int first = s.getFirstIndexToDraw(tMin);
+    unsigned int last = s.getLastIndexToDraw(tMax);
+    if (first > last) {
+        return;
+    }
+
+    program.enableAttributeArray(0);
+    program.setAttributeBuffer(0, GL_FLOAT, 0, 2);
+    if (first == last) {
+        glDrawArrays(GL_POINTS, first, 1);
+    }
+    else {
+        glDrawArrays(GL_LINE_STRIP, first, last - first + 1);
+    }
+}
+
+void PlotCanvasGL::paintGL() {
+    lock_guard<CLAMP::ProfiledRecursiveMutex> lockp(plot.pixmapMutex);
+    plot.data.applyPending();
+
+    QPainter painter(this);
+
+    // Background, axes, and grid, as rendered by the Plot
+    painter.drawPixmap(0, 0, plot.pixmap, x(), y(), width(), height());
+
+    painter.beginNativePainting();
+    if (generation != plot.data.oldDataGeneration || numLines != plot.data.lines.size()) {
+        buffers.clear();
+        generation = plot.data.oldDataGeneration;
+        numLines = plot.data.lines.size();
+    }
+    for (auto& entry : buffers) {
+        entry.second->used = false;
+    }
+
+    if (program.bind()) {
+        double tMin = plot.tAxis->minAxisValue();
+        double tMax = plot.tAxis->maxAxisValue();
+
+        for (Line& waveform : plot.data.lines) {
+            program.setUniformValue("color", waveform.color);
+            for (auto piece = waveform.data.begin() + waveform.getFirstPieceToDraw(tMin); piece != waveform.data.end() && (piece->tFront() <= tMax); piece++) {
+                drawSegment(*piece, tMin, tMax);
+            }
+        }
+
+        // Residual data from the previous sweep(s), to the right of the live data
+        double tResidual = std::max(tMin, plot.data.maxT());
+        if (tResidual < tMax) {
+            int left = plot.scaleToXPixel(plot.tAxis->valueToSteps(tResidual)) + 1 - x();
+            qreal ratio = devicePixelRatio();
+            glEnable(GL_SCISSOR_TEST);
+            glScissor(static_cast<GLint>(left * ratio), 0, static_cast<GLsizei>(std::max(0, width() - left) * ratio), static_cast<GLsizei>(height() * ratio));
+            for (Line& waveform : plot.data.lines) {
+                program.setUniformValue("color", waveform.color);
+                for (auto piece = waveform.oldData.begin(); piece != waveform.oldData.end() && (piece->tFront() <= tMax); piece++) {
+                    drawSegment(*piece, tResidual, tMax);
+                }
+            }
+            glDisable(GL_SCISSOR_TEST);
+        }
+
+        QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+        program.disableAttributeArray(0);
+        program.release();
+    }
+
+    // Segments that weren't drawn have gone away (or scrolled off); free their buffers
+    for (auto it = buffers.begin(); it != buffers.end();) {
+        if (it->second->used) {
+            ++it;
+        }
+        else {
+            it = buffers.erase(it);
+        }
+    }
+    painter.endNativePainting();
+
+    // Selection overlay, in the Plot's coordinates
+    painter.translate(-x(), -y());
+    plot.drawSelection(painter);
+}
+
+#endif // CLAMP_OPENGL_PLOTS
@@ -0,0 +1,62 @@
+#pragma once
+
+#ifdef CLAMP_OPENGL_PLOTS
+
+#include <QOpenGLWidget>
+#include <QOpenGLFunctions>
+#include <QOpenGLBuffer>
+#include <QOpenGLShaderProgram>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Plot;
+struct LineSegment;
+
+/** \brief OpenGL renderer for the traces of a Plot.
+ *
+ *  Sits on top of the plot area of its Plot.  The Plot still draws the frame, axes, and grid into its pixmap; this
+ *  widget copies that in as the background and draws the traces (Plot::data) with the GPU.
+ *
+ *  Each LineSegment gets its own vertex buffer, found by the segment's id (not its address, which a later segment can
+ *  reuse).  Since segments only grow at the end while a sweep is running, only the points appended since the last paint
+ *  are uploaded.  Vertices are stored relative to the start of their segment,
+ *  and the mapping to the screen is done in the vertex shader, so changing the axes doesn't require any uploads.
+ */
+class PlotCanvasGL : public QOpenGLWidget, protected QOpenGLFunctions
+{
+    Q_OBJECT
+
+public:
+    explicit PlotCanvasGL(Plot& plot_);
+    ~PlotCanvasGL();
+
+protected:
+    void initializeGL() override;
+    void paintGL() override;
+
+private:
+    /// \cond private
+    struct SegmentBuffer {
+        QOpenGLBuffer vbo;
+        double t0;            // Time of the first point; vertices store t - t0 so that floats keep enough precision
+        std::size_t uploaded; // Number of points already in vbo
+        std::size_t capacity; // Number of points vbo has room for
+        bool used;            // Drawn during the current paint
+    };
+    /// \endcond
+
+    Plot& plot;
+    QOpenGLShaderProgram program;
+    std::unordered_map<uint64_t, std::unique_ptr<SegmentBuffer>> buffers; // By LineSegment::getId()
+    unsigned int generation;
+    std::size_t numLines;
+    std::vector<float> vertices;
+
+    SegmentBuffer& upload(const LineSegment& segment);
+    void drawSegment(const LineSegment& segment, double tMin, double tMax);
+    void cleanup();
+};
+
+#endif // CLAMP_OPENGL_PLOTS
@@ -0,0 +1,389 @@
+#include "PlotRenderer.h"
+#include "Trace.h"
+#include <QPainter>
+#include <QVector>
+#include <QPointF>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+using std::lock_guard;
+using std::unique_lock;
+using std::mutex;
+using std::vector;
+
+// ----------------------------------------------------------------------------------------------------------
+PlotGeometry::PlotGeometry() :
+    xOffset(0),
+    yOffset(0),
+    topMargin(0),
+    rightMargin(0),
+    xStepSize(0),
+    yStepSize(0),
+    tStep(1),
+    tMinStep(0),
+    yStep(1),
+    yMinStep(0),
+    tMinAxis(0),
+    tMaxAxis(0),
+    scrolling(false),
+    scrollHead(0),
+    tOffset(0)
+{
+
+}
+
+// Same as Plot::getRect
+QRect PlotGeometry::rangeRect(double tMin, double tMax) const {
+    int minX = xPixel(tMin);
+    int maxX = std::min(xPixel(tMax), size.width() - rightMargin);
+    QRect clipRect;
+    clipRect.setCoords(minX, topMargin + 1, maxX, size.height() - (yOffset + 1));
+    return clipRect;
+}
+
+PlotFrame::PlotFrame() :
+    full(true),
+    tMin(0),
+    tMax(0),
+    maxT(0),
+    renderOldData(false),
+    sweepStart(0),
+    oldSweepStart(0),
+    incremental(false)
+{
+
+}
+
+// ----------------------------------------------------------------------------------------------------------
+namespace {
+    /* Reduces the samples that land in one pixel column to at most four points: the first, the minimum and maximum (in
+     * the order they occurred), and the last.  Drawn as a polyline, that looks the same as drawing every sample, so
+     * spikes and transients survive, but the number of points is bounded by the width of the plot.
+     */
+    struct PixelColumn {
+        int x;
+        int count;
+        int first, last, min, max;
+        bool minFirst;
+
+        PixelColumn() : x(0), count(0), first(0), last(0), min(0), max(0), minFirst(true) {}
+
+        void start(int x_, int y) {
+            x = x_;
+            count = 1;
+            first = last = min = max = y;
+            minFirst = true;
+        }
+
+        void add(int y) {
+            count++;
+            last = y;
+            if (y < min) {
+                min = y;
+                minFirst = false; // Min is the most recent extreme, so it comes after max
+            }
+            if (y > max) {
+                max = y;
+                minFirst = true;
+            }
+        }
+
+        void flush(QVector<QPointF>& p) const {
+            p.push_back(QPointF(x, first));
+            if (count > 2) {
+                p.push_back(QPointF(x, minFirst ? min : max));
+                p.push_back(QPointF(x, minFirst ? max : min));
+            }
+            if (count > 1) {
+                p.push_back(QPointF(x, last));
+            }
+        }
+    };
+
+    // Time spent rendering, summed over all renderers
+    std::atomic<uint64_t> renderNanoseconds(0);
+}
+
+// ----------------------------------------------------------------------------------------------------------
+PlotRenderer::PlotRenderer(QObject* parent) :
+    QObject(parent),
+    stopping(false),
+    scrollHead(0)
+{
+    worker = std::thread(&PlotRenderer::work, this);
+}
+
+PlotRenderer::~PlotRenderer() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+        frames.clear();
+    }
+    workAvailable.notify_one();
+    worker.join();
+}
+
+/** \brief Queues a redraw.
+ *
+ *  \param[in] frame  What to draw; a full redraw discards the frames queued before it
+ */
+void PlotRenderer::queue(PlotFrame&& frame) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (frame.full) {
+            // They'd all be drawn over
+            frames.clear();
+        }
+        frames.push_back(std::move(frame));
+    }
+    workAvailable.notify_one();
+}
+
+/// The traces as of the last frame drawn (a null image before the first one); shares, rather than copies, its pixels
+QImage PlotRenderer::takeImage() {
+    lock_guard<mutex> lock(queueMutex);
+    return finished;
+}
+
+double PlotRenderer::getRenderSeconds() {
+    return renderNanoseconds.load() * 1e-9;
+}
+
+void PlotRenderer::work() {
+    unique_lock<mutex> lock(queueMutex);
+    for (;;) {
+        while (frames.empty() && !stopping) {
+            workAvailable.wait(lock);
+        }
+        if (stopping) {
+            return;
+        }
+        PlotFrame frame = std::move(frames.front());
+        frames.pop_front();
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        render(frame);
+        renderNanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+        lock.lock();
+        if (frames.empty()) {
+            // Hand the image over; the next frame drawn into traces detaches it
+            finished = traces;
+            lock.unlock();
+            emit frameReady();
+            lock.lock();
+        }
+    }
+}
+
+void PlotRenderer::render(PlotFrame& frame) {
+    CLAMP_TRACE_SPAN("PlotRenderer::render");
+    if (frame.geometry.scrolling) {
+        renderScrolling(frame);
+        return;
+    }
+    const PlotGeometry& geometry = frame.geometry;
+
+    if (frame.full || traces.size() != geometry.size) {
+        traces = QImage(geometry.size, QImage::Format_ARGB32_Premultiplied);
+        traces.fill(Qt::transparent);
+        frame.full = true;
+    }
+    if (frame.renderOldData) {
+        renderOldLayer(frame);
+    }
+
+    double tMin = frame.tMin;
+    double tMax = frame.tMax;
+    QPainter painter(&traces);
+    QRect clipRect = frame.full ? geometry.plotArea : geometry.rangeRect(tMin, tMax);
+    if (!frame.full) {
+        // Clear the cursor area and the range being redrawn
+        QRect clearRect = clipRect;
+        if (frame.incremental) {
+            // The last frame's data ends in the first column, and the new points are drawn over it
+            clearRect.setLeft(clearRect.left() + 1);
+            clipRect = geometry.plotArea;
+        }
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.fillRect(frame.cursorRect, Qt::transparent);
+        if (clearRect.isValid()) {
+            painter.fillRect(clearRect, Qt::transparent);
+        }
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    }
+    painter.setClipRect(clipRect);
+
+    for (Line& waveform : frame.lines) {
+        painter.setPen(waveform.color);
+        for (LineSegment& piece : waveform.data) {
+            drawPiece(painter, geometry, tMin, tMax, piece, frame.incremental);
+        }
+    }
+
+    // Residual data from the previous sweep(s), to the right of the live data
+    double tResidual = std::max(tMin, frame.maxT);
+    if (tResidual < tMax && oldLayer.size() == traces.size()) {
+        QRect residualRect = geometry.rangeRect(tResidual, tMax);
+        residualRect.setLeft(residualRect.left() + 1);
+        painter.drawImage(residualRect.topLeft(), oldLayer, residualRect);
+    }
+}
+
+// Moves the pixels in area left by shift columns, and clears the columns that leaves on the right
+static void scrollLeft(QImage& image, const QRect& area, int shift) {
+    const int bytesPerPixel = 4; // Format_ARGB32_Premultiplied, where transparent is all zeros
+    int keep = area.width() - shift;
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        uchar* row = image.scanLine(y) + area.left() * bytesPerPixel;
+        memmove(row, row + shift * bytesPerPixel, keep * bytesPerPixel);
+        memset(row + keep * bytesPerPixel, 0, shift * bytesPerPixel);
+    }
+}
+
+// Strip chart: shifts what's there by the columns the new data takes up, and draws just the new data
+void PlotRenderer::renderScrolling(PlotFrame& frame) {
+    PlotGeometry geometry = frame.geometry;
+    QRect area = geometry.plotArea.intersected(QRect(QPoint(0, 0), geometry.size));
+    int64_t shift = geometry.scrollHead - scrollHead;
+    if (frame.full || traces.size() != geometry.size || shift < 0 || shift >= area.width()) {
+        traces = QImage(geometry.size, QImage::Format_ARGB32_Premultiplied);
+        traces.fill(Qt::transparent);
+    }
+    else if (shift > 0) {
+        scrollLeft(traces, area, static_cast<int>(shift));
+    }
+    scrollHead = geometry.scrollHead;
+
+    QPainter painter(&traces);
+    painter.setClipRect(area);
+    if (frame.renderOldData) {
+        geometry.tOffset = frame.oldSweepStart;
+        for (Line& waveform : frame.lines) {
+            painter.setPen(waveform.color);
+            for (LineSegment& piece : waveform.oldData) {
+                drawPiece(painter, geometry, std::numeric_limits<double>::lowest(), std::numeric_limits<double>::max(), piece);
+            }
+        }
+    }
+
+    // Everything left of tMin is already there
+    geometry.tOffset = frame.sweepStart;
+    if (!frame.full && !frame.incremental) {
+        QRect clipRect = area;
+        clipRect.setLeft(std::max(area.left(), geometry.xPixel(frame.tMin)));
+        painter.setClipRect(clipRect);
+    }
+    for (Line& waveform : frame.lines) {
+        painter.setPen(waveform.color);
+        for (LineSegment& piece : waveform.data) {
+            drawPiece(painter, geometry, frame.tMin, frame.tMax, piece, frame.incremental);
+        }
+    }
+}
+
+// Renders the finished sweeps (Line::oldData) on a transparent background
+void PlotRenderer::renderOldLayer(PlotFrame& frame) {
+    const PlotGeometry& geometry = frame.geometry;
+    oldLayer = QImage(geometry.size, QImage::Format_ARGB32_Premultiplied);
+    oldLayer.fill(Qt::transparent);
+    QPainter painter(&oldLayer);
+    painter.setClipRect(geometry.plotArea);
+
+    for (Line& waveform : frame.lines) {
+        painter.setPen(waveform.color);
+        for (LineSegment& piece : waveform.oldData) {
+            drawPiece(painter, geometry, geometry.tMinAxis, geometry.tMaxAxis, piece);
+        }
+    }
+}
+
+void PlotRenderer::drawLines(QPainter& painter, const PlotGeometry& geometry, vector<Line>& lines) {
+    for (Line& waveform : lines) {
+        painter.setPen(waveform.color);
+        for (LineSegment& piece : waveform.data) {
+            drawPiece(painter, geometry, geometry.tMinAxis, geometry.tMaxAxis, piece, true);
+        }
+    }
+}
+
+// Draws the points of lineSegment that [tMin, tMax] needs, or all of them if whole (so there's nothing to search for)
+void PlotRenderer::drawPiece(QPainter& painter, const PlotGeometry& geometry, double tMin, double tMax, LineSegment& lineSegment, bool whole) {
+    QVector<QPointF> p;
+
+    if (lineSegment.empty()) {
+        return;
+    }
+    const vector<double>& y = lineSegment.y;
+
+    PixelColumn column;
+    auto addPoint = [&](double tValue, double yValue) {
+        int px = geometry.xPixel(tValue);
+        int py = geometry.yPixel(yValue);
+        if (column.count == 0) {
+            column.start(px, py);
+        }
+        else if (px == column.x) {
+            column.add(py);
+        }
+        else {
+            column.flush(p);
+            column.start(px, py);
+        }
+    };
+
+    // Use the coarsest level of detail whose buckets are no wider than a pixel
+    unsigned int level = 0;
+    if (lineSegment.size() > 1) {
+        double pixelsPerPoint = geometry.xStepSize * (geometry.tToSteps(lineSegment.tBack()) - geometry.tToSteps(lineSegment.tFront())) / (lineSegment.size() - 1);
+        unsigned int numLevels = lineSegment.numLevels();
+        double pointsPerBucket = LineSegment::LOD_FACTOR;
+        while (level + 1 < numLevels && pointsPerBucket * pixelsPerPoint <= 1.0) {
+            level++;
+            pointsPerBucket *= LineSegment::LOD_FACTOR;
+        }
+    }
+
+    int width = geometry.size.width();
+    if (level == 0) {
+        int maxIteration = whole ? static_cast<int>(lineSegment.size()) - 1 : lineSegment.getLastIndexToDraw(tMax);
+        int firstIteration = whole ? 0 : lineSegment.getFirstIndexToDraw(tMin);
+        p.reserve(std::max(0, std::min(maxIteration - firstIteration + 1, 4 * width)));
+        for (int i = firstIteration; i <= maxIteration; ++i) {
+            addPoint(lineSegment.tAt(i), y[i]);
+        }
+    }
+    else {
+        const vector<LineBucket>& buckets = lineSegment.getLevel(level);
+        auto byTFirst = [](double value, const LineBucket& b) { return value < b.tFirst; };
+        std::size_t first = 0;
+        std::size_t last = buckets.size() - 1;
+        if (!whole) {
+            first = std::upper_bound(buckets.begin(), buckets.end(), tMin, byTFirst) - buckets.begin();
+            if (first > 0) {
+                first--;
+            }
+            last = std::min(static_cast<std::size_t>(std::upper_bound(buckets.begin(), buckets.end(), tMax, byTFirst) - buckets.begin()), last);
+        }
+        p.reserve(4 * width);
+        for (std::size_t i = first; i <= last; i++) {
+            const LineBucket& b = buckets[i];
+            addPoint(b.tFirst, b.yFirst);
+            addPoint(b.tFirst, b.minFirst ? b.yMin : b.yMax);
+            addPoint(b.tLast, b.minFirst ? b.yMax : b.yMin);
+            addPoint(b.tLast, b.yLast);
+        }
+    }
+    if (column.count > 0) {
+        column.flush(p);
+    }
+
+    if (!p.empty()) {
+        painter.drawPoint(p.first());
+        painter.drawPolyline(p);
+    }
+}
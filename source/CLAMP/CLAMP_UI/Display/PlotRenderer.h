@@ -0,0 +1,129 @@
+#pragma once
+
+#include <QObject>
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "Line.h"
+
+/// \cond private
+// Farther left than any plot is wide, so points way off the left edge of a strip chart don't overflow
+const int64_t MAX_SCROLL_PIXELS = 1 << 20;
+/// \endcond
+
+/// Pixel mapping of a Plot (the same as Plot::scaleToXPixel and friends), copied so the renderer never touches the widget
+struct PlotGeometry {
+    QSize size;
+    QRect plotArea;
+    int xOffset;
+    int yOffset;
+    int topMargin;
+    int rightMargin;
+    int xStepSize;
+    int yStepSize;
+    double tStep;
+    int tMinStep;
+    double yStep;
+    int yMinStep;
+    double tMinAxis; // Range of the time axis
+    double tMaxAxis;
+
+    // For a strip chart (see Plot::setScrolling), x is a column of the timeline that runs on from sweep to sweep, counting
+    // from t = 0 of the first sweep, and scrollHead is the column at the right edge of the plot area.  tOffset puts the
+    // sweep being drawn on the timeline.
+    bool scrolling;
+    int64_t scrollHead;
+    double tOffset;
+
+    PlotGeometry();
+    double tToSteps(double t) const { return t / tStep - tMinStep; }
+    int64_t column(double t) const { return static_cast<int64_t>(std::floor((t + tOffset) / tStep * xStepSize)); }
+    int xPixel(double t) const {
+        if (scrolling) {
+            return plotArea.right() - static_cast<int>(std::min<int64_t>(scrollHead - column(t), MAX_SCROLL_PIXELS));
+        }
+        return xOffset + static_cast<int>(tToSteps(t) * xStepSize);
+    }
+    int yPixel(double y) const { return size.height() - (yOffset + static_cast<int>((y / yStep - yMinStep) * yStepSize)); }
+    QRect rangeRect(double tMin, double tMax) const;
+};
+
+/// One redraw of the traces, with the data it needs copied out of Lines on the GUI thread
+struct PlotFrame {
+    bool full;               // Start from a blank image; otherwise only [tMin, tMax] and cursorRect are redrawn
+    PlotGeometry geometry;
+    double tMin;
+    double tMax;
+    QRect cursorRect;        // Cleared ahead of the live data, so cycling looks good
+    double maxT;             // End of the live data; finished sweeps show to the right of it
+    bool renderOldData;      // lines[i].oldData is included, and the finished sweeps must be rendered again
+    double sweepStart;       // Lines::sweepStart and Lines::oldSweepStart, for a strip chart
+    double oldSweepStart;
+    std::vector<Line> lines; // Only the points that drawing [tMin, tMax] uses
+    // Only points were appended since the last frame: lines has just those, plus the last point drawn on each line,
+    // and they're drawn over the image as it is; [tMin, tMax] is the range past the last frame's data to clear
+    bool incremental;
+
+    PlotFrame();
+};
+
+/** \brief Draws the traces of a Plot into a QImage on a worker thread.
+ *
+ *  Plot draws the frame, axes, and grid into its pixmap, which only changes when the axes or the size do; the traces
+ *  change with every batch of data, and drawing them is most of the cost of a redraw.  Plot queues a PlotFrame for each
+ *  redraw instead, and this draws it into a transparent image the size of the plot, so the GUI thread only composites
+ *  the finished image over the pixmap.
+ *
+ *  Frames are drawn in order, each on top of the last, as partial redraws need.  A full redraw replaces everything
+ *  queued before it.  The image is handed over (see takeImage()) once the queue is empty, and frameReady() is emitted.
+ */
+class PlotRenderer : public QObject {
+    Q_OBJECT
+
+public:
+    explicit PlotRenderer(QObject* parent = nullptr);
+    ~PlotRenderer();
+
+    void queue(PlotFrame&& frame);
+    QImage takeImage();
+
+    // Total time all renderers have spent drawing
+    static double getRenderSeconds();
+
+    // Draws every piece of lines' current sweep (Line::data) whole, as a frame would; for drawing traces outside a Plot
+    static void drawLines(QPainter& painter, const PlotGeometry& geometry, std::vector<Line>& lines);
+
+signals:
+    void frameReady();
+
+private:
+    std::mutex queueMutex;
+    std::condition_variable workAvailable;
+    std::deque<PlotFrame> frames; // Guarded by queueMutex
+    QImage finished;              // Guarded by queueMutex
+    bool stopping;
+
+    // Only used by the worker thread
+    QImage traces;
+    QImage oldLayer; // Finished sweeps, rendered once and copied in to the right of the live data
+    int64_t scrollHead; // Column at the right edge of traces, for a strip chart
+    std::thread worker;
+
+    void work();
+    void render(PlotFrame& frame);
+    void renderScrolling(PlotFrame& frame);
+    void renderOldLayer(PlotFrame& frame);
+    static void drawPiece(QPainter& painter, const PlotGeometry& geometry, double tMin, double tMax, LineSegment& lineSegment, bool whole = false);
+
+    // Not copyable
+    PlotRenderer(const PlotRenderer&);
+    PlotRenderer& operator=(const PlotRenderer&);
+};
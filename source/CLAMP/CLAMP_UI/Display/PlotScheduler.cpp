@@ -0,0 +1,87 @@
+#include "PlotScheduler.h"
+#include "Plot.h"
+#include <QTimer>
+#include <algorithm>
+
+PlotScheduler::PlotScheduler(QObject* parent) :
+    QObject(parent),
+    next(0),
+    maxPlotsPerFrame(DEFAULT_MAX_PLOTS_PER_FRAME)
+{
+    timer = new QTimer(this);
+    setFrameRate(DEFAULT_FRAME_RATE);
+    connect(timer, SIGNAL(timeout()), this, SLOT(frame()));
+}
+
+/** \brief Sets how often the dirty plots are redrawn.
+ *
+ *  \param[in] hz  Frames per second
+ */
+void PlotScheduler::setFrameRate(unsigned int hz) {
+    timer->setInterval(static_cast<int>(1000 / std::max(1u, hz)));
+}
+
+/** \brief Sets how many plots one frame redraws, at most.
+ *
+ *  \param[in] n  Plots per frame
+ */
+void PlotScheduler::setMaxPlotsPerFrame(unsigned int n) {
+    maxPlotsPerFrame = std::max(1u, n);
+}
+
+/// Adds a plot; Plot::setScheduler calls this
+void PlotScheduler::add(Plot* plot) {
+    if (std::find(plots.begin(), plots.end(), plot) == plots.end()) {
+        plots.push_back(plot);
+        dirty.push_back(false);
+    }
+}
+
+/// Removes a plot; Plot::setScheduler and the Plot's destructor call this
+void PlotScheduler::remove(Plot* plot) {
+    auto iter = std::find(plots.begin(), plots.end(), plot);
+    if (iter != plots.end()) {
+        std::size_t index = iter - plots.begin();
+        plots.erase(iter);
+        dirty.erase(dirty.begin() + index);
+        if (next > index) {
+            next--;
+        }
+    }
+}
+
+/// Asks for plot to be redrawn in one of the next frames
+void PlotScheduler::markDirty(Plot* plot) {
+    auto iter = std::find(plots.begin(), plots.end(), plot);
+    if (iter == plots.end()) {
+        return;
+    }
+    dirty[iter - plots.begin()] = true;
+    if (!timer->isActive()) {
+        timer->start();
+    }
+}
+
+void PlotScheduler::frame() {
+    unsigned int redrawn = 0;
+    bool waiting = false; // Visible plots still dirty after this frame
+    std::size_t n = plots.size();
+    std::size_t start = next;
+    for (std::size_t k = 0; k < n; k++) {
+        std::size_t i = (start + k) % n;
+        if (!dirty[i] || !plots[i]->isVisible() || plots[i]->visibleRegion().isEmpty()) {
+            continue;
+        }
+        if (redrawn == maxPlotsPerFrame) {
+            waiting = true;
+            break;
+        }
+        dirty[i] = false;
+        plots[i]->flushRedraw();
+        redrawn++;
+        next = (i + 1) % n;
+    }
+    if (!waiting) {
+        timer->stop();
+    }
+}
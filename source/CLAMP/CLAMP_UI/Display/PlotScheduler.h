@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QObject>
+#include <vector>
+#include <cstddef>
+
+class Plot;
+class QTimer;
+
+/** \brief Redraws a group of plots from one timer, instead of each plot redrawing on its own.
+ *
+ *  Normally each Plot collects the redraws its data asks for and does them on a timer of its own (see
+ *  Plot::setMaxFrameRate), so every plot added is another set of redraws per second.  A plot given a scheduler (see
+ *  Plot::setScheduler) just marks itself dirty, and on each frame the scheduler redraws the dirty plots that can be
+ *  seen, taking turns, and at most maxPlotsPerFrame of them.  So the redraw cost is bounded however many plots there
+ *  are; with many plots, each is redrawn less often.  Plots that are hidden stay dirty, and are redrawn when shown.
+ */
+class PlotScheduler : public QObject {
+    Q_OBJECT
+
+public:
+    explicit PlotScheduler(QObject* parent = nullptr);
+
+    void setFrameRate(unsigned int hz);
+    void setMaxPlotsPerFrame(unsigned int n);
+
+    void add(Plot* plot);
+    void remove(Plot* plot);
+    void markDirty(Plot* plot);
+
+    // Default for setFrameRate and setMaxPlotsPerFrame
+    static const unsigned int DEFAULT_FRAME_RATE = 30;
+    static const unsigned int DEFAULT_MAX_PLOTS_PER_FRAME = 4;
+
+private slots:
+    void frame();
+
+private:
+    QTimer* timer;
+    std::vector<Plot*> plots;
+    std::vector<bool> dirty; // By index in plots
+    std::size_t next;        // Where the next frame starts looking, so every plot gets its turn
+    unsigned int maxPlotsPerFrame;
+
+    // Not copyable
+    PlotScheduler(const PlotScheduler&);
+    PlotScheduler& operator=(const PlotScheduler&);
+};
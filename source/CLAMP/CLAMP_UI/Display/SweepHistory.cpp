@@ -0,0 +1,172 @@
+#include "SweepHistory.h"
+#include <algorithm>
+#include <cstdint>
+
+using std::vector;
+
+SweepHistory::SweepHistory(QObject* parent) :
+    QObject(parent),
+    memorySweeps(DEFAULT_MEMORY_SWEEPS)
+{
+}
+
+SweepHistory::~SweepHistory() {
+}
+
+/** \brief Sets how many of the most recent sweeps are kept in memory; older ones are moved to the temporary file.
+ *
+ *  \param[in] n  Sweeps kept in memory
+ */
+void SweepHistory::setMemorySweeps(unsigned int n) {
+    memorySweeps = std::max(1u, n);
+    while (recent.size() > memorySweeps) {
+        spillOldest();
+    }
+}
+
+/** \brief Adds a finished sweep.
+ *
+ *  \param[in] lines  The sweep's lines; only Line::data is kept.  Non-const because the pieces' levels of detail are
+ *                    brought up to date to decimate them.
+ */
+void SweepHistory::record(vector<Line>& lines) {
+    vector<Line> sweep(lines.size());
+    for (std::size_t i = 0; i < lines.size(); i++) {
+        for (LineSegment& piece : lines[i].data) {
+            if (!piece.empty()) {
+                sweep[i].data.push_back(decimate(piece));
+            }
+        }
+    }
+    recent.push_back(std::move(sweep));
+    while (recent.size() > memorySweeps) {
+        spillOldest();
+    }
+    emit sizeChanged(size());
+}
+
+/** \brief Returns a recorded sweep.
+ *
+ *  \param[in] index  Number of the sweep, from 0 for the oldest to size() - 1 for the most recent
+ *  \return The sweep's lines (not colored), or none if it couldn't be written to or read back from the temporary file
+ */
+vector<Line> SweepHistory::sweep(unsigned int index) {
+    vector<Line> result;
+    if (index >= size()) {
+        return result;
+    }
+    if (index >= offsets.size()) {
+        return recent[index - offsets.size()];
+    }
+    if (offsets[index] < 0 || !spill.seek(offsets[index])) {
+        return result;
+    }
+
+    uint32_t numLines = 0;
+    if (spill.read(reinterpret_cast<char*>(&numLines), sizeof(numLines)) != sizeof(numLines)) {
+        return result;
+    }
+    vector<double> ts, ys;
+    result.resize(numLines);
+    for (Line& line : result) {
+        uint32_t numPieces = 0;
+        spill.read(reinterpret_cast<char*>(&numPieces), sizeof(numPieces));
+        for (uint32_t p = 0; p < numPieces; p++) {
+            uint32_t n = 0;
+            spill.read(reinterpret_cast<char*>(&n), sizeof(n));
+            ts.resize(n);
+            ys.resize(n);
+            qint64 bytes = static_cast<qint64>(n) * sizeof(double);
+            if (spill.read(reinterpret_cast<char*>(ts.data()), bytes) != bytes || spill.read(reinterpret_cast<char*>(ys.data()), bytes) != bytes) {
+                return vector<Line>();
+            }
+            line.data.push_back(LineSegment());
+            line.data.back().append(ts.data(), ys.data(), n);
+        }
+    }
+    return result;
+}
+
+// Moves the oldest sweep in memory to the end of the temporary file
+void SweepHistory::spillOldest() {
+    qint64 offset = -1;
+    if (spill.isOpen() || spill.open()) {
+        offset = spill.size();
+        spill.seek(offset);
+
+        const vector<Line>& lines = recent.front();
+        uint32_t numLines = static_cast<uint32_t>(lines.size());
+        bool ok = spill.write(reinterpret_cast<const char*>(&numLines), sizeof(numLines)) == sizeof(numLines);
+        vector<double> ts;
+        for (const Line& line : lines) {
+            uint32_t numPieces = static_cast<uint32_t>(line.data.size());
+            ok = ok && spill.write(reinterpret_cast<const char*>(&numPieces), sizeof(numPieces)) == sizeof(numPieces);
+            for (const LineSegment& piece : line.data) {
+                uint32_t n = static_cast<uint32_t>(piece.size());
+                ts.resize(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    ts[i] = piece.tAt(i);
+                }
+                qint64 bytes = static_cast<qint64>(n) * sizeof(double);
+                ok = ok && spill.write(reinterpret_cast<const char*>(&n), sizeof(n)) == sizeof(n);
+                ok = ok && spill.write(reinterpret_cast<const char*>(ts.data()), bytes) == bytes;
+                ok = ok && spill.write(reinterpret_cast<const char*>(piece.y.data()), bytes) == bytes;
+            }
+        }
+        if (!ok) {
+            // E.g., the disk is full; the sweep is lost, but the ones after it still go where they belong
+            spill.resize(offset);
+            offset = -1;
+        }
+    }
+    offsets.push_back(offset);
+    recent.pop_front();
+}
+
+// A copy of piece with at most MAX_POINTS_PER_PIECE points, from the coarsest level of detail that has enough buckets
+LineSegment SweepHistory::decimate(LineSegment& piece) {
+    LineSegment result;
+    if (piece.size() <= MAX_POINTS_PER_PIECE) {
+        for (std::size_t i = 0; i < piece.size(); i++) {
+            result.append(piece.tAt(i), piece.y[i]);
+        }
+        return result;
+    }
+
+    // Each bucket becomes up to four points
+    unsigned int level = 1;
+    while (level + 1 < piece.numLevels() && piece.getLevel(level).size() * 4 > MAX_POINTS_PER_PIECE) {
+        level++;
+    }
+    for (const LineBucket& bucket : piece.getLevel(level)) {
+        result.append(bucket.tFirst, bucket.yFirst);
+        if (bucket.tLast > bucket.tFirst) {
+            double tMiddle = (bucket.tFirst + bucket.tLast) / 2;
+            result.append(tMiddle, bucket.minFirst ? bucket.yMin : bucket.yMax);
+            result.append(tMiddle, bucket.minFirst ? bucket.yMax : bucket.yMin);
+            result.append(bucket.tLast, bucket.yLast);
+        }
+    }
+    return result;
+}
+
+// Bytes held by the sweeps in memory; the ones in the temporary file only cost an entry in offsets
+std::size_t SweepHistory::memoryBytes() const {
+    std::size_t total = offsets.capacity() * sizeof(qint64);
+    for (const vector<Line>& lines : recent) {
+        for (const Line& line : lines) {
+            total += sizeof(Line) + line.dataBytes();
+        }
+    }
+    return total;
+}
+
+/// Forgets every sweep, and empties the temporary file
+void SweepHistory::clear() {
+    recent.clear();
+    offsets.clear();
+    if (spill.isOpen()) {
+        spill.resize(0);
+    }
+    emit sizeChanged(0);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QObject>
+#include <QTemporaryFile>
+#include <vector>
+#include <deque>
+#include <cstddef>
+#include "Line.h"
+
+/** \brief Finished sweeps of a Lines, kept so they can be looked at again later.
+ *
+ *  Lines records each sweep here as it finishes (see Lines::setHistory).  Every piece is decimated to at most
+ *  MAX_POINTS_PER_PIECE points, the way the renderer reduces it for drawing: each run of points becomes its first,
+ *  extreme, and last values, so it looks the same at any width a plot is likely to have.  The most recent
+ *  memorySweeps sweeps are kept in memory; older ones are written to a temporary file and read back when asked for, so
+ *  memory doesn't grow with the number of sweeps, however many there are.
+ *
+ *  GUI thread only.
+ */
+class SweepHistory : public QObject {
+    Q_OBJECT
+
+public:
+    explicit SweepHistory(QObject* parent = nullptr);
+    ~SweepHistory();
+
+    void record(std::vector<Line>& lines);
+    std::vector<Line> sweep(unsigned int index);
+    unsigned int size() const { return static_cast<unsigned int>(offsets.size() + recent.size()); }
+    void setMemorySweeps(unsigned int n);
+    std::size_t memoryBytes() const;
+
+    // Defaults for setMemorySweeps, and the most points a piece is decimated to
+    static const unsigned int DEFAULT_MEMORY_SWEEPS = 32;
+    static const unsigned int MAX_POINTS_PER_PIECE = 4096;
+
+public slots:
+    void clear();
+
+signals:
+    void sizeChanged(unsigned int count);
+
+private:
+    std::deque<std::vector<Line>> recent; // The last memorySweeps sweeps, oldest first
+    std::vector<qint64> offsets;          // Where each older sweep starts in spill, or -1 if it couldn't be written
+    QTemporaryFile spill;
+    unsigned int memorySweeps;
+
+    void spillOldest();
+    static LineSegment decimate(LineSegment& piece);
+
+    // Not copyable
+    SweepHistory(const SweepHistory&);
+    SweepHistory& operator=(const SweepHistory&);
+};
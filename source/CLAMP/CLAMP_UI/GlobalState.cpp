@@ -3,9 +3,19 @@
 #include "Board.h"
 #include "Thread.h"
 #include "ClampThread.h"
+#include "SaveFile.h"
+#include "MultiplexedSaveFile.h"
+#include "streams.h"
+#include "SaveWriterThread.h"
+#include "FileCloser.h"
+#include "HealthMonitor.h"
+#include "common.h"
+#include <set>
 
 using CLAMP::Board;
 using std::unique_ptr;
+using CLAMP::IO::MultiplexedSaveFile;
+using CLAMP::IO::FileCloser;
 
 //--------------------------------------------------------------------------
 class LEDThread : public Thread {
@@ -17,7 +27,7 @@ public:
         while (keepGoing) {
             board.setFpgaLeds(value);
             value = (value & 0x80) ? 1 : (value << 1);
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            keepGoing.waitFor(std::chrono::milliseconds(500));
         }
     }
     void done() override {
@@ -31,48 +41,150 @@ private:
 //--------------------------------------------------------------------------
 GlobalState::GlobalState(std::unique_ptr<CLAMP::Board>& board_) :
     board(std::move(board_)),
-    running(false)
+    boardStreams(std::make_shared<BoardStreams>()),
+    multiplexedNumAdcs(-1),
+    running(false),
+    multiplexedAuxConsumer(0)
 {
 	saveAuxMode = true;
+	asyncSaveMode = false;
+	directIOSaveMode = false;
+	journalSaveMode = false;
+	auxSaveFormat = CLAMP::IO::SaveFile::AUX_RECORDS;
+	auxSaveAdcs = true;
+	sweepIndexSaveMode = false;
+	saveFormat = CLAMP::IO::SaveFile::FLOAT_RECORDS;
+	saveRolloverMB = 0;
+	saveRolloverMinutes = 0;
+	multiplexedSaveMode = false;
+	concurrentProtocols = false;
+	gaplessIntervals = false;
 	vClampX2mode = false;
+	displayMemoryCap = 0;
+	processingIntervalMs = 0;
 	for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
 		datastore[i].state = this;
 		pipetteOffsetEnabled[i].setValue(true);
 	}
     connect(this, SIGNAL(threadFinished()), this, SLOT(finishThread()));
     ledThread.reset(new LEDThread(*board));
+
+    // Called on the ClampThread; the signal is queued to the GUI thread
+    healthMonitor.reset(new CLAMP::HealthMonitor(*board));
+    healthMonitor->setCallback([this](const std::vector<CLAMP::HealthReading>& readings) {
+        for (const CLAMP::HealthReading& reading : readings) {
+            emit healthChecked(reading.chip, reading.temperature, reading.drift, reading.responding);
+        }
+    });
+    // Likewise called on the thread that reads the board
+    board->fifoMonitor.addCallback([this](CLAMP::FifoMonitor::Watermark crossed, const CLAMP::FifoSample& sample) {
+        emit fifoWatermarkCrossed(crossed == CLAMP::FifoMonitor::HIGH, sample.percentageFull);
+    });
 }
 
 GlobalState::~GlobalState() {
+    closeMultiplexedFile();
+    // Files from the last run may still be closing, with callbacks that refer to this
+    FileCloser::instance().waitAll();
+}
+
+// Opens the file for a multiplexed recording (see multiplexedSaveMode), with the aux columns if auxToo
+void GlobalState::openMultiplexedFile(const QString& filename, bool auxToo) {
+	FILENAME path = toFileName(filename.toStdString());
+	FileCloser::instance().waitFor(path); // The last recording may have had the same name, and still be closing
+	unique_ptr<MultiplexedSaveFile> file(new MultiplexedSaveFile());
+	file->setDirectIO(directIOSaveMode);
+	file->open(path, asyncSaveMode);
+
+	closeMultiplexedFile();
+	if (auxToo) {
+		// The board only sends the ADCs and digital I/O if something uses them
+		multiplexedNumAdcs = board->expanderBoardPresent() ? 8 : 2;
+		bool adcs[8];
+		for (int i = 0; i < 8; i++) {
+			adcs[i] = (i < multiplexedNumAdcs);
+		}
+		multiplexedAuxConsumer = board->addDataConsumer(adcs, true, true);
+	}
+	multiplexedSaveFile = std::move(file);
+	multiplexedPath = path;
+}
+
+void GlobalState::closeMultiplexedFile() {
+	if (!multiplexedSaveFile) {
+		return;
+	}
+	multiplexedSaveFile->close();
+	multiplexedSaveFile.reset();
+	if (multiplexedNumAdcs >= 0) {
+		board->removeDataConsumer(multiplexedAuxConsumer);
+		multiplexedNumAdcs = -1;
+	}
+}
+
+// As closeMultiplexedFile, but FileCloser flushes and closes the file in the background, so the next run needn't wait;
+// an error is reported on unit's status line
+void GlobalState::closeMultiplexedFileAsync(int unit) {
+	if (!multiplexedSaveFile) {
+		return;
+	}
+	FileCloser::instance().close(std::move(multiplexedSaveFile), multiplexedPath, [this, unit](std::exception_ptr error) {
+		saveFileClosed(unit, error);
+	});
+	if (multiplexedNumAdcs >= 0) {
+		board->removeDataConsumer(multiplexedAuxConsumer);
+		multiplexedNumAdcs = -1;
+	}
 }
 
 void GlobalState::stateMessage(int unit, const char* message) {
     emit statusMessage(unit, message);
 }
 
+// Completion callback for files closed by FileCloser; called on its thread, so the message is queued to the GUI thread
+void GlobalState::saveFileClosed(int unit, std::exception_ptr error) {
+    if (!error) {
+        return;
+    }
+    try {
+        std::rethrow_exception(error);
+    }
+    catch (std::exception& e) {
+        std::string message = std::string("Error closing save file: ") + e.what();
+        emit statusMessage(unit, QString::fromStdString(message));
+    }
+    catch (...) {
+        emit statusMessage(unit, "Error closing save file");
+    }
+}
+
 void GlobalState::runThread(Thread* thread) {
     running = true;
     backgroundThread.reset(thread);
 
     emit threadStatusChanged(true);
-    backgroundThread->start();
-    ledThread->start();
+    backgroundThread->start(acquisitionLane);
+    ledThread->start(backgroundLane);
 }
 
 // Stops the current thread; stores it away
 // Runs the input thread
 // When the input thread finishes, will return to the thread it was running before all this started
+//
+// The input thread is queued on the acquisition lane right away, so it starts as soon as the current thread returns,
+// without waiting for finishThread; this doesn't block the GUI while the current thread winds down.
 void GlobalState::preemptThread(Thread* thread) {
-    closeThreads();
-    running = false;
-
     if (backgroundThread.get() == nullptr) {
         runThread(thread);
     }
+    else if (waitingThread.get() != nullptr) {
+        delete thread; // Already switching to another thread
+    }
     else {
-        if (waitingThread.get() == nullptr) {
-            waitingThread.reset(thread);
-        }
+        running = false;
+        waitingThread.reset(thread);
+        waitingThread->start(acquisitionLane);
+        stopThreads();
     }
 }
 
@@ -82,8 +194,11 @@ void GlobalState::finishThread()
     running = false;
 
     if (waitingThread.get() != nullptr) {
+        // Already queued by preemptThread, and probably running by now
         preemptedThread.swap(backgroundThread);
-        runThread(waitingThread.release());
+        backgroundThread.reset(waitingThread.release());
+        running = true;
+        ledThread->start(backgroundLane);
     }
     else if (preemptedThread.get() != nullptr) {
         runThread(preemptedThread.release());
@@ -109,6 +224,53 @@ void GlobalState::setPipetteOffset(int unit, double value) {
     }
 }
 
+void GlobalState::setDisplayMemoryCap(std::size_t bytes) {
+    displayMemoryCap = bytes;
+    for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+        datastore[i].setDisplayMemoryCap(bytes);
+    }
+}
+
+void GlobalState::setProcessingInterval(double milliseconds) {
+    processingIntervalMs = milliseconds;
+    for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+        datastore[i].setProcessingInterval(milliseconds / 1000);
+    }
+}
+
+static double megabytes(std::size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+// Writes the memory held by the acquisition, display, and save buffers to the log.  GUI thread only.
+void GlobalState::logMemoryUsage() {
+    CLAMP::MemoryUsage boardUsage = board->getMemoryUsage();
+    LOG(true) << "Memory usage (MB):\n";
+    LOG(true) << "  Read queue: " << megabytes(boardUsage.readQueueBytes) << " (" << boardUsage.readQueueAllocations << " allocations), USB buffer: "
+              << megabytes(boardUsage.usbBufferBytes) << "\n";
+    LOG(true) << "  Waveform RAM: " << boardUsage.waveformWordsUsed << " of " << boardUsage.waveformWordsTotal << " words\n";
+
+    std::size_t total = boardUsage.readQueueBytes + boardUsage.usbBufferBytes;
+    std::set<const BoardStreams*> streamsSeen;
+    for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+        DataStoreMemoryUsage usage = datastore[i].getMemoryUsage();
+        if (usage.total() > 0) {
+            LOG(true) << "  Headstage " << i << ": samples " << megabytes(usage.sampleBytes) << ", waveforms " << megabytes(usage.waveformBytes)
+                      << ", processors and plots " << megabytes(usage.processorBytes) << "\n";
+        }
+        total += usage.total();
+        if (usage.streams && streamsSeen.insert(usage.streams).second) {
+            LOG(true) << "  Board streams: " << megabytes(usage.streamBytes) << "\n";
+            total += usage.streamBytes;
+        }
+    }
+
+    CLAMP::IO::SaveQueueStatistics saveStats = CLAMP::IO::SaveWriterThread::instance().getStatistics();
+    LOG(true) << "  Save queue: " << megabytes(saveStats.bytesQueued) << "\n";
+    total += saveStats.bytesQueued;
+    LOG(true) << "  Total: " << megabytes(total) << "\n";
+}
+
 void GlobalState::errorMessage(const char* title, const char* message) {
     emit error(title, message);
 }
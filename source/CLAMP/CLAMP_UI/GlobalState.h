@@ -1,29 +1,59 @@
 #pragma once
 
+#include <exception>
 #include <memory>
 #include <QObject>
 #include "Constants.h"
 #include "DataStore.h"
 #include "MVC.h"
+#include "TaskLane.h"
 
 namespace CLAMP {
     class Board;
+    class HealthMonitor;
+    namespace IO {
+        class MultiplexedSaveFile;
+    }
 }
 
-class Thread;
-
 class GlobalState : public QObject {
     Q_OBJECT
 
 public:
     std::unique_ptr<CLAMP::Board> board;
 	DataStore datastore[CLAMP::MAX_NUM_CHIPS];
+    // Board-wide streams for the current cycle, viewed by the DataStores of the headstages being run
+    std::shared_ptr<BoardStreams> boardStreams;
+    // Persistent worker threads; declared before the threads that run on them, so they outlive them
+    TaskLane acquisitionLane; // Clamp runs, zaps, buzzes: one at a time
+    TaskLane backgroundLane;  // LED blinking
     std::unique_ptr<Thread> backgroundThread;
     std::unique_ptr<Thread> ledThread;
+    // Temperature and readback checks, done by ClampThread between sweeps; results come as healthChecked
+    std::unique_ptr<CLAMP::HealthMonitor> healthMonitor;
+    // Optional work to skip when the host falls behind the board; updated by ClampThread as it reads
+    OverloadController overload;
     double pipetteOffsetInmV[CLAMP::MAX_NUM_CHIPS];
     BoolHolder pipetteOffsetEnabled[CLAMP::MAX_NUM_CHIPS];
 	bool saveAuxMode;
+	bool asyncSaveMode;
+	bool directIOSaveMode; // Write .clp files around the OS file cache (see SaveFile::setDirectIO)
+	bool journalSaveMode; // Write .clp files as journals, recoverable after a crash (see SaveFile::setJournal)
+	int auxSaveFormat; // CLAMP::IO::SaveFile::AuxFormat, for .clp aux files
+	bool auxSaveAdcs;  // With SaveFile::AUX_EVENTS, store the ADCs as well as the digital changes
+	bool sweepIndexSaveMode; // Write a sweep index next to each headstage .clp file (see SaveFile::setSweepIndex)
+	int saveFormat; // CLAMP::IO::SaveFile::Format
+	double saveRolloverMB;      // Split save files into segments of at most this size (see SaveFile::setRollover); 0 for no limit
+	double saveRolloverMinutes; // ... or this duration; 0 for no limit
+	bool multiplexedSaveMode; // Record every headstage, and the aux I/O, to one file (see MultiplexedSaveFile)
+	// Open while a multiplexed recording runs; the ClampThread writes to it as it reads
+	std::unique_ptr<CLAMP::IO::MultiplexedSaveFile> multiplexedSaveFile;
+	int multiplexedNumAdcs; // ADCs in its aux columns; -1 if it has none
+	bool concurrentProtocols; // Every headstage runs its own waveform, rather than holding while one runs (see ClampThread)
+	bool gaplessIntervals; // Runs with an interval keep the board running, holding between sweeps (see ClampThread::waveformToCommands)
 	bool vClampX2mode;
+	std::size_t displayMemoryCap; // Per plot; 0 for no limit (see DataStore::setDisplayMemoryCap)
+	double processingIntervalMs; // 0 to process every read as it's stored (see DataStore::setProcessingInterval)
 
     GlobalState(std::unique_ptr<CLAMP::Board>& board_);
     ~GlobalState();
@@ -36,6 +66,13 @@ public:
     void preemptThread(Thread* thread);
     bool isRunning() { return running; }
 	void setPipetteOffset(int unit, double value);
+	void setDisplayMemoryCap(std::size_t bytes);
+	void setProcessingInterval(double milliseconds);
+	void logMemoryUsage();
+	void openMultiplexedFile(const QString& filename, bool auxToo);
+	void closeMultiplexedFile();
+	void closeMultiplexedFileAsync(int unit);
+	void saveFileClosed(int unit, std::exception_ptr error);
 
 signals:
     void pipetteOffsetChanged(int unit, double value);
@@ -43,6 +80,8 @@ signals:
     void threadFinished();
     void error(const char* title, const char* message);
     void statusMessage(int unit, QString message); // Note: should not be QString&
+    void healthChecked(int unit, double temperature, double drift, bool responding);
+    void fifoWatermarkCrossed(bool high, double percentageFull); // From Board::fifoMonitor
 
 public slots:
     void errorMessage(const char* title, const char* message);
@@ -52,6 +91,8 @@ private slots:
 
 private:
     bool running;
+    unsigned int multiplexedAuxConsumer;
+    FILENAME multiplexedPath; // Path multiplexedSaveFile was opened with, for FileCloser
     std::unique_ptr<Thread> preemptedThread;
     std::unique_ptr<Thread> waitingThread;
 };
@@ -0,0 +1,107 @@
+#include "OverloadController.h"
+#include "common.h"
+#include <algorithm>
+
+const double OverloadController::FIFO_HIGH = 25.0;
+const double OverloadController::LOAD_HIGH = 0.9;
+const double OverloadController::FIFO_CRITICAL = 60.0;
+const double OverloadController::FIFO_LOW = 5.0;
+const double OverloadController::LOAD_LOW = 0.5;
+const double OverloadController::SETTLE_SECONDS = 1.0;
+const double OverloadController::CALM_SECONDS = 10.0;
+
+OverloadController::OverloadController(QObject* parent) :
+    QObject(parent),
+    level(NORMAL),
+    load(0),
+    sinceChange(0),
+    calmSeconds(0)
+{
+}
+
+/** \brief Records one read's worth of processing, and sheds or restores a level of work if called for.
+ *
+ *  Called on the thread that reads the board, once it has finished with the read's data.
+ *
+ *  \param[in] fifoPercentageFull  Board::fifoPercentageFull after the read
+ *  \param[in] processingSeconds   Time spent on the read's data, not counting the read itself
+ *  \param[in] dataSeconds         Duration of the data read
+ */
+void OverloadController::update(double fifoPercentageFull, double processingSeconds, double dataSeconds) {
+    if (dataSeconds <= 0) {
+        return;
+    }
+    double weight = std::min(1.0, dataSeconds);
+    load += weight * (processingSeconds / dataSeconds - load);
+    sinceChange += dataSeconds;
+    if (fifoPercentageFull <= FIFO_LOW && load <= LOAD_LOW) {
+        calmSeconds += dataSeconds;
+    }
+    else {
+        calmSeconds = 0;
+    }
+
+    Level current = getLevel();
+    if (fifoPercentageFull >= FIFO_CRITICAL) {
+        if (current != SHED_ANALYSIS) {
+            setLevel(SHED_ANALYSIS, "FIFO nearly full");
+        }
+    }
+    else if ((fifoPercentageFull >= FIFO_HIGH || load >= LOAD_HIGH) && sinceChange >= SETTLE_SECONDS) {
+        if (current != SHED_ANALYSIS) {
+            setLevel(static_cast<Level>(current + 1), (fifoPercentageFull >= FIFO_HIGH) ? "FIFO filling" : "processing too slow");
+        }
+    }
+    else if (current != NORMAL && calmSeconds >= CALM_SECONDS) {
+        setLevel(static_cast<Level>(current - 1), "keeping up");
+    }
+}
+
+/// Goes back to shedding nothing, e.g., before a new run; doesn't log.
+void OverloadController::reset() {
+    load = 0;
+    sinceChange = 0;
+    calmSeconds = 0;
+    level = NORMAL;
+}
+
+void OverloadController::setLevel(Level next, const char* reason) {
+    LOG(true) << "Overload: " << levelName(next).toStdString() << " (" << reason << "; processing takes " << load * 100 << "% of real time)\n";
+    level = next;
+    sinceChange = 0;
+    calmSeconds = 0;
+}
+
+/// Short name of a level, for the status display and the log
+QString OverloadController::levelName(Level level_) {
+    switch (level_) {
+    case NORMAL:
+        return tr("Normal");
+    case SHED_PLOTS:
+        return tr("Plots paused");
+    case SHED_FITS:
+        return tr("Fits paused");
+    case SHED_SPECTRUM:
+        return tr("Spectrum paused");
+    case SHED_ANALYSIS:
+        return tr("Saving only");
+    }
+    return QString();
+}
+
+/// What's being shed at a level (and every level below it)
+QString OverloadController::levelDescription(Level level_) {
+    switch (level_) {
+    case NORMAL:
+        return tr("Keeping up with the board; nothing is being skipped");
+    case SHED_PLOTS:
+        return tr("Falling behind the board: the plots are paused");
+    case SHED_FITS:
+        return tr("Falling behind the board: the plots, exponential fits, and cell parameters are paused");
+    case SHED_SPECTRUM:
+        return tr("Falling behind the board: the plots, fits, cell parameters, and noise spectrum are paused");
+    case SHED_ANALYSIS:
+        return tr("Falling behind the board: all analysis is paused; data is still being saved");
+    }
+    return QString();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+
+/* Sheds optional work when the host can't keep up with the board, long before the board's FIFO fills (which leaves the
+ * board in a bad state; see Board::runContinuously) and data would be lost.
+ *
+ * The ClampThread calls update() after each read with how full the FIFO is and how long the read's data took to
+ * process.  When the FIFO starts filling, or processing takes nearly as long as the data lasts, the next level of work is
+ * shed, in order: the plots, the exponential fits (with the cell parameters and resistance computed from them), the
+ * noise spectrum, and finally every other DataProcessor.  Storing and saving the data is never shed.  A level is given
+ * SETTLE_SECONDS to take effect before the next one is shed, except that a nearly full FIFO sheds everything at once.
+ * Once the board has been comfortably keeping up for CALM_SECONDS, the last level shed is restored; its processors
+ * catch up on the cycle so far (see DataStore::handleChange).
+ *
+ * Every change of level is logged.  The level can be read from any thread; DataStores consult it on each change, and
+ * the control window shows it.
+ */
+class OverloadController : public QObject {
+    Q_OBJECT
+
+public:
+    enum Level {
+        NORMAL = 0,
+        SHED_PLOTS,    // DataProcessor::plotsOnly() processors
+        SHED_FITS,     // Exponential fits, and what's calculated from them
+        SHED_SPECTRUM, // The display's noise spectrum
+        SHED_ANALYSIS  // Every remaining DataProcessor
+    };
+
+    explicit OverloadController(QObject* parent = nullptr);
+
+    void update(double fifoPercentageFull, double processingSeconds, double dataSeconds);
+    void reset();
+    Level getLevel() const { return static_cast<Level>(level.load(std::memory_order_relaxed)); }
+    static QString levelName(Level level_);
+    static QString levelDescription(Level level_);
+
+    // When to shed the next level: FIFO percentage full, or seconds of processing per second of data
+    static const double FIFO_HIGH;
+    static const double LOAD_HIGH;
+    // When to shed everything at once
+    static const double FIFO_CRITICAL;
+    // When the board is keeping up comfortably
+    static const double FIFO_LOW;
+    static const double LOAD_LOW;
+    // Seconds of data a new level gets to take effect; seconds of comfortable running before a level is restored
+    static const double SETTLE_SECONDS;
+    static const double CALM_SECONDS;
+
+private:
+    std::atomic<int> level;
+    // Only used by the thread calling update()
+    double load;         // Processing seconds per second of data, smoothed over about a second of data
+    double sinceChange;  // Seconds of data since the level last changed
+    double calmSeconds;  // Seconds of data the board has been keeping up comfortably
+
+    void setLevel(Level next, const char* reason);
+};
@@ -11,6 +11,7 @@
 #define QSTRING_ANGLE_SYMBOL  ((QString)((QChar)0x2220))
 #define QSTRING_DEGREE_SYMBOL  ((QString)((QChar)0x00b0))
 #define QSTRING_PLUSMINUS_SYMBOL  ((QString)((QChar)0x00b1))
+#define QSTRING_SQRT_SYMBOL  ((QString)((QChar)0x221a))
 
 // Interface board FPGA constants
 #define MAX_COMMAND_SEQUENCE_LENGTH 16384
@@ -23,6 +23,9 @@
 #include <stdexcept>
 #include <iostream>
 #include <memory>
+#include <chrono>
+#include <functional>
+#include <future>
 
 #include "DisplayWindow.h"
 #include "ControlWindow.h"
@@ -30,10 +33,17 @@
 #include "common.h"
 #include "Constants.h"
 #include "Board.h"
+#include "CalibrationCache.h"
+#include "HealthMonitor.h"
+#include "SimulatedBoard.h"
+#include "Trace.h"
+#include "streams.h"
 #include <sstream>
 #include <QDesktopWidget>
+#include <QColor>
 #include <QFile>
 #include <QDir>
+#include <QTextStream>
 
 //#include <vld.h>
 
@@ -46,14 +56,147 @@ using namespace CLAMP::ClampConfig;
 using std::ostream;
 using std::string;
 using std::ostringstream;
+using std::vector;
 
 bool logTemperature = true;
+bool logCalibrationTimes = true;
 
-// Attach to board and do calibration
-string setupBoard(QSplashScreen* splash, Board& board) {
+// Set from the command line (--recalibrate) to ignore the saved calibration and cable delays
+bool forceCalibration = false;
+
+// Set from the command line (--simulate, or --replay <file>) to run without hardware; calibration is skipped
+bool simulated = false;
+
+// Times the phases of startup; the report is logged once the windows are up
+class StartupProfile {
+public:
+    StartupProfile() : last(std::chrono::steady_clock::now()), start(last) {}
+
+    // Records the time since the last mark as the given phase
+    void mark(const char* phase) {
+        auto now = std::chrono::steady_clock::now();
+        phases.push_back(Phase{ phase, std::chrono::duration<double>(now - last).count(), false });
+        last = now;
+    }
+
+    // Records a phase timed on another thread, which overlapped the ones marked meanwhile
+    void addOverlapped(const char* phase, double seconds) {
+        phases.push_back(Phase{ phase, seconds, true });
+    }
+
+    void report() const {
+        for (const Phase& phase : phases) {
+            LOG(true) << "Startup time (" << phase.name << (phase.overlapped ? ", in parallel" : "") << "):\t" << phase.seconds << " s\n";
+        }
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+        LOG(true) << "Startup time (total):\t" << total.count() << " s\n\n";
+    }
+
+private:
+    struct Phase {
+        const char* name;
+        double seconds;
+        bool overlapped;
+    };
+    std::chrono::steady_clock::time_point last;
+    std::chrono::steady_clock::time_point start;
+    vector<Phase> phases;
+};
+
+// Shows message on the splash screen; may be called from the calibration thread, since it goes through the event queue
+static void showSplashMessage(QSplashScreen* splash, const char* message) {
+    QMetaObject::invokeMethod(splash, "showMessage", Qt::QueuedConnection, Q_ARG(QString, QObject::tr(message)),
+                              Q_ARG(int, static_cast<int>(Qt::AlignCenter | Qt::AlignBottom)), Q_ARG(QColor, QColor(Qt::black)));
+}
+
+// Shows message on the splash screen, runs one calibration stage, and logs how long it took
+static void calibrationStage(QSplashScreen* splash, const char* message, const char* name, const std::function<void()>& stage) {
+    if (message) {
+        showSplashMessage(splash, message);
+    }
+    auto start = std::chrono::steady_clock::now();
+    stage();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(logCalibrationTimes) << "Calibration time (" << name << "):\t" << elapsed.count() << " s\n";
+}
+
+// Full calibration of all present headstages
+static void calibrateAll(QSplashScreen* splash, Board& board, const ChipChannelList& channelList) {
+    // Each stage calibrates all present headstages together
+    auto totalStart = std::chrono::steady_clock::now();
+    calibrationStage(splash, "Calibrating voltage amplifiers...", "voltage amplifiers", [&]() {
+        board.controller.voltageAmplifier.calibrate(channelList);
+    });
+    calibrationStage(splash, "Calibrating difference amplifiers...", "difference amplifiers 1", [&]() {
+        board.controller.differenceAmplifier.calibrate1(channelList);
+    });
+    calibrationStage(splash, "Calibrating voltage clamp DACs...", "voltage clamp DACs", [&]() {
+        board.controller.clampVoltageGenerator.calibrate(channelList);
+    });
+    calibrationStage(splash, nullptr, "difference amplifiers 2", [&]() {
+        board.controller.differenceAmplifier.calibrate2(channelList);
+    });
+    calibrationStage(splash, "Calibrating current-to-voltage converters...", "current-to-voltage converters", [&]() {
+        board.controller.currentToVoltageConverter.calibrate(channelList);
+    });
+    calibrationStage(splash, "Calibrating current clamp DACs...", "current clamp DACs", [&]() {
+        // Three settings per round trip narrows the search four-fold each time, halving the round trips
+        board.controller.clampCurrentGenerator.searchCandidatesPerStep = 3;
+        board.controller.clampCurrentGenerator.calibrate(channelList);
+    });
+    std::chrono::duration<double> totalElapsed = std::chrono::steady_clock::now() - totalStart;
+    LOG(logCalibrationTimes) << "Calibration time (total):\t" << totalElapsed.count() << " s\n\n";
+}
+
+// Where calibration results are kept between runs
+static FILENAME calibrationCacheFile() {
+    return toFileName(QDir(QDir::homePath()).filePath(".IntanCLAMPCalibration.dat").toStdWString());
+}
+
+// Where the cable delays found at the last start are kept, for Board::scanForChips to try first
+static QString cableDelayFile() {
+    return QDir(QDir::homePath()).filePath(".IntanCLAMPCableDelays.txt");
+}
+
+// One delay per port, -1 for none; empty if there's no (usable) file
+static vector<int> loadCableDelays() {
+    vector<int> delays;
+    QFile file(cableDelayFile());
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return delays;
+    }
+    QTextStream in(&file);
+    for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
+        int delay = -1;
+        in >> delay;
+        if (in.status() != QTextStream::Ok) {
+            return vector<int>();
+        }
+        delays.push_back(delay);
+    }
+    return delays;
+}
+
+static void saveCableDelays(const vector<int>& delays) {
+    QFile file(cableDelayFile());
+    if (file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        QTextStream out(&file);
+        for (int delay : delays) {
+            out << delay << " ";
+        }
+        out << "\n";
+    }
+}
+
+// Attach to board and find the headstages
+void connectBoard(QSplashScreen* splash, Board& board) {
     Qt::Alignment position = Qt::AlignCenter | Qt::AlignBottom;
     try {
         splash->showMessage(QObject::tr("Connecting to Intan CLAMP Controller..."), position, Qt::black);
+        // Confirming last time's cable delays takes one run instead of a scan through all of them
+        if (!simulated && !forceCalibration) {
+            board.cableDelayHints = loadCableDelays();
+        }
 		if (!board.open()) {
 			//QMessageBox::critical(nullptr, "Intan CLAMP Controller Not Found",
 			//	"Intan Technologies CLAMP Controller not found on any USB port.  "
@@ -71,40 +214,70 @@ string setupBoard(QSplashScreen* splash, Board& board) {
 		}
 		if (spiLedByte == 0) {
             throw runtime_error("No Intan CLAMP headstages detected.  Connect headstage(s) and restart.");
+        }
+        if (!simulated) {
+            saveCableDelays(board.getCableDelays());
         }
 		board.setSpiPortLeds(spiLedByte);
 		board.setStatusLeds(true, 1);
+    }
+    catch (exception& e) {
+        QMessageBox::critical(splash, QObject::tr("Error"), e.what());
+        exit(EXIT_FAILURE); // abort application
+    }
+}
 
-        ostringstream oss;
-        ostream* oldLogger = SetLogger(&oss);
-		ChipChannelList channelList = board.getPresentChannels();
-        splash->showMessage(QObject::tr("Calibrating voltage amplifiers..."), position, Qt::black);
-        board.controller.voltageAmplifier.calibrate(channelList);
-        splash->showMessage(QObject::tr("Calibrating difference amplifiers..."), position, Qt::black);
-        board.controller.differenceAmplifier.calibrate1(channelList);
-        splash->showMessage(QObject::tr("Calibrating voltage clamp DACs..."), position, Qt::black);
-        board.controller.clampVoltageGenerator.calibrate(channelList);
-        // splash->showMessage(QObject::tr("Calibrating difference amplifiers..."), position, Qt::black);
-        board.controller.differenceAmplifier.calibrate2(channelList);
-        splash->showMessage(QObject::tr("Calibrating current-to-voltage converters..."), position, Qt::black);
-        board.controller.currentToVoltageConverter.calibrate(channelList);
-        splash->showMessage(QObject::tr("Calibrating current clamp DACs..."), position, Qt::black);
-        board.controller.clampCurrentGenerator.calibrate(channelList);
+// Calibrate the headstages, or restore the saved calibration; returns the calibration report.  Runs on a worker thread
+// while the GUI thread builds the windows, so it mustn't touch any widget except through showSplashMessage.
+string calibrateBoard(QSplashScreen* splash, Board& board) {
+    // Everything logged meanwhile, on any thread, goes in the report
+    ostringstream oss;
+    ostream* oldLogger = SetLogger(&oss);
+    try {
+        ChipChannelList channelList = board.getPresentChannels();
+        if (!simulated) {
+            LOG(true) << (board.wasBitfileReused() ? "FPGA: already configured\n" : "FPGA: bitfile uploaded\n");
+        }
+        LOG(true) << (board.cableDelaysConfirmed ? "Cable delays: saved delays confirmed\n\n" : "Cable delays: full scan\n\n");
+
+        // Reuse the previous run's calibration if the same headstages are attached and it still checks out
+        CalibrationCache cache;
+        FILENAME cacheFile = calibrationCacheFile();
+        bool restored = false;
+        if (simulated) {
+            LOG(true) << "Simulated board; not calibrating\n\n";
+        }
+        else if (!forceCalibration) {
+            calibrationStage(splash, "Checking saved calibration...", "saved calibration check", [&]() {
+                restored = cache.load(cacheFile) && cache.restore(board, channelList);
+            });
+        }
+        if (restored) {
+            LOG(true) << "Using saved calibration\n\n";
+        }
+        else if (!simulated) {
+            calibrateAll(splash, board, channelList);
+            try {
+                cache.store(board, channelList);
+                cache.save(cacheFile);
+            }
+            catch (exception& e) {
+                LOG(true) << "Warning: could not save calibration: " << e.what() << "\n\n";
+            }
+        }
 
-		board.controller.clampVoltageGenerator.setClampStepSizeImmediate(channelList, false);
+        board.controller.clampVoltageGenerator.setClampStepSizeImmediate(channelList, false);
 
         if (logTemperature) {
             LOG(true) << "Temperature:\t" << board.controller.temperatureSensor.readTemperature(0) << "C\n\n";
         }
-
-        SetLogger(oldLogger);
-        return oss.str();
     }
-    catch (exception& e) {
-        QMessageBox::critical(splash, QObject::tr("Error"), e.what());
-        exit(EXIT_FAILURE); // abort application
+    catch (...) {
+        SetLogger(oldLogger);
+        throw;
     }
-
+    SetLogger(oldLogger);
+    return oss.str();
 }
 
 void center(QWidget& left, QWidget& right) {
@@ -133,8 +306,19 @@ int main(int argc, char *argv[]) {
     try {
         RedirectIOToConsole();
         SetLogger(&std::cerr);
+        SetAsyncLogging(true); // Calibration logs a lot; don't make it wait on the console
+        StartupProfile profile;
 
         QApplication app(argc, argv);
+        if (app.arguments().contains("--recalibrate")) {
+            forceCalibration = true;
+        }
+        // --trace <file> records hot-path timings, and writes them as a Chrome trace when the program exits
+        int traceIndex = app.arguments().indexOf("--trace");
+        bool tracing = (traceIndex >= 0 && traceIndex + 1 < app.arguments().size());
+        if (tracing) {
+            CLAMP::Tracing::setEnabled(true);
+        }
 
         QSplashScreen* splash = new QSplashScreen();
         splash->setPixmap(QPixmap(":/images/splash.png"));
@@ -142,20 +326,99 @@ int main(int argc, char *argv[]) {
 
         Qt::Alignment topRight = Qt::AlignRight | Qt::AlignTop;
         splash->showMessage(QObject::tr("Starting..."), topRight, Qt::black);
+        profile.mark("Qt and splash screen");
+
+        unique_ptr<Board> board;
+        QStringList arguments = app.arguments();
+        int replayIndex = arguments.indexOf("--replay");
+        if (arguments.contains("--simulate") || (replayIndex >= 0 && replayIndex + 1 < arguments.size())) {
+            simulated = true;
+            CLAMP::SimulatedBoard* simulatedBoard = new CLAMP::SimulatedBoard();
+            board.reset(new Board(unique_ptr<OpalKellyBoard>(simulatedBoard)));
+            unique_ptr<CLAMP::PacketSource> source;
+            if (replayIndex >= 0) {
+                source.reset(new CLAMP::ReplaySource(toFileName(arguments[replayIndex + 1].toStdString())));
+            }
+            else {
+                source.reset(new CLAMP::ModelCellSource(*board));
+            }
+            simulatedBoard->attach(*board, std::move(source));
+        }
+        else {
+            board.reset(new Board());
+            // --reload-fpga uploads the bitfile even if the FPGA still has it from last time
+            board->setForceBitfileUpload(arguments.contains("--reload-fpga"));
+        }
 
-        unique_ptr<Board> board(new Board());
-
-        string calibrationReport = setupBoard(splash, *board);
-
-		board->enableChannels({}, true);
-		board->clearCommands();
+        connectBoard(splash, *board);
+        profile.mark("board open: Opal Kelly library, bitfile, headstage scan");
 
 		ChipChannelList channelList = board->getPresentChannels();
 
-        board->controller.offChipComponents.setInputImmediate(channelList, Register8::ElectrodePin);
+        // Calibration is most of startup, and only needs the board, so it runs on a worker while the GUI thread builds
+        // the display window and loads the resources.  The control window waits: its widgets set up the board as
+        // they're built, from the calibration results.
+        Board& calibrating = *board;
+        double calibrationSeconds = 0;
+        std::future<string> calibration = std::async(std::launch::async, [&]() {
+            auto start = std::chrono::steady_clock::now();
+            string report = calibrateBoard(splash, calibrating);
+            calibrationSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return report;
+        });
 
         GlobalState state(board);
-        DisplayWindow display(state, calibrationReport, channelList.front().chip);
+        DisplayWindow display(state, channelList.front().chip);
+        profile.mark("display window");
+
+        // QSound cannot play wav files directly from Qt resource files, so
+        // this is a workaround:  Copy the wav file from the resource file to
+        // a temporary directory, then play it from there when needed.
+        QFile fileTemp(QDir::tempPath() + "/beep.wav");
+        copyResource(fileTemp, ":/sounds/beep.wav");
+
+        // QFile fileTemp2(QDir::tempPath() + "/buzz.wav");
+        // copyResource(fileTemp2, ":/sounds/buzz.wav");
+        profile.mark("resources");
+
+        // Keep the splash screen's messages coming while waiting
+        while (calibration.wait_for(std::chrono::milliseconds(20)) != std::future_status::ready) {
+            app.processEvents();
+        }
+        profile.mark("waiting for calibration");
+        try {
+            display.setCalibrationReport(calibration.get());
+        }
+        catch (exception& e) {
+            QMessageBox::critical(splash, QObject::tr("Error"), e.what());
+            exit(EXIT_FAILURE); // abort application
+        }
+        profile.addOverlapped("calibration", calibrationSeconds);
+
+        // --capture <file> records the raw USB data of everything read from here on (not the calibration), with the
+        // configuration it decodes with, for --replay and ClampBenchmarks --replay
+        int captureIndex = arguments.indexOf("--capture");
+        if (captureIndex >= 0 && captureIndex + 1 < arguments.size()) {
+            state.board->startUSBCapture(toFileName(arguments[captureIndex + 1].toStdString()));
+        }
+
+		state.board->enableChannels({}, true);
+		state.board->clearCommands();
+
+        state.board->controller.offChipComponents.setInputImmediate(channelList, Register8::ElectrodePin);
+
+        if (!simulated) {
+            // Background health checks report drift from the temperatures the calibration was made at
+            CalibrationCache cache;
+            double temperature;
+            if (cache.load(calibrationCacheFile())) {
+                for (auto& index : channelList) {
+                    if (cache.getTemperature(*state.board, index.chip, temperature)) {
+                        state.healthMonitor->setReference(index.chip, temperature);
+                    }
+                }
+            }
+        }
         ControlWindow control(&display, state);
 
 		for (int i = 0; i < CLAMP::MAX_NUM_CHIPS; i++) {
@@ -163,10 +426,14 @@ int main(int argc, char *argv[]) {
 			state.datastore[i].controlWindow = &control;
 
 			// Set the clamp tab to Voltage Clamp mode.
-			control.tabWidget[i]->setCurrentIndex(1); // HACK: set it to something else first, to be sure to emit an event when we come back to it
-			control.tabWidget[i]->setCurrentIndex(0);
+			if (control.tabWidget[i]) {
+				control.tabWidget[i]->setCurrentIndex(1); // HACK: set it to something else first, to be sure to emit an event when we come back to it
+				control.tabWidget[i]->setCurrentIndex(0);
+			}
 		}
 
+        profile.mark("control window");
+
         control.show();
         display.show();
         center(display, control);
@@ -174,20 +441,18 @@ int main(int argc, char *argv[]) {
         splash->showMessage(QObject::tr("All done"), topRight, Qt::black);
         splash->finish(&display);
         delete splash;
-
-        // QSound cannot play wav files directly from Qt resource files, so
-        // this is a workaround:  Copy the wav file from the resource file to
-        // a temporary directory, then play it from there when needed.
-        QFile fileTemp(QDir::tempPath() + "/beep.wav");
-        copyResource(fileTemp, ":/sounds/beep.wav");
-
-        // QFile fileTemp2(QDir::tempPath() + "/buzz.wav");
-        // copyResource(fileTemp2, ":/sounds/buzz.wav");
+        profile.mark("showing the windows");
+        profile.report();
 
 		LOG(true) << endl << "====================================" << endl;
 
         int retVal = app.exec();
 
+        if (tracing) {
+            CLAMP::Tracing::setEnabled(false);
+            CLAMP::Tracing::exportChromeTrace(toFileName(app.arguments()[traceIndex + 1].toStdString()));
+        }
+
         fileTemp.remove();
         // fileTemp2.remove();
 
@@ -0,0 +1,22 @@
+# Builds the CLAMP_API library, the headless ClampRunner, the ClampConvert batch converter, the ClampAnalyze batch
+# analyzer, and the Python bindings, without Qt; see CLAMP_UI/ClampUI.pro for the GUI
+TEMPLATE = subdirs
+
+SUBDIRS = \
+    CLAMP_API \
+    CLAMP_Runner \
+    CLAMP_Converter \
+    CLAMP_Analyzer \
+    CLAMP_Python
+
+CLAMP_Runner.file = CLAMP_Runner/ClampRunner.pro
+CLAMP_Runner.depends = CLAMP_API
+
+CLAMP_Converter.file = CLAMP_Converter/ClampConvert.pro
+CLAMP_Converter.depends = CLAMP_API
+
+CLAMP_Analyzer.file = CLAMP_Analyzer/ClampAnalyze.pro
+CLAMP_Analyzer.depends = CLAMP_API
+
+CLAMP_Python.file = CLAMP_Python/ClampPython.pro
+CLAMP_Python.depends = CLAMP_API
@@ -1,5 +1,11 @@
 #include "common.h"
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
 
 using std::ostream;
 using std::string;
@@ -23,10 +29,196 @@ public:
 // A stream that ouputs nowhere
 nullstream dev_null;
 
-ostream* logger = &dev_null;
-ostream* nulllogger = &dev_null;
+// Logging goes to this, which may point to dev_null.  Only written or written to while holding writeMutex.
+static ostream* logger = &dev_null;
+static std::mutex writeMutex;
+
+/* Bounded multi-producer/multi-consumer queue of log messages (after Dmitry Vyukov's).  Each cell's sequence number says
+ * whether it's ready to be written (== position) or read (== position + 1), so push and pop only need one
+ * compare-and-swap each, and never lock.
+ */
+class LogQueue {
+public:
+    static const std::size_t CAPACITY = 4096; // Power of 2
+
+    LogQueue() : enqueuePos(0), dequeuePos(0) {
+        for (std::size_t i = 0; i < CAPACITY; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+            cells[i].message = nullptr;
+        }
+    }
+
+    bool push(string* message) {
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells[pos & (CAPACITY - 1)];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false; // Full
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->message = message;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(string*& message) {
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells[pos & (CAPACITY - 1)];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false; // Empty
+            }
+            else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        message = cell->message;
+        cell->sequence.store(pos + CAPACITY, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        string* message;
+    };
+    Cell cells[CAPACITY];
+    std::atomic<std::size_t> enqueuePos;
+    std::atomic<std::size_t> dequeuePos;
+};
+
+// Producers don't lock, so the writer can miss a notification; this bounds how long a message waits
+static const unsigned int LOG_POLL_MS = 10;
+
+// Background thread that writes queued messages to the logger
+class AsyncLogWriter {
+public:
+    AsyncLogWriter() : running(false), stopping(false), queued(0), written(0) {}
+    ~AsyncLogWriter() { stop(); }
+
+    bool isRunning() const { return running.load(std::memory_order_acquire); }
+
+    void start() {
+        if (!isRunning()) {
+            stopping = false;
+            running = true;
+            thread = std::thread(&AsyncLogWriter::run, this);
+        }
+    }
+
+    void stop() {
+        if (isRunning()) {
+            {
+                std::lock_guard<std::mutex> lock(wakeMutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+            running = false;
+
+            // Anything posted while the writer was finishing
+            std::lock_guard<std::mutex> lock(writeMutex);
+            string* message;
+            while (queue.pop(message)) {
+                *logger << *message;
+                delete message;
+                written.fetch_add(1, std::memory_order_release);
+            }
+        }
+    }
+
+    // False if the writer isn't running, in which case the caller should write the message itself
+    bool post(string* message) {
+        if (!isRunning()) {
+            return false;
+        }
+        while (!queue.push(message)) {
+            wake.notify_one();
+            std::this_thread::yield(); // Full; let the writer catch up
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    void flush() {
+        uint64_t target = queued.load(std::memory_order_acquire);
+        while (isRunning() && written.load(std::memory_order_acquire) < target) {
+            wake.notify_one();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+private:
+    LogQueue queue;
+    std::atomic<bool> running;
+    bool stopping; // Guarded by wakeMutex
+    std::atomic<uint64_t> queued;
+    std::atomic<uint64_t> written;
+    std::thread thread;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+
+    void run() {
+        for (;;) {
+            bool wroteAny = false;
+            string* message;
+            {
+                std::lock_guard<std::mutex> lock(writeMutex);
+                while (queue.pop(message)) {
+                    *logger << *message;
+                    delete message;
+                    written.fetch_add(1, std::memory_order_release);
+                    wroteAny = true;
+                }
+                if (wroteAny) {
+                    logger->flush();
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            if (stopping && queued.load(std::memory_order_acquire) == written.load(std::memory_order_acquire)) {
+                return;
+            }
+            if (!wroteAny) {
+                wake.wait_for(lock, std::chrono::milliseconds(LOG_POLL_MS));
+            }
+        }
+    }
+};
+
+static AsyncLogWriter asyncWriter;
+
+LogMessage::~LogMessage() {
+    string* message = new string(os.str());
+    if (!asyncWriter.post(message)) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        *logger << *message;
+        delete message;
+    }
+}
 
 ostream* SetLogger(std::ostream* logger_) {
+    FlushLog();
+    std::lock_guard<std::mutex> lock(writeMutex);
     ostream* prev = logger;
     if (logger_ == nullptr) {
         logger = &dev_null;
@@ -37,6 +229,19 @@ ostream* SetLogger(std::ostream* logger_) {
     return prev;
 }
 
+void SetAsyncLogging(bool enable) {
+    if (enable) {
+        asyncWriter.start();
+    }
+    else {
+        asyncWriter.stop();
+    }
+}
+
+void FlushLog() {
+    asyncWriter.flush();
+}
+
 wstring toWString(const string& s) {
     wstring ws;
     ws.insert(ws.begin(), s.begin(), s.end());
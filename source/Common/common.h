@@ -39,17 +39,36 @@ using std::endl;
 //OutputDebugStringA( os_.str().c_str() );
 
 // Logging -----------------------------------------------------------------
-// Logging goes to this, which may point to dev_null
-extern std::ostream* logger;
+// One log statement: LOG(x) << ... formats into this, and hands the text to the logger when the statement ends.
+class LogMessage {
+public:
+    LogMessage() {}
+    ~LogMessage();
+    std::ostream& stream() { return os; }
 
-extern std::ostream* nulllogger; // Always points to dev_null
+private:
+    std::ostringstream os;
+    LogMessage(const LogMessage&);
+    LogMessage& operator=(const LogMessage&);
+};
 
-// To 
-#define LOG(x) ((x) ? (*logger) : (*nulllogger))
+// LOG(x) << a << b; logs a and b if x is true.  If x is false, a and b aren't evaluated at all, and if x is a constant
+// false, the statement compiles to nothing.  Define CLAMP_NO_LOGGING to compile out every log statement.
+#ifdef CLAMP_NO_LOGGING
+    #define LOG(x) if (true) {} else LogMessage().stream()
+#else
+    #define LOG(x) if (!(x)) {} else LogMessage().stream()
+#endif
 
-// Use SetLogger(&std::cerr), for example, or SetLogger(nullptr).
+// Use SetLogger(&std::cerr), for example, or SetLogger(nullptr).  Anything already logged goes to the previous logger first.
 std::ostream* SetLogger(std::ostream* logger_);
 
+// With asynchronous logging, log statements only queue their text (without locking); a background thread writes it to
+// the logger.  Otherwise, each statement writes to the logger directly.  Off by default.
+void SetAsyncLogging(bool enable);
+// Waits until everything logged so far has been written to the logger
+void FlushLog();
+
 // _T macro for unicode support ---------------------------------------------
 #ifndef _T
     #if defined(_WIN32) && defined(_UNICODE)
@@ -5,6 +5,7 @@
 #include "common.h"
 #include <system_error>
 #include <string.h>
+#include <algorithm>
 
 using std::cerr;
 using std::endl;
@@ -25,7 +26,7 @@ FileOutStream::FileOutStream() : filestream(nullptr) {
 }
 
 FileOutStream::~FileOutStream() {
-    close();
+    filestream.reset();
 }
 
 void FileOutStream::open(const FILENAME& filename) {
@@ -39,7 +40,13 @@ void FileOutStream::open(const FILENAME& filename) {
 }
 
 void FileOutStream::close() {
-    filestream.reset();
+    if (filestream) {
+        unique_ptr<ofstream> closing(std::move(filestream));
+        closing->close();
+        if (closing->fail()) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
 }
 
 int FileOutStream::write(const char* data, int len) {
@@ -50,13 +57,33 @@ int FileOutStream::write(const char* data, int len) {
     return len;
 }
 
+void FileOutStream::flush() {
+    if (filestream) {
+        filestream->flush();
+        if (filestream->fail()) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+}
+
+//  ------------------------------------------------------------------------
+MemoryOutStream::MemoryOutStream(vector<char>& bytes_) : bytes(bytes_) {
+
+}
+
+int MemoryOutStream::write(const char* data, int len) {
+    bytes.insert(bytes.end(), data, data + len);
+    return len;
+}
+
 //  ------------------------------------------------------------------------
 //const unsigned int BUFFERSIZE = ;
 BufferedOutStream::BufferedOutStream(unique_ptr<FileOutStream>&& other_, unsigned int bufferSize_) :
     other(std::move(other_)),
     dataStreamBuffer(nullptr),
     bufferIndex(0),
-    bufferSize(bufferSize_)
+    bufferSize(bufferSize_),
+    bytesWritten(0)
 {
     dataStreamBuffer = new char[bufferSize_ + 4 * KILO];
 }
@@ -67,12 +94,33 @@ BufferedOutStream::~BufferedOutStream() {
 }
 
 int BufferedOutStream::write(const char* data, int len) {
+    bytesWritten += len;
+    if (len > static_cast<int>(4 * KILO)) {
+        // Bigger than the slack at the end of the buffer; don't bother copying it
+        flush();
+        return other->write(data, len);
+    }
     memcpy(&dataStreamBuffer[bufferIndex], data, len);
     bufferIndex += len;
     flushIfNecessary();
     return len;
 }
 
+// Returns a pointer to len contiguous bytes in the buffer, which the caller fills in and then passes to commit().
+// len must be no more than maxReserve().
+char* BufferedOutStream::reserve(unsigned int len) {
+    if (bufferIndex + len > bufferSize + 4 * KILO) {
+        flush();
+    }
+    return &dataStreamBuffer[bufferIndex];
+}
+
+void BufferedOutStream::commit(unsigned int len) {
+    bufferIndex += len;
+    bytesWritten += len;
+    flushIfNecessary();
+}
+
 void BufferedOutStream::flushIfNecessary() {
     if (bufferIndex > bufferSize) {
         other->write(dataStreamBuffer, bufferSize);
@@ -88,6 +136,16 @@ void BufferedOutStream::flush() {
     }
 }
 
+// What's buffered is dropped if it can't be written, so the destructor doesn't try again
+void BufferedOutStream::close() {
+    unsigned int pending = bufferIndex;
+    bufferIndex = 0;
+    if (pending > 0) {
+        other->write(dataStreamBuffer, pending);
+    }
+    other->close();
+}
+
 //  ------------------------------------------------------------------------
 BinaryWriter::BinaryWriter(unique_ptr<FileOutStream>&& other_, unsigned int bufferSize_) :
     other(std::move(other_), bufferSize_)
@@ -97,6 +155,124 @@ BinaryWriter::BinaryWriter(unique_ptr<FileOutStream>&& other_, unsigned int buff
 BinaryWriter::~BinaryWriter() {
 }
 
+// Raw bytes, e.g., an already-encoded block
+void BinaryWriter::writeBytes(const char* data, unsigned int len) {
+    other.write(data, len);
+}
+
+// Pushes buffered data to the underlying file
+void BinaryWriter::flush() {
+    other.flush();
+}
+
+// Writes buffered data and closes the underlying file, throwing if that fails.  Nothing can be written afterwards.
+void BinaryWriter::close() {
+    other.close();
+}
+
+static inline void storeLittleEndian(char* out, uint32_t value) {
+    out[0] = value & 0x000000ff;
+    out[1] = (value & 0x0000ff00) >> 8;
+    out[2] = (value & 0x00ff0000) >> 16;
+    out[3] = (value & 0xff000000) >> 24;
+}
+
+static inline void storeLittleEndian(char* out, uint16_t value) {
+    out[0] = value & 0x00ff;
+    out[1] = (value & 0xff00) >> 8;
+}
+
+static inline void storeLittleEndian(char* out, float value) {
+    uint32_t tmp;
+    memcpy(&tmp, &value, sizeof(tmp));
+    storeLittleEndian(out, tmp);
+}
+
+// Stores count values from in, converted to OnDisk, at out, out + stride, out + 2*stride, ...
+template <typename InMemory, typename OnDisk>
+static void storeStrided(char* out, unsigned int stride, const InMemory* in, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++, out += stride) {
+        storeLittleEndian(out, static_cast<OnDisk>(in[i]));
+    }
+}
+
+// Copies an array whose in-memory representation is (on little-endian machines) identical to the on-disk one
+template <typename T>
+static void writeRaw(BufferedOutStream& out, const T* data, unsigned int count) {
+    unsigned int perChunk = out.maxReserve() / sizeof(T);
+    while (count > 0) {
+        unsigned int n = std::min(count, perChunk);
+        char* p = out.reserve(n * sizeof(T));
+        if (IS_BIG_ENDIAN) {
+            storeStrided<T, T>(p, sizeof(T), data, n);
+        } else {
+            memcpy(p, data, n * sizeof(T));
+        }
+        out.commit(n * sizeof(T));
+        data += n;
+        count -= n;
+    }
+}
+
+void BinaryWriter::writeArray(const uint32_t* data, unsigned int count) {
+    writeRaw(other, data, count);
+}
+
+void BinaryWriter::writeArray(const uint16_t* data, unsigned int count) {
+    writeRaw(other, data, count);
+}
+
+void BinaryWriter::writeArray(const float* data, unsigned int count) {
+    writeRaw(other, data, count);
+}
+
+void BinaryWriter::writeArray(const double* data, unsigned int count) {
+    BinaryColumn column(data);
+    writeRecords(&column, 1, count);
+}
+
+/** Writes numRecords records, where record i consists of element i of each column, in order.
+ *
+ *  Equivalent to looping over i and writing each column's element i with operator<<, but fills the buffer a chunk of
+ *  records at a time, column by column.
+ */
+void BinaryWriter::writeRecords(const BinaryColumn* columns, unsigned int numColumns, unsigned int numRecords) {
+    unsigned int recordSize = 0;
+    for (unsigned int c = 0; c < numColumns; c++) {
+        recordSize += columns[c].onDiskSize();
+    }
+    if (recordSize == 0) {
+        return;
+    }
+
+    unsigned int perChunk = std::max(1u, other.maxReserve() / recordSize);
+    for (unsigned int start = 0; start < numRecords; start += perChunk) {
+        unsigned int n = std::min(perChunk, numRecords - start);
+        char* p = other.reserve(n * recordSize);
+
+        for (unsigned int c = 0; c < numColumns; c++) {
+            const BinaryColumn& column = columns[c];
+            switch (column.type) {
+            case BinaryColumn::UINT32:
+                storeStrided<uint32_t, uint32_t>(p, recordSize, static_cast<const uint32_t*>(column.data) + start, n);
+                break;
+            case BinaryColumn::UINT16:
+                storeStrided<uint16_t, uint16_t>(p, recordSize, static_cast<const uint16_t*>(column.data) + start, n);
+                break;
+            case BinaryColumn::FLOAT:
+                storeStrided<float, float>(p, recordSize, static_cast<const float*>(column.data) + start, n);
+                break;
+            case BinaryColumn::DOUBLE_AS_FLOAT:
+                storeStrided<double, float>(p, recordSize, static_cast<const double*>(column.data) + start, n);
+                break;
+            }
+            p += column.onDiskSize();
+        }
+
+        other.commit(n * recordSize);
+    }
+}
+
 BinaryWriter& operator<<(BinaryWriter& ostream, int32_t value) {
     char data[4];
     data[0] = value & 0x000000ff;
@@ -117,6 +293,12 @@ BinaryWriter& operator<<(BinaryWriter& ostream, uint32_t value) {
     return ostream;
 }
 
+BinaryWriter& operator<<(BinaryWriter& ostream, uint64_t value) {
+    ostream << static_cast<uint32_t>(value & 0xffffffff);
+    ostream << static_cast<uint32_t>(value >> 32);
+    return ostream;
+}
+
 
 BinaryWriter& operator<<(BinaryWriter& ostream, uint16_t value) {
     char data[2];
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <iosfwd>
 #include <istream>
+#include <vector>
 
 #if defined(_WIN32) && defined(_UNICODE)
     typedef std::wstring FILENAME;
@@ -17,15 +18,26 @@
 class FileOutStream  {
 public:
     FileOutStream();
-    ~FileOutStream();
+    virtual ~FileOutStream();
 
     void open(const FILENAME& filename); // Opens with new name
-    int write(const char* data, int len);
+    virtual int write(const char* data, int len);
+    virtual void flush(); // Hands what's been written to the operating system, so it survives this process crashing
+    virtual void close(); // Throws if what's still pending can't be written; the destructor closes too, but can't report that
 
 private:
     std::unique_ptr<std::ofstream> filestream;
+};
 
-    void close();
+//  ------------------------------------------------------------------------
+// Appends what's written to a vector instead of a file, e.g., to encode data with BinaryWriter ahead of writing it
+class MemoryOutStream : public FileOutStream {
+public:
+    explicit MemoryOutStream(std::vector<char>& bytes_);
+    int write(const char* data, int len) override;
+
+private:
+    std::vector<char>& bytes;
 };
 
 //  ------------------------------------------------------------------------
@@ -37,25 +49,64 @@ public:
     ~BufferedOutStream();
 
     int write(const char* data, int len);
+    char* reserve(unsigned int len);
+    void commit(unsigned int len);
+    unsigned int maxReserve() const { return bufferSize; }
     void flushIfNecessary();
     void flush();
+    void close(); // Flushes and closes the underlying stream, throwing if either fails
+    uint64_t position() const { return bytesWritten; } // Total bytes written to this stream so far, flushed or not
     
 private:
     std::unique_ptr<FileOutStream> other;
     char* dataStreamBuffer;
     unsigned int bufferIndex;
     unsigned int bufferSize;
+    uint64_t bytesWritten;
 };
 
 //  ------------------------------------------------------------------------
+// One field of a fixed-size, interleaved binary record; see BinaryWriter::writeRecords.
+struct BinaryColumn {
+    enum Type {
+        UINT32,
+        UINT16,
+        FLOAT,
+        DOUBLE_AS_FLOAT // Written as float, like operator<<(BinaryWriter&, double)
+    };
+
+    Type type;
+    const void* data;
+
+    BinaryColumn(const uint32_t* data_) : type(UINT32), data(data_) {}
+    BinaryColumn(const uint16_t* data_) : type(UINT16), data(data_) {}
+    BinaryColumn(const float* data_) : type(FLOAT), data(data_) {}
+    BinaryColumn(const double* data_) : type(DOUBLE_AS_FLOAT), data(data_) {}
+
+    unsigned int onDiskSize() const { return (type == UINT16) ? 2 : 4; }
+};
+
 class BinaryWriter {
 public:
     BinaryWriter(std::unique_ptr<FileOutStream>&& other_, unsigned int bufferSize_);
     virtual ~BinaryWriter();
 
+    // Bulk versions of operator<<; these produce identical bytes, but copy whole spans into the buffer at once
+    void writeArray(const uint32_t* data, unsigned int count);
+    void writeArray(const uint16_t* data, unsigned int count);
+    void writeArray(const float* data, unsigned int count);
+    void writeArray(const double* data, unsigned int count);
+    void writeRecords(const BinaryColumn* columns, unsigned int numColumns, unsigned int numRecords);
+    void writeBytes(const char* data, unsigned int len);
+
+    uint64_t position() const { return other.position(); }
+    void flush();
+    void close();
+
 protected:
     friend BinaryWriter& operator<<(BinaryWriter& ostream, int32_t value);
     friend BinaryWriter& operator<<(BinaryWriter& ostream, uint32_t value);
+    friend BinaryWriter& operator<<(BinaryWriter& ostream, uint64_t value);
     friend BinaryWriter& operator<<(BinaryWriter& ostream, int16_t value);
     friend BinaryWriter& operator<<(BinaryWriter& ostream, uint16_t value);
     friend BinaryWriter& operator<<(BinaryWriter& ostream, int8_t value);